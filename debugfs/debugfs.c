@@ -26,6 +26,13 @@ extern char *optarg;
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <signal.h>
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#define HAVE_DEBUGFS_SERVER
+#endif
 
 #include "debugfs.h"
 #include "uuid/uuid.h"
@@ -57,12 +64,39 @@ int sci_idx;
 ext2_filsys	current_fs = NULL;
 ext2_ino_t	root, cwd;
 
+#ifndef READ_ONLY
+static int debugfs_setup_tdb(const char *device, char *undo_file,
+			     io_manager *io_ptr)
+{
+	errcode_t retval;
+
+	if (!access(undo_file, F_OK) && unlink(undo_file) < 0) {
+		retval = errno;
+		com_err(device, retval, "while trying to delete %s",
+			undo_file);
+		return retval;
+	}
+	retval = set_undo_io_backup_file(undo_file);
+	if (retval) {
+		com_err(device, retval, "while trying to setup undo file %s",
+			undo_file);
+		return retval;
+	}
+	set_undo_io_backing_manager(*io_ptr);
+	*io_ptr = undo_io_manager;
+	printf("To undo the debugfs operation please run "
+	       "the command\n    e2undo %s %s\n\n", undo_file, device);
+	return 0;
+}
+#endif
+
 static void open_filesystem(char *device, int open_flags, blk64_t superblock,
 			    blk64_t blocksize, int catastrophic,
-			    char *data_filename)
+			    char *data_filename, char *undo_file)
 {
 	int	retval;
 	io_channel data_io = 0;
+	io_manager io_ptr = unix_io_manager;
 
 	if (superblock != 0 && blocksize == 0) {
 		com_err(device, 0, "if you specify the superblock, you must also specify the block size");
@@ -93,14 +127,55 @@ static void open_filesystem(char *device, int open_flags, blk64_t superblock,
 	if (catastrophic)
 		open_flags |= EXT2_FLAG_SKIP_MMP;
 
+	if (!(open_flags & EXT2_FLAG_IMAGE_FILE) && qcow2_io_probe(device)) {
+		if (open_flags & EXT2_FLAG_RW) {
+			com_err(device, 0,
+				"opening read-only because it is a qcow2 image");
+			open_flags &= ~EXT2_FLAG_RW;
+		}
+		io_ptr = qcow2_io_manager;
+	} else if (!(open_flags & EXT2_FLAG_IMAGE_FILE) &&
+		   http_io_probe(device)) {
+		if (open_flags & EXT2_FLAG_RW) {
+			com_err(device, 0,
+				"opening read-only because it is a remote image");
+			open_flags &= ~EXT2_FLAG_RW;
+		}
+		io_ptr = http_io_manager;
+	}
+
+#ifndef READ_ONLY
+	if (undo_file) {
+		if (!(open_flags & EXT2_FLAG_RW)) {
+			com_err(device, 0,
+				"the -z option is only valid with -w");
+			current_fs = NULL;
+			return;
+		}
+		if (debugfs_setup_tdb(device, undo_file, &io_ptr)) {
+			current_fs = NULL;
+			return;
+		}
+	}
+#endif
+
 	retval = ext2fs_open(device, open_flags, superblock, blocksize,
-			     unix_io_manager, &current_fs);
+			     io_ptr, &current_fs);
 	if (retval) {
 		com_err(device, retval, "while opening filesystem");
 		current_fs = NULL;
 		return;
 	}
+	if (undo_file) {
+		char tdb_string[40];
+
+		sprintf(tdb_string, "tdb_data_size=%d",
+			current_fs->blocksize);
+		io_channel_set_options(current_fs->io, tdb_string);
+	}
 	current_fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
+	/* Scripts tend to resolve the same directories over and over */
+	(void) ext2fs_create_dentry_cache(current_fs, 0);
 
 	if (catastrophic)
 		com_err(device, 0, "catastrophic mode - not reading inode or group bitmaps");
@@ -144,9 +219,10 @@ void do_open_filesys(int argc, char **argv)
 	blk64_t	blocksize = 0;
 	int	open_flags = EXT2_FLAG_SOFTSUPP_FEATURES | EXT2_FLAG_64BITS; 
 	char	*data_filename = 0;
+	char	*undo_file = 0;
 
 	reset_getopt();
-	while ((c = getopt (argc, argv, "iwfecb:s:d:D")) != EOF) {
+	while ((c = getopt (argc, argv, "iwfecb:s:d:Dz:")) != EOF) {
 		switch (c) {
 		case 'i':
 			open_flags |= EXT2_FLAG_IMAGE_FILE;
@@ -173,6 +249,13 @@ void do_open_filesys(int argc, char **argv)
 		case 'D':
 			open_flags |= EXT2_FLAG_DIRECT_IO;
 			break;
+		case 'z':
+#ifdef READ_ONLY
+			goto print_usage;
+#else
+			undo_file = optarg;
+#endif /* READ_ONLY */
+			break;
 		case 'b':
 			blocksize = parse_ulong(optarg, argv[0],
 						"block size", &err);
@@ -195,14 +278,14 @@ void do_open_filesys(int argc, char **argv)
 		return;
 	open_filesystem(argv[optind], open_flags,
 			superblock, blocksize, catastrophic,
-			data_filename);
+			data_filename, undo_file);
 	return;
 
 print_usage:
 	fprintf(stderr, "%s: Usage: open [-s superblock] [-b blocksize] "
 		"[-d image_filename] [-c] [-i] [-f] [-e] [-D] "
 #ifndef READ_ONLY
-		"[-w] "
+		"[-w] [-z undo_file] "
 #endif
 		"<device>\n", argv[0]);
 }
@@ -236,6 +319,8 @@ static void close_filesystem(NOARGS)
 		if (retval)
 			com_err("ext2fs_write_block_bitmap", retval, 0);
 	}
+	revmap_release();
+	logdump_release();
 	retval = ext2fs_close(current_fs);
 	if (retval)
 		com_err("ext2fs_close", retval, 0);
@@ -1587,7 +1672,8 @@ static errcode_t copy_file(int fd, ext2_ino_t newfile, int bufsize, int make_hol
 	int		cmp;
 
 	retval = ext2fs_file_open(current_fs, newfile,
-				  EXT2_FILE_WRITE, &e2_file);
+				  EXT2_FILE_WRITE | EXT2_FILE_DELALLOC,
+				  &e2_file);
 	if (retval)
 		return retval;
 
@@ -2352,11 +2438,92 @@ void do_dump_mmp(int argc EXT2FS_ATTR((unused)), char *argv[])
 	fprintf(stdout, "magic: 0x%x\n", mmp_s->mmp_magic);
 }
 
-static int source_file(const char *cmd_file, int ss_idx)
+static int known_request(ss_request_table *tbl, const char *name)
+{
+	ss_request_entry	*req;
+	const char * const	*cp;
+
+	for (req = tbl->requests; req->command_names; req++)
+		for (cp = req->command_names; *cp; cp++)
+			if (!strcmp(*cp, name))
+				return 1;
+	return 0;
+}
+
+/*
+ * Make sure every line of a command file names a command before any of
+ * it is run, so that a mistake near the end of a long script doesn't
+ * leave a file system half changed.  Returns the number of bad lines.
+ */
+static int check_commands(const char *cmd_file, char **lines, int count)
+{
+	char	*cp, *name;
+	int	i, len, bad = 0;
+
+	for (i = 0; i < count; i++) {
+		for (cp = lines[i]; *cp == ' ' || *cp == '\t'; cp++)
+			;
+		len = strcspn(cp, " \t");
+		if (!len || *cp == '!')
+			continue;
+		name = malloc(len + 1);
+		if (!name) {
+			com_err(debug_prog_name, ENOMEM,
+				"while checking %s", cmd_file);
+			return bad + 1;
+		}
+		memcpy(name, cp, len);
+		name[len] = 0;
+		if (!known_request(&debug_cmds, name) &&
+		    !known_request(&ss_std_requests, name) &&
+		    !known_request(&extent_cmds, name) &&
+		    !(extra_cmds && known_request(extra_cmds, name))) {
+			fprintf(stderr, "%s:%d: unknown command: %s\n",
+				cmd_file, i + 1, name);
+			bad++;
+		}
+		free(name);
+	}
+	return bad;
+}
+
+/*
+ * Read a whole command file into memory, one string per line.
+ */
+static char **read_commands(FILE *f, const char *cmd_file, int *count)
+{
+	char	buf[BUFSIZ];
+	char	**lines = NULL, **new_lines;
+	int	max = 0;
+
+	*count = 0;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		buf[strcspn(buf, "\r\n")] = 0;
+		if (*count == max) {
+			max = max ? max * 2 : 256;
+			new_lines = realloc(lines, max * sizeof(char *));
+			if (!new_lines)
+				goto nomem;
+			lines = new_lines;
+		}
+		if (!(lines[*count] = strdup(buf)))
+			goto nomem;
+		(*count)++;
+	}
+	return lines;
+
+nomem:
+	com_err(debug_prog_name, ENOMEM, "while reading %s", cmd_file);
+	exit(1);
+}
+
+static int source_file(const char *cmd_file, int ss_idx, int check_first)
 {
 	FILE		*f;
 	char		buf[BUFSIZ];
 	char		*cp;
+	char		**lines = NULL;
+	int		count = 0, i = 0;
 	int		exit_status = 0;
 	int		retval;
 
@@ -2373,50 +2540,375 @@ static int source_file(const char *cmd_file, int ss_idx)
 	fflush(stderr);
 	setbuf(stdout, NULL);
 	setbuf(stderr, NULL);
-	while (!feof(f)) {
-		if (fgets(buf, sizeof(buf), f) == NULL)
-			break;
-		cp = strchr(buf, '\n');
-		if (cp)
-			*cp = 0;
-		cp = strchr(buf, '\r');
-		if (cp)
-			*cp = 0;
-		printf("debugfs: %s\n", buf);
-		retval = ss_execute_line(ss_idx, buf);
+	if (check_first) {
+		lines = read_commands(f, cmd_file, &count);
+		if (check_commands(cmd_file, lines, count)) {
+			exit_status = 1;
+			count = 0;
+		}
+	}
+	while (1) {
+		if (check_first) {
+			if (i == count)
+				break;
+			cp = lines[i++];
+		} else {
+			if (feof(f) || fgets(buf, sizeof(buf), f) == NULL)
+				break;
+			cp = strchr(buf, '\n');
+			if (cp)
+				*cp = 0;
+			cp = strchr(buf, '\r');
+			if (cp)
+				*cp = 0;
+			cp = buf;
+		}
+		printf("debugfs: %s\n", cp);
+		retval = ss_execute_line(ss_idx, cp);
 		if (retval) {
-			ss_perror(ss_idx, retval, buf);
+			ss_perror(ss_idx, retval, cp);
 			exit_status++;
 		}
 	}
 	if (f != stdin)
 		fclose(f);
+	if (lines) {
+		for (i = 0; i < count; i++)
+			free(lines[i]);
+		free(lines);
+	}
 	return exit_status;
 }
 
+#ifdef HAVE_DEBUGFS_SERVER
+/*
+ * Server mode (-S): keep one file system open read-only and run the
+ * requests of each client that connects to a unix socket, so that
+ * scripts asking many small questions of a large file system don't pay
+ * for opening it and reading its bitmaps every time.  A client sends
+ * request lines and closes its side; the output of every request is
+ * written back and the connection is then closed.
+ */
+
+/* How long a client may stall before the server gives up on it */
+#define SERVER_TIMEOUT	30
+
+static struct server_params {
+	char		*device;
+	int		open_flags;
+	blk64_t		superblock;
+	blk64_t		blocksize;
+	int		catastrophic;
+	char		*data_filename;
+	ext2_filsys	fs;
+} server;
+
+static const char *server_socket;
+
+static void server_intr(int signo EXT2FS_ATTR((unused)))
+{
+	if (server_socket)
+		(void) unlink(server_socket);
+	exit(0);
+}
+
+/*
+ * Re-read the superblock from the device and see whether the file
+ * system has been written (or mounted) since we opened it, in which
+ * case our descriptors and bitmaps can no longer be trusted.
+ */
+static int server_fs_changed(void)
+{
+	struct ext2_super_block sb;
+	io_channel	io;
+	errcode_t	retval;
+
+	if (!current_fs || current_fs != server.fs)
+		return 1;
+	if (current_fs->flags & EXT2_FLAG_IMAGE_FILE)
+		return 0;
+
+	retval = current_fs->io->manager->open(current_fs->device_name, 0,
+					       &io);
+	if (retval)
+		return 1;
+	if (server.superblock) {
+		io_channel_set_blksize(io, server.blocksize);
+		retval = io_channel_read_blk64(io, server.superblock,
+					       -SUPERBLOCK_SIZE, &sb);
+	} else {
+		io_channel_set_blksize(io, SUPERBLOCK_OFFSET);
+		retval = io_channel_read_blk64(io, 1, -SUPERBLOCK_SIZE, &sb);
+	}
+	io_channel_close(io);
+	if (retval)
+		return 1;
+#ifdef WORDS_BIGENDIAN
+	ext2fs_swap_super(&sb);
+#endif
+	return (sb.s_wtime != current_fs->super->s_wtime ||
+		sb.s_mnt_count != current_fs->super->s_mnt_count);
+}
+
+static void serve_client(int ns)
+{
+	struct timeval	tv;
+	char		buf[BUFSIZ];
+	char		*cp;
+	FILE		*in;
+	int		fd, save_stdout, save_stderr;
+	int		retval;
+
+	tv.tv_sec = SERVER_TIMEOUT;
+	tv.tv_usec = 0;
+	(void) setsockopt(ns, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	(void) setsockopt(ns, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	fd = dup(ns);
+	if (fd < 0 || (in = fdopen(fd, "r")) == NULL) {
+		com_err(debug_prog_name, errno, "while serving a client");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	save_stdout = dup(1);
+	save_stderr = dup(2);
+	dup2(ns, 1);
+	dup2(ns, 2);
+
+	if (server_fs_changed()) {
+		if (current_fs)
+			close_filesystem();
+		open_filesystem(server.device, server.open_flags,
+				server.superblock, server.blocksize,
+				server.catastrophic, server.data_filename, 0);
+		server.fs = current_fs;
+	}
+	/* Every client starts out in the root directory */
+	cwd = root;
+
+	while (fgets(buf, sizeof(buf), in) != NULL) {
+		buf[strcspn(buf, "\r\n")] = 0;
+		printf("debugfs: %s\n", buf);
+		fflush(stdout);
+		for (cp = buf; *cp == ' ' || *cp == '\t'; cp++)
+			;
+		if (*cp == '!') {
+			com_err(debug_prog_name, 0,
+				"shell escapes are not allowed from clients");
+		} else {
+			retval = ss_execute_line(sci_idx, buf);
+			if (retval)
+				ss_perror(sci_idx, retval, buf);
+		}
+		fflush(stdout);
+	}
+	fclose(in);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(save_stdout, 1);
+	dup2(save_stderr, 2);
+	close(save_stdout);
+	close(save_stderr);
+}
+
+static int run_server(const char *socket_path)
+{
+	struct sockaddr_un	addr;
+	mode_t			save_umask;
+	int			s, ns;
+
+	if (!current_fs)
+		return 1;
+	server.fs = current_fs;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		com_err(debug_prog_name, 0, "socket path too long: %s",
+			socket_path);
+		return 1;
+	}
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		com_err(debug_prog_name, errno,
+			"while creating unix stream socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	(void) unlink(socket_path);
+	/* Anyone who can connect can read any file, so keep it private */
+	save_umask = umask(077);
+	if (bind(s, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		com_err(debug_prog_name, errno, "while binding to %s",
+			socket_path);
+		(void) umask(save_umask);
+		close(s);
+		return 1;
+	}
+	(void) umask(save_umask);
+	if (listen(s, 5) < 0) {
+		com_err(debug_prog_name, errno, "while listening on %s",
+			socket_path);
+		(void) unlink(socket_path);
+		close(s);
+		return 1;
+	}
+
+	server_socket = socket_path;
+	signal(SIGHUP, server_intr);
+	signal(SIGINT, server_intr);
+	signal(SIGTERM, server_intr);
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "%s: serving %s on %s\n", debug_prog_name,
+		server.device, socket_path);
+
+	while (1) {
+		ns = accept(s, NULL, NULL);
+		if (ns < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			com_err(debug_prog_name, errno,
+				"while accepting a connection");
+			break;
+		}
+		serve_client(ns);
+		close(ns);
+	}
+	(void) unlink(socket_path);
+	close(s);
+	return 1;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t	ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Client side of -S: send the request given with -R, or the lines of
+ * the -f command file (or of standard input), to a running server and
+ * copy what comes back to standard output.
+ */
+static int run_client(const char *socket_path, const char *request,
+		      const char *cmd_file)
+{
+	struct sockaddr_un	addr;
+	char			buf[BUFSIZ];
+	FILE			*f = stdin;
+	ssize_t			got;
+	int			s;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		com_err(debug_prog_name, 0, "socket path too long: %s",
+			socket_path);
+		return 1;
+	}
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		com_err(debug_prog_name, errno,
+			"while creating unix stream socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (connect(s, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		com_err(debug_prog_name, errno, "while connecting to %s",
+			socket_path);
+		close(s);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (request) {
+		if (write_all(s, request, strlen(request)) ||
+		    write_all(s, "\n", 1))
+			goto write_err;
+	} else {
+		if (cmd_file && strcmp(cmd_file, "-")) {
+			f = fopen(cmd_file, "r");
+			if (!f) {
+				perror(cmd_file);
+				close(s);
+				return 1;
+			}
+		}
+		while (fgets(buf, sizeof(buf), f) != NULL)
+			if (write_all(s, buf, strlen(buf)))
+				goto write_err;
+		if (f != stdin)
+			fclose(f);
+	}
+	shutdown(s, SHUT_WR);
+
+	while ((got = read(s, buf, sizeof(buf))) != 0) {
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			com_err(debug_prog_name, errno,
+				"while reading from %s", socket_path);
+			close(s);
+			return 1;
+		}
+		if (write_all(1, buf, got))
+			break;
+	}
+	close(s);
+	return 0;
+
+write_err:
+	com_err(debug_prog_name, errno, "while writing to %s", socket_path);
+	if (f != stdin)
+		fclose(f);
+	close(s);
+	return 1;
+}
+#endif /* HAVE_DEBUGFS_SERVER */
+
 int main(int argc, char **argv)
 {
 	int		retval;
 	const char	*usage = 
 		"Usage: %s [-b blocksize] [-s superblock] [-f cmd_file] "
-		"[-R request] [-V] ["
+		"[-B cmd_file] [-R request] [-V] ["
 #ifndef READ_ONLY
-		"[-w] "
+		"[-w] [-z undo_file] "
 #endif
-		"[-c] device]";
+		"[-c] device]"
+#ifdef HAVE_DEBUGFS_SERVER
+		" [-S socket]"
+#endif
+		;
 	int		c;
 	int		open_flags = EXT2_FLAG_SOFTSUPP_FEATURES | EXT2_FLAG_64BITS;
 	char		*request = 0;
 	int		exit_status = 0;
 	char		*cmd_file = 0;
+	int		check_first = 0;
 	blk64_t		superblock = 0;
 	blk64_t		blocksize = 0;
 	int		catastrophic = 0;
 	char		*data_filename = 0;
+	char		*undo_file = 0;
+	char		*socket_path = 0;
 #ifdef READ_ONLY
-	const char	*opt_string = "icR:f:b:s:Vd:D";
+	const char	*opt_string = "icR:f:B:b:s:Vd:DS:";
 #else
-	const char	*opt_string = "iwcR:f:b:s:Vd:D";
+	const char	*opt_string = "iwcR:f:B:b:s:Vd:Dz:S:";
 #endif
 
 	if (debug_prog_name == 0)
@@ -2436,6 +2928,11 @@ int main(int argc, char **argv)
 			break;
 		case 'f':
 			cmd_file = optarg;
+			check_first = 0;
+			break;
+		case 'B':
+			cmd_file = optarg;
+			check_first = 1;
 			break;
 		case 'd':
 			data_filename = optarg;
@@ -2447,6 +2944,9 @@ int main(int argc, char **argv)
 		case 'w':
 			open_flags |= EXT2_FLAG_RW;
 			break;
+		case 'z':
+			undo_file = optarg;
+			break;
 #endif
 		case 'D':
 			open_flags |= EXT2_FLAG_DIRECT_IO;
@@ -2463,6 +2963,11 @@ int main(int argc, char **argv)
 		case 'c':
 			catastrophic = 1;
 			break;
+#ifdef HAVE_DEBUGFS_SERVER
+		case 'S':
+			socket_path = optarg;
+			break;
+#endif
 		case 'V':
 			/* Print version number and exit */
 			fprintf(stderr, "\tUsing %s\n",
@@ -2473,10 +2978,29 @@ int main(int argc, char **argv)
 			return 1;
 		}
 	}
+#ifdef HAVE_DEBUGFS_SERVER
+	if (socket_path && optind >= argc)
+		return run_client(socket_path, request, cmd_file);
+	if (socket_path) {
+		if ((open_flags & EXT2_FLAG_RW) || undo_file ||
+		    request || cmd_file) {
+			com_err(argv[0], 0, "the -S option serves a file "
+				"system read-only and can't be combined "
+				"with -w, -z, -R or -f");
+			return 1;
+		}
+		server.device = argv[optind];
+		server.open_flags = open_flags;
+		server.superblock = superblock;
+		server.blocksize = blocksize;
+		server.catastrophic = catastrophic;
+		server.data_filename = data_filename;
+	}
+#endif
 	if (optind < argc)
 		open_filesystem(argv[optind], open_flags,
 				superblock, blocksize, catastrophic,
-				data_filename);
+				data_filename, undo_file);
 
 	sci_idx = ss_create_invocation(debug_prog_name, "0.0", (char *) NULL,
 				       &debug_cmds, &retval);
@@ -2497,6 +3021,11 @@ int main(int argc, char **argv)
 		ss_perror(sci_idx, retval, "adding extra requests");
 		exit (1);
 	}
+#ifdef HAVE_DEBUGFS_SERVER
+	if (socket_path)
+		exit_status = run_server(socket_path);
+	else
+#endif
 	if (request) {
 		retval = 0;
 		retval = ss_execute_line(sci_idx, request);
@@ -2505,7 +3034,7 @@ int main(int argc, char **argv)
 			exit_status++;
 		}
 	} else if (cmd_file) {
-		exit_status = source_file(cmd_file, sci_idx);
+		exit_status = source_file(cmd_file, sci_idx, check_first);
 	} else {
 		ss_listen(sci_idx);
 	}
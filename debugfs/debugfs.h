@@ -99,6 +99,7 @@ extern void do_dirsearch(int argc, char **argv);
 
 /* logdump.c */
 extern void do_logdump(int argc, char **argv);
+extern void logdump_release(void);
 
 /* lsdel.c */
 extern void do_lsdel(int argc, char **argv);
@@ -109,6 +110,22 @@ extern void do_icheck(int argc, char **argv);
 /* ncheck.c */
 extern void do_ncheck(int argc, char **argv);
 
+/* revmap.c */
+struct revmap_name {
+	ext2_ino_t	ino;
+	ext2_ino_t	dir;		/* directory holding the entry */
+	__u32		seq;		/* order of the entry in the scan */
+	__u32		name_off;
+	__u8		name_len;
+	__u8		filetype;
+};
+
+extern int revmap_open(const char *cmd);
+extern void revmap_release(void);
+extern ext2_ino_t revmap_block_owner(blk64_t blk);
+extern struct revmap_name *revmap_names(ext2_ino_t ino, size_t *count);
+extern const char *revmap_name_string(struct revmap_name *name);
+
 /* set_fields.c */
 extern void do_set_super(int argc, char **);
 extern void do_set_inode(int argc, char **);
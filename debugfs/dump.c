@@ -99,6 +99,155 @@ static void fix_perms(const char *cmd, const struct ext2_inode *inode,
 		com_err(cmd, errno, "while setting times of %s", name);
 }
 
+/* Blocks read at a time by dump_extents() */
+#define DUMP_READ_BLOCKS	256
+
+static int write_all(int fd, const char *buf, size_t count)
+{
+	ssize_t	n;
+
+	while (count) {
+		n = write(fd, buf, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * Skip over len bytes of a hole.  If the output can seek, leave a hole
+ * there too; the last byte of a hole at the end of the file is written
+ * so that the output gets the right size.
+ */
+static int dump_hole(int fd, int can_seek, char *zero_buf, size_t buf_size,
+		     unsigned long long len, int at_end)
+{
+	size_t	n;
+
+	if (!len)
+		return 0;
+	if (can_seek) {
+		if (at_end)
+			len--;
+		if (len && lseek(fd, len, SEEK_CUR) < 0)
+			return -1;
+		return at_end ? write_all(fd, zero_buf, 1) : 0;
+	}
+	while (len) {
+		n = len > buf_size ? buf_size : len;
+		if (write_all(fd, zero_buf, n))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copy out an extent-mapped file one extent at a time, with large
+ * reads straight from the device rather than a block at a time through
+ * ext2fs_file_read().  Holes and uninitialized extents become holes in
+ * the output if it is a regular file, and zeroes otherwise.  Returns
+ * -1 if the file can't be copied this way; this is always decided
+ * before anything is written.
+ */
+static int dump_extents(const char *cmdname, ext2_ino_t ino,
+			struct ext2_inode *inode, int fd)
+{
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	struct stat	st;
+	errcode_t	retval;
+	char		*buf = 0, *zero_buf = 0;
+	unsigned int	blocksize = current_fs->blocksize;
+	unsigned long long size = EXT2_I_SIZE(inode), pos = 0, start, bytes;
+	blk64_t		blk, len, n;
+	int		op = EXT2_EXTENT_ROOT, can_seek;
+
+	if (!(inode->i_flags & EXT4_EXTENTS_FL))
+		return -1;
+	if (ext2fs_extent_open2(current_fs, ino, inode, &handle))
+		return -1;
+	if (io_channel_alloc_buf(current_fs->io, DUMP_READ_BLOCKS, &buf) ||
+	    ext2fs_get_memzero(blocksize, &zero_buf)) {
+		if (buf)
+			ext2fs_free_mem(&buf);
+		ext2fs_extent_free(handle);
+		return -1;
+	}
+	can_seek = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		    !(fcntl(fd, F_GETFL) & O_APPEND));
+
+	while (pos < size) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+		    retval == EXT2_ET_EXTENT_NO_DOWN)
+			break;
+		if (retval) {
+			com_err(cmdname, retval, "while reading ext2 file");
+			goto out;
+		}
+		op = EXT2_EXTENT_NEXT_LEAF;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF))
+			continue;
+
+		/* Ignore whatever overlaps what was already copied */
+		blk = extent.e_pblk;
+		len = extent.e_len;
+		start = (unsigned long long) extent.e_lblk * blocksize;
+		if (start < pos) {
+			n = (pos - start + blocksize - 1) / blocksize;
+			if (n >= len)
+				continue;
+			blk += n;
+			len -= n;
+			start += n * blocksize;
+		}
+		if (start >= size)
+			break;
+		if (dump_hole(fd, can_seek, zero_buf, blocksize,
+			      start - pos, 0))
+			goto write_err;
+		pos = start;
+		if (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+			continue;
+
+		while (len && pos < size) {
+			n = len > DUMP_READ_BLOCKS ? DUMP_READ_BLOCKS : len;
+			bytes = n * blocksize;
+			if (bytes > size - pos)
+				bytes = size - pos;
+			retval = io_channel_read_blk64(current_fs->io, blk,
+						       n, buf);
+			if (retval) {
+				com_err(cmdname, retval,
+					"while reading ext2 file");
+				goto out;
+			}
+			if (write_all(fd, buf, bytes))
+				goto write_err;
+			pos += bytes;
+			blk += n;
+			len -= n;
+		}
+	}
+	if (dump_hole(fd, can_seek, zero_buf, blocksize, size - pos, 1))
+		goto write_err;
+	goto out;
+
+write_err:
+	com_err(cmdname, errno, "while writing file");
+out:
+	ext2fs_free_mem(&zero_buf);
+	ext2fs_free_mem(&buf);
+	ext2fs_extent_free(handle);
+	return 0;
+}
+
 static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 		      int preserve, char *outname)
 {
@@ -112,7 +261,11 @@ static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 	if (debugfs_read_inode(ino, &inode, cmdname))
 		return;
 
-	retval = ext2fs_file_open(current_fs, ino, 0, &e2_file);
+	if (dump_extents(cmdname, ino, &inode, fd) == 0)
+		goto done;
+
+	retval = ext2fs_file_open(current_fs, ino, EXT2_FILE_READAHEAD,
+				  &e2_file);
 	if (retval) {
 		com_err(cmdname, retval, "while opening ext2 file");
 		return;
@@ -140,6 +293,7 @@ static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 		return;
 	}
 
+done:
 	if (preserve)
 		fix_perms("dump_file", &inode, fd, outname);
 
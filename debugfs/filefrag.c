@@ -30,6 +30,7 @@ extern char *optarg;
 #define VERBOSE_OPT	0x0001
 #define DIR_OPT		0x0002
 #define RECURSIVE_OPT	0x0004
+#define ALL_OPT		0x0008
 
 struct dir_list {
 	char		*name;
@@ -258,20 +259,328 @@ static void dir_iterate(ext2_ino_t ino, struct filefrag_struct *fs)
 	}
 }
 
+/*
+ * With -a, every inode is looked at straight from the inode table by
+ * ext2fs_parallel_inode_scan(), instead of going through the directory
+ * tree, and the extents of each file are counted from its extent tree
+ * (or, for block-mapped files, its block map).  The workers keep their
+ * counts in their shard data, which is added up once the scan is done.
+ */
+#define FRAG_CLASSES	6
+#define FRAG_MAX_TOP	100
+#define FRAG_MAX_JOBS	64
+
+static const char *frag_class_names[FRAG_CLASSES] = {
+	"< 64K", "< 1M", "< 16M", "< 256M", "< 4G", ">= 4G"
+};
+
+struct frag_class {
+	__u64		files;
+	__u64		fragmented;	/* files in more than one extent */
+	__u64		extents;
+	__u64		blocks;
+};
+
+struct frag_worst {
+	ext2_ino_t	ino;
+	__u32		extents;
+	__u64		size;
+};
+
+/* Per-group counts, for the inodes which live in the group */
+struct frag_group {
+	__u32		files;
+	__u32		fragmented;
+	__u64		extents;
+};
+
+struct frag_shard {
+	struct frag_class	classes[FRAG_CLASSES];
+	struct frag_worst	worst[FRAG_MAX_TOP];
+	int			num_worst, max_worst;
+	dgrp_t			first_group, num_groups;
+	struct frag_group	groups[1];	/* num_groups of them */
+};
+
+struct frag_count {
+	__u32		extents;
+	e2_blkcnt_t	logical;	/* where the current extent ends */
+	blk64_t		physical;
+	blk64_t		blocks;
+};
+
+static void frag_add(struct frag_count *fc, e2_blkcnt_t logical,
+		     blk64_t physical, blk64_t len)
+{
+	if (!fc->extents || logical != fc->logical ||
+	    physical != fc->physical)
+		fc->extents++;
+	fc->logical = logical + len;
+	fc->physical = physical + len;
+	fc->blocks += len;
+}
+
+static int frag_blocks_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+			    blk64_t *blocknr, e2_blkcnt_t blockcnt,
+			    blk64_t ref_block EXT2FS_ATTR((unused)),
+			    int ref_offset EXT2FS_ATTR((unused)),
+			    void *private)
+{
+	if (blockcnt >= 0 && *blocknr)
+		frag_add(private, blockcnt, *blocknr, 1);
+	return 0;
+}
+
+static errcode_t frag_extents(ext2_filsys fs, ext2_ino_t ino,
+			      struct ext2_inode *inode, struct frag_count *fc)
+{
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	errcode_t		retval;
+	int			op = EXT2_EXTENT_ROOT;
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+	while (1) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval)
+			break;
+		op = EXT2_EXTENT_NEXT_LEAF;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF))
+			continue;
+		frag_add(fc, extent.e_lblk, extent.e_pblk, extent.e_len);
+	}
+	ext2fs_extent_free(handle);
+	if (retval == EXT2_ET_EXTENT_NO_NEXT)
+		retval = 0;
+	return retval;
+}
+
+static errcode_t frag_scan_proc(ext2_filsys fs, ext2_ino_t ino,
+				struct ext2_inode *inode, void *shard_data,
+				void *priv_data EXT2FS_ATTR((unused)))
+{
+	struct frag_shard	*sh = shard_data;
+	struct frag_class	*cl;
+	struct frag_group	*gr;
+	struct frag_count	fc;
+	__u64			size = EXT2_I_SIZE(inode);
+	int			i, c;
+	dgrp_t			group;
+	errcode_t		retval;
+
+	if (!inode->i_links_count || inode->i_dtime ||
+	    (ino != EXT2_ROOT_INO && ino < EXT2_FIRST_INODE(fs->super)) ||
+	    !ext2fs_inode_has_valid_blocks2(fs, inode))
+		return 0;
+
+	memset(&fc, 0, sizeof(fc));
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		retval = frag_extents(fs, ino, inode, &fc);
+	else
+		retval = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY,
+					       NULL, frag_blocks_proc, &fc);
+	/* A damaged file is e2fsck's business; just leave it out */
+	if (retval || !fc.extents)
+		return 0;
+
+	for (c = 0; c < FRAG_CLASSES - 1; c++)
+		if (size < (65536ULL << (4 * c)))
+			break;
+	cl = &sh->classes[c];
+	cl->files++;
+	cl->extents += fc.extents;
+	cl->blocks += fc.blocks;
+	if (fc.extents > 1)
+		cl->fragmented++;
+
+	group = (ino - 1) / fs->super->s_inodes_per_group;
+	if (group >= sh->first_group &&
+	    group < sh->first_group + sh->num_groups) {
+		gr = &sh->groups[group - sh->first_group];
+		gr->files++;
+		gr->extents += fc.extents;
+		if (fc.extents > 1)
+			gr->fragmented++;
+	}
+
+	/* Keep the worst files sorted, most extents first */
+	if (fc.extents < 2 || (sh->num_worst == sh->max_worst &&
+	    (!sh->num_worst ||
+	     fc.extents <= sh->worst[sh->num_worst - 1].extents)))
+		return 0;
+	if (sh->num_worst < sh->max_worst)
+		sh->num_worst++;
+	for (i = sh->num_worst - 1;
+	     i > 0 && sh->worst[i - 1].extents < fc.extents; i--)
+		sh->worst[i] = sh->worst[i - 1];
+	sh->worst[i].ino = ino;
+	sh->worst[i].extents = fc.extents;
+	sh->worst[i].size = size;
+	return 0;
+}
+
+static int frag_worst_cmp(const void *a, const void *b)
+{
+	const struct frag_worst *wa = a, *wb = b;
+
+	if (wa->extents != wb->extents)
+		return wa->extents < wb->extents ? 1 : -1;
+	return (wa->ino > wb->ino) - (wa->ino < wb->ino);
+}
+
+static void filefrag_all(FILE *f, int num_jobs, int num_worst)
+{
+	struct frag_shard	*sh;
+	struct frag_class	total, *cl;
+	struct frag_worst	*worst;
+	struct frag_group	*gr;
+	dgrp_t			first, num, max_groups = 1;
+	size_t			size;
+	char			*shards;
+	int			i, c, n = 0;
+	errcode_t		retval;
+
+	for (i = 0; i < num_jobs; i++) {
+		ext2fs_inode_scan_shard(current_fs, i, num_jobs, &first, &num);
+		if (num > max_groups)
+			max_groups = num;
+	}
+	size = sizeof(struct frag_shard) +
+		(max_groups - 1) * sizeof(struct frag_group);
+	size = (size + 7) & ~((size_t) 7);
+	retval = ext2fs_get_arrayzero(num_jobs, size, &shards);
+	if (retval) {
+		com_err("filefrag", retval, "while allocating scan data");
+		return;
+	}
+	retval = ext2fs_get_array(num_jobs * num_worst + 1,
+				  sizeof(struct frag_worst), &worst);
+	if (retval) {
+		com_err("filefrag", retval, "while allocating scan data");
+		ext2fs_free_mem(&shards);
+		return;
+	}
+	for (i = 0; i < num_jobs; i++) {
+		sh = (struct frag_shard *) (shards + i * size);
+		ext2fs_inode_scan_shard(current_fs, i, num_jobs,
+					&sh->first_group, &sh->num_groups);
+		sh->max_worst = num_worst;
+	}
+
+	retval = ext2fs_parallel_inode_scan(current_fs, num_jobs, 0,
+					    frag_scan_proc, shards, size, 0);
+	if (retval) {
+		com_err("ext2fs_parallel_inode_scan", retval, 0);
+		goto out;
+	}
+
+	/* Fragmentation by file size */
+	fprintf(f, "%-8s %12s %12s %14s %10s\n", "size", "files",
+		"fragmented", "extents", "per file");
+	memset(&total, 0, sizeof(total));
+	for (c = 0; c <= FRAG_CLASSES; c++) {
+		struct frag_class	sum;
+
+		if (c < FRAG_CLASSES) {
+			memset(&sum, 0, sizeof(sum));
+			for (i = 0; i < num_jobs; i++) {
+				sh = (struct frag_shard *) (shards + i * size);
+				cl = &sh->classes[c];
+				sum.files += cl->files;
+				sum.fragmented += cl->fragmented;
+				sum.extents += cl->extents;
+				sum.blocks += cl->blocks;
+			}
+			total.files += sum.files;
+			total.fragmented += sum.fragmented;
+			total.extents += sum.extents;
+			total.blocks += sum.blocks;
+		} else
+			sum = total;
+		fprintf(f, "%-8s %12llu %12llu %14llu %10.2f\n",
+			c < FRAG_CLASSES ? frag_class_names[c] : "total",
+			(unsigned long long) sum.files,
+			(unsigned long long) sum.fragmented,
+			(unsigned long long) sum.extents,
+			sum.files ? (double) sum.extents / sum.files : 0.0);
+	}
+
+	/* The worst files of all the shards */
+	n = 0;
+	for (i = 0; i < num_jobs; i++) {
+		sh = (struct frag_shard *) (shards + i * size);
+		memcpy(worst + n, sh->worst,
+		       sh->num_worst * sizeof(struct frag_worst));
+		n += sh->num_worst;
+	}
+	qsort(worst, n, sizeof(struct frag_worst), frag_worst_cmp);
+	if (n > num_worst)
+		n = num_worst;
+	if (n) {
+		fprintf(f, "\n%10s %10s %18s\n", "inode", "extents", "size");
+		for (i = 0; i < n; i++)
+			fprintf(f, "%10u %10u %18llu\n", worst[i].ino,
+				worst[i].extents,
+				(unsigned long long) worst[i].size);
+	}
+
+	/* And by the group the inodes are in */
+	fprintf(f, "\n%8s %10s %10s %12s %10s\n", "group", "files",
+		"fragmented", "extents", "per file");
+	for (i = 0; i < num_jobs; i++) {
+		sh = (struct frag_shard *) (shards + i * size);
+		for (first = 0; first < sh->num_groups; first++) {
+			gr = &sh->groups[first];
+			if (!gr->files)
+				continue;
+			fprintf(f, "%8u %10u %10u %12llu %10.2f\n",
+				sh->first_group + first, gr->files,
+				gr->fragmented,
+				(unsigned long long) gr->extents,
+				(double) gr->extents / gr->files);
+		}
+	}
+out:
+	ext2fs_free_mem(&worst);
+	ext2fs_free_mem(&shards);
+}
+
 void do_filefrag(int argc, char *argv[])
 {
 	struct filefrag_struct fs;
 	struct ext2_inode inode;
 	ext2_ino_t	ino;
-	int		c;
+	int		c, num_jobs = 1, num_worst = 10;
+	char		*tmp;
 
 	memset(&fs, 0, sizeof(fs));
 	if (check_fs_open(argv[0]))
 		return;
 
 	reset_getopt();
-	while ((c = getopt(argc, argv, "dvr")) != EOF) {
+	while ((c = getopt(argc, argv, "adj:n:vr")) != EOF) {
 		switch (c) {
+		case 'a':
+			fs.options |= ALL_OPT;
+			break;
+		case 'j':
+			num_jobs = strtol(optarg, &tmp, 0);
+			if (*tmp || num_jobs < 1 || num_jobs > FRAG_MAX_JOBS) {
+				com_err(argv[0], 0,
+					"Bad number of workers - %s", optarg);
+				return;
+			}
+			break;
+		case 'n':
+			num_worst = strtol(optarg, &tmp, 0);
+			if (*tmp || num_worst < 0 || num_worst > FRAG_MAX_TOP) {
+				com_err(argv[0], 0,
+					"Bad number of files - %s", optarg);
+				return;
+			}
+			break;
 		case 'd':
 			fs.options |= DIR_OPT;
 			break;
@@ -286,9 +595,20 @@ void do_filefrag(int argc, char *argv[])
 		}
 	}
 
+	if ((fs.options & ALL_OPT) &&
+	    (argc > optind || (fs.options & ~ALL_OPT)))
+		goto print_usage;
 	if (argc > optind+1) {
 	print_usage:
-		com_err(0, 0, "Usage: filefrag [-dvr] file");
+		com_err(0, 0, "Usage: filefrag [-dvr] file\n"
+			"       filefrag -a [-j workers] [-n count]");
+		return;
+	}
+
+	if (fs.options & ALL_OPT) {
+		fs.f = open_pager();
+		filefrag_all(fs.f, num_jobs, num_worst);
+		close_pager(fs.f);
 		return;
 	}
 
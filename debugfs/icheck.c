@@ -31,17 +31,17 @@ struct block_walk_struct {
 };
 
 static int icheck_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
-		       blk64_t	*block_nr,
-		       e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
-		       blk64_t ref_block EXT2FS_ATTR((unused)),
-		       int ref_offset EXT2FS_ATTR((unused)),
+		       blk64_t lblk EXT2FS_ATTR((unused)),
+		       blk64_t pblk, __u32 len,
+		       int flags EXT2FS_ATTR((unused)),
 		       void *private)
 {
 	struct block_walk_struct *bw = (struct block_walk_struct *) private;
 	e2_blkcnt_t	i;
 
 	for (i=0; i < bw->num_blocks; i++) {
-		if (!bw->barray[i].ino && bw->barray[i].blk == *block_nr) {
+		if (!bw->barray[i].ino && bw->barray[i].blk >= pblk &&
+		    bw->barray[i].blk - pblk < len) {
 			bw->barray[i].ino = bw->inode;
 			bw->blocks_left--;
 		}
@@ -91,6 +91,12 @@ void do_icheck(int argc, char **argv)
 
 	bw.num_blocks = bw.blocks_left = argc-1;
 
+	if (revmap_open("icheck") == 0) {
+		for (i = 0; i < bw.num_blocks; i++)
+			bw.barray[i].ino = revmap_block_owner(bw.barray[i].blk);
+		goto print;
+	}
+
 	retval = ext2fs_open_inode_scan(current_fs, 0, &scan);
 	if (retval) {
 		com_err("icheck", retval, "while opening inode scan");
@@ -115,11 +121,9 @@ void do_icheck(int argc, char **argv)
 
 		blk = ext2fs_file_acl_block(current_fs, &inode);
 		if (blk) {
-			icheck_proc(current_fs, &blk, 0,
-				    0, 0, &bw);
+			icheck_proc(current_fs, 0, blk, 1, 0, &bw);
 			if (bw.blocks_left == 0)
 				break;
-			ext2fs_file_acl_block_set(current_fs, &inode, blk);
 		}
 
 		if (!ext2fs_inode_has_valid_blocks2(current_fs, &inode))
@@ -131,12 +135,11 @@ void do_icheck(int argc, char **argv)
 		if (inode.i_dtime)
 			goto next;
 
-		retval = ext2fs_block_iterate3(current_fs, ino,
-					       BLOCK_FLAG_READ_ONLY, block_buf,
+		retval = ext2fs_extent_iterate(current_fs, ino, 0, block_buf,
 					       icheck_proc, &bw);
 		if (retval) {
 			com_err("icheck", retval,
-				"while calling ext2fs_block_iterate");
+				"while calling ext2fs_extent_iterate");
 			goto next;
 		}
 
@@ -154,6 +157,7 @@ void do_icheck(int argc, char **argv)
 		}
 	}
 
+print:
 	printf("Block\tInode number\n");
 	for (i=0, binfo = bw.barray; i < bw.num_blocks; i++, binfo++) {
 		if (binfo->ino == 0) {
@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdarg.h>
 #include <time.h>
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
@@ -43,13 +44,54 @@ static blk64_t		block_to_dump, bitmap_to_dump, inode_block_to_dump;
 static unsigned int	group_to_dump, inode_offset_to_dump;
 static ext2_ino_t	inode_to_dump;
 
+/* The journal is read through a window this big */
+#define JOURNAL_READAHEAD	(1024 * 1024)
+
 struct journal_source
 {
 	enum journal_location where;
 	int fd;
 	ext2_file_t file;
+	ext2_ino_t ino;		/* of an internal journal */
+	char *ra_buf;
+	off_t ra_start;
+	unsigned int ra_len;
+};
+
+/*
+ * Every block tag and revoke record found by the last complete walk of
+ * a journal, sorted by file system block, so that looking up another
+ * block with -b or -i doesn't have to read the whole log again.  The
+ * index is only reused if the journal can't have changed: the journal
+ * superblock must be the same, and an internal journal must belong to
+ * the same file system, opened read-only.
+ */
+struct journal_record {
+	__u32	fs_block;
+	__u32	log_block;
+	__u32	transaction;
+	__u32	flags;
+	__u32	seq;		/* order of the record in the journal */
+	int	revoke;
 };
 
+struct journal_index {
+	enum journal_location	where;
+	ext2_filsys		fs;
+	ext2_ino_t		ino;
+	dev_t			dev;
+	ino_t			file_ino;
+	off_t			size;
+	time_t			mtime;
+	char			jsb[1024];
+	struct journal_record	*recs;
+	size_t			num, max;
+	char			end_msg[128];	/* how the walk stopped */
+	int			complete, failed;
+};
+
+static struct journal_index *journal_index;
+
 static void dump_journal(char *, FILE *, struct journal_source *);
 
 static void dump_descriptor_block(FILE *, struct journal_source *,
@@ -92,6 +134,10 @@ void do_logdump(int argc, char **argv)
 	journal_source.where = JOURNAL_IS_INTERNAL;
 	journal_source.fd = 0;
 	journal_source.file = 0;
+	journal_source.ino = 0;
+	journal_source.ra_buf = NULL;
+	journal_source.ra_start = 0;
+	journal_source.ra_len = 0;
 	dump_all = 0;
 	dump_contents = 0;
 	dump_descriptors = 1;
@@ -220,13 +266,15 @@ void do_logdump(int argc, char **argv)
 		}
 
 		retval = ext2fs_file_open2(current_fs, journal_inum,
-					   &journal_inode, 0, &journal_file);
+					   &journal_inode, EXT2_FILE_READAHEAD,
+					   &journal_file);
 		if (retval) {
 			com_err(argv[0], retval, "while opening ext2 file");
 			goto errout;
 		}
 		journal_source.where = JOURNAL_IS_INTERNAL;
 		journal_source.file = journal_file;
+		journal_source.ino = use_sb ? 0 : journal_inum;
 	} else {
 		char uuid[37];
 
@@ -258,6 +306,7 @@ void do_logdump(int argc, char **argv)
 		ext2fs_file_close(journal_file);
 	else
 		close(journal_fd);
+	free(journal_source.ra_buf);
 
 errout:
 	if (out_file && (out_file != stdout))
@@ -271,19 +320,44 @@ print_usage:
 }
 
 
+/*
+ * Read from the journal at offset.  Most reads are of one block just
+ * after the last one, so the journal is read a window at a time and
+ * reads which fall inside the current window are answered from it.
+ */
 static int read_journal_block(const char *cmd, struct journal_source *source,
 			      off_t offset, char *buf, int size,
 			      unsigned int *got)
 {
 	int retval;
 
+	if (source->ra_buf && offset >= source->ra_start &&
+	    offset + size <= source->ra_start + source->ra_len) {
+		memcpy(buf, source->ra_buf + (offset - source->ra_start), size);
+		*got = size;
+		return 0;
+	}
+
+	if (!source->ra_buf && size <= JOURNAL_READAHEAD) {
+		source->ra_buf = malloc(JOURNAL_READAHEAD);
+		if (!source->ra_buf) {
+			com_err(cmd, ENOMEM, "while reading journal");
+			return ENOMEM;
+		}
+	}
+	source->ra_len = 0;
+
 	if (source->where == JOURNAL_IS_EXTERNAL) {
 		if (lseek(source->fd, offset, SEEK_SET) < 0) {
 			retval = errno;
 			com_err(cmd, retval, "while seeking in reading journal");
 			return retval;
 		}
-		retval = read(source->fd, buf, size);
+		if (size <= JOURNAL_READAHEAD)
+			retval = read(source->fd, source->ra_buf,
+				      JOURNAL_READAHEAD);
+		else
+			retval = read(source->fd, buf, size);
 		if (retval >= 0) {
 			*got = retval;
 			retval = 0;
@@ -297,7 +371,19 @@ static int read_journal_block(const char *cmd, struct journal_source *source,
 			return retval;
 		}
 
-		retval = ext2fs_file_read(source->file, buf, size, got);
+		if (size <= JOURNAL_READAHEAD)
+			retval = ext2fs_file_read(source->file, source->ra_buf,
+						  JOURNAL_READAHEAD, got);
+		else
+			retval = ext2fs_file_read(source->file, buf, size, got);
+	}
+
+	if (!retval && size <= JOURNAL_READAHEAD) {
+		source->ra_start = offset;
+		source->ra_len = *got;
+		if (*got > (unsigned int) size)
+			*got = size;
+		memcpy(buf, source->ra_buf, *got);
 	}
 
 	if (retval)
@@ -311,6 +397,203 @@ static int read_journal_block(const char *cmd, struct journal_source *source,
 	return retval;
 }
 
+void logdump_release(void)
+{
+	if (!journal_index)
+		return;
+	free(journal_index->recs);
+	free(journal_index);
+	journal_index = NULL;
+}
+
+/*
+ * Fill in what identifies the journal read by source.  Returns non-zero
+ * if the journal might change while we hold an index of it.
+ */
+static int journal_index_identify(struct journal_source *source,
+				  struct journal_index *id)
+{
+	struct stat	st;
+
+	id->where = source->where;
+	if (source->where == JOURNAL_IS_INTERNAL) {
+		if (!source->ino || (current_fs->flags & EXT2_FLAG_RW))
+			return 1;
+		id->fs = current_fs;
+		id->ino = source->ino;
+		return 0;
+	}
+	if (fstat(source->fd, &st) < 0)
+		return 1;
+	id->dev = st.st_dev;
+	id->file_ino = st.st_ino;
+	id->size = st.st_size;
+	id->mtime = st.st_mtime;
+	return 0;
+}
+
+static int journal_index_valid(struct journal_source *source, char *jsb)
+{
+	struct journal_index	id;
+
+	if (!journal_index || !journal_index->complete)
+		return 0;
+	memset(&id, 0, sizeof(id));
+	if (journal_index_identify(source, &id))
+		return 0;
+	return (id.where == journal_index->where &&
+		id.fs == journal_index->fs &&
+		id.ino == journal_index->ino &&
+		id.dev == journal_index->dev &&
+		id.file_ino == journal_index->file_ino &&
+		id.size == journal_index->size &&
+		id.mtime == journal_index->mtime &&
+		!memcmp(jsb, journal_index->jsb, sizeof(journal_index->jsb)));
+}
+
+static void journal_index_start(struct journal_source *source, char *jsb)
+{
+	logdump_release();
+	journal_index = calloc(1, sizeof(struct journal_index));
+	if (!journal_index)
+		return;
+	if (journal_index_identify(source, journal_index)) {
+		logdump_release();
+		return;
+	}
+	memcpy(journal_index->jsb, jsb, sizeof(journal_index->jsb));
+}
+
+static void journal_index_add(__u32 fs_block, __u32 log_block, __u32 flags,
+			      tid_t transaction, int revoke)
+{
+	struct journal_record	*rec;
+
+	if (!journal_index || journal_index->failed)
+		return;
+	if (journal_index->num == journal_index->max) {
+		size_t new_max = journal_index->max ?
+			journal_index->max * 2 : 1024;
+
+		rec = realloc(journal_index->recs,
+			      new_max * sizeof(struct journal_record));
+		if (!rec) {
+			journal_index->failed = 1;
+			return;
+		}
+		journal_index->recs = rec;
+		journal_index->max = new_max;
+	}
+	rec = &journal_index->recs[journal_index->num];
+	rec->fs_block = fs_block;
+	rec->log_block = log_block;
+	rec->transaction = transaction;
+	rec->flags = flags;
+	rec->seq = journal_index->num++;
+	rec->revoke = revoke;
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+	const struct journal_record *ra = a, *rb = b;
+
+	if (ra->fs_block != rb->fs_block)
+		return ra->fs_block < rb->fs_block ? -1 : 1;
+	return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+static int record_seq_cmp(const void *a, const void *b)
+{
+	const struct journal_record *ra = *(const struct journal_record **) a;
+	const struct journal_record *rb = *(const struct journal_record **) b;
+
+	return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+/*
+ * Print the message saying why the walk of the journal stopped.  A walk
+ * which gets this far has seen the whole log, so its index is complete.
+ */
+static void end_of_journal(FILE *out_file, const char *fmt, ...)
+{
+	va_list	ap;
+
+	va_start(ap, fmt);
+	vfprintf(out_file, fmt, ap);
+	va_end(ap);
+
+	if (!journal_index || journal_index->failed)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(journal_index->end_msg, sizeof(journal_index->end_msg),
+		  fmt, ap);
+	va_end(ap);
+	qsort(journal_index->recs, journal_index->num,
+	      sizeof(struct journal_record), record_cmp);
+	journal_index->complete = 1;
+}
+
+/* Add the records for blk to matches */
+static size_t journal_index_find(blk64_t blk, struct journal_record **matches,
+				 size_t count)
+{
+	struct journal_record *recs = journal_index->recs;
+	size_t		lo = 0, hi = journal_index->num;
+
+	if (blk > 0xFFFFFFFFULL)
+		return count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (recs[mid].fs_block < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < journal_index->num && recs[lo].fs_block == blk; lo++)
+		matches[count++] = &recs[lo];
+	return count;
+}
+
+/*
+ * Print what a walk of the journal would print for the blocks being
+ * looked for, from the index.
+ */
+static void dump_journal_index(FILE *out_file, struct journal_source *source,
+			       journal_superblock_t *jsb, int blocksize)
+{
+	struct journal_record	**matches, *rec;
+	size_t			i, count = 0;
+
+	matches = malloc((journal_index->num + 1) * sizeof(*matches));
+	if (!matches) {
+		com_err("logdump", ENOMEM, "while searching the journal index");
+		return;
+	}
+	count = journal_index_find(block_to_dump, matches, count);
+	if (inode_block_to_dump != block_to_dump)
+		count = journal_index_find(inode_block_to_dump, matches, count);
+	if (bitmap_to_dump != block_to_dump &&
+	    bitmap_to_dump != inode_block_to_dump)
+		count = journal_index_find(bitmap_to_dump, matches, count);
+	qsort(matches, count, sizeof(*matches), record_seq_cmp);
+
+	for (i = 0; i < count; i++) {
+		rec = matches[i];
+		if (!rec->revoke)
+			dump_metadata_block(out_file, source, jsb,
+					    rec->log_block, rec->fs_block,
+					    rec->flags, blocksize,
+					    rec->transaction);
+		else if (rec->fs_block == block_to_dump)
+			fprintf(out_file, "  Revoke FS block %u at block %u, "
+				"sequence %u\n", rec->fs_block,
+				rec->log_block, rec->transaction);
+	}
+	fputs(journal_index->end_msg, out_file);
+	free(matches);
+}
+
 static const char *type_to_name(int btype)
 {
 	switch (btype) {
@@ -397,6 +680,13 @@ static void dump_journal(char *cmdname, FILE *out_file,
 		/* Empty journal, nothing to do. */
 		return;
 
+	if (!dump_all && !dump_descriptors &&
+	    journal_index_valid(source, jsb_buffer)) {
+		dump_journal_index(out_file, source, jsb, blocksize);
+		return;
+	}
+	journal_index_start(source, jsb_buffer);
+
 	while (1) {
 		retval = read_journal_block(cmdname, source,
 					    blocknr*blocksize, buf,
@@ -411,15 +701,15 @@ static void dump_journal(char *cmdname, FILE *out_file,
 		blocktype = be32_to_cpu(header->h_blocktype);
 
 		if (magic != JFS_MAGIC_NUMBER) {
-			fprintf (out_file, "No magic number at block %u: "
-				 "end of journal.\n", blocknr);
+			end_of_journal(out_file, "No magic number at block %u: "
+				       "end of journal.\n", blocknr);
 			return;
 		}
 
 		if (sequence != transaction) {
-			fprintf (out_file, "Found sequence %u (not %u) at "
-				 "block %u: end of journal.\n",
-				 sequence, transaction, blocknr);
+			end_of_journal(out_file, "Found sequence %u (not %u) at "
+				       "block %u: end of journal.\n",
+				       sequence, transaction, blocknr);
 			return;
 		}
 
@@ -452,8 +742,8 @@ static void dump_journal(char *cmdname, FILE *out_file,
 			continue;
 
 		default:
-			fprintf (out_file, "Unexpected block type %u at "
-				 "block %u.\n", blocktype, blocknr);
+			end_of_journal(out_file, "Unexpected block type %u at "
+				       "block %u.\n", blocktype, blocknr);
 			return;
 		}
 	}
@@ -505,6 +795,7 @@ static void dump_descriptor_block(FILE *out_file,
 		if (!(tag_flags & JFS_FLAG_SAME_UUID))
 			offset += 16;
 
+		journal_index_add(tag_block, blocknr, tag_flags, transaction, 0);
 		dump_metadata_block(out_file, source, jsb,
 				    blocknr, tag_block, tag_flags, blocksize,
 				    transaction);
@@ -539,6 +830,7 @@ static void dump_revoke_block(FILE *out_file, char *buf,
 	while (offset < max) {
 		entry = (unsigned int *) (buf + offset);
 		rblock = be32_to_cpu(*entry);
+		journal_index_add(rblock, blocknr, 0, transaction, 1);
 		if (dump_all || rblock == block_to_dump) {
 			fprintf(out_file, "  Revoke FS block %u", rblock);
 			if (dump_all)
@@ -18,6 +18,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#else
+extern int optind;
+extern char *optarg;
+#endif
+
 #include "debugfs.h"
 
 struct deleted_info {
@@ -47,6 +54,14 @@ static int deleted_info_compare(const void *a, const void *b)
 	return arg1->dtime - arg2->dtime;
 }
 
+static void print_deleted(FILE *out, struct deleted_info *info)
+{
+	fprintf(out, "%6u %6d %6o %6llu %6lld/%6lld %s",
+		info->ino, info->uid, info->mode, info->size,
+		info->free_blocks, info->num_blocks,
+		time_to_string(info->dtime));
+}
+
 static int lsdel_proc(ext2_filsys fs,
 		      blk64_t	*block_nr,
 		      e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
@@ -75,6 +90,7 @@ void do_lsdel(int argc, char **argv)
 	struct lsdel_struct 	lsd;
 	struct deleted_info	*delarray;
 	int			num_delarray, max_delarray;
+	int			num_found = 0;
 	ext2_inode_scan		scan = 0;
 	ext2_ino_t		ino;
 	struct ext2_inode	inode;
@@ -84,16 +100,31 @@ void do_lsdel(int argc, char **argv)
  	long			secs = 0;
  	char			*tmp;
 	time_t			now;
-	FILE			*out;
-
-	if (common_args_process(argc, argv, 1, 2, "list_deleted_inodes",
-				"[secs]", 0))
+	FILE			*out = NULL;
+	int			c, unsorted = 0;
+
+	reset_getopt();
+	while ((c = getopt(argc, argv, "u")) != EOF) {
+		switch (c) {
+		case 'u':
+			unsorted = 1;
+			break;
+		default:
+			goto print_usage;
+		}
+	}
+	if (argc > optind + 1) {
+	print_usage:
+		com_err(argv[0], 0, "Usage: list_deleted_inodes [-u] [secs]");
+		return;
+	}
+	if (check_fs_open(argv[0]))
 		return;
 
-	if (argc > 1) {
-		secs = strtol(argv[1],&tmp,0);
+	if (argc > optind) {
+		secs = strtol(argv[optind],&tmp,0);
 		if (*tmp) {
-			com_err(argv[0], 0, "Bad time - %s",argv[1]);
+			com_err(argv[0], 0, "Bad time - %s",argv[optind]);
 			return;
 		}
 	}
@@ -114,7 +145,10 @@ void do_lsdel(int argc, char **argv)
 		goto error_out;
 	}
 
-	retval = ext2fs_open_inode_scan(current_fs, 0, &scan);
+	/* Read a whole group's inode table at a time */
+	retval = ext2fs_open_inode_scan(current_fs,
+					current_fs->inode_blocks_per_group,
+					&scan);
 	if (retval) {
 		com_err("ls_deleted_inodes", retval,
 			"while opening inode scan");
@@ -130,6 +164,12 @@ void do_lsdel(int argc, char **argv)
 		goto error_out;
 	}
 
+	if (unsorted) {
+		out = open_pager();
+		fprintf(out, " Inode  Owner  Mode    Size      Blocks   "
+			"Time deleted\n");
+	}
+
 	while (ino) {
 		if ((inode.i_dtime == 0) ||
 		    (secs && ((unsigned) abs(now - secs) > inode.i_dtime)))
@@ -149,6 +189,8 @@ void do_lsdel(int argc, char **argv)
 			goto next;
 		}
 		if (lsd.free_blocks && !lsd.bad_blocks) {
+			if (unsorted)
+				num_delarray = 0;
 			if (num_delarray >= max_delarray) {
 				max_delarray += 50;
 				delarray = realloc(delarray,
@@ -168,7 +210,12 @@ void do_lsdel(int argc, char **argv)
 			delarray[num_delarray].dtime = inode.i_dtime;
 			delarray[num_delarray].num_blocks = lsd.num_blocks;
 			delarray[num_delarray].free_blocks = lsd.free_blocks;
-			num_delarray++;
+			if (unsorted) {
+				/* Print it now, and count it after all */
+				print_deleted(out, &delarray[0]);
+				num_found++;
+			} else
+				num_delarray++;
 		}
 
 	next:
@@ -182,6 +229,11 @@ void do_lsdel(int argc, char **argv)
 		}
 	}
 
+	if (unsorted) {
+		fprintf(out, "%d deleted inodes found.\n", num_found);
+		goto error_out;
+	}
+
 	out = open_pager();
 
 	fprintf(out, " Inode  Owner  Mode    Size      Blocks   Time deleted\n");
@@ -189,17 +241,13 @@ void do_lsdel(int argc, char **argv)
 	qsort(delarray, num_delarray, sizeof(struct deleted_info),
 	      deleted_info_compare);
 
-	for (i = 0; i < num_delarray; i++) {
-		fprintf(out, "%6u %6d %6o %6llu %6lld/%6lld %s",
-			delarray[i].ino,
-			delarray[i].uid, delarray[i].mode, delarray[i].size,
-			delarray[i].free_blocks, delarray[i].num_blocks,
-			time_to_string(delarray[i].dtime));
-	}
+	for (i = 0; i < num_delarray; i++)
+		print_deleted(out, &delarray[i]);
 	fprintf(out, "%d deleted inodes found.\n", num_delarray);
-	close_pager(out);
 
 error_out:
+	if (out)
+		close_pager(out);
 	free(block_buf);
 	free(delarray);
 	if (scan)
@@ -35,6 +35,34 @@ struct inode_walk_struct {
 	unsigned int		check_dirent:1;
 };
 
+static void print_name(struct inode_walk_struct *iw, ext2_ino_t ino,
+		       const char *name, int name_len, int filetype)
+{
+	struct ext2_inode inode;
+	errcode_t	retval;
+
+	if (!iw->parent && !iw->get_pathname_failed) {
+		retval = ext2fs_get_pathname(current_fs, iw->dir, 0,
+					     &iw->parent);
+		if (retval) {
+			com_err("ncheck", retval,
+		"while calling ext2fs_get_pathname for inode #%u", iw->dir);
+			iw->get_pathname_failed = 1;
+		}
+	}
+	if (iw->parent)
+		printf("%u\t%s/%.*s", ino, iw->parent, name_len, name);
+	else
+		printf("%u\t<%u>/%.*s", ino, iw->dir, name_len, name);
+	if (iw->check_dirent && filetype) {
+		if (!debugfs_read_inode(ino, &inode, "ncheck") &&
+		    filetype != ext2_file_type(inode.i_mode)) {
+			printf("  <--- BAD FILETYPE");
+		}
+	}
+	putc('\n', stdout);
+}
+
 static int ncheck_proc(struct ext2_dir_entry *dirent,
 		       int	offset EXT2FS_ATTR((unused)),
 		       int	blocksize EXT2FS_ATTR((unused)),
@@ -42,43 +70,16 @@ static int ncheck_proc(struct ext2_dir_entry *dirent,
 		       void	*private)
 {
 	struct inode_walk_struct *iw = (struct inode_walk_struct *) private;
-	struct ext2_inode inode;
-	errcode_t	retval;
-	int		filetype = dirent->name_len >> 8;
 	int		i;
 
 	iw->position++;
 	if (iw->position <= 2)
 		return 0;
 	for (i=0; i < iw->num_inodes; i++) {
-		if (iw->iarray[i] == dirent->inode) {
-			if (!iw->parent && !iw->get_pathname_failed) {
-				retval = ext2fs_get_pathname(current_fs,
-							     iw->dir,
-							     0, &iw->parent);
-				if (retval) {
-					com_err("ncheck", retval,
-		"while calling ext2fs_get_pathname for inode #%u", iw->dir);
-					iw->get_pathname_failed = 1;
-				}
-			}
-			if (iw->parent)
-				printf("%u\t%s/%.*s", iw->iarray[i],
-				       iw->parent,
-				       (dirent->name_len & 0xFF), dirent->name);
-			else
-				printf("%u\t<%u>/%.*s", iw->iarray[i],
-				       iw->dir,
-				       (dirent->name_len & 0xFF), dirent->name);
-			if (iw->check_dirent && filetype) {
-				if (!debugfs_read_inode(dirent->inode, &inode,
-							"ncheck") &&
-				    filetype != ext2_file_type(inode.i_mode)) {
-					printf("  <--- BAD FILETYPE");
-				}
-			}
-			putc('\n', stdout);
-		}
+		if (iw->iarray[i] == dirent->inode)
+			print_name(iw, iw->iarray[i], dirent->name,
+				   dirent->name_len & 0xFF,
+				   dirent->name_len >> 8);
 	}
 	if (!iw->inodes_left)
 		return DIRENT_ABORT;
@@ -86,6 +87,68 @@ static int ncheck_proc(struct ext2_dir_entry *dirent,
 	return 0;
 }
 
+struct name_match {
+	struct revmap_name	*name;
+	int			arg;	/* position of the inode in argv */
+};
+
+static int name_match_cmp(const void *a, const void *b)
+{
+	const struct name_match *ma = a, *mb = b;
+
+	if (ma->name->seq != mb->name->seq)
+		return ma->name->seq < mb->name->seq ? -1 : 1;
+	return ma->arg - mb->arg;
+}
+
+/*
+ * Answer from the reverse map, printing the names in the same order as
+ * the directory scan below.
+ */
+static void ncheck_revmap(struct inode_walk_struct *iw)
+{
+	struct name_match	*matches = NULL, *m;
+	struct revmap_name	*names;
+	size_t			count, num = 0, max = 0, j;
+	int			i;
+
+	for (i = 0; i < iw->num_inodes; i++) {
+		names = revmap_names(iw->iarray[i], &count);
+		if (num + count > max) {
+			max = num + count;
+			m = realloc(matches, max * sizeof(struct name_match));
+			if (!m) {
+				com_err("ncheck", ENOMEM,
+					"while allocating name array");
+				goto out;
+			}
+			matches = m;
+		}
+		for (j = 0; j < count; j++) {
+			matches[num].name = &names[j];
+			matches[num++].arg = i;
+		}
+	}
+	qsort(matches, num, sizeof(struct name_match), name_match_cmp);
+
+	iw->parent = 0;
+	iw->dir = 0;
+	for (j = 0; j < num; j++) {
+		struct revmap_name *name = matches[j].name;
+
+		if (name->dir != iw->dir) {
+			ext2fs_free_mem(&iw->parent);
+			iw->dir = name->dir;
+			iw->get_pathname_failed = 0;
+		}
+		print_name(iw, name->ino, revmap_name_string(name),
+			   name->name_len, name->filetype);
+	}
+	ext2fs_free_mem(&iw->parent);
+out:
+	free(matches);
+}
+
 void do_ncheck(int argc, char **argv)
 {
 	struct inode_walk_struct iw;
@@ -137,6 +200,12 @@ void do_ncheck(int argc, char **argv)
 
 	iw.num_inodes = iw.inodes_left = argc;
 
+	if (revmap_open("ncheck") == 0) {
+		printf("Inode\tPathname\n");
+		ncheck_revmap(&iw);
+		goto error_out;
+	}
+
 	retval = ext2fs_open_inode_scan(current_fs, 0, &scan);
 	if (retval) {
 		com_err("ncheck", retval, "while opening inode scan");
@@ -0,0 +1,342 @@
+/*
+ * revmap.c --- reverse map of blocks to inodes and of inodes to names,
+ * shared by icheck and ncheck
+ *
+ * Both commands have to look at every inode of the file system to
+ * answer a question about a handful of blocks or inodes.  When the file
+ * system is open read-only nothing can change under us, so the first of
+ * them scans the file system once, recording the owner of every block
+ * and the name of every directory entry, and later queries are answered
+ * from those tables with a binary search.  The tables are dropped when
+ * the file system is closed.
+ *
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/types.h>
+
+#include "debugfs.h"
+
+/* A run of physically consecutive blocks belonging to one inode */
+struct revmap_run {
+	blk64_t		start;
+	blk64_t		max_end;	/* highest end of this and earlier runs */
+	blk64_t		len;
+	ext2_ino_t	ino;
+};
+
+struct revmap {
+	ext2_filsys		fs;
+	struct revmap_run	*runs;
+	size_t			num_runs, max_runs;
+	struct revmap_name	*names;
+	size_t			num_names, max_names;
+	char			*strings;
+	size_t			strings_len, strings_max;
+	ext2_ino_t		ino;	/* inode being iterated */
+	ext2_ino_t		dir;	/* directory being iterated */
+	errcode_t		err;
+};
+
+static struct revmap *revmap;
+
+static errcode_t grow(void *ptr, size_t *max, size_t size)
+{
+	size_t		new_max = *max ? *max * 2 : 1024;
+	void		*p;
+
+	p = realloc(*(void **) ptr, new_max * size);
+	if (!p)
+		return ENOMEM;
+	*(void **) ptr = p;
+	*max = new_max;
+	return 0;
+}
+
+static void add_block(struct revmap *rm, blk64_t blk, ext2_ino_t ino)
+{
+	struct revmap_run *run;
+
+	if (rm->num_runs) {
+		run = &rm->runs[rm->num_runs - 1];
+		if (run->ino == ino && run->start + run->len == blk) {
+			run->len++;
+			return;
+		}
+	}
+	if (rm->num_runs == rm->max_runs &&
+	    (rm->err = grow(&rm->runs, &rm->max_runs,
+			    sizeof(struct revmap_run))))
+		return;
+	run = &rm->runs[rm->num_runs++];
+	run->start = blk;
+	run->len = 1;
+	run->ino = ino;
+}
+
+static int revmap_block_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     blk64_t	*block_nr,
+			     e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+			     blk64_t ref_block EXT2FS_ATTR((unused)),
+			     int ref_offset EXT2FS_ATTR((unused)),
+			     void *private)
+{
+	struct revmap	*rm = private;
+
+	add_block(rm, *block_nr, rm->ino);
+	return rm->err ? BLOCK_ABORT : 0;
+}
+
+static errcode_t revmap_add_name(struct revmap *rm,
+				 struct ext2_dir_entry *dirent)
+{
+	struct revmap_name	*name;
+	int			len = dirent->name_len & 0xFF;
+	errcode_t		retval;
+
+	if (rm->num_names == rm->max_names &&
+	    (retval = grow(&rm->names, &rm->max_names,
+			   sizeof(struct revmap_name))))
+		return retval;
+	while (rm->strings_len + len + 1 > rm->strings_max) {
+		if ((retval = grow(&rm->strings, &rm->strings_max, 1)))
+			return retval;
+	}
+
+	name = &rm->names[rm->num_names];
+	name->ino = dirent->inode;
+	name->dir = rm->dir;
+	name->seq = rm->num_names++;
+	name->filetype = dirent->name_len >> 8;
+	name->name_len = len;
+	name->name_off = rm->strings_len;
+	memcpy(rm->strings + rm->strings_len, dirent->name, len);
+	rm->strings_len += len;
+	rm->strings[rm->strings_len++] = 0;
+	return 0;
+}
+
+static int run_cmp(const void *a, const void *b)
+{
+	const struct revmap_run *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return ra->ino < rb->ino ? -1 : (ra->ino > rb->ino);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	const struct revmap_name *na = a, *nb = b;
+
+	if (na->ino != nb->ino)
+		return na->ino < nb->ino ? -1 : 1;
+	return na->seq < nb->seq ? -1 : (na->seq > nb->seq);
+}
+
+/*
+ * Scan the inodes the way icheck and ncheck do: unused inodes are
+ * skipped, the extended attribute block of an inode is counted even if
+ * it has been "deleted" by 0.3c extfs, and only directories are
+ * iterated for names.
+ */
+static errcode_t revmap_build(struct revmap *rm, const char *cmd)
+{
+	ext2_filsys		fs = rm->fs;
+	ext2_inode_scan		scan = 0;
+	ext2_dir_cursor		cursor;
+	struct ext2_dir_entry	*dirent;
+	ext2_ino_t		ino;
+	struct ext2_inode	inode;
+	int			entry;
+	char			*block_buf;
+	blk64_t			blk;
+	size_t			i;
+	errcode_t		retval;
+
+	block_buf = malloc(fs->blocksize * 3);
+	if (!block_buf)
+		return ENOMEM;
+
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval)
+		goto out;
+
+	while (1) {
+		do {
+			retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		} while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
+		if (retval || !ino)
+			break;
+		if (!inode.i_links_count)
+			continue;
+
+		blk = ext2fs_file_acl_block(fs, &inode);
+		if (blk)
+			add_block(rm, blk, ino);
+		if (rm->err)
+			break;
+
+		if (inode.i_dtime)
+			continue;
+
+		if (ext2fs_inode_has_valid_blocks2(fs, &inode)) {
+			rm->ino = ino;
+			retval = ext2fs_block_iterate3(fs, ino,
+						BLOCK_FLAG_READ_ONLY,
+						block_buf, revmap_block_proc,
+						rm);
+			if (rm->err)
+				break;
+			if (retval)
+				com_err(cmd, retval, "while reading the blocks "
+					"of inode %u for the reverse map", ino);
+		}
+
+		if (!LINUX_S_ISDIR(inode.i_mode))
+			continue;
+		rm->dir = ino;
+		retval = ext2fs_open_dir_cursor(fs, ino, 0, &cursor);
+		if (!retval) {
+			while (!(retval = ext2fs_dir_cursor_next(cursor,
+							&dirent, &entry)) &&
+			       dirent) {
+				/* Skip "." and ".." */
+				if (entry != DIRENT_OTHER_FILE)
+					continue;
+				if ((rm->err = revmap_add_name(rm, dirent)))
+					break;
+			}
+			ext2fs_close_dir_cursor(cursor);
+		}
+		if (rm->err)
+			break;
+		if (retval)
+			com_err(cmd, retval, "while reading directory %u "
+				"for the reverse map", ino);
+	}
+	if (rm->err)
+		retval = rm->err;
+	if (retval)
+		goto out;
+
+	qsort(rm->runs, rm->num_runs, sizeof(struct revmap_run), run_cmp);
+	for (i = 0; i < rm->num_runs; i++) {
+		rm->runs[i].max_end = rm->runs[i].start + rm->runs[i].len;
+		if (i && rm->runs[i - 1].max_end > rm->runs[i].max_end)
+			rm->runs[i].max_end = rm->runs[i - 1].max_end;
+	}
+	qsort(rm->names, rm->num_names, sizeof(struct revmap_name), name_cmp);
+
+out:
+	if (scan)
+		ext2fs_close_inode_scan(scan);
+	free(block_buf);
+	return retval;
+}
+
+void revmap_release(void)
+{
+	if (!revmap)
+		return;
+	free(revmap->runs);
+	free(revmap->names);
+	free(revmap->strings);
+	free(revmap);
+	revmap = NULL;
+}
+
+/*
+ * Make sure the reverse map of the current file system is built.
+ * Returns non-zero if it can't be used, either because the file system
+ * is writable or because it couldn't be built; the caller then scans
+ * the file system itself.
+ */
+int revmap_open(const char *cmd)
+{
+	errcode_t	retval;
+
+	if (current_fs->flags & EXT2_FLAG_RW)
+		return 1;
+	if (revmap && revmap->fs == current_fs)
+		return 0;
+	revmap_release();
+
+	revmap = calloc(1, sizeof(struct revmap));
+	if (!revmap)
+		return 1;
+	revmap->fs = current_fs;
+	retval = revmap_build(revmap, cmd);
+	if (retval) {
+		com_err(cmd, retval, "while building the reverse map");
+		revmap_release();
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Return the lowest inode which owns blk, which is the one a scan of
+ * the inodes in order would find first, or 0 if no inode does.
+ */
+ext2_ino_t revmap_block_owner(blk64_t blk)
+{
+	struct revmap_run *runs = revmap->runs;
+	size_t		lo = 0, hi = revmap->num_runs;
+	ext2_ino_t	ino = 0;
+
+	/* Find the first run which starts after blk */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (runs[mid].start <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Blocks claimed twice make runs overlap; look back through them */
+	while (lo-- > 0 && runs[lo].max_end > blk) {
+		if (runs[lo].start + runs[lo].len > blk &&
+		    (!ino || runs[lo].ino < ino))
+			ino = runs[lo].ino;
+	}
+	return ino;
+}
+
+/*
+ * Return the directory entries naming ino, in the order an inode scan
+ * would find them, and set *count to how many there are.
+ */
+struct revmap_name *revmap_names(ext2_ino_t ino, size_t *count)
+{
+	struct revmap_name *names = revmap->names;
+	size_t		lo = 0, hi = revmap->num_names, first;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (names[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	while (lo < revmap->num_names && names[lo].ino == ino)
+		lo++;
+	*count = lo - first;
+	return names + first;
+}
+
+const char *revmap_name_string(struct revmap_name *name)
+{
+	return revmap->strings + name->name_off;
+}
@@ -24,34 +24,148 @@ extern char *optarg;
 
 #include "debugfs.h"
 
-void do_dump_unused(int argc EXT2FS_ATTR((unused)), char **argv)
+/* Free space is read this many bytes at a time */
+#define UNUSED_CHUNK_BYTES	(4 * 1024 * 1024)
+
+/*
+ * Comparing the block with itself one byte on lets memcmp() do the
+ * work a word or more at a time.
+ */
+static int block_is_zero(const unsigned char *buf, unsigned int size)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0;
+}
+
+static const unsigned char *find_pattern(const unsigned char *buf,
+					 size_t len, const char *pattern,
+					 size_t pat_len)
+{
+	const unsigned char *p;
+
+	while (len >= pat_len &&
+	       (p = memchr(buf, pattern[0], len - pat_len + 1))) {
+		if (memcmp(p, pattern, pat_len) == 0)
+			return p;
+		len -= p + 1 - buf;
+		buf = p + 1;
+	}
+	return NULL;
+}
+
+/*
+ * Read count blocks from blk on.  If that fails, the blocks are read
+ * one at a time, and those which can't be read come back zeroed.
+ */
+static void read_unused(const char *cmd, blk64_t blk, blk64_t count,
+			unsigned char *buf)
 {
-	blk64_t		blk;
-	unsigned char	buf[EXT2_MAX_BLOCK_SIZE];
-	unsigned int	i;
+	unsigned int	bs = current_fs->blocksize;
 	errcode_t	retval;
+	blk64_t		i;
 
-	if (common_args_process(argc, argv, 1, 1,
-				"dump_unused", "", 0))
+	if (io_channel_read_blk64(current_fs->io, blk, count, buf) == 0)
 		return;
-
-	for (blk=current_fs->super->s_first_data_block;
-	     blk < ext2fs_blocks_count(current_fs->super); blk++) {
-		if (ext2fs_test_block_bitmap2(current_fs->block_map,blk))
-			continue;
-		retval = io_channel_read_blk64(current_fs->io, blk, 1, buf);
+	for (i = 0; i < count; i++) {
+		retval = io_channel_read_blk64(current_fs->io, blk + i, 1,
+					       buf + i * bs);
 		if (retval) {
-			com_err(argv[0], retval, "While reading block\n");
-			return;
+			com_err(cmd, retval, "while reading block %llu",
+				blk + i);
+			memset(buf + i * bs, 0, bs);
+		}
+	}
+}
+
+static void dump_unused_block(blk64_t blk, const unsigned char *buf,
+			      int list_only)
+{
+	if (list_only) {
+		printf("%llu\n", blk);
+		return;
+	}
+	printf("\nUnused block %llu contains non-zero data:\n\n", blk);
+	fwrite(buf, current_fs->blocksize, 1, stdout);
+}
+
+void do_dump_unused(int argc, char **argv)
+{
+	blk64_t		blk, end, run_end, chunk, count, extra;
+	unsigned char	*buf;
+	unsigned int	bs;
+	const char	*pattern = 0;
+	const unsigned char *p;
+	size_t		pat_len = 0, avail, from, i;
+	int		c, list_only = 0;
+
+	reset_getopt();
+	while ((c = getopt(argc, argv, "lp:")) != EOF) {
+		switch (c) {
+		case 'l':
+			list_only = 1;
+			break;
+		case 'p':
+			pattern = optarg;
+			pat_len = strlen(optarg);
+			break;
+		default:
+			goto print_usage;
+		}
+	}
+	if (optind != argc || (pattern && !pat_len)) {
+	print_usage:
+		com_err(argv[0], 0, "Usage: dump_unused [-l] [-p pattern]");
+		return;
+	}
+	if (check_fs_open(argv[0]) || check_fs_bitmaps(argv[0]))
+		return;
+
+	bs = current_fs->blocksize;
+	chunk = UNUSED_CHUNK_BYTES / bs;
+	buf = malloc((chunk + 1) * bs);
+	if (!buf) {
+		com_err(argv[0], ENOMEM, "while allocating buffer");
+		return;
+	}
+	end = ext2fs_blocks_count(current_fs->super);
+	for (blk = current_fs->super->s_first_data_block; blk < end;
+	     blk = run_end) {
+		if (ext2fs_find_first_zero_block_bitmap2(current_fs->block_map,
+							 blk, end - 1, &blk))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(current_fs->block_map,
+							blk, end - 1, &run_end))
+			run_end = end;
+
+		for (; blk < run_end; blk += count) {
+			count = run_end - blk;
+			if (count > chunk)
+				count = chunk;
+			/* A match may run on into the next chunk */
+			extra = (pattern && blk + count < run_end) ? 1 : 0;
+			read_unused(argv[0], blk, count + extra, buf);
+
+			if (!pattern) {
+				for (i = 0; i < count; i++)
+					if (!block_is_zero(buf + i * bs, bs))
+						dump_unused_block(blk + i,
+							buf + i * bs,
+							list_only);
+				continue;
+			}
+			/* The blocks in which a match starts */
+			avail = (count + extra) * bs;
+			for (from = 0; from < count * bs; from = (i + 1) * bs) {
+				p = find_pattern(buf + from, avail - from,
+						 pattern, pat_len);
+				if (!p)
+					break;
+				i = (p - buf) / bs;
+				if (i >= count)
+					break;
+				dump_unused_block(blk + i, buf + i * bs,
+						  list_only);
+			}
 		}
-		for (i=0; i < current_fs->blocksize; i++)
-			if (buf[i])
-				break;
-		if (i >= current_fs->blocksize)
-			continue;
-		printf("\nUnused block %llu contains non-zero data:\n\n",
-		       blk);
-		for (i=0; i < current_fs->blocksize; i++)
-			fputc(buf[i], stdout);
 	}
+	free(buf);
 }
@@ -106,6 +106,11 @@ e2fsck_src_files :=  \
 	quota.c \
 	rehash.c \
 	region.c \
+	prefetch.c \
+	checkpoint.c \
+	estimate.c \
+	extents.c \
+	batch.c \
 	sigcatcher.c
 
 e2fsck_shared_libraries := \
@@ -0,0 +1,280 @@
+/*
+ * batch.c --- check many file systems from one e2fsck invocation
+ *
+ * Checking a small image takes hardly any time at all, so when
+ * thousands of them are checked one e2fsck process after another, most
+ * of the time goes into starting e2fsck: loading it, parsing the
+ * options and e2fsck.conf, setting up the error tables and the message
+ * catalog.  With "-E batch[=N]", all of that is done once, and then a
+ * child process is forked for each image, which starts out with the
+ * parent's context already set up and goes straight on to open the
+ * file system.  Up to N of them run at once.
+ *
+ * A child's standard output and standard error go to a pipe; the
+ * parent collects what each one writes and prints it in one piece when
+ * it is done, followed by a line with its exit status, so that the
+ * reports of images checked side by side don't get mixed up.  The exit
+ * status of the batch is that of all the images or'ed together, as with
+ * fsck -A.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "e2fsck.h"
+
+struct batch_job {
+	pid_t	pid;
+	int	fd;		/* -1 once the child has closed its end */
+	char	*name;
+	char	*buf;		/* what the child has written so far */
+	size_t	len, size;
+};
+
+struct batch_state {
+	e2fsck_t		ctx;
+	struct batch_job	*jobs;
+	int			num_jobs, running;
+	int			num_names, next_name;
+	char			**names;
+	int			read_stdin;
+	int			exit_value;
+	int			checked, failed;
+};
+
+/*
+ * Returns the next image to check, or NULL when there are no more; a
+ * name of "-" stands for the names read from standard input, one per
+ * line.
+ */
+static char *next_name(struct batch_state *st)
+{
+	static char	line[4096];
+	char		*cp;
+
+	while (1) {
+		if (st->read_stdin) {
+			if (!fgets(line, sizeof(line), stdin)) {
+				st->read_stdin = 0;
+				continue;
+			}
+			cp = strchr(line, '\n');
+			if (cp)
+				*cp = 0;
+			if (line[0])
+				return string_copy(st->ctx, line, 0);
+			continue;
+		}
+		if (st->next_name >= st->num_names)
+			return NULL;
+		cp = st->names[st->next_name++];
+		if (strcmp(cp, "-") == 0) {
+			st->read_stdin = 1;
+			continue;
+		}
+		return string_copy(st->ctx, cp, 0);
+	}
+}
+
+/* The child goes on to check name; this only returns in the child */
+static int start_job(struct batch_state *st, struct batch_job *job,
+		     char *name)
+{
+	int	fds[2], i, fd;
+
+	if (pipe(fds) < 0)
+		return -1;
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	if (job->pid < 0) {
+		job->pid = 0;
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (job->pid == 0) {
+		for (i = 0; i < st->num_jobs; i++)
+			if (st->jobs[i].fd >= 0)
+				close(st->jobs[i].fd);
+		close(fds[0]);
+		dup2(fds[1], 1);
+		dup2(fds[1], 2);
+		close(fds[1]);
+		fd = open("/dev/null", O_RDONLY);
+		if (fd >= 0) {
+			dup2(fd, 0);
+			close(fd);
+		}
+		st->ctx->interactive = 0;
+		return 0;
+	}
+	close(fds[1]);
+	job->fd = fds[0];
+	job->name = name;
+	job->len = 0;
+	st->running++;
+	return 1;
+}
+
+static void read_job(struct batch_state *st, struct batch_job *job)
+{
+	ssize_t		n;
+	size_t		size;
+
+	if (job->len == job->size) {
+		size = job->size ? job->size * 2 : 4096;
+		if (ext2fs_resize_mem(job->size, size, &job->buf)) {
+			/* Drop what doesn't fit rather than stall the child */
+			job->len = 0;
+			return;
+		}
+		job->size = size;
+	}
+	n = read(job->fd, job->buf + job->len, job->size - job->len);
+	if (n < 0 && errno == EINTR)
+		return;
+	if (n > 0) {
+		job->len += n;
+		return;
+	}
+	close(job->fd);
+	job->fd = -1;
+}
+
+static void finish_job(struct batch_state *st, struct batch_job *job)
+{
+	int	status, exit_value;
+
+	while (waitpid(job->pid, &status, 0) < 0)
+		if (errno != EINTR) {
+			status = FSCK_ERROR << 8;
+			break;
+		}
+	if (WIFEXITED(status))
+		exit_value = WEXITSTATUS(status);
+	else
+		exit_value = FSCK_ERROR;
+
+	fwrite(job->buf, 1, job->len, stdout);
+	if (WIFSIGNALED(status))
+		printf(_("%s: terminated by signal %d\n"), job->name,
+		       WTERMSIG(status));
+	printf(_("%s: exit status %d\n"), job->name, exit_value);
+	fflush(stdout);
+
+	st->exit_value |= exit_value;
+	st->checked++;
+	if (exit_value & ~(FSCK_NONDESTRUCT | FSCK_REBOOT))
+		st->failed++;
+	ext2fs_free_mem(&job->name);
+	job->pid = 0;
+	st->running--;
+}
+
+/*
+ * Check the named images in child processes.  In each child, this
+ * returns the name of the image to check, and e2fsck carries on as if
+ * it had only been asked to check that one; the parent exits once the
+ * whole batch is done.
+ */
+char *e2fsck_batch(e2fsck_t ctx, int num_names, char **names)
+{
+	struct batch_state	st;
+	struct batch_job	*job;
+	fd_set			rfds;
+	char			*name;
+	int			i, max_fd, more = 1;
+
+	memset(&st, 0, sizeof(st));
+	st.ctx = ctx;
+	st.names = names;
+	st.num_names = num_names;
+	st.num_jobs = ctx->batch_jobs;
+	st.jobs = e2fsck_allocate_memory(ctx, st.num_jobs *
+					 sizeof(struct batch_job),
+					 "batch jobs");
+	for (i = 0; i < st.num_jobs; i++)
+		st.jobs[i].fd = -1;
+
+	while (1) {
+		for (i = 0; more && i < st.num_jobs; i++) {
+			job = st.jobs + i;
+			if (job->pid)
+				continue;
+			if ((ctx->flags & E2F_FLAG_CANCEL) ||
+			    !(name = next_name(&st))) {
+				more = 0;
+				break;
+			}
+			switch (start_job(&st, job, name)) {
+			case 0:
+				return name;
+			case -1:
+				com_err(ctx->program_name, errno,
+					_("while starting the check of %s"),
+					name);
+				st.exit_value |= FSCK_ERROR;
+				st.failed++;
+				ext2fs_free_mem(&name);
+				break;
+			}
+		}
+		if (!st.running)
+			break;
+
+		max_fd = -1;
+		FD_ZERO(&rfds);
+		for (i = 0; i < st.num_jobs; i++) {
+			job = st.jobs + i;
+			if (!job->pid)
+				continue;
+			if (job->fd < 0) {
+				finish_job(&st, job);
+				continue;
+			}
+			FD_SET(job->fd, &rfds);
+			if (job->fd > max_fd)
+				max_fd = job->fd;
+		}
+		if (max_fd < 0)
+			continue;
+		if (select(max_fd + 1, &rfds, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_error(ctx, "select");
+		}
+		for (i = 0; i < st.num_jobs; i++) {
+			job = st.jobs + i;
+			if (job->pid && job->fd >= 0 &&
+			    FD_ISSET(job->fd, &rfds))
+				read_job(&st, job);
+		}
+	}
+
+	if (!(ctx->options & E2F_OPT_PREEN))
+		printf(P_("%d file system checked, %d with errors left\n",
+			  "%d file systems checked, %d with errors left\n",
+			  st.checked), st.checked, st.failed);
+	for (i = 0; i < st.num_jobs; i++)
+		ext2fs_free_mem(&st.jobs[i].buf);
+	ext2fs_free_mem(&st.jobs);
+	if (ctx->flags & E2F_FLAG_CANCEL)
+		st.exit_value |= FSCK_CANCELED;
+	exit(st.exit_value);
+}
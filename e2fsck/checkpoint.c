@@ -0,0 +1,325 @@
+/*
+ * checkpoint.c --- skip checking a file system which is known clean
+ *
+ * With "-E checkpoint=<file>", a run of e2fsck which finds nothing to
+ * fix writes a small sidecar file describing the file system as it was
+ * found: the superblock fields which any mount or write updates, and a
+ * crc32c digest for each block group covering its group descriptor,
+ * its allocation bitmaps and the in-use part of its inode table.
+ *
+ * The next run given the same file recomputes the digests before
+ * starting pass 1.  If the superblock fields agree and every group's
+ * digest is unchanged, the metadata is the same that was checked
+ * last time, and the check is skipped.  Any difference, or any
+ * trouble reading the file, simply means a full check.
+ *
+ * Directory and extent tree blocks are not digested.  Changing them
+ * through the kernel or libext2fs also changes an inode or the
+ * superblock, but writes to the device behind the file system's back
+ * will not be noticed.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "e2fsck.h"
+
+#define CHECKPOINT_MAGIC	0xE2C4EC01
+#define CHECKPOINT_VERSION	1
+
+/* Blocks read at a time while digesting an inode table */
+#define CHECKPOINT_READ_BLOCKS	64
+
+/*
+ * Everything in the file is a 32-bit word, stored little-endian: this
+ * header followed by one digest per block group.
+ */
+struct checkpoint_header {
+	__u32	cp_magic;
+	__u32	cp_version;
+	__u32	cp_uuid[4];
+	__u32	cp_blocks_count_lo;
+	__u32	cp_blocks_count_hi;
+	__u32	cp_inodes_count;
+	__u32	cp_group_count;
+	__u32	cp_feature_compat;
+	__u32	cp_feature_incompat;
+	__u32	cp_feature_ro_compat;
+	__u32	cp_mtime;
+	__u32	cp_wtime;
+	__u32	cp_mnt_count;
+	__u32	cp_crc;		/* of the header and the digests */
+};
+
+#define CHECKPOINT_HDR_WORDS	(sizeof(struct checkpoint_header) / 4)
+
+static void checkpoint_swab(__u32 *words, unsigned long num)
+{
+#ifdef WORDS_BIGENDIAN
+	unsigned long	i;
+
+	for (i = 0; i < num; i++)
+		words[i] = ext2fs_swab32(words[i]);
+#endif
+}
+
+static void fill_header(ext2_filsys fs, struct checkpoint_header *hdr,
+			__u32 wtime)
+{
+	struct ext2_super_block *sb = fs->super;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->cp_magic = CHECKPOINT_MAGIC;
+	hdr->cp_version = CHECKPOINT_VERSION;
+	memcpy(hdr->cp_uuid, sb->s_uuid, sizeof(hdr->cp_uuid));
+	hdr->cp_blocks_count_lo = ext2fs_blocks_count(sb) & 0xFFFFFFFF;
+	hdr->cp_blocks_count_hi = ext2fs_blocks_count(sb) >> 32;
+	hdr->cp_inodes_count = sb->s_inodes_count;
+	hdr->cp_group_count = fs->group_desc_count;
+	hdr->cp_feature_compat = sb->s_feature_compat;
+	hdr->cp_feature_incompat = sb->s_feature_incompat;
+	hdr->cp_feature_ro_compat = sb->s_feature_ro_compat;
+	hdr->cp_mtime = sb->s_mtime;
+	hdr->cp_wtime = wtime;
+	hdr->cp_mnt_count = sb->s_mnt_count;
+}
+
+static __u32 checkpoint_crc(__u32 *words, unsigned long num)
+{
+	return ext2fs_crc32c_le(~0U, (unsigned char *) words, num * 4);
+}
+
+static errcode_t digest_blocks(ext2_filsys fs, blk64_t blk, blk64_t count,
+			       char *buf, __u32 *crc)
+{
+	errcode_t	retval;
+	int		n;
+
+	if (!blk || blk + count > ext2fs_blocks_count(fs->super))
+		return EXT2_ET_BAD_BLOCK_NUM;
+	while (count) {
+		n = count > CHECKPOINT_READ_BLOCKS ?
+			CHECKPOINT_READ_BLOCKS : count;
+		retval = io_channel_read_blk64(fs->io, blk, n, buf);
+		if (retval)
+			return retval;
+		*crc = ext2fs_crc32c_le(*crc, (unsigned char *) buf,
+					n * fs->blocksize);
+		blk += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static errcode_t digest_group(ext2_filsys fs, dgrp_t group, char *buf,
+			      __u32 *ret_crc)
+{
+	__u32		crc = ~0U, used;
+	blk64_t		count;
+	errcode_t	retval;
+	int		csum_flag;
+
+	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					       EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+	crc = ext2fs_crc32c_le(crc, (unsigned char *)
+			       ext2fs_group_desc(fs, fs->group_desc, group),
+			       EXT2_DESC_SIZE(fs->super));
+
+	if (!csum_flag ||
+	    !ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT)) {
+		retval = digest_blocks(fs, ext2fs_block_bitmap_loc(fs, group),
+				       1, buf, &crc);
+		if (retval)
+			return retval;
+	}
+
+	count = fs->inode_blocks_per_group;
+	if (csum_flag) {
+		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+			goto out;
+		used = EXT2_INODES_PER_GROUP(fs->super) -
+			ext2fs_bg_itable_unused(fs, group);
+		count = ((unsigned long long) used *
+			 EXT2_INODE_SIZE(fs->super) +
+			 fs->blocksize - 1) / fs->blocksize;
+		if (count > fs->inode_blocks_per_group)
+			count = fs->inode_blocks_per_group;
+	}
+	retval = digest_blocks(fs, ext2fs_inode_bitmap_loc(fs, group),
+			       1, buf, &crc);
+	if (retval)
+		return retval;
+	if (count) {
+		retval = digest_blocks(fs, ext2fs_inode_table_loc(fs, group),
+				       count, buf, &crc);
+		if (retval)
+			return retval;
+	}
+out:
+	*ret_crc = crc;
+	return 0;
+}
+
+/*
+ * Returns 1 if the checkpoint file shows that the file system has not
+ * changed since it was last found clean.  Otherwise *why may be set to
+ * explain why the checkpoint could not be used.
+ */
+int e2fsck_checkpoint_unchanged(e2fsck_t ctx, const char **why)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct ext2_super_block *sb = fs->super;
+	struct checkpoint_header expect, *hdr;
+	__u32		*words = 0, crc;
+	unsigned long	num_words;
+	char		*buf = 0;
+	FILE		*f;
+	dgrp_t		group;
+	errcode_t	retval;
+	int		ret = 0;
+
+	*why = 0;
+	if (!(sb->s_state & EXT2_VALID_FS) || (sb->s_state & EXT2_ERROR_FS) ||
+	    !ext2fs_test_valid(fs) || ext2fs_test_changed(fs) ||
+	    sb->s_last_orphan ||
+	    (sb->s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER))
+		return 0;
+
+	f = fopen(ctx->checkpoint_fn, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			*why = error_message(errno);
+		goto out;
+	}
+	num_words = CHECKPOINT_HDR_WORDS + fs->group_desc_count;
+	retval = ext2fs_get_array(num_words, sizeof(__u32), &words);
+	if (retval) {
+		*why = error_message(retval);
+		goto out;
+	}
+	if (fread(words, sizeof(__u32), num_words, f) != num_words ||
+	    fgetc(f) != EOF) {
+		*why = _("the checkpoint does not match this file system");
+		goto out;
+	}
+	checkpoint_swab(words, num_words);
+	hdr = (struct checkpoint_header *) words;
+	crc = hdr->cp_crc;
+	hdr->cp_crc = 0;
+	fill_header(fs, &expect, sb->s_wtime);
+	if (crc != checkpoint_crc(words, num_words)) {
+		*why = _("the checkpoint file is corrupt");
+		goto out;
+	}
+	if (memcmp(hdr, &expect, sizeof(expect))) {
+		*why = _("the file system was written since the checkpoint");
+		goto out;
+	}
+
+	retval = ext2fs_get_array(CHECKPOINT_READ_BLOCKS, fs->blocksize, &buf);
+	if (retval) {
+		*why = error_message(retval);
+		goto out;
+	}
+	for (group = 0; group < fs->group_desc_count; group++) {
+		if (digest_group(fs, group, buf, &crc) ||
+		    crc != words[CHECKPOINT_HDR_WORDS + group]) {
+			*why = _("block group metadata changed since the "
+				"checkpoint");
+			goto out;
+		}
+	}
+	ret = 1;
+out:
+	if (f)
+		fclose(f);
+	if (words)
+		ext2fs_free_mem(&words);
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return ret;
+}
+
+/*
+ * Record the state of a file system which was just found clean.  This
+ * must be called once the bitmaps have been written out, just before
+ * the file system is closed.
+ */
+void e2fsck_save_checkpoint(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct checkpoint_header *hdr;
+	__u32		*words = 0, wtime;
+	unsigned long	num_words;
+	char		*buf = 0, *tmp_fn = 0;
+	FILE		*f;
+	dgrp_t		group;
+	errcode_t	retval;
+
+	/* ext2fs_close() will stamp the superblock with fs->now */
+	wtime = fs->super->s_wtime;
+	if ((fs->flags & EXT2_FLAG_RW) && (fs->flags & EXT2_FLAG_DIRTY)) {
+		if (!fs->now)
+			fs->now = time(0);
+		wtime = fs->now;
+	}
+
+	num_words = CHECKPOINT_HDR_WORDS + fs->group_desc_count;
+	retval = ext2fs_get_array(num_words, sizeof(__u32), &words);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(CHECKPOINT_READ_BLOCKS, fs->blocksize, &buf);
+	if (retval)
+		goto errout;
+	hdr = (struct checkpoint_header *) words;
+	fill_header(fs, hdr, wtime);
+	for (group = 0; group < fs->group_desc_count; group++) {
+		retval = digest_group(fs, group, buf,
+				      words + CHECKPOINT_HDR_WORDS + group);
+		if (retval)
+			goto errout;
+	}
+	hdr->cp_crc = checkpoint_crc(words, num_words);
+	checkpoint_swab(words, num_words);
+
+	/* Write a new file and rename it, so a crash leaves no torn file */
+	retval = ext2fs_get_mem(strlen(ctx->checkpoint_fn) + 5, &tmp_fn);
+	if (retval)
+		goto errout;
+	sprintf(tmp_fn, "%s.new", ctx->checkpoint_fn);
+	f = fopen(tmp_fn, "w");
+	if (!f) {
+		retval = errno;
+		goto errout;
+	}
+	if (fwrite(words, sizeof(__u32), num_words, f) != num_words ||
+	    fflush(f) || fsync(fileno(f)))
+		retval = errno ? errno : EXT2_ET_SHORT_WRITE;
+	if (fclose(f) && !retval)
+		retval = errno;
+	if (!retval && rename(tmp_fn, ctx->checkpoint_fn) < 0)
+		retval = errno;
+	if (!retval)
+		goto out;
+	unlink(tmp_fn);
+errout:
+	com_err(ctx->program_name, retval,
+		_("while writing checkpoint file %s"), ctx->checkpoint_fn);
+out:
+	if (tmp_fn)
+		ext2fs_free_mem(&tmp_fn);
+	if (words)
+		ext2fs_free_mem(&words);
+	if (buf)
+		ext2fs_free_mem(&buf);
+}
@@ -151,22 +151,13 @@ __u32 crc32_le(__u32 crc, unsigned char const *p, size_t len)
 
 #endif /* UNITTEST */
 
-/**
- * crc32_be() - Calculate bitwise big-endian Ethernet AUTODIN II CRC32
- * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
- *	other uses, or the previous crc32 value if computing incrementally.
- * @p: pointer to buffer over which CRC is run
- * @len: length of buffer @p
- */
-__u32 crc32_be(__u32 crc, unsigned char const *p, size_t len);
-
 #if CRC_BE_BITS == 1
 /*
  * In fact, the table-based code will work in this case, but it can be
  * simplified by inlining the table in ?: form.
  */
 
-__u32 crc32_be(__u32 crc, unsigned char const *p, size_t len)
+static __u32 crc32_be_generic(__u32 crc, unsigned char const *p, size_t len)
 {
 	int i;
 	while (len--) {
@@ -180,54 +171,30 @@ __u32 crc32_be(__u32 crc, unsigned char const *p, size_t len)
 }
 
 #else				/* Table-based approach */
-__u32 crc32_be(__u32 crc, unsigned char const *p, size_t len)
+static __u32 crc32_be_generic(__u32 crc, unsigned char const *p, size_t len)
 {
 # if CRC_BE_BITS == 8
-	const __u32      *b =(const __u32 *)p;
-	const __u32      *tab = crc32table_be;
-
-# ifdef WORDS_BIGENDIAN
-#  define DO_CRC(x) crc = tab[ ((crc >> 24) ^ (x)) & 255] ^ (crc<<8)
-# else
-#  define DO_CRC(x) crc = tab[ (crc ^ (x)) & 255 ] ^ (crc>>8)
-# endif
-
-	crc = __cpu_to_be32(crc);
-	/* Align it */
-	if(unlikely(((long)b)&3 && len)){
-		do {
-			const __u8 *q = (const __u8 *)b;
-			DO_CRC(*q++);
-			b = (const __u32 *)q;
-		} while ((--len) && ((long)b)&3 );
+	const __u32 (*tab)[256] = crc32table_be_slice;
+
+	/*
+	 * Slice-by-8: the eight table lookups for each eight bytes don't
+	 * depend on each other, so they can all be in flight at once.
+	 * The bytes are gathered one at a time, so that neither the
+	 * alignment of the buffer nor the byte order of the CPU matters.
+	 */
+	while (len >= 8) {
+		crc ^= ((__u32) p[0] << 24) | ((__u32) p[1] << 16) |
+			((__u32) p[2] << 8) | p[3];
+		crc = tab[7][crc >> 24] ^ tab[6][(crc >> 16) & 255] ^
+			tab[5][(crc >> 8) & 255] ^ tab[4][crc & 255] ^
+			tab[3][p[4]] ^ tab[2][p[5]] ^
+			tab[1][p[6]] ^ tab[0][p[7]];
+		p += 8;
+		len -= 8;
 	}
-	if(likely(len >= 4)){
-		/* load data 32 bits wide, xor data 32 bits wide. */
-		size_t save_len = len & 3;
-	        len = len >> 2;
-		--b; /* use pre increment below(*++b) for speed */
-		do {
-			crc ^= *++b;
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-		} while (--len);
-		b++; /* point to next byte(s) */
-		len = save_len;
-	}
-	/* And the last few bytes */
-	if(len){
-		do {
-			const __u8 *q = (const __u8 *)b;
-			DO_CRC(*q++);
-			b = (const void *)q;
-		} while (--len);
-	}
-	return __be32_to_cpu(crc);
-#undef ENDIAN_SHIFT
-#undef DO_CRC
-
+	while (len--)
+		crc = (crc << 8) ^ tab[0][(crc >> 24) ^ *p++];
+	return crc;
 # elif CRC_BE_BITS == 4
 	while (len--) {
 		crc ^= *p++ << 24;
@@ -248,6 +215,163 @@ __u32 crc32_be(__u32 crc, unsigned char const *p, size_t len)
 }
 #endif
 
+/*
+ * A faster version for x86-64 CPUs which have the instructions for it,
+ * written with inline assembly so that this file doesn't need special
+ * compiler flags; whether it can be used is decided at run time.
+ */
+#ifndef WORDS_BIGENDIAN
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#define HAVE_CRC32_BE_HW
+
+/*
+ * Carry-less multiplication folds the buffer 64 bytes at a time.  A
+ * 128-bit piece H * x^64 + L of the message which is followed by d
+ * more bits contributes H * x^(d+64) + L * x^d to the remainder, and
+ * modulo the CRC polynomial that is H * k_hi + L * k_lo with two
+ * 32-bit constants, which is no wider than a piece is.  Four pieces
+ * are folded forward over 512 bits each round, then onto one another
+ * over 128 bits, and the CRC of the last 128 bits (and of whatever is
+ * left over) is computed with the tables.
+ */
+static __u64 crc32_be_fold512[2], crc32_be_fold128[2];
+
+#define CLMUL(a, b, imm) \
+	__asm__("pclmulqdq %2, %1, %0" : "+x" (a) : "x" (b), "i" (imm))
+
+static inline __m128i crc32_be_load(unsigned char const *p, __m128i bswap)
+{
+	__m128i x = _mm_loadu_si128((__m128i const *) p);
+
+	/* Put the first byte of the piece at the top */
+	__asm__("pshufb %1, %0" : "+x" (x) : "x" (bswap));
+	return x;
+}
+
+static inline __m128i crc32_be_fold(__m128i x, __m128i k, __m128i next)
+{
+	__m128i hi = x;
+
+	CLMUL(x, k, 0x00);
+	CLMUL(hi, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(x, hi), next);
+}
+
+static __u32 crc32_be_hw(__u32 crc, unsigned char const *p, size_t len)
+{
+	__m128i		bswap, k512, k128, x0, x1, x2, x3;
+	unsigned char	buf[16];
+
+	if (len < 64)
+		return crc32_be_generic(crc, p, len);
+
+	bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			     8, 9, 10, 11, 12, 13, 14, 15);
+	k512 = _mm_loadu_si128((__m128i const *) crc32_be_fold512);
+	k128 = _mm_loadu_si128((__m128i const *) crc32_be_fold128);
+
+	/* The CRC so far goes into the first 32 bits of the message */
+	x0 = _mm_xor_si128(crc32_be_load(p, bswap),
+			   _mm_set_epi32((int) crc, 0, 0, 0));
+	x1 = crc32_be_load(p + 16, bswap);
+	x2 = crc32_be_load(p + 32, bswap);
+	x3 = crc32_be_load(p + 48, bswap);
+	p += 64;
+	len -= 64;
+	while (len >= 64) {
+		x0 = crc32_be_fold(x0, k512, crc32_be_load(p, bswap));
+		x1 = crc32_be_fold(x1, k512, crc32_be_load(p + 16, bswap));
+		x2 = crc32_be_fold(x2, k512, crc32_be_load(p + 32, bswap));
+		x3 = crc32_be_fold(x3, k512, crc32_be_load(p + 48, bswap));
+		p += 64;
+		len -= 64;
+	}
+	x1 = crc32_be_fold(x0, k128, x1);
+	x2 = crc32_be_fold(x1, k128, x2);
+	x3 = crc32_be_fold(x2, k128, x3);
+	while (len >= 16) {
+		x3 = crc32_be_fold(x3, k128, crc32_be_load(p, bswap));
+		p += 16;
+		len -= 16;
+	}
+
+	/* Back into message order for the tables */
+	__asm__("pshufb %1, %0" : "+x" (x3) : "x" (bswap));
+	_mm_storeu_si128((__m128i *) buf, x3);
+	crc = crc32_be_generic(0, buf, sizeof(buf));
+	return crc32_be_generic(crc, p, len);
+}
+
+/* x^n modulo the CRC polynomial */
+static __u32 crc32_be_xpow(unsigned int n)
+{
+	__u32 r = 1;
+
+	while (n--)
+		r = (r << 1) ^ ((r & 0x80000000) ? CRCPOLY_BE : 0);
+	return r;
+}
+
+static int crc32_be_hw_available(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	if ((ecx & (bit_PCLMUL | bit_SSSE3)) != (bit_PCLMUL | bit_SSSE3))
+		return 0;
+	crc32_be_fold512[0] = crc32_be_xpow(512);
+	crc32_be_fold512[1] = crc32_be_xpow(512 + 64);
+	crc32_be_fold128[0] = crc32_be_xpow(128);
+	crc32_be_fold128[1] = crc32_be_xpow(128 + 64);
+	return 1;
+}
+#define CRC32_BE_HW_NAME	"pclmulqdq"
+
+#endif
+#endif /* WORDS_BIGENDIAN */
+
+static __u32 crc32_be_select(__u32 crc, unsigned char const *p, size_t len);
+
+static __u32 (*crc32_be_func)(__u32 crc, unsigned char const *p,
+			      size_t len) = crc32_be_select;
+
+/*
+ * Pick the fastest implementation the CPU supports on the first call.
+ */
+static __u32 crc32_be_select(__u32 crc, unsigned char const *p, size_t len)
+{
+	__u32 (*func)(__u32 crc, unsigned char const *p,
+		      size_t len) = crc32_be_generic;
+
+#ifdef HAVE_CRC32_BE_HW
+	if (crc32_be_hw_available()) {
+		/*
+		 * Another thread may pick up the new function as soon as
+		 * it is stored, so its constants must be visible first.
+		 */
+		__sync_synchronize();
+		func = crc32_be_hw;
+	}
+#endif
+	crc32_be_func = func;
+	return func(crc, p, len);
+}
+
+/**
+ * crc32_be() - Calculate bitwise big-endian Ethernet AUTODIN II CRC32
+ * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
+ *	other uses, or the previous crc32 value if computing incrementally.
+ * @p: pointer to buffer over which CRC is run
+ * @len: length of buffer @p
+ */
+__u32 crc32_be(__u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32_be_func(crc, p, len);
+}
+
 /*
  * A brief CRC tutorial.
  *
@@ -531,6 +655,44 @@ static __u32 test_step(__u32 init, unsigned char *buf, size_t len)
 	return crc1;
 }
 
+/*
+ * Compare the implementation in use, and the table code, with the
+ * CRC computed a bit at a time, over lengths and alignments which
+ * exercise the ends of the folding loops.
+ */
+static int test_impls(void)
+{
+	static unsigned char buf[4096 + 16];
+	__u32 init, crc, ref, fast, table;
+	size_t start, len, k;
+	int i, j, failures = 0;
+
+	random_garbage(buf, sizeof(buf));
+	for (i = 0; i < 2000; i++) {
+		start = random() % 16;
+		len = (i < 300) ? (size_t) i : (size_t) (random() % 4097);
+		init = (i & 1) ? ~0U : (__u32) random();
+
+		crc = init;
+		for (k = 0; k < len; k++) {
+			crc ^= buf[start + k] << 24;
+			for (j = 0; j < 8; j++)
+				crc = (crc << 1) ^
+				      ((crc & 0x80000000) ? CRCPOLY_BE : 0);
+		}
+		ref = crc;
+		fast = crc32_be(init, buf + start, len);
+		table = crc32_be_generic(init, buf + start, len);
+		if (fast != ref || table != ref) {
+			printf("\nCRC length %zu at %zu fail: 0x%08x, "
+			       "0x%08x != 0x%08x\n", len, start, fast,
+			       table, ref);
+			failures++;
+		}
+	}
+	return failures;
+}
+
 #define SIZE 64
 #define INIT1 0
 #define INIT2 0
@@ -562,8 +724,13 @@ int main(int argc, char **argv)
 			exit_status++;
 		}
 	}
+	exit_status += test_impls();
+#ifdef CRC32_BE_HW_NAME
+	printf("\ncrc32_be uses %s: %s\n", CRC32_BE_HW_NAME,
+	       crc32_be_func == crc32_be_hw ? "yes" : "no");
+#endif
 	printf("\nAll test complete.  No failures expected.\n");
-	return 0;
+	return exit_status;
 }
 
 #endif				/* UNITTEST */
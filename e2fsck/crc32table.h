@@ -68,69 +68,524 @@ tole(0xb3667a2eL), tole(0xc4614ab8L), tole(0x5d681b02L), tole(0x2a6f2b94L),
 tole(0xb40bbe37L), tole(0xc30c8ea1L), tole(0x5a05df1bL), tole(0x2d02ef8dL)
 };
 #endif /* UNITTEST */
-static const __u32 crc32table_be[] = {
-tobe(0x00000000L), tobe(0x04c11db7L), tobe(0x09823b6eL), tobe(0x0d4326d9L), 
-tobe(0x130476dcL), tobe(0x17c56b6bL), tobe(0x1a864db2L), tobe(0x1e475005L), 
-tobe(0x2608edb8L), tobe(0x22c9f00fL), tobe(0x2f8ad6d6L), tobe(0x2b4bcb61L), 
-tobe(0x350c9b64L), tobe(0x31cd86d3L), tobe(0x3c8ea00aL), tobe(0x384fbdbdL), 
-tobe(0x4c11db70L), tobe(0x48d0c6c7L), tobe(0x4593e01eL), tobe(0x4152fda9L), 
-tobe(0x5f15adacL), tobe(0x5bd4b01bL), tobe(0x569796c2L), tobe(0x52568b75L), 
-tobe(0x6a1936c8L), tobe(0x6ed82b7fL), tobe(0x639b0da6L), tobe(0x675a1011L), 
-tobe(0x791d4014L), tobe(0x7ddc5da3L), tobe(0x709f7b7aL), tobe(0x745e66cdL), 
-tobe(0x9823b6e0L), tobe(0x9ce2ab57L), tobe(0x91a18d8eL), tobe(0x95609039L), 
-tobe(0x8b27c03cL), tobe(0x8fe6dd8bL), tobe(0x82a5fb52L), tobe(0x8664e6e5L), 
-tobe(0xbe2b5b58L), tobe(0xbaea46efL), tobe(0xb7a96036L), tobe(0xb3687d81L), 
-tobe(0xad2f2d84L), tobe(0xa9ee3033L), tobe(0xa4ad16eaL), tobe(0xa06c0b5dL), 
-tobe(0xd4326d90L), tobe(0xd0f37027L), tobe(0xddb056feL), tobe(0xd9714b49L), 
-tobe(0xc7361b4cL), tobe(0xc3f706fbL), tobe(0xceb42022L), tobe(0xca753d95L), 
-tobe(0xf23a8028L), tobe(0xf6fb9d9fL), tobe(0xfbb8bb46L), tobe(0xff79a6f1L), 
-tobe(0xe13ef6f4L), tobe(0xe5ffeb43L), tobe(0xe8bccd9aL), tobe(0xec7dd02dL), 
-tobe(0x34867077L), tobe(0x30476dc0L), tobe(0x3d044b19L), tobe(0x39c556aeL), 
-tobe(0x278206abL), tobe(0x23431b1cL), tobe(0x2e003dc5L), tobe(0x2ac12072L), 
-tobe(0x128e9dcfL), tobe(0x164f8078L), tobe(0x1b0ca6a1L), tobe(0x1fcdbb16L), 
-tobe(0x018aeb13L), tobe(0x054bf6a4L), tobe(0x0808d07dL), tobe(0x0cc9cdcaL), 
-tobe(0x7897ab07L), tobe(0x7c56b6b0L), tobe(0x71159069L), tobe(0x75d48ddeL), 
-tobe(0x6b93dddbL), tobe(0x6f52c06cL), tobe(0x6211e6b5L), tobe(0x66d0fb02L), 
-tobe(0x5e9f46bfL), tobe(0x5a5e5b08L), tobe(0x571d7dd1L), tobe(0x53dc6066L), 
-tobe(0x4d9b3063L), tobe(0x495a2dd4L), tobe(0x44190b0dL), tobe(0x40d816baL), 
-tobe(0xaca5c697L), tobe(0xa864db20L), tobe(0xa527fdf9L), tobe(0xa1e6e04eL), 
-tobe(0xbfa1b04bL), tobe(0xbb60adfcL), tobe(0xb6238b25L), tobe(0xb2e29692L), 
-tobe(0x8aad2b2fL), tobe(0x8e6c3698L), tobe(0x832f1041L), tobe(0x87ee0df6L), 
-tobe(0x99a95df3L), tobe(0x9d684044L), tobe(0x902b669dL), tobe(0x94ea7b2aL), 
-tobe(0xe0b41de7L), tobe(0xe4750050L), tobe(0xe9362689L), tobe(0xedf73b3eL), 
-tobe(0xf3b06b3bL), tobe(0xf771768cL), tobe(0xfa325055L), tobe(0xfef34de2L), 
-tobe(0xc6bcf05fL), tobe(0xc27dede8L), tobe(0xcf3ecb31L), tobe(0xcbffd686L), 
-tobe(0xd5b88683L), tobe(0xd1799b34L), tobe(0xdc3abdedL), tobe(0xd8fba05aL), 
-tobe(0x690ce0eeL), tobe(0x6dcdfd59L), tobe(0x608edb80L), tobe(0x644fc637L), 
-tobe(0x7a089632L), tobe(0x7ec98b85L), tobe(0x738aad5cL), tobe(0x774bb0ebL), 
-tobe(0x4f040d56L), tobe(0x4bc510e1L), tobe(0x46863638L), tobe(0x42472b8fL), 
-tobe(0x5c007b8aL), tobe(0x58c1663dL), tobe(0x558240e4L), tobe(0x51435d53L), 
-tobe(0x251d3b9eL), tobe(0x21dc2629L), tobe(0x2c9f00f0L), tobe(0x285e1d47L), 
-tobe(0x36194d42L), tobe(0x32d850f5L), tobe(0x3f9b762cL), tobe(0x3b5a6b9bL), 
-tobe(0x0315d626L), tobe(0x07d4cb91L), tobe(0x0a97ed48L), tobe(0x0e56f0ffL), 
-tobe(0x1011a0faL), tobe(0x14d0bd4dL), tobe(0x19939b94L), tobe(0x1d528623L), 
-tobe(0xf12f560eL), tobe(0xf5ee4bb9L), tobe(0xf8ad6d60L), tobe(0xfc6c70d7L), 
-tobe(0xe22b20d2L), tobe(0xe6ea3d65L), tobe(0xeba91bbcL), tobe(0xef68060bL), 
-tobe(0xd727bbb6L), tobe(0xd3e6a601L), tobe(0xdea580d8L), tobe(0xda649d6fL), 
-tobe(0xc423cd6aL), tobe(0xc0e2d0ddL), tobe(0xcda1f604L), tobe(0xc960ebb3L), 
-tobe(0xbd3e8d7eL), tobe(0xb9ff90c9L), tobe(0xb4bcb610L), tobe(0xb07daba7L), 
-tobe(0xae3afba2L), tobe(0xaafbe615L), tobe(0xa7b8c0ccL), tobe(0xa379dd7bL), 
-tobe(0x9b3660c6L), tobe(0x9ff77d71L), tobe(0x92b45ba8L), tobe(0x9675461fL), 
-tobe(0x8832161aL), tobe(0x8cf30badL), tobe(0x81b02d74L), tobe(0x857130c3L), 
-tobe(0x5d8a9099L), tobe(0x594b8d2eL), tobe(0x5408abf7L), tobe(0x50c9b640L), 
-tobe(0x4e8ee645L), tobe(0x4a4ffbf2L), tobe(0x470cdd2bL), tobe(0x43cdc09cL), 
-tobe(0x7b827d21L), tobe(0x7f436096L), tobe(0x7200464fL), tobe(0x76c15bf8L), 
-tobe(0x68860bfdL), tobe(0x6c47164aL), tobe(0x61043093L), tobe(0x65c52d24L), 
-tobe(0x119b4be9L), tobe(0x155a565eL), tobe(0x18197087L), tobe(0x1cd86d30L), 
-tobe(0x029f3d35L), tobe(0x065e2082L), tobe(0x0b1d065bL), tobe(0x0fdc1becL), 
-tobe(0x3793a651L), tobe(0x3352bbe6L), tobe(0x3e119d3fL), tobe(0x3ad08088L), 
-tobe(0x2497d08dL), tobe(0x2056cd3aL), tobe(0x2d15ebe3L), tobe(0x29d4f654L), 
-tobe(0xc5a92679L), tobe(0xc1683bceL), tobe(0xcc2b1d17L), tobe(0xc8ea00a0L), 
-tobe(0xd6ad50a5L), tobe(0xd26c4d12L), tobe(0xdf2f6bcbL), tobe(0xdbee767cL), 
-tobe(0xe3a1cbc1L), tobe(0xe760d676L), tobe(0xea23f0afL), tobe(0xeee2ed18L), 
-tobe(0xf0a5bd1dL), tobe(0xf464a0aaL), tobe(0xf9278673L), tobe(0xfde69bc4L), 
-tobe(0x89b8fd09L), tobe(0x8d79e0beL), tobe(0x803ac667L), tobe(0x84fbdbd0L), 
-tobe(0x9abc8bd5L), tobe(0x9e7d9662L), tobe(0x933eb0bbL), tobe(0x97ffad0cL), 
-tobe(0xafb010b1L), tobe(0xab710d06L), tobe(0xa6322bdfL), tobe(0xa2f33668L), 
-tobe(0xbcb4666dL), tobe(0xb8757bdaL), tobe(0xb5365d03L), tobe(0xb1f740b4L)
-};
+static const __u32 crc32table_be_slice[8][256] = {{
+(0x00000000L), (0x04c11db7L), (0x09823b6eL), (0x0d4326d9L), 
+(0x130476dcL), (0x17c56b6bL), (0x1a864db2L), (0x1e475005L), 
+(0x2608edb8L), (0x22c9f00fL), (0x2f8ad6d6L), (0x2b4bcb61L), 
+(0x350c9b64L), (0x31cd86d3L), (0x3c8ea00aL), (0x384fbdbdL), 
+(0x4c11db70L), (0x48d0c6c7L), (0x4593e01eL), (0x4152fda9L), 
+(0x5f15adacL), (0x5bd4b01bL), (0x569796c2L), (0x52568b75L), 
+(0x6a1936c8L), (0x6ed82b7fL), (0x639b0da6L), (0x675a1011L), 
+(0x791d4014L), (0x7ddc5da3L), (0x709f7b7aL), (0x745e66cdL), 
+(0x9823b6e0L), (0x9ce2ab57L), (0x91a18d8eL), (0x95609039L), 
+(0x8b27c03cL), (0x8fe6dd8bL), (0x82a5fb52L), (0x8664e6e5L), 
+(0xbe2b5b58L), (0xbaea46efL), (0xb7a96036L), (0xb3687d81L), 
+(0xad2f2d84L), (0xa9ee3033L), (0xa4ad16eaL), (0xa06c0b5dL), 
+(0xd4326d90L), (0xd0f37027L), (0xddb056feL), (0xd9714b49L), 
+(0xc7361b4cL), (0xc3f706fbL), (0xceb42022L), (0xca753d95L), 
+(0xf23a8028L), (0xf6fb9d9fL), (0xfbb8bb46L), (0xff79a6f1L), 
+(0xe13ef6f4L), (0xe5ffeb43L), (0xe8bccd9aL), (0xec7dd02dL), 
+(0x34867077L), (0x30476dc0L), (0x3d044b19L), (0x39c556aeL), 
+(0x278206abL), (0x23431b1cL), (0x2e003dc5L), (0x2ac12072L), 
+(0x128e9dcfL), (0x164f8078L), (0x1b0ca6a1L), (0x1fcdbb16L), 
+(0x018aeb13L), (0x054bf6a4L), (0x0808d07dL), (0x0cc9cdcaL), 
+(0x7897ab07L), (0x7c56b6b0L), (0x71159069L), (0x75d48ddeL), 
+(0x6b93dddbL), (0x6f52c06cL), (0x6211e6b5L), (0x66d0fb02L), 
+(0x5e9f46bfL), (0x5a5e5b08L), (0x571d7dd1L), (0x53dc6066L), 
+(0x4d9b3063L), (0x495a2dd4L), (0x44190b0dL), (0x40d816baL), 
+(0xaca5c697L), (0xa864db20L), (0xa527fdf9L), (0xa1e6e04eL), 
+(0xbfa1b04bL), (0xbb60adfcL), (0xb6238b25L), (0xb2e29692L), 
+(0x8aad2b2fL), (0x8e6c3698L), (0x832f1041L), (0x87ee0df6L), 
+(0x99a95df3L), (0x9d684044L), (0x902b669dL), (0x94ea7b2aL), 
+(0xe0b41de7L), (0xe4750050L), (0xe9362689L), (0xedf73b3eL), 
+(0xf3b06b3bL), (0xf771768cL), (0xfa325055L), (0xfef34de2L), 
+(0xc6bcf05fL), (0xc27dede8L), (0xcf3ecb31L), (0xcbffd686L), 
+(0xd5b88683L), (0xd1799b34L), (0xdc3abdedL), (0xd8fba05aL), 
+(0x690ce0eeL), (0x6dcdfd59L), (0x608edb80L), (0x644fc637L), 
+(0x7a089632L), (0x7ec98b85L), (0x738aad5cL), (0x774bb0ebL), 
+(0x4f040d56L), (0x4bc510e1L), (0x46863638L), (0x42472b8fL), 
+(0x5c007b8aL), (0x58c1663dL), (0x558240e4L), (0x51435d53L), 
+(0x251d3b9eL), (0x21dc2629L), (0x2c9f00f0L), (0x285e1d47L), 
+(0x36194d42L), (0x32d850f5L), (0x3f9b762cL), (0x3b5a6b9bL), 
+(0x0315d626L), (0x07d4cb91L), (0x0a97ed48L), (0x0e56f0ffL), 
+(0x1011a0faL), (0x14d0bd4dL), (0x19939b94L), (0x1d528623L), 
+(0xf12f560eL), (0xf5ee4bb9L), (0xf8ad6d60L), (0xfc6c70d7L), 
+(0xe22b20d2L), (0xe6ea3d65L), (0xeba91bbcL), (0xef68060bL), 
+(0xd727bbb6L), (0xd3e6a601L), (0xdea580d8L), (0xda649d6fL), 
+(0xc423cd6aL), (0xc0e2d0ddL), (0xcda1f604L), (0xc960ebb3L), 
+(0xbd3e8d7eL), (0xb9ff90c9L), (0xb4bcb610L), (0xb07daba7L), 
+(0xae3afba2L), (0xaafbe615L), (0xa7b8c0ccL), (0xa379dd7bL), 
+(0x9b3660c6L), (0x9ff77d71L), (0x92b45ba8L), (0x9675461fL), 
+(0x8832161aL), (0x8cf30badL), (0x81b02d74L), (0x857130c3L), 
+(0x5d8a9099L), (0x594b8d2eL), (0x5408abf7L), (0x50c9b640L), 
+(0x4e8ee645L), (0x4a4ffbf2L), (0x470cdd2bL), (0x43cdc09cL), 
+(0x7b827d21L), (0x7f436096L), (0x7200464fL), (0x76c15bf8L), 
+(0x68860bfdL), (0x6c47164aL), (0x61043093L), (0x65c52d24L), 
+(0x119b4be9L), (0x155a565eL), (0x18197087L), (0x1cd86d30L), 
+(0x029f3d35L), (0x065e2082L), (0x0b1d065bL), (0x0fdc1becL), 
+(0x3793a651L), (0x3352bbe6L), (0x3e119d3fL), (0x3ad08088L), 
+(0x2497d08dL), (0x2056cd3aL), (0x2d15ebe3L), (0x29d4f654L), 
+(0xc5a92679L), (0xc1683bceL), (0xcc2b1d17L), (0xc8ea00a0L), 
+(0xd6ad50a5L), (0xd26c4d12L), (0xdf2f6bcbL), (0xdbee767cL), 
+(0xe3a1cbc1L), (0xe760d676L), (0xea23f0afL), (0xeee2ed18L), 
+(0xf0a5bd1dL), (0xf464a0aaL), (0xf9278673L), (0xfde69bc4L), 
+(0x89b8fd09L), (0x8d79e0beL), (0x803ac667L), (0x84fbdbd0L), 
+(0x9abc8bd5L), (0x9e7d9662L), (0x933eb0bbL), (0x97ffad0cL), 
+(0xafb010b1L), (0xab710d06L), (0xa6322bdfL), (0xa2f33668L), 
+(0xbcb4666dL), (0xb8757bdaL), (0xb5365d03L), (0xb1f740b4L)
+}, {
+(0x00000000L), (0xd219c1dcL), (0xa0f29e0fL), (0x72eb5fd3L), 
+(0x452421a9L), (0x973de075L), (0xe5d6bfa6L), (0x37cf7e7aL), 
+(0x8a484352L), (0x5851828eL), (0x2abadd5dL), (0xf8a31c81L), 
+(0xcf6c62fbL), (0x1d75a327L), (0x6f9efcf4L), (0xbd873d28L), 
+(0x10519b13L), (0xc2485acfL), (0xb0a3051cL), (0x62bac4c0L), 
+(0x5575babaL), (0x876c7b66L), (0xf58724b5L), (0x279ee569L), 
+(0x9a19d841L), (0x4800199dL), (0x3aeb464eL), (0xe8f28792L), 
+(0xdf3df9e8L), (0x0d243834L), (0x7fcf67e7L), (0xadd6a63bL), 
+(0x20a33626L), (0xf2baf7faL), (0x8051a829L), (0x524869f5L), 
+(0x6587178fL), (0xb79ed653L), (0xc5758980L), (0x176c485cL), 
+(0xaaeb7574L), (0x78f2b4a8L), (0x0a19eb7bL), (0xd8002aa7L), 
+(0xefcf54ddL), (0x3dd69501L), (0x4f3dcad2L), (0x9d240b0eL), 
+(0x30f2ad35L), (0xe2eb6ce9L), (0x9000333aL), (0x4219f2e6L), 
+(0x75d68c9cL), (0xa7cf4d40L), (0xd5241293L), (0x073dd34fL), 
+(0xbabaee67L), (0x68a32fbbL), (0x1a487068L), (0xc851b1b4L), 
+(0xff9ecfceL), (0x2d870e12L), (0x5f6c51c1L), (0x8d75901dL), 
+(0x41466c4cL), (0x935fad90L), (0xe1b4f243L), (0x33ad339fL), 
+(0x04624de5L), (0xd67b8c39L), (0xa490d3eaL), (0x76891236L), 
+(0xcb0e2f1eL), (0x1917eec2L), (0x6bfcb111L), (0xb9e570cdL), 
+(0x8e2a0eb7L), (0x5c33cf6bL), (0x2ed890b8L), (0xfcc15164L), 
+(0x5117f75fL), (0x830e3683L), (0xf1e56950L), (0x23fca88cL), 
+(0x1433d6f6L), (0xc62a172aL), (0xb4c148f9L), (0x66d88925L), 
+(0xdb5fb40dL), (0x094675d1L), (0x7bad2a02L), (0xa9b4ebdeL), 
+(0x9e7b95a4L), (0x4c625478L), (0x3e890babL), (0xec90ca77L), 
+(0x61e55a6aL), (0xb3fc9bb6L), (0xc117c465L), (0x130e05b9L), 
+(0x24c17bc3L), (0xf6d8ba1fL), (0x8433e5ccL), (0x562a2410L), 
+(0xebad1938L), (0x39b4d8e4L), (0x4b5f8737L), (0x994646ebL), 
+(0xae893891L), (0x7c90f94dL), (0x0e7ba69eL), (0xdc626742L), 
+(0x71b4c179L), (0xa3ad00a5L), (0xd1465f76L), (0x035f9eaaL), 
+(0x3490e0d0L), (0xe689210cL), (0x94627edfL), (0x467bbf03L), 
+(0xfbfc822bL), (0x29e543f7L), (0x5b0e1c24L), (0x8917ddf8L), 
+(0xbed8a382L), (0x6cc1625eL), (0x1e2a3d8dL), (0xcc33fc51L), 
+(0x828cd898L), (0x50951944L), (0x227e4697L), (0xf067874bL), 
+(0xc7a8f931L), (0x15b138edL), (0x675a673eL), (0xb543a6e2L), 
+(0x08c49bcaL), (0xdadd5a16L), (0xa83605c5L), (0x7a2fc419L), 
+(0x4de0ba63L), (0x9ff97bbfL), (0xed12246cL), (0x3f0be5b0L), 
+(0x92dd438bL), (0x40c48257L), (0x322fdd84L), (0xe0361c58L), 
+(0xd7f96222L), (0x05e0a3feL), (0x770bfc2dL), (0xa5123df1L), 
+(0x189500d9L), (0xca8cc105L), (0xb8679ed6L), (0x6a7e5f0aL), 
+(0x5db12170L), (0x8fa8e0acL), (0xfd43bf7fL), (0x2f5a7ea3L), 
+(0xa22feebeL), (0x70362f62L), (0x02dd70b1L), (0xd0c4b16dL), 
+(0xe70bcf17L), (0x35120ecbL), (0x47f95118L), (0x95e090c4L), 
+(0x2867adecL), (0xfa7e6c30L), (0x889533e3L), (0x5a8cf23fL), 
+(0x6d438c45L), (0xbf5a4d99L), (0xcdb1124aL), (0x1fa8d396L), 
+(0xb27e75adL), (0x6067b471L), (0x128ceba2L), (0xc0952a7eL), 
+(0xf75a5404L), (0x254395d8L), (0x57a8ca0bL), (0x85b10bd7L), 
+(0x383636ffL), (0xea2ff723L), (0x98c4a8f0L), (0x4add692cL), 
+(0x7d121756L), (0xaf0bd68aL), (0xdde08959L), (0x0ff94885L), 
+(0xc3cab4d4L), (0x11d37508L), (0x63382adbL), (0xb121eb07L), 
+(0x86ee957dL), (0x54f754a1L), (0x261c0b72L), (0xf405caaeL), 
+(0x4982f786L), (0x9b9b365aL), (0xe9706989L), (0x3b69a855L), 
+(0x0ca6d62fL), (0xdebf17f3L), (0xac544820L), (0x7e4d89fcL), 
+(0xd39b2fc7L), (0x0182ee1bL), (0x7369b1c8L), (0xa1707014L), 
+(0x96bf0e6eL), (0x44a6cfb2L), (0x364d9061L), (0xe45451bdL), 
+(0x59d36c95L), (0x8bcaad49L), (0xf921f29aL), (0x2b383346L), 
+(0x1cf74d3cL), (0xceee8ce0L), (0xbc05d333L), (0x6e1c12efL), 
+(0xe36982f2L), (0x3170432eL), (0x439b1cfdL), (0x9182dd21L), 
+(0xa64da35bL), (0x74546287L), (0x06bf3d54L), (0xd4a6fc88L), 
+(0x6921c1a0L), (0xbb38007cL), (0xc9d35fafL), (0x1bca9e73L), 
+(0x2c05e009L), (0xfe1c21d5L), (0x8cf77e06L), (0x5eeebfdaL), 
+(0xf33819e1L), (0x2121d83dL), (0x53ca87eeL), (0x81d34632L), 
+(0xb61c3848L), (0x6405f994L), (0x16eea647L), (0xc4f7679bL), 
+(0x79705ab3L), (0xab699b6fL), (0xd982c4bcL), (0x0b9b0560L), 
+(0x3c547b1aL), (0xee4dbac6L), (0x9ca6e515L), (0x4ebf24c9L)
+}, {
+(0x00000000L), (0x01d8ac87L), (0x03b1590eL), (0x0269f589L), 
+(0x0762b21cL), (0x06ba1e9bL), (0x04d3eb12L), (0x050b4795L), 
+(0x0ec56438L), (0x0f1dc8bfL), (0x0d743d36L), (0x0cac91b1L), 
+(0x09a7d624L), (0x087f7aa3L), (0x0a168f2aL), (0x0bce23adL), 
+(0x1d8ac870L), (0x1c5264f7L), (0x1e3b917eL), (0x1fe33df9L), 
+(0x1ae87a6cL), (0x1b30d6ebL), (0x19592362L), (0x18818fe5L), 
+(0x134fac48L), (0x129700cfL), (0x10fef546L), (0x112659c1L), 
+(0x142d1e54L), (0x15f5b2d3L), (0x179c475aL), (0x1644ebddL), 
+(0x3b1590e0L), (0x3acd3c67L), (0x38a4c9eeL), (0x397c6569L), 
+(0x3c7722fcL), (0x3daf8e7bL), (0x3fc67bf2L), (0x3e1ed775L), 
+(0x35d0f4d8L), (0x3408585fL), (0x3661add6L), (0x37b90151L), 
+(0x32b246c4L), (0x336aea43L), (0x31031fcaL), (0x30dbb34dL), 
+(0x269f5890L), (0x2747f417L), (0x252e019eL), (0x24f6ad19L), 
+(0x21fdea8cL), (0x2025460bL), (0x224cb382L), (0x23941f05L), 
+(0x285a3ca8L), (0x2982902fL), (0x2beb65a6L), (0x2a33c921L), 
+(0x2f388eb4L), (0x2ee02233L), (0x2c89d7baL), (0x2d517b3dL), 
+(0x762b21c0L), (0x77f38d47L), (0x759a78ceL), (0x7442d449L), 
+(0x714993dcL), (0x70913f5bL), (0x72f8cad2L), (0x73206655L), 
+(0x78ee45f8L), (0x7936e97fL), (0x7b5f1cf6L), (0x7a87b071L), 
+(0x7f8cf7e4L), (0x7e545b63L), (0x7c3daeeaL), (0x7de5026dL), 
+(0x6ba1e9b0L), (0x6a794537L), (0x6810b0beL), (0x69c81c39L), 
+(0x6cc35bacL), (0x6d1bf72bL), (0x6f7202a2L), (0x6eaaae25L), 
+(0x65648d88L), (0x64bc210fL), (0x66d5d486L), (0x670d7801L), 
+(0x62063f94L), (0x63de9313L), (0x61b7669aL), (0x606fca1dL), 
+(0x4d3eb120L), (0x4ce61da7L), (0x4e8fe82eL), (0x4f5744a9L), 
+(0x4a5c033cL), (0x4b84afbbL), (0x49ed5a32L), (0x4835f6b5L), 
+(0x43fbd518L), (0x4223799fL), (0x404a8c16L), (0x41922091L), 
+(0x44996704L), (0x4541cb83L), (0x47283e0aL), (0x46f0928dL), 
+(0x50b47950L), (0x516cd5d7L), (0x5305205eL), (0x52dd8cd9L), 
+(0x57d6cb4cL), (0x560e67cbL), (0x54679242L), (0x55bf3ec5L), 
+(0x5e711d68L), (0x5fa9b1efL), (0x5dc04466L), (0x5c18e8e1L), 
+(0x5913af74L), (0x58cb03f3L), (0x5aa2f67aL), (0x5b7a5afdL), 
+(0xec564380L), (0xed8eef07L), (0xefe71a8eL), (0xee3fb609L), 
+(0xeb34f19cL), (0xeaec5d1bL), (0xe885a892L), (0xe95d0415L), 
+(0xe29327b8L), (0xe34b8b3fL), (0xe1227eb6L), (0xe0fad231L), 
+(0xe5f195a4L), (0xe4293923L), (0xe640ccaaL), (0xe798602dL), 
+(0xf1dc8bf0L), (0xf0042777L), (0xf26dd2feL), (0xf3b57e79L), 
+(0xf6be39ecL), (0xf766956bL), (0xf50f60e2L), (0xf4d7cc65L), 
+(0xff19efc8L), (0xfec1434fL), (0xfca8b6c6L), (0xfd701a41L), 
+(0xf87b5dd4L), (0xf9a3f153L), (0xfbca04daL), (0xfa12a85dL), 
+(0xd743d360L), (0xd69b7fe7L), (0xd4f28a6eL), (0xd52a26e9L), 
+(0xd021617cL), (0xd1f9cdfbL), (0xd3903872L), (0xd24894f5L), 
+(0xd986b758L), (0xd85e1bdfL), (0xda37ee56L), (0xdbef42d1L), 
+(0xdee40544L), (0xdf3ca9c3L), (0xdd555c4aL), (0xdc8df0cdL), 
+(0xcac91b10L), (0xcb11b797L), (0xc978421eL), (0xc8a0ee99L), 
+(0xcdaba90cL), (0xcc73058bL), (0xce1af002L), (0xcfc25c85L), 
+(0xc40c7f28L), (0xc5d4d3afL), (0xc7bd2626L), (0xc6658aa1L), 
+(0xc36ecd34L), (0xc2b661b3L), (0xc0df943aL), (0xc10738bdL), 
+(0x9a7d6240L), (0x9ba5cec7L), (0x99cc3b4eL), (0x981497c9L), 
+(0x9d1fd05cL), (0x9cc77cdbL), (0x9eae8952L), (0x9f7625d5L), 
+(0x94b80678L), (0x9560aaffL), (0x97095f76L), (0x96d1f3f1L), 
+(0x93dab464L), (0x920218e3L), (0x906bed6aL), (0x91b341edL), 
+(0x87f7aa30L), (0x862f06b7L), (0x8446f33eL), (0x859e5fb9L), 
+(0x8095182cL), (0x814db4abL), (0x83244122L), (0x82fceda5L), 
+(0x8932ce08L), (0x88ea628fL), (0x8a839706L), (0x8b5b3b81L), 
+(0x8e507c14L), (0x8f88d093L), (0x8de1251aL), (0x8c39899dL), 
+(0xa168f2a0L), (0xa0b05e27L), (0xa2d9abaeL), (0xa3010729L), 
+(0xa60a40bcL), (0xa7d2ec3bL), (0xa5bb19b2L), (0xa463b535L), 
+(0xafad9698L), (0xae753a1fL), (0xac1ccf96L), (0xadc46311L), 
+(0xa8cf2484L), (0xa9178803L), (0xab7e7d8aL), (0xaaa6d10dL), 
+(0xbce23ad0L), (0xbd3a9657L), (0xbf5363deL), (0xbe8bcf59L), 
+(0xbb8088ccL), (0xba58244bL), (0xb831d1c2L), (0xb9e97d45L), 
+(0xb2275ee8L), (0xb3fff26fL), (0xb19607e6L), (0xb04eab61L), 
+(0xb545ecf4L), (0xb49d4073L), (0xb6f4b5faL), (0xb72c197dL)
+}, {
+(0x00000000L), (0xdc6d9ab7L), (0xbc1a28d9L), (0x6077b26eL), 
+(0x7cf54c05L), (0xa098d6b2L), (0xc0ef64dcL), (0x1c82fe6bL), 
+(0xf9ea980aL), (0x258702bdL), (0x45f0b0d3L), (0x999d2a64L), 
+(0x851fd40fL), (0x59724eb8L), (0x3905fcd6L), (0xe5686661L), 
+(0xf7142da3L), (0x2b79b714L), (0x4b0e057aL), (0x97639fcdL), 
+(0x8be161a6L), (0x578cfb11L), (0x37fb497fL), (0xeb96d3c8L), 
+(0x0efeb5a9L), (0xd2932f1eL), (0xb2e49d70L), (0x6e8907c7L), 
+(0x720bf9acL), (0xae66631bL), (0xce11d175L), (0x127c4bc2L), 
+(0xeae946f1L), (0x3684dc46L), (0x56f36e28L), (0x8a9ef49fL), 
+(0x961c0af4L), (0x4a719043L), (0x2a06222dL), (0xf66bb89aL), 
+(0x1303defbL), (0xcf6e444cL), (0xaf19f622L), (0x73746c95L), 
+(0x6ff692feL), (0xb39b0849L), (0xd3ecba27L), (0x0f812090L), 
+(0x1dfd6b52L), (0xc190f1e5L), (0xa1e7438bL), (0x7d8ad93cL), 
+(0x61082757L), (0xbd65bde0L), (0xdd120f8eL), (0x017f9539L), 
+(0xe417f358L), (0x387a69efL), (0x580ddb81L), (0x84604136L), 
+(0x98e2bf5dL), (0x448f25eaL), (0x24f89784L), (0xf8950d33L), 
+(0xd1139055L), (0x0d7e0ae2L), (0x6d09b88cL), (0xb164223bL), 
+(0xade6dc50L), (0x718b46e7L), (0x11fcf489L), (0xcd916e3eL), 
+(0x28f9085fL), (0xf49492e8L), (0x94e32086L), (0x488eba31L), 
+(0x540c445aL), (0x8861deedL), (0xe8166c83L), (0x347bf634L), 
+(0x2607bdf6L), (0xfa6a2741L), (0x9a1d952fL), (0x46700f98L), 
+(0x5af2f1f3L), (0x869f6b44L), (0xe6e8d92aL), (0x3a85439dL), 
+(0xdfed25fcL), (0x0380bf4bL), (0x63f70d25L), (0xbf9a9792L), 
+(0xa31869f9L), (0x7f75f34eL), (0x1f024120L), (0xc36fdb97L), 
+(0x3bfad6a4L), (0xe7974c13L), (0x87e0fe7dL), (0x5b8d64caL), 
+(0x470f9aa1L), (0x9b620016L), (0xfb15b278L), (0x277828cfL), 
+(0xc2104eaeL), (0x1e7dd419L), (0x7e0a6677L), (0xa267fcc0L), 
+(0xbee502abL), (0x6288981cL), (0x02ff2a72L), (0xde92b0c5L), 
+(0xcceefb07L), (0x108361b0L), (0x70f4d3deL), (0xac994969L), 
+(0xb01bb702L), (0x6c762db5L), (0x0c019fdbL), (0xd06c056cL), 
+(0x3504630dL), (0xe969f9baL), (0x891e4bd4L), (0x5573d163L), 
+(0x49f12f08L), (0x959cb5bfL), (0xf5eb07d1L), (0x29869d66L), 
+(0xa6e63d1dL), (0x7a8ba7aaL), (0x1afc15c4L), (0xc6918f73L), 
+(0xda137118L), (0x067eebafL), (0x660959c1L), (0xba64c376L), 
+(0x5f0ca517L), (0x83613fa0L), (0xe3168dceL), (0x3f7b1779L), 
+(0x23f9e912L), (0xff9473a5L), (0x9fe3c1cbL), (0x438e5b7cL), 
+(0x51f210beL), (0x8d9f8a09L), (0xede83867L), (0x3185a2d0L), 
+(0x2d075cbbL), (0xf16ac60cL), (0x911d7462L), (0x4d70eed5L), 
+(0xa81888b4L), (0x74751203L), (0x1402a06dL), (0xc86f3adaL), 
+(0xd4edc4b1L), (0x08805e06L), (0x68f7ec68L), (0xb49a76dfL), 
+(0x4c0f7becL), (0x9062e15bL), (0xf0155335L), (0x2c78c982L), 
+(0x30fa37e9L), (0xec97ad5eL), (0x8ce01f30L), (0x508d8587L), 
+(0xb5e5e3e6L), (0x69887951L), (0x09ffcb3fL), (0xd5925188L), 
+(0xc910afe3L), (0x157d3554L), (0x750a873aL), (0xa9671d8dL), 
+(0xbb1b564fL), (0x6776ccf8L), (0x07017e96L), (0xdb6ce421L), 
+(0xc7ee1a4aL), (0x1b8380fdL), (0x7bf43293L), (0xa799a824L), 
+(0x42f1ce45L), (0x9e9c54f2L), (0xfeebe69cL), (0x22867c2bL), 
+(0x3e048240L), (0xe26918f7L), (0x821eaa99L), (0x5e73302eL), 
+(0x77f5ad48L), (0xab9837ffL), (0xcbef8591L), (0x17821f26L), 
+(0x0b00e14dL), (0xd76d7bfaL), (0xb71ac994L), (0x6b775323L), 
+(0x8e1f3542L), (0x5272aff5L), (0x32051d9bL), (0xee68872cL), 
+(0xf2ea7947L), (0x2e87e3f0L), (0x4ef0519eL), (0x929dcb29L), 
+(0x80e180ebL), (0x5c8c1a5cL), (0x3cfba832L), (0xe0963285L), 
+(0xfc14cceeL), (0x20795659L), (0x400ee437L), (0x9c637e80L), 
+(0x790b18e1L), (0xa5668256L), (0xc5113038L), (0x197caa8fL), 
+(0x05fe54e4L), (0xd993ce53L), (0xb9e47c3dL), (0x6589e68aL), 
+(0x9d1cebb9L), (0x4171710eL), (0x2106c360L), (0xfd6b59d7L), 
+(0xe1e9a7bcL), (0x3d843d0bL), (0x5df38f65L), (0x819e15d2L), 
+(0x64f673b3L), (0xb89be904L), (0xd8ec5b6aL), (0x0481c1ddL), 
+(0x18033fb6L), (0xc46ea501L), (0xa419176fL), (0x78748dd8L), 
+(0x6a08c61aL), (0xb6655cadL), (0xd612eec3L), (0x0a7f7474L), 
+(0x16fd8a1fL), (0xca9010a8L), (0xaae7a2c6L), (0x768a3871L), 
+(0x93e25e10L), (0x4f8fc4a7L), (0x2ff876c9L), (0xf395ec7eL), 
+(0xef171215L), (0x337a88a2L), (0x530d3accL), (0x8f60a07bL)
+}, {
+(0x00000000L), (0x490d678dL), (0x921acf1aL), (0xdb17a897L), 
+(0x20f48383L), (0x69f9e40eL), (0xb2ee4c99L), (0xfbe32b14L), 
+(0x41e90706L), (0x08e4608bL), (0xd3f3c81cL), (0x9afeaf91L), 
+(0x611d8485L), (0x2810e308L), (0xf3074b9fL), (0xba0a2c12L), 
+(0x83d20e0cL), (0xcadf6981L), (0x11c8c116L), (0x58c5a69bL), 
+(0xa3268d8fL), (0xea2bea02L), (0x313c4295L), (0x78312518L), 
+(0xc23b090aL), (0x8b366e87L), (0x5021c610L), (0x192ca19dL), 
+(0xe2cf8a89L), (0xabc2ed04L), (0x70d54593L), (0x39d8221eL), 
+(0x036501afL), (0x4a686622L), (0x917fceb5L), (0xd872a938L), 
+(0x2391822cL), (0x6a9ce5a1L), (0xb18b4d36L), (0xf8862abbL), 
+(0x428c06a9L), (0x0b816124L), (0xd096c9b3L), (0x999bae3eL), 
+(0x6278852aL), (0x2b75e2a7L), (0xf0624a30L), (0xb96f2dbdL), 
+(0x80b70fa3L), (0xc9ba682eL), (0x12adc0b9L), (0x5ba0a734L), 
+(0xa0438c20L), (0xe94eebadL), (0x3259433aL), (0x7b5424b7L), 
+(0xc15e08a5L), (0x88536f28L), (0x5344c7bfL), (0x1a49a032L), 
+(0xe1aa8b26L), (0xa8a7ecabL), (0x73b0443cL), (0x3abd23b1L), 
+(0x06ca035eL), (0x4fc764d3L), (0x94d0cc44L), (0xddddabc9L), 
+(0x263e80ddL), (0x6f33e750L), (0xb4244fc7L), (0xfd29284aL), 
+(0x47230458L), (0x0e2e63d5L), (0xd539cb42L), (0x9c34accfL), 
+(0x67d787dbL), (0x2edae056L), (0xf5cd48c1L), (0xbcc02f4cL), 
+(0x85180d52L), (0xcc156adfL), (0x1702c248L), (0x5e0fa5c5L), 
+(0xa5ec8ed1L), (0xece1e95cL), (0x37f641cbL), (0x7efb2646L), 
+(0xc4f10a54L), (0x8dfc6dd9L), (0x56ebc54eL), (0x1fe6a2c3L), 
+(0xe40589d7L), (0xad08ee5aL), (0x761f46cdL), (0x3f122140L), 
+(0x05af02f1L), (0x4ca2657cL), (0x97b5cdebL), (0xdeb8aa66L), 
+(0x255b8172L), (0x6c56e6ffL), (0xb7414e68L), (0xfe4c29e5L), 
+(0x444605f7L), (0x0d4b627aL), (0xd65ccaedL), (0x9f51ad60L), 
+(0x64b28674L), (0x2dbfe1f9L), (0xf6a8496eL), (0xbfa52ee3L), 
+(0x867d0cfdL), (0xcf706b70L), (0x1467c3e7L), (0x5d6aa46aL), 
+(0xa6898f7eL), (0xef84e8f3L), (0x34934064L), (0x7d9e27e9L), 
+(0xc7940bfbL), (0x8e996c76L), (0x558ec4e1L), (0x1c83a36cL), 
+(0xe7608878L), (0xae6deff5L), (0x757a4762L), (0x3c7720efL), 
+(0x0d9406bcL), (0x44996131L), (0x9f8ec9a6L), (0xd683ae2bL), 
+(0x2d60853fL), (0x646de2b2L), (0xbf7a4a25L), (0xf6772da8L), 
+(0x4c7d01baL), (0x05706637L), (0xde67cea0L), (0x976aa92dL), 
+(0x6c898239L), (0x2584e5b4L), (0xfe934d23L), (0xb79e2aaeL), 
+(0x8e4608b0L), (0xc74b6f3dL), (0x1c5cc7aaL), (0x5551a027L), 
+(0xaeb28b33L), (0xe7bfecbeL), (0x3ca84429L), (0x75a523a4L), 
+(0xcfaf0fb6L), (0x86a2683bL), (0x5db5c0acL), (0x14b8a721L), 
+(0xef5b8c35L), (0xa656ebb8L), (0x7d41432fL), (0x344c24a2L), 
+(0x0ef10713L), (0x47fc609eL), (0x9cebc809L), (0xd5e6af84L), 
+(0x2e058490L), (0x6708e31dL), (0xbc1f4b8aL), (0xf5122c07L), 
+(0x4f180015L), (0x06156798L), (0xdd02cf0fL), (0x940fa882L), 
+(0x6fec8396L), (0x26e1e41bL), (0xfdf64c8cL), (0xb4fb2b01L), 
+(0x8d23091fL), (0xc42e6e92L), (0x1f39c605L), (0x5634a188L), 
+(0xadd78a9cL), (0xe4daed11L), (0x3fcd4586L), (0x76c0220bL), 
+(0xccca0e19L), (0x85c76994L), (0x5ed0c103L), (0x17dda68eL), 
+(0xec3e8d9aL), (0xa533ea17L), (0x7e244280L), (0x3729250dL), 
+(0x0b5e05e2L), (0x4253626fL), (0x9944caf8L), (0xd049ad75L), 
+(0x2baa8661L), (0x62a7e1ecL), (0xb9b0497bL), (0xf0bd2ef6L), 
+(0x4ab702e4L), (0x03ba6569L), (0xd8adcdfeL), (0x91a0aa73L), 
+(0x6a438167L), (0x234ee6eaL), (0xf8594e7dL), (0xb15429f0L), 
+(0x888c0beeL), (0xc1816c63L), (0x1a96c4f4L), (0x539ba379L), 
+(0xa878886dL), (0xe175efe0L), (0x3a624777L), (0x736f20faL), 
+(0xc9650ce8L), (0x80686b65L), (0x5b7fc3f2L), (0x1272a47fL), 
+(0xe9918f6bL), (0xa09ce8e6L), (0x7b8b4071L), (0x328627fcL), 
+(0x083b044dL), (0x413663c0L), (0x9a21cb57L), (0xd32cacdaL), 
+(0x28cf87ceL), (0x61c2e043L), (0xbad548d4L), (0xf3d82f59L), 
+(0x49d2034bL), (0x00df64c6L), (0xdbc8cc51L), (0x92c5abdcL), 
+(0x692680c8L), (0x202be745L), (0xfb3c4fd2L), (0xb231285fL), 
+(0x8be90a41L), (0xc2e46dccL), (0x19f3c55bL), (0x50fea2d6L), 
+(0xab1d89c2L), (0xe210ee4fL), (0x390746d8L), (0x700a2155L), 
+(0xca000d47L), (0x830d6acaL), (0x581ac25dL), (0x1117a5d0L), 
+(0xeaf48ec4L), (0xa3f9e949L), (0x78ee41deL), (0x31e32653L)
+}, {
+(0x00000000L), (0x1b280d78L), (0x36501af0L), (0x2d781788L), 
+(0x6ca035e0L), (0x77883898L), (0x5af02f10L), (0x41d82268L), 
+(0xd9406bc0L), (0xc26866b8L), (0xef107130L), (0xf4387c48L), 
+(0xb5e05e20L), (0xaec85358L), (0x83b044d0L), (0x989849a8L), 
+(0xb641ca37L), (0xad69c74fL), (0x8011d0c7L), (0x9b39ddbfL), 
+(0xdae1ffd7L), (0xc1c9f2afL), (0xecb1e527L), (0xf799e85fL), 
+(0x6f01a1f7L), (0x7429ac8fL), (0x5951bb07L), (0x4279b67fL), 
+(0x03a19417L), (0x1889996fL), (0x35f18ee7L), (0x2ed9839fL), 
+(0x684289d9L), (0x736a84a1L), (0x5e129329L), (0x453a9e51L), 
+(0x04e2bc39L), (0x1fcab141L), (0x32b2a6c9L), (0x299aabb1L), 
+(0xb102e219L), (0xaa2aef61L), (0x8752f8e9L), (0x9c7af591L), 
+(0xdda2d7f9L), (0xc68ada81L), (0xebf2cd09L), (0xf0dac071L), 
+(0xde0343eeL), (0xc52b4e96L), (0xe853591eL), (0xf37b5466L), 
+(0xb2a3760eL), (0xa98b7b76L), (0x84f36cfeL), (0x9fdb6186L), 
+(0x0743282eL), (0x1c6b2556L), (0x311332deL), (0x2a3b3fa6L), 
+(0x6be31dceL), (0x70cb10b6L), (0x5db3073eL), (0x469b0a46L), 
+(0xd08513b2L), (0xcbad1ecaL), (0xe6d50942L), (0xfdfd043aL), 
+(0xbc252652L), (0xa70d2b2aL), (0x8a753ca2L), (0x915d31daL), 
+(0x09c57872L), (0x12ed750aL), (0x3f956282L), (0x24bd6ffaL), 
+(0x65654d92L), (0x7e4d40eaL), (0x53355762L), (0x481d5a1aL), 
+(0x66c4d985L), (0x7decd4fdL), (0x5094c375L), (0x4bbcce0dL), 
+(0x0a64ec65L), (0x114ce11dL), (0x3c34f695L), (0x271cfbedL), 
+(0xbf84b245L), (0xa4acbf3dL), (0x89d4a8b5L), (0x92fca5cdL), 
+(0xd32487a5L), (0xc80c8addL), (0xe5749d55L), (0xfe5c902dL), 
+(0xb8c79a6bL), (0xa3ef9713L), (0x8e97809bL), (0x95bf8de3L), 
+(0xd467af8bL), (0xcf4fa2f3L), (0xe237b57bL), (0xf91fb803L), 
+(0x6187f1abL), (0x7aaffcd3L), (0x57d7eb5bL), (0x4cffe623L), 
+(0x0d27c44bL), (0x160fc933L), (0x3b77debbL), (0x205fd3c3L), 
+(0x0e86505cL), (0x15ae5d24L), (0x38d64aacL), (0x23fe47d4L), 
+(0x622665bcL), (0x790e68c4L), (0x54767f4cL), (0x4f5e7234L), 
+(0xd7c63b9cL), (0xccee36e4L), (0xe196216cL), (0xfabe2c14L), 
+(0xbb660e7cL), (0xa04e0304L), (0x8d36148cL), (0x961e19f4L), 
+(0xa5cb3ad3L), (0xbee337abL), (0x939b2023L), (0x88b32d5bL), 
+(0xc96b0f33L), (0xd243024bL), (0xff3b15c3L), (0xe41318bbL), 
+(0x7c8b5113L), (0x67a35c6bL), (0x4adb4be3L), (0x51f3469bL), 
+(0x102b64f3L), (0x0b03698bL), (0x267b7e03L), (0x3d53737bL), 
+(0x138af0e4L), (0x08a2fd9cL), (0x25daea14L), (0x3ef2e76cL), 
+(0x7f2ac504L), (0x6402c87cL), (0x497adff4L), (0x5252d28cL), 
+(0xcaca9b24L), (0xd1e2965cL), (0xfc9a81d4L), (0xe7b28cacL), 
+(0xa66aaec4L), (0xbd42a3bcL), (0x903ab434L), (0x8b12b94cL), 
+(0xcd89b30aL), (0xd6a1be72L), (0xfbd9a9faL), (0xe0f1a482L), 
+(0xa12986eaL), (0xba018b92L), (0x97799c1aL), (0x8c519162L), 
+(0x14c9d8caL), (0x0fe1d5b2L), (0x2299c23aL), (0x39b1cf42L), 
+(0x7869ed2aL), (0x6341e052L), (0x4e39f7daL), (0x5511faa2L), 
+(0x7bc8793dL), (0x60e07445L), (0x4d9863cdL), (0x56b06eb5L), 
+(0x17684cddL), (0x0c4041a5L), (0x2138562dL), (0x3a105b55L), 
+(0xa28812fdL), (0xb9a01f85L), (0x94d8080dL), (0x8ff00575L), 
+(0xce28271dL), (0xd5002a65L), (0xf8783dedL), (0xe3503095L), 
+(0x754e2961L), (0x6e662419L), (0x431e3391L), (0x58363ee9L), 
+(0x19ee1c81L), (0x02c611f9L), (0x2fbe0671L), (0x34960b09L), 
+(0xac0e42a1L), (0xb7264fd9L), (0x9a5e5851L), (0x81765529L), 
+(0xc0ae7741L), (0xdb867a39L), (0xf6fe6db1L), (0xedd660c9L), 
+(0xc30fe356L), (0xd827ee2eL), (0xf55ff9a6L), (0xee77f4deL), 
+(0xafafd6b6L), (0xb487dbceL), (0x99ffcc46L), (0x82d7c13eL), 
+(0x1a4f8896L), (0x016785eeL), (0x2c1f9266L), (0x37379f1eL), 
+(0x76efbd76L), (0x6dc7b00eL), (0x40bfa786L), (0x5b97aafeL), 
+(0x1d0ca0b8L), (0x0624adc0L), (0x2b5cba48L), (0x3074b730L), 
+(0x71ac9558L), (0x6a849820L), (0x47fc8fa8L), (0x5cd482d0L), 
+(0xc44ccb78L), (0xdf64c600L), (0xf21cd188L), (0xe934dcf0L), 
+(0xa8ecfe98L), (0xb3c4f3e0L), (0x9ebce468L), (0x8594e910L), 
+(0xab4d6a8fL), (0xb06567f7L), (0x9d1d707fL), (0x86357d07L), 
+(0xc7ed5f6fL), (0xdcc55217L), (0xf1bd459fL), (0xea9548e7L), 
+(0x720d014fL), (0x69250c37L), (0x445d1bbfL), (0x5f7516c7L), 
+(0x1ead34afL), (0x058539d7L), (0x28fd2e5fL), (0x33d52327L)
+}, {
+(0x00000000L), (0x4f576811L), (0x9eaed022L), (0xd1f9b833L), 
+(0x399cbdf3L), (0x76cbd5e2L), (0xa7326dd1L), (0xe86505c0L), 
+(0x73397be6L), (0x3c6e13f7L), (0xed97abc4L), (0xa2c0c3d5L), 
+(0x4aa5c615L), (0x05f2ae04L), (0xd40b1637L), (0x9b5c7e26L), 
+(0xe672f7ccL), (0xa9259fddL), (0x78dc27eeL), (0x378b4fffL), 
+(0xdfee4a3fL), (0x90b9222eL), (0x41409a1dL), (0x0e17f20cL), 
+(0x954b8c2aL), (0xda1ce43bL), (0x0be55c08L), (0x44b23419L), 
+(0xacd731d9L), (0xe38059c8L), (0x3279e1fbL), (0x7d2e89eaL), 
+(0xc824f22fL), (0x87739a3eL), (0x568a220dL), (0x19dd4a1cL), 
+(0xf1b84fdcL), (0xbeef27cdL), (0x6f169ffeL), (0x2041f7efL), 
+(0xbb1d89c9L), (0xf44ae1d8L), (0x25b359ebL), (0x6ae431faL), 
+(0x8281343aL), (0xcdd65c2bL), (0x1c2fe418L), (0x53788c09L), 
+(0x2e5605e3L), (0x61016df2L), (0xb0f8d5c1L), (0xffafbdd0L), 
+(0x17cab810L), (0x589dd001L), (0x89646832L), (0xc6330023L), 
+(0x5d6f7e05L), (0x12381614L), (0xc3c1ae27L), (0x8c96c636L), 
+(0x64f3c3f6L), (0x2ba4abe7L), (0xfa5d13d4L), (0xb50a7bc5L), 
+(0x9488f9e9L), (0xdbdf91f8L), (0x0a2629cbL), (0x457141daL), 
+(0xad14441aL), (0xe2432c0bL), (0x33ba9438L), (0x7cedfc29L), 
+(0xe7b1820fL), (0xa8e6ea1eL), (0x791f522dL), (0x36483a3cL), 
+(0xde2d3ffcL), (0x917a57edL), (0x4083efdeL), (0x0fd487cfL), 
+(0x72fa0e25L), (0x3dad6634L), (0xec54de07L), (0xa303b616L), 
+(0x4b66b3d6L), (0x0431dbc7L), (0xd5c863f4L), (0x9a9f0be5L), 
+(0x01c375c3L), (0x4e941dd2L), (0x9f6da5e1L), (0xd03acdf0L), 
+(0x385fc830L), (0x7708a021L), (0xa6f11812L), (0xe9a67003L), 
+(0x5cac0bc6L), (0x13fb63d7L), (0xc202dbe4L), (0x8d55b3f5L), 
+(0x6530b635L), (0x2a67de24L), (0xfb9e6617L), (0xb4c90e06L), 
+(0x2f957020L), (0x60c21831L), (0xb13ba002L), (0xfe6cc813L), 
+(0x1609cdd3L), (0x595ea5c2L), (0x88a71df1L), (0xc7f075e0L), 
+(0xbadefc0aL), (0xf589941bL), (0x24702c28L), (0x6b274439L), 
+(0x834241f9L), (0xcc1529e8L), (0x1dec91dbL), (0x52bbf9caL), 
+(0xc9e787ecL), (0x86b0effdL), (0x574957ceL), (0x181e3fdfL), 
+(0xf07b3a1fL), (0xbf2c520eL), (0x6ed5ea3dL), (0x2182822cL), 
+(0x2dd0ee65L), (0x62878674L), (0xb37e3e47L), (0xfc295656L), 
+(0x144c5396L), (0x5b1b3b87L), (0x8ae283b4L), (0xc5b5eba5L), 
+(0x5ee99583L), (0x11befd92L), (0xc04745a1L), (0x8f102db0L), 
+(0x67752870L), (0x28224061L), (0xf9dbf852L), (0xb68c9043L), 
+(0xcba219a9L), (0x84f571b8L), (0x550cc98bL), (0x1a5ba19aL), 
+(0xf23ea45aL), (0xbd69cc4bL), (0x6c907478L), (0x23c71c69L), 
+(0xb89b624fL), (0xf7cc0a5eL), (0x2635b26dL), (0x6962da7cL), 
+(0x8107dfbcL), (0xce50b7adL), (0x1fa90f9eL), (0x50fe678fL), 
+(0xe5f41c4aL), (0xaaa3745bL), (0x7b5acc68L), (0x340da479L), 
+(0xdc68a1b9L), (0x933fc9a8L), (0x42c6719bL), (0x0d91198aL), 
+(0x96cd67acL), (0xd99a0fbdL), (0x0863b78eL), (0x4734df9fL), 
+(0xaf51da5fL), (0xe006b24eL), (0x31ff0a7dL), (0x7ea8626cL), 
+(0x0386eb86L), (0x4cd18397L), (0x9d283ba4L), (0xd27f53b5L), 
+(0x3a1a5675L), (0x754d3e64L), (0xa4b48657L), (0xebe3ee46L), 
+(0x70bf9060L), (0x3fe8f871L), (0xee114042L), (0xa1462853L), 
+(0x49232d93L), (0x06744582L), (0xd78dfdb1L), (0x98da95a0L), 
+(0xb958178cL), (0xf60f7f9dL), (0x27f6c7aeL), (0x68a1afbfL), 
+(0x80c4aa7fL), (0xcf93c26eL), (0x1e6a7a5dL), (0x513d124cL), 
+(0xca616c6aL), (0x8536047bL), (0x54cfbc48L), (0x1b98d459L), 
+(0xf3fdd199L), (0xbcaab988L), (0x6d5301bbL), (0x220469aaL), 
+(0x5f2ae040L), (0x107d8851L), (0xc1843062L), (0x8ed35873L), 
+(0x66b65db3L), (0x29e135a2L), (0xf8188d91L), (0xb74fe580L), 
+(0x2c139ba6L), (0x6344f3b7L), (0xb2bd4b84L), (0xfdea2395L), 
+(0x158f2655L), (0x5ad84e44L), (0x8b21f677L), (0xc4769e66L), 
+(0x717ce5a3L), (0x3e2b8db2L), (0xefd23581L), (0xa0855d90L), 
+(0x48e05850L), (0x07b73041L), (0xd64e8872L), (0x9919e063L), 
+(0x02459e45L), (0x4d12f654L), (0x9ceb4e67L), (0xd3bc2676L), 
+(0x3bd923b6L), (0x748e4ba7L), (0xa577f394L), (0xea209b85L), 
+(0x970e126fL), (0xd8597a7eL), (0x09a0c24dL), (0x46f7aa5cL), 
+(0xae92af9cL), (0xe1c5c78dL), (0x303c7fbeL), (0x7f6b17afL), 
+(0xe4376989L), (0xab600198L), (0x7a99b9abL), (0x35ced1baL), 
+(0xddabd47aL), (0x92fcbc6bL), (0x43050458L), (0x0c526c49L)
+}, {
+(0x00000000L), (0x5ba1dccaL), (0xb743b994L), (0xece2655eL), 
+(0x6a466e9fL), (0x31e7b255L), (0xdd05d70bL), (0x86a40bc1L), 
+(0xd48cdd3eL), (0x8f2d01f4L), (0x63cf64aaL), (0x386eb860L), 
+(0xbecab3a1L), (0xe56b6f6bL), (0x09890a35L), (0x5228d6ffL), 
+(0xadd8a7cbL), (0xf6797b01L), (0x1a9b1e5fL), (0x413ac295L), 
+(0xc79ec954L), (0x9c3f159eL), (0x70dd70c0L), (0x2b7cac0aL), 
+(0x79547af5L), (0x22f5a63fL), (0xce17c361L), (0x95b61fabL), 
+(0x1312146aL), (0x48b3c8a0L), (0xa451adfeL), (0xfff07134L), 
+(0x5f705221L), (0x04d18eebL), (0xe833ebb5L), (0xb392377fL), 
+(0x35363cbeL), (0x6e97e074L), (0x8275852aL), (0xd9d459e0L), 
+(0x8bfc8f1fL), (0xd05d53d5L), (0x3cbf368bL), (0x671eea41L), 
+(0xe1bae180L), (0xba1b3d4aL), (0x56f95814L), (0x0d5884deL), 
+(0xf2a8f5eaL), (0xa9092920L), (0x45eb4c7eL), (0x1e4a90b4L), 
+(0x98ee9b75L), (0xc34f47bfL), (0x2fad22e1L), (0x740cfe2bL), 
+(0x262428d4L), (0x7d85f41eL), (0x91679140L), (0xcac64d8aL), 
+(0x4c62464bL), (0x17c39a81L), (0xfb21ffdfL), (0xa0802315L), 
+(0xbee0a442L), (0xe5417888L), (0x09a31dd6L), (0x5202c11cL), 
+(0xd4a6caddL), (0x8f071617L), (0x63e57349L), (0x3844af83L), 
+(0x6a6c797cL), (0x31cda5b6L), (0xdd2fc0e8L), (0x868e1c22L), 
+(0x002a17e3L), (0x5b8bcb29L), (0xb769ae77L), (0xecc872bdL), 
+(0x13380389L), (0x4899df43L), (0xa47bba1dL), (0xffda66d7L), 
+(0x797e6d16L), (0x22dfb1dcL), (0xce3dd482L), (0x959c0848L), 
+(0xc7b4deb7L), (0x9c15027dL), (0x70f76723L), (0x2b56bbe9L), 
+(0xadf2b028L), (0xf6536ce2L), (0x1ab109bcL), (0x4110d576L), 
+(0xe190f663L), (0xba312aa9L), (0x56d34ff7L), (0x0d72933dL), 
+(0x8bd698fcL), (0xd0774436L), (0x3c952168L), (0x6734fda2L), 
+(0x351c2b5dL), (0x6ebdf797L), (0x825f92c9L), (0xd9fe4e03L), 
+(0x5f5a45c2L), (0x04fb9908L), (0xe819fc56L), (0xb3b8209cL), 
+(0x4c4851a8L), (0x17e98d62L), (0xfb0be83cL), (0xa0aa34f6L), 
+(0x260e3f37L), (0x7dafe3fdL), (0x914d86a3L), (0xcaec5a69L), 
+(0x98c48c96L), (0xc365505cL), (0x2f873502L), (0x7426e9c8L), 
+(0xf282e209L), (0xa9233ec3L), (0x45c15b9dL), (0x1e608757L), 
+(0x79005533L), (0x22a189f9L), (0xce43eca7L), (0x95e2306dL), 
+(0x13463bacL), (0x48e7e766L), (0xa4058238L), (0xffa45ef2L), 
+(0xad8c880dL), (0xf62d54c7L), (0x1acf3199L), (0x416eed53L), 
+(0xc7cae692L), (0x9c6b3a58L), (0x70895f06L), (0x2b2883ccL), 
+(0xd4d8f2f8L), (0x8f792e32L), (0x639b4b6cL), (0x383a97a6L), 
+(0xbe9e9c67L), (0xe53f40adL), (0x09dd25f3L), (0x527cf939L), 
+(0x00542fc6L), (0x5bf5f30cL), (0xb7179652L), (0xecb64a98L), 
+(0x6a124159L), (0x31b39d93L), (0xdd51f8cdL), (0x86f02407L), 
+(0x26700712L), (0x7dd1dbd8L), (0x9133be86L), (0xca92624cL), 
+(0x4c36698dL), (0x1797b547L), (0xfb75d019L), (0xa0d40cd3L), 
+(0xf2fcda2cL), (0xa95d06e6L), (0x45bf63b8L), (0x1e1ebf72L), 
+(0x98bab4b3L), (0xc31b6879L), (0x2ff90d27L), (0x7458d1edL), 
+(0x8ba8a0d9L), (0xd0097c13L), (0x3ceb194dL), (0x674ac587L), 
+(0xe1eece46L), (0xba4f128cL), (0x56ad77d2L), (0x0d0cab18L), 
+(0x5f247de7L), (0x0485a12dL), (0xe867c473L), (0xb3c618b9L), 
+(0x35621378L), (0x6ec3cfb2L), (0x8221aaecL), (0xd9807626L), 
+(0xc7e0f171L), (0x9c412dbbL), (0x70a348e5L), (0x2b02942fL), 
+(0xada69feeL), (0xf6074324L), (0x1ae5267aL), (0x4144fab0L), 
+(0x136c2c4fL), (0x48cdf085L), (0xa42f95dbL), (0xff8e4911L), 
+(0x792a42d0L), (0x228b9e1aL), (0xce69fb44L), (0x95c8278eL), 
+(0x6a3856baL), (0x31998a70L), (0xdd7bef2eL), (0x86da33e4L), 
+(0x007e3825L), (0x5bdfe4efL), (0xb73d81b1L), (0xec9c5d7bL), 
+(0xbeb48b84L), (0xe515574eL), (0x09f73210L), (0x5256eedaL), 
+(0xd4f2e51bL), (0x8f5339d1L), (0x63b15c8fL), (0x38108045L), 
+(0x9890a350L), (0xc3317f9aL), (0x2fd31ac4L), (0x7472c60eL), 
+(0xf2d6cdcfL), (0xa9771105L), (0x4595745bL), (0x1e34a891L), 
+(0x4c1c7e6eL), (0x17bda2a4L), (0xfb5fc7faL), (0xa0fe1b30L), 
+(0x265a10f1L), (0x7dfbcc3bL), (0x9119a965L), (0xcab875afL), 
+(0x3548049bL), (0x6ee9d851L), (0x820bbd0fL), (0xd9aa61c5L), 
+(0x5f0e6a04L), (0x04afb6ceL), (0xe84dd390L), (0xb3ec0f5aL), 
+(0xe1c4d9a5L), (0xba65056fL), (0x56876031L), (0x0d26bcfbL), 
+(0x8b82b73aL), (0xd0236bf0L), (0x3cc10eaeL), (0x6760d264L)
+}};
@@ -14,17 +14,45 @@
 
 #include <ext2fs/tdb.h>
 
+/*
+ * In memory, directories are found by rank: a bitmap marks the inodes
+ * which are directories, and the number of directories with a smaller
+ * inode number indexes the dense parent and dotdot arrays.  The bitmap
+ * is kept in pages which are only allocated once a directory falls in
+ * them.  Each page remembers the rank of its first inode and of each
+ * of its words, so finding a directory costs a bit test and a single
+ * popcount.  The ranks are brought up to date on the first lookup
+ * after directories have been added.
+ */
+#define DIRINFO_PAGE_BITS	16
+#define DIRINFO_PAGE_WORDS	((1 << DIRINFO_PAGE_BITS) / 64)
+#define DIRINFO_NO_PAGE		(~(ext2_ino_t) 0)
+
+struct dir_info_page {
+	__u64		bits[DIRINFO_PAGE_WORDS];
+	__u16		word_rank[DIRINFO_PAGE_WORDS];	/* within the page */
+	ext2_ino_t	rank;		/* of the first inode in the page */
+	ext2_ino_t	count;		/* directories in the page */
+	int		dirty;		/* word_rank is out of date */
+};
+
 struct dir_info_db {
 	int		count;
 	int		size;
-	struct dir_info *array;
-	struct dir_info *last_lookup;
+	ext2_ino_t	*parent;
+	ext2_ino_t	*dotdot;
+	struct dir_info_page **pages;
+	ext2_ino_t	num_pages;
+	ext2_ino_t	last_page;	/* highest page allocated */
+	ext2_ino_t	dirty_page;	/* page ranks are stale from here */
+	ext2_ino_t	last_ino;	/* highest directory added */
 	char		*tdb_fn;
 	TDB_CONTEXT	*tdb;
 };
 
 struct dir_info_iter {
-	int	i;
+	ext2_ino_t	ino;
+	struct dir_info	dir;
 	TDB_DATA	tdb_iter;
 };
 
@@ -36,6 +64,22 @@ struct dir_info_ent {
 
 static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir);
 
+/*
+ * Return how much memory the dir_info for num_dirs directories may
+ * take: the parent and dotdot arrays, and a bitmap page for each
+ * directory at worst.
+ */
+unsigned long long e2fsck_dir_info_size(ext2_filsys fs, ext2_ino_t num_dirs)
+{
+	unsigned long long pages;
+
+	pages = (fs->super->s_inodes_count >> DIRINFO_PAGE_BITS) + 1;
+	if (pages > num_dirs)
+		pages = num_dirs;
+	return (unsigned long long) num_dirs * 2 * sizeof(ext2_ino_t) +
+		pages * sizeof(struct dir_info_page);
+}
+
 static void setup_tdb(e2fsck_t ctx, ext2_ino_t num_dirs)
 {
 	struct dir_info_db	*db = ctx->dir_info;
@@ -43,16 +87,19 @@ static void setup_tdb(e2fsck_t ctx, ext2_ino_t num_dirs)
 	errcode_t		retval;
 	char			*tdb_dir, uuid[40];
 	int			fd, enable;
+	unsigned long long	size;
+	ext2_ino_t		hash_size;
 
-	profile_get_string(ctx->profile, "scratch_files", "directory", 0, 0,
-			   &tdb_dir);
+	size = e2fsck_dir_info_size(ctx->fs, num_dirs);
+	tdb_dir = e2fsck_scratch_dir(ctx, size);
 	profile_get_uint(ctx->profile, "scratch_files",
 			 "numdirs_threshold", 0, 0, &threshold);
 	profile_get_boolean(ctx->profile, "scratch_files",
 			    "dirinfo", 0, 1, &enable);
 
 	if (!enable || !tdb_dir || access(tdb_dir, W_OK) ||
-	    (threshold && num_dirs <= threshold))
+	    (threshold && num_dirs <= threshold &&
+	     !e2fsck_over_memory_budget(ctx, size)))
 		return;
 
 	retval = ext2fs_get_mem(strlen(tdb_dir) + 64, &db->tdb_fn);
@@ -67,12 +114,22 @@ static void setup_tdb(e2fsck_t ctx, ext2_ino_t num_dirs)
 		return;
 	}
 
-	if (num_dirs < 99991)
-		num_dirs = 99991; /* largest 5 digit prime */
+	hash_size = num_dirs;
+	if (hash_size < 99991)
+		hash_size = 99991; /* largest 5 digit prime */
 
-	db->tdb = tdb_open(db->tdb_fn, num_dirs, TDB_NOLOCK | TDB_NOSYNC,
+	db->tdb = tdb_open(db->tdb_fn, hash_size, TDB_NOLOCK | TDB_NOSYNC,
 			   O_RDWR | O_CREAT | O_TRUNC, 0600);
 	close(fd);
+	/*
+	 * Every directory gets a record, so make room for all of them
+	 * now instead of growing the file as they are added.  Each one
+	 * takes a 24 byte header, the key, the data and a 4 byte tailer.
+	 */
+	if (db->tdb)
+		tdb_reserve(db->tdb, (size_t) num_dirs *
+			    (28 + sizeof(ext2_ino_t) +
+			     sizeof(struct dir_info_ent)));
 }
 
 static void setup_db(e2fsck_t ctx)
@@ -85,7 +142,7 @@ static void setup_db(e2fsck_t ctx)
 		e2fsck_allocate_memory(ctx, sizeof(struct dir_info_db),
 				       "directory map db");
 	db->count = db->size = 0;
-	db->array = 0;
+	db->parent = db->dotdot = 0;
 
 	ctx->dir_info = db;
 
@@ -103,10 +160,148 @@ static void setup_db(e2fsck_t ctx)
 	}
 
 	db->size = num_dirs + 10;
-	db->array  = (struct dir_info *)
-		e2fsck_allocate_memory(ctx, db->size
-				       * sizeof (struct dir_info),
-				       "directory map");
+	db->parent = (ext2_ino_t *)
+		e2fsck_allocate_memory(ctx, db->size * sizeof(ext2_ino_t),
+				       "directory parent map");
+	db->dotdot = (ext2_ino_t *)
+		e2fsck_allocate_memory(ctx, db->size * sizeof(ext2_ino_t),
+				       "directory dotdot map");
+	db->num_pages = (ctx->fs->super->s_inodes_count >>
+			 DIRINFO_PAGE_BITS) + 1;
+	db->pages = (struct dir_info_page **)
+		e2fsck_allocate_memory(ctx, db->num_pages *
+				       sizeof(struct dir_info_page *),
+				       "directory map pages");
+	db->last_page = 0;
+	db->dirty_page = DIRINFO_NO_PAGE;
+}
+
+/*
+ * Bring the ranks of the pages from db->dirty_page on up to date.
+ */
+static void update_page_ranks(struct dir_info_db *db)
+{
+	struct dir_info_page	*page;
+	ext2_ino_t		p, rank = 0;
+
+	for (p = db->dirty_page; p-- > 0; ) {
+		page = db->pages[p];
+		if (page) {
+			rank = page->rank + page->count;
+			break;
+		}
+	}
+	for (p = db->dirty_page; p <= db->last_page; p++) {
+		page = db->pages[p];
+		if (!page)
+			continue;
+		page->rank = rank;
+		rank += page->count;
+	}
+	db->dirty_page = DIRINFO_NO_PAGE;
+}
+
+static void update_word_ranks(struct dir_info_page *page)
+{
+	unsigned int	w, rank = 0;
+
+	for (w = 0; w < DIRINFO_PAGE_WORDS; w++) {
+		page->word_rank[w] = rank;
+		rank += ext2fs_bitcount(&page->bits[w], sizeof(__u64));
+	}
+	page->dirty = 0;
+}
+
+static int test_dir_bit(struct dir_info_db *db, ext2_ino_t ino)
+{
+	struct dir_info_page	*page;
+	ext2_ino_t		p = ino >> DIRINFO_PAGE_BITS;
+
+	if (p >= db->num_pages || !(page = db->pages[p]))
+		return 0;
+	return (page->bits[(ino >> 6) & (DIRINFO_PAGE_WORDS - 1)] >>
+		(ino & 63)) & 1;
+}
+
+/*
+ * Return the number of directories with an inode number below ino,
+ * and whether ino is one of them.
+ */
+static int dir_rank(struct dir_info_db *db, ext2_ino_t ino, int *rank)
+{
+	struct dir_info_page	*page;
+	ext2_ino_t		p = ino >> DIRINFO_PAGE_BITS;
+	unsigned int		w = (ino >> 6) & (DIRINFO_PAGE_WORDS - 1);
+	__u64			below, word;
+
+	if (p >= db->num_pages)
+		return 0;
+	page = db->pages[p];
+	if (!page)
+		return 0;
+	if (db->dirty_page != DIRINFO_NO_PAGE)
+		update_page_ranks(db);
+	if (page->dirty)
+		update_word_ranks(page);
+	word = page->bits[w];
+	below = word & ((((__u64) 1) << (ino & 63)) - 1);
+	*rank = page->rank + page->word_rank[w] +
+		ext2fs_bitcount(&below, sizeof(__u64));
+	return (word >> (ino & 63)) & 1;
+}
+
+/*
+ * Return the rank a new directory ino will have.  Directories are
+ * normally added in inode order, when this is simply the count.
+ */
+static int new_dir_rank(struct dir_info_db *db, ext2_ino_t ino)
+{
+	struct dir_info_page	*page;
+	ext2_ino_t		p = ino >> DIRINFO_PAGE_BITS;
+	int			rank = 0;
+
+	if (ino > db->last_ino)
+		return db->count;
+	if (db->pages[p]) {
+		dir_rank(db, ino, &rank);
+		return rank;
+	}
+
+	/* The first directory in its page follows those of earlier pages */
+	while (p-- > 0) {
+		page = db->pages[p];
+		if (page) {
+			if (db->dirty_page != DIRINFO_NO_PAGE)
+				update_page_ranks(db);
+			return page->rank + page->count;
+		}
+	}
+	return 0;
+}
+
+static void set_dir_bit(e2fsck_t ctx, struct dir_info_db *db, ext2_ino_t ino)
+{
+	struct dir_info_page	*page;
+	ext2_ino_t		p = ino >> DIRINFO_PAGE_BITS;
+	ext2_ino_t		stale = p + 1;
+
+	page = db->pages[p];
+	if (!page) {
+		page = (struct dir_info_page *)
+			e2fsck_allocate_memory(ctx,
+					       sizeof(struct dir_info_page),
+					       "directory map page");
+		db->pages[p] = page;
+		if (p > db->last_page)
+			db->last_page = p;
+		stale = p;
+	}
+	page->bits[(ino >> 6) & (DIRINFO_PAGE_WORDS - 1)] |=
+		((__u64) 1) << (ino & 63);
+	page->count++;
+	page->dirty = 1;
+	if (db->dirty_page == DIRINFO_NO_PAGE || stale < db->dirty_page)
+		db->dirty_page = stale;
 }
 
 /*
@@ -117,8 +312,8 @@ static void setup_db(e2fsck_t ctx)
 void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
 {
 	struct dir_info_db 	*db;
-	struct dir_info 	*dir, ent;
-	int			i, j;
+	struct dir_info 	ent;
+	int			rank;
 	errcode_t		retval;
 	unsigned long		old_size;
 
@@ -129,63 +324,71 @@ void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
 		setup_db(ctx);
 	db = ctx->dir_info;
 
-	if (ctx->dir_info->count >= ctx->dir_info->size) {
-		old_size = ctx->dir_info->size * sizeof(struct dir_info);
-		ctx->dir_info->size += 10;
-		retval = ext2fs_resize_mem(old_size, ctx->dir_info->size *
-					   sizeof(struct dir_info),
-					   &ctx->dir_info->array);
-		if (retval) {
-			ctx->dir_info->size -= 10;
-			return;
-		}
+	if (db->tdb) {
+		ent.ino = ino;
+		ent.parent = parent;
+		ent.dotdot = parent;
+		e2fsck_put_dir_info(ctx, &ent);
+		return;
 	}
 
-	ent.ino = ino;
-	ent.parent = parent;
-	ent.dotdot = parent;
+	if (ino == 0 || ino > ctx->fs->super->s_inodes_count)
+		return;
 
-	if (db->tdb) {
-		e2fsck_put_dir_info(ctx, &ent);
+	if (test_dir_bit(db, ino) && dir_rank(db, ino, &rank)) {
+		db->dotdot[rank] = parent;
+		db->parent[rank] = parent;
 		return;
 	}
 
+	if (db->count >= db->size) {
+		old_size = db->size * sizeof(ext2_ino_t);
+		db->size += 10;
+		retval = ext2fs_resize_mem(old_size, db->size *
+					   sizeof(ext2_ino_t), &db->parent);
+		if (!retval)
+			retval = ext2fs_resize_mem(old_size, db->size *
+						   sizeof(ext2_ino_t),
+						   &db->dotdot);
+		if (retval) {
+			db->size -= 10;
+			return;
+		}
+	}
+
 	/*
 	 * Normally, add_dir_info is called with each inode in
 	 * sequential order; but once in a while (like when pass 3
 	 * needs to recreate the root directory or lost+found
 	 * directory) it is called out of order.  In those cases, we
-	 * need to move the dir_info entries down to make room, since
-	 * the dir_info array needs to be sorted by inode number for
-	 * get_dir_info()'s sake.
+	 * need to move the later entries up to make room.
 	 */
-	if (ctx->dir_info->count &&
-	    ctx->dir_info->array[ctx->dir_info->count-1].ino >= ino) {
-		for (i = ctx->dir_info->count-1; i > 0; i--)
-			if (ctx->dir_info->array[i-1].ino < ino)
-				break;
-		dir = &ctx->dir_info->array[i];
-		if (dir->ino != ino)
-			for (j = ctx->dir_info->count++; j > i; j--)
-				ctx->dir_info->array[j] = ctx->dir_info->array[j-1];
-	} else
-		dir = &ctx->dir_info->array[ctx->dir_info->count++];
-
-	dir->ino = ino;
-	dir->dotdot = parent;
-	dir->parent = parent;
+	rank = new_dir_rank(db, ino);
+	if (rank < db->count) {
+		memmove(db->parent + rank + 1, db->parent + rank,
+			(db->count - rank) * sizeof(ext2_ino_t));
+		memmove(db->dotdot + rank + 1, db->dotdot + rank,
+			(db->count - rank) * sizeof(ext2_ino_t));
+	}
+	set_dir_bit(ctx, db, ino);
+	db->count++;
+	if (ino > db->last_ino)
+		db->last_ino = ino;
+	db->dotdot[rank] = parent;
+	db->parent[rank] = parent;
 }
 
 /*
  * get_dir_info() --- given an inode number, try to find the directory
- * information entry for it.
+ * information entry for it.  The result is only good until the next
+ * call.
  */
 static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 {
 	struct dir_info_db	*db = ctx->dir_info;
-	int			low, high, mid;
 	struct dir_info_ent	*buf;
 	static struct dir_info	ret_dir_info;
+	int			rank;
 
 	if (!db)
 		return 0;
@@ -219,46 +422,15 @@ static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 		return &ret_dir_info;
 	}
 
-	if (db->last_lookup && db->last_lookup->ino == ino)
-		return db->last_lookup;
-
-	low = 0;
-	high = ctx->dir_info->count-1;
-	if (ino == ctx->dir_info->array[low].ino) {
-#ifdef DIRINFO_DEBUG
-		printf("(%d,%d,%d)\n", ino,
-		       ctx->dir_info->array[low].dotdot,
-		       ctx->dir_info->array[low].parent);
-#endif
-		return &ctx->dir_info->array[low];
-	}
-	if (ino == ctx->dir_info->array[high].ino) {
-#ifdef DIRINFO_DEBUG
-		printf("(%d,%d,%d)\n", ino,
-		       ctx->dir_info->array[high].dotdot,
-		       ctx->dir_info->array[high].parent);
-#endif
-		return &ctx->dir_info->array[high];
-	}
-
-	while (low < high) {
-		mid = (low+high)/2;
-		if (mid == low || mid == high)
-			break;
-		if (ino == ctx->dir_info->array[mid].ino) {
+	if (!dir_rank(db, ino, &rank))
+		return 0;
+	ret_dir_info.ino = ino;
+	ret_dir_info.dotdot = db->dotdot[rank];
+	ret_dir_info.parent = db->parent[rank];
 #ifdef DIRINFO_DEBUG
-			printf("(%d,%d,%d)\n", ino,
-			       ctx->dir_info->array[mid].dotdot,
-			       ctx->dir_info->array[mid].parent);
+	printf("(%d,%d,%d)\n", ino, ret_dir_info.dotdot, ret_dir_info.parent);
 #endif
-			return &ctx->dir_info->array[mid];
-		}
-		if (ino < ctx->dir_info->array[mid].ino)
-			high = mid;
-		else
-			low = mid;
-	}
-	return 0;
+	return &ret_dir_info;
 }
 
 static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir)
@@ -272,8 +444,15 @@ static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir)
 	       dir->parent);
 #endif
 
-	if (!db->tdb)
+	if (!db->tdb) {
+		int	rank;
+
+		if (dir_rank(db, dir->ino, &rank)) {
+			db->dotdot[rank] = dir->dotdot;
+			db->parent[rank] = dir->parent;
+		}
 		return;
+	}
 
 	buf.parent = dir->parent;
 	buf.dotdot = dir->dotdot;
@@ -292,6 +471,32 @@ static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir)
 /*
  * Free the dir_info structure when it isn't needed any more.
  */
+/*
+ * How many bytes of memory the directory information takes; a tdb file
+ * isn't counted.
+ */
+unsigned long long e2fsck_dir_info_mem_usage(e2fsck_t ctx)
+{
+	struct dir_info_db	*db = ctx->dir_info;
+	unsigned long long	bytes;
+	ext2_ino_t		p;
+
+	if (!db)
+		return 0;
+	bytes = sizeof(struct dir_info_db);
+	if (db->parent)
+		bytes += (unsigned long long) db->size * 2 *
+			sizeof(ext2_ino_t);
+	if (db->pages) {
+		bytes += (unsigned long long) db->num_pages *
+			sizeof(struct dir_info_page *);
+		for (p = 0; p <= db->last_page && p < db->num_pages; p++)
+			if (db->pages[p])
+				bytes += sizeof(struct dir_info_page);
+	}
+	return bytes;
+}
+
 void e2fsck_free_dir_info(e2fsck_t ctx)
 {
 	if (ctx->dir_info) {
@@ -301,9 +506,18 @@ void e2fsck_free_dir_info(e2fsck_t ctx)
 			unlink(ctx->dir_info->tdb_fn);
 			free(ctx->dir_info->tdb_fn);
 		}
-		if (ctx->dir_info->array)
-			ext2fs_free_mem(&ctx->dir_info->array);
-		ctx->dir_info->array = 0;
+		if (ctx->dir_info->pages) {
+			ext2_ino_t	p;
+
+			for (p = 0; p < ctx->dir_info->num_pages; p++)
+				if (ctx->dir_info->pages[p])
+					ext2fs_free_mem(&ctx->dir_info->pages[p]);
+			ext2fs_free_mem(&ctx->dir_info->pages);
+		}
+		if (ctx->dir_info->parent)
+			ext2fs_free_mem(&ctx->dir_info->parent);
+		if (ctx->dir_info->dotdot)
+			ext2fs_free_mem(&ctx->dir_info->dotdot);
 		ctx->dir_info->size = 0;
 		ctx->dir_info->count = 0;
 		ext2fs_free_mem(&ctx->dir_info);
@@ -327,7 +541,7 @@ struct dir_info_iter *e2fsck_dir_info_iter_begin(e2fsck_t ctx)
 	iter = e2fsck_allocate_memory(ctx, sizeof(struct dir_info_iter),
 				      "dir_info iterator");
 
-	if (db->tdb)
+	if (db && db->tdb)
 		iter->tdb_iter = tdb_firstkey(db->tdb);
 
 	return iter;
@@ -373,16 +587,42 @@ struct dir_info *e2fsck_dir_info_iter(e2fsck_t ctx, struct dir_info_iter *iter)
 		return &ret_dir_info;
 	}
 
-	if (iter->i >= ctx->dir_info->count)
-		return 0;
-
+	/*
+	 * Step to the next bit set in the pages.  The rank is looked up
+	 * again since pass 3 may add lost+found while iterating.
+	 */
+	while (iter->ino < db->last_ino) {
+		struct dir_info_page	*page;
+		ext2_ino_t		ino = ++iter->ino;
+		__u64			word;
+		int			rank;
+
+		page = db->pages[ino >> DIRINFO_PAGE_BITS];
+		if (!page) {
+			iter->ino |= (1 << DIRINFO_PAGE_BITS) - 1;
+			continue;
+		}
+		word = page->bits[(ino >> 6) & (DIRINFO_PAGE_WORDS - 1)] >>
+			(ino & 63);
+		if (!word) {
+			iter->ino |= 63;
+			continue;
+		}
+		while (!(word & 1)) {
+			word >>= 1;
+			iter->ino++;
+		}
+		dir_rank(db, iter->ino, &rank);
+		iter->dir.ino = iter->ino;
+		iter->dir.dotdot = db->dotdot[rank];
+		iter->dir.parent = db->parent[rank];
 #ifdef DIRINFO_DEBUG
-	printf("iter(%d, %d, %d)...", ctx->dir_info->array[iter->i].ino,
-	       ctx->dir_info->array[iter->i].dotdot,
-	       ctx->dir_info->array[iter->i].parent);
+		printf("iter(%d, %d, %d)...", iter->dir.ino, iter->dir.dotdot,
+		       iter->dir.parent);
 #endif
-	ctx->dir_info->last_lookup = ctx->dir_info->array + iter->i++;
-	return(ctx->dir_info->last_lookup);
+		return &iter->dir;
+	}
+	return 0;
 }
 
 /*
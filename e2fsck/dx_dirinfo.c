@@ -8,6 +8,40 @@
 #include "e2fsck.h"
 #ifdef ENABLE_HTREE
 
+/*
+ * The dx_dir_info entries are kept in an array, in the order they were
+ * added, and found through an open-addressed hash table of their
+ * indices (plus one, so that zero marks a free slot) keyed by inode
+ * number.  The array is only sorted by inode number, if it has to be,
+ * when it is iterated over.
+ */
+static unsigned int dx_dir_slot(e2fsck_t ctx, ext2_ino_t ino)
+{
+	return (ino * 0x9E3779B1U) & (ctx->dx_dir_hash_size - 1);
+}
+
+static void dx_dir_hash_insert(e2fsck_t ctx, int i)
+{
+	unsigned int	slot = dx_dir_slot(ctx, ctx->dx_dir_info[i].ino);
+
+	while (ctx->dx_dir_hash[slot])
+		slot = (slot + 1) & (ctx->dx_dir_hash_size - 1);
+	ctx->dx_dir_hash[slot] = i + 1;
+}
+
+static void dx_dir_hash_rebuild(e2fsck_t ctx, int size)
+{
+	int	i;
+
+	if (ctx->dx_dir_hash)
+		ext2fs_free_mem(&ctx->dx_dir_hash);
+	ctx->dx_dir_hash_size = size;
+	ctx->dx_dir_hash = (int *) e2fsck_allocate_memory(ctx,
+				size * sizeof(int), "indexed directory hash");
+	for (i = 0; i < ctx->dx_dir_info_count; i++)
+		dx_dir_hash_insert(ctx, i);
+}
+
 /*
  * This subroutine is called during pass1 to create a directory info
  * entry.  During pass1, the passed-in parent is 0; it will get filled
@@ -16,9 +50,9 @@
 void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks)
 {
 	struct dx_dir_info *dir;
-	int		i, j;
 	errcode_t	retval;
 	unsigned long	old_size;
+	int		i;
 
 #if 0
 	printf("add_dx_dir_info for inode %lu...\n", ino);
@@ -30,48 +64,52 @@ void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks)
 			e2fsck_allocate_memory(ctx, ctx->dx_dir_info_size
 					       * sizeof (struct dx_dir_info),
 					       "directory map");
+		dx_dir_hash_rebuild(ctx, 256);
+	}
+
+	dir = e2fsck_get_dx_dir_info(ctx, ino);
+	if (dir) {
+		e2fsck_free_dx_dirblocks(dir);
+		if (dir->root_buf) {
+			ext2fs_free_mem(&dir->root_buf);
+			ctx->dx_root_saved -= ctx->fs->blocksize;
+		}
+		goto fill;
 	}
 
 	if (ctx->dx_dir_info_count >= ctx->dx_dir_info_size) {
 		old_size = ctx->dx_dir_info_size * sizeof(struct dx_dir_info);
-		ctx->dx_dir_info_size += 10;
-		retval = ext2fs_resize_mem(old_size, ctx->dx_dir_info_size *
-					   sizeof(struct dx_dir_info),
+		retval = ext2fs_resize_mem(old_size, 2 * old_size,
 					   &ctx->dx_dir_info);
-		if (retval) {
-			ctx->dx_dir_info_size -= 10;
+		if (retval)
 			return;
-		}
+		ctx->dx_dir_info_size *= 2;
 	}
 
 	/*
 	 * Normally, add_dx_dir_info is called with each inode in
-	 * sequential order; but once in a while (like when pass 3
-	 * needs to recreate the root directory or lost+found
-	 * directory) it is called out of order.  In those cases, we
-	 * need to move the dx_dir_info entries down to make room, since
-	 * the dx_dir_info array needs to be sorted by inode number for
-	 * get_dx_dir_info()'s sake.
+	 * sequential order; but once in a while it is called out of
+	 * order.  The new entry still goes at the end; the iterator
+	 * sorts the array before handing it out.
 	 */
-	if (ctx->dx_dir_info_count &&
-	    ctx->dx_dir_info[ctx->dx_dir_info_count-1].ino >= ino) {
-		for (i = ctx->dx_dir_info_count-1; i > 0; i--)
-			if (ctx->dx_dir_info[i-1].ino < ino)
-				break;
-		dir = &ctx->dx_dir_info[i];
-		if (dir->ino != ino)
-			for (j = ctx->dx_dir_info_count++; j > i; j--)
-				ctx->dx_dir_info[j] = ctx->dx_dir_info[j-1];
-	} else
-		dir = &ctx->dx_dir_info[ctx->dx_dir_info_count++];
-
+	i = ctx->dx_dir_info_count++;
+	if (i && ctx->dx_dir_info[i-1].ino > ino)
+		ctx->dx_dir_info_unsorted = 1;
+	dir = &ctx->dx_dir_info[i];
 	dir->ino = ino;
+	if (4 * ctx->dx_dir_info_count > 3 * ctx->dx_dir_hash_size)
+		dx_dir_hash_rebuild(ctx, 2 * ctx->dx_dir_hash_size);
+	else
+		dx_dir_hash_insert(ctx, i);
+
+fill:
 	dir->numblocks = num_blocks;
 	dir->hashversion = 0;
-	dir->dx_block = e2fsck_allocate_memory(ctx, num_blocks
-				       * sizeof (struct dx_dirblock_info),
-				       "dx_block info array");
-
+	dir->depth = 0;
+	dir->dx_chunks = 0;
+	dir->num_chunks = 0;
+	dir->root_buf = 0;
+	dir->root_blk = 0;
 }
 
 /*
@@ -80,52 +118,192 @@ void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks)
  */
 struct dx_dir_info *e2fsck_get_dx_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 {
-	int	low, high, mid;
+	unsigned int	slot;
+	int		i;
 
-	low = 0;
-	high = ctx->dx_dir_info_count-1;
 	if (!ctx->dx_dir_info)
 		return 0;
-	if (ino == ctx->dx_dir_info[low].ino)
-		return &ctx->dx_dir_info[low];
-	if  (ino == ctx->dx_dir_info[high].ino)
-		return &ctx->dx_dir_info[high];
-
-	while (low < high) {
-		mid = (low+high)/2;
-		if (mid == low || mid == high)
-			break;
-		if (ino == ctx->dx_dir_info[mid].ino)
-			return &ctx->dx_dir_info[mid];
-		if (ino < ctx->dx_dir_info[mid].ino)
-			high = mid;
-		else
-			low = mid;
-	}
+	for (slot = dx_dir_slot(ctx, ino); (i = ctx->dx_dir_hash[slot]);
+	     slot = (slot + 1) & (ctx->dx_dir_hash_size - 1))
+		if (ctx->dx_dir_info[i-1].ino == ino)
+			return &ctx->dx_dir_info[i-1];
 	return 0;
 }
 
+/*
+ * e2fsck_dx_dirblock() --- return the information about block blk of
+ * an indexed directory, allocating the chunk holding it if this is the
+ * first time one of its blocks is looked at.  blk must be less than
+ * dx_dir->numblocks.
+ */
+struct dx_dirblock_info *e2fsck_dx_dirblock(e2fsck_t ctx,
+					    struct dx_dir_info *dx_dir,
+					    blk64_t blk)
+{
+	struct dx_dirblock_info **chunk;
+
+	if (!dx_dir->dx_chunks) {
+		dx_dir->num_chunks = (dx_dir->numblocks + DX_CHUNK_BLOCKS - 1) >>
+			DX_CHUNK_BITS;
+		dx_dir->dx_chunks = e2fsck_allocate_memory(ctx,
+			dx_dir->num_chunks * sizeof(struct dx_dirblock_info *),
+			"dx_block chunk array");
+	}
+	chunk = &dx_dir->dx_chunks[blk >> DX_CHUNK_BITS];
+	if (!*chunk)
+		*chunk = e2fsck_allocate_memory(ctx, DX_CHUNK_BLOCKS *
+					sizeof(struct dx_dirblock_info),
+					"dx_block info array");
+	return &(*chunk)[blk & (DX_CHUNK_BLOCKS - 1)];
+}
+
+/*
+ * e2fsck_dx_dirblock_peek() --- the same, but return NULL instead of
+ * allocating anything if no block of blk's chunk has been looked at.
+ */
+struct dx_dirblock_info *e2fsck_dx_dirblock_peek(struct dx_dir_info *dx_dir,
+						 blk64_t blk)
+{
+	struct dx_dirblock_info *chunk;
+
+	if (!dx_dir->dx_chunks)
+		return 0;
+	chunk = dx_dir->dx_chunks[blk >> DX_CHUNK_BITS];
+	return chunk ? &chunk[blk & (DX_CHUNK_BLOCKS - 1)] : 0;
+}
+
+/*
+ * Free the per-block information of an indexed directory.
+ */
+void e2fsck_free_dx_dirblocks(struct dx_dir_info *dx_dir)
+{
+	int	i;
+
+	if (!dx_dir->dx_chunks)
+		return;
+	for (i = 0; i < dx_dir->num_chunks; i++)
+		if (dx_dir->dx_chunks[i])
+			ext2fs_free_mem(&dx_dir->dx_chunks[i]);
+	ext2fs_free_mem(&dx_dir->dx_chunks);
+}
+
+/*
+ * Pass 1 reads the root block of every indexed directory to check its
+ * dx_root, and pass 2 would read it again a while later, which on a
+ * file system with lots of directories is one more random read for
+ * each of them.  So keep a copy of the root block, just as it came
+ * off the disk, in the directory's dx_dir_info, until pass 2 picks it
+ * up.  Only DX_ROOT_SAVE_MAX bytes' worth are kept, and none if they
+ * would push us over the -E max_memory budget; the rest are simply
+ * read again.
+ */
+#define DX_ROOT_SAVE_MAX	(32 * 1024 * 1024)
+
+void e2fsck_save_dx_root(e2fsck_t ctx, ext2_ino_t ino, blk64_t blk,
+			 const char *buf)
+{
+	struct dx_dir_info *dx_dir;
+	unsigned long long size = ctx->fs->blocksize;
+
+	dx_dir = e2fsck_get_dx_dir_info(ctx, ino);
+	if (!dx_dir || dx_dir->root_buf ||
+	    ctx->dx_root_saved + size > DX_ROOT_SAVE_MAX ||
+	    e2fsck_over_memory_budget(ctx, ctx->dx_root_saved + size))
+		return;
+	if (ext2fs_get_mem(size, &dx_dir->root_buf))
+		return;
+	memcpy(dx_dir->root_buf, buf, size);
+	dx_dir->root_blk = blk;
+	ctx->dx_root_saved += size;
+}
+
+/*
+ * Returns 1 if pass 1 left a copy of block blk as the root block of
+ * the directory.
+ */
+int e2fsck_dx_root_saved(struct dx_dir_info *dx_dir, blk64_t blk)
+{
+	return dx_dir && dx_dir->root_buf && dx_dir->root_blk == blk;
+}
+
+/*
+ * Copy the saved root block into buf, in on-disk byte order, and
+ * forget it.  Returns 0 if there is no saved copy of block blk.
+ */
+int e2fsck_get_dx_root(e2fsck_t ctx, struct dx_dir_info *dx_dir,
+		       blk64_t blk, char *buf)
+{
+	if (!e2fsck_dx_root_saved(dx_dir, blk))
+		return 0;
+	memcpy(buf, dx_dir->root_buf, ctx->fs->blocksize);
+	ext2fs_free_mem(&dx_dir->root_buf);
+	ctx->dx_root_saved -= ctx->fs->blocksize;
+	return 1;
+}
+
+/*
+ * Throw away all of the saved root blocks.
+ */
+void e2fsck_forget_dx_roots(e2fsck_t ctx)
+{
+	int	i;
+
+	for (i = 0; i < ctx->dx_dir_info_count; i++)
+		if (ctx->dx_dir_info[i].root_buf)
+			ext2fs_free_mem(&ctx->dx_dir_info[i].root_buf);
+	ctx->dx_root_saved = 0;
+}
+
 /*
  * Free the dx_dir_info structure when it isn't needed any more.
  */
 void e2fsck_free_dx_dir_info(e2fsck_t ctx)
 {
 	int	i;
-	struct dx_dir_info *dir;
 
 	if (ctx->dx_dir_info) {
-		dir = ctx->dx_dir_info;
-		for (i=0; i < ctx->dx_dir_info_count; i++,dir++) {
-			if (dir->dx_block) {
-				ext2fs_free_mem(&dir->dx_block);
-				dir->dx_block = 0;
-			}
-		}
+		e2fsck_forget_dx_roots(ctx);
+		for (i=0; i < ctx->dx_dir_info_count; i++)
+			e2fsck_free_dx_dirblocks(&ctx->dx_dir_info[i]);
 		ext2fs_free_mem(&ctx->dx_dir_info);
 		ctx->dx_dir_info = 0;
 	}
+	if (ctx->dx_dir_hash)
+		ext2fs_free_mem(&ctx->dx_dir_hash);
+	ctx->dx_dir_hash_size = 0;
 	ctx->dx_dir_info_size = 0;
 	ctx->dx_dir_info_count = 0;
+	ctx->dx_dir_info_unsorted = 0;
+}
+
+/*
+ * How many bytes of memory the dx_dir_info structure takes, with the
+ * per-block information and the saved root blocks.
+ */
+unsigned long long e2fsck_dx_dir_info_mem_usage(e2fsck_t ctx)
+{
+	struct dx_dir_info	*dx_dir;
+	unsigned long long	bytes;
+	int			i, c;
+
+	if (!ctx->dx_dir_info)
+		return 0;
+	bytes = (unsigned long long) ctx->dx_dir_info_size *
+		sizeof(struct dx_dir_info) +
+		(unsigned long long) ctx->dx_dir_hash_size * sizeof(int) +
+		ctx->dx_root_saved;
+	for (i = 0; i < ctx->dx_dir_info_count; i++) {
+		dx_dir = &ctx->dx_dir_info[i];
+		if (!dx_dir->dx_chunks)
+			continue;
+		bytes += dx_dir->num_chunks *
+			sizeof(struct dx_dirblock_info *);
+		for (c = 0; c < dx_dir->num_chunks; c++)
+			if (dx_dir->dx_chunks[c])
+				bytes += DX_CHUNK_BLOCKS *
+					sizeof(struct dx_dirblock_info);
+	}
+	return bytes;
 }
 
 /*
@@ -139,8 +317,23 @@ int e2fsck_get_num_dx_dirinfo(e2fsck_t ctx)
 /*
  * A simple interator function
  */
+static int dx_dir_cmp(const void *a, const void *b)
+{
+	const struct dx_dir_info *da = a, *db = b;
+
+	if (da->ino == db->ino)
+		return 0;
+	return da->ino < db->ino ? -1 : 1;
+}
+
 struct dx_dir_info *e2fsck_dx_dir_info_iter(e2fsck_t ctx, int *control)
 {
+	if (*control == 0 && ctx->dx_dir_info_unsorted) {
+		qsort(ctx->dx_dir_info, ctx->dx_dir_info_count,
+		      sizeof(struct dx_dir_info), dx_dir_cmp);
+		dx_dir_hash_rebuild(ctx, ctx->dx_dir_hash_size);
+		ctx->dx_dir_info_unsorted = 0;
+	}
 	if (*control >= ctx->dx_dir_info_count)
 		return 0;
 
@@ -29,10 +29,11 @@ errcode_t e2fsck_allocate_context(e2fsck_t *ret)
 
 	memset(context, 0, sizeof(struct e2fsck_struct));
 
-	context->process_inode_size = 256;
+	context->inode_buffer_blocks = EXT2_INODE_SCAN_AUTO_BUFFER;
 	context->ext_attr_ver = 2;
 	context->blocks_per_page = 1;
 	context->htree_slack_percentage = 255;
+	context->readahead_kb = E2FSCK_DEFAULT_READAHEAD_KB;
 
 	time_env = getenv("E2FSCK_TIME");
 	if (time_env)
@@ -58,6 +59,9 @@ errcode_t e2fsck_reset_context(e2fsck_t ctx)
 	ctx->flags &= E2F_RESET_FLAGS;
 	ctx->lost_and_found = 0;
 	ctx->bad_lost_and_found = 0;
+	if (ctx->lnf_queue)
+		ext2fs_free_mem(&ctx->lnf_queue);
+	ctx->lnf_queue_num = ctx->lnf_queue_max = 0;
 	if (ctx->inode_used_map) {
 		ext2fs_free_inode_bitmap(ctx->inode_used_map);
 		ctx->inode_used_map = 0;
@@ -78,6 +82,7 @@ errcode_t e2fsck_reset_context(e2fsck_t ctx)
 		ext2fs_free_icount(ctx->inode_link_info);
 		ctx->inode_link_info = 0;
 	}
+	e2fsck_stop_itable_prefetch(ctx);
 	if (ctx->journal_io) {
 		if (ctx->fs && ctx->fs->io != ctx->journal_io)
 			io_channel_close(ctx->journal_io);
@@ -103,6 +108,7 @@ errcode_t e2fsck_reset_context(e2fsck_t ctx)
 		ext2fs_free_block_bitmap(ctx->block_dup_map);
 		ctx->block_dup_map = 0;
 	}
+	ctx->dup_last_ino = 0;
 	if (ctx->block_ea_map) {
 		ext2fs_free_block_bitmap(ctx->block_ea_map);
 		ctx->block_ea_map = 0;
@@ -190,9 +196,24 @@ void e2fsck_free_context(e2fsck_t ctx)
 	if (ctx->device_name)
 		ext2fs_free_mem(&ctx->device_name);
 
+	if (ctx->undo_file)
+		ext2fs_free_mem(&ctx->undo_file);
+
 	if (ctx->log_fn)
 		free(ctx->log_fn);
 
+	if (ctx->stats_file)
+		fclose(ctx->stats_file);
+
+	if (ctx->stats_fn)
+		free(ctx->stats_fn);
+
+	if (ctx->io_trace_fn)
+		free(ctx->io_trace_fn);
+
+	if (ctx->checkpoint_fn)
+		free(ctx->checkpoint_fn);
+
 	ext2fs_free_mem(&ctx);
 }
 
@@ -226,11 +247,23 @@ int e2fsck_run(e2fsck_t ctx)
 			break;
 		if (e2fsck_mmp_update(ctx->fs))
 			fatal_error(ctx, 0);
+		if (ctx->io_trace_fn) {
+			char	tag[32];
+
+			sprintf(tag, "trace_tag=pass%d", i + 1);
+			(void) io_channel_set_options(ctx->fs->io, tag);
+		}
 		e2fsck_pass(ctx);
+		/* Each pass's repairs go out to the device together */
+		if ((ctx->options & E2F_OPT_STAGE_WRITES) &&
+		    !(ctx->options & E2F_OPT_READONLY))
+			(void) io_channel_flush(ctx->fs->io);
 		if (ctx->progress)
 			(void) (ctx->progress)(ctx, 0, 0, 0);
 	}
 	ctx->flags &= ~E2F_FLAG_SETJMP_OK;
+	if (ctx->io_trace_fn)
+		(void) io_channel_set_options(ctx->fs->io, "trace_tag=finish");
 
 	if (ctx->flags & E2F_FLAG_RUN_RETURN)
 		return (ctx->flags & E2F_FLAG_RUN_RETURN);
@@ -108,9 +108,21 @@ struct dx_dir_info {
 	int			numblocks;	/* number of blocks */
 	int			hashversion;
 	short			depth;		/* depth of tree */
-	struct dx_dirblock_info	*dx_block; 	/* Array of size numblocks */
+	struct dx_dirblock_info	**dx_chunks;	/* of DX_CHUNK_BLOCKS blocks */
+	int			num_chunks;
+	char			*root_buf;	/* block 0, as read in pass 1 */
+	blk64_t			root_blk;	/* where root_buf came from */
 };
 
+/*
+ * The per-block information of an indexed directory is kept in chunks
+ * which are only allocated once one of their blocks is looked at, so
+ * a directory which is mostly holes (or claims far more blocks than it
+ * really has) costs little.
+ */
+#define DX_CHUNK_BITS		7
+#define DX_CHUNK_BLOCKS		(1 << DX_CHUNK_BITS)
+
 #define DX_DIRBLOCK_ROOT	1
 #define DX_DIRBLOCK_LEAF	2
 #define DX_DIRBLOCK_NODE	3
@@ -118,14 +130,14 @@ struct dx_dir_info {
 #define DX_DIRBLOCK_CLEARED	8
 
 struct dx_dirblock_info {
-	int		type;
 	blk64_t		phys;
-	int		flags;
-	blk64_t		parent;
 	ext2_dirhash_t	min_hash;
 	ext2_dirhash_t	max_hash;
 	ext2_dirhash_t	node_min_hash;
 	ext2_dirhash_t	node_max_hash;
+	blk_t		parent;
+	__u16		type;
+	__u16		flags;
 };
 
 #define DX_FLAG_REFERENCED	1
@@ -135,6 +147,37 @@ struct dx_dirblock_info {
 
 #define RESOURCE_TRACK
 
+/*
+ * The big structures whose memory is accounted for separately; see
+ * e2fsck_mem_sample()
+ */
+#define E2F_MEM_BLOCK_FOUND_MAP		0
+#define E2F_MEM_BLOCK_DUP_MAP		1
+#define E2F_MEM_BLOCK_EA_MAP		2
+#define E2F_MEM_INODE_USED_MAP		3
+#define E2F_MEM_INODE_BAD_MAP		4
+#define E2F_MEM_INODE_DIR_MAP		5
+#define E2F_MEM_INODE_BB_MAP		6
+#define E2F_MEM_INODE_IMAGIC_MAP	7
+#define E2F_MEM_INODE_REG_MAP		8
+#define E2F_MEM_FS_BLOCK_MAP		9
+#define E2F_MEM_FS_INODE_MAP		10
+#define E2F_MEM_INODE_LINK_INFO		11
+#define E2F_MEM_INODE_COUNT		12
+#define E2F_MEM_DIR_INFO		13
+#define E2F_MEM_DX_DIR_INFO		14
+#define E2F_MEM_DBLIST			15
+#define E2F_MEM_REFCOUNT		16
+#define E2F_MEM_REFCOUNT_EXTRA		17
+#define E2F_MEM_INODES_TO_PROCESS	18
+#define E2F_MEM_PASS1B			19
+#define E2F_MEM_OWNERS			20
+
+struct e2fsck_mem_usage {
+	unsigned long long	cur;
+	unsigned long long	peak;
+};
+
 #ifdef RESOURCE_TRACK
 /*
  * This structure is used for keeping track of how much resources have
@@ -147,6 +190,17 @@ struct resource_track {
 	void	*brk_start;
 	unsigned long long bytes_read;
 	unsigned long long bytes_written;
+	unsigned long long cache_hits;
+	unsigned long long cache_misses;
+	unsigned long long discards;
+	unsigned long long bytes_discarded;
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long flushes;
+	unsigned long long read_latency[IO_STATS_LATENCY_BUCKETS];
+	unsigned long long write_latency[IO_STATS_LATENCY_BUCKETS];
+	unsigned long long inodes_scanned;
+	unsigned long long dir_blocks_checked;
 };
 #endif
 
@@ -167,6 +221,25 @@ struct resource_track {
 #define E2F_OPT_FRAGCHECK	0x0800
 #define E2F_OPT_JOURNAL_ONLY	0x1000 /* only replay the journal */
 #define E2F_OPT_DISCARD		0x2000
+#define E2F_OPT_ESTIMATE	0x4000 /* only print an estimate */
+#define E2F_OPT_CONVERT_BMAP	0x8000 /* convert block maps to extents */
+#define E2F_OPT_CONVERT_RELOCATE 0x10000 /* ...moving fragmented files */
+#define E2F_OPT_RELOCATE_DIRS	0x20000 /* make rebuilt dirs contiguous */
+#define E2F_OPT_GROUPS		0x40000 /* only check some block groups */
+#define E2F_OPT_GROUPS_FIX	0x80000 /* ...and fix what's found there */
+#define E2F_OPT_STAGE_WRITES	0x100000 /* commit staged writes per pass */
+
+/*
+ * Sizes of the pass 1 batch of inodes to check in block order, when
+ * the disk is rotational, when it isn't, and when we can't tell (see
+ * e2fsck_process_inode_size)
+ */
+#define E2F_PROCESS_INODE_ROT		32768
+#define E2F_PROCESS_INODE_NONROT	2048
+#define E2F_PROCESS_INODE_MIN		256
+
+/* Default size of the pass 2 directory block readahead window */
+#define E2FSCK_DEFAULT_READAHEAD_KB	4096
 
 /*
  * E2fsck flags
@@ -212,6 +285,8 @@ typedef struct ea_refcount *ext2_refcount_t;
  */
 typedef struct e2fsck_struct *e2fsck_t;
 
+struct itable_prefetch;
+
 #define MAX_EXTENT_DEPTH_COUNT 5
 
 struct e2fsck_struct {
@@ -222,8 +297,14 @@ struct e2fsck_struct {
 	char *io_options;
 	FILE	*logf;
 	char	*log_fn;
+	FILE	*stats_file;
+	char	*stats_fn;
+	char	*io_trace_fn;
+	char	*checkpoint_fn;
 	int	flags;		/* E2fsck internal flags */
 	int	options;
+	dgrp_t	scope_first_group; /* -E groups=first-last */
+	dgrp_t	scope_last_group;
 	int	blocksize;	/* blocksize */
 	blk64_t	use_superblock;	/* sb requested by user */
 	blk64_t	superblock;	/* sb used to open fs */
@@ -250,6 +331,7 @@ struct e2fsck_struct {
 
 	ext2fs_block_bitmap block_found_map; /* Blocks which are in use */
 	ext2fs_block_bitmap block_dup_map; /* Blks referenced more than once */
+	ext2_ino_t dup_last_ino;	/* Pass 1 position at last dup block */
 	ext2fs_block_bitmap block_ea_map; /* Blocks which are used by EA's */
 
 	/*
@@ -286,6 +368,8 @@ struct e2fsck_struct {
 	 */
 	ext2_ino_t lost_and_found;
 	int bad_lost_and_found;
+	struct lnf_entry *lnf_queue;	/* inodes waiting to be linked there */
+	unsigned int lnf_queue_num, lnf_queue_max;
 
 	/*
 	 * Directory information
@@ -298,6 +382,10 @@ struct e2fsck_struct {
 	int		dx_dir_info_count;
 	int		dx_dir_info_size;
 	struct dx_dir_info *dx_dir_info;
+	int		*dx_dir_hash;	/* index+1 into dx_dir_info, by inode */
+	int		dx_dir_hash_size;
+	int		dx_dir_info_unsorted;
+	unsigned long long dx_root_saved; /* bytes of saved root blocks */
 
 	/*
 	 * Directories to hash
@@ -307,9 +395,20 @@ struct e2fsck_struct {
 	/*
 	 * Tuning parameters
 	 */
-	int process_inode_size;
+	int process_inode_size;	/* 0: chosen by pass 1 */
 	int inode_buffer_blocks;
 	unsigned int htree_slack_percentage;
+	int prefetch_workers;
+	unsigned long readahead_kb;
+	unsigned long long max_memory;	/* bytes, 0 for no limit */
+	int max_count_problems;		/* 0 to use e2fsck.conf */
+	unsigned long long output_buffer; /* bytes, 0 to write directly */
+	int batch_jobs;			/* > 0 to check several devices */
+
+	/*
+	 * Inode table prefetch helpers (pass 1)
+	 */
+	struct itable_prefetch *itable_prefetch;
 
 	/*
 	 * ext3 journal support
@@ -317,6 +416,11 @@ struct e2fsck_struct {
 	io_channel	journal_io;
 	char	*journal_name;
 
+	/*
+	 * Undo file for the changes made by this run
+	 */
+	char	*undo_file;
+
 	/*
 	 * Ext4 quota support
 	 */
@@ -335,6 +439,13 @@ struct e2fsck_struct {
 	int progress_pos;
 	int progress_last_percent;
 	unsigned int progress_last_time;
+	int progress_json;		/* -E progress_json */
+	double progress_interval;	/* seconds between -C fd updates */
+	int progress_pass;		/* pass the times below are for */
+	unsigned long progress_max;
+	unsigned long long progress_bytes_start;	/* read when it began */
+	struct timeval progress_start, progress_pass_start;
+	struct timeval progress_last_report;
 	int interactive;	/* Are we connected directly to a tty? */
 	char start_meta[2], stop_meta[2];
 
@@ -360,6 +471,16 @@ struct e2fsck_struct {
 	__u32 fs_ext_attr_blocks;
 	__u32 extent_depth_count[MAX_EXTENT_DEPTH_COUNT];
 
+	/* Work counters for the stats file */
+	unsigned long long inodes_scanned;
+	unsigned long long dir_blocks_checked;
+
+	/* Bytes taken by each of the big structures, now and at most */
+	struct e2fsck_mem_usage mem_usage[E2F_MEM_OWNERS];
+
+	/* Free blocks which pass 5 has yet to discard */
+	blk64_t discard_start, discard_count;
+
 	/* misc fields */
 	time_t now;
 	time_t time_fudge;	/* For working around buggy init scripts */
@@ -409,10 +530,26 @@ extern void read_bad_blocks_file(e2fsck_t ctx, const char *bad_blocks_file,
 /* crc32.c */
 extern __u32 crc32_be(__u32 crc, unsigned char const *p, size_t len);
 
+/* batch.c */
+extern char *e2fsck_batch(e2fsck_t ctx, int num_names, char **names);
+
+/* checkpoint.c */
+extern int e2fsck_checkpoint_unchanged(e2fsck_t ctx, const char **why);
+extern void e2fsck_save_checkpoint(e2fsck_t ctx);
+
+/* estimate.c */
+extern void e2fsck_estimate(e2fsck_t ctx);
+
+/* extents.c */
+extern void e2fsck_convert_extents(e2fsck_t ctx);
+
 /* dirinfo.c */
 extern void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent);
 extern void e2fsck_free_dir_info(e2fsck_t ctx);
+extern unsigned long long e2fsck_dir_info_size(ext2_filsys fs,
+					       ext2_ino_t num_dirs);
 extern int e2fsck_get_num_dirinfo(e2fsck_t ctx);
+extern unsigned long long e2fsck_dir_info_mem_usage(e2fsck_t ctx);
 extern struct dir_info_iter *e2fsck_dir_info_iter_begin(e2fsck_t ctx);
 extern struct dir_info *e2fsck_dir_info_iter(e2fsck_t ctx,
 					     struct dir_info_iter *);
@@ -431,7 +568,20 @@ extern void e2fsck_add_dx_dir(e2fsck_t ctx, ext2_ino_t ino, int num_blocks);
 extern struct dx_dir_info *e2fsck_get_dx_dir_info(e2fsck_t ctx, ext2_ino_t ino);
 extern void e2fsck_free_dx_dir_info(e2fsck_t ctx);
 extern int e2fsck_get_num_dx_dirinfo(e2fsck_t ctx);
+extern unsigned long long e2fsck_dx_dir_info_mem_usage(e2fsck_t ctx);
 extern struct dx_dir_info *e2fsck_dx_dir_info_iter(e2fsck_t ctx, int *control);
+extern struct dx_dirblock_info *e2fsck_dx_dirblock(e2fsck_t ctx,
+						   struct dx_dir_info *dx_dir,
+						   blk64_t blk);
+extern struct dx_dirblock_info *e2fsck_dx_dirblock_peek(struct dx_dir_info *dx_dir,
+							blk64_t blk);
+extern void e2fsck_free_dx_dirblocks(struct dx_dir_info *dx_dir);
+extern void e2fsck_save_dx_root(e2fsck_t ctx, ext2_ino_t ino, blk64_t blk,
+				const char *buf);
+extern int e2fsck_dx_root_saved(struct dx_dir_info *dx_dir, blk64_t blk);
+extern int e2fsck_get_dx_root(e2fsck_t ctx, struct dx_dir_info *dx_dir,
+			      blk64_t blk, char *buf);
+extern void e2fsck_forget_dx_roots(e2fsck_t ctx);
 
 /* ea_refcount.c */
 extern errcode_t ea_refcount_create(int size, ext2_refcount_t *ret);
@@ -444,6 +594,7 @@ extern errcode_t ea_refcount_decrement(ext2_refcount_t refcount,
 extern errcode_t ea_refcount_store(ext2_refcount_t refcount,
 				   blk64_t blk, int count);
 extern blk_t ext2fs_get_refcount_size(ext2_refcount_t refcount);
+extern unsigned long long ea_refcount_mem_usage(ext2_refcount_t refcount);
 extern void ea_refcount_intr_begin(ext2_refcount_t refcount);
 extern blk64_t ea_refcount_intr_next(ext2_refcount_t refcount, int *ret);
 
@@ -459,6 +610,12 @@ extern int e2fsck_fix_ext3_journal_hint(e2fsck_t ctx);
 
 /* logfile.c */
 extern void set_up_logging(e2fsck_t ctx);
+extern void set_up_output_buffer(e2fsck_t ctx);
+
+/* prefetch.c */
+extern void e2fsck_start_itable_prefetch(e2fsck_t ctx);
+extern void e2fsck_itable_prefetch_progress(e2fsck_t ctx, dgrp_t group);
+extern void e2fsck_stop_itable_prefetch(e2fsck_t ctx);
 
 /* quota.c */
 extern void e2fsck_hide_quota(e2fsck_t ctx);
@@ -481,6 +638,8 @@ extern int e2fsck_process_bad_inode(e2fsck_t ctx, ext2_ino_t dir,
 
 /* pass3.c */
 extern int e2fsck_reconnect_file(e2fsck_t ctx, ext2_ino_t inode);
+extern int e2fsck_reconnect_later(e2fsck_t ctx, ext2_ino_t inode);
+extern void e2fsck_reconnect_flush(e2fsck_t ctx);
 extern errcode_t e2fsck_expand_directory(e2fsck_t ctx, ext2_ino_t dir,
 					 int num, int gauranteed_size);
 extern ext2_ino_t e2fsck_get_lost_and_found(e2fsck_t ctx, int fix);
@@ -506,6 +665,10 @@ int check_backup_super_block(e2fsck_t ctx);
 void check_resize_inode(e2fsck_t ctx);
 
 /* util.c */
+extern char *e2fsck_scratch_dir(e2fsck_t ctx, unsigned long long bytes);
+extern int e2fsck_over_memory_budget(e2fsck_t ctx, unsigned long long bytes);
+extern int e2fsck_icount_fullmap_flag(e2fsck_t ctx);
+extern int e2fsck_process_inode_size(e2fsck_t ctx, unsigned int entry_size);
 extern void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
 				    const char *description);
 extern int ask(e2fsck_t ctx, const char * string, int def);
@@ -528,13 +691,19 @@ extern void print_resource_track(e2fsck_t ctx,
 				 const char *desc,
 				 struct resource_track *track,
 				 io_channel channel);
-extern void init_resource_track(struct resource_track *track,
+extern void init_resource_track(e2fsck_t ctx, struct resource_track *track,
 				io_channel channel);
 #else
 #define print_resource_track(ctx, desc, track, channel) do { } while (0)
-#define init_resource_track(track, channel) do { } while (0)
+#define init_resource_track(ctx, track, channel) do { } while (0)
 #endif
+extern void e2fsck_mem_account(e2fsck_t ctx, int owner,
+			       unsigned long long bytes);
+extern void e2fsck_mem_sample(e2fsck_t ctx);
 extern int inode_has_valid_blocks(struct ext2_inode *inode);
+extern int e2fsck_group_in_scope(e2fsck_t ctx, dgrp_t group);
+extern int e2fsck_ino_in_scope(e2fsck_t ctx, ext2_ino_t ino);
+extern int e2fsck_scope_inode_in_use(e2fsck_t ctx, ext2_ino_t ino);
 extern void e2fsck_read_inode(e2fsck_t ctx, unsigned long ino,
 			      struct ext2_inode * inode, const char * proc);
 extern void e2fsck_read_inode_full(e2fsck_t ctx, unsigned long ino,
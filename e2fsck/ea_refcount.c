@@ -18,21 +18,30 @@
 
 /*
  * The strategy we use for keeping track of EA refcounts is as
- * follows.  We keep a sorted array of first EA blocks and its
- * reference counts.  Once the refcount has dropped to zero, it is
- * removed from the array to save memory space.  Once the EA block is
- * checked, its bit is set in the block_ea_map bitmap.
+ * follows.  We keep an open-addressed hash table of EA blocks and
+ * their reference counts, probed linearly.  Entries whose refcount has
+ * dropped to zero are left in place, since removing an entry would
+ * break the probe sequences running through it; they are dropped when
+ * the table is rehashed into a bigger one, which happens once it is
+ * three quarters full.  Once the EA block is checked, its bit is set
+ * in the block_ea_map bitmap.
+ *
+ * The iterator returns the blocks in increasing order, so it sorts a
+ * snapshot of the table when it is started.
  */
 struct ea_refcount_el {
-	blk64_t	ea_blk;
+	blk64_t	ea_blk;		/* 0 if the slot is empty */
 	int	ea_count;
 };
 
 struct ea_refcount {
-	blk_t		count;
-	blk_t		size;
+	blk_t		count;		/* slots in use */
+	blk_t		size;		/* always a power of two */
+	int		shift;		/* 64 - log2(size) */
 	blk_t		cursor;
 	struct ea_refcount_el	*list;
+	struct ea_refcount_el	*iter;	/* sorted snapshot for the iterator */
+	blk_t		iter_count;
 };
 
 void ea_refcount_free(ext2_refcount_t refcount)
@@ -42,14 +51,39 @@ void ea_refcount_free(ext2_refcount_t refcount)
 
 	if (refcount->list)
 		ext2fs_free_mem(&refcount->list);
+	if (refcount->iter)
+		ext2fs_free_mem(&refcount->iter);
 	ext2fs_free_mem(&refcount);
 }
 
+static blk_t refcount_slot(ext2_refcount_t refcount, blk64_t blk)
+{
+	return (blk_t) ((blk * 0x9E3779B97F4A7C15ULL) >> refcount->shift);
+}
+
+static errcode_t refcount_alloc_table(ext2_refcount_t refcount, blk_t size)
+{
+	errcode_t	retval;
+	int		bits = 0;
+
+	while (((blk_t) 1 << bits) < size)
+		bits++;
+	size = (blk_t) 1 << bits;
+	retval = ext2fs_get_array(size, sizeof(struct ea_refcount_el),
+				  &refcount->list);
+	if (retval)
+		return retval;
+	memset(refcount->list, 0, (size_t) size * sizeof(struct ea_refcount_el));
+	refcount->size = size;
+	refcount->shift = 64 - bits;
+	refcount->count = 0;
+	return 0;
+}
+
 errcode_t ea_refcount_create(int size, ext2_refcount_t *ret)
 {
 	ext2_refcount_t	refcount;
 	errcode_t	retval;
-	size_t		bytes;
 
 	retval = ext2fs_get_mem(sizeof(struct ea_refcount), &refcount);
 	if (retval)
@@ -57,20 +91,15 @@ errcode_t ea_refcount_create(int size, ext2_refcount_t *ret)
 	memset(refcount, 0, sizeof(struct ea_refcount));
 
 	if (!size)
-		size = 500;
-	refcount->size = size;
-	bytes = (size_t) (size * sizeof(struct ea_refcount_el));
-#ifdef DEBUG
-	printf("Refcount allocated %d entries, %d bytes.\n",
-	       refcount->size, bytes);
-#endif
-	retval = ext2fs_get_mem(bytes, &refcount->list);
+		size = 512;
+	retval = refcount_alloc_table(refcount, size);
 	if (retval)
 		goto errout;
-	memset(refcount->list, 0, bytes);
-
-	refcount->count = 0;
-	refcount->cursor = 0;
+#ifdef DEBUG
+	printf("Refcount allocated %d entries, %lu bytes.\n",
+	       refcount->size, (unsigned long) refcount->size *
+	       sizeof(struct ea_refcount_el));
+#endif
 
 	*ret = refcount;
 	return 0;
@@ -81,128 +110,84 @@ errout:
 }
 
 /*
- * collapse_refcount() --- go through the refcount array, and get rid
- * of any count == zero entries
+ * refcount_rehash() --- move the entries whose count isn't zero into a
+ * 	table of new_size slots.
  */
-static void refcount_collapse(ext2_refcount_t refcount)
+static errcode_t refcount_rehash(ext2_refcount_t refcount, blk_t new_size)
 {
-	unsigned int	i, j;
-	struct ea_refcount_el	*list;
+	struct ea_refcount_el	*old = refcount->list, *el;
+	blk_t			old_size = refcount->size, i, slot;
+	errcode_t		retval;
 
-	list = refcount->list;
-	for (i = 0, j = 0; i < refcount->count; i++) {
-		if (list[i].ea_count) {
-			if (i != j)
-				list[j] = list[i];
-			j++;
+	retval = refcount_alloc_table(refcount, new_size);
+	if (retval) {
+		refcount->list = old;
+		return retval;
+	}
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].ea_count)
+			continue;
+		slot = refcount_slot(refcount, old[i].ea_blk);
+		el = &refcount->list[slot];
+		while (el->ea_blk) {
+			slot = (slot + 1) & (refcount->size - 1);
+			el = &refcount->list[slot];
 		}
+		*el = old[i];
+		refcount->count++;
 	}
 #if defined(DEBUG) || defined(TEST_PROGRAM)
-	printf("Refcount_collapse: size was %d, now %d\n",
-	       refcount->count, j);
+	printf("Refcount_rehash: size was %u, now %u, %u entries\n",
+	       old_size, refcount->size, refcount->count);
 #endif
-	refcount->count = j;
+	ext2fs_free_mem(&old);
+	return 0;
 }
 
-
+#ifdef TEST_PROGRAM
 /*
- * insert_refcount_el() --- Insert a new entry into the sorted list at a
- * 	specified position.
+ * collapse_refcount() --- get rid of any count == zero entries
  */
-static struct ea_refcount_el *insert_refcount_el(ext2_refcount_t refcount,
-						 blk64_t blk, int pos)
+static void refcount_collapse(ext2_refcount_t refcount)
 {
-	struct ea_refcount_el 	*el;
-	errcode_t		retval;
-	blk_t			new_size = 0;
-	int			num;
-
-	if (refcount->count >= refcount->size) {
-		new_size = refcount->size + 100;
-#ifdef DEBUG
-		printf("Reallocating refcount %d entries...\n", new_size);
-#endif
-		retval = ext2fs_resize_mem((size_t) refcount->size *
-					   sizeof(struct ea_refcount_el),
-					   (size_t) new_size *
-					   sizeof(struct ea_refcount_el),
-					   &refcount->list);
-		if (retval)
-			return 0;
-		refcount->size = new_size;
-	}
-	num = (int) refcount->count - pos;
-	if (num < 0)
-		return 0;	/* should never happen */
-	if (num) {
-		memmove(&refcount->list[pos+1], &refcount->list[pos],
-			sizeof(struct ea_refcount_el) * num);
-	}
-	refcount->count++;
-	el = &refcount->list[pos];
-	el->ea_count = 0;
-	el->ea_blk = blk;
-	return el;
+	(void) refcount_rehash(refcount, refcount->size);
 }
-
+#endif
 
 /*
  * get_refcount_el() --- given an block number, try to find refcount
- * 	information in the sorted list.  If the create flag is set,
- * 	and we can't find an entry, create one in the sorted list.
+ * 	information in the hash table.  If the create flag is set,
+ * 	and we can't find an entry, create one.
  */
 static struct ea_refcount_el *get_refcount_el(ext2_refcount_t refcount,
 					      blk64_t blk, int create)
 {
-	int	low, high, mid;
+	struct ea_refcount_el	*el;
+	blk_t			slot;
 
-	if (!refcount || !refcount->list)
+	if (!refcount || !refcount->list || !blk)
 		return 0;
 retry:
-	low = 0;
-	high = (int) refcount->count-1;
-	if (create && ((refcount->count == 0) ||
-		       (blk > refcount->list[high].ea_blk))) {
-		if (refcount->count >= refcount->size)
-			refcount_collapse(refcount);
-
-		return insert_refcount_el(refcount, blk,
-					  (unsigned) refcount->count);
+	slot = refcount_slot(refcount, blk);
+	el = &refcount->list[slot];
+	while (el->ea_blk) {
+		if (el->ea_blk == blk)
+			return el;
+		slot = (slot + 1) & (refcount->size - 1);
+		el = &refcount->list[slot];
 	}
-	if (refcount->count == 0)
+	if (!create)
 		return 0;
 
-	if (refcount->cursor >= refcount->count)
-		refcount->cursor = 0;
-	if (blk == refcount->list[refcount->cursor].ea_blk)
-		return &refcount->list[refcount->cursor++];
-#ifdef DEBUG
-	printf("Non-cursor get_refcount_el: %u\n", blk);
-#endif
-	while (low <= high) {
-		mid = (low+high)/2;
-		if (blk == refcount->list[mid].ea_blk) {
-			refcount->cursor = mid+1;
-			return &refcount->list[mid];
-		}
-		if (blk < refcount->list[mid].ea_blk)
-			high = mid-1;
-		else
-			low = mid+1;
-	}
-	/*
-	 * If we need to create a new entry, it should be right at
-	 * low (where high will be left at low-1).
-	 */
-	if (create) {
-		if (refcount->count >= refcount->size) {
-			refcount_collapse(refcount);
-			if (refcount->count < refcount->size)
-				goto retry;
-		}
-		return insert_refcount_el(refcount, blk, low);
+	if (refcount->count >= refcount->size / 4 * 3) {
+		if (refcount_rehash(refcount, refcount->size * 2))
+			return 0;
+		goto retry;
 	}
-	return 0;
+	refcount->count++;
+	el->ea_blk = blk;
+	el->ea_count = 0;
+	return el;
 }
 
 errcode_t ea_refcount_fetch(ext2_refcount_t refcount, blk64_t blk,
@@ -270,28 +255,56 @@ blk_t ext2fs_get_refcount_size(ext2_refcount_t refcount)
 	return refcount->size;
 }
 
+/* How many bytes of memory the refcount takes */
+unsigned long long ea_refcount_mem_usage(ext2_refcount_t refcount)
+{
+	if (!refcount)
+		return 0;
+
+	return sizeof(struct ea_refcount) +
+		((unsigned long long) refcount->size +
+		 (refcount->iter ? refcount->iter_count : 0)) *
+		sizeof(struct ea_refcount_el);
+}
+
+static EXT2_QSORT_TYPE refcount_el_cmp(const void *a, const void *b)
+{
+	const struct ea_refcount_el *el_a = a, *el_b = b;
+
+	return (el_a->ea_blk > el_b->ea_blk) - (el_a->ea_blk < el_b->ea_blk);
+}
+
 void ea_refcount_intr_begin(ext2_refcount_t refcount)
 {
+	blk_t	i, n = 0;
+
 	refcount->cursor = 0;
+	refcount->iter_count = 0;
+	if (refcount->iter)
+		ext2fs_free_mem(&refcount->iter);
+	if (ext2fs_get_array(refcount->count ? refcount->count : 1,
+			     sizeof(struct ea_refcount_el), &refcount->iter))
+		return;
+	for (i = 0; i < refcount->size; i++)
+		if (refcount->list[i].ea_count)
+			refcount->iter[n++] = refcount->list[i];
+	qsort(refcount->iter, n, sizeof(struct ea_refcount_el),
+	      refcount_el_cmp);
+	refcount->iter_count = n;
 }
 
 
 blk64_t ea_refcount_intr_next(ext2_refcount_t refcount,
 				int *ret)
 {
-	struct ea_refcount_el	*list;
+	struct ea_refcount_el	*el;
 
-	while (1) {
-		if (refcount->cursor >= refcount->count)
-			return 0;
-		list = refcount->list;
-		if (list[refcount->cursor].ea_count) {
-			if (ret)
-				*ret = list[refcount->cursor].ea_count;
-			return list[refcount->cursor++].ea_blk;
-		}
-		refcount->cursor++;
-	}
+	if (refcount->cursor >= refcount->iter_count)
+		return 0;
+	el = &refcount->iter[refcount->cursor++];
+	if (ret)
+		*ret = el->ea_count;
+	return el->ea_blk;
 }
 
 
@@ -300,22 +313,29 @@ blk64_t ea_refcount_intr_next(ext2_refcount_t refcount,
 errcode_t ea_refcount_validate(ext2_refcount_t refcount, FILE *out)
 {
 	errcode_t	ret = 0;
-	int		i;
+	blk_t		i, used = 0;
 	const char *bad = "bad refcount";
 
 	if (refcount->count > refcount->size) {
 		fprintf(out, "%s: count > size\n", bad);
 		return EXT2_ET_INVALID_ARGUMENT;
 	}
-	for (i=1; i < refcount->count; i++) {
-		if (refcount->list[i-1].ea_blk >= refcount->list[i].ea_blk) {
-			fprintf(out,
-				"%s: list[%d].blk=%llu, list[%d].blk=%llu\n",
-				bad, i-1, refcount->list[i-1].ea_blk,
-				i, refcount->list[i].ea_blk);
+	for (i = 0; i < refcount->size; i++) {
+		if (!refcount->list[i].ea_blk)
+			continue;
+		used++;
+		if (get_refcount_el(refcount, refcount->list[i].ea_blk, 0) !=
+		    &refcount->list[i]) {
+			fprintf(out, "%s: list[%u].blk=%llu can't be found\n",
+				bad, i, refcount->list[i].ea_blk);
 			ret = EXT2_ET_INVALID_ARGUMENT;
 		}
 	}
+	if (used != refcount->count) {
+		fprintf(out, "%s: %u slots used, count is %u\n", bad,
+			used, refcount->count);
+		ret = EXT2_ET_INVALID_ARGUMENT;
+	}
 	return ret;
 }
 
@@ -0,0 +1,341 @@
+/*
+ * estimate.c --- predict how long a check will take and what it needs
+ *
+ * "e2fsck -E estimate" opens the file system read-only and, instead
+ * of checking it, reads the group descriptors and the allocation
+ * bitmaps and prints how much each pass will read, about how long
+ * that will take, and how much memory e2fsck's main data structures
+ * will need.
+ *
+ * The group descriptors give exact counts of the inodes and blocks in
+ * use, the directories and the in-use inode table blocks.  Everything
+ * else is a guess made without reading any inodes: each run of
+ * allocated blocks in the block bitmaps is taken to be one extent,
+ * and directories are assumed to have two blocks each, which is what
+ * ext2fs_init_dblist() allows for.  The read speeds used are measured
+ * while reading the bitmaps and a piece of the first inode table; if
+ * those are already in the page cache, the times will be too low.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "e2fsck.h"
+
+/* struct bmap_rb_extent (blkmap64_rb.c) plus malloc overhead */
+#define RB_EXTENT_BYTES		48
+
+/* struct ext2_icount_el (icount.c) */
+#define ICOUNT_EL_BYTES		8
+
+/* How much of the first inode table to read to time sequential reads */
+#define SEQ_SAMPLE_BLOCKS	1024
+
+struct estimate {
+	unsigned long long	inodes_used;
+	unsigned long long	blocks_used;
+	unsigned long long	dirs;
+	unsigned long long	block_runs;
+	unsigned long long	inode_runs;
+	unsigned long long	itable_blocks;
+	unsigned long long	bitmap_blocks;
+	double			bitmap_secs;
+	double			seq_bytes_per_sec;
+	double			secs_per_block;
+};
+
+static double now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Count the runs of set bits in the first nbits bits of buf */
+static unsigned long long count_runs(const unsigned char *buf, int nbits)
+{
+	unsigned long long runs = 0;
+	int		i, bit, prev = 0;
+
+	for (i = 0; i < nbits; i++) {
+		if ((i & 7) == 0 && i + 8 <= nbits &&
+		    (buf[i >> 3] == 0 || buf[i >> 3] == 0xFF)) {
+			bit = buf[i >> 3] != 0;
+			if (bit && !prev)
+				runs++;
+			prev = bit;
+			i += 7;
+			continue;
+		}
+		bit = (buf[i >> 3] >> (i & 7)) & 1;
+		if (bit && !prev)
+			runs++;
+		prev = bit;
+	}
+	return runs;
+}
+
+static errcode_t read_bitmap(ext2_filsys fs, blk64_t blk, int nbits,
+			     char *buf, struct estimate *est,
+			     unsigned long long *runs)
+{
+	errcode_t	retval;
+	double		start;
+
+	if (!blk || blk >= ext2fs_blocks_count(fs->super))
+		return EXT2_ET_BAD_BLOCK_NUM;
+	start = now();
+	retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+	if (retval)
+		return retval;
+	est->bitmap_secs += now() - start;
+	est->bitmap_blocks++;
+	if (nbits > fs->blocksize * 8)
+		nbits = fs->blocksize * 8;
+	*runs += count_runs((unsigned char *) buf, nbits);
+	return 0;
+}
+
+static errcode_t scan_groups(ext2_filsys fs, struct estimate *est)
+{
+	unsigned long long free_blocks = 0, free_inodes = 0;
+	blk64_t		count;
+	char		*buf;
+	errcode_t	retval;
+	dgrp_t		group;
+	ext2_ino_t	num_dirs;
+	int		csum_flag, nbits;
+	__u32		used;
+
+	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					       EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+	for (group = 0; group < fs->group_desc_count; group++) {
+		free_blocks += ext2fs_bg_free_blocks_count(fs, group);
+		free_inodes += ext2fs_bg_free_inodes_count(fs, group);
+
+		if (!csum_flag ||
+		    !ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT)) {
+			nbits = EXT2_CLUSTERS_PER_GROUP(fs->super);
+			if (group == fs->group_desc_count - 1)
+				nbits = EXT2FS_NUM_B2C(fs,
+					ext2fs_blocks_count(fs->super) -
+					ext2fs_group_first_block2(fs, group));
+			retval = read_bitmap(fs,
+					     ext2fs_block_bitmap_loc(fs, group),
+					     nbits, buf, est, &est->block_runs);
+			if (retval)
+				goto out;
+		} else
+			est->block_runs++;	/* the group's metadata */
+
+		if (csum_flag &&
+		    ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+			continue;
+		retval = read_bitmap(fs, ext2fs_inode_bitmap_loc(fs, group),
+				     EXT2_INODES_PER_GROUP(fs->super), buf,
+				     est, &est->inode_runs);
+		if (retval)
+			goto out;
+
+		count = fs->inode_blocks_per_group;
+		if (csum_flag) {
+			used = EXT2_INODES_PER_GROUP(fs->super) -
+				ext2fs_bg_itable_unused(fs, group);
+			count = ((unsigned long long) used *
+				 EXT2_INODE_SIZE(fs->super) +
+				 fs->blocksize - 1) / fs->blocksize;
+			if (count > fs->inode_blocks_per_group)
+				count = fs->inode_blocks_per_group;
+		}
+		est->itable_blocks += count;
+	}
+
+	est->blocks_used = ext2fs_blocks_count(fs->super) -
+		EXT2FS_C2B(fs, free_blocks);
+	est->inodes_used = fs->super->s_inodes_count - free_inodes;
+	retval = ext2fs_get_num_dirs(fs, &num_dirs);
+	if (retval)
+		goto out;
+	est->dirs = num_dirs;
+out:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+/* Time a sequential read from the first inode table */
+static errcode_t time_sequential_read(ext2_filsys fs, struct estimate *est)
+{
+	blk64_t		blk, count;
+	char		*buf;
+	errcode_t	retval;
+	double		start, secs;
+
+	blk = ext2fs_inode_table_loc(fs, 0);
+	count = fs->inode_blocks_per_group;
+	if (count > SEQ_SAMPLE_BLOCKS)
+		count = SEQ_SAMPLE_BLOCKS;
+	if (!blk || blk + count > ext2fs_blocks_count(fs->super))
+		return EXT2_ET_BAD_BLOCK_NUM;
+	retval = ext2fs_get_array(count, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	start = now();
+	retval = io_channel_read_blk64(fs->io, blk, count, buf);
+	secs = now() - start;
+	ext2fs_free_mem(&buf);
+	if (retval)
+		return retval;
+	if (secs > 0)
+		est->seq_bytes_per_sec = count * fs->blocksize / secs;
+	return 0;
+}
+
+static void print_size(e2fsck_t ctx, const char *what,
+		       unsigned long long bytes)
+{
+	if (bytes >= 10ULL << 30)
+		log_out(ctx, "  %-28s %8llu GB\n", what, bytes >> 30);
+	else if (bytes >= 10ULL << 20)
+		log_out(ctx, "  %-28s %8llu MB\n", what, bytes >> 20);
+	else
+		log_out(ctx, "  %-28s %8llu KB\n", what, (bytes + 1023) >> 10);
+}
+
+static void print_time(e2fsck_t ctx, const char *what, const char *io,
+		       double secs)
+{
+	log_out(ctx, "  %-28s %-30s ", what, io);
+	if (secs < 0)
+		log_out(ctx, "%s\n", _("in memory"));
+	else if (secs < 100)
+		log_out(ctx, "%8.1f s\n", secs);
+	else
+		log_out(ctx, "%8.1f min\n", secs / 60);
+}
+
+static void print_estimate(e2fsck_t ctx, struct estimate *est)
+{
+	ext2_filsys	fs = ctx->fs;
+	unsigned long long meta_blocks, dir_blocks, files, per_block;
+	unsigned long long bitmaps, dir_map, icounts, dirinfo, dblist, total;
+	double		seq_time, rand_time;
+	char		io[64];
+
+	/*
+	 * Pass 1 reads an extent tree block for each file with more than
+	 * the four extents that fit in its inode, or an indirect block
+	 * for every blocksize/4 blocks mapped the old way.
+	 */
+	files = est->inodes_used - est->dirs;
+	if (EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+				      EXT3_FEATURE_INCOMPAT_EXTENTS)) {
+		per_block = (fs->blocksize - sizeof(struct ext3_extent_header)) /
+			sizeof(struct ext3_extent);
+		meta_blocks = est->block_runs > 4 * files ?
+			(est->block_runs - 4 * files) / per_block : 0;
+	} else
+		meta_blocks = est->blocks_used / (fs->blocksize / 4);
+	dir_blocks = est->dirs * 2 + 12;
+
+	log_out(ctx, _("Estimated check of %s (no checking was done):\n\n"),
+		ctx->device_name);
+	log_out(ctx, _("  %llu/%u inodes in use, %llu directories, "
+		       "%llu/%llu blocks in use\n"),
+		est->inodes_used, fs->super->s_inodes_count, est->dirs,
+		est->blocks_used, ext2fs_blocks_count(fs->super));
+	log_out(ctx, _("  about %llu extents, %llu extent tree or "
+		       "indirect blocks\n"), est->block_runs, meta_blocks);
+	if (est->seq_bytes_per_sec > 0)
+		log_out(ctx, _("  read speed: %.1f MB/s sequential, "
+			       "%.3f ms per scattered block\n\n"),
+			est->seq_bytes_per_sec / (1 << 20),
+			est->secs_per_block * 1000);
+	else
+		log_out(ctx, "\n");
+
+	seq_time = est->seq_bytes_per_sec > 0 ?
+		est->itable_blocks * fs->blocksize / est->seq_bytes_per_sec : 0;
+	rand_time = meta_blocks * est->secs_per_block;
+	snprintf(io, sizeof(io), _("%llu MB inode tables"),
+		 (est->itable_blocks * fs->blocksize) >> 20);
+	print_time(ctx, _("Pass 1 (inodes, blocks):"), io,
+		   seq_time + rand_time);
+	snprintf(io, sizeof(io), _("%llu directory blocks"), dir_blocks);
+	print_time(ctx, _("Pass 2 (directories):"), io,
+		   dir_blocks * est->secs_per_block);
+	print_time(ctx, _("Pass 3 (connectivity):"), "", -1);
+	print_time(ctx, _("Pass 4 (reference counts):"), "", -1);
+	snprintf(io, sizeof(io), _("%llu bitmap blocks"), est->bitmap_blocks);
+	print_time(ctx, _("Pass 5 (group summaries):"), io, est->bitmap_secs);
+
+	/*
+	 * The inode and block bitmaps are red-black trees of extents.
+	 * The directory map is a plain bitmap once directories make up
+	 * more than 1/320 of the inodes (EXT2FS_BMAP64_AUTODIR).
+	 */
+	bitmaps = (2 * est->block_runs + 3 * est->inode_runs) *
+		RB_EXTENT_BYTES;
+	if (est->dirs > fs->super->s_inodes_count / 320)
+		dir_map = fs->super->s_inodes_count / 8;
+	else
+		dir_map = est->dirs * RB_EXTENT_BYTES;
+	if (e2fsck_icount_fullmap_flag(ctx))
+		icounts = 2 * 2 * (fs->super->s_inodes_count + 1ULL);
+	else
+		icounts = 2 * (est->dirs + fs->super->s_inodes_count / 50) *
+			ICOUNT_EL_BYTES;
+	dirinfo = e2fsck_dir_info_size(fs, est->dirs);
+	dblist = dir_blocks * sizeof(struct ext2_db_entry2);
+	total = bitmaps + dir_map + icounts + dirinfo + dblist;
+
+	log_out(ctx, "\n");
+	print_size(ctx, _("Inode and block bitmaps:"), bitmaps + dir_map);
+	print_size(ctx, _("Inode reference counts:"), icounts);
+	print_size(ctx, _("Directory information:"), dirinfo);
+	print_size(ctx, _("Directory block list:"), dblist);
+	print_size(ctx, _("Peak memory, at least:"), total);
+
+	if (ctx->max_memory &&
+	    (e2fsck_over_memory_budget(ctx, dblist) ||
+	     e2fsck_over_memory_budget(ctx, dirinfo) ||
+	     e2fsck_over_memory_budget(ctx, icounts / 2)))
+		log_out(ctx, _("\nWith max_memory=%llu, some of these will "
+			       "be kept in scratch files.\n"),
+			ctx->max_memory);
+}
+
+/*
+ * Print the estimate for ctx->fs.  Only the group descriptors, the
+ * bitmaps and the start of the first inode table are read.
+ */
+void e2fsck_estimate(e2fsck_t ctx)
+{
+	struct estimate	est;
+	errcode_t	retval;
+
+	memset(&est, 0, sizeof(est));
+	retval = scan_groups(ctx->fs, &est);
+	if (retval) {
+		com_err(ctx->program_name, retval,
+			_("while reading the bitmaps of %s"),
+			ctx->device_name);
+		return;
+	}
+	if (est.bitmap_blocks)
+		est.secs_per_block = est.bitmap_secs / est.bitmap_blocks;
+	retval = time_sequential_read(ctx->fs, &est);
+	if (retval)
+		com_err(ctx->program_name, retval, "%s",
+			_("while timing inode table reads"));
+	print_estimate(ctx, &est);
+}
@@ -0,0 +1,380 @@
+/*
+ * extents.c --- convert block-mapped files to extent trees
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ *
+ * With "-E bmap2extent", once all the passes have run and the file
+ * system is known to be consistent, every regular file, directory and
+ * slow symlink which is still mapped through indirect blocks is given
+ * an extent tree instead.  The mapping is read with
+ * ext2fs_block_iterate3(), turned into a list of extents, and loaded
+ * in one go with ext2fs_extent_build_from_list(); the indirect blocks
+ * are released once the new tree has been written.
+ *
+ * With "-E bmap2extent=relocate", a file whose data is in at least
+ * twice as many pieces as it would be if it were contiguous is also
+ * copied into a single run of free space, if one can be found, before
+ * its tree is built.  The old blocks are only released after the inode
+ * points at the copy.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "e2fsck.h"
+#include "problem.h"
+
+/* How much file data is copied at a time when relocating */
+#define COPY_CHUNK_BYTES	(4 * 1024 * 1024)
+
+struct convert_struct {
+	e2fsck_t		ctx;
+	struct ext2fs_extent	*list;		/* the data, as extents */
+	unsigned int		count, max;
+	blk64_t			*meta;		/* the indirect blocks */
+	unsigned int		meta_count, meta_max;
+	blk64_t			data_blocks;
+	blk64_t			fail_len;	/* no free run this long */
+	char			*buf;		/* for copying */
+	unsigned int		buf_blocks;
+	errcode_t		errcode;
+	unsigned int		converted, relocated;
+};
+
+static int collect_blocks(ext2_filsys fs EXT2FS_ATTR((unused)),
+			  blk64_t *blocknr, e2_blkcnt_t blockcnt,
+			  blk64_t ref_blk EXT2FS_ATTR((unused)),
+			  int ref_offset EXT2FS_ATTR((unused)),
+			  void *priv_data)
+{
+	struct convert_struct *cs = (struct convert_struct *) priv_data;
+	struct ext2fs_extent *ex;
+
+	if (blockcnt < 0) {
+		if (cs->meta_count == cs->meta_max) {
+			cs->errcode = ext2fs_resize_mem(cs->meta_max *
+							sizeof(blk64_t),
+					(cs->meta_max + 64) * sizeof(blk64_t),
+					&cs->meta);
+			if (cs->errcode)
+				return BLOCK_ABORT;
+			cs->meta_max += 64;
+		}
+		cs->meta[cs->meta_count++] = *blocknr;
+		return 0;
+	}
+
+	cs->data_blocks++;
+	if (cs->count) {
+		ex = &cs->list[cs->count - 1];
+		if (ex->e_lblk + ex->e_len == (blk64_t) blockcnt &&
+		    ex->e_pblk + ex->e_len == *blocknr &&
+		    ex->e_len < EXT_INIT_MAX_LEN) {
+			ex->e_len++;
+			return 0;
+		}
+	}
+	if (cs->count == cs->max) {
+		cs->errcode = ext2fs_resize_mem(cs->max *
+						sizeof(struct ext2fs_extent),
+				(cs->max + 256) * sizeof(struct ext2fs_extent),
+				&cs->list);
+		if (cs->errcode)
+			return BLOCK_ABORT;
+		cs->max += 256;
+	}
+	ex = &cs->list[cs->count++];
+	ex->e_lblk = blockcnt;
+	ex->e_pblk = *blocknr;
+	ex->e_len = 1;
+	ex->e_flags = 0;
+	return 0;
+}
+
+/*
+ * Look for len free blocks in a row, starting at goal and wrapping
+ * around to the start of the file system.
+ */
+static int find_free_run(ext2_filsys fs, blk64_t goal, blk64_t len,
+			 blk64_t *ret)
+{
+	blk64_t	first = fs->super->s_first_data_block;
+	blk64_t	last = ext2fs_blocks_count(fs->super) - 1;
+	blk64_t	start, next, b = goal;
+	int	wrapped = 0;
+
+	while (1) {
+		if (b > last || (wrapped && b >= goal)) {
+			if (wrapped)
+				return 0;
+			wrapped = 1;
+			b = first;
+			continue;
+		}
+		if (ext2fs_find_first_zero_block_bitmap2(fs->block_map, b,
+							 last, &start) ||
+		    start + len - 1 > last) {
+			b = last + 1;
+			continue;
+		}
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map, start,
+							start + len - 1,
+							&next)) {
+			*ret = start;
+			return 1;
+		}
+		b = next + 1;
+	}
+}
+
+/*
+ * Copy the file's data into one run of free space, and point the
+ * extent list at the copy, merging extents which are now adjacent.
+ * Returns how many extents the copy takes, or 0 if the file stays put.
+ */
+static int relocate_file(struct convert_struct *cs, ext2_ino_t ino)
+{
+	ext2_filsys	fs = cs->ctx->fs;
+	struct ext2fs_extent *ex;
+	blk64_t		goal, start, dest, done, n;
+	unsigned int	i, j, runs;
+	errcode_t	retval;
+
+	/* Only bother with files which would end up in far fewer pieces */
+	for (i = 1, runs = 1; i < cs->count; i++)
+		if (cs->list[i].e_lblk !=
+		    cs->list[i - 1].e_lblk + cs->list[i - 1].e_len)
+			runs++;
+	runs += cs->data_blocks / EXT_INIT_MAX_LEN;
+	if (cs->count < 2 * runs)
+		return 0;
+
+	if (cs->data_blocks >= cs->fail_len)
+		return 0;
+	goal = ext2fs_group_first_block2(fs, ext2fs_group_of_ino(fs, ino));
+	if (!find_free_run(fs, goal, cs->data_blocks, &start)) {
+		cs->fail_len = cs->data_blocks;
+		return 0;
+	}
+
+	if (!cs->buf) {
+		cs->buf_blocks = COPY_CHUNK_BYTES / fs->blocksize;
+		retval = ext2fs_get_mem(COPY_CHUNK_BYTES, &cs->buf);
+		if (retval)
+			return 0;
+	}
+	ext2fs_block_alloc_stats_range(fs, start, cs->data_blocks, +1);
+
+	dest = start;
+	for (i = 0; i < cs->count; i++) {
+		ex = &cs->list[i];
+		for (done = 0; done < ex->e_len; done += n) {
+			n = ex->e_len - done;
+			if (n > cs->buf_blocks)
+				n = cs->buf_blocks;
+			retval = io_channel_read_blk64(fs->io,
+						       ex->e_pblk + done, n,
+						       cs->buf);
+			if (!retval)
+				retval = io_channel_write_blk64(fs->io,
+							dest + done, n,
+							cs->buf);
+			if (retval)
+				goto fail;
+		}
+		dest += ex->e_len;
+	}
+	/* The copy must be on disk before anything points at it */
+	retval = io_channel_flush(fs->io);
+	if (retval)
+		goto fail;
+
+	/*
+	 * Keep the old extents at the end of the list, so that their
+	 * blocks can be released once the new tree is in place.
+	 */
+	if (cs->max < 2 * cs->count) {
+		retval = ext2fs_resize_mem(cs->max *
+					   sizeof(struct ext2fs_extent),
+					   2 * cs->count *
+					   sizeof(struct ext2fs_extent),
+					   &cs->list);
+		if (retval)
+			goto fail;
+		cs->max = 2 * cs->count;
+	}
+	memcpy(cs->list + cs->count, cs->list,
+	       cs->count * sizeof(struct ext2fs_extent));
+	dest = start;
+	for (i = 0, j = 0; i < cs->count; i++) {
+		ex = &cs->list[cs->count + i];
+		if (j && cs->list[j - 1].e_lblk + cs->list[j - 1].e_len ==
+		    ex->e_lblk &&
+		    cs->list[j - 1].e_len + ex->e_len <= EXT_INIT_MAX_LEN) {
+			cs->list[j - 1].e_len += ex->e_len;
+		} else {
+			cs->list[j] = *ex;
+			cs->list[j].e_pblk = dest;
+			j++;
+		}
+		dest += ex->e_len;
+	}
+	/* Move the old extents down to just after the new ones */
+	memmove(cs->list + j, cs->list + cs->count,
+		cs->count * sizeof(struct ext2fs_extent));
+	return j;
+
+fail:
+	ext2fs_block_alloc_stats_range(fs, start, cs->data_blocks, -1);
+	return 0;
+}
+
+static void convert_inode(struct convert_struct *cs, ext2_ino_t ino,
+			  struct ext2_inode *inode)
+{
+	e2fsck_t	ctx = cs->ctx;
+	ext2_filsys	fs = ctx->fs;
+	struct problem_context pctx;
+	struct ext2_inode save;
+	struct ext2fs_extent *ex;
+	unsigned int	i, new_count = 0, old_count;
+	blk64_t		tree_blocks;
+	int		unit;
+
+	clear_problem_context(&pctx);
+	pctx.ino = ino;
+
+	cs->count = cs->meta_count = 0;
+	cs->data_blocks = 0;
+	cs->errcode = 0;
+	pctx.errcode = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY,
+					     0, collect_blocks, cs);
+	if (!pctx.errcode)
+		pctx.errcode = cs->errcode;
+	if (pctx.errcode)
+		goto err;
+	if (cs->count == 0)
+		return;
+
+	old_count = cs->count;
+	if (ctx->options & E2F_OPT_CONVERT_RELOCATE)
+		new_count = relocate_file(cs, ino);
+
+	save = *inode;
+	ext2fs_iblk_sub_blocks(fs, inode, cs->meta_count);
+	tree_blocks = ext2fs_inode_i_blocks(fs, inode);
+	pctx.errcode = ext2fs_extent_build_from_list(fs, ino, inode, cs->list,
+				new_count ? new_count : old_count);
+	if (pctx.errcode) {
+		*inode = save;
+		if (new_count) {
+			for (i = 0; i < new_count; i++)
+				ext2fs_block_alloc_stats_range(fs,
+					cs->list[i].e_pblk,
+					cs->list[i].e_len, -1);
+		}
+		goto err;
+	}
+
+	for (i = 0; i < cs->meta_count; i++)
+		ext2fs_block_alloc_stats2(fs, cs->meta[i], -1);
+	if (new_count) {
+		for (i = 0; i < old_count; i++) {
+			ex = &cs->list[new_count + i];
+			ext2fs_block_alloc_stats_range(fs, ex->e_pblk,
+						       ex->e_len, -1);
+		}
+		cs->relocated++;
+	}
+	if (new_count)
+		cs->fail_len = ~0ULL;
+
+	/* i_blocks counts file system blocks for huge files */
+	unit = (inode->i_flags & EXT4_HUGE_FILE_FL) ? fs->blocksize : 512;
+	tree_blocks = ext2fs_inode_i_blocks(fs, inode) - tree_blocks;
+	quota_data_sub(ctx->qctx, inode, ino,
+		       (qsize_t) cs->meta_count * fs->blocksize);
+	quota_data_add(ctx->qctx, inode, ino, (qsize_t) tree_blocks * unit);
+	cs->converted++;
+	return;
+
+err:
+	fix_problem(ctx, PR_6_BMAP2EXTENT_ERROR, &pctx);
+}
+
+void e2fsck_convert_extents(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct convert_struct cs;
+	struct problem_context pctx;
+	ext2_inode_scan	scan;
+	struct ext2_inode inode;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_BIGALLOC))
+		return;
+
+	clear_problem_context(&pctx);
+	fix_problem(ctx, PR_6_BMAP2EXTENT_HEADER, &pctx);
+	if (!EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+				       EXT3_FEATURE_INCOMPAT_EXTENTS)) {
+		fs->super->s_feature_incompat |=
+			EXT3_FEATURE_INCOMPAT_EXTENTS;
+		ext2fs_mark_super_dirty(fs);
+	}
+
+	memset(&cs, 0, sizeof(cs));
+	cs.ctx = ctx;
+	cs.fail_len = ~0ULL;
+
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval) {
+		pctx.errcode = retval;
+		fix_problem(ctx, PR_1_ISCAN_ERROR, &pctx);
+		return;
+	}
+	while (1) {
+		retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+			continue;
+		if (retval) {
+			pctx.errcode = retval;
+			fix_problem(ctx, PR_1_ISCAN_ERROR, &pctx);
+			break;
+		}
+		if (!ino)
+			break;
+		if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
+			break;
+		if (ino != EXT2_ROOT_INO &&
+		    ino < EXT2_FIRST_INODE(fs->super))
+			continue;
+		if (!inode.i_links_count || inode.i_dtime ||
+		    (inode.i_flags & EXT4_EXTENTS_FL))
+			continue;
+		if (!LINUX_S_ISREG(inode.i_mode) &&
+		    !LINUX_S_ISDIR(inode.i_mode) &&
+		    !LINUX_S_ISLNK(inode.i_mode))
+			continue;
+		if (!ext2fs_inode_has_valid_blocks2(fs, &inode))
+			continue;
+		convert_inode(&cs, ino, &inode);
+	}
+	ext2fs_close_inode_scan(scan);
+
+	if (!(ctx->options & E2F_OPT_PREEN)) {
+		log_out(ctx, _("%u files converted to extents"),
+			cs.converted);
+		if (ctx->options & E2F_OPT_CONVERT_RELOCATE)
+			log_out(ctx, _(", %u of them relocated"),
+				cs.relocated);
+		log_out(ctx, "\n");
+	}
+	ext2fs_free_mem(&cs.list);
+	ext2fs_free_mem(&cs.meta);
+	ext2fs_free_mem(&cs.buf);
+}
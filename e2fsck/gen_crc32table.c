@@ -20,6 +20,7 @@
 
 static uint32_t crc32table_le[LE_TABLE_SIZE];
 static uint32_t crc32table_be[BE_TABLE_SIZE];
+static uint32_t crc32table_be_slice[8][256];
 
 /**
  * crc32init_le() - allocate and initialize LE table data
@@ -59,6 +60,31 @@ static void crc32init_be(void)
 	}
 }
 
+/**
+ * crc32init_be_slice() - initialize the slice-by-8 BE tables
+ *
+ * crc32table_be_slice[n][i] is the CRC of the byte i followed by n zero
+ * bytes, so that eight bytes can be folded in with independent lookups.
+ */
+static void crc32init_be_slice(void)
+{
+	unsigned i, j, k;
+	uint32_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = (uint32_t) i << 24;
+		for (j = 0; j < 8; j++)
+			crc = (crc << 1) ^ ((crc & 0x80000000) ? CRCPOLY_BE : 0);
+		crc32table_be_slice[0][i] = crc;
+	}
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++) {
+			crc = crc32table_be_slice[k - 1][i];
+			crc32table_be_slice[k][i] = (crc << 8) ^
+				crc32table_be_slice[0][crc >> 24];
+		}
+}
+
 static void output_table(uint32_t table[], int len, const char *trans)
 {
 	int i;
@@ -90,7 +116,18 @@ int main(int argc ATTR((unused)), char** argv ATTR((unused)))
 	}
 	printf("#endif /* UNITTEST */\n");
 
-	if (CRC_BE_BITS > 1) {
+	if (CRC_BE_BITS == 8) {
+		int k;
+
+		crc32init_be_slice();
+		printf("static const __u32 crc32table_be_slice[8][256] = {");
+		for (k = 0; k < 8; k++) {
+			printf("{");
+			output_table(crc32table_be_slice[k], 256, "");
+			printf("}%s", k < 7 ? ", " : "");
+		}
+		printf("};\n");
+	} else if (CRC_BE_BITS > 1) {
 		crc32init_be();
 		printf("static const __u32 crc32table_be[] = {");
 		output_table(crc32table_be, BE_TABLE_SIZE, "tobe");
@@ -25,10 +25,22 @@ struct buffer_head {
 	char		b_data[1024];
 };
 
+/* A run of journal blocks which are contiguous on disk */
+struct journal_map_run {
+	blk64_t		pblk;
+	__u32		lblk;
+	__u32		len;
+};
+
 struct inode {
 	e2fsck_t	i_ctx;
 	ext2_ino_t	i_ino;
 	struct ext2_inode i_ext2;
+	/* Block map of the journal inode, see journal_bmap() */
+	struct journal_map_run *i_map;
+	unsigned int	i_map_count;
+	unsigned int	i_map_size;
+	unsigned int	i_map_last;	/* run which was looked at last */
 };
 
 struct kdev_s {
@@ -144,6 +156,25 @@ void brelse(struct buffer_head *bh);
 int buffer_uptodate(struct buffer_head *bh);
 void wait_on_buffer(struct buffer_head *bh);
 
+/*
+ * Instead of writing each block as it is found in the log, recovery
+ * collects them and has them all written at the end, see
+ * journal_replay_blocks() in journal.c.
+ */
+struct journal_replay_block {
+	unsigned long long	home;	/* block in the file system */
+	unsigned long long	log;	/* block in the journal device */
+	unsigned int		seq;	/* position in the log */
+	int			escape;	/* JFS_FLAG_ESCAPE was set */
+};
+
+int journal_replay_blocks(journal_t *journal,
+			  struct journal_replay_block *blocks,
+			  unsigned int count);
+
+/* revoke.c */
+int journal_size_revoke(journal_t *journal, int nr_records);
+
 /*
  * Define newer 2.5 interfaces
  */
@@ -50,14 +50,45 @@ int journal_bmap(journal_t *journal, blk64_t block, unsigned long long *phys)
 	return 0;
 #else
 	struct inode 	*inode = journal->j_inode;
+	struct journal_map_run *run;
 	errcode_t	retval;
 	blk64_t		pblk;
+	unsigned int	low, high, mid;
 
 	if (!inode) {
 		*phys = block;
 		return 0;
 	}
 
+	/*
+	 * The journal is read mostly in order, so try the run used last
+	 * time and the one after it before searching the whole map.
+	 */
+	if (inode->i_map_count) {
+		low = inode->i_map_last;
+		run = inode->i_map + low;
+		if (block >= run->lblk + run->len &&
+		    low + 1 < inode->i_map_count)
+			run++;
+		if (block < run->lblk || block >= run->lblk + run->len) {
+			low = 0;
+			high = inode->i_map_count;
+			while (low + 1 < high) {
+				mid = (low + high) / 2;
+				if (block < inode->i_map[mid].lblk)
+					high = mid;
+				else
+					low = mid;
+			}
+			run = inode->i_map + low;
+		}
+		if (block >= run->lblk && block < run->lblk + run->len) {
+			inode->i_map_last = run - inode->i_map;
+			*phys = run->pblk + (block - run->lblk);
+			return 0;
+		}
+	}
+
 	retval= ext2fs_bmap2(inode->i_ctx->fs, inode->i_ino,
 			     &inode->i_ext2, NULL, 0, block, 0, &pblk);
 	*phys = pblk;
@@ -105,48 +136,110 @@ void sync_blockdev(kdev_t kdev)
 	io_channel_flush(io);
 }
 
+static void ll_rw_one(int rw, struct buffer_head *bh)
+{
+	errcode_t retval;
+
+	if (rw == READ) {
+		jfs_debug(3, "reading block %llu/%p\n",
+			  bh->b_blocknr, (void *) bh);
+		retval = io_channel_read_blk64(bh->b_io,
+					     bh->b_blocknr,
+					     1, bh->b_data);
+		if (retval) {
+			com_err(bh->b_ctx->device_name, retval,
+				"while reading block %llu\n",
+				bh->b_blocknr);
+			bh->b_err = (int) retval;
+			return;
+		}
+		bh->b_uptodate = 1;
+	} else {
+		jfs_debug(3, "writing block %llu/%p\n",
+			  bh->b_blocknr,
+			  (void *) bh);
+		retval = io_channel_write_blk64(bh->b_io,
+					      bh->b_blocknr,
+					      1, bh->b_data);
+		if (retval) {
+			com_err(bh->b_ctx->device_name, retval,
+				"while writing block %llu\n",
+				bh->b_blocknr);
+			bh->b_err = (int) retval;
+			return;
+		}
+		bh->b_dirty = 0;
+		bh->b_uptodate = 1;
+	}
+}
+
+static int ll_rw_needed(int rw, struct buffer_head *bh)
+{
+	return (rw == READ) ? !bh->b_uptodate : (rw == WRITE && bh->b_dirty);
+}
+
+/*
+ * Buffers which follow each other on disk are read or written with a
+ * single request, through a bounce buffer since their data areas are
+ * separate.  If that request fails, they are retried one at a time so
+ * that the error lands on the right buffer.
+ */
 void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
 {
 	errcode_t retval;
 	struct buffer_head *bh;
+	char	*buf;
+	int	i, j, run;
 
-	for (; nr > 0; --nr) {
-		bh = *bhp++;
-		if (rw == READ && !bh->b_uptodate) {
-			jfs_debug(3, "reading block %llu/%p\n",
-				  bh->b_blocknr, (void *) bh);
+	for (i = 0; i < nr; i += run) {
+		bh = bhp[i];
+		run = 1;
+		if (!ll_rw_needed(rw, bh)) {
+			jfs_debug(3, "no-op %s for block %llu\n",
+				  rw == READ ? "read" : "write",
+				  bh->b_blocknr);
+			continue;
+		}
+		while (i + run < nr && ll_rw_needed(rw, bhp[i + run]) &&
+		       bhp[i + run]->b_io == bh->b_io &&
+		       bhp[i + run]->b_size == bh->b_size &&
+		       bhp[i + run]->b_blocknr == bh->b_blocknr + run)
+			run++;
+		if (run == 1 ||
+		    ext2fs_get_array(run, bh->b_size, &buf)) {
+			for (j = i; j < i + run; j++)
+				ll_rw_one(rw, bhp[j]);
+			continue;
+		}
+
+		jfs_debug(3, "%s blocks %llu-%llu\n",
+			  rw == READ ? "reading" : "writing",
+			  bh->b_blocknr, bh->b_blocknr + run - 1);
+		if (rw == READ) {
 			retval = io_channel_read_blk64(bh->b_io,
-						     bh->b_blocknr,
-						     1, bh->b_data);
-			if (retval) {
-				com_err(bh->b_ctx->device_name, retval,
-					"while reading block %llu\n",
-					bh->b_blocknr);
-				bh->b_err = (int) retval;
-				continue;
+						       bh->b_blocknr,
+						       run, buf);
+			for (j = 0; !retval && j < run; j++) {
+				memcpy(bhp[i + j]->b_data,
+				       buf + j * bh->b_size, bh->b_size);
+				bhp[i + j]->b_uptodate = 1;
 			}
-			bh->b_uptodate = 1;
-		} else if (rw == WRITE && bh->b_dirty) {
-			jfs_debug(3, "writing block %llu/%p\n",
-				  bh->b_blocknr,
-				  (void *) bh);
+		} else {
+			for (j = 0; j < run; j++)
+				memcpy(buf + j * bh->b_size,
+				       bhp[i + j]->b_data, bh->b_size);
 			retval = io_channel_write_blk64(bh->b_io,
-						      bh->b_blocknr,
-						      1, bh->b_data);
-			if (retval) {
-				com_err(bh->b_ctx->device_name, retval,
-					"while writing block %llu\n",
-					bh->b_blocknr);
-				bh->b_err = (int) retval;
-				continue;
+							bh->b_blocknr,
+							run, buf);
+			for (j = 0; !retval && j < run; j++) {
+				bhp[i + j]->b_dirty = 0;
+				bhp[i + j]->b_uptodate = 1;
 			}
-			bh->b_dirty = 0;
-			bh->b_uptodate = 1;
-		} else {
-			jfs_debug(3, "no-op %s for block %llu\n",
-				  rw == READ ? "read" : "write",
-				  bh->b_blocknr);
 		}
+		ext2fs_free_mem(&buf);
+		if (retval)
+			for (j = i; j < i + run; j++)
+				ll_rw_one(rw, bhp[j]);
 	}
 }
 
@@ -185,6 +278,142 @@ void wait_on_buffer(struct buffer_head *bh)
 		ll_rw_block(READ, 1, &bh);
 }
 
+/*
+ * Replay in batches of this many bytes of journal blocks
+ */
+#define REPLAY_BATCH_SIZE	(8 * 1024 * 1024)
+
+static EXT2_QSORT_TYPE replay_home_cmp(const void *a, const void *b)
+{
+	const struct journal_replay_block *ra = a, *rb = b;
+
+	if (ra->home != rb->home)
+		return ra->home < rb->home ? -1 : 1;
+	return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+static EXT2_QSORT_TYPE replay_log_cmp(const void *a, const void *b)
+{
+	const struct journal_replay_block *ra, *rb;
+
+	ra = *(const struct journal_replay_block * const *) a;
+	rb = *(const struct journal_replay_block * const *) b;
+	if (ra->log != rb->log)
+		return ra->log < rb->log ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Copy the blocks found by journal_recover() to their home locations.
+ * A block which was logged more than once is only written once, from
+ * its last copy in the log.  The home blocks are written in ascending
+ * order, each run of consecutive blocks with one write, and the
+ * journal blocks of each batch are read in the order they sit in the
+ * journal, so that neither side is accessed in log order.
+ */
+int journal_replay_blocks(journal_t *journal,
+			  struct journal_replay_block *blocks,
+			  unsigned int count)
+{
+	e2fsck_t	ctx = journal->j_fs_dev->k_ctx;
+	io_channel	fs_io = ctx->fs->io;
+	io_channel	log_io = ctx->journal_io;
+	struct journal_replay_block **order = 0;
+	unsigned int	i, j, n, run, start, batch;
+	int		bs = journal->j_blocksize;
+	int		*slot = 0;
+	char		*rbuf = 0, *wbuf = 0;
+	errcode_t	retval, err = 0;
+
+	qsort(blocks, count, sizeof(*blocks), replay_home_cmp);
+	for (i = 0, n = 0; i < count; i++) {
+		if (n && blocks[n - 1].home == blocks[i].home)
+			blocks[n - 1] = blocks[i];
+		else
+			blocks[n++] = blocks[i];
+	}
+	jfs_debug(1, "replaying %u blocks, %u after merging\n", count, n);
+
+	batch = REPLAY_BATCH_SIZE / bs;
+	if (batch > n)
+		batch = n;
+	retval = ext2fs_get_array(batch, sizeof(*order), &order);
+	if (!retval)
+		retval = ext2fs_get_array(batch, sizeof(*slot), &slot);
+	if (!retval)
+		retval = ext2fs_get_array(batch, bs, &rbuf);
+	if (!retval)
+		retval = ext2fs_get_array(batch, bs, &wbuf);
+	if (retval) {
+		err = retval;
+		goto out;
+	}
+
+	for (start = 0; start < n; start += batch) {
+		struct journal_replay_block *rb = blocks + start;
+		unsigned int cnt = n - start;
+
+		if (cnt > batch)
+			cnt = batch;
+
+		/* Read the batch in journal order */
+		for (i = 0; i < cnt; i++)
+			order[i] = rb + i;
+		qsort(order, cnt, sizeof(*order), replay_log_cmp);
+		for (i = 0; i < cnt; i += run) {
+			for (run = 1; i + run < cnt &&
+				     order[i + run]->log ==
+				     order[i]->log + run; run++)
+				;
+			retval = io_channel_read_blk64(log_io, order[i]->log,
+						       run, rbuf + i * bs);
+			for (j = i; j < i + run; j++)
+				slot[order[j] - rb] = retval ? -1 : (int) j;
+			if (retval) {
+				com_err(ctx->device_name, retval,
+					"while reading block %llu\n",
+					order[i]->log);
+				err = retval;
+			}
+		}
+
+		/* Write it in file system order */
+		for (i = 0; i < cnt; i += run) {
+			if (slot[i] < 0) {
+				run = 1;
+				continue;
+			}
+			for (run = 0; i + run < cnt && slot[i + run] >= 0 &&
+				     rb[i + run].home == rb[i].home + run;
+			     run++) {
+				char *p = wbuf + run * bs;
+
+				memcpy(p, rbuf + slot[i + run] * bs, bs);
+				if (rb[i + run].escape) {
+					journal_header_t *header;
+
+					header = (journal_header_t *) p;
+					header->h_magic =
+						cpu_to_be32(JFS_MAGIC_NUMBER);
+				}
+			}
+			retval = io_channel_write_blk64(fs_io, rb[i].home, run,
+							wbuf);
+			if (retval) {
+				com_err(ctx->device_name, retval,
+					"while writing block %llu\n",
+					rb[i].home);
+				err = retval;
+			}
+		}
+	}
+out:
+	ext2fs_free_mem(&order);
+	ext2fs_free_mem(&slot);
+	ext2fs_free_mem(&rbuf);
+	ext2fs_free_mem(&wbuf);
+	return -(int) err;
+}
 
 static void e2fsck_clear_recover(e2fsck_t ctx, int error)
 {
@@ -201,6 +430,8 @@ static void e2fsck_clear_recover(e2fsck_t ctx, int error)
  */
 struct process_block_struct {
 	e2_blkcnt_t	last_block;
+	struct inode	*j_inode;
+	errcode_t	errcode;
 };
 
 static int process_journal_block(ext2_filsys fs,
@@ -211,7 +442,9 @@ static int process_journal_block(ext2_filsys fs,
 				 void *priv_data)
 {
 	struct process_block_struct *p;
+	struct journal_map_run *map;
 	blk64_t	blk = *block_nr;
+	unsigned int n, size;
 
 	p = (struct process_block_struct *) priv_data;
 
@@ -219,11 +452,42 @@ static int process_journal_block(ext2_filsys fs,
 	    blk >= ext2fs_blocks_count(fs->super))
 		return BLOCK_ABORT;
 
-	if (blockcnt >= 0)
-		p->last_block = blockcnt;
+	if (blockcnt < 0)
+		return 0;
+	p->last_block = blockcnt;
+
+	/* Note the block in the journal's map */
+	map = p->j_inode->i_map;
+	n = p->j_inode->i_map_count;
+	if (n && map[n-1].lblk + map[n-1].len == blockcnt &&
+	    map[n-1].pblk + map[n-1].len == blk && map[n-1].len < ~0U) {
+		map[n-1].len++;
+		return 0;
+	}
+	if (n == p->j_inode->i_map_size) {
+		size = n ? 2 * n : 64;
+		p->errcode = ext2fs_resize_mem(n * sizeof(*map),
+					       size * sizeof(*map),
+					       &p->j_inode->i_map);
+		if (p->errcode)
+			return BLOCK_ABORT;
+		p->j_inode->i_map_size = size;
+		map = p->j_inode->i_map;
+	}
+	map[n].lblk = blockcnt;
+	map[n].pblk = blk;
+	map[n].len = 1;
+	p->j_inode->i_map_count++;
 	return 0;
 }
 
+static void free_journal_inode(struct inode **j_inode)
+{
+	if ((*j_inode)->i_map)
+		ext2fs_free_mem(&(*j_inode)->i_map);
+	ext2fs_free_mem(j_inode);
+}
+
 static errcode_t e2fsck_get_journal(e2fsck_t ctx, journal_t **ret_journal)
 {
 	struct process_block_struct pb;
@@ -309,9 +573,17 @@ static errcode_t e2fsck_get_journal(e2fsck_t ctx, journal_t **ret_journal)
 			goto try_backup_journal;
 		}
 		pb.last_block = -1;
+		pb.j_inode = j_inode;
+		pb.errcode = 0;
+		j_inode->i_map_count = 0;
+		j_inode->i_map_last = 0;
 		retval = ext2fs_block_iterate3(ctx->fs, j_inode->i_ino,
 					       BLOCK_FLAG_HOLE, 0,
 					       process_journal_block, &pb);
+		if (pb.errcode) {
+			retval = pb.errcode;
+			goto errout;
+		}
 		if ((pb.last_block + 1) * ctx->fs->blocksize <
 		    (int) EXT2_I_SIZE(&j_inode->i_ext2)) {
 			retval = EXT2_ET_JOURNAL_TOO_SMALL;
@@ -440,7 +712,7 @@ static errcode_t e2fsck_get_journal(e2fsck_t ctx, journal_t **ret_journal)
 
 #ifdef USE_INODE_IO
 	if (j_inode)
-		ext2fs_free_mem(&j_inode);
+		free_journal_inode(&j_inode);
 #endif
 
 	*ret_journal = journal;
@@ -452,7 +724,7 @@ errout:
 	if (dev_fs)
 		ext2fs_free_mem(&dev_fs);
 	if (j_inode)
-		ext2fs_free_mem(&j_inode);
+		free_journal_inode(&j_inode);
 	if (journal)
 		ext2fs_free_mem(&journal);
 	return retval;
@@ -692,7 +964,7 @@ static void e2fsck_journal_release(e2fsck_t ctx, journal_t *journal,
 
 #ifndef USE_INODE_IO
 	if (journal->j_inode)
-		ext2fs_free_mem(&journal->j_inode);
+		free_journal_inode(&journal->j_inode);
 #endif
 	if (journal->j_fs_dev)
 		ext2fs_free_mem(&journal->j_fs_dev);
@@ -916,6 +1188,7 @@ errcode_t e2fsck_run_ext3_journal(e2fsck_t ctx)
 	ctx->fs->now = ctx->now;
 	ctx->fs->flags |= EXT2_FLAG_MASTER_SB_ONLY;
 	ctx->fs->super->s_kbytes_written += kbytes_written;
+	(void) ext2fs_mmp_start_heartbeat(ctx->fs);
 
 	/* Set the superblock flags */
 	e2fsck_clear_recover(ctx, recover_retval != 0);
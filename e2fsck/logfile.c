@@ -14,8 +14,15 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
 #include <fcntl.h>
+#include <signal.h>
 
+#include "e2p/e2p.h"
 #include "e2fsck.h"
 #include <pwd.h>
 
@@ -339,6 +346,151 @@ out:
 	free(log_dir);
 	return;
 }
+
+/* Most we write to stdout at once, so that a slow tty rarely blocks us */
+#define OUTPUT_CHUNK	256
+
+static pid_t	output_pid;
+
+/*
+ * Copy everything read from in to out through a ring buffer of size
+ * bytes, reading whenever there is room and writing whenever out will
+ * take more.  If out goes away, keep reading so that our parent never
+ * blocks on a full pipe (or gets a SIGPIPE).
+ */
+static void copy_output(int in, int out, size_t size)
+{
+	char	*buf;
+	size_t	head = 0, len = 0, tail, n;
+	ssize_t	c;
+	fd_set	rfds, wfds;
+	int	eof = 0, discard = 0;
+
+	buf = malloc(size);
+	if (!buf)
+		_exit(1);
+
+	while (!eof || (len && !discard)) {
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		if (!eof && len < size)
+			FD_SET(in, &rfds);
+		if (len && !discard)
+			FD_SET(out, &wfds);
+		if (select((in > out ? in : out) + 1, &rfds, &wfds,
+			   0, 0) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (FD_ISSET(in, &rfds)) {
+			tail = (head + len) % size;
+			n = size - len;
+			if (tail + n > size)
+				n = size - tail;
+			c = read(in, buf + tail, n);
+			if (c < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (c <= 0)
+				eof = 1;
+			else if (!discard)
+				len += c;
+		}
+		if (FD_ISSET(out, &wfds)) {
+			n = len;
+			if (head + n > size)
+				n = size - head;
+			if (n > OUTPUT_CHUNK)
+				n = OUTPUT_CHUNK;
+			c = write(out, buf + head, n);
+			if (c < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (c < 0) {
+				discard = 1;
+				head = len = 0;
+				continue;
+			}
+			head = (head + c) % size;
+			len -= c;
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Called at exit (including from fatal_error()): hand over what is
+ * left in stdio, tell the output process there is no more, and wait
+ * for it to write everything out.
+ */
+static void finish_output(void)
+{
+	int	status;
+
+	if (output_pid <= 0)
+		return;
+	fflush(stdout);
+	close(1);
+	while (waitpid(output_pid, &status, 0) < 0 && errno == EINTR)
+		;
+	output_pid = 0;
+}
+
+/*
+ * With -E output_buffer=size (or output_buffer in e2fsck.conf), fork a
+ * process which owns our standard output and copies to it whatever we
+ * print, through a buffer of that size.  A slow console then holds up
+ * the checking only once the buffer is full.  This is only done when
+ * no questions will be asked, since a question has to be seen before
+ * it is answered.
+ */
+void set_up_output_buffer(e2fsck_t ctx)
+{
+	char	*size_str = 0;
+	int	fds[2];
+	pid_t	pid;
+
+	if (!ctx->output_buffer) {
+		profile_get_string(ctx->profile, "options", "output_buffer",
+				   0, 0, &size_str);
+		if (size_str)
+			ctx->output_buffer = parse_num_blocks2(size_str, -1);
+		free(size_str);
+	}
+	if (!ctx->output_buffer ||
+	    !(ctx->options & (E2F_OPT_PREEN | E2F_OPT_YES | E2F_OPT_NO)))
+		return;
+
+	fflush(stdout);
+	if (pipe(fds) < 0)
+		return;
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	if (pid == 0) {
+		/* Keep writing out what we have when e2fsck is interrupted */
+		signal(SIGINT, SIG_IGN);
+		signal(SIGTERM, SIG_IGN);
+		signal(SIGUSR1, SIG_IGN);
+		signal(SIGUSR2, SIG_IGN);
+		signal(SIGPIPE, SIG_IGN);
+		close(fds[1]);
+		copy_output(fds[0], 1, ctx->output_buffer);
+		_exit(0);
+	}
+	close(fds[0]);
+	if (dup2(fds[1], 1) < 0) {
+		close(fds[1]);
+		kill(pid, SIGKILL);
+		waitpid(pid, 0, 0);
+		return;
+	}
+	close(fds[1]);
+	output_pid = pid;
+	atexit(finish_output);
+}
 #else
 void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
 			     const char *description)
@@ -64,6 +64,7 @@ static int process_bad_block(ext2_filsys fs, blk64_t *block_nr,
 static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 			 char *block_buf);
 static void mark_table_blocks(e2fsck_t ctx);
+static void merge_scope_bitmaps(e2fsck_t ctx);
 static void alloc_bb_map(e2fsck_t ctx);
 static void alloc_imagic_map(e2fsck_t ctx);
 static void mark_inode_bad(e2fsck_t ctx, ino_t ino);
@@ -71,6 +72,7 @@ static void add_encrypted_dir(e2fsck_t ctx, ino_t ino);
 static void handle_fs_bad_blocks(e2fsck_t ctx);
 static void process_inodes(e2fsck_t ctx, char *block_buf);
 static EXT2_QSORT_TYPE process_inode_cmp(const void *a, const void *b);
+static void readahead_blocks(ext2_filsys fs, blk64_t *blks, int count);
 static errcode_t scan_callback(ext2_filsys fs, ext2_inode_scan scan,
 				  dgrp_t group, void * priv_data);
 static void adjust_extattr_refcount(e2fsck_t ctx, ext2_refcount_t refcount,
@@ -88,6 +90,8 @@ struct process_block_struct {
 	e2_blkcnt_t	last_db_block;
 	int		num_illegal_blocks;
 	blk64_t		previous_block;
+	blk64_t		run_start;	/* blocks not yet marked in use */
+	unsigned int	run_len;
 	struct ext2_inode *inode;
 	struct problem_context *pctx;
 	ext2fs_block_bitmap fs_meta_blocks;
@@ -96,6 +100,7 @@ struct process_block_struct {
 
 struct process_inode_block {
 	ext2_ino_t ino;
+	blk64_t meta_blk;		/* what the batch is sorted by */
 	struct ext2_inode inode;
 };
 
@@ -108,7 +113,11 @@ struct scan_callback_struct {
  * For the inodes to process list.
  */
 static struct process_inode_block *inodes_to_process;
-static int process_inode_count;
+static int process_inode_count, process_inode_max;
+static dgrp_t process_inode_groups;	/* groups to collect inodes from */
+
+/* Last inode read by the main inode scan (see note_dup_block) */
+static ext2_ino_t scan_ino;
 
 static __u64 ext2_max_sizes[EXT2_MAX_BLOCK_LOG_SIZE -
 			    EXT2_MIN_BLOCK_LOG_SIZE + 1];
@@ -123,6 +132,66 @@ static void unwind_pass1(ext2_filsys fs EXT2FS_ATTR((unused)))
 	inodes_to_process = 0;
 }
 
+/*
+ * Returns the root of an inode's extent tree if it has index or leaf
+ * blocks outside the inode.  The extent tree in i_block is always
+ * kept in disk byte order.
+ */
+static struct ext3_extent_header *extent_tree_root(struct ext2_inode *inode)
+{
+	struct ext3_extent_header *eh;
+
+	eh = (struct ext3_extent_header *) inode->i_block;
+	if (ext2fs_le16_to_cpu(eh->eh_magic) != EXT3_EXT_MAGIC ||
+	    ext2fs_le16_to_cpu(eh->eh_depth) == 0 ||
+	    ext2fs_le16_to_cpu(eh->eh_entries) == 0 ||
+	    ext2fs_le16_to_cpu(eh->eh_entries) >
+	    (sizeof(inode->i_block) - sizeof(*eh)) /
+	    sizeof(struct ext3_extent_idx))
+		return NULL;
+	return eh;
+}
+
+/*
+ * Returns the first block check_blocks() will have to read for an
+ * inode: its first indirect block, or the first block below the root
+ * of its extent tree.
+ */
+static blk64_t first_meta_block(struct ext2_inode *inode)
+{
+	struct ext3_extent_header	*eh;
+	struct ext3_extent_idx		*ix;
+
+	if (!(inode->i_flags & EXT4_EXTENTS_FL)) {
+		if (inode->i_block[EXT2_IND_BLOCK])
+			return inode->i_block[EXT2_IND_BLOCK];
+		if (inode->i_block[EXT2_DIND_BLOCK])
+			return inode->i_block[EXT2_DIND_BLOCK];
+		return inode->i_block[EXT2_TIND_BLOCK];
+	}
+	eh = extent_tree_root(inode);
+	if (!eh)
+		return 0;
+	ix = EXT_FIRST_INDEX(eh);
+	return ext2fs_le32_to_cpu(ix->ei_leaf) +
+		((__u64) ext2fs_le16_to_cpu(ix->ei_leaf_hi) << 32);
+}
+
+/*
+ * Returns true if an inode has metadata blocks outside the inode and
+ * the inode table, so that check_blocks() is better off checking it in
+ * block order along with others like it.
+ */
+static int want_deferred_check(ext2_filsys fs, struct ext2_inode *inode)
+{
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return extent_tree_root(inode) != NULL;
+	return (inode->i_block[EXT2_IND_BLOCK] ||
+		inode->i_block[EXT2_DIND_BLOCK] ||
+		inode->i_block[EXT2_TIND_BLOCK] ||
+		ext2fs_file_acl_block(fs, inode));
+}
+
 /*
  * Check to make sure a device inode is real.  Returns 1 if the device
  * checks out, 0 if not.
@@ -522,11 +591,10 @@ void e2fsck_setup_tdb_icount(e2fsck_t ctx, int flags,
 	errcode_t		retval;
 	char			*tdb_dir;
 	int			enable;
+	unsigned long long	size;
 
 	*ret = 0;
 
-	profile_get_string(ctx->profile, "scratch_files", "directory", 0, 0,
-			   &tdb_dir);
 	profile_get_uint(ctx->profile, "scratch_files",
 			 "numdirs_threshold", 0, 0, &threshold);
 	profile_get_boolean(ctx->profile, "scratch_files",
@@ -536,8 +604,17 @@ void e2fsck_setup_tdb_icount(e2fsck_t ctx, int flags,
 	if (retval)
 		num_dirs = 1024;	/* Guess */
 
+	/*
+	 * The in-memory icount keeps an (inode, count) pair for each
+	 * directory and, roughly as many again, for files with more
+	 * than one link.
+	 */
+	size = (unsigned long long) num_dirs * 2 * 2 * sizeof(__u32);
+	tdb_dir = e2fsck_scratch_dir(ctx, size);
+
 	if (!enable || !tdb_dir || access(tdb_dir, W_OK) ||
-	    (threshold && num_dirs <= threshold))
+	    (threshold && num_dirs <= threshold &&
+	     !e2fsck_over_memory_budget(ctx, size)))
 		return;
 
 	retval = ext2fs_create_icount_tdb(ctx->fs, tdb_dir, flags, ret);
@@ -545,6 +622,46 @@ void e2fsck_setup_tdb_icount(e2fsck_t ctx, int flags,
 		*ret = 0;
 }
 
+/*
+ * With -E max_memory, let the directory block list move into a scratch
+ * file once it outgrows its share of the limit.
+ */
+static void setup_dblist_spill(e2fsck_t ctx)
+{
+	char	*dir;
+
+	if (!ctx->max_memory)
+		return;
+	dir = e2fsck_scratch_dir(ctx, ctx->max_memory);
+	if (!dir)
+		return;
+	if (access(dir, W_OK) == 0)
+		ext2fs_dblist_set_spill(ctx->fs->dblist, dir,
+					ctx->max_memory / 4);
+	free(dir);
+}
+
+/*
+ * With -E max_memory, keep the block bitmaps which end up as bit arrays
+ * in scratch files if one of them would take up more than its share
+ * of the limit.
+ */
+static void setup_bitmap_spill(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	char		*dir;
+
+	if (!e2fsck_over_memory_budget(ctx,
+			EXT2FS_B2C(fs, ext2fs_blocks_count(fs->super)) / 8))
+		return;
+	dir = e2fsck_scratch_dir(ctx, ctx->max_memory);
+	if (!dir)
+		return;
+	if (access(dir, W_OK) == 0)
+		ext2fs_set_bitmap_spill(fs, dir);
+	free(dir);
+}
+
 void e2fsck_pass1(e2fsck_t ctx)
 {
 	int	i;
@@ -567,7 +684,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 	int		busted_fs_time = 0;
 	int		inode_size;
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	clear_problem_context(&pctx);
 
 	if (!(ctx->options & E2F_OPT_PREEN))
@@ -600,6 +717,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 	/*
 	 * Allocate bitmaps structures
 	 */
+	setup_bitmap_spill(ctx);
 	pctx.errcode = e2fsck_allocate_inode_bitmap(fs, _("in-use inode map"),
 						    EXT2FS_BMAP64_RBTREE,
 						    "inode_used_map",
@@ -642,8 +760,9 @@ void e2fsck_pass1(e2fsck_t ctx)
 	if (!ctx->inode_link_info) {
 		e2fsck_set_bitmap_type(fs, EXT2FS_BMAP64_RBTREE,
 				       "inode_link_info", &save_type);
-		pctx.errcode = ext2fs_create_icount2(fs, 0, 0, 0,
-						     &ctx->inode_link_info);
+		pctx.errcode = ext2fs_create_icount2(fs,
+					e2fsck_icount_fullmap_flag(ctx),
+					0, 0, &ctx->inode_link_info);
 		fs->default_bitmap_type = save_type;
 	}
 
@@ -656,12 +775,27 @@ void e2fsck_pass1(e2fsck_t ctx)
 	inode = (struct ext2_inode *)
 		e2fsck_allocate_memory(ctx, inode_size, "scratch inode");
 
+	process_inode_max = e2fsck_process_inode_size(ctx,
+					sizeof(struct process_inode_block));
 	inodes_to_process = (struct process_inode_block *)
 		e2fsck_allocate_memory(ctx,
-				       (ctx->process_inode_size *
+				       (process_inode_max *
 					sizeof(struct process_inode_block)),
 				       "array of inodes to process");
+	e2fsck_mem_account(ctx, E2F_MEM_INODES_TO_PROCESS,
+			   (unsigned long long) process_inode_max *
+			   sizeof(struct process_inode_block));
 	process_inode_count = 0;
+	/*
+	 * With flex_bg, the indirect and extent tree blocks of a flex
+	 * group's inodes are allocated near each other, so the batch
+	 * can collect inodes from all of its groups before sorting.
+	 */
+	process_inode_groups = 1;
+	if (fs->super->s_feature_incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG &&
+	    fs->super->s_log_groups_per_flex < 31)
+		process_inode_groups = 1U << fs->super->s_log_groups_per_flex;
+	scan_ino = 0;
 
 	pctx.errcode = ext2fs_init_dblist(fs, 0);
 	if (pctx.errcode) {
@@ -670,6 +804,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 		ext2fs_free_mem(&inode);
 		return;
 	}
+	setup_dblist_spill(ctx);
 
 	/*
 	 * If the last orphan field is set, clear it, since the pass1
@@ -685,6 +820,10 @@ void e2fsck_pass1(e2fsck_t ctx)
 		}
 	}
 
+	/* e2fsck_get_alloc_block() needs them during a partial check */
+	if (ctx->options & E2F_OPT_GROUPS)
+		e2fsck_read_bitmaps(ctx);
+
 	mark_table_blocks(ctx);
 	pctx.errcode = ext2fs_convert_subcluster_bitmap(fs,
 						&ctx->block_found_map);
@@ -709,6 +848,21 @@ void e2fsck_pass1(e2fsck_t ctx)
 		return;
 	}
 	ext2fs_inode_scan_flags(scan, EXT2_SF_SKIP_MISSING_ITABLE, 0);
+	if (ctx->options & E2F_OPT_GROUPS) {
+		pctx.errcode = ext2fs_inode_scan_set_groups(scan,
+				ctx->scope_first_group,
+				ctx->scope_last_group -
+				ctx->scope_first_group + 1);
+		if (pctx.errcode) {
+			fix_problem(ctx, PR_1_ISCAN_ERROR, &pctx);
+			ctx->flags |= E2F_FLAG_ABORT;
+			ext2fs_close_inode_scan(scan);
+			ext2fs_free_mem(&block_buf);
+			ext2fs_free_mem(&inode);
+			return;
+		}
+	}
+	e2fsck_start_itable_prefetch(ctx);
 	ctx->stashed_inode = inode;
 	scan_struct.ctx = ctx;
 	scan_struct.block_buf = block_buf;
@@ -751,9 +905,11 @@ void e2fsck_pass1(e2fsck_t ctx)
 		}
 		if (!ino)
 			break;
+		ctx->inodes_scanned++;
 		pctx.ino = ino;
 		pctx.inode = inode;
 		ctx->stashed_ino = ino;
+		scan_ino = ino;
 		if (inode->i_links_count) {
 			pctx.errcode = ext2fs_icount_store(ctx->inode_link_info,
 					   ino, inode->i_links_count);
@@ -1141,12 +1297,10 @@ void e2fsck_pass1(e2fsck_t ctx)
 			if (inode->i_block[EXT2_TIND_BLOCK])
 				ctx->fs_tind_count++;
 		}
-		if (!(inode->i_flags & EXT4_EXTENTS_FL) &&
-		    (inode->i_block[EXT2_IND_BLOCK] ||
-		     inode->i_block[EXT2_DIND_BLOCK] ||
-		     inode->i_block[EXT2_TIND_BLOCK] ||
-		     ext2fs_file_acl_block(fs, inode))) {
+		if (want_deferred_check(fs, inode)) {
 			inodes_to_process[process_inode_count].ino = ino;
+			inodes_to_process[process_inode_count].meta_blk =
+				first_meta_block(inode);
 			inodes_to_process[process_inode_count].inode = *inode;
 			process_inode_count++;
 		} else
@@ -1155,15 +1309,21 @@ void e2fsck_pass1(e2fsck_t ctx)
 		if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 			return;
 
-		if (process_inode_count >= ctx->process_inode_size) {
+		if (process_inode_count >= process_inode_max) {
 			process_inodes(ctx, block_buf);
 
 			if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 				return;
 		}
 	}
+	scan_ino = fs->super->s_inodes_count;
 	process_inodes(ctx, block_buf);
 	ext2fs_close_inode_scan(scan);
+	e2fsck_stop_itable_prefetch(ctx);
+	if (ctx->options & E2F_OPT_GROUPS)
+		merge_scope_bitmaps(ctx);
+
+	e2fsck_mem_sample(ctx);
 
 	/*
 	 * If any extended attribute blocks' reference counts need to
@@ -1226,6 +1386,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 		 */
 		ctx->use_superblock = 0;
 		unwind_pass1(fs);
+		e2fsck_mem_account(ctx, E2F_MEM_INODES_TO_PROCESS, 0);
 		goto endit;
 	}
 
@@ -1234,9 +1395,14 @@ void e2fsck_pass1(e2fsck_t ctx)
 			clear_problem_context(&pctx);
 			fix_problem(ctx, PR_1_DUP_BLOCKS_PREENSTOP, &pctx);
 		}
+#ifdef ENABLE_HTREE
+		/* A directory sharing its root block may get a new one */
+		e2fsck_forget_dx_roots(ctx);
+#endif
 		e2fsck_pass1_dupblocks(ctx, block_buf);
 	}
 	ext2fs_free_mem(&inodes_to_process);
+	e2fsck_mem_account(ctx, E2F_MEM_INODES_TO_PROCESS, 0);
 endit:
 	e2fsck_use_inode_shortcuts(ctx, 0);
 
@@ -1248,7 +1414,8 @@ endit:
 
 /*
  * When the inode_scan routines call this callback at the end of the
- * glock group, call process_inodes.
+ * block group, call process_inodes if that is the end of the groups
+ * whose inodes are collected together.
  */
 static errcode_t scan_callback(ext2_filsys fs,
 			       ext2_inode_scan scan EXT2FS_ATTR((unused)),
@@ -1260,7 +1427,10 @@ static errcode_t scan_callback(ext2_filsys fs,
 	scan_struct = (struct scan_callback_struct *) priv_data;
 	ctx = scan_struct->ctx;
 
-	process_inodes((e2fsck_t) fs->priv_data, scan_struct->block_buf);
+	if ((group + 1) % process_inode_groups == 0)
+		process_inodes((e2fsck_t) fs->priv_data,
+			       scan_struct->block_buf);
+	e2fsck_itable_prefetch_progress(ctx, group + 1);
 
 	if (ctx->progress)
 		if ((ctx->progress)(ctx, 1, group+1,
@@ -1270,12 +1440,69 @@ static errcode_t scan_callback(ext2_filsys fs,
 	return 0;
 }
 
+#define PROCESS_RA_BATCH	64
+
+/*
+ * Start reading the metadata blocks of the batch's inodes from start
+ * on, up to the readahead window's worth of them: the top level
+ * indirect blocks, the blocks below the root of the extent tree, and
+ * the extended attribute block.  Returns the index of the first inode
+ * whose blocks weren't asked for.
+ */
+static int readahead_inodes(e2fsck_t ctx, int start)
+{
+	ext2_filsys		fs = ctx->fs;
+	struct ext2_inode	*inode;
+	struct ext3_extent_header *eh;
+	struct ext3_extent_idx	*ix;
+	blk64_t			blks[PROCESS_RA_BATCH], blk, meta[4 + 1];
+	unsigned long long	window, done = 0;
+	int			i, j, n, count = 0;
+
+	window = ((unsigned long long) ctx->readahead_kb * 1024) /
+		fs->blocksize;
+	for (i = start; i < process_inode_count && done < window; i++) {
+		inode = &inodes_to_process[i].inode;
+		n = 0;
+		if (inode->i_flags & EXT4_EXTENTS_FL) {
+			eh = extent_tree_root(inode);
+			ix = eh ? EXT_FIRST_INDEX(eh) : NULL;
+			for (j = 0; eh && j < ext2fs_le16_to_cpu(eh->eh_entries);
+			     j++, ix++)
+				meta[n++] = ext2fs_le32_to_cpu(ix->ei_leaf) +
+				  ((__u64) ext2fs_le16_to_cpu(ix->ei_leaf_hi)
+				   << 32);
+		} else {
+			for (j = EXT2_IND_BLOCK; j <= EXT2_TIND_BLOCK; j++)
+				if (inode->i_block[j])
+					meta[n++] = inode->i_block[j];
+		}
+		blk = ext2fs_file_acl_block(fs, inode);
+		if (blk)
+			meta[n++] = blk;
+		for (j = 0; j < n; j++) {
+			if (meta[j] < fs->super->s_first_data_block ||
+			    meta[j] >= ext2fs_blocks_count(fs->super))
+				continue;
+			blks[count++] = meta[j];
+			done++;
+			if (count == PROCESS_RA_BATCH) {
+				readahead_blocks(fs, blks, count);
+				count = 0;
+			}
+		}
+	}
+	if (count)
+		readahead_blocks(fs, blks, count);
+	return i;
+}
+
 /*
  * Process the inodes in the "inodes to process" list.
  */
 static void process_inodes(e2fsck_t ctx, char *block_buf)
 {
-	int			i;
+	int			i, ra_next = 0, ra_mid = 0;
 	struct ext2_inode	*old_stashed_inode;
 	ext2_ino_t		old_stashed_ino;
 	const char		*old_operation;
@@ -1297,11 +1524,24 @@ static void process_inodes(e2fsck_t ctx, char *block_buf)
 		pctx.inode = ctx->stashed_inode = &inodes_to_process[i].inode;
 		pctx.ino = ctx->stashed_ino = inodes_to_process[i].ino;
 
+		/*
+		 * Keep between half and all of the readahead window's
+		 * worth of blocks ahead of the inode being checked.
+		 */
+		if (ctx->readahead_kb && i >= ra_mid &&
+		    ra_next < process_inode_count) {
+			ra_next = readahead_inodes(ctx, ra_next);
+			ra_mid = i + (ra_next - i) / 2;
+		}
 #if 0
 		printf("%u ", pctx.ino);
 #endif
-		sprintf(buf, _("reading indirect blocks of inode %u"),
-			pctx.ino);
+		if (pctx.inode->i_flags & EXT4_EXTENTS_FL)
+			sprintf(buf, _("reading extent tree of inode %u"),
+				pctx.ino);
+		else
+			sprintf(buf, _("reading indirect blocks of inode %u"),
+				pctx.ino);
 		ehandler_operation(buf);
 		check_blocks(ctx, &pctx, block_buf);
 		if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
@@ -1322,21 +1562,22 @@ static EXT2_QSORT_TYPE process_inode_cmp(const void *a, const void *b)
 		(const struct process_inode_block *) a;
 	const struct process_inode_block *ib_b =
 		(const struct process_inode_block *) b;
-	int	ret;
+	blk64_t	blk_a, blk_b;
 
-	ret = (ib_a->inode.i_block[EXT2_IND_BLOCK] -
-	       ib_b->inode.i_block[EXT2_IND_BLOCK]);
-	if (ret == 0)
+	blk_a = ib_a->meta_blk;
+	blk_b = ib_b->meta_blk;
+	if (blk_a == blk_b) {
 		/*
-		 * We only call process_inodes() for non-extent
-		 * inodes, so it's OK to pass NULL to
-		 * ext2fs_file_acl_block() here.
+		 * This is only a tie breaker, so it's OK to pass NULL
+		 * to ext2fs_file_acl_block() and ignore the high bits
+		 * of the block number.
 		 */
-		ret = ext2fs_file_acl_block(0, &(ib_a->inode)) -
-			ext2fs_file_acl_block(0, &(ib_b->inode));
-	if (ret == 0)
-		ret = ib_a->ino - ib_b->ino;
-	return ret;
+		blk_a = ext2fs_file_acl_block(0, &(ib_a->inode));
+		blk_b = ext2fs_file_acl_block(0, &(ib_b->inode));
+	}
+	if (blk_a == blk_b)
+		return (ib_a->ino > ib_b->ino) - (ib_a->ino < ib_b->ino);
+	return (blk_a > blk_b) - (blk_a < blk_b);
 }
 
 /*
@@ -1428,41 +1669,97 @@ static void alloc_imagic_map(e2fsck_t ctx)
  * WARNING: Assumes checks have already been done to make sure block
  * is valid.  This is true in both process_block and process_bad_block.
  */
-static _INLINE_ void mark_block_used(e2fsck_t ctx, blk64_t block)
+static int alloc_block_dup_map(e2fsck_t ctx)
 {
 	struct		problem_context pctx;
 
+	if (ctx->block_dup_map)
+		return 0;
+
 	clear_problem_context(&pctx);
+	pctx.errcode = e2fsck_allocate_block_bitmap(ctx->fs,
+			_("multiply claimed block map"),
+			EXT2FS_BMAP64_RBTREE, "block_dup_map",
+			&ctx->block_dup_map);
+	if (pctx.errcode) {
+		pctx.num = 3;
+		fix_problem(ctx, PR_1_ALLOCATE_BBITMAP_ERROR, &pctx);
+		/* Should never get here */
+		ctx->flags |= E2F_FLAG_ABORT;
+		return 1;
+	}
+	return 0;
+}
 
+/*
+ * Every inode which claims a multiply-claimed block after the last one
+ * was found trips over it here, so pass 1b only has to look at the
+ * inodes up to where the scan was at that point; the deferred inodes
+ * in inodes_to_process all come before it.
+ */
+static _INLINE_ void note_dup_block(e2fsck_t ctx)
+{
+	ctx->dup_last_ino = scan_ino;
+}
+
+static _INLINE_ void mark_block_used(e2fsck_t ctx, blk64_t block)
+{
 	if (ext2fs_fast_test_block_bitmap2(ctx->block_found_map, block)) {
-		if (!ctx->block_dup_map) {
-			pctx.errcode = e2fsck_allocate_block_bitmap(ctx->fs,
-					_("multiply claimed block map"),
-					EXT2FS_BMAP64_RBTREE, "block_dup_map",
-					&ctx->block_dup_map);
-			if (pctx.errcode) {
-				pctx.num = 3;
-				fix_problem(ctx, PR_1_ALLOCATE_BBITMAP_ERROR,
-					    &pctx);
-				/* Should never get here */
-				ctx->flags |= E2F_FLAG_ABORT;
-				return;
-			}
-		}
+		if (alloc_block_dup_map(ctx))
+			return;
+		note_dup_block(ctx);
 		ext2fs_fast_mark_block_bitmap2(ctx->block_dup_map, block);
 	} else {
 		ext2fs_fast_mark_block_bitmap2(ctx->block_found_map, block);
 	}
 }
 
+/*
+ * Called by ext2fs_mark_block_bitmap_range_test2() for each run of
+ * blocks which were already in use.
+ */
+static errcode_t mark_dup_blocks(ext2fs_block_bitmap bmap EXT2FS_ATTR((unused)),
+				 blk64_t block, blk64_t num, void *priv_data)
+{
+	e2fsck_t ctx = (e2fsck_t) priv_data;
+
+	if (alloc_block_dup_map(ctx))
+		return EXT2_ET_NO_MEMORY;
+	note_dup_block(ctx);
+	ext2fs_mark_block_bitmap_range2(ctx->block_dup_map, block, num);
+	return 0;
+}
+
 static _INLINE_ void mark_blocks_used(e2fsck_t ctx, blk64_t block,
 				      unsigned int num)
 {
-	if (ext2fs_test_block_bitmap_range2(ctx->block_found_map, block, num))
-		ext2fs_mark_block_bitmap_range2(ctx->block_found_map, block, num);
-	else
-		while (num--)
-			mark_block_used(ctx, block++);
+	ext2fs_mark_block_bitmap_range_test2(ctx->block_found_map, block, num,
+					     mark_dup_blocks, ctx);
+}
+
+/*
+ * process_block() sees the blocks of an indirect-mapped file one at a
+ * time; collect physically contiguous ones so that they can be marked
+ * with a single call to mark_blocks_used().
+ */
+static void flush_blocks_used(struct process_block_struct *p)
+{
+	if (p->run_len)
+		mark_blocks_used(p->ctx, p->run_start, p->run_len);
+	p->run_len = 0;
+}
+
+static _INLINE_ void defer_block_used(struct process_block_struct *p,
+				      blk64_t blk)
+{
+	if (p->run_len && blk == p->run_start + p->run_len &&
+	    p->run_len < (1U << 30)) {
+		p->run_len++;
+		return;
+	}
+	flush_blocks_used(p);
+	p->run_start = blk;
+	p->run_len = 1;
 }
 
 /*
@@ -1697,15 +1994,20 @@ clear_extattr:
 }
 
 /* Returns 1 if bad htree, 0 if OK */
+/*
+ * On success, *root_blk is set to the root block if it is in block_buf,
+ * or to zero if it couldn't be read.
+ */
 static int handle_htree(e2fsck_t ctx, struct problem_context *pctx,
 			ext2_ino_t ino, struct ext2_inode *inode,
-			char *block_buf)
+			char *block_buf, blk64_t *root_blk)
 {
 	struct ext2_dx_root_info	*root;
 	ext2_filsys			fs = ctx->fs;
 	errcode_t			retval;
 	blk64_t				blk;
 
+	*root_blk = 0;
 	if ((!LINUX_S_ISDIR(inode->i_mode) &&
 	     fix_problem(ctx, PR_1_HTREE_NODIR, pctx)) ||
 	    (!(fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
@@ -1727,6 +2029,8 @@ static int handle_htree(e2fsck_t ctx, struct problem_context *pctx,
 	retval = io_channel_read_blk64(fs->io, blk, 1, block_buf);
 	if (retval && fix_problem(ctx, PR_1_HTREE_BADROOT, pctx))
 		return 1;
+	if (!retval)
+		*root_blk = blk;
 
 	/* XXX should check that beginning matches a directory */
 	root = (struct ext2_dx_root_info *) (block_buf + 24);
@@ -1782,6 +2086,69 @@ void e2fsck_clear_inode(e2fsck_t ctx, ext2_ino_t ino,
 	e2fsck_write_inode(ctx, ino, inode, source);
 }
 
+#define EXTENT_RA_BATCH	64
+
+static EXT2_QSORT_TYPE blk64_cmp(const void *a, const void *b)
+{
+	const blk64_t	blk_a = *(const blk64_t *) a;
+	const blk64_t	blk_b = *(const blk64_t *) b;
+
+	return (blk_a > blk_b) - (blk_a < blk_b);
+}
+
+/* Sort the blocks and ask for them in as few contiguous runs as possible */
+static void readahead_blocks(ext2_filsys fs, blk64_t *blks, int count)
+{
+	int	i, start;
+
+	qsort(blks, count, sizeof(blk64_t), blk64_cmp);
+	for (start = 0, i = 1; i <= count; i++) {
+		if (i < count && blks[i] <= blks[i - 1] + 1)
+			continue;
+		(void) io_channel_cache_readahead(fs->io, blks[start],
+					blks[i - 1] - blks[start] + 1);
+		start = i;
+	}
+}
+
+/*
+ * The handle is on the first entry of an index node; start reading all
+ * of the child nodes now, so that scan_extent_node() doesn't have to
+ * wait for each of them in turn.  This only walks the entries already
+ * in memory, and leaves the handle where it found it.
+ */
+static void readahead_extent_children(e2fsck_t ctx,
+				      ext2_extent_handle_t ehandle,
+				      int num_entries)
+{
+	ext2_filsys		fs = ctx->fs;
+	struct ext2fs_extent	extent;
+	blk64_t			blks[EXTENT_RA_BATCH];
+	int			count = 0;
+	errcode_t		retval;
+
+	if (!ctx->readahead_kb || num_entries < 2)
+		return;
+
+	retval = ext2fs_extent_get(ehandle, EXT2_EXTENT_CURRENT, &extent);
+	while (!retval) {
+		if (extent.e_pblk >= fs->super->s_first_data_block &&
+		    extent.e_pblk < ext2fs_blocks_count(fs->super))
+			blks[count++] = extent.e_pblk;
+		if (count == EXTENT_RA_BATCH) {
+			readahead_blocks(fs, blks, count);
+			count = 0;
+		}
+		if (--num_entries <= 0)
+			break;
+		retval = ext2fs_extent_get(ehandle, EXT2_EXTENT_NEXT_SIB,
+					   &extent);
+	}
+	if (count)
+		readahead_blocks(fs, blks, count);
+	(void) ext2fs_extent_get(ehandle, EXT2_EXTENT_FIRST_SIB, &extent);
+}
+
 static void scan_extent_node(e2fsck_t ctx, struct problem_context *pctx,
 			     struct process_block_struct *pb,
 			     blk64_t start_block, blk64_t end_block,
@@ -1802,6 +2169,8 @@ static void scan_extent_node(e2fsck_t ctx, struct problem_context *pctx,
 
 	pctx->errcode = ext2fs_extent_get(ehandle, EXT2_EXTENT_FIRST_SIB,
 					  &extent);
+	if (!pctx->errcode && !(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF))
+		readahead_extent_children(ctx, ehandle, info.num_entries);
 	while (!pctx->errcode && info.num_entries-- > 0) {
 		is_leaf = extent.e_flags & EXT2_EXTENT_FLAGS_LEAF;
 		is_dir = LINUX_S_ISDIR(pctx->inode->i_mode);
@@ -2032,6 +2401,7 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 	int		dirty_inode = 0;
 	int		extent_fs;
 	__u64		size;
+	blk64_t		root_blk;
 
 	pb.ino = ino;
 	pb.num_blocks = 0;
@@ -2043,6 +2413,7 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 	pb.fragmented = 0;
 	pb.compressed = 0;
 	pb.previous_block = 0;
+	pb.run_len = 0;
 	pb.is_dir = LINUX_S_ISDIR(inode->i_mode);
 	pb.is_reg = LINUX_S_ISREG(inode->i_mode);
 	pb.max_blocks = 1 << (31 - fs->super->s_log_block_size);
@@ -2081,6 +2452,7 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 			pctx->errcode = ext2fs_block_iterate3(fs, ino,
 						pb.is_dir ? BLOCK_FLAG_HOLE : 0,
 						block_buf, process_block, &pb);
+			flush_blocks_used(&pb);
 			/*
 			 * We do not have uninitialized extents in non extent
 			 * files.
@@ -2109,12 +2481,16 @@ static void check_blocks(e2fsck_t ctx, struct problem_context *pctx,
 	}
 
 	if (inode->i_flags & EXT2_INDEX_FL) {
-		if (handle_htree(ctx, pctx, ino, inode, block_buf)) {
+		if (handle_htree(ctx, pctx, ino, inode, block_buf,
+				 &root_blk)) {
 			inode->i_flags &= ~EXT2_INDEX_FL;
 			dirty_inode++;
 		} else {
 #ifdef ENABLE_HTREE
 			e2fsck_add_dx_dir(ctx, ino, pb.last_block+1);
+			if (root_blk)
+				e2fsck_save_dx_root(ctx, ino, root_blk,
+						    block_buf);
 #endif
 		}
 	}
@@ -2388,8 +2764,10 @@ static int process_block(ext2_filsys fs,
 		if (blockcnt == BLOCK_COUNT_DIND)
 			mark_block_used(ctx, blk);
 		p->num_blocks++;
-	} else if (!(ctx->fs->cluster_ratio_bits &&
-		     p->previous_block &&
+	} else if (!ctx->fs->cluster_ratio_bits) {
+		defer_block_used(p, blk);
+		p->num_blocks++;
+	} else if (!(p->previous_block &&
 		     (EXT2FS_B2C(ctx->fs, blk) ==
 		      EXT2FS_B2C(ctx->fs, p->previous_block)) &&
 		     (blk & EXT2FS_CLUSTER_MASK(ctx->fs)) ==
@@ -2717,6 +3095,72 @@ static void handle_fs_bad_blocks(e2fsck_t ctx)
 	ctx->invalid_bitmaps = 0;
 }
 
+/*
+ * A partial check has only seen the files in its own groups, so once
+ * they have all been scanned, take the on-disk bitmaps' word for the
+ * blocks and the inodes outside them; that way nothing which might
+ * belong to someone else gets handed out or reported as free.  Any
+ * block or inode in the groups which is in use but marked free on disk
+ * still shows up in pass 5.
+ */
+static void merge_scope_bitmaps(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	dgrp_t		g;
+	blk64_t		start;
+	ext2_ino_t	ino;
+	unsigned int	i, num, nbytes;
+	char		*buf, *disk_buf;
+	errcode_t	retval = 0;
+
+	e2fsck_read_bitmaps(ctx);
+	nbytes = fs->super->s_clusters_per_group;
+	if (nbytes < fs->super->s_inodes_per_group)
+		nbytes = fs->super->s_inodes_per_group;
+	nbytes = (nbytes + 7) / 8;
+	buf = e2fsck_allocate_memory(ctx, nbytes, "scope bitmap buffer");
+	disk_buf = e2fsck_allocate_memory(ctx, nbytes, "scope bitmap buffer");
+
+	for (g = 0; g < fs->group_desc_count; g++) {
+		start = EXT2FS_B2C(fs, ext2fs_group_first_block2(fs, g));
+		num = EXT2FS_NUM_B2C(fs, ext2fs_group_blocks_count(fs, g));
+		retval = ext2fs_get_block_bitmap_range2(ctx->block_found_map,
+							start, num, buf);
+		if (!retval)
+			retval = ext2fs_get_block_bitmap_range2(fs->block_map,
+							start, num, disk_buf);
+		if (retval)
+			break;
+		if (num % 8)
+			disk_buf[num / 8] &= (1 << (num % 8)) - 1;
+		for (i = 0; i < (num + 7) / 8; i++)
+			buf[i] |= disk_buf[i];
+		retval = ext2fs_set_block_bitmap_range2(ctx->block_found_map,
+							start, num, buf);
+		if (retval)
+			break;
+
+		if (e2fsck_group_in_scope(ctx, g))
+			continue;
+		ino = g * fs->super->s_inodes_per_group + 1;
+		num = fs->super->s_inodes_per_group;
+		retval = ext2fs_get_inode_bitmap_range2(fs->inode_map, ino,
+							num, buf);
+		if (!retval)
+			retval = ext2fs_set_inode_bitmap_range2(
+					ctx->inode_used_map, ino, num, buf);
+		if (retval)
+			break;
+	}
+	ext2fs_free_mem(&disk_buf);
+	ext2fs_free_mem(&buf);
+	if (retval) {
+		com_err(ctx->program_name, retval, "%s",
+			_("while merging the on-disk bitmaps"));
+		fatal_error(ctx, 0);
+	}
+}
+
 /*
  * This routine marks all blocks which are used by the superblock,
  * group descriptors, inode bitmaps, and block bitmaps.
@@ -2854,13 +3298,29 @@ static errcode_t e2fsck_get_alloc_block(ext2_filsys fs, blk64_t goal,
 {
 	e2fsck_t ctx = (e2fsck_t) fs->priv_data;
 	errcode_t	retval;
-	blk64_t		new_block;
+	blk64_t		new_block, first;
 
 	if (ctx->block_found_map) {
 		retval = ext2fs_new_block2(fs, goal, ctx->block_found_map,
 					   &new_block);
 		if (retval)
 			return retval;
+		/*
+		 * Until pass 1 has merged in the on-disk bitmap, a
+		 * partial check doesn't know about the blocks of the
+		 * files outside its groups.
+		 */
+		first = new_block;
+		while ((ctx->options & E2F_OPT_GROUPS) && fs->block_map &&
+		       ext2fs_test_block_bitmap2(fs->block_map, new_block)) {
+			retval = ext2fs_new_block2(fs, new_block + 1,
+						   ctx->block_found_map,
+						   &new_block);
+			if (retval)
+				return retval;
+			if (new_block == first)
+				return EXT2_ET_BLOCK_ALLOC_FAIL;
+		}
 		if (fs->block_map) {
 			ext2fs_mark_block_bitmap2(fs->block_map, new_block);
 			ext2fs_mark_bb_dirty(fs);
@@ -32,23 +32,16 @@
 #include <errno.h>
 #endif
 
-#ifdef HAVE_INTTYPES_H
-#include <inttypes.h>
-#endif
-
-#ifndef HAVE_INTPTR_T
-typedef long intptr_t;
-#endif
-
-/* Needed for architectures where sizeof(int) != sizeof(void *) */
-#define INT_TO_VOIDPTR(val)  ((void *)(intptr_t)(val))
-#define VOIDPTR_TO_INT(ptr)  ((int)(intptr_t)(ptr))
-
 #include <et/com_err.h>
 #include "e2fsck.h"
 
 #include "problem.h"
-#include "dict.h"
+
+#ifdef NO_INLINE_FUNCS
+#define _INLINE_
+#else
+#define _INLINE_ inline
+#endif
 
 /* Define an extension to the ext2 library's block count information */
 #define BLOCK_COUNT_EXTATTR	(-5)
@@ -63,7 +56,23 @@ struct inode_el {
 	struct inode_el *next;
 };
 
+/*
+ * The cluster and inode records are kept in chained hash tables; the
+ * key and chain pointer have to be the first thing in each record.
+ */
+struct dup_hash_node {
+	unsigned long long	key;
+	struct dup_hash_node	*next;
+};
+
+struct dup_hash {
+	struct dup_hash_node	**table;
+	unsigned int		bits;
+	unsigned int		count;
+};
+
 struct dup_cluster {
+	struct dup_hash_node	h;	/* key is the cluster number */
 	int		num_bad;
 	struct inode_el *inode_list;
 };
@@ -76,6 +85,7 @@ struct dup_cluster {
  * of multiply-claimed blocks.
  */
 struct dup_inode {
+	struct dup_hash_node	h;	/* key is the inode number */
 	ext2_ino_t		dir;
 	int			num_dupblocks;
 	struct ext2_inode	inode;
@@ -85,6 +95,8 @@ struct dup_inode {
 static int process_pass1b_block(ext2_filsys fs, blk64_t	*blocknr,
 				e2_blkcnt_t blockcnt, blk64_t ref_blk,
 				int ref_offset, void *priv_data);
+static int process_pass1b_run(ext2_filsys fs, blk64_t lblk, blk64_t pblk,
+			      __u32 len, int flags, void *priv_data);
 static void delete_file(e2fsck_t ctx, ext2_ino_t ino,
 			struct dup_inode *dp, char *block_buf);
 static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
@@ -99,18 +111,133 @@ static void pass1d(e2fsck_t ctx, char *block_buf);
 static int dup_inode_count = 0;
 static int dup_inode_founddir = 0;
 
-static dict_t clstr_dict, ino_dict;
+static struct dup_hash clstr_hash, ino_hash;
 
 static ext2fs_inode_bitmap inode_dup_map;
 
-static int dict_int_cmp(const void *a, const void *b)
+/*
+ * All of the records and list elements are carved out of large
+ * chunks, which are only freed (all at once) when pass 1d is done.
+ */
+#define DUP_POOL_CHUNK_SIZE	65536
+
+struct dup_pool_chunk {
+	struct dup_pool_chunk	*next;
+	unsigned long long	pad;	/* keep the records aligned */
+};
+
+static struct dup_pool_chunk *dup_pool;
+static char *dup_pool_ptr;
+static size_t dup_pool_left;
+static unsigned long long dup_pool_bytes;
+
+static void *dup_alloc(e2fsck_t ctx, size_t size)
+{
+	struct dup_pool_chunk	*chunk;
+	void			*ret;
+
+	size = (size + 7) & ~7;
+	if (size > dup_pool_left) {
+		chunk = e2fsck_allocate_memory(ctx, DUP_POOL_CHUNK_SIZE,
+					       "duplicate block records");
+		chunk->next = dup_pool;
+		dup_pool = chunk;
+		dup_pool_ptr = (char *) (chunk + 1);
+		dup_pool_left = DUP_POOL_CHUNK_SIZE - sizeof(*chunk);
+		dup_pool_bytes += DUP_POOL_CHUNK_SIZE;
+	}
+	ret = dup_pool_ptr;
+	dup_pool_ptr += size;
+	dup_pool_left -= size;
+	return ret;
+}
+
+static void dup_pool_free(void)
+{
+	struct dup_pool_chunk	*chunk, *next;
+
+	for (chunk = dup_pool; chunk; chunk = next) {
+		next = chunk->next;
+		ext2fs_free_mem(&chunk);
+	}
+	dup_pool = 0;
+	dup_pool_ptr = 0;
+	dup_pool_left = 0;
+	dup_pool_bytes = 0;
+}
+
+#define DUP_HASH_INIT_BITS	10
+
+static _INLINE_ unsigned int dup_hash_fn(struct dup_hash *h,
+					 unsigned long long key)
+{
+	return (key * 0x9E3779B97F4A7C15ULL) >> (64 - h->bits);
+}
+
+static void dup_hash_init(e2fsck_t ctx, struct dup_hash *h)
+{
+	h->bits = DUP_HASH_INIT_BITS;
+	h->count = 0;
+	h->table = e2fsck_allocate_memory(ctx,
+			sizeof(struct dup_hash_node *) << h->bits,
+			"duplicate block hash table");
+}
+
+static void dup_hash_free(struct dup_hash *h)
+{
+	ext2fs_free_mem(&h->table);
+	h->count = 0;
+}
+
+static struct dup_hash_node *dup_hash_lookup(struct dup_hash *h,
+					     unsigned long long key)
+{
+	struct dup_hash_node *n;
+
+	for (n = h->table[dup_hash_fn(h, key)]; n; n = n->next)
+		if (n->key == key)
+			return n;
+	return 0;
+}
+
+static void dup_hash_insert(e2fsck_t ctx, struct dup_hash *h,
+			    struct dup_hash_node *n)
 {
-	intptr_t	ia, ib;
+	struct dup_hash_node	**old, *p, *next;
+	unsigned int		i, old_size, b;
+
+	/* Keep the chains short by doubling the table as it fills */
+	if (h->count >= (1U << h->bits)) {
+		old = h->table;
+		old_size = 1U << h->bits;
+		h->bits++;
+		h->table = e2fsck_allocate_memory(ctx,
+				sizeof(struct dup_hash_node *) << h->bits,
+				"duplicate block hash table");
+		for (i = 0; i < old_size; i++) {
+			for (p = old[i]; p; p = next) {
+				next = p->next;
+				b = dup_hash_fn(h, p->key);
+				p->next = h->table[b];
+				h->table[b] = p;
+			}
+		}
+		ext2fs_free_mem(&old);
+	}
+	b = dup_hash_fn(h, n->key);
+	n->next = h->table[b];
+	h->table[b] = n;
+	h->count++;
+}
 
-	ia = (intptr_t)a;
-	ib = (intptr_t)b;
+static _INLINE_ struct dup_cluster *find_dup_cluster(blk64_t cluster)
+{
+	return (struct dup_cluster *) dup_hash_lookup(&clstr_hash, cluster);
+}
 
-	return (ia-ib);
+static _INLINE_ struct dup_inode *find_dup_inode(ext2_ino_t ino)
+{
+	return (struct dup_inode *) dup_hash_lookup(&ino_hash, ino);
 }
 
 /*
@@ -119,35 +246,29 @@ static int dict_int_cmp(const void *a, const void *b)
 static void add_dupe(e2fsck_t ctx, ext2_ino_t ino, blk64_t cluster,
 		     struct ext2_inode *inode)
 {
-	dnode_t	*n;
 	struct dup_cluster	*db;
 	struct dup_inode	*di;
 	struct cluster_el	*cluster_el;
 	struct inode_el 	*ino_el;
 
-	n = dict_lookup(&clstr_dict, INT_TO_VOIDPTR(cluster));
-	if (n)
-		db = (struct dup_cluster *) dnode_get(n);
-	else {
-		db = (struct dup_cluster *) e2fsck_allocate_memory(ctx,
-			sizeof(struct dup_cluster), "duplicate cluster header");
+	db = find_dup_cluster(cluster);
+	if (!db) {
+		db = dup_alloc(ctx, sizeof(struct dup_cluster));
+		db->h.key = cluster;
 		db->num_bad = 0;
 		db->inode_list = 0;
-		dict_alloc_insert(&clstr_dict, INT_TO_VOIDPTR(cluster), db);
+		dup_hash_insert(ctx, &clstr_hash, &db->h);
 	}
-	ino_el = (struct inode_el *) e2fsck_allocate_memory(ctx,
-			 sizeof(struct inode_el), "inode element");
+	ino_el = dup_alloc(ctx, sizeof(struct inode_el));
 	ino_el->inode = ino;
 	ino_el->next = db->inode_list;
 	db->inode_list = ino_el;
 	db->num_bad++;
 
-	n = dict_lookup(&ino_dict, INT_TO_VOIDPTR(ino));
-	if (n)
-		di = (struct dup_inode *) dnode_get(n);
-	else {
-		di = (struct dup_inode *) e2fsck_allocate_memory(ctx,
-			 sizeof(struct dup_inode), "duplicate inode header");
+	di = find_dup_inode(ino);
+	if (!di) {
+		di = dup_alloc(ctx, sizeof(struct dup_inode));
+		di->h.key = ino;
 		if (ino == EXT2_ROOT_INO) {
 			di->dir = EXT2_ROOT_INO;
 			dup_inode_founddir++;
@@ -157,52 +278,15 @@ static void add_dupe(e2fsck_t ctx, ext2_ino_t ino, blk64_t cluster,
 		di->num_dupblocks = 0;
 		di->cluster_list = 0;
 		di->inode = *inode;
-		dict_alloc_insert(&ino_dict, INT_TO_VOIDPTR(ino), di);
+		dup_hash_insert(ctx, &ino_hash, &di->h);
 	}
-	cluster_el = (struct cluster_el *) e2fsck_allocate_memory(ctx,
-			 sizeof(struct cluster_el), "cluster element");
+	cluster_el = dup_alloc(ctx, sizeof(struct cluster_el));
 	cluster_el->cluster = cluster;
 	cluster_el->next = di->cluster_list;
 	di->cluster_list = cluster_el;
 	di->num_dupblocks++;
 }
 
-/*
- * Free a duplicate inode record
- */
-static void inode_dnode_free(dnode_t *node,
-			     void *context EXT2FS_ATTR((unused)))
-{
-	struct dup_inode	*di;
-	struct cluster_el		*p, *next;
-
-	di = (struct dup_inode *) dnode_get(node);
-	for (p = di->cluster_list; p; p = next) {
-		next = p->next;
-		free(p);
-	}
-	free(di);
-	free(node);
-}
-
-/*
- * Free a duplicate cluster record
- */
-static void cluster_dnode_free(dnode_t *node,
-			       void *context EXT2FS_ATTR((unused)))
-{
-	struct dup_cluster	*dc;
-	struct inode_el		*p, *next;
-
-	dc = (struct dup_cluster *) dnode_get(node);
-	for (p = dc->inode_list; p; p = next) {
-		next = p->next;
-		free(p);
-	}
-	free(dc);
-	free(node);
-}
-
 
 /*
  * Main procedure for handling duplicate blocks
@@ -227,20 +311,23 @@ void e2fsck_pass1_dupblocks(e2fsck_t ctx, char *block_buf)
 		return;
 	}
 
-	dict_init(&ino_dict, DICTCOUNT_T_MAX, dict_int_cmp);
-	dict_init(&clstr_dict, DICTCOUNT_T_MAX, dict_int_cmp);
-	dict_set_allocator(&ino_dict, NULL, inode_dnode_free, NULL);
-	dict_set_allocator(&clstr_dict, NULL, cluster_dnode_free, NULL);
+	dup_hash_init(ctx, &ino_hash);
+	dup_hash_init(ctx, &clstr_hash);
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	pass1b(ctx, block_buf);
+	/* Nothing is added to the records once pass 1b is done */
+	e2fsck_mem_account(ctx, E2F_MEM_PASS1B, dup_pool_bytes +
+			   ((sizeof(struct dup_hash_node *) << ino_hash.bits) +
+			    (sizeof(struct dup_hash_node *) << clstr_hash.bits)) +
+			   ext2fs_get_bmap_mem_usage(inode_dup_map));
 	print_resource_track(ctx, "Pass 1b", &rtrack, ctx->fs->io);
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	pass1c(ctx, block_buf);
 	print_resource_track(ctx, "Pass 1c", &rtrack, ctx->fs->io);
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	pass1d(ctx, block_buf);
 	print_resource_track(ctx, "Pass 1d", &rtrack, ctx->fs->io);
 
@@ -248,9 +335,11 @@ void e2fsck_pass1_dupblocks(e2fsck_t ctx, char *block_buf)
 	 * Time to free all of the accumulated data structures that we
 	 * don't need anymore.
 	 */
-	dict_free_nodes(&ino_dict);
-	dict_free_nodes(&clstr_dict);
+	dup_hash_free(&ino_hash);
+	dup_hash_free(&clstr_hash);
+	dup_pool_free();
 	ext2fs_free_inode_bitmap(inode_dup_map);
+	e2fsck_mem_account(ctx, E2F_MEM_PASS1B, 0);
 }
 
 /*
@@ -280,6 +369,11 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 		fix_problem(ctx, PR_1B_PASS_HEADER, &pctx);
 	pctx.errcode = ext2fs_open_inode_scan(fs, ctx->inode_buffer_blocks,
 					      &scan);
+	if (!pctx.errcode && (ctx->options & E2F_OPT_GROUPS))
+		pctx.errcode = ext2fs_inode_scan_set_groups(scan,
+				ctx->scope_first_group,
+				ctx->scope_last_group -
+				ctx->scope_first_group + 1);
 	if (pctx.errcode) {
 		fix_problem(ctx, PR_1B_ISCAN_ERROR, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
@@ -302,7 +396,12 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 			ctx->flags |= E2F_FLAG_ABORT;
 			return;
 		}
-		if (!ino)
+		/*
+		 * Pass 1 found the last multiply-claimed block while it
+		 * was at dup_last_ino; any inode after that claiming one
+		 * would have been noticed then, so it can't have any.
+		 */
+		if (!ino || ino > ctx->dup_last_ino)
 			break;
 		pctx.ino = ctx->stashed_ino = ino;
 		if ((ino != EXT2_BAD_INO) &&
@@ -316,9 +415,8 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 
 		if (ext2fs_inode_has_valid_blocks2(fs, &inode) ||
 		    (ino == EXT2_BAD_INO))
-			pctx.errcode = ext2fs_block_iterate3(fs, ino,
-					     BLOCK_FLAG_READ_ONLY, block_buf,
-					     process_pass1b_block, &pb);
+			pctx.errcode = ext2fs_extent_iterate(fs, ino, 0,
+					     block_buf, process_pass1b_run, &pb);
 		/* If the feature is not set, attrs will be cleared later anyway */
 		if ((fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_EXT_ATTR) &&
 		    ext2fs_file_acl_block(fs, &inode)) {
@@ -376,6 +474,42 @@ finish:
 	return 0;
 }
 
+/*
+ * Most runs have no multiply-claimed block at all, and are passed over
+ * with one test of the bitmap; the others are looked at block by block.
+ */
+static int process_pass1b_run(ext2_filsys fs, blk64_t lblk, blk64_t pblk,
+			      __u32 len, int flags, void *priv_data)
+{
+	struct process_block_struct *p;
+	blk64_t	blk;
+	__u32	i;
+
+	p = (struct process_block_struct *) priv_data;
+	if (flags & EXT2_EXTENT_ITERATE_METADATA) {
+		/*
+		 * Indirect blocks each had a block count of their own,
+		 * so none of them is taken for part of the last cluster.
+		 */
+		if (!(p->inode->i_flags & EXT4_EXTENTS_FL))
+			p->cur_cluster = 0;
+		return process_pass1b_block(fs, &pblk, BLOCK_COUNT_IND,
+					    0, 0, priv_data);
+	}
+	if (pblk >= fs->super->s_first_data_block &&
+	    pblk + len <= ext2fs_blocks_count(fs->super) &&
+	    ext2fs_test_block_bitmap_range2(p->ctx->block_dup_map,
+					    pblk, len)) {
+		p->cur_cluster = EXT2FS_B2C(fs, lblk + len - 1);
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		blk = pblk + i;
+		process_pass1b_block(fs, &blk, lblk + i, 0, 0, priv_data);
+	}
+	return 0;
+}
+
 /*
  * Pass 1c: Scan directories for inodes with duplicate blocks.  This
  * is used so that we can print pathnames when prompting the user for
@@ -396,7 +530,6 @@ static int search_dirent_proc(ext2_ino_t dir, int entry,
 {
 	struct search_dir_struct *sd;
 	struct dup_inode	*p;
-	dnode_t			*n;
 
 	sd = (struct search_dir_struct *) priv_data;
 
@@ -408,10 +541,9 @@ static int search_dirent_proc(ext2_ino_t dir, int entry,
 	    !ext2fs_test_inode_bitmap2(inode_dup_map, dirent->inode))
 		return 0;
 
-	n = dict_lookup(&ino_dict, INT_TO_VOIDPTR(dirent->inode));
-	if (!n)
+	p = find_dup_inode(dirent->inode);
+	if (!p)
 		return 0;
-	p = (struct dup_inode *) dnode_get(n);
 	if (!p->dir) {
 		p->dir = dir;
 		sd->count--;
@@ -443,18 +575,29 @@ static void pass1c(e2fsck_t ctx, char *block_buf)
 				  search_dirent_proc, &sd);
 }
 
+static int dup_inode_cmp(const void *a, const void *b)
+{
+	const struct dup_inode *ia = *(const struct dup_inode **) a;
+	const struct dup_inode *ib = *(const struct dup_inode **) b;
+
+	if (ia->h.key < ib->h.key)
+		return -1;
+	return ia->h.key > ib->h.key;
+}
+
 static void pass1d(e2fsck_t ctx, char *block_buf)
 {
 	ext2_filsys fs = ctx->fs;
-	struct dup_inode	*p, *t;
+	struct dup_inode	*p, *t, **inodes;
 	struct dup_cluster	*q;
+	struct dup_hash_node	*n;
 	ext2_ino_t		*shared, ino;
 	int	shared_len;
 	int	i;
+	unsigned int	b, j, num_inodes;
 	int	file_ok;
 	int	meta_data = 0;
 	struct problem_context pctx;
-	dnode_t	*n, *m;
 	struct cluster_el	*s;
 	struct inode_el *r;
 
@@ -464,16 +607,27 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 		fix_problem(ctx, PR_1D_PASS_HEADER, &pctx);
 	e2fsck_read_bitmaps(ctx);
 
-	pctx.num = dup_inode_count; /* dict_count(&ino_dict); */
+	pctx.num = dup_inode_count; /* ino_hash.count */
 	fix_problem(ctx, PR_1D_NUM_DUP_INODES, &pctx);
 	shared = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
-				sizeof(ext2_ino_t) * dict_count(&ino_dict),
+				sizeof(ext2_ino_t) * ino_hash.count,
 				"Shared inode list");
-	for (n = dict_first(&ino_dict); n; n = dict_next(&ino_dict, n)) {
-		p = (struct dup_inode *) dnode_get(n);
+
+	/* Deal with the inodes in order, as the problem reports expect */
+	inodes = (struct dup_inode **) e2fsck_allocate_memory(ctx,
+				sizeof(struct dup_inode *) * ino_hash.count,
+				"Duplicate inode list");
+	num_inodes = 0;
+	for (b = 0; b < (1U << ino_hash.bits); b++)
+		for (n = ino_hash.table[b]; n; n = n->next)
+			inodes[num_inodes++] = (struct dup_inode *) n;
+	qsort(inodes, num_inodes, sizeof(struct dup_inode *), dup_inode_cmp);
+
+	for (j = 0; j < num_inodes; j++) {
+		p = inodes[j];
 		shared_len = 0;
 		file_ok = 1;
-		ino = (ext2_ino_t)VOIDPTR_TO_INT(dnode_getkey(n));
+		ino = p->h.key;
 		if (ino == EXT2_BAD_INO || ino == EXT2_RESIZE_INO)
 			continue;
 
@@ -484,11 +638,9 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 		 * get the list of inodes, and merge them together.
 		 */
 		for (s = p->cluster_list; s; s = s->next) {
-			m = dict_lookup(&clstr_dict,
-					INT_TO_VOIDPTR(s->cluster));
-			if (!m)
+			q = find_dup_cluster(s->cluster);
+			if (!q)
 				continue; /* Should never happen... */
-			q = (struct dup_cluster *) dnode_get(m);
 			if (q->num_bad > 1)
 				file_ok = 0;
 			if (check_if_fs_cluster(ctx, s->cluster)) {
@@ -530,10 +682,9 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 			fix_problem(ctx, PR_1D_SHARE_METADATA, &pctx);
 
 		for (i = 0; i < shared_len; i++) {
-			m = dict_lookup(&ino_dict, INT_TO_VOIDPTR(shared[i]));
-			if (!m)
+			t = find_dup_inode(shared[i]);
+			if (!t)
 				continue; /* should never happen */
-			t = (struct dup_inode *) dnode_get(m);
 			/*
 			 * Report the inode that we are sharing with
 			 */
@@ -558,6 +709,7 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 		else
 			ext2fs_unmark_valid(fs);
 	}
+	ext2fs_free_mem(&inodes);
 	ext2fs_free_mem(&shared);
 }
 
@@ -586,7 +738,6 @@ static int delete_file_block(ext2_filsys fs,
 {
 	struct process_block_struct *pb;
 	struct dup_cluster *p;
-	dnode_t	*n;
 	e2fsck_t ctx;
 	blk64_t c, lc;
 
@@ -599,9 +750,8 @@ static int delete_file_block(ext2_filsys fs,
 	c = EXT2FS_B2C(fs, *block_nr);
 	lc = EXT2FS_B2C(fs, blockcnt);
 	if (ext2fs_test_block_bitmap2(ctx->block_dup_map, *block_nr)) {
-		n = dict_lookup(&clstr_dict, INT_TO_VOIDPTR(c));
-		if (n) {
-			p = (struct dup_cluster *) dnode_get(n);
+		p = find_dup_cluster(c);
+		if (p) {
 			if (lc != pb->cur_cluster)
 				decrement_badcount(ctx, *block_nr, p);
 		} else
@@ -682,15 +832,65 @@ static void delete_file(e2fsck_t ctx, ext2_ino_t ino,
 	}
 }
 
+/*
+ * Copies of consecutive data blocks to consecutive new blocks are
+ * batched up into a single read and write of up to this many blocks.
+ */
+#define CLONE_BATCH_BLOCKS	64
+
 struct clone_struct {
 	errcode_t	errcode;
 	blk64_t		dup_cluster;
 	blk64_t		alloc_block;
+	blk64_t		goal;
+	blk64_t		copy_src, copy_dst;	/* pending copy */
+	int		copy_len;
 	ext2_ino_t	dir;
 	char	*buf;
 	e2fsck_t ctx;
 };
 
+static errcode_t clone_flush_copy(ext2_filsys fs, struct clone_struct *cs)
+{
+	errcode_t	retval;
+
+	if (!cs->copy_len)
+		return 0;
+	retval = io_channel_read_blk64(fs->io, cs->copy_src, cs->copy_len,
+				       cs->buf);
+	if (!retval)
+		retval = io_channel_write_blk64(fs->io, cs->copy_dst,
+						cs->copy_len, cs->buf);
+	cs->copy_len = 0;
+	return retval;
+}
+
+/*
+ * Queue up the copy of block src to dst.  Metadata blocks are copied
+ * right away, since the block iterator reads them back from their new
+ * location as soon as we return.
+ */
+static errcode_t clone_copy_block(ext2_filsys fs, struct clone_struct *cs,
+				  blk64_t src, blk64_t dst, int metadata)
+{
+	errcode_t	retval;
+
+	if (cs->copy_len &&
+	    (src != cs->copy_src + cs->copy_len ||
+	     dst != cs->copy_dst + cs->copy_len ||
+	     cs->copy_len >= CLONE_BATCH_BLOCKS)) {
+		retval = clone_flush_copy(fs, cs);
+		if (retval)
+			return retval;
+	}
+	if (!cs->copy_len) {
+		cs->copy_src = src;
+		cs->copy_dst = dst;
+	}
+	cs->copy_len++;
+	return metadata ? clone_flush_copy(fs, cs) : 0;
+}
+
 static int clone_file_block(ext2_filsys fs,
 			    blk64_t	*block_nr,
 			    e2_blkcnt_t blockcnt,
@@ -702,7 +902,6 @@ static int clone_file_block(ext2_filsys fs,
 	blk64_t	new_block;
 	errcode_t	retval;
 	struct clone_struct *cs = (struct clone_struct *) priv_data;
-	dnode_t *n;
 	e2fsck_t ctx;
 	blk64_t c;
 	int is_meta = 0;
@@ -722,28 +921,28 @@ static int clone_file_block(ext2_filsys fs,
 	}
 
 	if (ext2fs_test_block_bitmap2(ctx->block_dup_map, *block_nr)) {
-		n = dict_lookup(&clstr_dict,
-				INT_TO_VOIDPTR(EXT2FS_B2C(fs, *block_nr)));
-		if (!n) {
+		p = find_dup_cluster(EXT2FS_B2C(fs, *block_nr));
+		if (!p) {
 			com_err("clone_file_block", 0,
 			    _("internal error: can't find dup_blk for %llu\n"),
 				*block_nr);
 			return 0;
 		}
 
-		p = (struct dup_cluster *) dnode_get(n);
 		if (!is_meta)
 			decrement_badcount(ctx, *block_nr, p);
 
 		cs->dup_cluster = c;
 
-		retval = ext2fs_new_block2(fs, 0, ctx->block_found_map,
+		/* Keep the copies of the file's blocks together */
+		retval = ext2fs_new_block2(fs, cs->goal, ctx->block_found_map,
 					   &new_block);
 		if (retval) {
 			cs->errcode = retval;
 			return BLOCK_ABORT;
 		}
 		cs->alloc_block = new_block;
+		cs->goal = new_block + EXT2FS_CLUSTER_RATIO(fs);
 
 	got_block:
 		new_block &= ~EXT2FS_CLUSTER_MASK(fs);
@@ -760,12 +959,8 @@ static int clone_file_block(ext2_filsys fs,
  		printf("Cloning block #%lld from %llu to %llu\n",
 		       blockcnt, *block_nr, new_block);
 #endif
-		retval = io_channel_read_blk64(fs->io, *block_nr, 1, cs->buf);
-		if (retval) {
-			cs->errcode = retval;
-			return BLOCK_ABORT;
-		}
-		retval = io_channel_write_blk64(fs->io, new_block, 1, cs->buf);
+		retval = clone_copy_block(fs, cs, *block_nr, new_block,
+					  blockcnt < 0);
 		if (retval) {
 			cs->errcode = retval;
 			return BLOCK_ABORT;
@@ -786,7 +981,6 @@ static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
 	struct clone_struct cs;
 	struct problem_context	pctx;
 	blk64_t		blk, new_blk;
-	dnode_t		*n;
 	struct inode_el	*ino_el;
 	struct dup_cluster	*dc;
 	struct dup_inode	*di;
@@ -796,8 +990,10 @@ static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
 	cs.dir = 0;
 	cs.dup_cluster = ~0;
 	cs.alloc_block = 0;
+	cs.goal = 0;
+	cs.copy_len = 0;
 	cs.ctx = ctx;
-	retval = ext2fs_get_mem(fs->blocksize, &cs.buf);
+	retval = ext2fs_get_array(CLONE_BATCH_BLOCKS, fs->blocksize, &cs.buf);
 	if (retval)
 		return retval;
 
@@ -809,6 +1005,8 @@ static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
 	if (ext2fs_inode_has_valid_blocks2(fs, &dp->inode))
 		pctx.errcode = ext2fs_block_iterate3(fs, ino, 0, block_buf,
 						     clone_file_block, &cs);
+	if (!cs.errcode)
+		cs.errcode = clone_flush_copy(fs, &cs);
 	ext2fs_mark_bb_dirty(fs);
 	if (pctx.errcode) {
 		fix_problem(ctx, PR_1B_BLOCK_ITERATE, &pctx);
@@ -835,21 +1033,19 @@ static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
 		 * which refered to that EA block, and modify
 		 * them to point to the new EA block.
 		 */
-		n = dict_lookup(&clstr_dict,
-				INT_TO_VOIDPTR(EXT2FS_B2C(fs, blk)));
-		if (!n) {
+		dc = find_dup_cluster(EXT2FS_B2C(fs, blk));
+		if (!dc) {
 			com_err("clone_file", 0,
 				_("internal error: couldn't lookup EA "
 				  "block record for %llu"), blk);
 			retval = 0; /* OK to stumble on... */
 			goto errout;
 		}
-		dc = (struct dup_cluster *) dnode_get(n);
 		for (ino_el = dc->inode_list; ino_el; ino_el = ino_el->next) {
 			if (ino_el->inode == ino)
 				continue;
-			n = dict_lookup(&ino_dict, INT_TO_VOIDPTR(ino_el->inode));
-			if (!n) {
+			di = find_dup_inode(ino_el->inode);
+			if (!di) {
 				com_err("clone_file", 0,
 					_("internal error: couldn't lookup EA "
 					  "inode record for %u"),
@@ -857,7 +1053,6 @@ static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
 				retval = 0; /* OK to stumble on... */
 				goto errout;
 			}
-			di = (struct dup_inode *) dnode_get(n);
 			if (ext2fs_file_acl_block(fs, &di->inode) == blk) {
 				ext2fs_file_acl_block_set(fs, &di->inode,
 					ext2fs_file_acl_block(fs, &dp->inode));
@@ -46,7 +46,6 @@
 
 #include "e2fsck.h"
 #include "problem.h"
-#include "dict.h"
 
 #ifdef NO_INLINE_FUNCS
 #define _INLINE_
@@ -71,11 +70,53 @@ static int htree_depth(struct dx_dir_info *dx_dir,
 		       struct dx_dirblock_info *dx_db);
 static EXT2_QSORT_TYPE special_dir_block_cmp(const void *a, const void *b);
 
+/*
+ * Directory blocks are read in batches covering the next
+ * DIR_BATCH_ENTRIES dblist entries.  Since the dblist is sorted by
+ * block number, neighbouring entries are merged into a single read,
+ * which also reads through gaps of up to DIR_BATCH_GAP blocks, since
+ * that is cheaper than seeking over them.
+ */
+#define DIR_BATCH_ENTRIES	64
+#define DIR_BATCH_BLOCKS	128
+#define DIR_BATCH_GAP		4
+
+struct dir_batch {
+	e2fsck_t	ctx;
+	char		*buf;		/* DIR_BATCH_BLOCKS blocks */
+	blk64_t		blk[DIR_BATCH_BLOCKS];	/* block in each slot; 0=none */
+	int		slot[DIR_BATCH_ENTRIES]; /* slot of each entry, or -1 */
+	unsigned long long start, end;	/* dblist entries in the batch */
+	int		used;		/* slots filled */
+	int		run_slot;	/* first slot of the pending read */
+	int		run_len;
+	int		entries;
+};
+
+/* A name seen in the directory block being checked */
+struct dup_name_slot {
+	__u32	hash;
+	__u16	offset;		/* of the entry in the block */
+	__u16	gen;		/* the slot is in use if this is name_gen */
+};
+
 struct check_dir_struct {
 	char *buf;
 	struct problem_context	pctx;
 	int	count, max;
 	e2fsck_t ctx;
+	unsigned long long list_offset;	/* dblist index of current block */
+	unsigned long long ra_next;	/* first entry not yet read ahead */
+	unsigned long long ra_window;	/* entries to keep read ahead */
+	struct dir_batch *batch;
+	struct dup_name_slot *name_slots;
+	unsigned int name_mask, name_count;
+	__u16	name_gen;
+};
+
+struct dir_readahead {
+	blk64_t		start;
+	blk64_t		count;
 };
 
 void e2fsck_pass2(e2fsck_t ctx)
@@ -89,14 +130,14 @@ void e2fsck_pass2(e2fsck_t ctx)
 #endif
 	struct check_dir_struct cd;
 	struct dx_dir_info	*dx_dir;
-	struct dx_dirblock_info	*dx_db, *dx_parent;
+	struct dx_dirblock_info	*dx_db, *dx_parent, unseen;
 	unsigned int		save_type;
 	int			b;
 	int			i, depth;
 	problem_t		code;
 	int			bad_dir;
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	clear_problem_context(&cd.pctx);
 
 #ifdef MTRACE
@@ -114,7 +155,9 @@ void e2fsck_pass2(e2fsck_t ctx)
 		e2fsck_set_bitmap_type(fs, EXT2FS_BMAP64_RBTREE,
 				       "inode_count", &save_type);
 		cd.pctx.errcode = ext2fs_create_icount2(fs,
-						EXT2_ICOUNT_OPT_INCREMENT,
+						EXT2_ICOUNT_OPT_INCREMENT |
+						EXT2_ICOUNT_OPT_HASH |
+						e2fsck_icount_fullmap_flag(ctx),
 						0, ctx->inode_link_info,
 						&ctx->inode_count);
 		fs->default_bitmap_type = save_type;
@@ -138,6 +181,24 @@ void e2fsck_pass2(e2fsck_t ctx)
 	cd.ctx = ctx;
 	cd.count = 1;
 	cd.max = ext2fs_dblist_count2(fs->dblist);
+	cd.list_offset = 0;
+	cd.ra_next = 0;
+	cd.ra_window = ((unsigned long long) ctx->readahead_kb * 1024) /
+		fs->blocksize;
+	cd.batch = (struct dir_batch *)
+		e2fsck_allocate_memory(ctx, sizeof(struct dir_batch),
+				       "directory block batch");
+	cd.batch->ctx = ctx;
+	cd.batch->buf = (char *)
+		e2fsck_allocate_memory(ctx, DIR_BATCH_BLOCKS * fs->blocksize,
+				       "directory block batch buffer");
+	cd.name_mask = fs->blocksize / 4 - 1;
+	cd.name_count = 0;
+	cd.name_gen = 1;
+	cd.name_slots = (struct dup_name_slot *)
+		e2fsck_allocate_memory(ctx, fs->blocksize / 4 *
+				       sizeof(struct dup_name_slot),
+				       "directory name table");
 
 	if (ctx->progress)
 		(void) (ctx->progress)(ctx, 2, 0, cd.max);
@@ -147,6 +208,10 @@ void e2fsck_pass2(e2fsck_t ctx)
 
 	cd.pctx.errcode = ext2fs_dblist_iterate2(fs->dblist, check_dir_block,
 						 &cd);
+	e2fsck_mem_sample(ctx);
+	ext2fs_free_mem(&cd.batch->buf);
+	ext2fs_free_mem(&cd.batch);
+	ext2fs_free_mem(&cd.name_slots);
 	if (ctx->flags & E2F_FLAG_SIGNAL_MASK || ctx->flags & E2F_FLAG_RESTART)
 		return;
 
@@ -170,7 +235,7 @@ void e2fsck_pass2(e2fsck_t ctx)
 		clear_problem_context(&pctx);
 		bad_dir = 0;
 		pctx.dir = dx_dir->ino;
-		dx_db = dx_dir->dx_block;
+		dx_db = e2fsck_dx_dirblock(ctx, dx_dir, 0);
 		if (dx_db->flags & DX_FLAG_REFERENCED)
 			dx_db->flags |= DX_FLAG_DUP_REF;
 		else
@@ -179,13 +244,13 @@ void e2fsck_pass2(e2fsck_t ctx)
 		 * Find all of the first and last leaf blocks, and
 		 * update their parent's min and max hash values
 		 */
-		for (b=0, dx_db = dx_dir->dx_block;
-		     b < dx_dir->numblocks;
-		     b++, dx_db++) {
-			if ((dx_db->type != DX_DIRBLOCK_LEAF) ||
+		for (b=0; b < dx_dir->numblocks; b++) {
+			dx_db = e2fsck_dx_dirblock_peek(dx_dir, b);
+			if (!dx_db || (dx_db->type != DX_DIRBLOCK_LEAF) ||
 			    !(dx_db->flags & (DX_FLAG_FIRST | DX_FLAG_LAST)))
 				continue;
-			dx_parent = &dx_dir->dx_block[dx_db->parent];
+			dx_parent = e2fsck_dx_dirblock(ctx, dx_dir,
+						       dx_db->parent);
 			/*
 			 * XXX Make sure dx_parent->min_hash > dx_db->min_hash
 			 */
@@ -198,9 +263,12 @@ void e2fsck_pass2(e2fsck_t ctx)
 				dx_parent->max_hash = dx_db->max_hash;
 		}
 
-		for (b=0, dx_db = dx_dir->dx_block;
-		     b < dx_dir->numblocks;
-		     b++, dx_db++) {
+		memset(&unseen, 0, sizeof(unseen));
+		for (b=0; b < dx_dir->numblocks; b++) {
+			/* Blocks never seen in the directory are all zero */
+			dx_db = e2fsck_dx_dirblock_peek(dx_dir, b);
+			if (!dx_db)
+				dx_db = &unseen;
 			pctx.blkcount = b;
 			pctx.group = dx_db->parent;
 			code = 0;
@@ -243,6 +311,7 @@ void e2fsck_pass2(e2fsck_t ctx)
 				bad_dir++;
 			}
 		}
+		e2fsck_free_dx_dirblocks(dx_dir);
 		if (bad_dir && fix_problem(ctx, PR_2_HTREE_CLEAR, &pctx)) {
 			clear_htree(ctx, dx_dir->ino);
 			dx_dir->numblocks = 0;
@@ -292,27 +361,70 @@ static int htree_depth(struct dx_dir_info *dx_dir,
 {
 	int	depth = 0;
 
-	while (dx_db->type != DX_DIRBLOCK_ROOT && depth < MAX_DEPTH) {
-		dx_db = &dx_dir->dx_block[dx_db->parent];
+	while (dx_db && dx_db->type != DX_DIRBLOCK_ROOT && depth < MAX_DEPTH) {
+		dx_db = e2fsck_dx_dirblock_peek(dx_dir, dx_db->parent);
 		depth++;
 	}
 	return depth;
 }
 
-static int dict_de_cmp(const void *a, const void *b)
+/*
+ * Duplicate names are looked for one directory block at a time.  A
+ * block holds at most blocksize / 8 entries, so an open-addressed
+ * table twice that size never fills up.  Each slot keeps the hash of
+ * its name, so names are only compared when the hashes match, and the
+ * generation it was filled in; moving on to the next block just bumps
+ * the generation, and the table is only wiped when that wraps.
+ */
+static unsigned int name_hash(const struct ext2_dir_entry *dirent)
 {
-	const struct ext2_dir_entry *de_a, *de_b;
-	int	a_len, b_len;
+	const unsigned char *cp = (const unsigned char *) dirent->name;
+	int		len = dirent->name_len & 0xFF;
+	unsigned int	h = 2166136261U;
 
-	de_a = (const struct ext2_dir_entry *) a;
-	a_len = de_a->name_len & 0xFF;
-	de_b = (const struct ext2_dir_entry *) b;
-	b_len = de_b->name_len & 0xFF;
+	while (len--)
+		h = (h ^ *cp++) * 16777619U;
+	return h;
+}
+
+/*
+ * Return 1 if a name equal to dirent's has already been seen in this
+ * block; otherwise remember dirent and return 0.
+ */
+static int check_dup_name(struct check_dir_struct *cd, char *buf,
+			  struct ext2_dir_entry *dirent)
+{
+	struct dup_name_slot *ns;
+	struct ext2_dir_entry *de;
+	int		len = dirent->name_len & 0xFF;
+	__u32		hash = name_hash(dirent);
+	unsigned int	slot = hash & cd->name_mask;
 
-	if (a_len != b_len)
-		return (a_len - b_len);
+	if (cd->name_count > cd->name_mask / 2)
+		return 0;
+	for (ns = cd->name_slots + slot; ns->gen == cd->name_gen;
+	     ns = cd->name_slots + slot) {
+		de = (struct ext2_dir_entry *) (buf + ns->offset);
+		if (ns->hash == hash && (de->name_len & 0xFF) == len &&
+		    !memcmp(de->name, dirent->name, len))
+			return 1;
+		slot = (slot + 1) & cd->name_mask;
+	}
+	ns->hash = hash;
+	ns->offset = (char *) dirent - buf;
+	ns->gen = cd->name_gen;
+	cd->name_count++;
+	return 0;
+}
 
-	return memcmp(de_a->name, de_b->name, a_len);
+static void clear_dup_names(struct check_dir_struct *cd)
+{
+	cd->name_count = 0;
+	if (++cd->name_gen == 0) {
+		memset(cd->name_slots, 0, (cd->name_mask + 1) *
+		       sizeof(struct dup_name_slot));
+		cd->name_gen = 1;
+	}
 }
 
 /*
@@ -613,7 +725,7 @@ static void parse_int_node(ext2_filsys fs,
 		if (hash < prev_hash &&
 		    fix_problem(cd->ctx, PR_2_HTREE_HASH_ORDER, &cd->pctx))
 			goto clear_and_exit;
-		dx_db = &dx_dir->dx_block[blk];
+		dx_db = e2fsck_dx_dirblock(cd->ctx, dx_dir, blk);
 		if (dx_db->flags & DX_FLAG_REFERENCED) {
 			dx_db->flags |= DX_FLAG_DUP_REF;
 		} else {
@@ -639,7 +751,7 @@ static void parse_int_node(ext2_filsys fs,
 	printf("Blockcnt = %d, min hash 0x%08x, max hash 0x%08x\n",
 	       db->blockcnt, min_hash, max_hash);
 #endif
-	dx_db = &dx_dir->dx_block[db->blockcnt];
+	dx_db = e2fsck_dx_dirblock(cd->ctx, dx_dir, db->blockcnt);
 	dx_db->min_hash = min_hash;
 	dx_db->max_hash = max_hash;
 	return;
@@ -721,6 +833,170 @@ static void salvage_directory(ext2_filsys fs,
 	}
 }
 
+static int readahead_dir_block(ext2_filsys fs, struct ext2_db_entry2 *db,
+			       void *priv_data)
+{
+	struct dir_readahead *ra = (struct dir_readahead *) priv_data;
+
+	if (!db->blk)
+		return 0;
+	if (ra->count && db->blk == ra->start + ra->count) {
+		ra->count++;
+		return 0;
+	}
+	if (ra->count)
+		(void) io_channel_cache_readahead(fs->io, ra->start, ra->count);
+	ra->start = db->blk;
+	ra->count = 1;
+	return 0;
+}
+
+/*
+ * Keep between half and all of the readahead window's worth of
+ * directory blocks beyond the current one queued up with the I/O
+ * channel.  The dblist is sorted by block number, so most of the
+ * requests can be merged into large ones.
+ */
+static void readahead_dir_blocks(ext2_filsys fs, struct check_dir_struct *cd)
+{
+	struct dir_readahead ra;
+	unsigned long long count;
+
+	if (cd->list_offset + cd->ra_window / 2 < cd->ra_next)
+		return;
+	count = cd->list_offset + cd->ra_window - cd->ra_next;
+
+	ra.start = ra.count = 0;
+	ext2fs_dblist_iterate3(fs->dblist, readahead_dir_block,
+			       cd->ra_next, count, &ra);
+	if (ra.count)
+		(void) io_channel_cache_readahead(fs->io, ra.start, ra.count);
+	cd->ra_next += count;
+}
+
+static void read_batch_run(ext2_filsys fs, struct dir_batch *b)
+{
+	errcode_t	retval;
+	int		i;
+
+	if (!b->run_len)
+		return;
+	retval = io_channel_read_blk64(fs->io, b->blk[b->run_slot],
+				       b->run_len,
+				       b->buf + b->run_slot * fs->blocksize);
+	if (retval) {
+		/*
+		 * Let check_dir_block() read these blocks one at a
+		 * time, so that the error is reported for the right
+		 * block.
+		 */
+		for (i = 0; i < b->run_len; i++)
+			b->blk[b->run_slot + i] = 0;
+	}
+	b->run_len = 0;
+}
+
+static int batch_dir_block(ext2_filsys fs, struct ext2_db_entry2 *db,
+			   void *priv_data)
+{
+	struct dir_batch *b = (struct dir_batch *) priv_data;
+	blk64_t		run_start, run_end;
+	int		entry = b->entries;
+
+	b->slot[entry] = -1;
+	if (!db->blk)
+		goto next;
+
+	if (b->run_len) {
+		run_start = b->blk[b->run_slot];
+		run_end = run_start + b->run_len;
+		if (db->blk >= run_start && db->blk < run_end) {
+			b->slot[entry] = b->run_slot + (db->blk - run_start);
+			goto next;
+		}
+		if (db->blk >= run_end &&
+		    db->blk - run_end <= DIR_BATCH_GAP &&
+		    b->used + (db->blk - run_end) < DIR_BATCH_BLOCKS) {
+			while (run_end <= db->blk) {
+				b->blk[b->used++] = run_end++;
+				b->run_len++;
+			}
+			b->slot[entry] = b->used - 1;
+			goto next;
+		}
+		read_batch_run(fs, b);
+	}
+#ifdef ENABLE_HTREE
+	/* Don't read it just for this if pass 1 saved us a copy */
+	if (db->blockcnt == 0 &&
+	    e2fsck_dx_root_saved(e2fsck_get_dx_dir_info(b->ctx, db->ino),
+				 db->blk))
+		goto next;
+#endif
+	if (b->used >= DIR_BATCH_BLOCKS)
+		return DBLIST_ABORT;
+	b->run_slot = b->used;
+	b->run_len = 1;
+	b->blk[b->used++] = db->blk;
+	b->slot[entry] = b->run_slot;
+next:
+	b->entries++;
+	return 0;
+}
+
+/*
+ * Read the directory blocks for the dblist entries starting at the
+ * current one.
+ */
+static void fill_dir_batch(ext2_filsys fs, struct check_dir_struct *cd,
+			   unsigned long long entry)
+{
+	struct dir_batch *b = cd->batch;
+
+	b->used = 0;
+	b->run_len = 0;
+	b->entries = 0;
+	ext2fs_dblist_iterate3(fs->dblist, batch_dir_block, entry,
+			       DIR_BATCH_ENTRIES, b);
+	read_batch_run(fs, b);
+	b->start = entry;
+	b->end = entry + b->entries;
+}
+
+/*
+ * Copy the given entry's directory block out of the current batch.
+ * Returns 0 if it isn't there.
+ */
+static int get_batched_dir_block(ext2_filsys fs, struct check_dir_struct *cd,
+				 unsigned long long entry, blk64_t blk,
+				 char *buf)
+{
+	struct dir_batch *b = cd->batch;
+	int		slot;
+
+	if (entry < b->start || entry >= b->end)
+		return 0;
+	slot = b->slot[entry - b->start];
+	if (slot < 0 || b->blk[slot] != blk)
+		return 0;
+	memcpy(buf, b->buf + slot * fs->blocksize, fs->blocksize);
+	return 1;
+}
+
+/*
+ * Forget any batched copy of a block which is being rewritten.
+ */
+static void invalidate_batched_dir_block(struct check_dir_struct *cd,
+					 blk64_t blk)
+{
+	struct dir_batch *b = cd->batch;
+	int		i;
+
+	for (i = 0; i < b->used; i++)
+		if (b->blk[i] == blk)
+			b->blk[i] = 0;
+}
+
 static int check_dir_block(ext2_filsys fs,
 			   struct ext2_db_entry2 *db,
 			   void *priv_data)
@@ -745,11 +1021,11 @@ static int check_dir_block(ext2_filsys fs,
 	problem_t		problem;
 	struct ext2_dx_root_info *root;
 	struct ext2_dx_countlimit *limit;
-	static dict_t de_dict;
 	struct problem_context	pctx;
 	int	dups_found = 0;
 	int	encrypted = 0;
 	int	ret;
+	unsigned long long entry;
 
 	cd = (struct check_dir_struct *) priv_data;
 	buf = cd->buf;
@@ -758,6 +1034,13 @@ static int check_dir_block(ext2_filsys fs,
 	if (ctx->flags & E2F_FLAG_SIGNAL_MASK || ctx->flags & E2F_FLAG_RESTART)
 		return DIRENT_ABORT;
 
+	if (cd->ra_window)
+		readahead_dir_blocks(fs, cd);
+	entry = cd->list_offset++;
+	if (entry >= cd->batch->end)
+		fill_dir_batch(fs, cd, entry);
+	ctx->dir_blocks_checked++;
+
 	if (ctx->progress && (ctx->progress)(ctx, 2, cd->count++, cd->max))
 		return DIRENT_ABORT;
 
@@ -796,7 +1079,18 @@ static int check_dir_block(ext2_filsys fs,
 #endif
 
 	ehandler_operation(_("reading directory block"));
-	cd->pctx.errcode = ext2fs_read_dir_block3(fs, block_nr, buf, 0);
+#ifdef ENABLE_HTREE
+	dx_dir = e2fsck_get_dx_dir_info(ctx, ino);
+	if (db->blockcnt == 0 &&
+	    e2fsck_get_dx_root(ctx, dx_dir, block_nr, buf))
+		cd->pctx.errcode = ext2fs_dirent_swab_in(fs, buf, 0);
+	else
+#endif
+	if (get_batched_dir_block(fs, cd, entry, block_nr, buf))
+		cd->pctx.errcode = ext2fs_dirent_swab_in(fs, buf, 0);
+	else
+		cd->pctx.errcode = ext2fs_read_dir_block3(fs, block_nr,
+							  buf, 0);
 	ehandler_operation(0);
 	if (cd->pctx.errcode == EXT2_ET_DIR_CORRUPTED)
 		cd->pctx.errcode = 0; /* We'll handle this ourselves */
@@ -808,7 +1102,6 @@ static int check_dir_block(ext2_filsys fs,
 		memset(buf, 0, fs->blocksize);
 	}
 #ifdef ENABLE_HTREE
-	dx_dir = e2fsck_get_dx_dir_info(ctx, ino);
 	if (dx_dir && dx_dir->numblocks) {
 		if (db->blockcnt >= dx_dir->numblocks) {
 			if (fix_problem(ctx, PR_2_UNEXPECTED_HTREE_BLOCK,
@@ -820,7 +1113,7 @@ static int check_dir_block(ext2_filsys fs,
 			}
 			fatal_error(ctx, _("Can not continue."));
 		}
-		dx_db = &dx_dir->dx_block[db->blockcnt];
+		dx_db = e2fsck_dx_dirblock(ctx, dx_dir, db->blockcnt);
 		dx_db->type = DX_DIRBLOCK_LEAF;
 		dx_db->phys = block_nr;
 		dx_db->min_hash = ~0;
@@ -860,7 +1153,6 @@ out_htree:
 	if (ctx->encrypted_dirs)
 		encrypted = ext2fs_u32_list_test(ctx->encrypted_dirs, ino);
 
-	dict_init(&de_dict, DICTCOUNT_T_MAX, dict_de_cmp);
 	prev = 0;
 	do {
 		dgrp_t group;
@@ -880,7 +1172,7 @@ out_htree:
 				dir_modified++;
 				continue;
 			} else
-				goto abort_free_dict;
+				goto abort_clear_names;
 		}
 
 		if (dot_state == 0) {
@@ -889,7 +1181,7 @@ out_htree:
 		} else if (dot_state == 1) {
 			ret = check_dotdot(ctx, dirent, ino, &cd->pctx);
 			if (ret < 0)
-				goto abort_free_dict;
+				goto abort_clear_names;
 			if (ret)
 				dir_modified++;
 		} else if (dirent->inode == ino) {
@@ -1035,8 +1327,7 @@ out_htree:
 		 * problems after we restart.
 		 */
 		if (!(ctx->flags & E2F_FLAG_RESTART_LATER) &&
-		    !(ext2fs_test_inode_bitmap2(ctx->inode_used_map,
-						dirent->inode)))
+		    !e2fsck_scope_inode_in_use(ctx, dirent->inode))
 			problem = PR_2_UNUSED_INODE;
 
 		if (problem) {
@@ -1089,7 +1380,7 @@ out_htree:
 						       &subdir_parent)) {
 				cd->pctx.ino = dirent->inode;
 				fix_problem(ctx, PR_2_NO_DIRINFO, &cd->pctx);
-				goto abort_free_dict;
+				goto abort_clear_names;
 			}
 			if (subdir_parent) {
 				cd->pctx.ino2 = subdir_parent;
@@ -1108,7 +1399,7 @@ out_htree:
 
 		if (dups_found) {
 			;
-		} else if (dict_lookup(&de_dict, dirent)) {
+		} else if (check_dup_name(cd, buf, dirent)) {
 			clear_problem_context(&pctx);
 			pctx.ino = ino;
 			pctx.dirent = dirent;
@@ -1118,8 +1409,7 @@ out_htree:
 			if (ctx->dirs_to_hash)
 				ext2fs_u32_list_add(ctx->dirs_to_hash, ino);
 			dups_found++;
-		} else
-			dict_alloc_insert(&de_dict, dirent, dirent);
+		}
 
 		ext2fs_icount_increment(ctx->inode_count, dirent->inode,
 					&links);
@@ -1157,27 +1447,40 @@ out_htree:
 		}
 	}
 	if (dir_modified) {
+		invalidate_batched_dir_block(cd, block_nr);
 		cd->pctx.errcode = ext2fs_write_dir_block3(fs, block_nr, buf, 0);
 		if (cd->pctx.errcode) {
 			if (!fix_problem(ctx, PR_2_WRITE_DIRBLOCK,
 					 &cd->pctx))
-				goto abort_free_dict;
+				goto abort_clear_names;
 		}
 		ext2fs_mark_changed(fs);
 	}
-	dict_free_nodes(&de_dict);
+	clear_dup_names(cd);
 	return 0;
-abort_free_dict:
+abort_clear_names:
 	ctx->flags |= E2F_FLAG_ABORT;
-	dict_free_nodes(&de_dict);
+	clear_dup_names(cd);
 	return DIRENT_ABORT;
 }
 
 struct del_block {
 	e2fsck_t	ctx;
 	e2_blkcnt_t	num;
+	blk64_t		run_start;	/* blocks not yet freed */
+	blk64_t		run_len;
 };
 
+static void deallocate_block_run(ext2_filsys fs, struct del_block *p)
+{
+	if (!p->run_len)
+		return;
+	ext2fs_unmark_block_bitmap_range2(p->ctx->block_found_map,
+					  p->run_start, p->run_len);
+	ext2fs_block_alloc_stats_range(fs, p->run_start, p->run_len, -1);
+	p->run_len = 0;
+}
+
 /*
  * This function is called to deallocate a block, and is an interator
  * functioned called by deallocate inode via ext2fs_iterate_block().
@@ -1196,9 +1499,19 @@ static int deallocate_inode_block(ext2_filsys fs,
 	if ((*block_nr < fs->super->s_first_data_block) ||
 	    (*block_nr >= ext2fs_blocks_count(fs->super)))
 		return 0;
-	ext2fs_unmark_block_bitmap2(p->ctx->block_found_map, *block_nr);
-	ext2fs_block_alloc_stats2(fs, *block_nr, -1);
 	p->num++;
+	if (EXT2FS_CLUSTER_RATIO(fs) > 1) {
+		ext2fs_unmark_block_bitmap2(p->ctx->block_found_map,
+					    *block_nr);
+		ext2fs_block_alloc_stats2(fs, *block_nr, -1);
+		return 0;
+	}
+	/* Free runs of consecutive blocks together */
+	if (*block_nr != p->run_start + p->run_len)
+		deallocate_block_run(fs, p);
+	if (!p->run_len)
+		p->run_start = *block_nr;
+	p->run_len++;
 	return 0;
 }
 
@@ -1256,9 +1569,11 @@ static void deallocate_inode(e2fsck_t ctx, ext2_ino_t ino, char* block_buf)
 
 	del_block.ctx = ctx;
 	del_block.num = 0;
+	del_block.run_start = del_block.run_len = 0;
 	pctx.errcode = ext2fs_block_iterate3(fs, ino, 0, block_buf,
 					     deallocate_inode_block,
 					     &del_block);
+	deallocate_block_run(fs, &del_block);
 	if (pctx.errcode) {
 		fix_problem(ctx, PR_2_DEALLOC_INODE, &pctx);
 		ctx->flags |= E2F_FLAG_ABORT;
@@ -29,6 +29,8 @@
  * reconnect inodes to /lost+found; this subroutine is also used by
  * pass 4.  e2fsck_reconnect_file() calls get_lost_and_found(), which
  * is responsible for creating /lost+found if it does not exist.
+ * Pass 4 queues the inodes with e2fsck_reconnect_later() instead, and
+ * e2fsck_reconnect_flush() links them all at once when it's done.
  *
  * Pass 3 frees the following data structures:
  *     	- The dirinfo directory information cache.
@@ -45,9 +47,12 @@ static void check_root(e2fsck_t ctx);
 static int check_directory(e2fsck_t ctx, ext2_ino_t ino,
 			   struct problem_context *pctx);
 static void fix_dotdot(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent);
+static void check_scope_directory(e2fsck_t ctx, ext2_ino_t dir,
+				  struct problem_context *pctx);
 
-static ext2fs_inode_bitmap inode_loop_detect = 0;
 static ext2fs_inode_bitmap inode_done_map = 0;
+static ext2_ino_t *dir_path = 0;	/* directories of the current walk */
+static unsigned int dir_path_max;
 
 void e2fsck_pass3(e2fsck_t ctx)
 {
@@ -60,7 +65,7 @@ void e2fsck_pass3(e2fsck_t ctx)
 	struct dir_info	*dir;
 	unsigned long maxdirs, count;
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	clear_problem_context(&pctx);
 
 #ifdef MTRACE
@@ -71,7 +76,7 @@ void e2fsck_pass3(e2fsck_t ctx)
 		fix_problem(ctx, PR_3_PASS_HEADER, &pctx);
 
 	/*
-	 * Allocate some bitmaps to do loop detection.
+	 * Allocate the bitmap of directories which have been checked.
 	 */
 	pctx.errcode = e2fsck_allocate_inode_bitmap(fs, _("inode done bitmap"),
 					EXT2FS_BMAP64_AUTODIR,
@@ -82,9 +87,14 @@ void e2fsck_pass3(e2fsck_t ctx)
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto abort_exit;
 	}
+	dir_path_max = 1024;
+	dir_path = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
+				dir_path_max * sizeof(ext2_ino_t),
+				"directory path");
 	print_resource_track(ctx, _("Peak memory"), &ctx->global_rtrack, NULL);
 
-	check_root(ctx);
+	if (e2fsck_ino_in_scope(ctx, EXT2_ROOT_INO))
+		check_root(ctx);
 	if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 		goto abort_exit;
 
@@ -103,15 +113,18 @@ void e2fsck_pass3(e2fsck_t ctx)
 			goto abort_exit;
 		if (ctx->progress && (ctx->progress)(ctx, 3, count++, maxdirs))
 			goto abort_exit;
-		if (ext2fs_test_inode_bitmap2(ctx->inode_dir_map, dir->ino))
-			if (check_directory(ctx, dir->ino, &pctx))
-				goto abort_exit;
+		if (!ext2fs_test_inode_bitmap2(ctx->inode_dir_map, dir->ino))
+			continue;
+		if (ctx->options & E2F_OPT_GROUPS)
+			check_scope_directory(ctx, dir->ino, &pctx);
+		else if (check_directory(ctx, dir->ino, &pctx))
+			goto abort_exit;
 	}
 
 	/*
 	 * Force the creation of /lost+found if not present
 	 */
-	if ((ctx->options & E2F_OPT_READONLY) == 0)
+	if ((ctx->options & (E2F_OPT_READONLY | E2F_OPT_GROUPS)) == 0)
 		e2fsck_get_lost_and_found(ctx, 1);
 
 	/*
@@ -123,11 +136,10 @@ void e2fsck_pass3(e2fsck_t ctx)
 abort_exit:
 	if (iter)
 		e2fsck_dir_info_iter_end(ctx, iter);
+	e2fsck_mem_sample(ctx);
 	e2fsck_free_dir_info(ctx);
-	if (inode_loop_detect) {
-		ext2fs_free_inode_bitmap(inode_loop_detect);
-		inode_loop_detect = 0;
-	}
+	if (dir_path)
+		ext2fs_free_mem(&dir_path);
 	if (inode_done_map) {
 		ext2fs_free_inode_bitmap(inode_done_map);
 		inode_done_map = 0;
@@ -242,6 +254,27 @@ static void check_root(e2fsck_t ctx)
 	ext2fs_mark_ib_dirty(fs);
 }
 
+/*
+ * Offer to reconnect a directory which can't be traced to the root to
+ * lost+found.  If it was found by going around a loop, parent still
+ * has an entry for it; that entry is removed so the directory isn't
+ * left with two names.
+ */
+static void reconnect_directory(e2fsck_t ctx, ext2_ino_t ino,
+				ext2_ino_t parent, struct problem_context *pctx)
+{
+	pctx->ino = ino;
+	if (!fix_problem(ctx, PR_3_UNCONNECTED_DIR, pctx))
+		return;
+	if (e2fsck_reconnect_file(ctx, ino)) {
+		ext2fs_unmark_valid(ctx->fs);
+		return;
+	}
+	fix_dotdot(ctx, ino, ctx->lost_and_found);
+	if (parent && !ext2fs_unlink(ctx->fs, parent, 0, ino, 0))
+		e2fsck_adjust_inode_count(ctx, ino, -1);
+}
+
 /*
  * This subroutine is responsible for making sure that a particular
  * directory is connected to the root; if it isn't we trace it up as
@@ -250,86 +283,55 @@ static void check_root(e2fsck_t ctx)
  * a loop, we treat that as a disconnected directory and offer to
  * reparent it to lost+found.
  *
- * However, loop detection is expensive, because for very large
- * filesystems, the inode_loop_detect bitmap is huge, and clearing it
- * is non-trivial.  Loops in filesystems are also a rare error case,
- * and we shouldn't optimize for error cases.  So we try two passes of
- * the algorithm.  The first time, we ignore loop detection and merely
- * increment a counter; if the counter exceeds some extreme threshold,
- * then we try again with the loop detection bitmap enabled.
+ * Every directory on the way up is marked "done" and pushed on
+ * dir_path, so each directory is walked through only once in the
+ * whole pass.  The walk stops at the first directory which is already
+ * done; either it was checked by an earlier walk, or it is on dir_path
+ * and we have gone around a loop.  Looking through dir_path once per
+ * walk keeps the pass linear in the number of directories, however
+ * deep the tree is.
  */
 static int check_directory(e2fsck_t ctx, ext2_ino_t dir,
 			   struct problem_context *pctx)
 {
-	ext2_filsys 	fs = ctx->fs;
 	ext2_ino_t	ino = dir, parent;
-	int		loop_pass = 0, parent_count = 0;
+	unsigned int	depth = 0, i;
 
 	while (1) {
-		/*
-		 * Mark this inode as being "done"; by the time we
-		 * return from this function, the inode we either be
-		 * verified as being connected to the directory tree,
-		 * or we will have offered to reconnect this to
-		 * lost+found.
-		 *
-		 * If it was marked done already, then we've reached a
-		 * parent we've already checked.
-		 */
-	  	if (ext2fs_mark_inode_bitmap2(inode_done_map, ino))
+		if (ext2fs_mark_inode_bitmap2(inode_done_map, ino)) {
+			for (i = 0; i < depth; i++)
+				if (dir_path[i] == ino)
+					break;
+			if (i < depth)
+				reconnect_directory(ctx, dir_path[depth - 1],
+						    ino, pctx);
 			break;
+		}
+
+		if (depth >= dir_path_max) {
+			pctx->errcode = ext2fs_resize_mem(
+				dir_path_max * sizeof(ext2_ino_t),
+				dir_path_max * 2 * sizeof(ext2_ino_t),
+				&dir_path);
+			if (pctx->errcode) {
+				fix_problem(ctx, PR_3_ALLOCATE_PATH_ERROR,
+					    pctx);
+				ctx->flags |= E2F_FLAG_ABORT;
+				return -1;
+			}
+			dir_path_max *= 2;
+		}
+		dir_path[depth++] = ino;
 
 		if (e2fsck_dir_info_get_parent(ctx, ino, &parent)) {
 			fix_problem(ctx, PR_3_NO_DIRINFO, pctx);
 			return 0;
 		}
-
-		/*
-		 * If this directory doesn't have a parent, or we've
-		 * seen the parent once already, then offer to
-		 * reparent it to lost+found
-		 */
-		if (!parent ||
-		    (loop_pass &&
-		     (ext2fs_test_inode_bitmap2(inode_loop_detect,
-					       parent)))) {
-			pctx->ino = ino;
-			if (fix_problem(ctx, PR_3_UNCONNECTED_DIR, pctx)) {
-				if (e2fsck_reconnect_file(ctx, pctx->ino))
-					ext2fs_unmark_valid(fs);
-				else {
-					fix_dotdot(ctx, pctx->ino,
-						   ctx->lost_and_found);
-					parent = ctx->lost_and_found;
-				}
-			}
+		if (!parent) {
+			reconnect_directory(ctx, ino, 0, pctx);
 			break;
 		}
 		ino = parent;
-		if (loop_pass) {
-			ext2fs_mark_inode_bitmap2(inode_loop_detect, ino);
-		} else if (parent_count++ > 2048) {
-			/*
-			 * If we've run into a path depth that's
-			 * greater than 2048, try again with the inode
-			 * loop bitmap turned on and start from the
-			 * top.
-			 */
-			loop_pass = 1;
-			if (inode_loop_detect)
-				ext2fs_clear_inode_bitmap(inode_loop_detect);
-			else {
-				pctx->errcode = e2fsck_allocate_inode_bitmap(fs, _("inode loop detection bitmap"), EXT2FS_BMAP64_AUTODIR, "inode_loop_detect", &inode_loop_detect);
-				if (pctx->errcode) {
-					pctx->num = 1;
-					fix_problem(ctx,
-				    PR_3_ALLOCATE_IBITMAP_ERROR, pctx);
-					ctx->flags |= E2F_FLAG_ABORT;
-					return -1;
-				}
-			}
-			ino = dir;
-		}
 	}
 
 	/*
@@ -349,6 +351,75 @@ static int check_directory(e2fsck_t ctx, ext2_ino_t dir,
 	return 0;
 }
 
+static int find_entry_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
+			   int entry EXT2FS_ATTR((unused)),
+			   struct ext2_dir_entry *dirent,
+			   int offset EXT2FS_ATTR((unused)),
+			   int blocksize EXT2FS_ATTR((unused)),
+			   char *buf EXT2FS_ATTR((unused)), void *priv_data)
+{
+	ext2_ino_t	*ino = (ext2_ino_t *) priv_data;
+
+	if (dirent->inode != *ino)
+		return 0;
+	*ino = 0;
+	return DIRENT_ABORT;
+}
+
+/*
+ * A partial check (-E groups) only knows the parent of a directory
+ * whose parent is in the same groups, and it hasn't looked at the
+ * directory tree above that, so it can't check that everything is
+ * connected to the root.  What it can check is that each directory's
+ * '..' is right: it has to be a directory in use which has an entry
+ * for this one.  That may mean reading a directory outside the groups;
+ * any directory inside them which had an entry would have been seen in
+ * pass 2.
+ *
+ * Problems of the second kind can't be fixed without knowing where
+ * else the directory might be linked from, so they are just reported.
+ */
+static void check_scope_directory(e2fsck_t ctx, ext2_ino_t dir,
+				  struct problem_context *pctx)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct ext2_inode inode;
+	ext2_ino_t	ino;
+
+	if (dir == EXT2_ROOT_INO)
+		return;
+	pctx->ino = dir;
+	if (e2fsck_dir_info_get_dotdot(ctx, dir, &pctx->ino2) ||
+	    e2fsck_dir_info_get_parent(ctx, dir, &pctx->dir)) {
+		fix_problem(ctx, PR_3_NO_DIRINFO, pctx);
+		return;
+	}
+	if (pctx->dir) {
+		if (pctx->ino2 != pctx->dir &&
+		    fix_problem(ctx, PR_3_BAD_DOT_DOT, pctx))
+			fix_dotdot(ctx, dir, pctx->dir);
+		return;
+	}
+	/* Pass 2 has already complained about a missing '..' */
+	if (!pctx->ino2)
+		return;
+
+	ino = dir;
+	if (!e2fsck_ino_in_scope(ctx, pctx->ino2) &&
+	    e2fsck_scope_inode_in_use(ctx, pctx->ino2)) {
+		if (ext2fs_read_inode(fs, pctx->ino2, &inode))
+			return;
+		if (LINUX_S_ISDIR(inode.i_mode) &&
+		    ext2fs_dir_iterate2(fs, pctx->ino2, 0, 0,
+					find_entry_proc, &ino))
+			return;
+	}
+	if (ino) {
+		fix_problem(ctx, PR_3_SCOPE_BAD_DOT_DOT, pctx);
+		ext2fs_unmark_valid(fs);
+	}
+}
+
 /*
  * This routine gets the lost_and_found inode, making it a directory
  * if necessary
@@ -499,16 +570,65 @@ ext2_ino_t e2fsck_get_lost_and_found(e2fsck_t ctx, int fix)
 }
 
 /*
- * This routine will connect a file to lost+found
+ * Reconnecting inodes one at a time means scanning all of lost+found
+ * for room for each of them, and growing it a block at a time, which
+ * gets quadratic when there are very many.  So e2fsck_reconnect_later()
+ * only queues the inode (its link count is adjusted right away), and
+ * e2fsck_reconnect_flush() writes the entries in one go.  Pass 3 can't
+ * wait, since it prints the paths of what is under lost+found.  Below
+ * LNF_BATCH_MIN inodes they're still linked one at a time, which puts
+ * them where ext2fs_link() always has; at LNF_INDEX_MIN or more,
+ * lost+found is indexed once they're all in.
  */
-int e2fsck_reconnect_file(e2fsck_t ctx, ext2_ino_t ino)
+#define LNF_BATCH_MIN	64
+#define LNF_INDEX_MIN	1024
+
+struct lnf_entry {
+	ext2_ino_t	ino;
+	int		file_type;
+};
+
+static int link_lost_and_found(e2fsck_t ctx, struct lnf_entry *ent)
 {
 	ext2_filsys fs = ctx->fs;
 	errcode_t	retval;
 	char		name[80];
 	struct problem_context	pctx;
+
+	clear_problem_context(&pctx);
+	pctx.ino = ent->ino;
+
+	sprintf(name, "#%u", ent->ino);
+	retval = ext2fs_link(fs, ctx->lost_and_found, name, ent->ino,
+			     ent->file_type);
+	if (retval == EXT2_ET_DIR_NO_SPACE) {
+		if (!fix_problem(ctx, PR_3_EXPAND_LF_DIR, &pctx))
+			return 1;
+		retval = e2fsck_expand_directory(ctx, ctx->lost_and_found,
+						 1, 0);
+		if (retval) {
+			pctx.errcode = retval;
+			fix_problem(ctx, PR_3_CANT_EXPAND_LPF, &pctx);
+			return 1;
+		}
+		retval = ext2fs_link(fs, ctx->lost_and_found, name,
+				     ent->ino, ent->file_type);
+	}
+	if (retval) {
+		pctx.errcode = retval;
+		fix_problem(ctx, PR_3_CANT_RECONNECT, &pctx);
+		return 1;
+	}
+	return 0;
+}
+
+static int reconnect_file(e2fsck_t ctx, ext2_ino_t ino, int later)
+{
+	ext2_filsys fs = ctx->fs;
+	struct problem_context	pctx;
 	struct ext2_inode 	inode;
-	int		file_type = 0;
+	struct lnf_entry	ent;
+	unsigned int		new_max;
 
 	clear_problem_context(&pctx);
 	pctx.ino = ino;
@@ -522,31 +642,247 @@ int e2fsck_reconnect_file(e2fsck_t ctx, ext2_ino_t ino)
 		return 1;
 	}
 
-	sprintf(name, "#%u", ino);
+	ent.ino = ino;
+	ent.file_type = 0;
 	if (ext2fs_read_inode(fs, ino, &inode) == 0)
-		file_type = ext2_file_type(inode.i_mode);
-	retval = ext2fs_link(fs, ctx->lost_and_found, name, ino, file_type);
-	if (retval == EXT2_ET_DIR_NO_SPACE) {
+		ent.file_type = ext2_file_type(inode.i_mode);
+
+	if (later && ctx->lnf_queue_num == ctx->lnf_queue_max) {
+		new_max = ctx->lnf_queue_max ? ctx->lnf_queue_max * 2 : 64;
+		if (ext2fs_resize_mem(ctx->lnf_queue_max *
+				      sizeof(struct lnf_entry),
+				      new_max * sizeof(struct lnf_entry),
+				      &ctx->lnf_queue))
+			later = 0;	/* no room to queue it; link it now */
+		else
+			ctx->lnf_queue_max = new_max;
+	}
+	if (later)
+		ctx->lnf_queue[ctx->lnf_queue_num++] = ent;
+	else if (link_lost_and_found(ctx, &ent))
+		return 1;
+	e2fsck_adjust_inode_count(ctx, ino, 1);
+
+	return 0;
+}
+
+/*
+ * This routine will connect a file to lost+found
+ */
+int e2fsck_reconnect_file(e2fsck_t ctx, ext2_ino_t ino)
+{
+	return reconnect_file(ctx, ino, 0);
+}
+
+/*
+ * Likewise, but the entry is only added by e2fsck_reconnect_flush()
+ */
+int e2fsck_reconnect_later(e2fsck_t ctx, ext2_ino_t ino)
+{
+	return reconnect_file(ctx, ino, 1);
+}
+
+struct lnf_fill_struct {
+	ext2_filsys		fs;
+	struct lnf_entry	*queue;
+	unsigned int		next, num;
+	errcode_t		err;
+};
+
+static void lnf_set_entry(struct lnf_fill_struct *fp,
+			  struct ext2_dir_entry *dirent)
+{
+	struct lnf_entry *ent = fp->queue + fp->next++;
+
+	dirent->inode = ent->ino;
+	dirent->name_len = sprintf(dirent->name, "#%u", ent->ino);
+	if (fp->fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)
+		dirent->name_len |= (ent->file_type & 0x7) << 8;
+}
+
+static unsigned int lnf_rec_len(struct lnf_entry *ent)
+{
+	char	name[16];
+
+	return EXT2_DIR_REC_LEN(sprintf(name, "#%u", ent->ino));
+}
+
+/*
+ * Put as many of the queued entries in the space of this entry as will
+ * fit, the way link_proc() in the library would for each of them.
+ */
+static int lnf_fill_proc(struct ext2_dir_entry *dirent,
+			 int	offset,
+			 int	blocksize,
+			 char	*buf,
+			 void	*priv_data)
+{
+	struct lnf_fill_struct *fp = (struct lnf_fill_struct *) priv_data;
+	struct ext2_dir_entry *next;
+	unsigned int rec_len, min_rec_len, curr_rec_len;
+	int ret = 0;
+
+	if (fp->next >= fp->num)
+		return DIRENT_ABORT;
+	rec_len = lnf_rec_len(fp->queue + fp->next);
+
+	fp->err = ext2fs_get_rec_len(fp->fs, dirent, &curr_rec_len);
+	if (fp->err)
+		return DIRENT_ABORT;
+
+	/* Absorb a following unused entry, like link_proc() does */
+	next = (struct ext2_dir_entry *) (buf + offset + curr_rec_len);
+	if ((offset + (int) curr_rec_len < blocksize - 8) &&
+	    (next->inode == 0) &&
+	    (offset + (int) curr_rec_len + (int) next->rec_len <= blocksize)) {
+		curr_rec_len += next->rec_len;
+		fp->err = ext2fs_set_rec_len(fp->fs, curr_rec_len, dirent);
+		if (fp->err)
+			return DIRENT_ABORT;
+		ret = DIRENT_CHANGED;
+	}
+
+	if (!dirent->inode) {
+		if (curr_rec_len < rec_len)
+			return ret;
+		lnf_set_entry(fp, dirent);
+		ret = DIRENT_CHANGED;
+		if (fp->next >= fp->num)
+			return ret;
+		rec_len = lnf_rec_len(fp->queue + fp->next);
+	}
+
+	/*
+	 * Split off the slack at the end of the entry for the next one;
+	 * the directory iterator goes on to it, and so on until the
+	 * block is full.
+	 */
+	min_rec_len = EXT2_DIR_REC_LEN(dirent->name_len & 0xFF);
+	if (curr_rec_len < (min_rec_len + rec_len))
+		return ret;
+	fp->err = ext2fs_set_rec_len(fp->fs, min_rec_len, dirent);
+	if (fp->err)
+		return DIRENT_ABORT;
+	next = (struct ext2_dir_entry *) (buf + offset + min_rec_len);
+	fp->err = ext2fs_set_rec_len(fp->fs, curr_rec_len - min_rec_len, next);
+	if (fp->err)
+		return DIRENT_ABORT;
+	lnf_set_entry(fp, next);
+	return DIRENT_CHANGED;
+}
+
+static errcode_t lnf_fill(e2fsck_t ctx, struct lnf_fill_struct *fp)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_dir_iterate(ctx->fs, ctx->lost_and_found,
+				    DIRENT_FLAG_INCLUDE_EMPTY, 0,
+				    lnf_fill_proc, fp);
+	return retval ? retval : fp->err;
+}
+
+/*
+ * How many new blocks the entries not placed yet need, packed in the
+ * order they're placed.
+ */
+static blk64_t lnf_blocks_needed(ext2_filsys fs, struct lnf_fill_struct *fp)
+{
+	blk64_t		blocks = 0;
+	unsigned int	i, used = fs->blocksize, rec_len;
+
+	for (i = fp->next; i < fp->num; i++) {
+		rec_len = lnf_rec_len(fp->queue + i);
+		if (used + rec_len > fs->blocksize) {
+			blocks++;
+			used = 0;
+		}
+		used += rec_len;
+	}
+	return blocks;
+}
+
+/*
+ * Add the entries of all the inodes queued by e2fsck_reconnect_later()
+ * to lost+found: the free space it already has is filled in a single
+ * pass over it, it's grown by as many blocks as the rest need, and
+ * those are filled in turn.
+ */
+void e2fsck_reconnect_flush(e2fsck_t ctx)
+{
+	ext2_filsys fs = ctx->fs;
+	struct lnf_fill_struct	fp;
+	struct problem_context	pctx;
+	struct ext2_inode	inode;
+	blk64_t			blocks;
+	unsigned int		i;
+	errcode_t		retval;
+
+	if (!ctx->lnf_queue_num)
+		return;
+
+	clear_problem_context(&pctx);
+	fp.fs = fs;
+	fp.queue = ctx->lnf_queue;
+	fp.next = 0;
+	fp.num = ctx->lnf_queue_num;
+	fp.err = 0;
+
+	if (fp.num < LNF_BATCH_MIN) {
+		for (i = 0; i < fp.num; i++) {
+			if (link_lost_and_found(ctx, fp.queue + i)) {
+				e2fsck_adjust_inode_count(ctx,
+							  fp.queue[i].ino, -1);
+				ext2fs_unmark_valid(fs);
+			}
+		}
+		goto out;
+	}
+
+	/* The entries are written in linear order; any index goes stale */
+	e2fsck_read_inode(ctx, ctx->lost_and_found, &inode, "reconnect_flush");
+	if (inode.i_flags & EXT2_INDEX_FL) {
+		inode.i_flags &= ~EXT2_INDEX_FL;
+		e2fsck_write_inode(ctx, ctx->lost_and_found, &inode,
+				   "reconnect_flush");
+	}
+
+	retval = lnf_fill(ctx, &fp);
+	if (!retval && fp.next < fp.num) {
+		pctx.ino = fp.queue[fp.next].ino;
+		blocks = lnf_blocks_needed(fs, &fp);
 		if (!fix_problem(ctx, PR_3_EXPAND_LF_DIR, &pctx))
-			return 1;
+			goto unlinked;
 		retval = e2fsck_expand_directory(ctx, ctx->lost_and_found,
-						 1, 0);
+						 blocks, 0);
 		if (retval) {
 			pctx.errcode = retval;
 			fix_problem(ctx, PR_3_CANT_EXPAND_LPF, &pctx);
-			return 1;
+			goto unlinked;
 		}
-		retval = ext2fs_link(fs, ctx->lost_and_found, name,
-				     ino, file_type);
+		retval = lnf_fill(ctx, &fp);
 	}
-	if (retval) {
-		pctx.errcode = retval;
+
+unlinked:
+	for (i = fp.next; i < fp.num; i++) {
+		pctx.ino = fp.queue[i].ino;
+		pctx.errcode = retval ? retval : EXT2_ET_DIR_NO_SPACE;
 		fix_problem(ctx, PR_3_CANT_RECONNECT, &pctx);
-		return 1;
+		e2fsck_adjust_inode_count(ctx, fp.queue[i].ino, -1);
+		ext2fs_unmark_valid(fs);
 	}
-	e2fsck_adjust_inode_count(ctx, ino, 1);
 
-	return 0;
+	if (fp.next >= LNF_INDEX_MIN &&
+	    (fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		pctx.ino = 0;
+		pctx.dir = ctx->lost_and_found;
+		pctx.errcode = e2fsck_rehash_dir(ctx, ctx->lost_and_found);
+		if (pctx.errcode)
+			fix_problem(ctx, PR_3A_OPTIMIZE_DIR_ERR, &pctx);
+	}
+
+out:
+	ext2fs_free_mem(&ctx->lnf_queue);
+	ctx->lnf_queue_num = ctx->lnf_queue_max = 0;
 }
 
 /*
@@ -72,7 +72,7 @@ static int disconnect_inode(e2fsck_t ctx, ext2_ino_t i,
 	 * Prompt to reconnect.
 	 */
 	if (fix_problem(ctx, PR_4_UNATTACHED_INODE, &pctx)) {
-		if (e2fsck_reconnect_file(ctx, i))
+		if (e2fsck_reconnect_later(ctx, i))
 			ext2fs_unmark_valid(fs);
 	} else {
 		/*
@@ -86,12 +86,39 @@ static int disconnect_inode(e2fsck_t ctx, ext2_ino_t i,
 	return 0;
 }
 
+/*
+ * When both counts are kept in full maps, find the next inode, starting
+ * at ino, that pass 4 has to look at: one in use whose counts don't
+ * agree, or which nothing refers to.  Returns 0 if there is none.  If
+ * the counts aren't in full maps, clears *fast and returns ino.
+ */
+static ext2_ino_t next_inode_to_check(e2fsck_t ctx, ext2_ino_t ino,
+				      int *fast)
+{
+	ext2_ino_t	next;
+
+	while (1) {
+		next = ino;
+		if (ext2fs_icount_next_diff(ctx->inode_link_info,
+					    ctx->inode_count, &next)) {
+			*fast = 0;
+			return ino;
+		}
+		if (!next ||
+		    ext2fs_test_inode_bitmap2(ctx->inode_used_map, next))
+			return next;
+		/* Skip the run of unused inodes */
+		if (ext2fs_find_first_set_inode_bitmap2(ctx->inode_used_map,
+				next, ctx->fs->super->s_inodes_count, &ino))
+			return 0;
+	}
+}
 
 void e2fsck_pass4(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
 	ext2_ino_t	i;
-	struct ext2_inode	*inode;
+	struct ext2_inode	*inode = 0;
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
 #endif
@@ -99,8 +126,10 @@ void e2fsck_pass4(e2fsck_t ctx)
 	__u16	link_count, link_counted;
 	char	*buf = 0;
 	dgrp_t	group, maxgroup;
+	ext2_ino_t	next;
+	int	fast = 1;
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 
 #ifdef MTRACE
 	mtrace_print("Pass 4");
@@ -108,6 +137,13 @@ void e2fsck_pass4(e2fsck_t ctx)
 
 	clear_problem_context(&pctx);
 
+	/*
+	 * A partial check hasn't seen the directories outside its
+	 * groups, so it can't tell how many links an inode should have.
+	 */
+	if (ctx->options & E2F_OPT_GROUPS)
+		goto done;
+
 	if (!(ctx->options & E2F_OPT_PREEN))
 		fix_problem(ctx, PR_4_PASS_HEADER, &pctx);
 
@@ -126,11 +162,21 @@ void e2fsck_pass4(e2fsck_t ctx)
 
 		if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 			goto errout;
-		if ((i % fs->super->s_inodes_per_group) == 0) {
-			group++;
-			if (ctx->progress)
-				if ((ctx->progress)(ctx, 4, group, maxgroup))
+		if (fast) {
+			next = next_inode_to_check(ctx, i, &fast);
+			if (!next) {
+				if (ctx->progress &&
+				    (ctx->progress)(ctx, 4, maxgroup, maxgroup))
 					goto errout;
+				break;
+			}
+			i = next;
+		}
+		if (i / fs->super->s_inodes_per_group != group) {
+			group = i / fs->super->s_inodes_per_group;
+			if (ctx->progress &&
+			    (ctx->progress)(ctx, 4, group, maxgroup))
+				goto errout;
 		}
 		if (i == EXT2_BAD_INO ||
 		    (i > EXT2_ROOT_INO && i < EXT2_FIRST_INODE(fs->super)))
@@ -181,6 +227,9 @@ void e2fsck_pass4(e2fsck_t ctx)
 			}
 		}
 	}
+	e2fsck_reconnect_flush(ctx);
+done:
+	e2fsck_mem_sample(ctx);
 	ext2fs_free_icount(ctx->inode_link_info); ctx->inode_link_info = 0;
 	ext2fs_free_icount(ctx->inode_count); ctx->inode_count = 0;
 	ext2fs_free_inode_bitmap(ctx->inode_bb_map);
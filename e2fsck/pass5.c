@@ -38,8 +38,9 @@ void e2fsck_pass5(e2fsck_t ctx)
 	mtrace_print("Pass 5");
 #endif
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	clear_problem_context(&pctx);
+	ctx->discard_start = ctx->discard_count = 0;
 
 	if (!(ctx->options & E2F_OPT_PREEN))
 		fix_problem(ctx, PR_5_PASS_HEADER, &pctx);
@@ -63,6 +64,7 @@ void e2fsck_pass5(e2fsck_t ctx)
 	if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 		return;
 
+	e2fsck_mem_sample(ctx);
 	ext2fs_free_inode_bitmap(ctx->inode_used_map);
 	ctx->inode_used_map = 0;
 	ext2fs_free_inode_bitmap(ctx->inode_dir_map);
@@ -73,11 +75,21 @@ void e2fsck_pass5(e2fsck_t ctx)
 	print_resource_track(ctx, _("Pass 5"), &rtrack, ctx->fs->io);
 }
 
-static void e2fsck_discard_blocks(e2fsck_t ctx, blk64_t start,
-				  blk64_t count)
+/*
+ * Free runs are found a group, or a bit, at a time, and the runs of
+ * neighbouring groups (and their inode tables, with flex_bg) often
+ * touch.  Rather than sending the device many small discards, adjacent
+ * runs are merged and the result is only discarded once a run which
+ * doesn't touch it comes along, or the caller flushes it.  The
+ * pending run is kept in ctx->discard_start and ctx->discard_count.
+ */
+static void e2fsck_flush_discard(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
 
+	if (!ctx->discard_count)
+		return;
+
 	/*
 	 * If the filesystem has changed it means that there was an corruption
 	 * which should be repaired, but in some cases just one e2fsck run is
@@ -88,8 +100,27 @@ static void e2fsck_discard_blocks(e2fsck_t ctx, blk64_t start,
 		ctx->options &= ~E2F_OPT_DISCARD;
 
 	if ((ctx->options & E2F_OPT_DISCARD) &&
-	    (io_channel_discard(fs->io, start, count)))
+	    (io_channel_discard(fs->io, ctx->discard_start,
+				ctx->discard_count)))
 		ctx->options &= ~E2F_OPT_DISCARD;
+	ctx->discard_count = 0;
+}
+
+static void e2fsck_discard_blocks(e2fsck_t ctx, blk64_t start,
+				  blk64_t count)
+{
+	if (!(ctx->options & E2F_OPT_DISCARD)) {
+		ctx->discard_count = 0;
+		return;
+	}
+	if (ctx->discard_count &&
+	    ctx->discard_start + ctx->discard_count == start) {
+		ctx->discard_count += count;
+		return;
+	}
+	e2fsck_flush_discard(ctx);
+	ctx->discard_start = start;
+	ctx->discard_count = count;
 }
 
 /*
@@ -150,6 +181,71 @@ static void e2fsck_discard_inodes(e2fsck_t ctx, dgrp_t group,
 
 #define NO_BLK ((blk64_t) -1)
 
+/*
+ * Compare the first nbits bits of two bitmap buffers, ignoring
+ * whatever follows them in the last byte.
+ */
+static int bitmap_buf_equal(const char *a, const char *b, unsigned int nbits)
+{
+	unsigned int	nbytes = nbits / 8;
+	unsigned char	mask = (1 << (nbits % 8)) - 1;
+
+	if (memcmp(a, b, nbytes))
+		return 0;
+	return !(nbits % 8) || !((a[nbytes] ^ b[nbytes]) & mask);
+}
+
+/* Count the bits set in the first nbits bits of a bitmap buffer */
+static unsigned int bitmap_buf_count(const char *buf, unsigned int nbits)
+{
+	unsigned int	nbytes = nbits / 8;
+	unsigned char	tail;
+
+	if (!(nbits % 8))
+		return ext2fs_bitcount(buf, nbytes);
+	tail = buf[nbytes] & ((1 << (nbits % 8)) - 1);
+	return ext2fs_bitcount(buf, nbytes) + ext2fs_bitcount(&tail, 1);
+}
+
+/* Discard the runs of blocks between start and end which are not in use */
+static void discard_free_blocks(e2fsck_t ctx, blk64_t start, blk64_t end)
+{
+	blk64_t	first, last;
+
+	while (start <= end && (ctx->options & E2F_OPT_DISCARD)) {
+		if (ext2fs_find_first_zero_block_bitmap2(ctx->block_found_map,
+							 start, end, &first))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(ctx->block_found_map,
+							first, end, &last))
+			last = end + 1;
+		e2fsck_discard_blocks(ctx, first, last - first);
+		start = last;
+	}
+}
+
+/* Discard the inode table blocks of a group which hold no used inodes */
+static void discard_free_inodes(e2fsck_t ctx, dgrp_t group)
+{
+	ext2_filsys	fs = ctx->fs;
+	ext2_ino_t	start, end, first, last;
+
+	start = group * fs->super->s_inodes_per_group + 1;
+	end = start + fs->super->s_inodes_per_group - 1;
+	while (start <= end && (ctx->options & E2F_OPT_DISCARD)) {
+		if (ext2fs_find_first_zero_inode_bitmap2(ctx->inode_used_map,
+							 start, end, &first))
+			break;
+		if (ext2fs_find_first_set_inode_bitmap2(ctx->inode_used_map,
+							first, end, &last))
+			last = end + 1;
+		e2fsck_discard_inodes(ctx, group,
+			first - group * fs->super->s_inodes_per_group,
+			last - first);
+		start = last;
+	}
+}
+
 static void print_bitmap_problem(e2fsck_t ctx, problem_t problem,
 			    struct problem_context *pctx)
 {
@@ -278,35 +374,37 @@ redo_counts:
 		 * comparing the two.  If they are identical, then
 		 * update the free block counts and go on to the next
 		 * block group.  This is much faster than doing the
-		 * individual bit-by-bit comparison.  The one downside
-		 * is that this doesn't work if we are asking e2fsck
-		 * to do a discard operation.
+		 * individual bit-by-bit comparison; the bit-by-bit
+		 * path is only needed for groups which differ.
 		 */
-		if (!first_block_in_bg ||
-		    (group == (int)fs->group_desc_count - 1) ||
-		    (ctx->options & E2F_OPT_DISCARD))
+		if (!first_block_in_bg)
 			goto no_optimize;
 
+		cmp_block = fs->super->s_clusters_per_group;
+		if (group == (int)fs->group_desc_count - 1)
+			cmp_block = EXT2FS_NUM_B2C(fs,
+				    ext2fs_group_blocks_count(fs, group));
 		retval = ext2fs_get_block_bitmap_range2(ctx->block_found_map,
-				B2C(i), fs->super->s_clusters_per_group,
-				actual_buf);
+				B2C(i), cmp_block, actual_buf);
 		if (retval)
 			goto no_optimize;
 		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT))
 			memset(bitmap_buf, 0, nbytes);
 		else {
 			retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-					B2C(i), fs->super->s_clusters_per_group,
-					bitmap_buf);
+					B2C(i), cmp_block, bitmap_buf);
 			if (retval)
 				goto no_optimize;
 		}
-		if (memcmp(actual_buf, bitmap_buf, nbytes) != 0)
+		if (!bitmap_buf_equal(actual_buf, bitmap_buf, cmp_block))
 			goto no_optimize;
-		n = ext2fs_bitcount(actual_buf, nbytes);
-		group_free = fs->super->s_clusters_per_group - n;
+		n = bitmap_buf_count(actual_buf, cmp_block);
+		group_free = cmp_block - n;
 		free_blocks += group_free;
-		i += EXT2FS_C2B(fs, fs->super->s_clusters_per_group - 1);
+		if (group_free)
+			discard_free_blocks(ctx, i,
+					    ext2fs_group_last_block2(fs, group));
+		i += EXT2FS_C2B(fs, cmp_block - 1);
 		goto next_group;
 	no_optimize:
 
@@ -468,6 +566,7 @@ redo_counts:
 				skip_group++;
 		}
 	}
+	e2fsck_flush_discard(ctx);
 	if (pctx.blk != NO_BLK)
 		print_bitmap_problem(ctx, save_problem, &pctx);
 	if (had_problem)
@@ -498,6 +597,15 @@ redo_counts:
 		ext2fs_unmark_valid(fs);
 
 	for (g = 0; g < fs->group_desc_count; g++) {
+		/*
+		 * A partial check only counts its own groups, and
+		 * takes the descriptors' word for the others.
+		 */
+		if (!e2fsck_group_in_scope(ctx, g)) {
+			free_blocks = free_blocks - free_array[g] +
+				ext2fs_bg_free_blocks_count(fs, g);
+			continue;
+		}
 		if (free_array[g] != ext2fs_bg_free_blocks_count(fs, g)) {
 			pctx.group = g;
 			pctx.blk = ext2fs_bg_free_blocks_count(fs, g);
@@ -548,6 +656,15 @@ static void check_inode_bitmaps(e2fsck_t ctx)
 	int		skip_group = 0;
 	int		redo_flag = 0;
 	ext2_ino_t		first_free = fs->super->s_inodes_per_group + 1;
+	int		n, nbytes = fs->super->s_inodes_per_group / 8;
+	char		*actual_buf, *bitmap_buf, *dir_buf;
+
+	actual_buf = (char *) e2fsck_allocate_memory(ctx, nbytes,
+						     "actual bitmap buffer");
+	bitmap_buf = (char *) e2fsck_allocate_memory(ctx, nbytes,
+						     "bitmap block buffer");
+	dir_buf = (char *) e2fsck_allocate_memory(ctx, nbytes,
+						  "directory bitmap buffer");
 
 	clear_problem_context(&pctx);
 	free_array = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
@@ -596,6 +713,40 @@ redo_counts:
 	/* Protect loop from wrap-around if inodes_count is maxed */
 	for (i = 1; i <= fs->super->s_inodes_count && i > 0; i++) {
 		bitmap = 0;
+		/*
+		 * As for the blocks, compare a whole group at a time and
+		 * count its free inodes and directories from the bitmap
+		 * buffers; only groups which differ are checked inode by
+		 * inode.
+		 */
+		if (i % fs->super->s_inodes_per_group != 1)
+			goto no_optimize;
+		if (ext2fs_get_inode_bitmap_range2(ctx->inode_used_map, i,
+				fs->super->s_inodes_per_group, actual_buf))
+			goto no_optimize;
+		if (redo_flag)
+			memcpy(bitmap_buf, actual_buf, nbytes);
+		else if (skip_group)
+			memset(bitmap_buf, 0, nbytes);
+		else if (ext2fs_get_inode_bitmap_range2(fs->inode_map, i,
+				fs->super->s_inodes_per_group, bitmap_buf))
+			goto no_optimize;
+		if (memcmp(actual_buf, bitmap_buf, nbytes) ||
+		    ext2fs_get_inode_bitmap_range2(ctx->inode_dir_map, i,
+				fs->super->s_inodes_per_group, dir_buf))
+			goto no_optimize;
+		for (n = 0; n < nbytes; n++)
+			dir_buf[n] &= actual_buf[n];
+		dirs_count = ext2fs_bitcount(dir_buf, nbytes);
+		group_free = fs->super->s_inodes_per_group -
+			ext2fs_bitcount(actual_buf, nbytes);
+		free_inodes += group_free;
+		if (group_free)
+			discard_free_inodes(ctx, group);
+		i += fs->super->s_inodes_per_group - 1;
+		goto next_group;
+	no_optimize:
+
 		if (skip_group &&
 		    i % fs->super->s_inodes_per_group == 1) {
 			/*
@@ -699,10 +850,17 @@ do_counts:
 			if (!bitmap && inodes >= first_free)
 				e2fsck_discard_inodes(ctx, group, first_free,
 						      inodes - first_free + 1);
+		next_group:
 			/*
 			 * If discard zeroes data and the group inode table
-			 * was not zeroed yet, set itable as zeroed
+			 * was not zeroed yet, set itable as zeroed.  The
+			 * table must really have been discarded by then.
 			 */
+			if ((ctx->options & E2F_OPT_DISCARD) &&
+			    io_channel_discard_zeroes_data(fs->io) &&
+			    !(ext2fs_bg_flags_test(fs, group,
+						   EXT2_BG_INODE_ZEROED)))
+				e2fsck_flush_discard(ctx);
 			if ((ctx->options & E2F_OPT_DISCARD) &&
 			    io_channel_discard_zeroes_data(fs->io) &&
 			    !(ext2fs_bg_flags_test(fs, group,
@@ -732,6 +890,7 @@ do_counts:
 				skip_group++;
 		}
 	}
+	e2fsck_flush_discard(ctx);
 	if (pctx.ino)
 		print_bitmap_problem(ctx, save_problem, &pctx);
 
@@ -765,6 +924,12 @@ do_counts:
 		ext2fs_unmark_valid(fs);
 
 	for (i = 0; i < fs->group_desc_count; i++) {
+		/* As for the blocks; the directories are only known there */
+		if (!e2fsck_group_in_scope(ctx, i)) {
+			free_inodes = free_inodes - free_array[i] +
+				ext2fs_bg_free_inodes_count(fs, i);
+			continue;
+		}
 		if (free_array[i] != ext2fs_bg_free_inodes_count(fs, i)) {
 			pctx.group = i;
 			pctx.ino = ext2fs_bg_free_inodes_count(fs, i);
@@ -802,6 +967,9 @@ do_counts:
 errout:
 	ext2fs_free_mem(&free_array);
 	ext2fs_free_mem(&dir_array);
+	ext2fs_free_mem(&actual_buf);
+	ext2fs_free_mem(&bitmap_buf);
+	ext2fs_free_mem(&dir_buf);
 }
 
 static void check_inode_end(e2fsck_t ctx)
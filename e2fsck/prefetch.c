@@ -0,0 +1,393 @@
+/*
+ * prefetch.c --- prefetch inode tables for pass 1 from helper processes
+ *
+ * Pass 1 reads the inode table one group at a time and only issues
+ * the next read after it has finished checking the previous buffer,
+ * so on large arrays the device sees at most one outstanding request.
+ * When "-E prefetch_workers=N" is given, e2fsck forks N helper
+ * processes which each own a shard of the block groups and read the
+ * inode tables of their shard into the page cache, staying a bounded
+ * distance ahead of the checking process.  The checking itself stays
+ * in the main process, since the libext2fs handle, the bitmaps and
+ * the problem reporting code are not safe to share; the helpers only
+ * open the device read-only and never touch the file system handle.
+ *
+ * Having read a piece of an inode table, a helper also looks at the
+ * inodes in it and starts reading the blocks that check_blocks() will
+ * need next: the extent tree blocks (the interior ones are read by the
+ * helper itself, so that it can find the leaves), the first level of
+ * indirect blocks, and the extended attribute block.  That way pass 1
+ * rarely has to wait for metadata outside the inode table.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <sys/wait.h>
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "e2fsck.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+#define HAVE_ITABLE_PREFETCH
+#endif
+
+#define PREFETCH_MAX_WORKERS	64
+#define PREFETCH_IO_SIZE	(1024 * 1024)	/* max bytes per read */
+#define PREFETCH_STOP		(~(dgrp_t) 0)
+#define PREFETCH_MAX_DEPTH	5	/* deepest extent tree we follow */
+#define PREFETCH_MAX_INODES	(PREFETCH_IO_SIZE / EXT2_GOOD_OLD_INODE_SIZE)
+
+/*
+ * State shared between the checking process and the helpers.  Only
+ * the checking process writes it.
+ */
+struct prefetch_shared {
+	volatile dgrp_t	cur_group;	/* next group pass 1 will scan */
+};
+
+struct itable_prefetch {
+	int			nr_workers;
+	pid_t			pids[PREFETCH_MAX_WORKERS];
+	struct prefetch_shared	*shared;
+	dgrp_t			stripe;	  /* groups handed out at once */
+	dgrp_t			window;	  /* how far ahead helpers may run */
+	dgrp_t			first, end; /* groups pass 1 will scan */
+};
+
+#ifdef HAVE_ITABLE_PREFETCH
+/* Ask the kernel to start reading a block, if it's a sane block number */
+static void prefetch_block(ext2_filsys fs, int fd, blk64_t blk)
+{
+	if (blk < fs->super->s_first_data_block ||
+	    blk >= ext2fs_blocks_count(fs->super))
+		return;
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	(void) posix_fadvise(fd, (ext2_loff_t) blk * fs->blocksize,
+			     fs->blocksize, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * Walk the interior nodes of an extent tree, reading them into scratch
+ * (one block per level), and start the reads of the leaf blocks.
+ */
+static void prefetch_extent_node(ext2_filsys fs, int fd, char *scratch,
+				 const struct ext3_extent_header *eh,
+				 unsigned int max_entries, int level)
+{
+	const struct ext3_extent_idx *ix;
+	unsigned int	i, entries, depth;
+	blk64_t		blk;
+	char		*child;
+
+	if (ext2fs_le16_to_cpu(eh->eh_magic) != EXT3_EXT_MAGIC)
+		return;
+	depth = ext2fs_le16_to_cpu(eh->eh_depth);
+	entries = ext2fs_le16_to_cpu(eh->eh_entries);
+	if (depth == 0 || level + depth > PREFETCH_MAX_DEPTH)
+		return;
+	if (entries > max_entries)
+		entries = max_entries;
+
+	ix = (const struct ext3_extent_idx *) (eh + 1);
+	for (i = 0; i < entries; i++, ix++) {
+		blk = ext2fs_le32_to_cpu(ix->ei_leaf) +
+			((blk64_t) ext2fs_le16_to_cpu(ix->ei_leaf_hi) << 32);
+		if (depth == 1) {
+			prefetch_block(fs, fd, blk);
+			continue;
+		}
+		if (blk < fs->super->s_first_data_block ||
+		    blk >= ext2fs_blocks_count(fs->super))
+			continue;
+		child = scratch + level * fs->blocksize;
+		if (pread(fd, child, fs->blocksize,
+			  (ext2_loff_t) blk * fs->blocksize) !=
+		    (ssize_t) fs->blocksize)
+			continue;
+		prefetch_extent_node(fs, fd, scratch,
+				     (struct ext3_extent_header *) child,
+				     (fs->blocksize - sizeof(*eh)) /
+				     sizeof(*ix), level + 1);
+	}
+}
+
+static EXT2_QSORT_TYPE blk_cmp(const void *a, const void *b)
+{
+	blk64_t	ba = *(const blk64_t *) a, bb = *(const blk64_t *) b;
+
+	return (ba > bb) - (ba < bb);
+}
+
+/*
+ * Start reading the metadata blocks of the inodes found in buf.
+ *
+ * Extended attribute blocks are often shared by many inodes, so they
+ * are collected in ea_blks, and each distinct one is prefetched once,
+ * in disk order, after the rest of the buffer has been looked at.
+ */
+static void prefetch_inode_blocks(ext2_filsys fs, int fd, char *scratch,
+				  blk64_t *ea_blks, const char *buf,
+				  ssize_t size)
+{
+	const struct ext2_inode *inode;
+	int		isize = EXT2_INODE_SIZE(fs->super);
+	__u16		mode;
+	__u32		flags;
+	blk64_t		blk;
+	int		i, num_ea = 0;
+
+	for (; size >= isize; buf += isize, size -= isize) {
+		inode = (const struct ext2_inode *) buf;
+		if (!inode->i_links_count)
+			continue;
+		mode = ext2fs_le16_to_cpu(inode->i_mode);
+		if (!LINUX_S_ISREG(mode) && !LINUX_S_ISDIR(mode))
+			continue;
+		flags = ext2fs_le32_to_cpu(inode->i_flags);
+
+		blk = ext2fs_le32_to_cpu(inode->i_file_acl) +
+			((blk64_t) ext2fs_le16_to_cpu(
+				inode->osd2.linux2.l_i_file_acl_high) << 32);
+		if (blk)
+			ea_blks[num_ea++] = blk;
+
+		if (flags & EXT4_EXTENTS_FL) {
+			prefetch_extent_node(fs, fd, scratch,
+				(const struct ext3_extent_header *)
+				inode->i_block,
+				(sizeof(inode->i_block) -
+				 sizeof(struct ext3_extent_header)) /
+				sizeof(struct ext3_extent_idx), 0);
+			continue;
+		}
+		for (i = EXT2_IND_BLOCK; i <= EXT2_TIND_BLOCK; i++) {
+			blk = ext2fs_le32_to_cpu(inode->i_block[i]);
+			if (blk)
+				prefetch_block(fs, fd, blk);
+		}
+	}
+
+	qsort(ea_blks, num_ea, sizeof(blk64_t), blk_cmp);
+	for (i = 0; i < num_ea; i++)
+		if (i == 0 || ea_blks[i] != ea_blks[i - 1])
+			prefetch_block(fs, fd, ea_blks[i]);
+}
+
+/*
+ * Read one group's inode table; we only want it in the page cache,
+ * so the contents are thrown away once the blocks the inodes refer
+ * to have been prefetched.
+ */
+static void prefetch_group(ext2_filsys fs, int fd, char *buf,
+			   char *scratch, blk64_t *ea_blks, dgrp_t group)
+{
+	blk64_t		blk;
+	__u64		offset, len;
+	ssize_t		size, ret;
+
+	blk = ext2fs_inode_table_loc(fs, group);
+	if (!blk || blk >= ext2fs_blocks_count(fs->super))
+		return;
+	len = fs->inode_blocks_per_group;
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+		__u32 used;
+
+		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+			return;
+		used = fs->super->s_inodes_per_group -
+			ext2fs_bg_itable_unused(fs, group);
+		len = ((__u64) used * EXT2_INODE_SIZE(fs->super) +
+		       fs->blocksize - 1) / fs->blocksize;
+		if (len > fs->inode_blocks_per_group)
+			len = fs->inode_blocks_per_group;
+	}
+	offset = blk * fs->blocksize;
+	len *= fs->blocksize;
+	while (len) {
+		size = (len > PREFETCH_IO_SIZE) ? PREFETCH_IO_SIZE : len;
+		ret = pread(fd, buf, size, offset);
+		if (ret <= 0)
+			return;
+		prefetch_inode_blocks(fs, fd, scratch, ea_blks, buf, ret);
+		offset += ret;
+		len -= ret;
+	}
+}
+
+static void prefetch_worker(e2fsck_t ctx, struct itable_prefetch *pf,
+			    int worker, pid_t parent)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct sigaction sa;
+	dgrp_t		start, group, end, cur;
+	char		*buf, *scratch;
+	blk64_t		*ea_blks;
+	int		fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sigaction(SIGUSR1, &sa, 0);
+	sigaction(SIGUSR2, &sa, 0);
+
+	fd = open(ctx->filesystem_name, O_RDONLY);
+	if (fd < 0)
+		_exit(0);
+	buf = malloc(PREFETCH_IO_SIZE);
+	scratch = malloc(PREFETCH_MAX_DEPTH * fs->blocksize);
+	ea_blks = malloc(PREFETCH_MAX_INODES * sizeof(blk64_t));
+	if (!buf || !scratch || !ea_blks)
+		_exit(0);
+
+	for (start = pf->first + worker * pf->stripe; start < pf->end;
+	     start += pf->nr_workers * pf->stripe) {
+		end = start + pf->stripe;
+		if (end > pf->end)
+			end = pf->end;
+		/*
+		 * Don't run too far ahead of the checking process,
+		 * or our blocks will be evicted before it gets to
+		 * them.
+		 */
+		while (1) {
+			cur = pf->shared->cur_group;
+			if (cur == PREFETCH_STOP || getppid() != parent)
+				_exit(0);
+			if (end <= cur)
+				break;
+			if (start <= cur + pf->window)
+				break;
+			usleep(10000);
+		}
+		if (end <= cur)
+			continue;
+		group = (start < cur) ? cur : start;
+		for (; group < end; group++)
+			prefetch_group(fs, fd, buf, scratch, ea_blks, group);
+	}
+	_exit(0);
+}
+#endif /* HAVE_ITABLE_PREFETCH */
+
+void e2fsck_start_itable_prefetch(e2fsck_t ctx)
+{
+#ifdef HAVE_ITABLE_PREFETCH
+	ext2_filsys	fs = ctx->fs;
+	struct itable_prefetch *pf;
+	pid_t		parent, pid;
+	int		i;
+
+	if (ctx->itable_prefetch)
+		e2fsck_stop_itable_prefetch(ctx);
+	if (ctx->prefetch_workers <= 0 || !fs || fs->group_desc_count < 2)
+		return;
+	/*
+	 * The helpers read the device directly, so they would be of
+	 * no use (or actively wrong) for any other I/O manager, or
+	 * if the file system doesn't start at offset 0.
+	 */
+	if (fs->io->manager != unix_io_manager || ctx->io_options)
+		return;
+
+	pf = (struct itable_prefetch *)
+		e2fsck_allocate_memory(ctx, sizeof(struct itable_prefetch),
+				       "inode table prefetch state");
+	pf->nr_workers = ctx->prefetch_workers;
+	if (pf->nr_workers > PREFETCH_MAX_WORKERS)
+		pf->nr_workers = PREFETCH_MAX_WORKERS;
+	/*
+	 * With flex_bg the inode tables of a flex group are adjacent,
+	 * so hand out a whole flex group at a time.
+	 */
+	pf->stripe = 8;
+	if (EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+				      EXT4_FEATURE_INCOMPAT_FLEX_BG) &&
+	    fs->super->s_log_groups_per_flex < 16)
+		pf->stripe = 1 << fs->super->s_log_groups_per_flex;
+	if (pf->stripe < 1)
+		pf->stripe = 1;
+	pf->window = 2 * pf->stripe * pf->nr_workers;
+
+	pf->shared = mmap(0, sizeof(struct prefetch_shared),
+			  PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pf->shared == MAP_FAILED) {
+		ext2fs_free_mem(&pf);
+		return;
+	}
+	pf->first = 0;
+	pf->end = fs->group_desc_count;
+	if (ctx->options & E2F_OPT_GROUPS) {
+		pf->first = ctx->scope_first_group;
+		pf->end = ctx->scope_last_group + 1;
+	}
+	pf->shared->cur_group = pf->first;
+
+	/* Don't duplicate unflushed stdio output into the children */
+	fflush(stdout);
+	fflush(stderr);
+	if (ctx->logf)
+		fflush(ctx->logf);
+
+	parent = getpid();
+	for (i = 0; i < pf->nr_workers; i++) {
+		pid = fork();
+		if (pid == 0)
+			prefetch_worker(ctx, pf, i, parent);
+		if (pid < 0)
+			break;
+		pf->pids[i] = pid;
+	}
+	pf->nr_workers = i;
+	ctx->itable_prefetch = pf;
+	if (i == 0)
+		e2fsck_stop_itable_prefetch(ctx);
+#endif
+}
+
+/*
+ * Called by pass 1 when it moves on to a new block group.
+ */
+void e2fsck_itable_prefetch_progress(e2fsck_t ctx, dgrp_t group)
+{
+	struct itable_prefetch *pf = ctx->itable_prefetch;
+
+	if (pf)
+		pf->shared->cur_group = group;
+}
+
+void e2fsck_stop_itable_prefetch(e2fsck_t ctx)
+{
+#ifdef HAVE_ITABLE_PREFETCH
+	struct itable_prefetch *pf = ctx->itable_prefetch;
+	int	i;
+
+	if (!pf)
+		return;
+	pf->shared->cur_group = PREFETCH_STOP;
+	for (i = 0; i < pf->nr_workers; i++) {
+		kill(pf->pids[i], SIGTERM);
+		while (waitpid(pf->pids[i], 0, 0) < 0 && errno == EINTR)
+			;
+	}
+	munmap((void *) pf->shared, sizeof(struct prefetch_shared));
+	ext2fs_free_mem(&ctx->itable_prefetch);
+#endif
+}
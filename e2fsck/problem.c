@@ -1518,6 +1518,16 @@ static struct e2fsck_problem problem_table[] = {
 	  N_("/@l is not a @d (ino=%i)\n"),
 	  PROMPT_UNLINK, 0 },
 
+	/* Error allocating the directory path */
+	{ PR_3_ALLOCATE_PATH_ERROR,
+	  N_("@A @d path: %m\n"),
+	  PROMPT_NONE, PR_FATAL },
+
+	/* '..' of a directory in a partial check doesn't lead back to it */
+	{ PR_3_SCOPE_BAD_DOT_DOT,
+	  N_("'..' in %p (%i) is %P (%j), which has no @e for it.\n"),
+	  PROMPT_NONE, 0 },
+
 	/* Pass 3A Directory Optimization	*/
 
 	/* Pass 3A: Optimizing directories */
@@ -1724,6 +1734,16 @@ static struct e2fsck_problem problem_table[] = {
 	  N_("Update quota info for quota type %N"),
 	  PROMPT_NULL, PR_PREEN_OK },
 
+	/* Converting block-mapped files to extents */
+	{ PR_6_BMAP2EXTENT_HEADER,
+	  N_("Converting block-mapped files to extents\n"),
+	  PROMPT_NONE, PR_PREEN_NOMSG },
+
+	/* Error converting a block-mapped file to extents */
+	{ PR_6_BMAP2EXTENT_ERROR,
+	  N_("Error while converting @i %i to extents: %m\n"),
+	  PROMPT_NONE, PR_PREEN_OK },
+
 	{ 0 }
 };
 
@@ -1747,13 +1767,30 @@ static struct latch_descr pr_latch_info[] = {
 	{ -1, 0, 0 },
 };
 
+/*
+ * fix_problem() may be called millions of times on a badly damaged
+ * file system, so look the code up with a binary search; the problem
+ * table is sorted by code (tst_problem checks that).
+ */
 static struct e2fsck_problem *find_problem(problem_t code)
 {
-	int	i;
-
-	for (i=0; problem_table[i].e2p_code; i++) {
-		if (problem_table[i].e2p_code == code)
-			return &problem_table[i];
+	static int	num_problems;
+	int		low, high, mid;
+
+	if (!num_problems)
+		while (problem_table[num_problems].e2p_code)
+			num_problems++;
+
+	low = 0;
+	high = num_problems - 1;
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (problem_table[mid].e2p_code == code)
+			return &problem_table[mid];
+		if (problem_table[mid].e2p_code < code)
+			low = mid + 1;
+		else
+			high = mid - 1;
 	}
 	return 0;
 }
@@ -1862,9 +1899,12 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 		reconfigure_bool(ctx, ptr, key, PR_NO_NOMSG, "no_nomsg");
 		reconfigure_bool(ctx, ptr, key, PR_PREEN_NOHDR, "preen_noheader");
 		reconfigure_bool(ctx, ptr, key, PR_FORCE_NO, "force_no");
-		profile_get_integer(ctx->profile, "options",
-				    "max_count_problems", 0, 0,
-				    &ptr->max_count);
+		if (ctx->max_count_problems)
+			ptr->max_count = ctx->max_count_problems;
+		else
+			profile_get_integer(ctx->profile, "options",
+					    "max_count_problems", 0, 0,
+					    &ptr->max_count);
 		profile_get_integer(ctx->profile, "problems", key, "max_count",
 				    ptr->max_count, &ptr->max_count);
 
@@ -1901,6 +1941,8 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 	    ((ctx->options & E2F_OPT_NO) || (ptr->flags & PR_FORCE_NO)))
 		suppress++;
 	if (ptr->max_count && (ptr->count > ptr->max_count)) {
+		int	was_suppressed = suppress;
+
 		if (ctx->options & (E2F_OPT_NO | E2F_OPT_YES))
 			suppress++;
 		if ((ctx->options & E2F_OPT_PREEN) &&
@@ -1909,6 +1951,8 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 		if ((ptr->flags & PR_LATCH_MASK) &&
 		    (ldesc->flags & (PRL_YES | PRL_NO)))
 			suppress++;
+		if (suppress && !was_suppressed)
+			ptr->suppressed++;
 		if (ptr->count == ptr->max_count + 1) {
 			printf("...problem 0x%06x suppressed\n",
 			       ptr->e2p_code);
@@ -1982,6 +2026,31 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 	return answer;
 }
 
+/*
+ * Once the checks are done, say how many reports of each problem were
+ * left out of the output because of max_count_problems, so that a
+ * flood of identical problems ends up as one line each.
+ */
+void report_suppressed_problems(e2fsck_t ctx)
+{
+	struct e2fsck_problem *ptr;
+	const char	*fmt = _("Problem 0x%06x: %d of %d reports suppressed\n");
+	int		first = 1;
+
+	for (ptr = problem_table; ptr->e2p_code; ptr++) {
+		if (!ptr->suppressed)
+			continue;
+		if (first) {
+			fputc('\n', stdout);
+			first = 0;
+		}
+		printf(fmt, ptr->e2p_code, ptr->suppressed, ptr->count);
+		if (ctx->logf)
+			fprintf(ctx->logf, fmt, ptr->e2p_code,
+				ptr->suppressed, ptr->count);
+	}
+}
+
 #ifdef UNITTEST
 
 #include <stdlib.h>
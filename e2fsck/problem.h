@@ -912,6 +912,12 @@ struct problem_context {
 /* Lost+found is not a directory */
 #define PR_3_LPF_NOTDIR			0x030017
 
+/* Error allocating the directory path */
+#define PR_3_ALLOCATE_PATH_ERROR	0x030018
+
+/* '..' of a directory in a partial check doesn't lead back to it */
+#define PR_3_SCOPE_BAD_DOT_DOT		0x030019
+
 /*
  * Pass 3a --- rehashing diretories
  */
@@ -1044,6 +1050,12 @@ struct problem_context {
 /* Update quota information if it is inconsistent */
 #define PR_6_UPDATE_QUOTAS		0x060002
 
+/* Converting block-mapped files to extents */
+#define PR_6_BMAP2EXTENT_HEADER		0x060003
+
+/* Error converting a block-mapped file to extents */
+#define PR_6_BMAP2EXTENT_ERROR		0x060004
+
 /*
  * Function declarations
  */
@@ -1052,6 +1064,7 @@ int end_problem_latch(e2fsck_t ctx, int mask);
 int set_latch_flags(int mask, int setflags, int clearflags);
 int get_latch_flags(int mask, int *value);
 void clear_problem_context(struct problem_context *pctx);
+void report_suppressed_problems(e2fsck_t ctx);
 
 /* message.c */
 void print_e2fsck_message(FILE *f, e2fsck_t ctx, const char *msg,
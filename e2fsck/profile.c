@@ -139,11 +139,23 @@ struct profile_node {
 	int group_level;
 	unsigned int final:1;		/* Indicate don't search next file */
 	unsigned int deleted:1;
+	unsigned int hash;		/* of name */
 	struct profile_node *first_child;
 	struct profile_node *parent;
 	struct profile_node *next, *prev;
+	/*
+	 * Sections with many children also get a hash table, holding
+	 * the first child of each name.  It is built by the first
+	 * lookup which needs it.
+	 */
+	struct profile_node **child_hash;
+	unsigned int child_hash_size;
+	unsigned int num_children;
 };
 
+/* Sections with fewer children than this are just searched linearly */
+#define PROFILE_CHILD_HASH_MIN	16
+
 #define CHECK_MAGIC(node) \
 	  if ((node)->magic != PROF_MAGIC_NODE) \
 		  return PROF_MAGIC_NODE;
@@ -1055,6 +1067,7 @@ void profile_free_node(struct profile_node *node)
 
 	free(node->name);
 	free(node->value);
+	free(node->child_hash);
 
 	for (child=node->first_child; child; child = next) {
 		next = child->next;
@@ -1081,6 +1094,73 @@ static char *MYstrdup (const char *s)
 /*
  * Create a node
  */
+static unsigned int profile_name_hash(const char *name)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = (hash * 31) + (unsigned char) *name++;
+	return hash;
+}
+
+/*
+ * (Re)build the hash table of a section's children.  If there's no
+ * memory for it, the section is simply searched linearly.
+ */
+static void build_child_hash(struct profile_node *section)
+{
+	struct profile_node	*p, **table;
+	unsigned int		size, i;
+
+	free(section->child_hash);
+	section->child_hash = 0;
+	section->child_hash_size = 0;
+
+	for (size = 64; size < section->num_children * 2; size *= 2)
+		;
+	table = calloc(size, sizeof(struct profile_node *));
+	if (!table)
+		return;
+	for (p = section->first_child; p; p = p->next) {
+		if (p->prev && p->prev->hash == p->hash &&
+		    !strcmp(p->prev->name, p->name))
+			continue;
+		for (i = p->hash & (size - 1); table[i]; i = (i + 1) & (size - 1))
+			;
+		table[i] = p;
+	}
+	section->child_hash = table;
+	section->child_hash_size = size;
+}
+
+/*
+ * Children are kept sorted by name, so all the children with the same
+ * name follow each other.  Return the first of them, or NULL if there
+ * are none.
+ */
+static struct profile_node *find_first_child(struct profile_node *section,
+					     const char *name,
+					     unsigned int hash)
+{
+	struct profile_node	*p;
+	unsigned int		i, mask;
+
+	if (!section->child_hash &&
+	    section->num_children >= PROFILE_CHILD_HASH_MIN)
+		build_child_hash(section);
+	if (!section->child_hash) {
+		for (p = section->first_child; p; p = p->next)
+			if (p->hash == hash && !strcmp(p->name, name))
+				return p;
+		return 0;
+	}
+	mask = section->child_hash_size - 1;
+	for (i = hash & mask; (p = section->child_hash[i]); i = (i + 1) & mask)
+		if (p->hash == hash && !strcmp(p->name, name))
+			return p;
+	return 0;
+}
+
 errcode_t profile_create_node(const char *name, const char *value,
 			      struct profile_node **ret_node)
 {
@@ -1090,11 +1170,13 @@ errcode_t profile_create_node(const char *name, const char *value,
 	if (!new)
 		return ENOMEM;
 	memset(new, 0, sizeof(struct profile_node));
+	new->magic = PROF_MAGIC_NODE;
 	new->name = strdup(name);
 	if (new->name == 0) {
 	    profile_free_node(new);
 	    return ENOMEM;
 	}
+	new->hash = profile_name_hash(name);
 	if (value) {
 		new->value = strdup(value);
 		if (new->value == 0) {
@@ -1102,7 +1184,6 @@ errcode_t profile_create_node(const char *name, const char *value,
 		    return ENOMEM;
 		}
 	}
-	new->magic = PROF_MAGIC_NODE;
 
 	*ret_node = new;
 	return 0;
@@ -1150,26 +1231,35 @@ errcode_t profile_add_node(struct profile_node *section, const char *name,
 {
 	errcode_t retval;
 	struct profile_node *p, *last, *new;
+	int first_of_name = 0;
 
 	CHECK_MAGIC(section);
 
 	if (section->value)
 		return PROF_ADD_NOT_SECTION;
 
+	retval = profile_create_node(name, value, &new);
+	if (retval)
+		return retval;
+
 	/*
 	 * Find the place to insert the new node.  We look for the
 	 * place *after* the last match of the node name, since
 	 * order matters.
 	 */
-	for (p=section->first_child, last = 0; p; last = p, p = p->next) {
-		int cmp;
-		cmp = strcmp(p->name, name);
-		if (cmp > 0)
-			break;
+	p = find_first_child(section, name, new->hash);
+	if (p) {
+		for (last = p, p = p->next; p; last = p, p = p->next)
+			if (p->hash != new->hash || strcmp(p->name, name))
+				break;
+	} else {
+		for (p=section->first_child, last = 0; p;
+		     last = p, p = p->next) {
+			if (strcmp(p->name, name) > 0)
+				break;
+		}
+		first_of_name = 1;
 	}
-	retval = profile_create_node(name, value, &new);
-	if (retval)
-		return retval;
 	new->group_level = section->group_level+1;
 	new->deleted = 0;
 	new->parent = section;
@@ -1181,6 +1271,23 @@ errcode_t profile_add_node(struct profile_node *section, const char *name,
 		last->next = new;
 	else
 		section->first_child = new;
+	section->num_children++;
+	/*
+	 * A new name has to go in the hash table; rebuild it when it
+	 * gets too full.
+	 */
+	if (section->child_hash && first_of_name) {
+		if (section->num_children * 2 > section->child_hash_size)
+			build_child_hash(section);
+		else {
+			unsigned int i, mask = section->child_hash_size - 1;
+
+			for (i = new->hash & mask; section->child_hash[i];
+			     i = (i + 1) & mask)
+				;
+			section->child_hash[i] = new;
+		}
+	}
 	if (ret_node)
 		*ret_node = new;
 	return 0;
@@ -1205,17 +1312,25 @@ errcode_t profile_find_node(struct profile_node *section, const char *name,
 			    struct profile_node **node)
 {
 	struct profile_node *p;
+	unsigned int hash = 0;
 
 	CHECK_MAGIC(section);
+	if (name)
+		hash = profile_name_hash(name);
 	p = *state;
 	if (p) {
 		CHECK_MAGIC(p);
-	} else
+	} else if (name)
+		p = find_first_child(section, name, hash);
+	else
 		p = section->first_child;
 
 	for (; p; p = p->next) {
-		if (name && (strcmp(p->name, name)))
-			continue;
+		/* Nodes of the same name are next to each other */
+		if (name && (p->hash != hash || strcmp(p->name, name))) {
+			p = 0;
+			break;
+		}
 		if (section_flag) {
 			if (p->value)
 				continue;
@@ -1242,8 +1357,10 @@ errcode_t profile_find_node(struct profile_node *section, const char *name,
 	 * there's guaranteed to be another match that's returned.
 	 */
 	for (p = p->next; p; p = p->next) {
-		if (name && (strcmp(p->name, name)))
-			continue;
+		if (name && (p->hash != hash || strcmp(p->name, name))) {
+			p = 0;
+			break;
+		}
 		if (section_flag) {
 			if (p->value)
 				continue;
@@ -1270,6 +1387,7 @@ struct profile_iterator {
 	int			flags;
 	const char 		*const *names;
 	const char		*name;
+	unsigned int		name_hash;
 	prf_file_t		file;
 	int			file_serial;
 	int			done_idx;
@@ -1339,6 +1457,7 @@ errcode_t profile_node_iterator(void **iter_p, struct profile_node **ret_node,
 	const char			*const *cpp;
 	errcode_t			retval;
 	int				skip_num = 0;
+	unsigned int			hash;
 
 	if (!iter || iter->magic != PROF_MAGIC_ITERATOR)
 		return PROF_MAGIC_ITERATOR;
@@ -1389,8 +1508,14 @@ get_new_file:
 		 */
 		section = iter->file->root;
 		for (cpp = iter->names; cpp[iter->done_idx]; cpp++) {
-			for (p=section->first_child; p; p = p->next) {
-				if (!strcmp(p->name, *cpp) && !p->value)
+			hash = profile_name_hash(*cpp);
+			for (p = find_first_child(section, *cpp, hash); p;
+			     p = p->next) {
+				if (p->hash != hash || strcmp(p->name, *cpp)) {
+					p = 0;
+					break;
+				}
+				if (!p->value)
 					break;
 			}
 			if (!p) {
@@ -1407,15 +1532,29 @@ get_new_file:
 			goto get_new_file;
 		}
 		iter->name = *cpp;
-		iter->node = section->first_child;
+		if (iter->name) {
+			iter->name_hash = profile_name_hash(iter->name);
+			iter->node = find_first_child(section, iter->name,
+						      iter->name_hash);
+			if (!iter->node) {
+				iter->file = iter->file->next;
+				skip_num = 0;
+				goto get_new_file;
+			}
+		} else
+			iter->node = section->first_child;
 	}
 	/*
 	 * OK, now we know iter->node is set up correctly.  Let's do
 	 * the search.
 	 */
 	for (p = iter->node; p; p = p->next) {
-		if (iter->name && strcmp(p->name, iter->name))
-			continue;
+		/* Nodes of the same name are next to each other */
+		if (iter->name && (p->hash != iter->name_hash ||
+				   strcmp(p->name, iter->name))) {
+			p = 0;
+			break;
+		}
 		if ((iter->flags & PROFILE_ITER_SECTIONS_ONLY) &&
 		    p->value)
 			continue;
@@ -35,6 +35,16 @@ struct recovery_info
 	int		nr_replays;
 	int		nr_revokes;
 	int		nr_revoke_hits;
+
+#ifndef __KERNEL__
+	/* Blocks to be replayed once the whole log has been scanned */
+	struct journal_replay_block *replay;
+	unsigned int	nr_replay;
+	unsigned int	max_replay;
+
+	/* Revoke records seen by the scan pass */
+	int		nr_scanned_revokes;
+#endif
 };
 
 enum passtype {PASS_SCAN, PASS_REVOKE, PASS_REPLAY};
@@ -174,6 +184,69 @@ static int jread(struct buffer_head **bhp, journal_t *journal,
 }
 
 
+#ifndef __KERNEL__
+/*
+ * Remember that the log block at offset io_block holds a new copy of
+ * the file system block blocknr.  Nothing is read or written yet;
+ * journal_replay_blocks() does that for all of them at the end.
+ */
+static int add_replay_block(journal_t *journal, struct recovery_info *info,
+			    unsigned long long blocknr, unsigned int io_block,
+			    int escape)
+{
+	struct journal_replay_block *rb;
+	unsigned long long log_blocknr;
+	int err;
+
+	if (io_block >= journal->j_maxlen) {
+		printk(KERN_ERR "JBD: corrupted journal superblock\n");
+		return -EIO;
+	}
+	err = journal_bmap(journal, io_block, &log_blocknr);
+	if (err) {
+		printk(KERN_ERR "JBD: bad block at offset %u\n", io_block);
+		return err;
+	}
+
+	if (info->nr_replay >= info->max_replay) {
+		unsigned int new_max = info->max_replay ?
+			info->max_replay * 2 : 1024;
+
+		rb = realloc(info->replay, new_max * sizeof(*rb));
+		if (!rb)
+			return -ENOMEM;
+		info->replay = rb;
+		info->max_replay = new_max;
+	}
+	rb = info->replay + info->nr_replay;
+	rb->home = blocknr;
+	rb->log = log_blocknr;
+	rb->seq = info->nr_replay++;
+	rb->escape = escape;
+	return 0;
+}
+
+/*
+ * Count the blocks revoked by a revoke block, so that the revoke
+ * table can be sized before they are added to it.
+ */
+static int count_revoke_records(journal_t *journal, struct buffer_head *bh)
+{
+	journal_revoke_header_t *header;
+	int max, record_len = 4;
+
+	header = (journal_revoke_header_t *) bh->b_data;
+	max = be32_to_cpu(header->r_count);
+	if (max > journal->j_blocksize)
+		max = journal->j_blocksize;
+	if (JFS_HAS_INCOMPAT_FEATURE(journal, JFS_FEATURE_INCOMPAT_64BIT))
+		record_len = 8;
+	if (max <= (int) sizeof(journal_revoke_header_t))
+		return 0;
+	return (max - sizeof(journal_revoke_header_t)) / record_len;
+}
+#endif
+
 /*
  * Count the number of in-use tags in a journal descriptor block.
  */
@@ -246,10 +319,25 @@ int journal_recover(journal_t *journal)
 	}
 
 	err = do_one_pass(journal, &info, PASS_SCAN);
+#ifndef __KERNEL__
+	/* The table can still grow if this fails */
+	if (!err)
+		(void) journal_size_revoke(journal, info.nr_scanned_revokes);
+#endif
 	if (!err)
 		err = do_one_pass(journal, &info, PASS_REVOKE);
 	if (!err)
 		err = do_one_pass(journal, &info, PASS_REPLAY);
+#ifndef __KERNEL__
+	/* Write out what was found, even if the log ended badly */
+	if (info.nr_replay) {
+		int replay_err = journal_replay_blocks(journal, info.replay,
+						       info.nr_replay);
+		if (!err)
+			err = replay_err;
+	}
+	free(info.replay);
+#endif
 
 	jbd_debug(1, "JBD: recovery, exit status %d, "
 		  "recovered transactions %u to %u\n",
@@ -483,6 +571,36 @@ static int do_one_pass(journal_t *journal,
 
 				io_block = next_log_block++;
 				wrap(journal, next_log_block);
+#ifndef __KERNEL__
+				{
+					unsigned long long blocknr;
+
+					blocknr = read_tag_block(tag_bytes,
+								 tag);
+					if (journal_test_revoke
+					    (journal, blocknr,
+					     next_commit_ID)) {
+						++info->nr_revoke_hits;
+						goto skip_write;
+					}
+					err = add_replay_block(journal, info,
+						blocknr, io_block,
+						flags & JFS_FLAG_ESCAPE);
+					if (err == -ENOMEM) {
+						printk(KERN_ERR
+						       "JBD: Out of memory "
+						       "during recovery.\n");
+						brelse(bh);
+						goto failed;
+					}
+					if (err) {
+						success = err;
+						goto skip_write;
+					}
+					++info->nr_replays;
+					goto skip_write;
+				}
+#endif
 				err = jread(&obh, journal, io_block);
 				if (err) {
 					/* Recover what we can, but
@@ -659,6 +777,12 @@ static int do_one_pass(journal_t *journal,
 			/* If we aren't in the REVOKE pass, then we can
 			 * just skip over this block. */
 			if (pass != PASS_REVOKE) {
+#ifndef __KERNEL__
+				if (pass == PASS_SCAN)
+					info->nr_scanned_revokes +=
+						count_revoke_records(journal,
+								     bh);
+#endif
 				brelse(bh);
 				continue;
 			}
@@ -19,16 +19,21 @@
 #endif
 #include "e2fsck.h"
 
+/*
+ * The allocated regions are kept in an array sorted by start address.
+ * Adjacent regions are always merged, so no two elements touch, and
+ * the place of a new region can be found with a binary search.
+ */
 struct region_el {
 	region_addr_t	start;
 	region_addr_t	end;
-	struct region_el *next;
 };
 
 struct region_struct {
 	region_addr_t	min;
 	region_addr_t	max;
 	struct region_el *allocated;
+	unsigned int	num, size;
 };
 
 region_t region_create(region_addr_t min, region_addr_t max)
@@ -46,20 +51,16 @@ region_t region_create(region_addr_t min, region_addr_t max)
 
 void region_free(region_t region)
 {
-	struct region_el	*r, *next;
-
-	for (r = region->allocated; r; r = next) {
-		next = r->next;
-		free(r);
-	}
+	free(region->allocated);
 	memset(region, 0, sizeof(struct region_struct));
 	free(region);
 }
 
 int region_allocate(region_t region, region_addr_t start, int n)
 {
-	struct region_el	*r, *new_region, *prev, *next;
-	region_addr_t end;
+	struct region_el	*r, *new_list;
+	region_addr_t		end;
+	unsigned int		lo, hi, mid, new_size;
 
 	end = start+n;
 	if ((start < region->min) || (end > region->max))
@@ -68,56 +69,61 @@ int region_allocate(region_t region, region_addr_t start, int n)
 		return 1;
 
 	/*
-	 * Search through the linked list.  If we find that it
-	 * conflicts witih something that's already allocated, return
-	 * 1; if we can find an existing region which we can grow, do
-	 * so.  Otherwise, stop when we find the appropriate place
-	 * insert a new region element into the linked list.
+	 * Find the first region which ends after the new one starts.
+	 * If it also starts before the new one ends, they overlap;
+	 * otherwise the new region goes just before it, and is merged
+	 * with its neighbours if it touches them.
 	 */
-	for (r = region->allocated, prev=NULL; r; prev = r, r = r->next) {
-		if (((start >= r->start) && (start < r->end)) ||
-		    ((end > r->start) && (end <= r->end)) ||
-		    ((start <= r->start) && (end >= r->end)))
-			return 1;
-		if (end == r->start) {
-			r->start = start;
-			return 0;
-		}
-		if (start == r->end) {
-			if ((next = r->next)) {
-				if (end > next->start)
-					return 1;
-				if (end == next->start) {
-					r->end = next->end;
-					r->next = next->next;
-					free(next);
-					return 0;
-				}
-			}
-			r->end = end;
-			return 0;
-		}
-		if (start < r->start)
-			break;
+	lo = 0;
+	hi = region->num;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (region->allocated[mid].end <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	r = region->allocated + lo;
+	if (lo < region->num && r->start < end)
+		return 1;
+
+	if (lo > 0 && r[-1].end == start) {
+		if (lo < region->num && r->start == end) {
+			r[-1].end = r->end;
+			memmove(r, r + 1, (region->num - lo - 1) * sizeof(*r));
+			region->num--;
+		} else
+			r[-1].end = end;
+		return 0;
+	}
+	if (lo < region->num && r->start == end) {
+		r->start = start;
+		return 0;
+	}
+
 	/*
-	 * Insert a new region element structure into the linked list
+	 * Insert a new region element into the array
 	 */
-	new_region = malloc(sizeof(struct region_el));
-	if (!new_region)
-		return -1;
-	new_region->start = start;
-	new_region->end = start + n;
-	new_region->next = r;
-	if (prev)
-		prev->next = new_region;
-	else
-		region->allocated = new_region;
+	if (region->num == region->size) {
+		new_size = region->size ? region->size * 2 : 8;
+		new_list = realloc(region->allocated,
+				   new_size * sizeof(struct region_el));
+		if (!new_list)
+			return -1;
+		region->allocated = new_list;
+		region->size = new_size;
+		r = region->allocated + lo;
+	}
+	memmove(r + 1, r, (region->num - lo) * sizeof(*r));
+	r->start = start;
+	r->end = end;
+	region->num++;
 	return 0;
 }
 
 #ifdef TEST_PROGRAM
 #include <stdio.h>
+#include <time.h>
 
 #define BCODE_END	0
 #define BCODE_CREATE	1
@@ -155,25 +161,77 @@ int bcode_program[] = {
 
 void region_print(region_t region, FILE *f)
 {
-	struct region_el	*r;
+	unsigned int	n;
 	int	i = 0;
 
 	fprintf(f, "Printing region (min=%d. max=%d)\n\t", region->min,
 		region->max);
-	for (r = region->allocated; r; r = r->next) {
-		fprintf(f, "(%d, %d)  ", r->start, r->end);
+	for (n = 0; n < region->num; n++) {
+		fprintf(f, "(%d, %d)  ", region->allocated[n].start,
+			region->allocated[n].end);
 		if (++i >= 8)
 			fprintf(f, "\n\t");
 	}
 	fprintf(f, "\n");
 }
 
+/*
+ * "tst_region N" times N allocations of single units in a scattered
+ * order, every other unit of the region, and then fills the holes so
+ * that the regions are merged again.
+ */
+static int region_benchmark(int count)
+{
+	region_t	r;
+	clock_t		t;
+	unsigned int	i, step = 7919;
+	region_addr_t	pos;
+
+	while (count % step == 0)
+		step++;
+	r = region_create(0, 2 * count);
+	if (!r) {
+		fprintf(stderr, "Couldn't create region.\n");
+		return 1;
+	}
+	t = clock();
+	for (i = 0; i < (unsigned int) count; i++) {
+		pos = 2 * ((i * (unsigned long long) step) % count);
+		if (region_allocate(r, pos, 1)) {
+			fprintf(stderr, "region_allocate(%u, 1) failed\n", pos);
+			return 1;
+		}
+	}
+	for (i = 0; i < (unsigned int) count; i++) {
+		pos = 2 * ((i * (unsigned long long) step) % count);
+		if (region_allocate(r, pos, 2) != 1) {
+			fprintf(stderr, "Overlap at %u not found\n", pos);
+			return 1;
+		}
+		if (region_allocate(r, pos + 1, 1)) {
+			fprintf(stderr, "region_allocate(%u, 1) failed\n",
+				pos + 1);
+			return 1;
+		}
+	}
+	if (r->num != 1) {
+		fprintf(stderr, "%u regions left, expected 1\n", r->num);
+		return 1;
+	}
+	printf("%d allocations: %.3f seconds\n", 3 * count,
+	       (double) (clock() - t) / CLOCKS_PER_SEC);
+	region_free(r);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	region_t	r = NULL;
 	int		pc = 0, ret;
 	region_addr_t	start, end;
 
+	if (argc > 1)
+		exit(region_benchmark(atoi(argv[1])));
 
 	while (1) {
 		switch (bcode_program[pc++]) {
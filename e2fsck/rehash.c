@@ -77,6 +77,56 @@ struct out_dir {
 	ext2_dirhash_t	*hashes;
 };
 
+/*
+ * Hash the entries gathered from one directory block.  TEA names are
+ * handed to ext2fs_dirhash_many() a batch at a time; for the other
+ * hashes that is no faster than hashing them one by one.
+ */
+#define HASH_BATCH	64
+
+static errcode_t hash_dir_entries(ext2_filsys fs, int hash_alg,
+				  struct hash_entry *ent, int num)
+{
+	const char	*names[HASH_BATCH];
+	int		lens[HASH_BATCH];
+	ext2_dirhash_t	hash[HASH_BATCH], minor_hash[HASH_BATCH];
+	errcode_t	retval;
+	int		i, n;
+
+	if (hash_alg != EXT2_HASH_TEA && hash_alg != EXT2_HASH_TEA_UNSIGNED) {
+		for (i = 0; i < num; i++) {
+			retval = ext2fs_dirhash(hash_alg, ent[i].dir->name,
+						ent[i].dir->name_len & 0xFF,
+						fs->super->s_hash_seed,
+						&ent[i].hash,
+						&ent[i].minor_hash);
+			if (retval)
+				return retval;
+		}
+		return 0;
+	}
+
+	while (num > 0) {
+		n = num > HASH_BATCH ? HASH_BATCH : num;
+		for (i = 0; i < n; i++) {
+			names[i] = ent[i].dir->name;
+			lens[i] = ent[i].dir->name_len & 0xFF;
+		}
+		retval = ext2fs_dirhash_many(hash_alg, n, names, lens,
+					     fs->super->s_hash_seed,
+					     hash, minor_hash);
+		if (retval)
+			return retval;
+		for (i = 0; i < n; i++) {
+			ent[i].hash = hash[i];
+			ent[i].minor_hash = minor_hash[i];
+		}
+		ent += n;
+		num -= n;
+	}
+	return 0;
+}
+
 static int fill_dir_block(ext2_filsys fs,
 			  blk64_t *block_nr,
 			  e2_blkcnt_t blockcnt,
@@ -89,7 +139,7 @@ static int fill_dir_block(ext2_filsys fs,
 	struct ext2_dir_entry 	*dirent;
 	char			*dir;
 	unsigned int		offset, dir_offset, rec_len;
-	int			hash_alg;
+	int			hash_alg, new_max, first_ent;
 
 	if (blockcnt < 0)
 		return 0;
@@ -114,6 +164,7 @@ static int fill_dir_block(ext2_filsys fs,
 	    (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
 		hash_alg += 3;
 	/* While the directory block is "hot", index it. */
+	first_ent = fd->num_array;
 	dir_offset = 0;
 	while (dir_offset < fs->blocksize) {
 		dirent = (struct ext2_dir_entry *) (dir + dir_offset);
@@ -137,31 +188,31 @@ static int fill_dir_block(ext2_filsys fs,
 			continue;
 		}
 		if (fd->num_array >= fd->max_array) {
+			/* Grow geometrically, to keep the copying linear */
+			new_max = fd->max_array + fd->max_array / 2 + 500;
 			new_array = realloc(fd->harray,
-			    sizeof(struct hash_entry) * (fd->max_array+500));
+			    sizeof(struct hash_entry) * new_max);
 			if (!new_array) {
 				fd->err = ENOMEM;
 				return BLOCK_ABORT;
 			}
 			fd->harray = new_array;
-			fd->max_array += 500;
+			fd->max_array = new_max;
 		}
 		ent = fd->harray + fd->num_array++;
 		ent->dir = dirent;
 		fd->dir_size += EXT2_DIR_REC_LEN(dirent->name_len & 0xFF);
 		ent->ino = dirent->inode;
-		if (fd->compress)
-			ent->hash = ent->minor_hash = 0;
-		else {
-			fd->err = ext2fs_dirhash(hash_alg, dirent->name,
-						 dirent->name_len & 0xFF,
-						 fs->super->s_hash_seed,
-						 &ent->hash, &ent->minor_hash);
-			if (fd->err)
-				return BLOCK_ABORT;
-		}
+		ent->hash = ent->minor_hash = 0;
 	}
 
+	if (!fd->compress) {
+		fd->err = hash_dir_entries(fs, hash_alg,
+					   fd->harray + first_ent,
+					   fd->num_array - first_ent);
+		if (fd->err)
+			return BLOCK_ABORT;
+	}
 	return 0;
 }
 
@@ -220,6 +271,63 @@ static EXT2_QSORT_TYPE hash_cmp(const void *a, const void *b)
 	return ret;
 }
 
+/*
+ * Sort the hash entries the way qsort() with hash_cmp would.  Large
+ * directories are sorted by (hash, minor_hash) with a least
+ * significant digit first radix sort, a byte at a time; the (rare)
+ * runs of entries whose hashes are both equal are then put in order
+ * with hash_cmp.
+ */
+#define RADIX_SORT_MIN	256
+
+static __u64 hash_key(const struct hash_entry *ent)
+{
+	return ((__u64) ent->hash << 32) | ent->minor_hash;
+}
+
+static void sort_hash_entries(struct hash_entry *harray, int num)
+{
+	struct hash_entry	*tmp, *src, *dst, *swap;
+	unsigned int		count[256], pos, c;
+	int			i, j, shift;
+
+	if (num < RADIX_SORT_MIN ||
+	    (tmp = malloc(num * sizeof(struct hash_entry))) == NULL) {
+		qsort(harray, num, sizeof(struct hash_entry), hash_cmp);
+		return;
+	}
+
+	src = harray;
+	dst = tmp;
+	for (shift = 0; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < num; i++)
+			count[(hash_key(src + i) >> shift) & 0xFF]++;
+		for (pos = 0, i = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = pos;
+			pos += c;
+		}
+		for (i = 0; i < num; i++)
+			dst[count[(hash_key(src + i) >> shift) & 0xFF]++] =
+				src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	/* An even number of passes leaves the result back in harray */
+	free(tmp);
+
+	for (i = 0; i < num; i = j) {
+		for (j = i + 1; j < num; j++)
+			if (hash_key(harray + j) != hash_key(harray + i))
+				break;
+		if (j - i > 1)
+			qsort(harray + i, j - i, sizeof(struct hash_entry),
+			      hash_cmp);
+	}
+}
+
 static errcode_t alloc_size_dir(ext2_filsys fs, struct out_dir *outdir,
 				int blocks)
 {
@@ -671,6 +779,230 @@ static int write_dir_block(ext2_filsys fs,
 	return 0;
 }
 
+/*
+ * With -E relocate_dirs, a rebuilt directory whose blocks aren't
+ * already in one piece is written to a new contiguous run of blocks,
+ * looked for from the start of its inode's block group onwards, and
+ * its old blocks are released a range at a time.  If no run is free
+ * the directory is rewritten in place as usual.
+ */
+struct relocate_dir_struct {
+	blk64_t		*blocks;	/* old blocks, to be freed */
+	blk64_t		num, max;
+	blk64_t		new_blk;	/* first block of the new run */
+	e2_blkcnt_t	dir_blocks;	/* blocks in the new directory */
+	blk64_t		first;
+	int		contiguous;
+	errcode_t	err;
+};
+
+static int relocate_add_block(struct relocate_dir_struct *rd, blk64_t blk)
+{
+	errcode_t	retval;
+
+	if (rd->num == rd->max) {
+		retval = ext2fs_resize_mem(rd->max * sizeof(blk64_t),
+					   (rd->max + 256) * sizeof(blk64_t),
+					   &rd->blocks);
+		if (retval) {
+			rd->err = retval;
+			return BLOCK_ABORT;
+		}
+		rd->max += 256;
+	}
+	rd->blocks[rd->num++] = blk;
+	return 0;
+}
+
+/*
+ * Note every block of the directory, and whether the blocks it will
+ * keep already follow one another.
+ */
+static int relocate_scan_block(ext2_filsys fs EXT2FS_ATTR((unused)),
+			       blk64_t *block_nr, e2_blkcnt_t blockcnt,
+			       blk64_t ref_block EXT2FS_ATTR((unused)),
+			       int ref_offset EXT2FS_ATTR((unused)),
+			       void *priv_data)
+{
+	struct relocate_dir_struct *rd = priv_data;
+
+	if (blockcnt == 0)
+		rd->first = *block_nr;
+	if (blockcnt >= rd->dir_blocks ||
+	    (blockcnt >= 0 && *block_nr != rd->first + blockcnt))
+		rd->contiguous = 0;
+	return relocate_add_block(rd, *block_nr);
+}
+
+/*
+ * For a block-mapped directory: point each block at the new run and
+ * drop the ones past its end.  The indirect blocks are kept.
+ */
+static int relocate_map_block(ext2_filsys fs EXT2FS_ATTR((unused)),
+			      blk64_t *block_nr, e2_blkcnt_t blockcnt,
+			      blk64_t ref_block EXT2FS_ATTR((unused)),
+			      int ref_offset EXT2FS_ATTR((unused)),
+			      void *priv_data)
+{
+	struct relocate_dir_struct *rd = priv_data;
+
+	if (blockcnt < 0 || *block_nr == 0)
+		return 0;
+	if (relocate_add_block(rd, *block_nr))
+		return BLOCK_ABORT;
+	if (blockcnt < rd->dir_blocks)
+		*block_nr = rd->new_blk + blockcnt;
+	else
+		*block_nr = 0;
+	return BLOCK_CHANGED;
+}
+
+static EXT2_QSORT_TYPE blk64_cmp(const void *a, const void *b)
+{
+	blk64_t	ba = *(const blk64_t *) a, bb = *(const blk64_t *) b;
+
+	return (ba < bb) ? -1 : (ba > bb);
+}
+
+static void relocate_free_old(e2fsck_t ctx, struct relocate_dir_struct *rd)
+{
+	ext2_filsys	fs = ctx->fs;
+	blk64_t		i, j;
+
+	qsort(rd->blocks, rd->num, sizeof(blk64_t), blk64_cmp);
+	for (i = 0; i < rd->num; i = j) {
+		for (j = i + 1; j < rd->num &&
+			     rd->blocks[j] == rd->blocks[j - 1] + 1; j++)
+			;
+		ext2fs_unmark_block_bitmap_range2(ctx->block_found_map,
+						  rd->blocks[i], j - i);
+		ext2fs_block_alloc_stats_range(fs, rd->blocks[i], j - i, -1);
+	}
+}
+
+static void set_dir_inode(ext2_filsys fs, struct ext2_inode *inode,
+			  struct out_dir *outdir, int compress)
+{
+	if (compress)
+		inode->i_flags &= ~EXT2_INDEX_FL;
+	else
+		inode->i_flags |= EXT2_INDEX_FL;
+	inode->i_size = outdir->num * fs->blocksize;
+}
+
+static errcode_t relocate_directory(e2fsck_t ctx, ext2_filsys fs,
+				    struct out_dir *outdir, ext2_ino_t ino,
+				    int compress, int *done)
+{
+	struct relocate_dir_struct rd;
+	struct ext2fs_extent	*list = 0;
+	struct ext2_inode	inode;
+	blk64_t			goal, left;
+	unsigned int		i, count, unit;
+	errcode_t		retval;
+
+	*done = 0;
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_BIGALLOC))
+		return 0;
+
+	memset(&rd, 0, sizeof(rd));
+	rd.dir_blocks = outdir->num;
+	rd.contiguous = 1;
+	retval = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY, 0,
+				       relocate_scan_block, &rd);
+	if (!retval)
+		retval = rd.err;
+	if (retval || rd.contiguous)
+		goto errout;
+
+	e2fsck_read_bitmaps(ctx);
+	goal = ext2fs_group_first_block2(fs, ext2fs_group_of_ino(fs, ino));
+	if (ext2fs_get_free_blocks2(fs, goal, 0, outdir->num,
+				    ctx->block_found_map, &rd.new_blk))
+		goto errout;
+	ext2fs_mark_block_bitmap_range2(ctx->block_found_map, rd.new_blk,
+					outdir->num);
+	ext2fs_block_alloc_stats_range(fs, rd.new_blk, outdir->num, +1);
+
+	for (i = 0; i < (unsigned int) outdir->num; i++) {
+		retval = ext2fs_write_dir_block3(fs, rd.new_blk + i,
+				outdir->buf + (size_t) i * fs->blocksize, 0);
+		if (retval)
+			goto errout_free;
+	}
+
+	e2fsck_read_inode(ctx, ino, &inode, "rehash_dir");
+	if (inode.i_flags & EXT4_EXTENTS_FL) {
+		/* The whole tree is replaced, so all of it goes */
+		count = (outdir->num + EXT_INIT_MAX_LEN - 1) /
+			EXT_INIT_MAX_LEN;
+		retval = ext2fs_get_array(count, sizeof(*list), &list);
+		if (retval)
+			goto errout_free;
+		for (i = 0, left = outdir->num; i < count; i++) {
+			list[i].e_lblk = (blk64_t) i * EXT_INIT_MAX_LEN;
+			list[i].e_pblk = rd.new_blk + list[i].e_lblk;
+			list[i].e_len = left < EXT_INIT_MAX_LEN ? left :
+				EXT_INIT_MAX_LEN;
+			list[i].e_flags = 0;
+			left -= list[i].e_len;
+		}
+		set_dir_inode(fs, &inode, outdir, compress);
+		ext2fs_iblk_set(fs, &inode, 0);
+		ext2fs_iblk_add_blocks(fs, &inode, outdir->num);
+		retval = ext2fs_extent_build_from_list(fs, ino, &inode,
+						       list, count);
+		if (retval)
+			goto errout_free;
+		/* i_blocks counts file system blocks for huge files */
+		unit = (inode.i_flags & EXT4_HUGE_FILE_FL) ?
+			fs->blocksize : 512;
+		quota_data_sub(ctx->qctx, &inode, ino,
+			       (qsize_t) rd.num * fs->blocksize);
+		quota_data_add(ctx->qctx, &inode, ino,
+			       (qsize_t) ext2fs_inode_i_blocks(fs, &inode) *
+			       unit);
+	} else {
+		/*
+		 * Only the data blocks are remapped; the walk notes
+		 * them again, together with any past the new end.
+		 */
+		rd.num = 0;
+		retval = e2fsck_expand_directory(ctx, ino, -1, outdir->num);
+		if (retval)
+			goto errout_free;
+		retval = ext2fs_block_iterate3(fs, ino, 0, 0,
+					       relocate_map_block, &rd);
+		if (!retval)
+			retval = rd.err;
+		if (retval)
+			goto errout;
+		e2fsck_read_inode(ctx, ino, &inode, "rehash_dir");
+		set_dir_inode(fs, &inode, outdir, compress);
+		ext2fs_iblk_sub_blocks(fs, &inode, rd.num - outdir->num);
+		e2fsck_write_inode(ctx, ino, &inode, "rehash_dir");
+		quota_data_sub(ctx->qctx, &inode, ino,
+			       (qsize_t) (rd.num - outdir->num) *
+			       fs->blocksize);
+	}
+
+	relocate_free_old(ctx, &rd);
+	*done = 1;
+	goto errout;
+
+errout_free:
+	ext2fs_unmark_block_bitmap_range2(ctx->block_found_map, rd.new_blk,
+					  outdir->num);
+	ext2fs_block_alloc_stats_range(fs, rd.new_blk, outdir->num, -1);
+errout:
+	if (list)
+		ext2fs_free_mem(&list);
+	if (rd.blocks)
+		ext2fs_free_mem(&rd.blocks);
+	return retval;
+}
+
 static errcode_t write_directory(e2fsck_t ctx, ext2_filsys fs,
 				 struct out_dir *outdir,
 				 ext2_ino_t ino, int compress)
@@ -678,6 +1010,14 @@ static errcode_t write_directory(e2fsck_t ctx, ext2_filsys fs,
 	struct write_dir_struct wd;
 	errcode_t	retval;
 	struct ext2_inode 	inode;
+	int		done;
+
+	if (ctx->options & E2F_OPT_RELOCATE_DIRS) {
+		retval = relocate_directory(ctx, fs, outdir, ino, compress,
+					    &done);
+		if (retval || done)
+			return retval;
+	}
 
 	retval = e2fsck_expand_directory(ctx, ino, -1, outdir->num);
 	if (retval)
@@ -696,11 +1036,7 @@ static errcode_t write_directory(e2fsck_t ctx, ext2_filsys fs,
 		return wd.err;
 
 	e2fsck_read_inode(ctx, ino, &inode, "rehash_dir");
-	if (compress)
-		inode.i_flags &= ~EXT2_INDEX_FL;
-	else
-		inode.i_flags |= EXT2_INDEX_FL;
-	inode.i_size = outdir->num * fs->blocksize;
+	set_dir_inode(fs, &inode, outdir, compress);
 	ext2fs_iblk_sub_blocks(fs, &inode, wd.cleared);
 	e2fsck_write_inode(ctx, ino, &inode, "rehash_dir");
 
@@ -775,8 +1111,7 @@ resort:
 		qsort(fd.harray+2, fd.num_array-2, sizeof(struct hash_entry),
 		      hash_cmp);
 	else
-		qsort(fd.harray, fd.num_array, sizeof(struct hash_entry),
-		      hash_cmp);
+		sort_hash_entries(fd.harray, fd.num_array);
 
 	/*
 	 * Look for duplicates
@@ -823,20 +1158,185 @@ errout:
 	return retval;
 }
 
+/*
+ * Walks the directories which are to be rebuilt
+ */
+struct rehash_iter {
+	int			all_dirs;
+	struct dir_info_iter	*dirinfo_iter;
+	ext2_u32_iterate	iter;
+};
+
+static errcode_t rehash_iter_begin(e2fsck_t ctx, struct rehash_iter *ri)
+{
+	ri->all_dirs = ctx->options & E2F_OPT_COMPRESS_DIRS;
+	ri->dirinfo_iter = 0;
+	ri->iter = 0;
+	if (ri->all_dirs) {
+		ri->dirinfo_iter = e2fsck_dir_info_iter_begin(ctx);
+		return 0;
+	}
+	return ext2fs_u32_list_iterate_begin(ctx->dirs_to_hash, &ri->iter);
+}
+
+static int rehash_iter_next(e2fsck_t ctx, struct rehash_iter *ri,
+			    ext2_ino_t *ino)
+{
+	struct dir_info		*dir;
+
+	if (ri->all_dirs) {
+		if ((dir = e2fsck_dir_info_iter(ctx, ri->dirinfo_iter)) == 0)
+			return 0;
+		*ino = dir->ino;
+		return 1;
+	}
+	return ext2fs_u32_list_iterate(ri->iter, ino);
+}
+
+static void rehash_iter_end(e2fsck_t ctx, struct rehash_iter *ri)
+{
+	if (ri->all_dirs)
+		e2fsck_dir_info_iter_end(ctx, ri->dirinfo_iter);
+	else
+		ext2fs_u32_list_iterate_end(ri->iter);
+}
+
+/*
+ * While one directory is being rebuilt, the I/O channel is asked to
+ * start reading the blocks of the directories after it, up to
+ * readahead_kb worth of them, so that e2fsck_rehash_dir() does not
+ * have to wait for each one in turn.  The blocks are found from the
+ * inode alone: the data blocks of directories whose extents or block
+ * pointers fit in the inode, and the first level of the tree or of
+ * indirect blocks otherwise.
+ */
+#define REHASH_RA_DIRS		64
+
+struct rehash_readahead {
+	struct rehash_iter	iter;
+	int			done;
+	blk64_t			window;		/* in blocks */
+	blk64_t			queued;		/* blocks in the ring */
+	blk64_t			count[REHASH_RA_DIRS];
+	int			head, len;
+};
+
+static blk64_t readahead_range(ext2_filsys fs, blk64_t start, blk64_t count,
+			       blk64_t max)
+{
+	if (start < fs->super->s_first_data_block ||
+	    start >= ext2fs_blocks_count(fs->super))
+		return 0;
+	if (count > ext2fs_blocks_count(fs->super) - start)
+		count = ext2fs_blocks_count(fs->super) - start;
+	if (count > max)
+		count = max;
+	if (!count)
+		return 0;
+	(void) io_channel_cache_readahead(fs->io, start, count);
+	return count;
+}
+
+static blk64_t readahead_dir(ext2_filsys fs, ext2_ino_t ino, blk64_t max)
+{
+	struct ext2_inode		inode;
+	struct ext3_extent_header	*eh;
+	struct ext3_extent		*ex;
+	struct ext3_extent_idx		*ix;
+	blk64_t		start, count, total = 0;
+	int		i, n;
+
+	if (ext2fs_read_inode(fs, ino, &inode) ||
+	    !LINUX_S_ISDIR(inode.i_mode))
+		return 0;
+
+	if (!(inode.i_flags & EXT4_EXTENTS_FL)) {
+		start = count = 0;
+		for (i = 0; i <= EXT2_NDIR_BLOCKS; i++) {
+			if (i < EXT2_NDIR_BLOCKS && inode.i_block[i] &&
+			    inode.i_block[i] == start + count) {
+				count++;
+				continue;
+			}
+			if (count)
+				total += readahead_range(fs, start, count,
+							 max - total);
+			start = i < EXT2_NDIR_BLOCKS ? inode.i_block[i] :
+				inode.i_block[EXT2_IND_BLOCK];
+			count = start ? 1 : 0;
+		}
+		if (count)
+			total += readahead_range(fs, start, count, max - total);
+		return total;
+	}
+
+	eh = (struct ext3_extent_header *) inode.i_block;
+	if (ext2fs_le16_to_cpu(eh->eh_magic) != EXT3_EXT_MAGIC)
+		return 0;
+	n = ext2fs_le16_to_cpu(eh->eh_entries);
+	if (n > 4)
+		n = 4;
+	ex = EXT_FIRST_EXTENT(eh);
+	ix = EXT_FIRST_INDEX(eh);
+	for (i = 0; i < n && total < max; i++) {
+		if (eh->eh_depth) {
+			start = ext2fs_le32_to_cpu(ix[i].ei_leaf) +
+				((blk64_t) ext2fs_le16_to_cpu(ix[i].ei_leaf_hi)
+				 << 32);
+			count = 1;
+		} else {
+			start = ext2fs_le32_to_cpu(ex[i].ee_start) +
+				((blk64_t) ext2fs_le16_to_cpu(ex[i].ee_start_hi)
+				 << 32);
+			count = ext2fs_le16_to_cpu(ex[i].ee_len);
+			if (count > EXT_INIT_MAX_LEN)
+				count -= EXT_INIT_MAX_LEN;
+		}
+		total += readahead_range(fs, start, count, max - total);
+	}
+	return total;
+}
+
+/*
+ * Called as each directory is reached: forget about the one before
+ * it, and top up the readahead window.
+ */
+static void rehash_readahead(e2fsck_t ctx, struct rehash_readahead *ra)
+{
+	ext2_ino_t	ino;
+	int		i;
+
+	if (ra->len) {
+		ra->queued -= ra->count[ra->head];
+		ra->head = (ra->head + 1) % REHASH_RA_DIRS;
+		ra->len--;
+	}
+	while (!ra->done && ra->len < REHASH_RA_DIRS &&
+	       ra->queued < ra->window) {
+		if (!rehash_iter_next(ctx, &ra->iter, &ino)) {
+			ra->done = 1;
+			break;
+		}
+		i = (ra->head + ra->len++) % REHASH_RA_DIRS;
+		ra->count[i] = readahead_dir(ctx->fs, ino,
+					     ra->window - ra->queued);
+		ra->queued += ra->count[i];
+	}
+}
+
 void e2fsck_rehash_directories(e2fsck_t ctx)
 {
 	struct problem_context	pctx;
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
 #endif
-	struct dir_info		*dir;
-	ext2_u32_iterate 	iter;
-	struct dir_info_iter *	dirinfo_iter = 0;
+	struct rehash_iter	ri;
+	struct rehash_readahead	*ra = 0;
 	ext2_ino_t		ino;
 	errcode_t		retval;
 	int			cur, max, all_dirs, first = 1;
 
-	init_resource_track(&rtrack, ctx->fs->io);
+	init_resource_track(ctx, &rtrack, ctx->fs->io);
 	all_dirs = ctx->options & E2F_OPT_COMPRESS_DIRS;
 
 	if (!ctx->dirs_to_hash && !all_dirs)
@@ -847,29 +1347,33 @@ void e2fsck_rehash_directories(e2fsck_t ctx)
 	clear_problem_context(&pctx);
 
 	cur = 0;
-	if (all_dirs) {
-		dirinfo_iter = e2fsck_dir_info_iter_begin(ctx);
+	retval = rehash_iter_begin(ctx, &ri);
+	if (retval) {
+		pctx.errcode = retval;
+		fix_problem(ctx, PR_3A_OPTIMIZE_ITER, &pctx);
+		return;
+	}
+	if (all_dirs)
 		max = e2fsck_get_num_dirinfo(ctx);
-	} else {
-		retval = ext2fs_u32_list_iterate_begin(ctx->dirs_to_hash,
-						       &iter);
-		if (retval) {
-			pctx.errcode = retval;
-			fix_problem(ctx, PR_3A_OPTIMIZE_ITER, &pctx);
-			return;
-		}
+	else
 		max = ext2fs_u32_list_count(ctx->dirs_to_hash);
+
+	if (ctx->readahead_kb) {
+		ra = e2fsck_allocate_memory(ctx, sizeof(struct rehash_readahead),
+					    "rehash readahead");
+		ra->window = ((blk64_t) ctx->readahead_kb * 1024) /
+			ctx->fs->blocksize;
+		if (rehash_iter_begin(ctx, &ra->iter)) {
+			ext2fs_free_mem(&ra);
+			ra = 0;
+		}
 	}
+
 	while (1) {
-		if (all_dirs) {
-			if ((dir = e2fsck_dir_info_iter(ctx,
-							dirinfo_iter)) == 0)
-				break;
-			ino = dir->ino;
-		} else {
-			if (!ext2fs_u32_list_iterate(iter, &ino))
-				break;
-		}
+		if (!rehash_iter_next(ctx, &ri, &ino))
+			break;
+		if (ra)
+			rehash_readahead(ctx, ra);
 		if (ino == ctx->lost_and_found)
 			continue;
 		pctx.dir = ino;
@@ -890,10 +1394,11 @@ void e2fsck_rehash_directories(e2fsck_t ctx)
 			       100.0 * (float) (++cur) / (float) max, ino);
 	}
 	end_problem_latch(ctx, PR_LATCH_OPTIMIZE_DIR);
-	if (all_dirs)
-		e2fsck_dir_info_iter_end(ctx, dirinfo_iter);
-	else
-		ext2fs_u32_list_iterate_end(iter);
+	rehash_iter_end(ctx, &ri);
+	if (ra) {
+		rehash_iter_end(ctx, &ra->iter);
+		ext2fs_free_mem(&ra);
+	}
 
 	if (ctx->dirs_to_hash)
 		ext2fs_u32_list_free(ctx->dirs_to_hash);
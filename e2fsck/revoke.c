@@ -78,6 +78,31 @@ static lkmem_cache_t *revoke_table_cache;
    journal replay, this involves recording the transaction ID of the
    last transaction to revoke this block. */
 
+#ifndef __KERNEL__
+/*
+ * e2fsck only uses the revoke table for recovery, where a journal may
+ * revoke hundreds of thousands of blocks.  Rather than chaining
+ * individually allocated records, the records live in the hash table
+ * itself, which is searched with linear probing and is sized from the
+ * number of revoke records which the scan pass found.
+ */
+struct jbd_revoke_record_s
+{
+	unsigned long	  blocknr;
+	tid_t		  sequence;
+	int		  in_use;
+};
+
+struct jbd_revoke_table_s
+{
+	/* Must be a power of two, and is kept at least twice as
+	 * large as the number of records */
+	int		  hash_size;
+	int		  hash_shift;
+	int		  nr_records;
+	struct jbd_revoke_record_s *hash_table;
+};
+#else
 struct jbd_revoke_record_s
 {
 	struct list_head  hash;
@@ -95,6 +120,7 @@ struct jbd_revoke_table_s
 	int		  hash_shift;
 	struct list_head *hash_table;
 };
+#endif
 
 
 #ifdef __KERNEL__
@@ -106,6 +132,107 @@ static void flush_descriptor(journal_t *, struct journal_head *, int);
 
 /* Utility functions to maintain the revoke table */
 
+#ifndef __KERNEL__
+static inline int hash(journal_t *journal, unsigned long block)
+{
+	struct jbd_revoke_table_s *table = journal->j_revoke;
+
+	if (!table->hash_shift)
+		return 0;
+	return ((__u64) block * 0x9E3779B97F4A7C15ULL) >>
+		(64 - table->hash_shift);
+}
+
+static struct jbd_revoke_record_s *probe_revoke_table(journal_t *journal,
+						      unsigned long blocknr)
+{
+	struct jbd_revoke_table_s *table = journal->j_revoke;
+	struct jbd_revoke_record_s *record;
+	int i = hash(journal, blocknr);
+
+	while (1) {
+		record = &table->hash_table[i];
+		if (!record->in_use || record->blocknr == blocknr)
+			return record;
+		i = (i + 1) & (table->hash_size - 1);
+	}
+}
+
+/* Move the records to a new table of hash_size slots */
+static int resize_revoke_table(journal_t *journal, int hash_size)
+{
+	struct jbd_revoke_table_s *table = journal->j_revoke;
+	struct jbd_revoke_record_s *old_table = table->hash_table;
+	struct jbd_revoke_record_s *record;
+	int i, old_size = table->hash_size, shift = 0;
+
+	while ((1 << shift) < hash_size)
+		shift++;
+	table->hash_table = calloc(hash_size, sizeof(*record));
+	if (!table->hash_table) {
+		table->hash_table = old_table;
+		return -ENOMEM;
+	}
+	table->hash_size = hash_size;
+	table->hash_shift = shift;
+
+	for (i = 0; i < old_size; i++) {
+		if (!old_table[i].in_use)
+			continue;
+		record = probe_revoke_table(journal, old_table[i].blocknr);
+		*record = old_table[i];
+	}
+	free(old_table);
+	return 0;
+}
+
+/*
+ * Make room for nr_records revoke records, so that the table does not
+ * have to grow while they are added.
+ */
+int journal_size_revoke(journal_t *journal, int nr_records)
+{
+	struct jbd_revoke_table_s *table = journal->j_revoke;
+	int hash_size = table->hash_size;
+
+	while (hash_size < INT_MAX / 4 && hash_size / 2 < nr_records)
+		hash_size <<= 1;
+	if (hash_size == table->hash_size)
+		return 0;
+	return resize_revoke_table(journal, hash_size);
+}
+
+static int insert_revoke_hash(journal_t *journal, unsigned long blocknr,
+			      tid_t seq)
+{
+	struct jbd_revoke_table_s *table = journal->j_revoke;
+	struct jbd_revoke_record_s *record;
+	int err;
+
+	if ((table->nr_records + 1) * 2 > table->hash_size) {
+		err = resize_revoke_table(journal, table->hash_size * 2);
+		if (err)
+			return err;
+	}
+	record = probe_revoke_table(journal, blocknr);
+	record->blocknr = blocknr;
+	record->sequence = seq;
+	record->in_use = 1;
+	table->nr_records++;
+	return 0;
+}
+
+/* Find a revoke record in the journal's hash table. */
+
+static struct jbd_revoke_record_s *find_revoke_record(journal_t *journal,
+						      unsigned long blocknr)
+{
+	struct jbd_revoke_record_s *record;
+
+	record = probe_revoke_table(journal, blocknr);
+	return record->in_use ? record : NULL;
+}
+#else
 /* Borrowed from buffer.c: this is a tried and tested block hash function */
 static inline int hash(journal_t *journal, unsigned long block)
 {
@@ -167,6 +294,7 @@ static struct jbd_revoke_record_s *find_revoke_record(journal_t *journal,
 	}
 	return NULL;
 }
+#endif /* __KERNEL__ */
 
 int __init journal_init_revoke_caches(void)
 {
@@ -218,16 +346,24 @@ int journal_init_revoke(journal_t *journal, int hash_size)
 		shift++;
 	journal->j_revoke->hash_shift = shift;
 
+#ifndef __KERNEL__
+	journal->j_revoke->nr_records = 0;
+	journal->j_revoke->hash_table =
+		calloc(hash_size, sizeof(struct jbd_revoke_record_s));
+#else
 	journal->j_revoke->hash_table =
 		kmalloc(hash_size * sizeof(struct list_head), GFP_KERNEL);
+#endif
 	if (!journal->j_revoke->hash_table) {
 		kmem_cache_free(revoke_table_cache, journal->j_revoke);
 		journal->j_revoke = NULL;
 		return -ENOMEM;
 	}
 
+#ifdef __KERNEL__
 	for (tmp = 0; tmp < hash_size; tmp++)
 		INIT_LIST_HEAD(&journal->j_revoke->hash_table[tmp]);
+#endif
 
 	return 0;
 }
@@ -237,17 +373,23 @@ int journal_init_revoke(journal_t *journal, int hash_size)
 void journal_destroy_revoke(journal_t *journal)
 {
 	struct jbd_revoke_table_s *table;
+#ifdef __KERNEL__
 	struct list_head *hash_list;
 	int i;
+#endif
 
 	table = journal->j_revoke;
 	if (!table)
 		return;
 
+#ifndef __KERNEL__
+	J_ASSERT (table->nr_records == 0);
+#else
 	for (i=0; i<table->hash_size; i++) {
 		hash_list = &table->hash_table[i];
 		J_ASSERT (list_empty(hash_list));
 	}
+#endif
 
 	kfree(table->hash_table);
 	kmem_cache_free(revoke_table_cache, table);
@@ -621,6 +763,13 @@ int journal_test_revoke(journal_t *journal,
 
 void journal_clear_revoke(journal_t *journal)
 {
+#ifndef __KERNEL__
+	struct jbd_revoke_table_s *revoke = journal->j_revoke;
+
+	memset(revoke->hash_table, 0,
+	       revoke->hash_size * sizeof(struct jbd_revoke_record_s));
+	revoke->nr_records = 0;
+#else
 	int i;
 	struct list_head *hash_list;
 	struct jbd_revoke_record_s *record;
@@ -636,5 +785,6 @@ void journal_clear_revoke(journal_t *journal)
 			kmem_cache_free(revoke_record_cache, record);
 		}
 	}
+#endif
 }
 
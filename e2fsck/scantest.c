@@ -1,140 +1,486 @@
 /*
- * scantest.c - test the speed of the inode scan routine
+ * scantest.c - measure how fast the inode table can be scanned
+ *
+ * Runs ext2fs_get_next_inode_full() over the whole inode table of a
+ * file system once for every combination of the settings given on the
+ * command line: the number of blocks read at a time by the scan, the
+ * I/O manager, whether the inode tables of the next groups are read
+ * ahead, and whether the inodes the group descriptors say were never
+ * used are skipped.  The same is then done with
+ * ext2fs_parallel_inode_scan() for each number of worker processes.
+ * The results are written to stdout as a JSON object, in inodes and
+ * megabytes per second, so that the best settings for a kind of
+ * hardware can be picked by a script.
+ *
+ * Usage: scantest [-c] [-r runs] [-b buffer_blocks,...] [-m io,...]
+ *		   [-R on|off,...] [-U on|off,...] [-w workers,...] device
+ *
+ * The I/O managers are "unix", "direct" (the unix manager with
+ * O_DIRECT) and "qcow2"; any of them may be followed by io_options, as
+ * in "unix?cache_size=32m".  A buffer_blocks of 0 is the library's
+ * default, and "auto" has it sized from the device's I/O hints; a
+ * worker count of 0 skips the parallel scan.  With -c,
+ * the device's pages are dropped from the page cache before every run.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
-#include <ctype.h>
-#include <termios.h>
-#include <time.h>
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
-#include <unistd.h>
-#include <sys/ioctl.h>
-#ifdef HAVE_MALLOC_H
-#include <malloc.h>
-#endif
-#include <sys/resource.h>
-
-#include "et/com_err.h"
-#include "../version.h"
-
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 
+#include "et/com_err.h"
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
 
+#define MAX_SETTINGS	32
 
-extern int isatty(int);
+static const char *program_name = "scantest";
+static const char *device_name;
+static int num_results, num_runs = 1, cold_cache;
 
-const char * device_name = NULL;
+struct setting_list {
+	int	num;
+	char	*val[MAX_SETTINGS];
+};
 
-/*
- * This structure is used for keeping track of how much resources have
- * been used for a particular pass of e2fsck.
- */
-struct resource_track {
-	struct timeval time_start;
-	struct timeval user_start;
-	struct timeval system_start;
-	void	*brk_start;
+struct scan_config {
+	const char	*io;		/* as given, with any io_options */
+	int		buffer_blocks;
+	int		readahead;
+	int		skip_unused;
+	int		workers;	/* 0 for the plain serial scan */
+};
+
+struct scan_result {
+	unsigned long long	inodes;
+	unsigned long long	in_use;
+	unsigned long long	bytes_read;
+	double			seconds, user_seconds, system_seconds;
+};
+
+/* What each worker of the parallel scan counts */
+struct shard_count {
+	unsigned long long	inodes;
+	unsigned long long	in_use;
+	unsigned long long	bytes_read;	/* the channel's count so far */
 };
 
-struct resource_track	global_rtrack;
+/* Managers which differ from the real ones only in not reading ahead */
+static struct struct_io_manager no_readahead[3];
 
-void init_resource_track(struct resource_track *track)
+static double now(void)
 {
-	struct rusage r;
+	struct timeval	tv;
 
-	track->brk_start = sbrk(0);
-	gettimeofday(&track->time_start, 0);
-	getrusage(RUSAGE_SELF, &r);
-	track->user_start = r.ru_utime;
-	track->system_start = r.ru_stime;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
-static __inline__ float timeval_subtract(struct timeval *tv1,
-					 struct timeval *tv2)
+static void cpu_time(double *user, double *sys)
 {
-	return ((tv1->tv_sec - tv2->tv_sec) +
-		((float) (tv1->tv_usec - tv2->tv_usec)) / 1000000);
+	struct rusage	self, children;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	*user = self.ru_utime.tv_sec + children.ru_utime.tv_sec +
+		(self.ru_utime.tv_usec + children.ru_utime.tv_usec) /
+		1000000.0;
+	*sys = self.ru_stime.tv_sec + children.ru_stime.tv_sec +
+		(self.ru_stime.tv_usec + children.ru_stime.tv_usec) /
+		1000000.0;
 }
 
-static void print_resource_track(struct resource_track *track)
+static void drop_cache(void)
 {
-	struct rusage r;
-	struct timeval time_end;
-
-	gettimeofday(&time_end, 0);
-	getrusage(RUSAGE_SELF, &r);
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+	int	fd;
 
-	printf(_("Memory used: %d, elapsed time: %6.3f/%6.3f/%6.3f\n"),
-	       (int) (((char *) sbrk(0)) - ((char *) track->brk_start)),
-	       timeval_subtract(&time_end, &track->time_start),
-	       timeval_subtract(&r.ru_utime, &track->user_start),
-	       timeval_subtract(&r.ru_stime, &track->system_start));
+	fd = open(device_name, O_RDONLY);
+	if (fd < 0)
+		return;
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+#endif
 }
 
+static void split_list(struct setting_list *list, char *arg)
+{
+	char	*cp;
 
+	list->num = 0;
+	for (cp = strtok(arg, ","); cp; cp = strtok(NULL, ",")) {
+		if (list->num == MAX_SETTINGS) {
+			fprintf(stderr, "%s: too many settings in list\n",
+				program_name);
+			exit(1);
+		}
+		list->val[list->num++] = cp;
+	}
+}
 
-int main (int argc, char *argv[])
+static int parse_bool(const char *arg)
 {
-	errcode_t	retval = 0;
-	int		exit_value = 0;
-	int		i;
-	ext2_filsys	fs;
-	ext2_inode_scan	scan;
-	ext2_ino_t	ino;
-	struct ext2_inode inode;
+	if (!strcmp(arg, "on") || !strcmp(arg, "1") || !strcmp(arg, "yes"))
+		return 1;
+	if (!strcmp(arg, "off") || !strcmp(arg, "0") || !strcmp(arg, "no"))
+		return 0;
+	fprintf(stderr, "%s: %s is neither on nor off\n", program_name, arg);
+	exit(1);
+}
+
+static int parse_num(const char *arg, int max)
+{
+	char	*end;
+	long	n;
 
-	printf(_("size of inode=%d\n"), sizeof(inode));
+	n = strtol(arg, &end, 0);
+	if (*end || n < 0 || n > max) {
+		fprintf(stderr, "%s: bad number %s\n", program_name, arg);
+		exit(1);
+	}
+	return n;
+}
 
-	device_name = "/dev/hda3";
+static void print_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+		if ((unsigned char) *str < ' ')
+			printf("\\u%04x", (unsigned char) *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
 
-	init_resource_track(&global_rtrack);
+/*
+ * Open the file system with the I/O manager a config asks for; the
+ * io_options go after a '?', as they do for ext2fs_open2().
+ */
+static ext2_filsys open_fs(struct scan_config *cfg)
+{
+	ext2_filsys	fs;
+	io_manager	io;
+	char		name[64], *opts;
+	int		flags = EXT2_FLAG_64BITS, i;
+	errcode_t	retval;
 
-	retval = ext2fs_open(device_name, 0,
-			     0, 0, unix_io_manager, &fs);
+	strncpy(name, cfg->io, sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	opts = strchr(name, '?');
+	if (opts)
+		*opts++ = 0;
+	if (!strcmp(name, "unix")) {
+		io = unix_io_manager;
+		i = 0;
+	} else if (!strcmp(name, "direct")) {
+		io = unix_io_manager;
+		flags |= EXT2_FLAG_DIRECT_IO;
+		i = 1;
+	} else if (!strcmp(name, "qcow2")) {
+		io = qcow2_io_manager;
+		i = 2;
+	} else {
+		fprintf(stderr, "%s: unknown I/O manager %s\n",
+			program_name, name);
+		exit(1);
+	}
+	if (!cfg->readahead) {
+		no_readahead[i] = *io;
+		no_readahead[i].cache_readahead = 0;
+		io = &no_readahead[i];
+	}
+
+	retval = ext2fs_open2(device_name, opts, flags, 0, 0, io, &fs);
 	if (retval) {
-		com_err(argv[0], retval, _("while trying to open %s"),
-			device_name);
+		com_err(program_name, retval, "while opening %s with %s",
+			device_name, cfg->io);
 		exit(1);
 	}
+	return fs;
+}
+
+static unsigned long long bytes_read(ext2_filsys fs)
+{
+	io_stats	stats = 0;
+
+	if (fs->io->manager->get_stats)
+		fs->io->manager->get_stats(fs->io, &stats);
+	return stats ? stats->bytes_read : 0;
+}
+
+static void serial_scan(ext2_filsys fs, struct scan_config *cfg,
+			struct scan_result *res)
+{
+	ext2_inode_scan	scan;
+	ext2_ino_t	ino;
+	struct ext2_inode *inode;
+	int		inode_size = EXT2_INODE_SIZE(fs->super);
+	errcode_t	retval;
 
-	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	retval = ext2fs_get_mem(inode_size, &inode);
 	if (retval) {
-		com_err(argv[0], retval, _("while opening inode scan"));
+		com_err(program_name, retval, "while allocating inode");
 		exit(1);
 	}
-	retval = ext2fs_get_next_inode(scan, &ino, &inode);
+	retval = ext2fs_open_inode_scan(fs, cfg->buffer_blocks, &scan);
 	if (retval) {
-		com_err(argv[0], retval, _("while starting inode scan"));
+		com_err(program_name, retval, "while opening inode scan");
 		exit(1);
 	}
-	while (ino) {
-		if (!inode.i_links_count)
-			goto next;
-		printf("%lu\n", inode.i_blocks);
-	next:
-		retval = ext2fs_get_next_inode(scan, &ino, &inode);
+	/* Hand the skipped inodes back too, so that every run counts all */
+	ext2fs_inode_scan_flags(scan, EXT2_SF_ZERO_UNUSED, 0);
+	if (!cfg->skip_unused) {
+		ext2fs_inode_scan_flags(scan, EXT2_SF_READ_UNUSED, 0);
+		ext2fs_inode_scan_goto_blockgroup(scan, 0);
+	}
+	while (1) {
+		retval = ext2fs_get_next_inode_full(scan, &ino, inode,
+						    inode_size);
+		if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+			continue;
 		if (retval) {
-			com_err(argv[0], retval,
-				_("while doing inode scan"));
+			com_err(program_name, retval,
+				"while getting next inode");
 			exit(1);
 		}
+		if (!ino)
+			break;
+		res->inodes++;
+		if (inode->i_links_count)
+			res->in_use++;
+	}
+	ext2fs_close_inode_scan(scan);
+	ext2fs_free_mem(&inode);
+}
+
+static errcode_t count_inode(ext2_filsys fs,
+			     ext2_ino_t ino EXT2FS_ATTR((unused)),
+			     struct ext2_inode *inode, void *shard_data,
+			     void *priv_data EXT2FS_ATTR((unused)))
+{
+	struct shard_count *count = (struct shard_count *) shard_data;
+
+	count->inodes++;
+	if (inode->i_links_count)
+		count->in_use++;
+	count->bytes_read = bytes_read(fs);
+	return 0;
+}
+
+static void parallel_scan(ext2_filsys fs, struct scan_config *cfg,
+			  struct scan_result *res, unsigned long long base)
+{
+	struct shard_count *counts;
+	int		i;
+	errcode_t	retval;
+
+	retval = ext2fs_get_arrayzero(cfg->workers, sizeof(*counts), &counts);
+	if (retval) {
+		com_err(program_name, retval, "while allocating counts");
+		exit(1);
+	}
+	retval = ext2fs_parallel_inode_scan(fs, cfg->workers,
+					    EXT2_SF_ZERO_UNUSED |
+					    (cfg->skip_unused ? 0 :
+					     EXT2_SF_READ_UNUSED),
+					    count_inode, counts,
+					    sizeof(*counts), NULL);
+	if (retval) {
+		com_err(program_name, retval, "during parallel inode scan");
+		exit(1);
+	}
+	/*
+	 * Each worker's channel started out with the caller's counts
+	 * when it was forked; a single worker runs in this process.
+	 */
+	for (i = 0; i < cfg->workers; i++) {
+		res->inodes += counts[i].inodes;
+		res->in_use += counts[i].in_use;
+		if (counts[i].bytes_read > base)
+			res->bytes_read += counts[i].bytes_read - base;
+	}
+	ext2fs_free_mem(&counts);
+}
+
+/* Scan with one config, num_runs times, and keep the fastest run */
+static void run_config(struct scan_config *cfg)
+{
+	struct scan_result res, best;
+	ext2_filsys	fs;
+	unsigned long long base;
+	double		start, user, sys, user_end, sys_end;
+	int		run;
+
+	memset(&best, 0, sizeof(best));
+	for (run = 0; run < num_runs; run++) {
+		memset(&res, 0, sizeof(res));
+		fs = open_fs(cfg);
+		if (cold_cache)
+			drop_cache();
+		base = bytes_read(fs);
+		cpu_time(&user, &sys);
+		start = now();
+		if (cfg->workers)
+			parallel_scan(fs, cfg, &res, base);
+		else {
+			serial_scan(fs, cfg, &res);
+			res.bytes_read = bytes_read(fs) - base;
+		}
+		res.seconds = now() - start;
+		cpu_time(&user_end, &sys_end);
+		res.user_seconds = user_end - user;
+		res.system_seconds = sys_end - sys;
+		ext2fs_close(fs);
+		if (run == 0 || res.seconds < best.seconds)
+			best = res;
 	}
 
+	printf("%s\n    {\"mode\": \"%s\", \"io\": ", num_results++ ? "," : "",
+	       cfg->workers ? "parallel" : "serial");
+	print_string(cfg->io);
+	if (cfg->buffer_blocks == EXT2_INODE_SCAN_AUTO_BUFFER)
+		printf(", \"buffer_blocks\": \"auto\"");
+	else
+		printf(", \"buffer_blocks\": %d", cfg->buffer_blocks);
+	printf(", \"readahead\": %s, "
+	       "\"skip_unused\": %s, \"workers\": %d,\n"
+	       "     \"inodes\": %llu, \"inodes_in_use\": %llu, "
+	       "\"bytes_read\": %llu,\n"
+	       "     \"seconds\": %.6f, \"user_seconds\": %.6f, "
+	       "\"system_seconds\": %.6f,\n"
+	       "     \"inodes_per_sec\": %.0f, \"mb_per_sec\": %.2f}",
+	       cfg->readahead ? "true" : "false",
+	       cfg->skip_unused ? "true" : "false",
+	       cfg->workers ? cfg->workers : 1,
+	       best.inodes, best.in_use, best.bytes_read, best.seconds,
+	       best.user_seconds, best.system_seconds,
+	       best.seconds > 0 ? best.inodes / best.seconds : 0.0,
+	       best.seconds > 0 ?
+	       best.bytes_read / best.seconds / (1024 * 1024) : 0.0);
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-c] [-r runs] [-b buffer_blocks,...] "
+		"[-m io,...]\n\t\t[-R on|off,...] [-U on|off,...] "
+		"[-w workers,...] device\n", program_name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct setting_list buffers, managers, readahead, skip, workers;
+	struct scan_config cfg;
+	char		buffers_def[] = "0,32,128,512,auto", managers_def[] = "unix";
+	char		readahead_def[] = "on,off", skip_def[] = "on,off";
+	char		workers_def[] = "1,2,4,8";
+	ext2_filsys	fs;
+	int		b, m, r, u, w, c;
+
+	add_error_table(&et_ext2_error_table);
+
+	split_list(&buffers, buffers_def);
+	split_list(&managers, managers_def);
+	split_list(&readahead, readahead_def);
+	split_list(&skip, skip_def);
+	split_list(&workers, workers_def);
+	while ((c = getopt(argc, argv, "b:cm:r:R:U:w:")) != EOF) {
+		switch (c) {
+		case 'b':
+			split_list(&buffers, optarg);
+			break;
+		case 'c':
+			cold_cache = 1;
+			break;
+		case 'm':
+			split_list(&managers, optarg);
+			break;
+		case 'r':
+			num_runs = parse_num(optarg, 1000);
+			if (!num_runs)
+				usage();
+			break;
+		case 'R':
+			split_list(&readahead, optarg);
+			break;
+		case 'U':
+			split_list(&skip, optarg);
+			break;
+		case 'w':
+			split_list(&workers, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	device_name = argv[optind];
 
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.io = managers.num ? managers.val[0] : "unix";
+	cfg.readahead = 1;
+	fs = open_fs(&cfg);
+	printf("{\n  \"benchmark\": \"inode_scan\",\n  \"device\": ");
+	print_string(device_name);
+	printf(",\n  \"inodes_count\": %u,\n  \"inode_size\": %d,\n"
+	       "  \"groups\": %u,\n  \"cold_cache\": %s,\n  \"runs\": %d,\n"
+	       "  \"results\": [", fs->super->s_inodes_count,
+	       EXT2_INODE_SIZE(fs->super), fs->group_desc_count,
+	       cold_cache ? "true" : "false", num_runs);
 	ext2fs_close(fs);
 
-	print_resource_track(&global_rtrack);
+	for (m = 0; m < managers.num; m++) {
+		cfg.io = managers.val[m];
+		for (r = 0; r < readahead.num; r++) {
+			cfg.readahead = parse_bool(readahead.val[r]);
+			cfg.workers = 0;
+			for (b = 0; b < buffers.num; b++) {
+				if (!strcmp(buffers.val[b], "auto"))
+					cfg.buffer_blocks =
+						EXT2_INODE_SCAN_AUTO_BUFFER;
+				else
+					cfg.buffer_blocks =
+						parse_num(buffers.val[b],
+							  65536);
+				for (u = 0; u < skip.num; u++) {
+					cfg.skip_unused =
+						parse_bool(skip.val[u]);
+					run_config(&cfg);
+				}
+			}
+			/* The parallel scan has its own buffer size */
+			cfg.buffer_blocks = 0;
+			for (w = 0; w < workers.num; w++) {
+				cfg.workers = parse_num(workers.val[w], 64);
+				if (!cfg.workers)
+					continue;
+				for (u = 0; u < skip.num; u++) {
+					cfg.skip_unused =
+						parse_bool(skip.val[u]);
+					run_config(&cfg);
+				}
+			}
+		}
+	}
+	printf("\n  ]\n}\n");
 
-	return exit_value;
+	remove_error_table(&et_ext2_error_table);
+	return 0;
 }
@@ -53,6 +53,7 @@ struct process_block_struct {
 	int		truncated_blocks;
 	int		abort;
 	errcode_t	errcode;
+	ext2fs_block_bitmap released;	/* freed by release_freed_blocks() */
 };
 
 static int release_inode_block(ext2_filsys fs,
@@ -86,7 +87,8 @@ static int release_inode_block(ext2_filsys fs,
 		return BLOCK_ABORT;
 	}
 
-	if (!ext2fs_test_block_bitmap2(fs->block_map, blk)) {
+	if (!ext2fs_test_block_bitmap2(fs->block_map, blk) ||
+	    ext2fs_test_block_bitmap2(pb->released, blk)) {
 		fix_problem(ctx, PR_0_ORPHAN_ALREADY_CLEARED_BLOCK, pctx);
 		goto return_abort;
 	}
@@ -143,11 +145,33 @@ static int release_inode_block(ext2_filsys fs,
 		retval |= BLOCK_CHANGED;
 	}
 
-	ext2fs_block_alloc_stats2(fs, blk, -1);
+	ext2fs_mark_block_bitmap2(pb->released, blk);
 	ctx->free_blocks++;
 	return retval;
 }
 
+/*
+ * The blocks of the orphan inodes are collected in a bitmap as they
+ * are released, and freed here a range at a time, so that each group
+ * descriptor is updated once per range instead of once per block.
+ */
+static void release_freed_blocks(ext2_filsys fs, ext2fs_block_bitmap released)
+{
+	blk64_t	start, end, last = ext2fs_blocks_count(fs->super) - 1;
+
+	start = fs->super->s_first_data_block;
+	while (start <= last &&
+	       !ext2fs_find_first_set_block_bitmap2(released, start, last,
+						    &start)) {
+		if (ext2fs_find_first_zero_block_bitmap2(released, start,
+							 last, &end))
+			end = last + 1;
+		ext2fs_block_alloc_stats_range(fs, start, end - start, -1);
+		start = end;
+	}
+	ext2fs_clear_block_bitmap(released);
+}
+
 /*
  * This function releases an inode.  Returns 1 if an inconsistency was
  * found.  If the inode has a link count, then it is being truncated and
@@ -155,6 +179,7 @@ static int release_inode_block(ext2_filsys fs,
  */
 static int release_inode_blocks(e2fsck_t ctx, ext2_ino_t ino,
 				struct ext2_inode *inode, char *block_buf,
+				ext2fs_block_bitmap released,
 				struct problem_context *pctx)
 {
 	struct process_block_struct 	pb;
@@ -170,6 +195,7 @@ static int release_inode_blocks(e2fsck_t ctx, ext2_ino_t ino,
 	pb.abort = 0;
 	pb.errcode = 0;
 	pb.pctx = pctx;
+	pb.released = released;
 	if (inode->i_links_count) {
 		pb.truncating = 1;
 		pb.truncate_block = (e2_blkcnt_t)
@@ -214,8 +240,8 @@ static int release_inode_blocks(e2fsck_t ctx, ext2_ino_t ino,
 			return 1;
 		}
 		if (count == 0) {
-			ext2fs_block_alloc_stats2(fs,
-					ext2fs_file_acl_block(fs, inode), -1);
+			ext2fs_mark_block_bitmap2(released,
+					ext2fs_file_acl_block(fs, inode));
 			ctx->free_blocks++;
 		}
 		ext2fs_file_acl_block_set(fs, inode, 0);
@@ -233,6 +259,7 @@ static int release_orphan_inodes(e2fsck_t ctx)
 	ext2_ino_t	ino, next_ino;
 	struct ext2_inode inode;
 	struct problem_context pctx;
+	ext2fs_block_bitmap released;
 	char *block_buf;
 
 	if ((ino = fs->super->s_last_orphan) == 0)
@@ -261,6 +288,16 @@ static int release_orphan_inodes(e2fsck_t ctx)
 		return 1;
 	}
 
+	clear_problem_context(&pctx);
+	pctx.errcode = e2fsck_allocate_block_bitmap(fs,
+			_("released orphan blocks"), EXT2FS_BMAP64_RBTREE,
+			"orphan_released_map", &released);
+	if (pctx.errcode) {
+		pctx.num = 1;
+		fix_problem(ctx, PR_1_ALLOCATE_BBITMAP_ERROR, &pctx);
+		ctx->flags |= E2F_FLAG_ABORT;
+		return 1;
+	}
 	block_buf = (char *) e2fsck_allocate_memory(ctx, fs->blocksize * 4,
 						    "block iterate buffer");
 	e2fsck_read_bitmaps(ctx);
@@ -284,7 +321,8 @@ static int release_orphan_inodes(e2fsck_t ctx)
 			goto return_abort;
 		}
 
-		if (release_inode_blocks(ctx, ino, &inode, block_buf, &pctx))
+		if (release_inode_blocks(ctx, ino, &inode, block_buf,
+					 released, &pctx))
 			goto return_abort;
 
 		if (!inode.i_links_count) {
@@ -298,9 +336,13 @@ static int release_orphan_inodes(e2fsck_t ctx)
 		e2fsck_write_inode(ctx, ino, &inode, "delete_file");
 		ino = next_ino;
 	}
+	release_freed_blocks(fs, released);
+	ext2fs_free_block_bitmap(released);
 	ext2fs_free_mem(&block_buf);
 	return 0;
 return_abort:
+	release_freed_blocks(fs, released);
+	ext2fs_free_block_bitmap(released);
 	ext2fs_free_mem(&block_buf);
 	return 1;
 }
@@ -60,6 +60,8 @@ static int verbose;
 static int replace_bad_blocks;
 static int keep_bad_blocks;
 static char *bad_blocks_file;
+static char **batch_names;	/* with -E batch */
+static int num_batch_names;
 
 e2fsck_t e2fsck_global_ctx;	/* Try your very best not to use this! */
 
@@ -77,7 +79,7 @@ static void usage(e2fsck_t ctx)
 		_("Usage: %s [-panyrcdfvtDFV] [-b superblock] [-B blocksize]\n"
 		"\t\t[-I inode_buffer_blocks] [-P process_inode_size]\n"
 		"\t\t[-l|-L bad_blocks_file] [-C fd] [-j external_journal]\n"
-		"\t\t[-E extended-options] device\n"),
+		"\t\t[-E extended-options] [-z undo_file] device ...\n"),
 		ctx->program_name);
 
 	fprintf(stderr, "%s", _("\nEmergency help:\n"
@@ -93,6 +95,7 @@ static void usage(e2fsck_t ctx)
 		" -j external_journal  Set location of the external journal\n"
 		" -l bad_blocks_file   Add to badblocks list\n"
 		" -L bad_blocks_file   Set badblocks list\n"
+		" -z undo_file         Create an undo file\n"
 		));
 
 	exit(FSCK_USAGE);
@@ -460,6 +463,37 @@ skip:
 	exit(FSCK_OK);
 }
 
+/*
+ * If a checkpoint file was given and it shows that the file system
+ * has not changed since it was last found clean, skip the check.
+ */
+static void check_checkpoint(e2fsck_t ctx)
+{
+	ext2_filsys fs = ctx->fs;
+	const char *why;
+
+	if (!ctx->checkpoint_fn || bad_blocks_file || cflag)
+		return;
+	if (!e2fsck_checkpoint_unchanged(ctx, &why)) {
+		if (why && verbose)
+			log_out(ctx, _("%s: not using checkpoint %s: %s\n"),
+				ctx->device_name, ctx->checkpoint_fn, why);
+		return;
+	}
+	log_out(ctx, _("%s: unchanged since last check, "
+		       "%u/%u files, %llu/%llu blocks\n"),
+		ctx->device_name,
+		fs->super->s_inodes_count - fs->super->s_free_inodes_count,
+		fs->super->s_inodes_count,
+		ext2fs_blocks_count(fs->super) -
+		ext2fs_free_blocks_count(fs->super),
+		ext2fs_blocks_count(fs->super));
+	ext2fs_close(fs);
+	ctx->fs = NULL;
+	e2fsck_free_context(ctx);
+	exit(FSCK_OK);
+}
+
 /*
  * For completion notice
  */
@@ -566,16 +600,138 @@ int e2fsck_simple_progress(e2fsck_t ctx, const char *label, float percent,
 	return 0;
 }
 
+static double progress_secs(struct timeval *now, struct timeval *then)
+{
+	return (now->tv_sec - then->tv_sec) +
+		((double) (now->tv_usec - then->tv_usec)) / 1000000;
+}
+
+/* Copy str into buf as a quoted JSON string, truncating it if need be */
+static void progress_json_string(char *buf, size_t size, const char *str)
+{
+	const unsigned char *cp;
+	size_t	len = 0;
+
+	buf[len++] = '"';
+	for (cp = (const unsigned char *) str; cp && *cp; cp++) {
+		if (len + 8 >= size)
+			break;
+		if (*cp == '"' || *cp == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = *cp;
+		} else if (*cp < 0x20)
+			len += sprintf(buf + len, "\\u%04x", *cp);
+		else
+			buf[len++] = *cp;
+	}
+	buf[len++] = '"';
+	buf[len] = 0;
+}
+
+/*
+ * With -E progress_json, each update on the -C file descriptor is a
+ * JSON object on a line of its own.  Rather than only the position
+ * within the pass, it carries the rates measured since the pass began
+ * and the time left, both for the pass and for the whole check.  The
+ * latter assumes that the passes still to come take the share of the
+ * run given to them by e2fsck_tbl, at the rate the check has gone so
+ * far; it is no better than that table, but it sharpens as the check
+ * goes on.  A line with "finished" set ends each pass.
+ */
+static void e2fsck_json_progress(e2fsck_t ctx, int pass, unsigned long cur,
+				 unsigned long max, int finished)
+{
+	char		buf[1024], name[512], pass_eta[32], eta[32];
+	struct timeval	now;
+	io_stats	stats = 0;
+	unsigned long long bytes = 0;
+	double		secs, pass_secs, percent, left;
+
+	gettimeofday(&now, 0);
+	if (ctx->fs && ctx->fs->io && ctx->fs->io->manager->get_stats)
+		ctx->fs->io->manager->get_stats(ctx->fs->io, &stats);
+	if (stats)
+		bytes = stats->bytes_read;
+
+	if (!ctx->progress_start.tv_sec)
+		ctx->progress_start = now;
+	if (pass != ctx->progress_pass) {
+		ctx->progress_pass = pass;
+		ctx->progress_pass_start = now;
+		ctx->progress_bytes_start = bytes;
+	} else if (!finished && cur && cur < max &&
+		   progress_secs(&now, &ctx->progress_last_report) <
+		   ctx->progress_interval)
+		return;
+	ctx->progress_last_report = now;
+	ctx->progress_max = max;
+
+	secs = progress_secs(&now, &ctx->progress_start);
+	pass_secs = progress_secs(&now, &ctx->progress_pass_start);
+	strcpy(pass_eta, "null");
+	strcpy(eta, "null");
+	if (finished || (max && cur >= max))
+		strcpy(pass_eta, "0");
+	else if (cur && max)
+		sprintf(pass_eta, "%.1f",
+			pass_secs * (max - cur) / cur);
+	percent = calc_percent(&e2fsck_tbl, pass, cur, max);
+	if (percent >= 100.0)
+		strcpy(eta, "0");
+	else if (strcmp(pass_eta, "null") && percent > 0 &&
+		 pass <= e2fsck_tbl.max_pass) {
+		left = 100 - e2fsck_tbl.table[pass];
+		sprintf(eta, "%.1f", strtod(pass_eta, 0) +
+			left * secs / percent);
+	}
+
+	progress_json_string(name, sizeof(name), ctx->device_name);
+	snprintf(buf, sizeof(buf),
+		 "{\"device\": %s, \"pass\": %d, \"done\": %lu, "
+		 "\"total\": %lu, \"percent\": %.1f, \"elapsed\": %.3f, "
+		 "\"pass_elapsed\": %.3f, \"bytes_read\": %llu, "
+		 "\"read_rate\": %.0f, \"rate\": %.1f, "
+		 "\"pass_eta\": %s, \"eta\": %s%s}\n",
+		 name, pass, cur, max, percent, secs, pass_secs,
+		 bytes - ctx->progress_bytes_start,
+		 pass_secs > 0 ?
+		 (bytes - ctx->progress_bytes_start) / pass_secs : 0.0,
+		 pass_secs > 0 ? cur / pass_secs : 0.0,
+		 pass_eta, eta, finished ? ", \"finished\": true" : "");
+	write_all(ctx->progress_fd, buf, strlen(buf));
+}
+
 static int e2fsck_update_progress(e2fsck_t ctx, int pass,
 				  unsigned long cur, unsigned long max)
 {
 	char buf[1024];
 	float percent;
-
-	if (pass == 0)
+	struct timeval now;
+
+	if (pass == 0) {
+		/* The pass which was running is over */
+		if (ctx->progress_json && ctx->progress_fd &&
+		    ctx->progress_pass > 0) {
+			e2fsck_json_progress(ctx, ctx->progress_pass,
+					     ctx->progress_max,
+					     ctx->progress_max, 1);
+			ctx->progress_pass = 0;
+		}
 		return 0;
+	}
 
-	if (ctx->progress_fd) {
+	if (ctx->progress_fd && ctx->progress_json) {
+		e2fsck_json_progress(ctx, pass, cur, max, 0);
+	} else if (ctx->progress_fd) {
+		if (ctx->progress_interval > 0 && cur && cur < max) {
+			gettimeofday(&now, 0);
+			if (pass == ctx->progress_pass &&
+			    progress_secs(&now, &ctx->progress_last_report) <
+			    ctx->progress_interval)
+				return 0;
+			ctx->progress_pass = pass;
+			ctx->progress_last_report = now;
+		}
 		snprintf(buf, sizeof(buf), "%d %lu %lu %s\n",
 			 pass, cur, max, ctx->device_name);
 		write_all(ctx->progress_fd, buf, strlen(buf));
@@ -695,6 +851,171 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 			else
 				ctx->log_fn = string_copy(ctx, arg, 0);
 			continue;
+		} else if (strcmp(token, "stats_file") == 0) {
+			if (!arg)
+				extended_usage++;
+			else
+				ctx->stats_fn = string_copy(ctx, arg, 0);
+			continue;
+		} else if (strcmp(token, "io_trace") == 0) {
+			if (!arg)
+				extended_usage++;
+			else
+				ctx->io_trace_fn = string_copy(ctx, arg, 0);
+			continue;
+		} else if (strcmp(token, "prefetch_workers") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->prefetch_workers = strtoul(arg, &p, 0);
+			if (*p || ctx->prefetch_workers > 64) {
+				fprintf(stderr, "%s",
+					_("Invalid number of prefetch "
+					  "workers.\n"));
+				extended_usage++;
+				continue;
+			}
+		} else if (strcmp(token, "readahead_kb") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->readahead_kb = strtoul(arg, &p, 0);
+			if (*p) {
+				fprintf(stderr, "%s",
+					_("Invalid readahead buffer size.\n"));
+				extended_usage++;
+				continue;
+			}
+		} else if (strcmp(token, "bmap2extent") == 0) {
+			if (arg && strcmp(arg, "relocate")) {
+				extended_usage++;
+				continue;
+			}
+			ctx->options |= E2F_OPT_CONVERT_BMAP;
+			if (arg)
+				ctx->options |= E2F_OPT_CONVERT_RELOCATE;
+		} else if (strcmp(token, "relocate_dirs") == 0) {
+			ctx->options |= E2F_OPT_RELOCATE_DIRS;
+			continue;
+		} else if (strcmp(token, "groups") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->scope_first_group = strtoul(arg, &p, 0);
+			ctx->scope_last_group = ctx->scope_first_group;
+			if (*p == '-')
+				ctx->scope_last_group = strtoul(p + 1, &p, 0);
+			if (*p || p == arg ||
+			    ctx->scope_last_group < ctx->scope_first_group) {
+				fprintf(stderr, "%s",
+					_("Invalid block group range.\n"));
+				extended_usage++;
+				continue;
+			}
+			ctx->options |= E2F_OPT_GROUPS;
+		} else if (strcmp(token, "groups_fix") == 0) {
+			ctx->options |= E2F_OPT_GROUPS_FIX;
+			continue;
+		} else if (strcmp(token, "estimate") == 0) {
+			ctx->options |= E2F_OPT_ESTIMATE;
+			continue;
+		} else if (strcmp(token, "stage_writes") == 0) {
+			unsigned long long size = 0;
+			char	*io_opts;
+
+			if (arg && !(size = parse_num_blocks2(arg, -1))) {
+				fprintf(stderr, "%s",
+					_("Invalid staging buffer size.\n"));
+				extended_usage++;
+				continue;
+			}
+			/* The staging I/O manager does the work */
+			io_opts = e2fsck_allocate_memory(ctx,
+				(ctx->io_options ? strlen(ctx->io_options) : 0) +
+				40, "io options");
+			sprintf(io_opts, "%s%sstage_writes",
+				ctx->io_options ? ctx->io_options : "",
+				ctx->io_options ? "&" : "");
+			if (size)
+				sprintf(io_opts + strlen(io_opts), "=%llu",
+					size);
+			ctx->io_options = io_opts;
+			ctx->options |= E2F_OPT_STAGE_WRITES;
+			continue;
+		} else if (strcmp(token, "checkpoint") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->checkpoint_fn = string_copy(ctx, arg, 0);
+		} else if (strcmp(token, "max_memory") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->max_memory = parse_num_blocks2(arg, -1);
+			if (!ctx->max_memory) {
+				fprintf(stderr, "%s",
+					_("Invalid memory limit.\n"));
+				extended_usage++;
+				continue;
+			}
+		} else if (strcmp(token, "output_buffer") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->output_buffer = parse_num_blocks2(arg, -1);
+			if (!ctx->output_buffer) {
+				fprintf(stderr, "%s",
+					_("Invalid output buffer size.\n"));
+				extended_usage++;
+				continue;
+			}
+		} else if (strcmp(token, "progress_json") == 0) {
+			ctx->progress_json = 1;
+			if (ctx->progress_interval < 0)
+				ctx->progress_interval = 1;
+			continue;
+		} else if (strcmp(token, "progress_interval") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->progress_interval = strtod(arg, &p);
+			if (*p || p == arg || ctx->progress_interval < 0) {
+				fprintf(stderr, "%s",
+					_("Invalid progress interval.\n"));
+				extended_usage++;
+				continue;
+			}
+		} else if (strcmp(token, "batch") == 0) {
+			ctx->batch_jobs = 1;
+			if (!arg)
+				continue;
+			ctx->batch_jobs = strtoul(arg, &p, 0);
+			if (*p || ctx->batch_jobs < 1 ||
+			    ctx->batch_jobs > 64) {
+				fprintf(stderr, "%s",
+					_("Invalid number of batch jobs.\n"));
+				extended_usage++;
+				continue;
+			}
+		} else if (strcmp(token, "max_count_problems") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->max_count_problems = strtoul(arg, &p, 0);
+			if (*p || ctx->max_count_problems <= 0) {
+				fprintf(stderr, "%s",
+					_("Invalid maximum problem count.\n"));
+				extended_usage++;
+				continue;
+			}
 		} else {
 			fprintf(stderr, _("Unknown extended option: %s\n"),
 				token);
@@ -713,6 +1034,23 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 		fputs(("\tjournal_only\n"), stderr);
 		fputs(("\tdiscard\n"), stderr);
 		fputs(("\tnodiscard\n"), stderr);
+		fputs(("\tbmap2extent[=relocate]\n"), stderr);
+		fputs(("\trelocate_dirs\n"), stderr);
+		fputs(("\tgroups=<first group>[-<last group>]\n"), stderr);
+		fputs(("\tgroups_fix\n"), stderr);
+		fputs(("\testimate\n"), stderr);
+		fputs(("\tstage_writes[=<size>]\n"), stderr);
+		fputs(("\tcheckpoint=<file name>\n"), stderr);
+		fputs(("\tmax_memory=<size>\n"), stderr);
+		fputs(("\tmax_count_problems=<count>\n"), stderr);
+		fputs(("\toutput_buffer=<size>\n"), stderr);
+		fputs(("\tprefetch_workers=<number of helpers>\n"), stderr);
+		fputs(("\treadahead_kb=<buffer size>\n"), stderr);
+		fputs(("\tstats_file=<file name>\n"), stderr);
+		fputs(("\tio_trace=<file name>\n"), stderr);
+		fputs(("\tprogress_json\n"), stderr);
+		fputs(("\tprogress_interval=<seconds>\n"), stderr);
+		fputs(("\tbatch[=<jobs>]\n"), stderr);
 		fputc('\n', stderr);
 		exit(1);
 	}
@@ -728,6 +1066,19 @@ static void syntax_err_report(const char *filename, long err, int line_num)
 
 static const char *config_fn[] = { ROOT_SYSCONFDIR "/e2fsck.conf", 0 };
 
+static void set_filesystem_name(e2fsck_t ctx, char *name)
+{
+	ctx->io_options = strchr(name, '?');
+	if (ctx->io_options)
+		*ctx->io_options++ = 0;
+	ctx->filesystem_name = blkid_get_devname(ctx->blkid, name, 0);
+	if (!ctx->filesystem_name) {
+		com_err(ctx->program_name, 0, _("Unable to resolve '%s'"),
+			name);
+		fatal_error(ctx, 0);
+	}
+}
+
 static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 {
 	int		flush = 0;
@@ -752,6 +1103,7 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 		return retval;
 
 	*ret_ctx = ctx;
+	ctx->progress_interval = -1;	/* until -E says otherwise */
 
 	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 	setvbuf(stderr, NULL, _IONBF, BUFSIZ);
@@ -772,7 +1124,7 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 	else
 		ctx->program_name = "e2fsck";
 
-	while ((c = getopt (argc, argv, "panyrcC:B:dE:fvtFVM:b:I:j:P:l:L:N:SsDk")) != EOF)
+	while ((c = getopt (argc, argv, "panyrcC:B:dE:fvtFVM:b:I:j:P:l:L:N:SsDkz:")) != EOF)
 		switch (c) {
 		case 'C':
 			ctx->progress = e2fsck_update_progress;
@@ -904,12 +1256,15 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 		case 'k':
 			keep_bad_blocks++;
 			break;
+		case 'z':
+			ctx->undo_file = string_copy(ctx, optarg, 0);
+			break;
 		default:
 			usage(ctx);
 		}
 	if (show_version_only)
 		return 0;
-	if (optind != argc - 1)
+	if (optind >= argc)
 		usage(ctx);
 	if ((ctx->options & E2F_OPT_NO) &&
 	    (ctx->options & E2F_OPT_COMPRESS_DIRS)) {
@@ -917,6 +1272,11 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 			_("The -n and -D options are incompatible."));
 		fatal_error(ctx, 0);
 	}
+	if ((ctx->options & E2F_OPT_NO) && ctx->undo_file) {
+		com_err(ctx->program_name, 0, "%s",
+			_("The -n and -z options are incompatible."));
+		fatal_error(ctx, 0);
+	}
 	if ((ctx->options & E2F_OPT_NO) && cflag) {
 		com_err(ctx->program_name, 0, "%s",
 			_("The -n and -c options are incompatible."));
@@ -930,17 +1290,72 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 	if (ctx->options & E2F_OPT_NO)
 		ctx->options |= E2F_OPT_READONLY;
 
-	ctx->io_options = strchr(argv[optind], '?');
-	if (ctx->io_options)
-		*ctx->io_options++ = 0;
-	ctx->filesystem_name = blkid_get_devname(ctx->blkid, argv[optind], 0);
-	if (!ctx->filesystem_name) {
-		com_err(ctx->program_name, 0, _("Unable to resolve '%s'"),
-			argv[optind]);
-		fatal_error(ctx, 0);
-	}
 	if (extended_opts)
 		parse_extended_opts(ctx, extended_opts);
+	if (ctx->batch_jobs) {
+		if (cflag || bad_blocks_file || flush || ctx->progress ||
+		    ctx->undo_file || ctx->checkpoint_fn || ctx->stats_fn) {
+			com_err(ctx->program_name, 0, "%s",
+				_("The -E batch option can't be combined "
+				  "with -c, -C, -F, -l, -L, -z or the\n"
+				  "checkpoint or stats_file extended "
+				  "options."));
+			fatal_error(ctx, 0);
+		}
+		if (!(ctx->options & (E2F_OPT_PREEN | E2F_OPT_NO |
+				      E2F_OPT_YES))) {
+			com_err(ctx->program_name, 0, "%s",
+				_("The -E batch option needs -p, -n or -y."));
+			fatal_error(ctx, 0);
+		}
+		batch_names = argv + optind;
+		num_batch_names = argc - optind;
+	} else if (optind != argc - 1)
+		usage(ctx);
+	else
+		set_filesystem_name(ctx, argv[optind]);
+	if (ctx->progress_interval < 0)
+		ctx->progress_interval = 0;
+	if (ctx->options & E2F_OPT_CONVERT_BMAP) {
+		if (ctx->options & (E2F_OPT_NO | E2F_OPT_ESTIMATE)) {
+			com_err(ctx->program_name, 0, "%s",
+				_("The -n and -E bmap2extent options are "
+				  "incompatible."));
+			fatal_error(ctx, 0);
+		}
+		/* Only a file system which has been checked is converted */
+		ctx->options |= E2F_OPT_FORCE;
+	}
+	if (ctx->options & E2F_OPT_GROUPS) {
+		if (ctx->options & (E2F_OPT_CONVERT_BMAP | E2F_OPT_ESTIMATE |
+				    E2F_OPT_JOURNAL_ONLY) ||
+		    ctx->checkpoint_fn || bad_blocks_file || cflag) {
+			com_err(ctx->program_name, 0, "%s",
+				_("The -E groups option can't be combined "
+				  "with -c, -l, -L or the bmap2extent,\n"
+				  "checkpoint, estimate or journal_only "
+				  "extended options."));
+			fatal_error(ctx, 0);
+		}
+		/*
+		 * Without groups_fix, a partial check is only there to find
+		 * out whether a full one is needed, so it never writes.
+		 */
+		if (!(ctx->options & E2F_OPT_GROUPS_FIX)) {
+			ctx->options &= ~(E2F_OPT_YES | E2F_OPT_PREEN);
+			ctx->options |= E2F_OPT_NO | E2F_OPT_READONLY;
+		}
+		ctx->options |= E2F_OPT_FORCE;
+	} else if (ctx->options & E2F_OPT_GROUPS_FIX) {
+		com_err(ctx->program_name, 0, "%s",
+			_("The -E groups_fix option needs -E groups."));
+		fatal_error(ctx, 0);
+	}
+	/* An estimate only reads the file system and never asks anything */
+	if (ctx->options & E2F_OPT_ESTIMATE) {
+		ctx->options &= ~(E2F_OPT_YES | E2F_OPT_PREEN);
+		ctx->options |= E2F_OPT_NO | E2F_OPT_READONLY;
+	}
 
 	if ((cp = getenv("E2FSCK_CONFIG")) != NULL)
 		config_fn[0] = cp;
@@ -1040,6 +1455,34 @@ sscanf_err:
 	exit (1);
 }
 
+/*
+ * Start the undo file which -z asked for.  Whatever was in it before
+ * is thrown away; when e2fsck restarts, the undo I/O manager carries
+ * on with what it has saved so far.
+ */
+static errcode_t e2fsck_setup_tdb(e2fsck_t ctx)
+{
+	errcode_t retval;
+
+	if (!access(ctx->undo_file, F_OK) && unlink(ctx->undo_file) < 0) {
+		retval = errno;
+		com_err(ctx->program_name, retval,
+			_("while trying to delete %s"), ctx->undo_file);
+		return retval;
+	}
+	retval = set_undo_io_backup_file(ctx->undo_file);
+	if (retval) {
+		com_err(ctx->program_name, retval,
+			_("while trying to setup undo file %s"),
+			ctx->undo_file);
+		return retval;
+	}
+	log_out(ctx, _("To undo the e2fsck operation please run "
+		       "the command\n    e2undo %s %s\n\n"),
+		ctx->undo_file, ctx->filesystem_name);
+	return 0;
+}
+
 static errcode_t try_open_fs(e2fsck_t ctx, int flags, io_manager io_ptr,
 			     ext2_filsys *ret_fs)
 {
@@ -1209,9 +1652,13 @@ int main (int argc, char *argv[])
 			_("while trying to initialize program"));
 		exit(FSCK_ERROR);
 	}
+	if (num_batch_names && !show_version_only)
+		set_filesystem_name(ctx, e2fsck_batch(ctx, num_batch_names,
+						      batch_names));
 	reserve_stdio_fds();
 
 	set_up_logging(ctx);
+	set_up_output_buffer(ctx);
 	if (ctx->logf) {
 		int i;
 		fputs("E2fsck run: ", ctx->logf);
@@ -1222,8 +1669,24 @@ int main (int argc, char *argv[])
 		}
 		fputc('\n', ctx->logf);
 	}
+	if (ctx->io_trace_fn) {
+		retval = set_trace_io_file(ctx->io_trace_fn);
+		if (retval) {
+			com_err(ctx->program_name, retval,
+				_("while setting up I/O trace %s"),
+				ctx->io_trace_fn);
+			fatal_error(ctx, 0);
+		}
+	}
+	if (ctx->stats_fn) {
+		ctx->stats_file = fopen(ctx->stats_fn, "w");
+		if (!ctx->stats_file)
+			com_err(ctx->program_name, errno,
+				_("while opening stats file %s"),
+				ctx->stats_fn);
+	}
 
-	init_resource_track(&ctx->global_rtrack, NULL);
+	init_resource_track(ctx, &ctx->global_rtrack, NULL);
 	if (!(ctx->options & E2F_OPT_PREEN) || show_version_only)
 		log_err(ctx, "e2fsck %s (%s)\n", my_ver_string,
 			 my_ver_date);
@@ -1245,6 +1708,12 @@ int main (int argc, char *argv[])
 	}
 	ctx->superblock = ctx->use_superblock;
 
+	if (ctx->undo_file) {
+		retval = e2fsck_setup_tdb(ctx);
+		if (retval)
+			fatal_error(ctx, 0);
+	}
+
 	flags = EXT2_FLAG_SKIP_MMP;
 restart:
 #ifdef CONFIG_TESTIO_DEBUG
@@ -1253,8 +1722,36 @@ restart:
 		test_io_backing_manager = unix_io_manager;
 	} else
 #endif
+	if (qcow2_io_probe(ctx->filesystem_name)) {
+		if (!(ctx->options & E2F_OPT_READONLY)) {
+			log_err(ctx, _("%s is a qcow2 image, which can only "
+				       "be checked with -n.\n"),
+				ctx->filesystem_name);
+			fatal_error(ctx, 0);
+		}
+		io_ptr = qcow2_io_manager;
+	} else if (http_io_probe(ctx->filesystem_name)) {
+		if (!(ctx->options & E2F_OPT_READONLY)) {
+			log_err(ctx, _("%s is a remote image, which can only "
+				       "be checked with -n.\n"),
+				ctx->filesystem_name);
+			fatal_error(ctx, 0);
+		}
+		io_ptr = http_io_manager;
+	} else
 		io_ptr = unix_io_manager;
+	if (ctx->io_trace_fn) {
+		set_trace_io_backing_manager(io_ptr);
+		io_ptr = trace_io_manager;
+	}
+	if (ctx->undo_file) {
+		set_undo_io_backing_manager(io_ptr);
+		io_ptr = undo_io_manager;
+	}
 	flags |= EXT2_FLAG_NOFREE_ON_ERROR;
+	/* Have the bitmaps count their operations for -tt and stats_file */
+	if ((ctx->options & E2F_OPT_TIME2) || ctx->stats_fn)
+		flags |= EXT2_FLAG_BMAP_STATS;
 	profile_get_boolean(ctx->profile, "options", "old_bitmaps", 0, 0,
 			    &old_bitmaps);
 	if (!old_bitmaps)
@@ -1385,7 +1882,12 @@ failure:
 	 */
 	fs->flags |= EXT2_FLAG_MASTER_SB_ONLY;
 
-	if (!(ctx->flags & E2F_FLAG_GOT_DEVSIZE)) {
+	/*
+	 * The length of a qcow2 file says nothing about the image size,
+	 * and a remote image has no local length at all
+	 */
+	if (!(ctx->flags & E2F_FLAG_GOT_DEVSIZE) &&
+	    io_ptr != qcow2_io_manager && io_ptr != http_io_manager) {
 		__u32 blocksize = EXT2_BLOCK_SIZE(fs->super);
 		int need_restart = 0;
 
@@ -1424,6 +1926,13 @@ failure:
 	fs->now = ctx->now;
 	sb = fs->super;
 
+	if (ctx->undo_file) {
+		char tdb_string[40];
+
+		sprintf(tdb_string, "tdb_data_size=%d", fs->blocksize);
+		io_channel_set_options(fs->io, tdb_string);
+	}
+
 	if (sb->s_rev_level > E2FSCK_CURRENT_REV) {
 		com_err(ctx->program_name, EXT2_ET_REV_TOO_HIGH,
 			_("while trying to open %s"),
@@ -1463,6 +1972,14 @@ failure:
 		goto restart;
 	}
 
+	/*
+	 * Keep the MMP block up to date from a helper process, so that
+	 * a pass which runs for a long time between calls to
+	 * e2fsck_mmp_update() doesn't look like a dead node.  If that
+	 * can't be done, the passes update it themselves.
+	 */
+	(void) ext2fs_mmp_start_heartbeat(fs);
+
 	if (ctx->logf)
 		fprintf(ctx->logf, "Filesystem UUID: %s\n",
 			e2p_uuid2str(sb->s_uuid));
@@ -1582,10 +2099,30 @@ print_unsupp_features:
 	if (ctx->superblock)
 		set_latch_flags(PR_LATCH_RELOC, PRL_LATCHED, 0);
 	ext2fs_mark_valid(fs);
+	if ((ctx->options & E2F_OPT_GROUPS) &&
+	    ctx->scope_last_group >= fs->group_desc_count) {
+		log_err(ctx, _("%s: the file system only has block groups "
+			       "0-%u\n"), ctx->device_name,
+			fs->group_desc_count - 1);
+		fatal_error(ctx, 0);
+	}
+	if ((ctx->options & E2F_OPT_GROUPS) &&
+	    !(ctx->options & E2F_OPT_PREEN))
+		log_out(ctx, _("%s: checking block groups %u-%u only\n"),
+			ctx->device_name, ctx->scope_first_group,
+			ctx->scope_last_group);
 	check_super_block(ctx);
 	if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 		fatal_error(ctx, 0);
+	if (ctx->options & E2F_OPT_ESTIMATE) {
+		e2fsck_estimate(ctx);
+		ext2fs_close(fs);
+		ctx->fs = NULL;
+		e2fsck_free_context(ctx);
+		exit(FSCK_OK);
+	}
 	check_if_skip(ctx);
+	check_checkpoint(ctx);
 	check_resize_inode(ctx);
 	if (bad_blocks_file)
 		read_bad_blocks_file(ctx, bad_blocks_file, replace_bad_blocks);
@@ -1619,7 +2156,9 @@ print_unsupp_features:
 	else
 		journal_size = -1;
 
-	if (sb->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_QUOTA) {
+	/* A partial check doesn't see enough of the files to count quotas */
+	if ((sb->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_QUOTA) &&
+	    !(ctx->options & E2F_OPT_GROUPS)) {
 		/* Quotas were enabled. Do quota accounting during fsck. */
 		if ((sb->s_usr_quota_inum && sb->s_grp_quota_inum) ||
 		    (!sb->s_usr_quota_inum && !sb->s_grp_quota_inum))
@@ -1663,6 +2202,10 @@ print_unsupp_features:
 	}
 no_journal:
 
+	if ((ctx->options & E2F_OPT_CONVERT_BMAP) && run_result == 0 &&
+	    ext2fs_test_valid(fs))
+		e2fsck_convert_extents(ctx);
+
 	if (ctx->qctx) {
 		int i, needs_writeout;
 		for (i = 0; i < MAXQUOTAS; i++) {
@@ -1673,7 +2216,8 @@ no_journal:
 			retval = quota_compare_and_update(ctx->qctx, i,
 							  &needs_writeout);
 			if ((retval || needs_writeout) &&
-			    fix_problem(ctx, PR_6_UPDATE_QUOTAS, &pctx))
+			    fix_problem(ctx, PR_6_UPDATE_QUOTAS, &pctx) &&
+			    (retval || quota_update_inode(ctx->qctx, i)))
 				quota_write_inode(ctx->qctx, i);
 		}
 		quota_release_context(&ctx->qctx);
@@ -1702,6 +2246,7 @@ no_journal:
 		fs->flags &= ~EXT2_FLAG_MASTER_SB_ONLY;
 		ext2fs_mark_super_dirty(fs);
 	}
+	report_suppressed_problems(ctx);
 
 #ifdef MTRACE
 	mtrace_print("Cleanup");
@@ -1739,7 +2284,19 @@ no_journal:
 			exit_value = 0;
 	} else {
 		show_stats(ctx);
-		if (!(ctx->options & E2F_OPT_READONLY)) {
+		/*
+		 * A partial check can't vouch for the rest of the file
+		 * system, so it leaves the state and the time of the last
+		 * check alone; it only makes sure that a full check follows
+		 * if it found something it didn't fix.
+		 */
+		if ((ctx->options & E2F_OPT_GROUPS) &&
+		    !(ctx->options & E2F_OPT_READONLY)) {
+			if (!ext2fs_test_valid(fs)) {
+				sb->s_state &= ~EXT2_VALID_FS;
+				ext2fs_mark_super_dirty(fs);
+			}
+		} else if (!(ctx->options & E2F_OPT_READONLY)) {
 			if (ext2fs_test_valid(fs)) {
 				if (!(sb->s_state & EXT2_VALID_FS))
 					exit_value |= FSCK_NONDESTRUCT;
@@ -1768,6 +2325,9 @@ no_journal:
 
 	e2fsck_write_bitmaps(ctx);
 	io_channel_flush(ctx->fs->io);
+	if (ctx->checkpoint_fn && exit_value == FSCK_OK &&
+	    ext2fs_test_valid(fs))
+		e2fsck_save_checkpoint(ctx);
 	print_resource_track(ctx, NULL, &ctx->global_rtrack, ctx->fs->io);
 
 	ext2fs_close(fs);
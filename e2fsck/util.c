@@ -14,9 +14,16 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #ifdef __linux__
 #include <sys/utsname.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
 
 #ifdef HAVE_CONIO_H
 #undef HAVE_TERMIOS_H
@@ -109,6 +116,150 @@ void log_err(e2fsck_t ctx, const char *fmt, ...)
 	}
 }
 
+/*
+ * Return the directory to put scratch files for a data structure of
+ * about the given size in, or NULL if there is none.  The
+ * [scratch_files] directory relation wins; failing that, if the
+ * structure would not fit in the -E max_memory budget, use $TMPDIR or
+ * /tmp.  The caller must free the returned string.
+ */
+char *e2fsck_scratch_dir(e2fsck_t ctx, unsigned long long bytes)
+{
+	char	*dir, *tmp;
+
+	profile_get_string(ctx->profile, "scratch_files", "directory", 0, 0,
+			   &dir);
+	if (dir || !e2fsck_over_memory_budget(ctx, bytes))
+		return dir;
+
+	tmp = getenv("TMPDIR");
+	if (!tmp || !*tmp)
+		tmp = "/tmp";
+	return string_copy(ctx, tmp, 0);
+}
+
+/*
+ * Returns true if a data structure of about the given size should go
+ * into a scratch file because of the -E max_memory limit.  Any one
+ * structure may use up to a quarter of the limit, which leaves room
+ * for the bitmaps and everything else that has to stay in memory.
+ */
+int e2fsck_over_memory_budget(e2fsck_t ctx, unsigned long long bytes)
+{
+	return ctx->max_memory && bytes > ctx->max_memory / 4;
+}
+
+/*
+ * Returns the flag to create an icount with, if its counts can be
+ * kept in a plain array indexed by inode number.  That costs two
+ * bytes per inode for each of the two icounts, which has to fit in the
+ * -E max_memory budget, or without one in an eighth of physical memory.
+ */
+int e2fsck_icount_fullmap_flag(e2fsck_t ctx)
+{
+	unsigned long long	bytes;
+	long			pages = -1, page_size = -1;
+
+	bytes = 2ULL * (ctx->fs->super->s_inodes_count + 1);
+	if (ctx->max_memory)
+		return e2fsck_over_memory_budget(ctx, bytes) ?
+			0 : EXT2_ICOUNT_OPT_FULLMAP;
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+	pages = sysconf(_SC_PHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+#endif
+	if (pages <= 0 || page_size <= 0)
+		return 0;
+	return bytes * 16 <= (unsigned long long) pages * page_size ?
+		EXT2_ICOUNT_OPT_FULLMAP : 0;
+}
+
+/*
+ * Returns 1 if the file system is on a rotational disk, 0 if it is on
+ * one that isn't, and -1 if we can't tell, which is always the case
+ * for image files.
+ */
+static int device_rotational(const char *device)
+{
+#if defined(__linux__) && defined(S_ISBLK) && defined(major)
+	char		path[PATH_MAX], real[PATH_MAX], *cp;
+	struct stat	st;
+	FILE		*f;
+	int		n, val, i;
+
+	if (!device || stat(device, &st) < 0 || !S_ISBLK(st.st_mode))
+		return -1;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+		 (unsigned) major(st.st_rdev), (unsigned) minor(st.st_rdev));
+	if (!realpath(path, real))
+		return -1;
+	/* A partition's directory sits inside the one for its disk */
+	for (i = 0; i < 2; i++) {
+		if (snprintf(path, sizeof(path), "%s/queue/rotational",
+			     real) >= (int) sizeof(path))
+			break;
+		f = fopen(path, "r");
+		if (f) {
+			n = fscanf(f, "%d", &val);
+			fclose(f);
+			return n == 1 ? (val != 0) : -1;
+		}
+		cp = strrchr(real, '/');
+		if (!cp)
+			break;
+		*cp = 0;
+	}
+#endif
+	return -1;
+}
+
+/*
+ * Returns the number of inodes with metadata blocks outside the inode
+ * which pass 1 collects before checking them in block order, unless
+ * -P gave one.  Sorting a big batch saves a lot of seeking on a
+ * rotational disk; a solid state one only needs enough of them to
+ * keep readahead busy.  When we can't tell, keep the traditional 256.
+ * The batch may use up to 1/256th of physical memory, or its share of
+ * the -E max_memory budget.
+ */
+int e2fsck_process_inode_size(e2fsck_t ctx, unsigned int entry_size)
+{
+	unsigned long long	limit = 0;
+	long			pages = -1, page_size = -1;
+	int			size;
+
+	if (ctx->process_inode_size > 0)
+		return ctx->process_inode_size;
+
+	switch (device_rotational(ctx->filesystem_name)) {
+	case 1:
+		size = E2F_PROCESS_INODE_ROT;
+		break;
+	case 0:
+		size = E2F_PROCESS_INODE_NONROT;
+		break;
+	default:
+		size = E2F_PROCESS_INODE_MIN;
+		break;
+	}
+	if (size > (int) ctx->fs->super->s_inodes_count)
+		size = ctx->fs->super->s_inodes_count;
+
+	if (ctx->max_memory)
+		limit = ctx->max_memory / 4;
+	else {
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+		pages = sysconf(_SC_PHYS_PAGES);
+		page_size = sysconf(_SC_PAGESIZE);
+#endif
+		if (pages > 0 && page_size > 0)
+			limit = (unsigned long long) pages * page_size / 256;
+	}
+	if (limit && size > (int) (limit / entry_size))
+		size = limit / entry_size;
+	return size < E2F_PROCESS_INODE_MIN ? E2F_PROCESS_INODE_MIN : size;
+}
+
 void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
 			     const char *description)
 {
@@ -323,8 +474,77 @@ void preenhalt(e2fsck_t ctx)
 	exit(FSCK_UNCORRECTED);
 }
 
+/*
+ * Memory accounting for -t and the stats file.  The big structures
+ * only grow until they are freed, so asking each of them how much it
+ * takes just before the passes free what they are done with, and when
+ * a pass's resources are reported, finds their peaks.  Structures
+ * private to a pass report themselves with e2fsck_mem_account().
+ */
+static const char *mem_owner_names[E2F_MEM_OWNERS] = {
+	"block_found_map", "block_dup_map", "block_ea_map",
+	"inode_used_map", "inode_bad_map", "inode_dir_map",
+	"inode_bb_map", "inode_imagic_map", "inode_reg_map",
+	"fs_block_map", "fs_inode_map", "inode_link_info", "inode_count",
+	"dir_info", "dx_dir_info", "dblist", "refcount", "refcount_extra",
+	"inodes_to_process", "pass1b"
+};
+
+void e2fsck_mem_account(e2fsck_t ctx, int owner, unsigned long long bytes)
+{
+	ctx->mem_usage[owner].cur = bytes;
+	if (bytes > ctx->mem_usage[owner].peak)
+		ctx->mem_usage[owner].peak = bytes;
+}
+
+void e2fsck_mem_sample(e2fsck_t ctx)
+{
+	ext2_filsys	fs = ctx->fs;
+
+	if (!(ctx->options & (E2F_OPT_TIME | E2F_OPT_TIME2)) &&
+	    !ctx->stats_file)
+		return;
+	e2fsck_mem_account(ctx, E2F_MEM_BLOCK_FOUND_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->block_found_map));
+	e2fsck_mem_account(ctx, E2F_MEM_BLOCK_DUP_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->block_dup_map));
+	e2fsck_mem_account(ctx, E2F_MEM_BLOCK_EA_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->block_ea_map));
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_USED_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->inode_used_map));
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_BAD_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->inode_bad_map));
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_DIR_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->inode_dir_map));
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_BB_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->inode_bb_map));
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_IMAGIC_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->inode_imagic_map));
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_REG_MAP,
+			   ext2fs_get_bmap_mem_usage(ctx->inode_reg_map));
+	e2fsck_mem_account(ctx, E2F_MEM_FS_BLOCK_MAP, fs ?
+			   ext2fs_get_bmap_mem_usage(fs->block_map) : 0);
+	e2fsck_mem_account(ctx, E2F_MEM_FS_INODE_MAP, fs ?
+			   ext2fs_get_bmap_mem_usage(fs->inode_map) : 0);
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_LINK_INFO,
+			   ext2fs_get_icount_mem_usage(ctx->inode_link_info));
+	e2fsck_mem_account(ctx, E2F_MEM_INODE_COUNT,
+			   ext2fs_get_icount_mem_usage(ctx->inode_count));
+	e2fsck_mem_account(ctx, E2F_MEM_DIR_INFO,
+			   e2fsck_dir_info_mem_usage(ctx));
+	e2fsck_mem_account(ctx, E2F_MEM_DX_DIR_INFO,
+			   e2fsck_dx_dir_info_mem_usage(ctx));
+	e2fsck_mem_account(ctx, E2F_MEM_DBLIST, fs ?
+			   ext2fs_dblist_mem_usage(fs->dblist) : 0);
+	e2fsck_mem_account(ctx, E2F_MEM_REFCOUNT,
+			   ea_refcount_mem_usage(ctx->refcount));
+	e2fsck_mem_account(ctx, E2F_MEM_REFCOUNT_EXTRA,
+			   ea_refcount_mem_usage(ctx->refcount_extra));
+}
+
 #ifdef RESOURCE_TRACK
-void init_resource_track(struct resource_track *track, io_channel channel)
+void init_resource_track(e2fsck_t ctx, struct resource_track *track,
+			 io_channel channel)
 {
 #ifdef HAVE_GETRUSAGE
 	struct rusage r;
@@ -346,12 +566,38 @@ void init_resource_track(struct resource_track *track, io_channel channel)
 #endif
 	track->bytes_read = 0;
 	track->bytes_written = 0;
+	track->cache_hits = 0;
+	track->cache_misses = 0;
+	track->discards = 0;
+	track->bytes_discarded = 0;
+	track->reads = track->writes = track->flushes = 0;
+	memset(track->read_latency, 0, sizeof(track->read_latency));
+	memset(track->write_latency, 0, sizeof(track->write_latency));
 	if (channel && channel->manager && channel->manager->get_stats)
 		channel->manager->get_stats(channel, &io_start);
 	if (io_start) {
 		track->bytes_read = io_start->bytes_read;
 		track->bytes_written = io_start->bytes_written;
+		if (io_start->num_fields >= 4) {
+			track->cache_hits = io_start->cache_hits;
+			track->cache_misses = io_start->cache_misses;
+		}
+		if (io_start->num_fields >= 6) {
+			track->discards = io_start->discards;
+			track->bytes_discarded = io_start->bytes_discarded;
+		}
+		if (io_start->num_fields >= IO_STATS_NUM_FIELDS) {
+			track->reads = io_start->reads;
+			track->writes = io_start->writes;
+			track->flushes = io_start->flushes;
+			memcpy(track->read_latency, io_start->read_latency,
+			       sizeof(track->read_latency));
+			memcpy(track->write_latency, io_start->write_latency,
+			       sizeof(track->write_latency));
+		}
 	}
+	track->inodes_scanned = ctx->inodes_scanned;
+	track->dir_blocks_checked = ctx->dir_blocks_checked;
 }
 
 #ifdef __GNUC__
@@ -367,6 +613,254 @@ static _INLINE_ float timeval_subtract(struct timeval *tv1,
 		((float) (tv1->tv_usec - tv2->tv_usec)) / 1000000);
 }
 
+static void json_string(FILE *f, const char *str)
+{
+	const unsigned char *cp;
+
+	fputc('"', f);
+	for (cp = (const unsigned char *) str; cp && *cp; cp++) {
+		if (*cp == '"' || *cp == '\\')
+			fprintf(f, "\\%c", *cp);
+		else if (*cp < 0x20)
+			fprintf(f, "\\u%04x", *cp);
+		else
+			fputc(*cp, f);
+	}
+	fputc('"', f);
+}
+
+static void json_latency(FILE *f, const char *name,
+			 const unsigned long long *hist,
+			 const unsigned long long *base)
+{
+	int	b;
+
+	fprintf(f, ", \"%s\": [", name);
+	for (b = 0; b < IO_STATS_LATENCY_BUCKETS; b++)
+		fprintf(f, b ? ", %llu" : "%llu", hist[b] - base[b]);
+	fputc(']', f);
+}
+
+/*
+ * Find the bitmaps which count their operations, which they do when
+ * -tt or a stats file was asked for.  The counts are kept from when
+ * each bitmap was allocated.
+ */
+#define MAX_STATS_BITMAPS	11
+
+static int get_bitmap_stats(e2fsck_t ctx,
+			    struct ext2fs_bmap_statistics *stats)
+{
+	ext2fs_generic_bitmap	maps[MAX_STATS_BITMAPS];
+	int			i, n = 0;
+
+	if (!ctx->fs)
+		return 0;
+	maps[0] = ctx->fs->block_map;
+	maps[1] = ctx->fs->inode_map;
+	maps[2] = ctx->block_found_map;
+	maps[3] = ctx->block_dup_map;
+	maps[4] = ctx->block_ea_map;
+	maps[5] = ctx->inode_used_map;
+	maps[6] = ctx->inode_bad_map;
+	maps[7] = ctx->inode_dir_map;
+	maps[8] = ctx->inode_bb_map;
+	maps[9] = ctx->inode_imagic_map;
+	maps[10] = ctx->inode_reg_map;
+	for (i = 0; i < MAX_STATS_BITMAPS; i++) {
+		if (maps[i] &&
+		    ext2fs_get_bmap_statistics(maps[i], stats + n) == 0)
+			n++;
+	}
+	return n;
+}
+
+static void write_bitmap_stats_json(e2fsck_t ctx, FILE *f)
+{
+	struct ext2fs_bmap_statistics stats[MAX_STATS_BITMAPS], *s;
+	int	i, n;
+
+	n = get_bitmap_stats(ctx, stats);
+	if (!n)
+		return;
+	fputs(", \"bitmaps\": [", f);
+	for (i = 0, s = stats; i < n; i++, s++) {
+		fputs(i ? ", {\"name\": " : "{\"name\": ", f);
+		json_string(f, s->description);
+		fprintf(f, ", \"type\": %d, \"conversions\": %lu"
+			", \"mark\": %lu, \"unmark\": %lu, \"test\": %lu",
+			s->type, s->conversions, s->mark_count,
+			s->unmark_count, s->test_count);
+		fprintf(f, ", \"mark_extent\": %lu, \"unmark_extent\": %lu"
+			", \"test_extent\": %lu",
+			s->mark_ext_count, s->unmark_ext_count,
+			s->test_ext_count);
+		fprintf(f, ", \"set_range\": %lu, \"get_range\": %lu"
+			", \"clear\": %lu, \"copy\": %lu, \"resize\": %lu",
+			s->set_range_count, s->get_range_count,
+			s->clear_count, s->copy_count, s->resize_count);
+		fprintf(f, ", \"mark_seq\": %lu, \"test_seq\": %lu"
+			", \"mem_kb\": %lu}",
+			s->mark_seq, s->test_seq,
+			(unsigned long) (s->mem_usage + 1023) / 1024);
+	}
+	fputc(']', f);
+}
+
+static void print_bitmap_stats(e2fsck_t ctx, const char *desc)
+{
+	struct ext2fs_bmap_statistics stats[MAX_STATS_BITMAPS], *s;
+	int	i, n;
+
+	n = get_bitmap_stats(ctx, stats);
+	for (i = 0, s = stats; i < n; i++, s++) {
+		log_out(ctx, "%s: ", desc);
+		log_out(ctx, _("bitmap %s: %lu marks, %lu unmarks, "
+			       "%lu tests, %lu extent ops, %lu range ops, "
+			       "%luk\n"),
+			s->description ? s->description : "?",
+			s->mark_count, s->unmark_count, s->test_count,
+			s->mark_ext_count + s->unmark_ext_count +
+			s->test_ext_count,
+			s->set_range_count + s->get_range_count,
+			(unsigned long) (s->mem_usage + 1023) / 1024);
+	}
+}
+
+static void write_mem_usage_json(e2fsck_t ctx, FILE *f)
+{
+	struct e2fsck_mem_usage	*m;
+	int			i, n = 0;
+
+	fputs(", \"memory\": {", f);
+	for (i = 0, m = ctx->mem_usage; i < E2F_MEM_OWNERS; i++, m++) {
+		if (!m->peak)
+			continue;
+		fprintf(f, "%s\"%s\": {\"cur\": %llu, \"peak\": %llu}",
+			n++ ? ", " : "", mem_owner_names[i], m->cur, m->peak);
+	}
+	fputc('}', f);
+}
+
+/*
+ * Print the memory taken by each structure which has taken any; for the
+ * whole run (desc NULL), only the peaks mean anything.
+ */
+static void print_mem_usage(e2fsck_t ctx, const char *desc)
+{
+	struct e2fsck_mem_usage	*m;
+	int			i, n = 0;
+
+	for (i = 0, m = ctx->mem_usage; i < E2F_MEM_OWNERS; i++, m++) {
+		if (!m->peak)
+			continue;
+		if (!n++) {
+			if (desc)
+				log_out(ctx, "%s: ", desc);
+			log_out(ctx, "%s", desc ? _("Memory by structure:") :
+				_("Peak memory by structure:"));
+		}
+		if (desc)
+			log_out(ctx, " %s %lluk/%lluk", mem_owner_names[i],
+				(m->cur + 1023) / 1024,
+				(m->peak + 1023) / 1024);
+		else
+			log_out(ctx, " %s %lluk", mem_owner_names[i],
+				(m->peak + 1023) / 1024);
+	}
+	if (n)
+		log_out(ctx, "\n");
+}
+
+/*
+ * Append one line describing the resources used by a pass (or, if
+ * desc is NULL, by the whole run) to the stats file, as a JSON object.
+ */
+static void write_stats_json(e2fsck_t ctx, const char *desc,
+			     struct resource_track *track,
+			     io_channel channel)
+{
+	FILE		*f = ctx->stats_file;
+	struct timeval	time_end;
+	io_stats	stats = 0;
+	unsigned long long bytes_read = 0, bytes_written = 0;
+	unsigned long long hits = 0, misses = 0;
+	unsigned long long discards = 0, bytes_discarded = 0;
+	double		elapsed, user = 0, sys = 0, io_wait;
+	long		max_rss = 0;
+	int		blocksize;
+#ifdef HAVE_GETRUSAGE
+	struct rusage	r;
+#endif
+
+	gettimeofday(&time_end, 0);
+	elapsed = timeval_subtract(&time_end, &track->time_start);
+#ifdef HAVE_GETRUSAGE
+	getrusage(RUSAGE_SELF, &r);
+	user = timeval_subtract(&r.ru_utime, &track->user_start);
+	sys = timeval_subtract(&r.ru_stime, &track->system_start);
+	max_rss = r.ru_maxrss;
+#endif
+	/* Whatever wasn't spent on the CPU was spent waiting, mostly on I/O */
+	io_wait = elapsed - user - sys;
+	if (io_wait < 0)
+		io_wait = 0;
+
+	if (channel->manager && channel->manager->get_stats)
+		channel->manager->get_stats(channel, &stats);
+	if (stats) {
+		bytes_read = stats->bytes_read - track->bytes_read;
+		bytes_written = stats->bytes_written - track->bytes_written;
+		if (stats->num_fields >= 4) {
+			hits = stats->cache_hits - track->cache_hits;
+			misses = stats->cache_misses - track->cache_misses;
+		}
+		if (stats->num_fields >= 6) {
+			discards = stats->discards - track->discards;
+			bytes_discarded = stats->bytes_discarded -
+				track->bytes_discarded;
+		}
+		if (stats->num_fields < IO_STATS_NUM_FIELDS)
+			stats = 0;
+	}
+	blocksize = channel->block_size ? channel->block_size : 1;
+
+	fputs("{\"device\": ", f);
+	json_string(f, ctx->device_name ? ctx->device_name :
+		    ctx->filesystem_name);
+	fputs(", \"pass\": ", f);
+	json_string(f, desc ? desc : "total");
+	fprintf(f, ", \"elapsed\": %.3f, \"user\": %.3f, "
+		"\"system\": %.3f, \"io_wait\": %.3f",
+		elapsed, user, sys, io_wait);
+	fprintf(f, ", \"bytes_read\": %llu, \"bytes_written\": %llu"
+		", \"blocks_read\": %llu, \"blocks_written\": %llu",
+		bytes_read, bytes_written,
+		bytes_read / blocksize, bytes_written / blocksize);
+	fprintf(f, ", \"cache_hits\": %llu, \"cache_misses\": %llu",
+		hits, misses);
+	fprintf(f, ", \"discards\": %llu, \"bytes_discarded\": %llu",
+		discards, bytes_discarded);
+	if (stats) {
+		fprintf(f, ", \"reads\": %llu, \"writes\": %llu"
+			", \"flushes\": %llu",
+			stats->reads - track->reads,
+			stats->writes - track->writes,
+			stats->flushes - track->flushes);
+		json_latency(f, "read_latency_us", stats->read_latency,
+			     track->read_latency);
+		json_latency(f, "write_latency_us", stats->write_latency,
+			     track->write_latency);
+	}
+	fprintf(f, ", \"inodes\": %llu, \"dir_blocks\": %llu",
+		ctx->inodes_scanned - track->inodes_scanned,
+		ctx->dir_blocks_checked - track->dir_blocks_checked);
+	write_bitmap_stats_json(ctx, f);
+	write_mem_usage_json(ctx, f);
+	fprintf(f, ", \"max_rss_kb\": %ld}\n", max_rss);
+	fflush(f);
+}
+
 void print_resource_track(e2fsck_t ctx, const char *desc,
 			  struct resource_track *track, io_channel channel)
 {
@@ -378,6 +872,11 @@ void print_resource_track(e2fsck_t ctx, const char *desc,
 #endif
 	struct timeval time_end;
 
+	if (channel)
+		e2fsck_mem_sample(ctx);
+	if (ctx->stats_file && channel)
+		write_stats_json(ctx, desc, track, channel);
+
 	if ((desc && !(ctx->options & E2F_OPT_TIME2)) ||
 	    (!desc && !(ctx->options & E2F_OPT_TIME)))
 		return;
@@ -431,10 +930,88 @@ void print_resource_track(e2fsck_t ctx, const char *desc,
 			mbytes(bytes_read), mbytes(bytes_written),
 			(double)mbytes(bytes_read + bytes_written) /
 			timeval_subtract(&time_end, &track->time_start));
+		if (delta && delta->num_fields >= IO_STATS_NUM_FIELDS &&
+		    (delta->reads != track->reads ||
+		     delta->writes != track->writes)) {
+			if (desc)
+				log_out(ctx, "%s: ", desc);
+			log_out(ctx, _("I/O requests: %llu reads "
+				       "(50%% under %lluus, 99%% under %lluus), "
+				       "%llu writes (50%% under %lluus, "
+				       "99%% under %lluus), %llu flushes\n"),
+				delta->reads - track->reads,
+				io_stats_latency(delta->read_latency,
+						 track->read_latency, 50),
+				io_stats_latency(delta->read_latency,
+						 track->read_latency, 99),
+				delta->writes - track->writes,
+				io_stats_latency(delta->write_latency,
+						 track->write_latency, 50),
+				io_stats_latency(delta->write_latency,
+						 track->write_latency, 99),
+				delta->flushes - track->flushes);
+		}
+		if (delta && delta->num_fields >= 6 &&
+		    delta->discards != track->discards) {
+			if (desc)
+				log_out(ctx, "%s: ", desc);
+			log_out(ctx, _("Discarded: %llu extents, %lluMB\n"),
+				delta->discards - track->discards,
+				mbytes(delta->bytes_discarded -
+				       track->bytes_discarded));
+		}
 	}
+	if (desc && channel)
+		print_bitmap_stats(ctx, desc);
+	if (channel)
+		print_mem_usage(ctx, desc);
 }
 #endif /* RESOURCE_TRACK */
 
+/*
+ * Is this block group one of those being checked?  Without -E groups,
+ * they all are.
+ */
+int e2fsck_group_in_scope(e2fsck_t ctx, dgrp_t group)
+{
+	if (!(ctx->options & E2F_OPT_GROUPS))
+		return 1;
+	return (group >= ctx->scope_first_group &&
+		group <= ctx->scope_last_group);
+}
+
+int e2fsck_ino_in_scope(e2fsck_t ctx, ext2_ino_t ino)
+{
+	return e2fsck_group_in_scope(ctx, (ino - 1) /
+				     ctx->fs->super->s_inodes_per_group);
+}
+
+/*
+ * Is this inode in use, as far as pass 1 is concerned?  For the inodes
+ * it scanned, inode_used_map says.  The others are only looked at when
+ * something in a partial check's groups refers to them, and are judged
+ * the way pass 1 would have: by whether they still have links, unless
+ * their group's inode table has never been used.  If one can't be
+ * read, give it the benefit of the doubt, since it isn't ours to clear.
+ */
+int e2fsck_scope_inode_in_use(e2fsck_t ctx, ext2_ino_t ino)
+{
+	ext2_filsys		fs = ctx->fs;
+	struct ext2_inode	inode;
+	dgrp_t			group;
+
+	if (e2fsck_ino_in_scope(ctx, ino))
+		return ext2fs_test_inode_bitmap2(ctx->inode_used_map, ino);
+	group = (ino - 1) / fs->super->s_inodes_per_group;
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+		return 0;
+	if (ext2fs_read_inode(fs, ino, &inode))
+		return 1;
+	return inode.i_links_count != 0;
+}
+
 void e2fsck_read_inode(e2fsck_t ctx, unsigned long ino,
 			      struct ext2_inode * inode, const char *proc)
 {
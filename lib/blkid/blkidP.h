@@ -62,6 +62,7 @@ struct blkid_struct_tag
 {
 	struct list_head	bit_tags;	/* All tags for this device */
 	struct list_head	bit_names;	/* All tags with given NAME */
+	struct list_head	bit_hash;	/* Tags in same NAME=value bucket */
 	char			*bit_name;	/* NAME of tag (shared) */
 	char			*bit_val;	/* value of tag */
 	blkid_dev		bit_dev;	/* pointer to device */
@@ -96,8 +97,15 @@ struct blkid_struct_cache
 	time_t			bic_ftime; 	/* Mod time of the cachefile */
 	unsigned int		bic_flags;	/* Status flags of the cache */
 	char			*bic_filename;	/* filename of cache */
+	struct list_head	*bic_hash;	/* NAME=value index of all tags */
 };
 
+/*
+ * Number of buckets in bic_hash.  If it could not be allocated,
+ * lookups fall back to walking the list of tags with the given NAME.
+ */
+#define BLKID_HASH_SIZE		256
+
 #define BLKID_BIC_FL_PROBED	0x0002	/* We probed /proc/partition devices */
 #define BLKID_BIC_FL_CHANGED	0x0004	/* Cache has changed from disk */
 
@@ -152,6 +160,10 @@ extern void blkid_debug_dump_dev(blkid_dev dev);
 extern void blkid_debug_dump_tag(blkid_tag tag);
 #endif
 
+/* devname.c */
+extern int blkid__probe_tag_link(blkid_cache cache, const char *type,
+				 const char *value);
+
 /* devno.c */
 struct dir_list {
 	char	*name;
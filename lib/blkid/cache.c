@@ -103,6 +103,14 @@ int blkid_get_cache(blkid_cache *ret_cache, const char *filename)
 	INIT_LIST_HEAD(&cache->bic_devs);
 	INIT_LIST_HEAD(&cache->bic_tags);
 
+	cache->bic_hash = malloc(BLKID_HASH_SIZE * sizeof(struct list_head));
+	if (cache->bic_hash) {
+		int i;
+
+		for (i = 0; i < BLKID_HASH_SIZE; i++)
+			INIT_LIST_HEAD(&cache->bic_hash[i]);
+	}
+
 	if (filename && !strlen(filename))
 		filename = 0;
 	if (!filename)
@@ -152,6 +160,7 @@ void blkid_put_cache(blkid_cache cache)
 		blkid_free_tag(tag);
 	}
 	free(cache->bic_filename);
+	free(cache->bic_hash);
 
 	free(cache);
 }
@@ -35,9 +35,11 @@
 #if HAVE_SYS_MKDEV_H
 #include <sys/mkdev.h>
 #endif
+#include <fcntl.h>
 #include <time.h>
 
 #include "blkidP.h"
+#include "probe.h"
 
 /*
  * Find a dev struct in the cache by device name, if available.
@@ -388,6 +390,76 @@ evms_probe_all(blkid_cache cache, int only_if_new)
 	return num;
 }
 
+/*
+ * Probing reads the start of each device in turn, so with many disks
+ * most of the time goes into waiting for one disk after another.
+ * Before probing starts, ask the kernel to read the start of all of
+ * them at once.  The devices are kept open until probing is done,
+ * since a block device's page cache may be dropped when its last user
+ * closes it.
+ */
+#define PREFETCH_MAX	256
+
+struct prefetch_list {
+	int	nr;
+	int	fd[PREFETCH_MAX];
+};
+
+static void prefetch_devices(blkid_cache cache, int only_if_new,
+			     struct prefetch_list *pf)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	FILE *proc;
+	char line[1024], ptname[128], device[256];
+	unsigned long long sz;
+	struct list_head *p;
+	struct stat st;
+	dev_t devno;
+	int ma, mi, fd;
+
+	pf->nr = 0;
+	proc = fopen(PROC_PARTITIONS, "r");
+	if (!proc)
+		return;
+	while (pf->nr < PREFETCH_MAX && fgets(line, sizeof(line), proc)) {
+		if (sscanf(line, " %d %d %llu %127[^\n ]",
+			   &ma, &mi, &sz, ptname) != 4 || sz <= 1)
+			continue;
+		devno = makedev(ma, mi);
+		if (only_if_new) {
+			list_for_each(p, &cache->bic_devs) {
+				blkid_dev tmp = list_entry(p,
+					struct blkid_struct_dev, bid_devs);
+				if (tmp->bid_devno == devno)
+					break;
+			}
+			if (p != &cache->bic_devs)
+				continue;
+		}
+		sprintf(device, "/dev/%s", ptname);
+		if (stat(device, &st) || !S_ISBLK(st.st_mode) ||
+		    st.st_rdev != devno)
+			continue;
+		fd = open(device, O_RDONLY);
+		if (fd < 0)
+			continue;
+		DBG(DEBUG_DEVNAME, printf("prefetching %s\n", device));
+		(void) posix_fadvise(fd, 0, SB_BUFFER_SIZE,
+				     POSIX_FADV_WILLNEED);
+		pf->fd[pf->nr++] = fd;
+	}
+	fclose(proc);
+#else
+	pf->nr = 0;
+#endif
+}
+
+static void prefetch_done(struct prefetch_list *pf)
+{
+	while (pf->nr > 0)
+		close(pf->fd[--pf->nr]);
+}
+
 /*
  * Read the device data for all available block devices in the system.
  */
@@ -403,6 +475,7 @@ static int probe_all(blkid_cache cache, int only_if_new)
 	int lens[2] = { 0, 0 };
 	int which = 0, last = 0;
 	struct list_head *p, *pnext;
+	struct prefetch_list pf;
 
 	ptnames[0] = ptname0;
 	ptnames[1] = ptname1;
@@ -424,6 +497,8 @@ static int probe_all(blkid_cache cache, int only_if_new)
 	if (!proc)
 		return -BLKID_ERR_PROC;
 
+	prefetch_devices(cache, only_if_new, &pf);
+
 	while (fgets(line, sizeof(line), proc)) {
 		last = which;
 		which ^= 1;
@@ -504,6 +579,7 @@ static int probe_all(blkid_cache cache, int only_if_new)
 	if (lens[which])
 		probe_one(cache, ptname, devs[which], 0, only_if_new);
 
+	prefetch_done(&pf);
 	fclose(proc);
 	blkid_flush_cache(cache);
 	return 0;
@@ -531,6 +607,61 @@ int blkid_probe_all_new(blkid_cache cache)
 	return ret;
 }
 
+/*
+ * udev keeps a symlink to each device under /dev/disk/by-uuid and
+ * /dev/disk/by-label, named after the tag with the characters which
+ * can't go in a file name written as \xNN.  If there is one for the
+ * tag being looked for, probing the one device it points to is much
+ * cheaper than probing all of them.  Returns 1 if a device was
+ * probed; the caller still has to check that it has the tag.
+ */
+int blkid__probe_tag_link(blkid_cache cache, const char *type,
+			  const char *value)
+{
+	const char	*dir, *ptname, *cp;
+	char		*path, *p, target[256];
+	struct stat	st;
+	ssize_t		len;
+	int		ret = 0;
+
+	if (!strcmp(type, "UUID"))
+		dir = "by-uuid";
+	else if (!strcmp(type, "LABEL"))
+		dir = "by-label";
+	else
+		return 0;
+
+	path = malloc(strlen(dir) + 4 * strlen(value) + 16);
+	if (!path)
+		return 0;
+	p = path + sprintf(path, "/dev/disk/%s/", dir);
+	for (cp = value; *cp; cp++) {
+		if (isalnum((unsigned char) *cp) || strchr("#+-.:=@_", *cp) ||
+		    (unsigned char) *cp >= 0x80)
+			*p++ = *cp;
+		else
+			p += sprintf(p, "\\x%02x", (unsigned char) *cp);
+	}
+	*p = 0;
+
+	if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+		goto out;
+	len = readlink(path, target, sizeof(target) - 1);
+	if (len <= 0)
+		goto out;
+	target[len] = 0;
+	ptname = strrchr(target, '/');
+	ptname = ptname ? ptname + 1 : target;
+
+	DBG(DEBUG_PROBE, printf("probing %s for %s=%s\n", ptname,
+				type, value));
+	probe_one(cache, ptname, st.st_rdev, 0, 0);
+	ret = 1;
+out:
+	free(path);
+	return ret;
+}
+
 
 #ifdef TEST_PROGRAM
 int main(int argc, char **argv)
@@ -1522,10 +1522,11 @@ static struct blkid_magic type_array[] = {
  */
 blkid_dev blkid_verify(blkid_cache cache, blkid_dev dev)
 {
-	struct blkid_magic *id;
+	struct blkid_magic *id, *last;
 	struct blkid_probe probe;
 	blkid_tag_iterate iter;
-	unsigned char *buf;
+	unsigned char *buf = NULL;
+	int last_match = 0;
 	const char *type, *value;
 	struct stat st;
 	time_t now;
@@ -1597,19 +1598,36 @@ try_again:
 			goto found_type;
 		}
 	}
+	last = NULL;
 	for (id = type_array; id->bim_type; id++) {
 		if (dev->bid_type &&
 		    strcmp(id->bim_type, dev->bid_type))
 			continue;
 
-		idx = id->bim_kboff + (id->bim_sboff >> 10);
-		buf = get_buffer(&probe, idx << 10, 1024);
-		if (!buf)
-			continue;
-
-		if (memcmp(id->bim_magic, buf + (id->bim_sboff & 0x3ff),
-			   id->bim_len))
-			continue;
+		/*
+		 * Several types often share a magic (ext2/3/4, hfs and
+		 * hfsplus, ...); don't compare it again for each of them.
+		 */
+		if (last && last->bim_kboff == id->bim_kboff &&
+		    last->bim_sboff == id->bim_sboff &&
+		    last->bim_len == id->bim_len &&
+		    !memcmp(last->bim_magic, id->bim_magic, id->bim_len)) {
+			if (!last_match)
+				continue;
+		} else {
+			last = id;
+			last_match = 0;
+			idx = id->bim_kboff + (id->bim_sboff >> 10);
+			buf = get_buffer(&probe, idx << 10, 1024);
+			if (!buf)
+				continue;
+
+			if (memcmp(id->bim_magic,
+				   buf + (id->bim_sboff & 0x3ff),
+				   id->bim_len))
+				continue;
+			last_match = 1;
+		}
 
 		if ((id->bim_probe == NULL) ||
 		    (id->bim_probe(&probe, id, buf) == 0)) {
@@ -18,7 +18,12 @@
 
 struct blkid_magic;
 
-#define SB_BUFFER_SIZE		0x11000
+/*
+ * The first read from a device has to cover the deepest magic in
+ * type_array (zfs at 264k), so that every magic check is served from
+ * the same buffer.
+ */
+#define SB_BUFFER_SIZE		0x42400
 
 struct blkid_probe {
 	int			fd;
@@ -26,10 +26,37 @@ static blkid_tag blkid_new_tag(void)
 
 	INIT_LIST_HEAD(&tag->bit_tags);
 	INIT_LIST_HEAD(&tag->bit_names);
+	INIT_LIST_HEAD(&tag->bit_hash);
 
 	return tag;
 }
 
+static unsigned int blkid_tag_hash(const char *name, const char *value)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = hash * 31 + (unsigned char) *name++;
+	hash = hash * 31 + '=';
+	while (*value)
+		hash = hash * 31 + (unsigned char) *value++;
+	return hash % BLKID_HASH_SIZE;
+}
+
+/*
+ * Add a tag to the NAME=value index of its device's cache.
+ */
+static void blkid_hash_tag(blkid_tag tag)
+{
+	blkid_cache cache = tag->bit_dev->bid_cache;
+
+	if (!cache || !cache->bic_hash)
+		return;
+	list_add_tail(&tag->bit_hash,
+		      &cache->bic_hash[blkid_tag_hash(tag->bit_name,
+						      tag->bit_val)]);
+}
+
 #ifdef CONFIG_BLKID_DEBUG
 void blkid_debug_dump_tag(blkid_tag tag)
 {
@@ -53,6 +80,7 @@ void blkid_free_tag(blkid_tag tag)
 
 	list_del(&tag->bit_tags);	/* list of tags for this device */
 	list_del(&tag->bit_names);	/* list of tags with this type */
+	list_del(&tag->bit_hash);	/* index of tags by value */
 
 	free(tag->bit_name);
 	free(tag->bit_val);
@@ -163,6 +191,8 @@ int blkid_set_tag(blkid_dev dev, const char *name,
 		}
 		free(t->bit_val);
 		t->bit_val = val;
+		list_del_init(&t->bit_hash);
+		blkid_hash_tag(t);
 	} else {
 		/* Existing tag not present, add to device */
 		if (!(t = blkid_new_tag()))
@@ -190,6 +220,7 @@ int blkid_set_tag(blkid_dev dev, const char *name,
 					      &dev->bid_cache->bic_tags);
 			}
 			list_add_tail(&t->bit_names, &head->bit_names);
+			blkid_hash_tag(t);
 		}
 	}
 
@@ -334,6 +365,7 @@ extern blkid_dev blkid_find_dev_with_tag(blkid_cache cache,
 	int		pri;
 	struct list_head *p;
 	int		probe_new = 0;
+	int		probe_link = 0;
 
 	if (!cache || !type || !value)
 		return NULL;
@@ -345,9 +377,24 @@ extern blkid_dev blkid_find_dev_with_tag(blkid_cache cache,
 try_again:
 	pri = -1;
 	dev = 0;
-	head = blkid_find_head_cache(cache, type);
 
-	if (head) {
+	if (cache->bic_hash) {
+		struct list_head *bucket;
+
+		bucket = &cache->bic_hash[blkid_tag_hash(type, value)];
+		list_for_each(p, bucket) {
+			blkid_tag tmp = list_entry(p, struct blkid_struct_tag,
+						   bit_hash);
+
+			if (!strcmp(tmp->bit_name, type) &&
+			    !strcmp(tmp->bit_val, value) &&
+			    (tmp->bit_dev->bid_pri > pri) &&
+			    !access(tmp->bit_dev->bid_name, F_OK)) {
+				dev = tmp->bit_dev;
+				pri = dev->bid_pri;
+			}
+		}
+	} else if ((head = blkid_find_head_cache(cache, type))) {
 		list_for_each(p, &head->bit_names) {
 			blkid_tag tmp = list_entry(p, struct blkid_struct_tag,
 						   bit_names);
@@ -366,6 +413,13 @@ try_again:
 			goto try_again;
 	}
 
+	/* udev may already know where the tag is */
+	if (!dev && !probe_link) {
+		probe_link++;
+		if (blkid__probe_tag_link(cache, type, value))
+			goto try_again;
+	}
+
 	if (!dev && !probe_new) {
 		if (blkid_probe_all_new(cache) < 0)
 			return NULL;
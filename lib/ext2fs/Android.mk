@@ -12,6 +12,7 @@ libext2fs_src_files := \
 	bitops.c \
 	blkmap64_ba.c \
 	blkmap64_rb.c \
+	blkmap64_rt.c \
 	blknum.c \
 	block.c \
 	bmap.c \
@@ -21,7 +22,9 @@ libext2fs_src_files := \
 	csum.c \
 	dblist.c \
 	dblist_dir.c \
+	dirbuild.c \
 	dirblock.c \
+	dir_cursor.c \
 	dirhash.c \
 	dir_iterate.c \
 	dupfs.c \
@@ -32,11 +35,14 @@ libext2fs_src_files := \
 	finddev.c \
 	flushb.c \
 	freefs.c \
+	freespace.c \
+	gdcache.c \
 	gen_bitmap.c \
 	gen_bitmap64.c \
 	get_pathname.c \
 	getsize.c \
 	getsectsize.c \
+	http_io.c \
 	i_block.c \
 	icount.c \
 	ind_block.c \
@@ -55,16 +61,22 @@ libext2fs_src_files := \
 	native.c \
 	newdir.c \
 	openfs.c \
+	parscan.c \
 	progress.c \
 	punch.c \
 	qcow2.c \
+	qcow2_io.c \
 	read_bb.c \
 	read_bb_file.c \
 	res_gdt.c \
 	rw_bitmaps.c \
+	stage_io.c \
 	swapfs.c \
 	symlink.c \
 	tdb.c \
+	template_io.c \
+	throttle_io.c \
+	trace_io.c \
 	undo_io.c \
 	unix_io.c \
 	unlink.c \
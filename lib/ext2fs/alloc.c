@@ -24,6 +24,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 /*
  * Check for uninit block bitmaps and deal with them appropriately
@@ -74,6 +75,34 @@ static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 	ext2fs_mark_bb_dirty(fs);
 }
 
+/*
+ * The bitmap of a BLOCK_UNINIT group reads as all free, including its
+ * superblock and group tables, until check_block_uninit() has set it
+ * up.  Code which looks for a free run in the bitmap itself, rather
+ * than going through ext2fs_new_block2(), must do that for every
+ * group the run it found touches.  Returns 1 if any group had to be
+ * set up, in which case the search should be repeated.
+ */
+int ext2fs_init_block_uninit_range(ext2_filsys fs, ext2fs_block_bitmap map,
+				   blk64_t blk, blk64_t num)
+{
+	dgrp_t	group, last;
+	int	ret = 0;
+
+	if (!num || !EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+		return 0;
+
+	last = ext2fs_group_of_blk2(fs, blk + num - 1);
+	for (group = ext2fs_group_of_blk2(fs, blk); group <= last; group++) {
+		if (!ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT))
+			continue;
+		check_block_uninit(fs, map, group);
+		ret = 1;
+	}
+	return ret;
+}
+
 /*
  * Check for uninit inode bitmaps and deal with them appropriately
  */
@@ -99,19 +128,116 @@ static void check_inode_uninit(ext2_filsys fs, ext2fs_inode_bitmap map,
 }
 
 /*
- * Right now, just search forward from the parent directory's block
- * group to find the next free inode.
- *
- * Should have a special policy for directories.
+ * Returns the inode allocation cursor, set up afresh if fs->inode_map
+ * or the number of groups has changed since it was last used, or NULL
+ * if there is no memory for it.
+ */
+struct ext2_inode_cursor *ext2fs_inode_cursor(ext2_filsys fs)
+{
+	struct ext2_inode_cursor *cursor = fs->inode_cursor;
+	ext2_ino_t	ipg = EXT2_INODES_PER_GROUP(fs->super);
+	dgrp_t		g;
+
+	if (cursor && cursor->map == fs->inode_map &&
+	    cursor->num_groups == fs->group_desc_count)
+		return cursor;
+	if (!cursor || cursor->num_groups != fs->group_desc_count) {
+		if (cursor)
+			ext2fs_free_mem(&fs->inode_cursor);
+		if (ext2fs_get_memzero(sizeof(struct ext2_inode_cursor) +
+				       fs->group_desc_count *
+				       sizeof(ext2_ino_t), &cursor))
+			return NULL;
+		cursor->num_groups = fs->group_desc_count;
+		fs->inode_cursor = cursor;
+	}
+	cursor->map = fs->inode_map;
+	for (g = 0; g < cursor->num_groups; g++) {
+		cursor->next[g] = g * ipg + 1;
+		if (cursor->next[g] < EXT2_FIRST_INODE(fs->super))
+			cursor->next[g] = EXT2_FIRST_INODE(fs->super);
+	}
+	return cursor;
+}
+
+/*
+ * With EXT2_FLAG_SPREAD_DIRS, pick the group for a new directory the
+ * way the kernel's Orlov allocator does: a directory at the top of the
+ * tree goes to the group with the fewest directories of those with at
+ * least the average number of free inodes and blocks, so that
+ * unrelated trees end up apart, and one further down goes to the first
+ * group from its parent's on which isn't much fuller than the average,
+ * so that it stays near its parent.
+ */
+static dgrp_t find_dir_group(ext2_filsys fs, ext2_ino_t dir)
+{
+	struct ext2_inode_cursor *cursor = ext2fs_inode_cursor(fs);
+	dgrp_t		ngroups = fs->group_desc_count;
+	dgrp_t		parent, g, i, best = ngroups;
+	ext2_ino_t	ipg = EXT2_INODES_PER_GROUP(fs->super);
+	__u64		avefreei, avefreeb, ndirs = 0;
+	__u64		max_dirs, min_inodes, min_blocks;
+
+	parent = dir ? (dir - 1) / ipg : 0;
+	if (parent >= ngroups)
+		parent = 0;
+	for (g = 0; g < ngroups; g++)
+		ndirs += ext2fs_bg_used_dirs_count(fs, g);
+	avefreei = fs->super->s_free_inodes_count / ngroups;
+	avefreeb = ext2fs_free_blocks_count(fs->super) / ngroups;
+
+	if (dir == 0 || dir == EXT2_ROOT_INO) {
+		/* Start after the last one, so that ties go round */
+		parent = cursor ? cursor->dir_group + 1 : 0;
+		for (i = 0; i < ngroups; i++) {
+			g = (parent + i) % ngroups;
+			if (!ext2fs_bg_free_inodes_count(fs, g) ||
+			    ext2fs_bg_free_inodes_count(fs, g) < avefreei ||
+			    ext2fs_bg_free_blocks_count(fs, g) < avefreeb)
+				continue;
+			if (best == ngroups ||
+			    ext2fs_bg_used_dirs_count(fs, g) <
+			    ext2fs_bg_used_dirs_count(fs, best))
+				best = g;
+		}
+		if (best == ngroups)
+			return parent % ngroups;
+		if (cursor)
+			cursor->dir_group = best;
+		return best;
+	}
+
+	max_dirs = ndirs / ngroups + ipg / 16;
+	min_inodes = avefreei > ipg / 4 ? avefreei - ipg / 4 : 1;
+	min_blocks = avefreeb > fs->super->s_blocks_per_group / 4 ?
+		avefreeb - fs->super->s_blocks_per_group / 4 : 0;
+	for (i = 0; i < ngroups; i++) {
+		g = (parent + i) % ngroups;
+		if (ext2fs_bg_used_dirs_count(fs, g) < max_dirs &&
+		    ext2fs_bg_free_inodes_count(fs, g) >= min_inodes &&
+		    ext2fs_bg_free_blocks_count(fs, g) >= min_blocks)
+			return g;
+	}
+	return parent;
+}
+
+/*
+ * Search forward from the parent directory's block group to find the
+ * next free inode.  When allocating from fs->inode_map, the search in
+ * each group starts at the cursor, which moves past the inodes found
+ * in use, so that creating many inodes one after another doesn't test
+ * the same bits over and over.  If that finds nothing, the cursor is
+ * reset and the search repeated from the start of each group.
  */
-errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
-			   int mode EXT2FS_ATTR((unused)),
+errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir, int mode,
 			   ext2fs_inode_bitmap map, ext2_ino_t *ret)
 {
+	struct ext2_inode_cursor *cursor = NULL;
 	ext2_ino_t	start_inode = 0;
-	ext2_ino_t	i, ino_in_group, upto, first_zero;
+	ext2_ino_t	i, ino_in_group, upto, first_zero, from;
 	errcode_t	retval;
 	dgrp_t		group;
+	int		rescan = 0;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -119,8 +245,13 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 		map = fs->inode_map;
 	if (!map)
 		return EXT2_ET_NO_INODE_BITMAP;
+	if (map == fs->inode_map)
+		cursor = ext2fs_inode_cursor(fs);
 
-	if (dir > 0) {
+	if ((fs->flags & EXT2_FLAG_SPREAD_DIRS) && LINUX_S_ISDIR(mode)) {
+		group = find_dir_group(fs, dir);
+		start_inode = (group * EXT2_INODES_PER_GROUP(fs->super)) + 1;
+	} else if (dir > 0) {
 		group = (dir - 1) / EXT2_INODES_PER_GROUP(fs->super);
 		start_inode = (group * EXT2_INODES_PER_GROUP(fs->super)) + 1;
 	}
@@ -128,6 +259,7 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 		start_inode = EXT2_FIRST_INODE(fs->super);
 	if (start_inode > fs->super->s_inodes_count)
 		return EXT2_ET_INODE_ALLOC_FAIL;
+retry:
 	i = start_inode;
 	do {
 		ino_in_group = (i - 1) % EXT2_INODES_PER_GROUP(fs->super);
@@ -140,34 +272,61 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 		if (upto > fs->super->s_inodes_count)
 			upto = fs->super->s_inodes_count;
 
-		retval = ext2fs_find_first_zero_inode_bitmap2(map, i, upto,
-							      &first_zero);
+		from = i;
+		if (cursor && cursor->next[group] > from)
+			from = cursor->next[group];
+		retval = ENOENT;
+		if (from <= upto)
+			retval = ext2fs_find_first_zero_inode_bitmap2(map,
+							from, upto,
+							&first_zero);
 		if (retval == 0) {
+			if (cursor && from == cursor->next[group])
+				cursor->next[group] = first_zero;
 			i = first_zero;
 			break;
 		}
 		if (retval != ENOENT)
 			return EXT2_ET_INODE_ALLOC_FAIL;
+		/* The whole group is in use */
+		if (cursor && from == cursor->next[group] &&
+		    upto % EXT2_INODES_PER_GROUP(fs->super) == 0)
+			cursor->next[group] = upto + 1;
 		i = upto + 1;
 		if (i > fs->super->s_inodes_count)
 			i = EXT2_FIRST_INODE(fs->super);
 	} while (i != start_inode);
 
-	if (ext2fs_test_inode_bitmap2(map, i))
+	if (ext2fs_test_inode_bitmap2(map, i)) {
+		/*
+		 * An inode cleared in the bitmap directly, without
+		 * ext2fs_inode_alloc_stats2(), may be below the cursor.
+		 * Start the cursor again at the bottom of each group and
+		 * search once more before giving up.
+		 */
+		if (cursor && !rescan) {
+			cursor->map = NULL;
+			cursor = ext2fs_inode_cursor(fs);
+			rescan = 1;
+			goto retry;
+		}
 		return EXT2_ET_INODE_ALLOC_FAIL;
+	}
 	*ret = i;
 	return 0;
 }
 
 /*
  * Stupid algorithm --- we now just search forward starting from the
- * goal.  Should put in a smarter one someday....
+ * goal, one block group at a time.  Should put in a smarter one
+ * someday....
  */
 errcode_t ext2fs_new_block2(ext2_filsys fs, blk64_t goal,
 			   ext2fs_block_bitmap map, blk64_t *ret)
 {
-	blk64_t	i;
-	int	c_ratio;
+	blk64_t	i, upto, b;
+	dgrp_t	group;
+	errcode_t retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -178,24 +337,22 @@ errcode_t ext2fs_new_block2(ext2_filsys fs, blk64_t goal,
 	if (!goal || (goal >= ext2fs_blocks_count(fs->super)))
 		goal = fs->super->s_first_data_block;
 	i = goal;
-	c_ratio = 1 << ext2fs_get_bitmap_granularity(map);
-	if (c_ratio > 1)
-		goal &= ~EXT2FS_CLUSTER_MASK(fs);
-	check_block_uninit(fs, map,
-			   (i - fs->super->s_first_data_block) /
-			   EXT2_BLOCKS_PER_GROUP(fs->super));
 	do {
-		if (((i - fs->super->s_first_data_block) %
-		     EXT2_BLOCKS_PER_GROUP(fs->super)) == 0)
-			check_block_uninit(fs, map,
-					   (i - fs->super->s_first_data_block) /
-					   EXT2_BLOCKS_PER_GROUP(fs->super));
-
-		if (!ext2fs_fast_test_block_bitmap2(map, i)) {
-			*ret = i;
+		group = (i - fs->super->s_first_data_block) /
+			EXT2_BLOCKS_PER_GROUP(fs->super);
+		check_block_uninit(fs, map, group);
+		upto = ext2fs_group_last_block2(fs, group);
+		if (i < goal && upto >= goal)
+			upto = goal - 1;
+
+		retval = ext2fs_find_first_zero_block_bitmap2(map, i, upto, &b);
+		if (retval == 0) {
+			*ret = b;
 			return 0;
 		}
-		i = (i + c_ratio) & ~(c_ratio - 1);
+		if (retval != ENOENT)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+		i = upto + 1;
 		if (i >= ext2fs_blocks_count(fs->super))
 			i = fs->super->s_first_data_block;
 	} while (i != goal);
@@ -272,11 +429,21 @@ errcode_t ext2fs_alloc_block(ext2_filsys fs, blk_t goal,
 	return retval;
 }
 
+/*
+ * Find num free blocks in a row, trying each starting point from start
+ * up to the end of the file system and then from the first data block
+ * up to finish.  Rather than testing every candidate, skip to the next
+ * free block, and when the run starting there isn't free, to just past
+ * the first block in it which is in use.
+ */
 errcode_t ext2fs_get_free_blocks2(ext2_filsys fs, blk64_t start, blk64_t finish,
 				 int num, ext2fs_block_bitmap map, blk64_t *ret)
 {
 	blk64_t	b = start;
+	blk64_t	blocks, limit, next, used;
 	int	c_ratio;
+	int	wrapped = 0;
+	errcode_t retval;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -293,16 +460,53 @@ errcode_t ext2fs_get_free_blocks2(ext2_filsys fs, blk64_t start, blk64_t finish,
 	c_ratio = 1 << ext2fs_get_bitmap_granularity(map);
 	b &= ~(c_ratio - 1);
 	finish &= ~(c_ratio -1);
-	do {
-		if (b+num-1 > ext2fs_blocks_count(fs->super))
+	blocks = ext2fs_blocks_count(fs->super);
+	while (1) {
+		if (b + num - 1 >= blocks) {
+			/* finish may lie in the tail we just skipped */
+			if (finish > start || wrapped++)
+				return EXT2_ET_BLOCK_ALLOC_FAIL;
 			b = fs->super->s_first_data_block;
-		if (ext2fs_fast_test_block_bitmap_range2(map, b, num)) {
-			*ret = b;
+		}
+		/* The candidates left in this pass are b .. limit - 1 */
+		limit = (finish > b && finish < blocks) ? finish : blocks;
+
+		retval = ext2fs_find_first_zero_block_bitmap2(map, b,
+							      limit - 1, &next);
+		if (retval == ENOENT)
+			next = limit;
+		else if (retval)
+			next = b;
+		if (next >= limit) {
+			if (limit == finish)
+				return EXT2_ET_BLOCK_ALLOC_FAIL;
+			b = limit;
+			continue;
+		}
+		if (next + num - 1 >= blocks) {
+			b = next;
+			continue;
+		}
+
+		retval = ext2fs_find_first_set_block_bitmap2(map, next,
+							     next + num - 1,
+							     &used);
+		if (retval == ENOENT) {
+			*ret = next;
 			return 0;
 		}
-		b += c_ratio;
-	} while (b != finish);
-	return EXT2_ET_BLOCK_ALLOC_FAIL;
+		if (retval) {
+			if (ext2fs_fast_test_block_bitmap_range2(map, next,
+								 num)) {
+				*ret = next;
+				return 0;
+			}
+			used = next;
+		}
+		b = (used & ~(c_ratio - 1)) + c_ratio;
+		if (limit == finish && b >= finish)
+			return EXT2_ET_BLOCK_ALLOC_FAIL;
+	}
 }
 
 errcode_t ext2fs_get_free_blocks(ext2_filsys fs, blk_t start, blk_t finish,
@@ -13,6 +13,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 			       int inuse, int isdir)
@@ -30,6 +31,17 @@ void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 		ext2fs_mark_inode_bitmap2(fs->inode_map, ino);
 	else
 		ext2fs_unmark_inode_bitmap2(fs->inode_map, ino);
+	/* Don't let ext2fs_new_inode()'s cursor pass a free inode */
+	if (fs->inode_cursor && fs->inode_cursor->map == fs->inode_map &&
+	    group < (int) fs->inode_cursor->num_groups) {
+		ext2_ino_t *next = &fs->inode_cursor->next[group];
+
+		if (inuse > 0 && ino == *next)
+			(*next)++;
+		else if (inuse < 0 && ino < *next &&
+			 ino >= EXT2_FIRST_INODE(fs->super))
+			*next = ino;
+	}
 	ext2fs_bg_free_inodes_count_set(fs, group, ext2fs_bg_free_inodes_count(fs, group) - inuse);
 	if (isdir)
 		ext2fs_bg_used_dirs_count_set(fs, group, ext2fs_bg_used_dirs_count(fs, group) + inuse);
@@ -73,6 +85,7 @@ void ext2fs_block_alloc_stats2(ext2_filsys fs, blk64_t blk, int inuse)
 		ext2fs_mark_block_bitmap2(fs->block_map, blk);
 	else
 		ext2fs_unmark_block_bitmap2(fs->block_map, blk);
+	ext2fs_update_space_cache(fs, blk, 1, inuse);
 	ext2fs_bg_free_blocks_count_set(fs, group, ext2fs_bg_free_blocks_count(fs, group) - inuse);
 	ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
 	ext2fs_group_desc_csum_set(fs, group);
@@ -90,6 +103,55 @@ void ext2fs_block_alloc_stats(ext2_filsys fs, blk_t blk, int inuse)
 	ext2fs_block_alloc_stats2(fs, blk, inuse);
 }
 
+/*
+ * Like ext2fs_block_alloc_stats2(), for num blocks starting at blk,
+ * but each block group descriptor is only updated once.
+ */
+void ext2fs_block_alloc_stats_range(ext2_filsys fs, blk64_t blk,
+				    blk_t num, int inuse)
+{
+	blk64_t	b, end = blk + num;
+
+#ifndef OMIT_COM_ERR
+	if (end > ext2fs_blocks_count(fs->super)) {
+		com_err("ext2fs_block_alloc_stats_range", 0,
+			"Illegal block range: %llu (%u) ",
+			(unsigned long long) blk, num);
+		return;
+	}
+#endif
+	if (inuse == 0)
+		return;
+	if (inuse > 0) {
+		ext2fs_mark_block_bitmap_range2(fs->block_map, blk, num);
+		inuse = 1;
+	} else {
+		ext2fs_unmark_block_bitmap_range2(fs->block_map, blk, num);
+		inuse = -1;
+	}
+	ext2fs_update_space_cache(fs, blk, num, inuse);
+	for (b = blk; b < end; ) {
+		dgrp_t	group = ext2fs_group_of_blk2(fs, b);
+		blk64_t	n = ext2fs_group_last_block2(fs, group) + 1;
+
+		if (n > end)
+			n = end;
+		n -= b;
+		ext2fs_bg_free_blocks_count_set(fs, group,
+			ext2fs_bg_free_blocks_count(fs, group) -
+			inuse * n / EXT2FS_CLUSTER_RATIO(fs));
+		ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
+		ext2fs_group_desc_csum_set(fs, group);
+		ext2fs_free_blocks_count_add(fs->super, -inuse * (blk64_t) n);
+		b += n;
+	}
+	ext2fs_mark_super_dirty(fs);
+	ext2fs_mark_bb_dirty(fs);
+	if (fs->block_alloc_stats)
+		for (b = blk; b < end; b++)
+			(fs->block_alloc_stats)(fs, b, inuse);
+}
+
 void ext2fs_set_block_alloc_stats_callback(ext2_filsys fs,
 					   void (*func)(ext2_filsys fs,
 							blk64_t blk,
@@ -79,12 +79,42 @@ static blk64_t flexbg_offset(ext2_filsys fs, dgrp_t group, blk64_t start_blk,
 	return first_free;
 }
 
+/*
+ * Mark num blocks starting at blk in use for group metadata.  With
+ * flex_bg the blocks may belong to other groups than the one whose
+ * metadata they hold, so the free block counts of the groups they are
+ * in are kept up to date here, a group at a time.
+ */
+static void claim_table_blocks(ext2_filsys fs, ext2fs_block_bitmap bmap,
+			       blk64_t blk, blk64_t num, int flexbg_size)
+{
+	dgrp_t	gr;
+	blk64_t	n;
+
+	ext2fs_mark_block_bitmap_range2(bmap, blk, num);
+	if (!flexbg_size)
+		return;
+
+	while (num) {
+		gr = ext2fs_group_of_blk2(fs, blk);
+		n = ext2fs_group_last_block2(fs, gr) - blk + 1;
+		if (n > num)
+			n = num;
+		ext2fs_bg_free_blocks_count_set(fs, gr,
+				ext2fs_bg_free_blocks_count(fs, gr) - n);
+		ext2fs_free_blocks_count_add(fs->super, -n);
+		ext2fs_bg_flags_clear(fs, gr, EXT2_BG_BLOCK_UNINIT);
+		ext2fs_group_desc_csum_set(fs, gr);
+		blk += n;
+		num -= n;
+	}
+}
+
 errcode_t ext2fs_allocate_group_table(ext2_filsys fs, dgrp_t group,
 				      ext2fs_block_bitmap bmap)
 {
-	unsigned int	j;
 	errcode_t	retval;
-	blk64_t		group_blk, start_blk, last_blk, new_blk, blk;
+	blk64_t		group_blk, start_blk, last_blk, new_blk;
 	dgrp_t		last_grp = 0;
 	int		rem_grps = 0, flexbg_size = 0;
 
@@ -138,15 +168,8 @@ errcode_t ext2fs_allocate_group_table(ext2_filsys fs, dgrp_t group,
 					last_blk, 1, bmap, &new_blk);
 		if (retval)
 			return retval;
-		ext2fs_mark_block_bitmap2(bmap, new_blk);
+		claim_table_blocks(fs, bmap, new_blk, 1, flexbg_size);
 		ext2fs_block_bitmap_loc_set(fs, group, new_blk);
-		if (flexbg_size) {
-			dgrp_t gr = ext2fs_group_of_blk2(fs, new_blk);
-			ext2fs_bg_free_blocks_count_set(fs, gr, ext2fs_bg_free_blocks_count(fs, gr) - 1);
-			ext2fs_free_blocks_count_add(fs->super, -1);
-			ext2fs_bg_flags_clear(fs, gr, EXT2_BG_BLOCK_UNINIT);
-			ext2fs_group_desc_csum_set(fs, gr);
-		}
 	}
 
 	if (flexbg_size) {
@@ -169,15 +192,8 @@ errcode_t ext2fs_allocate_group_table(ext2_filsys fs, dgrp_t group,
 					 last_blk, 1, bmap, &new_blk);
 		if (retval)
 			return retval;
-		ext2fs_mark_block_bitmap2(bmap, new_blk);
+		claim_table_blocks(fs, bmap, new_blk, 1, flexbg_size);
 		ext2fs_inode_bitmap_loc_set(fs, group, new_blk);
-		if (flexbg_size) {
-			dgrp_t gr = ext2fs_group_of_blk2(fs, new_blk);
-			ext2fs_bg_free_blocks_count_set(fs, gr, ext2fs_bg_free_blocks_count(fs, gr) - 1);
-			ext2fs_free_blocks_count_add(fs->super, -1);
-			ext2fs_bg_flags_clear(fs, gr, EXT2_BG_BLOCK_UNINIT);
-			ext2fs_group_desc_csum_set(fs, gr);
-		}
 	}
 
 	/*
@@ -204,36 +220,91 @@ errcode_t ext2fs_allocate_group_table(ext2_filsys fs, dgrp_t group,
 						bmap, &new_blk);
 		if (retval)
 			return retval;
-		for (j=0, blk = new_blk;
-		     j < fs->inode_blocks_per_group;
-		     j++, blk++) {
-			ext2fs_mark_block_bitmap2(bmap, blk);
-			if (flexbg_size) {
-				dgrp_t gr = ext2fs_group_of_blk2(fs, blk);
-				ext2fs_bg_free_blocks_count_set(fs, gr, ext2fs_bg_free_blocks_count(fs, gr) - 1);
-				ext2fs_free_blocks_count_add(fs->super, -1);
-				ext2fs_bg_flags_clear(fs, gr,
-						     EXT2_BG_BLOCK_UNINIT);
-				ext2fs_group_desc_csum_set(fs, gr);
-			}
-		}
+		claim_table_blocks(fs, bmap, new_blk,
+				   fs->inode_blocks_per_group, flexbg_size);
 		ext2fs_inode_table_loc_set(fs, group, new_blk);
 	}
 	ext2fs_group_desc_csum_set(fs, group);
 	return 0;
 }
 
+/*
+ * On a new file system ext2fs_allocate_group_table() ends up packing
+ * the block bitmaps of a flex group one after another from the first
+ * run of free blocks in it which is big enough, the inode bitmaps
+ * flexbg_size blocks further on and the inode tables flexbg_size
+ * blocks after those.  Work that layout out for the whole flex group
+ * starting at group at once, and take it if all of it is free; this
+ * saves searching the bitmap three times for every group.  Returns 0
+ * if the layout didn't fit, in which case nothing has been changed and
+ * the groups have to be allocated one at a time.
+ */
+static int allocate_flexbg_tables(ext2_filsys fs, dgrp_t group,
+				  dgrp_t *ret_count)
+{
+	ext2fs_block_bitmap bmap = fs->block_map;
+	blk64_t		bb, ib, it, last_blk;
+	blk64_t		ipg = fs->inode_blocks_per_group;
+	dgrp_t		i, last_grp, n;
+	int		flexbg_size;
+
+	flexbg_size = 1 << fs->super->s_log_groups_per_flex;
+	if (group & (flexbg_size - 1))
+		return 0;
+	last_grp = group | (flexbg_size - 1);
+	if (last_grp > fs->group_desc_count - 1)
+		last_grp = fs->group_desc_count - 1;
+	n = last_grp - group + 1;
+	last_blk = ext2fs_group_last_block2(fs, last_grp);
+
+	for (i = group; i <= last_grp; i++)
+		if (ext2fs_block_bitmap_loc(fs, i) ||
+		    ext2fs_inode_bitmap_loc(fs, i) ||
+		    ext2fs_inode_table_loc(fs, i))
+			return 0;
+
+	bb = flexbg_offset(fs, group, 0, bmap, n, 1);
+	ib = bb + flexbg_size;
+	it = ib + flexbg_size;
+	if (!bb || it + n * ipg - 1 > last_blk ||
+	    !ext2fs_test_block_bitmap_range2(bmap, bb, n) ||
+	    !ext2fs_test_block_bitmap_range2(bmap, ib, n) ||
+	    !ext2fs_test_block_bitmap_range2(bmap, it, n * ipg))
+		return 0;
+
+	claim_table_blocks(fs, bmap, bb, n, flexbg_size);
+	claim_table_blocks(fs, bmap, ib, n, flexbg_size);
+	claim_table_blocks(fs, bmap, it, n * ipg, flexbg_size);
+	for (i = 0; i < n; i++) {
+		ext2fs_block_bitmap_loc_set(fs, group + i, bb + i);
+		ext2fs_inode_bitmap_loc_set(fs, group + i, ib + i);
+		ext2fs_inode_table_loc_set(fs, group + i, it + i * ipg);
+		ext2fs_group_desc_csum_set(fs, group + i);
+	}
+	*ret_count = n;
+	return 1;
+}
+
 errcode_t ext2fs_allocate_tables(ext2_filsys fs)
 {
 	errcode_t	retval;
-	dgrp_t		i;
+	dgrp_t		i, n;
+	int		flexbg;
 	struct ext2fs_numeric_progress_struct progress;
 
 	ext2fs_numeric_progress_init(fs, &progress, NULL,
 				     fs->group_desc_count);
 
-	for (i = 0; i < fs->group_desc_count; i++) {
+	flexbg = EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+					   EXT4_FEATURE_INCOMPAT_FLEX_BG) &&
+		fs->super->s_log_groups_per_flex && !fs->stride &&
+		EXT2FS_CLUSTER_RATIO(fs) == 1;
+
+	for (i = 0; i < fs->group_desc_count; i += n) {
 		ext2fs_numeric_progress_update(fs, &progress, i);
+		n = 1;
+		if (flexbg && allocate_flexbg_tables(fs, i, &n))
+			continue;
 		retval = ext2fs_allocate_group_table(fs, i, fs->block_map);
 		if (retval)
 			return retval;
@@ -10,6 +10,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -101,27 +102,44 @@ errcode_t ext2fs_badblocks_copy(ext2_badblocks_list src,
  */
 
 
+/*
+ * Make room for at least num more blocks in a list, doubling it
+ * rather than growing it a little at a time, since lists read from
+ * failing media can run to millions of blocks.
+ */
+static errcode_t grow_u32_list(ext2_u32_list bb, int num)
+{
+	errcode_t	retval;
+	int		new_size;
+
+	if (bb->num + num <= bb->size)
+		return 0;
+	new_size = bb->size * 2;
+	if (new_size < bb->num + num)
+		new_size = bb->num + num;
+	if (new_size < bb->size + 100)
+		new_size = bb->size + 100;
+	retval = ext2fs_resize_mem(bb->size * sizeof(__u32),
+				   new_size * sizeof(__u32), &bb->list);
+	if (retval)
+		return retval;
+	bb->size = new_size;
+	return 0;
+}
+
 /*
  * This procedure adds a block to a badblocks list.
  */
 errcode_t ext2fs_u32_list_add(ext2_u32_list bb, __u32 blk)
 {
 	errcode_t	retval;
-	int		i, j;
-	unsigned long	old_size;
+	int		i, low, high, mid;
 
 	EXT2_CHECK_MAGIC(bb, EXT2_ET_MAGIC_BADBLOCKS_LIST);
 
-	if (bb->num >= bb->size) {
-		old_size = bb->size * sizeof(__u32);
-		bb->size += 100;
-		retval = ext2fs_resize_mem(old_size, bb->size * sizeof(__u32),
-					   &bb->list);
-		if (retval) {
-			bb->size -= 100;
-			return retval;
-		}
-	}
+	retval = grow_u32_list(bb, 1);
+	if (retval)
+		return retval;
 
 	/*
 	 * Add special case code for appending to the end of the list
@@ -134,27 +152,88 @@ errcode_t ext2fs_u32_list_add(ext2_u32_list bb, __u32 blk)
 		return 0;
 	}
 
-	j = bb->num;
-	for (i=0; i < bb->num; i++) {
-		if (bb->list[i] == blk)
-			return 0;
-		if (bb->list[i] > blk) {
-			j = i;
-			break;
-		}
+	/* Find the first entry which isn't smaller than blk */
+	low = 0;
+	high = bb->num - 1;
+	while (low < high) {
+		mid = ((unsigned) low + (unsigned) high) / 2;
+		if (bb->list[mid] < blk)
+			low = mid + 1;
+		else
+			high = mid;
 	}
-	for (i=bb->num; i > j; i--)
-		bb->list[i] = bb->list[i-1];
-	bb->list[j] = blk;
+	if (bb->list[low] == blk)
+		return 0;
+	memmove(bb->list + low + 1, bb->list + low,
+		(bb->num - low) * sizeof(__u32));
+	bb->list[low] = blk;
 	bb->num++;
 	return 0;
 }
 
+static EXT2_QSORT_TYPE u32_cmp(const void *a, const void *b)
+{
+	__u32	ua = *(const __u32 *) a, ub = *(const __u32 *) b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/*
+ * Add num blocks to a list at once.  They are sorted (in place, so the
+ * caller's array is reordered) and merged into the list in one pass,
+ * which is much faster than adding them one by one when there are many
+ * of them or they don't come in order.
+ */
+errcode_t ext2fs_u32_list_add_array(ext2_u32_list bb, __u32 *blks, int num)
+{
+	errcode_t	retval;
+	int		i, n, src, dst;
+
+	EXT2_CHECK_MAGIC(bb, EXT2_ET_MAGIC_BADBLOCKS_LIST);
+
+	if (num <= 0)
+		return 0;
+	qsort(blks, num, sizeof(__u32), u32_cmp);
+	for (i = n = 1; i < num; i++)
+		if (blks[i] != blks[n - 1])
+			blks[n++] = blks[i];
+
+	retval = grow_u32_list(bb, n);
+	if (retval)
+		return retval;
+
+	/* Merge from the top down, so that nothing is overwritten early */
+	src = bb->num - 1;
+	i = n - 1;
+	dst = bb->num + n - 1;
+	while (i >= 0) {
+		if (src >= 0 && bb->list[src] >= blks[i]) {
+			if (bb->list[src] == blks[i])
+				i--;
+			bb->list[dst--] = bb->list[src--];
+		} else
+			bb->list[dst--] = blks[i--];
+	}
+	/* Close the gap left by the blocks which were already listed */
+	if (dst > src)
+		memmove(bb->list + src + 1, bb->list + dst + 1,
+			(bb->num + n - 1 - dst) * sizeof(__u32));
+	bb->num += n - (dst - src);
+	return 0;
+}
+
 errcode_t ext2fs_badblocks_list_add(ext2_badblocks_list bb, blk_t blk)
 {
 	return ext2fs_u32_list_add((ext2_u32_list) bb, (__u32) blk);
 }
 
+errcode_t ext2fs_badblocks_list_add_array(ext2_badblocks_list bb,
+					  blk_t *blks, int num)
+{
+	return ext2fs_u32_list_add_array((ext2_u32_list) bb, (__u32 *) blks,
+					 num);
+}
+
 /*
  * This procedure finds a particular block is on a badblocks
  * list.
@@ -325,3 +404,48 @@ int ext2fs_u32_list_count(ext2_u32_list bb)
 {
 	return bb->num;
 }
+
+/*
+ * Return a block bitmap with the blocks of a badblocks list marked.
+ * It has block (not cluster) granularity and, for 64-bit bitmaps, is
+ * kept as a tree of extents, so that it stays small however many bad
+ * blocks there are, and whole ranges can be tested at once with
+ * ext2fs_test_block_bitmap_range2().  Blocks which don't belong to the
+ * file system are left out.
+ */
+errcode_t ext2fs_badblocks_list_to_bitmap(ext2_filsys fs,
+					  ext2_badblocks_list bb,
+					  ext2fs_block_bitmap *ret)
+{
+	ext2fs_block_bitmap	bmap;
+	errcode_t		retval;
+	blk64_t			first, last;
+	int			save_type, i, j;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+	EXT2_CHECK_MAGIC(bb, EXT2_ET_MAGIC_BADBLOCKS_LIST);
+
+	save_type = fs->default_bitmap_type;
+	fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
+	retval = ext2fs_allocate_subcluster_bitmap(fs, "bad blocks", &bmap);
+	fs->default_bitmap_type = save_type;
+	if (retval)
+		return retval;
+
+	first = fs->super->s_first_data_block;
+	last = ext2fs_blocks_count(fs->super) - 1;
+	for (i = 0; i < bb->num; i = j) {
+		/* Mark each run of consecutive blocks in one go */
+		for (j = i + 1; j < bb->num && bb->list[j] == bb->list[j-1] + 1;
+		     j++)
+			;
+		if (bb->list[j - 1] < first || bb->list[i] > last)
+			continue;
+		ext2fs_mark_block_bitmap_range2(bmap,
+			bb->list[i] < first ? first : bb->list[i],
+			(bb->list[j - 1] > last ? last : bb->list[j - 1]) -
+			(bb->list[i] < first ? first : bb->list[i]) + 1);
+	}
+	*ret = bmap;
+	return 0;
+}
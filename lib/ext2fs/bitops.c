@@ -122,30 +122,33 @@ static unsigned int popcount8(unsigned int w)
 	return (res + (res >> 4)) & 0x0F;
 }
 
-static unsigned int popcount32(unsigned int w)
+static unsigned int popcount64(__u64 w)
 {
-	unsigned int res = w - ((w >> 1) & 0x55555555);
-	res = (res & 0x33333333) + ((res >> 2) & 0x33333333);
-	res = (res + (res >> 4)) & 0x0F0F0F0F;
-	res = res + (res >> 8);
-	return (res + (res >> 16)) & 0x000000FF;
+#if defined(__GNUC__) && defined(__POPCNT__)
+	return __builtin_popcountll(w);
+#else
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (w * 0x0101010101010101ULL) >> 56;
+#endif
 }
 
 unsigned int ext2fs_bitcount(const void *addr, unsigned int nbytes)
 {
 	const unsigned char *cp = addr;
-	const __u32 *p;
+	const __u64 *p;
 	unsigned int res = 0;
 
-	while (((((unsigned long) cp) & 3) != 0) && (nbytes > 0)) {
+	while (((((unsigned long) cp) & 7) != 0) && (nbytes > 0)) {
 		res += popcount8(*cp++);
 		nbytes--;
 	}
-	p = (const __u32 *) cp;
+	p = (const __u64 *) cp;
 
-	while (nbytes > 4) {
-		res += popcount32(*p++);
-		nbytes -= 4;
+	while (nbytes >= 8) {
+		res += popcount64(*p++);
+		nbytes -= 8;
 	}
 	cp = (const unsigned char *) p;
 
@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -22,66 +23,312 @@
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fsP.h"
 #include "bmap64.h"
 
+#ifndef offsetof
+#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#endif
+
+/*
+ * Private data for bit array implementation of bitmaps.  The bit array
+ * is kept in pages of BA_PAGE_BITS bits, so that a copy of a bitmap
+ * can share the pages of the original instead of duplicating them:
+ * each page counts the bitmaps using it, and one which is shared is
+ * only copied when one of them is about to change it.  The last page
+ * is always allocated in full; the bits past the end of the bitmap
+ * are kept zero.
+ */
+#define BA_PAGE_SHIFT	15			/* log2 of bits per page */
+#define BA_PAGE_BITS	((__u64) 1 << BA_PAGE_SHIFT)
+#define BA_PAGE_MASK	(BA_PAGE_BITS - 1)
+#define BA_PAGE_BYTES	(BA_PAGE_BITS / 8)
+#define BA_PAGE_WORDS	(BA_PAGE_BITS / 64)
+
+struct ba_arena;
+
+struct ba_page {
+	unsigned long	refs;		/* bitmaps using this page */
+	struct ba_arena	*arena;		/* where it came from, or NULL */
+	__u64		bits[BA_PAGE_WORDS];
+};
+
 /*
- * Private data for bit array implementation of bitmap ops.
- * Currently, this is just a pointer to our big flat hunk of memory,
- * exactly equivalent to the old-skool char * bitmap member.
+ * The pages of a big bitmap are carved out of arenas of BA_ARENA_BYTES
+ * mapped with mmap() rather than taken from malloc(): anonymous memory
+ * aligned so that the kernel can back it with huge pages, which cuts
+ * down on TLB misses when bits all over the bitmap are tested, or with
+ * ext2fs_set_bitmap_spill() an unlinked file in a scratch directory,
+ * which the kernel can write out instead of the process running out of
+ * memory.  Each bitmap hands out pages from an arena of its own; since
+ * a copy may still be sharing them, an arena is only unmapped once
+ * every page of it has been given back.
  */
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define BA_USE_ARENAS
+#endif
+
+#define BA_ARENA_BYTES		(2 * 1024 * 1024)
+#define BA_ARENA_MIN_PAGES	64		/* 2M bits */
+
+struct ba_arena {
+	unsigned long	users;		/* pages in use, +1 for the owner */
+	struct ba_page	*free;		/* given back, linked through bits */
+	unsigned int	next;		/* first page never handed out */
+	unsigned int	num;
+	struct ba_page	pages[1];
+};
+
+#define BA_ARENA_PAGES	((BA_ARENA_BYTES - offsetof(struct ba_arena, pages)) \
+			 / sizeof(struct ba_page))
 
 struct ext2fs_ba_private_struct {
-	char *bitarray;
+	struct ba_page	**pages;
+	__u64		num_pages;
+	ext2_filsys	fs;
+	int		use_arenas;
+	struct ba_arena	*arena;		/* the one pages come from now */
 };
 
 typedef struct ext2fs_ba_private_struct *ext2fs_ba_private;
 
-static errcode_t ba_alloc_private_data (ext2fs_generic_bitmap bitmap)
+static __u64 ba_num_pages(__u64 start, __u64 real_end)
+{
+	return ((real_end - start) >> BA_PAGE_SHIFT) + 1;
+}
+
+#ifdef BA_USE_ARENAS
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* Map a file in the spill directory, if there is one */
+static void *ba_map_spill(ext2fs_ba_private bp)
+{
+	const char	*dir = bp->fs ? bp->fs->bitmap_spill_dir : NULL;
+	void		*p = MAP_FAILED;
+	char		*fn;
+	int		fd;
+
+	if (!dir || ext2fs_get_mem(strlen(dir) + 32, &fn))
+		return MAP_FAILED;
+	sprintf(fn, "%s/bitmap-XXXXXX", dir);
+	fd = mkstemp(fn);
+	if (fd >= 0) {
+		unlink(fn);
+		if (ftruncate(fd, BA_ARENA_BYTES) == 0)
+			p = mmap(0, BA_ARENA_BYTES, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	ext2fs_free_mem(&fn);
+	return p;
+}
+
+/* Map anonymous memory on a BA_ARENA_BYTES boundary */
+static void *ba_map_anon(void)
+{
+	char		*p, *start;
+	unsigned long	head;
+
+	p = mmap(0, 2 * BA_ARENA_BYTES, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+	head = (unsigned long) p & (BA_ARENA_BYTES - 1);
+	start = p + (head ? BA_ARENA_BYTES - head : 0);
+	if (start > p)
+		munmap(p, start - p);
+	munmap(start + BA_ARENA_BYTES, p + BA_ARENA_BYTES - start);
+#ifdef MADV_HUGEPAGE
+	madvise(start, BA_ARENA_BYTES, MADV_HUGEPAGE);
+#endif
+	return start;
+}
+
+static void ba_put_arena(struct ba_arena *arena)
+{
+	if (--arena->users == 0)
+		munmap(arena, BA_ARENA_BYTES);
+}
+
+/* Returns NULL if no arena could be mapped */
+static struct ba_page *ba_arena_page(ext2fs_ba_private bp)
+{
+	struct ba_arena	*arena = bp->arena;
+	struct ba_page	*page;
+	void		*p;
+
+	if (!arena || (!arena->free && arena->next >= arena->num)) {
+		p = ba_map_spill(bp);
+		if (p == MAP_FAILED)
+			p = ba_map_anon();
+		if (p == MAP_FAILED)
+			return NULL;
+		if (arena)
+			ba_put_arena(arena);
+		arena = bp->arena = p;
+		arena->users = 1;
+		arena->free = NULL;
+		arena->next = 0;
+		arena->num = BA_ARENA_PAGES;
+	}
+	if (arena->free) {
+		page = arena->free;
+		memcpy(&arena->free, page->bits, sizeof(page));
+	} else
+		page = &arena->pages[arena->next++];
+	arena->users++;
+	page->arena = arena;
+	return page;
+}
+#endif /* BA_USE_ARENAS */
+
+/* A page of its own for bp, with its bits left as they were */
+static errcode_t ba_get_page(ext2fs_ba_private bp, struct ba_page **ret)
 {
-	ext2fs_ba_private bp;
 	errcode_t	retval;
-	size_t		size;
 
-	/*
-	 * Since we only have the one pointer, we could just shove our
-	 * private data in the void *private field itself, but then
-	 * we'd have to do a fair bit of rewriting if we ever added a
-	 * field.  I'm agnostic.
-	 */
-	retval = ext2fs_get_mem(sizeof (ext2fs_ba_private), &bp);
+#ifdef BA_USE_ARENAS
+	if (bp->use_arenas) {
+		*ret = ba_arena_page(bp);
+		if (*ret)
+			goto out;
+	}
+#endif
+	retval = ext2fs_get_mem(sizeof(struct ba_page), ret);
 	if (retval)
 		return retval;
+	(*ret)->arena = NULL;
+#ifdef BA_USE_ARENAS
+out:
+#endif
+	(*ret)->refs = 1;
+	return 0;
+}
 
-	size = (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1);
+static errcode_t ba_alloc_page(ext2fs_ba_private bp, struct ba_page **ret)
+{
+	errcode_t	retval;
 
-	retval = ext2fs_get_mem(size, &bp->bitarray);
-	if (retval) {
-		ext2fs_free_mem(&bp);
-		bp = 0;
+	retval = ba_get_page(bp, ret);
+	if (retval)
 		return retval;
-	}
-	bitmap->private = (void *) bp;
+	memset((*ret)->bits, 0, BA_PAGE_BYTES);
 	return 0;
 }
 
-static errcode_t ba_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
-			     ext2fs_generic_bitmap bitmap)
+static void ba_put_page(struct ba_page *page)
 {
-	ext2fs_ba_private bp;
+	if (--page->refs)
+		return;
+#ifdef BA_USE_ARENAS
+	if (page->arena) {
+		memcpy(page->bits, &page->arena->free, sizeof(page));
+		page->arena->free = page;
+		ba_put_arena(page->arena);
+		return;
+	}
+#endif
+	ext2fs_free_mem(&page);
+}
+
+static char *ba_page_bits(ext2fs_ba_private bp, __u64 bitno)
+{
+	return (char *) bp->pages[bitno >> BA_PAGE_SHIFT]->bits;
+}
+
+/*
+ * Return the bits of the page holding bitno, giving the bitmap a page
+ * of its own first if it shares it.  Like the other backends, which
+ * allocate as bits are set, this can't fail but by exiting.
+ */
+static char *ba_writable_bits(ext2fs_ba_private bp, __u64 bitno)
+{
+	struct ba_page	**pp = bp->pages + (bitno >> BA_PAGE_SHIFT);
+	struct ba_page	*page;
 	errcode_t	retval;
-	size_t		size;
 
-	retval = ba_alloc_private_data (bitmap);
+	if ((*pp)->refs > 1) {
+		retval = ba_get_page(bp, &page);
+		if (retval) {
+			perror("ext2fs_get_mem");
+			exit(1);
+		}
+		memcpy(page->bits, (*pp)->bits, BA_PAGE_BYTES);
+		(*pp)->refs--;
+		*pp = page;
+	}
+	return (char *) (*pp)->bits;
+}
+
+static void ba_free_pages(ext2fs_ba_private bp, __u64 first)
+{
+	__u64	i;
+
+	for (i = first; i < bp->num_pages; i++)
+		ba_put_page(bp->pages[i]);
+	bp->num_pages = first;
+}
+
+static errcode_t ba_add_pages(ext2fs_ba_private bp, __u64 num_pages)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_resize_mem(bp->num_pages * sizeof(struct ba_page *),
+				   num_pages * sizeof(struct ba_page *),
+				   &bp->pages);
 	if (retval)
 		return retval;
+	while (bp->num_pages < num_pages) {
+		retval = ba_alloc_page(bp, bp->pages + bp->num_pages);
+		if (retval)
+			return retval;
+		bp->num_pages++;
+	}
+	return 0;
+}
 
-	bp = (ext2fs_ba_private) bitmap->private;
-	size = (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1);
-	memset(bp->bitarray, 0, size);
+/* Clear the bits from first to last, inclusive */
+static void ba_zero_bits(ext2fs_ba_private bp, __u64 first, __u64 last)
+{
+	char	*bits;
+	__u64	end;
+
+	while (first <= last) {
+		end = (first | BA_PAGE_MASK) < last ? (first | BA_PAGE_MASK) :
+			last;
+		bits = ba_writable_bits(bp, first);
+		for (; first <= end && (first & 7); first++)
+			ext2fs_fast_clear_bit64(first & BA_PAGE_MASK, bits);
+		if (end - first + 1 >= 8) {
+			memset(bits + ((first & BA_PAGE_MASK) >> 3), 0,
+			       (end - first + 1) >> 3);
+			first += (end - first + 1) & ~7ULL;
+		}
+		for (; first <= end; first++)
+			ext2fs_fast_clear_bit64(first & BA_PAGE_MASK, bits);
+	}
+}
 
+static errcode_t ba_alloc_private_data (ext2fs_generic_bitmap bitmap)
+{
+	ext2fs_ba_private bp;
+	errcode_t	retval;
+
+	retval = ext2fs_get_memzero(sizeof (struct ext2fs_ba_private_struct),
+				    &bp);
+	if (retval)
+		return retval;
+	bp->fs = bitmap->fs;
+	bp->use_arenas = ba_num_pages(bitmap->start, bitmap->real_end) >=
+		BA_ARENA_MIN_PAGES;
+	bitmap->private = (void *) bp;
 	return 0;
 }
 
@@ -92,31 +339,59 @@ static void ba_free_bmap(ext2fs_generic_bitmap bitmap)
 	if (!bp)
 		return;
 
-	if (bp->bitarray) {
-		ext2fs_free_mem (&bp->bitarray);
-		bp->bitarray = 0;
+	if (bp->pages) {
+		ba_free_pages(bp, 0);
+		ext2fs_free_mem (&bp->pages);
 	}
+#ifdef BA_USE_ARENAS
+	if (bp->arena)
+		ba_put_arena(bp->arena);
+#endif
 	ext2fs_free_mem (&bp);
-	bp = 0;
+	bitmap->private = 0;
 }
 
+static errcode_t ba_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     ext2fs_generic_bitmap bitmap)
+{
+	errcode_t	retval;
+
+	retval = ba_alloc_private_data (bitmap);
+	if (retval)
+		return retval;
+
+	retval = ba_add_pages((ext2fs_ba_private) bitmap->private,
+			      ba_num_pages(bitmap->start, bitmap->real_end));
+	if (retval)
+		ba_free_bmap(bitmap);
+	return retval;
+}
+
+/* The copy shares all of the pages of src; see ba_writable_bits() */
 static errcode_t ba_copy_bmap(ext2fs_generic_bitmap src,
 			      ext2fs_generic_bitmap dest)
 {
 	ext2fs_ba_private src_bp = (ext2fs_ba_private) src->private;
 	ext2fs_ba_private dest_bp;
 	errcode_t retval;
-	size_t size;
+	__u64	i;
 
 	retval = ba_alloc_private_data (dest);
 	if (retval)
 		return retval;
 
 	dest_bp = (ext2fs_ba_private) dest->private;
-
-	size = (size_t) (((src->real_end - src->start) / 8) + 1);
-	memcpy (dest_bp->bitarray, src_bp->bitarray, size);
-
+	retval = ext2fs_get_array(src_bp->num_pages, sizeof(struct ba_page *),
+				  &dest_bp->pages);
+	if (retval) {
+		ba_free_bmap(dest);
+		return retval;
+	}
+	for (i = 0; i < src_bp->num_pages; i++) {
+		dest_bp->pages[i] = src_bp->pages[i];
+		dest_bp->pages[i]->refs++;
+	}
+	dest_bp->num_pages = src_bp->num_pages;
 	return 0;
 }
 
@@ -125,35 +400,38 @@ static errcode_t ba_resize_bmap(ext2fs_generic_bitmap bmap,
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bmap->private;
 	errcode_t	retval;
-	size_t		size, new_size;
-	__u64		bitno;
+	__u64		num_pages, last;
 
 	/*
 	 * If we're expanding the bitmap, make sure all of the new
 	 * parts of the bitmap are zero.
 	 */
 	if (new_end > bmap->end) {
-		bitno = bmap->real_end;
-		if (bitno > new_end)
-			bitno = new_end;
-		for (; bitno > bmap->end; bitno--)
-			ext2fs_clear_bit64(bitno - bmap->start, bp->bitarray);
+		last = bmap->real_end;
+		if (last > new_end)
+			last = new_end;
+		if (last > bmap->end)
+			ba_zero_bits(bp, bmap->end + 1 - bmap->start,
+				     last - bmap->start);
 	}
 	if (new_real_end == bmap->real_end) {
 		bmap->end = new_end;
 		return 0;
 	}
 
-	size = ((bmap->real_end - bmap->start) / 8) + 1;
-	new_size = ((new_real_end - bmap->start) / 8) + 1;
-
-	if (size != new_size) {
-		retval = ext2fs_resize_mem(size, new_size, &bp->bitarray);
+	num_pages = ba_num_pages(bmap->start, new_real_end);
+	if (num_pages < bp->num_pages)
+		ba_free_pages(bp, num_pages);
+	/* keep the bits past the end of the last page zero */
+	last = (bp->num_pages << BA_PAGE_SHIFT) - 1;
+	if (new_real_end < bmap->real_end) {
+		if (new_real_end - bmap->start < last)
+			ba_zero_bits(bp, new_real_end - bmap->start + 1, last);
+	} else if (num_pages > bp->num_pages) {
+		retval = ba_add_pages(bp, num_pages);
 		if (retval)
 			return retval;
 	}
-	if (new_size > size)
-		memset(bp->bitarray + size, 0, new_size - size);
 
 	bmap->end = new_end;
 	bmap->real_end = new_real_end;
@@ -164,53 +442,64 @@ static errcode_t ba_resize_bmap(ext2fs_generic_bitmap bmap,
 static int ba_mark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	blk64_t bitno = (blk64_t) arg;
+	blk64_t bitno = (blk64_t) arg - bitmap->start;
 
-	return ext2fs_set_bit64(bitno - bitmap->start, bp->bitarray);
+	return ext2fs_set_bit64(bitno & BA_PAGE_MASK,
+				ba_writable_bits(bp, bitno));
 }
 
 static int ba_unmark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	blk64_t bitno = (blk64_t) arg;
+	blk64_t bitno = (blk64_t) arg - bitmap->start;
 
-	return ext2fs_clear_bit64(bitno - bitmap->start, bp->bitarray);
+	return ext2fs_clear_bit64(bitno & BA_PAGE_MASK,
+				  ba_writable_bits(bp, bitno));
 }
 
 static int ba_test_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	blk64_t bitno = (blk64_t) arg;
+	blk64_t bitno = (blk64_t) arg - bitmap->start;
 
-	return ext2fs_test_bit64(bitno - bitmap->start, bp->bitarray);
+	return ext2fs_test_bit64(bitno & BA_PAGE_MASK,
+				 ba_page_bits(bp, bitno));
 }
 
 static void ba_mark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
 				unsigned int num)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	blk64_t bitno = (blk64_t) arg;
+	blk64_t bitno = (blk64_t) arg - bitmap->start;
+	char	*bits = NULL;
 	unsigned int i;
 
-	for (i = 0; i < num; i++)
-		ext2fs_fast_set_bit64(bitno + i - bitmap->start, bp->bitarray);
+	for (i = 0; i < num; i++, bitno++) {
+		if (!bits || !(bitno & BA_PAGE_MASK))
+			bits = ba_writable_bits(bp, bitno);
+		ext2fs_fast_set_bit64(bitno & BA_PAGE_MASK, bits);
+	}
 }
 
 static void ba_unmark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
 				  unsigned int num)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-	blk64_t bitno = (blk64_t) arg;
+	blk64_t bitno = (blk64_t) arg - bitmap->start;
+	char	*bits = NULL;
 	unsigned int i;
 
-	for (i = 0; i < num; i++)
-		ext2fs_fast_clear_bit64(bitno + i - bitmap->start, bp->bitarray);
+	for (i = 0; i < num; i++, bitno++) {
+		if (!bits || !(bitno & BA_PAGE_MASK))
+			bits = ba_writable_bits(bp, bitno);
+		ext2fs_fast_clear_bit64(bitno & BA_PAGE_MASK, bits);
+	}
 }
 
-static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
-				     __u64 start, unsigned int len)
+/* Are the len bits of ADDR from start on all clear? */
+static int ba_test_clear_bits(const char *ADDR, __u64 start,
+			      unsigned int len)
 {
-	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
 	__u64 start_byte, len_byte = len >> 3;
 	unsigned int start_bit, len_bit = len % 8;
 	unsigned int first_bit = 0;
@@ -218,10 +507,7 @@ static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
 	int mark_count = 0;
 	int mark_bit = 0;
 	int i;
-	const char *ADDR;
 
-	ADDR = bp->bitarray;
-	start -= bitmap->start;
 	start_byte = start >> 3;
 	start_bit = start % 8;
 
@@ -280,13 +566,45 @@ static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
 	return ext2fs_mem_is_zero(ADDR + start_byte, len_byte);
 }
 
+static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
+				     __u64 start, unsigned int len)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	unsigned int	n;
+
+	start -= bitmap->start;
+	while (len) {
+		n = BA_PAGE_BITS - (start & BA_PAGE_MASK);
+		if (n > len)
+			n = len;
+		if (!ba_test_clear_bits(ba_page_bits(bp, start),
+					start & BA_PAGE_MASK, n))
+			return 0;
+		start += n;
+		len -= n;
+	}
+	return 1;
+}
+
 
 static errcode_t ba_set_bmap_range(ext2fs_generic_bitmap bitmap,
 				     __u64 start, size_t num, void *in)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-
-	memcpy (bp->bitarray + (start >> 3), in, (num + 7) >> 3);
+	const char	*cp = in;
+	__u64		byte = start >> 3;
+	size_t		len = (num + 7) >> 3, n, offset;
+
+	while (len) {
+		offset = byte % BA_PAGE_BYTES;
+		n = BA_PAGE_BYTES - offset;
+		if (n > len)
+			n = len;
+		memcpy(ba_writable_bits(bp, byte << 3) + offset, cp, n);
+		byte += n;
+		cp += n;
+		len -= n;
+	}
 
 	return 0;
 }
@@ -295,8 +613,20 @@ static errcode_t ba_get_bmap_range(ext2fs_generic_bitmap bitmap,
 				     __u64 start, size_t num, void *out)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
-
-	memcpy (out, bp->bitarray + (start >> 3), (num + 7) >> 3);
+	char		*cp = out;
+	__u64		byte = start >> 3;
+	size_t		len = (num + 7) >> 3, n, offset;
+
+	while (len) {
+		offset = byte % BA_PAGE_BYTES;
+		n = BA_PAGE_BYTES - offset;
+		if (n > len)
+			n = len;
+		memcpy(cp, ba_page_bits(bp, byte << 3) + offset, n);
+		byte += n;
+		cp += n;
+		len -= n;
+	}
 
 	return 0;
 }
@@ -304,96 +634,124 @@ static errcode_t ba_get_bmap_range(ext2fs_generic_bitmap bitmap,
 static void ba_clear_bmap(ext2fs_generic_bitmap bitmap)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	struct ba_page	*page;
+	__u64		i;
 
-	memset(bp->bitarray, 0,
-	       (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1));
+	for (i = 0; i < bp->num_pages; i++) {
+		if (bp->pages[i]->refs > 1 && !ba_alloc_page(bp, &page)) {
+			ba_put_page(bp->pages[i]);
+			bp->pages[i] = page;
+		} else
+			memset(ba_writable_bits(bp, i << BA_PAGE_SHIFT), 0,
+			       BA_PAGE_BYTES);
+	}
 }
 
 static void ba_print_stats(ext2fs_generic_bitmap bitmap)
 {
+	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
+	unsigned long long shared = 0;
+	__u64	i;
+
+	for (i = 0; i < bp->num_pages; i++)
+		if (bp->pages[i]->refs > 1)
+			shared++;
 	fprintf(stderr, "%16llu Bytes used by bitarray\n",
-		((bitmap->real_end - bitmap->start) >> 3) + 1 +
+		(unsigned long long) bp->num_pages * sizeof(struct ba_page) +
 		sizeof(struct ext2fs_ba_private_struct));
+	fprintf(stderr, "%16llu of %llu pages shared with copies\n",
+		shared, (unsigned long long) bp->num_pages);
 }
 
-/* Find the first zero bit between start and end, inclusive. */
-static errcode_t ba_find_first_zero(ext2fs_generic_bitmap bitmap,
-				    __u64 start, __u64 end, __u64 *out)
+static size_t ba_mem_usage(ext2fs_generic_bitmap bitmap)
+{
+	return ((bitmap->real_end - bitmap->start) >> 3) + 1;
+}
+
+/* Index of the lowest set bit of a non-zero word */
+static inline int ba_ffs64(__u64 w)
+{
+#if defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4))
+	return __builtin_ctzll(w);
+#else
+	int bit = 0;
+
+	if (!(w & 0xffffffffULL)) { w >>= 32; bit += 32; }
+	if (!(w & 0xffff)) { w >>= 16; bit += 16; }
+	if (!(w & 0xff)) { w >>= 8; bit += 8; }
+	if (!(w & 0xf)) { w >>= 4; bit += 4; }
+	if (!(w & 0x3)) { w >>= 2; bit += 2; }
+	if (!(w & 0x1)) bit++;
+	return bit;
+#endif
+}
+
+/*
+ * Find the first bit between start and end, inclusive, which is set
+ * (invert == 0) or clear (invert == ~0).  Whole 64-bit words are
+ * compared at a time, and runs of full (or empty) words are skipped
+ * four at a time, which the compiler can turn into wide vector
+ * compares.
+ */
+static errcode_t ba_find_first(ext2fs_generic_bitmap bitmap, __u64 start,
+			       __u64 end, __u64 invert, __u64 *out)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
-	unsigned long bitpos = start - bitmap->start;
-	unsigned long count = end - start + 1;
-	int byte_found = 0; /* whether a != 0xff byte has been found */
-	const unsigned char *pos;
-	unsigned long max_loop_count, i;
+	__u64		bitpos, last, base, word, w;
+	const __u64	*p;
 
 	if (start < bitmap->start || end > bitmap->end || start > end)
 		return EINVAL;
 
-	if (bitmap->cluster_bits)
-		return EINVAL;
-
-	/* scan bits until we hit a byte boundary */
-	while ((bitpos & 0x7) != 0 && count > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-		count--;
-	}
-
-	if (!count)
-		return ENOENT;
-
-	pos = ((unsigned char *)bp->bitarray) + (bitpos >> 3);
-	/* scan bytes until 8-byte (64-bit) aligned */
-	while (count >= 8 && (((unsigned long)pos) & 0x07)) {
-		if (*pos != 0xff) {
-			byte_found = 1;
-			break;
-		}
-		pos++;
-		count -= 8;
-		bitpos += 8;
-	}
-
-	if (!byte_found) {
-		max_loop_count = count >> 6; /* 8-byte blocks */
-		i = max_loop_count;
-		while (i) {
-			if (*((const __u64 *)pos) != ((__u64)-1))
+	bitpos = start - bitmap->start;
+	last = end - bitmap->start;
+
+	while (bitpos <= last) {
+		base = bitpos & ~BA_PAGE_MASK;
+		p = bp->pages[bitpos >> BA_PAGE_SHIFT]->bits;
+		word = (bitpos & BA_PAGE_MASK) >> 6;
+		w = (ext2fs_le64_to_cpu(p[word]) ^ invert) &
+			(~0ULL << (bitpos & 63));
+		while (1) {
+			if (w) {
+				bitpos = base + (word << 6) + ba_ffs64(w);
+				if (bitpos > last)
+					return ENOENT;
+				*out = bitpos + bitmap->start;
+				return 0;
+			}
+			if (++word == BA_PAGE_WORDS)
 				break;
-			pos += 8;
-			i--;
-		}
-		count -= 64 * (max_loop_count - i);
-		bitpos += 64 * (max_loop_count - i);
-
-		max_loop_count = count >> 3;
-		i = max_loop_count;
-		while (i) {
-			if (*pos != 0xff) {
-				byte_found = 1;
+			if (base + (word << 6) > last)
+				return ENOENT;
+			/* Skip over uninteresting words, 256 bits at a time */
+			while (word + 4 <= BA_PAGE_WORDS &&
+			       base + ((word + 4) << 6) <= last &&
+			       !((p[word] ^ invert) | (p[word + 1] ^ invert) |
+				 (p[word + 2] ^ invert) |
+				 (p[word + 3] ^ invert)))
+				word += 4;
+			if (word == BA_PAGE_WORDS)
 				break;
-			}
-			pos++;
-			i--;
+			w = ext2fs_le64_to_cpu(p[word]) ^ invert;
 		}
-		count -= 8 * (max_loop_count - i);
-		bitpos += 8 * (max_loop_count - i);
+		bitpos = base + BA_PAGE_BITS;
 	}
+	return ENOENT;
+}
 
-	/* Here either count < 8 or byte_found == 1. */
-	while (count-- > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-	}
+/* Find the first zero bit between start and end, inclusive. */
+static errcode_t ba_find_first_zero(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	return ba_find_first(bitmap, start, end, ~0ULL, out);
+}
 
-	return ENOENT;
+/* Find the first set bit between start and end, inclusive. */
+static errcode_t ba_find_first_set(ext2fs_generic_bitmap bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	return ba_find_first(bitmap, start, end, 0, out);
 }
 
 struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
@@ -412,5 +770,31 @@ struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
 	.get_bmap_range = ba_get_bmap_range,
 	.clear_bmap = ba_clear_bmap,
 	.print_stats = ba_print_stats,
-	.find_first_zero = ba_find_first_zero
+	.find_first_zero = ba_find_first_zero,
+	.find_first_set = ba_find_first_set,
+	.mem_usage = ba_mem_usage,
 };
+
+/*
+ * Keep the pages of the big bitarray bitmaps created from now on in
+ * unlinked temporary files in dir, mapped into memory, so that the
+ * kernel can write them out instead of the process running out of
+ * memory; NULL goes back to anonymous memory.  Only supported where
+ * mmap() is; elsewhere the setting is ignored.
+ */
+errcode_t ext2fs_set_bitmap_spill(ext2_filsys fs, const char *dir)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (fs->bitmap_spill_dir)
+		ext2fs_free_mem(&fs->bitmap_spill_dir);
+	if (!dir)
+		return 0;
+	retval = ext2fs_get_mem(strlen(dir) + 1, &fs->bitmap_spill_dir);
+	if (retval)
+		return retval;
+	strcpy(fs->bitmap_spill_dir, dir);
+	return 0;
+}
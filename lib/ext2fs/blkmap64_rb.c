@@ -36,11 +36,34 @@ struct bmap_rb_extent {
 	__u64 count;
 };
 
+/*
+ * Extents are handed out from chunks of RB_CHUNK_EXTENTS, which are
+ * only freed when the whole bitmap is freed or cleared.  Extents
+ * released in between go on a free list, linked through the memory
+ * of their rb_node.
+ */
+#define RB_CHUNK_EXTENTS	256
+
+struct bmap_rb_chunk {
+	struct bmap_rb_chunk *next;
+	struct bmap_rb_extent ext[RB_CHUNK_EXTENTS];
+};
+
+struct bmap_rb_free_extent {
+	struct bmap_rb_free_extent *next;
+};
+
 struct ext2fs_rb_private {
 	struct rb_root root;
 	struct bmap_rb_extent *wcursor;
 	struct bmap_rb_extent *rcursor;
 	struct bmap_rb_extent *rcursor_next;
+	struct bmap_rb_chunk *chunks;
+	unsigned int chunk_used;	/* extents used in chunks[0] */
+	struct bmap_rb_free_extent *free_list;
+	unsigned long nr_chunks;
+	unsigned long nr_extents;	/* extents not on the free list */
+	unsigned long refs;		/* bitmaps sharing this tree */
 #ifdef BMAP_STATS_OPS
 	__u64 mark_hit;
 	__u64 test_hit;
@@ -60,7 +83,8 @@ inline static struct bmap_rb_extent *node_to_extent(struct rb_node *node)
 
 static int rb_insert_extent(__u64 start, __u64 count,
 			    struct ext2fs_rb_private *);
-static void rb_get_new_extent(struct bmap_rb_extent **, __u64, __u64);
+static void rb_get_new_extent(struct ext2fs_rb_private *,
+			      struct bmap_rb_extent **, __u64, __u64);
 
 /* #define DEBUG_RB */
 
@@ -138,18 +162,33 @@ err_out:
 #define print_tree(root, msg) do {} while (0)
 #endif
 
-static void rb_get_new_extent(struct bmap_rb_extent **ext, __u64 start,
-			     __u64 count)
+static void rb_get_new_extent(struct ext2fs_rb_private *bp,
+			      struct bmap_rb_extent **ext, __u64 start,
+			      __u64 count)
 {
 	struct bmap_rb_extent *new_ext;
+	struct bmap_rb_chunk *chunk;
 	int retval;
 
-	retval = ext2fs_get_mem(sizeof (struct bmap_rb_extent),
-				&new_ext);
-	if (retval) {
-		perror("ext2fs_get_mem");
-		exit(1);
+	if (bp->free_list) {
+		new_ext = (struct bmap_rb_extent *) bp->free_list;
+		bp->free_list = bp->free_list->next;
+	} else {
+		if (!bp->chunks || bp->chunk_used >= RB_CHUNK_EXTENTS) {
+			retval = ext2fs_get_mem(sizeof (struct bmap_rb_chunk),
+						&chunk);
+			if (retval) {
+				perror("ext2fs_get_mem");
+				exit(1);
+			}
+			chunk->next = bp->chunks;
+			bp->chunks = chunk;
+			bp->chunk_used = 0;
+			bp->nr_chunks++;
+		}
+		new_ext = &bp->chunks->ext[bp->chunk_used++];
 	}
+	bp->nr_extents++;
 
 	new_ext->start = start;
 	new_ext->count = count;
@@ -166,7 +205,9 @@ static void rb_free_extent(struct ext2fs_rb_private *bp,
 		bp->rcursor = NULL;
 	if (bp->rcursor_next == ext)
 		bp->rcursor_next = NULL;
-	ext2fs_free_mem(&ext);
+	((struct bmap_rb_free_extent *) ext)->next = bp->free_list;
+	bp->free_list = (struct bmap_rb_free_extent *) ext;
+	bp->nr_extents--;
 }
 
 static errcode_t rb_alloc_private_data (ext2fs_generic_bitmap bitmap)
@@ -182,6 +223,12 @@ static errcode_t rb_alloc_private_data (ext2fs_generic_bitmap bitmap)
 	bp->rcursor = NULL;
 	bp->rcursor_next = NULL;
 	bp->wcursor = NULL;
+	bp->chunks = NULL;
+	bp->chunk_used = 0;
+	bp->free_list = NULL;
+	bp->nr_chunks = 0;
+	bp->nr_extents = 0;
+	bp->refs = 1;
 
 #ifdef BMAP_STATS_OPS
 	bp->test_hit = 0;
@@ -204,17 +251,24 @@ static errcode_t rb_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
 	return 0;
 }
 
-static void rb_free_tree(struct rb_root *root)
+/* Release all of the extents at once, leaving an empty tree */
+static void rb_free_tree(struct ext2fs_rb_private *bp)
 {
-	struct bmap_rb_extent *ext;
-	struct rb_node *node, *next;
+	struct bmap_rb_chunk *chunk, *next;
 
-	for (node = ext2fs_rb_first(root); node; node = next) {
-		next = ext2fs_rb_next(node);
-		ext = node_to_extent(node);
-		ext2fs_rb_erase(node, root);
-		ext2fs_free_mem(&ext);
+	for (chunk = bp->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		ext2fs_free_mem(&chunk);
 	}
+	bp->root = RB_ROOT;
+	bp->chunks = NULL;
+	bp->chunk_used = 0;
+	bp->free_list = NULL;
+	bp->nr_chunks = 0;
+	bp->nr_extents = 0;
+	bp->rcursor = NULL;
+	bp->rcursor_next = NULL;
+	bp->wcursor = NULL;
 }
 
 static void rb_free_bmap(ext2fs_generic_bitmap bitmap)
@@ -223,37 +277,27 @@ static void rb_free_bmap(ext2fs_generic_bitmap bitmap)
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
 
-	rb_free_tree(&bp->root);
+	if (--bp->refs)
+		return;
+	rb_free_tree(bp);
 	ext2fs_free_mem(&bp);
 	bp = 0;
 }
 
-static errcode_t rb_copy_bmap(ext2fs_generic_bitmap src,
-			      ext2fs_generic_bitmap dest)
+static void rb_copy_tree(struct ext2fs_rb_private *src_bp,
+			 struct ext2fs_rb_private *dest_bp)
 {
-	struct ext2fs_rb_private *src_bp, *dest_bp;
 	struct bmap_rb_extent *src_ext, *dest_ext;
 	struct rb_node *dest_node, *src_node, *dest_last, **n;
-	errcode_t retval = 0;
-
-	retval = rb_alloc_private_data (dest);
-	if (retval)
-		return retval;
 
-	src_bp = (struct ext2fs_rb_private *) src->private;
-	dest_bp = (struct ext2fs_rb_private *) dest->private;
 	src_bp->rcursor = NULL;
 	dest_bp->rcursor = NULL;
 
 	src_node = ext2fs_rb_first(&src_bp->root);
 	while (src_node) {
 		src_ext = node_to_extent(src_node);
-		retval = ext2fs_get_mem(sizeof (struct bmap_rb_extent),
-					&dest_ext);
-		if (retval)
-			break;
-
-		memcpy(dest_ext, src_ext, sizeof(struct bmap_rb_extent));
+		rb_get_new_extent(dest_bp, &dest_ext, src_ext->start,
+				  src_ext->count);
 
 		dest_node = &dest_ext->node;
 		n = &dest_bp->root.rb_node;
@@ -269,12 +313,44 @@ static errcode_t rb_copy_bmap(ext2fs_generic_bitmap src,
 
 		src_node = ext2fs_rb_next(src_node);
 	}
+}
 
-	return retval;
+/*
+ * A copy shares the tree of the bitmap it was made from, until one of
+ * them is about to be changed: that one gets a tree of its own first.
+ * The cursors of a shared tree point into it, so the first lookups
+ * through either bitmap can use them.
+ */
+static errcode_t rb_copy_bmap(ext2fs_generic_bitmap src,
+			      ext2fs_generic_bitmap dest)
+{
+	struct ext2fs_rb_private *bp;
+
+	bp = (struct ext2fs_rb_private *) src->private;
+	bp->refs++;
+	dest->private = bp;
+	return 0;
 }
 
-static void rb_truncate(__u64 new_max, struct rb_root *root)
+static struct ext2fs_rb_private *rb_writable(ext2fs_generic_bitmap bitmap)
 {
+	struct ext2fs_rb_private *bp;
+
+	bp = (struct ext2fs_rb_private *) bitmap->private;
+	if (bp->refs == 1)
+		return bp;
+	if (rb_alloc_private_data(bitmap)) {
+		perror("ext2fs_get_mem");
+		exit(1);
+	}
+	rb_copy_tree(bp, (struct ext2fs_rb_private *) bitmap->private);
+	bp->refs--;
+	return (struct ext2fs_rb_private *) bitmap->private;
+}
+
+static void rb_truncate(__u64 new_max, struct ext2fs_rb_private *bp)
+{
+	struct rb_root *root = &bp->root;
 	struct bmap_rb_extent *ext;
 	struct rb_node *node;
 
@@ -286,7 +362,7 @@ static void rb_truncate(__u64 new_max, struct rb_root *root)
 			break;
 		else if (ext->start > new_max) {
 			ext2fs_rb_erase(node, root);
-			ext2fs_free_mem(&ext);
+			rb_free_extent(bp, ext);
 			node = ext2fs_rb_last(root);
 			continue;
 		} else
@@ -305,12 +381,12 @@ static errcode_t rb_resize_bmap(ext2fs_generic_bitmap bmap,
 		return 0;
 	}
 
-	bp = (struct ext2fs_rb_private *) bmap->private;
+	bp = rb_writable(bmap);
 	bp->rcursor = NULL;
 	bp->wcursor = NULL;
 
 	/* truncate tree to new_real_end size */
-	rb_truncate(new_real_end, &bp->root);
+	rb_truncate(new_real_end, bp);
 
 	bmap->end = new_end;
 	bmap->real_end = new_real_end;
@@ -430,7 +506,7 @@ got_extent:
 		}
 	}
 
-	rb_get_new_extent(&new_ext, start, count);
+	rb_get_new_extent(bp, &new_ext, start, count);
 
 	new_node = &new_ext->node;
 	ext2fs_rb_link_node(new_node, parent, n);
@@ -570,7 +646,7 @@ static int rb_mark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
 {
 	struct ext2fs_rb_private *bp;
 
-	bp = (struct ext2fs_rb_private *) bitmap->private;
+	bp = rb_writable(bitmap);
 	arg -= bitmap->start;
 
 	return rb_insert_extent(arg, 1, bp);
@@ -581,7 +657,7 @@ static int rb_unmark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
 	struct ext2fs_rb_private *bp;
 	int retval;
 
-	bp = (struct ext2fs_rb_private *) bitmap->private;
+	bp = rb_writable(bitmap);
 	arg -= bitmap->start;
 
 	retval = rb_remove_extent(arg, 1, bp);
@@ -606,7 +682,7 @@ static void rb_mark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
 {
 	struct ext2fs_rb_private *bp;
 
-	bp = (struct ext2fs_rb_private *) bitmap->private;
+	bp = rb_writable(bitmap);
 	arg -= bitmap->start;
 
 	rb_insert_extent(arg, num, bp);
@@ -617,7 +693,7 @@ static void rb_unmark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
 {
 	struct ext2fs_rb_private *bp;
 
-	bp = (struct ext2fs_rb_private *) bitmap->private;
+	bp = rb_writable(bitmap);
 	arg -= bitmap->start;
 
 	rb_remove_extent(arg, num, bp);
@@ -688,7 +764,7 @@ static errcode_t rb_set_bmap_range(ext2fs_generic_bitmap bitmap,
 	size_t i;
 	int first_set = -1;
 
-	bp = (struct ext2fs_rb_private *) bitmap->private;
+	bp = rb_writable(bitmap);
 
 	for (i = 0; i < num; i++) {
 		if ((i & 7) == 0) {
@@ -795,10 +871,84 @@ static void rb_clear_bmap(ext2fs_generic_bitmap bitmap)
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
 
-	rb_free_tree(&bp->root);
-	bp->rcursor = NULL;
-	bp->rcursor_next = NULL;
-	bp->wcursor = NULL;
+	/* a shared tree is left to the other bitmaps */
+	if (bp->refs > 1) {
+		bp->refs--;
+		if (rb_alloc_private_data(bitmap)) {
+			perror("ext2fs_get_mem");
+			exit(1);
+		}
+		return;
+	}
+	rb_free_tree(bp);
+}
+
+/*
+ * Return the extent containing bit, or failing that the first extent
+ * after it; NULL if there is none.
+ */
+static struct bmap_rb_extent *
+rb_find_extent(struct ext2fs_rb_private *bp, __u64 bit)
+{
+	struct rb_node *n = bp->root.rb_node;
+	struct bmap_rb_extent *ext, *next = NULL;
+
+	while (n) {
+		ext = node_to_extent(n);
+		if (bit < ext->start) {
+			next = ext;
+			n = n->rb_left;
+		} else if (bit >= (ext->start + ext->count))
+			n = n->rb_right;
+		else
+			return ext;
+	}
+	return next;
+}
+
+static errcode_t rb_find_first_zero(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_rb_private *bp;
+	struct bmap_rb_extent *ext;
+	__u64 bit, last;
+
+	bp = (struct ext2fs_rb_private *) bitmap->private;
+	bit = start - bitmap->start;
+	last = end - bitmap->start;
+
+	while (bit <= last) {
+		ext = rb_find_extent(bp, bit);
+		if (!ext || ext->start > bit) {
+			*out = bit + bitmap->start;
+			return 0;
+		}
+		/* Extents may touch, so look again past this one */
+		bit = ext->start + ext->count;
+	}
+	return ENOENT;
+}
+
+static errcode_t rb_find_first_set(ext2fs_generic_bitmap bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_rb_private *bp;
+	struct bmap_rb_extent *ext;
+	__u64 bit, last;
+
+	bp = (struct ext2fs_rb_private *) bitmap->private;
+	bit = start - bitmap->start;
+	last = end - bitmap->start;
+
+	ext = rb_find_extent(bp, bit);
+	if (!ext)
+		return ENOENT;
+	if (ext->start > bit)
+		bit = ext->start;
+	if (bit > last)
+		return ENOENT;
+	*out = bit + bitmap->start;
+	return 0;
 }
 
 #ifdef BMAP_STATS
@@ -811,7 +961,8 @@ static void rb_print_stats(ext2fs_generic_bitmap bitmap)
 	__u64 max_size = 0;
 	__u64 min_size = ULONG_MAX;
 	__u64 size = 0, avg_size = 0;
-	double eff;
+	__u64 arena;
+	double eff, arena_use = 0.0;
 #ifdef BMAP_STATS_OPS
 	__u64 mark_all, test_all;
 	double m_hit = 0.0, t_hit = 0.0;
@@ -835,8 +986,11 @@ static void rb_print_stats(ext2fs_generic_bitmap bitmap)
 		avg_size = size / count;
 	if (min_size == ULONG_MAX)
 		min_size = 0;
-	eff = (double)((count * sizeof(struct bmap_rb_extent)) << 3) /
-	      (bitmap->real_end - bitmap->start);
+	arena = bp->nr_chunks * sizeof(struct bmap_rb_chunk);
+	if (bp->nr_chunks)
+		arena_use = ((double)bp->nr_extents * 100) /
+			    (bp->nr_chunks * RB_CHUNK_EXTENTS);
+	eff = (double)(arena << 3) / (bitmap->real_end - bitmap->start);
 #ifdef BMAP_STATS_OPS
 	mark_all = bitmap->stats.mark_count + bitmap->stats.mark_ext_count;
 	test_all = bitmap->stats.test_count + bitmap->stats.test_ext_count;
@@ -852,6 +1006,8 @@ static void rb_print_stats(ext2fs_generic_bitmap bitmap)
 	fprintf(stderr, "%16llu extents (%llu bytes)\n",
 		count, ((count * sizeof(struct bmap_rb_extent)) +
 			sizeof(struct ext2fs_rb_private)));
+	fprintf(stderr, "%16lu extent chunks (%llu bytes, %.2f%% in use)\n",
+		bp->nr_chunks, arena, arena_use);
  	fprintf(stderr, "%16llu bits minimum size\n",
 		min_size);
 	fprintf(stderr, "%16llu bits maximum size\n"
@@ -867,6 +1023,20 @@ static void rb_print_stats(ext2fs_generic_bitmap bitmap)
 static void rb_print_stats(ext2fs_generic_bitmap bitmap){}
 #endif
 
+static size_t rb_mem_usage(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rb_private *bp;
+
+	bp = (struct ext2fs_rb_private *) bitmap->private;
+	return bp->nr_chunks * sizeof(struct bmap_rb_chunk);
+}
+
+/* What a tree of the given number of extents would cost at least */
+size_t ext2fs_rb_mem_estimate(__u64 extents)
+{
+	return extents * sizeof(struct bmap_rb_extent);
+}
+
 struct ext2_bitmap_ops ext2fs_blkmap64_rbtree = {
 	.type = EXT2FS_BMAP64_RBTREE,
 	.new_bmap = rb_new_bmap,
@@ -883,4 +1053,7 @@ struct ext2_bitmap_ops ext2fs_blkmap64_rbtree = {
 	.get_bmap_range = rb_get_bmap_range,
 	.clear_bmap = rb_clear_bmap,
 	.print_stats = rb_print_stats,
+	.find_first_zero = rb_find_first_zero,
+	.find_first_set = rb_find_first_set,
+	.mem_usage = rb_mem_usage,
 };
@@ -0,0 +1,741 @@
+/*
+ * blkmap64_rt.c --- Radix tree of bitmap pages
+ *
+ * The bitmap is split into leaf pages of RT_LEAF_BITS bits, which are
+ * reached through a radix tree of interior pages holding RT_NODE_SLOTS
+ * pointers each.  Only the leaf pages which have (or have had) a bit
+ * set are allocated, so a mostly empty bitmap costs a few pages, but
+ * a densely populated region costs no more than the bitarray
+ * implementation does.  This makes it a middle ground between the
+ * bitarray, which is always allocated in full, and the rbtree, which
+ * is very compact for long runs but needs one allocation for every
+ * extent when the bitmap is fragmented.
+ *
+ * Leaf and interior pages are the same size and are carved out of
+ * larger chunks, which are kept on a list per bitmap and released all
+ * at once when the bitmap is freed or cleared.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
+
+#define RT_PAGE_SIZE	4096
+#define RT_LEAF_SHIFT	15			/* log2 of bits per leaf */
+#define RT_LEAF_BITS	(1U << RT_LEAF_SHIFT)
+#define RT_LEAF_MASK	(RT_LEAF_BITS - 1)
+#define RT_NODE_SHIFT	9			/* log2 of slots per node */
+#define RT_NODE_SLOTS	(1U << RT_NODE_SHIFT)
+#define RT_NODE_MASK	(RT_NODE_SLOTS - 1)
+#define RT_CHUNK_PAGES	16			/* pages allocated at once */
+#define RT_NONE		(~(__u64) 0)
+
+union rt_page {
+	union rt_page	*next_free;
+	union rt_page	*slot[RT_NODE_SLOTS];
+	unsigned char	bits[RT_PAGE_SIZE];
+};
+
+struct rt_chunk {
+	struct rt_chunk	*next;
+	union rt_page	pages[RT_CHUNK_PAGES];
+};
+
+struct ext2fs_rt_private {
+	union rt_page	*root;
+	int		height;		/* levels of interior pages */
+	struct rt_chunk	*chunks;
+	unsigned int	chunk_used;	/* pages handed out from chunks */
+	union rt_page	*free_list;
+	unsigned long	nr_chunks;
+	unsigned long	nr_leaves;
+	unsigned long	nr_nodes;
+	/* The last leaf we looked up */
+	__u64		cache_idx;
+	union rt_page	*cache_leaf;
+};
+
+static union rt_page *rt_alloc_page(struct ext2fs_rt_private *bp)
+{
+	struct rt_chunk	*chunk;
+	union rt_page	*page;
+	errcode_t	retval;
+
+	if (bp->free_list) {
+		page = bp->free_list;
+		bp->free_list = page->next_free;
+	} else {
+		if (!bp->chunks || bp->chunk_used >= RT_CHUNK_PAGES) {
+			retval = ext2fs_get_mem(sizeof(struct rt_chunk),
+						&chunk);
+			if (retval) {
+				perror("ext2fs_get_mem");
+				exit(1);
+			}
+			chunk->next = bp->chunks;
+			bp->chunks = chunk;
+			bp->chunk_used = 0;
+			bp->nr_chunks++;
+		}
+		page = &bp->chunks->pages[bp->chunk_used++];
+	}
+	memset(page, 0, sizeof(union rt_page));
+	return page;
+}
+
+static void rt_free_page(struct ext2fs_rt_private *bp, union rt_page *page)
+{
+	page->next_free = bp->free_list;
+	bp->free_list = page;
+}
+
+static void rt_free_all_pages(struct ext2fs_rt_private *bp)
+{
+	struct rt_chunk	*chunk, *next;
+
+	for (chunk = bp->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		ext2fs_free_mem(&chunk);
+	}
+	bp->chunks = NULL;
+	bp->chunk_used = 0;
+	bp->free_list = NULL;
+	bp->root = NULL;
+	bp->nr_chunks = bp->nr_leaves = bp->nr_nodes = 0;
+	bp->cache_leaf = NULL;
+}
+
+/* Number of interior levels needed to address the whole bitmap */
+static int rt_height(ext2fs_generic_bitmap bitmap)
+{
+	__u64	nr_leaves = ((bitmap->real_end - bitmap->start) >>
+			     RT_LEAF_SHIFT) + 1;
+	int	height = 0;
+
+	while (height * RT_NODE_SHIFT < 64 &&
+	       ((__u64) 1 << (height * RT_NODE_SHIFT)) < nr_leaves)
+		height++;
+	return height;
+}
+
+/*
+ * Return the leaf page holding leaf number idx.  If it doesn't exist
+ * yet it is allocated when create is set, otherwise NULL is returned.
+ */
+static union rt_page *rt_lookup(struct ext2fs_rt_private *bp, __u64 idx,
+				int create)
+{
+	union rt_page	**pp = &bp->root;
+	int		level;
+
+	if (bp->cache_leaf && bp->cache_idx == idx)
+		return bp->cache_leaf;
+
+	for (level = bp->height; level > 0; level--) {
+		if (!*pp) {
+			if (!create)
+				return NULL;
+			*pp = rt_alloc_page(bp);
+			bp->nr_nodes++;
+		}
+		pp = &(*pp)->slot[(idx >> ((level - 1) * RT_NODE_SHIFT)) &
+				  RT_NODE_MASK];
+	}
+	if (!*pp) {
+		if (!create)
+			return NULL;
+		*pp = rt_alloc_page(bp);
+		bp->nr_leaves++;
+	}
+	bp->cache_idx = idx;
+	bp->cache_leaf = *pp;
+	return *pp;
+}
+
+/* Give a leaf page back to the pool; used when a whole leaf is cleared */
+static void rt_release_leaf(struct ext2fs_rt_private *bp, __u64 idx)
+{
+	union rt_page	**pp = &bp->root;
+	int		level;
+
+	for (level = bp->height; level > 0; level--) {
+		if (!*pp)
+			return;
+		pp = &(*pp)->slot[(idx >> ((level - 1) * RT_NODE_SHIFT)) &
+				  RT_NODE_MASK];
+	}
+	if (!*pp)
+		return;
+	if (bp->cache_leaf == *pp)
+		bp->cache_leaf = NULL;
+	rt_free_page(bp, *pp);
+	*pp = NULL;
+	bp->nr_leaves--;
+}
+
+static __u64 rt_next_leaf_node(union rt_page *node, int level, __u64 idx,
+			       union rt_page **leaf)
+{
+	unsigned int	slot, shift;
+	__u64		ret;
+
+	if (level == 0) {
+		*leaf = node;
+		return idx;
+	}
+	shift = (level - 1) * RT_NODE_SHIFT;
+	for (slot = (idx >> shift) & RT_NODE_MASK; slot < RT_NODE_SLOTS;
+	     slot++) {
+		if (node->slot[slot]) {
+			ret = rt_next_leaf_node(node->slot[slot], level - 1,
+						idx, leaf);
+			if (ret != RT_NONE)
+				return ret;
+		}
+		/* Move on to the first leaf under the next slot */
+		idx = ((idx >> shift) + 1) << shift;
+	}
+	return RT_NONE;
+}
+
+/*
+ * Find the first allocated leaf whose number is at least idx, skipping
+ * over missing subtrees; returns RT_NONE if there isn't one.
+ */
+static __u64 rt_next_leaf(struct ext2fs_rt_private *bp, __u64 idx,
+			  union rt_page **leaf)
+{
+	if (!bp->root)
+		return RT_NONE;
+	if (bp->height * RT_NODE_SHIFT < 64 &&
+	    idx >= ((__u64) 1 << (bp->height * RT_NODE_SHIFT)))
+		return RT_NONE;
+	return rt_next_leaf_node(bp->root, bp->height, idx, leaf);
+}
+
+/* Set or clear n bits of a leaf, starting at bit off */
+static void rt_fill_bits(unsigned char *bits, unsigned int off,
+			 unsigned int n, int set)
+{
+	for (; n && (off & 7); off++, n--) {
+		if (set)
+			ext2fs_fast_set_bit(off, bits);
+		else
+			ext2fs_fast_clear_bit(off, bits);
+	}
+	if (n >= 8) {
+		memset(bits + (off >> 3), set ? 0xff : 0, n >> 3);
+		off += n & ~7U;
+		n &= 7;
+	}
+	for (; n; off++, n--) {
+		if (set)
+			ext2fs_fast_set_bit(off, bits);
+		else
+			ext2fs_fast_clear_bit(off, bits);
+	}
+}
+
+/* Return true if n bits of a leaf starting at bit off are all clear */
+static int rt_bits_clear(const unsigned char *bits, unsigned int off,
+			 unsigned int n)
+{
+	for (; n && (off & 7); off++, n--)
+		if (ext2fs_test_bit(off, bits))
+			return 0;
+	if (n >= 8) {
+		if (!ext2fs_mem_is_zero((const char *) bits + (off >> 3),
+					n >> 3))
+			return 0;
+		off += n & ~7U;
+		n &= 7;
+	}
+	for (; n; off++, n--)
+		if (ext2fs_test_bit(off, bits))
+			return 0;
+	return 1;
+}
+
+/* Mark count bits starting at bit r, relative to the start of the bitmap */
+static void rt_mark_range(struct ext2fs_rt_private *bp, __u64 r, __u64 count)
+{
+	union rt_page	*leaf;
+	unsigned int	off, n;
+
+	while (count) {
+		off = r & RT_LEAF_MASK;
+		n = RT_LEAF_BITS - off;
+		if (n > count)
+			n = count;
+		leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 1);
+		rt_fill_bits(leaf->bits, off, n, 1);
+		r += n;
+		count -= n;
+	}
+}
+
+static void rt_unmark_range(struct ext2fs_rt_private *bp, __u64 r,
+			    __u64 count)
+{
+	union rt_page	*leaf;
+	unsigned int	off, n;
+	__u64		idx, last = r + count - 1;
+
+	if (!count)
+		return;
+	while (r <= last) {
+		idx = rt_next_leaf(bp, r >> RT_LEAF_SHIFT, &leaf);
+		if (idx == RT_NONE || (idx << RT_LEAF_SHIFT) > last)
+			return;
+		if ((idx << RT_LEAF_SHIFT) > r)
+			r = idx << RT_LEAF_SHIFT;
+		off = r & RT_LEAF_MASK;
+		n = RT_LEAF_BITS - off;
+		if (n > last - r + 1)
+			n = last - r + 1;
+		if (n == RT_LEAF_BITS)
+			rt_release_leaf(bp, idx);
+		else
+			rt_fill_bits(leaf->bits, off, n, 0);
+		r += n;
+		if (!r)		/* wrapped around */
+			return;
+	}
+}
+
+static errcode_t rt_alloc_private_data(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rt_private *bp;
+	errcode_t	retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2fs_rt_private), &bp);
+	if (retval)
+		return retval;
+	bp->height = rt_height(bitmap);
+	bitmap->private = (void *) bp;
+	return 0;
+}
+
+static errcode_t rt_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     ext2fs_generic_bitmap bitmap)
+{
+	return rt_alloc_private_data(bitmap);
+}
+
+static void rt_free_bmap(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rt_private *bp;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	if (!bp)
+		return;
+	rt_free_all_pages(bp);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t rt_copy_bmap(ext2fs_generic_bitmap src,
+			      ext2fs_generic_bitmap dest)
+{
+	struct ext2fs_rt_private *src_bp, *dest_bp;
+	union rt_page	*leaf;
+	errcode_t	retval;
+	__u64		idx;
+
+	retval = rt_alloc_private_data(dest);
+	if (retval)
+		return retval;
+
+	src_bp = (struct ext2fs_rt_private *) src->private;
+	dest_bp = (struct ext2fs_rt_private *) dest->private;
+
+	for (idx = rt_next_leaf(src_bp, 0, &leaf); idx != RT_NONE;
+	     idx = rt_next_leaf(src_bp, idx + 1, &leaf))
+		memcpy(rt_lookup(dest_bp, idx, 1), leaf,
+		       sizeof(union rt_page));
+	return 0;
+}
+
+static errcode_t rt_resize_bmap(ext2fs_generic_bitmap bmap,
+				__u64 new_end, __u64 new_real_end)
+{
+	struct ext2fs_rt_private *bp;
+	union rt_page	*node;
+	__u64		last;
+	int		height;
+
+	bp = (struct ext2fs_rt_private *) bmap->private;
+
+	/*
+	 * If we're expanding the bitmap, make sure all of the new
+	 * parts of the bitmap are zero.
+	 */
+	if (new_end > bmap->end) {
+		last = (new_end < bmap->real_end) ? new_end : bmap->real_end;
+		if (last > bmap->end)
+			rt_unmark_range(bp, bmap->end + 1 - bmap->start,
+					last - bmap->end);
+	}
+	/* Throw away whatever is past the new end of the bitmap */
+	if (new_real_end < bmap->real_end)
+		rt_unmark_range(bp, new_real_end + 1 - bmap->start,
+				bmap->real_end - new_real_end);
+
+	bmap->end = new_end;
+	bmap->real_end = new_real_end;
+
+	/*
+	 * The tree only ever grows taller; the existing tree becomes
+	 * the first subtree of the new root.
+	 */
+	height = rt_height(bmap);
+	while (bp->height < height) {
+		if (bp->root) {
+			node = rt_alloc_page(bp);
+			node->slot[0] = bp->root;
+			bp->root = node;
+			bp->nr_nodes++;
+		}
+		bp->height++;
+	}
+	return 0;
+}
+
+static int rt_mark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_rt_private *bp;
+	union rt_page	*leaf;
+	__u64		r = arg - bitmap->start;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 1);
+	return ext2fs_set_bit(r & RT_LEAF_MASK, leaf->bits);
+}
+
+static int rt_unmark_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_rt_private *bp;
+	union rt_page	*leaf;
+	__u64		r = arg - bitmap->start;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 0);
+	if (!leaf)
+		return 0;
+	return ext2fs_clear_bit(r & RT_LEAF_MASK, leaf->bits);
+}
+
+static int rt_test_bmap(ext2fs_generic_bitmap bitmap, __u64 arg)
+{
+	struct ext2fs_rt_private *bp;
+	union rt_page	*leaf;
+	__u64		r = arg - bitmap->start;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 0);
+	if (!leaf)
+		return 0;
+	return ext2fs_test_bit(r & RT_LEAF_MASK, leaf->bits);
+}
+
+static void rt_mark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				unsigned int num)
+{
+	rt_mark_range((struct ext2fs_rt_private *) bitmap->private,
+		      arg - bitmap->start, num);
+}
+
+static void rt_unmark_bmap_extent(ext2fs_generic_bitmap bitmap, __u64 arg,
+				  unsigned int num)
+{
+	rt_unmark_range((struct ext2fs_rt_private *) bitmap->private,
+			arg - bitmap->start, num);
+}
+
+static int rt_test_clear_bmap_extent(ext2fs_generic_bitmap bitmap,
+				     __u64 start, unsigned int len)
+{
+	struct ext2fs_rt_private *bp;
+	union rt_page	*leaf;
+	unsigned int	off, n;
+	__u64		r = start - bitmap->start;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	while (len) {
+		off = r & RT_LEAF_MASK;
+		n = RT_LEAF_BITS - off;
+		if (n > len)
+			n = len;
+		leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 0);
+		if (leaf && !rt_bits_clear(leaf->bits, off, n))
+			return 0;
+		r += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static errcode_t rt_set_bmap_range(ext2fs_generic_bitmap bitmap,
+				   __u64 start, size_t num, void *in)
+{
+	struct ext2fs_rt_private *bp;
+	const unsigned char *cp = in;
+	union rt_page	*leaf;
+	unsigned int	off, n, i;
+	size_t		pos = 0;
+	__u64		r = start - bitmap->start;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	while (pos < num) {
+		off = r & RT_LEAF_MASK;
+		n = RT_LEAF_BITS - off;
+		if (n > num - pos)
+			n = num - pos;
+		leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 0);
+		if (!leaf && (pos & 7) == 0 &&
+		    rt_bits_clear(cp + (pos >> 3), 0, n))
+			goto next;
+		if (!leaf)
+			leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 1);
+		i = 0;
+		if (((off | pos) & 7) == 0) {
+			memcpy(leaf->bits + (off >> 3), cp + (pos >> 3),
+			       n >> 3);
+			i = n & ~7U;
+		}
+		for (; i < n; i++) {
+			if (ext2fs_test_bit(pos + i, cp))
+				ext2fs_fast_set_bit(off + i, leaf->bits);
+			else
+				ext2fs_fast_clear_bit(off + i, leaf->bits);
+		}
+	next:
+		r += n;
+		pos += n;
+	}
+	return 0;
+}
+
+static errcode_t rt_get_bmap_range(ext2fs_generic_bitmap bitmap,
+				   __u64 start, size_t num, void *out)
+{
+	struct ext2fs_rt_private *bp;
+	unsigned char	*cp = out;
+	union rt_page	*leaf;
+	unsigned int	off, n, i;
+	size_t		pos = 0;
+	__u64		r = start - bitmap->start;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	memset(out, 0, (num + 7) >> 3);
+	while (pos < num) {
+		off = r & RT_LEAF_MASK;
+		n = RT_LEAF_BITS - off;
+		if (n > num - pos)
+			n = num - pos;
+		leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 0);
+		if (leaf) {
+			i = 0;
+			if (((off | pos) & 7) == 0) {
+				memcpy(cp + (pos >> 3),
+				       leaf->bits + (off >> 3), n >> 3);
+				i = n & ~7U;
+			}
+			for (; i < n; i++)
+				if (ext2fs_test_bit(off + i, leaf->bits))
+					ext2fs_fast_set_bit(pos + i, cp);
+		}
+		r += n;
+		pos += n;
+	}
+	return 0;
+}
+
+static void rt_clear_bmap(ext2fs_generic_bitmap bitmap)
+{
+	rt_free_all_pages((struct ext2fs_rt_private *) bitmap->private);
+}
+
+#ifdef BMAP_STATS
+static void rt_print_stats(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rt_private *bp;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	fprintf(stderr, "%16lu leaf pages, %lu interior pages, "
+		"tree height %d\n", bp->nr_leaves, bp->nr_nodes,
+		bp->height);
+	fprintf(stderr, "%16llu bytes in %lu chunks (%.2f%% in use)\n",
+		(unsigned long long) bp->nr_chunks * sizeof(struct rt_chunk) +
+		sizeof(struct ext2fs_rt_private), bp->nr_chunks,
+		bp->nr_chunks ? (double) (bp->nr_leaves + bp->nr_nodes) *
+		100 / (bp->nr_chunks * RT_CHUNK_PAGES) : 0.0);
+}
+#else
+static void rt_print_stats(ext2fs_generic_bitmap bitmap){}
+#endif
+
+static size_t rt_mem_usage(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rt_private *bp;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	return bp->nr_chunks * sizeof(struct rt_chunk);
+}
+
+/* Index of the lowest set bit of a non-zero word */
+static inline int rt_ffs64(__u64 w)
+{
+#if defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4))
+	return __builtin_ctzll(w);
+#else
+	int bit = 0;
+
+	if (!(w & 0xffffffffULL)) { w >>= 32; bit += 32; }
+	if (!(w & 0xffff)) { w >>= 16; bit += 16; }
+	if (!(w & 0xff)) { w >>= 8; bit += 8; }
+	if (!(w & 0xf)) { w >>= 4; bit += 4; }
+	if (!(w & 0x3)) { w >>= 2; bit += 2; }
+	if (!(w & 0x1)) bit++;
+	return bit;
+#endif
+}
+
+/*
+ * Find the first bit of a leaf between off and last, inclusive, which
+ * is set (invert == 0) or clear (invert == ~0); returns -1 if none.
+ */
+static int rt_leaf_find(const union rt_page *leaf, unsigned int off,
+			unsigned int last, __u64 invert)
+{
+	unsigned int	word = off >> 6, bit;
+	__u64		w;
+
+	memcpy(&w, leaf->bits + word * 8, 8);
+	w = (ext2fs_le64_to_cpu(w) ^ invert) & (~0ULL << (off & 63));
+	while (1) {
+		if (w) {
+			bit = (word << 6) + rt_ffs64(w);
+			return (bit > last) ? -1 : (int) bit;
+		}
+		if (++word > (last >> 6))
+			return -1;
+		memcpy(&w, leaf->bits + word * 8, 8);
+		w = ext2fs_le64_to_cpu(w) ^ invert;
+	}
+}
+
+/* Find the first zero bit between start and end, inclusive. */
+static errcode_t rt_find_first_zero(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_rt_private *bp;
+	union rt_page	*leaf;
+	__u64		r, last;
+	unsigned int	leaf_last;
+	int		bit;
+
+	if (start < bitmap->start || end > bitmap->end || start > end)
+		return EINVAL;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	r = start - bitmap->start;
+	last = end - bitmap->start;
+	while (1) {
+		leaf = rt_lookup(bp, r >> RT_LEAF_SHIFT, 0);
+		if (!leaf) {
+			*out = r + bitmap->start;
+			return 0;
+		}
+		leaf_last = RT_LEAF_MASK;
+		if ((r | RT_LEAF_MASK) > last)
+			leaf_last = last & RT_LEAF_MASK;
+		bit = rt_leaf_find(leaf, r & RT_LEAF_MASK, leaf_last, ~0ULL);
+		if (bit >= 0) {
+			*out = (r & ~(__u64) RT_LEAF_MASK) + bit +
+				bitmap->start;
+			return 0;
+		}
+		r = (r | RT_LEAF_MASK) + 1;
+		if (r > last || !r)
+			return ENOENT;
+	}
+}
+
+/* Find the first set bit between start and end, inclusive. */
+static errcode_t rt_find_first_set(ext2fs_generic_bitmap bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	struct ext2fs_rt_private *bp;
+	union rt_page	*leaf;
+	__u64		r, last, idx;
+	unsigned int	leaf_last;
+	int		bit;
+
+	if (start < bitmap->start || end > bitmap->end || start > end)
+		return EINVAL;
+
+	bp = (struct ext2fs_rt_private *) bitmap->private;
+	r = start - bitmap->start;
+	last = end - bitmap->start;
+	while (1) {
+		idx = rt_next_leaf(bp, r >> RT_LEAF_SHIFT, &leaf);
+		if (idx == RT_NONE || (idx << RT_LEAF_SHIFT) > last)
+			return ENOENT;
+		if ((idx << RT_LEAF_SHIFT) > r)
+			r = idx << RT_LEAF_SHIFT;
+		leaf_last = RT_LEAF_MASK;
+		if ((r | RT_LEAF_MASK) > last)
+			leaf_last = last & RT_LEAF_MASK;
+		bit = rt_leaf_find(leaf, r & RT_LEAF_MASK, leaf_last, 0);
+		if (bit >= 0) {
+			*out = (r & ~(__u64) RT_LEAF_MASK) + bit +
+				bitmap->start;
+			return 0;
+		}
+		r = (r | RT_LEAF_MASK) + 1;
+		if (r > last || !r)
+			return ENOENT;
+	}
+}
+
+struct ext2_bitmap_ops ext2fs_blkmap64_radixtree = {
+	.type = EXT2FS_BMAP64_RADIXTREE,
+	.new_bmap = rt_new_bmap,
+	.free_bmap = rt_free_bmap,
+	.copy_bmap = rt_copy_bmap,
+	.resize_bmap = rt_resize_bmap,
+	.mark_bmap = rt_mark_bmap,
+	.unmark_bmap = rt_unmark_bmap,
+	.test_bmap = rt_test_bmap,
+	.test_clear_bmap_extent = rt_test_clear_bmap_extent,
+	.mark_bmap_extent = rt_mark_bmap_extent,
+	.unmark_bmap_extent = rt_unmark_bmap_extent,
+	.set_bmap_range = rt_set_bmap_range,
+	.get_bmap_range = rt_get_bmap_range,
+	.clear_bmap = rt_clear_bmap,
+	.print_stats = rt_print_stats,
+	.find_first_zero = rt_find_first_zero,
+	.find_first_set = rt_find_first_set,
+	.mem_usage = rt_mem_usage,
+};
@@ -11,7 +11,7 @@
  * %End-Header%
  */
 
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 /*
  * Return the group # of a block
@@ -186,6 +186,18 @@ struct ext2_group_desc *ext2fs_group_desc(ext2_filsys fs,
 					  struct opaque_ext2_group_desc *gdp,
 					  dgrp_t group)
 {
+	unsigned long	blk;
+
+	/*
+	 * With EXT2_FLAG_LAZY_DESC, read the descriptor block the first
+	 * time it's needed.  If that fails, the descriptor reads as zeros
+	 * and reading it is tried again next time.
+	 */
+	if (fs->desc_unread && gdp == fs->group_desc) {
+		blk = group / EXT2_DESC_PER_BLOCK(fs->super);
+		if (blk < fs->desc_blocks && fs->desc_unread[blk])
+			ext2fs_read_desc_blocks(fs, blk, 1);
+	}
 	return (struct ext2_group_desc *)((char *)gdp +
 					  group * EXT2_DESC_SIZE(fs->super));
 }
@@ -305,6 +317,8 @@ void ext2fs_bg_free_blocks_count_set(ext2_filsys fs, dgrp_t group, __u32 n)
 
 	if (fs->super->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
 		gdp->bg_free_blocks_count_hi = (__u32) n >> 16;
+	if (fs->group_cache)
+		ext2fs_update_group_cache(fs, group);
 }
 
 /*
@@ -332,6 +346,8 @@ void ext2fs_bg_free_inodes_count_set(ext2_filsys fs, dgrp_t group, __u32 n)
 	gdp->bg_free_inodes_count = n;
 	if (fs->super->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
 		gdp->bg_free_inodes_count_hi = (__u32) n >> 16;
+	if (fs->group_cache)
+		ext2fs_update_group_cache(fs, group);
 }
 
 /*
@@ -386,6 +402,8 @@ void ext2fs_bg_itable_unused_set(ext2_filsys fs, dgrp_t group, __u32 n)
 	gdp->bg_itable_unused = n;
 	if (fs->super->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
 		gdp->bg_itable_unused_hi = (__u32) n >> 16;
+	if (fs->group_cache)
+		ext2fs_update_group_cache(fs, group);
 }
 
 /*
@@ -408,6 +426,8 @@ void ext2fs_bg_flags_zap(ext2_filsys fs, dgrp_t group)
 
 	gdp = ext4fs_group_desc(fs, fs->group_desc, group);
 	gdp->bg_flags = 0;
+	if (fs->group_cache)
+		ext2fs_update_group_cache(fs, group);
 	return;
 }
 
@@ -431,6 +451,8 @@ void ext2fs_bg_flags_set(ext2_filsys fs, dgrp_t group, __u16 bg_flags)
 
 	gdp = ext4fs_group_desc(fs, fs->group_desc, group);
 	gdp->bg_flags |= bg_flags;
+	if (fs->group_cache)
+		ext2fs_update_group_cache(fs, group);
 	return;
 }
 
@@ -443,6 +465,8 @@ void ext2fs_bg_flags_clear(ext2_filsys fs, dgrp_t group, __u16 bg_flags)
 
 	gdp = ext4fs_group_desc(fs, fs->group_desc, group);
 	gdp->bg_flags &= ~bg_flags;
+	if (fs->group_cache)
+		ext2fs_update_group_cache(fs, group);
 	return;
 }
 
@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -33,6 +34,7 @@ struct block_context {
 	char	*ind_buf;
 	char	*dind_buf;
 	char	*tind_buf;
+	blk_t	*ra_buf;
 	void	*priv_data;
 };
 
@@ -56,6 +58,47 @@ struct block_context {
 		}							\
 	} while (0)
 
+static int blk_cmp(const void *a, const void *b)
+{
+	blk_t	ba = *(const blk_t *) a;
+	blk_t	bb = *(const blk_t *) b;
+
+	if (ba < bb)
+		return -1;
+	return ba > bb;
+}
+
+/*
+ * A double or triple indirect block has just been read; start reading
+ * all of the indirect blocks it points to, in block order, so that
+ * they are in the cache by the time we descend into each of them.
+ */
+static void readahead_children(struct block_context *ctx, blk_t *list)
+{
+	ext2_filsys	fs = ctx->fs;
+	int		i, n = 0, start, limit = fs->blocksize >> 2;
+
+	if (!fs->io->manager->cache_readahead)
+		return;
+	if (!ctx->ra_buf &&
+	    ext2fs_get_array(limit, sizeof(blk_t), &ctx->ra_buf))
+		return;
+	for (i = 0; i < limit; i++)
+		if (list[i] >= fs->super->s_first_data_block &&
+		    list[i] < ext2fs_blocks_count(fs->super))
+			ctx->ra_buf[n++] = list[i];
+	if (n < 2)
+		return;
+	qsort(ctx->ra_buf, n, sizeof(blk_t), blk_cmp);
+	for (start = 0, i = 1; i <= n; i++) {
+		if (i < n && ctx->ra_buf[i] <= ctx->ra_buf[i - 1] + 1)
+			continue;
+		(void) io_channel_cache_readahead(fs->io, ctx->ra_buf[start],
+				ctx->ra_buf[i - 1] - ctx->ra_buf[start] + 1);
+		start = i;
+	}
+}
+
 static int block_iterate_ind(blk_t *ind_block, blk_t ref_block,
 			     int ref_offset, struct block_context *ctx)
 {
@@ -179,6 +222,7 @@ static int block_iterate_dind(blk_t *dind_block, blk_t ref_block,
 		ret |= BLOCK_ERROR;
 		return ret;
 	}
+	readahead_children(ctx, (blk_t *) ctx->dind_buf);
 
 	block_nr = (blk_t *) ctx->dind_buf;
 	offset = 0;
@@ -265,6 +309,7 @@ static int block_iterate_tind(blk_t *tind_block, blk_t ref_block,
 		ret |= BLOCK_ERROR;
 		return ret;
 	}
+	readahead_children(ctx, (blk_t *) ctx->tind_buf);
 
 	block_nr = (blk_t *) ctx->tind_buf;
 	offset = 0;
@@ -359,6 +404,7 @@ errcode_t ext2fs_block_iterate3(ext2_filsys fs,
 	ctx.priv_data = priv_data;
 	ctx.flags = flags;
 	ctx.bcount = 0;
+	ctx.ra_buf = NULL;
 	if (block_buf) {
 		ctx.ind_buf = block_buf;
 	} else {
@@ -553,6 +599,8 @@ abort_exit:
 		}
 	}
 errout:
+	if (ctx.ra_buf)
+		ext2fs_free_mem(&ctx.ra_buf);
 	if (!block_buf)
 		ext2fs_free_mem(&ctx.ind_buf);
 
@@ -649,3 +697,143 @@ errcode_t ext2fs_block_iterate(ext2_filsys fs,
 				     block_buf, xlate_func, &xl);
 }
 
+
+/*
+ * ext2fs_extent_iterate() calls back once per run of blocks which are
+ * contiguous both logically and on disk, instead of once per block:
+ * once per extent for an extent-mapped file, and for a block-mapped
+ * file once per run of data blocks found by ext2fs_block_iterate3(),
+ * up to EXT_INIT_MAX_LEN blocks long.
+ */
+struct run_context {
+	ext2_extent_iterate_func func;
+	void		*priv_data;
+	blk64_t		lblk, pblk;
+	__u32		len;
+	int		ret;
+};
+
+static int flush_run(ext2_filsys fs, struct run_context *rc)
+{
+	if (!rc->len)
+		return 0;
+	rc->ret |= (*rc->func)(fs, rc->lblk, rc->pblk, rc->len, 0,
+			       rc->priv_data);
+	rc->len = 0;
+	return rc->ret & BLOCK_ABORT;
+}
+
+static int run_block_func(ext2_filsys fs, blk64_t *blocknr,
+			  e2_blkcnt_t blockcnt,
+			  blk64_t ref_blk EXT2FS_ATTR((unused)),
+			  int ref_offset EXT2FS_ATTR((unused)),
+			  void *priv_data)
+{
+	struct run_context *rc = (struct run_context *) priv_data;
+
+	if (blockcnt < 0) {
+		if (flush_run(fs, rc))
+			return BLOCK_ABORT;
+		rc->ret |= (*rc->func)(fs, 0, *blocknr, 1,
+				       EXT2_EXTENT_ITERATE_METADATA,
+				       rc->priv_data);
+		return rc->ret & BLOCK_ABORT;
+	}
+	if (rc->len && rc->len < EXT_INIT_MAX_LEN &&
+	    (blk64_t) blockcnt == rc->lblk + rc->len &&
+	    *blocknr == rc->pblk + rc->len) {
+		rc->len++;
+		return 0;
+	}
+	if (flush_run(fs, rc))
+		return BLOCK_ABORT;
+	rc->lblk = blockcnt;
+	rc->pblk = *blocknr;
+	rc->len = 1;
+	return 0;
+}
+
+/*
+ * Call func for each run of blocks of the inode, in logical order, with
+ * the blocks which map it reported as they are reached.  The only flag
+ * honoured is BLOCK_FLAG_DATA_ONLY; the iteration is always read only.
+ * func returns BLOCK_ABORT to stop.  block_buf is passed to
+ * ext2fs_block_iterate3() for block-mapped files, and may be NULL.
+ */
+errcode_t ext2fs_extent_iterate(ext2_filsys fs, ext2_ino_t ino, int flags,
+				char *block_buf, ext2_extent_iterate_func func,
+				void *priv_data)
+{
+	struct ext2_inode	inode;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	struct run_context	rc;
+	blk64_t			next_lblk = 0;
+	int			op = EXT2_EXTENT_ROOT;
+	int			ret = 0;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (flags & ~BLOCK_FLAG_DATA_ONLY)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+
+	if (!(inode.i_flags & EXT4_EXTENTS_FL)) {
+		memset(&rc, 0, sizeof(rc));
+		rc.func = func;
+		rc.priv_data = priv_data;
+		retval = ext2fs_block_iterate3(fs, ino,
+					       flags | BLOCK_FLAG_READ_ONLY,
+					       block_buf, run_block_func, &rc);
+		if (!retval && !(rc.ret & BLOCK_ABORT))
+			flush_run(fs, &rc);
+		return retval;
+	}
+
+	if ((fs->super->s_creator_os == EXT2_OS_HURD) &&
+	    !(flags & BLOCK_FLAG_DATA_ONLY) &&
+	    inode.osd1.hurd1.h_i_translator) {
+		ret = (*func)(fs, 0, inode.osd1.hurd1.h_i_translator, 1,
+			      EXT2_EXTENT_ITERATE_METADATA, priv_data);
+		if (ret & BLOCK_ABORT)
+			return 0;
+	}
+
+	/* as for ext2fs_block_iterate3(), a bad tree root has no blocks */
+	if (ext2fs_extent_open2(fs, ino, &inode, &handle))
+		return 0;
+	while (1) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval) {
+			if (retval == EXT2_ET_EXTENT_NO_NEXT)
+				retval = 0;
+			break;
+		}
+		op = EXT2_EXTENT_NEXT;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
+			if ((flags & BLOCK_FLAG_DATA_ONLY) ||
+			    (extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT))
+				continue;
+			ret = (*func)(fs, extent.e_lblk, extent.e_pblk, 1,
+				      EXT2_EXTENT_ITERATE_METADATA, priv_data);
+		} else {
+			/* as ext2fs_block_iterate3(), skip overlapped extents */
+			if (!extent.e_len ||
+			    extent.e_lblk + extent.e_len <= next_lblk)
+				continue;
+			next_lblk = extent.e_lblk + extent.e_len;
+			ret = (*func)(fs, extent.e_lblk, extent.e_pblk,
+				      extent.e_len,
+				      (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) ?
+				      EXT2_EXTENT_ITERATE_UNINIT : 0,
+				      priv_data);
+		}
+		if (ret & BLOCK_ABORT)
+			break;
+	}
+	ext2fs_extent_free(handle);
+	return retval;
+}
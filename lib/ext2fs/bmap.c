@@ -288,6 +288,215 @@ int ext2fs_file_block_offset_too_big(ext2_filsys fs,
 	return offset >= max_map_block;
 }
 
+/*
+ * Looking a block up in an extent tree means opening a handle and
+ * descending from the root.  Callers which walk a file block by block
+ * would do that for every block, so the tree of the inode looked up last
+ * is kept open at the extent which was found.  A block inside the range
+ * found last, or in the extent right after it, is then answered without
+ * reading anything.
+ *
+ * The cache is dropped whenever the inode is written or its tree is
+ * changed through an extent handle, and it is only used when the root in
+ * the caller's inode is the one it was built from.
+ */
+#define BMAP_CACHE_MAX_LBLK	((1ULL << 32) - 1)
+
+static void bmap_cache_hole(struct ext2fs_extent *range, blk64_t start,
+			    blk64_t end)
+{
+	range->e_lblk = start;
+	range->e_pblk = 0;
+	range->e_len = end - start;
+	range->e_flags = 0;
+}
+
+static int bmap_cache_in(struct ext2fs_extent *extent, blk64_t block)
+{
+	return block >= extent->e_lblk &&
+		block < extent->e_lblk + extent->e_len;
+}
+
+void ext2fs_forget_bmap_cache(ext2_filsys fs, ext2_ino_t ino)
+{
+	struct ext2_bmap_cache	*cache = fs->bmap_cache;
+
+	if (!cache || !cache->ino || cache->ino != ino)
+		return;
+	ext2fs_extent_free(cache->handle);
+	cache->handle = 0;
+	cache->ino = 0;
+	cache->cur_valid = 0;
+}
+
+void ext2fs_free_bmap_cache(ext2_filsys fs)
+{
+	if (!fs->bmap_cache)
+		return;
+	ext2fs_forget_bmap_cache(fs, fs->bmap_cache->ino);
+	ext2fs_free_mem(&fs->bmap_cache);
+}
+
+/*
+ * Find the extent containing block, or the hole around it, which is
+ * returned with e_pblk set to 0.
+ */
+static errcode_t bmap_cache_lookup(ext2_filsys fs, ext2_ino_t ino,
+				   struct ext2_inode *inode, blk64_t block,
+				   struct ext2fs_extent *range)
+{
+	struct ext2_bmap_cache	*cache = fs->bmap_cache;
+	struct ext2fs_extent	extent;
+	errcode_t		retval, retval2;
+
+	if (!cache) {
+		retval = ext2fs_get_mem(sizeof(struct ext2_bmap_cache),
+					&cache);
+		if (retval)
+			return retval;
+		memset(cache, 0, sizeof(struct ext2_bmap_cache));
+		fs->bmap_cache = cache;
+	}
+	if (cache->ino && (cache->ino != ino ||
+			   memcmp(cache->i_block, inode->i_block,
+				  sizeof(cache->i_block))))
+		ext2fs_forget_bmap_cache(fs, cache->ino);
+	if (!cache->ino) {
+		cache->inode = *inode;
+		retval = ext2fs_extent_open2(fs, ino, &cache->inode,
+					     &cache->handle);
+		if (retval)
+			return retval;
+		memcpy(cache->i_block, inode->i_block,
+		       sizeof(cache->i_block));
+		cache->ino = ino;
+		cache->range.e_len = 0;
+		cache->cur_valid = 0;
+	}
+
+	if (bmap_cache_in(&cache->range, block))
+		goto found;
+	if (cache->cur_valid && bmap_cache_in(&cache->cur, block)) {
+		cache->range = cache->cur;
+		goto found;
+	}
+
+	/* Reading forward, the next extent is usually the one we want */
+	if (cache->cur_valid &&
+	    block >= cache->cur.e_lblk + cache->cur.e_len) {
+		retval = ext2fs_extent_get(cache->handle,
+					   EXT2_EXTENT_NEXT_LEAF, &extent);
+		if (retval == EXT2_ET_EXTENT_NO_NEXT) {
+			cache->cur_valid = 0;
+			bmap_cache_hole(&cache->range, block,
+					BMAP_CACHE_MAX_LBLK);
+			goto found;
+		}
+		if (retval)
+			goto errout;
+		cache->cur = extent;
+		if (bmap_cache_in(&extent, block)) {
+			cache->range = extent;
+			goto found;
+		}
+		if (extent.e_lblk > block) {
+			bmap_cache_hole(&cache->range, block, extent.e_lblk);
+			goto found;
+		}
+	}
+
+	retval = ext2fs_extent_goto(cache->handle, block);
+	if (retval && retval != EXT2_ET_EXTENT_NOT_FOUND)
+		goto errout;
+	retval2 = ext2fs_extent_get(cache->handle, EXT2_EXTENT_CURRENT,
+				    &extent);
+	if (!retval) {
+		if (retval2) {
+			retval = retval2;
+			goto errout;
+		}
+		cache->cur = cache->range = extent;
+		cache->cur_valid = 1;
+		goto found;
+	}
+
+	/*
+	 * The block is in a hole; _goto() leaves the handle at the extent
+	 * before it, or at the first one if there is none before it.
+	 */
+	if (retval2 == EXT2_ET_NO_CURRENT_NODE) {
+		cache->cur_valid = 0;
+		bmap_cache_hole(&cache->range, block, BMAP_CACHE_MAX_LBLK);
+		goto found;
+	} else if (retval2) {
+		retval = retval2;
+		goto errout;
+	}
+	cache->cur = extent;
+	cache->cur_valid = 1;
+	if (extent.e_lblk > block) {
+		bmap_cache_hole(&cache->range, block, extent.e_lblk);
+		goto found;
+	}
+	retval = ext2fs_extent_get(cache->handle, EXT2_EXTENT_NEXT_LEAF,
+				   &extent);
+	if (retval == EXT2_ET_EXTENT_NO_NEXT) {
+		cache->cur_valid = 0;
+		bmap_cache_hole(&cache->range, block, BMAP_CACHE_MAX_LBLK);
+		goto found;
+	}
+	if (retval)
+		goto errout;
+	cache->cur = extent;
+	bmap_cache_hole(&cache->range, block, extent.e_lblk > block ?
+			extent.e_lblk : block + 1);
+found:
+	*range = cache->range;
+	return 0;
+
+errout:
+	ext2fs_forget_bmap_cache(fs, ino);
+	return retval;
+}
+
+/*
+ * Return the mapping around a logical block of a file: for a file
+ * using extents, the whole extent which contains block, or the hole
+ * around it with e_pblk set to 0.  A file using indirect blocks gets
+ * just the one block.
+ */
+errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+			    struct ext2_inode *inode, blk64_t block,
+			    struct ext2fs_extent *extent)
+{
+	struct ext2_inode inode_buf;
+	blk64_t		pblk;
+	int		ret_flags;
+	errcode_t	retval;
+
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+
+	if (ext2fs_file_block_offset_too_big(fs, inode, block))
+		return EXT2_ET_FILE_TOO_BIG;
+
+	if ((inode->i_flags & EXT4_EXTENTS_FL) && ino)
+		return bmap_cache_lookup(fs, ino, inode, block, extent);
+
+	retval = ext2fs_bmap2(fs, ino, inode, 0, 0, block, &ret_flags, &pblk);
+	if (retval)
+		return retval;
+	extent->e_lblk = block;
+	extent->e_pblk = pblk;
+	extent->e_len = 1;
+	extent->e_flags = 0;
+	return 0;
+}
+
 errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 		       char *block_buf, int bmap_flags, blk64_t block,
 		       int *ret_flags, blk64_t *phys_blk)
@@ -318,6 +527,22 @@ errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 	if (ext2fs_file_block_offset_too_big(fs, inode, block))
 		return EXT2_ET_FILE_TOO_BIG;
 
+	if ((inode->i_flags & EXT4_EXTENTS_FL) && ino &&
+	    !(bmap_flags & (BMAP_ALLOC | BMAP_SET))) {
+		struct ext2fs_extent	range;
+
+		if (bmap_cache_lookup(fs, ino, inode, block, &range) == 0) {
+			if (range.e_pblk) {
+				*phys_blk = range.e_pblk +
+					(block - range.e_lblk);
+				if (ret_flags && (range.e_flags &
+						  EXT2_EXTENT_FLAGS_UNINIT))
+					*ret_flags |= BMAP_RET_UNINIT;
+			}
+			return 0;
+		}
+	}
+
 	if (!block_buf) {
 		retval = ext2fs_get_array(2, fs->blocksize, &buf);
 		if (retval)
@@ -12,8 +12,9 @@
 struct ext2_bmap_statistics {
 	int		type;
 	struct timeval	created;
+	unsigned long	conversions;	/* of an adaptive bitmap's backend */
 
-#ifdef BMAP_STATS_OPS
+	/* Only counted if the bitmap has EXT2_BMFLAG_STATS */
 	unsigned long	copy_count;
 	unsigned long	resize_count;
 	unsigned long	mark_count;
@@ -33,6 +34,10 @@ struct ext2_bmap_statistics {
 
 	unsigned long	mark_seq;
 	unsigned long	test_seq;
+
+#ifdef BMAP_STATS_OPS
+	/* Operations are logged here if E2FSPROGS_BITMAP_TRACE is set */
+	FILE		*trace;
 #endif /* BMAP_STATS_OPS */
 };
 
@@ -48,11 +53,17 @@ struct ext2fs_struct_generic_bitmap {
 	char			*description;
 	void			*private;
 	errcode_t		base_error_code;
+	/* Changes left until an adaptive bitmap checks its backend */
+	unsigned long		adapt_countdown;
 #ifdef BMAP_STATS
 	struct ext2_bmap_statistics	stats;
 #endif
 };
 
+/* Flags for ext2fs_struct_generic_bitmap */
+#define EXT2_BMFLAG_ADAPTIVE	0x0001	/* may switch backends */
+#define EXT2_BMFLAG_STATS	0x0002	/* counts its operations */
+
 #define EXT2FS_IS_32_BITMAP(bmap) \
 	(((bmap)->magic == EXT2_ET_MAGIC_GENERIC_BITMAP) || \
 	 ((bmap)->magic == EXT2_ET_MAGIC_BLOCK_BITMAP) || \
@@ -91,10 +102,23 @@ struct ext2_bitmap_ops {
 	void (*print_stats)(ext2fs_generic_bitmap);
 
 	/* Find the first zero bit between start and end, inclusive.
-	 * May be NULL, in which case a generic function is used. */
+	 * May be NULL, in which case a generic function is used.
+	 * start and end are in units of clusters and have already
+	 * been checked against the bounds of the bitmap. */
 	errcode_t (*find_first_zero)(ext2fs_generic_bitmap bitmap,
 				     __u64 start, __u64 end, __u64 *out);
+	/* The same for the first set bit. */
+	errcode_t (*find_first_set)(ext2fs_generic_bitmap bitmap,
+				    __u64 start, __u64 end, __u64 *out);
+
+	/* Bytes of memory holding the bits.  May be NULL, in which
+	 * case the bitmap is never converted away from this backend. */
+	size_t	(*mem_usage)(ext2fs_generic_bitmap bitmap);
 };
 
 extern struct ext2_bitmap_ops ext2fs_blkmap64_bitarray;
 extern struct ext2_bitmap_ops ext2fs_blkmap64_rbtree;
+extern struct ext2_bitmap_ops ext2fs_blkmap64_radixtree;
+
+/* blkmap64_rb.c */
+extern size_t ext2fs_rb_mem_estimate(__u64 extents);
@@ -10,6 +10,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -27,9 +28,144 @@
 #include "ext2fs.h"
 
 /*
- * This routine sanity checks the group descriptors
+ * The blocks taken by one piece of metadata, for check_desc_extents()
  */
-errcode_t ext2fs_check_desc(ext2_filsys fs)
+struct desc_extent {
+	blk64_t	start;
+	blk64_t	end;		/* inclusive */
+	int	super;		/* a superblock or descriptors */
+};
+
+static EXT2_QSORT_TYPE desc_extent_cmp(const void *a, const void *b)
+{
+	const struct desc_extent *ea = a, *eb = b;
+
+	if (ea->start != eb->start)
+		return ea->start < eb->start ? -1 : 1;
+	return 0;
+}
+
+static void add_desc_extent(struct desc_extent *ext, int *n, blk64_t start,
+			    blk64_t end, int super)
+{
+	/* The descriptors usually follow their superblock */
+	if (super && *n && ext[*n - 1].super && ext[*n - 1].end + 1 == start) {
+		ext[*n - 1].end = end;
+		return;
+	}
+	ext[*n].start = start;
+	ext[*n].end = end;
+	ext[*n].super = super;
+	(*n)++;
+}
+
+/*
+ * Check the layout by sorting the extents taken by the superblocks,
+ * descriptors, bitmaps and inode tables of all the groups and making
+ * one pass over them, rather than by marking all of their blocks in a
+ * bitmap as big as the file system, which can take gigabytes.  The
+ * superblocks and descriptors may overlap each other (with meta_bg
+ * they can), but nothing else may overlap anything.
+ *
+ * Returns 0 if the layout is sane, and 1 if it isn't or couldn't be
+ * checked this way; check_desc_map() then finds out what is wrong,
+ * with the same answer as it always gave.
+ */
+static int check_desc_extents(ext2_filsys fs)
+{
+	struct desc_extent *ext;
+	blk64_t first_block = fs->super->s_first_data_block;
+	blk64_t last_block = ext2fs_blocks_count(fs->super)-1;
+	blk64_t super_blk, old_desc_blk, new_desc_blk, blk, max_end = 0;
+	blk64_t max_meta_end = 0;
+	unsigned int old_desc_blocks, num_blocks;
+	int n = 0, k, have_meta = 0, ret = 0;
+	dgrp_t i;
+
+	if (ext2fs_get_array((size_t) fs->group_desc_count * 4 + 2,
+			     sizeof(struct desc_extent), &ext))
+		return 1;
+
+	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+		old_desc_blocks = fs->super->s_first_meta_bg;
+	else
+		old_desc_blocks =
+			fs->desc_blocks + fs->super->s_reserved_gdt_blocks;
+
+	for (i = 0; i < fs->group_desc_count; i++) {
+		/* As ext2fs_reserve_super_and_bgd() would mark them */
+		ext2fs_super_and_bgd_loc2(fs, i, &super_blk, &old_desc_blk,
+					  &new_desc_blk, 0);
+		if ((i == 0) && (fs->blocksize == 1024) &&
+		    EXT2FS_CLUSTER_RATIO(fs) > 1)
+			add_desc_extent(ext, &n, 0, 0, 1);
+		if (super_blk || (i == 0))
+			add_desc_extent(ext, &n, super_blk, super_blk, 1);
+		if (old_desc_blk) {
+			num_blocks = old_desc_blocks;
+			if (old_desc_blk + num_blocks >=
+			    ext2fs_blocks_count(fs->super))
+				num_blocks = ext2fs_blocks_count(fs->super) -
+					old_desc_blk;
+			if (num_blocks)
+				add_desc_extent(ext, &n, old_desc_blk,
+						old_desc_blk + num_blocks - 1,
+						1);
+		}
+		if (new_desc_blk)
+			add_desc_extent(ext, &n, new_desc_blk, new_desc_blk,
+					1);
+
+		if (!EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+					       EXT4_FEATURE_INCOMPAT_FLEX_BG)) {
+			first_block = ext2fs_group_first_block2(fs, i);
+			last_block = ext2fs_group_last_block2(fs, i);
+		}
+		blk = ext2fs_block_bitmap_loc(fs, i);
+		if (blk < first_block || blk > last_block)
+			goto bad;
+		add_desc_extent(ext, &n, blk, blk, 0);
+		blk = ext2fs_inode_bitmap_loc(fs, i);
+		if (blk < first_block || blk > last_block)
+			goto bad;
+		add_desc_extent(ext, &n, blk, blk, 0);
+		blk = ext2fs_inode_table_loc(fs, i);
+		if (blk < first_block ||
+		    ((blk + fs->inode_blocks_per_group - 1) > last_block))
+			goto bad;
+		if (fs->inode_blocks_per_group)
+			add_desc_extent(ext, &n, blk,
+					blk + fs->inode_blocks_per_group - 1,
+					0);
+	}
+
+	qsort(ext, n, sizeof(struct desc_extent), desc_extent_cmp);
+	for (k = 0; k < n; k++) {
+		if (ext[k].super ? (have_meta && max_meta_end >= ext[k].start) :
+		    (k && max_end >= ext[k].start))
+			goto bad;
+		if (!k || ext[k].end > max_end)
+			max_end = ext[k].end;
+		if (!ext[k].super &&
+		    (!have_meta || ext[k].end > max_meta_end)) {
+			max_meta_end = ext[k].end;
+			have_meta = 1;
+		}
+	}
+	goto out;
+bad:
+	ret = 1;
+out:
+	ext2fs_free_mem(&ext);
+	return ret;
+}
+
+/*
+ * Find out what is wrong with the layout by marking the blocks of the
+ * metadata in a bitmap, one group table after another, so that the
+ * first one found to be out of place is the one blamed.
+ */
+static errcode_t check_desc_map(ext2_filsys fs)
 {
 	ext2fs_block_bitmap bmap;
 	errcode_t retval;
@@ -39,11 +175,6 @@ errcode_t ext2fs_check_desc(ext2_filsys fs)
 	blk64_t blk, b;
 	unsigned int j;
 
-	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
-
-	if (EXT2_DESC_SIZE(fs->super) & (EXT2_DESC_SIZE(fs->super) - 1))
-		return EXT2_ET_BAD_DESC_SIZE;
-
 	retval = ext2fs_allocate_subcluster_bitmap(fs, "check_desc map", &bmap);
 	if (retval)
 		return retval;
@@ -102,3 +233,24 @@ errout:
 	ext2fs_free_block_bitmap(bmap);
 	return retval;
 }
+
+/*
+ * This routine sanity checks the group descriptors
+ */
+errcode_t ext2fs_check_desc(ext2_filsys fs)
+{
+	errcode_t retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (EXT2_DESC_SIZE(fs->super) & (EXT2_DESC_SIZE(fs->super) - 1))
+		return EXT2_ET_BAD_DESC_SIZE;
+
+	retval = ext2fs_read_group_descs(fs);
+	if (retval)
+		return retval;
+
+	if (check_desc_extents(fs) == 0)
+		return 0;
+	return check_desc_map(fs);
+}
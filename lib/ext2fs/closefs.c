@@ -242,22 +242,158 @@ void ext2fs_update_dynamic_rev(ext2_filsys fs)
 	/* other fields should be left alone */
 }
 
-static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
-				    blk64_t group_block,
-				    struct ext2_super_block *super_shadow)
+/*
+ * Returns the s_block_group_nr of the backup superblock in group, in
+ * on-disk byte order.
+ */
+static __u16 backup_group_nr(dgrp_t group)
 {
 	dgrp_t	sgrp = group;
 
 	if (sgrp > ((1 << 16) - 1))
 		sgrp = (1 << 16) - 1;
 #ifdef WORDS_BIGENDIAN
-	super_shadow->s_block_group_nr = ext2fs_swab16(sgrp);
+	return ext2fs_swab16(sgrp);
 #else
-	fs->super->s_block_group_nr = sgrp;
+	return sgrp;
+#endif
+}
+
+/*
+ * Returns 1 if the only fields of the superblock which changed since it
+ * was last written are the free counts, the write and mount times, the
+ * mount and check counts and the lifetime write count.  Nothing reads
+ * those from a backup superblock without recomputing them.
+ */
+static int super_counters_only(ext2_filsys fs)
+{
+	struct ext2_super_block	new_sb, old_sb;
+	struct ext2_super_block	*sb;
+	int			i;
+
+	if (!fs->orig_super)
+		return 0;
+	new_sb = *fs->super;
+#ifdef WORDS_BIGENDIAN
+	ext2fs_swap_super(&new_sb);
 #endif
+	memcpy(&old_sb, fs->orig_super, SUPERBLOCK_SIZE);
+
+	for (i = 0, sb = &new_sb; i < 2; i++, sb = &old_sb) {
+		sb->s_free_blocks_count = 0;
+		sb->s_free_blocks_hi = 0;
+		sb->s_free_inodes_count = 0;
+		sb->s_mtime = 0;
+		sb->s_wtime = 0;
+		sb->s_mnt_count = 0;
+		sb->s_lastcheck = 0;
+		sb->s_kbytes_written = 0;
+		sb->s_checksum = 0;
+	}
+	return memcmp(&new_sb, &old_sb, SUPERBLOCK_SIZE) == 0;
+}
+
+/*
+ * The backup superblocks and the copies of the group descriptors are
+ * spread over the whole disk.  Rather than writing them group by group,
+ * ext2fs_flush2() collects them in a list, sorts it by block number and
+ * merges the writes to adjacent blocks into one.
+ */
+struct flush_write {
+	blk64_t	blk;
+	int	count;		/* in blocks, or -SUPERBLOCK_SIZE */
+	dgrp_t	group;
+	char	*buf;		/* NULL for a backup superblock */
+};
+
+static int flush_write_cmp(const void *a, const void *b)
+{
+	const struct flush_write *wa = a, *wb = b;
+
+	if (wa->blk != wb->blk)
+		return wa->blk < wb->blk ? -1 : 1;
+	return 0;
+}
+
+static void add_flush_write(struct flush_write *list, int *num,
+			    blk64_t blk, int count, dgrp_t group, char *buf)
+{
+	struct flush_write *w = &list[(*num)++];
 
-	return io_channel_write_blk64(fs->io, group_block, -SUPERBLOCK_SIZE,
-				    super_shadow);
+	w->blk = blk;
+	w->count = count;
+	w->group = group;
+	w->buf = buf;
+}
+
+static errcode_t write_flush_list(ext2_filsys fs, struct flush_write *list,
+				  int num, struct ext2_super_block *super_shadow,
+				  struct ext2fs_numeric_progress_struct *progress)
+{
+	struct ext2_super_block *sb;
+	char		*buf = 0, *p;
+	unsigned long	buf_size = 0, size;
+	blk64_t		count;
+	errcode_t	retval = 0;
+	int		i, j, k;
+
+	qsort(list, num, sizeof(struct flush_write), flush_write_cmp);
+
+	for (i = 0; i < num; i = j) {
+		ext2fs_numeric_progress_update(fs, progress, list[i].group);
+
+		/* Find the writes which continue this one on disk */
+		count = list[i].count;
+		for (j = i + 1; j < num && list[i].count > 0 &&
+			     list[j].count > 0 &&
+			     list[i].blk + count == list[j].blk; j++)
+			count += list[j].count;
+
+		if (j == i + 1) {
+			if (list[i].buf) {
+				retval = io_channel_write_blk64(fs->io,
+						list[i].blk, list[i].count,
+						list[i].buf);
+			} else {
+				super_shadow->s_block_group_nr =
+					backup_group_nr(list[i].group);
+				retval = io_channel_write_blk64(fs->io,
+						list[i].blk, -SUPERBLOCK_SIZE,
+						super_shadow);
+			}
+			if (retval)
+				break;
+			continue;
+		}
+
+		size = count * fs->blocksize;
+		if (size > buf_size) {
+			retval = ext2fs_resize_mem(buf_size, size, &buf);
+			if (retval)
+				break;
+			buf_size = size;
+		}
+		for (k = i, p = buf; k < j; k++) {
+			size = list[k].count * fs->blocksize;
+			if (list[k].buf) {
+				memcpy(p, list[k].buf, size);
+			} else {
+				/* Only merged if the block size is 1k */
+				memcpy(p, super_shadow, SUPERBLOCK_SIZE);
+				sb = (struct ext2_super_block *) p;
+				sb->s_block_group_nr =
+					backup_group_nr(list[k].group);
+			}
+			p += size;
+		}
+		retval = io_channel_write_blk64(fs->io, list[i].blk, count,
+						buf);
+		if (retval)
+			break;
+	}
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return retval;
 }
 
 errcode_t ext2fs_flush(ext2_filsys fs)
@@ -279,10 +415,26 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 #endif
 	char	*group_ptr;
 	int	old_desc_blocks;
+	int	backup_flags = fs->flags;
+	struct flush_write *write_list = 0;
+	int	num_writes = 0;
 	struct ext2fs_numeric_progress_struct progress;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	if (!(fs->flags & EXT2_FLAG_SUPER_ONLY)) {
+		retval = ext2fs_read_group_descs(fs);
+		if (retval)
+			return retval;
+	}
+
+	/*
+	 * The backups don't need to be rewritten for a change that only
+	 * touched the counters; see super_counters_only().
+	 */
+	if ((flags & EXT2_FLAG_FLUSH_DEFER_BACKUPS) && super_counters_only(fs))
+		backup_flags |= EXT2_FLAG_MASTER_SB_ONLY;
+
 	fs_state = fs->super->s_state;
 	feature_incompat = fs->super->s_feature_incompat;
 
@@ -344,38 +496,42 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 				     fs->group_desc_count);
 
 
+	retval = ext2fs_get_array(fs->group_desc_count, 3 *
+				  sizeof(struct flush_write), &write_list);
+	if (retval)
+		goto errout;
+
 	for (i = 0; i < fs->group_desc_count; i++) {
 		blk64_t	super_blk, old_desc_blk, new_desc_blk;
 
-		ext2fs_numeric_progress_update(fs, &progress, i);
 		ext2fs_super_and_bgd_loc2(fs, i, &super_blk, &old_desc_blk,
 					 &new_desc_blk, 0);
 
-		if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&i && super_blk) {
-			retval = write_backup_super(fs, i, super_blk,
-						    super_shadow);
-			if (retval)
-				goto errout;
-		}
+		if (!(backup_flags & EXT2_FLAG_MASTER_SB_ONLY) && i &&
+		    super_blk)
+			add_flush_write(write_list, &num_writes, super_blk,
+					fs->blocksize == SUPERBLOCK_SIZE ? 1 :
+					-SUPERBLOCK_SIZE, i, NULL);
 		if (fs->flags & EXT2_FLAG_SUPER_ONLY)
 			continue;
 		if ((old_desc_blk) &&
-		    (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) || (i == 0))) {
-			retval = io_channel_write_blk64(fs->io,
-			      old_desc_blk, old_desc_blocks, group_ptr);
-			if (retval)
-				goto errout;
-		}
+		    (!(backup_flags & EXT2_FLAG_MASTER_SB_ONLY) || (i == 0)))
+			add_flush_write(write_list, &num_writes, old_desc_blk,
+					old_desc_blocks, i, group_ptr);
 		if (new_desc_blk) {
 			int meta_bg = i / EXT2_DESC_PER_BLOCK(fs->super);
 
-			retval = io_channel_write_blk64(fs->io, new_desc_blk,
-				1, group_ptr + (meta_bg*fs->blocksize));
-			if (retval)
-				goto errout;
+			add_flush_write(write_list, &num_writes, new_desc_blk,
+					1, i, group_ptr +
+					(meta_bg*fs->blocksize));
 		}
 	}
 
+	retval = write_flush_list(fs, write_list, num_writes, super_shadow,
+				  &progress);
+	if (retval)
+		goto errout;
+
 	ext2fs_numeric_progress_close(fs, &progress, NULL);
 
 	/*
@@ -419,6 +575,8 @@ write_primary_superblock_only:
 		retval = io_channel_flush(fs->io);
 errout:
 	fs->super->s_state = fs_state;
+	if (write_list)
+		ext2fs_free_mem(&write_list);
 #ifdef WORDS_BIGENDIAN
 	if (super_shadow)
 		ext2fs_free_mem(&super_shadow);
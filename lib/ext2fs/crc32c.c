@@ -31,6 +31,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #define __force
 #define min(x, y)		((x) > (y) ? (y) : (x))
 #define __ALIGN_KERNEL_MASK(x, mask)	(((x) + (mask)) & ~(mask))
@@ -368,14 +369,12 @@ static uint32_t crc32c_be_body(uint32_t crc, uint8_t const *buf, size_t len)
 }
 #endif
 
-/**
- * crc32c_le() - Calculate bitwise little-endian CRC32c.
- * @crc: seed value for computation.  ~0 for ext4, sometimes 0 for
- *	other uses, or the previous crc32c value if computing incrementally.
- * @p: pointer to buffer over which CRC is run
- * @len: length of buffer @p
+/*
+ * Table driven little-endian CRC32c; this is always available, and is
+ * what the accelerated versions below fall back to.
  */
-uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
+static uint32_t crc32c_le_generic(uint32_t crc, unsigned char const *p,
+				  size_t len)
 {
 #if CRC_LE_BITS == 1
 	int i;
@@ -409,6 +408,181 @@ uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
 	return crc;
 }
 
+/*
+ * x86 CPUs with SSE 4.2 have a CRC32c instruction.  It is emitted with
+ * inline assembly rather than intrinsics, so that this file doesn't
+ * need to be compiled with special flags; whether it can be used is
+ * decided at run time.
+ */
+#ifndef WORDS_BIGENDIAN
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define HAVE_CRC32C_HW
+
+#ifdef __x86_64__
+static inline uint32_t crc32c_hw_u64(uint32_t crc, uint64_t v)
+{
+	uint64_t c = crc;
+
+	__asm__("crc32q %1, %0" : "+r" (c) : "rm" (v));
+	return c;
+}
+#else
+static inline uint32_t crc32c_hw_u64(uint32_t crc, uint64_t v)
+{
+	__asm__("crc32l %1, %0" : "+r" (crc) : "rm" ((uint32_t) v));
+	__asm__("crc32l %1, %0" : "+r" (crc) : "rm" ((uint32_t) (v >> 32)));
+	return crc;
+}
+#endif
+
+static inline uint32_t crc32c_hw_u8(uint32_t crc, uint8_t v)
+{
+	__asm__("crc32b %1, %0" : "+r" (crc) : "rm" (v));
+	return crc;
+}
+
+static int crc32c_hw_available(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_SSE4_2) != 0;
+}
+#define CRC32C_HW_NAME	"sse4.2"
+#endif
+#endif /* WORDS_BIGENDIAN */
+
+#ifdef HAVE_CRC32C_HW
+/*
+ * The CRC32c instruction has a latency of several cycles but can start
+ * a new one every cycle, so large buffers are cut into three streams
+ * which are computed at the same time.  The partial results are then
+ * combined by shifting them forward over the following streams; since
+ * the CRC (without the final inversion) is linear, the shift over a
+ * fixed length is a precomputed table lookup per byte of the CRC.
+ * The stride is chosen so that a 4k block is nearly all done three
+ * streams at a time.
+ */
+#define CRC32C_STRIDE	1344
+
+static uint32_t crc32c_shift_table[4][256];
+
+static void crc32c_init_shift_table(void)
+{
+	static const unsigned char zeroes[CRC32C_STRIDE];
+	uint32_t	basis[32];
+	int		i, j, k;
+
+	/* Shifting the CRC forward is the same as feeding it zeroes */
+	for (i = 0; i < 32; i++)
+		basis[i] = crc32c_le_generic((uint32_t) 1 << i, zeroes,
+					     CRC32C_STRIDE);
+	for (k = 0; k < 4; k++) {
+		for (j = 0; j < 256; j++) {
+			uint32_t v = 0;
+
+			for (i = 0; i < 8; i++)
+				if (j & (1 << i))
+					v ^= basis[k * 8 + i];
+			crc32c_shift_table[k][j] = v;
+		}
+	}
+}
+
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+	return crc32c_shift_table[0][crc & 0xff] ^
+		crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+		crc32c_shift_table[2][(crc >> 16) & 0xff] ^
+		crc32c_shift_table[3][crc >> 24];
+}
+
+static inline uint64_t load_u64(unsigned char const *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t crc32c_le_hw(uint32_t crc, unsigned char const *p,
+			     size_t len)
+{
+	uint32_t	crc1, crc2;
+	size_t		i;
+
+	while (len && ((uintptr_t) p & 7)) {
+		crc = crc32c_hw_u8(crc, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_STRIDE) {
+		crc1 = crc2 = 0;
+		for (i = 0; i < CRC32C_STRIDE; i += 8) {
+			crc = crc32c_hw_u64(crc, load_u64(p + i));
+			crc1 = crc32c_hw_u64(crc1,
+					     load_u64(p + CRC32C_STRIDE + i));
+			crc2 = crc32c_hw_u64(crc2,
+					     load_u64(p + 2 * CRC32C_STRIDE + i));
+		}
+		crc = crc32c_shift(crc32c_shift(crc) ^ crc1) ^ crc2;
+		p += 3 * CRC32C_STRIDE;
+		len -= 3 * CRC32C_STRIDE;
+	}
+	while (len >= 8) {
+		crc = crc32c_hw_u64(crc, load_u64(p));
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_hw_u8(crc, *p++);
+	return crc;
+}
+#endif /* HAVE_CRC32C_HW */
+
+static uint32_t crc32c_le_select(uint32_t crc, unsigned char const *p,
+				 size_t len);
+
+static uint32_t (*crc32c_le_func)(uint32_t crc, unsigned char const *p,
+				  size_t len) = crc32c_le_select;
+
+/*
+ * Pick the fastest implementation the CPU supports on the first call.
+ */
+static uint32_t crc32c_le_select(uint32_t crc, unsigned char const *p,
+				 size_t len)
+{
+	uint32_t (*func)(uint32_t crc, unsigned char const *p,
+			 size_t len) = crc32c_le_generic;
+
+#ifdef HAVE_CRC32C_HW
+	if (crc32c_hw_available()) {
+		crc32c_init_shift_table();
+		/*
+		 * Another thread may pick up the new function as soon as
+		 * it is stored, so the table must be visible first.
+		 */
+		__sync_synchronize();
+		func = crc32c_le_hw;
+	}
+#endif
+	crc32c_le_func = func;
+	return func(crc, p, len);
+}
+
+/**
+ * crc32c_le() - Calculate bitwise little-endian CRC32c.
+ * @crc: seed value for computation.  ~0 for ext4, sometimes 0 for
+ *	other uses, or the previous crc32c value if computing incrementally.
+ * @p: pointer to buffer over which CRC is run
+ * @len: length of buffer @p
+ */
+uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
+{
+	return crc32c_le_func(crc, p, len);
+}
+
 /**
  * crc32c_be() - Calculate bitwise big-endian CRC32c.
  * @crc: seed value for computation.  ~0 for ext4, sometimes 0 for
@@ -1105,13 +1279,82 @@ static struct crc_test {
 	{0, 0, 0, 0, 0},
 };
 
+static struct crc32c_impl {
+	const char	*name;
+	uint32_t	(*func)(uint32_t crc, unsigned char const *p,
+				size_t len);
+} impls[] = {
+	{ "generic", crc32c_le_generic },
+#ifdef HAVE_CRC32C_HW
+	{ CRC32C_HW_NAME, crc32c_le_hw },
+#endif
+	{ 0, 0 }
+};
+
+/*
+ * Check every implementation the CPU supports against the table
+ * driven one on large buffers, at all alignments, so that the
+ * three-stream path of the accelerated versions gets exercised.
+ */
+static int test_crc32c_impls(void)
+{
+	static unsigned char buf[4 * 4096 + 8];
+	struct crc32c_impl *impl;
+	int failures = 0;
+	size_t i, len;
+	uint32_t want, got;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = test_buf[i % sizeof(test_buf)] ^ (i >> 8);
+
+	for (impl = impls + 1; impl->name; impl++) {
+#ifdef HAVE_CRC32C_HW
+		if (impl->func == crc32c_le_hw && !crc32c_hw_available())
+			continue;
+#endif
+		for (len = 0; len <= 4 * 4096; len += (len < 64) ? 1 : 509) {
+			for (i = 0; i < 8; i++) {
+				want = crc32c_le_generic(~0, buf + i, len);
+				got = impl->func(~0, buf + i, len);
+				if (got == want)
+					continue;
+				printf("%s fails at offset %d length %d, "
+				       "%x != %x\n", impl->name, (int) i,
+				       (int) len, got, want);
+				failures++;
+			}
+		}
+	}
+	return failures;
+}
+
 static int test_crc32c(void)
 {
 	struct crc_test *t = test;
+	struct crc32c_impl *impl;
 	int failures = 0;
 
+	/* Make sure the selection (and its setup) has been done */
+	ext2fs_crc32c_le(~0, test_buf, 1);
+
 	while (t->length) {
 		uint32_t be, le;
+
+		for (impl = impls; impl->name; impl++) {
+#ifdef HAVE_CRC32C_HW
+			if (impl->func == crc32c_le_hw &&
+			    !crc32c_hw_available())
+				continue;
+#endif
+			le = impl->func(t->crc, test_buf + t->start,
+					t->length);
+			if (le != t->crc_le) {
+				printf("Test %d LE (%s) fails, %x != %x\n",
+				       (int) (t - test), impl->name, le,
+				       t->crc_le);
+				failures++;
+			}
+		}
 		le = ext2fs_crc32c_le(t->crc, test_buf + t->start, t->length);
 		be = ext2fs_crc32c_be(t->crc, test_buf + t->start, t->length);
 		if (le != t->crc_le) {
@@ -1135,6 +1378,7 @@ int main(int argc, char *argv[])
 	int ret;
 
 	ret = test_crc32c();
+	ret += test_crc32c_impls();
 	if (!ret)
 		printf("No failures.\n");
 
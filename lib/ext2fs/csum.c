@@ -29,13 +29,22 @@
 #define STATIC static
 #endif
 
-__u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group)
+/*
+ * Every descriptor checksum starts with the file system UUID; when a
+ * whole table is checksummed that part is only computed once.
+ */
+static __u16 group_desc_csum_seed(ext2_filsys fs)
+{
+	return ext2fs_crc16(~0, fs->super->s_uuid, sizeof(fs->super->s_uuid));
+}
+
+static __u16 group_desc_csum(ext2_filsys fs, dgrp_t group, __u16 seed)
 {
 	struct ext2_group_desc *desc = ext2fs_group_desc(fs, fs->group_desc,
 							 group);
 	size_t size = EXT2_DESC_SIZE(fs->super);
 	size_t offset;
-	__u16 crc;
+	__u16 crc = 0;
 
 	if (fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM) {
 		size_t offset = offsetof(struct ext2_group_desc, bg_checksum);
@@ -56,9 +65,7 @@ __u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group)
 
 		group = ext2fs_swab32(group);
 #endif
-		crc = ext2fs_crc16(~0, fs->super->s_uuid,
-				   sizeof(fs->super->s_uuid));
-		crc = ext2fs_crc16(crc, &group, sizeof(group));
+		crc = ext2fs_crc16(seed, &group, sizeof(group));
 		crc = ext2fs_crc16(crc, desc, offset);
 		offset += sizeof(desc->bg_checksum); /* skip checksum */
 		/* for checksum of struct ext4_group_desc do the rest...*/
@@ -82,6 +89,11 @@ __u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group)
 	return crc;
 }
 
+__u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group)
+{
+	return group_desc_csum(fs, group, group_desc_csum_seed(fs));
+}
+
 int ext2fs_group_desc_csum_verify(ext2_filsys fs, dgrp_t group)
 {
 	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
@@ -104,17 +116,57 @@ void ext2fs_group_desc_csum_set(ext2_filsys fs, dgrp_t group)
 	ext2fs_bg_checksum_set(fs, group, ext2fs_group_desc_csum(fs, group));
 }
 
+/*
+ * Recompute the checksum of every group descriptor, for callers which
+ * have changed all of them, such as after a change of UUID or when the
+ * checksum feature is turned on.
+ */
+void ext2fs_group_desc_csum_set_all(ext2_filsys fs)
+{
+	__u16	seed;
+	dgrp_t	i;
+
+	if (!EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+		return;
+
+	seed = group_desc_csum_seed(fs);
+	for (i = 0; i < fs->group_desc_count; i++)
+		ext2fs_bg_checksum_set(fs, i, group_desc_csum(fs, i, seed));
+}
+
+/*
+ * Return the number of the last inode in use in group grp_no, counting
+ * from 1, or inodes_per_grp if none is.  The bitmap of the group is
+ * copied into buf, which must hold inodes_per_grp bits, so that it can
+ * be searched a byte at a time from the end.
+ */
 static __u32 find_last_inode_ingrp(ext2fs_inode_bitmap bitmap,
-				   __u32 inodes_per_grp, dgrp_t grp_no)
+				   __u32 inodes_per_grp, dgrp_t grp_no,
+				   unsigned char *buf)
 {
-	ext2_ino_t i, start_ino, end_ino;
+	ext2_ino_t start_ino;
+	int i, bit;
 
 	start_ino = grp_no * inodes_per_grp + 1;
-	end_ino = start_ino + inodes_per_grp - 1;
+	if (ext2fs_get_inode_bitmap_range2(bitmap, start_ino, inodes_per_grp,
+					   buf)) {
+		for (i = inodes_per_grp; i > 0; i--) {
+			if (ext2fs_fast_test_inode_bitmap2(bitmap,
+							   start_ino + i - 1))
+				return i;
+		}
+		return inodes_per_grp;
+	}
 
-	for (i = end_ino; i >= start_ino; i--) {
-		if (ext2fs_fast_test_inode_bitmap2(bitmap, i))
-			return i - start_ino + 1;
+	for (i = (inodes_per_grp + 7) / 8 - 1; i >= 0; i--) {
+		if (!buf[i])
+			continue;
+		for (bit = 7; bit >= 0; bit--) {
+			if ((buf[i] & (1 << bit)) &&
+			    (__u32) (i * 8 + bit) < inodes_per_grp)
+				return i * 8 + bit + 1;
+		}
 	}
 	return inodes_per_grp;
 }
@@ -126,6 +178,9 @@ errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 	struct ext2_super_block *sb = fs->super;
 	int dirty = 0;
 	dgrp_t i;
+	__u16 seed;
+	unsigned char *buf;
+	errcode_t retval;
 
 	if (!fs->inode_map)
 		return EXT2_ET_NO_INODE_BITMAP;
@@ -134,6 +189,11 @@ errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 					EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
 		return 0;
 
+	retval = ext2fs_get_mem((sb->s_inodes_per_group + 7) / 8, &buf);
+	if (retval)
+		return retval;
+
+	seed = group_desc_csum_seed(fs);
 	for (i = 0; i < fs->group_desc_count; i++) {
 		__u32 old_csum = ext2fs_bg_checksum(fs, i);
 		__u32 old_unused = ext2fs_bg_itable_unused(fs, i);
@@ -147,13 +207,14 @@ errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 			int unused =
 				sb->s_inodes_per_group -
 				find_last_inode_ingrp(fs->inode_map,
-						      sb->s_inodes_per_group, i);
+						      sb->s_inodes_per_group, i,
+						      buf);
 
 			ext2fs_bg_flags_clear(fs, i, EXT2_BG_INODE_UNINIT);
 			ext2fs_bg_itable_unused_set(fs, i, unused);
 		}
 
-		ext2fs_group_desc_csum_set(fs, i);
+		ext2fs_bg_checksum_set(fs, i, group_desc_csum(fs, i, seed));
 		if (old_flags != ext2fs_bg_flags(fs, i))
 			dirty = 1;
 		if (old_unused != ext2fs_bg_itable_unused(fs, i))
@@ -161,6 +222,7 @@ errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 		if (old_csum != ext2fs_bg_checksum(fs, i))
 			dirty = 1;
 	}
+	ext2fs_free_mem(&buf);
 	if (dirty)
 		ext2fs_mark_super_dirty(fs);
 	return 0;
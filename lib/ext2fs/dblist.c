@@ -15,6 +15,14 @@
 #endif
 #include <string.h>
 #include <time.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fsP.h"
@@ -52,60 +60,343 @@ errcode_t ext2fs_get_num_dirs(ext2_filsys fs, ext2_ino_t *ret_num_dirs)
 }
 
 /*
- * helper function for making a new directory block list (for
- * initialize and copy).
+ * The list is kept as runs of entries: a run stands for len entries of
+ * the same inode whose logical and physical block numbers both go up
+ * by one from each entry to the next (or whose blocks are all holes),
+ * which is how most directories are laid out.  A run takes 16 bytes,
+ * however long it is.  Runs are stored in chunks of fixed size, so
+ * that growing the list never copies it.
+ *
+ * Runs don't start at logical block 0 of a directory, or go on from a
+ * negative (metadata) block, so that the comparison functions used to
+ * sort the list give the same answer for a run as for its entries.
  */
-static errcode_t make_dblist(ext2_filsys fs, ext2_ino_t size,
-			     ext2_ino_t count,
-			     struct ext2_db_entry2 *list,
-			     ext2_dblist *ret_dblist)
+struct dblist_run {
+	__u32	ino;
+	__s32	blockcnt;	/* of the first entry */
+	__u32	blk_lo;
+	__u16	blk_hi;
+	__u16	len;
+};
+
+#define DBLIST_RUN_MAX		0xFFFF
+#define DBLIST_CHUNK_SIZE	65536
+#define DBLIST_CHUNK_HDR	16
+#define DBLIST_CHUNK_RUNS	((DBLIST_CHUNK_SIZE - DBLIST_CHUNK_HDR) / \
+				 sizeof(struct dblist_run))
+
+struct dblist_chunk {
+	unsigned long long	first;	/* index of its first entry */
+	unsigned int		num;	/* runs used */
+	int			slot;	/* in the spill file, or -1 */
+	struct dblist_run	runs[DBLIST_CHUNK_RUNS];
+};
+
+static blk64_t run_blk(const struct dblist_run *run)
+{
+	return ((blk64_t) run->blk_hi << 32) | run->blk_lo;
+}
+
+/* Fill in entry n of a run */
+static void run_entry(const struct dblist_run *run, unsigned int n,
+		      struct ext2_db_entry2 *db)
 {
-	ext2_dblist	dblist = NULL;
+	blk64_t	blk = run_blk(run);
+
+	db->ino = run->ino;
+	db->blk = blk ? blk + n : 0;
+	db->blockcnt = (e2_blkcnt_t) run->blockcnt + n;
+}
+
+static errcode_t run_set(struct dblist_run *run, ext2_ino_t ino,
+			 blk64_t blk, e2_blkcnt_t blockcnt)
+{
+	if ((blk >> 48) || blockcnt != (__s32) blockcnt)
+		return EXT2_ET_INVALID_ARGUMENT;
+	run->ino = ino;
+	run->blockcnt = blockcnt;
+	run->blk_lo = blk & 0xFFFFFFFF;
+	run->blk_hi = blk >> 32;
+	run->len = 1;
+	return 0;
+}
+
+/* Can the entry be added to the end of the run? */
+static int run_extends(const struct dblist_run *run, ext2_ino_t ino,
+		       blk64_t blk, e2_blkcnt_t blockcnt)
+{
+	blk64_t	start = run_blk(run);
+
+	if (run->ino != ino || run->len == DBLIST_RUN_MAX ||
+	    run->blockcnt <= 0 ||
+	    blockcnt != (e2_blkcnt_t) run->blockcnt + run->len)
+		return 0;
+	if (!start)
+		return !blk;
+	return blk == start + run->len;
+}
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+/* Get a chunk from the spill file */
+static errcode_t map_chunk(ext2_dblist dblist, struct dblist_chunk **ret)
+{
+	struct dblist_chunk *chunk;
+	unsigned int	slot;
+	char		*fn;
 	errcode_t	retval;
-	ext2_ino_t	num_dirs;
-	size_t		len;
 
-	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+	if (dblist->spill_fd < 0) {
+		retval = ext2fs_get_mem(strlen(dblist->spill_dir) + 32, &fn);
+		if (retval)
+			return retval;
+		sprintf(fn, "%s/dblist-XXXXXX", dblist->spill_dir);
+		dblist->spill_fd = mkstemp(fn);
+		if (dblist->spill_fd >= 0)
+			unlink(fn);
+		ext2fs_free_mem(&fn);
+		if (dblist->spill_fd < 0)
+			return errno;
+	}
+	if (dblist->num_free)
+		slot = dblist->free_slots[--dblist->num_free];
+	else {
+		slot = dblist->spill_slots;
+		if (ftruncate(dblist->spill_fd, (off_t) (slot + 1) *
+			      DBLIST_CHUNK_SIZE) < 0)
+			return errno;
+		dblist->spill_slots++;
+	}
+	chunk = mmap(0, DBLIST_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     dblist->spill_fd, (off_t) slot * DBLIST_CHUNK_SIZE);
+	if (chunk == MAP_FAILED) {
+		retval = errno;
+		dblist->free_slots[dblist->num_free++] = slot;
+		return retval;
+	}
+	chunk->slot = slot;
+	*ret = chunk;
+	return 0;
+}
+#endif
 
-	if ((ret_dblist == 0) && fs->dblist &&
-	    (fs->dblist->magic == EXT2_ET_MAGIC_DBLIST))
+static errcode_t alloc_chunk(ext2_dblist dblist, struct dblist_chunk **ret)
+{
+	struct dblist_chunk *chunk = 0;
+	unsigned int	new_max;
+	errcode_t	retval;
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	if (dblist->spill_dir &&
+	    (unsigned long long) (dblist->heap_chunks + 1) *
+	    DBLIST_CHUNK_SIZE > dblist->spill_bytes) {
+		/* so that every slot of the file can be given back */
+		if (dblist->spill_slots >= dblist->max_free) {
+			new_max = dblist->max_free ? dblist->max_free * 2 : 32;
+			retval = ext2fs_resize_mem(dblist->max_free *
+						   sizeof(unsigned int),
+						   new_max *
+						   sizeof(unsigned int),
+						   &dblist->free_slots);
+			if (retval)
+				return retval;
+			dblist->max_free = new_max;
+		}
+		retval = map_chunk(dblist, &chunk);
+		if (retval)
+			return retval;
+		goto out;
+	}
+#endif
+	retval = ext2fs_get_mem(sizeof(struct dblist_chunk), &chunk);
+	if (retval)
+		return retval;
+	chunk->slot = -1;
+	dblist->heap_chunks++;
+out:
+	chunk->first = 0;
+	chunk->num = 0;
+	*ret = chunk;
+	return 0;
+}
+
+static void free_chunk(ext2_dblist dblist, struct dblist_chunk *chunk)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	if (chunk->slot >= 0) {
+		/* alloc_chunk() made sure there is room */
+		dblist->free_slots[dblist->num_free++] = chunk->slot;
+		munmap(chunk, DBLIST_CHUNK_SIZE);
+		return;
+	}
+#endif
+	dblist->heap_chunks--;
+	ext2fs_free_mem(&chunk);
+}
+
+/* Make room for another chunk pointer in the table */
+static errcode_t grow_table(ext2_dblist dblist)
+{
+	unsigned long	new_max;
+	errcode_t	retval;
+
+	if (dblist->num_chunks < dblist->max_chunks)
 		return 0;
+	new_max = dblist->max_chunks ? dblist->max_chunks * 2 : 16;
+	retval = ext2fs_resize_mem(dblist->max_chunks *
+				   sizeof(struct dblist_chunk *),
+				   new_max * sizeof(struct dblist_chunk *),
+				   &dblist->chunks);
+	if (retval)
+		return retval;
+	dblist->max_chunks = new_max;
+	return 0;
+}
 
-	retval = ext2fs_get_mem(sizeof(struct ext2_struct_dblist), &dblist);
+/* Append an empty chunk to the list */
+static errcode_t add_chunk(ext2_dblist dblist)
+{
+	struct dblist_chunk *chunk;
+	errcode_t	retval;
+
+	retval = grow_table(dblist);
+	if (retval)
+		return retval;
+	retval = alloc_chunk(dblist, &chunk);
 	if (retval)
-		goto cleanup;
-	memset(dblist, 0, sizeof(struct ext2_struct_dblist));
+		return retval;
+	chunk->first = dblist->count;
+	dblist->chunks[dblist->num_chunks++] = chunk;
+	return 0;
+}
 
-	dblist->magic = EXT2_ET_MAGIC_DBLIST;
-	dblist->fs = fs;
-	if (size)
-		dblist->size = size;
-	else {
-		retval = ext2fs_get_num_dirs(fs, &num_dirs);
+/*
+ * Find entry i of the list: run *ret_run of chunk *ret_chunk, entry
+ * *ret_n of that run.  Returns 0 if there is none.
+ */
+static int find_entry(ext2_dblist dblist, unsigned long long i,
+		      unsigned long *ret_chunk, unsigned int *ret_run,
+		      unsigned int *ret_n)
+{
+	struct dblist_chunk *chunk;
+	unsigned long	low, high, mid;
+	unsigned long long first;
+	unsigned int	r;
+
+	if (i >= dblist->count)
+		return 0;
+	low = 0;
+	high = dblist->num_chunks - 1;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (dblist->chunks[mid]->first <= i)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	chunk = dblist->chunks[low];
+	first = chunk->first;
+	for (r = 0; r < chunk->num; r++) {
+		if (i < first + chunk->runs[r].len)
+			break;
+		first += chunk->runs[r].len;
+	}
+	*ret_chunk = low;
+	*ret_run = r;
+	*ret_n = i - first;
+	return 1;
+}
+
+/*
+ * Replace run r of chunk c by the runs in new_runs.  If they don't
+ * fit, the chunk is split in two first.
+ */
+static errcode_t replace_run(ext2_dblist dblist, unsigned long c,
+			     unsigned int r, struct dblist_run *new_runs,
+			     unsigned int num)
+{
+	struct dblist_chunk *chunk = dblist->chunks[c], *next;
+	unsigned int	i, half;
+	errcode_t	retval;
+
+	if (chunk->num + num - 1 > DBLIST_CHUNK_RUNS) {
+		retval = grow_table(dblist);
+		if (retval)
+			return retval;
+		retval = alloc_chunk(dblist, &next);
 		if (retval)
-			goto cleanup;
-		dblist->size = (num_dirs * 2) + 12;
+			return retval;
+		half = chunk->num / 2;
+		next->num = chunk->num - half;
+		memcpy(next->runs, chunk->runs + half,
+		       next->num * sizeof(struct dblist_run));
+		chunk->num = half;
+		next->first = chunk->first;
+		for (i = 0; i < half; i++)
+			next->first += chunk->runs[i].len;
+		memmove(dblist->chunks + c + 2, dblist->chunks + c + 1,
+			(dblist->num_chunks - c - 1) *
+			sizeof(struct dblist_chunk *));
+		dblist->chunks[c + 1] = next;
+		dblist->num_chunks++;
+		if (r >= half) {
+			chunk = next;
+			r -= half;
+		}
 	}
-	len = (size_t) sizeof(struct ext2_db_entry2) * dblist->size;
-	dblist->count = count;
-	retval = ext2fs_get_array(dblist->size, sizeof(struct ext2_db_entry2),
-		&dblist->list);
+	memmove(chunk->runs + r + num, chunk->runs + r + 1,
+		(chunk->num - r - 1) * sizeof(struct dblist_run));
+	memcpy(chunk->runs + r, new_runs, num * sizeof(struct dblist_run));
+	chunk->num += num - 1;
+	return 0;
+}
+
+/* Change entry n of run r of chunk c */
+static errcode_t set_entry(ext2_dblist dblist, unsigned long c,
+			   unsigned int r, unsigned int n,
+			   struct ext2_db_entry2 *db)
+{
+	struct dblist_run *run = dblist->chunks[c]->runs + r;
+	struct dblist_run new_runs[3];
+	struct ext2_db_entry2 db_after;
+	unsigned int	num = 0;
+	errcode_t	retval;
+
+	if (run->len == 1)
+		return run_set(run, db->ino, db->blk, db->blockcnt);
+
+	/* Split the run around the entry */
+	if (n) {
+		new_runs[num] = *run;
+		new_runs[num++].len = n;
+	}
+	retval = run_set(new_runs + num++, db->ino, db->blk, db->blockcnt);
 	if (retval)
-		goto cleanup;
+		return retval;
+	if (n + 1 < run->len) {
+		run_entry(run, n + 1, &db_after);
+		run_set(new_runs + num, db_after.ino, db_after.blk,
+			db_after.blockcnt);
+		new_runs[num++].len = run->len - n - 1;
+	}
+	return replace_run(dblist, c, r, new_runs, num);
+}
 
-	if (list)
-		memcpy(dblist->list, list, len);
-	else
-		memset(dblist->list, 0, len);
-	if (ret_dblist)
-		*ret_dblist = dblist;
-	else
-		fs->dblist = dblist;
+static errcode_t make_dblist(ext2_filsys fs, ext2_dblist *ret_dblist)
+{
+	ext2_dblist	dblist;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_struct_dblist),
+				    &dblist);
+	if (retval)
+		return retval;
+	dblist->magic = EXT2_ET_MAGIC_DBLIST;
+	dblist->fs = fs;
+	dblist->spill_fd = -1;
+	*ret_dblist = dblist;
 	return 0;
-cleanup:
-	if (dblist)
-		ext2fs_free_mem(&dblist);
-	return retval;
 }
 
 /*
@@ -116,7 +407,11 @@ errcode_t ext2fs_init_dblist(ext2_filsys fs, ext2_dblist *ret_dblist)
 	ext2_dblist	dblist;
 	errcode_t	retval;
 
-	retval = make_dblist(fs, 0, 0, 0, &dblist);
+	if ((ret_dblist == 0) && fs->dblist &&
+	    (fs->dblist->magic == EXT2_ET_MAGIC_DBLIST))
+		return 0;
+
+	retval = make_dblist(fs, &dblist);
 	if (retval)
 		return retval;
 
@@ -135,12 +430,26 @@ errcode_t ext2fs_init_dblist(ext2_filsys fs, ext2_dblist *ret_dblist)
 errcode_t ext2fs_copy_dblist(ext2_dblist src, ext2_dblist *dest)
 {
 	ext2_dblist	dblist;
+	struct dblist_chunk *chunk;
+	unsigned long	c;
 	errcode_t	retval;
 
-	retval = make_dblist(src->fs, src->size, src->count, src->list,
-			     &dblist);
+	retval = make_dblist(src->fs, &dblist);
 	if (retval)
 		return retval;
+	for (c = 0; c < src->num_chunks; c++) {
+		retval = add_chunk(dblist);
+		if (retval) {
+			ext2fs_free_dblist(dblist);
+			return retval;
+		}
+		chunk = dblist->chunks[c];
+		chunk->first = src->chunks[c]->first;
+		chunk->num = src->chunks[c]->num;
+		memcpy(chunk->runs, src->chunks[c]->runs,
+		       chunk->num * sizeof(struct dblist_run));
+	}
+	dblist->count = src->count;
 	dblist->sorted = src->sorted;
 	*dest = dblist;
 	return 0;
@@ -152,6 +461,78 @@ errcode_t ext2fs_copy_dblist(ext2_dblist src, ext2_dblist *dest)
  * (moved to closefs.c)
  */
 
+/*
+ * Once the list would need more than bytes of memory, keep the new
+ * parts of it in an (unlinked) temporary file in dir which is mapped
+ * into memory, so that the kernel can write them out instead of the
+ * process running out of memory.  If the list is already bigger than
+ * that, it is moved right away.  Currently only supported where
+ * mmap() is.
+ */
+errcode_t ext2fs_dblist_set_spill(ext2_dblist dblist, const char *dir,
+				  unsigned long long bytes)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	struct dblist_chunk *chunk;
+	unsigned long	c;
+	errcode_t	retval;
+#endif
+
+	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	if (dblist->spill_dir)
+		ext2fs_free_mem(&dblist->spill_dir);
+	retval = ext2fs_get_mem(strlen(dir) + 1, &dblist->spill_dir);
+	if (retval)
+		return retval;
+	strcpy(dblist->spill_dir, dir);
+	dblist->spill_bytes = bytes;
+
+	if ((unsigned long long) dblist->heap_chunks * DBLIST_CHUNK_SIZE <=
+	    bytes)
+		return 0;
+	dblist->spill_bytes = 0;
+	for (c = 0; c < dblist->num_chunks; c++) {
+		if (dblist->chunks[c]->slot >= 0)
+			continue;
+		retval = alloc_chunk(dblist, &chunk);
+		if (retval)
+			break;
+		chunk->first = dblist->chunks[c]->first;
+		chunk->num = dblist->chunks[c]->num;
+		memcpy(chunk->runs, dblist->chunks[c]->runs,
+		       chunk->num * sizeof(struct dblist_run));
+		free_chunk(dblist, dblist->chunks[c]);
+		dblist->chunks[c] = chunk;
+	}
+	dblist->spill_bytes = bytes;
+	return retval;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+void ext2fs_dblist_free_list(ext2_dblist dblist)
+{
+	unsigned long	c;
+
+	for (c = 0; c < dblist->num_chunks; c++)
+		free_chunk(dblist, dblist->chunks[c]);
+	if (dblist->chunks)
+		ext2fs_free_mem(&dblist->chunks);
+	dblist->num_chunks = dblist->max_chunks = 0;
+	dblist->count = 0;
+	if (dblist->spill_fd >= 0)
+		close(dblist->spill_fd);
+	dblist->spill_fd = -1;
+	dblist->spill_slots = 0;
+	if (dblist->free_slots)
+		ext2fs_free_mem(&dblist->free_slots);
+	dblist->num_free = dblist->max_free = 0;
+	if (dblist->spill_dir)
+		ext2fs_free_mem(&dblist->spill_dir);
+}
 
 /*
  * Add a directory block to the directory block list
@@ -159,28 +540,32 @@ errcode_t ext2fs_copy_dblist(ext2_dblist src, ext2_dblist *dest)
 errcode_t ext2fs_add_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 				blk64_t blk, e2_blkcnt_t blockcnt)
 {
-	struct ext2_db_entry2 	*new_entry;
+	struct dblist_chunk	*chunk = 0;
+	struct dblist_run	*run;
 	errcode_t		retval;
-	unsigned long		old_size;
 
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
-	if (dblist->count >= dblist->size) {
-		old_size = dblist->size * sizeof(struct ext2_db_entry2);
-		dblist->size += dblist->size > 200 ? dblist->size / 2 : 100;
-		retval = ext2fs_resize_mem(old_size, (size_t) dblist->size *
-					   sizeof(struct ext2_db_entry2),
-					   &dblist->list);
-		if (retval) {
-			dblist->size = old_size / sizeof(struct ext2_db_entry2);
+	if (dblist->num_chunks)
+		chunk = dblist->chunks[dblist->num_chunks - 1];
+	if (chunk && chunk->num &&
+	    run_extends(chunk->runs + chunk->num - 1, ino, blk, blockcnt)) {
+		chunk->runs[chunk->num - 1].len++;
+		goto out;
+	}
+	if (!chunk || chunk->num == DBLIST_CHUNK_RUNS) {
+		retval = add_chunk(dblist);
+		if (retval)
 			return retval;
-		}
+		chunk = dblist->chunks[dblist->num_chunks - 1];
 	}
-	new_entry = dblist->list + ( dblist->count++);
-	new_entry->blk = blk;
-	new_entry->ino = ino;
-	new_entry->blockcnt = blockcnt;
-
+	run = chunk->runs + chunk->num;
+	retval = run_set(run, ino, blk, blockcnt);
+	if (retval)
+		return retval;
+	chunk->num++;
+out:
+	dblist->count++;
 	dblist->sorted = 0;
 
 	return 0;
@@ -192,56 +577,484 @@ errcode_t ext2fs_add_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 errcode_t ext2fs_set_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 				blk64_t blk, e2_blkcnt_t blockcnt)
 {
-	dgrp_t			i;
+	struct dblist_run	*run;
+	struct ext2_db_entry2	db;
+	unsigned long		c;
+	unsigned int		r;
+	errcode_t		retval;
 
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
-	for (i=0; i < dblist->count; i++) {
-		if ((dblist->list[i].ino != ino) ||
-		    (dblist->list[i].blockcnt != blockcnt))
-			continue;
-		dblist->list[i].blk = blk;
-		dblist->sorted = 0;
-		return 0;
+	for (c = 0; c < dblist->num_chunks; c++) {
+		for (r = 0; r < dblist->chunks[c]->num; r++) {
+			run = dblist->chunks[c]->runs + r;
+			if (run->ino != ino || blockcnt < run->blockcnt ||
+			    blockcnt >= (e2_blkcnt_t) run->blockcnt + run->len)
+				continue;
+			db.ino = ino;
+			db.blk = blk;
+			db.blockcnt = blockcnt;
+			retval = set_entry(dblist, c, r,
+					   blockcnt - run->blockcnt, &db);
+			if (retval)
+				return retval;
+			dblist->sorted = 0;
+			return 0;
+		}
 	}
 	return EXT2_ET_DB_NOT_FOUND;
 }
 
+/*
+ * Sorting.  Runs are compared by their first entries, with a merge
+ * sort which keeps the comparison function on the stack: each chunk
+ * is sorted in place, then the sorted chunks are merged pairwise into
+ * new chunks, reusing the old ones as they're used up.  If that
+ * doesn't give a sorted list of entries, because runs overlap or the
+ * comparison function looks at more than the order of the blocks, the
+ * runs are broken up into single entries and sorted again.
+ *
+ * The default order is by block, and that is what nearly every caller
+ * asks for, so it gets a fast path: each chunk is radix sorted on the
+ * block number, a byte at a time, skipping the bytes which are the
+ * same for the whole chunk, and the merges compare the keys directly
+ * instead of calling through the function pointer.
+ */
+#define DBLIST_SPARE_CHUNKS	8
+
+struct dblist_sort {
+	EXT2_QSORT_TYPE (*func)(const void *a, const void *b);
+	struct dblist_run	*tmp;
+	struct dblist_chunk	*spare[DBLIST_SPARE_CHUNKS];
+	int			num_spare;
+};
+
+/* The same order as dir_block_cmp2() */
+static int run_key_cmp(const struct dblist_run *a, const struct dblist_run *b)
+{
+	blk64_t	blk_a = run_blk(a), blk_b = run_blk(b);
+
+	if (blk_a != blk_b)
+		return blk_a < blk_b ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	if (a->blockcnt != b->blockcnt)
+		return a->blockcnt < b->blockcnt ? -1 : 1;
+	return 0;
+}
+
+static int run_cmp(struct dblist_sort *ds, const struct dblist_run *a,
+		   const struct dblist_run *b)
+{
+	struct ext2_db_entry2	db_a, db_b;
+
+	if (ds->func == dir_block_cmp2)
+		return run_key_cmp(a, b);
+	run_entry(a, 0, &db_a);
+	run_entry(b, 0, &db_b);
+	return (ds->func)(&db_a, &db_b);
+}
+
+static void sort_runs(struct dblist_sort *ds, struct dblist_run *runs,
+		      unsigned int num)
+{
+	unsigned int	mid = num / 2, i, j, k;
+
+	if (num < 2)
+		return;
+	sort_runs(ds, runs, mid);
+	sort_runs(ds, runs + mid, num - mid);
+	if (run_cmp(ds, runs + mid - 1, runs + mid) <= 0)
+		return;
+	memcpy(ds->tmp, runs, mid * sizeof(struct dblist_run));
+	for (i = 0, j = mid, k = 0; i < mid; k++) {
+		if (j < num && run_cmp(ds, runs + j, ds->tmp + i) < 0)
+			runs[k] = runs[j++];
+		else
+			runs[k] = ds->tmp[i++];
+	}
+}
+
+#define DBLIST_RADIX_BYTES	6	/* of the 48 bit block numbers */
+
+/*
+ * Sort the runs of a chunk by block with an LSD radix sort, going back
+ * and forth between runs and ds->tmp, which must have room for num
+ * runs.  Runs of the same block are then put in order by sort_runs().
+ */
+static void radix_sort_runs(struct dblist_sort *ds, struct dblist_run *runs,
+			    unsigned int num)
+{
+	unsigned int	count[DBLIST_RADIX_BYTES][256];
+	struct dblist_run *src = runs, *dst = ds->tmp, *t;
+	unsigned int	i, d, n, sum;
+	blk64_t		blk;
+
+	if (num < 2)
+		return;
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < num; i++) {
+		blk = run_blk(runs + i);
+		for (d = 0; d < DBLIST_RADIX_BYTES; d++)
+			count[d][(blk >> (8 * d)) & 0xFF]++;
+	}
+
+	for (d = 0; d < DBLIST_RADIX_BYTES; d++) {
+		/* skip a byte which all the blocks have in common */
+		if (count[d][(run_blk(src) >> (8 * d)) & 0xFF] == num)
+			continue;
+		for (i = 0, sum = 0; i < 256; i++) {
+			n = count[d][i];
+			count[d][i] = sum;
+			sum += n;
+		}
+		for (i = 0; i < num; i++) {
+			blk = run_blk(src + i);
+			dst[count[d][(blk >> (8 * d)) & 0xFF]++] = src[i];
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != runs)
+		memcpy(runs, src, num * sizeof(struct dblist_run));
+
+	for (i = 0; i < num; i = n) {
+		blk = run_blk(runs + i);
+		for (n = i + 1; n < num && run_blk(runs + n) == blk; n++)
+			;
+		if (n - i > 1)
+			sort_runs(ds, runs + i, n - i);
+	}
+}
+
+static void put_spare(ext2_dblist dblist, struct dblist_sort *ds,
+		      struct dblist_chunk *chunk)
+{
+	if (ds->num_spare < DBLIST_SPARE_CHUNKS) {
+		chunk->num = 0;
+		ds->spare[ds->num_spare++] = chunk;
+	} else
+		free_chunk(dblist, chunk);
+}
+
+/* Move the runs of old[c] from r on to the end of the list's table */
+static void keep_runs(ext2_dblist dblist, struct dblist_chunk **old,
+		      unsigned long c, unsigned int r)
+{
+	memmove(old[c]->runs, old[c]->runs + r,
+		(old[c]->num - r) * sizeof(struct dblist_run));
+	old[c]->num -= r;
+	dblist->chunks[dblist->num_chunks++] = old[c];
+}
+
+/*
+ * Merge the sorted runs of old[a..m) and old[m..b) into new chunks at
+ * the end of the list's table.  The chunks used up are handed back as
+ * spares, and a merge never needs more than a few chunks more than it
+ * has used up, so with three spares to start with there should be no
+ * need to allocate any.  If a chunk can't be had, what is left of
+ * old[a..b) is appended unmerged.
+ */
+static errcode_t merge_chunks(ext2_dblist dblist, struct dblist_sort *ds,
+			      struct dblist_chunk **old, unsigned long a,
+			      unsigned long m, unsigned long b)
+{
+	struct dblist_chunk *out = 0;
+	unsigned long	ca = a, cb = m;
+	unsigned int	ra = 0, rb = 0;
+	errcode_t	retval;
+
+	while (ca < m || cb < b) {
+		if (!out || out->num == DBLIST_CHUNK_RUNS) {
+			if (ds->num_spare)
+				out = ds->spare[--ds->num_spare];
+			else {
+				retval = alloc_chunk(dblist, &out);
+				if (retval)
+					goto errout;
+			}
+			dblist->chunks[dblist->num_chunks++] = out;
+		}
+		if (cb >= b || (ca < m &&
+				run_cmp(ds, old[ca]->runs + ra,
+					old[cb]->runs + rb) <= 0))
+			out->runs[out->num++] = old[ca]->runs[ra++];
+		else
+			out->runs[out->num++] = old[cb]->runs[rb++];
+		if (ca < m && ra == old[ca]->num) {
+			put_spare(dblist, ds, old[ca++]);
+			ra = 0;
+		}
+		if (cb < b && rb == old[cb]->num) {
+			put_spare(dblist, ds, old[cb++]);
+			rb = 0;
+		}
+	}
+	return 0;
+
+errout:
+	for (; ca < m; ca++, ra = 0)
+		keep_runs(dblist, old, ca, ra);
+	for (; cb < b; cb++, rb = 0)
+		keep_runs(dblist, old, cb, rb);
+	return retval;
+}
+
+/* Does each entry of the list compare <= the next one? */
+static int entries_sorted(ext2_dblist dblist, struct dblist_sort *ds,
+			  int check_runs)
+{
+	struct ext2_db_entry2	prev, cur;
+	struct dblist_run	*run;
+	unsigned long		c;
+	unsigned int		r, n;
+	int			have_prev = 0;
+
+	for (c = 0; c < dblist->num_chunks; c++) {
+		for (r = 0; r < dblist->chunks[c]->num; r++) {
+			run = dblist->chunks[c]->runs + r;
+			for (n = 0; n < run->len; n++) {
+				/* a run is in order for the default sort */
+				if (n && !check_runs)
+					n = run->len - 1;
+				run_entry(run, n, &cur);
+				if (have_prev && (ds->func)(&prev, &cur) > 0)
+					return 0;
+				prev = cur;
+				have_prev = 1;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ * Break every run of the list up into runs of a single entry.  The
+ * new list is built before the old one is freed, so that a failure
+ * leaves the list as it was.
+ */
+static errcode_t split_runs(ext2_dblist dblist)
+{
+	struct ext2_struct_dblist old = *dblist;
+	struct ext2_db_entry2 db;
+	struct dblist_chunk *chunk;
+	struct dblist_run *run;
+	unsigned long	c;
+	unsigned int	r, n;
+	errcode_t	retval;
+
+	dblist->chunks = 0;
+	dblist->num_chunks = dblist->max_chunks = 0;
+	dblist->count = 0;
+	for (c = 0; c < old.num_chunks; c++) {
+		for (r = 0; r < old.chunks[c]->num; r++) {
+			run = old.chunks[c]->runs + r;
+			for (n = 0; n < run->len; n++) {
+				chunk = dblist->num_chunks ?
+					dblist->chunks[dblist->num_chunks - 1] :
+					0;
+				if (!chunk || chunk->num == DBLIST_CHUNK_RUNS) {
+					retval = add_chunk(dblist);
+					if (retval)
+						goto errout;
+					chunk = dblist->chunks[dblist->num_chunks
+							       - 1];
+				}
+				run_entry(run, n, &db);
+				run_set(chunk->runs + chunk->num++, db.ino,
+					db.blk, db.blockcnt);
+				dblist->count++;
+			}
+		}
+	}
+	for (c = 0; c < old.num_chunks; c++)
+		free_chunk(dblist, old.chunks[c]);
+	ext2fs_free_mem(&old.chunks);
+	return 0;
+
+errout:
+	for (c = 0; c < dblist->num_chunks; c++)
+		free_chunk(dblist, dblist->chunks[c]);
+	if (dblist->chunks)
+		ext2fs_free_mem(&dblist->chunks);
+	dblist->chunks = old.chunks;
+	dblist->num_chunks = old.num_chunks;
+	dblist->max_chunks = old.max_chunks;
+	dblist->count = old.count;
+	return retval;
+}
+
+/*
+ * If memory runs out, the list is left as it is, in some order.
+ */
+static errcode_t sort_dblist(ext2_dblist dblist,
+			     EXT2_QSORT_TYPE (*sortfunc)(const void *,
+							 const void *))
+{
+	struct dblist_sort	ds;
+	struct dblist_chunk	**old, **table;
+	unsigned long		num_old, width, a, m, b, c;
+	unsigned long long	first;
+	unsigned int		r;
+	int			split = 0;
+	errcode_t		retval;
+
+	memset(&ds, 0, sizeof(ds));
+	ds.func = sortfunc;
+	retval = ext2fs_get_array(DBLIST_CHUNK_RUNS,
+				  sizeof(struct dblist_run), &ds.tmp);
+	if (retval)
+		return retval;
+	while (ds.num_spare < 3) {
+		retval = alloc_chunk(dblist, &ds.spare[ds.num_spare]);
+		if (retval)
+			goto out;
+		ds.num_spare++;
+	}
+again:
+	for (c = 0; c < dblist->num_chunks; c++) {
+		if (sortfunc == dir_block_cmp2)
+			radix_sort_runs(&ds, dblist->chunks[c]->runs,
+					dblist->chunks[c]->num);
+		else
+			sort_runs(&ds, dblist->chunks[c]->runs,
+				  dblist->chunks[c]->num);
+	}
+
+	for (width = 1; width < dblist->num_chunks; width *= 2) {
+		/* each merge may come out two chunks longer */
+		num_old = dblist->num_chunks;
+		retval = ext2fs_get_array(2 * num_old + 2,
+					  sizeof(struct dblist_chunk *), &table);
+		if (retval)
+			goto out;
+		old = dblist->chunks;
+		dblist->chunks = table;
+		dblist->num_chunks = 0;
+		dblist->max_chunks = 2 * num_old + 2;
+		for (a = 0; a < num_old; a = b) {
+			m = a + width < num_old ? a + width : num_old;
+			b = m + width < num_old ? m + width : num_old;
+			retval = merge_chunks(dblist, &ds, old, a, m, b);
+			if (retval)
+				break;
+		}
+		if (retval)
+			for (c = b; c < num_old; c++)
+				keep_runs(dblist, old, c, 0);
+		ext2fs_free_mem(&old);
+		if (retval)
+			break;
+	}
+
+	first = 0;
+	for (c = 0; c < dblist->num_chunks; c++) {
+		dblist->chunks[c]->first = first;
+		for (r = 0; r < dblist->chunks[c]->num; r++)
+			first += dblist->chunks[c]->runs[r].len;
+	}
+
+	if (retval)
+		goto out;
+	if (!split && !entries_sorted(dblist, &ds,
+				      sortfunc != dir_block_cmp2)) {
+		retval = split_runs(dblist);
+		if (retval)
+			goto out;
+		split = 1;
+		goto again;
+	}
+out:
+	while (ds.num_spare)
+		free_chunk(dblist, ds.spare[--ds.num_spare]);
+	ext2fs_free_mem(&ds.tmp);
+	return retval;
+}
+
 void ext2fs_dblist_sort2(ext2_dblist dblist,
 			 EXT2_QSORT_TYPE (*sortfunc)(const void *,
 						     const void *))
 {
 	if (!sortfunc)
 		sortfunc = dir_block_cmp2;
-	qsort(dblist->list, (size_t) dblist->count,
-	      sizeof(struct ext2_db_entry2), sortfunc);
+	(void) sort_dblist(dblist, sortfunc);
 	dblist->sorted = 1;
 }
 
 /*
- * This function iterates over the directory block list
+ * This function iterates over the directory block list, starting at
+ * entry start and visiting at most count entries.  An entry changed
+ * by func is changed in the list.
  */
-errcode_t ext2fs_dblist_iterate2(ext2_dblist dblist,
+errcode_t ext2fs_dblist_iterate3(ext2_dblist dblist,
 				 int (*func)(ext2_filsys fs,
 					     struct ext2_db_entry2 *db_info,
 					     void	*priv_data),
+				 unsigned long long start,
+				 unsigned long long count,
 				 void *priv_data)
 {
-	unsigned long long	i;
-	int		ret;
+	struct ext2_db_entry2	db, orig;
+	struct dblist_run	*run;
+	unsigned long long	i, end;
+	unsigned long		c;
+	unsigned int		r, n;
+	int			ret;
+	errcode_t		retval;
 
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
 	if (!dblist->sorted)
 		ext2fs_dblist_sort2(dblist, 0);
-	for (i=0; i < dblist->count; i++) {
-		ret = (*func)(dblist->fs, &dblist->list[i], priv_data);
+	if (start > dblist->count)
+		return 0;
+	end = start + count;
+	if (end > dblist->count || end < start)
+		end = dblist->count;
+	if (start == end || !find_entry(dblist, start, &c, &r, &n))
+		return 0;
+	for (i = start; i < end; i++) {
+		run = dblist->chunks[c]->runs + r;
+		run_entry(run, n, &db);
+		orig = db;
+		ret = (*func)(dblist->fs, &db, priv_data);
+		if (db.ino != orig.ino || db.blk != orig.blk ||
+		    db.blockcnt != orig.blockcnt) {
+			retval = set_entry(dblist, c, r, n, &db);
+			if (retval)
+				return retval;
+			if (!(ret & DBLIST_ABORT) && i + 1 < end &&
+			    !find_entry(dblist, i + 1, &c, &r, &n))
+				return 0;
+		} else if (++n == run->len) {
+			n = 0;
+			if (++r == dblist->chunks[c]->num) {
+				r = 0;
+				c++;
+			}
+		}
 		if (ret & DBLIST_ABORT)
 			return 0;
 	}
 	return 0;
 }
 
+/*
+ * This function iterates over the directory block list
+ */
+errcode_t ext2fs_dblist_iterate2(ext2_dblist dblist,
+				 int (*func)(ext2_filsys fs,
+					     struct ext2_db_entry2 *db_info,
+					     void	*priv_data),
+				 void *priv_data)
+{
+	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
+
+	return ext2fs_dblist_iterate3(dblist, func, 0, dblist->count,
+				      priv_data);
+}
+
 static EXT2_QSORT_TYPE dir_block_cmp2(const void *a, const void *b)
 {
 	const struct ext2_db_entry2 *db_a =
@@ -249,13 +1062,16 @@ static EXT2_QSORT_TYPE dir_block_cmp2(const void *a, const void *b)
 	const struct ext2_db_entry2 *db_b =
 		(const struct ext2_db_entry2 *) b;
 
+	/* the differences may not fit in an int */
 	if (db_a->blk != db_b->blk)
-		return (int) (db_a->blk - db_b->blk);
+		return db_a->blk < db_b->blk ? -1 : 1;
 
 	if (db_a->ino != db_b->ino)
-		return (int) (db_a->ino - db_b->ino);
+		return db_a->ino < db_b->ino ? -1 : 1;
 
-	return (db_a->blockcnt - db_b->blockcnt);
+	if (db_a->blockcnt != db_b->blockcnt)
+		return db_a->blockcnt < db_b->blockcnt ? -1 : 1;
+	return 0;
 }
 
 blk64_t ext2fs_dblist_count2(ext2_dblist dblist)
@@ -263,26 +1079,56 @@ blk64_t ext2fs_dblist_count2(ext2_dblist dblist)
 	return dblist->count;
 }
 
+/* How many bytes of memory the list takes; chunks in the spill file
+ * aren't counted */
+size_t ext2fs_dblist_mem_usage(ext2_dblist dblist)
+{
+	if (!dblist || dblist->magic != EXT2_ET_MAGIC_DBLIST)
+		return 0;
+	return sizeof(struct ext2_struct_dblist) +
+		(size_t) dblist->heap_chunks * sizeof(struct dblist_chunk) +
+		(size_t) dblist->max_chunks * sizeof(struct dblist_chunk *) +
+		(size_t) dblist->max_free * sizeof(unsigned int);
+}
+
+/*
+ * The entry returned is a copy; it can be changed in the list with
+ * ext2fs_set_dir_block2().
+ */
 errcode_t ext2fs_dblist_get_last2(ext2_dblist dblist,
 				  struct ext2_db_entry2 **entry)
 {
+	struct dblist_chunk	*chunk;
+	struct dblist_run	*run;
+
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
 	if (dblist->count == 0)
 		return EXT2_ET_DBLIST_EMPTY;
 
-	if (entry)
-		*entry = dblist->list + ( dblist->count-1);
+	if (entry) {
+		chunk = dblist->chunks[dblist->num_chunks - 1];
+		run = chunk->runs + chunk->num - 1;
+		run_entry(run, run->len - 1, &dblist->last2);
+		*entry = &dblist->last2;
+	}
 	return 0;
 }
 
 errcode_t ext2fs_dblist_drop_last(ext2_dblist dblist)
 {
+	struct dblist_chunk	*chunk;
+
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
 	if (dblist->count == 0)
 		return EXT2_ET_DBLIST_EMPTY;
 
+	chunk = dblist->chunks[dblist->num_chunks - 1];
+	if (--chunk->runs[chunk->num - 1].len == 0 && --chunk->num == 0) {
+		free_chunk(dblist, chunk);
+		dblist->num_chunks--;
+	}
 	dblist->count--;
 	return 0;
 }
@@ -318,8 +1164,7 @@ void ext2fs_dblist_sort(ext2_dblist dblist,
 		sortfunc = dir_block_cmp;
 	} else
 		sortfunc = dir_block_cmp2;
-	qsort(dblist->list, (size_t) dblist->count,
-	      sizeof(struct ext2_db_entry2), sortfunc);
+	(void) sort_dblist(dblist, sortfunc);
 	dblist->sorted = 1;
 }
 
@@ -392,23 +1237,19 @@ int ext2fs_dblist_count(ext2_dblist dblist)
 errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 				 struct ext2_db_entry **entry)
 {
-	static struct ext2_db_entry ret_entry;
 	struct ext2_db_entry2 *last;
+	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
-	if (dblist->count == 0)
-		return EXT2_ET_DBLIST_EMPTY;
-
-	if (!entry)
-		return 0;
-
-	last = dblist->list + dblist->count -1;
+	retval = ext2fs_dblist_get_last2(dblist, &last);
+	if (retval || !entry)
+		return retval;
 
-	ret_entry.ino = last->ino;
-	ret_entry.blk = last->blk;
-	ret_entry.blockcnt = last->blockcnt;
-	*entry = &ret_entry;
+	dblist->last.ino = last->ino;
+	dblist->last.blk = last->blk;
+	dblist->last.blockcnt = last->blockcnt;
+	*entry = &dblist->last;
 
 	return 0;
 }
@@ -0,0 +1,265 @@
+/*
+ * dir_cursor.c --- walk the entries of a directory without callbacks
+ *
+ * ext2fs_dir_iterate() reads a directory one block at a time through
+ * ext2fs_block_iterate3() and calls back once per entry, checking each
+ * entry's length again as it goes.  A directory cursor instead maps the
+ * directory's blocks once, reads runs of blocks which are contiguous on
+ * disk into a buffer with a single request, checks each block once as
+ * it is read, and then hands out pointers to the entries where they lie
+ * in that buffer.  It is read only: an entry returned by the cursor
+ * must not be changed, and stays valid only until the next call.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+/* How many directory blocks are read at once */
+#define DIR_CURSOR_BATCH	16
+
+struct dir_cursor_blk {
+	blk64_t		pblk;
+	e2_blkcnt_t	lblk;
+};
+
+struct ext2_struct_dir_cursor {
+	ext2_filsys		fs;
+	ext2_ino_t		dir;
+	int			flags;
+	struct dir_cursor_blk	*blocks;
+	blk64_t			num_blocks, max_blocks;
+	blk64_t			next;		/* first block not read yet */
+	char			*buf;
+	unsigned int		loaded;		/* blocks in buf */
+	unsigned int		cur;		/* block of buf being walked */
+	unsigned int		offset;		/* of the next entry in it */
+	unsigned int		last_offset;	/* of the entry returned */
+	int			entry;
+	errcode_t		errcode;
+};
+
+static int add_dir_block(ext2_filsys fs EXT2FS_ATTR((unused)),
+			 blk64_t *blocknr, e2_blkcnt_t blockcnt,
+			 blk64_t ref_block EXT2FS_ATTR((unused)),
+			 int ref_offset EXT2FS_ATTR((unused)),
+			 void *priv_data)
+{
+	ext2_dir_cursor	cursor = (ext2_dir_cursor) priv_data;
+	blk64_t		new_max;
+
+	if (blockcnt < 0)
+		return 0;
+	if (cursor->num_blocks == cursor->max_blocks) {
+		new_max = cursor->max_blocks ? cursor->max_blocks * 2 : 64;
+		cursor->errcode = ext2fs_resize_mem(cursor->max_blocks *
+					sizeof(struct dir_cursor_blk),
+					new_max * sizeof(struct dir_cursor_blk),
+					&cursor->blocks);
+		if (cursor->errcode)
+			return BLOCK_ABORT;
+		cursor->max_blocks = new_max;
+	}
+	cursor->blocks[cursor->num_blocks].pblk = *blocknr;
+	cursor->blocks[cursor->num_blocks].lblk = blockcnt;
+	cursor->num_blocks++;
+	return 0;
+}
+
+/*
+ * Bring a block just read into host byte order and make sure its
+ * entries chain from the beginning of the block exactly to its end,
+ * so that they can be handed out without being checked again.
+ */
+static errcode_t check_dir_block(ext2_filsys fs, char *buf)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset, rec_len;
+	errcode_t	retval;
+
+	retval = ext2fs_dirent_swab_in(fs, buf, 0);
+	if (retval)
+		return retval;
+	for (offset = 0; offset < fs->blocksize; offset += rec_len) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+		if (offset + rec_len > fs->blocksize || rec_len < 8 ||
+		    rec_len % 4 ||
+		    ((unsigned) dirent->name_len & 0xFF) + 8 > rec_len)
+			return EXT2_ET_DIR_CORRUPTED;
+	}
+	return 0;
+}
+
+/* Read the next run of blocks which are contiguous on disk */
+static errcode_t load_blocks(ext2_dir_cursor cursor)
+{
+	ext2_filsys	fs = cursor->fs;
+	struct dir_cursor_blk *b = cursor->blocks + cursor->next;
+	unsigned int	n, i;
+	errcode_t	retval;
+
+	for (n = 1; n < DIR_CURSOR_BATCH &&
+		     cursor->next + n < cursor->num_blocks; n++)
+		if (b[n].pblk != b[0].pblk + n)
+			break;
+	cursor->loaded = 0;
+	retval = io_channel_read_blk64(fs->io, b[0].pblk, n, cursor->buf);
+	if (retval)
+		return retval;
+	/*
+	 * Hand out the entries of the blocks before a bad one first; the
+	 * error is returned when the cursor gets to it.
+	 */
+	for (i = 0; i < n; i++) {
+		retval = check_dir_block(fs, cursor->buf + i * fs->blocksize);
+		if (retval && i == 0)
+			return retval;
+		if (retval) {
+			n = i;
+			break;
+		}
+	}
+	cursor->loaded = n;
+	cursor->cur = 0;
+	cursor->offset = 0;
+	cursor->next += n;
+	return 0;
+}
+
+/*
+ * Start walking the entries of dir.  The only flag honoured is
+ * DIRENT_FLAG_INCLUDE_EMPTY, which also returns the unused entries.
+ */
+errcode_t ext2fs_open_dir_cursor(ext2_filsys fs, ext2_ino_t dir, int flags,
+				 ext2_dir_cursor *ret)
+{
+	ext2_dir_cursor	cursor;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (flags & ~DIRENT_FLAG_INCLUDE_EMPTY)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = ext2fs_check_directory(fs, dir);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_struct_dir_cursor),
+				    &cursor);
+	if (retval)
+		return retval;
+	cursor->fs = fs;
+	cursor->dir = dir;
+	cursor->flags = flags;
+
+	retval = io_channel_alloc_buf(fs->io, DIR_CURSOR_BATCH, &cursor->buf);
+	if (retval)
+		goto errout;
+	retval = ext2fs_block_iterate3(fs, dir, BLOCK_FLAG_READ_ONLY |
+				       BLOCK_FLAG_DATA_ONLY, 0,
+				       add_dir_block, cursor);
+	if (!retval)
+		retval = cursor->errcode;
+	if (retval)
+		goto errout;
+	*ret = cursor;
+	return 0;
+
+errout:
+	ext2fs_close_dir_cursor(cursor);
+	return retval;
+}
+
+/*
+ * Return the next entry of the directory in *ret_dirent, or NULL once
+ * all of them have been seen.  If ret_entry is not NULL, it is set to
+ * DIRENT_DOT_FILE, DIRENT_DOT_DOT_FILE or DIRENT_OTHER_FILE, as for the
+ * callbacks of ext2fs_dir_iterate2().
+ */
+errcode_t ext2fs_dir_cursor_next(ext2_dir_cursor cursor,
+				 struct ext2_dir_entry **ret_dirent,
+				 int *ret_entry)
+{
+	ext2_filsys	fs = cursor->fs;
+	struct ext2_dir_entry *dirent;
+	unsigned int	rec_len;
+	errcode_t	retval;
+
+	while (1) {
+		if (cursor->cur >= cursor->loaded ||
+		    cursor->offset >= fs->blocksize) {
+			if (cursor->loaded && ++cursor->cur < cursor->loaded) {
+				cursor->offset = 0;
+			} else if (cursor->next < cursor->num_blocks) {
+				retval = load_blocks(cursor);
+				if (retval)
+					return retval;
+			} else {
+				*ret_dirent = NULL;
+				return 0;
+			}
+			cursor->entry = cursor->blocks[cursor->next -
+				cursor->loaded + cursor->cur].lblk ?
+				DIRENT_OTHER_FILE : DIRENT_DOT_FILE;
+		}
+
+		dirent = (struct ext2_dir_entry *)
+			(cursor->buf + cursor->cur * fs->blocksize +
+			 cursor->offset);
+		(void) ext2fs_get_rec_len(fs, dirent, &rec_len);
+		cursor->last_offset = cursor->offset;
+		cursor->offset += rec_len;
+		if (!dirent->inode &&
+		    !(cursor->flags & DIRENT_FLAG_INCLUDE_EMPTY))
+			continue;
+
+		if (ret_entry)
+			*ret_entry = cursor->entry;
+		if (cursor->entry < DIRENT_OTHER_FILE)
+			cursor->entry++;
+		*ret_dirent = dirent;
+		return 0;
+	}
+}
+
+/*
+ * Tell where the entry last returned by ext2fs_dir_cursor_next() is:
+ * its physical and logical block, and its offset within the block.
+ */
+void ext2fs_dir_cursor_pos(ext2_dir_cursor cursor, blk64_t *pblk,
+			   e2_blkcnt_t *lblk, unsigned int *offset)
+{
+	struct dir_cursor_blk *b;
+
+	b = cursor->blocks + cursor->next - cursor->loaded + cursor->cur;
+	if (pblk)
+		*pblk = b->pblk;
+	if (lblk)
+		*lblk = b->lblk;
+	if (offset)
+		*offset = cursor->last_offset;
+}
+
+void ext2fs_close_dir_cursor(ext2_dir_cursor cursor)
+{
+	if (!cursor)
+		return;
+	if (cursor->blocks)
+		ext2fs_free_mem(&cursor->blocks);
+	if (cursor->buf)
+		ext2fs_free_mem(&cursor->buf);
+	ext2fs_free_mem(&cursor);
+}
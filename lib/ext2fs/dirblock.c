@@ -19,19 +19,18 @@
 #include "ext2_fs.h"
 #include "ext2fs.h"
 
-errcode_t ext2fs_read_dir_block3(ext2_filsys fs, blk64_t block,
-				 void *buf, int flags EXT2FS_ATTR((unused)))
+/*
+ * Convert a directory block which has just been read from disk to
+ * host byte order, and check that its entries' lengths are sane.
+ */
+errcode_t ext2fs_dirent_swab_in(ext2_filsys fs, void *buf,
+				int flags EXT2FS_ATTR((unused)))
 {
-	errcode_t	retval;
+	errcode_t	retval = 0;
 	char		*p, *end;
 	struct ext2_dir_entry *dirent;
 	unsigned int	name_len, rec_len;
 
-
-	retval = io_channel_read_blk64(fs->io, block, 1, buf);
-	if (retval)
-		return retval;
-
 	p = (char *) buf;
 	end = (char *) buf + fs->blocksize;
 	while (p < end-8) {
@@ -58,6 +57,18 @@ errcode_t ext2fs_read_dir_block3(ext2_filsys fs, blk64_t block,
 	return retval;
 }
 
+errcode_t ext2fs_read_dir_block3(ext2_filsys fs, blk64_t block,
+				 void *buf, int flags)
+{
+	errcode_t	retval;
+
+	retval = io_channel_read_blk64(fs->io, block, 1, buf);
+	if (retval)
+		return retval;
+
+	return ext2fs_dirent_swab_in(fs, buf, flags);
+}
+
 errcode_t ext2fs_read_dir_block2(ext2_filsys fs, blk_t block,
 				 void *buf, int flags EXT2FS_ATTR((unused)))
 {
@@ -81,6 +92,9 @@ errcode_t ext2fs_write_dir_block3(ext2_filsys fs, blk64_t block,
 	unsigned int	rec_len;
 	struct ext2_dir_entry *dirent;
 
+	/* Cached lookups may name entries this block changes */
+	ext2fs_flush_dentry_cache(fs);
+
 	retval = ext2fs_get_mem(fs->blocksize, &buf);
 	if (retval)
 		return retval;
@@ -108,6 +122,7 @@ errcode_t ext2fs_write_dir_block3(ext2_filsys fs, blk64_t block,
 	ext2fs_free_mem(&buf);
 	return retval;
 #else
+	ext2fs_flush_dentry_cache(fs);
 	return io_channel_write_blk64(fs->io, block, 1, (char *) inbuf);
 #endif
 }
@@ -0,0 +1,488 @@
+/*
+ * dirbuild.c --- add many entries to a directory at once
+ *
+ * Adding entries one at a time with ext2fs_link() has to find room for
+ * each of them in the directory.  A directory builder instead collects
+ * the entries in memory, and when it is closed writes the whole
+ * directory out in one pass: the blocks are filled sequentially and,
+ * if the file system supports it and the entries need more than one
+ * block, the htree index is built once at the end, the same way e2fsck
+ * -D lays it out.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+/* How many names are hashed by each call to ext2fs_dirhash_many() */
+#define DIRBUILD_HASH_BATCH	256
+
+struct dir_build_ent {
+	ext2_ino_t	ino;
+	__u32		name_off;
+	__u16		name_len;	/* with the file type in the high byte */
+	ext2_dirhash_t	hash;
+};
+
+struct ext2_struct_dir_builder {
+	ext2_filsys		fs;
+	ext2_ino_t		dir;
+	ext2_ino_t		parent;
+	struct dir_build_ent	*ents;
+	size_t			num, max;
+	char			*names;
+	size_t			names_len, names_max;
+};
+
+static errcode_t add_entry(ext2_dir_builder db, const char *name, int len,
+			   ext2_ino_t ino, int filetype)
+{
+	struct dir_build_ent *ent;
+	size_t		new_max;
+	errcode_t	retval;
+
+	if (db->num == db->max) {
+		new_max = db->max ? db->max * 2 : 1024;
+		retval = ext2fs_resize_mem(db->max * sizeof(*ent),
+					   new_max * sizeof(*ent), &db->ents);
+		if (retval)
+			return retval;
+		db->max = new_max;
+	}
+	while (db->names_len + len > db->names_max) {
+		new_max = db->names_max ? db->names_max * 2 : 16384;
+		retval = ext2fs_resize_mem(db->names_max, new_max,
+					   &db->names);
+		if (retval)
+			return retval;
+		db->names_max = new_max;
+	}
+	ent = &db->ents[db->num++];
+	ent->ino = ino;
+	ent->name_off = db->names_len;
+	ent->name_len = len | (filetype << 8);
+	ent->hash = 0;
+	memcpy(db->names + db->names_len, name, len);
+	db->names_len += len;
+	return 0;
+}
+
+static int load_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
+		     int entry,
+		     struct ext2_dir_entry *dirent,
+		     int offset EXT2FS_ATTR((unused)),
+		     int blocksize EXT2FS_ATTR((unused)),
+		     char *buf EXT2FS_ATTR((unused)),
+		     void *priv_data)
+{
+	ext2_dir_builder db = (ext2_dir_builder) priv_data;
+
+	if (entry == DIRENT_DOT_FILE)
+		return 0;
+	if (entry == DIRENT_DOT_DOT_FILE) {
+		db->parent = dirent->inode;
+		return 0;
+	}
+	if (add_entry(db, dirent->name, dirent->name_len & 0xFF,
+		      dirent->inode, dirent->name_len >> 8))
+		return DIRENT_ABORT;
+	return 0;
+}
+
+void ext2fs_free_dir_builder(ext2_dir_builder db)
+{
+	if (!db)
+		return;
+	ext2fs_free_mem(&db->ents);
+	ext2fs_free_mem(&db->names);
+	ext2fs_free_mem(&db);
+}
+
+/*
+ * Start building directory dir.  The entries it already has are read
+ * in first, so they are kept.
+ */
+errcode_t ext2fs_open_dir_builder(ext2_filsys fs, ext2_ino_t dir,
+				  ext2_dir_builder *ret)
+{
+	ext2_dir_builder db;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+
+	retval = ext2fs_check_directory(fs, dir);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_struct_dir_builder),
+				    &db);
+	if (retval)
+		return retval;
+	db->fs = fs;
+	db->dir = dir;
+
+	retval = ext2fs_dir_iterate2(fs, dir, 0, 0, load_proc, db);
+	if (!retval && !db->parent)
+		retval = EXT2_ET_DIR_CORRUPTED;
+	if (retval) {
+		ext2fs_free_dir_builder(db);
+		return retval;
+	}
+	*ret = db;
+	return 0;
+}
+
+/*
+ * Note: the low 3 bits of the flags field are used as the directory
+ * entry filetype, as for ext2fs_link().  No check is made for an
+ * entry of the same name.
+ */
+errcode_t ext2fs_dir_builder_add(ext2_dir_builder db, const char *name,
+				 ext2_ino_t ino, int flags)
+{
+	int		len = name ? strlen(name) : 0;
+
+	if (len == 0 || len > EXT2_NAME_LEN || !ino)
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (!(db->fs->super->s_feature_incompat &
+	      EXT2_FEATURE_INCOMPAT_FILETYPE))
+		flags = 0;
+	return add_entry(db, name, len, ino, flags & 0x7);
+}
+
+static EXT2_QSORT_TYPE hash_cmp(const void *a, const void *b)
+{
+	const struct dir_build_ent *ea = a, *eb = b;
+
+	if (ea->hash != eb->hash)
+		return ea->hash < eb->hash ? -1 : 1;
+	/* Names with the same hash stay in the order they were added */
+	return ea->name_off < eb->name_off ? -1 : 1;
+}
+
+static errcode_t hash_entries(ext2_dir_builder db, int hash_version)
+{
+	const char	*names[DIRBUILD_HASH_BATCH];
+	int		lens[DIRBUILD_HASH_BATCH];
+	ext2_dirhash_t	hashes[DIRBUILD_HASH_BATCH];
+	size_t		i;
+	int		j, n;
+	errcode_t	retval;
+
+	for (i = 0; i < db->num; i += n) {
+		n = db->num - i;
+		if (n > DIRBUILD_HASH_BATCH)
+			n = DIRBUILD_HASH_BATCH;
+		for (j = 0; j < n; j++) {
+			names[j] = db->names + db->ents[i + j].name_off;
+			lens[j] = db->ents[i + j].name_len & 0xFF;
+		}
+		retval = ext2fs_dirhash_many(hash_version, n, names, lens,
+					     db->fs->super->s_hash_seed,
+					     hashes, 0);
+		if (retval)
+			return retval;
+		for (j = 0; j < n; j++)
+			db->ents[i + j].hash = hashes[j];
+	}
+	return 0;
+}
+
+/* The blocks of the new directory, built up in memory */
+struct dir_build_out {
+	char		*buf;
+	ext2_dirhash_t	*hashes;	/* first hash of each leaf */
+	blk64_t		num, max;
+};
+
+static errcode_t next_block(ext2_filsys fs, struct dir_build_out *out,
+			    char **ret)
+{
+	blk64_t		new_max;
+	errcode_t	retval;
+
+	if (out->num == out->max) {
+		new_max = out->max ? out->max * 2 : 16;
+		retval = ext2fs_resize_mem(out->max * fs->blocksize,
+					   new_max * fs->blocksize, &out->buf);
+		if (retval)
+			return retval;
+		retval = ext2fs_resize_mem(out->max * sizeof(ext2_dirhash_t),
+					   new_max * sizeof(ext2_dirhash_t),
+					   &out->hashes);
+		if (retval)
+			return retval;
+		out->max = new_max;
+	}
+	*ret = out->buf + out->num * fs->blocksize;
+	memset(*ret, 0, fs->blocksize);
+	out->hashes[out->num++] = 0;
+	return 0;
+}
+
+/*
+ * Write the entries into blocks one after the other.  In an indexed
+ * directory each block becomes a leaf, and a leaf which starts in the
+ * middle of a run of equal hashes has the low bit of its hash set.
+ */
+static errcode_t fill_blocks(ext2_dir_builder db, struct dir_build_out *out,
+			     char *block, unsigned int offset, int indexed)
+{
+	ext2_filsys	fs = db->fs;
+	struct dir_build_ent *ent;
+	struct ext2_dir_entry *dirent = 0;
+	unsigned int	rec_len;
+	size_t		i;
+	errcode_t	retval;
+
+	for (i = 0; i < db->num; i++) {
+		ent = &db->ents[i];
+		rec_len = EXT2_DIR_REC_LEN(ent->name_len & 0xFF);
+		if (offset + rec_len > fs->blocksize) {
+			retval = ext2fs_set_rec_len(fs, fs->blocksize -
+						    ((char *) dirent - block),
+						    dirent);
+			if (retval)
+				return retval;
+			retval = next_block(fs, out, &block);
+			if (retval)
+				return retval;
+			offset = 0;
+		}
+		if (indexed && offset == 0) {
+			out->hashes[out->num - 1] = ent->hash;
+			if (i && db->ents[i - 1].hash == ent->hash)
+				out->hashes[out->num - 1] |= 1;
+		}
+		dirent = (struct ext2_dir_entry *) (block + offset);
+		dirent->inode = ent->ino;
+		dirent->name_len = ent->name_len;
+		memcpy(dirent->name, db->names + ent->name_off,
+		       ent->name_len & 0xFF);
+		retval = ext2fs_set_rec_len(fs, rec_len, dirent);
+		if (retval)
+			return retval;
+		offset += rec_len;
+	}
+	if (!dirent)
+		return 0;
+	return ext2fs_set_rec_len(fs, fs->blocksize -
+				  ((char *) dirent - block), dirent);
+}
+
+static void set_dot_entries(ext2_dir_builder db, char *buf,
+			    unsigned int dotdot_len)
+{
+	struct ext2_dir_entry *dirent;
+	int		filetype = 0;
+
+	if (db->fs->super->s_feature_incompat &
+	    EXT2_FEATURE_INCOMPAT_FILETYPE)
+		filetype = EXT2_FT_DIR << 8;
+
+	dirent = (struct ext2_dir_entry *) buf;
+	dirent->inode = db->dir;
+	dirent->name_len = 1 | filetype;
+	dirent->name[0] = '.';
+	(void) ext2fs_set_rec_len(db->fs, 12, dirent);
+	dirent = (struct ext2_dir_entry *) (buf + 12);
+	dirent->inode = db->parent;
+	dirent->name_len = 2 | filetype;
+	dirent->name[0] = '.';
+	dirent->name[1] = '.';
+	(void) ext2fs_set_rec_len(db->fs, dotdot_len, dirent);
+}
+
+/*
+ * Fill in the root, and any interior nodes needed, for the leaves in
+ * blocks 1 and up.  The interior nodes are added after the leaves.
+ */
+static errcode_t build_index(ext2_dir_builder db, struct dir_build_out *out,
+			     int hash_version)
+{
+	ext2_filsys	fs = db->fs;
+	struct ext2_dx_root_info *root;
+	struct ext2_dx_countlimit *limit;
+	struct ext2_dx_entry *ent;
+	blk64_t		leaves = out->num - 1, i, node = 0;
+	int		root_max, node_max, root_count = 0, count = 0;
+	char		*block;
+	errcode_t	retval;
+
+	root_max = (fs->blocksize - 32) / sizeof(struct ext2_dx_entry);
+	node_max = (fs->blocksize - 8) / sizeof(struct ext2_dx_entry);
+	if (leaves > (blk64_t) root_max * node_max)
+		return EXT2_ET_DIR_NO_SPACE;
+
+	set_dot_entries(db, out->buf, fs->blocksize - 12);
+	root = (struct ext2_dx_root_info *) (out->buf + 24);
+	root->hash_version = hash_version;
+	root->info_length = 8;
+	if (leaves > (blk64_t) root_max)
+		root->indirect_levels = 1;
+
+	/*
+	 * next_block() may move out->buf, so the nodes are found by
+	 * their block number each time.
+	 */
+	for (i = 0; i < leaves; i++) {
+		if (root->indirect_levels && (!node || count == node_max)) {
+			ent = (struct ext2_dx_entry *) (out->buf + 32);
+			if (root_count)
+				ent[root_count].hash =
+				  ext2fs_cpu_to_le32(out->hashes[i + 1]);
+			ent[root_count++].block = ext2fs_cpu_to_le32(out->num);
+			if (node) {
+				limit = (struct ext2_dx_countlimit *)
+					(out->buf + node * fs->blocksize + 8);
+				limit->count = ext2fs_cpu_to_le16(count);
+			}
+			node = out->num;
+			retval = next_block(fs, out, &block);
+			if (retval)
+				return retval;
+			(void) ext2fs_set_rec_len(fs, fs->blocksize,
+					(struct ext2_dir_entry *) block);
+			limit = (struct ext2_dx_countlimit *) (block + 8);
+			limit->limit = ext2fs_cpu_to_le16(node_max);
+			count = 0;
+			root = (struct ext2_dx_root_info *) (out->buf + 24);
+		}
+		if (node) {
+			ent = (struct ext2_dx_entry *)
+				(out->buf + node * fs->blocksize + 8);
+			if (count)
+				ent[count].hash =
+				  ext2fs_cpu_to_le32(out->hashes[i + 1]);
+			ent[count++].block = ext2fs_cpu_to_le32(i + 1);
+		} else {
+			ent = (struct ext2_dx_entry *) (out->buf + 32);
+			if (root_count)
+				ent[root_count].hash =
+				  ext2fs_cpu_to_le32(out->hashes[i + 1]);
+			ent[root_count++].block = ext2fs_cpu_to_le32(i + 1);
+		}
+	}
+	if (node) {
+		limit = (struct ext2_dx_countlimit *)
+			(out->buf + node * fs->blocksize + 8);
+		limit->count = ext2fs_cpu_to_le16(count);
+	}
+	limit = (struct ext2_dx_countlimit *) (out->buf + 32);
+	limit->limit = ext2fs_cpu_to_le16(root_max);
+	limit->count = ext2fs_cpu_to_le16(root_count);
+	return 0;
+}
+
+/*
+ * Write the new directory over the old one, allocating blocks as
+ * needed and releasing any left over at the end.
+ */
+static errcode_t write_blocks(ext2_dir_builder db, struct dir_build_out *out,
+			      int indexed)
+{
+	ext2_filsys	fs = db->fs;
+	struct ext2_inode inode;
+	blk64_t		lblk, pblk, old_blocks;
+	errcode_t	retval;
+
+	retval = ext2fs_read_inode(fs, db->dir, &inode);
+	if (retval)
+		return retval;
+	old_blocks = EXT2_I_SIZE(&inode) / fs->blocksize;
+
+	for (lblk = 0; lblk < out->num; lblk++) {
+		pblk = 0;
+		retval = ext2fs_bmap2(fs, db->dir, &inode, NULL, BMAP_ALLOC,
+				      lblk, 0, &pblk);
+		if (retval)
+			return retval;
+		retval = ext2fs_write_dir_block3(fs, pblk,
+				out->buf + lblk * fs->blocksize, 0);
+		if (retval)
+			return retval;
+	}
+	if (old_blocks > out->num) {
+		retval = ext2fs_punch(fs, db->dir, &inode, NULL, out->num,
+				      ~0ULL);
+		if (retval)
+			return retval;
+	}
+
+	inode.i_size = out->num * fs->blocksize;
+	if (indexed)
+		inode.i_flags |= EXT2_INDEX_FL;
+	else
+		inode.i_flags &= ~EXT2_INDEX_FL;
+	return ext2fs_write_inode(fs, db->dir, &inode);
+}
+
+/*
+ * Write out the directory and free the builder.  The directory is
+ * indexed if the file system has dir_index and the entries don't fit
+ * in a single block.
+ */
+errcode_t ext2fs_close_dir_builder(ext2_dir_builder db)
+{
+	ext2_filsys	fs = db->fs;
+	struct dir_build_out out;
+	char		*block;
+	size_t		i, size = 24;
+	int		hash_version, indexed = 0;
+	errcode_t	retval;
+
+	memset(&out, 0, sizeof(out));
+	for (i = 0; i < db->num; i++)
+		size += EXT2_DIR_REC_LEN(db->ents[i].name_len & 0xFF);
+	if ((fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+	    size > fs->blocksize)
+		indexed = 1;
+
+	retval = next_block(fs, &out, &block);
+	if (retval)
+		goto out;
+	if (indexed) {
+		hash_version = fs->super->s_def_hash_version;
+		if (hash_version <= EXT2_HASH_TEA &&
+		    (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+			hash_version += 3;
+		retval = hash_entries(db, hash_version);
+		if (retval)
+			goto out;
+		qsort(db->ents, db->num, sizeof(struct dir_build_ent),
+		      hash_cmp);
+
+		retval = next_block(fs, &out, &block);
+		if (retval)
+			goto out;
+		retval = fill_blocks(db, &out, block, 0, 1);
+		if (retval)
+			goto out;
+		retval = build_index(db, &out, fs->super->s_def_hash_version);
+	} else {
+		set_dot_entries(db, block, db->num ? 12 : fs->blocksize - 12);
+		retval = fill_blocks(db, &out, block, 24, 0);
+	}
+	if (retval)
+		goto out;
+
+	retval = write_blocks(db, &out, indexed);
+out:
+	ext2fs_free_mem(&out.buf);
+	ext2fs_free_mem(&out.hashes);
+	ext2fs_free_dir_builder(db);
+	return retval;
+}
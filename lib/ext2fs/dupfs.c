@@ -26,6 +26,10 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 
 	EXT2_CHECK_MAGIC(src, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	retval = ext2fs_read_group_descs(src);
+	if (retval)
+		return retval;
+
 	retval = ext2fs_get_mem(sizeof(struct struct_ext2_filsys), &fs);
 	if (retval)
 		return retval;
@@ -42,6 +46,14 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 	fs->mmp_buf = 0;
 	fs->mmp_cmp = 0;
 	fs->mmp_fd = -1;
+	fs->mmp_heartbeat_pid = 0;	/* the heartbeat stays with src */
+	fs->mmp_heartbeat_fd = -1;
+	fs->dcache = 0;		/* the copy starts without one */
+	fs->bmap_cache = 0;
+	fs->group_cache = 0;
+	fs->inode_cursor = 0;
+	fs->space_cache = 0;
+	fs->bitmap_spill_dir = 0;
 
 	io_channel_bumpcount(fs->io);
 	if (fs->icache)
@@ -57,6 +69,12 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 		goto errout;
 	memcpy(fs->super, src->super, SUPERBLOCK_SIZE);
 
+	if (src->bitmap_spill_dir) {
+		retval = ext2fs_set_bitmap_spill(fs, src->bitmap_spill_dir);
+		if (retval)
+			goto errout;
+	}
+
 	retval = ext2fs_get_mem(SUPERBLOCK_SIZE, &fs->orig_super);
 	if (retval)
 		goto errout;
@@ -17,6 +17,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 struct expand_dir_struct {
 	int		done;
@@ -36,6 +37,7 @@ static int expand_dir_proc(ext2_filsys	fs,
 	blk64_t	new_blk;
 	char		*block;
 	errcode_t	retval;
+	struct ext2_dentry_cache *dcache;
 
 	if (*blocknr) {
 		if (blockcnt >= 0)
@@ -62,7 +64,11 @@ static int expand_dir_proc(ext2_filsys	fs,
 			return BLOCK_ABORT;
 		}
 		es->done = 1;
+		/* An empty block can't make a cached lookup wrong */
+		dcache = fs->dcache;
+		fs->dcache = 0;
 		retval = ext2fs_write_dir_block(fs, new_blk, block);
+		fs->dcache = dcache;
 	} else {
 		retval = ext2fs_get_mem(fs->blocksize, &block);
 		if (retval) {
@@ -61,11 +61,44 @@ struct struct_io_channel {
 	int		align;
 };
 
+/*
+ * A latency histogram counts the requests which took less than 1, 2,
+ * 4, ... 2^(IO_STATS_LATENCY_BUCKETS - 2) microseconds, and in its last
+ * bucket, those which took longer.
+ */
+#define IO_STATS_LATENCY_BUCKETS	24
+
+/*
+ * num_fields is the number of unsigned long long fields the manager
+ * fills in, counting each bucket of a histogram as one.
+ */
 struct struct_io_stats {
 	int			num_fields;
 	int			reserved;
 	unsigned long long	bytes_read;
 	unsigned long long	bytes_written;
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+	unsigned long long	discards;
+	unsigned long long	bytes_discarded;
+	/* requests which went to the device */
+	unsigned long long	reads;
+	unsigned long long	writes;
+	unsigned long long	flushes;
+	unsigned long long	read_latency[IO_STATS_LATENCY_BUCKETS];
+	unsigned long long	write_latency[IO_STATS_LATENCY_BUCKETS];
+};
+
+#define IO_STATS_NUM_FIELDS	(9 + 2 * IO_STATS_LATENCY_BUCKETS)
+
+/*
+ * One piece of a scatter/gather request: count blocks to be read into
+ * or written from buf.  The pieces of a request cover consecutive
+ * blocks on disk.
+ */
+struct io_blk_vec {
+	void			*buf;
+	int			count;
 };
 
 struct struct_io_manager {
@@ -90,7 +123,18 @@ struct struct_io_manager {
 					int count, const void *data);
 	errcode_t (*discard)(io_channel channel, unsigned long long block,
 			     unsigned long long count);
-	long	reserved[16];
+	errcode_t (*cache_readahead)(io_channel channel,
+				     unsigned long long block,
+				     unsigned long long count);
+	errcode_t (*read_blk_vec)(io_channel channel,
+				  unsigned long long block,
+				  struct io_blk_vec *vec, int nr_vec);
+	errcode_t (*write_blk_vec)(io_channel channel,
+				   unsigned long long block,
+				   const struct io_blk_vec *vec, int nr_vec);
+	errcode_t (*zeroout)(io_channel channel, unsigned long long block,
+			     unsigned long long count);
+	long	reserved[12];
 };
 
 #define IO_FLAG_RW		0x0001
@@ -124,6 +168,24 @@ extern errcode_t io_channel_discard(io_channel channel,
 				    unsigned long long count);
 extern errcode_t io_channel_alloc_buf(io_channel channel,
 				      int count, void *ptr);
+extern errcode_t io_channel_cache_readahead(io_channel io,
+					    unsigned long long block,
+					    unsigned long long count);
+extern errcode_t io_channel_zeroout(io_channel channel,
+				    unsigned long long block,
+				    unsigned long long count);
+extern errcode_t io_channel_read_blk_vec(io_channel channel,
+					 unsigned long long block,
+					 struct io_blk_vec *vec, int nr_vec);
+extern errcode_t io_channel_write_blk_vec(io_channel channel,
+					  unsigned long long block,
+					  const struct io_blk_vec *vec,
+					  int nr_vec);
+extern void io_stats_add_latency(unsigned long long *hist,
+				 unsigned long long usec);
+extern unsigned long long io_stats_latency(const unsigned long long *hist,
+					   const unsigned long long *base,
+					   int percent);
 
 /* unix_io.c */
 extern io_manager unix_io_manager;
@@ -133,6 +195,42 @@ extern io_manager undo_io_manager;
 extern errcode_t set_undo_io_backing_manager(io_manager manager);
 extern errcode_t set_undo_io_backup_file(char *file_name);
 
+/* trace_io.c */
+extern io_manager trace_io_manager;
+extern errcode_t set_trace_io_backing_manager(io_manager manager);
+extern errcode_t set_trace_io_file(const char *file_name);
+
+/* throttle_io.c */
+extern io_manager throttle_io_manager;
+extern errcode_t set_throttle_io_backing_manager(io_manager manager);
+extern int throttle_io_wanted(const char *opts);
+
+/* stage_io.c */
+extern io_manager stage_io_manager;
+extern errcode_t set_stage_io_backing_manager(io_manager manager);
+extern int stage_io_wanted(const char *opts);
+
+/* template_io.c */
+struct ext2_super_block;
+extern io_manager template_io_manager;
+extern errcode_t set_template_io_backing_manager(io_manager manager);
+extern errcode_t template_io_save(io_channel channel, const char *file_name);
+extern errcode_t template_io_read_super(const char *file_name,
+					struct ext2_super_block *super);
+extern errcode_t template_io_apply(io_channel channel, const char *file_name,
+				   int flags);
+
+/* Flags for template_io_apply() */
+#define TEMPLATE_IO_SKIP_ZEROES	0x0001	/* the device reads back zeroes */
+
+/* http_io.c */
+extern io_manager http_io_manager;
+extern int http_io_probe(const char *name);
+
+/* qcow2_io.c */
+extern io_manager qcow2_io_manager;
+extern int qcow2_io_probe(const char *name);
+
 /* test_io.c */
 extern io_manager test_io_manager, test_io_backing_manager;
 extern void (*test_io_cb_read_blk)
@@ -147,6 +147,10 @@ struct ext2_db_entry {
 
 typedef struct ext2_struct_dblist *ext2_dblist;
 
+typedef struct ext2_struct_dir_builder *ext2_dir_builder;
+
+typedef struct ext2_struct_dir_cursor *ext2_dir_cursor;
+
 #define DBLIST_ABORT	1
 
 /*
@@ -155,6 +159,8 @@ typedef struct ext2_struct_dblist *ext2_dblist;
 
 #define EXT2_FILE_WRITE		0x0001
 #define EXT2_FILE_CREATE	0x0002
+#define EXT2_FILE_READAHEAD	0x0004	/* read contiguous blocks ahead */
+#define EXT2_FILE_DELALLOC	0x0008	/* allocate written blocks in runs */
 
 #define EXT2_FILE_MASK		0x00FF
 
@@ -191,6 +197,9 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_PRINT_PROGRESS	0x40000
 #define EXT2_FLAG_DIRECT_IO		0x80000
 #define EXT2_FLAG_SKIP_MMP		0x100000
+#define EXT2_FLAG_LAZY_DESC		0x200000
+#define EXT2_FLAG_BMAP_STATS		0x400000
+#define EXT2_FLAG_SPREAD_DIRS		0x800000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -273,6 +282,50 @@ struct struct_ext2_filsys {
 	 * Time at which e2fsck last updated the MMP block.
 	 */
 	long mmp_last_written;
+
+	/*
+	 * Dentry cache, see ext2fs_create_dentry_cache()
+	 */
+	struct ext2_dentry_cache	*dcache;
+
+	/*
+	 * Last extent found by ext2fs_bmap2(), see bmap.c
+	 */
+	struct ext2_bmap_cache		*bmap_cache;
+
+	/*
+	 * With EXT2_FLAG_LAZY_DESC, the descriptor blocks which haven't
+	 * been read yet, and where they were to be read from
+	 */
+	__u8				*desc_unread;
+	blk64_t				desc_group_block;
+
+	/*
+	 * MMP heartbeat helper, see ext2fs_mmp_start_heartbeat()
+	 */
+	pid_t				mmp_heartbeat_pid;
+	int				mmp_heartbeat_fd;
+
+	/*
+	 * Group descriptor cache, see ext2fs_create_group_cache()
+	 */
+	struct ext2_group_cache		*group_cache;
+
+	/*
+	 * Where ext2fs_new_inode() carries on searching, see alloc.c
+	 */
+	struct ext2_inode_cursor	*inode_cursor;
+
+	/*
+	 * Free runs of each group, see ext2fs_create_space_cache()
+	 */
+	struct ext2_space_cache		*space_cache;
+
+	/*
+	 * Where big bitarray bitmaps keep their bits, see
+	 * ext2fs_set_bitmap_spill()
+	 */
+	char				*bitmap_spill_dir;
 };
 
 #if EXT2_FLAT_INCLUDES
@@ -287,6 +340,8 @@ struct struct_ext2_filsys {
 #define EXT2FS_BMAP64_BITARRAY	1
 #define EXT2FS_BMAP64_RBTREE	2
 #define EXT2FS_BMAP64_AUTODIR	3
+#define EXT2FS_BMAP64_RADIXTREE	4
+#define EXT2FS_BMAP64_ADAPTIVE	5
 
 /*
  * Return flags for the block iterator functions
@@ -335,6 +390,20 @@ struct struct_ext2_filsys {
 #define BLOCK_COUNT_TIND	(-3)
 #define BLOCK_COUNT_TRANSLATOR	(-4)
 
+/*
+ * Flags passed to the callback of ext2fs_extent_iterate().
+ *
+ * EXT2_EXTENT_ITERATE_METADATA marks a block which holds part of the
+ * mapping itself (an extent tree node, an indirect block or the HURD
+ * translator block) rather than file data; it is always reported as a
+ * run of one block, and its logical block is meaningless.
+ *
+ * EXT2_EXTENT_ITERATE_UNINIT marks a run which is allocated but not
+ * initialized.
+ */
+#define EXT2_EXTENT_ITERATE_METADATA	0x0001
+#define EXT2_EXTENT_ITERATE_UNINIT	0x0002
+
 #if 0
 /*
  * Flags for ext2fs_move_blocks
@@ -449,6 +518,14 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
 #define EXT2_SF_BAD_EXTRA_BYTES	0x0004
 #define EXT2_SF_SKIP_MISSING_ITABLE	0x0008
 #define EXT2_SF_DO_LAZY		0x0010
+#define EXT2_SF_ZERO_UNUSED	0x0020
+#define EXT2_SF_READ_UNUSED	0x0040
+
+/*
+ * The buffer_blocks to pass to ext2fs_open_inode_scan to have the
+ * buffer sized from the device's I/O hints
+ */
+#define EXT2_INODE_SCAN_AUTO_BUFFER	(-1)
 
 /*
  * ext2fs_check_if_mounted flags
@@ -508,6 +585,8 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
  * ext2_icount_t abstraction
  */
 #define EXT2_ICOUNT_OPT_INCREMENT	0x01
+#define EXT2_ICOUNT_OPT_HASH		0x02
+#define EXT2_ICOUNT_OPT_FULLMAP		0x04
 
 typedef struct ext2_icount *ext2_icount_t;
 
@@ -633,6 +712,15 @@ typedef struct stat ext2fs_struct_stat;
  */
 #define EXT2_FLAG_FLUSH_NO_SYNC          1
 
+/*
+ * For ext2fs_close2() and ext2fs_flush2(), this flag leaves the backup
+ * superblocks and group descriptors alone if only the free counts, the
+ * times and the mount count have changed in the superblock since it was
+ * read.  The caller must not have changed anything else in the group
+ * descriptors than their counters.
+ */
+#define EXT2_FLAG_FLUSH_DEFER_BACKUPS    2
+
 /*
  * function prototypes
  */
@@ -688,6 +776,8 @@ void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 			       int inuse, int isdir);
 void ext2fs_block_alloc_stats(ext2_filsys fs, blk_t blk, int inuse);
 void ext2fs_block_alloc_stats2(ext2_filsys fs, blk64_t blk, int inuse);
+void ext2fs_block_alloc_stats_range(ext2_filsys fs, blk64_t blk,
+				    blk_t num, int inuse);
 
 /* alloc_tables.c */
 extern errcode_t ext2fs_allocate_tables(ext2_filsys fs);
@@ -697,6 +787,8 @@ extern errcode_t ext2fs_allocate_group_table(ext2_filsys fs, dgrp_t group,
 /* badblocks.c */
 extern errcode_t ext2fs_u32_list_create(ext2_u32_list *ret, int size);
 extern errcode_t ext2fs_u32_list_add(ext2_u32_list bb, __u32 blk);
+extern errcode_t ext2fs_u32_list_add_array(ext2_u32_list bb, __u32 *blks,
+					   int num);
 extern int ext2fs_u32_list_find(ext2_u32_list bb, __u32 blk);
 extern int ext2fs_u32_list_test(ext2_u32_list bb, blk_t blk);
 extern errcode_t ext2fs_u32_list_iterate_begin(ext2_u32_list bb,
@@ -710,6 +802,8 @@ extern errcode_t ext2fs_badblocks_list_create(ext2_badblocks_list *ret,
 					    int size);
 extern errcode_t ext2fs_badblocks_list_add(ext2_badblocks_list bb,
 					   blk_t blk);
+extern errcode_t ext2fs_badblocks_list_add_array(ext2_badblocks_list bb,
+						 blk_t *blks, int num);
 extern int ext2fs_badblocks_list_test(ext2_badblocks_list bb,
 				    blk_t blk);
 extern int ext2fs_u32_list_del(ext2_u32_list bb, __u32 blk);
@@ -725,6 +819,9 @@ extern errcode_t ext2fs_badblocks_copy(ext2_badblocks_list src,
 extern int ext2fs_badblocks_equal(ext2_badblocks_list bb1,
 				  ext2_badblocks_list bb2);
 extern int ext2fs_u32_list_count(ext2_u32_list bb);
+extern errcode_t ext2fs_badblocks_list_to_bitmap(ext2_filsys fs,
+						 ext2_badblocks_list bb,
+						 ext2fs_block_bitmap *ret);
 
 /* bb_compat */
 extern errcode_t badblocks_list_create(badblocks_list *ret, int size);
@@ -808,6 +905,9 @@ extern errcode_t ext2fs_get_block_bitmap_range2(ext2fs_block_bitmap bmap,
 					 blk64_t start, size_t num,
 					 void *out);
 
+/* blkmap64_ba.c */
+extern errcode_t ext2fs_set_bitmap_spill(ext2_filsys fs, const char *dir);
+
 /* blknum.c */
 extern dgrp_t ext2fs_group_of_blk2(ext2_filsys fs, blk64_t);
 extern blk64_t ext2fs_group_first_block2(ext2_filsys fs, dgrp_t group);
@@ -901,6 +1001,13 @@ errcode_t ext2fs_block_iterate3(ext2_filsys fs,
 					    int		ref_offset,
 					    void	*priv_data),
 				void *priv_data);
+typedef int (*ext2_extent_iterate_func)(ext2_filsys fs, blk64_t lblk,
+					blk64_t pblk, __u32 len, int flags,
+					void *priv_data);
+extern errcode_t ext2fs_extent_iterate(ext2_filsys fs, ext2_ino_t ino,
+				       int flags, char *block_buf,
+				       ext2_extent_iterate_func func,
+				       void *priv_data);
 
 /* bmap.c */
 extern errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino,
@@ -911,6 +1018,9 @@ extern errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino,
 			      struct ext2_inode *inode,
 			      char *block_buf, int bmap_flags, blk64_t block,
 			      int *ret_flags, blk64_t *phys_blk);
+extern errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+				   struct ext2_inode *inode, blk64_t block,
+				   struct ext2fs_extent *extent);
 errcode_t ext2fs_map_cluster_block(ext2_filsys fs, ext2_ino_t ino,
 				   struct ext2_inode *inode, blk64_t lblk,
 				   blk64_t *pblk);
@@ -952,6 +1062,7 @@ extern __u32 ext2fs_crc32c_le(__u32 crc, unsigned char const *p, size_t len);
 
 /* csum.c */
 extern void ext2fs_group_desc_csum_set(ext2_filsys fs, dgrp_t group);
+extern void ext2fs_group_desc_csum_set_all(ext2_filsys fs);
 extern int ext2fs_group_desc_csum_verify(ext2_filsys fs, dgrp_t group);
 extern errcode_t ext2fs_set_gdt_csum(ext2_filsys fs);
 extern __u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group);
@@ -978,14 +1089,23 @@ extern errcode_t ext2fs_dblist_iterate2(ext2_dblist dblist,
 	int (*func)(ext2_filsys fs, struct ext2_db_entry2 *db_info,
 		    void	*priv_data),
        void *priv_data);
+extern errcode_t ext2fs_dblist_iterate3(ext2_dblist dblist,
+	int (*func)(ext2_filsys fs, struct ext2_db_entry2 *db_info,
+		    void	*priv_data),
+	unsigned long long start,
+	unsigned long long count,
+	void *priv_data);
 extern errcode_t ext2fs_set_dir_block(ext2_dblist dblist, ext2_ino_t ino,
 				      blk_t blk, int blockcnt);
 extern errcode_t ext2fs_set_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 				       blk64_t blk, e2_blkcnt_t blockcnt);
 extern errcode_t ext2fs_copy_dblist(ext2_dblist src,
 				    ext2_dblist *dest);
+extern errcode_t ext2fs_dblist_set_spill(ext2_dblist dblist, const char *dir,
+					 unsigned long long bytes);
 extern int ext2fs_dblist_count(ext2_dblist dblist);
 extern blk64_t ext2fs_dblist_count2(ext2_dblist dblist);
+extern size_t ext2fs_dblist_mem_usage(ext2_dblist dblist);
 extern errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 					struct ext2_db_entry **entry);
 extern errcode_t ext2fs_dblist_get_last2(ext2_dblist dblist,
@@ -1007,6 +1127,7 @@ extern errcode_t
 				  void *priv_data);
 
 /* dirblock.c */
+extern errcode_t ext2fs_dirent_swab_in(ext2_filsys fs, void *buf, int flags);
 extern errcode_t ext2fs_read_dir_block(ext2_filsys fs, blk_t block,
 				       void *buf);
 extern errcode_t ext2fs_read_dir_block2(ext2_filsys fs, blk_t block,
@@ -1020,12 +1141,36 @@ extern errcode_t ext2fs_write_dir_block2(ext2_filsys fs, blk_t block,
 extern errcode_t ext2fs_write_dir_block3(ext2_filsys fs, blk64_t block,
 					 void *buf, int flags);
 
+/* dirbuild.c */
+extern errcode_t ext2fs_open_dir_builder(ext2_filsys fs, ext2_ino_t dir,
+					 ext2_dir_builder *ret);
+extern errcode_t ext2fs_dir_builder_add(ext2_dir_builder db,
+					const char *name, ext2_ino_t ino,
+					int flags);
+extern errcode_t ext2fs_close_dir_builder(ext2_dir_builder db);
+extern void ext2fs_free_dir_builder(ext2_dir_builder db);
+
 /* dirhash.c */
 extern errcode_t ext2fs_dirhash(int version, const char *name, int len,
 				const __u32 *seed,
 				ext2_dirhash_t *ret_hash,
 				ext2_dirhash_t *ret_minor_hash);
-
+extern errcode_t ext2fs_dirhash_many(int version, int num,
+				     const char * const *names,
+				     const int *lens, const __u32 *seed,
+				     ext2_dirhash_t *hashes,
+				     ext2_dirhash_t *minor_hashes);
+
+
+/* dir_cursor.c */
+extern errcode_t ext2fs_open_dir_cursor(ext2_filsys fs, ext2_ino_t dir,
+					int flags, ext2_dir_cursor *ret);
+extern errcode_t ext2fs_dir_cursor_next(ext2_dir_cursor cursor,
+					struct ext2_dir_entry **ret_dirent,
+					int *ret_entry);
+extern void ext2fs_dir_cursor_pos(ext2_dir_cursor cursor, blk64_t *pblk,
+				  e2_blkcnt_t *lblk, unsigned int *offset);
+extern void ext2fs_close_dir_cursor(ext2_dir_cursor cursor);
 
 /* dir_iterate.c */
 extern errcode_t ext2fs_get_rec_len(ext2_filsys fs,
@@ -1106,6 +1251,10 @@ extern errcode_t ext2fs_extent_goto(ext2_extent_handle_t handle,
 extern errcode_t ext2fs_extent_goto2(ext2_extent_handle_t handle,
 				     int leaf_level, blk64_t blk);
 extern errcode_t ext2fs_extent_fix_parents(ext2_extent_handle_t handle);
+extern errcode_t ext2fs_extent_build_from_list(ext2_filsys fs, ext2_ino_t ino,
+					       struct ext2_inode *inode,
+					       struct ext2fs_extent *list,
+					       unsigned int count);
 
 /* fileio.c */
 extern errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
@@ -1130,6 +1279,10 @@ errcode_t ext2fs_file_get_lsize(ext2_file_t file, __u64 *ret_size);
 extern ext2_off_t ext2fs_file_get_size(ext2_file_t file);
 extern errcode_t ext2fs_file_set_size(ext2_file_t file, ext2_off_t size);
 extern errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size);
+extern errcode_t ext2fs_file_set_readahead(ext2_file_t file,
+					   unsigned int blocks);
+extern errcode_t ext2fs_file_set_delalloc(ext2_file_t file,
+					  unsigned int blocks);
 
 /* finddev.c */
 extern char *ext2fs_find_block_device(dev_t device);
@@ -1143,6 +1296,33 @@ extern void ext2fs_free_dblist(ext2_dblist dblist);
 extern void ext2fs_badblocks_list_free(ext2_badblocks_list bb);
 extern void ext2fs_u32_list_free(ext2_u32_list bb);
 
+/* freespace.c */
+#define EXT2_NEWRANGE_FIXED_GOAL	0x0001	/* the run must start at goal */
+#define EXT2_NEWRANGE_MIN_LENGTH	0x0002	/* and be len blocks long */
+extern errcode_t ext2fs_create_space_cache(ext2_filsys fs);
+extern void ext2fs_free_space_cache(ext2_filsys fs);
+extern errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
+				  blk64_t len, ext2fs_block_bitmap map,
+				  blk64_t *pblk, blk64_t *plen);
+extern errcode_t ext2fs_alloc_range(ext2_filsys fs, int flags, blk64_t goal,
+				    blk_t len, blk64_t *ret);
+
+/* gdcache.c */
+extern errcode_t ext2fs_create_group_cache(ext2_filsys fs);
+extern void ext2fs_free_group_cache(ext2_filsys fs);
+extern __u64 ext2fs_sum_bg_free_blocks(ext2_filsys fs, dgrp_t first,
+				       dgrp_t num);
+extern __u64 ext2fs_sum_bg_free_inodes(ext2_filsys fs, dgrp_t first,
+				       dgrp_t num);
+extern __u64 ext2fs_sum_bg_itable_unused(ext2_filsys fs, dgrp_t first,
+					 dgrp_t num);
+extern errcode_t ext2fs_find_bg_free_blocks(ext2_filsys fs, dgrp_t start,
+					    __u32 min, dgrp_t *ret);
+extern errcode_t ext2fs_find_bg_free_inodes(ext2_filsys fs, dgrp_t start,
+					    __u32 min, dgrp_t *ret);
+extern errcode_t ext2fs_find_bg_flags(ext2_filsys fs, dgrp_t start,
+				      __u16 bg_flags, dgrp_t *ret);
+
 /* gen_bitmap.c */
 extern void ext2fs_free_generic_bitmap(ext2fs_inode_bitmap bitmap);
 extern errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
@@ -1182,12 +1362,41 @@ extern errcode_t ext2fs_set_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 extern errcode_t ext2fs_find_first_zero_generic_bitmap(ext2fs_generic_bitmap bitmap,
 						       __u32 start, __u32 end,
 						       __u32 *out);
+extern errcode_t ext2fs_find_first_set_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						      __u32 start, __u32 end,
+						      __u32 *out);
 
 /* gen_bitmap64.c */
 
 /* Generate and print bitmap usage statistics */
 #define BMAP_STATS
 
+/*
+ * Operation counts of a bitmap, see ext2fs_get_bmap_statistics()
+ */
+struct ext2fs_bmap_statistics {
+	const char	*description;	/* as long as the bitmap lives */
+	int		type;		/* EXT2FS_BMAP64_* backend now in use */
+	unsigned long	conversions;	/* of an adaptive bitmap's backend */
+	unsigned long	copy_count;
+	unsigned long	resize_count;
+	unsigned long	mark_count;
+	unsigned long	unmark_count;
+	unsigned long	test_count;
+	unsigned long	mark_ext_count;
+	unsigned long	unmark_ext_count;
+	unsigned long	test_ext_count;
+	unsigned long	set_range_count;
+	unsigned long	get_range_count;
+	unsigned long	clear_count;
+	unsigned long	mark_seq;	/* marks of the bit after the last one */
+	unsigned long	test_seq;	/* tests of the bit after the last one */
+	blk64_t		mark_back;	/* marks before the last one marked */
+	blk64_t		test_back;	/* tests before the last one tested */
+	double		seconds;	/* since the bitmap was allocated */
+	size_t		mem_usage;	/* bytes, if the backend can tell */
+};
+
 void ext2fs_free_generic_bmap(ext2fs_generic_bitmap bmap);
 errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 				    int type, __u64 start, __u64 end,
@@ -1213,8 +1422,16 @@ errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap bmap,
 errcode_t ext2fs_set_generic_bmap_range(ext2fs_generic_bitmap bmap,
 					__u64 start, unsigned int num,
 					void *in);
+errcode_t ext2fs_convert_generic_bmap(ext2fs_generic_bitmap bmap, int type);
+errcode_t ext2fs_get_bmap_statistics(ext2fs_generic_bitmap bitmap,
+				     struct ext2fs_bmap_statistics *stats);
+size_t ext2fs_get_bmap_mem_usage(ext2fs_generic_bitmap bitmap);
 errcode_t ext2fs_convert_subcluster_bitmap(ext2_filsys fs,
 					   ext2fs_block_bitmap *bitmap);
+errcode_t ext2fs_count_used_clusters(ext2_filsys fs, blk64_t start,
+				     blk64_t end, blk64_t *out);
+errcode_t ext2fs_count_used_inodes(ext2_filsys fs, ext2_ino_t start,
+				   ext2_ino_t end, ext2_ino_t *out);
 
 /* getsize.c */
 extern errcode_t ext2fs_get_device_size(const char *file, int blocksize,
@@ -1226,6 +1443,8 @@ extern errcode_t ext2fs_get_device_size2(const char *file, int blocksize,
 extern int ext2fs_get_dio_alignment(int fd);
 errcode_t ext2fs_get_device_sectsize(const char *file, int *sectsize);
 errcode_t ext2fs_get_device_phys_sectsize(const char *file, int *sectsize);
+errcode_t ext2fs_get_device_io_hints(const char *file, unsigned int *opt_io,
+				     unsigned int *max_io, int *rotational);
 
 /* i_block.c */
 errcode_t ext2fs_iblk_add_blocks(ext2_filsys fs, struct ext2_inode *inode,
@@ -1270,6 +1489,9 @@ extern errcode_t ext2fs_icount_decrement(ext2_icount_t icount, ext2_ino_t ino,
 extern errcode_t ext2fs_icount_store(ext2_icount_t icount, ext2_ino_t ino,
 				     __u16 count);
 extern ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount);
+extern size_t ext2fs_get_icount_mem_usage(ext2_icount_t icount);
+extern errcode_t ext2fs_icount_next_diff(ext2_icount_t a, ext2_icount_t b,
+					 ext2_ino_t *ino);
 errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *);
 
 /* inline.c */
@@ -1278,6 +1500,8 @@ extern errcode_t ext2fs_get_memalign(unsigned long size,
 				     unsigned long align, void *ptr);
 
 /* inode.c */
+extern errcode_t ext2fs_create_inode_cache(ext2_filsys fs,
+					   unsigned int cache_size);
 extern errcode_t ext2fs_flush_icache(ext2_filsys fs);
 extern errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan,
 					    ext2_ino_t *ino,
@@ -1290,6 +1514,9 @@ extern errcode_t ext2fs_get_next_inode(ext2_inode_scan scan, ext2_ino_t *ino,
 			       struct ext2_inode *inode);
 extern errcode_t ext2fs_inode_scan_goto_blockgroup(ext2_inode_scan scan,
 						   int	group);
+extern errcode_t ext2fs_inode_scan_set_groups(ext2_inode_scan scan,
+					      dgrp_t first_group,
+					      dgrp_t num_groups);
 extern void ext2fs_set_inode_callback
 	(ext2_inode_scan scan,
 	 errcode_t (*done_group)(ext2_filsys fs,
@@ -1340,6 +1567,8 @@ extern errcode_t ext2fs_punch(ext2_filsys fs, ext2_ino_t ino,
 /* namei.c */
 extern errcode_t ext2fs_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
 			 int namelen, char *buf, ext2_ino_t *inode);
+extern errcode_t ext2fs_create_dentry_cache(ext2_filsys fs, unsigned int size);
+extern void ext2fs_flush_dentry_cache(ext2_filsys fs);
 extern errcode_t ext2fs_namei(ext2_filsys fs, ext2_ino_t root, ext2_ino_t cwd,
 			const char *name, ext2_ino_t *inode);
 errcode_t ext2fs_namei_follow(ext2_filsys fs, ext2_ino_t root, ext2_ino_t cwd,
@@ -1380,6 +1609,7 @@ extern errcode_t ext2fs_open2(const char *name, const char *io_options,
 			      int flags, int superblock,
 			      unsigned int block_size, io_manager manager,
 			      ext2_filsys *ret_fs);
+extern errcode_t ext2fs_read_group_descs(ext2_filsys fs);
 extern blk64_t ext2fs_descriptor_block_loc2(ext2_filsys fs,
 					blk64_t group_block, dgrp_t i);
 extern blk_t ext2fs_descriptor_block_loc(ext2_filsys fs, blk_t group_block,
@@ -1388,6 +1618,21 @@ errcode_t ext2fs_get_data_io(ext2_filsys fs, io_channel *old_io);
 errcode_t ext2fs_set_data_io(ext2_filsys fs, io_channel new_io);
 errcode_t ext2fs_rewrite_to_io(ext2_filsys fs, io_channel new_io);
 
+/* parscan.c */
+typedef errcode_t (*ext2_parallel_scan_func)(ext2_filsys fs, ext2_ino_t ino,
+					     struct ext2_inode *inode,
+					     void *shard_data,
+					     void *priv_data);
+extern void ext2fs_inode_scan_shard(ext2_filsys fs, int shard,
+				    int num_shards, dgrp_t *first_group,
+				    dgrp_t *num_groups);
+extern errcode_t ext2fs_parallel_inode_scan(ext2_filsys fs, int num_workers,
+					    int scan_flags,
+					    ext2_parallel_scan_func func,
+					    void *shard_data,
+					    size_t shard_data_size,
+					    void *priv_data);
+
 /* get_pathname.c */
 extern errcode_t ext2fs_get_pathname(ext2_filsys fs, ext2_ino_t dir, ext2_ino_t ino,
 			       char **name);
@@ -1410,6 +1655,8 @@ errcode_t ext2fs_mmp_init(ext2_filsys fs);
 errcode_t ext2fs_mmp_start(ext2_filsys fs);
 errcode_t ext2fs_mmp_update(ext2_filsys fs);
 errcode_t ext2fs_mmp_stop(ext2_filsys fs);
+errcode_t ext2fs_mmp_start_heartbeat(ext2_filsys fs);
+errcode_t ext2fs_mmp_stop_heartbeat(ext2_filsys fs);
 unsigned ext2fs_mmp_new_seq(void);
 
 /* read_bb.c */
@@ -1447,6 +1694,8 @@ extern void ext2fs_swap_inode_full(ext2_filsys fs, struct ext2_inode_large *t,
 				   int bufsize);
 extern void ext2fs_swap_inode(ext2_filsys fs,struct ext2_inode *t,
 			      struct ext2_inode *f, int hostorder);
+extern void ext2fs_swap_inode_table(ext2_filsys fs, void *buf, int count,
+				    int hostorder);
 extern void ext2fs_swap_mmp(struct mmp_struct *mmp);
 
 /* unix_io.c */
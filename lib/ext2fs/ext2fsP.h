@@ -34,13 +34,26 @@ struct ext2_struct_u32_iterate {
 /*
  * Directory block iterator definition
  */
+struct dblist_chunk;
+
 struct ext2_struct_dblist {
 	int			magic;
 	ext2_filsys		fs;
-	unsigned long long	size;
 	unsigned long long	count;
 	int			sorted;
-	struct ext2_db_entry2 *	list;
+	/* Runs of entries, in chunks; see dblist.c */
+	struct dblist_chunk	**chunks;
+	unsigned long		num_chunks, max_chunks;
+	unsigned long		heap_chunks;	/* not in the spill file */
+	/* See ext2fs_dblist_set_spill() */
+	char			*spill_dir;
+	unsigned long long	spill_bytes;
+	int			spill_fd;
+	unsigned int		spill_slots;	/* chunks the file holds */
+	unsigned int		*free_slots;
+	unsigned int		num_free, max_free;
+	struct ext2_db_entry2	last2;	/* see ext2fs_dblist_get_last2() */
+	struct ext2_db_entry	last;	/* see ext2fs_dblist_get_last() */
 };
 
 /*
@@ -65,19 +78,120 @@ struct dir_context {
  * Inode cache structure
  */
 struct ext2_inode_cache {
-	void *				buffer;
-	blk64_t				buffer_blk;
-	int				cache_last;
 	int				cache_size;
 	int				refcount;
+	int				hash_mask;
+	int				*hash;		/* chain heads, or -1 */
+	int				lru_head;	/* most recently used */
+	int				lru_tail;	/* next to be reused */
 	struct ext2_inode_cache_ent	*cache;
+	/* Inode table blocks, direct-mapped by block number */
+	int				buffer_count;	/* a power of 2 */
+	blk64_t				*buffer_blk;	/* 0 if the slot is empty */
+	char				*buffer;
 };
 
 struct ext2_inode_cache_ent {
+	ext2_ino_t		ino;		/* 0 if the entry is empty */
+	int			hash_next;
+	int			lru_prev;
+	int			lru_next;
+	struct ext2_inode	inode;
+};
+
+/*
+ * Dentry cache structures
+ */
+struct ext2_dentry_cache {
+	unsigned int			cache_size;	/* a power of 2 */
+	unsigned int			cache_used;
+	struct ext2_dcache_ent		*cache;
+};
+
+struct ext2_dcache_ent {
+	ext2_ino_t		dir;		/* 0 if the slot is empty */
 	ext2_ino_t		ino;
+	unsigned int		hash;
+	int			len;
+	char			*name;
+};
+
+/*
+ * Block map cache: the extent tree of the inode looked up last, held
+ * open at the extent which was found
+ */
+struct ext2_bmap_cache {
+	ext2_ino_t		ino;		/* 0 if the cache is empty */
+	__u32			i_block[EXT2_N_BLOCKS];	/* root of the tree */
 	struct ext2_inode	inode;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	range;		/* last range; e_pblk 0 if a hole */
+	struct ext2fs_extent	cur;		/* where the handle points */
+	int			cur_valid;
+};
+
+/*
+ * Group descriptor cache, see gdcache.c
+ */
+struct ext2_group_cache {
+	dgrp_t			num_groups;
+	struct opaque_ext2_group_desc *group_desc;	/* what it was built from */
+	__u32			*free_blocks;
+	__u32			*free_inodes;
+	__u32			*itable_unused;
+	__u16			*flags;
 };
 
+/*
+ * Inode allocation cursor, see alloc.c: for each group, the lowest inode
+ * which may be free in fs->inode_map.  Inodes freed through
+ * ext2fs_inode_alloc_stats2() move it back; one cleared in the bitmap
+ * directly is missed until ext2fs_new_inode() finds nothing above the
+ * cursor and resets it.
+ */
+struct ext2_inode_cursor {
+	ext2fs_inode_bitmap	map;		/* what next[] describes */
+	dgrp_t			num_groups;
+	dgrp_t			dir_group;	/* last top-level directory */
+	ext2_ino_t		next[1];	/* num_groups of them */
+};
+
+/*
+ * Free space cache, see freespace.c: the free runs of each group, as
+ * offsets from its first block, sorted by where they start
+ */
+struct ext2_space_run {
+	__u32			start;
+	__u32			len;
+};
+
+struct ext2_space_group {
+	struct ext2_space_run	*runs;
+	__u32			count, size;
+	__u32			max_len;	/* the longest of the runs */
+	int			max_stale;	/* max_len may be too big */
+	int			loaded;		/* runs[] has been read */
+};
+
+struct ext2_space_cache {
+	ext2fs_block_bitmap	map;		/* what it describes */
+	dgrp_t			num_groups;
+	struct ext2_space_group	*groups;
+};
+
+extern void ext2fs_free_dentry_cache(ext2_filsys fs);
+extern void ext2fs_forget_dentry(ext2_filsys fs, ext2_ino_t dir,
+				 const char *name, int len);
+extern void ext2fs_free_inode_cache(struct ext2_inode_cache *icache);
+extern void ext2fs_forget_bmap_cache(ext2_filsys fs, ext2_ino_t ino);
+extern errcode_t ext2fs_read_desc_blocks(ext2_filsys fs, unsigned long first,
+					 unsigned long count);
+extern void ext2fs_free_bmap_cache(ext2_filsys fs);
+extern void ext2fs_update_group_cache(ext2_filsys fs, dgrp_t group);
+extern struct ext2_inode_cursor *ext2fs_inode_cursor(ext2_filsys fs);
+extern void ext2fs_update_space_cache(ext2_filsys fs, blk64_t blk,
+				      blk64_t num, int inuse);
+
 /* Function prototypes */
 
 extern int ext2fs_process_dir_block(ext2_filsys  	fs,
@@ -142,6 +256,17 @@ extern void ext2fs_warn_bitmap32(ext2fs_generic_bitmap bitmap,const char *func);
 
 extern int ext2fs_mem_is_zero(const char *mem, size_t len);
 
+/* alloc.c */
+extern int ext2fs_init_block_uninit_range(ext2_filsys fs,
+					  ext2fs_block_bitmap map,
+					  blk64_t blk, blk64_t num);
+
+/* dblist.c */
+extern void ext2fs_dblist_free_list(ext2_dblist dblist);
+
+/* fileio.c */
+extern errcode_t ext2fs_file_discard_cache(ext2_file_t file);
+
 extern int ext2fs_file_block_offset_too_big(ext2_filsys fs,
 					    struct ext2_inode *inode,
 					    blk64_t offset);
@@ -541,6 +541,7 @@ static errcode_t update_path(ext2_extent_handle_t handle)
 	errcode_t			retval;
 	struct ext3_extent_idx		*ix;
 
+	ext2fs_forget_bmap_cache(handle->fs, handle->ino);
 	if (handle->level == 0) {
 		retval = ext2fs_write_inode(handle->fs, handle->ino,
 					    handle->inode);
@@ -1562,6 +1563,193 @@ errcode_t ext2fs_extent_get_info(ext2_extent_handle_t handle,
 	return 0;
 }
 
+/*
+ * Write one node of a tree being built by ext2fs_extent_build_from_list():
+ * the entries of a leaf (depth 0) come straight from the extent list,
+ * those of an index node from the first extent and the block of each
+ * node one level down.
+ */
+static void build_node(char *buf, int max_entries, int depth,
+		       struct ext2fs_extent *list, int entries)
+{
+	struct ext3_extent_header	*eh;
+	struct ext3_extent_idx		*ix;
+	struct ext3_extent		*ex;
+	int				i;
+
+	eh = (struct ext3_extent_header *) buf;
+	eh->eh_magic = ext2fs_cpu_to_le16(EXT3_EXT_MAGIC);
+	eh->eh_entries = ext2fs_cpu_to_le16(entries);
+	eh->eh_max = ext2fs_cpu_to_le16(max_entries);
+	eh->eh_depth = ext2fs_cpu_to_le16(depth);
+	eh->eh_generation = 0;
+
+	for (i = 0; i < entries; i++, list++) {
+		if (depth) {
+			ix = EXT_FIRST_INDEX(eh) + i;
+			ix->ei_block = ext2fs_cpu_to_le32(list->e_lblk);
+			ix->ei_leaf = ext2fs_cpu_to_le32(list->e_pblk &
+							 0xFFFFFFFF);
+			ix->ei_leaf_hi = ext2fs_cpu_to_le16(list->e_pblk >> 32);
+			ix->ei_unused = 0;
+			continue;
+		}
+		ex = EXT_FIRST_EXTENT(eh) + i;
+		ex->ee_block = ext2fs_cpu_to_le32(list->e_lblk);
+		ex->ee_start = ext2fs_cpu_to_le32(list->e_pblk & 0xFFFFFFFF);
+		ex->ee_start_hi = ext2fs_cpu_to_le16(list->e_pblk >> 32);
+		if (list->e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+			ex->ee_len = ext2fs_cpu_to_le16(list->e_len +
+							EXT_INIT_MAX_LEN);
+		else
+			ex->ee_len = ext2fs_cpu_to_le16(list->e_len);
+	}
+}
+
+/*
+ * Give an inode the count extents in list, which must be sorted by
+ * logical block and must not overlap, as its block map.
+ *
+ * Rather than inserting the extents one at a time, which splits nodes
+ * and rewrites their parents over and over, the tree is built from the
+ * bottom up: the extents are spread as evenly as possible over the
+ * fewest leaves which hold them, those leaves over the fewest index
+ * nodes, and so on until what is left fits in the inode.  Each tree
+ * block is written exactly once.
+ *
+ * Whatever the inode mapped before is overwritten, not freed; the data
+ * blocks in the list are expected to be allocated, and counted in
+ * i_blocks, by the caller.  The tree blocks are allocated here and
+ * added to i_blocks, and the inode is written out.
+ */
+errcode_t ext2fs_extent_build_from_list(ext2_filsys fs, ext2_ino_t ino,
+					struct ext2_inode *inode,
+					struct ext2fs_extent *list,
+					unsigned int count)
+{
+	struct ext2_inode		inode_buf;
+	struct ext2fs_extent		*level = NULL, *next;
+	blk64_t				goal, blk, *blocks = NULL;
+	blk64_t				end = 0;
+	char				*block_buf = NULL;
+	unsigned int			i, n, nodes, num_blocks = 0, used = 0;
+	unsigned int			b = 0;
+	unsigned int			per_node, extra, entries;
+	int				depth = 0;
+	int				root_max, node_max;
+	dgrp_t				group;
+	__u8				log_flex;
+	errcode_t			retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (list[i].e_len == 0 ||
+		    list[i].e_len > ((list[i].e_flags &
+				      EXT2_EXTENT_FLAGS_UNINIT) ?
+				     EXT_UNINIT_MAX_LEN : EXT_INIT_MAX_LEN) ||
+		    list[i].e_lblk + list[i].e_len > ((__u64) 1 << 32))
+			return EXT2_ET_EXTENT_INVALID_LENGTH;
+		if (list[i].e_lblk < end)
+			return EINVAL;
+		end = list[i].e_lblk + list[i].e_len;
+	}
+
+	root_max = (sizeof(inode->i_block) -
+		    sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+	node_max = (fs->blocksize - sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+
+	/* Count the tree blocks the extents need */
+	for (n = count; n > (unsigned int) root_max; depth++) {
+		n = (n + node_max - 1) / node_max;
+		num_blocks += n;
+	}
+
+	if (num_blocks) {
+		retval = ext2fs_get_array(num_blocks, sizeof(blk64_t),
+					  &blocks);
+		if (retval)
+			goto errout;
+		retval = ext2fs_get_mem(fs->blocksize, &block_buf);
+		if (retval)
+			goto errout;
+
+		group = ext2fs_group_of_ino(fs, ino);
+		log_flex = fs->super->s_log_groups_per_flex;
+		if (log_flex)
+			group = group & ~((1 << (log_flex)) - 1);
+		goal = ext2fs_group_first_block2(fs, group);
+		for (i = 0; i < num_blocks; i++) {
+			retval = ext2fs_new_block2(fs, goal, 0, &blk);
+			if (retval)
+				goto errout;
+			ext2fs_block_alloc_stats2(fs, blk, +1);
+			blocks[used++] = goal = blk;
+		}
+	}
+
+	/*
+	 * Build each level from the one below it, keeping the first
+	 * logical block and the physical block of every node in an
+	 * array which stands in for the extent list one level up.
+	 */
+	n = count;
+	for (i = 0; i < (unsigned int) depth; i++) {
+		nodes = (n + node_max - 1) / node_max;
+		retval = ext2fs_get_array(nodes, sizeof(struct ext2fs_extent),
+					  &next);
+		if (retval)
+			goto errout;
+		per_node = n / nodes;
+		extra = n % nodes;
+		for (n = 0; n < nodes; n++) {
+			entries = per_node + (n < extra);
+			memset(block_buf, 0, fs->blocksize);
+			build_node(block_buf, node_max, i, list, entries);
+			blk = blocks[b++];
+			retval = io_channel_write_blk64(fs->io, blk, 1,
+							block_buf);
+			if (retval) {
+				ext2fs_free_mem(&next);
+				goto errout;
+			}
+			next[n].e_lblk = list->e_lblk;
+			next[n].e_pblk = blk;
+			list += entries;
+		}
+		ext2fs_free_mem(&level);
+		list = level = next;
+	}
+
+	memset(inode->i_block, 0, sizeof(inode->i_block));
+	build_node((char *) inode->i_block, root_max, depth, list, n);
+	inode->i_flags |= EXT4_EXTENTS_FL;
+	ext2fs_iblk_add_blocks(fs, inode, used);
+	used = 0;
+	retval = ext2fs_write_inode(fs, ino, inode);
+
+errout:
+	/* On failure, give back the tree blocks */
+	for (i = 0; i < used; i++)
+		ext2fs_block_alloc_stats2(fs, blocks[i], -1);
+	ext2fs_free_mem(&level);
+	ext2fs_free_mem(&blocks);
+	ext2fs_free_mem(&block_buf);
+	return retval;
+}
+
 #ifdef DEBUG
 /*
  * Override debugfs's prompt
@@ -18,6 +18,7 @@
 #include "ext2_fs.h"
 #include "ext2fs.h"
 #include "ext2fsP.h"
+#include "ext3_extents.h"
 
 struct ext2_file {
 	errcode_t		magic;
@@ -29,10 +30,29 @@ struct ext2_file {
 	blk64_t			blockno;
 	blk64_t			physblock;
 	char 			*buf;
+
+	/* Read-ahead window, used with EXT2_FILE_READAHEAD */
+	char			*ra_buf;
+	blk64_t			ra_lblk;	/* first logical block */
+	blk64_t			ra_pblk;	/* ...and where it is on disk */
+	unsigned int		ra_count;	/* valid blocks in ra_buf */
+	unsigned int		ra_max;		/* size of ra_buf in blocks */
+
+	/* Unallocated dirty blocks, used with EXT2_FILE_DELALLOC */
+	char			*da_buf;
+	blk64_t			da_lblk;	/* first logical block */
+	unsigned int		da_count;	/* blocks waiting in da_buf */
+	unsigned int		da_max;		/* size of da_buf in blocks */
 };
 
 #define BMAP_BUFFER (file->buf + fs->blocksize)
 
+/* Default size of the read-ahead window */
+#define READAHEAD_BYTES	(256 * 1024)
+
+/* Default amount of data which may wait for delayed allocation */
+#define DELALLOC_BYTES	(1024 * 1024)
+
 errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 			    struct ext2_inode *inode,
 			    int flags, ext2_file_t *ret)
@@ -70,6 +90,13 @@ errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 	if (retval)
 		goto fail;
 
+	file->ra_max = READAHEAD_BYTES / fs->blocksize;
+	if (file->ra_max == 0)
+		file->ra_max = 1;
+	file->da_max = DELALLOC_BYTES / fs->blocksize;
+	if (file->da_max == 0)
+		file->da_max = 1;
+
 	*ret = file;
 	return 0;
 
@@ -115,21 +142,227 @@ ext2_ino_t ext2fs_file_get_inode_num(ext2_file_t file)
 }
 
 /*
- * This function flushes the dirty block buffer out to disk if
- * necessary.
+ * Delayed allocation is only done for extent-mapped files, where a run
+ * of blocks can be mapped by a single extent.  Allocation through a
+ * caller's get_alloc_block hook, and bigalloc clusters, are left to
+ * the block at a time path.
  */
-errcode_t ext2fs_file_flush(ext2_file_t file)
+static int use_delalloc(ext2_file_t file)
+{
+	ext2_filsys fs = file->fs;
+
+	return ((file->flags & EXT2_FILE_DELALLOC) && file->ino &&
+		(file->inode.i_flags & EXT4_EXTENTS_FL) &&
+		!fs->get_alloc_block &&
+		!EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					    EXT4_FEATURE_RO_COMPAT_BIGALLOC));
+}
+
+/*
+ * Map logical blocks lblk .. lblk+count-1 to the physical blocks
+ * starting at pblk.  The logical blocks must all be unmapped.  The
+ * first block goes through ext2fs_extent_set_bmap(), which finds it a
+ * place in the tree, and the extent holding it is then stretched over
+ * the rest of the run.
+ */
+static errcode_t map_run(ext2_extent_handle_t handle, blk64_t lblk,
+			 blk64_t pblk, unsigned int count)
+{
+	struct ext2fs_extent	extent;
+	unsigned int		i;
+	errcode_t		retval;
+
+	retval = ext2fs_extent_set_bmap(handle, lblk, pblk, 0);
+	if (retval || count == 1)
+		return retval;
+
+	if (ext2fs_extent_goto(handle, lblk) == 0 &&
+	    ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent) == 0 &&
+	    !(extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) &&
+	    extent.e_lblk + extent.e_len == lblk + 1 &&
+	    extent.e_len + count - 1 <= EXT_INIT_MAX_LEN) {
+		extent.e_len += count - 1;
+		return ext2fs_extent_replace(handle, 0, &extent);
+	}
+
+	for (i = 1; i < count; i++) {
+		retval = ext2fs_extent_set_bmap(handle, lblk + i, pblk + i, 0);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * Find a free run of up to *n blocks near goal, and say how long it is.
+ * With the space cache, this is the shortest run near goal which is
+ * long enough, or failing that the longest there is.
+ */
+static errcode_t get_run(ext2_filsys fs, blk64_t goal, unsigned int *n,
+			 blk64_t *pblk)
 {
+	blk64_t		plen;
 	errcode_t	retval;
-	ext2_filsys fs;
 
-	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
-	fs = file->fs;
+	if (fs->space_cache) {
+		retval = ext2fs_new_range(fs, 0, goal, *n, 0, pblk, &plen);
+		if (retval == 0)
+			*n = plen;
+		return retval;
+	}
+	while (1) {
+		retval = ext2fs_get_free_blocks2(fs, goal, 0, *n,
+						 fs->block_map, pblk);
+		if (retval) {
+			if (*n == 1)
+				return retval;
+			*n = (*n + 1) / 2;
+			continue;
+		}
+		if (!ext2fs_init_block_uninit_range(fs, fs->block_map,
+						    *pblk, *n))
+			return 0;
+	}
+}
+
+/*
+ * Allocate and write out the blocks waiting in the delayed allocation
+ * buffer.  They are placed in as few contiguous runs as the free space
+ * allows, starting after the block which precedes them in the file.
+ */
+static errcode_t flush_delalloc(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	ext2_extent_handle_t handle;
+	blk64_t		goal = 0, pblk;
+	unsigned int	i, n;
+	errcode_t	retval;
+
+	if (!file->da_count)
+		return 0;
+
+	if (!fs->block_map) {
+		retval = ext2fs_read_block_bitmap(fs);
+		if (retval)
+			return retval;
+	}
+
+	if (file->da_lblk &&
+	    ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER, 0,
+			 file->da_lblk - 1, 0, &goal) == 0 && goal)
+		goal++;
+	if (!goal || goal >= ext2fs_blocks_count(fs->super))
+		goal = ext2fs_group_first_block2(fs,
+					ext2fs_group_of_ino(fs, file->ino));
+
+	retval = ext2fs_extent_open2(fs, file->ino, &file->inode, &handle);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < file->da_count; i += n) {
+		n = file->da_count - i;
+		retval = get_run(fs, goal, &n, &pblk);
+		if (retval)
+			goto out;
+
+		/* Claim the run first, so the extent tree can't use it */
+		ext2fs_block_alloc_stats_range(fs, pblk, n, +1);
+		retval = io_channel_write_blk64(fs->io, pblk, n,
+					file->da_buf + i * fs->blocksize);
+		if (retval == 0)
+			retval = map_run(handle, file->da_lblk + i, pblk, n);
+		if (retval) {
+			ext2fs_block_alloc_stats_range(fs, pblk, n, -1);
+			goto out;
+		}
+
+		/* The block buffer may hold one of these blocks */
+		if ((file->flags & EXT2_FILE_BUF_VALID) &&
+		    file->blockno >= file->da_lblk + i &&
+		    file->blockno < file->da_lblk + i + n)
+			file->physblock = pblk + file->blockno -
+				(file->da_lblk + i);
+		goal = pblk + n;
+	}
+
+out:
+	ext2fs_extent_free(handle);
+	/*
+	 * The extent code wrote the inode back; pick up its changes
+	 * and account for the data blocks which were mapped.
+	 */
+	if (ext2fs_read_inode(fs, file->ino, &file->inode) == 0 && i) {
+		ext2fs_iblk_add_blocks(fs, &file->inode, i);
+		if (!retval)
+			retval = ext2fs_write_inode(fs, file->ino,
+						    &file->inode);
+	}
+	if (retval) {
+		/* Keep the blocks which weren't written for a retry */
+		memmove(file->da_buf, file->da_buf + i * fs->blocksize,
+			(file->da_count - i) * fs->blocksize);
+		file->da_lblk += i;
+		file->da_count -= i;
+		return retval;
+	}
+	file->da_count = 0;
+	return 0;
+}
+
+/*
+ * Put a dirty block which has no physical block yet into the delayed
+ * allocation buffer, flushing the buffer first if the block does not
+ * extend the run already waiting there.
+ */
+static errcode_t delay_block(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	errcode_t	retval;
+
+	if (file->da_count &&
+	    (file->blockno < file->da_lblk ||
+	     file->blockno > file->da_lblk + file->da_count ||
+	     file->blockno == file->da_lblk + file->da_max)) {
+		retval = flush_delalloc(file);
+		if (retval)
+			return retval;
+	}
+	if (!file->da_buf) {
+		retval = io_channel_alloc_buf(fs->io, file->da_max,
+					      &file->da_buf);
+		if (retval)
+			return retval;
+	}
+	if (!file->da_count)
+		file->da_lblk = file->blockno;
+	memcpy(file->da_buf + (file->blockno - file->da_lblk) * fs->blocksize,
+	       file->buf, fs->blocksize);
+	if (file->blockno == file->da_lblk + file->da_count)
+		file->da_count++;
+	return 0;
+}
+
+/*
+ * This function writes the dirty block buffer out to disk if
+ * necessary, or hands it to delayed allocation.
+ */
+static errcode_t sync_block(ext2_file_t file)
+{
+	errcode_t	retval;
+	ext2_filsys fs = file->fs;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID) ||
 	    !(file->flags & EXT2_FILE_BUF_DIRTY))
 		return 0;
 
+	if (!file->physblock && use_delalloc(file)) {
+		retval = delay_block(file);
+		if (retval)
+			return retval;
+		file->flags &= ~EXT2_FILE_BUF_DIRTY;
+		return 0;
+	}
+
 	/*
 	 * OK, the physical block hasn't been allocated yet.
 	 * Allocate it.
@@ -146,11 +379,52 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	if (retval)
 		return retval;
 
+	/* Keep the read-ahead window's copy of the block up to date */
+	if (file->ra_count && file->physblock >= file->ra_pblk &&
+	    file->physblock < file->ra_pblk + file->ra_count)
+		memcpy(file->ra_buf + (file->physblock - file->ra_pblk) *
+		       fs->blocksize, file->buf, fs->blocksize);
+
 	file->flags &= ~EXT2_FILE_BUF_DIRTY;
 
 	return retval;
 }
 
+/*
+ * This function flushes the dirty block buffer, and any blocks
+ * waiting for delayed allocation, out to disk if necessary.
+ */
+errcode_t ext2fs_file_flush(ext2_file_t file)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	retval = sync_block(file);
+	if (retval)
+		return retval;
+	return flush_delalloc(file);
+}
+
+/*
+ * Write out whatever the file has buffered and forget the blocks it
+ * holds, because the caller is about to read or write them behind the
+ * file's back (see inode_io.c).
+ */
+errcode_t ext2fs_file_discard_cache(ext2_file_t file)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	retval = ext2fs_file_flush(file);
+	if (retval)
+		return retval;
+	file->flags &= ~EXT2_FILE_BUF_VALID;
+	file->ra_count = 0;
+	return 0;
+}
+
 /*
  * This function synchronizes the file's block buffer and the current
  * file position, possibly invalidating block buffer if necessary
@@ -162,7 +436,7 @@ static errcode_t sync_buffer_position(ext2_file_t file)
 
 	b = file->pos / file->fs->blocksize;
 	if (b != file->blockno) {
-		retval = ext2fs_file_flush(file);
+		retval = sync_block(file);
 		if (retval)
 			return retval;
 		file->flags &= ~EXT2_FILE_BUF_VALID;
@@ -171,6 +445,78 @@ static errcode_t sync_buffer_position(ext2_file_t file)
 	return 0;
 }
 
+/*
+ * Fill the read-ahead window with the run of blocks that starts at
+ * file->blockno, which load_buffer() has just mapped to
+ * file->physblock.  For an extent-mapped file the run is found by
+ * looking up the extent once; otherwise the following blocks are
+ * mapped one at a time for as long as they stay contiguous.  Either
+ * way the run is read with a single I/O.
+ */
+static errcode_t fill_readahead(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	ext2_extent_handle_t handle;
+	struct ext2fs_extent extent;
+	blk64_t		pblk, last;
+	unsigned int	count = 1;
+	errcode_t	retval;
+
+	file->ra_count = 0;
+	if (!file->ra_buf) {
+		retval = io_channel_alloc_buf(fs->io, file->ra_max,
+					      &file->ra_buf);
+		if (retval)
+			return retval;
+	}
+
+	if (file->inode.i_flags & EXT4_EXTENTS_FL) {
+		retval = ext2fs_extent_open2(fs, file->ino, &file->inode,
+					     &handle);
+		if (retval)
+			return retval;
+		retval = ext2fs_extent_goto(handle, file->blockno);
+		if (retval == 0)
+			retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+						   &extent);
+		ext2fs_extent_free(handle);
+		if (retval == 0 &&
+		    !(extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) &&
+		    file->blockno >= extent.e_lblk &&
+		    file->blockno < extent.e_lblk + extent.e_len &&
+		    file->physblock == extent.e_pblk +
+					(file->blockno - extent.e_lblk))
+			count = extent.e_lblk + extent.e_len - file->blockno;
+	} else {
+		while (count < file->ra_max) {
+			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+					      BMAP_BUFFER, 0,
+					      file->blockno + count, 0,
+					      &pblk);
+			if (retval || pblk != file->physblock + count)
+				break;
+			count++;
+		}
+	}
+
+	/* Don't read past the window, or the end of the file */
+	if (count > file->ra_max)
+		count = file->ra_max;
+	last = (EXT2_I_SIZE(&file->inode) + fs->blocksize - 1) /
+		fs->blocksize;
+	if (last > file->blockno && count > last - file->blockno)
+		count = last - file->blockno;
+
+	retval = io_channel_read_blk64(fs->io, file->physblock, count,
+				       file->ra_buf);
+	if (retval)
+		return retval;
+	file->ra_lblk = file->blockno;
+	file->ra_pblk = file->physblock;
+	file->ra_count = count;
+	return 0;
+}
+
 /*
  * This function loads the file's block buffer with valid data from
  * the disk as necessary.
@@ -184,15 +530,42 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 {
 	ext2_filsys	fs = file->fs;
 	errcode_t	retval;
+	blk64_t		i;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID)) {
+		if (file->da_count && file->blockno >= file->da_lblk &&
+		    file->blockno < file->da_lblk + file->da_count) {
+			i = file->blockno - file->da_lblk;
+			file->physblock = 0;
+			if (!dontfill)
+				memcpy(file->buf, file->da_buf +
+				       i * fs->blocksize, fs->blocksize);
+			file->flags |= EXT2_FILE_BUF_VALID;
+			return 0;
+		}
+		if (file->ra_count && file->blockno >= file->ra_lblk &&
+		    file->blockno < file->ra_lblk + file->ra_count) {
+			i = file->blockno - file->ra_lblk;
+			file->physblock = file->ra_pblk + i;
+			if (!dontfill)
+				memcpy(file->buf, file->ra_buf +
+				       i * fs->blocksize, fs->blocksize);
+			file->flags |= EXT2_FILE_BUF_VALID;
+			return 0;
+		}
 		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
 				     BMAP_BUFFER, 0, file->blockno, 0,
 				     &file->physblock);
 		if (retval)
 			return retval;
 		if (!dontfill) {
-			if (file->physblock) {
+			if (file->physblock &&
+			    (file->flags & EXT2_FILE_READAHEAD)) {
+				retval = fill_readahead(file);
+				if (retval)
+					return retval;
+				memcpy(file->buf, file->ra_buf, fs->blocksize);
+			} else if (file->physblock) {
 				retval = io_channel_read_blk64(fs->io,
 							       file->physblock,
 							       1, file->buf);
@@ -217,6 +590,10 @@ errcode_t ext2fs_file_close(ext2_file_t file)
 
 	if (file->buf)
 		ext2fs_free_mem(&file->buf);
+	if (file->ra_buf)
+		ext2fs_free_mem(&file->ra_buf);
+	if (file->da_buf)
+		ext2fs_free_mem(&file->da_buf);
 	ext2fs_free_mem(&file);
 
 	return retval;
@@ -299,9 +676,10 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 
 		/*
 		 * OK, the physical block hasn't been allocated yet.
-		 * Allocate it.
+		 * Allocate it, unless that is being put off until the
+		 * block is flushed.
 		 */
-		if (!file->physblock) {
+		if (!file->physblock && !use_delalloc(file)) {
 			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
 					      BMAP_BUFFER,
 					      file->ino ? BMAP_ALLOC : 0,
@@ -452,6 +830,9 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 
+	/* The blocks in the read-ahead window may be zeroed or freed */
+	file->ra_count = 0;
+
 	if (size && ext2fs_file_block_offset_too_big(file->fs, &file->inode,
 					(size - 1) / file->fs->blocksize))
 		return EXT2_ET_FILE_TOO_BIG;
@@ -461,6 +842,13 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 	old_truncate = ((old_size + file->fs->blocksize - 1) >>
 		      EXT2_BLOCK_SIZE_BITS(file->fs->super));
 
+	/* Blocks waiting for allocation must be mapped before a punch */
+	if (truncate_block < old_truncate) {
+		retval = flush_delalloc(file);
+		if (retval)
+			return retval;
+	}
+
 	/* If we're writing a large file, set the large_file flag */
 	if (LINUX_S_ISREG(file->inode.i_mode) &&
 	    ext2fs_needs_large_file_feature(EXT2_I_SIZE(&file->inode)) &&
@@ -496,3 +884,41 @@ errcode_t ext2fs_file_set_size(ext2_file_t file, ext2_off_t size)
 {
 	return ext2fs_file_set_size2(file, size);
 }
+
+/*
+ * Set how many blocks a file opened with EXT2_FILE_READAHEAD may read
+ * at a time.
+ */
+errcode_t ext2fs_file_set_readahead(ext2_file_t file, unsigned int blocks)
+{
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	if (blocks == 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (file->ra_buf)
+		ext2fs_free_mem(&file->ra_buf);
+	file->ra_count = 0;
+	file->ra_max = blocks;
+	return 0;
+}
+
+/*
+ * Set how many blocks a file opened with EXT2_FILE_DELALLOC may hold
+ * back before allocating them.
+ */
+errcode_t ext2fs_file_set_delalloc(ext2_file_t file, unsigned int blocks)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	if (blocks == 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = flush_delalloc(file);
+	if (retval)
+		return retval;
+	if (file->da_buf)
+		ext2fs_free_mem(&file->da_buf);
+	file->da_max = blocks;
+	return 0;
+}
@@ -17,7 +17,6 @@
 #include "ext2_fs.h"
 #include "ext2fsP.h"
 
-static void ext2fs_free_inode_cache(struct ext2_inode_cache *icache);
 
 void ext2fs_free(ext2_filsys fs)
 {
@@ -38,6 +37,8 @@ void ext2fs_free(ext2_filsys fs)
 		ext2fs_free_mem(&fs->orig_super);
 	if (fs->group_desc)
 		ext2fs_free_mem(&fs->group_desc);
+	if (fs->desc_unread)
+		ext2fs_free_mem(&fs->desc_unread);
 	if (fs->block_map)
 		ext2fs_free_block_bitmap(fs->block_map);
 	if (fs->inode_map)
@@ -54,7 +55,16 @@ void ext2fs_free(ext2_filsys fs)
 
 	if (fs->icache)
 		ext2fs_free_inode_cache(fs->icache);
-
+	ext2fs_free_dentry_cache(fs);
+	ext2fs_free_bmap_cache(fs);
+	ext2fs_free_group_cache(fs);
+	if (fs->inode_cursor)
+		ext2fs_free_mem(&fs->inode_cursor);
+	ext2fs_free_space_cache(fs);
+	if (fs->bitmap_spill_dir)
+		ext2fs_free_mem(&fs->bitmap_spill_dir);
+
+	ext2fs_mmp_stop_heartbeat(fs);
 	if (fs->mmp_buf)
 		ext2fs_free_mem(&fs->mmp_buf);
 	if (fs->mmp_cmp)
@@ -68,15 +78,18 @@ void ext2fs_free(ext2_filsys fs)
 /*
  * Free the inode cache structure
  */
-static void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
+void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
 {
 	if (--icache->refcount)
 		return;
 	if (icache->buffer)
 		ext2fs_free_mem(&icache->buffer);
+	if (icache->buffer_blk)
+		ext2fs_free_mem(&icache->buffer_blk);
+	if (icache->hash)
+		ext2fs_free_mem(&icache->hash);
 	if (icache->cache)
 		ext2fs_free_mem(&icache->cache);
-	icache->buffer_blk = 0;
 	ext2fs_free_mem(&icache);
 }
 
@@ -108,9 +121,7 @@ void ext2fs_free_dblist(ext2_dblist dblist)
 	if (!dblist || (dblist->magic != EXT2_ET_MAGIC_DBLIST))
 		return;
 
-	if (dblist->list)
-		ext2fs_free_mem(&dblist->list);
-	dblist->list = 0;
+	ext2fs_dblist_free_list(dblist);
 	if (dblist->fs && dblist->fs->dblist == dblist)
 		dblist->fs->dblist = 0;
 	dblist->magic = 0;
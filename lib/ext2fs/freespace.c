@@ -0,0 +1,537 @@
+/*
+ * freespace.c --- find free runs of blocks of a given length
+ *
+ * ext2fs_get_free_blocks2() and ext2fs_new_block2() know nothing about
+ * the free space but what the block bitmap tells them, so a writer
+ * which wants a long run of blocks searches the bitmap from its goal
+ * each time, and takes the first run which is long enough even when a
+ * better one is close by.  ext2fs_create_space_cache() keeps a sorted
+ * list of the free runs of each block group, built from the bitmap the
+ * first time the group is looked at, along with the length of its
+ * longest run; ext2fs_new_range() uses it to find the shortest run near
+ * the goal which is long enough, without going through the groups
+ * which have none.
+ *
+ * The block allocation statistics functions keep the cache up to date.
+ * Code which changes fs->block_map directly can leave it describing
+ * runs which aren't free any more, so every run the cache offers is
+ * checked against the bitmap before it is handed out, and the group is
+ * looked at again if it isn't.  The cache isn't used for bigalloc file
+ * systems.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+/* Is the cache there, and does it still describe fs->block_map? */
+static struct ext2_space_cache *space_cache(ext2_filsys fs)
+{
+	struct ext2_space_cache *cache = fs->space_cache;
+
+	if (!cache || cache->map != fs->block_map ||
+	    cache->num_groups != fs->group_desc_count)
+		return 0;
+	return cache;
+}
+
+void ext2fs_free_space_cache(ext2_filsys fs)
+{
+	struct ext2_space_cache *cache = fs->space_cache;
+	dgrp_t		g;
+
+	if (!cache)
+		return;
+	for (g = 0; g < cache->num_groups; g++)
+		if (cache->groups[g].runs)
+			ext2fs_free_mem(&cache->groups[g].runs);
+	ext2fs_free_mem(&cache->groups);
+	ext2fs_free_mem(&fs->space_cache);
+}
+
+/*
+ * Set up an empty cache, or empty the one there is; the groups are
+ * only looked at when an allocation comes to them.  The block bitmap
+ * is read if it hasn't been.
+ */
+errcode_t ext2fs_create_space_cache(ext2_filsys fs)
+{
+	struct ext2_space_cache *cache;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (EXT2FS_CLUSTER_RATIO(fs) > 1)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (!fs->block_map) {
+		retval = ext2fs_read_block_bitmap(fs);
+		if (retval)
+			return retval;
+	}
+	ext2fs_free_space_cache(fs);
+	retval = ext2fs_get_memzero(sizeof(struct ext2_space_cache), &cache);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_arrayzero(fs->group_desc_count,
+				      sizeof(struct ext2_space_group),
+				      &cache->groups);
+	if (retval) {
+		ext2fs_free_mem(&cache);
+		return retval;
+	}
+	cache->map = fs->block_map;
+	cache->num_groups = fs->group_desc_count;
+	fs->space_cache = cache;
+	return 0;
+}
+
+static void update_max(struct ext2_space_group *sg)
+{
+	__u32	i;
+
+	sg->max_len = 0;
+	for (i = 0; i < sg->count; i++)
+		if (sg->runs[i].len > sg->max_len)
+			sg->max_len = sg->runs[i].len;
+	sg->max_stale = 0;
+}
+
+/* Make room for one more run before runs[i] */
+static errcode_t insert_run(struct ext2_space_group *sg, __u32 i)
+{
+	errcode_t	retval;
+	__u32		size;
+
+	if (sg->count == sg->size) {
+		size = sg->size ? sg->size * 2 : 16;
+		retval = ext2fs_resize_mem(sg->size *
+					   sizeof(struct ext2_space_run),
+					   size * sizeof(struct ext2_space_run),
+					   &sg->runs);
+		if (retval)
+			return retval;
+		sg->size = size;
+	}
+	memmove(sg->runs + i + 1, sg->runs + i,
+		(sg->count - i) * sizeof(struct ext2_space_run));
+	sg->count++;
+	return 0;
+}
+
+/* Read the free runs of a group from the block bitmap */
+static errcode_t load_group(ext2_filsys fs, struct ext2_space_cache *cache,
+			    dgrp_t g)
+{
+	struct ext2_space_group *sg = &cache->groups[g];
+	blk64_t		first = ext2fs_group_first_block2(fs, g);
+	blk64_t		last = ext2fs_group_last_block2(fs, g);
+	blk64_t		blk, start, end;
+	errcode_t	retval;
+
+	ext2fs_init_block_uninit_range(fs, fs->block_map, first, 1);
+	sg->count = 0;
+	for (blk = first; blk <= last; blk = end + 1) {
+		if (ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk,
+							 last, &start))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map, start,
+							last, &end))
+			end = last + 1;
+		retval = insert_run(sg, sg->count);
+		if (retval) {
+			sg->count = 0;
+			return retval;
+		}
+		sg->runs[sg->count - 1].start = start - first;
+		sg->runs[sg->count - 1].len = end - start;
+	}
+	update_max(sg);
+	sg->loaded = 1;
+	return 0;
+}
+
+/* The first run which ends after off */
+static __u32 find_run(struct ext2_space_group *sg, __u32 off)
+{
+	__u32	lo = 0, hi = sg->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (sg->runs[mid].start + sg->runs[mid].len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Take off .. off + len - 1 out of the runs of a group */
+static errcode_t take_space(struct ext2_space_group *sg, __u32 off,
+			    __u32 len)
+{
+	struct ext2_space_run *r;
+	__u32		i = find_run(sg, off), end = off + len, r_end;
+	errcode_t	retval;
+
+	while (i < sg->count && sg->runs[i].start < end) {
+		r = &sg->runs[i];
+		r_end = r->start + r->len;
+		if (r->len == sg->max_len)
+			sg->max_stale = 1;
+		if (r->start < off && r_end > end) {
+			/* Split it in two */
+			retval = insert_run(sg, i + 1);
+			if (retval)
+				return retval;
+			r = &sg->runs[i];
+			r[1].start = end;
+			r[1].len = r_end - end;
+			r->len = off - r->start;
+			return 0;
+		}
+		if (r->start < off) {
+			r->len = off - r->start;
+			i++;
+		} else if (r_end > end) {
+			r->len = r_end - end;
+			r->start = end;
+			i++;
+		} else {
+			memmove(r, r + 1, (sg->count - i - 1) *
+				sizeof(struct ext2_space_run));
+			sg->count--;
+		}
+	}
+	return 0;
+}
+
+/* Put off .. off + len - 1 back, joining it to the runs next to it */
+static errcode_t give_space(struct ext2_space_group *sg, __u32 off,
+			    __u32 len)
+{
+	__u32		i, end = off + len, r_end;
+	errcode_t	retval;
+
+	/* The first run which touches the range, if any */
+	i = find_run(sg, off ? off - 1 : 0);
+	if (i < sg->count && sg->runs[i].start <= end &&
+	    sg->runs[i].start + sg->runs[i].len >= off) {
+		if (sg->runs[i].start < off)
+			off = sg->runs[i].start;
+	} else {
+		retval = insert_run(sg, i);
+		if (retval)
+			return retval;
+		sg->runs[i].start = off;
+		sg->runs[i].len = len;
+	}
+	/* Swallow every run the range now touches */
+	while (i + 1 < sg->count && sg->runs[i + 1].start <= end) {
+		r_end = sg->runs[i + 1].start + sg->runs[i + 1].len;
+		if (r_end > end)
+			end = r_end;
+		memmove(sg->runs + i + 1, sg->runs + i + 2,
+			(sg->count - i - 2) * sizeof(struct ext2_space_run));
+		sg->count--;
+	}
+	r_end = sg->runs[i].start + sg->runs[i].len;
+	if (r_end > end)
+		end = r_end;
+	sg->runs[i].start = off;
+	sg->runs[i].len = end - off;
+	if (sg->runs[i].len > sg->max_len)
+		sg->max_len = sg->runs[i].len;
+	return 0;
+}
+
+/*
+ * Called by the block allocation statistics functions once they have
+ * marked blk .. blk + num - 1 in use (inuse > 0) or free in the block
+ * bitmap.  A group which can't be updated is read again from the
+ * bitmap the next time it is needed.
+ */
+void ext2fs_update_space_cache(ext2_filsys fs, blk64_t blk, blk64_t num,
+			       int inuse)
+{
+	struct ext2_space_cache *cache = space_cache(fs);
+	struct ext2_space_group *sg;
+	blk64_t		end = blk + num, first, n;
+	dgrp_t		g;
+	errcode_t	retval;
+
+	if (!cache || !num)
+		return;
+	while (blk < end) {
+		g = ext2fs_group_of_blk2(fs, blk);
+		first = ext2fs_group_first_block2(fs, g);
+		n = ext2fs_group_last_block2(fs, g) + 1;
+		if (n > end)
+			n = end;
+		n -= blk;
+		sg = &cache->groups[g];
+		if (sg->loaded) {
+			if (inuse > 0)
+				retval = take_space(sg, blk - first, n);
+			else
+				retval = give_space(sg, blk - first, n);
+			if (retval)
+				sg->loaded = 0;
+		}
+		blk += n;
+	}
+}
+
+/*
+ * The shortest run of the group which has at least len blocks, or
+ * failing that the longest; the chosen run is checked against the
+ * bitmap, and the group read again if it is out of date.  Returns 0
+ * if the group has no free blocks.
+ */
+static __u32 pick_run(ext2_filsys fs, struct ext2_space_cache *cache,
+		      dgrp_t g, __u32 len, blk64_t *ret)
+{
+	struct ext2_space_group *sg = &cache->groups[g];
+	blk64_t		first = ext2fs_group_first_block2(fs, g);
+	__u32		i, best;
+	int		tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		if (!sg->loaded && load_group(fs, cache, g))
+			return 0;
+		if (sg->max_stale)
+			update_max(sg);
+		if (!sg->count)
+			return 0;
+		best = sg->count;
+		for (i = 0; i < sg->count; i++) {
+			if (best == sg->count) {
+				best = i;
+				continue;
+			}
+			if (sg->runs[best].len < len ?
+			    sg->runs[i].len > sg->runs[best].len :
+			    (sg->runs[i].len >= len &&
+			     sg->runs[i].len < sg->runs[best].len))
+				best = i;
+		}
+		*ret = first + sg->runs[best].start;
+		if (ext2fs_test_block_bitmap_range2(fs->block_map, *ret,
+						    sg->runs[best].len))
+			return sg->runs[best].len;
+		sg->loaded = 0;
+	}
+	return 0;
+}
+
+/*
+ * The number of free blocks from goal on, up to len, from the cache or
+ * from the bitmap
+ */
+static blk64_t run_at(ext2_filsys fs, struct ext2_space_cache *cache,
+		      ext2fs_block_bitmap map, blk64_t goal, blk64_t len)
+{
+	struct ext2_space_group *sg;
+	blk64_t		end, first, last;
+	dgrp_t		g = ext2fs_group_of_blk2(fs, goal);
+	__u32		i;
+
+	if (cache) {
+		sg = &cache->groups[g];
+		first = ext2fs_group_first_block2(fs, g);
+		last = ext2fs_group_last_block2(fs, g);
+		if (sg->loaded || !load_group(fs, cache, g)) {
+			i = find_run(sg, goal - first);
+			if (i >= sg->count || first + sg->runs[i].start > goal)
+				return 0;
+			end = first + sg->runs[i].start + sg->runs[i].len;
+			if (end - goal > len)
+				end = goal + len;
+			if (ext2fs_test_block_bitmap_range2(map, goal,
+							    end - goal)) {
+				/* It may go on in the next group */
+				if (end == last + 1 && end - goal < len &&
+				    end < ext2fs_blocks_count(fs->super))
+					end += run_at(fs, cache, map, end,
+						      len - (end - goal));
+				return end - goal;
+			}
+			sg->loaded = 0;
+		}
+	}
+	end = goal + len - 1;
+	if (end >= ext2fs_blocks_count(fs->super))
+		end = ext2fs_blocks_count(fs->super) - 1;
+	ext2fs_init_block_uninit_range(fs, map, goal, end - goal + 1);
+	if (ext2fs_test_block_bitmap2(map, goal))
+		return 0;
+	if (ext2fs_find_first_set_block_bitmap2(map, goal, end, &end) == 0)
+		return end - goal;
+	return end - goal + 1;
+}
+
+/*
+ * Without a cache: the first run from goal on which is long enough,
+ * or the longest one there is.
+ */
+static errcode_t scan_bitmap(ext2_filsys fs, int flags, blk64_t goal,
+			     blk64_t len, ext2fs_block_bitmap map,
+			     blk64_t *pblk, blk64_t *plen)
+{
+	blk64_t		first = fs->super->s_first_data_block;
+	blk64_t		last = ext2fs_blocks_count(fs->super) - 1;
+	blk64_t		blk = goal, start, end, limit;
+	blk64_t		best = 0, best_len = 0;
+	int		wrapped = 0;
+
+	while (1) {
+		limit = wrapped ? goal - 1 : last;
+		if (blk > limit ||
+		    ext2fs_find_first_zero_block_bitmap2(map, blk, limit,
+							 &start)) {
+			if (wrapped || goal == first)
+				break;
+			wrapped = 1;
+			blk = first;
+			continue;
+		}
+		end = start + len - 1;
+		if (end > limit)
+			end = limit;
+		if (ext2fs_init_block_uninit_range(fs, map, start,
+						   end - start + 1)) {
+			blk = start;
+			continue;
+		}
+		if (ext2fs_find_first_set_block_bitmap2(map, start, end,
+							&blk) == 0)
+			end = blk - 1;
+		if (end - start + 1 >= len) {
+			*pblk = start;
+			*plen = len;
+			return 0;
+		}
+		if (end - start + 1 > best_len) {
+			best = start;
+			best_len = end - start + 1;
+		}
+		blk = end + 1;
+	}
+	if (!best_len || (flags & EXT2_NEWRANGE_MIN_LENGTH))
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+	*pblk = best;
+	*plen = best_len;
+	return 0;
+}
+
+/*
+ * Find up to len free blocks in a row, which are not marked in use:
+ *
+ * - If the blocks from goal on are free, they are taken, so that a file
+ *   being written stays in one piece;
+ * - otherwise the shortest run which is long enough, in the first group
+ *   from goal's on which has one;
+ * - otherwise, unless EXT2_NEWRANGE_MIN_LENGTH is given, the longest
+ *   run there is, which will be shorter than len.
+ *
+ * With EXT2_NEWRANGE_FIXED_GOAL, only the run at goal will do.  The
+ * cache is used if there is one and map is fs->block_map (or NULL);
+ * otherwise the bitmap is searched from goal for the first run which
+ * is long enough.  The run found is returned in *pblk and *plen.
+ */
+errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
+			   blk64_t len, ext2fs_block_bitmap map,
+			   blk64_t *pblk, blk64_t *plen)
+{
+	struct ext2_space_cache *cache;
+	blk64_t		n, blk, best = 0, best_len = 0;
+	dgrp_t		g, start, i;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!map)
+		map = fs->block_map;
+	if (!map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (!len || (flags & ~(EXT2_NEWRANGE_FIXED_GOAL |
+			       EXT2_NEWRANGE_MIN_LENGTH)))
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (goal < fs->super->s_first_data_block ||
+	    goal >= ext2fs_blocks_count(fs->super)) {
+		if (flags & EXT2_NEWRANGE_FIXED_GOAL)
+			return EXT2_ET_INVALID_ARGUMENT;
+		goal = fs->super->s_first_data_block;
+	}
+	cache = (map == fs->block_map) ? space_cache(fs) : 0;
+
+	n = run_at(fs, cache, map, goal, len);
+	if (n == len || (n && (flags & EXT2_NEWRANGE_FIXED_GOAL) &&
+			 !(flags & EXT2_NEWRANGE_MIN_LENGTH))) {
+		*pblk = goal;
+		*plen = n;
+		return 0;
+	}
+	if (flags & EXT2_NEWRANGE_FIXED_GOAL)
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+	if (!cache)
+		return scan_bitmap(fs, flags, goal, len, map, pblk, plen);
+
+	start = ext2fs_group_of_blk2(fs, goal);
+	for (i = 0; i < cache->num_groups; i++) {
+		g = (start + i) % cache->num_groups;
+		if (cache->groups[g].loaded && !cache->groups[g].max_stale &&
+		    cache->groups[g].max_len <= best_len &&
+		    cache->groups[g].max_len < len)
+			continue;
+		n = pick_run(fs, cache, g, len < ~0U ? len : ~0U, &blk);
+		if (n >= len) {
+			*pblk = blk;
+			*plen = len;
+			return 0;
+		}
+		if (n > best_len) {
+			best = blk;
+			best_len = n;
+		}
+	}
+	if (!best_len || (flags & EXT2_NEWRANGE_MIN_LENGTH))
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+	*pblk = best;
+	*plen = best_len;
+	return 0;
+}
+
+/*
+ * Find len free blocks in a row as ext2fs_new_range() does, and mark
+ * them in use.
+ */
+errcode_t ext2fs_alloc_range(ext2_filsys fs, int flags, blk64_t goal,
+			     blk_t len, blk64_t *ret)
+{
+	blk64_t		plen;
+	errcode_t	retval;
+
+	if (!fs->block_map) {
+		retval = ext2fs_read_block_bitmap(fs);
+		if (retval)
+			return retval;
+	}
+	retval = ext2fs_new_range(fs, flags | EXT2_NEWRANGE_MIN_LENGTH, goal,
+				  len, 0, ret, &plen);
+	if (retval)
+		return retval;
+	ext2fs_block_alloc_stats_range(fs, *ret, len, +1);
+	return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * gdcache.c --- a columnar copy of the group descriptor counts
+ *
+ * The block group descriptors are packed one after another, 32 or 64
+ * bytes apiece, so a loop which wants one count from every group reads
+ * the whole table to get at it.  ext2fs_create_group_cache() keeps the
+ * free blocks, free inodes, unused inodes and flags of every group in
+ * arrays of their own, which the group accessors update as they change
+ * the descriptors; the sums and searches below run over those arrays
+ * when the cache is there, and over the descriptors when it isn't.
+ *
+ * Code which writes a descriptor other than through ext2fs_bg_*_set()
+ * and friends must call ext2fs_create_group_cache() again afterwards,
+ * or free the cache.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+/* Is the cache there, and does it still describe fs->group_desc? */
+static struct ext2_group_cache *group_cache(ext2_filsys fs)
+{
+	struct ext2_group_cache *cache = fs->group_cache;
+
+	if (!cache || cache->num_groups != fs->group_desc_count ||
+	    cache->group_desc != fs->group_desc)
+		return 0;
+	return cache;
+}
+
+void ext2fs_free_group_cache(ext2_filsys fs)
+{
+	struct ext2_group_cache *cache = fs->group_cache;
+
+	if (!cache)
+		return;
+	ext2fs_free_mem(&cache->free_blocks);
+	ext2fs_free_mem(&cache->free_inodes);
+	ext2fs_free_mem(&cache->itable_unused);
+	ext2fs_free_mem(&cache->flags);
+	ext2fs_free_mem(&fs->group_cache);
+}
+
+/* Copy the counts of a group from its descriptor into the cache */
+void ext2fs_update_group_cache(ext2_filsys fs, dgrp_t group)
+{
+	struct ext2_group_cache *cache = group_cache(fs);
+
+	if (!cache || group >= cache->num_groups)
+		return;
+	cache->free_blocks[group] = ext2fs_bg_free_blocks_count(fs, group);
+	cache->free_inodes[group] = ext2fs_bg_free_inodes_count(fs, group);
+	cache->itable_unused[group] = ext2fs_bg_itable_unused(fs, group);
+	cache->flags[group] = ext2fs_bg_flags(fs, group);
+}
+
+/*
+ * Build the cache from the group descriptors, or build it again if
+ * there is one already.  This reads any descriptor blocks which
+ * EXT2_FLAG_LAZY_DESC has left unread.
+ */
+errcode_t ext2fs_create_group_cache(ext2_filsys fs)
+{
+	struct ext2_group_cache *cache;
+	dgrp_t		n = fs->group_desc_count, g;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	ext2fs_free_group_cache(fs);
+	retval = ext2fs_get_memzero(sizeof(struct ext2_group_cache), &cache);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(n, sizeof(__u32), &cache->free_blocks);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(n, sizeof(__u32), &cache->free_inodes);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(n, sizeof(__u32), &cache->itable_unused);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(n, sizeof(__u16), &cache->flags);
+	if (retval)
+		goto errout;
+	cache->num_groups = n;
+	cache->group_desc = fs->group_desc;
+
+	fs->group_cache = cache;
+	for (g = 0; g < n; g++)
+		ext2fs_update_group_cache(fs, g);
+	return 0;
+
+errout:
+	fs->group_cache = cache;
+	ext2fs_free_group_cache(fs);
+	return retval;
+}
+
+/* Clip the groups [first, first + num) to the file system */
+static dgrp_t clip_groups(ext2_filsys fs, dgrp_t first, dgrp_t num)
+{
+	if (first >= fs->group_desc_count)
+		return 0;
+	if (num > fs->group_desc_count - first)
+		num = fs->group_desc_count - first;
+	return num;
+}
+
+static __u64 sum_counts(const __u32 *counts, dgrp_t num)
+{
+	__u64	sum = 0;
+	dgrp_t	g;
+
+	for (g = 0; g < num; g++)
+		sum += counts[g];
+	return sum;
+}
+
+/*
+ * The sums of the free blocks (clusters, with bigalloc), free inodes
+ * and unused inodes counts of the groups [first, first + num)
+ */
+__u64 ext2fs_sum_bg_free_blocks(ext2_filsys fs, dgrp_t first, dgrp_t num)
+{
+	struct ext2_group_cache *cache = group_cache(fs);
+	__u64	sum = 0;
+	dgrp_t	g;
+
+	num = clip_groups(fs, first, num);
+	if (cache)
+		return sum_counts(cache->free_blocks + first, num);
+	for (g = first; g < first + num; g++)
+		sum += ext2fs_bg_free_blocks_count(fs, g);
+	return sum;
+}
+
+__u64 ext2fs_sum_bg_free_inodes(ext2_filsys fs, dgrp_t first, dgrp_t num)
+{
+	struct ext2_group_cache *cache = group_cache(fs);
+	__u64	sum = 0;
+	dgrp_t	g;
+
+	num = clip_groups(fs, first, num);
+	if (cache)
+		return sum_counts(cache->free_inodes + first, num);
+	for (g = first; g < first + num; g++)
+		sum += ext2fs_bg_free_inodes_count(fs, g);
+	return sum;
+}
+
+__u64 ext2fs_sum_bg_itable_unused(ext2_filsys fs, dgrp_t first, dgrp_t num)
+{
+	struct ext2_group_cache *cache = group_cache(fs);
+	__u64	sum = 0;
+	dgrp_t	g;
+
+	num = clip_groups(fs, first, num);
+	if (cache)
+		return sum_counts(cache->itable_unused + first, num);
+	for (g = first; g < first + num; g++)
+		sum += ext2fs_bg_itable_unused(fs, g);
+	return sum;
+}
+
+/*
+ * Find the first group from start on with at least min free blocks
+ * (clusters, with bigalloc), or with at least min free inodes.
+ * Returns ENOENT if there is none.
+ */
+errcode_t ext2fs_find_bg_free_blocks(ext2_filsys fs, dgrp_t start,
+				     __u32 min, dgrp_t *ret)
+{
+	struct ext2_group_cache *cache = group_cache(fs);
+	dgrp_t	g;
+
+	for (g = start; g < fs->group_desc_count; g++) {
+		if ((cache ? cache->free_blocks[g] :
+		     ext2fs_bg_free_blocks_count(fs, g)) >= min) {
+			*ret = g;
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+errcode_t ext2fs_find_bg_free_inodes(ext2_filsys fs, dgrp_t start,
+				     __u32 min, dgrp_t *ret)
+{
+	struct ext2_group_cache *cache = group_cache(fs);
+	dgrp_t	g;
+
+	for (g = start; g < fs->group_desc_count; g++) {
+		if ((cache ? cache->free_inodes[g] :
+		     ext2fs_bg_free_inodes_count(fs, g)) >= min) {
+			*ret = g;
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Find the first group from start on which has any of bg_flags set.
+ * Returns ENOENT if there is none.
+ */
+errcode_t ext2fs_find_bg_flags(ext2_filsys fs, dgrp_t start, __u16 bg_flags,
+			       dgrp_t *ret)
+{
+	struct ext2_group_cache *cache = group_cache(fs);
+	dgrp_t	g;
+
+	for (g = start; g < fs->group_desc_count; g++) {
+		if ((cache ? cache->flags[g] :
+		     ext2fs_bg_flags(fs, g)) & bg_flags) {
+			*ret = g;
+			return 0;
+		}
+	}
+	return ENOENT;
+}
@@ -11,6 +11,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -65,8 +66,19 @@
  * its own uses.  For example, when doing parent directory pointer
  * loop detections in pass 3, the bitmap will *always* be sparse, so
  * e2fsck can request an encoding which is optimized for that.
+ *
+ * When the application can't know in advance, it can ask for an
+ * adaptive bitmap.  This starts out as an rbtree, which is compact as
+ * long as the bits come in long runs.  After every ADAPT_INTERVAL
+ * changes, we compare what the tree costs with what a bitarray
+ * would, and convert the bitmap in place once the tree has grown
+ * bigger.  A bitarray whose bits have come back together goes back to
+ * being a tree.  Counting the runs in a bitarray means scanning it, so
+ * that check is made less often the bigger the bitmap is.
  */
 
+#define ADAPT_INTERVAL	4096
+
 static void warn_bitmap(ext2fs_generic_bitmap bitmap,
 			int code, __u64 arg)
 {
@@ -79,12 +91,129 @@ static void warn_bitmap(ext2fs_generic_bitmap bitmap,
 #endif
 }
 
-#ifdef BMAP_STATS_OPS
-#define INC_STAT(map, name) map->stats.name
+#ifdef BMAP_STATS
+#define INC_STAT(map, name) \
+	do { \
+		if ((map)->flags & EXT2_BMFLAG_STATS) \
+			(map)->stats.name++; \
+	} while (0)
 #else
 #define INC_STAT(map, name) ;;
 #endif
 
+static void adapt_bmap(ext2fs_generic_bitmap bmap);
+
+#define ADAPT_CHECK(bmap) \
+	do { \
+		if (((bmap)->flags & EXT2_BMFLAG_ADAPTIVE) && \
+		    !--(bmap)->adapt_countdown) \
+			adapt_bmap(bmap); \
+	} while (0)
+
+static struct ext2_bitmap_ops *bmap_type_ops(ext2_filsys fs, int type)
+{
+	ext2_ino_t num_dirs;
+	errcode_t retval;
+
+	switch (type) {
+	case EXT2FS_BMAP64_BITARRAY:
+		return &ext2fs_blkmap64_bitarray;
+	case EXT2FS_BMAP64_RBTREE:
+	case EXT2FS_BMAP64_ADAPTIVE:
+		return &ext2fs_blkmap64_rbtree;
+	case EXT2FS_BMAP64_RADIXTREE:
+		return &ext2fs_blkmap64_radixtree;
+	case EXT2FS_BMAP64_AUTODIR:
+		retval = ext2fs_get_num_dirs(fs, &num_dirs);
+		if (retval || num_dirs > (fs->super->s_inodes_count / 320))
+			return &ext2fs_blkmap64_bitarray;
+		return &ext2fs_blkmap64_rbtree;
+	}
+	return NULL;
+}
+
+/*
+ * Find the first set (or clear) bit between start and end, which are
+ * bitmap units already checked against the bounds
+ */
+static errcode_t backend_find(ext2fs_generic_bitmap bmap, __u64 start,
+			      __u64 end, __u64 *out, int want_set)
+{
+	struct ext2_bitmap_ops *ops = bmap->bitmap_ops;
+
+	if (want_set && ops->find_first_set)
+		return ops->find_first_set(bmap, start, end, out);
+	if (!want_set && ops->find_first_zero)
+		return ops->find_first_zero(bmap, start, end, out);
+	for (; start <= end; start++) {
+		if (!ops->test_bmap(bmap, start) == !want_set) {
+			*out = start;
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+#ifdef BMAP_STATS_OPS
+/*
+ * With E2FSPROGS_BITMAP_TRACE set to a file name prefix, every bitmap
+ * logs its operations to a file of its own, in bitmap units, to be
+ * replayed by tst_bitmaps' bench_trace command.
+ */
+static void trace_op(ext2fs_generic_bitmap bmap, int op, int nargs,
+		     __u64 a, __u64 b)
+{
+	FILE *f = bmap->stats.trace;
+
+	if (!f)
+		return;
+	if (nargs == 0)
+		fprintf(f, "%c\n", op);
+	else if (nargs == 1)
+		fprintf(f, "%c %llu\n", op, (unsigned long long) a);
+	else
+		fprintf(f, "%c %llu %llu\n", op, (unsigned long long) a,
+			(unsigned long long) b);
+}
+
+/* Log the runs of set bits, so that a replay starts from them */
+static void trace_runs(ext2fs_generic_bitmap bmap)
+{
+	__u64 pos, next;
+
+	for (pos = bmap->start; pos <= bmap->real_end; pos = next) {
+		if (backend_find(bmap, pos, bmap->real_end, &pos, 1))
+			break;
+		if (backend_find(bmap, pos, bmap->real_end, &next, 0))
+			next = bmap->real_end + 1;
+		trace_op(bmap, 'M', 2, pos, next - pos);
+	}
+}
+
+static void trace_open(ext2fs_generic_bitmap bmap)
+{
+	static int	seq;
+	const char	*prefix = getenv("E2FSPROGS_BITMAP_TRACE");
+	char		*fn;
+
+	if (!prefix || ext2fs_get_mem(strlen(prefix) + 32, &fn))
+		return;
+	sprintf(fn, "%s.%d.%d", prefix, (int) getpid(), seq++);
+	bmap->stats.trace = fopen(fn, "w");
+	ext2fs_free_mem(&fn);
+	if (!bmap->stats.trace)
+		return;
+	fprintf(bmap->stats.trace, "# %s\nb %llu %llu %llu\n",
+		bmap->description ? bmap->description : "",
+		(unsigned long long) bmap->start,
+		(unsigned long long) bmap->end,
+		(unsigned long long) bmap->real_end);
+}
+#define TRACE(map, op, n, a, b)	trace_op(map, op, n, a, b)
+#else
+#define TRACE(map, op, n, a, b)	;;
+#endif
+
 
 errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 				    int type, __u64 start, __u64 end,
@@ -94,29 +223,14 @@ errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 {
 	ext2fs_generic_bitmap	bitmap;
 	struct ext2_bitmap_ops	*ops;
-	ext2_ino_t num_dirs;
 	errcode_t retval;
 
 	if (!type)
 		type = EXT2FS_BMAP64_BITARRAY;
 
-	switch (type) {
-	case EXT2FS_BMAP64_BITARRAY:
-		ops = &ext2fs_blkmap64_bitarray;
-		break;
-	case EXT2FS_BMAP64_RBTREE:
-		ops = &ext2fs_blkmap64_rbtree;
-		break;
-	case EXT2FS_BMAP64_AUTODIR:
-		retval = ext2fs_get_num_dirs(fs, &num_dirs);
-		if (retval || num_dirs > (fs->super->s_inodes_count / 320))
-			ops = &ext2fs_blkmap64_bitarray;
-		else
-			ops = &ext2fs_blkmap64_rbtree;
-		break;
-	default:
+	ops = bmap_type_ops(fs, type);
+	if (!ops)
 		return EINVAL;
-	}
 
 	retval = ext2fs_get_memzero(sizeof(struct ext2fs_struct_generic_bitmap),
 				    &bitmap);
@@ -141,6 +255,15 @@ errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 	bitmap->real_end = real_end;
 	bitmap->bitmap_ops = ops;
 	bitmap->cluster_bits = 0;
+	if (type == EXT2FS_BMAP64_ADAPTIVE) {
+		bitmap->flags |= EXT2_BMFLAG_ADAPTIVE;
+		bitmap->adapt_countdown = ADAPT_INTERVAL;
+	}
+#ifdef BMAP_STATS
+	if ((fs && (fs->flags & EXT2_FLAG_BMAP_STATS)) ||
+	    getenv("E2FSPROGS_BITMAP_STATS"))
+		bitmap->flags |= EXT2_BMFLAG_STATS;
+#endif
 	switch (magic) {
 	case EXT2_ET_MAGIC_INODE_BITMAP64:
 		bitmap->base_error_code = EXT2_ET_BAD_INODE_MARK;
@@ -168,23 +291,118 @@ errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 		ext2fs_free_mem(&bitmap);
 		return retval;
 	}
+#ifdef BMAP_STATS_OPS
+	trace_open(bitmap);
+#endif
 
 	*ret = bitmap;
 	return 0;
 }
 
+/*
+ * Move bmap over to the backend for type, keeping its contents; on
+ * failure it is left as it was.  Converting to EXT2FS_BMAP64_ADAPTIVE
+ * keeps the current backend and lets the library pick from then on.
+ */
+errcode_t ext2fs_convert_generic_bmap(ext2fs_generic_bitmap bmap, int type)
+{
+	struct ext2fs_struct_generic_bitmap new_bmap;
+	struct ext2_bitmap_ops	*ops;
+	__u64			pos, next, n;
+	errcode_t		retval;
+
+	if (!bmap || !EXT2FS_IS_64_BITMAP(bmap))
+		return EINVAL;
+
+	if (type == EXT2FS_BMAP64_ADAPTIVE) {
+		bmap->flags |= EXT2_BMFLAG_ADAPTIVE;
+		bmap->adapt_countdown = ADAPT_INTERVAL;
+		return 0;
+	}
+	ops = bmap_type_ops(bmap->fs, type);
+	if (!ops)
+		return EINVAL;
+	if (ops == bmap->bitmap_ops)
+		return 0;
+
+	new_bmap = *bmap;
+	new_bmap.bitmap_ops = ops;
+	new_bmap.private = 0;
+	retval = ops->new_bmap(bmap->fs, &new_bmap);
+	if (retval)
+		return retval;
+
+	/* Copy the runs of set bits, including the padding */
+	for (pos = bmap->start; pos <= bmap->real_end; pos = next) {
+		if (backend_find(bmap, pos, bmap->real_end, &pos, 1))
+			break;
+		if (backend_find(bmap, pos, bmap->real_end, &next, 0))
+			next = bmap->real_end + 1;
+		for (; pos < next; pos += n) {
+			n = next - pos;
+			if (n > (1U << 30))
+				n = 1U << 30;
+			ops->mark_bmap_extent(&new_bmap, pos, n);
+		}
+	}
+
+	bmap->bitmap_ops->free_bmap(bmap);
+	bmap->bitmap_ops = ops;
+	bmap->private = new_bmap.private;
+#ifdef BMAP_STATS
+	bmap->stats.conversions++;
+#endif
+	return 0;
+}
+
+static void adapt_bmap(ext2fs_generic_bitmap bmap)
+{
+	struct ext2_bitmap_ops	*ops = bmap->bitmap_ops;
+	size_t			array_size, limit;
+	__u64			pos, end = bmap->real_end, runs = 0;
+
+	array_size = ((bmap->real_end - bmap->start) >> 3) + 1;
+	bmap->adapt_countdown = ADAPT_INTERVAL;
+
+	if (ops->type == EXT2FS_BMAP64_RBTREE) {
+		if (ops->mem_usage && ops->mem_usage(bmap) > array_size)
+			ext2fs_convert_generic_bmap(bmap,
+						    EXT2FS_BMAP64_BITARRAY);
+	} else if (ops->type == EXT2FS_BMAP64_BITARRAY) {
+		/*
+		 * Only go back when the tree would take less than a
+		 * quarter of the array, so that a bitmap near the
+		 * break-even point doesn't keep flipping.
+		 */
+		limit = array_size / (4 * ext2fs_rb_mem_estimate(1));
+		pos = bmap->start;
+		while (runs <= limit) {
+			if (backend_find(bmap, pos, end, &pos, 1))
+				break;
+			runs++;
+			if (backend_find(bmap, pos, end, &pos, 0))
+				break;
+		}
+		if (runs <= limit)
+			ext2fs_convert_generic_bmap(bmap,
+						    EXT2FS_BMAP64_RBTREE);
+	}
+
+	/* Keep the scans of a bitarray to a few bytes per change */
+	if (bmap->bitmap_ops->type == EXT2FS_BMAP64_BITARRAY &&
+	    (array_size >> 3) > ADAPT_INTERVAL)
+		bmap->adapt_countdown = array_size >> 3;
+}
+
 #ifdef BMAP_STATS
 static void ext2fs_print_bmap_statistics(ext2fs_generic_bitmap bitmap)
 {
 	struct ext2_bmap_statistics *stats = &bitmap->stats;
-#ifdef BMAP_STATS_OPS
 	float mark_seq_perc = 0.0, test_seq_perc = 0.0;
 	float mark_back_perc = 0.0, test_back_perc = 0.0;
-#endif
 	double inuse;
 	struct timeval now;
 
-#ifdef BMAP_STATS_OPS
 	if (stats->test_count) {
 		test_seq_perc = ((float)stats->test_seq /
 				 stats->test_count) * 100;
@@ -198,7 +416,6 @@ static void ext2fs_print_bmap_statistics(ext2fs_generic_bitmap bitmap)
 		mark_back_perc = ((float)stats->mark_back /
 				  stats->mark_count) * 100;
 	}
-#endif
 
 	if (gettimeofday(&now, (struct timezone *) NULL) == -1) {
 		perror("gettimeofday");
@@ -213,7 +430,9 @@ static void ext2fs_print_bmap_statistics(ext2fs_generic_bitmap bitmap)
 	fprintf(stderr, "\n[+] %s bitmap (type %d)\n", bitmap->description,
 		stats->type);
 	fprintf(stderr, "=================================================\n");
-#ifdef BMAP_STATS_OPS
+	if (bitmap->flags & EXT2_BMFLAG_ADAPTIVE)
+		fprintf(stderr, "%16lu backend conversions (now type %d)\n",
+			stats->conversions, bitmap->bitmap_ops->type);
 	fprintf(stderr, "%16llu bits long\n",
 		bitmap->real_end - bitmap->start);
 	fprintf(stderr, "%16lu copy_bmap\n%16lu resize_bmap\n",
@@ -225,7 +444,7 @@ static void ext2fs_print_bmap_statistics(ext2fs_generic_bitmap bitmap)
 	fprintf(stderr, "%16lu unmark_bmap_extent\n"
 		"%16lu test_clear_bmap_extent\n",
 		stats->unmark_ext_count, stats->test_ext_count);
-	fprintf(stderr, "%16lu set_bmap_range\n%16lu set_bmap_range\n",
+	fprintf(stderr, "%16lu set_bmap_range\n%16lu get_bmap_range\n",
 		stats->set_range_count, stats->get_range_count);
 	fprintf(stderr, "%16lu clear_bmap\n%16lu contiguous bit test (%.2f%%)\n",
 		stats->clear_count, stats->test_seq, test_seq_perc);
@@ -236,10 +455,76 @@ static void ext2fs_print_bmap_statistics(ext2fs_generic_bitmap bitmap)
 	fprintf(stderr, "%16llu bits marked backwards (%.2f%%)\n"
 		"%16.2f seconds in use\n",
 		stats->mark_back, mark_back_perc, inuse);
-#endif /* BMAP_STATS_OPS */
 }
 #endif
 
+/*
+ * Return the operation counts of a bitmap.  They are only kept for
+ * bitmaps allocated with EXT2_FLAG_BMAP_STATS set on the file system,
+ * or with E2FSPROGS_BITMAP_STATS in the environment; for any other
+ * bitmap EXT2_ET_OP_NOT_SUPPORTED is returned.
+ */
+errcode_t ext2fs_get_bmap_statistics(ext2fs_generic_bitmap bitmap,
+				     struct ext2fs_bmap_statistics *stats)
+{
+#ifdef BMAP_STATS
+	struct ext2_bmap_statistics *s;
+	struct timeval now;
+
+	if (!bitmap || !EXT2FS_IS_64_BITMAP(bitmap))
+		return EINVAL;
+	if (!(bitmap->flags & EXT2_BMFLAG_STATS))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+
+	s = &bitmap->stats;
+
+	memset(stats, 0, sizeof(struct ext2fs_bmap_statistics));
+	stats->description = bitmap->description;
+	stats->type = bitmap->bitmap_ops->type;
+	stats->conversions = s->conversions;
+	stats->copy_count = s->copy_count;
+	stats->resize_count = s->resize_count;
+	stats->mark_count = s->mark_count;
+	stats->unmark_count = s->unmark_count;
+	stats->test_count = s->test_count;
+	stats->mark_ext_count = s->mark_ext_count;
+	stats->unmark_ext_count = s->unmark_ext_count;
+	stats->test_ext_count = s->test_ext_count;
+	stats->set_range_count = s->set_range_count;
+	stats->get_range_count = s->get_range_count;
+	stats->clear_count = s->clear_count;
+	stats->mark_seq = s->mark_seq;
+	stats->test_seq = s->test_seq;
+	stats->mark_back = s->mark_back;
+	stats->test_back = s->test_back;
+	if (gettimeofday(&now, (struct timezone *) NULL) == 0)
+		stats->seconds = (now.tv_sec - s->created.tv_sec) +
+			((double) (now.tv_usec - s->created.tv_usec)) /
+			1000000;
+	if (bitmap->bitmap_ops->mem_usage)
+		stats->mem_usage = bitmap->bitmap_ops->mem_usage(bitmap);
+	return 0;
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * Return the number of bytes a bitmap takes, as far as its backend can
+ * tell; unlike the statistics above, this works for any bitmap.
+ */
+size_t ext2fs_get_bmap_mem_usage(ext2fs_generic_bitmap bitmap)
+{
+	if (!bitmap)
+		return 0;
+	if (EXT2FS_IS_32_BITMAP(bitmap))
+		return (ext2fs_get_generic_bitmap_end(bitmap) -
+			ext2fs_get_generic_bitmap_start(bitmap)) / 8 + 1;
+	if (!EXT2FS_IS_64_BITMAP(bitmap) || !bitmap->bitmap_ops->mem_usage)
+		return 0;
+	return bitmap->bitmap_ops->mem_usage(bitmap);
+}
+
 void ext2fs_free_generic_bmap(ext2fs_generic_bitmap bmap)
 {
 	if (!bmap)
@@ -260,6 +545,11 @@ void ext2fs_free_generic_bmap(ext2fs_generic_bitmap bmap)
 	}
 #endif
 
+#ifdef BMAP_STATS_OPS
+	if (bmap->stats.trace)
+		fclose(bmap->stats.trace);
+#endif
+
 	bmap->bitmap_ops->free_bmap(bmap);
 
 	if (bmap->description) {
@@ -293,9 +583,7 @@ errcode_t ext2fs_copy_generic_bmap(ext2fs_generic_bitmap src,
 		return retval;
 
 
-#ifdef BMAP_STATS_OPS
-	src->stats.copy_count++;
-#endif
+	INC_STAT(src, copy_count);
 #ifdef BMAP_STATS
 	if (gettimeofday(&new_bmap->stats.created,
 			 (struct timezone *) NULL) == -1) {
@@ -315,6 +603,8 @@ errcode_t ext2fs_copy_generic_bmap(ext2fs_generic_bitmap src,
 	new_bmap->bitmap_ops = src->bitmap_ops;
 	new_bmap->base_error_code = src->base_error_code;
 	new_bmap->cluster_bits = src->cluster_bits;
+	new_bmap->flags = src->flags;
+	new_bmap->adapt_countdown = src->adapt_countdown;
 
 	descr = src->description;
 	if (descr) {
@@ -333,6 +623,10 @@ errcode_t ext2fs_copy_generic_bmap(ext2fs_generic_bitmap src,
 		ext2fs_free_mem(&new_bmap);
 		return retval;
 	}
+#ifdef BMAP_STATS_OPS
+	trace_open(new_bmap);
+	trace_runs(new_bmap);
+#endif
 
 	*dest = new_bmap;
 
@@ -354,6 +648,7 @@ errcode_t ext2fs_resize_generic_bmap(ext2fs_generic_bitmap bmap,
 		return EINVAL;
 
 	INC_STAT(bmap, resize_count);
+	TRACE(bmap, 'r', 2, new_end, new_real_end);
 
 	return bmap->bitmap_ops->resize_bmap(bmap, new_end, new_real_end);
 }
@@ -384,6 +679,7 @@ errcode_t ext2fs_fudge_generic_bmap_end(ext2fs_generic_bitmap bitmap,
 	if (oend)
 		*oend = bitmap->end;
 	bitmap->end = end;
+	TRACE(bitmap, 'e', 1, end, 0);
 	return 0;
 }
 
@@ -417,15 +713,25 @@ __u64 ext2fs_get_generic_bmap_end(ext2fs_generic_bitmap bitmap)
 
 void ext2fs_clear_generic_bmap(ext2fs_generic_bitmap bitmap)
 {
-	if (EXT2FS_IS_32_BITMAP(bitmap))
+	if (EXT2FS_IS_32_BITMAP(bitmap)) {
 		ext2fs_clear_generic_bitmap(bitmap);
-	else
-		bitmap->bitmap_ops->clear_bmap (bitmap);
+		return;
+	}
+
+	INC_STAT(bitmap, clear_count);
+	TRACE(bitmap, 'c', 0, 0, 0);
+	bitmap->bitmap_ops->clear_bmap (bitmap);
+	/* An empty bitmap is best kept as a tree */
+	if ((bitmap->flags & EXT2_BMFLAG_ADAPTIVE) &&
+	    bitmap->bitmap_ops->type != EXT2FS_BMAP64_RBTREE)
+		ext2fs_convert_generic_bmap(bitmap, EXT2FS_BMAP64_RBTREE);
 }
 
 int ext2fs_mark_generic_bmap(ext2fs_generic_bitmap bitmap,
 			     __u64 arg)
 {
+	int ret;
+
 	if (!bitmap)
 		return 0;
 
@@ -443,13 +749,15 @@ int ext2fs_mark_generic_bmap(ext2fs_generic_bitmap bitmap,
 
 	arg >>= bitmap->cluster_bits;
 
-#ifdef BMAP_STATS_OPS
-	if (arg == bitmap->stats.last_marked + 1)
-		bitmap->stats.mark_seq++;
-	if (arg < bitmap->stats.last_marked)
-		bitmap->stats.mark_back++;
-	bitmap->stats.last_marked = arg;
-	bitmap->stats.mark_count++;
+#ifdef BMAP_STATS
+	if (bitmap->flags & EXT2_BMFLAG_STATS) {
+		if (arg == bitmap->stats.last_marked + 1)
+			bitmap->stats.mark_seq++;
+		if (arg < bitmap->stats.last_marked)
+			bitmap->stats.mark_back++;
+		bitmap->stats.last_marked = arg;
+		bitmap->stats.mark_count++;
+	}
 #endif
 
 	if ((arg < bitmap->start) || (arg > bitmap->end)) {
@@ -457,12 +765,17 @@ int ext2fs_mark_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return 0;
 	}
 
-	return bitmap->bitmap_ops->mark_bmap(bitmap, arg);
+	TRACE(bitmap, 'm', 1, arg, 0);
+	ret = bitmap->bitmap_ops->mark_bmap(bitmap, arg);
+	ADAPT_CHECK(bitmap);
+	return ret;
 }
 
 int ext2fs_unmark_generic_bmap(ext2fs_generic_bitmap bitmap,
 			       __u64 arg)
 {
+	int ret;
+
 	if (!bitmap)
 		return 0;
 
@@ -487,7 +800,10 @@ int ext2fs_unmark_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return 0;
 	}
 
-	return bitmap->bitmap_ops->unmark_bmap(bitmap, arg);
+	TRACE(bitmap, 'u', 1, arg, 0);
+	ret = bitmap->bitmap_ops->unmark_bmap(bitmap, arg);
+	ADAPT_CHECK(bitmap);
+	return ret;
 }
 
 int ext2fs_test_generic_bmap(ext2fs_generic_bitmap bitmap,
@@ -510,13 +826,15 @@ int ext2fs_test_generic_bmap(ext2fs_generic_bitmap bitmap,
 
 	arg >>= bitmap->cluster_bits;
 
-#ifdef BMAP_STATS_OPS
-	bitmap->stats.test_count++;
-	if (arg == bitmap->stats.last_tested + 1)
-		bitmap->stats.test_seq++;
-	if (arg < bitmap->stats.last_tested)
-		bitmap->stats.test_back++;
-	bitmap->stats.last_tested = arg;
+#ifdef BMAP_STATS
+	if (bitmap->flags & EXT2_BMFLAG_STATS) {
+		bitmap->stats.test_count++;
+		if (arg == bitmap->stats.last_tested + 1)
+			bitmap->stats.test_seq++;
+		if (arg < bitmap->stats.last_tested)
+			bitmap->stats.test_back++;
+		bitmap->stats.last_tested = arg;
+	}
 #endif
 
 	if ((arg < bitmap->start) || (arg > bitmap->end)) {
@@ -524,6 +842,7 @@ int ext2fs_test_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return 0;
 	}
 
+	TRACE(bitmap, 't', 1, arg, 0);
 	return bitmap->bitmap_ops->test_bmap(bitmap, arg);
 }
 
@@ -531,6 +850,8 @@ errcode_t ext2fs_set_generic_bmap_range(ext2fs_generic_bitmap bmap,
 					__u64 start, unsigned int num,
 					void *in)
 {
+	errcode_t retval;
+
 	if (!bmap)
 		return EINVAL;
 
@@ -549,7 +870,25 @@ errcode_t ext2fs_set_generic_bmap_range(ext2fs_generic_bitmap bmap,
 
 	INC_STAT(bmap, set_range_count);
 
-	return bmap->bitmap_ops->set_bmap_range(bmap, start, num, in);
+	retval = bmap->bitmap_ops->set_bmap_range(bmap, start, num, in);
+#ifdef BMAP_STATS_OPS
+	if (bmap->stats.trace) {
+		unsigned int i, run = 0;
+
+		trace_op(bmap, 'U', 2, start, num);
+		for (i = 0; i <= num; i++) {
+			if (i < num && ext2fs_test_bit(i, in)) {
+				run++;
+				continue;
+			}
+			if (run)
+				trace_op(bmap, 'M', 2, start + i - run, run);
+			run = 0;
+		}
+	}
+#endif
+	ADAPT_CHECK(bmap);
+	return retval;
 }
 
 errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap bmap,
@@ -661,6 +1000,7 @@ int ext2fs_test_block_bitmap_range2(ext2fs_block_bitmap bmap,
 		return EINVAL;
 	}
 
+	TRACE(bmap, 'T', 2, block, num);
 	return bmap->bitmap_ops->test_clear_bmap_extent(bmap, block, num);
 }
 
@@ -699,7 +1039,52 @@ void ext2fs_mark_block_bitmap_range2(ext2fs_block_bitmap bmap,
 		return;
 	}
 
+	TRACE(bmap, 'M', 2, block, num);
 	bmap->bitmap_ops->mark_bmap_extent(bmap, block, num);
+	ADAPT_CHECK(bmap);
+}
+
+/*
+ * Mark num blocks starting at block, after calling func for each run
+ * of blocks in the range which were already marked.  The runs are
+ * found with the backend's find_first_set and find_first_zero, so a
+ * range which is clear costs a single search.  func must not modify
+ * the bitmap; if it returns non-zero, the bitmap is left unchanged
+ * and that value is returned.
+ */
+errcode_t ext2fs_mark_block_bitmap_range_test2(ext2fs_block_bitmap bmap,
+		blk64_t block, unsigned int num,
+		errcode_t (*func)(ext2fs_block_bitmap bitmap, blk64_t block,
+				  blk64_t num, void *priv_data),
+		void *priv_data)
+{
+	blk64_t		end = block + num - 1, set, clear;
+	errcode_t	retval;
+
+	if (!bmap)
+		return EINVAL;
+	if (!num)
+		return 0;
+
+	for (set = block; func && set <= end; set = clear) {
+		retval = ext2fs_find_first_set_block_bitmap2(bmap, set, end,
+							     &set);
+		if (retval == ENOENT)
+			break;
+		if (retval)
+			return retval;
+		retval = ext2fs_find_first_zero_block_bitmap2(bmap, set, end,
+							      &clear);
+		if (retval == ENOENT)
+			clear = end + 1;
+		else if (retval)
+			return retval;
+		retval = (func)(bmap, set, clear - set, priv_data);
+		if (retval)
+			return retval;
+	}
+	ext2fs_mark_block_bitmap_range2(bmap, block, num);
+	return 0;
 }
 
 void ext2fs_unmark_block_bitmap_range2(ext2fs_block_bitmap bmap,
@@ -737,7 +1122,9 @@ void ext2fs_unmark_block_bitmap_range2(ext2fs_block_bitmap bmap,
 		return;
 	}
 
+	TRACE(bmap, 'U', 2, block, num);
 	bmap->bitmap_ops->unmark_bmap_extent(bmap, block, num);
+	ADAPT_CHECK(bmap);
 }
 
 void ext2fs_warn_bitmap32(ext2fs_generic_bitmap bitmap, const char *func)
@@ -753,13 +1140,18 @@ void ext2fs_warn_bitmap32(ext2fs_generic_bitmap bitmap, const char *func)
 #endif
 }
 
+/*
+ * Turn a per-block bitmap into a cluster bitmap.  Rather than testing
+ * every block, find each run of set blocks with the backend's
+ * find_first_set and find_first_zero, which skip a word (or an
+ * extent) at a time, and mark the clusters it touches as one extent.
+ */
 errcode_t ext2fs_convert_subcluster_bitmap(ext2_filsys fs,
 					   ext2fs_block_bitmap *bitmap)
 {
 	ext2fs_block_bitmap	cmap, bmap;
 	errcode_t		retval;
-	blk64_t			i, b_end, c_end;
-	int			n, ratio;
+	blk64_t			i, b_end, c_end, first, next;
 
 	bmap = *bitmap;
 
@@ -776,41 +1168,142 @@ errcode_t ext2fs_convert_subcluster_bitmap(ext2_filsys fs,
 	bmap->end = bmap->real_end;
 	c_end = cmap->end;
 	cmap->end = cmap->real_end;
-	n = 0;
-	ratio = 1 << fs->cluster_ratio_bits;
-	while (i < bmap->real_end) {
-		if (ext2fs_test_block_bitmap2(bmap, i)) {
-			ext2fs_mark_block_bitmap2(cmap, i);
-			i += ratio - n;
-			n = 0;
-			continue;
-		}
-		i++; n++;
-		if (n >= ratio)
-			n = 0;
+	while (i <= bmap->real_end) {
+		retval = ext2fs_find_first_set_block_bitmap2(bmap, i,
+						bmap->real_end, &first);
+		if (retval)
+			break;
+		retval = ext2fs_find_first_zero_block_bitmap2(bmap, first,
+						bmap->real_end, &next);
+		if (retval)
+			next = bmap->real_end + 1;
+		ext2fs_mark_block_bitmap_range2(cmap, first, next - first);
+		/* The rest of the last cluster is marked already */
+		i = EXT2FS_C2B(fs, EXT2FS_B2C(fs, next - 1) + 1);
 	}
 	bmap->end = b_end;
 	cmap->end = c_end;
+	if (retval && retval != ENOENT) {
+		ext2fs_free_block_bitmap(cmap);
+		return retval;
+	}
 	ext2fs_free_block_bitmap(bmap);
 	*bitmap = cmap;
 	return 0;
 }
 
-errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
-					      __u64 start, __u64 end, __u64 *out)
+/*
+ * Count the bits set in bmap between start and end, inclusive, in the
+ * bitmap's own units.  The bits are fetched a chunk at a time with
+ * get_bmap_range and counted a word at a time, instead of being
+ * tested one by one.
+ */
+#define COUNT_CHUNK_BYTES	4096
+
+static errcode_t count_set_bits(ext2fs_generic_bitmap bmap, __u64 start,
+				__u64 end, __u64 *out)
+{
+	unsigned char	buf[COUNT_CHUNK_BYTES];
+	unsigned int	num;
+	__u64		count = 0, first;
+	errcode_t	retval;
+
+	if (!bmap)
+		return EINVAL;
+	first = ext2fs_get_generic_bmap_start(bmap);
+	if (start < first || end > ext2fs_get_generic_bmap_end(bmap) ||
+	    start > end)
+		return EINVAL;
+
+	/* get_bmap_range wants a byte-aligned start */
+	while (start <= end && ((start - first) & 7)) {
+		if (ext2fs_test_generic_bmap(bmap, start))
+			count++;
+		start++;
+	}
+	while (start <= end) {
+		if (end - start + 1 > COUNT_CHUNK_BYTES * 8)
+			num = COUNT_CHUNK_BYTES * 8;
+		else
+			num = end - start + 1;
+		/* Not every backend clears the buffer when it's all zeroes */
+		memset(buf, 0, (num + 7) >> 3);
+		retval = ext2fs_get_generic_bmap_range(bmap, start, num, buf);
+		if (retval)
+			return retval;
+		count += ext2fs_bitcount(buf, num >> 3);
+		if (num & 7) {
+			buf[num >> 3] &= (1 << (num & 7)) - 1;
+			count += ext2fs_bitcount(buf + (num >> 3), 1);
+		}
+		start += num;
+	}
+	*out = count;
+	return 0;
+}
+
+/*
+ * Count the clusters in use in fs->block_map between the blocks
+ * start and end, inclusive.
+ */
+errcode_t ext2fs_count_used_clusters(ext2_filsys fs, blk64_t start,
+				     blk64_t end, blk64_t *out)
 {
+	__u64		count;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!fs->block_map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (EXT2FS_IS_64_BITMAP(fs->block_map)) {
+		start >>= fs->block_map->cluster_bits;
+		end >>= fs->block_map->cluster_bits;
+	}
+	retval = count_set_bits(fs->block_map, start, end, &count);
+	if (retval)
+		return retval;
+	*out = count;
+	return 0;
+}
+
+/*
+ * Count the inodes in use in fs->inode_map between start and end,
+ * inclusive.
+ */
+errcode_t ext2fs_count_used_inodes(ext2_filsys fs, ext2_ino_t start,
+				   ext2_ino_t end, ext2_ino_t *out)
+{
+	__u64		count;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!fs->inode_map)
+		return EXT2_ET_NO_INODE_BITMAP;
+	retval = count_set_bits(fs->inode_map, start, end, &count);
+	if (retval)
+		return retval;
+	*out = count;
+	return 0;
+}
+
+/*
+ * Find the first bit between start and end, inclusive, which is set
+ * (if want_set is non-zero) or clear.
+ */
+static errcode_t find_first_bit(ext2fs_generic_bitmap bitmap, __u64 start,
+				__u64 end, __u64 *out, int want_set)
+{
+	__u64 cstart, cend, cout;
+	errcode_t retval;
 	int b;
 
 	if (!bitmap)
 		return EINVAL;
 
-	if (EXT2FS_IS_64_BITMAP(bitmap) && bitmap->bitmap_ops->find_first_zero)
-		return bitmap->bitmap_ops->find_first_zero(bitmap, start,
-							   end, out);
-
 	if (EXT2FS_IS_32_BITMAP(bitmap)) {
 		blk_t blk = 0;
-		errcode_t retval;
 
 		if (((start) & ~0xffffffffULL) ||
 		    ((end) & ~0xffffffffULL)) {
@@ -818,8 +1311,12 @@ errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
 			return EINVAL;
 		}
 
-		retval = ext2fs_find_first_zero_generic_bitmap(bitmap, start,
-							       end, &blk);
+		if (want_set)
+			retval = ext2fs_find_first_set_generic_bitmap(bitmap,
+							start, end, &blk);
+		else
+			retval = ext2fs_find_first_zero_generic_bitmap(bitmap,
+							start, end, &blk);
 		if (retval == 0)
 			*out = blk;
 		return retval;
@@ -828,22 +1325,52 @@ errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
 	if (!EXT2FS_IS_64_BITMAP(bitmap))
 		return EINVAL;
 
-	start >>= bitmap->cluster_bits;
-	end >>= bitmap->cluster_bits;
+	cstart = start >> bitmap->cluster_bits;
+	cend = end >> bitmap->cluster_bits;
 
-	if (start < bitmap->start || end > bitmap->end || start > end) {
+	if (cstart < bitmap->start || cend > bitmap->end || start > end) {
 		warn_bitmap(bitmap, EXT2FS_TEST_ERROR, start);
 		return EINVAL;
 	}
+	TRACE(bitmap, want_set ? 'f' : 'z', 2, cstart, cend);
 
-	while (start <= end) {
-		b = bitmap->bitmap_ops->test_bmap(bitmap, start);
-		if (!b) {
-			*out = start << bitmap->cluster_bits;
-			return 0;
-		}
-		start++;
+	if (want_set && bitmap->bitmap_ops->find_first_set) {
+		retval = bitmap->bitmap_ops->find_first_set(bitmap, cstart,
+							    cend, &cout);
+		if (retval)
+			return retval;
+		goto found;
+	}
+	if (!want_set && bitmap->bitmap_ops->find_first_zero) {
+		retval = bitmap->bitmap_ops->find_first_zero(bitmap, cstart,
+							     cend, &cout);
+		if (retval)
+			return retval;
+		goto found;
 	}
 
+	for (cout = cstart; cout <= cend; cout++) {
+		b = bitmap->bitmap_ops->test_bmap(bitmap, cout);
+		if (!b == !want_set)
+			goto found;
+	}
 	return ENOENT;
+
+found:
+	/* The first cluster may start before the requested block */
+	cout <<= bitmap->cluster_bits;
+	*out = (cout >= start) ? cout : start;
+	return 0;
+}
+
+errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
+					      __u64 start, __u64 end, __u64 *out)
+{
+	return find_first_bit(bitmap, start, end, out, 0);
+}
+
+errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
+					     __u64 start, __u64 end, __u64 *out)
+{
+	return find_first_bit(bitmap, start, end, out, 1);
 }
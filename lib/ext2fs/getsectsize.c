@@ -21,6 +21,11 @@
 #include <errno.h>
 #endif
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
 #ifdef HAVE_LINUX_FD_H
 #include <sys/ioctl.h>
 #include <linux/fd.h>
@@ -107,3 +112,63 @@ errcode_t ext2fs_get_device_phys_sectsize(const char *file, int *sectsize)
 	close(fd);
 	return 0;
 }
+
+#if defined(__linux__) && defined(major)
+/*
+ * Read a number from a block device's queue directory in sysfs; a
+ * partition has none of its own, so look in its disk's.
+ */
+static int read_queue_num(dev_t dev, const char *file,
+			  unsigned long long *ret)
+{
+	char	path[80];
+	FILE	*f;
+	int	i, n;
+
+	for (i = 0; i < 2; i++) {
+		sprintf(path, "/sys/dev/block/%u:%u/%squeue/%s",
+			(unsigned) major(dev), (unsigned) minor(dev),
+			i ? "../" : "", file);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		n = fscanf(f, "%llu", ret);
+		fclose(f);
+		return n == 1 ? 0 : -1;
+	}
+	return -1;
+}
+#endif
+
+/*
+ * Returns the size in bytes of the reads a device does best and of
+ * the biggest ones it takes at once, and whether it is rotational.
+ * For a file, these are the hints of the device the file is on.  The
+ * sizes are 0 and rotational is -1 when they can't be found out.
+ */
+errcode_t ext2fs_get_device_io_hints(const char *file, unsigned int *opt_io,
+				     unsigned int *max_io, int *rotational)
+{
+#if defined(__linux__) && defined(major)
+	ext2fs_struct_stat st;
+	unsigned long long val;
+	dev_t		dev;
+#endif
+
+	*opt_io = *max_io = 0;
+	*rotational = -1;
+#if defined(__linux__) && defined(major)
+	if (ext2fs_stat(file, &st) < 0)
+		return errno;
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	if (read_queue_num(dev, "optimal_io_size", &val) == 0 &&
+	    val < (1U << 31))
+		*opt_io = val;
+	if (read_queue_num(dev, "max_sectors_kb", &val) == 0 &&
+	    val < (1U << 21))
+		*max_io = val * 1024;
+	if (read_queue_num(dev, "rotational", &val) == 0)
+		*rotational = (val != 0);
+#endif
+	return 0;
+}
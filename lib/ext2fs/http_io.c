@@ -0,0 +1,970 @@
+/*
+ * http_io.c --- read-only I/O manager for images served over HTTP
+ *
+ * This allows debugfs, dumpe2fs and e2fsck -n to open a raw image
+ * (or, through the qcow2 manager, a qcow2 image) which is stored on a
+ * web server or an object store, without downloading it first.  The
+ * image is read in aligned chunks with HTTP range requests over a
+ * kept-alive connection, and the chunks are kept in a cache.  A miss
+ * which follows on from the previous one is taken to be part of a
+ * sequential scan, and fetches a readahead window with it which grows
+ * up to max_readahead; io_channel_cache_readahead() fetches the chunks
+ * of the range it is given the same way.
+ *
+ * The I/O options chunk_size, cache_size and max_readahead (in bytes,
+ * with an optional k, m or g suffix) and timeout (in seconds) tune the
+ * cache and the connection.  If E2FSPROGS_HTTP_HEADER is set in the
+ * environment, it is sent as an extra header line with each request,
+ * e.g. for authorization.
+ *
+ * Only plain HTTP is spoken; an https:// image has to be reached
+ * through a local TLS proxy.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <time.h>
+#include <sys/time.h>
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_NETINET_IN_H)
+#define HAVE_HTTP_IO
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define HTTP_DEFAULT_CHUNK	(256 * 1024)
+#define HTTP_DEFAULT_CACHE	(64 * 1024 * 1024)
+#define HTTP_DEFAULT_READAHEAD	(4 * 1024 * 1024)
+#define HTTP_DEFAULT_TIMEOUT	60
+#define HTTP_MAX_HEADER		8192
+
+struct http_chunk {
+	unsigned long long	index;
+	unsigned long		access_time;	/* 0 if unused */
+	unsigned int		len;		/* short at the end */
+	int			hash_next;
+	char			*buf;
+};
+
+struct http_private_data {
+	int		magic;
+	char		*host;
+	char		*port;
+	char		*path;
+	int		sock;
+	int		timeout;
+	unsigned long long size;	/* of the image; ~0 until known */
+	unsigned int	chunk_size;
+	unsigned long long cache_size;
+	unsigned long long max_readahead;
+	int		nr_chunks;
+	struct http_chunk *chunks;
+	int		*hash;
+	int		hash_size;
+	unsigned long	access_time;
+	unsigned long long ra_next;	/* chunk a sequential scan wants */
+	unsigned int	ra_window;	/* chunks fetched with the last miss */
+	char		rbuf[HTTP_MAX_HEADER];
+	unsigned int	rpos, rlen;
+	struct struct_io_stats io_stats;
+};
+
+static errcode_t http_open(const char *name, int flags, io_channel *channel);
+static errcode_t http_close(io_channel channel);
+static errcode_t http_set_blksize(io_channel channel, int blksize);
+static errcode_t http_read_blk(io_channel channel, unsigned long block,
+			       int count, void *data);
+static errcode_t http_write_blk(io_channel channel, unsigned long block,
+				int count, const void *data);
+static errcode_t http_flush(io_channel channel);
+static errcode_t http_write_byte(io_channel channel, unsigned long offset,
+				 int size, const void *data);
+static errcode_t http_set_option(io_channel channel, const char *option,
+				 const char *arg);
+static errcode_t http_get_stats(io_channel channel, io_stats *stats);
+static errcode_t http_read_blk64(io_channel channel, unsigned long long block,
+				 int count, void *data);
+static errcode_t http_write_blk64(io_channel channel,
+				  unsigned long long block, int count,
+				  const void *data);
+static errcode_t http_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
+
+static struct struct_io_manager struct_http_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"HTTP I/O Manager",
+	http_open,
+	http_close,
+	http_set_blksize,
+	http_read_blk,
+	http_write_blk,
+	http_flush,
+	http_write_byte,
+	http_set_option,
+	http_get_stats,
+	http_read_blk64,
+	http_write_blk64,
+	NULL,
+	http_cache_readahead,
+};
+
+io_manager http_io_manager = &struct_http_manager;
+
+/*
+ * Returns 1 if name is a URL which should be opened with this manager.
+ */
+int http_io_probe(const char *name)
+{
+	return name && (!strncmp(name, "http://", 7) ||
+			!strncmp(name, "https://", 8));
+}
+
+static unsigned long long http_usec(void)
+{
+	struct timeval	tv;
+
+	if (gettimeofday(&tv, 0) < 0)
+		return 0;
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static char *http_strndup(const char *s, size_t len)
+{
+	char	*ret;
+
+	if (ext2fs_get_mem(len + 1, &ret))
+		return NULL;
+	memcpy(ret, s, len);
+	ret[len] = 0;
+	return ret;
+}
+
+/* Split http://host[:port][/path] into its parts */
+static errcode_t http_parse_url(struct http_private_data *data,
+				const char *url)
+{
+	const char	*host, *end, *colon;
+
+	if (strncmp(url, "http://", 7))
+		return EXT2_ET_HTTP_BAD_URL;
+	host = url + 7;
+	end = host + strcspn(host, "/");
+	if (*host == '[') {
+		/* [IPv6 address] */
+		colon = strchr(host, ']');
+		if (!colon || colon > end)
+			return EXT2_ET_HTTP_BAD_URL;
+		data->host = http_strndup(host + 1, colon - host - 1);
+		colon++;
+	} else {
+		colon = memchr(host, ':', end - host);
+		if (!colon)
+			colon = end;
+		data->host = http_strndup(host, colon - host);
+	}
+	if (*colon == ':')
+		data->port = http_strndup(colon + 1, end - colon - 1);
+	else if (colon == end)
+		data->port = http_strndup("80", 2);
+	else
+		return EXT2_ET_HTTP_BAD_URL;
+	data->path = http_strndup(*end ? end : "/", *end ? strlen(end) : 1);
+	if (!data->host || !data->port || !data->path)
+		return EXT2_ET_NO_MEMORY;
+	if (!*data->host || !*data->port)
+		return EXT2_ET_HTTP_BAD_URL;
+	return 0;
+}
+
+static void http_disconnect(struct http_private_data *data)
+{
+	if (data->sock >= 0)
+		close(data->sock);
+	data->sock = -1;
+	data->rpos = data->rlen = 0;
+}
+
+#ifdef HAVE_HTTP_IO
+static errcode_t http_connect(struct http_private_data *data)
+{
+	struct addrinfo	hints, *res, *ai;
+	struct timeval	tv;
+	int		sock = -1, ret;
+	errcode_t	retval = EXT2_ET_HTTP_ERROR;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(data->host, data->port, &hints, &res);
+	if (ret)
+		return EXT2_ET_HTTP_BAD_URL;
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0) {
+			retval = errno;
+			continue;
+		}
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		retval = errno;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock < 0)
+		return retval;
+
+	tv.tv_sec = data->timeout;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	data->sock = sock;
+	data->rpos = data->rlen = 0;
+	return 0;
+}
+
+static errcode_t http_send(struct http_private_data *data, const char *buf,
+			   size_t len)
+{
+	ssize_t	actual;
+
+	while (len) {
+		actual = send(data->sock, buf, len, MSG_NOSIGNAL);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual <= 0)
+			return actual < 0 ? errno : EXT2_ET_SHORT_WRITE;
+		buf += actual;
+		len -= actual;
+	}
+	return 0;
+}
+
+/* Read exactly len bytes of the response */
+static errcode_t http_recv(struct http_private_data *data, char *buf,
+			   size_t len)
+{
+	ssize_t	actual;
+	size_t	n;
+
+	if (data->rpos < data->rlen) {
+		n = data->rlen - data->rpos;
+		if (n > len)
+			n = len;
+		memcpy(buf, data->rbuf + data->rpos, n);
+		data->rpos += n;
+		buf += n;
+		len -= n;
+	}
+	while (len) {
+		actual = recv(data->sock, buf, len, 0);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual <= 0)
+			return actual < 0 ? errno : EXT2_ET_SHORT_READ;
+		buf += actual;
+		len -= actual;
+	}
+	return 0;
+}
+
+/*
+ * Read the status line and the headers of a response into rbuf, and
+ * leave rpos at the start of the body.
+ */
+static errcode_t http_recv_header(struct http_private_data *data,
+				  char **end)
+{
+	ssize_t	actual;
+
+	data->rpos = data->rlen = 0;
+	while (1) {
+		data->rbuf[data->rlen] = 0;
+		*end = strstr(data->rbuf, "\r\n\r\n");
+		if (*end)
+			break;
+		if (data->rlen >= sizeof(data->rbuf) - 1)
+			return EXT2_ET_HTTP_ERROR;
+		actual = recv(data->sock, data->rbuf + data->rlen,
+			      sizeof(data->rbuf) - 1 - data->rlen, 0);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual <= 0)
+			return actual < 0 ? errno : EXT2_ET_SHORT_READ;
+		data->rlen += actual;
+	}
+	data->rpos = *end + 4 - data->rbuf;
+	return 0;
+}
+
+static const char *http_header(const char *hdr, const char *end,
+			       const char *name)
+{
+	size_t	len = strlen(name);
+	const char *cp;
+
+	for (cp = strstr(hdr, "\r\n"); cp && cp < end;
+	     cp = strstr(cp, "\r\n")) {
+		cp += 2;
+		if (!strncasecmp(cp, name, len) && cp[len] == ':') {
+			cp += len + 1;
+			while (*cp == ' ' || *cp == '\t')
+				cp++;
+			return cp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Ask for the bytes [start, start + len) of the image.  On success
+ * the body, of *ret_len bytes, is waiting to be read with http_recv(),
+ * and data->size has been set from the response.
+ */
+static errcode_t http_request(struct http_private_data *data,
+			      unsigned long long start,
+			      unsigned long long len,
+			      unsigned long long *ret_len, int *close_after)
+{
+	const char	*extra = getenv("E2FSPROGS_HTTP_HEADER");
+	char		*req, *end;
+	const char	*cp;
+	unsigned long long first, last, total;
+	int		status, tries, req_len;
+	errcode_t	retval;
+
+	req_len = strlen(data->path) + strlen(data->host) +
+		(extra ? strlen(extra) : 0) + 200;
+	retval = ext2fs_get_mem(req_len, &req);
+	if (retval)
+		return retval;
+	snprintf(req, req_len,
+		 "GET %s HTTP/1.1\r\n"
+		 "Host: %s:%s\r\n"
+		 "Range: bytes=%llu-%llu\r\n"
+		 "User-Agent: e2fsprogs\r\n"
+		 "%s%s"
+		 "\r\n", data->path, data->host, data->port,
+		 start, start + len - 1,
+		 extra ? extra : "", extra ? "\r\n" : "");
+
+	/* A kept-alive connection may have been closed by the server */
+	for (tries = 0; tries < 2; tries++) {
+		if (data->sock < 0) {
+			retval = http_connect(data);
+			if (retval)
+				break;
+		}
+		retval = http_send(data, req, strlen(req));
+		if (!retval)
+			retval = http_recv_header(data, &end);
+		if (!retval)
+			break;
+		http_disconnect(data);
+	}
+	ext2fs_free_mem(&req);
+	if (retval)
+		return retval;
+
+	if (sscanf(data->rbuf, "HTTP/%*d.%*d %d", &status) != 1 ||
+	    status != 206)
+		goto bad_response;
+	cp = http_header(data->rbuf, end, "Transfer-Encoding");
+	if (cp && strncasecmp(cp, "identity", 8))
+		goto bad_response;
+	cp = http_header(data->rbuf, end, "Content-Range");
+	if (!cp || sscanf(cp, "bytes %llu-%llu/%llu", &first, &last,
+			  &total) != 3 ||
+	    first != start || last < first || last >= start + len)
+		goto bad_response;
+	cp = http_header(data->rbuf, end, "Content-Length");
+	if (cp && strtoull(cp, NULL, 10) != last - first + 1)
+		goto bad_response;
+	cp = http_header(data->rbuf, end, "Connection");
+	*close_after = cp && !strncasecmp(cp, "close", 5);
+	if (!strncmp(data->rbuf, "HTTP/1.0", 8))
+		*close_after = 1;
+	data->size = total;
+	*ret_len = last - first + 1;
+	return 0;
+
+bad_response:
+	http_disconnect(data);
+	return EXT2_ET_HTTP_ERROR;
+}
+#else
+static errcode_t http_request(struct http_private_data *data,
+			      unsigned long long start
+				EXT2FS_ATTR((unused)),
+			      unsigned long long len EXT2FS_ATTR((unused)),
+			      unsigned long long *ret_len
+				EXT2FS_ATTR((unused)),
+			      int *close_after EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+static errcode_t http_recv(struct http_private_data *data,
+			   char *buf EXT2FS_ATTR((unused)),
+			   size_t len EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+#endif
+
+static void http_free_cache(struct http_private_data *data)
+{
+	int	i;
+
+	if (data->chunks) {
+		for (i = 0; i < data->nr_chunks; i++)
+			if (data->chunks[i].buf)
+				ext2fs_free_mem(&data->chunks[i].buf);
+		ext2fs_free_mem(&data->chunks);
+	}
+	if (data->hash)
+		ext2fs_free_mem(&data->hash);
+	data->nr_chunks = 0;
+}
+
+/*
+ * (Re)allocate the cache for the current chunk and cache sizes.  The
+ * buffers of the chunks are allocated as they are first used.
+ */
+static errcode_t http_alloc_cache(struct http_private_data *data)
+{
+	errcode_t	retval;
+	int		i, n;
+
+	http_free_cache(data);
+	n = data->cache_size / data->chunk_size;
+	if (n < 4)
+		n = 4;
+	retval = ext2fs_get_arrayzero(n, sizeof(struct http_chunk),
+				      &data->chunks);
+	if (retval)
+		return retval;
+	data->nr_chunks = n;
+	for (data->hash_size = 1; data->hash_size < 2 * n; data->hash_size <<= 1)
+		;
+	retval = ext2fs_get_array(data->hash_size, sizeof(int), &data->hash);
+	if (retval)
+		goto errout;
+	for (i = 0; i < data->hash_size; i++)
+		data->hash[i] = -1;
+	data->ra_next = 0;
+	data->ra_window = 0;
+	return 0;
+
+errout:
+	http_free_cache(data);
+	return retval;
+}
+
+static struct http_chunk *http_find_chunk(struct http_private_data *data,
+					  unsigned long long index)
+{
+	int	i = data->hash[index & (data->hash_size - 1)];
+
+	for (; i >= 0; i = data->chunks[i].hash_next)
+		if (data->chunks[i].index == index &&
+		    data->chunks[i].access_time)
+			return &data->chunks[i];
+	return NULL;
+}
+
+static void http_unhash_chunk(struct http_private_data *data, int i)
+{
+	int	*p = &data->hash[data->chunks[i].index &
+				 (data->hash_size - 1)];
+
+	while (*p >= 0 && *p != i)
+		p = &data->chunks[*p].hash_next;
+	if (*p == i)
+		*p = data->chunks[i].hash_next;
+}
+
+/*
+ * Take the least recently used chunk for the chunk index.  Returns
+ * NULL if there is no memory for its buffer.
+ */
+static struct http_chunk *http_new_chunk(struct http_private_data *data,
+					 unsigned long long index)
+{
+	struct http_chunk *chunk;
+	int		i, victim = 0;
+	int		*head;
+
+	for (i = 0; i < data->nr_chunks; i++) {
+		if (!data->chunks[i].access_time) {
+			victim = i;
+			break;
+		}
+		if (data->chunks[i].access_time <
+		    data->chunks[victim].access_time)
+			victim = i;
+	}
+	chunk = &data->chunks[victim];
+	if (!chunk->buf && ext2fs_get_mem(data->chunk_size, &chunk->buf))
+		return NULL;
+	if (chunk->access_time)
+		http_unhash_chunk(data, victim);
+	head = &data->hash[index & (data->hash_size - 1)];
+	chunk->index = index;
+	chunk->hash_next = *head;
+	*head = victim;
+	chunk->access_time = ++data->access_time;
+	chunk->len = 0;
+	return chunk;
+}
+
+/* The number of chunks in the image */
+static unsigned long long http_last_chunk(struct http_private_data *data)
+{
+	return data->size / data->chunk_size +
+		(data->size % data->chunk_size != 0);
+}
+
+/*
+ * Fetch the chunks [first, first + num) with one request.  The caller
+ * makes sure none of them is in the cache.
+ */
+static errcode_t http_fetch(struct http_private_data *data,
+			    unsigned long long first, unsigned int num)
+{
+	unsigned long long start = first * data->chunk_size;
+	unsigned long long len, got, t0;
+	struct http_chunk *chunk;
+	unsigned int	i, n;
+	int		close_after = 0;
+	errcode_t	retval;
+
+	if (num > (unsigned int) data->nr_chunks / 2)
+		num = data->nr_chunks / 2;
+	if (first + num > http_last_chunk(data))
+		num = http_last_chunk(data) - first;
+	if (!num)
+		return EXT2_ET_SHORT_READ;
+	len = (unsigned long long) num * data->chunk_size;
+	if (start + len > data->size)
+		len = data->size - start;
+
+	t0 = http_usec();
+	retval = http_request(data, start, len, &got, &close_after);
+	if (retval)
+		return retval;
+	data->io_stats.reads++;
+	for (i = 0; i < num && got; i++) {
+		chunk = http_new_chunk(data, first + i);
+		if (!chunk) {
+			http_disconnect(data);
+			return EXT2_ET_NO_MEMORY;
+		}
+		n = got < data->chunk_size ? got : data->chunk_size;
+		retval = http_recv(data, chunk->buf, n);
+		if (retval) {
+			/* Forget the partly read chunk */
+			http_unhash_chunk(data, chunk - data->chunks);
+			chunk->access_time = 0;
+			http_disconnect(data);
+			return retval;
+		}
+		chunk->len = n;
+		got -= n;
+		data->io_stats.bytes_read += n;
+	}
+	io_stats_add_latency(data->io_stats.read_latency, http_usec() - t0);
+	if (close_after)
+		http_disconnect(data);
+	return 0;
+}
+
+/*
+ * Fetch the chunks from first up to, but not including, end which are
+ * not in the cache, a run of consecutive missing chunks at a time.
+ */
+static errcode_t http_fetch_range(struct http_private_data *data,
+				  unsigned long long first,
+				  unsigned long long end)
+{
+	unsigned long long run;
+	errcode_t	retval;
+
+	if (end > http_last_chunk(data))
+		end = http_last_chunk(data);
+	while (first < end) {
+		if (http_find_chunk(data, first)) {
+			first++;
+			continue;
+		}
+		for (run = first + 1; run < end; run++)
+			if (run - first >= (unsigned int) data->nr_chunks / 2 ||
+			    http_find_chunk(data, run))
+				break;
+		retval = http_fetch(data, first, run - first);
+		if (retval)
+			return retval;
+		first = run;
+	}
+	return 0;
+}
+
+static errcode_t http_read_bytes(struct http_private_data *data,
+				 unsigned long long location, char *buf,
+				 size_t size)
+{
+	struct http_chunk *chunk;
+	unsigned long long index, end;
+	unsigned int	within, len, ra_max;
+	errcode_t	retval;
+
+	if (location + size > data->size)
+		return EXT2_ET_SHORT_READ;
+	ra_max = data->max_readahead / data->chunk_size;
+	while (size) {
+		index = location / data->chunk_size;
+		within = location % data->chunk_size;
+		chunk = http_find_chunk(data, index);
+		if (chunk)
+			data->io_stats.cache_hits++;
+		else {
+			data->io_stats.cache_misses++;
+			/* A miss where the last one left off is sequential */
+			if (index == data->ra_next && data->ra_window)
+				data->ra_window = data->ra_window * 2;
+			else
+				data->ra_window = 1;
+			if (data->ra_window > ra_max)
+				data->ra_window = ra_max ? ra_max : 1;
+			end = (location + size + data->chunk_size - 1) /
+				data->chunk_size;
+			if (end < index + data->ra_window)
+				end = index + data->ra_window;
+			if (end > index + data->nr_chunks / 2)
+				end = index + data->nr_chunks / 2;
+			retval = http_fetch_range(data, index, end);
+			if (retval)
+				return retval;
+			data->ra_next = end;
+			chunk = http_find_chunk(data, index);
+			if (!chunk)
+				return EXT2_ET_SHORT_READ;
+		}
+		chunk->access_time = ++data->access_time;
+		if (within >= chunk->len)
+			return EXT2_ET_SHORT_READ;
+		len = chunk->len - within;
+		if (len > size)
+			len = size;
+		memcpy(buf, chunk->buf + within, len);
+		location += len;
+		buf += len;
+		size -= len;
+	}
+	return 0;
+}
+
+static errcode_t http_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct http_private_data *data = NULL;
+	char		c;
+	errcode_t	retval;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (flags & IO_FLAG_RW)
+		return EXT2_ET_RO_FILSYS;
+#ifndef HAVE_HTTP_IO
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto cleanup;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct http_private_data), &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_HTTP_IO_CHANNEL;
+	data->sock = -1;
+	data->timeout = HTTP_DEFAULT_TIMEOUT;
+	data->chunk_size = HTTP_DEFAULT_CHUNK;
+	data->cache_size = HTTP_DEFAULT_CACHE;
+	data->max_readahead = HTTP_DEFAULT_READAHEAD;
+	data->io_stats.num_fields = IO_STATS_NUM_FIELDS;
+
+	io->manager = http_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->refcount = 1;
+
+	if (!strncmp(name, "https://", 8)) {
+		retval = EXT2_ET_OP_NOT_SUPPORTED;
+		goto cleanup;
+	}
+	retval = http_parse_url(data, name);
+	if (retval)
+		goto cleanup;
+	retval = http_alloc_cache(data);
+	if (retval)
+		goto cleanup;
+
+	/* The first request tells us how big the image is */
+	data->size = ~0ULL;
+	retval = http_read_bytes(data, 0, &c, 1);
+	if (retval)
+		goto cleanup;
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data) {
+		http_disconnect(data);
+		http_free_cache(data);
+		if (data->host)
+			ext2fs_free_mem(&data->host);
+		if (data->port)
+			ext2fs_free_mem(&data->port);
+		if (data->path)
+			ext2fs_free_mem(&data->path);
+		ext2fs_free_mem(&data);
+	}
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t http_close(io_channel channel)
+{
+	struct http_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct http_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_HTTP_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	http_disconnect(data);
+	http_free_cache(data);
+	ext2fs_free_mem(&data->host);
+	ext2fs_free_mem(&data->port);
+	ext2fs_free_mem(&data->path);
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return 0;
+}
+
+static errcode_t http_set_blksize(io_channel channel, int blksize)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (blksize <= 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t http_read_blk64(io_channel channel, unsigned long long block,
+				 int count, void *buf)
+{
+	struct http_private_data *data;
+	errcode_t	retval;
+	size_t		size;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct http_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_HTTP_IO_CHANNEL);
+
+	size = (count < 0) ? -count : (size_t) count * channel->block_size;
+	retval = http_read_bytes(data, block * channel->block_size,
+				 buf, size);
+	if (retval) {
+		memset(buf, 0, size);
+		if (channel->read_error)
+			retval = (channel->read_error)(channel, block, count,
+						       buf, size, 0, retval);
+	}
+	return retval;
+}
+
+static errcode_t http_read_blk(io_channel channel, unsigned long block,
+			       int count, void *buf)
+{
+	return http_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t http_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count)
+{
+	struct http_private_data *data;
+	unsigned long long start, end, max;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct http_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_HTTP_IO_CHANNEL);
+
+	start = block * channel->block_size;
+	if (start >= data->size || !count)
+		return 0;
+	end = start + count * channel->block_size;
+	/* Don't let readahead push out what is about to be used */
+	max = (unsigned long long) data->chunk_size * (data->nr_chunks / 2);
+	if (end - start > max)
+		end = start + max;
+	return http_fetch_range(data, start / data->chunk_size,
+				(end + data->chunk_size - 1) /
+				data->chunk_size);
+}
+
+static errcode_t http_write_blk64(io_channel channel,
+				  unsigned long long block EXT2FS_ATTR((unused)),
+				  int count EXT2FS_ATTR((unused)),
+				  const void *buf EXT2FS_ATTR((unused)))
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return EXT2_ET_RO_FILSYS;
+}
+
+static errcode_t http_write_blk(io_channel channel, unsigned long block,
+				int count, const void *buf)
+{
+	return http_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t http_write_byte(io_channel channel,
+				 unsigned long offset EXT2FS_ATTR((unused)),
+				 int size EXT2FS_ATTR((unused)),
+				 const void *buf EXT2FS_ATTR((unused)))
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return EXT2_ET_RO_FILSYS;
+}
+
+static errcode_t http_flush(io_channel channel)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return 0;
+}
+
+static errcode_t http_parse_size(const char *arg, unsigned long long *ret)
+{
+	unsigned long long	val;
+	char			*end;
+
+	if (!arg || !*arg)
+		return EXT2_ET_INVALID_ARGUMENT;
+	val = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'g': case 'G':
+		val *= 1024;
+		/* fall through */
+	case 'm': case 'M':
+		val *= 1024;
+		/* fall through */
+	case 'k': case 'K':
+		val *= 1024;
+		end++;
+	}
+	if (*end)
+		return EXT2_ET_INVALID_ARGUMENT;
+	*ret = val;
+	return 0;
+}
+
+/*
+ * Changing chunk_size or cache_size empties the cache.
+ */
+static errcode_t http_set_option(io_channel channel, const char *option,
+				 const char *arg)
+{
+	struct http_private_data *data;
+	unsigned long long val;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct http_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_HTTP_IO_CHANNEL);
+
+	retval = http_parse_size(arg, &val);
+	if (retval)
+		return retval;
+	if (!strcmp(option, "chunk_size")) {
+		if (val < 4096 || val > 64 * 1024 * 1024 || (val & (val - 1)))
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->chunk_size = val;
+		return http_alloc_cache(data);
+	}
+	if (!strcmp(option, "cache_size")) {
+		if (val < data->chunk_size)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->cache_size = val;
+		return http_alloc_cache(data);
+	}
+	if (!strcmp(option, "max_readahead")) {
+		data->max_readahead = val;
+		return 0;
+	}
+	if (!strcmp(option, "timeout")) {
+		if (!val || val > 3600)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->timeout = val;
+		http_disconnect(data);
+		return 0;
+	}
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t http_get_stats(io_channel channel, io_stats *stats)
+{
+	struct http_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct http_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_HTTP_IO_CHANNEL);
+
+	if (stats)
+		*stats = &data->io_stats;
+	return 0;
+}
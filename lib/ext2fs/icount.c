@@ -39,6 +39,20 @@
  * e2fsck's pass 2.  Pass 2 increments inode counts as it finds them,
  * so this extra bitmap avoids searching the sorted list to see if a
  * particular inode is on the sorted list already.
+ *
+ * Pass 2 visits inodes in directory order, not inode order, so on
+ * file systems with many hard links most of those increments insert
+ * into the middle of the sorted list, which is quadratic.  With
+ * EXT2_ICOUNT_OPT_HASH, the counts greater than one are kept in an
+ * open-addressing (linear probing) hash table keyed by inode number
+ * instead.  The counts are only 16 bits wide there, which is all the
+ * interface returns anyway.
+ *
+ * With EXT2_ICOUNT_OPT_FULLMAP, there are no bitmaps and no list;
+ * every count is kept in an array of 16-bit counters indexed by inode
+ * number.  That takes two bytes per inode, but every operation is a
+ * single array access, and two such icounts can be compared with a
+ * linear scan (see ext2fs_icount_next_diff()).
  */
 
 struct ext2_icount_el {
@@ -58,6 +72,10 @@ struct ext2_icount {
 	struct ext2_icount_el	*last_lookup;
 	char			*tdb_fn;
 	TDB_CONTEXT		*tdb;
+	ext2_ino_t		*hash_ino;	/* 0 marks an empty slot */
+	__u16			*hash_count;
+	unsigned int		hash_bits;
+	__u16			*fullmap;
 };
 
 /*
@@ -77,6 +95,12 @@ void ext2fs_free_icount(ext2_icount_t icount)
 	icount->magic = 0;
 	if (icount->list)
 		ext2fs_free_mem(&icount->list);
+	if (icount->hash_ino)
+		ext2fs_free_mem(&icount->hash_ino);
+	if (icount->hash_count)
+		ext2fs_free_mem(&icount->hash_count);
+	if (icount->fullmap)
+		ext2fs_free_mem(&icount->fullmap);
 	if (icount->single)
 		ext2fs_free_inode_bitmap(icount->single);
 	if (icount->multiple)
@@ -102,6 +126,17 @@ static errcode_t alloc_icount(ext2_filsys fs, int flags, ext2_icount_t *ret)
 	if (retval)
 		return retval;
 	memset(icount, 0, sizeof(struct ext2_icount));
+	icount->magic = EXT2_ET_MAGIC_ICOUNT;
+	icount->num_inodes = fs->super->s_inodes_count;
+
+	if (flags & EXT2_ICOUNT_OPT_FULLMAP) {
+		retval = ext2fs_get_arrayzero(icount->num_inodes + 1,
+					      sizeof(__u16), &icount->fullmap);
+		if (retval)
+			goto errout;
+		*ret = icount;
+		return 0;
+	}
 
 	retval = ext2fs_allocate_inode_bitmap(fs, "icount", &icount->single);
 	if (retval)
@@ -115,9 +150,6 @@ static errcode_t alloc_icount(ext2_filsys fs, int flags, ext2_icount_t *ret)
 	} else
 		icount->multiple = 0;
 
-	icount->magic = EXT2_ET_MAGIC_ICOUNT;
-	icount->num_inodes = fs->super->s_inodes_count;
-
 	*ret = icount;
 	return 0;
 
@@ -222,6 +254,139 @@ errout:
 	return(retval);
 }
 
+/*
+ * Allocate an empty hash table of (1 << bits) slots.
+ */
+static errcode_t alloc_icount_hash(ext2_icount_t icount, unsigned int bits)
+{
+	errcode_t	retval;
+	size_t		slots = (size_t) 1 << bits;
+
+	retval = ext2fs_get_array(slots, sizeof(ext2_ino_t),
+				  &icount->hash_ino);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(slots, sizeof(__u16), &icount->hash_count);
+	if (retval) {
+		ext2fs_free_mem(&icount->hash_ino);
+		return retval;
+	}
+	memset(icount->hash_ino, 0, slots * sizeof(ext2_ino_t));
+	memset(icount->hash_count, 0, slots * sizeof(__u16));
+	icount->hash_bits = bits;
+	icount->size = slots;
+	icount->count = 0;
+	return 0;
+}
+
+static unsigned int icount_hash(ext2_icount_t icount, ext2_ino_t ino)
+{
+	return ((__u32) (ino * 2654435761U)) >> (32 - icount->hash_bits);
+}
+
+/*
+ * Return the slot holding ino, or the empty slot where it would go.
+ */
+static unsigned int find_icount_slot(ext2_icount_t icount, ext2_ino_t ino)
+{
+	unsigned int	mask = icount->size - 1;
+	unsigned int	i = icount_hash(icount, ino);
+
+	while (icount->hash_ino[i] && icount->hash_ino[i] != ino)
+		i = (i + 1) & mask;
+	return i;
+}
+
+/*
+ * Double the size of the hash table.
+ */
+static errcode_t grow_icount_hash(ext2_icount_t icount)
+{
+	ext2_ino_t	*old_ino = icount->hash_ino;
+	__u16		*old_count = icount->hash_count;
+	unsigned int	old_size = icount->size, old_count_used;
+	unsigned int	i, slot;
+	errcode_t	retval;
+
+	if (icount->hash_bits >= 31)
+		return EXT2_ET_NO_MEMORY;
+	old_count_used = icount->count;
+	retval = alloc_icount_hash(icount, icount->hash_bits + 1);
+	if (retval) {
+		icount->hash_ino = old_ino;
+		icount->hash_count = old_count;
+		return retval;
+	}
+	for (i = 0; i < old_size; i++) {
+		if (!old_ino[i])
+			continue;
+		slot = find_icount_slot(icount, old_ino[i]);
+		icount->hash_ino[slot] = old_ino[i];
+		icount->hash_count[slot] = old_count[i];
+	}
+	icount->count = old_count_used;
+	ext2fs_free_mem(&old_ino);
+	ext2fs_free_mem(&old_count);
+	return 0;
+}
+
+/*
+ * Remove the entry in the given slot, moving later entries of the
+ * same probe sequence back so that no tombstones are needed.
+ */
+static void delete_icount_slot(ext2_icount_t icount, unsigned int hole)
+{
+	unsigned int	mask = icount->size - 1;
+	unsigned int	i, home;
+
+	for (i = (hole + 1) & mask; icount->hash_ino[i]; i = (i + 1) & mask) {
+		home = icount_hash(icount, icount->hash_ino[i]);
+		/* Can the entry at i be moved back to the hole? */
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		icount->hash_ino[hole] = icount->hash_ino[i];
+		icount->hash_count[hole] = icount->hash_count[i];
+		hole = i;
+	}
+	icount->hash_ino[hole] = 0;
+	icount->hash_count[hole] = 0;
+	icount->count--;
+}
+
+static errcode_t set_icount_hash(ext2_icount_t icount, ext2_ino_t ino,
+				 __u32 count)
+{
+	unsigned int	slot;
+	errcode_t	retval;
+
+	slot = find_icount_slot(icount, ino);
+	if (!icount->hash_ino[slot]) {
+		if (!count)
+			return 0;
+		/* Keep the load factor below 3/4 */
+		if ((icount->count + 1) * 4 > icount->size * 3) {
+			retval = grow_icount_hash(icount);
+			if (retval)
+				return retval;
+			slot = find_icount_slot(icount, ino);
+		}
+		icount->hash_ino[slot] = ino;
+		icount->count++;
+	} else if (!count) {
+		delete_icount_slot(icount, slot);
+		return 0;
+	}
+	icount->hash_count[slot] = (count > 0xFFFF) ? 0xFFFF : count;
+	return 0;
+}
+
+static __u32 get_icount_hash(ext2_icount_t icount, ext2_ino_t ino)
+{
+	unsigned int	slot = find_icount_slot(icount, ino);
+
+	return icount->hash_ino[slot] ? icount->hash_count[slot] : 0;
+}
+
 errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 				ext2_icount_t hint, ext2_icount_t *ret)
 {
@@ -239,6 +404,10 @@ errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 	retval = alloc_icount(fs, flags, &icount);
 	if (retval)
 		return retval;
+	if (icount->fullmap) {
+		*ret = icount;
+		return 0;
+	}
 
 	if (size) {
 		icount->size = size;
@@ -254,6 +423,21 @@ errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 		icount->size += fs->super->s_inodes_count / 50;
 	}
 
+	if (flags & EXT2_ICOUNT_OPT_HASH) {
+		unsigned int bits = 4;
+
+		/* Size the table so that it starts out at most 3/4 full */
+		while (bits < 31 &&
+		       ((unsigned long long) 3 << bits) <
+		       (unsigned long long) icount->size * 4)
+			bits++;
+		retval = alloc_icount_hash(icount, bits);
+		if (retval)
+			goto errout;
+		*ret = icount;
+		return 0;
+	}
+
 	bytes = (size_t) (icount->size * sizeof(struct ext2_icount_el));
 #if 0
 	printf("Icount allocated %u entries, %d bytes.\n",
@@ -273,7 +457,7 @@ errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 	 * found in the hint icount (since those are ones which will
 	 * likely need to be in the sorted list this time around).
 	 */
-	if (hint) {
+	if (hint && hint->list) {
 		for (i=0; i < hint->count; i++)
 			icount->list[i].ino = hint->list[i].ino;
 		icount->count = hint->count;
@@ -416,6 +600,9 @@ static errcode_t set_inode_count(ext2_icount_t icount, ext2_ino_t ino,
 		return 0;
 	}
 
+	if (icount->hash_ino)
+		return set_icount_hash(icount, ino, count);
+
 	el = get_icount_el(icount, ino, 1);
 	if (!el)
 		return EXT2_ET_NO_MEMORY;
@@ -444,6 +631,10 @@ static errcode_t get_inode_count(ext2_icount_t icount, ext2_ino_t ino,
 		free(data.dptr);
 		return 0;
 	}
+	if (icount->hash_ino) {
+		*count = get_icount_hash(icount, ino);
+		return *count ? 0 : ENOENT;
+	}
 	el = get_icount_el(icount, ino, 0);
 	if (!el) {
 		*count = 0;
@@ -466,6 +657,30 @@ errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *out)
 		fprintf(out, "%s: count > size\n", bad);
 		return EXT2_ET_INVALID_ARGUMENT;
 	}
+	if (icount->fullmap)
+		return 0;
+	if (icount->hash_ino) {
+		unsigned int used = 0;
+
+		for (i = 0; i < icount->size; i++) {
+			if (!icount->hash_ino[i])
+				continue;
+			used++;
+			if (find_icount_slot(icount,
+					     icount->hash_ino[i]) != i) {
+				fprintf(out, "%s: hash[%u].ino=%u "
+					"unreachable\n", bad, i,
+					icount->hash_ino[i]);
+				ret = EXT2_ET_INVALID_ARGUMENT;
+			}
+		}
+		if (used != icount->count) {
+			fprintf(out, "%s: %u entries used, count is %u\n",
+				bad, used, icount->count);
+			ret = EXT2_ET_INVALID_ARGUMENT;
+		}
+		return ret;
+	}
 	for (i=1; i < icount->count; i++) {
 		if (icount->list[i-1].ino >= icount->list[i].ino) {
 			fprintf(out, "%s: list[%d].ino=%u, list[%d].ino=%u\n",
@@ -485,6 +700,10 @@ errcode_t ext2fs_icount_fetch(ext2_icount_t icount, ext2_ino_t ino, __u16 *ret)
 	if (!ino || (ino > icount->num_inodes))
 		return EXT2_ET_INVALID_ARGUMENT;
 
+	if (icount->fullmap) {
+		*ret = icount_16_xlate(icount->fullmap[ino]);
+		return 0;
+	}
 	if (ext2fs_test_inode_bitmap2(icount->single, ino)) {
 		*ret = 1;
 		return 0;
@@ -509,6 +728,13 @@ errcode_t ext2fs_icount_increment(ext2_icount_t icount, ext2_ino_t ino,
 	if (!ino || (ino > icount->num_inodes))
 		return EXT2_ET_INVALID_ARGUMENT;
 
+	if (icount->fullmap) {
+		if (icount->fullmap[ino] < 0xFFFF)
+			icount->fullmap[ino]++;
+		if (ret)
+			*ret = icount_16_xlate(icount->fullmap[ino]);
+		return 0;
+	}
 	if (ext2fs_test_inode_bitmap2(icount->single, ino)) {
 		/*
 		 * If the existing count is 1, then we know there is
@@ -566,6 +792,14 @@ errcode_t ext2fs_icount_decrement(ext2_icount_t icount, ext2_ino_t ino,
 
 	EXT2_CHECK_MAGIC(icount, EXT2_ET_MAGIC_ICOUNT);
 
+	if (icount->fullmap) {
+		if (!icount->fullmap[ino])
+			return EXT2_ET_INVALID_ARGUMENT;
+		icount->fullmap[ino]--;
+		if (ret)
+			*ret = icount_16_xlate(icount->fullmap[ino]);
+		return 0;
+	}
 	if (ext2fs_test_inode_bitmap2(icount->single, ino)) {
 		ext2fs_unmark_inode_bitmap2(icount->single, ino);
 		if (icount->multiple)
@@ -607,6 +841,10 @@ errcode_t ext2fs_icount_store(ext2_icount_t icount, ext2_ino_t ino,
 
 	EXT2_CHECK_MAGIC(icount, EXT2_ET_MAGIC_ICOUNT);
 
+	if (icount->fullmap) {
+		icount->fullmap[ino] = count;
+		return 0;
+	}
 	if (count == 1) {
 		ext2fs_mark_inode_bitmap2(icount->single, ino);
 		if (icount->multiple)
@@ -642,6 +880,75 @@ ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount)
 	return icount->size;
 }
 
+/* How many bytes of memory the icount takes; a tdb file isn't counted */
+size_t ext2fs_get_icount_mem_usage(ext2_icount_t icount)
+{
+	size_t	bytes;
+
+	if (!icount || icount->magic != EXT2_ET_MAGIC_ICOUNT)
+		return 0;
+
+	bytes = sizeof(struct ext2_icount) +
+		ext2fs_get_bmap_mem_usage(icount->single) +
+		ext2fs_get_bmap_mem_usage(icount->multiple);
+	if (icount->fullmap)
+		bytes += (size_t) (icount->num_inodes + 1) * sizeof(__u16);
+	if (icount->list)
+		bytes += (size_t) icount->size * sizeof(struct ext2_icount_el);
+	if (icount->hash_ino)
+		bytes += (size_t) icount->size *
+			(sizeof(ext2_ino_t) + sizeof(__u16));
+	return bytes;
+}
+
+/*
+ * Starting at *ino, find the next inode whose counts in a and in b
+ * differ, or are zero or larger than EXT2_LINK_MAX, and return it in
+ * *ino; *ino is set to 0 if there is none.  In other words, inodes
+ * whose counts agree on a plausible link count are skipped.  Both
+ * icounts must have been created with EXT2_ICOUNT_OPT_FULLMAP.
+ */
+errcode_t ext2fs_icount_next_diff(ext2_icount_t a, ext2_icount_t b,
+				  ext2_ino_t *ino)
+{
+	const __u16	*ma, *mb;
+	ext2_ino_t	i = *ino, last;
+	unsigned int	j, diff;
+
+	EXT2_CHECK_MAGIC(a, EXT2_ET_MAGIC_ICOUNT);
+	EXT2_CHECK_MAGIC(b, EXT2_ET_MAGIC_ICOUNT);
+	if (!a->fullmap || !b->fullmap || a->num_inodes != b->num_inodes)
+		return EXT2_ET_INVALID_ARGUMENT;
+	ma = a->fullmap;
+	mb = b->fullmap;
+	last = a->num_inodes;
+	if (!i)
+		i = 1;
+
+	/*
+	 * Look at 16 inodes at a time without branching on each, so
+	 * that the compiler can vectorize the common case of runs of
+	 * matching counts.
+	 */
+	while (i <= last && last - i >= 16) {
+		diff = 0;
+		for (j = 0; j < 16; j++)
+			diff |= (ma[i + j] ^ mb[i + j]) | (ma[i + j] == 0) |
+				(ma[i + j] > EXT2_LINK_MAX);
+		if (diff)
+			break;
+		i += 16;
+	}
+	for (; i <= last && i > 0; i++) {
+		if (ma[i] != mb[i] || ma[i] == 0 || ma[i] > EXT2_LINK_MAX) {
+			*ino = i;
+			return 0;
+		}
+	}
+	*ino = 0;
+	return 0;
+}
+
 #ifdef DEBUG
 
 ext2_filsys	test_fs;
@@ -842,6 +1149,17 @@ int main(int argc, char **argv)
 	failed += run_test(0, 0, ".", prog);
 	printf("\nMultiple bitmap test with tdb:\n");
 	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT, 0, ".", prog);
+	printf("\nStandard icount run with hash table:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_HASH, 0, 0, prog);
+	printf("\nMultiple bitmap test with hash table:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_HASH | EXT2_ICOUNT_OPT_INCREMENT,
+			   0, 0, prog);
+	printf("\nResizing hash table icount:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_HASH, 3, 0, extended);
+	printf("\nStandard icount run with full map:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_FULLMAP, 0, 0, prog);
+	printf("\nExtended icount run with full map:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_FULLMAP, 0, 0, extended);
 	if (failed)
 		printf("FAILED!\n");
 	return failed;
@@ -194,6 +194,10 @@ errcode_t ext2fs_image_super_write(ext2_filsys fs, int fd,
 	ssize_t		actual;
 	errcode_t	retval;
 
+	retval = ext2fs_read_group_descs(fs);
+	if (retval)
+		return retval;
+
 	buf = malloc(fs->blocksize);
 	if (!buf)
 		return ENOMEM;
@@ -269,6 +273,8 @@ errcode_t ext2fs_image_super_read(ext2_filsys fs, int fd,
 
 	memcpy(fs->group_desc, buf + fs->blocksize,
 	       fs->blocksize * fs->group_desc_count);
+	if (fs->desc_unread)
+		ext2fs_free_mem(&fs->desc_unread);
 
 	retval = 0;
 
@@ -24,6 +24,9 @@
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fsP.h"
@@ -51,56 +54,392 @@ struct ext2_struct_inode_scan {
 	void *			done_group_data;
 	int			bad_block_ptr;
 	int			scan_flags;
-	int			reserved[6];
+	ext2_ino_t		zeroes_left;	/* see EXT2_SF_ZERO_UNUSED */
+	int			reserved[5];
+	/* see EXT2_INODE_SCAN_AUTO_BUFFER */
+	blk_t			inode_buffer_max;	/* blocks allocated */
+	int			tuning;
+	int			tune_reads;
+	blk_t			tune_prev_blocks;
+	unsigned long long	tune_usec;
+	unsigned long long	tune_prev_rate;
 };
 
+/*
+ * An automatically sized scan buffer starts out at the size of the
+ * device's optimal or largest request, or SCAN_AUTO_ROT_BYTES on a
+ * rotational disk, and may grow to SCAN_AUTO_GROWTH times that.
+ */
+#define SCAN_AUTO_MIN_BLOCKS	8
+#define SCAN_AUTO_NONROT_BYTES	(128 * 1024)
+#define SCAN_AUTO_ROT_BYTES	(1024 * 1024)
+#define SCAN_AUTO_MAX_BYTES	(8 * 1024 * 1024)
+#define SCAN_AUTO_GROWTH	4
+#define SCAN_AUTO_SAMPLES	4	/* reads timed at each size */
+
+/*
+ * The inode cache holds recently used inodes in a hash table, and
+ * reuses the least recently used entry when it is full.  Behind it
+ * sits a small direct-mapped cache of inode table blocks, so that
+ * reading an inode next to one read recently doesn't go back to the
+ * disk.
+ */
+#define ICACHE_DEFAULT_SIZE	256
+#define ICACHE_INODES_PER_BUF	16	/* cached inodes per cached block */
+
 /*
  * This routine flushes the icache, if it exists.
  */
 errcode_t ext2fs_flush_icache(ext2_filsys fs)
 {
+	struct ext2_inode_cache *icache = fs->icache;
 	int	i;
 
-	if (!fs->icache)
+	if (!icache)
 		return 0;
 
-	for (i=0; i < fs->icache->cache_size; i++)
-		fs->icache->cache[i].ino = 0;
-
-	fs->icache->buffer_blk = 0;
+	for (i=0; i < icache->cache_size; i++)
+		icache->cache[i].ino = 0;
+	for (i=0; i <= icache->hash_mask; i++)
+		icache->hash[i] = -1;
+	for (i=0; i < icache->buffer_count; i++)
+		icache->buffer_blk[i] = 0;
 	return 0;
 }
 
-static errcode_t create_icache(ext2_filsys fs)
+/*
+ * Create an inode cache holding cache_size inodes, replacing any
+ * existing one.  A cache_size of 0 picks the default.
+ */
+errcode_t ext2fs_create_inode_cache(ext2_filsys fs, unsigned int cache_size)
 {
+	struct ext2_inode_cache *icache;
 	errcode_t	retval;
+	unsigned int	i, n;
 
-	if (fs->icache)
-		return 0;
-	retval = ext2fs_get_mem(sizeof(struct ext2_inode_cache), &fs->icache);
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!cache_size)
+		cache_size = ICACHE_DEFAULT_SIZE;
+	retval = ext2fs_get_mem(sizeof(struct ext2_inode_cache), &icache);
 	if (retval)
 		return retval;
+	memset(icache, 0, sizeof(struct ext2_inode_cache));
+	icache->refcount = 1;
 
-	memset(fs->icache, 0, sizeof(struct ext2_inode_cache));
-	retval = ext2fs_get_mem(fs->blocksize, &fs->icache->buffer);
-	if (retval) {
-		ext2fs_free_mem(&fs->icache);
-		return retval;
-	}
-	fs->icache->buffer_blk = 0;
-	fs->icache->cache_last = -1;
-	fs->icache->cache_size = 4;
-	fs->icache->refcount = 1;
-	retval = ext2fs_get_array(fs->icache->cache_size,
+	icache->cache_size = cache_size;
+	retval = ext2fs_get_array(cache_size,
 				  sizeof(struct ext2_inode_cache_ent),
-				  &fs->icache->cache);
-	if (retval) {
-		ext2fs_free_mem(&fs->icache->buffer);
-		ext2fs_free_mem(&fs->icache);
-		return retval;
+				  &icache->cache);
+	if (retval)
+		goto errout;
+	for (i = 0; i < cache_size; i++) {
+		icache->cache[i].lru_prev = i - 1;
+		icache->cache[i].lru_next = (i + 1 < cache_size) ? i + 1 : -1;
 	}
+	icache->lru_head = 0;
+	icache->lru_tail = cache_size - 1;
+
+	for (n = 1; n < cache_size; n <<= 1)
+		;
+	icache->hash_mask = n - 1;
+	retval = ext2fs_get_array(n, sizeof(int), &icache->hash);
+	if (retval)
+		goto errout;
+
+	for (n = 1; n < cache_size / ICACHE_INODES_PER_BUF; n <<= 1)
+		;
+	icache->buffer_count = n;
+	retval = ext2fs_get_array(n, sizeof(blk64_t), &icache->buffer_blk);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(n, fs->blocksize, &icache->buffer);
+	if (retval)
+		goto errout;
+
+	if (fs->icache)
+		ext2fs_free_inode_cache(fs->icache);
+	fs->icache = icache;
 	ext2fs_flush_icache(fs);
 	return 0;
+
+errout:
+	ext2fs_free_inode_cache(icache);
+	return retval;
+}
+
+static errcode_t create_icache(ext2_filsys fs)
+{
+	if (fs->icache)
+		return 0;
+	return ext2fs_create_inode_cache(fs, 0);
+}
+
+static int icache_find(struct ext2_inode_cache *icache, ext2_ino_t ino)
+{
+	int	i;
+
+	for (i = icache->hash[ino & icache->hash_mask]; i >= 0;
+	     i = icache->cache[i].hash_next)
+		if (icache->cache[i].ino == ino)
+			return i;
+	return -1;
+}
+
+/* Move an entry to the head of the LRU list */
+static void icache_touch(struct ext2_inode_cache *icache, int i)
+{
+	struct ext2_inode_cache_ent *ent = &icache->cache[i];
+
+	if (icache->lru_head == i)
+		return;
+	icache->cache[ent->lru_prev].lru_next = ent->lru_next;
+	if (ent->lru_next >= 0)
+		icache->cache[ent->lru_next].lru_prev = ent->lru_prev;
+	else
+		icache->lru_tail = ent->lru_prev;
+	ent->lru_prev = -1;
+	ent->lru_next = icache->lru_head;
+	icache->cache[icache->lru_head].lru_prev = i;
+	icache->lru_head = i;
+}
+
+static void icache_unhash(struct ext2_inode_cache *icache, int i)
+{
+	int	*p = &icache->hash[icache->cache[i].ino & icache->hash_mask];
+
+	while (*p != i)
+		p = &icache->cache[*p].hash_next;
+	*p = icache->cache[i].hash_next;
+	icache->cache[i].ino = 0;
+}
+
+static void icache_add(struct ext2_inode_cache *icache, ext2_ino_t ino,
+		       struct ext2_inode *inode)
+{
+	struct ext2_inode_cache_ent *ent;
+	int	i, *head;
+
+	i = icache_find(icache, ino);
+	if (i < 0) {
+		i = icache->lru_tail;
+		ent = &icache->cache[i];
+		if (ent->ino)
+			icache_unhash(icache, i);
+		head = &icache->hash[ino & icache->hash_mask];
+		ent->ino = ino;
+		ent->hash_next = *head;
+		*head = i;
+	}
+	icache->cache[i].inode = *inode;
+	icache_touch(icache, i);
+}
+
+/*
+ * Return the cached copy of an inode table block, reading it first if
+ * need be.
+ */
+static errcode_t icache_get_block(ext2_filsys fs, io_channel io,
+				  blk64_t blk, char **ret)
+{
+	struct ext2_inode_cache *icache = fs->icache;
+	int		slot = blk & (icache->buffer_count - 1);
+	char		*buf = icache->buffer + (size_t) slot * fs->blocksize;
+	errcode_t	retval;
+
+	if (icache->buffer_blk[slot] != blk) {
+		icache->buffer_blk[slot] = 0;
+		retval = io_channel_read_blk64(io, blk, 1, buf);
+		if (retval)
+			return retval;
+		icache->buffer_blk[slot] = blk;
+	}
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Ask the I/O channel to start reading a group's inode table in the
+ * background, so that it is (hopefully) in memory by the time the scan
+ * gets there.  This is only a hint, so errors are ignored.
+ */
+static void inode_scan_readahead(ext2_inode_scan scan, dgrp_t group)
+{
+	ext2_filsys	fs = scan->fs;
+	blk64_t		blk;
+	__u32		used;
+	unsigned long long count;
+
+	if (group >= fs->group_desc_count)
+		return;
+	blk = ext2fs_inode_table_loc(fs, group);
+	if (!blk || blk >= ext2fs_blocks_count(fs->super))
+		return;
+	count = fs->inode_blocks_per_group;
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    !(scan->scan_flags & EXT2_SF_READ_UNUSED)) {
+		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+			return;
+		used = EXT2_INODES_PER_GROUP(fs->super) -
+			ext2fs_bg_itable_unused(fs, group);
+		count = ((unsigned long long) used * scan->inode_size +
+			 fs->blocksize - 1) / fs->blocksize;
+		if (count > fs->inode_blocks_per_group)
+			count = fs->inode_blocks_per_group;
+	}
+	if (count)
+		(void) io_channel_cache_readahead(fs->io, blk, count);
+}
+
+/*
+ * The group descriptor of a filesystem with uninit_bg says how many
+ * inodes at the end of the group's inode table have never been used;
+ * they needn't be read.  That is only believed if the descriptor's
+ * checksum is good, since skipping inodes which are in use would hide
+ * them from e2fsck.
+ */
+static int group_unused_valid(ext2_filsys fs, dgrp_t group)
+{
+	return (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					   EXT4_FEATURE_RO_COMPAT_GDT_CSUM) &&
+		ext2fs_group_desc_csum_verify(fs, group));
+}
+
+/*
+ * Returns the largest number of blocks up to max which divides the
+ * inode table of a group evenly, so that the reads of a table, and of
+ * the tables laid end to end in a flex group, are all the same size.
+ * If there is none above half of max, max itself will have to do.
+ */
+static blk_t itable_divisor(ext2_filsys fs, blk_t max)
+{
+	blk_t	n;
+
+	if (max < SCAN_AUTO_MIN_BLOCKS)
+		max = SCAN_AUTO_MIN_BLOCKS;
+	if (max >= fs->inode_blocks_per_group)
+		return fs->inode_blocks_per_group;
+	for (n = max; n > max / 2; n--)
+		if (fs->inode_blocks_per_group % n == 0)
+			return n;
+	return max;
+}
+
+/*
+ * Size the scan buffer from what sysfs says about the device.  When it
+ * says nothing, stay with the traditional 8 blocks.  The buffer is
+ * allocated at the biggest size it may grow to, which is kept to a
+ * 1/1024th of physical memory for the sake of small systems.
+ */
+static void auto_buffer_size(ext2_inode_scan scan)
+{
+	ext2_filsys	fs = scan->fs;
+	unsigned int	opt_io, max_io;
+	unsigned long long bytes, max_bytes;
+	long		pages = -1, page_size = -1;
+	int		rotational;
+
+	scan->inode_buffer_blocks = scan->inode_buffer_max =
+		SCAN_AUTO_MIN_BLOCKS;
+	if (!fs->device_name ||
+	    ext2fs_get_device_io_hints(fs->device_name, &opt_io, &max_io,
+				       &rotational) ||
+	    (!opt_io && !max_io && rotational < 0))
+		return;
+
+	if (opt_io)
+		bytes = opt_io;
+	else if (rotational == 1)
+		bytes = SCAN_AUTO_ROT_BYTES;
+	else
+		bytes = max_io;
+	if (bytes < SCAN_AUTO_NONROT_BYTES)
+		bytes = SCAN_AUTO_NONROT_BYTES;
+	max_bytes = bytes * SCAN_AUTO_GROWTH;
+	if (max_bytes > SCAN_AUTO_MAX_BYTES)
+		max_bytes = SCAN_AUTO_MAX_BYTES;
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+	pages = sysconf(_SC_PHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+#endif
+	if (pages > 0 && page_size > 0 &&
+	    max_bytes > (unsigned long long) pages * page_size / 1024)
+		max_bytes = (unsigned long long) pages * page_size / 1024;
+	if (bytes > max_bytes)
+		bytes = max_bytes;
+
+	scan->inode_buffer_max = itable_divisor(fs, max_bytes / fs->blocksize);
+	scan->inode_buffer_blocks = itable_divisor(fs, bytes / fs->blocksize);
+	scan->tuning = scan->inode_buffer_blocks < scan->inode_buffer_max;
+}
+
+static unsigned long long scan_usec(void)
+{
+	struct timeval	tv;
+
+	if (gettimeofday(&tv, 0) < 0)
+		return 0;
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Time the reads of an automatically sized buffer, and double its size
+ * for as long as that makes them faster by at least an eighth.  If
+ * doubling slows them down, go back to the size before; either way,
+ * the size stays put from then on.
+ */
+static void tune_buffer_size(ext2_inode_scan scan, unsigned long long usec)
+{
+	ext2_filsys	fs = scan->fs;
+	unsigned long long rate;
+	blk_t		next;
+
+	scan->tune_usec += usec;
+	if (++scan->tune_reads < SCAN_AUTO_SAMPLES)
+		return;
+	rate = ((unsigned long long) scan->inode_buffer_blocks *
+		fs->blocksize * SCAN_AUTO_SAMPLES) / (scan->tune_usec + 1);
+	scan->tune_reads = 0;
+	scan->tune_usec = 0;
+
+	if (scan->tune_prev_rate &&
+	    rate < scan->tune_prev_rate + scan->tune_prev_rate / 8) {
+		if (rate < scan->tune_prev_rate)
+			scan->inode_buffer_blocks = scan->tune_prev_blocks;
+		scan->tuning = 0;
+		return;
+	}
+	next = itable_divisor(fs, scan->inode_buffer_blocks * 2);
+	if (next > scan->inode_buffer_max)
+		next = scan->inode_buffer_max;
+	if (next <= scan->inode_buffer_blocks) {
+		scan->tuning = 0;
+		return;
+	}
+	scan->tune_prev_blocks = scan->inode_buffer_blocks;
+	scan->tune_prev_rate = rate;
+	scan->inode_buffer_blocks = next;
+}
+
+/*
+ * Work out how much of the current group's inode table is to be read.
+ */
+static void setup_group_inodes(ext2_inode_scan scan)
+{
+	ext2_filsys	fs = scan->fs;
+	ext2_ino_t	unused = 0;
+
+	if (!(scan->scan_flags & EXT2_SF_READ_UNUSED) &&
+	    group_unused_valid(fs, scan->current_group))
+		unused = ext2fs_bg_itable_unused(fs, scan->current_group);
+	if (unused > EXT2_INODES_PER_GROUP(fs->super))
+		unused = EXT2_INODES_PER_GROUP(fs->super);
+	scan->inodes_left = EXT2_INODES_PER_GROUP(fs->super) - unused;
+	scan->zeroes_left = unused;
+	scan->blocks_left = (scan->inodes_left +
+			     (fs->blocksize / scan->inode_size - 1)) *
+		scan->inode_size / fs->blocksize;
 }
 
 errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
@@ -142,21 +481,15 @@ errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
 	scan->bytes_left = 0;
 	scan->current_group = 0;
 	scan->groups_left = fs->group_desc_count - 1;
-	scan->inode_buffer_blocks = buffer_blocks ? buffer_blocks : 8;
 	scan->current_block = ext2fs_inode_table_loc(scan->fs,
 						     scan->current_group);
-	scan->inodes_left = EXT2_INODES_PER_GROUP(scan->fs->super);
-	scan->blocks_left = scan->fs->inode_blocks_per_group;
-	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
-				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
-		scan->inodes_left -=
-			ext2fs_bg_itable_unused(fs, scan->current_group);
-		scan->blocks_left =
-			(scan->inodes_left +
-			 (fs->blocksize / scan->inode_size - 1)) *
-			scan->inode_size / fs->blocksize;
-	}
-	retval = io_channel_alloc_buf(fs->io, scan->inode_buffer_blocks,
+	if (buffer_blocks == EXT2_INODE_SCAN_AUTO_BUFFER)
+		auto_buffer_size(scan);
+	else
+		scan->inode_buffer_blocks = scan->inode_buffer_max =
+			buffer_blocks ? buffer_blocks : 8;
+	setup_group_inodes(scan);
+	retval = io_channel_alloc_buf(fs->io, scan->inode_buffer_max,
 				      &scan->inode_buffer);
 	scan->done_group = 0;
 	scan->done_group_data = 0;
@@ -176,6 +509,8 @@ errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
 	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
 		scan->scan_flags |= EXT2_SF_DO_LAZY;
+	inode_scan_readahead(scan, 0);
+	inode_scan_readahead(scan, 1);
 	*ret_scan = scan;
 	return 0;
 }
@@ -238,17 +573,8 @@ static errcode_t get_next_blockgroup(ext2_inode_scan scan)
 		EXT2_INODES_PER_GROUP(fs->super);
 
 	scan->bytes_left = 0;
-	scan->inodes_left = EXT2_INODES_PER_GROUP(fs->super);
-	scan->blocks_left = fs->inode_blocks_per_group;
-	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
-				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
-		scan->inodes_left -=
-			ext2fs_bg_itable_unused(fs, scan->current_group);
-		scan->blocks_left =
-			(scan->inodes_left +
-			 (fs->blocksize / scan->inode_size - 1)) *
-			scan->inode_size / fs->blocksize;
-	}
+	setup_group_inodes(scan);
+	inode_scan_readahead(scan, scan->current_group + 1);
 
 	return 0;
 }
@@ -261,6 +587,24 @@ errcode_t ext2fs_inode_scan_goto_blockgroup(ext2_inode_scan scan,
 	return get_next_blockgroup(scan);
 }
 
+/*
+ * Restrict the scan to num_groups block groups starting at
+ * first_group; it ends after the last of them instead of at the end
+ * of the file system.
+ */
+errcode_t ext2fs_inode_scan_set_groups(ext2_inode_scan scan,
+				       dgrp_t first_group, dgrp_t num_groups)
+{
+	EXT2_CHECK_MAGIC(scan, EXT2_ET_MAGIC_INODE_SCAN);
+
+	if (num_groups == 0 || first_group >= scan->fs->group_desc_count ||
+	    num_groups > scan->fs->group_desc_count - first_group)
+		return EXT2_ET_INVALID_ARGUMENT;
+	ext2fs_inode_scan_goto_blockgroup(scan, first_group);
+	scan->groups_left = num_groups - 1;
+	return 0;
+}
+
 /*
  * This function is called by get_next_blocks() to check for bad
  * blocks in the inode table.
@@ -329,6 +673,7 @@ static errcode_t check_for_inode_bad_blocks(ext2_inode_scan scan,
 static errcode_t get_next_blocks(ext2_inode_scan scan)
 {
 	blk64_t		num_blocks;
+	unsigned long long start = 0;
 	errcode_t	retval;
 
 	/*
@@ -364,12 +709,16 @@ static errcode_t get_next_blocks(ext2_inode_scan scan)
 		memset(scan->inode_buffer, 0,
 		       (size_t) num_blocks * scan->fs->blocksize);
 	} else {
+		if (scan->tuning && num_blocks == scan->inode_buffer_blocks)
+			start = scan_usec();
 		retval = io_channel_read_blk64(scan->fs->io,
 					     scan->current_block,
 					     (int) num_blocks,
 					     scan->inode_buffer);
 		if (retval)
 			return EXT2_ET_NEXT_INODE_READ;
+		if (start)
+			tune_buffer_size(scan, scan_usec() - start);
 	}
 	scan->ptr = scan->inode_buffer;
 	scan->bytes_left = num_blocks * scan->fs->blocksize;
@@ -406,6 +755,9 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 {
 	errcode_t	retval;
 	int		extra_bytes = 0;
+#ifdef WORDS_BIGENDIAN
+	int		swap_skip;
+#endif
 
 	EXT2_CHECK_MAGIC(scan, EXT2_ET_MAGIC_INODE_SCAN);
 
@@ -414,6 +766,18 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 	 */
 	if (scan->inodes_left <= 0) {
 	force_new_group:
+		/*
+		 * Hand out the inodes which were skipped as never used
+		 * without reading them, if the caller wants to see them.
+		 */
+		if (scan->zeroes_left &&
+		    (scan->scan_flags & EXT2_SF_ZERO_UNUSED)) {
+			scan->zeroes_left--;
+			memset(inode, 0, bufsize);
+			scan->current_inode++;
+			*ino = scan->current_inode;
+			return 0;
+		}
 		if (scan->done_group) {
 			retval = (scan->done_group)
 				(scan->fs, scan, scan->current_group,
@@ -434,13 +798,19 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 	 * they can be done for block group #0.
 	 */
 	if ((scan->scan_flags & EXT2_SF_DO_LAZY) &&
-	    (ext2fs_bg_flags_test(scan->fs, scan->current_group, EXT2_BG_INODE_UNINIT)
-	     ))
+	    !(scan->scan_flags & EXT2_SF_READ_UNUSED) &&
+	    ext2fs_bg_flags_test(scan->fs, scan->current_group,
+				 EXT2_BG_INODE_UNINIT) &&
+	    group_unused_valid(scan->fs, scan->current_group)) {
+		scan->zeroes_left += scan->inodes_left;
+		scan->inodes_left = 0;
 		goto force_new_group;
+	}
 	if (scan->inodes_left == 0)
 		goto force_new_group;
 	if (scan->current_block == 0) {
 		if (scan->scan_flags & EXT2_SF_SKIP_MISSING_ITABLE) {
+			scan->zeroes_left = 0;
 			goto force_new_group;
 		} else
 			return EXT2_ET_MISSING_INODE_TABLE;
@@ -458,6 +828,19 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 		retval = get_next_blocks(scan);
 		if (retval)
 			return retval;
+#ifdef WORDS_BIGENDIAN
+		/*
+		 * Swap the whole inodes which were just read all at
+		 * once; the one which straddles the two buffers is
+		 * swapped below from temp_buffer.
+		 */
+		swap_skip = extra_bytes ? scan->inode_size - extra_bytes : 0;
+		if (scan->bytes_left > swap_skip)
+			ext2fs_swap_inode_table(scan->fs,
+				scan->ptr + swap_skip,
+				(scan->bytes_left - swap_skip) /
+				scan->inode_size, 0);
+#endif
 #if 0
 		/*
 		 * XXX test  Need check for used inode somehow.
@@ -488,15 +871,8 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 			retval = EXT2_ET_BAD_BLOCK_IN_INODE_TABLE;
 		scan->scan_flags &= ~EXT2_SF_BAD_EXTRA_BYTES;
 	} else {
-#ifdef WORDS_BIGENDIAN
-		memset(inode, 0, bufsize);
-		ext2fs_swap_inode_full(scan->fs,
-				(struct ext2_inode_large *) inode,
-				(struct ext2_inode_large *) scan->ptr,
-				0, bufsize);
-#else
+		/* On big-endian hosts it was swapped when it was read */
 		memcpy(inode, scan->ptr, bufsize);
-#endif
 		scan->ptr += scan->inode_size;
 		scan->bytes_left -= scan->inode_size;
 		if (scan->scan_flags & EXT2_SF_BAD_INODE_BLK)
@@ -524,7 +900,7 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 {
 	blk64_t		block_nr;
 	unsigned long 	group, block, offset;
-	char 		*ptr;
+	char 		*ptr, *buf;
 	errcode_t	retval;
 	int 		clen, i, inodes_per_block, length;
 	io_channel	io;
@@ -550,11 +926,11 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	/* Check to see if it's in the inode cache */
 	if (bufsize == sizeof(struct ext2_inode)) {
 		/* only old good inode can be retrieved from the cache */
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				*inode = fs->icache->cache[i].inode;
-				return 0;
-			}
+		i = icache_find(fs->icache, ino);
+		if (i >= 0) {
+			*inode = fs->icache->cache[i].inode;
+			icache_touch(fs->icache, i);
+			return 0;
 		}
 	}
 	if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
@@ -589,16 +965,10 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		if ((offset + length) > fs->blocksize)
 			clen = fs->blocksize - offset;
 
-		if (block_nr != fs->icache->buffer_blk) {
-			retval = io_channel_read_blk64(io, block_nr, 1,
-						     fs->icache->buffer);
-			if (retval)
-				return retval;
-			fs->icache->buffer_blk = block_nr;
-		}
-
-		memcpy(ptr, ((char *) fs->icache->buffer) + (unsigned) offset,
-		       clen);
+		retval = icache_get_block(fs, io, block_nr, &buf);
+		if (retval)
+			return retval;
+		memcpy(ptr, buf + (unsigned) offset, clen);
 
 		offset = 0;
 		length -= clen;
@@ -613,10 +983,7 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 #endif
 
 	/* Update the inode cache */
-	fs->icache->cache_last = (fs->icache->cache_last + 1) %
-		fs->icache->cache_size;
-	fs->icache->cache[fs->icache->cache_last].ino = ino;
-	fs->icache->cache[fs->icache->cache_last].inode = *inode;
+	icache_add(fs->icache, ino, inode);
 
 	return 0;
 }
@@ -635,11 +1002,13 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	unsigned long group, block, offset;
 	errcode_t retval = 0;
 	struct ext2_inode_large temp_inode, *w_inode;
-	char *ptr;
+	char *ptr, *buf;
 	int clen, i, length;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	ext2fs_forget_bmap_cache(fs, ino);
+
 	/* Check to see if user provided an override function */
 	if (fs->write_inode) {
 		retval = (fs->write_inode)(fs, ino, inode);
@@ -649,12 +1018,9 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 
 	/* Check to see if the inode cache needs to be updated */
 	if (fs->icache) {
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				fs->icache->cache[i].inode = *inode;
-				break;
-			}
-		}
+		i = icache_find(fs->icache, ino);
+		if (i >= 0)
+			fs->icache->cache[i].inode = *inode;
 	} else {
 		retval = create_icache(fs);
 		if (retval)
@@ -712,22 +1078,19 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		if ((offset + length) > fs->blocksize)
 			clen = fs->blocksize - offset;
 
-		if (fs->icache->buffer_blk != block_nr) {
-			retval = io_channel_read_blk64(fs->io, block_nr, 1,
-						     fs->icache->buffer);
-			if (retval)
-				goto errout;
-			fs->icache->buffer_blk = block_nr;
-		}
-
+		retval = icache_get_block(fs, fs->io, block_nr, &buf);
+		if (retval)
+			goto errout;
 
-		memcpy((char *) fs->icache->buffer + (unsigned) offset,
-		       ptr, clen);
+		memcpy(buf + (unsigned) offset, ptr, clen);
 
-		retval = io_channel_write_blk64(fs->io, block_nr, 1,
-					      fs->icache->buffer);
-		if (retval)
+		retval = io_channel_write_blk64(fs->io, block_nr, 1, buf);
+		if (retval) {
+			/* the cached copy no longer matches the disk */
+			fs->icache->buffer_blk[block_nr &
+				(fs->icache->buffer_count - 1)] = 0;
 			goto errout;
+		}
 
 		offset = 0;
 		ptr += clen;
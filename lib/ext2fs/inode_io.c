@@ -21,7 +21,7 @@
 #include <time.h>
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 /*
  * For checking structure magic numbers...
@@ -39,6 +39,10 @@ struct inode_private_data {
 	struct ext2_inode		inode;
 	int				flags;
 	struct inode_private_data	*next;
+	/* The last run of blocks found by inode_map_run() */
+	blk64_t				run_lblk;
+	blk64_t				run_pblk;
+	blk64_t				run_len;
 };
 
 #define CHANNEL_HAS_INODE	0x8000
@@ -95,6 +99,7 @@ errcode_t ext2fs_inode_io_intern2(ext2_filsys fs, ext2_ino_t ino,
 	data->fs = fs;
 	data->ino = ino;
 	data->flags = 0;
+	data->run_len = 0;
 	if (inode) {
 		memcpy(&data->inode, inode, sizeof(struct ext2_inode));
 		data->flags |= CHANNEL_HAS_INODE;
@@ -206,24 +211,148 @@ static errcode_t inode_set_blksize(io_channel channel, int blksize)
 }
 
 
-static errcode_t inode_read_blk64(io_channel channel,
-				unsigned long long block, int count, void *buf)
+/*
+ * Aligned reads and writes don't go through the file's block buffer one
+ * block at a time.  The range is split into runs of blocks which are
+ * contiguous on disk, each found with one extent lookup (or, for a
+ * block-mapped file, one bmap per block), and every run is passed to
+ * the file system's channel as a single request.  Holes, uninitialized
+ * extents and anything reaching past the end of the file are left to
+ * ext2fs_file_read() and ext2fs_file_write(), which know how to handle
+ * them.
+ */
+static errcode_t inode_map_run(struct inode_private_data *data,
+			       blk64_t lblk, blk64_t max,
+			       blk64_t *pblk, blk64_t *len)
+{
+	ext2_filsys		fs = data->fs;
+	struct ext2_inode	*inode = ext2fs_file_get_inode(data->file);
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	blk64_t			blk;
+	errcode_t		retval;
+
+	if (data->run_len && lblk >= data->run_lblk &&
+	    lblk < data->run_lblk + data->run_len)
+		goto found;
+
+	*pblk = 0;
+	*len = 1;
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		retval = ext2fs_extent_open2(fs, data->ino, inode, &handle);
+		if (retval)
+			return retval;
+		retval = ext2fs_extent_goto(handle, lblk);
+		if (retval == 0)
+			retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+						   &extent);
+		ext2fs_extent_free(handle);
+		if (retval == EXT2_ET_EXTENT_NOT_FOUND)
+			return 0;
+		if (retval)
+			return retval;
+		if (lblk < extent.e_lblk ||
+		    lblk >= extent.e_lblk + extent.e_len ||
+		    (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT))
+			return 0;
+		data->run_lblk = extent.e_lblk;
+		data->run_pblk = extent.e_pblk;
+		data->run_len = extent.e_len;
+	} else {
+		retval = ext2fs_bmap2(fs, data->ino, inode, NULL, 0, lblk, 0,
+				      &blk);
+		if (retval || !blk)
+			return retval;
+		data->run_lblk = lblk;
+		data->run_pblk = blk;
+		data->run_len = 1;
+		while (data->run_len < max &&
+		       ext2fs_bmap2(fs, data->ino, inode, NULL, 0,
+				    lblk + data->run_len, 0, &blk) == 0 &&
+		       blk == data->run_pblk + data->run_len)
+			data->run_len++;
+	}
+
+found:
+	*pblk = data->run_pblk + (lblk - data->run_lblk);
+	*len = data->run_lblk + data->run_len - lblk;
+	if (*len > max)
+		*len = max;
+	return 0;
+}
+
+static errcode_t inode_file_rw(struct inode_private_data *data,
+			       ext2_loff_t offset, unsigned int size,
+			       void *buf, int write)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_file_llseek(data->file, offset, EXT2_SEEK_SET, 0);
+	if (retval)
+		return retval;
+	if (write)
+		return ext2fs_file_write(data->file, buf, size, 0);
+	return ext2fs_file_read(data->file, buf, size, 0);
+}
+
+static errcode_t inode_rw(io_channel channel, unsigned long long block,
+			  int count, void *buf, int write)
 {
 	struct inode_private_data *data;
+	ext2_filsys	fs;
+	ext2_loff_t	offset;
+	unsigned int	size;
+	__u64		file_size;
+	blk64_t		lblk, num, pblk, len;
+	char		*ptr = buf;
 	errcode_t	retval;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct inode_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_INODE_IO_CHANNEL);
+	fs = data->fs;
+
+	offset = block * channel->block_size;
+	size = (count < 0) ? -count : (count * channel->block_size);
 
-	if ((retval = ext2fs_file_lseek(data->file,
-					block * channel->block_size,
-					EXT2_SEEK_SET, 0)))
+	retval = ext2fs_file_get_lsize(data->file, &file_size);
+	if (retval)
 		return retval;
+	if ((offset % fs->blocksize) || (size % fs->blocksize) ||
+	    offset + size > file_size)
+		return inode_file_rw(data, offset, size, buf, write);
 
-	count = (count < 0) ? -count : (count * channel->block_size);
+	retval = ext2fs_file_discard_cache(data->file);
+	if (retval)
+		return retval;
+	lblk = offset / fs->blocksize;
+	for (num = size / fs->blocksize; num; num -= len) {
+		retval = inode_map_run(data, lblk, num, &pblk, &len);
+		if (retval)
+			return retval;
+		if (!pblk) {
+			retval = inode_file_rw(data,
+					(ext2_loff_t) lblk * fs->blocksize,
+					fs->blocksize, ptr, write);
+			/* Writing may have changed the mapping */
+			if (write)
+				data->run_len = 0;
+		} else if (write)
+			retval = io_channel_write_blk64(fs->io, pblk, len, ptr);
+		else
+			retval = io_channel_read_blk64(fs->io, pblk, len, ptr);
+		if (retval)
+			return retval;
+		lblk += len;
+		ptr += len * fs->blocksize;
+	}
+	return 0;
+}
 
-	return ext2fs_file_read(data->file, buf, count, 0);
+static errcode_t inode_read_blk64(io_channel channel,
+				unsigned long long block, int count, void *buf)
+{
+	return inode_rw(channel, block, count, buf, 0);
 }
 
 static errcode_t inode_read_blk(io_channel channel, unsigned long block,
@@ -235,21 +364,7 @@ static errcode_t inode_read_blk(io_channel channel, unsigned long block,
 static errcode_t inode_write_blk64(io_channel channel,
 				unsigned long long block, int count, const void *buf)
 {
-	struct inode_private_data *data;
-	errcode_t	retval;
-
-	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
-	data = (struct inode_private_data *) channel->private_data;
-	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_INODE_IO_CHANNEL);
-
-	if ((retval = ext2fs_file_lseek(data->file,
-					block * channel->block_size,
-					EXT2_SEEK_SET, 0)))
-		return retval;
-
-	count = (count < 0) ? -count : (count * channel->block_size);
-
-	return ext2fs_file_write(data->file, buf, count, 0);
+	return inode_rw(channel, block, count, (void *) buf, 1);
 }
 
 static errcode_t inode_write_blk(io_channel channel, unsigned long block,
@@ -262,17 +377,14 @@ static errcode_t inode_write_byte(io_channel channel, unsigned long offset,
 				 int size, const void *buf)
 {
 	struct inode_private_data *data;
-	errcode_t	retval = 0;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct inode_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_INODE_IO_CHANNEL);
 
-	if ((retval = ext2fs_file_lseek(data->file, offset,
-					EXT2_SEEK_SET, 0)))
-		return retval;
-
-	return ext2fs_file_write(data->file, buf, size, 0);
+	/* This may allocate blocks, changing the mapping */
+	data->run_len = 0;
+	return inode_file_rw(data, offset, size, (void *) buf, 1);
 }
 
 /*
@@ -111,6 +111,91 @@ errcode_t io_channel_discard(io_channel channel, unsigned long long block,
 	return EXT2_ET_UNIMPLEMENTED;
 }
 
+/*
+ * Zero the given blocks without sending the zeroes down the channel,
+ * if the device or file underneath can do that.  If this fails
+ * (EXT2_ET_UNIMPLEMENTED when the manager has no way to do it), the
+ * caller is expected to write the zeroes itself.
+ */
+errcode_t io_channel_zeroout(io_channel channel, unsigned long long block,
+			     unsigned long long count)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->zeroout)
+		return (channel->manager->zeroout)(channel, block, count);
+
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+/*
+ * Tell the I/O manager that we will soon be reading the given blocks,
+ * so that it can start fetching them in the background.  This is
+ * only a hint; managers which can't do anything useful with it return
+ * EXT2_ET_OP_NOT_SUPPORTED, which callers are free to ignore.
+ */
+errcode_t io_channel_cache_readahead(io_channel io, unsigned long long block,
+				     unsigned long long count)
+{
+	EXT2_CHECK_MAGIC(io, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (!io->manager->cache_readahead)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+
+	return io->manager->cache_readahead(io, block, count);
+}
+
+/*
+ * Read or write a run of consecutive blocks from/to several buffers.
+ * I/O managers which don't support this natively get one read_blk64
+ * or write_blk64 call per buffer.
+ */
+errcode_t io_channel_read_blk_vec(io_channel channel,
+				  unsigned long long block,
+				  struct io_blk_vec *vec, int nr_vec)
+{
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->read_blk_vec)
+		return (channel->manager->read_blk_vec)(channel, block,
+							vec, nr_vec);
+
+	for (i = 0; i < nr_vec; i++) {
+		retval = io_channel_read_blk64(channel, block, vec[i].count,
+					       vec[i].buf);
+		if (retval)
+			return retval;
+		block += vec[i].count;
+	}
+	return 0;
+}
+
+errcode_t io_channel_write_blk_vec(io_channel channel,
+				   unsigned long long block,
+				   const struct io_blk_vec *vec, int nr_vec)
+{
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->write_blk_vec)
+		return (channel->manager->write_blk_vec)(channel, block,
+							 vec, nr_vec);
+
+	for (i = 0; i < nr_vec; i++) {
+		retval = io_channel_write_blk64(channel, block, vec[i].count,
+						vec[i].buf);
+		if (retval)
+			return retval;
+		block += vec[i].count;
+	}
+	return 0;
+}
+
 errcode_t io_channel_alloc_buf(io_channel io, int count, void *ptr)
 {
 	size_t	size;
@@ -127,3 +212,43 @@ errcode_t io_channel_alloc_buf(io_channel io, int count, void *ptr)
 	else
 		return ext2fs_get_mem(size, ptr);
 }
+
+/*
+ * Add a request which took usec microseconds to a latency histogram
+ */
+void io_stats_add_latency(unsigned long long *hist, unsigned long long usec)
+{
+	int	b = 0;
+
+	while (b < IO_STATS_LATENCY_BUCKETS - 1 && usec >= (1ULL << b))
+		b++;
+	hist[b]++;
+}
+
+/*
+ * Return a bound on the latency, in microseconds, of percent% of the
+ * requests counted in hist since it was base (which may be NULL);
+ * requests which fell in the last bucket make it the bound of the one
+ * before.  Returns 0 if there were no requests.
+ */
+unsigned long long io_stats_latency(const unsigned long long *hist,
+				    const unsigned long long *base,
+				    int percent)
+{
+	unsigned long long total = 0, sum = 0, n;
+	int	b;
+
+	for (b = 0; b < IO_STATS_LATENCY_BUCKETS; b++)
+		total += hist[b] - (base ? base[b] : 0);
+	if (!total)
+		return 0;
+	for (b = 0; b < IO_STATS_LATENCY_BUCKETS - 1; b++) {
+		n = hist[b] - (base ? base[b] : 0);
+		sum += n;
+		if (sum * 100 >= total * percent)
+			break;
+	}
+	if (b == IO_STATS_LATENCY_BUCKETS - 1)
+		b--;
+	return 1ULL << b;
+}
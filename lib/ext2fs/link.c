@@ -17,6 +17,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 struct link_struct  {
 	ext2_filsys	fs;
@@ -104,6 +105,451 @@ static int link_proc(struct ext2_dir_entry *dirent,
 	return DIRENT_ABORT|DIRENT_CHANGED;
 }
 
+/*
+ * Try to fit the new entry into a single directory block in buf, the
+ * same way link_proc does when called by ext2fs_dir_iterate().
+ */
+static errcode_t link_into_block(struct link_struct *ls, char *buf)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset, rec_len;
+	errcode_t	retval;
+
+	for (offset = 0; offset < ls->blocksize; offset += rec_len) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(ls->fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+		if (rec_len < 8 || rec_len % 4 ||
+		    offset + rec_len > ls->blocksize)
+			return EXT2_ET_DIR_CORRUPTED;
+		link_proc(dirent, offset, ls->blocksize, buf, ls);
+		if (ls->err)
+			return ls->err;
+		if (ls->done)
+			return 0;
+		retval = ext2fs_get_rec_len(ls->fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/* One level of the path from the htree root down to a leaf */
+struct dx_frame {
+	char			*buf;
+	blk64_t			pblk;
+	int			offset;		/* of the entries in buf */
+	int			at;		/* entry which was followed */
+};
+
+#define DX_COUNT(f)	((struct ext2_dx_countlimit *) ((f)->buf + (f)->offset))
+#define DX_ENTRIES(f)	((struct ext2_dx_entry *) ((f)->buf + (f)->offset))
+
+struct dx_hash_ent {
+	ext2_dirhash_t		hash;
+	struct ext2_dir_entry	*dirent;
+};
+
+static EXT2_QSORT_TYPE dx_hash_cmp(const void *a, const void *b)
+{
+	const struct dx_hash_ent *ha = a, *hb = b;
+
+	if (ha->hash != hb->hash)
+		return ha->hash < hb->hash ? -1 : 1;
+	/* Keep names in block order, like a stable sort */
+	return ha->dirent < hb->dirent ? -1 : (ha->dirent > hb->dirent);
+}
+
+/*
+ * Append a block to the directory for a new leaf or index node and
+ * return its logical and physical block numbers.
+ */
+static errcode_t dx_new_block(ext2_filsys fs, ext2_ino_t dir,
+			      struct ext2_inode *inode, blk64_t *lblk,
+			      blk64_t *pblk)
+{
+	errcode_t	retval;
+
+	*lblk = EXT2_I_SIZE(inode) / fs->blocksize;
+	*pblk = 0;
+	retval = ext2fs_bmap2(fs, dir, inode, NULL, BMAP_ALLOC, *lblk,
+			      0, pblk);
+	if (retval)
+		return retval;
+	inode->i_size += fs->blocksize;
+	return ext2fs_write_inode(fs, dir, inode);
+}
+
+/* Start an empty interior node, written in on-disk byte order */
+static struct ext2_dx_countlimit *dx_init_node(ext2_filsys fs, char *buf)
+{
+	struct ext2_dir_entry *dirent = (struct ext2_dir_entry *) buf;
+	struct ext2_dx_countlimit *limit;
+
+	memset(buf, 0, fs->blocksize);
+	(void) ext2fs_set_rec_len(fs, fs->blocksize, dirent);
+	dirent->rec_len = ext2fs_cpu_to_le16(dirent->rec_len);
+	limit = (struct ext2_dx_countlimit *) (buf + 8);
+	limit->limit = ext2fs_cpu_to_le16((fs->blocksize - 8) /
+					  sizeof(struct ext2_dx_entry));
+	return limit;
+}
+
+/* Insert (hash, block) into an index node after the entry at pos */
+static void dx_insert_entry(struct dx_frame *frame, int pos,
+			    ext2_dirhash_t hash, blk64_t block)
+{
+	struct ext2_dx_countlimit *limit = DX_COUNT(frame);
+	struct ext2_dx_entry *ent = DX_ENTRIES(frame);
+	int		count = ext2fs_le16_to_cpu(limit->count);
+
+	memmove(ent + pos + 2, ent + pos + 1,
+		(count - pos - 1) * sizeof(struct ext2_dx_entry));
+	ent[pos + 1].hash = ext2fs_cpu_to_le32(hash);
+	ent[pos + 1].block = ext2fs_cpu_to_le32(block);
+	limit->count = ext2fs_cpu_to_le16(count + 1);
+}
+
+static int dx_full(struct dx_frame *frame)
+{
+	struct ext2_dx_countlimit *limit = DX_COUNT(frame);
+
+	return limit->count == limit->limit;
+}
+
+/*
+ * Make room in the index for one more leaf.  If the node above the
+ * leaf is full, a full root gets a second level, or a full interior
+ * node is split in two, as the kernel does.  The caller has checked
+ * that there is room for that.
+ */
+static errcode_t dx_grow_index(ext2_filsys fs, ext2_ino_t dir,
+			       struct ext2_inode *inode,
+			       struct dx_frame *frames, int *levels,
+			       char *spare)
+{
+	struct ext2_dx_root_info *root;
+	struct ext2_dx_countlimit *limit;
+	struct ext2_dx_entry *ent;
+	struct dx_frame	*node = &frames[*levels];
+	blk64_t		lblk, pblk;
+	int		count, half;
+	errcode_t	retval;
+
+	if (!dx_full(node))
+		return 0;
+	retval = dx_new_block(fs, dir, inode, &lblk, &pblk);
+	if (retval)
+		return retval;
+	limit = dx_init_node(fs, spare);
+	ent = (struct ext2_dx_entry *) limit;
+	count = ext2fs_le16_to_cpu(DX_COUNT(node)->count);
+
+	if (*levels == 0) {
+		/* Move all of the root's entries into the new node */
+		memcpy(ent + 1, DX_ENTRIES(node) + 1,
+		       (count - 1) * sizeof(struct ext2_dx_entry));
+		ent[0].block = DX_ENTRIES(node)[0].block;
+		limit->count = ext2fs_cpu_to_le16(count);
+		DX_COUNT(node)->count = ext2fs_cpu_to_le16(1);
+		DX_ENTRIES(node)[0].block = ext2fs_cpu_to_le32(lblk);
+		root = (struct ext2_dx_root_info *) (node->buf + 24);
+		root->indirect_levels = 1;
+
+		frames[1].buf = spare;
+		frames[1].pblk = pblk;
+		frames[1].offset = 8;
+		frames[1].at = node->at;
+		node->at = 0;
+		*levels = 1;
+		return 0;
+	}
+
+	/* Move the upper half of the interior node into the new one */
+	half = count / 2;
+	memcpy(ent + 1, DX_ENTRIES(node) + half + 1,
+	       (count - half - 1) * sizeof(struct ext2_dx_entry));
+	ent[0].block = DX_ENTRIES(node)[half].block;
+	limit->count = ext2fs_cpu_to_le16(count - half);
+	DX_COUNT(node)->count = ext2fs_cpu_to_le16(half);
+	dx_insert_entry(&frames[0], frames[0].at,
+			ext2fs_le32_to_cpu(DX_ENTRIES(node)[half].hash), lblk);
+
+	/* Then follow whichever half holds the leaf we were going to */
+	if (node->at >= half) {
+		retval = io_channel_write_blk64(fs->io, node->pblk, 1,
+						node->buf);
+		if (retval)
+			return retval;
+		memcpy(node->buf, spare, fs->blocksize);
+		node->pblk = pblk;
+		node->at -= half;
+		frames[0].at++;
+		return 0;
+	}
+	return io_channel_write_blk64(fs->io, pblk, 1, spare);
+}
+
+/*
+ * Split a full leaf: the entries are sorted by hash and the upper half,
+ * by size, is moved into a new block.  Returns the hash which starts the new
+ * leaf; its low bit is set if the two leaves share a hash.
+ */
+static errcode_t dx_split_leaf(ext2_filsys fs, int hash_version,
+			       char *leaf, char *new_leaf,
+			       ext2_dirhash_t *split_hash)
+{
+	struct dx_hash_ent *map = 0;
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len, len, size;
+	int		count = 0, i, split;
+	char		*copy = 0, *out = leaf;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem(fs->blocksize, &copy);
+	if (retval)
+		return retval;
+	memcpy(copy, leaf, fs->blocksize);
+	retval = ext2fs_get_array(fs->blocksize / 12,
+				  sizeof(struct dx_hash_ent), &map);
+	if (retval)
+		goto out;
+
+	for (offset = 0; offset < fs->blocksize; offset += rec_len) {
+		dirent = (struct ext2_dir_entry *) (copy + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			goto out;
+		if (!dirent->inode)
+			continue;
+		retval = ext2fs_dirhash(hash_version, dirent->name,
+					dirent->name_len & 0xFF,
+					fs->super->s_hash_seed,
+					&map[count].hash, 0);
+		if (retval)
+			goto out;
+		map[count++].dirent = dirent;
+	}
+	if (count < 2) {
+		retval = EXT2_ET_DIR_NO_SPACE;
+		goto out;
+	}
+	qsort(map, count, sizeof(struct dx_hash_ent), dx_hash_cmp);
+
+	/* Move about half of the bytes, not half of the names */
+	for (size = 0, split = count; split > 1; split--) {
+		len = EXT2_DIR_REC_LEN(map[split - 1].dirent->name_len & 0xFF);
+		if (size + len / 2 > fs->blocksize / 2)
+			break;
+		size += len;
+	}
+	if (split == count)
+		split--;
+	*split_hash = map[split].hash;
+	if (map[split].hash == map[split - 1].hash)
+		*split_hash |= 1;
+
+	/* Write each half back packed, with the slack at the end */
+	for (i = 0; i < count; i++) {
+		if (i == 0 || i == split) {
+			out = i ? new_leaf : leaf;
+			offset = 0;
+		}
+		len = EXT2_DIR_REC_LEN(map[i].dirent->name_len & 0xFF);
+		dirent = (struct ext2_dir_entry *) (out + offset);
+		memcpy(dirent, map[i].dirent, len);
+		offset += len;
+		if (i + 1 == count || i + 1 == split)
+			len += fs->blocksize - offset;
+		retval = ext2fs_set_rec_len(fs, len, dirent);
+		if (retval)
+			goto out;
+	}
+out:
+	ext2fs_free_mem(&map);
+	ext2fs_free_mem(&copy);
+	return retval;
+}
+
+/*
+ * Add the entry to an htree directory by going down the index to the
+ * leaf its hash belongs in, splitting the leaf if it is full.  Returns
+ * EXT2_ET_DIRHASH_UNSUPP if the index isn't one this code can update;
+ * the caller then falls back to adding the entry anywhere and
+ * dropping the index.
+ */
+static errcode_t dx_link(ext2_filsys fs, ext2_ino_t dir,
+			 struct ext2_inode *inode, struct link_struct *ls)
+{
+	struct ext2_dx_root_info *root;
+	struct ext2_dx_countlimit *limit;
+	struct ext2_dx_entry *ent;
+	struct ext2_dir_entry *dirent;
+	struct dx_frame	frames[2], *frame;
+	char		*buf = 0, *leaf, *new_leaf, *spare;
+	ext2_dirhash_t	hash, split_hash;
+	blk64_t		num_blocks, blk, leaf_pblk, new_lblk, new_pblk;
+	int		hash_version, levels, i, count, lo, hi, mid;
+	struct ext2_dentry_cache *dcache;
+	errcode_t	retval;
+
+	if (!(fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) ||
+	    (ls->namelen <= 2 && ls->name[0] == '.' &&
+	     (ls->namelen == 1 || ls->name[1] == '.')))
+		return EXT2_ET_DIRHASH_UNSUPP;
+	num_blocks = EXT2_I_SIZE(inode) / fs->blocksize;
+
+	/* Two index levels, the leaf, a new leaf and a spare node */
+	retval = ext2fs_get_array(5, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	frames[0].buf = buf;
+	frames[1].buf = buf + fs->blocksize;
+	leaf = buf + 2 * fs->blocksize;
+	new_leaf = buf + 3 * fs->blocksize;
+	spare = buf + 4 * fs->blocksize;
+
+	/* The index blocks are handled in on-disk byte order */
+	retval = ext2fs_bmap2(fs, dir, inode, NULL, 0, 0, NULL,
+			      &frames[0].pblk);
+	if (retval)
+		goto out;
+	retval = EXT2_ET_DIRHASH_UNSUPP;
+	if (!frames[0].pblk)
+		goto out;
+	retval = io_channel_read_blk64(fs->io, frames[0].pblk, 1, buf);
+	if (retval)
+		goto out;
+	dirent = (struct ext2_dir_entry *) buf;
+	root = (struct ext2_dx_root_info *) (buf + 24);
+	retval = EXT2_ET_DIRHASH_UNSUPP;
+	if (ext2fs_le16_to_cpu(dirent->rec_len) != 12 ||
+	    root->reserved_zero || root->info_length != 8 ||
+	    root->indirect_levels > 1 || root->hash_version > EXT2_HASH_TEA)
+		goto out;
+	hash_version = root->hash_version;
+	if (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+		hash_version += 3;
+	levels = root->indirect_levels;
+	frames[0].offset = 24 + root->info_length;
+
+	retval = ext2fs_dirhash(hash_version, ls->name, ls->namelen,
+				fs->super->s_hash_seed, &hash, 0);
+	if (retval)
+		goto out;
+
+	for (i = 0; ; i++) {
+		frame = &frames[i];
+		limit = DX_COUNT(frame);
+		ent = DX_ENTRIES(frame);
+		count = ext2fs_le16_to_cpu(limit->count);
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+		if (ext2fs_le16_to_cpu(limit->limit) !=
+		    (fs->blocksize - frame->offset) /
+		    sizeof(struct ext2_dx_entry) ||
+		    count == 0 || count > ext2fs_le16_to_cpu(limit->limit))
+			goto out;
+
+		/* Find the last entry whose hash is <= the new one */
+		lo = 1;
+		hi = count - 1;
+		while (lo <= hi) {
+			mid = (lo + hi) / 2;
+			if (ext2fs_le32_to_cpu(ent[mid].hash) > hash)
+				hi = mid - 1;
+			else
+				lo = mid + 1;
+		}
+		frame->at = lo - 1;
+		blk = ext2fs_le32_to_cpu(ent[frame->at].block) & 0x00ffffff;
+		if (blk == 0 || blk >= num_blocks)
+			goto out;
+		if (i == levels)
+			break;
+
+		frames[1].offset = 8;
+		retval = ext2fs_bmap2(fs, dir, inode, NULL, 0, blk, NULL,
+				      &frames[1].pblk);
+		if (retval)
+			goto out;
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+		if (!frames[1].pblk)
+			goto out;
+		retval = io_channel_read_blk64(fs->io, frames[1].pblk, 1,
+					       frames[1].buf);
+		if (retval)
+			goto out;
+		dirent = (struct ext2_dir_entry *) frames[1].buf;
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+		if (dirent->inode ||
+		    ext2fs_le16_to_cpu(dirent->rec_len) != fs->blocksize)
+			goto out;
+	}
+
+	retval = ext2fs_bmap2(fs, dir, inode, NULL, 0, blk, NULL, &leaf_pblk);
+	if (retval)
+		goto out;
+	retval = EXT2_ET_DIRHASH_UNSUPP;
+	if (!leaf_pblk)
+		goto out;
+	retval = ext2fs_read_dir_block3(fs, leaf_pblk, leaf, 0);
+	if (retval)
+		goto out;
+
+	/* Adding a name doesn't change what earlier lookups found */
+	dcache = fs->dcache;
+	fs->dcache = 0;
+	retval = link_into_block(ls, leaf);
+	if (retval == EXT2_ET_DIR_CORRUPTED)
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+	if (retval || ls->done) {
+		if (!retval)
+			retval = ext2fs_write_dir_block3(fs, leaf_pblk,
+							 leaf, 0);
+		goto out_cache;
+	}
+
+	/*
+	 * The leaf is full.  Split it and place the new entry in memory
+	 * first, so that nothing is written if the index can't take it.
+	 */
+	retval = EXT2_ET_DIRHASH_UNSUPP;
+	if (levels && dx_full(&frames[1]) && dx_full(&frames[0]))
+		goto out_cache;
+	retval = dx_split_leaf(fs, hash_version, leaf, new_leaf, &split_hash);
+	if (retval == EXT2_ET_DIR_NO_SPACE)
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+	if (retval)
+		goto out_cache;
+	retval = link_into_block(ls, hash >= split_hash ? new_leaf : leaf);
+	if (!retval && !ls->done)
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+	if (retval)
+		goto out_cache;
+
+	retval = dx_grow_index(fs, dir, inode, frames, &levels, spare);
+	if (retval)
+		goto out_cache;
+	retval = dx_new_block(fs, dir, inode, &new_lblk, &new_pblk);
+	if (retval)
+		goto out_cache;
+	frame = &frames[levels];
+	dx_insert_entry(frame, frame->at, split_hash, new_lblk);
+
+	retval = ext2fs_write_dir_block3(fs, new_pblk, new_leaf, 0);
+	if (!retval)
+		retval = ext2fs_write_dir_block3(fs, leaf_pblk, leaf, 0);
+	for (i = levels; !retval && i >= 0; i--)
+		retval = io_channel_write_blk64(fs->io, frames[i].pblk, 1,
+						frames[i].buf);
+out_cache:
+	fs->dcache = dcache;
+out:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
 /*
  * Note: the low 3 bits of the flags field are used as the directory
  * entry filetype.
@@ -117,6 +563,7 @@ errcode_t ext2fs_link(ext2_filsys fs, ext2_ino_t dir, const char *name,
 	errcode_t		retval;
 	struct link_struct	ls;
 	struct ext2_inode	inode;
+	struct ext2_dentry_cache *dcache;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -133,8 +580,29 @@ errcode_t ext2fs_link(ext2_filsys fs, ext2_ino_t dir, const char *name,
 	ls.blocksize = fs->blocksize;
 	ls.err = 0;
 
+	if ((retval = ext2fs_read_inode(fs, dir, &inode)) != 0)
+		return retval;
+
+	if (inode.i_flags & EXT2_INDEX_FL) {
+		retval = dx_link(fs, dir, &inode, &ls);
+		if (retval != EXT2_ET_DIRHASH_UNSUPP) {
+			ext2fs_forget_dentry(fs, dir, name, ls.namelen);
+			return retval;
+		}
+		ls.done = 0;
+	}
+
+	/*
+	 * Adding an entry doesn't change what an earlier lookup found,
+	 * except one of the same name, so don't let writing the
+	 * directory block empty the dentry cache.
+	 */
+	dcache = fs->dcache;
+	fs->dcache = 0;
 	retval = ext2fs_dir_iterate(fs, dir, DIRENT_FLAG_INCLUDE_EMPTY,
 				    0, link_proc, &ls);
+	fs->dcache = dcache;
+	ext2fs_forget_dentry(fs, dir, name, ls.namelen);
 	if (retval)
 		return retval;
 	if (ls.err)
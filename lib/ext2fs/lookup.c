@@ -17,53 +17,362 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
-struct lookup_struct  {
-	const char	*name;
-	int		len;
-	ext2_ino_t	*inode;
-	int		found;
-};
+/* Default number of slots in the dentry cache */
+#define DCACHE_DEFAULT_SIZE	4096
 
-#ifdef __TURBOC__
- #pragma argsused
-#endif
-static int lookup_proc(struct ext2_dir_entry *dirent,
-		       int	offset EXT2FS_ATTR((unused)),
-		       int	blocksize EXT2FS_ATTR((unused)),
-		       char	*buf EXT2FS_ATTR((unused)),
-		       void	*priv_data)
+/*
+ * Find the entries at one level of an htree index which point at the
+ * block that can hold hash.  The index block is in buf, its
+ * entries start at offset, and its count/limit must agree with the
+ * space there.  Returns the logical block to look in next, and the
+ * hash that starts the following block (or 0 if there is none at this
+ * level) in *next_hash.
+ */
+static errcode_t dx_probe(ext2_filsys fs, char *buf, int offset,
+			  ext2_dirhash_t hash, blk64_t num_blocks,
+			  blk64_t *blk, ext2_dirhash_t *next_hash)
+{
+	struct ext2_dx_countlimit *limit;
+	struct ext2_dx_entry *ent;
+	int		count, lo, hi, mid;
+
+	limit = (struct ext2_dx_countlimit *) (buf + offset);
+	ent = (struct ext2_dx_entry *) (buf + offset);
+	count = ext2fs_le16_to_cpu(limit->count);
+	if (ext2fs_le16_to_cpu(limit->limit) !=
+	    (fs->blocksize - offset) / sizeof(struct ext2_dx_entry) ||
+	    count == 0 || count > ext2fs_le16_to_cpu(limit->limit))
+		return EXT2_ET_DIRHASH_UNSUPP;
+
+	/* Find the last entry whose hash is <= the one looked for */
+	lo = 1;
+	hi = count - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ext2fs_le32_to_cpu(ent[mid].hash) > hash)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	*blk = ext2fs_le32_to_cpu(ent[lo - 1].block) & 0x00ffffff;
+	*next_hash = lo < count ? ext2fs_le32_to_cpu(ent[lo].hash) : 0;
+	if (*blk == 0 || *blk >= num_blocks)
+		return EXT2_ET_DIRHASH_UNSUPP;
+	return 0;
+}
+
+static errcode_t read_dir_lblk(ext2_filsys fs, ext2_ino_t dir,
+			       struct ext2_inode *inode, blk64_t lblk,
+			       char *buf, int raw)
+{
+	blk64_t		pblk;
+	errcode_t	retval;
+
+	retval = ext2fs_bmap2(fs, dir, inode, NULL, 0, lblk, NULL, &pblk);
+	if (retval)
+		return retval;
+	if (!pblk)
+		return EXT2_ET_DIRHASH_UNSUPP;
+	if (raw)
+		return io_channel_read_blk64(fs->io, pblk, 1, buf);
+	return ext2fs_read_dir_block3(fs, pblk, buf, 0);
+}
+
+/*
+ * Look a name up through the directory's htree index, so that only the
+ * index blocks on the way down and the single leaf block they point at
+ * are read.  Returns EXT2_ET_DIRHASH_UNSUPP if the directory has no
+ * index, or one this code does not trust, so the caller can fall back
+ * to scanning the whole directory.
+ */
+static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
+			   int namelen, ext2_ino_t *ret)
+{
+	struct ext2_inode inode;
+	struct ext2_dx_root_info *root;
+	struct ext2_dir_entry *dirent;
+	char		*buf = 0;
+	ext2_dirhash_t	hash, next_hash = 0, level_next;
+	blk64_t		num_blocks, blk;
+	unsigned int	offset, rec_len;
+	int		hash_version, levels, i;
+	errcode_t	retval;
+
+	if (!(fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) ||
+	    (namelen <= 2 && name[0] == '.' &&
+	     (namelen == 1 || name[1] == '.')))
+		return EXT2_ET_DIRHASH_UNSUPP;
+	retval = ext2fs_read_inode(fs, dir, &inode);
+	if (retval)
+		return retval;
+	if (!LINUX_S_ISDIR(inode.i_mode) || !(inode.i_flags & EXT2_INDEX_FL))
+		return EXT2_ET_DIRHASH_UNSUPP;
+	num_blocks = EXT2_I_SIZE(&inode) / fs->blocksize;
+
+	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	if (retval)
+		return retval;
+
+	/* The root follows the "." and ".." entries in block 0 */
+	retval = read_dir_lblk(fs, dir, &inode, 0, buf, 1);
+	if (retval)
+		goto out;
+	dirent = (struct ext2_dir_entry *) buf;
+	root = (struct ext2_dx_root_info *) (buf + 24);
+	if (ext2fs_le16_to_cpu(dirent->rec_len) != 12 ||
+	    root->reserved_zero || root->info_length != 8 ||
+	    root->indirect_levels > 1 ||
+	    root->hash_version > EXT2_HASH_TEA) {
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+		goto out;
+	}
+	hash_version = root->hash_version;
+	if (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+		hash_version += 3;
+	levels = root->indirect_levels;
+
+	retval = ext2fs_dirhash(hash_version, name, namelen,
+				fs->super->s_hash_seed, &hash, 0);
+	if (retval)
+		goto out;
+
+	offset = 24 + root->info_length;
+	for (i = 0; ; i++) {
+		retval = dx_probe(fs, buf, offset, hash, num_blocks, &blk,
+				  &level_next);
+		if (retval)
+			goto out;
+		if (level_next)
+			next_hash = level_next;
+		if (i == levels)
+			break;
+		/* An interior node looks like a single empty dirent */
+		retval = read_dir_lblk(fs, dir, &inode, blk, buf, 1);
+		if (retval)
+			goto out;
+		dirent = (struct ext2_dir_entry *) buf;
+		if (dirent->inode ||
+		    ext2fs_le16_to_cpu(dirent->rec_len) != fs->blocksize) {
+			retval = EXT2_ET_DIRHASH_UNSUPP;
+			goto out;
+		}
+		offset = 8;
+	}
+
+	retval = read_dir_lblk(fs, dir, &inode, blk, buf, 0);
+	if (retval)
+		goto out;
+	for (offset = 0; offset < fs->blocksize - 8; offset += rec_len) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			goto out;
+		if (rec_len < 8 || rec_len % 4 ||
+		    offset + rec_len > fs->blocksize) {
+			retval = EXT2_ET_DIRHASH_UNSUPP;
+			goto out;
+		}
+		if (dirent->inode && (dirent->name_len & 0xFF) == namelen &&
+		    !memcmp(dirent->name, name, namelen)) {
+			*ret = dirent->inode;
+			goto out;
+		}
+	}
+
+	/*
+	 * Names whose hashes collide may spill into the next leaf, which
+	 * is marked by the low bit of its starting hash; leave those to
+	 * the linear scan.
+	 */
+	if ((next_hash & 1) && (next_hash & ~1) == hash)
+		retval = EXT2_ET_DIRHASH_UNSUPP;
+	else
+		retval = EXT2_ET_FILE_NOT_FOUND;
+out:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+/*
+ * The dentry cache remembers (directory, name) -> inode results.  It
+ * is direct mapped: each name hashes to one slot, and a new entry
+ * simply replaces whatever was there.  Any directory block written
+ * through ext2fs_write_dir_block*() empties it.
+ */
+static unsigned int dcache_hash(ext2_ino_t dir, const char *name, int len)
+{
+	unsigned int	h = 2166136261U ^ dir;
+	int		i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) name[i]) * 16777619U;
+	return h;
+}
+
+static struct ext2_dcache_ent *dcache_slot(struct ext2_dentry_cache *dcache,
+					   unsigned int hash)
+{
+	return &dcache->cache[hash & (dcache->cache_size - 1)];
+}
+
+static int dcache_find(ext2_filsys fs, ext2_ino_t dir, const char *name,
+		       int len, unsigned int hash, ext2_ino_t *inode)
 {
-	struct lookup_struct *ls = (struct lookup_struct *) priv_data;
+	struct ext2_dcache_ent *ent = dcache_slot(fs->dcache, hash);
 
-	if (ls->len != (dirent->name_len & 0xFF))
+	if (ent->dir != dir || ent->hash != hash || ent->len != len ||
+	    memcmp(ent->name, name, len))
 		return 0;
-	if (strncmp(ls->name, dirent->name, (dirent->name_len & 0xFF)))
+	*inode = ent->ino;
+	return 1;
+}
+
+static void dcache_add(ext2_filsys fs, ext2_ino_t dir, const char *name,
+		       int len, unsigned int hash, ext2_ino_t inode)
+{
+	struct ext2_dcache_ent *ent = dcache_slot(fs->dcache, hash);
+
+	if (ent->dir && ent->len != len) {
+		ext2fs_free_mem(&ent->name);
+		ent->dir = 0;
+		fs->dcache->cache_used--;
+	}
+	if (!ent->dir) {
+		if (ext2fs_get_mem(len ? len : 1, &ent->name))
+			return;
+		fs->dcache->cache_used++;
+	}
+	memcpy(ent->name, name, len);
+	ent->len = len;
+	ent->hash = hash;
+	ent->dir = dir;
+	ent->ino = inode;
+}
+
+/*
+ * Turn on caching of lookup results for this file system, with room
+ * for size entries (rounded up to a power of two; 0 picks a default).
+ */
+errcode_t ext2fs_create_dentry_cache(ext2_filsys fs, unsigned int size)
+{
+	struct ext2_dentry_cache *dcache;
+	unsigned int	n = 1;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (fs->dcache)
 		return 0;
-	*ls->inode = dirent->inode;
-	ls->found++;
-	return DIRENT_ABORT;
+	if (!size)
+		size = DCACHE_DEFAULT_SIZE;
+	while (n < size)
+		n <<= 1;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2_dentry_cache), &dcache);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(n, sizeof(struct ext2_dcache_ent),
+				  &dcache->cache);
+	if (retval) {
+		ext2fs_free_mem(&dcache);
+		return retval;
+	}
+	memset(dcache->cache, 0, n * sizeof(struct ext2_dcache_ent));
+	dcache->cache_size = n;
+	dcache->cache_used = 0;
+	fs->dcache = dcache;
+	return 0;
+}
+
+/* Forget the cached lookup of name in dir, if there is one */
+void ext2fs_forget_dentry(ext2_filsys fs, ext2_ino_t dir, const char *name,
+			  int len)
+{
+	unsigned int	hash;
+	ext2_ino_t	ino;
+	struct ext2_dcache_ent *ent;
+
+	if (!fs->dcache || !fs->dcache->cache_used)
+		return;
+	hash = dcache_hash(dir, name, len);
+	if (!dcache_find(fs, dir, name, len, hash, &ino))
+		return;
+	ent = dcache_slot(fs->dcache, hash);
+	ext2fs_free_mem(&ent->name);
+	ent->dir = 0;
+	fs->dcache->cache_used--;
 }
 
+/* Forget every cached lookup result */
+void ext2fs_flush_dentry_cache(ext2_filsys fs)
+{
+	struct ext2_dentry_cache *dcache = fs->dcache;
+	unsigned int	i;
+
+	if (!dcache || !dcache->cache_used)
+		return;
+	for (i = 0; i < dcache->cache_size; i++) {
+		if (!dcache->cache[i].dir)
+			continue;
+		ext2fs_free_mem(&dcache->cache[i].name);
+		dcache->cache[i].dir = 0;
+	}
+	dcache->cache_used = 0;
+}
+
+void ext2fs_free_dentry_cache(ext2_filsys fs)
+{
+	if (!fs->dcache)
+		return;
+	ext2fs_flush_dentry_cache(fs);
+	ext2fs_free_mem(&fs->dcache->cache);
+	ext2fs_free_mem(&fs->dcache);
+}
 
 errcode_t ext2fs_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
 			int namelen, char *buf, ext2_ino_t *inode)
 {
 	errcode_t	retval;
-	struct lookup_struct ls;
+	ext2_dir_cursor	cursor;
+	struct ext2_dir_entry *dirent;
+	unsigned int	hash = 0;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
-	ls.name = name;
-	ls.len = namelen;
-	ls.inode = inode;
-	ls.found = 0;
+	if (fs->dcache) {
+		hash = dcache_hash(dir, name, namelen);
+		if (dcache_find(fs, dir, name, namelen, hash, inode))
+			return 0;
+	}
 
-	retval = ext2fs_dir_iterate(fs, dir, 0, buf, lookup_proc, &ls);
-	if (retval)
+	retval = dx_lookup(fs, dir, name, namelen, inode);
+	if (retval == 0)
+		goto found;
+	if (retval == EXT2_ET_FILE_NOT_FOUND)
 		return retval;
 
-	return (ls.found) ? 0 : EXT2_ET_FILE_NOT_FOUND;
+	retval = ext2fs_open_dir_cursor(fs, dir, 0, &cursor);
+	if (retval)
+		return retval;
+	while (!(retval = ext2fs_dir_cursor_next(cursor, &dirent, 0)) &&
+	       dirent) {
+		if ((dirent->name_len & 0xFF) == namelen &&
+		    !strncmp(name, dirent->name, namelen)) {
+			*inode = dirent->inode;
+			break;
+		}
+	}
+	ext2fs_close_dir_cursor(cursor);
+	if (retval)
+		return retval;
+	if (!dirent)
+		return EXT2_ET_FILE_NOT_FOUND;
+found:
+	if (fs->dcache)
+		dcache_add(fs, dir, name, namelen, hash, *inode);
+	return 0;
 }
 
 
@@ -35,6 +35,7 @@
 #include "ext2_fs.h"
 #include "e2p/e2p.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 #include "jfs_user.h"
 
 /*
@@ -146,16 +147,25 @@ errfree:
  * via _ret_blk_ and _ret_count_ if they are non-NULL pointers.
  * Returns 0 on success, and an error code on an error.
  *
+ * If the I/O manager can zero the range by itself (for example with
+ * BLKZEROOUT on a block device) that is tried first, then a discard if
+ * the device is known to return zeroes for discarded blocks, and we
+ * only fall back to writing out a buffer full of zeroes if both fail.
+ * The buffer grows with the largest request, up to MAX_STRIDE_LENGTH
+ * blocks, so that big ranges go out in big writes.
+ *
  * As a special case, if the first argument is NULL, then it will
  * attempt to free the static zeroizing buffer.  (This is to keep
  * programs that check for memory leaks happy.)
  */
 #define STRIDE_LENGTH 8
+#define MAX_STRIDE_LENGTH (4194304 / (int) fs->blocksize)
 errcode_t ext2fs_zero_blocks2(ext2_filsys fs, blk64_t blk, int num,
 			      blk64_t *ret_blk, int *ret_count)
 {
-	int		j, count;
+	int		j, count, stride_length;
 	static char	*buf;
+	static size_t	buf_size;
 	errcode_t	retval;
 
 	/* If fs is null, clean up the static buffer and return */
@@ -163,27 +173,49 @@ errcode_t ext2fs_zero_blocks2(ext2_filsys fs, blk64_t blk, int num,
 		if (buf) {
 			free(buf);
 			buf = 0;
+			buf_size = 0;
 		}
 		return 0;
 	}
+	if (num <= 0)
+		return 0;
+
+	/* Try a zero out command, if supported */
+	retval = io_channel_zeroout(fs->io, blk, num);
+	if (retval == 0)
+		return 0;
+	if (io_channel_discard_zeroes_data(fs->io) &&
+	    io_channel_discard(fs->io, blk, num) == 0)
+		return 0;
+
 	/* Allocate the zeroizing buffer if necessary */
-	if (!buf) {
-		buf = malloc(fs->blocksize * STRIDE_LENGTH);
-		if (!buf)
+	stride_length = buf_size / fs->blocksize;
+	if (stride_length < num && stride_length < MAX_STRIDE_LENGTH) {
+		char	*p;
+
+		stride_length = num;
+		if (stride_length < STRIDE_LENGTH)
+			stride_length = STRIDE_LENGTH;
+		if (stride_length > MAX_STRIDE_LENGTH)
+			stride_length = MAX_STRIDE_LENGTH;
+		p = realloc(buf, (size_t) fs->blocksize * stride_length);
+		if (!p)
 			return ENOMEM;
-		memset(buf, 0, fs->blocksize * STRIDE_LENGTH);
+		buf = p;
+		buf_size = (size_t) fs->blocksize * stride_length;
+		memset(buf, 0, buf_size);
 	}
 	/* OK, do the write loop */
 	j=0;
 	while (j < num) {
-		if (blk % STRIDE_LENGTH) {
-			count = STRIDE_LENGTH - (blk % STRIDE_LENGTH);
+		if (blk % stride_length) {
+			count = stride_length - (blk % stride_length);
 			if (count > (num - j))
 				count = num - j;
 		} else {
 			count = num - j;
-			if (count > STRIDE_LENGTH)
-				count = STRIDE_LENGTH;
+			if (count > stride_length)
+				count = stride_length;
 		}
 		retval = io_channel_write_blk64(fs->io, blk, count, buf);
 		if (retval) {
@@ -293,6 +325,107 @@ static int mkjournal_proc(ext2_filsys	fs,
 
 }
 
+/*
+ * Allocate the journal of an extent-mapped file system in as few
+ * extents as the free space allows, looking for free runs from the goal
+ * onwards and then from the start of the file system, and give it to
+ * the inode in one go with ext2fs_extent_build_from_list().  This is
+ * much faster for a big journal than appending it a block at a time,
+ * and each run is zeroed with a single request.
+ */
+static errcode_t alloc_journal_extents(ext2_filsys fs, ext2_ino_t journal_ino,
+				       struct ext2_inode *inode,
+				       struct mkjournal_struct *es)
+{
+	struct ext2fs_extent	*list = 0;
+	unsigned int		count = 0, max = 0, i;
+	blk64_t			start, end, first, last, limit;
+	blk64_t			blk = es->goal, left = es->num_blocks;
+	e2_blkcnt_t		lblk = 0;
+	int			wrapped = 0;
+	errcode_t		retval = 0;
+
+	first = fs->super->s_first_data_block;
+	last = ext2fs_blocks_count(fs->super) - 1;
+	while (left) {
+		limit = wrapped ? es->goal - 1 : last;
+		if (blk > limit ||
+		    ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk,
+						limit, &start)) {
+			if (wrapped || es->goal == first) {
+				retval = EXT2_ET_BLOCK_ALLOC_FAIL;
+				goto errout;
+			}
+			wrapped = 1;
+			blk = first;
+			continue;
+		}
+		end = start + (left < EXT_INIT_MAX_LEN ? left :
+			       EXT_INIT_MAX_LEN) - 1;
+		if (end > limit)
+			end = limit;
+		if (ext2fs_init_block_uninit_range(fs, fs->block_map, start,
+						   end - start + 1)) {
+			blk = start;
+			continue;
+		}
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map, start,
+							end, &blk) == 0)
+			end = blk - 1;
+
+		if (count == max) {
+			retval = ext2fs_resize_mem(max * sizeof(*list),
+					(max + 16) * sizeof(*list), &list);
+			if (retval)
+				goto errout;
+			max += 16;
+		}
+		list[count].e_lblk = lblk;
+		list[count].e_pblk = start;
+		list[count].e_len = end - start + 1;
+		list[count].e_flags = 0;
+		ext2fs_block_alloc_stats_range(fs, start, end - start + 1, +1);
+		count++;
+
+		lblk += end - start + 1;
+		left -= end - start + 1;
+		blk = end + 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		start = list[i].e_pblk;
+		if (i == 0) {
+			retval = io_channel_write_blk64(fs->io, start, 1,
+							es->buf);
+			if (retval)
+				goto errout;
+			start++;
+		}
+		if (es->flags & EXT2_MKJOURNAL_LAZYINIT)
+			continue;
+		retval = ext2fs_zero_blocks2(fs, start, list[i].e_pblk +
+					     list[i].e_len - start, 0, 0);
+		if (retval)
+			goto errout;
+	}
+
+	retval = ext2fs_extent_build_from_list(fs, journal_ino, inode,
+					       list, count);
+	if (retval)
+		goto errout;
+	es->newblocks = es->num_blocks;
+	count = 0;
+
+errout:
+	/* On failure, give back what was allocated */
+	for (i = 0; i < count; i++)
+		ext2fs_block_alloc_stats_range(fs, list[i].e_pblk,
+					       list[i].e_len, -1);
+	if (list)
+		ext2fs_free_mem(&list);
+	return retval;
+}
+
 /*
  * This function creates a journal using direct I/O routines.
  */
@@ -344,10 +477,7 @@ static errcode_t write_journal_inode(ext2_filsys fs, ext2_ino_t journal_ino,
 	log_flex = 1 << fs->super->s_log_groups_per_flex;
 	if (fs->super->s_log_groups_per_flex && (group > log_flex)) {
 		group = group & ~(log_flex - 1);
-		while ((group < fs->group_desc_count) &&
-		       ext2fs_bg_free_blocks_count(fs, group) == 0)
-			group++;
-		if (group == fs->group_desc_count)
+		if (ext2fs_find_bg_free_blocks(fs, group, 1, &group))
 			group = 0;
 		start = group;
 	} else
@@ -360,11 +490,19 @@ static errcode_t write_journal_inode(ext2_filsys fs, ext2_ino_t journal_ino,
 			group = i;
 
 	es.goal = ext2fs_group_first_block2(fs, group);
-	retval = ext2fs_block_iterate3(fs, journal_ino, BLOCK_FLAG_APPEND,
-				       0, mkjournal_proc, &es);
-	if (es.err) {
-		retval = es.err;
-		goto errout;
+	if ((fs->super->s_feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS) &&
+	    EXT2FS_CLUSTER_RATIO(fs) == 1) {
+		retval = alloc_journal_extents(fs, journal_ino, &inode, &es);
+		if (retval)
+			goto errout;
+	} else {
+		retval = ext2fs_block_iterate3(fs, journal_ino,
+					       BLOCK_FLAG_APPEND, 0,
+					       mkjournal_proc, &es);
+		if (es.err) {
+			retval = es.err;
+			goto errout;
+		}
 	}
 	if (es.zero_count) {
 		retval = ext2fs_zero_blocks2(fs, es.blk_to_zero,
@@ -22,6 +22,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
@@ -224,6 +231,189 @@ out:
 	return retval;
 }
 
+/*
+ * The MMP heartbeat.  Rather than relying on the program to call
+ * ext2fs_mmp_update() often enough, ext2fs_mmp_start_heartbeat() forks
+ * a helper process which opens the device on its own O_DIRECT file
+ * descriptor and rewrites the MMP block's timestamp every update
+ * interval, however long the program spends between calls.  Each time,
+ * it first checks that the block still holds what it last wrote, and
+ * exits with one of the codes below if it doesn't or the I/O fails;
+ * ext2fs_mmp_update() then only has to look whether the helper is
+ * still running.  The helper stops when the control pipe is closed,
+ * including when the program dies.
+ */
+#define MMP_HB_STOPPED		0
+#define MMP_HB_CHANGED		1
+#define MMP_HB_OPEN_FAILED	2
+#define MMP_HB_READ_FAILED	3
+#define MMP_HB_WRITE_FAILED	4
+
+#if defined(HAVE_SYS_WAIT_H) && defined(HAVE_SYS_SELECT_H)
+static void mmp_heartbeat(ext2_filsys fs, int ctl_fd, pid_t parent)
+{
+	struct mmp_struct *mmp;
+	ext2_loff_t	offset = fs->super->s_mmp_block * fs->blocksize;
+	unsigned int	interval;
+	struct timeval	tv;
+	fd_set		rfds;
+	char		*buf, *cmp;
+	int		fd, align;
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+
+	interval = fs->super->s_mmp_update_interval;
+	if (interval < EXT4_MMP_MIN_CHECK_INTERVAL)
+		interval = EXT4_MMP_MIN_CHECK_INTERVAL;
+	if (interval > EXT4_MMP_MAX_UPDATE_INTERVAL)
+		interval = EXT4_MMP_MAX_UPDATE_INTERVAL;
+
+	fd = open(fs->device_name, O_RDWR | O_DIRECT);
+	if (fd < 0)
+		_exit(MMP_HB_OPEN_FAILED);
+	align = ext2fs_get_dio_alignment(fd);
+	if (ext2fs_get_memalign(fs->blocksize, align, &buf) ||
+	    ext2fs_get_memalign(fs->blocksize, align, &cmp))
+		_exit(MMP_HB_OPEN_FAILED);
+
+	/* Work on the block as it is on disk */
+	memcpy(buf, fs->mmp_buf, fs->blocksize);
+	mmp = (struct mmp_struct *) buf;
+#ifdef WORDS_BIGENDIAN
+	ext2fs_swap_mmp(mmp);
+#endif
+
+	while (1) {
+		FD_ZERO(&rfds);
+		FD_SET(ctl_fd, &rfds);
+		tv.tv_sec = interval;
+		tv.tv_usec = 0;
+		if (select(ctl_fd + 1, &rfds, 0, 0, &tv) != 0 ||
+		    getppid() != parent)
+			_exit(MMP_HB_STOPPED);
+
+		if (ext2fs_llseek(fd, offset, SEEK_SET) != offset ||
+		    read(fd, cmp, fs->blocksize) != (ssize_t) fs->blocksize)
+			_exit(MMP_HB_READ_FAILED);
+		if (memcmp(cmp, buf, sizeof(struct mmp_struct)))
+			_exit(MMP_HB_CHANGED);
+
+		gettimeofday(&tv, 0);
+		mmp->mmp_time = ext2fs_cpu_to_le64(tv.tv_sec);
+		if (ext2fs_llseek(fd, offset, SEEK_SET) != offset ||
+		    write(fd, buf, fs->blocksize) != (ssize_t) fs->blocksize ||
+		    fsync(fd))
+			_exit(MMP_HB_WRITE_FAILED);
+	}
+}
+
+/*
+ * Start the heartbeat helper.  If this fails, the program can go on
+ * calling ext2fs_mmp_update() as before.
+ */
+errcode_t ext2fs_mmp_start_heartbeat(ext2_filsys fs)
+{
+	int	ctl[2];
+	pid_t	pid, parent = getpid();
+
+	if (!(fs->super->s_feature_incompat & EXT4_FEATURE_INCOMPAT_MMP) ||
+	    !(fs->flags & EXT2_FLAG_RW) || (fs->flags & EXT2_FLAG_SKIP_MMP) ||
+	    !fs->mmp_buf)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (fs->mmp_heartbeat_pid)
+		return 0;
+
+	if (pipe(ctl) < 0)
+		return errno;
+	pid = fork();
+	if (pid < 0) {
+		close(ctl[0]);
+		close(ctl[1]);
+		return errno;
+	}
+	if (pid == 0) {
+		close(ctl[1]);
+		mmp_heartbeat(fs, ctl[0], parent);
+	}
+	close(ctl[0]);
+	fs->mmp_heartbeat_pid = pid;
+	fs->mmp_heartbeat_fd = ctl[1];
+	return 0;
+}
+
+/*
+ * Collect the heartbeat helper if it has exited (or, with wait, once
+ * it has), and say why it did.  If it went away without finding
+ * anything wrong, the MMP block is read back so that
+ * ext2fs_mmp_update() can carry on where the helper left off.
+ */
+static errcode_t mmp_heartbeat_reap(ext2_filsys fs, int wait)
+{
+	pid_t	pid;
+	int	status;
+
+	do {
+		pid = waitpid(fs->mmp_heartbeat_pid, &status,
+			      wait ? 0 : WNOHANG);
+	} while (pid < 0 && errno == EINTR);
+	if (pid == 0)
+		return 0;
+
+	if (fs->mmp_heartbeat_fd >= 0)
+		close(fs->mmp_heartbeat_fd);
+	fs->mmp_heartbeat_fd = -1;
+	fs->mmp_heartbeat_pid = 0;
+	if (pid < 0 || !WIFEXITED(status))
+		status = MMP_HB_STOPPED;
+	else
+		status = WEXITSTATUS(status);
+
+	switch (status) {
+	case MMP_HB_CHANGED:
+		/* Leave what is there now in mmp_cmp for the caller */
+		ext2fs_mmp_read(fs, fs->super->s_mmp_block, NULL);
+		return EXT2_ET_MMP_CHANGE_ABORT;
+	case MMP_HB_OPEN_FAILED:
+		return EXT2_ET_MMP_OPEN_DIRECT;
+	case MMP_HB_READ_FAILED:
+		return EXT2_ET_SHORT_READ;
+	case MMP_HB_WRITE_FAILED:
+		return EXT2_ET_SHORT_WRITE;
+	}
+	return ext2fs_mmp_read(fs, fs->super->s_mmp_block, fs->mmp_buf);
+}
+
+/*
+ * Stop the heartbeat helper, and report what it found if it stopped
+ * by itself.
+ */
+errcode_t ext2fs_mmp_stop_heartbeat(ext2_filsys fs)
+{
+	if (!fs->mmp_heartbeat_pid)
+		return 0;
+	close(fs->mmp_heartbeat_fd);
+	fs->mmp_heartbeat_fd = -1;
+	return mmp_heartbeat_reap(fs, 1);
+}
+#else
+errcode_t ext2fs_mmp_start_heartbeat(ext2_filsys fs EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+static errcode_t mmp_heartbeat_reap(ext2_filsys fs EXT2FS_ATTR((unused)),
+				    int wait EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+
+errcode_t ext2fs_mmp_stop_heartbeat(ext2_filsys fs EXT2FS_ATTR((unused)))
+{
+	return 0;
+}
+#endif
+
 /*
  * Make sure that the fs is not mounted or being fsck'ed while opening the fs.
  */
@@ -331,6 +521,12 @@ errcode_t ext2fs_mmp_stop(ext2_filsys fs)
 	struct mmp_struct *mmp, *mmp_cmp;
 	errcode_t retval = 0;
 
+	/* Don't mark the MMP block clean if somebody else has taken it */
+	if (ext2fs_mmp_stop_heartbeat(fs) == EXT2_ET_MMP_CHANGE_ABORT) {
+		retval = EXT2_ET_MMP_CHANGE_ABORT;
+		goto mmp_error;
+	}
+
 	if (!(fs->super->s_feature_incompat & EXT4_FEATURE_INCOMPAT_MMP) ||
 	    !(fs->flags & EXT2_FLAG_RW) || (fs->flags & EXT2_FLAG_SKIP_MMP))
 		goto mmp_error;
@@ -374,6 +570,9 @@ errcode_t ext2fs_mmp_update(ext2_filsys fs)
 	    !(fs->flags & EXT2_FLAG_RW) || (fs->flags & EXT2_FLAG_SKIP_MMP))
 		return 0;
 
+	if (fs->mmp_heartbeat_pid)
+		return mmp_heartbeat_reap(fs, 0);
+
 	gettimeofday(&tv, 0);
 	if (tv.tv_sec - fs->mmp_last_written < EXT2_MIN_MMP_UPDATE_INTERVAL)
 		return 0;
@@ -67,6 +67,82 @@ blk_t ext2fs_descriptor_block_loc(ext2_filsys fs, blk_t group_block, dgrp_t i)
 	return ext2fs_descriptor_block_loc2(fs, group_block, i);
 }
 
+/*
+ * Read the descriptor blocks first to first + count - 1 of the group
+ * descriptor table, skipping those which have already been read when
+ * the file system was opened with EXT2_FLAG_LAZY_DESC.  Blocks which
+ * lie next to each other on disk are read together.  With meta_bg most
+ * of them are far apart, so the kernel is told about all of them before
+ * the first one is read.
+ */
+errcode_t ext2fs_read_desc_blocks(ext2_filsys fs, unsigned long first,
+				  unsigned long count)
+{
+	unsigned long	i, n, end = first + count;
+	blk64_t		blk;
+	char		*dest;
+	errcode_t	retval;
+	int		pass;
+#ifdef WORDS_BIGENDIAN
+	unsigned int	groups_per_block = EXT2_DESC_PER_BLOCK(fs->super);
+	unsigned int	j;
+#endif
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = first; i < end; i += n) {
+			n = 1;
+			if (fs->desc_unread && !fs->desc_unread[i])
+				continue;
+			blk = ext2fs_descriptor_block_loc2(fs,
+						fs->desc_group_block, i);
+			while (i + n < end &&
+			       !(fs->desc_unread && !fs->desc_unread[i + n]) &&
+			       ext2fs_descriptor_block_loc2(fs,
+					fs->desc_group_block, i + n) == blk + n)
+				n++;
+			if (pass == 0) {
+				if (n == count)
+					break;
+				io_channel_cache_readahead(fs->io, blk, n);
+				continue;
+			}
+			dest = (char *) fs->group_desc + i * fs->blocksize;
+			retval = io_channel_read_blk64(fs->io, blk, n, dest);
+			if (retval)
+				return retval;
+#ifdef WORDS_BIGENDIAN
+			for (j = 0; j < n * groups_per_block; j++)
+				ext2fs_swap_group_desc2(fs,
+					(struct ext2_group_desc *) (dest +
+					j * EXT2_DESC_SIZE(fs->super)));
+#endif
+			if (fs->desc_unread)
+				memset(fs->desc_unread + i, 0, n);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read whatever is left of the group descriptor table of a file system
+ * opened with EXT2_FLAG_LAZY_DESC, for callers which are about to look
+ * at all of it.
+ */
+errcode_t ext2fs_read_group_descs(ext2_filsys fs)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!fs->desc_unread)
+		return 0;
+	retval = ext2fs_read_desc_blocks(fs, 0, fs->desc_blocks);
+	if (retval)
+		return retval;
+	ext2fs_free_mem(&fs->desc_unread);
+	return 0;
+}
+
 errcode_t ext2fs_open(const char *name, int flags, int superblock,
 		      unsigned int block_size, io_manager manager,
 		      ext2_filsys *ret_fs)
@@ -96,16 +172,10 @@ errcode_t ext2fs_open2(const char *name, const char *io_options,
 {
 	ext2_filsys	fs;
 	errcode_t	retval;
-	unsigned long	i, first_meta_bg;
 	__u32		features;
 	unsigned int	blocks_per_group, io_flags;
-	blk64_t		group_block, blk;
-	char		*dest, *cp;
-#ifdef WORDS_BIGENDIAN
-	unsigned int	groups_per_block;
-	struct ext2_group_desc *gdp;
-	int		j;
-#endif
+	blk64_t		group_block;
+	char		*cp;
 
 	EXT2_CHECK_MAGIC(manager, EXT2_ET_MAGIC_IO_MANAGER);
 
@@ -136,6 +206,16 @@ errcode_t ext2fs_open2(const char *name, const char *io_options,
 		io_flags |= IO_FLAG_EXCLUSIVE;
 	if (flags & EXT2_FLAG_DIRECT_IO)
 		io_flags |= IO_FLAG_DIRECT_IO;
+	/* Limits on the I/O rate put the throttling manager on top */
+	if (throttle_io_wanted(io_options)) {
+		set_throttle_io_backing_manager(manager);
+		manager = throttle_io_manager;
+	}
+	/* Staging writes in memory puts the staging manager above that */
+	if (stage_io_wanted(io_options)) {
+		set_stage_io_backing_manager(manager);
+		manager = stage_io_manager;
+	}
 	retval = manager->open(fs->device_name, io_flags, &fs->io);
 	if (retval)
 		goto cleanup;
@@ -343,41 +423,21 @@ errcode_t ext2fs_open2(const char *name, const char *io_options,
 		group_block = fs->super->s_first_data_block;
 	if (group_block == 0 && fs->blocksize == 1024)
 		group_block = 1; /* Deal with 1024 blocksize && bigalloc */
-	dest = (char *) fs->group_desc;
-#ifdef WORDS_BIGENDIAN
-	groups_per_block = EXT2_DESC_PER_BLOCK(fs->super);
-#endif
-	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
-		first_meta_bg = fs->super->s_first_meta_bg;
-	else
-		first_meta_bg = fs->desc_blocks;
-	if (first_meta_bg) {
-		retval = io_channel_read_blk(fs->io, group_block+1,
-					     first_meta_bg, dest);
+	fs->desc_group_block = group_block;
+	if ((flags & EXT2_FLAG_LAZY_DESC) && !(flags & EXT2_FLAG_IMAGE_FILE) &&
+	    !(superblock > 1 && EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM))) {
+		/* Read them as they are needed; see ext2fs_group_desc() */
+		memset(fs->group_desc, 0, (size_t) fs->desc_blocks *
+		       fs->blocksize);
+		retval = ext2fs_get_mem(fs->desc_blocks, &fs->desc_unread);
 		if (retval)
 			goto cleanup;
-#ifdef WORDS_BIGENDIAN
-		gdp = (struct ext2_group_desc *) dest;
-		for (j=0; j < groups_per_block*first_meta_bg; j++) {
-			gdp = ext2fs_group_desc(fs, fs->group_desc, j);
-			ext2fs_swap_group_desc2(fs, gdp);
-		}
-#endif
-		dest += fs->blocksize*first_meta_bg;
-	}
-	for (i=first_meta_bg ; i < fs->desc_blocks; i++) {
-		blk = ext2fs_descriptor_block_loc2(fs, group_block, i);
-		retval = io_channel_read_blk64(fs->io, blk, 1, dest);
+		memset(fs->desc_unread, 1, fs->desc_blocks);
+	} else {
+		retval = ext2fs_read_desc_blocks(fs, 0, fs->desc_blocks);
 		if (retval)
 			goto cleanup;
-#ifdef WORDS_BIGENDIAN
-		for (j=0; j < groups_per_block; j++) {
-			gdp = ext2fs_group_desc(fs, fs->group_desc,
-						i * groups_per_block + j);
-			ext2fs_swap_group_desc2(fs, gdp);
-		}
-#endif
-		dest += fs->blocksize;
 	}
 
 	fs->stride = fs->super->s_raid_stride;
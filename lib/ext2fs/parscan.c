@@ -0,0 +1,266 @@
+/*
+ * parscan.c --- scan the inode table from several processes at once
+ *
+ * ext2fs_get_next_inode() walks the inode table one block group at a
+ * time, so a program which looks at every inode waits for each piece
+ * of the table in turn.  ext2fs_parallel_inode_scan() splits the block
+ * groups into shards with about the same number of inodes in use, and
+ * scans each shard in a worker process of its own, with its own scan
+ * handle and buffers.
+ *
+ * The library keeps caches in the file system handle and isn't safe to
+ * use from several threads, so the workers are forked processes: each
+ * gets a private copy of the handle, and since the unix I/O manager
+ * reads with pread() they can share its file descriptor.  The price is
+ * that nothing the callback does survives the worker except what it
+ * writes into its shard's data, which is copied back to the caller
+ * once every worker is done.  The callback must only read from the
+ * file system.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && \
+	defined(MAP_ANONYMOUS) && defined(HAVE_SYS_WAIT_H)
+#define HAVE_SCAN_WORKERS
+#endif
+
+#define PARSCAN_MAX_WORKERS	64
+
+/* What a worker hands back, followed by its shard data */
+struct parscan_result {
+	errcode_t	retval;
+	int		done;
+};
+
+#define PARSCAN_SLOT(size) \
+	((sizeof(struct parscan_result) + (size) + 7) & ~((size_t) 7))
+
+/* The number of inodes of a group which may be in use */
+static ext2_ino_t group_inodes(ext2_filsys fs, dgrp_t group)
+{
+	ext2_ino_t	n = fs->super->s_inodes_per_group;
+
+	if (!EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+		return n;
+	if (ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+		return 0;
+	return n - ext2fs_bg_itable_unused(fs, group);
+}
+
+/*
+ * Work out which block groups make up a shard: num_shards runs of
+ * consecutive groups, each with about the same number of inodes in
+ * use.  Some shards may come out empty (*num_groups == 0) when there
+ * are fewer groups than shards.
+ */
+void ext2fs_inode_scan_shard(ext2_filsys fs, int shard, int num_shards,
+			     dgrp_t *first_group, dgrp_t *num_groups)
+{
+	unsigned long long total = 0, sum = 0;
+	dgrp_t		g, start, end;
+
+	if (num_shards < 1)
+		num_shards = 1;
+	for (g = 0; g < fs->group_desc_count; g++)
+		total += group_inodes(fs, g);
+
+	if (total == 0) {
+		start = (unsigned long long) fs->group_desc_count *
+			shard / num_shards;
+		end = (unsigned long long) fs->group_desc_count *
+			(shard + 1) / num_shards;
+	} else {
+		/* a shard starts at the first group with enough before it */
+		start = end = fs->group_desc_count;
+		for (g = 0; g < fs->group_desc_count; g++) {
+			if (start == fs->group_desc_count &&
+			    sum * num_shards >= total * shard)
+				start = g;
+			if (sum * num_shards >= total * (shard + 1)) {
+				end = g;
+				break;
+			}
+			sum += group_inodes(fs, g);
+		}
+		if (shard == num_shards - 1)
+			end = fs->group_desc_count;
+		if (end < start)
+			end = start;
+	}
+	*first_group = start;
+	*num_groups = end - start;
+}
+
+static errcode_t scan_shard(ext2_filsys fs, int shard, int num_shards,
+			    int scan_flags, ext2_parallel_scan_func func,
+			    void *shard_data, void *priv_data)
+{
+	ext2_inode_scan	scan;
+	struct ext2_inode *inode;
+	ext2_ino_t	ino;
+	dgrp_t		first, num;
+	int		inode_size = EXT2_INODE_SIZE(fs->super);
+	errcode_t	retval;
+
+	ext2fs_inode_scan_shard(fs, shard, num_shards, &first, &num);
+	if (num == 0)
+		return 0;
+
+	retval = ext2fs_get_mem(inode_size, &inode);
+	if (retval)
+		return retval;
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval)
+		goto out_free;
+	ext2fs_inode_scan_flags(scan, scan_flags, 0);
+	retval = ext2fs_inode_scan_set_groups(scan, first, num);
+	if (retval)
+		goto out_close;
+
+	while (1) {
+		retval = ext2fs_get_next_inode_full(scan, &ino, inode,
+						    inode_size);
+		if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+			continue;
+		if (retval || !ino)
+			break;
+		retval = (func)(fs, ino, inode, shard_data, priv_data);
+		if (retval)
+			break;
+	}
+
+out_close:
+	ext2fs_close_inode_scan(scan);
+out_free:
+	ext2fs_free_mem(&inode);
+	return retval;
+}
+
+/*
+ * Call func for every inode of the file system, from num_workers
+ * worker processes which each scan a shard of the block groups.
+ * shard_data points to num_workers consecutive areas of
+ * shard_data_size bytes, set up by the caller; func gets the area of
+ * the shard it is called for, and whatever it leaves there is copied
+ * back when the scan is done.  scan_flags are EXT2_SF_* flags to set
+ * on each scan handle.
+ *
+ * A worker stops at the first error returned by func or by the scan;
+ * the error of the first shard which failed is returned.  Changes to
+ * the file system must have been flushed before the call, since the
+ * workers see it as it is on disk.  With a single worker, or where
+ * processes can't be forked, the shards are scanned in turn by the
+ * calling process, which gives the same results.
+ */
+errcode_t ext2fs_parallel_inode_scan(ext2_filsys fs, int num_workers,
+				     int scan_flags,
+				     ext2_parallel_scan_func func,
+				     void *shard_data, size_t shard_data_size,
+				     void *priv_data)
+{
+#ifdef HAVE_SCAN_WORKERS
+	struct parscan_result *res;
+	pid_t		pids[PARSCAN_MAX_WORKERS];
+	char		*shared;
+	size_t		slot = PARSCAN_SLOT(shard_data_size);
+	int		status;
+#endif
+	char		*data = shard_data;
+	errcode_t	retval, first_err = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (num_workers < 1 || num_workers > PARSCAN_MAX_WORKERS)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	/* the workers would write back dirty cache blocks they evict */
+	retval = io_channel_flush(fs->io);
+	if (retval)
+		return retval;
+
+#ifdef HAVE_SCAN_WORKERS
+	if (num_workers == 1)
+		goto in_process;
+
+	shared = mmap(NULL, slot * num_workers, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		goto in_process;
+	for (i = 0; i < num_workers; i++) {
+		res = (struct parscan_result *) (shared + i * slot);
+		res->retval = 0;
+		res->done = 0;
+		memcpy(res + 1, data + i * shard_data_size, shard_data_size);
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		res = (struct parscan_result *) (shared + i * slot);
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			fs->flags &= ~EXT2_FLAG_RW;
+			res->retval = scan_shard(fs, i, num_workers,
+						 scan_flags, func, res + 1,
+						 priv_data);
+			res->done = 1;
+			_exit(0);
+		}
+		/* no process for this shard; scan it here instead */
+		if (pids[i] < 0) {
+			res->retval = scan_shard(fs, i, num_workers,
+						 scan_flags, func, res + 1,
+						 priv_data);
+			res->done = 1;
+		}
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		res = (struct parscan_result *) (shared + i * slot);
+		if (pids[i] > 0) {
+			while (waitpid(pids[i], &status, 0) < 0 &&
+			       errno == EINTR)
+				;
+		}
+		if (!res->done)
+			res->retval = EXT2_ET_INODE_SCAN_WORKER;
+		if (res->retval && !first_err)
+			first_err = res->retval;
+		memcpy(data + i * shard_data_size, res + 1, shard_data_size);
+	}
+	munmap(shared, slot * num_workers);
+	return first_err;
+
+in_process:
+#endif
+	for (i = 0; i < num_workers; i++) {
+		retval = scan_shard(fs, i, num_workers, scan_flags, func,
+				    data + i * shard_data_size, priv_data);
+		if (retval && !first_err)
+			first_err = retval;
+	}
+	return first_err;
+}
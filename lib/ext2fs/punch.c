@@ -21,6 +21,9 @@
 
 #undef PUNCH_DEBUG
 
+/* The highest logical block an extent can map */
+#define PUNCH_MAX_LBLK	((1ULL << 32) - 1)
+
 /*
  * This function returns 1 if the specified block is all zeros
  */
@@ -48,11 +51,12 @@ static errcode_t ind_punch(ext2_filsys fs, struct ext2_inode *inode,
 			   char *block_buf, blk_t *p, int level,
 			   blk_t start, blk_t count, int max)
 {
-	errcode_t	retval;
+	errcode_t	retval = 0;
 	blk_t		b;
 	int		i;
 	blk64_t		offset, incr;
 	int		freed = 0;
+	blk_t		run_start = 0, run_len = 0;
 
 #ifdef PUNCH_DEBUG
 	printf("Entering ind_punch, level %d, start %u, count %u, "
@@ -72,27 +76,40 @@ static errcode_t ind_punch(ext2_filsys fs, struct ext2_inode *inode,
 #endif
 			retval = ext2fs_read_ind_block(fs, b, block_buf);
 			if (retval)
-				return retval;
+				goto out;
 			start2 = (start > offset) ? start - offset : 0;
 			retval = ind_punch(fs, inode, block_buf + fs->blocksize,
 					   (blk_t *) block_buf, level - 1,
 					   start2, count - offset,
 					   fs->blocksize >> 2);
 			if (retval)
-				return retval;
+				goto out;
 			retval = ext2fs_write_ind_block(fs, b, block_buf);
 			if (retval)
-				return retval;
+				goto out;
 			if (!check_zero_block(block_buf, fs->blocksize))
 				continue;
 		}
 #ifdef PUNCH_DEBUG
 		printf("Freeing block %u (offset %llu)\n", b, offset);
 #endif
-		ext2fs_block_alloc_stats(fs, b, -1);
+		/* Free runs of consecutive blocks together */
+		if (run_len && b != run_start + run_len) {
+			ext2fs_block_alloc_stats_range(fs, run_start,
+						       run_len, -1);
+			run_len = 0;
+		}
+		if (!run_len)
+			run_start = b;
+		run_len++;
 		*p = 0;
 		freed++;
 	}
+out:
+	if (run_len)
+		ext2fs_block_alloc_stats_range(fs, run_start, run_len, -1);
+	if (retval)
+		return retval;
 #ifdef PUNCH_DEBUG
 	printf("Freed %d blocks\n", freed);
 #endif
@@ -187,11 +204,12 @@ static errcode_t punch_extent_blocks(ext2_filsys fs, ext2_ino_t ino,
 	__u32		cluster_freed;
 	errcode_t	retval = 0;
 
-	/* No bigalloc?  Just free each block. */
+	/* No bigalloc?  Just free the blocks. */
 	if (EXT2FS_CLUSTER_RATIO(fs) == 1) {
 		*freed += free_count;
-		while (free_count-- > 0)
-			ext2fs_block_alloc_stats2(fs, free_start++, -1);
+		if (free_count)
+			ext2fs_block_alloc_stats_range(fs, free_start,
+						       free_count, -1);
 		return retval;
 	}
 
@@ -219,10 +237,11 @@ static errcode_t punch_extent_blocks(ext2_filsys fs, ext2_ino_t ino,
 	}
 
 	/* Free whole clusters from the middle of the range. */
-	while (free_count > 0 && free_count >= EXT2FS_CLUSTER_RATIO(fs)) {
-		ext2fs_block_alloc_stats2(fs, free_start, -1);
-		freed_now++;
-		cluster_freed = EXT2FS_CLUSTER_RATIO(fs);
+	if (free_count >= EXT2FS_CLUSTER_RATIO(fs)) {
+		cluster_freed = free_count & ~EXT2FS_CLUSTER_MASK(fs);
+		ext2fs_block_alloc_stats_range(fs, free_start, cluster_freed,
+					       -1);
+		freed_now += EXT2FS_B2C(fs, cluster_freed);
 		free_count -= cluster_freed;
 		free_start += cluster_freed;
 		lfree_start += cluster_freed;
@@ -245,6 +264,231 @@ errout:
 	return retval;
 }
 
+/*
+ * The blocks found under an index entry which is about to be removed:
+ * the data extents of its leaves and the tree blocks themselves.
+ */
+struct punch_subtree {
+	struct ext2fs_extent	*data;
+	blk64_t			*nodes;
+	size_t			num_data, max_data;
+	size_t			num_nodes, max_nodes;
+	blk64_t			start, end;
+};
+
+static errcode_t subtree_add(void *ptr, size_t *num, size_t *max,
+			     size_t size)
+{
+	errcode_t	retval;
+	size_t		new_max;
+
+	if (*num < *max)
+		return 0;
+	new_max = *max ? *max * 2 : 32;
+	retval = ext2fs_resize_mem(*max * size, new_max * size, ptr);
+	if (retval)
+		return retval;
+	*max = new_max;
+	return 0;
+}
+
+/*
+ * Record the tree block blk, which should be a node of the given depth,
+ * and everything below it.  Nothing is freed here, so a subtree which
+ * turns out to be damaged, or to map blocks outside of the punch
+ * range, is simply left for the per-extent code to deal with.
+ */
+static errcode_t collect_subtree(ext2_filsys fs, struct punch_subtree *st,
+				 blk64_t blk, int depth)
+{
+	struct ext3_extent_header	*eh;
+	struct ext3_extent_idx		*ix;
+	struct ext3_extent		*ex;
+	struct ext2fs_extent		*data;
+	char				*buf;
+	blk64_t				lblk;
+	__u32				len;
+	int				i, entries;
+	errcode_t			retval;
+
+	if (blk < fs->super->s_first_data_block ||
+	    blk >= ext2fs_blocks_count(fs->super))
+		return EXT2_ET_EXTENT_HEADER_BAD;
+
+	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+	if (retval)
+		goto errout;
+	eh = (struct ext3_extent_header *) buf;
+	retval = ext2fs_extent_header_verify(buf, fs->blocksize);
+	if (retval)
+		goto errout;
+	if (ext2fs_le16_to_cpu(eh->eh_depth) != depth) {
+		retval = EXT2_ET_EXTENT_HEADER_BAD;
+		goto errout;
+	}
+
+	retval = subtree_add(&st->nodes, &st->num_nodes, &st->max_nodes,
+			     sizeof(blk64_t));
+	if (retval)
+		goto errout;
+	st->nodes[st->num_nodes++] = blk;
+
+	entries = ext2fs_le16_to_cpu(eh->eh_entries);
+	for (i = 0; i < entries; i++) {
+		if (depth) {
+			ix = EXT_FIRST_INDEX(eh) + i;
+			blk = ext2fs_le32_to_cpu(ix->ei_leaf) +
+				((__u64) ext2fs_le16_to_cpu(ix->ei_leaf_hi)
+				 << 32);
+			retval = collect_subtree(fs, st, blk, depth - 1);
+			if (retval)
+				goto errout;
+			continue;
+		}
+		ex = EXT_FIRST_EXTENT(eh) + i;
+		lblk = ext2fs_le32_to_cpu(ex->ee_block);
+		len = ext2fs_le16_to_cpu(ex->ee_len);
+		if (len > EXT_INIT_MAX_LEN)
+			len -= EXT_INIT_MAX_LEN;
+		if (!len)
+			continue;
+		if (lblk < st->start || lblk + len - 1 > st->end) {
+			retval = EXT2_ET_EXTENT_NOT_FOUND;
+			goto errout;
+		}
+		retval = subtree_add(&st->data, &st->num_data, &st->max_data,
+				     sizeof(struct ext2fs_extent));
+		if (retval)
+			goto errout;
+		data = &st->data[st->num_data++];
+		data->e_lblk = lblk;
+		data->e_len = len;
+		data->e_pblk = ext2fs_le32_to_cpu(ex->ee_start) +
+			((__u64) ext2fs_le16_to_cpu(ex->ee_start_hi) << 32);
+	}
+errout:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+/*
+ * The current extent starts inside the punch range.  If the leaf
+ * holding it, or some node above the leaf, covers nothing but blocks
+ * inside the range, remove that whole subtree at once: free its data
+ * blocks and tree blocks directly and delete the index entry pointing
+ * to it, instead of deleting its extents one at a time and rewriting
+ * the node (and its parents) after each of them.
+ *
+ * On success, *done is set if nothing is mapped past the removed
+ * subtree; otherwise the handle is left at the next extent to look at.
+ * If there is no such subtree, *removed is cleared and the handle is
+ * put back where it was.
+ */
+static errcode_t punch_subtree(ext2_filsys fs, ext2_extent_handle_t handle,
+			       struct ext2fs_extent *extent,
+			       blk64_t start, blk64_t end, int *freed,
+			       int *removed, int *done)
+{
+	struct ext2_extent_info	info;
+	struct ext2fs_extent	ix, top;
+	struct punch_subtree	st;
+	blk64_t			top_end = 0, ix_end, next_lblk;
+	int			level, height = 0;
+	size_t			i;
+	errcode_t		retval;
+
+	*removed = 0;
+	*done = 0;
+	retval = ext2fs_extent_get_info(handle, &info);
+	if (retval || info.curr_level == 0)
+		return retval;
+	level = info.curr_level;
+
+	/* Climb while the parent entry covers only the punch range */
+	while (height < level) {
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_UP, &ix);
+		if (retval)
+			break;
+		if (ix.e_lblk < start)
+			break;
+		retval = ext2fs_extent_get_info(handle, &info);
+		if (retval)
+			break;
+		/*
+		 * The last entry of a node is only bounded by the entries
+		 * of the nodes above it, so assume it extends to the end
+		 * of the file.
+		 */
+		if (info.curr_entry < info.num_entries)
+			ix_end = ix.e_lblk + ix.e_len - 1;
+		else
+			ix_end = PUNCH_MAX_LBLK;
+		if (ix_end > end)
+			break;
+		height++;
+		top = ix;
+		top_end = ix_end;
+	}
+	if (retval || !height) {
+		ext2fs_extent_goto(handle, extent->e_lblk);
+		return retval;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.start = start;
+	st.end = end;
+	if (collect_subtree(fs, &st, top.e_pblk, height - 1)) {
+		retval = ext2fs_extent_goto(handle, extent->e_lblk);
+		goto out;
+	}
+
+	retval = ext2fs_extent_goto2(handle, height, top.e_lblk);
+	if (retval)
+		goto out;
+	dbg_print_extent("deleting subtree", &top);
+	retval = ext2fs_extent_delete(handle, 0);
+	if (retval)
+		goto out;
+	retval = ext2fs_extent_fix_parents(handle);
+	if (retval && retval != EXT2_ET_NO_CURRENT_NODE)
+		goto out;
+	retval = 0;
+
+	for (i = 0; i < st.num_data; i++) {
+		ext2fs_block_alloc_stats_range(fs, st.data[i].e_pblk,
+					       st.data[i].e_len, -1);
+		*freed += st.data[i].e_len;
+	}
+	for (i = 0; i < st.num_nodes; i++)
+		ext2fs_block_alloc_stats2(fs, st.nodes[i], -1);
+	*freed += st.num_nodes;
+	*removed = 1;
+
+	/* Find the first extent past the subtree, if there is one */
+	if (top_end >= PUNCH_MAX_LBLK) {
+		*done = 1;
+		goto out;
+	}
+	next_lblk = top_end + 1;
+	ext2fs_extent_goto(handle, next_lblk);
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, extent);
+	while (!retval && extent->e_lblk + extent->e_len <= next_lblk)
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF,
+					   extent);
+	if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+	    retval == EXT2_ET_NO_CURRENT_NODE) {
+		*done = 1;
+		retval = 0;
+	}
+out:
+	ext2fs_free_mem(&st.data);
+	ext2fs_free_mem(&st.nodes);
+	return retval;
+}
+
 static errcode_t ext2fs_punch_extent(ext2_filsys fs, ext2_ino_t ino,
 				     struct ext2_inode *inode,
 				     blk64_t start, blk64_t end)
@@ -289,6 +533,21 @@ static errcode_t ext2fs_punch_extent(ext2_filsys fs, ext2_ino_t ino,
 		if (start <= extent.e_lblk) {
 			if (end < extent.e_lblk)
 				goto next_extent;
+			if (EXT2FS_CLUSTER_RATIO(fs) == 1) {
+				int	removed, done;
+
+				retval = punch_subtree(fs, handle, &extent,
+						       start, end, &freed,
+						       &removed, &done);
+				if (retval)
+					goto errout;
+				if (done)
+					break;
+				if (removed) {
+					op = EXT2_EXTENT_CURRENT;
+					goto next_extent;
+				}
+			}
 			dbg_printf("Case #%d\n", 1);
 			/* Start of deleted region before extent; 
 			   adjust beginning of extent */
@@ -302,8 +561,13 @@ static errcode_t ext2fs_punch_extent(ext2_filsys fs, ext2_ino_t ino,
 			extent.e_lblk += free_count;
 			extent.e_pblk += free_count;
 		} else if (end >= next-1) {
+			/*
+			 * The punch range starts past this extent, which
+			 * happens when start is in a hole; move on to the
+			 * next one.
+			 */
 			if (start >= next)
-				break;
+				goto next_extent;
 			/* End of deleted region after extent;
 			   adjust end of extent */
 			dbg_printf("Case #%d\n", 2);
@@ -343,6 +607,9 @@ static errcode_t ext2fs_punch_extent(ext2_filsys fs, ext2_ino_t ino,
 		if (extent.e_len) {
 			dbg_print_extent("replacing", &extent);
 			retval = ext2fs_extent_replace(handle, 0, &extent);
+			if (retval)
+				goto errout;
+			retval = ext2fs_extent_fix_parents(handle);
 		} else {
 			struct ext2fs_extent	newex;
 			blk64_t			old_lblk, next_lblk;
@@ -376,6 +643,10 @@ static errcode_t ext2fs_punch_extent(ext2_filsys fs, ext2_ino_t ino,
 			retval = ext2fs_extent_delete(handle, 0);
 			if (retval)
 				goto errout;
+			retval = ext2fs_extent_fix_parents(handle);
+			if (retval && retval != EXT2_ET_NO_CURRENT_NODE)
+				goto errout;
+			retval = 0;
 
 			/* Jump forward to the next extent. */
 			ext2fs_extent_goto(handle, next_lblk);
@@ -25,6 +25,7 @@
 
 #define _LARGEFILE_SOURCE
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
 
 #include <fcntl.h>
 #include <grp.h>
@@ -41,6 +42,9 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <assert.h>
+#if HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#endif
 
 #include "ext2fs/ext2fs.h"
 #include "qcow2.h"
@@ -150,16 +154,102 @@ static int qcow2_copy_data(int fdin, int fdout, ext2_off64_t off_in,
 	return 0;
 }
 
+/*
+ * Clusters which follow one another both in the qcow2 image and in the
+ * raw image are copied together, up to this many bytes at a time.
+ */
+#define QCOW2_COPY_MAX	(4 * 1024 * 1024)
+
+struct qcow2_run {
+	ext2_off64_t	in;
+	ext2_off64_t	out;
+	size_t		len;
+};
+
+struct qcow2_copy {
+	int		fdin, fdout;
+	void		*buf;
+	ext2_off64_t	written;	/* end of what has been copied */
+	ext2_off64_t	old_size;	/* of the raw image, when it's a file */
+	struct qcow2_run pending;	/* being read ahead */
+};
+
+/*
+ * Make sure that a range of the raw image which isn't in the qcow2
+ * image reads back as zeroes.  Only an existing regular file can have
+ * anything there, and a hole is punched in it if possible.
+ */
+static int qcow2_zero_range(struct qcow2_copy *cp, ext2_off64_t start,
+			    ext2_off64_t end)
+{
+	size_t len;
+
+	if (end > cp->old_size)
+		end = cp->old_size;
+	if (start >= end)
+		return 0;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+	if (fallocate(cp->fdout, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      (off_t) start, (off_t) (end - start)) == 0)
+		return 0;
+#endif
+	if (ext2fs_llseek(cp->fdout, start, SEEK_SET) < 0)
+		return errno;
+	memset(cp->buf, 0, QCOW2_COPY_MAX);
+	while (start < end) {
+		len = QCOW2_COPY_MAX;
+		if ((ext2_off64_t) len > end - start)
+			len = end - start;
+		if (write(cp->fdout, cp->buf, len) != (ssize_t) len)
+			return errno;
+		start += len;
+	}
+	return 0;
+}
+
+/*
+ * Copy the run which is being read ahead, and start reading the next
+ * one, so that the reads of one run overlap with the writes of the
+ * one before it.
+ */
+static int qcow2_next_run(struct qcow2_copy *cp, struct qcow2_run *next)
+{
+	struct qcow2_run *run = &cp->pending;
+	int ret;
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	if (next && next->len)
+		(void) posix_fadvise(cp->fdin, next->in, next->len,
+				     POSIX_FADV_WILLNEED);
+#endif
+	if (run->len) {
+		ret = qcow2_zero_range(cp, cp->written, run->out);
+		if (ret)
+			return ret;
+		ret = qcow2_copy_data(cp->fdin, cp->fdout, run->in, run->out,
+				      cp->buf, run->len);
+		if (ret)
+			return ret;
+		cp->written = run->out + run->len;
+	}
+	if (next)
+		*run = *next;
+	else
+		run->len = 0;
+	return 0;
+}
 
 int qcow2_write_raw_image(int qcow2_fd, int raw_fd,
 			      struct ext2_qcow2_hdr *hdr)
 {
 	struct ext2_qcow2_image img;
+	struct qcow2_copy cp;
+	struct qcow2_run run;
+	struct stat st;
 	errcode_t ret = 0;
 	unsigned int l1_index, l2_index;
 	ext2_off64_t offset;
 	blk64_t *l1_table, *l2_table = NULL;
-	void *copy_buf = NULL;
 	size_t size;
 
 	if (hdr->crypt_method)
@@ -176,12 +266,19 @@ int qcow2_write_raw_image(int qcow2_fd, int raw_fd,
 	img.l2_size = 1 << (img.cluster_bits - 3);
 	img.image_size = ext2fs_be64_to_cpu(hdr->size);
 
+	memset(&cp, 0, sizeof(cp));
+	memset(&run, 0, sizeof(run));
+	cp.fdin = qcow2_fd;
+	cp.fdout = raw_fd;
+	if (fstat(raw_fd, &st) == 0 && S_ISREG(st.st_mode))
+		cp.old_size = st.st_size;
 
 	ret = ext2fs_get_memzero(img.cluster_size, &l2_table);
 	if (ret)
 		goto out;
 
-	ret = ext2fs_get_memzero(1 << img.cluster_bits, &copy_buf);
+	ret = ext2fs_get_mem(img.cluster_size > QCOW2_COPY_MAX ?
+			     img.cluster_size : QCOW2_COPY_MAX, &cp.buf);
 	if (ret)
 		goto out;
 
@@ -226,27 +323,48 @@ int qcow2_write_raw_image(int qcow2_fd, int raw_fd,
 			off_out = (l1_index * img.l2_size) +
 				  l2_index;
 			off_out <<= img.cluster_bits;
-			ret = qcow2_copy_data(qcow2_fd, raw_fd, offset,
-					off_out, copy_buf, img.cluster_size);
+			if (run.len && offset == run.in + run.len &&
+			    off_out == run.out + run.len &&
+			    run.len + img.cluster_size <= QCOW2_COPY_MAX) {
+				run.len += img.cluster_size;
+				continue;
+			}
+			ret = qcow2_next_run(&cp, &run);
 			if (ret)
 				goto out;
+			run.in = offset;
+			run.out = off_out;
+			run.len = img.cluster_size;
 		}
 	}
+	ret = qcow2_next_run(&cp, &run);
+	if (!ret)
+		ret = qcow2_next_run(&cp, NULL);
+	if (ret)
+		goto out;
 
-	/* Resize the output image to the filesystem size */
-	if (ext2fs_llseek(raw_fd, img.image_size - 1, SEEK_SET) < 0)
-		return errno;
+	/* What follows the last cluster reads back as zeroes */
+	if (cp.written < (ext2_off64_t) img.image_size) {
+		ret = qcow2_zero_range(&cp, cp.written, img.image_size);
+		if (ret)
+			goto out;
 
-	((char *)copy_buf)[0] = 0;
-	size = write(raw_fd, copy_buf, 1);
-	if (size != 1) {
-		ret = errno;
-		goto out;
+		/* Resize the output image to the filesystem size */
+		if (ext2fs_llseek(raw_fd, img.image_size - 1, SEEK_SET) < 0) {
+			ret = errno;
+			goto out;
+		}
+		((char *)cp.buf)[0] = 0;
+		size = write(raw_fd, cp.buf, 1);
+		if (size != 1) {
+			ret = errno;
+			goto out;
+		}
 	}
 
 out:
-	if (copy_buf)
-		ext2fs_free_mem(&copy_buf);
+	if (cp.buf)
+		ext2fs_free_mem(&cp.buf);
 	if (img.l1_table)
 		ext2fs_free_mem(&img.l1_table);
 	if (l2_table)
@@ -26,6 +26,10 @@
 
 /* Number of l2 tables in memory before writeback */
 #define L2_CACHE_PREALLOC	512
+/* Memory the L2 table cache may grow to; tables are allocated on demand */
+#define L2_CACHE_MEM		(64 * 1024 * 1024)
+/* Memory for full refcount blocks waiting to be written */
+#define REFCOUNT_PENDING_MEM	(16 * 1024 * 1024)
 
 
 #define QCOW_MAGIC (('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
@@ -57,6 +61,41 @@ struct ext2_qcow2_hdr {
 	__u64	snapshots_offset;
 };
 
+/*
+ * Header extensions follow the header in its cluster; the list ends
+ * with one whose magic is QCOW2_EXT_MAGIC_END.  Each is padded to a
+ * multiple of 8 bytes.
+ */
+#define QCOW2_EXT_MAGIC_END		0
+#define QCOW2_EXT_MAGIC_E2_DIGESTS	0xe2d16e57
+
+struct ext2_qcow2_ext {
+	__u32	magic;
+	__u32	len;
+};
+
+/*
+ * e2image -Q -k records a crc32c of every nonzero block of the file
+ * system image, so that a later image of the same file system can be
+ * written against it with -d.  The digests are sorted by block number
+ * and stored in clusters after everything else in the file; they are
+ * not refcounted, so qemu may overwrite them if it writes to the
+ * image, which the crc of the table will show.
+ */
+struct ext2_qcow2_digest_ext {
+	__u64	table_offset;
+	__u64	nr_digests;
+	__u32	table_crc;
+	__u32	reserved;
+	__u8	uuid[16];
+};
+
+struct ext2_qcow2_digest {
+	__u64	blk;
+	__u32	crc;
+	__u32	reserved;
+};
+
 typedef struct ext2_qcow2_l2_table L2_CACHE_HEAD;
 
 struct ext2_qcow2_l2_table {
@@ -71,7 +110,8 @@ struct ext2_qcow2_l2_cache {
 	L2_CACHE_HEAD	*used_tail;
 	L2_CACHE_HEAD	*free_head;
 	__u32		free;
-	__u32		count;
+	__u32		count;		/* most tables the cache may hold */
+	__u32		allocated;
 	__u64		next_offset;
 };
 
@@ -85,6 +125,12 @@ struct ext2_qcow2_refcount {
 	__u32	refcount_block_index;
 
 	__u16	*refcount_block;
+
+	/* Full refcount blocks not yet written, in offset order */
+	char	*pending;
+	__u64	*pending_offset;
+	__u32	pending_count;
+	__u32	pending_max;
 };
 
 struct ext2_qcow2_image {
@@ -0,0 +1,687 @@
+/*
+ * qcow2_io.c --- read-only I/O manager for qcow2 images
+ *
+ * This allows the qcow2 images written by "e2image -Q" to be opened
+ * directly by debugfs, dumpe2fs and e2fsck -n, without converting
+ * them back into a raw image first.  The L1 table is read when the
+ * image is opened; L2 tables and data clusters are read on demand and
+ * kept in two small caches.  Clusters which are not mapped read back
+ * as zeros, as they would from the sparse raw image.
+ *
+ * An image given as an http:// URL is read through the HTTP I/O
+ * manager instead of from a local file.
+ *
+ * An image with a backing file, such as one written by "e2image -Q -d",
+ * reads its unmapped clusters from the backing file, which may have
+ * one in turn.  A backing file name which is not absolute is taken
+ * relative to the directory of the image that names it, as qemu does.
+ *
+ * Compressed clusters and encryption are not supported, since e2image
+ * never writes them.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "qcow2.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+/* Number of L2 tables and of data clusters kept in memory */
+#define QCOW2_L2_CACHE_SIZE	16
+#define QCOW2_DATA_CACHE_SIZE	8
+
+/* The most backing files an image may be stacked on */
+#define QCOW2_MAX_CHAIN		64
+
+struct qcow2_cache_entry {
+	__u64		offset;		/* in the image file; 0 if unused */
+	unsigned long	access_time;
+	void		*buf;
+};
+
+struct qcow2_private_data {
+	int		magic;
+	int		dev;
+	io_channel	image;		/* if the image is not a local file */
+	io_channel	backing;	/* block size 1 */
+	__u64		backing_size;
+	int		cluster_bits;
+	__u32		cluster_size;
+	__u32		l2_size;
+	__u32		l1_size;
+	__u64		*l1_table;	/* in cpu byte order */
+	__u64		image_size;
+	unsigned long	access_time;
+	struct qcow2_cache_entry l2_cache[QCOW2_L2_CACHE_SIZE];
+	struct qcow2_cache_entry data_cache[QCOW2_DATA_CACHE_SIZE];
+	struct struct_io_stats io_stats;
+};
+
+static errcode_t qcow2_open(const char *name, int flags, io_channel *channel);
+static errcode_t qcow2_close(io_channel channel);
+static errcode_t qcow2_set_blksize(io_channel channel, int blksize);
+static errcode_t qcow2_read_blk(io_channel channel, unsigned long block,
+				int count, void *data);
+static errcode_t qcow2_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *data);
+static errcode_t qcow2_flush(io_channel channel);
+static errcode_t qcow2_write_byte(io_channel channel, unsigned long offset,
+				  int size, const void *data);
+static errcode_t qcow2_set_option(io_channel channel, const char *option,
+				  const char *arg);
+static errcode_t qcow2_get_stats(io_channel channel, io_stats *stats);
+static errcode_t qcow2_read_blk64(io_channel channel, unsigned long long block,
+				  int count, void *data);
+static errcode_t qcow2_write_blk64(io_channel channel,
+				   unsigned long long block, int count,
+				   const void *data);
+
+static struct struct_io_manager struct_qcow2_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"QCOW2 I/O Manager",
+	qcow2_open,
+	qcow2_close,
+	qcow2_set_blksize,
+	qcow2_read_blk,
+	qcow2_write_blk,
+	qcow2_flush,
+	qcow2_write_byte,
+	qcow2_set_option,
+	qcow2_get_stats,
+	qcow2_read_blk64,
+	qcow2_write_blk64,
+};
+
+io_manager qcow2_io_manager = &struct_qcow2_manager;
+
+/* How deep in a chain of backing files the image being opened is */
+static int qcow2_chain_depth;
+
+/* Like qcow2_read_header(), for an image read through an io_channel */
+static struct ext2_qcow2_hdr *qcow2_read_image_header(io_channel image)
+{
+	struct ext2_qcow2_hdr *hdr;
+
+	if (ext2fs_get_mem(sizeof(struct ext2_qcow2_hdr), &hdr))
+		return NULL;
+	if (io_channel_read_blk64(image, 0, -(int) sizeof(*hdr), hdr) ||
+	    ext2fs_be32_to_cpu(hdr->magic) != QCOW_MAGIC ||
+	    ext2fs_be32_to_cpu(hdr->version) != 2) {
+		ext2fs_free_mem(&hdr);
+		return NULL;
+	}
+	return hdr;
+}
+
+/*
+ * Returns 1 if the named file (or URL) starts with a qcow2 header.
+ */
+int qcow2_io_probe(const char *name)
+{
+	struct ext2_qcow2_hdr *hdr;
+	io_channel image;
+	int fd;
+
+	if (http_io_probe(name)) {
+		if (http_io_manager->open(name, 0, &image))
+			return 0;
+		io_channel_set_blksize(image, 1);
+		hdr = qcow2_read_image_header(image);
+		io_channel_close(image);
+		if (!hdr)
+			return 0;
+		ext2fs_free_mem(&hdr);
+		return 1;
+	}
+
+	fd = ext2fs_open_file(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	hdr = qcow2_read_header(fd);
+	close(fd);
+	if (!hdr)
+		return 0;
+	ext2fs_free_mem(&hdr);
+	return 1;
+}
+
+static errcode_t qcow2_pread(struct qcow2_private_data *data, __u64 offset,
+			     void *buf, size_t size)
+{
+	ssize_t	actual;
+	errcode_t retval;
+
+	if (data->image) {
+		/* The image channel's block size is 1 */
+		retval = io_channel_read_blk64(data->image, offset,
+					       -(int) size, buf);
+		if (retval)
+			return retval;
+		data->io_stats.bytes_read += size;
+		return 0;
+	}
+	if (ext2fs_llseek(data->dev, offset, SEEK_SET) != (ext2_loff_t) offset)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = read(data->dev, buf, size);
+	if (actual < 0)
+		return errno;
+	if ((size_t) actual != size)
+		return EXT2_ET_SHORT_READ;
+	data->io_stats.bytes_read += size;
+	return 0;
+}
+
+/*
+ * Return the cache entry holding the cluster at offset in the image
+ * file, reading it into the least recently used entry on a miss.
+ */
+static errcode_t qcow2_cache_get(struct qcow2_private_data *data,
+				 struct qcow2_cache_entry *cache, int nr,
+				 __u64 offset, void **buf)
+{
+	struct qcow2_cache_entry *cache_entry, *unused = 0, *oldest = 0;
+	errcode_t	retval;
+	int		i;
+
+	for (i = 0, cache_entry = cache; i < nr; i++, cache_entry++) {
+		if (cache_entry->offset == offset) {
+			data->io_stats.cache_hits++;
+			cache_entry->access_time = ++data->access_time;
+			*buf = cache_entry->buf;
+			return 0;
+		}
+		if (!cache_entry->offset)
+			unused = cache_entry;
+		else if (!oldest ||
+			 cache_entry->access_time < oldest->access_time)
+			oldest = cache_entry;
+	}
+	data->io_stats.cache_misses++;
+	cache_entry = unused ? unused : oldest;
+	cache_entry->offset = 0;
+	retval = qcow2_pread(data, offset, cache_entry->buf,
+			     data->cluster_size);
+	if (retval)
+		return retval;
+	cache_entry->offset = offset;
+	cache_entry->access_time = ++data->access_time;
+	*buf = cache_entry->buf;
+	return 0;
+}
+
+/*
+ * Find where a cluster of the file system image is stored in the
+ * qcow2 file.  *ret_offset is set to 0 for a cluster which is not
+ * mapped.
+ */
+static errcode_t qcow2_map_cluster(struct qcow2_private_data *data,
+				   __u64 cluster, __u64 *ret_offset)
+{
+	__u64		l1_index, offset;
+	__u64		*l2_table;
+	errcode_t	retval;
+
+	*ret_offset = 0;
+	l1_index = cluster / data->l2_size;
+	if (l1_index >= data->l1_size)
+		return 0;
+	offset = data->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+	if (!offset)
+		return 0;
+	if ((offset & QCOW_OFLAG_COMPRESSED) ||
+	    (offset & (data->cluster_size - 1)))
+		return EXT2_ET_QCOW2_BAD_IMAGE;
+
+	retval = qcow2_cache_get(data, data->l2_cache, QCOW2_L2_CACHE_SIZE,
+				 offset, (void **) &l2_table);
+	if (retval)
+		return retval;
+	offset = ext2fs_be64_to_cpu(l2_table[cluster % data->l2_size]) &
+		~QCOW_OFLAG_COPIED;
+	if ((offset & QCOW_OFLAG_COMPRESSED) ||
+	    (offset & (data->cluster_size - 1)))
+		return EXT2_ET_QCOW2_BAD_IMAGE;
+	*ret_offset = offset;
+	return 0;
+}
+
+static errcode_t qcow2_read_bytes(struct qcow2_private_data *data,
+				  __u64 location, char *buf, size_t size)
+{
+	__u64		cluster, offset, next;
+	size_t		within, len, run;
+	void		*cbuf;
+	errcode_t	retval;
+
+	if (location + size > data->image_size)
+		return EXT2_ET_SHORT_READ;
+
+	while (size) {
+		cluster = location >> data->cluster_bits;
+		within = location & (data->cluster_size - 1);
+		len = data->cluster_size - within;
+		if (len > size)
+			len = size;
+		retval = qcow2_map_cluster(data, cluster, &offset);
+		if (retval)
+			return retval;
+		if (!offset && !data->backing) {
+			memset(buf, 0, len);
+			goto next;
+		}
+		if (!offset) {
+			/* Pass runs of unmapped clusters on to the backing file */
+			run = len;
+			while (run < size) {
+				retval = qcow2_map_cluster(data, cluster + 1,
+							   &next);
+				if (retval)
+					return retval;
+				if (next)
+					break;
+				cluster++;
+				run += (size - run < data->cluster_size) ?
+					size - run : data->cluster_size;
+			}
+			len = run;
+			if (location >= data->backing_size)
+				run = 0;
+			else if (location + run > data->backing_size)
+				run = data->backing_size - location;
+			if (run) {
+				retval = io_channel_read_blk64(data->backing,
+							location, -(int) run,
+							buf);
+				if (retval)
+					return retval;
+			}
+			memset(buf + run, 0, len - run);
+			goto next;
+		}
+		if (len == size) {
+			/* Small reads go through the data cluster cache */
+			retval = qcow2_cache_get(data, data->data_cache,
+						 QCOW2_DATA_CACHE_SIZE,
+						 offset, &cbuf);
+			if (retval)
+				return retval;
+			memcpy(buf, (char *) cbuf + within, len);
+			goto next;
+		}
+
+		/* Read clusters which follow each other in the file at once */
+		run = len;
+		while (run < size) {
+			retval = qcow2_map_cluster(data, cluster + 1, &next);
+			if (retval)
+				return retval;
+			if (next != offset + within + run)
+				break;
+			cluster++;
+			if (size - run < data->cluster_size) {
+				run = size;
+				break;
+			}
+			run += data->cluster_size;
+		}
+		retval = qcow2_pread(data, offset + within, buf, run);
+		if (retval)
+			return retval;
+		len = run;
+	next:
+		location += len;
+		buf += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/*
+ * Open the backing file of the image called name, whose header is hdr.
+ */
+static errcode_t qcow2_open_backing(struct qcow2_private_data *data,
+				    const char *name,
+				    struct ext2_qcow2_hdr *hdr)
+{
+	struct qcow2_private_data *bdata;
+	__u32		len = ext2fs_be32_to_cpu(hdr->backing_file_size);
+	const char	*dir_end;
+	char		*path;
+	size_t		dir_len = 0;
+	errcode_t	retval;
+	io_manager	manager;
+
+	if (len == 0 || len > 1023 || qcow2_chain_depth >= QCOW2_MAX_CHAIN)
+		return EXT2_ET_QCOW2_BAD_IMAGE;
+
+	dir_end = strrchr(name, '/');
+	if (dir_end)
+		dir_len = dir_end - name + 1;
+	retval = ext2fs_get_mem(dir_len + len + 1, &path);
+	if (retval)
+		return retval;
+	retval = qcow2_pread(data, ext2fs_be64_to_cpu(hdr->backing_file_offset),
+			     path + dir_len, len);
+	if (retval)
+		goto out;
+	path[dir_len + len] = 0;
+	if (strlen(path + dir_len) != len) {
+		retval = EXT2_ET_QCOW2_BAD_IMAGE;
+		goto out;
+	}
+	if (path[dir_len] == '/' || http_io_probe(path + dir_len))
+		memmove(path, path + dir_len, len + 1);
+	else
+		memcpy(path, name, dir_len);
+
+	if (qcow2_io_probe(path))
+		manager = qcow2_io_manager;
+	else if (http_io_probe(path))
+		manager = http_io_manager;
+	else
+		manager = unix_io_manager;
+	qcow2_chain_depth++;
+	retval = manager->open(path, 0, &data->backing);
+	qcow2_chain_depth--;
+	if (retval)
+		goto out;
+	io_channel_set_blksize(data->backing, 1);
+
+	/* A backing file which isn't a qcow2 image is taken to be as large */
+	data->backing_size = data->image_size;
+	if (manager == qcow2_io_manager) {
+		bdata = (struct qcow2_private_data *)
+			data->backing->private_data;
+		data->backing_size = bdata->image_size;
+	}
+out:
+	ext2fs_free_mem(&path);
+	return retval;
+}
+
+static errcode_t qcow2_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct qcow2_private_data *data = NULL;
+	struct ext2_qcow2_hdr *hdr = NULL;
+	size_t		l1_bytes;
+	errcode_t	retval;
+	unsigned int	i;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (flags & IO_FLAG_RW)
+		return EXT2_ET_RO_FILSYS;
+
+	retval = ext2fs_get_mem(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto cleanup;
+	memset(io, 0, sizeof(struct struct_io_channel));
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct qcow2_private_data), &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_QCOW2_IO_CHANNEL;
+	data->dev = -1;
+	data->io_stats.num_fields = 4;
+
+	io->manager = qcow2_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->read_error = 0;
+	io->write_error = 0;
+	io->refcount = 1;
+
+	if (http_io_probe(name)) {
+		retval = http_io_manager->open(name, 0, &data->image);
+		if (retval)
+			goto cleanup;
+		io_channel_set_blksize(data->image, 1);
+		hdr = qcow2_read_image_header(data->image);
+	} else {
+		data->dev = ext2fs_open_file(name, O_RDONLY, 0);
+		if (data->dev < 0) {
+			retval = errno;
+			goto cleanup;
+		}
+		hdr = qcow2_read_header(data->dev);
+	}
+	if (!hdr) {
+		retval = EXT2_ET_QCOW2_BAD_IMAGE;
+		goto cleanup;
+	}
+	data->cluster_bits = ext2fs_be32_to_cpu(hdr->cluster_bits);
+	data->l1_size = ext2fs_be32_to_cpu(hdr->l1_size);
+	data->image_size = ext2fs_be64_to_cpu(hdr->size);
+	if (hdr->crypt_method ||
+	    data->cluster_bits < 9 || data->cluster_bits > 21) {
+		retval = EXT2_ET_QCOW2_BAD_IMAGE;
+		goto cleanup;
+	}
+	data->cluster_size = 1 << data->cluster_bits;
+	data->l2_size = 1 << (data->cluster_bits - 3);
+
+	l1_bytes = data->l1_size * sizeof(__u64);
+	retval = ext2fs_get_array(data->l1_size, sizeof(__u64),
+				  &data->l1_table);
+	if (retval)
+		goto cleanup;
+	retval = qcow2_pread(data, ext2fs_be64_to_cpu(hdr->l1_table_offset),
+			     data->l1_table, l1_bytes);
+	if (retval)
+		goto cleanup;
+	for (i = 0; i < data->l1_size; i++)
+		data->l1_table[i] = ext2fs_be64_to_cpu(data->l1_table[i]);
+
+	if (hdr->backing_file_offset) {
+		retval = qcow2_open_backing(data, name, hdr);
+		if (retval)
+			goto cleanup;
+	}
+
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++) {
+		retval = ext2fs_get_mem(data->cluster_size,
+					&data->l2_cache[i].buf);
+		if (retval)
+			goto cleanup;
+	}
+	for (i = 0; i < QCOW2_DATA_CACHE_SIZE; i++) {
+		retval = ext2fs_get_mem(data->cluster_size,
+					&data->data_cache[i].buf);
+		if (retval)
+			goto cleanup;
+	}
+
+	ext2fs_free_mem(&hdr);
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (hdr)
+		ext2fs_free_mem(&hdr);
+	if (data) {
+		for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+			if (data->l2_cache[i].buf)
+				ext2fs_free_mem(&data->l2_cache[i].buf);
+		for (i = 0; i < QCOW2_DATA_CACHE_SIZE; i++)
+			if (data->data_cache[i].buf)
+				ext2fs_free_mem(&data->data_cache[i].buf);
+		if (data->l1_table)
+			ext2fs_free_mem(&data->l1_table);
+		if (data->dev >= 0)
+			close(data->dev);
+		if (data->image)
+			io_channel_close(data->image);
+		if (data->backing)
+			io_channel_close(data->backing);
+		ext2fs_free_mem(&data);
+	}
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t qcow2_close(io_channel channel)
+{
+	struct qcow2_private_data *data;
+	errcode_t	retval = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct qcow2_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_QCOW2_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	if (data->backing)
+		io_channel_close(data->backing);
+	if (data->image)
+		retval = io_channel_close(data->image);
+	else if (close(data->dev) < 0)
+		retval = errno;
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+		ext2fs_free_mem(&data->l2_cache[i].buf);
+	for (i = 0; i < QCOW2_DATA_CACHE_SIZE; i++)
+		ext2fs_free_mem(&data->data_cache[i].buf);
+	ext2fs_free_mem(&data->l1_table);
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t qcow2_set_blksize(io_channel channel, int blksize)
+{
+	struct qcow2_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct qcow2_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_QCOW2_IO_CHANNEL);
+
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t qcow2_read_blk64(io_channel channel, unsigned long long block,
+				  int count, void *buf)
+{
+	struct qcow2_private_data *data;
+	errcode_t	retval;
+	size_t		size;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct qcow2_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_QCOW2_IO_CHANNEL);
+
+	size = (count < 0) ? -count : count * channel->block_size;
+	retval = qcow2_read_bytes(data,
+				  (__u64) block * channel->block_size,
+				  buf, size);
+	if (retval) {
+		memset(buf, 0, size);
+		if (channel->read_error)
+			retval = (channel->read_error)(channel, block, count,
+						       buf, size, 0, retval);
+	}
+	return retval;
+}
+
+static errcode_t qcow2_read_blk(io_channel channel, unsigned long block,
+				int count, void *buf)
+{
+	return qcow2_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t qcow2_write_blk64(io_channel channel,
+				   unsigned long long block EXT2FS_ATTR((unused)),
+				   int count EXT2FS_ATTR((unused)),
+				   const void *buf EXT2FS_ATTR((unused)))
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return EXT2_ET_RO_FILSYS;
+}
+
+static errcode_t qcow2_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *buf)
+{
+	return qcow2_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t qcow2_write_byte(io_channel channel,
+				  unsigned long offset EXT2FS_ATTR((unused)),
+				  int size EXT2FS_ATTR((unused)),
+				  const void *buf EXT2FS_ATTR((unused)))
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return EXT2_ET_RO_FILSYS;
+}
+
+static errcode_t qcow2_flush(io_channel channel)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	return 0;
+}
+
+/* The options of a remote image are those of its HTTP channel */
+static errcode_t qcow2_set_option(io_channel channel, const char *option,
+				  const char *arg)
+{
+	struct qcow2_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct qcow2_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_QCOW2_IO_CHANNEL);
+
+	if (!data->image || !data->image->manager->set_option)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return data->image->manager->set_option(data->image, option, arg);
+}
+
+static errcode_t qcow2_get_stats(io_channel channel, io_stats *stats)
+{
+	struct qcow2_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct qcow2_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_QCOW2_IO_CHANNEL);
+
+	if (stats)
+		*stats = &data->io_stats;
+	return 0;
+}
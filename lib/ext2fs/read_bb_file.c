@@ -28,6 +28,10 @@
 
 /*
  * Reads a list of bad blocks from  a FILE *
+ *
+ * The blocks are gathered first and added to the list all at once, so
+ * that a long list, or one which isn't sorted, doesn't have to be
+ * kept in order one insertion at a time.
  */
 errcode_t ext2fs_read_bb_FILE2(ext2_filsys fs, FILE *f,
 			       ext2_badblocks_list *bb_list,
@@ -39,7 +43,8 @@ errcode_t ext2fs_read_bb_FILE2(ext2_filsys fs, FILE *f,
 {
 	errcode_t	retval;
 	blk64_t		blockno;
-	int		count;
+	blk_t		*blks = 0;
+	int		count, num = 0, max = 0;
 	char		buf[128];
 
 	if (fs)
@@ -58,8 +63,10 @@ errcode_t ext2fs_read_bb_FILE2(ext2_filsys fs, FILE *f,
 		if (count <= 0)
 			continue;
 		/* Badblocks isn't going to be updated for 64bit */
-		if (blockno >> 32)
-			return EOVERFLOW;
+		if (blockno >> 32) {
+			retval = EOVERFLOW;
+			goto out;
+		}
 		if (fs &&
 		    ((blockno < fs->super->s_first_data_block) ||
 		     (blockno >= ext2fs_blocks_count(fs->super)))) {
@@ -67,11 +74,20 @@ errcode_t ext2fs_read_bb_FILE2(ext2_filsys fs, FILE *f,
 				(invalid)(fs, blockno, buf, priv_data);
 			continue;
 		}
-		retval = ext2fs_badblocks_list_add(*bb_list, blockno);
-		if (retval)
-			return retval;
+		if (num >= max) {
+			retval = ext2fs_resize_mem(max * sizeof(blk_t),
+						   (max ? max * 2 : 1024) *
+						   sizeof(blk_t), &blks);
+			if (retval)
+				goto out;
+			max = max ? max * 2 : 1024;
+		}
+		blks[num++] = blockno;
 	}
-	return 0;
+	retval = ext2fs_badblocks_list_add_array(*bb_list, blks, num);
+out:
+	ext2fs_free_mem(&blks);
+	return retval;
 }
 
 struct compat_struct {
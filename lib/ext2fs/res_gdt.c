@@ -52,31 +52,87 @@ static unsigned int list_backups(ext2_filsys fs, unsigned int *three,
 	return ret;
 }
 
+/*
+ * The reserved GDT blocks are handled RES_GDT_BATCH at a time: the ones
+ * already in the resize inode are read with a single request for each
+ * run of them, and the ones which changed are written back the same
+ * way.  They are indirect blocks, so they are kept in host byte order
+ * while we work on them.
+ */
+#define RES_GDT_BATCH	256
+
+static errcode_t read_gdt_blocks(ext2_filsys fs, blk_t blk, int num,
+				 __u32 *buf)
+{
+	errcode_t	retval;
+#ifdef WORDS_BIGENDIAN
+	unsigned int	i, limit = num * (fs->blocksize >> 2);
+#endif
+
+	if ((fs->flags & EXT2_FLAG_IMAGE_FILE) &&
+	    (fs->io != fs->image_io)) {
+		memset(buf, 0, (size_t) num * fs->blocksize);
+		return 0;
+	}
+	retval = io_channel_read_blk(fs->io, blk, num, buf);
+	if (retval)
+		return retval;
+#ifdef WORDS_BIGENDIAN
+	for (i = 0; i < limit; i++)
+		buf[i] = ext2fs_swab32(buf[i]);
+#endif
+	return 0;
+}
+
+static errcode_t write_gdt_blocks(ext2_filsys fs, blk_t blk, int num,
+				  __u32 *buf)
+{
+#ifdef WORDS_BIGENDIAN
+	unsigned int	i, limit = num * (fs->blocksize >> 2);
+#endif
+
+	if (fs->flags & EXT2_FLAG_IMAGE_FILE)
+		return 0;
+#ifdef WORDS_BIGENDIAN
+	for (i = 0; i < limit; i++)
+		buf[i] = ext2fs_swab32(buf[i]);
+#endif
+	return io_channel_write_blk(fs->io, blk, num, buf);
+}
+
 /*
  * This code assumes that the reserved blocks have already been marked in-use
  * during ext2fs_initialize(), so that they are not allocated for other
  * uses before we can add them to the resize inode (which has to come
  * after the creation of the inode table).
+ *
+ * The groups holding backups are the same for every reserved block, so
+ * they are listed once; then each batch of reserved blocks is read,
+ * checked and filled in, and the ones which changed are written out.
+ * The dindirect block and the inode are written once at the end.
  */
 errcode_t ext2fs_create_resize_inode(ext2_filsys fs)
 {
 	errcode_t		retval, retval2;
 	struct ext2_super_block	*sb;
 	struct ext2_inode	inode;
-	__u32			*dindir_buf, *gdt_buf;
+	__u32			*dindir_buf, *gdt_buf = 0, *buf;
 	unsigned long long	apb, inode_size;
 	/* FIXME-64 - can't deal with extents */
-	blk_t			dindir_blk, rsv_off, gdt_off, gdt_blk;
+	blk_t			dindir_blk, rsv_off, gdt_off, gdt_blk, expect;
 	int			dindir_dirty = 0, inode_dirty = 0, sb_blk = 0;
+	unsigned int		three = 1, five = 5, seven = 7;
+	unsigned int		*backups = 0, num_backups = 0, grp, last;
+	unsigned char		dirty[RES_GDT_BATCH];
+	int			i, j, n, ok, batch;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
 	sb = fs->super;
 
-	retval = ext2fs_get_array(2, fs->blocksize, &dindir_buf);
+	retval = ext2fs_get_mem(fs->blocksize, &dindir_buf);
 	if (retval)
 		return retval;
-	gdt_buf = (__u32 *)((char *)dindir_buf + fs->blocksize);
 
 	retval = ext2fs_read_inode(fs, EXT2_RESIZE_INO, &inode);
 	if (retval)
@@ -128,81 +184,138 @@ errcode_t ext2fs_create_resize_inode(ext2_filsys fs)
 		inode.i_ctime = fs->now ? fs->now : time(0);
 	}
 
-	for (rsv_off = 0, gdt_off = fs->desc_blocks,
-	     gdt_blk = sb_blk + 1 + fs->desc_blocks;
-	     rsv_off < sb->s_reserved_gdt_blocks;
-	     rsv_off++, gdt_off++, gdt_blk++) {
-		unsigned int three = 1, five = 5, seven = 7;
-		unsigned int grp, last = 0;
-		int gdt_dirty = 0;
-
-		gdt_off %= apb;
-		if (!dindir_buf[gdt_off]) {
-			/* FIXME XXX XXX
-			blk_t new_blk;
-
-			retval = ext2fs_new_block(fs, gdt_blk, 0, &new_blk);
-			if (retval)
-				goto out_free;
-			if (new_blk != gdt_blk) {
-				// XXX free block
-				retval = -1; // XXX
-			}
-			*/
-			gdt_dirty = dindir_dirty = inode_dirty = 1;
-			memset(gdt_buf, 0, fs->blocksize);
-			dindir_buf[gdt_off] = gdt_blk;
-			ext2fs_iblk_add_blocks(fs, &inode, 1);
-#ifdef RES_GDT_DEBUG
-			printf("added primary GDT block %u at %u[%u]\n",
-			       gdt_blk, dindir_blk, gdt_off);
-#endif
-		} else if (dindir_buf[gdt_off] == gdt_blk) {
+	if (!sb->s_reserved_gdt_blocks)
+		goto out_dindir;
+
+	/* A block only has room for apb backups, so never list more */
+	retval = ext2fs_get_array(apb, sizeof(unsigned int), &backups);
+	if (retval)
+		goto out_dindir;
+	while (num_backups < apb &&
+	       (grp = list_backups(fs, &three, &five, &seven)) <
+	       fs->group_desc_count)
+		backups[num_backups++] = grp;
+
+	batch = sb->s_reserved_gdt_blocks;
+	if (batch > RES_GDT_BATCH)
+		batch = RES_GDT_BATCH;
+	retval = ext2fs_get_array(batch, fs->blocksize, &gdt_buf);
+	if (retval)
+		goto out_dindir;
+
+	for (rsv_off = 0; rsv_off < sb->s_reserved_gdt_blocks; rsv_off += n) {
+		n = sb->s_reserved_gdt_blocks - rsv_off;
+		if (n > batch)
+			n = batch;
+		gdt_blk = sb_blk + 1 + fs->desc_blocks + rsv_off;
+
+		/*
+		 * Each reserved block must be either missing from the
+		 * dindirect block, or in it at its own place; we only
+		 * go as far as the first one which isn't.
+		 */
+		for (ok = 0; ok < n; ok++) {
+			gdt_off = (fs->desc_blocks + rsv_off + ok) % apb;
+			if (dindir_buf[gdt_off] &&
+			    dindir_buf[gdt_off] != gdt_blk + ok) {
 #ifdef RES_GDT_DEBUG
-			printf("reading primary GDT block %u\n", gdt_blk);
+				printf("bad primary GDT %u != %u at %u[%u]\n",
+				       dindir_buf[gdt_off], gdt_blk + ok,
+				       dindir_blk, gdt_off);
 #endif
-			retval = ext2fs_read_ind_block(fs, gdt_blk, gdt_buf);
-			if (retval)
-				goto out_dindir;
-		} else {
+				retval = EXT2_ET_RESIZE_INODE_CORRUPT;
+				break;
+			}
+		}
+
+		/* Read the runs of them which are there already */
+		for (i = 0; i < ok; i = j) {
+			for (j = i; j < ok; j++)
+				if (!dindir_buf[(fs->desc_blocks + rsv_off + j) %
+						apb])
+					break;
+			if (j > i) {
 #ifdef RES_GDT_DEBUG
-			printf("bad primary GDT %u != %u at %u[%u]\n",
-			       dindir_buf[gdt_off], gdt_blk,dindir_blk,gdt_off);
+				printf("reading primary GDT blocks %u-%u\n",
+				       gdt_blk + i, gdt_blk + j - 1);
 #endif
-			retval = EXT2_ET_RESIZE_INODE_CORRUPT;
-			goto out_dindir;
+				retval2 = read_gdt_blocks(fs, gdt_blk + i,
+						j - i, gdt_buf + i * apb);
+				if (retval2) {
+					retval = retval2;
+					goto out_dindir;
+				}
+			}
+			for (; j < ok; j++)
+				if (dindir_buf[(fs->desc_blocks + rsv_off + j) %
+					       apb])
+					break;
 		}
 
-		while ((grp = list_backups(fs, &three, &five, &seven)) <
-		       fs->group_desc_count) {
-			blk_t expect = gdt_blk + grp * sb->s_blocks_per_group;
+		for (i = 0; i < ok; i++) {
+			buf = gdt_buf + i * apb;
+			gdt_off = (fs->desc_blocks + rsv_off + i) % apb;
+			dirty[i] = 0;
+			if (!dindir_buf[gdt_off]) {
+				dirty[i] = dindir_dirty = inode_dirty = 1;
+				memset(buf, 0, fs->blocksize);
+				dindir_buf[gdt_off] = gdt_blk + i;
+				ext2fs_iblk_add_blocks(fs, &inode, 1);
+#ifdef RES_GDT_DEBUG
+				printf("added primary GDT block %u at %u[%u]\n",
+				       gdt_blk + i, dindir_blk, gdt_off);
+#endif
+			}
 
-			if (!gdt_buf[last]) {
+			for (last = 0; last < num_backups; last++) {
+				expect = gdt_blk + i + backups[last] *
+					sb->s_blocks_per_group;
+				if (!buf[last]) {
 #ifdef RES_GDT_DEBUG
-				printf("added backup GDT %u grp %u@%u[%u]\n",
-				       expect, grp, gdt_blk, last);
+					printf("added backup GDT %u grp %u@%u[%u]\n",
+					       expect, backups[last],
+					       gdt_blk + i, last);
 #endif
-				gdt_buf[last] = expect;
-				ext2fs_iblk_add_blocks(fs, &inode, 1);
-				gdt_dirty = inode_dirty = 1;
-			} else if (gdt_buf[last] != expect) {
+					buf[last] = expect;
+					ext2fs_iblk_add_blocks(fs, &inode, 1);
+					dirty[i] = inode_dirty = 1;
+				} else if (buf[last] != expect) {
 #ifdef RES_GDT_DEBUG
-				printf("bad backup GDT %u != %u at %u[%u]\n",
-				       gdt_buf[last], expect, gdt_blk, last);
+					printf("bad backup GDT %u != %u at %u[%u]\n",
+					       buf[last], expect, gdt_blk + i,
+					       last);
 #endif
-				retval = EXT2_ET_RESIZE_INODE_CORRUPT;
-				goto out_dindir;
+					retval = EXT2_ET_RESIZE_INODE_CORRUPT;
+					break;
+				}
+			}
+			if (last < num_backups) {
+				ok = i;
+				break;
 			}
-			last++;
 		}
-		if (gdt_dirty) {
+
+		/* Write back the runs of blocks which changed */
+		for (i = 0; i < ok; i = j) {
+			for (j = i; j < ok && dirty[j]; j++)
+				;
+			if (j > i) {
 #ifdef RES_GDT_DEBUG
-			printf("writing primary GDT block %u\n", gdt_blk);
+				printf("writing primary GDT blocks %u-%u\n",
+				       gdt_blk + i, gdt_blk + j - 1);
 #endif
-			retval = ext2fs_write_ind_block(fs, gdt_blk, gdt_buf);
-			if (retval)
-				goto out_dindir;
+				retval2 = write_gdt_blocks(fs, gdt_blk + i,
+						j - i, gdt_buf + i * apb);
+				if (retval2) {
+					retval = retval2;
+					goto out_dindir;
+				}
+			}
+			for (; j < ok && !dirty[j]; j++)
+				;
 		}
+		if (retval)
+			goto out_dindir;
 	}
 
 out_dindir:
@@ -223,7 +336,10 @@ out_inode:
 			retval = retval2;
 	}
 out_free:
+	if (gdt_buf)
+		ext2fs_free_mem(&gdt_buf);
+	if (backups)
+		ext2fs_free_mem(&backups);
 	ext2fs_free_mem(&dindir_buf);
 	return retval;
 }
-
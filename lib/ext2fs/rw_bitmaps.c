@@ -27,18 +27,104 @@
 #include "ext2fs.h"
 #include "e2image.h"
 
+/*
+ * With flex_bg, the bitmaps of consecutive groups are normally stored
+ * next to each other, so they are read and written in runs of up to
+ * this many blocks at a time.
+ */
+#define BITMAP_IO_RUN	64
+
+/*
+ * Write the block (or inode) bitmaps of all groups from fs->block_map
+ * (or fs->inode_map).  Each group's bitmap is copied into the next
+ * slot of buf as long as it is stored right after the previous one,
+ * and the run is written out with one I/O when that stops being true
+ * or buf is full.  buf must be BITMAP_IO_RUN blocks long, with the
+ * padding past nbytes already set.
+ */
+static errcode_t write_bitmap_groups(ext2_filsys fs, int inode, char *buf,
+				     int nbytes, int csum_flag)
+{
+	dgrp_t		i;
+	unsigned int	j, nbits, n = 0;
+	int		skip;
+	unsigned int	cnt = nbytes << 3;
+	char		*bitmap;
+	blk64_t		blk, run_blk = 0;
+	blk64_t		blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
+	ext2_ino_t	ino_itr = 1;
+	errcode_t	retval;
+
+	for (i = 0; i <= fs->group_desc_count; i++) {
+		blk = 0;
+		skip = 1;
+		if (i < fs->group_desc_count) {
+			skip = csum_flag &&
+				ext2fs_bg_flags_test(fs, i, inode ?
+						     EXT2_BG_INODE_UNINIT :
+						     EXT2_BG_BLOCK_UNINIT);
+			if (inode)
+				blk = ext2fs_inode_bitmap_loc(fs, i);
+			else
+				blk = ext2fs_block_bitmap_loc(fs, i);
+			if (skip)
+				blk = 0;
+		}
+		/* Write out the pending run if this bitmap doesn't extend it */
+		if (n && (!blk || blk != run_blk + n || n >= BITMAP_IO_RUN)) {
+			retval = io_channel_write_blk64(fs->io, run_blk, n, buf);
+			if (retval)
+				return inode ? EXT2_ET_INODE_BITMAP_WRITE :
+					EXT2_ET_BLOCK_BITMAP_WRITE;
+			n = 0;
+		}
+		if (i == fs->group_desc_count)
+			break;
+		if (skip)
+			goto skip_this_bitmap;
+		bitmap = buf + (size_t) n * fs->blocksize;
+
+		if (inode) {
+			retval = ext2fs_get_inode_bitmap_range2(fs->inode_map,
+						ino_itr, cnt, bitmap);
+			if (retval)
+				return retval;
+		} else {
+			retval = ext2fs_get_block_bitmap_range2(fs->block_map,
+						blk_itr, cnt, bitmap);
+			if (retval)
+				return retval;
+			if (i == fs->group_desc_count - 1) {
+				/* Force bitmap padding for the last group */
+				nbits = EXT2FS_NUM_B2C(fs,
+					((ext2fs_blocks_count(fs->super)
+					  - (__u64) fs->super->s_first_data_block)
+					 % (__u64) EXT2_BLOCKS_PER_GROUP(fs->super)));
+				if (nbits)
+					for (j = nbits; j < fs->blocksize * 8; j++)
+						ext2fs_set_bit(j, bitmap);
+			}
+		}
+		if (blk) {
+			if (!n)
+				run_blk = blk;
+			n++;
+		}
+	skip_this_bitmap:
+		if (inode)
+			ino_itr += cnt;
+		else
+			blk_itr += cnt;
+	}
+	return 0;
+}
+
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 {
-	dgrp_t 		i;
-	unsigned int	j;
 	int		block_nbytes, inode_nbytes;
-	unsigned int	nbits;
 	errcode_t	retval;
 	char		*block_buf = NULL, *inode_buf = NULL;
 	int		csum_flag = 0;
-	blk64_t		blk;
-	blk64_t		blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
-	ext2_ino_t	ino_itr = 1;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -52,80 +138,28 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	inode_nbytes = block_nbytes = 0;
 	if (do_block) {
 		block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
-		retval = io_channel_alloc_buf(fs->io, 0, &block_buf);
+		retval = io_channel_alloc_buf(fs->io, BITMAP_IO_RUN,
+					      &block_buf);
+		if (retval)
+			goto errout;
+		memset(block_buf, 0xff, (size_t) fs->blocksize * BITMAP_IO_RUN);
+		retval = write_bitmap_groups(fs, 0, block_buf, block_nbytes,
+					     csum_flag);
 		if (retval)
 			goto errout;
-		memset(block_buf, 0xff, fs->blocksize);
 	}
 	if (do_inode) {
 		inode_nbytes = (size_t)
 			((EXT2_INODES_PER_GROUP(fs->super)+7) / 8);
-		retval = io_channel_alloc_buf(fs->io, 0, &inode_buf);
-		if (retval)
-			goto errout;
-		memset(inode_buf, 0xff, fs->blocksize);
-	}
-
-	for (i = 0; i < fs->group_desc_count; i++) {
-		if (!do_block)
-			goto skip_block_bitmap;
-
-		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT)
-		    )
-			goto skip_this_block_bitmap;
-
-		retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-				blk_itr, block_nbytes << 3, block_buf);
+		retval = io_channel_alloc_buf(fs->io, BITMAP_IO_RUN,
+					      &inode_buf);
 		if (retval)
 			goto errout;
-
-		if (i == fs->group_desc_count - 1) {
-			/* Force bitmap padding for the last group */
-			nbits = EXT2FS_NUM_B2C(fs,
-				((ext2fs_blocks_count(fs->super)
-				  - (__u64) fs->super->s_first_data_block)
-				 % (__u64) EXT2_BLOCKS_PER_GROUP(fs->super)));
-			if (nbits)
-				for (j = nbits; j < fs->blocksize * 8; j++)
-					ext2fs_set_bit(j, block_buf);
-		}
-		blk = ext2fs_block_bitmap_loc(fs, i);
-		if (blk) {
-			retval = io_channel_write_blk64(fs->io, blk, 1,
-							block_buf);
-			if (retval) {
-				retval = EXT2_ET_BLOCK_BITMAP_WRITE;
-				goto errout;
-			}
-		}
-	skip_this_block_bitmap:
-		blk_itr += block_nbytes << 3;
-	skip_block_bitmap:
-
-		if (!do_inode)
-			continue;
-
-		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT)
-		    )
-			goto skip_this_inode_bitmap;
-
-		retval = ext2fs_get_inode_bitmap_range2(fs->inode_map,
-				ino_itr, inode_nbytes << 3, inode_buf);
+		memset(inode_buf, 0xff, (size_t) fs->blocksize * BITMAP_IO_RUN);
+		retval = write_bitmap_groups(fs, 1, inode_buf, inode_nbytes,
+					     csum_flag);
 		if (retval)
 			goto errout;
-
-		blk = ext2fs_inode_bitmap_loc(fs, i);
-		if (blk) {
-			retval = io_channel_write_blk64(fs->io, blk, 1,
-						      inode_buf);
-			if (retval) {
-				retval = EXT2_ET_INODE_BITMAP_WRITE;
-				goto errout;
-			}
-		}
-	skip_this_inode_bitmap:
-		ino_itr += inode_nbytes << 3;
-
 	}
 	if (do_block) {
 		fs->flags &= ~EXT2_FLAG_BB_DIRTY;
@@ -144,9 +178,84 @@ errout:
 	return retval;
 }
 
+/*
+ * Return where a group's block (or inode) bitmap is, or 0 if it
+ * doesn't have to be read because the group is uninitialized.
+ */
+static blk64_t bitmap_to_read(ext2_filsys fs, dgrp_t group, int inode,
+			      int csum_flag)
+{
+	blk64_t	blk;
+	int	flag;
+
+	if (inode) {
+		blk = ext2fs_inode_bitmap_loc(fs, group);
+		flag = EXT2_BG_INODE_UNINIT;
+	} else {
+		blk = ext2fs_block_bitmap_loc(fs, group);
+		flag = EXT2_BG_BLOCK_UNINIT;
+	}
+	if (csum_flag && ext2fs_bg_flags_test(fs, group, flag) &&
+	    ext2fs_group_desc_csum_verify(fs, group))
+		blk = 0;
+	return blk;
+}
+
+/*
+ * Read the block (or inode) bitmaps of all groups into fs->block_map
+ * (or fs->inode_map).  First the on-disk locations are scanned for a
+ * run of groups whose bitmaps are contiguous, which is read with one
+ * I/O; then each group's part of the buffer is copied into the
+ * in-memory bitmap.  buf must be BITMAP_IO_RUN blocks long.
+ */
+static errcode_t read_bitmap_groups(ext2_filsys fs, int inode, char *buf,
+				    int nbytes, int csum_flag)
+{
+	dgrp_t		i, j, n;
+	blk64_t		blk, next;
+	blk64_t		blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
+	ext2_ino_t	ino_itr = 1;
+	unsigned int	cnt = nbytes << 3;
+	errcode_t	retval;
+
+	next = bitmap_to_read(fs, 0, inode, csum_flag);
+	for (i = 0; i < fs->group_desc_count; i = j) {
+		blk = next;
+		for (j = i + 1; j < fs->group_desc_count; j++) {
+			next = bitmap_to_read(fs, j, inode, csum_flag);
+			if (!blk || next != blk + (j - i) ||
+			    j - i >= BITMAP_IO_RUN)
+				break;
+		}
+		if (blk) {
+			retval = io_channel_read_blk64(fs->io, blk, j - i, buf);
+			if (retval)
+				return inode ? EXT2_ET_INODE_BITMAP_READ :
+					EXT2_ET_BLOCK_BITMAP_READ;
+		} else
+			memset(buf, 0, nbytes);
+
+		for (n = 0; n < j - i; n++) {
+			char *bitmap = buf + (size_t) n * fs->blocksize;
+
+			if (inode) {
+				retval = ext2fs_set_inode_bitmap_range2(
+					fs->inode_map, ino_itr, cnt, bitmap);
+				ino_itr += cnt;
+			} else {
+				retval = ext2fs_set_block_bitmap_range2(
+					fs->block_map, blk_itr, cnt, bitmap);
+				blk_itr += cnt;
+			}
+			if (retval)
+				return retval;
+		}
+	}
+	return 0;
+}
+
 static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 {
-	dgrp_t i;
 	char *block_bitmap = 0, *inode_bitmap = 0;
 	char *buf;
 	errcode_t retval;
@@ -183,7 +292,8 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		retval = ext2fs_allocate_block_bitmap(fs, buf, &fs->block_map);
 		if (retval)
 			goto cleanup;
-		retval = io_channel_alloc_buf(fs->io, 0, &block_bitmap);
+		retval = io_channel_alloc_buf(fs->io, BITMAP_IO_RUN,
+					      &block_bitmap);
 		if (retval)
 			goto cleanup;
 	} else
@@ -196,7 +306,8 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		retval = ext2fs_allocate_inode_bitmap(fs, buf, &fs->inode_map);
 		if (retval)
 			goto cleanup;
-		retval = io_channel_alloc_buf(fs->io, 0, &inode_bitmap);
+		retval = io_channel_alloc_buf(fs->io, BITMAP_IO_RUN,
+					      &inode_bitmap);
 		if (retval)
 			goto cleanup;
 	} else
@@ -245,51 +356,17 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		goto success_cleanup;
 	}
 
-	for (i = 0; i < fs->group_desc_count; i++) {
-		if (block_bitmap) {
-			blk = ext2fs_block_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, block_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(block_bitmap, 0, block_nbytes);
-			cnt = block_nbytes << 3;
-			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
-					       blk_itr, cnt, block_bitmap);
-			if (retval)
-				goto cleanup;
-			blk_itr += block_nbytes << 3;
-		}
-		if (inode_bitmap) {
-			blk = ext2fs_inode_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, inode_bitmap);
-				if (retval) {
-					retval = EXT2_ET_INODE_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(inode_bitmap, 0, inode_nbytes);
-			cnt = inode_nbytes << 3;
-			retval = ext2fs_set_inode_bitmap_range2(fs->inode_map,
-					       ino_itr, cnt, inode_bitmap);
-			if (retval)
-				goto cleanup;
-			ino_itr += inode_nbytes << 3;
-		}
+	if (block_bitmap) {
+		retval = read_bitmap_groups(fs, 0, block_bitmap, block_nbytes,
+					    csum_flag);
+		if (retval)
+			goto cleanup;
+	}
+	if (inode_bitmap) {
+		retval = read_bitmap_groups(fs, 1, inode_bitmap, inode_nbytes,
+					    csum_flag);
+		if (retval)
+			goto cleanup;
 	}
 success_cleanup:
 	if (inode_bitmap)
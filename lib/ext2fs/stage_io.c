@@ -0,0 +1,758 @@
+/*
+ * stage_io.c --- This is the write staging I/O manager.
+ *
+ * It sits on top of another I/O manager and holds the blocks written
+ * through it in memory, so that a program which rewrites the same
+ * metadata blocks many times, as e2fsck does while it repairs a file
+ * system, sends each of them to the device only once.  The staged
+ * blocks are laid over whatever is read back, and are committed in
+ * block order, as runs of consecutive blocks, when the channel is
+ * flushed or closed, or when the memory set aside for them is full.
+ * On flash, where small scattered writes are the most expensive kind,
+ * this turns a repair into a few sequential passes over the metadata.
+ *
+ * Staging is turned on with the io_options which ext2fs_open2()
+ * takes, e.g. "/dev/sdb1?stage_writes=64m".  The blocks staged since
+ * the last flush are lost if the program dies; the undo I/O manager,
+ * put underneath this one, still saves the old contents of every
+ * block before it is overwritten.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+/* What is staged when stage_writes is given without a size */
+#define STAGE_DEFAULT_SIZE	(32 * 1024 * 1024)
+/* Writes of more blocks than this already go out in one piece */
+#define STAGE_DIRECT_SIZE	64
+/* The most buffers handed to the backing channel in one request */
+#define STAGE_MAX_VEC		64
+
+struct stage_block {
+	struct stage_block	*next;
+	unsigned long long	block;
+	char			*buf;
+};
+
+struct stage_private_data {
+	int	magic;
+	io_channel real;
+	int	writable;
+	unsigned long long	limit;		/* bytes; 0 is no staging */
+	unsigned int		max_blocks;
+	unsigned int		num_blocks;
+	unsigned int		hash_mask;
+	struct stage_block	**hash;
+	struct stage_block	**sorted;
+	struct stage_block	*spare;		/* committed, for reuse */
+};
+
+static errcode_t stage_open(const char *name, int flags,
+			    io_channel *channel);
+static errcode_t stage_close(io_channel channel);
+static errcode_t stage_set_blksize(io_channel channel, int blksize);
+static errcode_t stage_read_blk64(io_channel channel,
+				  unsigned long long block,
+				  int count, void *data);
+static errcode_t stage_write_blk64(io_channel channel,
+				   unsigned long long block,
+				   int count, const void *data);
+static errcode_t stage_read_blk(io_channel channel, unsigned long block,
+				int count, void *data);
+static errcode_t stage_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *data);
+static errcode_t stage_flush(io_channel channel);
+static errcode_t stage_write_byte(io_channel channel, unsigned long offset,
+				  int count, const void *buf);
+static errcode_t stage_set_option(io_channel channel, const char *option,
+				  const char *arg);
+static errcode_t stage_get_stats(io_channel channel, io_stats *stats);
+static errcode_t stage_discard(io_channel channel,
+			       unsigned long long block,
+			       unsigned long long count);
+static errcode_t stage_cache_readahead(io_channel channel,
+				       unsigned long long block,
+				       unsigned long long count);
+static errcode_t stage_read_blk_vec(io_channel channel,
+				    unsigned long long block,
+				    struct io_blk_vec *vec, int nr_vec);
+static errcode_t stage_write_blk_vec(io_channel channel,
+				     unsigned long long block,
+				     const struct io_blk_vec *vec,
+				     int nr_vec);
+static errcode_t stage_zeroout(io_channel channel,
+			       unsigned long long block,
+			       unsigned long long count);
+
+static struct struct_io_manager struct_stage_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"Write Staging I/O Manager",
+	stage_open,
+	stage_close,
+	stage_set_blksize,
+	stage_read_blk,
+	stage_write_blk,
+	stage_flush,
+	stage_write_byte,
+	stage_set_option,
+	stage_get_stats,
+	stage_read_blk64,
+	stage_write_blk64,
+	stage_discard,
+	stage_cache_readahead,
+	stage_read_blk_vec,
+	stage_write_blk_vec,
+	stage_zeroout,
+};
+
+io_manager stage_io_manager = &struct_stage_manager;
+static io_manager stage_io_backing_manager;
+
+errcode_t set_stage_io_backing_manager(io_manager manager)
+{
+	stage_io_backing_manager = manager;
+	return 0;
+}
+
+/*
+ * Does the io_options string opts ask for staging?  If so,
+ * ext2fs_open2() opens the device through this manager.
+ */
+int stage_io_wanted(const char *opts)
+{
+	size_t		len;
+
+	while (opts && *opts) {
+		len = strcspn(opts, "=&");
+		if (len == strlen("stage_writes") &&
+		    !strncmp(opts, "stage_writes", len))
+			return 1;
+		opts = strchr(opts, '&');
+		if (opts)
+			opts++;
+	}
+	return 0;
+}
+
+static struct stage_block **stage_slot(struct stage_private_data *data,
+				       unsigned long long block)
+{
+	struct stage_block	**pp;
+	unsigned long long	h;
+
+	h = block * 0x9E3779B97F4A7C15ULL;
+	pp = &data->hash[(h >> 32) & data->hash_mask];
+	while (*pp && (*pp)->block != block)
+		pp = &(*pp)->next;
+	return pp;
+}
+
+static struct stage_block *stage_find(struct stage_private_data *data,
+				      unsigned long long block)
+{
+	if (!data->num_blocks)
+		return NULL;
+	return *stage_slot(data, block);
+}
+
+static void stage_release(struct stage_private_data *data,
+			  struct stage_block **pp)
+{
+	struct stage_block	*sb = *pp;
+
+	*pp = sb->next;
+	sb->next = data->spare;
+	data->spare = sb;
+	data->num_blocks--;
+}
+
+/* Forget the staged copies of blocks which are about to be overwritten */
+static void stage_drop(struct stage_private_data *data,
+		       unsigned long long block, unsigned long long count)
+{
+	struct stage_block	**pp;
+	unsigned int		i;
+
+	if (!data->num_blocks)
+		return;
+	if (count <= data->num_blocks) {
+		for (; count > 0; block++, count--) {
+			pp = stage_slot(data, block);
+			if (*pp)
+				stage_release(data, pp);
+		}
+		return;
+	}
+	for (i = 0; i <= data->hash_mask && data->num_blocks; i++) {
+		pp = &data->hash[i];
+		while (*pp) {
+			if ((*pp)->block >= block &&
+			    (*pp)->block - block < count)
+				stage_release(data, pp);
+			else
+				pp = &(*pp)->next;
+		}
+	}
+}
+
+/*
+ * Copy the bytes of [offset, offset + size) which fall in staged
+ * blocks from buf into them, or, if to_staged is 0, from them into
+ * buf.
+ */
+static void stage_overlay(io_channel channel,
+			  struct stage_private_data *data,
+			  unsigned long long offset, unsigned long long size,
+			  char *buf, int to_staged)
+{
+	struct stage_block	*sb;
+	unsigned long long	block, end = offset + size;
+	unsigned long long	start, stop;
+	unsigned int		bs = channel->block_size;
+
+	if (!data->num_blocks || !size)
+		return;
+	for (block = offset / bs; block * bs < end; block++) {
+		sb = stage_find(data, block);
+		if (!sb)
+			continue;
+		start = block * bs > offset ? block * bs : offset;
+		stop = (block + 1) * bs < end ? (block + 1) * bs : end;
+		if (to_staged)
+			memcpy(sb->buf + (start - block * bs),
+			       buf + (start - offset), stop - start);
+		else
+			memcpy(buf + (start - offset),
+			       sb->buf + (start - block * bs), stop - start);
+	}
+}
+
+static int stage_cmp(const void *a, const void *b)
+{
+	const struct stage_block *sa = *(const struct stage_block * const *) a;
+	const struct stage_block *sb = *(const struct stage_block * const *) b;
+
+	if (sa->block < sb->block)
+		return -1;
+	return sa->block > sb->block;
+}
+
+/*
+ * Write out everything staged, in block order and a run of
+ * consecutive blocks at a time.  If a write fails, the blocks stay
+ * staged, so that the next flush tries them again.
+ */
+static errcode_t stage_commit(struct stage_private_data *data)
+{
+	struct io_blk_vec	vec[STAGE_MAX_VEC];
+	struct stage_block	*sb;
+	unsigned int		i, n = 0, nr_vec, run;
+	errcode_t		retval;
+
+	if (!data->num_blocks)
+		return 0;
+	for (i = 0; i <= data->hash_mask; i++)
+		for (sb = data->hash[i]; sb; sb = sb->next)
+			data->sorted[n++] = sb;
+	qsort(data->sorted, n, sizeof(struct stage_block *), stage_cmp);
+
+	for (i = 0; i < n; i += nr_vec) {
+		vec[0].buf = data->sorted[i]->buf;
+		vec[0].count = 1;
+		for (nr_vec = 1; nr_vec < STAGE_MAX_VEC && i + nr_vec < n;
+		     nr_vec++) {
+			run = i + nr_vec;
+			if (data->sorted[run]->block !=
+			    data->sorted[run - 1]->block + 1)
+				break;
+			vec[nr_vec].buf = data->sorted[run]->buf;
+			vec[nr_vec].count = 1;
+		}
+		retval = io_channel_write_blk_vec(data->real,
+						  data->sorted[i]->block,
+						  vec, nr_vec);
+		if (retval)
+			return retval;
+	}
+
+	for (i = 0; i <= data->hash_mask; i++)
+		while (data->hash[i])
+			stage_release(data, &data->hash[i]);
+	return 0;
+}
+
+static void stage_free_blocks(struct stage_private_data *data)
+{
+	struct stage_block	*sb;
+	unsigned int		i;
+
+	for (i = 0; data->hash && i <= data->hash_mask; i++)
+		while (data->hash[i])
+			stage_release(data, &data->hash[i]);
+	while ((sb = data->spare)) {
+		data->spare = sb->next;
+		ext2fs_free_mem(&sb);
+	}
+	if (data->hash)
+		ext2fs_free_mem(&data->hash);
+	if (data->sorted)
+		ext2fs_free_mem(&data->sorted);
+	data->max_blocks = 0;
+	data->hash_mask = 0;
+}
+
+/*
+ * Set aside room for limit bytes of the current block size, after
+ * committing whatever was staged in the old room.
+ */
+static errcode_t stage_setup(io_channel channel,
+			     struct stage_private_data *data,
+			     unsigned long long limit)
+{
+	unsigned long long	max_blocks;
+	unsigned int		hash_size;
+	errcode_t		retval;
+
+	retval = stage_commit(data);
+	if (retval)
+		return retval;
+	stage_free_blocks(data);
+	data->limit = limit;
+	if (!limit || !data->writable)
+		return 0;
+
+	max_blocks = limit / channel->block_size;
+	if (max_blocks < STAGE_DIRECT_SIZE)
+		max_blocks = STAGE_DIRECT_SIZE;
+	if (max_blocks > (1U << 30))
+		max_blocks = 1U << 30;
+	for (hash_size = 1; hash_size < max_blocks; hash_size <<= 1)
+		;
+	retval = ext2fs_get_array(hash_size, sizeof(struct stage_block *),
+				  &data->hash);
+	if (retval)
+		goto fail;
+	memset(data->hash, 0, hash_size * sizeof(struct stage_block *));
+	retval = ext2fs_get_array(max_blocks, sizeof(struct stage_block *),
+				  &data->sorted);
+	if (retval)
+		goto fail;
+	data->hash_mask = hash_size - 1;
+	data->max_blocks = max_blocks;
+	return 0;
+
+fail:
+	stage_free_blocks(data);
+	data->limit = 0;
+	return retval;
+}
+
+/* Stage one block, committing what is already staged if it is full */
+static errcode_t stage_put(io_channel channel,
+			   struct stage_private_data *data,
+			   unsigned long long block, const char *buf)
+{
+	struct stage_block	**pp, *sb;
+	errcode_t		retval;
+
+	pp = stage_slot(data, block);
+	if (!*pp) {
+		if (data->num_blocks >= data->max_blocks) {
+			retval = stage_commit(data);
+			if (retval)
+				return retval;
+			pp = stage_slot(data, block);
+		}
+		sb = data->spare;
+		if (sb)
+			data->spare = sb->next;
+		else {
+			retval = ext2fs_get_mem(sizeof(struct stage_block) +
+						channel->block_size, &sb);
+			if (retval)
+				return retval;
+			sb->buf = (char *) (sb + 1);
+		}
+		sb->block = block;
+		sb->next = NULL;
+		*pp = sb;
+		data->num_blocks++;
+	}
+	memcpy((*pp)->buf, buf, channel->block_size);
+	return 0;
+}
+
+static errcode_t stage_open(const char *name, int flags,
+			    io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct stage_private_data *data = NULL;
+	errcode_t	retval;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (!stage_io_backing_manager)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto cleanup;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct stage_private_data),
+				    &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->writable = (flags & IO_FLAG_RW) != 0;
+
+	io->manager = stage_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->refcount = 1;
+
+	retval = stage_io_backing_manager->open(name, flags, &data->real);
+	if (retval)
+		goto cleanup;
+	io->block_size = data->real->block_size;
+	retval = stage_setup(io, data, STAGE_DEFAULT_SIZE);
+	if (retval) {
+		io_channel_close(data->real);
+		goto cleanup;
+	}
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data)
+		ext2fs_free_mem(&data);
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t stage_close(io_channel channel)
+{
+	struct stage_private_data *data;
+	errcode_t	retval, retval2;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	retval = stage_commit(data);
+	stage_free_blocks(data);
+	retval2 = io_channel_close(data->real);
+	if (!retval)
+		retval = retval2;
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t stage_set_blksize(io_channel channel, int blksize)
+{
+	struct stage_private_data *data;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (channel->block_size == blksize)
+		return io_channel_set_blksize(data->real, blksize);
+	retval = stage_commit(data);
+	if (retval)
+		return retval;
+	retval = io_channel_set_blksize(data->real, blksize);
+	if (retval)
+		return retval;
+	channel->block_size = blksize;
+	return stage_setup(channel, data, data->limit);
+}
+
+static errcode_t stage_read_blk64(io_channel channel,
+				  unsigned long long block,
+				  int count, void *buf)
+{
+	struct stage_private_data *data;
+	unsigned long long size;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = io_channel_read_blk64(data->real, block, count, buf);
+	if (retval)
+		return retval;
+	size = count < 0 ? -count :
+		(unsigned long long) count * channel->block_size;
+	stage_overlay(channel, data, block * channel->block_size, size,
+		      buf, 0);
+	return 0;
+}
+
+static errcode_t stage_read_blk(io_channel channel, unsigned long block,
+				int count, void *buf)
+{
+	return stage_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t stage_write_blk64(io_channel channel,
+				   unsigned long long block,
+				   int count, const void *buf)
+{
+	struct stage_private_data *data;
+	const char	*cp = buf;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	/*
+	 * A write of less than a block goes straight through, and the
+	 * staged blocks it touches are updated to match, so that they
+	 * don't undo it when they are committed.
+	 */
+	if (count < 0) {
+		stage_overlay(channel, data, block * channel->block_size,
+			      -count, (char *) buf, 1);
+		return io_channel_write_blk64(data->real, block, count, buf);
+	}
+	if (!data->max_blocks || count > STAGE_DIRECT_SIZE) {
+		stage_drop(data, block, count);
+		return io_channel_write_blk64(data->real, block, count, buf);
+	}
+	for (; count > 0; count--, block++, cp += channel->block_size) {
+		retval = stage_put(channel, data, block, cp);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+static errcode_t stage_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *buf)
+{
+	return stage_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t stage_write_byte(io_channel channel, unsigned long offset,
+				  int size, const void *buf)
+{
+	struct stage_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	stage_overlay(channel, data, offset, size, (char *) buf, 1);
+	return io_channel_write_byte(data->real, offset, size, buf);
+}
+
+static errcode_t stage_read_blk_vec(io_channel channel,
+				    unsigned long long block,
+				    struct io_blk_vec *vec, int nr_vec)
+{
+	struct stage_private_data *data;
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = io_channel_read_blk_vec(data->real, block, vec, nr_vec);
+	if (retval)
+		return retval;
+	for (i = 0; i < nr_vec; block += vec[i++].count)
+		stage_overlay(channel, data, block * channel->block_size,
+			      (unsigned long long) vec[i].count *
+			      channel->block_size, vec[i].buf, 0);
+	return 0;
+}
+
+static errcode_t stage_write_blk_vec(io_channel channel,
+				     unsigned long long block,
+				     const struct io_blk_vec *vec,
+				     int nr_vec)
+{
+	struct stage_private_data *data;
+	unsigned long long count = 0;
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr_vec; i++) {
+		if (vec[i].count <= 0)
+			return EXT2_ET_INVALID_ARGUMENT;
+		count += vec[i].count;
+	}
+	if (!data->max_blocks || count > STAGE_DIRECT_SIZE) {
+		stage_drop(data, block, count);
+		return io_channel_write_blk_vec(data->real, block,
+						vec, nr_vec);
+	}
+	for (i = 0; i < nr_vec; block += vec[i++].count) {
+		retval = stage_write_blk64(channel, block, vec[i].count,
+					   vec[i].buf);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+static errcode_t stage_flush(io_channel channel)
+{
+	struct stage_private_data *data;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = stage_commit(data);
+	if (retval)
+		return retval;
+	return io_channel_flush(data->real);
+}
+
+static errcode_t stage_discard(io_channel channel,
+			       unsigned long long block,
+			       unsigned long long count)
+{
+	struct stage_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	stage_drop(data, block, count);
+	return io_channel_discard(data->real, block, count);
+}
+
+static errcode_t stage_cache_readahead(io_channel channel,
+				       unsigned long long block,
+				       unsigned long long count)
+{
+	struct stage_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return io_channel_cache_readahead(data->real, block, count);
+}
+
+/*
+ * If the backing channel can't zero the range itself, the caller
+ * writes zeroes over it, so the staged blocks in it can go either way.
+ */
+static errcode_t stage_zeroout(io_channel channel,
+			       unsigned long long block,
+			       unsigned long long count)
+{
+	struct stage_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	stage_drop(data, block, count);
+	return io_channel_zeroout(data->real, block, count);
+}
+
+/*
+ * "stage_writes=<bytes>" sets how much may be staged, with an optional
+ * k, m or g suffix; without a size it is 32m, and 0 commits what is
+ * staged and lets later writes straight through.  Everything else is
+ * passed on to the backing channel.
+ */
+static errcode_t stage_set_option(io_channel channel, const char *option,
+				  const char *arg)
+{
+	struct stage_private_data *data;
+	unsigned long long	val;
+	char			*end;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!strcmp(option, "stage_writes")) {
+		if (!arg || !*arg)
+			return stage_setup(channel, data, STAGE_DEFAULT_SIZE);
+		val = strtoull(arg, &end, 0);
+		switch (*end) {
+		case 'g': case 'G':
+			val *= 1024;
+			/* fall through */
+		case 'm': case 'M':
+			val *= 1024;
+			/* fall through */
+		case 'k': case 'K':
+			val *= 1024;
+			end++;
+		}
+		if (*end)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return stage_setup(channel, data, val);
+	}
+
+	if (!data->real->manager->set_option)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return data->real->manager->set_option(data->real, option, arg);
+}
+
+static errcode_t stage_get_stats(io_channel channel, io_stats *stats)
+{
+	struct stage_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct stage_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!data->real->manager->get_stats)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	return data->real->manager->get_stats(data->real, stats);
+}
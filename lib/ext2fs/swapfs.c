@@ -20,6 +20,10 @@
 #include "ext2fs.h"
 #include <ext2fs/ext2_ext_attr.h>
 
+#ifndef offsetof
+#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#endif
+
 #ifdef WORDS_BIGENDIAN
 void ext2fs_swap_super(struct ext2_super_block * sb)
 {
@@ -199,14 +203,17 @@ void ext2fs_swap_ext_attr(char *to, char *from, int bufsize, int has_header)
 	}
 }
 
+static void swap_inode_extra(ext2_filsys fs, struct ext2_inode_large *t,
+			     struct ext2_inode_large *f, int hostorder,
+			     int bufsize);
+
 void ext2fs_swap_inode_full(ext2_filsys fs, struct ext2_inode_large *t,
 			    struct ext2_inode_large *f, int hostorder,
 			    int bufsize)
 {
-	unsigned i, has_data_blocks, extra_isize, attr_magic;
+	unsigned i, has_data_blocks;
 	int has_extents = 0;
 	int islnk = 0;
-	__u32 *eaf, *eat;
 
 	if (hostorder && LINUX_S_ISLNK(f->i_mode))
 		islnk = 1;
@@ -279,6 +286,20 @@ void ext2fs_swap_inode_full(ext2_filsys fs, struct ext2_inode_large *t,
 		break;
 	}
 
+	swap_inode_extra(fs, t, f, hostorder, bufsize);
+}
+
+/*
+ * Swap the fields past the end of struct ext2_inode, and the extended
+ * attributes stored in the inode.
+ */
+static void swap_inode_extra(ext2_filsys fs, struct ext2_inode_large *t,
+			     struct ext2_inode_large *f, int hostorder,
+			     int bufsize)
+{
+	unsigned i, extra_isize, attr_magic;
+	__u32 *eaf, *eat;
+
 	if (bufsize < (int) (sizeof(struct ext2_inode) + sizeof(__u16)))
 		return; /* no i_extra_isize field */
 
@@ -330,7 +351,6 @@ void ext2fs_swap_inode_full(ext2_filsys fs, struct ext2_inode_large *t,
 	ext2fs_swap_ext_attr((char *) (eat + 1), (char *) (eaf + 1),
 			     bufsize - sizeof(struct ext2_inode) -
 			     extra_isize - sizeof(__u32), 0);
-
 }
 
 void ext2fs_swap_inode(ext2_filsys fs, struct ext2_inode *t,
@@ -341,6 +361,134 @@ void ext2fs_swap_inode(ext2_filsys fs, struct ext2_inode *t,
 				sizeof(struct ext2_inode));
 }
 
+/*
+ * Swapping a whole buffer of inodes at a time.  Apart from i_block,
+ * whether a field of struct ext2_inode needs swapping depends only on
+ * the creator OS, so the first 128 bytes of every inode get the same
+ * byte permutation, which is built once per buffer and applied 16
+ * bytes at a time; i_block is swapped along with the rest and swapped
+ * back for the inodes which keep it in disk order.
+ */
+static void swap_permute(unsigned char *p, const unsigned char *perm)
+{
+	unsigned char	tmp[16];
+	int		i, j;
+
+	for (i = 0; i < 128; i += 16) {
+		memcpy(tmp, p + i, sizeof(tmp));
+		for (j = 0; j < 16; j++)
+			p[i + j] = tmp[perm[i + j]];
+	}
+}
+
+static void perm_swab(unsigned char *perm, int offset, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		perm[offset + i] = (offset & 15) + size - 1 - i;
+}
+
+/*
+ * Build the permutation for the fields which ext2fs_swap_inode_full()
+ * swaps; each byte gives the position, within its 16 byte chunk, of
+ * the byte which is to be moved there.
+ */
+static void inode_swap_perm(ext2_filsys fs, unsigned char *perm)
+{
+	int i;
+
+	for (i = 0; i < 128; i++)
+		perm[i] = i & 15;
+	perm_swab(perm, offsetof(struct ext2_inode, i_mode), 2);
+	perm_swab(perm, offsetof(struct ext2_inode, i_uid), 2);
+	for (i = offsetof(struct ext2_inode, i_size);
+	     i <= (int) offsetof(struct ext2_inode, i_dtime); i += 4)
+		perm_swab(perm, i, 4);
+	perm_swab(perm, offsetof(struct ext2_inode, i_gid), 2);
+	perm_swab(perm, offsetof(struct ext2_inode, i_links_count), 2);
+	perm_swab(perm, offsetof(struct ext2_inode, i_blocks), 4);
+	perm_swab(perm, offsetof(struct ext2_inode, i_flags), 4);
+	for (i = 0; i < EXT2_N_BLOCKS; i++)
+		perm_swab(perm, offsetof(struct ext2_inode, i_block) + 4 * i,
+			  4);
+	perm_swab(perm, offsetof(struct ext2_inode, i_generation), 4);
+	perm_swab(perm, offsetof(struct ext2_inode, i_file_acl), 4);
+	perm_swab(perm, offsetof(struct ext2_inode, i_dir_acl), 4);
+	perm_swab(perm, offsetof(struct ext2_inode, i_faddr), 4);
+
+	switch (fs->super->s_creator_os) {
+	case EXT2_OS_LINUX:
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd1.linux1.l_i_version), 4);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.linux2.l_i_blocks_hi), 2);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.linux2.l_i_file_acl_high), 2);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.linux2.l_i_uid_high), 2);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.linux2.l_i_gid_high), 2);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.linux2.l_i_checksum_lo), 2);
+		break;
+	case EXT2_OS_HURD:
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd1.hurd1.h_i_translator), 4);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.hurd2.h_i_mode_high), 2);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.hurd2.h_i_uid_high), 2);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.hurd2.h_i_gid_high), 2);
+		perm_swab(perm, offsetof(struct ext2_inode,
+			osd2.hurd2.h_i_author), 4);
+		break;
+	default:
+		break;
+	}
+}
+
+/* The inodes whose i_block ext2fs_swap_inode_full() leaves alone */
+static int inode_keeps_blocks(ext2_filsys fs, struct ext2_inode *inode)
+{
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return 1;
+	return LINUX_S_ISLNK(inode->i_mode) &&
+		!ext2fs_inode_data_blocks(fs, inode);
+}
+
+/*
+ * Swap count whole inodes of the file system's inode size in place, as
+ * ext2fs_swap_inode_full() would swap each of them into itself.
+ */
+void ext2fs_swap_inode_table(ext2_filsys fs, void *buf, int count,
+			     int hostorder)
+{
+	struct ext2_inode_large *inode;
+	char *p = buf;
+	int inode_size = EXT2_INODE_SIZE(fs->super);
+	unsigned char perm[128];
+	int keep = 0, i;
+
+	inode_swap_perm(fs, perm);
+	for (; count > 0; count--, p += inode_size) {
+		inode = (struct ext2_inode_large *) p;
+		if (hostorder)
+			keep = inode_keeps_blocks(fs,
+					(struct ext2_inode *) inode);
+		swap_permute((unsigned char *) p, perm);
+		if (!hostorder)
+			keep = inode_keeps_blocks(fs,
+					(struct ext2_inode *) inode);
+		if (keep)
+			for (i = 0; i < EXT2_N_BLOCKS; i++)
+				inode->i_block[i] =
+					ext2fs_swab32(inode->i_block[i]);
+		swap_inode_extra(fs, inode, inode, hostorder, inode_size);
+	}
+}
+
 void ext2fs_swap_mmp(struct mmp_struct *mmp)
 {
 	mmp->mmp_magic = ext2fs_swab32(mmp->mmp_magic);
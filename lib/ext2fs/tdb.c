@@ -141,6 +141,7 @@ typedef u32 tdb_off_t;
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
 #define TDB_PAD_BYTE 0x42
 #define TDB_PAD_U32  0x42424242
+#define TDB_MAX_RESERVE (1 << 30)
 
 /* NB assumes there is a local variable called "tdb" that is the
  * current context, also takes doubly-parenthesized print-style
@@ -1010,13 +1011,20 @@ void tdb_mmap(struct tdb_context *tdb)
   says to use for mmap expansion */
 static int tdb_expand_file(struct tdb_context *tdb, tdb_off_t size, tdb_off_t addition)
 {
-	char buf[1024];
+	char buf[8192];
 
 	if (tdb->read_only || tdb->traverse_read) {
 		tdb->ecode = TDB_ERR_RDONLY;
 		return -1;
 	}
 
+#if defined(_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+	/* reserving the space is enough to keep the file from being
+	   sparse, and is much cheaper than writing it */
+	if (posix_fallocate(tdb->fd, size, addition) == 0)
+		return 0;
+#endif
+
 	if (ftruncate(tdb->fd, size+addition) == -1) {
 		char b = 0;
 		if (pwrite(tdb->fd,  &b, 1, (size+addition) - 1) != 1) {
@@ -1045,9 +1053,10 @@ static int tdb_expand_file(struct tdb_context *tdb, tdb_off_t size, tdb_off_t ad
 }
 
 
-/* expand the database at least size bytes by expanding the underlying
-   file and doing the mmap again if necessary */
-int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
+/* expand the database by size bytes, rounded up to a multiple of the
+   page size, by expanding the underlying file and doing the mmap again
+   if necessary */
+static int tdb_expand_by(struct tdb_context *tdb, tdb_off_t size)
 {
 	struct list_struct rec;
 	tdb_off_t offset;
@@ -1057,12 +1066,12 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 		return -1;
 	}
 
-	/* must know about any previous expansions by another process */
-	tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+	/* must know about any previous expansions by another process;
+	   without locking there can't be another process */
+	if (!(tdb->flags & TDB_NOLOCK))
+		tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
 
-	/* always make room for at least 10 more records, and round
-           the database up to a multiple of the page size */
-	size = TDB_ALIGN(tdb->map_size + size*10, tdb->page_size) - tdb->map_size;
+	size = TDB_ALIGN(tdb->map_size + size, tdb->page_size) - tdb->map_size;
 
 	if (!(tdb->flags & TDB_INTERNAL))
 		tdb_munmap(tdb);
@@ -1116,6 +1125,34 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 	return -1;
 }
 
+/* expand the database at least size bytes.  Always make room for at
+   least 100 more records, and grow by at least a quarter of the
+   current size, so that filling a large database only needs a few
+   expansions (each of which remaps the whole file) */
+int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
+{
+	tdb_off_t growth = size * 100;
+
+	if (growth < tdb->map_size / 4)
+		growth = tdb->map_size / 4;
+	return tdb_expand_by(tdb, growth);
+}
+
+/* make room for size more bytes of records in one go, when the caller
+   knows roughly how big the database is going to get */
+int tdb_reserve(struct tdb_context *tdb, size_t size)
+{
+	if (tdb->read_only || tdb->traverse_read) {
+		tdb->ecode = TDB_ERR_RDONLY;
+		return -1;
+	}
+	/* this is only a hint, so don't let it grow the database past
+	   what a tdb_off_t can comfortably address */
+	if (size > TDB_MAX_RESERVE)
+		size = TDB_MAX_RESERVE;
+	return tdb_expand_by(tdb, size);
+}
+
 /* read/write a tdb_off_t */
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d)
 {
@@ -3719,7 +3756,6 @@ static unsigned int default_tdb_hash(TDB_DATA *key)
 	return value;
 }
 
-
 /* initialise a new database with a specified hash size */
 static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 {
@@ -3848,6 +3884,13 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 
 	if (hash_size == 0)
 		hash_size = DEFAULT_HASH_SIZE;
+	/* The default hash of a short key keeps its low bytes in the
+	   high bits, so with an even number of chains consecutive keys
+	   such as inode numbers pile up on a few of them.  This only
+	   matters for new databases; an existing one keeps the hash size
+	   in its header. */
+	if (!hash_fn)
+		hash_size |= 1;
 	if ((open_flags & O_ACCMODE) == O_RDONLY) {
 		tdb->read_only = 1;
 		/* read only databases don't do locking or clear if first */
@@ -111,6 +111,7 @@ typedef struct TDB_DATA {
 #define tdb_get_seqnum ext2fs_tdb_get_seqnum
 #define tdb_hash_size ext2fs_tdb_hash_size
 #define tdb_map_size ext2fs_tdb_map_size
+#define tdb_reserve ext2fs_tdb_reserve
 #define tdb_get_flags ext2fs_tdb_get_flags
 #define tdb_chainlock ext2fs_tdb_chainlock
 #define tdb_chainunlock ext2fs_tdb_chainunlock
@@ -188,6 +189,7 @@ int tdb_transaction_recover(struct tdb_context *tdb);
 int tdb_get_seqnum(struct tdb_context *tdb);
 int tdb_hash_size(struct tdb_context *tdb);
 size_t tdb_map_size(struct tdb_context *tdb);
+int tdb_reserve(struct tdb_context *tdb, size_t size);
 int tdb_get_flags(struct tdb_context *tdb);
 void tdb_enable_seqnum(struct tdb_context *tdb);
 void tdb_increment_seqnum_nonblock(struct tdb_context *tdb);
@@ -0,0 +1,823 @@
+/*
+ * template_io.c --- This is the metadata template I/O manager.
+ *
+ * It sits on top of another I/O manager and remembers which parts of
+ * the device were written through it, noting as it goes which of the
+ * writes were nothing but zeroes.  mke2fs formats through it when it
+ * is asked to save a template: once the new file system has been
+ * flushed, template_io_save() reads back what was written and stores
+ * it in a file, as a list of extents in disk order, each of which is
+ * either zeroes or the data itself.  template_io_apply() writes such a
+ * file to another device with a request per extent, so that a file
+ * system which has been made once can be made again on many identical
+ * devices without laying it out and sending its metadata to the
+ * device in small scattered writes each time.  Patching the fields
+ * which must differ from one copy to the next, such as the UUID, is
+ * up to the caller.
+ *
+ * A template starts with a struct template_header, which holds a copy
+ * of the primary superblock so that the caller can check that the
+ * template fits, followed by the extents: a struct template_extent
+ * for each, followed by the data of the data extents.  Extents are
+ * sector aligned, sorted and don't overlap.  All fields are stored
+ * little-endian.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define TEMPLATE_MAGIC		"E2MKTPL1"
+#define TEMPLATE_MAGIC_LEN	8
+
+/* Everything is recorded and written in sectors of this size */
+#define TEMPLATE_SECTOR		512
+/* The most data read or written in one request */
+#define TEMPLATE_BUF_SIZE	(8 * 1024 * 1024)
+
+struct template_header {
+	char	magic[TEMPLATE_MAGIC_LEN];
+	__u32	num_extents;
+	__u32	reserved;
+	char	super[SUPERBLOCK_SIZE];	/* as it is on disk */
+};
+
+/* Values of template_extent.type */
+#define TEMPLATE_EXTENT_DATA	1	/* followed by len bytes of data */
+#define TEMPLATE_EXTENT_ZERO	2
+
+struct template_extent {
+	__u64	start;		/* in bytes */
+	__u64	len;
+	__u32	type;
+	__u32	reserved;
+};
+
+struct template_range {
+	unsigned long long	start, end;	/* in bytes */
+};
+
+struct template_ranges {
+	struct template_range	*list;
+	size_t			num, max;
+};
+
+struct template_private_data {
+	int	magic;
+	io_channel real;
+	errcode_t	errcode;	/* first failure to record a write */
+	struct template_ranges	written;	/* read back when saved */
+	struct template_ranges	zeroed;		/* nothing but zeroes */
+};
+
+static errcode_t template_open(const char *name, int flags,
+			       io_channel *channel);
+static errcode_t template_close(io_channel channel);
+static errcode_t template_set_blksize(io_channel channel, int blksize);
+static errcode_t template_read_blk64(io_channel channel,
+				     unsigned long long block,
+				     int count, void *data);
+static errcode_t template_write_blk64(io_channel channel,
+				      unsigned long long block,
+				      int count, const void *data);
+static errcode_t template_read_blk(io_channel channel, unsigned long block,
+				   int count, void *data);
+static errcode_t template_write_blk(io_channel channel, unsigned long block,
+				    int count, const void *data);
+static errcode_t template_flush(io_channel channel);
+static errcode_t template_write_byte(io_channel channel, unsigned long offset,
+				     int count, const void *buf);
+static errcode_t template_set_option(io_channel channel, const char *option,
+				     const char *arg);
+static errcode_t template_get_stats(io_channel channel, io_stats *stats);
+static errcode_t template_discard(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count);
+static errcode_t template_cache_readahead(io_channel channel,
+					  unsigned long long block,
+					  unsigned long long count);
+static errcode_t template_zeroout(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count);
+
+/*
+ * There are no vectored requests here: io_channel_write_blk_vec()
+ * hands each buffer to template_write_blk64(), which sees the data.
+ */
+static struct struct_io_manager struct_template_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"Metadata Template I/O Manager",
+	template_open,
+	template_close,
+	template_set_blksize,
+	template_read_blk,
+	template_write_blk,
+	template_flush,
+	template_write_byte,
+	template_set_option,
+	template_get_stats,
+	template_read_blk64,
+	template_write_blk64,
+	template_discard,
+	template_cache_readahead,
+	NULL,
+	NULL,
+	template_zeroout,
+};
+
+io_manager template_io_manager = &struct_template_manager;
+static io_manager template_io_backing_manager;
+
+errcode_t set_template_io_backing_manager(io_manager manager)
+{
+	template_io_backing_manager = manager;
+	return 0;
+}
+
+/* Add [start, end) to r, widened to whole sectors */
+static errcode_t add_range(struct template_ranges *r,
+			   unsigned long long start, unsigned long long end)
+{
+	struct template_range	*last;
+	errcode_t		retval;
+	size_t			new_max;
+
+	start -= start % TEMPLATE_SECTOR;
+	end = (end + TEMPLATE_SECTOR - 1) / TEMPLATE_SECTOR *
+		TEMPLATE_SECTOR;
+	if (start >= end)
+		return 0;
+	if (r->num) {
+		last = &r->list[r->num - 1];
+		if (start >= last->start && start <= last->end) {
+			if (end > last->end)
+				last->end = end;
+			return 0;
+		}
+	}
+	if (r->num >= r->max) {
+		new_max = r->max ? r->max * 2 : 256;
+		retval = ext2fs_resize_mem(r->max *
+					   sizeof(struct template_range),
+					   new_max *
+					   sizeof(struct template_range),
+					   &r->list);
+		if (retval)
+			return retval;
+		r->max = new_max;
+	}
+	r->list[r->num].start = start;
+	r->list[r->num].end = end;
+	r->num++;
+	return 0;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct template_range *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/* Sort r and merge the ranges in it which overlap or touch */
+static void normalize_ranges(struct template_ranges *r)
+{
+	size_t	i, n = 0;
+
+	if (!r->num)
+		return;
+	qsort(r->list, r->num, sizeof(struct template_range), range_cmp);
+	for (i = 1; i < r->num; i++) {
+		if (r->list[i].start <= r->list[n].end) {
+			if (r->list[i].end > r->list[n].end)
+				r->list[n].end = r->list[i].end;
+		} else
+			r->list[++n] = r->list[i];
+	}
+	r->num = n + 1;
+}
+
+/*
+ * Take what was written with data out of the zeroed ranges: the data
+ * is read back when the template is saved, so it is right even if the
+ * zeroes came later.  Both lists must be normalized.
+ */
+static errcode_t subtract_ranges(struct template_ranges *zeroed,
+				 const struct template_ranges *written)
+{
+	struct template_ranges	out;
+	unsigned long long	start, end;
+	size_t			i, j = 0;
+	errcode_t		retval;
+
+	memset(&out, 0, sizeof(out));
+	for (i = 0; i < zeroed->num; i++) {
+		start = zeroed->list[i].start;
+		end = zeroed->list[i].end;
+		while (j < written->num && written->list[j].end <= start)
+			j++;
+		while (start < end) {
+			if (j >= written->num ||
+			    written->list[j].start >= end) {
+				retval = add_range(&out, start, end);
+				if (retval)
+					goto fail;
+				break;
+			}
+			if (written->list[j].start > start) {
+				retval = add_range(&out, start,
+						   written->list[j].start);
+				if (retval)
+					goto fail;
+			}
+			start = written->list[j].end;
+			if (start >= end)
+				break;
+			j++;
+		}
+	}
+	if (zeroed->list)
+		ext2fs_free_mem(&zeroed->list);
+	*zeroed = out;
+	return 0;
+
+fail:
+	if (out.list)
+		ext2fs_free_mem(&out.list);
+	return retval;
+}
+
+static int buf_is_zero(const char *buf, size_t len)
+{
+	return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+/*
+ * Note a write of size bytes at offset, a block of the channel at a
+ * time, so that the blocks of zeroes in it are told apart from the
+ * others.
+ */
+static void note_write(io_channel channel, struct template_private_data *data,
+		       unsigned long long offset, unsigned long long size,
+		       const char *buf)
+{
+	unsigned long long	done, run = 0, len;
+	int			zero, run_zero = 0;
+	errcode_t		retval = 0;
+
+	for (done = 0; done < size; done += len) {
+		len = size - done;
+		if (len > (unsigned) channel->block_size)
+			len = channel->block_size;
+		zero = buf_is_zero(buf + done, len);
+		if (done && zero != run_zero) {
+			retval = add_range(run_zero ? &data->zeroed :
+					   &data->written, offset + run,
+					   offset + done);
+			if (retval)
+				break;
+			run = done;
+		}
+		run_zero = zero;
+	}
+	if (!retval && size)
+		retval = add_range(run_zero ? &data->zeroed : &data->written,
+				   offset + run, offset + size);
+	if (retval && !data->errcode)
+		data->errcode = retval;
+}
+
+static errcode_t template_open(const char *name, int flags,
+			       io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct template_private_data *data = NULL;
+	errcode_t	retval;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (!template_io_backing_manager)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto cleanup;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct template_private_data),
+				    &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+
+	io->manager = template_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->refcount = 1;
+
+	retval = template_io_backing_manager->open(name, flags, &data->real);
+	if (retval)
+		goto cleanup;
+	io->block_size = data->real->block_size;
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data)
+		ext2fs_free_mem(&data);
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t template_close(io_channel channel)
+{
+	struct template_private_data *data;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	retval = io_channel_close(data->real);
+	if (data->written.list)
+		ext2fs_free_mem(&data->written.list);
+	if (data->zeroed.list)
+		ext2fs_free_mem(&data->zeroed.list);
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t template_set_blksize(io_channel channel, int blksize)
+{
+	struct template_private_data *data;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = io_channel_set_blksize(data->real, blksize);
+	if (retval)
+		return retval;
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t template_read_blk64(io_channel channel,
+				     unsigned long long block,
+				     int count, void *buf)
+{
+	struct template_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return io_channel_read_blk64(data->real, block, count, buf);
+}
+
+static errcode_t template_read_blk(io_channel channel, unsigned long block,
+				   int count, void *buf)
+{
+	return template_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t template_write_blk64(io_channel channel,
+				      unsigned long long block,
+				      int count, const void *buf)
+{
+	struct template_private_data *data;
+	unsigned long long size;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = io_channel_write_blk64(data->real, block, count, buf);
+	if (retval)
+		return retval;
+	size = count < 0 ? -count :
+		(unsigned long long) count * channel->block_size;
+	note_write(channel, data, block * channel->block_size, size, buf);
+	return 0;
+}
+
+static errcode_t template_write_blk(io_channel channel, unsigned long block,
+				    int count, const void *buf)
+{
+	return template_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t template_write_byte(io_channel channel, unsigned long offset,
+				     int size, const void *buf)
+{
+	struct template_private_data *data;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = io_channel_write_byte(data->real, offset, size, buf);
+	if (retval)
+		return retval;
+	/* Only part of a sector, so it has to be read back */
+	retval = add_range(&data->written, offset, offset + size);
+	if (retval && !data->errcode)
+		data->errcode = retval;
+	return 0;
+}
+
+static errcode_t template_flush(io_channel channel)
+{
+	struct template_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return io_channel_flush(data->real);
+}
+
+/* What a discard leaves behind varies, so it isn't recorded */
+static errcode_t template_discard(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count)
+{
+	struct template_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return io_channel_discard(data->real, block, count);
+}
+
+static errcode_t template_cache_readahead(io_channel channel,
+					  unsigned long long block,
+					  unsigned long long count)
+{
+	struct template_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return io_channel_cache_readahead(data->real, block, count);
+}
+
+static errcode_t template_zeroout(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count)
+{
+	struct template_private_data *data;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = io_channel_zeroout(data->real, block, count);
+	if (retval)
+		return retval;
+	retval = add_range(&data->zeroed, block * channel->block_size,
+			   (block + count) * channel->block_size);
+	if (retval && !data->errcode)
+		data->errcode = retval;
+	return 0;
+}
+
+static errcode_t template_set_option(io_channel channel, const char *option,
+				     const char *arg)
+{
+	struct template_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!data->real->manager->set_option)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return data->real->manager->set_option(data->real, option, arg);
+}
+
+static errcode_t template_get_stats(io_channel channel, io_stats *stats)
+{
+	struct template_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!data->real->manager->get_stats)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	return data->real->manager->get_stats(data->real, stats);
+}
+
+static errcode_t put_extent(FILE *f, unsigned long long start,
+			    unsigned long long len, int type)
+{
+	struct template_extent	ext;
+
+	memset(&ext, 0, sizeof(ext));
+	ext.start = ext2fs_cpu_to_le64(start);
+	ext.len = ext2fs_cpu_to_le64(len);
+	ext.type = ext2fs_cpu_to_le32(type);
+	if (fwrite(&ext, sizeof(ext), 1, f) != 1)
+		return errno ? errno : EXT2_ET_SHORT_WRITE;
+	return 0;
+}
+
+/* Copy [start, end) of the device to the template, read back in sectors */
+static errcode_t put_data(FILE *f, io_channel real, char *buf,
+			  unsigned long long start, unsigned long long end)
+{
+	unsigned long long	len;
+	errcode_t		retval;
+
+	retval = put_extent(f, start, end - start, TEMPLATE_EXTENT_DATA);
+	for (; !retval && start < end; start += len) {
+		len = end - start;
+		if (len > TEMPLATE_BUF_SIZE)
+			len = TEMPLATE_BUF_SIZE;
+		retval = io_channel_read_blk64(real, start / TEMPLATE_SECTOR,
+					       len / TEMPLATE_SECTOR, buf);
+		if (retval)
+			break;
+		if (fwrite(buf, len, 1, f) != 1)
+			retval = errno ? errno : EXT2_ET_SHORT_WRITE;
+	}
+	return retval;
+}
+
+/*
+ * Save what has been written through channel, which must have been
+ * opened with template_io_manager, as a template in file_name.  The
+ * caller flushes the file system first.
+ */
+errcode_t template_io_save(io_channel channel, const char *file_name)
+{
+	struct template_private_data *data;
+	struct template_header	hdr;
+	struct template_ranges	*w, *z;
+	FILE			*f = NULL;
+	char			*buf = NULL;
+	size_t			i = 0, j = 0;
+	int			blksize;
+	errcode_t		retval, retval2;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	if (channel->manager != template_io_manager)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	data = (struct template_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+	blksize = channel->block_size;
+	if (data->errcode)
+		return data->errcode;
+
+	w = &data->written;
+	z = &data->zeroed;
+	normalize_ranges(w);
+	normalize_ranges(z);
+	retval = subtract_ranges(z, w);
+	if (retval)
+		return retval;
+
+	retval = io_channel_flush(data->real);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(TEMPLATE_BUF_SIZE, &buf);
+	if (retval)
+		return retval;
+	retval = io_channel_set_blksize(data->real, TEMPLATE_SECTOR);
+	if (retval)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TEMPLATE_MAGIC, TEMPLATE_MAGIC_LEN);
+	hdr.num_extents = ext2fs_cpu_to_le32(w->num + z->num);
+	retval = io_channel_read_blk64(data->real,
+				       SUPERBLOCK_OFFSET / TEMPLATE_SECTOR,
+				       -SUPERBLOCK_SIZE, hdr.super);
+	if (retval)
+		goto out;
+
+	f = fopen(file_name, "w");
+	if (!f) {
+		retval = errno;
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		retval = errno ? errno : EXT2_ET_SHORT_WRITE;
+		goto out;
+	}
+	while (!retval && (i < w->num || j < z->num)) {
+		if (j >= z->num ||
+		    (i < w->num && w->list[i].start < z->list[j].start)) {
+			retval = put_data(f, data->real, buf, w->list[i].start,
+					  w->list[i].end);
+			i++;
+		} else {
+			retval = put_extent(f, z->list[j].start,
+					    z->list[j].end - z->list[j].start,
+					    TEMPLATE_EXTENT_ZERO);
+			j++;
+		}
+	}
+
+out:
+	if (f && fclose(f) && !retval)
+		retval = errno;
+	if (retval && f)
+		unlink(file_name);
+	retval2 = io_channel_set_blksize(data->real, blksize);
+	if (!retval)
+		retval = retval2;
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+static errcode_t get_header(FILE *f, struct template_header *hdr)
+{
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+	    memcmp(hdr->magic, TEMPLATE_MAGIC, TEMPLATE_MAGIC_LEN))
+		return EXT2_ET_TEMPLATE_CORRUPT;
+	hdr->num_extents = ext2fs_le32_to_cpu(hdr->num_extents);
+	return 0;
+}
+
+/*
+ * Read the superblock kept in the template file_name, so that the
+ * caller can check that it is the file system it means to make.
+ */
+errcode_t template_io_read_super(const char *file_name,
+				 struct ext2_super_block *super)
+{
+	struct template_header	hdr;
+	FILE			*f;
+	errcode_t		retval;
+
+	f = fopen(file_name, "r");
+	if (!f)
+		return errno;
+	retval = get_header(f, &hdr);
+	fclose(f);
+	if (retval)
+		return retval;
+	memcpy(super, hdr.super, SUPERBLOCK_SIZE);
+#ifdef WORDS_BIGENDIAN
+	ext2fs_swap_super(super);
+#endif
+	if (super->s_magic != EXT2_SUPER_MAGIC)
+		return EXT2_ET_TEMPLATE_CORRUPT;
+	return 0;
+}
+
+/* Write len bytes of zeroes at start, if the device can't do it itself */
+static errcode_t write_zeroes(io_channel channel, char *buf,
+			      unsigned long long start,
+			      unsigned long long len)
+{
+	unsigned long long	n;
+	errcode_t		retval;
+
+	if (io_channel_zeroout(channel, start / TEMPLATE_SECTOR,
+			       len / TEMPLATE_SECTOR) == 0)
+		return 0;
+	memset(buf, 0, TEMPLATE_BUF_SIZE);
+	for (; len; start += n, len -= n) {
+		n = len > TEMPLATE_BUF_SIZE ? TEMPLATE_BUF_SIZE : len;
+		retval = io_channel_write_blk64(channel,
+						start / TEMPLATE_SECTOR,
+						n / TEMPLATE_SECTOR, buf);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * Write the template file_name to channel, in order and a request per
+ * extent of up to 8 megabytes.  With TEMPLATE_IO_SKIP_ZEROES in flags,
+ * the device is known to read back zeroes already (after a discard,
+ * say) and the zero extents are skipped.
+ */
+errcode_t template_io_apply(io_channel channel, const char *file_name,
+			    int flags)
+{
+	struct template_header	hdr;
+	struct template_extent	ext;
+	unsigned long long	start, len, n, next = 0;
+	unsigned int		i;
+	FILE			*f;
+	char			*buf = NULL;
+	int			blksize, type;
+	errcode_t		retval, retval2;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	blksize = channel->block_size;
+
+	f = fopen(file_name, "r");
+	if (!f)
+		return errno;
+	retval = get_header(f, &hdr);
+	if (retval)
+		goto out_close;
+	retval = ext2fs_get_mem(TEMPLATE_BUF_SIZE, &buf);
+	if (retval)
+		goto out_close;
+	retval = io_channel_set_blksize(channel, TEMPLATE_SECTOR);
+	if (retval)
+		goto out_free;
+
+	for (i = 0; i < hdr.num_extents; i++) {
+		if (fread(&ext, sizeof(ext), 1, f) != 1) {
+			retval = EXT2_ET_TEMPLATE_CORRUPT;
+			break;
+		}
+		start = ext2fs_le64_to_cpu(ext.start);
+		len = ext2fs_le64_to_cpu(ext.len);
+		type = ext2fs_le32_to_cpu(ext.type);
+		if (start < next || !len || start + len < start ||
+		    (start % TEMPLATE_SECTOR) || (len % TEMPLATE_SECTOR) ||
+		    (type != TEMPLATE_EXTENT_DATA &&
+		     type != TEMPLATE_EXTENT_ZERO)) {
+			retval = EXT2_ET_TEMPLATE_CORRUPT;
+			break;
+		}
+		next = start + len;
+
+		if (type == TEMPLATE_EXTENT_ZERO) {
+			if (flags & TEMPLATE_IO_SKIP_ZEROES)
+				continue;
+			retval = write_zeroes(channel, buf, start, len);
+			if (retval)
+				break;
+			continue;
+		}
+		for (; len; start += n, len -= n) {
+			n = len > TEMPLATE_BUF_SIZE ? TEMPLATE_BUF_SIZE : len;
+			if (fread(buf, n, 1, f) != 1) {
+				retval = EXT2_ET_TEMPLATE_CORRUPT;
+				break;
+			}
+			retval = io_channel_write_blk64(channel,
+						start / TEMPLATE_SECTOR,
+						n / TEMPLATE_SECTOR, buf);
+			if (retval)
+				break;
+		}
+		if (retval)
+			break;
+	}
+	if (!retval)
+		retval = io_channel_flush(channel);
+
+	retval2 = io_channel_set_blksize(channel, blksize);
+	if (!retval)
+		retval = retval2;
+out_free:
+	ext2fs_free_mem(&buf);
+out_close:
+	fclose(f);
+	return retval;
+}
@@ -81,6 +81,11 @@ static errcode_t test_set_option(io_channel channel, const char *option,
 static errcode_t test_get_stats(io_channel channel, io_stats *stats);
 static errcode_t test_discard(io_channel channel, unsigned long long block,
 			      unsigned long long count);
+static errcode_t test_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
+static errcode_t test_zeroout(io_channel channel, unsigned long long block,
+			      unsigned long long count);
 
 static struct struct_io_manager struct_test_manager = {
 	EXT2_ET_MAGIC_IO_MANAGER,
@@ -97,6 +102,10 @@ static struct struct_io_manager struct_test_manager = {
 	test_read_blk64,
 	test_write_blk64,
 	test_discard,
+	test_cache_readahead,
+	NULL,			/* read_blk_vec */
+	NULL,			/* write_blk_vec */
+	test_zeroout,
 };
 
 io_manager test_io_manager = &struct_test_manager;
@@ -129,6 +138,9 @@ void (*test_io_cb_write_byte)
 #define TEST_FLAG_DUMP			0x10
 #define TEST_FLAG_SET_OPTION		0x20
 #define TEST_FLAG_DISCARD		0x40
+#define TEST_FLAG_READAHEAD		0x80
+#define TEST_FLAG_ZEROOUT		0x100
+#define TEST_FLAG_STATS			0x200
 
 static void test_dump_block(io_channel channel,
 			    struct test_private_data *data,
@@ -268,6 +280,29 @@ cleanup:
 	return retval;
 }
 
+/* Print the statistics of the real channel, as it is about to close */
+static void test_dump_stats(struct test_private_data *data)
+{
+	io_stats	stats = 0;
+
+	if (!data->real->manager->get_stats ||
+	    data->real->manager->get_stats(data->real, &stats) || !stats)
+		return;
+	fprintf(data->outfile, "Test_io: stats: %llu bytes read, "
+		"%llu bytes written\n", stats->bytes_read,
+		stats->bytes_written);
+	if (stats->num_fields < IO_STATS_NUM_FIELDS)
+		return;
+	fprintf(data->outfile, "Test_io: stats: %llu reads "
+		"(50%% under %lluus, 99%% under %lluus), %llu writes "
+		"(50%% under %lluus, 99%% under %lluus), %llu flushes\n",
+		stats->reads, io_stats_latency(stats->read_latency, 0, 50),
+		io_stats_latency(stats->read_latency, 0, 99),
+		stats->writes, io_stats_latency(stats->write_latency, 0, 50),
+		io_stats_latency(stats->write_latency, 0, 99),
+		stats->flushes);
+}
+
 static errcode_t test_close(io_channel channel)
 {
 	struct test_private_data *data;
@@ -280,6 +315,8 @@ static errcode_t test_close(io_channel channel)
 	if (--channel->refcount > 0)
 		return 0;
 
+	if ((data->flags & TEST_FLAG_STATS) && data->real)
+		test_dump_stats(data);
 	if (data->real)
 		retval = io_channel_close(data->real);
 
@@ -528,3 +565,44 @@ static errcode_t test_discard(io_channel channel, unsigned long long block,
 			block, count, retval ? error_message(retval) : "OK");
 	return retval;
 }
+
+static errcode_t test_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count)
+{
+	struct test_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct test_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
+
+	if (data->real)
+		retval = io_channel_cache_readahead(data->real, block, count);
+	if (data->flags & TEST_FLAG_READAHEAD)
+		fprintf(data->outfile,
+			"Test_io: readahead(%llu, %llu) returned %s\n",
+			block, count, retval ? error_message(retval) : "OK");
+	return retval;
+}
+
+static errcode_t test_zeroout(io_channel channel, unsigned long long block,
+			      unsigned long long count)
+{
+	struct test_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct test_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_TEST_IO_CHANNEL);
+
+	if (data->real)
+		retval = io_channel_zeroout(data->real, block, count);
+	else
+		retval = EXT2_ET_UNIMPLEMENTED;
+	if (data->flags & TEST_FLAG_ZEROOUT)
+		fprintf(data->outfile,
+			"Test_io: zeroout(%llu, %llu) returned %s\n",
+			block, count, retval ? error_message(retval) : "OK");
+	return retval;
+}
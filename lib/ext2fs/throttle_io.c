@@ -0,0 +1,658 @@
+/*
+ * throttle_io.c --- This is the throttling I/O manager.
+ *
+ * It sits on top of another I/O manager and holds back the requests
+ * passed through it, so that a program checking or copying a file
+ * system in the background leaves the device to the programs in the
+ * foreground.  Requests and bytes are each metered by a token bucket:
+ * a bucket fills at the configured rate, up to what the burst allows,
+ * and a request which finds its bucket empty waits until the bucket
+ * has refilled.
+ *
+ * The limits are set with the io_options which ext2fs_open2() takes,
+ * e.g. "/dev/sdb1?max_iops=200&max_bandwidth=20m", and can be changed
+ * while the program runs by rewriting the file named by the
+ * throttle_control option.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <time.h>
+#include <sys/time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+/* How often the control file is looked at, in microseconds */
+#define THROTTLE_CONTROL_INTERVAL	1000000
+#define THROTTLE_MAX_CONTROL		1024
+
+struct throttle_bucket {
+	unsigned long long	rate;		/* per second; 0 is no limit */
+	double			tokens;
+};
+
+struct throttle_private_data {
+	int	magic;
+	io_channel real;
+	struct throttle_bucket	iops;
+	struct throttle_bucket	bandwidth;
+	unsigned int	burst;		/* seconds of tokens a bucket holds */
+	struct timeval	last;		/* when the buckets were filled */
+	char		*control;
+	struct timeval	control_checked;
+	time_t		control_mtime;
+	off_t		control_size;
+};
+
+static errcode_t throttle_open(const char *name, int flags,
+			       io_channel *channel);
+static errcode_t throttle_close(io_channel channel);
+static errcode_t throttle_set_blksize(io_channel channel, int blksize);
+static errcode_t throttle_read_blk64(io_channel channel,
+				     unsigned long long block,
+				     int count, void *data);
+static errcode_t throttle_write_blk64(io_channel channel,
+				      unsigned long long block,
+				      int count, const void *data);
+static errcode_t throttle_read_blk(io_channel channel, unsigned long block,
+				   int count, void *data);
+static errcode_t throttle_write_blk(io_channel channel, unsigned long block,
+				    int count, const void *data);
+static errcode_t throttle_flush(io_channel channel);
+static errcode_t throttle_write_byte(io_channel channel, unsigned long offset,
+				     int count, const void *buf);
+static errcode_t throttle_set_option(io_channel channel, const char *option,
+				     const char *arg);
+static errcode_t throttle_get_stats(io_channel channel, io_stats *stats);
+static errcode_t throttle_discard(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count);
+static errcode_t throttle_cache_readahead(io_channel channel,
+					  unsigned long long block,
+					  unsigned long long count);
+static errcode_t throttle_read_blk_vec(io_channel channel,
+				       unsigned long long block,
+				       struct io_blk_vec *vec, int nr_vec);
+static errcode_t throttle_write_blk_vec(io_channel channel,
+					unsigned long long block,
+					const struct io_blk_vec *vec,
+					int nr_vec);
+static errcode_t throttle_zeroout(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count);
+
+static struct struct_io_manager struct_throttle_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"Throttle I/O Manager",
+	throttle_open,
+	throttle_close,
+	throttle_set_blksize,
+	throttle_read_blk,
+	throttle_write_blk,
+	throttle_flush,
+	throttle_write_byte,
+	throttle_set_option,
+	throttle_get_stats,
+	throttle_read_blk64,
+	throttle_write_blk64,
+	throttle_discard,
+	throttle_cache_readahead,
+	throttle_read_blk_vec,
+	throttle_write_blk_vec,
+	throttle_zeroout,
+};
+
+io_manager throttle_io_manager = &struct_throttle_manager;
+static io_manager throttle_io_backing_manager;
+
+static const char *throttle_options[] = {
+	"max_iops", "max_bandwidth", "burst", "throttle_control", 0
+};
+
+errcode_t set_throttle_io_backing_manager(io_manager manager)
+{
+	throttle_io_backing_manager = manager;
+	return 0;
+}
+
+/*
+ * Does the io_options string opts set any of the options above?  If
+ * so, ext2fs_open2() opens the device through this manager.
+ */
+int throttle_io_wanted(const char *opts)
+{
+	const char	**o;
+	size_t		len;
+
+	while (opts && *opts) {
+		len = strcspn(opts, "=&");
+		for (o = throttle_options; *o; o++)
+			if (len == strlen(*o) && !strncmp(opts, *o, len))
+				return 1;
+		opts = strchr(opts, '&');
+		if (opts)
+			opts++;
+	}
+	return 0;
+}
+
+static long long throttle_usec(struct timeval *from, struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000LL +
+		to->tv_usec - from->tv_usec;
+}
+
+static void throttle_sleep(unsigned long long usec)
+{
+#ifdef HAVE_NANOSLEEP
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+#else
+#ifdef HAVE_USLEEP
+	if (usec >= 1000000)
+		sleep(usec / 1000000);
+	usleep(usec % 1000000);
+#else
+	sleep((usec + 999999) / 1000000);
+#endif
+#endif
+}
+
+/* Start a bucket over, full, at a new rate */
+static void throttle_set_rate(struct throttle_private_data *data,
+			      struct throttle_bucket *b,
+			      unsigned long long rate)
+{
+	b->rate = rate;
+	b->tokens = (double) rate * data->burst;
+}
+
+/*
+ * Parse a count with an optional k, m or g suffix, which multiply it
+ * by 1024, 1024^2 and 1024^3.
+ */
+static errcode_t throttle_parse(const char *arg, unsigned long long *ret)
+{
+	unsigned long long	val;
+	char			*end;
+
+	if (!arg || !*arg)
+		return EXT2_ET_INVALID_ARGUMENT;
+	val = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'g': case 'G':
+		val *= 1024;
+		/* fall through */
+	case 'm': case 'M':
+		val *= 1024;
+		/* fall through */
+	case 'k': case 'K':
+		val *= 1024;
+		end++;
+	}
+	if (*end)
+		return EXT2_ET_INVALID_ARGUMENT;
+	*ret = val;
+	return 0;
+}
+
+static errcode_t throttle_set_limit(struct throttle_private_data *data,
+				    const char *option, const char *arg)
+{
+	unsigned long long	val;
+	errcode_t		retval;
+
+	retval = throttle_parse(arg, &val);
+	if (retval)
+		return retval;
+	if (!strcmp(option, "max_iops"))
+		throttle_set_rate(data, &data->iops, val);
+	else if (!strcmp(option, "max_bandwidth"))
+		throttle_set_rate(data, &data->bandwidth, val);
+	else if (!strcmp(option, "burst")) {
+		if (val == 0 || val > 3600)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->burst = val;
+		throttle_set_rate(data, &data->iops, data->iops.rate);
+		throttle_set_rate(data, &data->bandwidth,
+				  data->bandwidth.rate);
+	} else
+		return EXT2_ET_INVALID_ARGUMENT;
+	return 0;
+}
+
+/*
+ * The control file holds limits in the form of the io_options, e.g.
+ * "max_iops=50 max_bandwidth=4m", separated by white space or '&'.
+ * It is read again each time it changes; a limit which is left out of
+ * it keeps its value, and a file which can't be read or parsed leaves
+ * the limits as they were.
+ */
+static void throttle_check_control(struct throttle_private_data *data,
+				   struct timeval *now)
+{
+	struct throttle_private_data new_data;
+	char		buf[THROTTLE_MAX_CONTROL], *cp, *next, *arg;
+	struct stat	st;
+	FILE		*f;
+	size_t		len;
+
+	if (throttle_usec(&data->control_checked, now) <
+	    THROTTLE_CONTROL_INTERVAL)
+		return;
+	data->control_checked = *now;
+	if (stat(data->control, &st) < 0 ||
+	    (st.st_mtime == data->control_mtime &&
+	     st.st_size == data->control_size))
+		return;
+	f = fopen(data->control, "r");
+	if (!f)
+		return;
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = 0;
+	data->control_mtime = st.st_mtime;
+	data->control_size = st.st_size;
+
+	new_data = *data;
+	for (cp = buf; *cp; cp = next) {
+		cp += strspn(cp, " \t\n&");
+		if (!*cp)
+			break;
+		next = cp + strcspn(cp, " \t\n&");
+		if (*next)
+			*next++ = 0;
+		arg = strchr(cp, '=');
+		if (arg)
+			*arg++ = 0;
+		if (throttle_set_limit(&new_data, cp, arg))
+			return;
+	}
+	data->iops = new_data.iops;
+	data->bandwidth = new_data.bandwidth;
+	data->burst = new_data.burst;
+}
+
+static void throttle_fill(struct throttle_private_data *data,
+			  struct throttle_bucket *b, long long usec)
+{
+	double	max = (double) b->rate * data->burst;
+
+	b->tokens += (double) b->rate * usec / 1000000;
+	if (b->tokens > max)
+		b->tokens = max;
+}
+
+/*
+ * Wait until the buckets allow a request of bytes bytes, and take it
+ * out of them.  A request may overdraw a bucket; the requests after it
+ * wait for the debt to be paid off, so that a request larger than the
+ * burst does not have to be split up to get through.
+ */
+static void throttle_wait(struct throttle_private_data *data,
+			  unsigned long long bytes)
+{
+	struct timeval	now;
+	long long	usec;
+	double		wait = 0, w;
+
+	gettimeofday(&now, 0);
+	if (data->control)
+		throttle_check_control(data, &now);
+	usec = throttle_usec(&data->last, &now);
+	if (usec < 0)
+		usec = 0;
+	data->last = now;
+
+	if (data->iops.rate) {
+		throttle_fill(data, &data->iops, usec);
+		if (data->iops.tokens < 1) {
+			w = (1 - data->iops.tokens) / data->iops.rate;
+			if (w > wait)
+				wait = w;
+		}
+		data->iops.tokens -= 1;
+	}
+	if (data->bandwidth.rate && bytes) {
+		throttle_fill(data, &data->bandwidth, usec);
+		if (data->bandwidth.tokens < 0) {
+			w = -data->bandwidth.tokens / data->bandwidth.rate;
+			if (w > wait)
+				wait = w;
+		}
+		data->bandwidth.tokens -= bytes;
+	}
+	if (wait > 0)
+		throttle_sleep(wait * 1000000);
+}
+
+static unsigned long long throttle_bytes(io_channel channel, int count)
+{
+	if (count < 0)
+		return -count;
+	return (unsigned long long) count * channel->block_size;
+}
+
+static errcode_t throttle_open(const char *name, int flags,
+			       io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct throttle_private_data *data = NULL;
+	errcode_t	retval;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (!throttle_io_backing_manager)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto cleanup;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct throttle_private_data),
+				    &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->burst = 1;
+	gettimeofday(&data->last, 0);
+
+	io->manager = throttle_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->refcount = 1;
+
+	retval = throttle_io_backing_manager->open(name, flags, &data->real);
+	if (retval)
+		goto cleanup;
+	io->block_size = data->real->block_size;
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data)
+		ext2fs_free_mem(&data);
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t throttle_close(io_channel channel)
+{
+	struct throttle_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	if (data->real)
+		retval = io_channel_close(data->real);
+	if (data->control)
+		ext2fs_free_mem(&data->control);
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t throttle_set_blksize(io_channel channel, int blksize)
+{
+	struct throttle_private_data *data;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = io_channel_set_blksize(data->real, blksize);
+	if (!retval)
+		channel->block_size = blksize;
+	return retval;
+}
+
+static errcode_t throttle_read_blk64(io_channel channel,
+				     unsigned long long block,
+				     int count, void *buf)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	throttle_wait(data, throttle_bytes(channel, count));
+	return io_channel_read_blk64(data->real, block, count, buf);
+}
+
+static errcode_t throttle_read_blk(io_channel channel, unsigned long block,
+				   int count, void *buf)
+{
+	return throttle_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t throttle_write_blk64(io_channel channel,
+				      unsigned long long block,
+				      int count, const void *buf)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	throttle_wait(data, throttle_bytes(channel, count));
+	return io_channel_write_blk64(data->real, block, count, buf);
+}
+
+static errcode_t throttle_write_blk(io_channel channel, unsigned long block,
+				    int count, const void *buf)
+{
+	return throttle_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t throttle_write_byte(io_channel channel, unsigned long offset,
+				     int size, const void *buf)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	throttle_wait(data, size);
+	return io_channel_write_byte(data->real, offset, size, buf);
+}
+
+static errcode_t throttle_read_blk_vec(io_channel channel,
+				       unsigned long long block,
+				       struct io_blk_vec *vec, int nr_vec)
+{
+	struct throttle_private_data *data;
+	unsigned long long count = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr_vec; i++)
+		count += vec[i].count;
+	throttle_wait(data, count * channel->block_size);
+	return io_channel_read_blk_vec(data->real, block, vec, nr_vec);
+}
+
+static errcode_t throttle_write_blk_vec(io_channel channel,
+					unsigned long long block,
+					const struct io_blk_vec *vec,
+					int nr_vec)
+{
+	struct throttle_private_data *data;
+	unsigned long long count = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr_vec; i++)
+		count += vec[i].count;
+	throttle_wait(data, count * channel->block_size);
+	return io_channel_write_blk_vec(data->real, block, vec, nr_vec);
+}
+
+static errcode_t throttle_flush(io_channel channel)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return io_channel_flush(data->real);
+}
+
+static errcode_t throttle_discard(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	throttle_wait(data, 0);
+	return io_channel_discard(data->real, block, count);
+}
+
+/*
+ * Readahead would have the kernel read behind the buckets' back, so it
+ * is dropped while a limit is set; it is only a hint anyway.
+ */
+static errcode_t throttle_cache_readahead(io_channel channel,
+					  unsigned long long block,
+					  unsigned long long count)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (data->iops.rate || data->bandwidth.rate)
+		return 0;
+	return io_channel_cache_readahead(data->real, block, count);
+}
+
+static errcode_t throttle_zeroout(io_channel channel,
+				  unsigned long long block,
+				  unsigned long long count)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	throttle_wait(data, count * channel->block_size);
+	return io_channel_zeroout(data->real, block, count);
+}
+
+/*
+ * "max_iops=<n>" and "max_bandwidth=<bytes>" set the number of requests
+ * and of bytes per second let through, 0 meaning no limit, and
+ * "burst=<seconds>" how many seconds' worth of either may go through
+ * at once after the device has been left alone; it defaults to 1.
+ * "throttle_control=<file>" names a file from which the limits are
+ * read again whenever it changes.  Everything else is passed on to the
+ * backing channel.
+ */
+static errcode_t throttle_set_option(io_channel channel, const char *option,
+				     const char *arg)
+{
+	struct throttle_private_data *data;
+	struct timeval	now;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!strcmp(option, "throttle_control")) {
+		if (!arg || !*arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+		if (data->control)
+			ext2fs_free_mem(&data->control);
+		retval = ext2fs_get_mem(strlen(arg) + 1, &data->control);
+		if (retval)
+			return retval;
+		strcpy(data->control, arg);
+		data->control_mtime = 0;
+		data->control_size = 0;
+		memset(&data->control_checked, 0, sizeof(struct timeval));
+		gettimeofday(&now, 0);
+		throttle_check_control(data, &now);
+		return 0;
+	}
+	if (!strcmp(option, "max_iops") || !strcmp(option, "max_bandwidth") ||
+	    !strcmp(option, "burst"))
+		return throttle_set_limit(data, option, arg);
+
+	if (!data->real->manager->set_option)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return data->real->manager->set_option(data->real, option, arg);
+}
+
+static errcode_t throttle_get_stats(io_channel channel, io_stats *stats)
+{
+	struct throttle_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct throttle_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!data->real->manager->get_stats)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	return data->real->manager->get_stats(data->real, stats);
+}
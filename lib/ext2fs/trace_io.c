@@ -0,0 +1,647 @@
+/*
+ * trace_io.c --- This is the I/O tracing manager.
+ *
+ * It sits on top of another I/O manager and records every request
+ * passed through it -- what it was, where it went, how long the backing
+ * channel took to complete it, and which part of the caller issued it
+ * -- in a trace file which can be analyzed or replayed with e2ioreplay.
+ * The format of the trace is described in trace_io.h.
+ *
+ * Records are collected in memory and written out in large chunks, so
+ * that tracing does not disturb the access pattern being traced with
+ * small writes of its own.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "trace_io.h"
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define TRACE_BUF_SIZE		(256 * 1024)
+#define TRACE_MAX_TAGS		256
+#define TRACE_MAX_NAME		1024
+
+struct trace_private_data {
+	int	magic;
+	io_channel real;
+	int	channel;	/* number of this channel in the trace */
+	int	tag;		/* caller tag in effect */
+};
+
+static errcode_t trace_open(const char *name, int flags, io_channel *channel);
+static errcode_t trace_close(io_channel channel);
+static errcode_t trace_set_blksize(io_channel channel, int blksize);
+static errcode_t trace_read_blk64(io_channel channel, unsigned long long block,
+				  int count, void *data);
+static errcode_t trace_write_blk64(io_channel channel, unsigned long long block,
+				   int count, const void *data);
+static errcode_t trace_read_blk(io_channel channel, unsigned long block,
+				int count, void *data);
+static errcode_t trace_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *data);
+static errcode_t trace_flush(io_channel channel);
+static errcode_t trace_write_byte(io_channel channel, unsigned long offset,
+				  int count, const void *buf);
+static errcode_t trace_set_option(io_channel channel, const char *option,
+				  const char *arg);
+static errcode_t trace_get_stats(io_channel channel, io_stats *stats);
+static errcode_t trace_discard(io_channel channel, unsigned long long block,
+			       unsigned long long count);
+static errcode_t trace_cache_readahead(io_channel channel,
+				       unsigned long long block,
+				       unsigned long long count);
+static errcode_t trace_read_blk_vec(io_channel channel,
+				    unsigned long long block,
+				    struct io_blk_vec *vec, int nr_vec);
+static errcode_t trace_write_blk_vec(io_channel channel,
+				     unsigned long long block,
+				     const struct io_blk_vec *vec, int nr_vec);
+static errcode_t trace_zeroout(io_channel channel, unsigned long long block,
+			       unsigned long long count);
+
+static struct struct_io_manager struct_trace_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"Trace I/O Manager",
+	trace_open,
+	trace_close,
+	trace_set_blksize,
+	trace_read_blk,
+	trace_write_blk,
+	trace_flush,
+	trace_write_byte,
+	trace_set_option,
+	trace_get_stats,
+	trace_read_blk64,
+	trace_write_blk64,
+	trace_discard,
+	trace_cache_readahead,
+	trace_read_blk_vec,
+	trace_write_blk_vec,
+	trace_zeroout,
+};
+
+io_manager trace_io_manager = &struct_trace_manager;
+static io_manager trace_io_backing_manager;
+
+/*
+ * The trace is shared by every channel opened through this manager, so
+ * that the records of all of them end up in the order they were issued.
+ */
+static char *trace_file;
+static int trace_fd = -1;
+static int trace_file_created;
+static int trace_users;
+static int trace_next_channel;
+static errcode_t trace_write_error;
+static struct timeval trace_start;
+static pid_t trace_pid;
+static char *trace_buf;
+static unsigned int trace_buf_used;
+static char *trace_tags[TRACE_MAX_TAGS];
+static int trace_num_tags = 1;		/* tag 0 means no tag */
+
+errcode_t set_trace_io_backing_manager(io_manager manager)
+{
+	trace_io_backing_manager = manager;
+	return 0;
+}
+
+errcode_t set_trace_io_file(const char *file_name)
+{
+	char *file = strdup(file_name);
+
+	if (!file)
+		return EXT2_ET_NO_MEMORY;
+	if (trace_file)
+		free(trace_file);
+	trace_file = file;
+	trace_file_created = 0;
+	return 0;
+}
+
+static void trace_write_buf(void)
+{
+	unsigned int	done = 0;
+	ssize_t		actual;
+
+	while (trace_fd >= 0 && done < trace_buf_used) {
+		actual = write(trace_fd, trace_buf + done,
+			       trace_buf_used - done);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual <= 0) {
+			/* Give up on the trace, but not on the I/O */
+			trace_write_error = actual < 0 ? errno :
+				EXT2_ET_SHORT_WRITE;
+			close(trace_fd);
+			trace_fd = -1;
+			break;
+		}
+		done += actual;
+	}
+	trace_buf_used = 0;
+}
+
+static void trace_atexit(void)
+{
+	/* A forked child must not write out its copy of the buffer */
+	if (getpid() == trace_pid)
+		trace_write_buf();
+}
+
+/*
+ * Return space for len bytes of trace, writing out what has been
+ * collected so far if the buffer is full.
+ */
+static void *trace_space(unsigned int len)
+{
+	void	*p;
+
+	if (trace_buf_used + len > TRACE_BUF_SIZE)
+		trace_write_buf();
+	p = trace_buf + trace_buf_used;
+	trace_buf_used += len;
+	return p;
+}
+
+static __u64 trace_usec(struct timeval *tv)
+{
+	return (tv->tv_sec - trace_start.tv_sec) * 1000000ULL +
+		tv->tv_usec - trace_start.tv_usec;
+}
+
+static void trace_record(io_channel channel, int op, unsigned long long block,
+			 long long count, struct timeval *start,
+			 errcode_t retval)
+{
+	struct trace_private_data *data;
+	struct io_trace_record *rec;
+	struct timeval	now;
+	__u64		when;
+
+	if (trace_fd < 0)
+		return;
+	data = (struct trace_private_data *) channel->private_data;
+	when = trace_usec(start);
+	gettimeofday(&now, 0);
+
+	rec = trace_space(sizeof(struct io_trace_record));
+	memset(rec, 0, sizeof(struct io_trace_record));
+	rec->when = ext2fs_cpu_to_le64(when);
+	rec->block = ext2fs_cpu_to_le64(block);
+	rec->count = ext2fs_cpu_to_le64(count);
+	rec->latency = ext2fs_cpu_to_le32(trace_usec(&now) - when);
+	rec->blksize = ext2fs_cpu_to_le32(channel->block_size);
+	rec->op = op;
+	rec->tag = data->tag;
+	rec->channel = data->channel;
+	if (retval)
+		rec->flags |= IO_TRACE_FLAG_ERROR;
+}
+
+static void trace_name(io_channel channel, int op, int tag,
+		       unsigned long long block, const char *name)
+{
+	struct trace_private_data *data;
+	struct io_trace_record *rec;
+	struct timeval	now;
+	unsigned int	len = strlen(name);
+	char		*p;
+
+	if (trace_fd < 0)
+		return;
+	if (len > TRACE_MAX_NAME)
+		len = TRACE_MAX_NAME;
+	data = (struct trace_private_data *) channel->private_data;
+	gettimeofday(&now, 0);
+
+	rec = trace_space(sizeof(struct io_trace_record) +
+			  IO_TRACE_NAME_PAD(len));
+	memset(rec, 0, sizeof(struct io_trace_record));
+	rec->when = ext2fs_cpu_to_le64(trace_usec(&now));
+	rec->block = ext2fs_cpu_to_le64(block);
+	rec->count = ext2fs_cpu_to_le64(len);
+	rec->blksize = ext2fs_cpu_to_le32(channel->block_size);
+	rec->op = op;
+	rec->tag = tag;
+	rec->channel = data->channel;
+	p = (char *) (rec + 1);
+	memset(p, 0, IO_TRACE_NAME_PAD(len));
+	memcpy(p, name, len);
+}
+
+static errcode_t trace_start_file(void)
+{
+	struct io_trace_header *hdr;
+	static int	atexit_done;
+	errcode_t	retval;
+
+	if (!trace_buf) {
+		retval = ext2fs_get_mem(TRACE_BUF_SIZE, &trace_buf);
+		if (retval)
+			return retval;
+	}
+	if (trace_file_created) {
+		trace_fd = ext2fs_open_file(trace_file, O_WRONLY | O_APPEND, 0);
+		if (trace_fd < 0)
+			return errno;
+		return 0;
+	}
+	trace_fd = ext2fs_open_file(trace_file,
+				    O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (trace_fd < 0)
+		return errno;
+	trace_file_created = 1;
+	trace_write_error = 0;
+	while (trace_num_tags > 1)
+		free(trace_tags[--trace_num_tags]);
+	gettimeofday(&trace_start, 0);
+
+	hdr = trace_space(sizeof(struct io_trace_header));
+	memset(hdr, 0, sizeof(struct io_trace_header));
+	memcpy(hdr->magic, IO_TRACE_MAGIC, IO_TRACE_MAGIC_LEN);
+	hdr->record_size = ext2fs_cpu_to_le32(sizeof(struct io_trace_record));
+	hdr->start_sec = ext2fs_cpu_to_le64(trace_start.tv_sec);
+	hdr->start_usec = ext2fs_cpu_to_le64(trace_start.tv_usec);
+
+	trace_pid = getpid();
+	if (!atexit_done) {
+		atexit(trace_atexit);
+		atexit_done = 1;
+	}
+	return 0;
+}
+
+static errcode_t trace_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct trace_private_data *data = NULL;
+	errcode_t	retval;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	if (!trace_io_backing_manager)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto cleanup;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_memzero(sizeof(struct trace_private_data), &data);
+	if (retval)
+		goto cleanup;
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+
+	io->manager = trace_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->refcount = 1;
+
+	retval = trace_io_backing_manager->open(name, flags, &data->real);
+	if (retval)
+		goto cleanup;
+	io->block_size = data->real->block_size;
+
+	if (trace_file && trace_fd < 0 && !trace_write_error) {
+		retval = trace_start_file();
+		if (retval) {
+			io_channel_close(data->real);
+			goto cleanup;
+		}
+	}
+
+	trace_users++;
+	data->channel = trace_next_channel++ & 0xFF;
+	trace_name(io, IO_TRACE_OP_OPEN, 0, flags, name);
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (io && io->name)
+		ext2fs_free_mem(&io->name);
+	if (data)
+		ext2fs_free_mem(&data);
+	if (io)
+		ext2fs_free_mem(&io);
+	return retval;
+}
+
+static errcode_t trace_close(io_channel channel)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	gettimeofday(&start, 0);
+	if (data->real)
+		retval = io_channel_close(data->real);
+	trace_record(channel, IO_TRACE_OP_CLOSE, 0, 0, &start, retval);
+
+	if (--trace_users == 0 && trace_fd >= 0) {
+		trace_write_buf();
+		if (trace_fd >= 0 && close(trace_fd) < 0 && !trace_write_error)
+			trace_write_error = errno;
+		trace_fd = -1;
+	}
+	if (!retval && trace_write_error)
+		retval = trace_write_error;
+
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t trace_set_blksize(io_channel channel, int blksize)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_set_blksize(data->real, blksize);
+	if (!retval)
+		channel->block_size = blksize;
+	trace_record(channel, IO_TRACE_OP_SET_BLKSIZE, 0, blksize, &start,
+		     retval);
+	return retval;
+}
+
+static errcode_t trace_read_blk64(io_channel channel, unsigned long long block,
+				  int count, void *buf)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_read_blk64(data->real, block, count, buf);
+	trace_record(channel, IO_TRACE_OP_READ, block, count, &start, retval);
+	return retval;
+}
+
+static errcode_t trace_read_blk(io_channel channel, unsigned long block,
+				int count, void *buf)
+{
+	return trace_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t trace_write_blk64(io_channel channel, unsigned long long block,
+				   int count, const void *buf)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_write_blk64(data->real, block, count, buf);
+	trace_record(channel, IO_TRACE_OP_WRITE, block, count, &start, retval);
+	return retval;
+}
+
+static errcode_t trace_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *buf)
+{
+	return trace_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t trace_write_byte(io_channel channel, unsigned long offset,
+				  int size, const void *buf)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_write_byte(data->real, offset, size, buf);
+	trace_record(channel, IO_TRACE_OP_WRITE_BYTE, offset, size, &start,
+		     retval);
+	return retval;
+}
+
+static errcode_t trace_read_blk_vec(io_channel channel,
+				    unsigned long long block,
+				    struct io_blk_vec *vec, int nr_vec)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+	long long	count = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr_vec; i++)
+		count += vec[i].count;
+	gettimeofday(&start, 0);
+	retval = io_channel_read_blk_vec(data->real, block, vec, nr_vec);
+	trace_record(channel, IO_TRACE_OP_READ, block, count, &start, retval);
+	return retval;
+}
+
+static errcode_t trace_write_blk_vec(io_channel channel,
+				     unsigned long long block,
+				     const struct io_blk_vec *vec, int nr_vec)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+	long long	count = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr_vec; i++)
+		count += vec[i].count;
+	gettimeofday(&start, 0);
+	retval = io_channel_write_blk_vec(data->real, block, vec, nr_vec);
+	trace_record(channel, IO_TRACE_OP_WRITE, block, count, &start, retval);
+	return retval;
+}
+
+static errcode_t trace_flush(io_channel channel)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_flush(data->real);
+	trace_record(channel, IO_TRACE_OP_FLUSH, 0, 0, &start, retval);
+	return retval;
+}
+
+static errcode_t trace_discard(io_channel channel, unsigned long long block,
+			       unsigned long long count)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_discard(data->real, block, count);
+	trace_record(channel, IO_TRACE_OP_DISCARD, block, count, &start,
+		     retval);
+	return retval;
+}
+
+static errcode_t trace_cache_readahead(io_channel channel,
+				       unsigned long long block,
+				       unsigned long long count)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_cache_readahead(data->real, block, count);
+	trace_record(channel, IO_TRACE_OP_READAHEAD, block, count, &start,
+		     retval);
+	return retval;
+}
+
+static errcode_t trace_zeroout(io_channel channel, unsigned long long block,
+			       unsigned long long count)
+{
+	struct trace_private_data *data;
+	struct timeval	start;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	gettimeofday(&start, 0);
+	retval = io_channel_zeroout(data->real, block, count);
+	trace_record(channel, IO_TRACE_OP_ZEROOUT, block, count, &start,
+		     retval);
+	return retval;
+}
+
+/*
+ * "trace_tag=<name>" marks the requests which follow as coming from
+ * <name>, e.g. one pass of e2fsck; without an argument it clears the
+ * tag.  Everything else is passed on to the backing channel.
+ */
+static errcode_t trace_set_option(io_channel channel, const char *option,
+				  const char *arg)
+{
+	struct trace_private_data *data;
+	int		tag;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (strcmp(option, "trace_tag")) {
+		if (!data->real->manager->set_option)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return data->real->manager->set_option(data->real, option,
+						       arg);
+	}
+
+	if (!arg || !*arg) {
+		data->tag = 0;
+		return 0;
+	}
+	for (tag = 1; tag < trace_num_tags; tag++)
+		if (!strcmp(trace_tags[tag], arg))
+			break;
+	if (tag == trace_num_tags) {
+		if (tag == TRACE_MAX_TAGS)
+			return EXT2_ET_INVALID_ARGUMENT;
+		trace_tags[tag] = strdup(arg);
+		if (!trace_tags[tag])
+			return EXT2_ET_NO_MEMORY;
+		trace_num_tags++;
+		trace_name(channel, IO_TRACE_OP_TAG, tag, 0, arg);
+	}
+	data->tag = tag;
+	return 0;
+}
+
+static errcode_t trace_get_stats(io_channel channel, io_stats *stats)
+{
+	struct trace_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct trace_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!data->real->manager->get_stats)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	return data->real->manager->get_stats(data->real, stats);
+}
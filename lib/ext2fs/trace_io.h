@@ -0,0 +1,65 @@
+/*
+ * trace_io.h --- on-disk format of the I/O traces written by trace_io.c
+ * and replayed by e2ioreplay
+ *
+ * A trace starts with a struct io_trace_header, followed by a stream of
+ * fixed size records, one for each request that was passed to the
+ * traced channels.  Records which name something (the device a channel
+ * was opened on, or the caller tag set with the "trace_tag" option) are
+ * followed by the name itself, padded to a multiple of eight bytes;
+ * the length of the name is kept in the count field.
+ *
+ * Every channel opened through the trace manager in one process writes
+ * to the same trace, so the records are in the order the requests were
+ * issued; the channel field says which channel each one went to.
+ *
+ * All fields are stored little-endian.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#define IO_TRACE_MAGIC		"E2IOTRC1"
+#define IO_TRACE_MAGIC_LEN	8
+
+struct io_trace_header {
+	char	magic[IO_TRACE_MAGIC_LEN];
+	__u32	record_size;	/* sizeof(struct io_trace_record) */
+	__u32	reserved;
+	__u64	start_sec;	/* wall clock time of the first record */
+	__u64	start_usec;
+};
+
+/* Values of io_trace_record.op */
+#define IO_TRACE_OP_OPEN	1	/* name: device; block: open flags */
+#define IO_TRACE_OP_CLOSE	2
+#define IO_TRACE_OP_SET_BLKSIZE	3	/* count: new block size */
+#define IO_TRACE_OP_READ	4
+#define IO_TRACE_OP_WRITE	5
+#define IO_TRACE_OP_WRITE_BYTE	6	/* block: byte offset; count: bytes */
+#define IO_TRACE_OP_FLUSH	7
+#define IO_TRACE_OP_DISCARD	8
+#define IO_TRACE_OP_READAHEAD	9
+#define IO_TRACE_OP_ZEROOUT	10
+#define IO_TRACE_OP_TAG		11	/* name: caller tag; tag: its number */
+#define IO_TRACE_OP_MAX		11
+
+/* Values of io_trace_record.flags */
+#define IO_TRACE_FLAG_ERROR	0x01	/* the request failed */
+
+struct io_trace_record {
+	__u64	when;		/* microseconds since start of the trace */
+	__u64	block;
+	__s64	count;		/* as passed to the channel; < 0 is bytes */
+	__u32	latency;	/* microseconds spent in the backing channel */
+	__u32	blksize;	/* block size of the channel at the time */
+	__u8	op;
+	__u8	tag;		/* caller tag in effect, 0 if none */
+	__u8	channel;
+	__u8	flags;
+	__u32	reserved;
+};
+
+#define IO_TRACE_NAME_PAD(len)	(((len) + 7) & ~7)
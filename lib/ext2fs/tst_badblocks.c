@@ -89,6 +89,42 @@ static errcode_t create_test_list(blk_t *vec, badblocks_list *ret)
 	return 0;
 }
 
+/*
+ * The same as create_test_list(), but the vector is added all at once,
+ * half of it on top of a list which has the other half already.
+ */
+static errcode_t create_test_list_array(blk_t *vec, badblocks_list *ret)
+{
+	errcode_t	retval;
+	badblocks_list	bb;
+	blk_t		copy[64];
+	int		i, n;
+
+	for (n = 0; vec[n]; n++)
+		copy[n] = vec[n];
+	retval = ext2fs_badblocks_list_create(&bb, 5);
+	if (retval) {
+		com_err("create_test_list_array", retval,
+			"while creating list");
+		return retval;
+	}
+	for (i = 0; i < n; i += 2) {
+		retval = ext2fs_badblocks_list_add(bb, copy[i]);
+		if (retval)
+			break;
+	}
+	if (!retval)
+		retval = ext2fs_badblocks_list_add_array(bb, copy, n);
+	if (retval) {
+		com_err("create_test_list_array", retval,
+			"while adding test vector");
+		ext2fs_badblocks_list_free(bb);
+		return retval;
+	}
+	*ret = bb;
+	return 0;
+}
+
 static void print_list(badblocks_list bb, int verify)
 {
 	errcode_t	retval;
@@ -267,13 +303,13 @@ int file_test_invalid(badblocks_list bb)
 
 int main(int argc, char **argv)
 {
-	badblocks_list bb1, bb2, bb3, bb4, bb5;
+	badblocks_list bb1, bb2, bb3, bb4, bb5, bb6;
 	int	equal;
 	errcode_t	retval;
 
 	add_error_table(&et_ext2_error_table);
 
-	bb1 = bb2 = bb3 = bb4 = bb5 = 0;
+	bb1 = bb2 = bb3 = bb4 = bb5 = bb6 = 0;
 
 	printf("test1: ");
 	retval = create_test_list(test1, &bb1);
@@ -293,6 +329,12 @@ int main(int argc, char **argv)
 		print_list(bb3, 1);
 	printf("\n");
 
+	printf("test3 added at once: ");
+	retval = create_test_list_array(test3, &bb6);
+	if (retval == 0)
+		print_list(bb6, 1);
+	printf("\n");
+
 	printf("test4: ");
 	retval = create_test_list(test4, &bb4);
 	if (retval == 0) {
@@ -326,6 +368,14 @@ int main(int argc, char **argv)
 		if (!equal)
 			test_fail++;
 
+		if (bb6) {
+			equal = ext2fs_badblocks_equal(bb1, bb6);
+			printf("bb1 and bb6 are %sequal.\n",
+			       equal ? "" : "NOT ");
+			if (!equal)
+				test_fail++;
+		}
+
 		equal = ext2fs_badblocks_equal(bb1, bb4);
 		printf("bb1 and bb4 are %sequal.\n", equal ? "" : "NOT ");
 		if (equal)
@@ -353,6 +403,8 @@ int main(int argc, char **argv)
 		ext2fs_badblocks_list_free(bb3);
 	if (bb4)
 		ext2fs_badblocks_list_free(bb4);
+	if (bb6)
+		ext2fs_badblocks_list_free(bb6);
 
 	return test_fail;
 
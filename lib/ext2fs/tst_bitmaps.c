@@ -25,6 +25,7 @@
 #include "ext2_fs.h"
 #include "ext2fs.h"
 #include "ext2fsP.h"
+#include "bmap64.h"
 
 extern ss_request_table tst_bitmaps_cmds;
 
@@ -32,6 +33,7 @@ static char subsystem_name[] = "tst_bitmaps";
 static char version[] = "1.0";
 
 ext2_filsys	test_fs;
+static ext2fs_block_bitmap saved_block_map;
 int		exit_status = 0;
 
 static int source_file(const char *cmd_file, int sci_idx)
@@ -148,6 +150,13 @@ int check_fs_open(char *name)
 	return 0;
 }
 
+static void free_saved_block_map(void)
+{
+	if (saved_block_map)
+		ext2fs_free_block_bitmap(saved_block_map);
+	saved_block_map = 0;
+}
+
 static void setup_filesystem(const char *name,
 			     unsigned int blocks, unsigned int inodes,
 			     unsigned int type, int flags)
@@ -199,6 +208,7 @@ void setup_cmd(int argc, char **argv)
 	int		flags = EXT2_FLAG_64BITS;
 
 	if (test_fs) {
+		free_saved_block_map();
 		ext2fs_close(test_fs);
 		test_fs = 0;
 	}
@@ -241,6 +251,7 @@ void close_cmd(int argc, char **argv)
 	if (check_fs_open(argv[0]))
 		return;
 
+	free_saved_block_map();
 	ext2fs_close(test_fs);
 	test_fs = 0;
 }
@@ -436,6 +447,39 @@ void do_ffzb(int argc, char *argv[])
 }
 
 
+void do_ffsb(int argc, char *argv[])
+{
+	unsigned int start, end;
+	int err;
+	errcode_t retval;
+	blk64_t out;
+
+	if (check_fs_open(argv[0]))
+		return;
+
+	if (argc != 3) {
+		com_err(argv[0], 0, "Usage: ffsb <start> <end>");
+		return;
+	}
+
+	start = parse_ulong(argv[1], argv[0], "start", &err);
+	if (err)
+		return;
+
+	end = parse_ulong(argv[2], argv[0], "end", &err);
+	if (err)
+		return;
+
+	retval = ext2fs_find_first_set_block_bitmap2(test_fs->block_map,
+						     start, end, &out);
+	if (retval) {
+		printf("ext2fs_find_first_set_block_bitmap2() returned %s\n",
+		       error_message(retval));
+		return;
+	}
+	printf("First marked block is %llu\n", out);
+}
+
 void do_zerob(int argc, char *argv[])
 {
 	if (check_fs_open(argv[0]))
@@ -445,6 +489,35 @@ void do_zerob(int argc, char *argv[])
 	ext2fs_clear_block_bitmap(test_fs->block_map);
 }
 
+void do_copyb(int argc, char *argv[])
+{
+	errcode_t	retval;
+
+	if (check_fs_open(argv[0]))
+		return;
+
+	free_saved_block_map();
+	retval = ext2fs_copy_bitmap(test_fs->block_map, &saved_block_map);
+	if (retval)
+		com_err(argv[0], retval, "while copying the block bitmap");
+}
+
+void do_swapb(int argc, char *argv[])
+{
+	ext2fs_block_bitmap	bmap;
+
+	if (check_fs_open(argv[0]))
+		return;
+
+	if (!saved_block_map) {
+		com_err(argv[0], 0, "No copy of the block bitmap saved");
+		return;
+	}
+	bmap = test_fs->block_map;
+	test_fs->block_map = saved_block_map;
+	saved_block_map = bmap;
+}
+
 void do_seti(int argc, char *argv[])
 {
 	unsigned int inode;
@@ -559,6 +632,39 @@ void do_ffzi(int argc, char *argv[])
 }
 
 
+void do_ffsi(int argc, char *argv[])
+{
+	unsigned int start, end;
+	int err;
+	errcode_t retval;
+	ext2_ino_t out;
+
+	if (check_fs_open(argv[0]))
+		return;
+
+	if (argc != 3) {
+		com_err(argv[0], 0, "Usage: ffsi <start> <end>");
+		return;
+	}
+
+	start = parse_ulong(argv[1], argv[0], "start", &err);
+	if (err)
+		return;
+
+	end = parse_ulong(argv[2], argv[0], "end", &err);
+	if (err)
+		return;
+
+	retval = ext2fs_find_first_set_inode_bitmap2(test_fs->inode_map,
+						     start, end, &out);
+	if (retval) {
+		printf("ext2fs_find_first_set_inode_bitmap2() returned %s\n",
+		       error_message(retval));
+		return;
+	}
+	printf("First marked inode is %u\n", out);
+}
+
 void do_zeroi(int argc, char *argv[])
 {
 	if (check_fs_open(argv[0]))
@@ -568,6 +674,316 @@ void do_zeroi(int argc, char *argv[])
 	ext2fs_clear_inode_bitmap(test_fs->inode_map);
 }
 
+/*
+ * Compare the backends' find_first_zero and find_first_set with a
+ * bit-by-bit scan, on a bitmap where the only interesting bit is the
+ * last one.  The output depends on the machine, so this isn't part
+ * of the regression test.
+ */
+static const char *bench_type_name(int type)
+{
+	switch (type) {
+	case EXT2FS_BMAP64_RBTREE:
+		return "rbtree";
+	case EXT2FS_BMAP64_RADIXTREE:
+		return "radixtree";
+	case EXT2FS_BMAP64_ADAPTIVE:
+		return "adaptive";
+	default:
+		return "bitarray";
+	}
+}
+
+static void bench_one(int type, __u64 nbits, int loops)
+{
+	ext2fs_generic_bitmap bmap;
+	errcode_t	retval;
+	clock_t		t0, t1, t2;
+	__u64		out = 0, bit = 0;
+	int		i, set;
+
+	retval = ext2fs_alloc_generic_bmap(test_fs, EXT2_ET_MAGIC_BLOCK_BITMAP64,
+					   type, 0, nbits - 1, nbits - 1,
+					   "benchmark bitmap", &bmap);
+	if (retval) {
+		com_err("bench_find", retval, "while allocating bitmap");
+		return;
+	}
+	for (set = 0; set < 2; set++) {
+		ext2fs_clear_generic_bmap(bmap);
+		if (!set)
+			ext2fs_mark_block_bitmap_range2(bmap, 0, nbits - 1);
+		else
+			ext2fs_mark_generic_bmap(bmap, nbits - 1);
+
+		t0 = clock();
+		for (i = 0; i < loops; i++) {
+			if (set)
+				retval = ext2fs_find_first_set_generic_bmap(bmap,
+							0, nbits - 1, &out);
+			else
+				retval = ext2fs_find_first_zero_generic_bmap(bmap,
+							0, nbits - 1, &out);
+		}
+		t1 = clock();
+		for (i = 0; i < loops; i++) {
+			for (bit = 0; bit < nbits - 1; bit++)
+				if (!ext2fs_test_generic_bmap(bmap, bit) ==
+				    !set)
+					break;
+		}
+		t2 = clock();
+		if (retval || out != nbits - 1 || bit != nbits - 1)
+			printf("%s: %s: wrong result\n", bench_type_name(type),
+			       set ? "find_first_set" : "find_first_zero");
+		printf("%-9s %-15s %8.3f ms (bit by bit %8.3f ms)\n",
+		       bench_type_name(type),
+		       set ? "find_first_set" : "find_first_zero",
+		       (double) (t1 - t0) * 1000 / CLOCKS_PER_SEC / loops,
+		       (double) (t2 - t1) * 1000 / CLOCKS_PER_SEC / loops);
+	}
+	ext2fs_free_generic_bmap(bmap);
+}
+
+void do_bench_find(int argc, char *argv[])
+{
+	unsigned int nbits = 1 << 24, loops = 10;
+	int err;
+
+	if (check_fs_open(argv[0]))
+		return;
+
+	if (argc > 3) {
+		com_err(argv[0], 0, "Usage: bench_find [bits] [loops]");
+		return;
+	}
+	if (argc > 1) {
+		nbits = parse_ulong(argv[1], argv[0], "bits", &err);
+		if (err)
+			return;
+	}
+	if (argc > 2) {
+		loops = parse_ulong(argv[2], argv[0], "loops", &err);
+		if (err)
+			return;
+	}
+	if (nbits < 2 || !loops) {
+		com_err(argv[0], 0, "Invalid number of bits or loops");
+		return;
+	}
+
+	bench_one(EXT2FS_BMAP64_BITARRAY, nbits, loops);
+	bench_one(EXT2FS_BMAP64_RBTREE, nbits, loops);
+	bench_one(EXT2FS_BMAP64_RADIXTREE, nbits, loops);
+}
+
+/*
+ * Replay a trace of bitmap operations, as written by a library built
+ * with BMAP_STATS_OPS when E2FSPROGS_BITMAP_TRACE is set, against each
+ * backend.  Besides the timings, this checks that all the backends
+ * end up with the same bits set.
+ */
+struct trace_op {
+	char	op;
+	__u64	a, b;
+};
+
+static int read_trace(const char *fn, __u64 *range, struct trace_op **ret,
+		      size_t *ret_count)
+{
+	FILE		*f;
+	char		buf[256], op;
+	struct trace_op	*ops = NULL, *new_ops;
+	size_t		count = 0, max = 0;
+	unsigned long long a, b;
+	int		have_range = 0;
+
+	f = fopen(fn, "r");
+	if (!f) {
+		perror(fn);
+		return 1;
+	}
+	while (fgets(buf, sizeof(buf), f)) {
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		if (buf[0] == 'b') {
+			have_range = sscanf(buf, "b %llu %llu %llu", &a, &b,
+					    (unsigned long long *) &range[2]) == 3;
+			range[0] = a;
+			range[1] = b;
+			continue;
+		}
+		a = b = 0;
+		if (sscanf(buf, "%c %llu %llu", &op, &a, &b) < 1)
+			continue;
+		if (count == max) {
+			max = max ? max * 2 : 65536;
+			new_ops = realloc(ops, max * sizeof(struct trace_op));
+			if (!new_ops) {
+				com_err("bench_trace", ENOMEM,
+					"while reading %s", fn);
+				free(ops);
+				fclose(f);
+				return 1;
+			}
+			ops = new_ops;
+		}
+		ops[count].op = op;
+		ops[count].a = a;
+		ops[count].b = b;
+		count++;
+	}
+	fclose(f);
+	if (!have_range) {
+		com_err("bench_trace", 0, "%s: no bitmap range in trace", fn);
+		free(ops);
+		return 1;
+	}
+	*ret = ops;
+	*ret_count = count;
+	return 0;
+}
+
+static void replay_trace(ext2fs_generic_bitmap bmap, struct trace_op *ops,
+			 size_t count)
+{
+	size_t		i;
+	__u64		out, n, left;
+
+	for (i = 0; i < count; i++) {
+		switch (ops[i].op) {
+		case 'm':
+			ext2fs_mark_generic_bmap(bmap, ops[i].a);
+			break;
+		case 'u':
+			ext2fs_unmark_generic_bmap(bmap, ops[i].a);
+			break;
+		case 't':
+			ext2fs_test_generic_bmap(bmap, ops[i].a);
+			break;
+		case 'M':
+		case 'U':
+			for (out = ops[i].a, left = ops[i].b; left;
+			     out += n, left -= n) {
+				n = left > (1U << 30) ? (1U << 30) : left;
+				if (ops[i].op == 'M')
+					ext2fs_mark_block_bitmap_range2(bmap,
+								out, n);
+				else
+					ext2fs_unmark_block_bitmap_range2(bmap,
+								out, n);
+			}
+			break;
+		case 'T':
+			ext2fs_test_block_bitmap_range2(bmap, ops[i].a,
+							ops[i].b);
+			break;
+		case 'f':
+			ext2fs_find_first_set_generic_bmap(bmap, ops[i].a,
+							   ops[i].b, &out);
+			break;
+		case 'z':
+			ext2fs_find_first_zero_generic_bmap(bmap, ops[i].a,
+							    ops[i].b, &out);
+			break;
+		case 'c':
+			ext2fs_clear_generic_bmap(bmap);
+			break;
+		case 'r':
+			ext2fs_resize_generic_bmap(bmap, ops[i].a, ops[i].b);
+			break;
+		case 'e':
+			ext2fs_fudge_generic_bmap_end(bmap, EINVAL, ops[i].a,
+						      NULL);
+			break;
+		}
+	}
+}
+
+static int same_bits(ext2fs_generic_bitmap bm1, ext2fs_generic_bitmap bm2)
+{
+	static char	buf1[4096], buf2[4096];
+	__u64		start = bm1->start, end = bm1->end;
+	unsigned int	num;
+
+	if (bm1->start != bm2->start || bm1->end != bm2->end)
+		return 0;
+	while (start <= end) {
+		num = (end - start + 1 > sizeof(buf1) * 8) ?
+			sizeof(buf1) * 8 : end - start + 1;
+		memset(buf1, 0, sizeof(buf1));
+		memset(buf2, 0, sizeof(buf2));
+		if (ext2fs_get_generic_bmap_range(bm1, start, num, buf1) ||
+		    ext2fs_get_generic_bmap_range(bm2, start, num, buf2))
+			return 0;
+		if (num & 7) {
+			buf1[num >> 3] &= (1 << (num & 7)) - 1;
+			buf2[num >> 3] &= (1 << (num & 7)) - 1;
+		}
+		if (memcmp(buf1, buf2, (num + 7) >> 3))
+			return 0;
+		start += num;
+	}
+	return 1;
+}
+
+void do_bench_trace(int argc, char *argv[])
+{
+	static const int types[] = { EXT2FS_BMAP64_BITARRAY,
+				     EXT2FS_BMAP64_RBTREE,
+				     EXT2FS_BMAP64_RADIXTREE,
+				     EXT2FS_BMAP64_ADAPTIVE };
+	ext2fs_generic_bitmap bmap, first = NULL;
+	struct trace_op	*ops;
+	size_t		count;
+	__u64		range[3];
+	errcode_t	retval;
+	clock_t		t0;
+	unsigned int	i;
+
+	if (check_fs_open(argv[0]))
+		return;
+
+	if (argc != 2) {
+		com_err(argv[0], 0, "Usage: bench_trace <trace file>");
+		return;
+	}
+	if (read_trace(argv[1], range, &ops, &count))
+		return;
+
+	printf("%lu operations on bits %llu-%llu\n", (unsigned long) count,
+	       (unsigned long long) range[0], (unsigned long long) range[1]);
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		retval = ext2fs_alloc_generic_bmap(test_fs,
+					EXT2_ET_MAGIC_BLOCK_BITMAP64, types[i],
+					range[0], range[1], range[2],
+					"trace bitmap", &bmap);
+		if (retval) {
+			com_err(argv[0], retval, "while allocating bitmap");
+			break;
+		}
+		t0 = clock();
+		replay_trace(bmap, ops, count);
+		printf("%-9s %10.3f ms", bench_type_name(types[i]),
+		       (double) (clock() - t0) * 1000 / CLOCKS_PER_SEC);
+		if (types[i] == EXT2FS_BMAP64_ADAPTIVE)
+			printf(", %lu conversions, ended as %s",
+			       bmap->stats.conversions,
+			       bench_type_name(bmap->bitmap_ops->type));
+		if (first && !same_bits(first, bmap))
+			printf(" (bits differ from %s!)",
+			       bench_type_name(types[0]));
+		printf("\n");
+		if (first)
+			ext2fs_free_generic_bmap(bmap);
+		else
+			first = bmap;
+	}
+	if (first)
+		ext2fs_free_generic_bmap(first);
+	free(ops);
+}
+
 int main(int argc, char **argv)
 {
 	unsigned int	blocks = 128;
@@ -1,6 +1,10 @@
 /*
  * undo_io.c --- This is the undo io manager that copies the old data that
- * copies the old data being overwritten into a tdb database
+ * copies the old data being overwritten into an undo file
+ *
+ * The old data is appended to the undo file as it is saved, and a
+ * bitmap kept in memory records which blocks have been saved already.
+ * The format of the undo file is described in undo_io.h.
  *
  * Copyright IBM Corporation, 2007
  * Author Aneesh Kumar K.V <aneesh.kumar@linux.vnet.ibm.com>
@@ -13,6 +17,9 @@
 
 #define _LARGEFILE_SOURCE
 #define _LARGEFILE64_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
 #include <string.h>
@@ -37,10 +44,10 @@
 #include <sys/resource.h>
 #endif
 
-#include "tdb.h"
-
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
+#include "undo_io.h"
 
 #ifdef __GNUC__
 #define ATTR(x) __attribute__(x)
@@ -55,16 +62,41 @@
 #define EXT2_CHECK_MAGIC(struct, code) \
 	  if ((struct)->magic != (code)) return (code)
 
+/* Most data read and saved at once */
+#define UNDO_MAX_EXTENT		(1024 * 1024)
+/* Most data one extent may grow to as adjacent blocks are saved */
+#define UNDO_MAX_MERGE		(8 * 1024 * 1024)
+/* Start writing back the undo file after this much has been appended */
+#define UNDO_WRITE_BEHIND	(4 * 1024 * 1024)
+
 struct undo_private_data {
 	int	magic;
-	TDB_CONTEXT *tdb;
-	char *tdb_file;
+	int	undo_fd;
 
 	/* The backing io channel */
 	io_channel real;
 
-	int tdb_data_size;
-	int tdb_written;
+	int undo_blk_size;
+	int undo_written;
+
+	/* Undo blocks whose old contents have been saved */
+	ext2fs_generic_bitmap saved;
+
+	/* Index of the extents written so far */
+	struct undo_key *keys;
+	unsigned long long num_keys;
+	unsigned long long max_keys;
+
+	/* End of the undo file, where the next extent goes */
+	ext2_loff_t undo_off;
+	/* How much of it has been handed to undo_write_behind() */
+	ext2_loff_t sync_off;
+
+	/* Buffer for reading old data, with room for an extent header */
+	char *buf;
+
+	__u32 fs_mtime;
+	__u8 fs_uuid[16];
 
 	/* to support offset in unix I/O manager */
 	ext2_loff_t offset;
@@ -87,6 +119,9 @@ static errcode_t undo_write_byte(io_channel channel, unsigned long offset,
 static errcode_t undo_set_option(io_channel channel, const char *option,
 				 const char *arg);
 static errcode_t undo_get_stats(io_channel channel, io_stats *stats);
+static errcode_t undo_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
 
 static struct struct_io_manager struct_undo_manager = {
 	EXT2_ET_MAGIC_IO_MANAGER,
@@ -102,17 +137,16 @@ static struct struct_io_manager struct_undo_manager = {
 	undo_get_stats,
 	undo_read_blk64,
 	undo_write_blk64,
+	NULL,			/* discard */
+	undo_cache_readahead,
 };
 
 io_manager undo_io_manager = &struct_undo_manager;
 static io_manager undo_io_backing_manager ;
-static char *tdb_file;
+static char *undo_file;
+static int undo_file_created;
 static int actual_size;
 
-static unsigned char mtime_key[] = "filesystem MTIME";
-static unsigned char blksize_key[] = "filesystem BLKSIZE";
-static unsigned char uuid_key[] = "filesystem UUID";
-
 errcode_t set_undo_io_backing_manager(io_manager manager)
 {
 	/*
@@ -124,21 +158,60 @@ errcode_t set_undo_io_backing_manager(io_manager manager)
 
 errcode_t set_undo_io_backup_file(char *file_name)
 {
-	tdb_file = strdup(file_name);
+	undo_file = strdup(file_name);
 
-	if (tdb_file == NULL) {
+	if (undo_file == NULL) {
 		return EXT2_ET_NO_MEMORY;
 	}
+	/* The next open starts a new undo file */
+	undo_file_created = 0;
 
 	return 0;
 }
 
-static errcode_t write_file_system_identity(io_channel undo_channel,
-							TDB_CONTEXT *tdb)
+static errcode_t undo_pwrite(struct undo_private_data *data,
+			     ext2_loff_t offset, const void *buf, size_t size)
+{
+	ssize_t	actual;
+
+	if (ext2fs_llseek(data->undo_fd, offset, SEEK_SET) != offset)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = write(data->undo_fd, buf, size);
+	if (actual < 0)
+		return errno;
+	if ((size_t) actual != size)
+		return EXT2_ET_SHORT_WRITE;
+	return 0;
+}
+
+static errcode_t write_undo_header(struct undo_private_data *data, int state,
+				   __u32 index_crc)
+{
+	char	buf[E2UNDO_HEADER_SIZE];
+	struct undo_header *hdr = (struct undo_header *) buf;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(hdr->magic, E2UNDO_MAGIC, E2UNDO_MAGIC_LEN);
+	hdr->block_size = ext2fs_cpu_to_le32(data->undo_blk_size);
+	hdr->state = ext2fs_cpu_to_le32(state);
+	if (state == E2UNDO_STATE_FINISHED) {
+		hdr->num_keys = ext2fs_cpu_to_le64(data->num_keys);
+		hdr->index_offset = ext2fs_cpu_to_le64(data->undo_off);
+		hdr->index_crc = ext2fs_cpu_to_le32(index_crc);
+		/* Kept in the file system byte order */
+		hdr->fs_mtime = data->fs_mtime;
+		memcpy(hdr->fs_uuid, data->fs_uuid, sizeof(hdr->fs_uuid));
+	}
+	hdr->header_crc = ext2fs_cpu_to_le32(
+		ext2fs_crc32c_le(~0, (unsigned char *) hdr,
+				 offsetof(struct undo_header, header_crc)));
+	return undo_pwrite(data, 0, buf, sizeof(buf));
+}
+
+static errcode_t read_file_system_identity(io_channel undo_channel)
 {
 	errcode_t retval;
 	struct ext2_super_block super;
-	TDB_DATA tdb_key, tdb_data;
 	struct undo_private_data *data;
 	io_channel channel;
 	int block_size ;
@@ -152,69 +225,284 @@ static errcode_t write_file_system_identity(io_channel undo_channel,
 	if (retval)
 		goto err_out;
 
-	/* Write to tdb file in the file system byte order */
-	tdb_key.dptr = mtime_key;
-	tdb_key.dsize = sizeof(mtime_key);
-	tdb_data.dptr = (unsigned char *) &(super.s_mtime);
-	tdb_data.dsize = sizeof(super.s_mtime);
+	data->fs_mtime = super.s_mtime;
+	memcpy(data->fs_uuid, super.s_uuid, sizeof(data->fs_uuid));
 
-	retval = tdb_store(tdb, tdb_key, tdb_data, TDB_INSERT);
-	if (retval == -1) {
-		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
-		goto err_out;
-	}
+err_out:
+	io_channel_set_blksize(channel, block_size);
+	return retval;
+}
 
-	tdb_key.dptr = uuid_key;
-	tdb_key.dsize = sizeof(uuid_key);
-	tdb_data.dptr = (unsigned char *)&(super.s_uuid);
-	tdb_data.dsize = sizeof(super.s_uuid);
+static int undo_key_cmp(const void *a, const void *b)
+{
+	const struct undo_key *ka = a, *kb = b;
+
+	if (ka->block < kb->block)
+		return -1;
+	return ka->block > kb->block;
+}
 
-	retval = tdb_store(tdb, tdb_key, tdb_data, TDB_INSERT);
-	if (retval == -1) {
-		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
+/*
+ * Append the index, sorted by block, and point the header at it.
+ */
+static errcode_t write_undo_index(struct undo_private_data *data)
+{
+	struct undo_key *key;
+	unsigned long long i;
+	errcode_t	retval;
+	__u32		crc;
+	size_t		size;
+
+	qsort(data->keys, data->num_keys, sizeof(struct undo_key),
+	      undo_key_cmp);
+	for (i = 0, key = data->keys; i < data->num_keys; i++, key++) {
+		key->block = ext2fs_cpu_to_le64(key->block);
+		key->offset = ext2fs_cpu_to_le64(key->offset);
+		key->len = ext2fs_cpu_to_le32(key->len);
+		key->crc = ext2fs_cpu_to_le32(key->crc);
+	}
+	size = data->num_keys * sizeof(struct undo_key);
+	crc = ext2fs_crc32c_le(~0, (unsigned char *) data->keys, size);
+	if (size) {
+		retval = undo_pwrite(data, data->undo_off, data->keys, size);
+		if (retval)
+			return retval;
 	}
+	retval = write_undo_header(data, E2UNDO_STATE_FINISHED, crc);
+	if (retval)
+		return retval;
+	if (fsync(data->undo_fd) < 0)
+		return errno;
+	return 0;
+}
 
-err_out:
-	io_channel_set_blksize(channel, block_size);
-	return retval;
+/*
+ * Start writing back what has been appended to the undo file since the
+ * last call, once there is enough of it.  The program does not wait
+ * for it; by the time the channel is flushed and the undo file has to
+ * be synced, most of it is on the disk already.
+ */
+static void undo_write_behind(struct undo_private_data *data)
+{
+	if (data->undo_off - data->sync_off < UNDO_WRITE_BEHIND)
+		return;
+#ifdef HAVE_SYNC_FILE_RANGE
+	(void) sync_file_range(data->undo_fd, data->sync_off,
+			       data->undo_off - data->sync_off,
+			       SYNC_FILE_RANGE_WRITE);
+#endif
+	data->sync_off = data->undo_off;
 }
 
-static errcode_t write_block_size(TDB_CONTEXT *tdb, int block_size)
+/*
+ * Pick up an undo file which this program already wrote and closed,
+ * for instance before e2fsck restarts, so that what it holds is kept
+ * and the blocks it saved are not saved again.
+ */
+static errcode_t reopen_undo_file(struct undo_private_data *data)
 {
-	errcode_t retval;
-	TDB_DATA tdb_key, tdb_data;
+	char		buf[E2UNDO_HEADER_SIZE];
+	struct undo_header *hdr = (struct undo_header *) buf;
+	struct undo_key	*key;
+	unsigned long long i, num;
+	ext2_loff_t	index_offset;
+	errcode_t	retval;
+	ssize_t		actual;
+	size_t		size;
+
+	if (ext2fs_llseek(data->undo_fd, 0, SEEK_SET) != 0)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = read(data->undo_fd, buf, sizeof(buf));
+	if (actual != sizeof(buf) ||
+	    memcmp(hdr->magic, E2UNDO_MAGIC, E2UNDO_MAGIC_LEN) ||
+	    ext2fs_crc32c_le(~0, (unsigned char *) hdr,
+			     offsetof(struct undo_header, header_crc)) !=
+	    ext2fs_le32_to_cpu(hdr->header_crc) ||
+	    ext2fs_le32_to_cpu(hdr->state) != E2UNDO_STATE_FINISHED)
+		return EXT2_ET_UNDO_FILE_CORRUPT;
+
+	num = ext2fs_le64_to_cpu(hdr->num_keys);
+	index_offset = ext2fs_le64_to_cpu(hdr->index_offset);
+	data->undo_off = index_offset;
+	data->sync_off = index_offset;
+	if (!num)
+		return 0;
+
+	data->undo_blk_size = ext2fs_le32_to_cpu(hdr->block_size);
+	data->undo_written = 1;
+	if (!data->undo_blk_size)
+		return EXT2_ET_UNDO_FILE_CORRUPT;
+	size = num * sizeof(struct undo_key);
+	retval = ext2fs_get_mem(size, &data->keys);
+	if (retval)
+		return retval;
+	data->max_keys = num;
+	if (ext2fs_llseek(data->undo_fd, index_offset, SEEK_SET) !=
+	    index_offset)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = read(data->undo_fd, data->keys, size);
+	if (actual < 0 || (size_t) actual != size ||
+	    ext2fs_crc32c_le(~0, (unsigned char *) data->keys, size) !=
+	    ext2fs_le32_to_cpu(hdr->index_crc))
+		return EXT2_ET_UNDO_FILE_CORRUPT;
+	for (i = 0, key = data->keys; i < num; i++, key++) {
+		key->block = ext2fs_le64_to_cpu(key->block);
+		key->offset = ext2fs_le64_to_cpu(key->offset);
+		key->len = ext2fs_le32_to_cpu(key->len);
+		key->crc = ext2fs_le32_to_cpu(key->crc);
+		ext2fs_mark_block_bitmap_range2(data->saved, key->block,
+			(key->len + data->undo_blk_size - 1) /
+			data->undo_blk_size);
+	}
+	data->num_keys = num;
+	return 0;
+}
+
+/*
+ * Save count undo blocks starting at block, which have not been saved
+ * before, as one extent at the end of the undo file.
+ */
+static errcode_t undo_save_extent(io_channel channel, unsigned long long block,
+				  int count)
+{
+	struct undo_private_data *data;
+	struct undo_extent extent;
+	struct undo_key *key;
+	ext2_loff_t	location;
+	__u32		crc;
+	unsigned long long backing_blk_num;
+	errcode_t	retval;
+	char		*read_ptr;
+	int		size, skip, sz, len;
 
-	tdb_key.dptr = blksize_key;
-	tdb_key.dsize = sizeof(blksize_key);
-	tdb_data.dptr = (unsigned char *)&(block_size);
-	tdb_data.dsize = sizeof(block_size);
+	data = (struct undo_private_data *) channel->private_data;
 
-	retval = tdb_store(tdb, tdb_key, tdb_data, TDB_INSERT);
-	if (retval == -1) {
-		retval = EXT2_ET_TDB_SUCCESS + tdb_error(tdb);
+	/*
+	 * Read the old data using the backing I/O manager.  The backing
+	 * I/O manager block size may be different from the undo block
+	 * size, so the read may have to start before the extent.
+	 */
+	location = block * data->undo_blk_size - data->offset;
+	backing_blk_num = location / channel->block_size;
+	skip = location % channel->block_size;
+	size = skip + count * data->undo_blk_size;
+	if ((size % channel->block_size) == 0)
+		sz = size / channel->block_size;
+	else
+		sz = -size;
+
+	read_ptr = data->buf + sizeof(struct undo_extent);
+	len = count * data->undo_blk_size;
+	actual_size = 0;
+	retval = io_channel_read_blk64(data->real, backing_blk_num, sz,
+				       read_ptr);
+	if (retval) {
+		if (retval != EXT2_ET_SHORT_READ)
+			return retval;
+		/*
+		 * short read so update the extent size
+		 * accordingly
+		 */
+		len = actual_size - skip;
+		if (len <= 0)
+			goto done;
 	}
 
-	return retval;
+	extent.magic = ext2fs_cpu_to_le32(E2UNDO_EXTENT_MAGIC);
+	extent.len = ext2fs_cpu_to_le32(len);
+	extent.block = ext2fs_cpu_to_le64(block);
+	crc = ext2fs_crc32c_le(~0, (unsigned char *) read_ptr + skip, len);
+	extent.crc = ext2fs_cpu_to_le32(crc);
+	extent.reserved = 0;
+	/* The header goes right before the data, over the skipped bytes */
+	memcpy(read_ptr + skip - sizeof(extent), &extent, sizeof(extent));
+
+	if (data->num_keys >= data->max_keys) {
+		unsigned long long new_max = data->max_keys ?
+			data->max_keys * 2 : 1024;
+
+		retval = ext2fs_resize_mem(data->max_keys *
+					   sizeof(struct undo_key),
+					   new_max * sizeof(struct undo_key),
+					   &data->keys);
+		if (retval)
+			return retval;
+		data->max_keys = new_max;
+	}
+
+	if (!data->undo_written) {
+		data->undo_written = 1;
+		/* Write the block size to the undo file */
+		retval = write_undo_header(data, E2UNDO_STATE_OPEN, 0);
+		if (retval)
+			return retval;
+	}
+
+	/*
+	 * If this continues the last extent, both on the device and in
+	 * the undo file, just append the data and grow that extent.
+	 * Its header is updated after the data is written, so it
+	 * always describes data which is there.
+	 */
+	key = data->num_keys ? data->keys + data->num_keys - 1 : NULL;
+	if (key && key->offset + key->len == (__u64) data->undo_off &&
+	    (key->len % data->undo_blk_size) == 0 &&
+	    key->block + key->len / data->undo_blk_size == block &&
+	    key->len + len <= UNDO_MAX_MERGE) {
+		retval = undo_pwrite(data, data->undo_off, read_ptr + skip,
+				     len);
+		if (retval)
+			return retval;
+		key->len += len;
+		key->crc = ext2fs_crc32c_le(key->crc,
+					    (unsigned char *) read_ptr + skip,
+					    len);
+		extent.len = ext2fs_cpu_to_le32(key->len);
+		extent.block = ext2fs_cpu_to_le64(key->block);
+		extent.crc = ext2fs_cpu_to_le32(key->crc);
+		retval = undo_pwrite(data, key->offset - sizeof(extent),
+				     &extent, sizeof(extent));
+		if (retval)
+			return retval;
+		data->undo_off += len;
+		undo_write_behind(data);
+		goto done;
+	}
+
+	retval = undo_pwrite(data, data->undo_off,
+			     read_ptr + skip - sizeof(extent),
+			     sizeof(extent) + len);
+	if (retval)
+		return retval;
+
+	key = data->keys + data->num_keys++;
+	key->block = block;
+	key->offset = data->undo_off + sizeof(struct undo_extent);
+	key->len = len;
+	key->crc = crc;
+	data->undo_off += sizeof(struct undo_extent) + len;
+	undo_write_behind(data);
+done:
+	ext2fs_mark_block_bitmap_range2(data->saved, block, count);
+	return 0;
 }
 
-static errcode_t undo_write_tdb(io_channel channel,
+static errcode_t undo_save_blocks(io_channel channel,
 				unsigned long long block, int count)
 
 {
-	int size, sz;
-	unsigned long long block_num, backing_blk_num;
+	int size, max_count;
+	unsigned long long block_num, end_block, run_end;
 	errcode_t retval = 0;
 	ext2_loff_t offset;
 	struct undo_private_data *data;
-	TDB_DATA tdb_key, tdb_data;
-	unsigned char *read_ptr;
-	unsigned long long end_block;
+	__u64 found;
 
 	data = (struct undo_private_data *) channel->private_data;
 
-	if (data->tdb == NULL) {
+	if (data->undo_fd < 0) {
 		/*
-		 * Transaction database not initialized
+		 * Undo file not initialized
 		 */
 		return 0;
 	}
@@ -227,105 +515,51 @@ static errcode_t undo_write_tdb(io_channel channel,
 		else
 			size = count * channel->block_size;
 	}
+	if (size <= 0)
+		return 0;
+
+	if (!data->buf) {
+		/* Room for the skipped start of a backing block, too */
+		retval = ext2fs_get_mem(sizeof(struct undo_extent) +
+					(data->undo_blk_size > UNDO_MAX_EXTENT ?
+					 data->undo_blk_size : UNDO_MAX_EXTENT) +
+					EXT2_MAX_BLOCK_SIZE, &data->buf);
+		if (retval)
+			return retval;
+	}
+	max_count = UNDO_MAX_EXTENT / data->undo_blk_size;
+	if (!max_count)
+		max_count = 1;
+
 	/*
-	 * Data is stored in tdb database as blocks of tdb_data_size size
-	 * This helps in efficient lookup further.
+	 * Data is saved in the undo file in blocks of undo_blk_size.
 	 *
-	 * We divide the disk to blocks of tdb_data_size.
+	 * We divide the disk to blocks of undo_blk_size.
 	 */
 	offset = (block * channel->block_size) + data->offset ;
-	block_num = offset / data->tdb_data_size;
-	end_block = (offset + size) / data->tdb_data_size;
-
-	tdb_transaction_start(data->tdb);
-	while (block_num <= end_block ) {
-
-		tdb_key.dptr = (unsigned char *)&block_num;
-		tdb_key.dsize = sizeof(block_num);
-		/*
-		 * Check if we have the record already
-		 */
-		if (tdb_exists(data->tdb, tdb_key)) {
-			/* Try the next block */
-			block_num++;
-			continue;
-		}
-		/*
-		 * Read one block using the backing I/O manager
-		 * The backing I/O manager block size may be
-		 * different from the tdb_data_size.
-		 * Also we need to recalcuate the block number with respect
-		 * to the backing I/O manager.
-		 */
-		offset = block_num * data->tdb_data_size;
-		backing_blk_num = (offset - data->offset) / channel->block_size;
-
-		count = data->tdb_data_size +
-				((offset - data->offset) % channel->block_size);
-		retval = ext2fs_get_mem(count, &read_ptr);
-		if (retval) {
-			tdb_transaction_cancel(data->tdb);
-			return retval;
-		}
-
-		memset(read_ptr, 0, count);
-		actual_size = 0;
-		if ((count % channel->block_size) == 0)
-			sz = count / channel->block_size;
-		else
-			sz = -count;
-		retval = io_channel_read_blk64(data->real, backing_blk_num,
-					     sz, read_ptr);
-		if (retval) {
-			if (retval != EXT2_ET_SHORT_READ) {
-				free(read_ptr);
-				tdb_transaction_cancel(data->tdb);
-				return retval;
-			}
-			/*
-			 * short read so update the record size
-			 * accordingly
-			 */
-			tdb_data.dsize = actual_size;
-		} else {
-			tdb_data.dsize = data->tdb_data_size;
-		}
-		tdb_data.dptr = read_ptr +
-				((offset - data->offset) % channel->block_size);
-#ifdef DEBUG
-		printf("Printing with key %lld data %x and size %d\n",
-		       block_num,
-		       tdb_data.dptr,
-		       tdb_data.dsize);
-#endif
-		if (!data->tdb_written) {
-			data->tdb_written = 1;
-			/* Write the blocksize to tdb file */
-			retval = write_block_size(data->tdb,
-						  data->tdb_data_size);
-			if (retval) {
-				tdb_transaction_cancel(data->tdb);
-				retval = EXT2_ET_TDB_ERR_IO;
-				free(read_ptr);
+	block_num = offset / data->undo_blk_size;
+	end_block = (offset + size - 1) / data->undo_blk_size;
+
+	while (block_num <= end_block) {
+		/* Skip over the blocks which are saved already */
+		if (ext2fs_find_first_zero_generic_bmap(data->saved, block_num,
+							end_block, &found))
+			break;
+		block_num = found;
+		if (ext2fs_find_first_set_generic_bmap(data->saved, block_num,
+						       end_block, &found))
+			found = end_block + 1;
+		run_end = found;
+
+		while (block_num < run_end) {
+			count = run_end - block_num > (unsigned) max_count ?
+				max_count : (int) (run_end - block_num);
+			retval = undo_save_extent(channel, block_num, count);
+			if (retval)
 				return retval;
-			}
+			block_num += count;
 		}
-		retval = tdb_store(data->tdb, tdb_key, tdb_data, TDB_INSERT);
-		if (retval == -1) {
-			/*
-			 * TDB_ERR_EXISTS cannot happen because we
-			 * have already verified it doesn't exist
-			 */
-			tdb_transaction_cancel(data->tdb);
-			retval = EXT2_ET_TDB_ERR_IO;
-			free(read_ptr);
-			return retval;
-		}
-		free(read_ptr);
-		/* Next block */
-		block_num++;
 	}
-	tdb_transaction_commit(data->tdb);
 
 	return retval;
 }
@@ -352,6 +586,7 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 	io_channel	io = NULL;
 	struct undo_private_data *data = NULL;
 	errcode_t	retval;
+	int		created = 0;
 
 	if (name == 0)
 		return EXT2_ET_BAD_DEVICE_NAME;
@@ -363,6 +598,9 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 	retval = ext2fs_get_mem(sizeof(struct undo_private_data), &data);
 	if (retval)
 		goto cleanup;
+	memset(data, 0, sizeof(struct undo_private_data));
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->undo_fd = -1;
 
 	io->manager = undo_io_manager;
 	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
@@ -376,9 +614,6 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 	io->write_error = 0;
 	io->refcount = 1;
 
-	memset(data, 0, sizeof(struct undo_private_data));
-	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
-
 	if (undo_io_backing_manager) {
 		retval = undo_io_backing_manager->open(name, flags,
 						       &data->real);
@@ -388,13 +623,43 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 		data->real = 0;
 	}
 
-	/* setup the tdb file */
-	data->tdb = tdb_open(tdb_file, 0, TDB_CLEAR_IF_FIRST,
-			     O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0600);
-	if (!data->tdb) {
-		retval = errno;
+	/*
+	 * setup the undo file; nothing can be overwritten through a
+	 * channel which is not opened for writing
+	 */
+	if (!(flags & IO_FLAG_RW))
+		goto done;
+	retval = ext2fs_alloc_generic_bmap(NULL, EXT2_ET_MAGIC_GENERIC_BITMAP64,
+					   EXT2FS_BMAP64_RBTREE, 0,
+					   ~0ULL >> 1, ~0ULL >> 1,
+					   "saved undo blocks", &data->saved);
+	if (retval)
 		goto cleanup;
+	if (undo_file_created) {
+		data->undo_fd = ext2fs_open_file(undo_file, O_RDWR, 0);
+		if (data->undo_fd < 0) {
+			retval = errno;
+			goto cleanup;
+		}
+		retval = reopen_undo_file(data);
+	} else {
+		data->undo_fd = ext2fs_open_file(undo_file,
+					O_RDWR | O_CREAT | O_TRUNC | O_EXCL,
+					0600);
+		if (data->undo_fd < 0) {
+			retval = errno;
+			goto cleanup;
+		}
+		created = 1;
+		data->undo_off = E2UNDO_HEADER_SIZE;
+		data->sync_off = E2UNDO_HEADER_SIZE;
 	}
+	if (!retval)
+		retval = write_undo_header(data, E2UNDO_STATE_OPEN, 0);
+	if (retval)
+		goto cleanup;
+	undo_file_created = 1;
+done:
 
 	/*
 	 * setup err handler for read so that we know
@@ -407,6 +672,15 @@ static errcode_t undo_open(const char *name, int flags, io_channel *channel)
 	return 0;
 
 cleanup:
+	if (data && data->undo_fd >= 0) {
+		close(data->undo_fd);
+		if (created)
+			unlink(undo_file);
+	}
+	if (data && data->saved)
+		ext2fs_free_generic_bmap(data->saved);
+	if (data && data->keys)
+		ext2fs_free_mem(&data->keys);
 	if (data && data->real)
 		io_channel_close(data->real);
 	if (data)
@@ -427,14 +701,23 @@ static errcode_t undo_close(io_channel channel)
 
 	if (--channel->refcount > 0)
 		return 0;
-	/* Before closing write the file system identity */
-	retval = write_file_system_identity(channel, data->tdb);
-	if (retval)
-		return retval;
+	/* Before closing write the file system identity and the index */
+	if (data->undo_fd >= 0) {
+		retval = read_file_system_identity(channel);
+		if (retval)
+			return retval;
+		retval = write_undo_index(data);
+		if (retval)
+			return retval;
+		close(data->undo_fd);
+		ext2fs_free_generic_bmap(data->saved);
+	}
 	if (data->real)
 		retval = io_channel_close(data->real);
-	if (data->tdb)
-		tdb_close(data->tdb);
+	if (data->keys)
+		ext2fs_free_mem(&data->keys);
+	if (data->buf)
+		ext2fs_free_mem(&data->buf);
 	ext2fs_free_mem(&channel->private_data);
 	if (channel->name)
 		ext2fs_free_mem(&channel->name);
@@ -455,10 +738,10 @@ static errcode_t undo_set_blksize(io_channel channel, int blksize)
 	if (data->real)
 		retval = io_channel_set_blksize(data->real, blksize);
 	/*
-	 * Set the block size used for tdb
+	 * Set the block size used for the undo file
 	 */
-	if (!data->tdb_data_size) {
-		data->tdb_data_size = blksize;
+	if (!data->undo_blk_size) {
+		data->undo_blk_size = blksize;
 	}
 	channel->block_size = blksize;
 	return retval;
@@ -498,7 +781,7 @@ static errcode_t undo_write_blk64(io_channel channel, unsigned long long block,
 	/*
 	 * First write the existing content into database
 	 */
-	retval = undo_write_tdb(channel, block, count);
+	retval = undo_save_blocks(channel, block, count);
 	if (retval)
 		 return retval;
 	if (data->real)
@@ -530,12 +813,12 @@ static errcode_t undo_write_byte(io_channel channel, unsigned long offset,
 	/*
 	 * the size specified may spread across multiple blocks
 	 * also make sure we account for the fact that block start
-	 * offset for tdb is different from the backing I/O manager
+	 * offset for the undo file is different from the backing I/O manager
 	 * due to possible different block size
 	 */
 	count = (size + (location % channel->block_size) +
 			channel->block_size  -1)/channel->block_size;
-	retval = undo_write_tdb(channel, blk_num, count);
+	retval = undo_save_blocks(channel, blk_num, count);
 	if (retval)
 		return retval;
 	if (data->real && data->real->manager->write_byte)
@@ -556,6 +839,12 @@ static errcode_t undo_flush(io_channel channel)
 	data = (struct undo_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	/*
+	 * The old data must reach the disk no later than whatever new
+	 * data is being flushed.
+	 */
+	if (data->undo_fd >= 0 && fsync(data->undo_fd) < 0)
+		return errno;
 	if (data->real)
 		retval = io_channel_flush(data->real);
 
@@ -581,8 +870,12 @@ static errcode_t undo_set_option(io_channel channel, const char *option,
 		tmp = strtoul(arg, &end, 0);
 		if (*end)
 			return EXT2_ET_INVALID_ARGUMENT;
-		if (!data->tdb_data_size || !data->tdb_written) {
-			data->tdb_data_size = tmp;
+		if (!tmp)
+			return EXT2_ET_INVALID_ARGUMENT;
+		if (!data->undo_blk_size || !data->undo_written) {
+			data->undo_blk_size = tmp;
+			if (data->buf)
+				ext2fs_free_mem(&data->buf);
 		}
 		return 0;
 	}
@@ -615,8 +908,25 @@ static errcode_t undo_get_stats(io_channel channel, io_stats *stats)
 	data = (struct undo_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
-	if (data->real)
+	if (data->real && data->real->manager->get_stats)
 		retval = (data->real->manager->get_stats)(data->real, stats);
 
 	return retval;
 }
+
+static errcode_t undo_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count)
+{
+	struct undo_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct undo_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (data->real)
+		retval = io_channel_cache_readahead(data->real, block, count);
+
+	return retval;
+}
@@ -0,0 +1,64 @@
+/*
+ * undo_io.h --- on-disk format of the undo files written by undo_io.c
+ * and replayed by e2undo
+ *
+ * An undo file starts with a header of E2UNDO_HEADER_SIZE bytes.  The
+ * original contents of each range of blocks which is about to be
+ * overwritten are appended after it as an extent: a struct
+ * undo_extent followed by the saved data.  When the undo file is
+ * closed, an index of every extent, sorted by block number, is
+ * appended as a trailer and the header is rewritten to point to it.
+ *
+ * An undo file which was never closed has no index, but the extents
+ * describe themselves, so they can still be found by reading the file
+ * from the beginning.
+ *
+ * Undo files written by older versions of e2fsprogs are tdb databases
+ * instead; e2undo tells the two apart by the magic number.
+ *
+ * All fields are stored little-endian.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#define E2UNDO_MAGIC		"E2UNDO02"
+#define E2UNDO_MAGIC_LEN	8
+#define E2UNDO_HEADER_SIZE	1024
+#define E2UNDO_EXTENT_MAGIC	0xE2DA7A00
+
+/* Values of undo_header.state */
+#define E2UNDO_STATE_OPEN	0	/* no index yet */
+#define E2UNDO_STATE_FINISHED	1	/* index and fs identity written */
+
+struct undo_header {
+	char	magic[E2UNDO_MAGIC_LEN];
+	__u32	block_size;	/* size of the undo blocks */
+	__u32	state;
+	__u64	num_keys;	/* entries in the index */
+	__u64	index_offset;
+	__u32	index_crc;	/* crc32c of the index */
+	__u32	fs_mtime;	/* file system identity when closed */
+	__u8	fs_uuid[16];
+	__u32	reserved[5];
+	__u32	header_crc;	/* crc32c of everything above */
+};
+
+/* Precedes the saved data of each extent */
+struct undo_extent {
+	__u32	magic;
+	__u32	len;		/* bytes of data which follow */
+	__u64	block;		/* first undo block of the extent */
+	__u32	crc;		/* crc32c of the data */
+	__u32	reserved;
+};
+
+/* One entry of the index */
+struct undo_key {
+	__u64	block;
+	__u64	offset;		/* of the data in the undo file */
+	__u32	len;
+	__u32	crc;
+};
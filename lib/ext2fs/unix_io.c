@@ -2,7 +2,7 @@
  * unix_io.c --- This is the Unix (well, really POSIX) implementation
  * 	of the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements a set-associative write-back block cache.
  *
  * Includes support for Windows NT support under Cygwin.
  *
@@ -22,6 +22,7 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -31,6 +32,9 @@
 #endif
 #include <fcntl.h>
 #include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #ifdef __linux__
 #include <sys/utsname.h>
 #endif
@@ -49,6 +53,9 @@
 #if HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
+#if HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #if HAVE_LINUX_FALLOC_H
 #include <linux/falloc.h>
 #endif
@@ -72,24 +79,39 @@
 struct unix_cache {
 	char			*buf;
 	unsigned long long	block;
-	int			access_time;
+	unsigned long		access_time;
 	unsigned		dirty:1;
 	unsigned		in_use:1;
 };
 
-#define CACHE_SIZE 8
-#define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_SIZE */
-#define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_SIZE */
+/*
+ * The cache is divided into sets of CACHE_WAYS entries; a block can
+ * only live in the set its number hashes to, and LRU replacement is
+ * done within the set.  The number of sets is always a power of two.
+ */
+#define CACHE_WAYS		8
+#define CACHE_DEFAULT_SETS	8
+#define CACHE_MAX_SETS		(1 << 20)
+#define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_WAYS */
+#define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_WAYS */
+#define FLUSH_BATCH_SIZE 64	/* Max blocks written at once by a flush */
+#define MAX_IOV		64	/* Max buffers passed to one readv/writev */
 
 struct unix_private_data {
 	int	magic;
 	int	dev;
 	int	flags;
 	int	align;
-	int	access_time;
+	unsigned long access_time;
 	ext2_loff_t offset;
-	struct unix_cache cache[CACHE_SIZE];
+	struct unix_cache *cache;
+	unsigned int cache_sets;
+	unsigned long long cache_bytes;	/* requested size; 0 = default */
+	char	*cache_buf;
+	struct unix_cache **flush_list;
 	void	*bounce;
+	unsigned long long discard_granularity;	/* bytes; 0 if unknown */
+	unsigned long long discard_alignment;	/* offset of the first unit */
 	struct struct_io_stats io_stats;
 };
 
@@ -118,6 +140,17 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 				int count, const void *data);
 static errcode_t unix_discard(io_channel channel, unsigned long long block,
 			      unsigned long long count);
+static errcode_t unix_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
+static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
+			      unsigned long long count);
+static errcode_t unix_read_blk_vec(io_channel channel,
+				   unsigned long long block,
+				   struct io_blk_vec *vec, int nr_vec);
+static errcode_t unix_write_blk_vec(io_channel channel,
+				    unsigned long long block,
+				    const struct io_blk_vec *vec, int nr_vec);
 
 static struct struct_io_manager struct_unix_manager = {
 	EXT2_ET_MAGIC_IO_MANAGER,
@@ -134,6 +167,10 @@ static struct struct_io_manager struct_unix_manager = {
 	unix_read_blk64,
 	unix_write_blk64,
 	unix_discard,
+	unix_cache_readahead,
+	unix_read_blk_vec,
+	unix_write_blk_vec,
+	unix_zeroout,
 };
 
 io_manager unix_io_manager = &struct_unix_manager;
@@ -154,13 +191,31 @@ static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
 	return retval;
 }
 
+/* The time in microseconds, for the latency histograms */
+static unsigned long long unix_usec(void)
+{
+	struct timeval	tv;
+
+	if (gettimeofday(&tv, 0) < 0)
+		return 0;
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void account_request(unsigned long long *hist,
+			    unsigned long long start)
+{
+	unsigned long long now = unix_usec();
+
+	io_stats_add_latency(hist, now > start ? now - start : 0);
+}
+
 /*
  * Here are the raw I/O functions
  */
-static errcode_t raw_read_blk(io_channel channel,
-			      struct unix_private_data *data,
-			      unsigned long long block,
-			      int count, void *bufv)
+static errcode_t do_raw_read_blk(io_channel channel,
+				 struct unix_private_data *data,
+				 unsigned long long block,
+				 int count, void *bufv)
 {
 	errcode_t	retval;
 	ssize_t		size;
@@ -171,6 +226,21 @@ static errcode_t raw_read_blk(io_channel channel,
 	size = (count < 0) ? -count : count * channel->block_size;
 	data->io_stats.bytes_read += size;
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+#ifdef HAVE_PREAD64
+	/*
+	 * pread() leaves the file offset alone, so processes which share
+	 * the descriptor (see ext2fs_parallel_inode_scan()) can read at
+	 * the same time.
+	 */
+	if ((channel->align == 0) ||
+	    (IS_ALIGNED(buf, channel->align) &&
+	     IS_ALIGNED(size, channel->align))) {
+		actual = pread64(data->dev, buf, size, location);
+		if (actual != size)
+			goto short_read;
+		return 0;
+	}
+#endif
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -219,10 +289,24 @@ error_out:
 	return retval;
 }
 
-static errcode_t raw_write_blk(io_channel channel,
-			       struct unix_private_data *data,
-			       unsigned long long block,
-			       int count, const void *bufv)
+static errcode_t raw_read_blk(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long long block,
+			      int count, void *bufv)
+{
+	unsigned long long start = unix_usec();
+	errcode_t	retval;
+
+	retval = do_raw_read_blk(channel, data, block, count, bufv);
+	data->io_stats.reads++;
+	account_request(data->io_stats.read_latency, start);
+	return retval;
+}
+
+static errcode_t do_raw_write_blk(io_channel channel,
+				  struct unix_private_data *data,
+				  unsigned long long block,
+				  int count, const void *bufv)
 {
 	ssize_t		size;
 	ext2_loff_t	location;
@@ -294,6 +378,130 @@ error_out:
 	return retval;
 }
 
+static errcode_t raw_write_blk(io_channel channel,
+			       struct unix_private_data *data,
+			       unsigned long long block,
+			       int count, const void *bufv)
+{
+	unsigned long long start = unix_usec();
+	errcode_t	retval;
+
+	retval = do_raw_write_blk(channel, data, block, count, bufv);
+	data->io_stats.writes++;
+	account_request(data->io_stats.write_latency, start);
+	return retval;
+}
+
+
+/*
+ * Transfer a run of consecutive blocks to or from several buffers
+ * with a single readv/writev.  Returns EXT2_ET_UNIMPLEMENTED if the
+ * request can't be done that way (no readv/writev, or buffers which
+ * don't meet the O_DIRECT alignment rules); in that case, and if the
+ * system call fails or comes up short, nothing is reported to the
+ * read_error/write_error handlers, so the caller can retry the
+ * blocks with raw_read_blk()/raw_write_blk().
+ */
+static errcode_t raw_rw_vec(io_channel channel,
+			    struct unix_private_data *data,
+			    unsigned long long block,
+			    const struct io_blk_vec *vec, int nr_vec,
+			    int write)
+{
+#ifdef HAVE_SYS_UIO_H
+	struct iovec	iov[MAX_IOV];
+	ext2_loff_t	location;
+	unsigned long long start;
+	ssize_t		size, actual;
+	int		i, n;
+
+	while (nr_vec > 0) {
+		n = (nr_vec > MAX_IOV) ? MAX_IOV : nr_vec;
+		size = 0;
+		for (i = 0; i < n; i++) {
+			if (vec[i].count <= 0)
+				return EXT2_ET_INVALID_ARGUMENT;
+			iov[i].iov_base = vec[i].buf;
+			iov[i].iov_len = (size_t) vec[i].count *
+				channel->block_size;
+			if (channel->align &&
+			    !(IS_ALIGNED(iov[i].iov_base, channel->align) &&
+			      IS_ALIGNED(iov[i].iov_len, channel->align)))
+				return EXT2_ET_UNIMPLEMENTED;
+			size += iov[i].iov_len;
+		}
+
+		location = ((ext2_loff_t) block * channel->block_size) +
+			data->offset;
+		if (ext2fs_llseek(data->dev, location, SEEK_SET) != location)
+			return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+		start = unix_usec();
+		if (write) {
+			data->io_stats.bytes_written += size;
+			data->io_stats.writes++;
+			actual = writev(data->dev, iov, n);
+			account_request(data->io_stats.write_latency, start);
+			if (actual != size)
+				return EXT2_ET_SHORT_WRITE;
+		} else {
+			data->io_stats.bytes_read += size;
+			data->io_stats.reads++;
+			actual = readv(data->dev, iov, n);
+			account_request(data->io_stats.read_latency, start);
+			if (actual != size)
+				return EXT2_ET_SHORT_READ;
+		}
+		block += size / channel->block_size;
+		vec += n;
+		nr_vec -= n;
+	}
+	return 0;
+#else
+	return EXT2_ET_UNIMPLEMENTED;
+#endif
+}
+
+static errcode_t raw_read_vec(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long long block,
+			      struct io_blk_vec *vec, int nr_vec)
+{
+	errcode_t	retval;
+	int		i;
+
+	if (raw_rw_vec(channel, data, block, vec, nr_vec, 0) == 0)
+		return 0;
+
+	for (i = 0; i < nr_vec; i++) {
+		retval = raw_read_blk(channel, data, block, vec[i].count,
+				      vec[i].buf);
+		if (retval)
+			return retval;
+		block += vec[i].count;
+	}
+	return 0;
+}
+
+static errcode_t raw_write_vec(io_channel channel,
+			       struct unix_private_data *data,
+			       unsigned long long block,
+			       const struct io_blk_vec *vec, int nr_vec)
+{
+	errcode_t	retval, retval2 = 0;
+	int		i;
+
+	if (raw_rw_vec(channel, data, block, vec, nr_vec, 1) == 0)
+		return 0;
+
+	for (i = 0; i < nr_vec; i++) {
+		retval = raw_write_blk(channel, data, block, vec[i].count,
+				       vec[i].buf);
+		if (retval)
+			retval2 = retval;
+		block += vec[i].count;
+	}
+	return retval2;
+}
 
 /*
  * Here we implement the cache functions
@@ -305,20 +513,43 @@ static errcode_t alloc_cache(io_channel channel,
 {
 	errcode_t		retval;
 	struct unix_cache	*cache;
-	int			i;
+	unsigned long long	blocks;
+	unsigned int		i, sets, entries;
+	size_t			size;
+
+	sets = CACHE_DEFAULT_SETS;
+	if (data->cache_bytes) {
+		blocks = data->cache_bytes / channel->block_size;
+		for (sets = 1; sets < CACHE_MAX_SETS; sets <<= 1)
+			if ((unsigned long long) sets * 2 * CACHE_WAYS > blocks)
+				break;
+	}
+	entries = sets * CACHE_WAYS;
 
 	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
-		retval = io_channel_alloc_buf(channel, 0, &cache->buf);
-		if (retval)
-			return retval;
-	}
+	data->cache_sets = 0;
+	retval = ext2fs_get_array(entries, sizeof(struct unix_cache),
+				  &data->cache);
+	if (retval)
+		return retval;
+	memset(data->cache, 0, entries * sizeof(struct unix_cache));
+	/* Too big for io_channel_alloc_buf(), which uses an int */
+	size = (size_t) entries * channel->block_size;
+	if (channel->align)
+		retval = ext2fs_get_memalign(size, channel->align,
+					     &data->cache_buf);
+	else
+		retval = ext2fs_get_mem(size, &data->cache_buf);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(entries, sizeof(struct unix_cache *),
+				  &data->flush_list);
+	if (retval)
+		return retval;
+	for (i=0, cache = data->cache; i < entries; i++, cache++)
+		cache->buf = data->cache_buf + i * channel->block_size;
+	data->cache_sets = sets;
+
 	if (channel->align) {
 		if (data->bounce)
 			ext2fs_free_mem(&data->bounce);
@@ -330,23 +561,34 @@ static errcode_t alloc_cache(io_channel channel,
 /* Free the cache buffers */
 static void free_cache(struct unix_private_data *data)
 {
-	struct unix_cache	*cache;
-	int			i;
-
 	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
-	}
+	data->cache_sets = 0;
+	if (data->cache)
+		ext2fs_free_mem(&data->cache);
+	if (data->cache_buf)
+		ext2fs_free_mem(&data->cache_buf);
+	if (data->flush_list)
+		ext2fs_free_mem(&data->flush_list);
 	if (data->bounce)
 		ext2fs_free_mem(&data->bounce);
 }
 
 #ifndef NO_IO_CACHE
+/*
+ * Return the first entry of the set which block maps to.  A
+ * multiplicative hash is used so that blocks at a power-of-two
+ * stride, such as the start of each block group, don't all land in
+ * the same set.
+ */
+static struct unix_cache *cache_set(struct unix_private_data *data,
+				    unsigned long long block)
+{
+	unsigned long long hash = block * 0x9E3779B97F4A7C15ULL;
+
+	return data->cache +
+		((hash >> 32) & (data->cache_sets - 1)) * CACHE_WAYS;
+}
+
 /*
  * Try to find a block in the cache.  If the block is not found, and
  * eldest is a non-zero pointer, then fill in eldest with the cache
@@ -360,7 +602,8 @@ static struct unix_cache *find_cached_block(struct unix_private_data *data,
 	int			i;
 
 	unused_cache = oldest_cache = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
+	cache = cache_set(data, block);
+	for (i=0; i < CACHE_WAYS; i++, cache++) {
 		if (!cache->in_use) {
 			if (!unused_cache)
 				unused_cache = cache;
@@ -394,20 +637,74 @@ static void reuse_cache(io_channel channel, struct unix_private_data *data,
 	cache->access_time = ++data->access_time;
 }
 
+static int cache_block_cmp(const void *a, const void *b)
+{
+	const struct unix_cache *ca = *(const struct unix_cache * const *) a;
+	const struct unix_cache *cb = *(const struct unix_cache * const *) b;
+
+	if (ca->block < cb->block)
+		return -1;
+	return (ca->block > cb->block);
+}
+
 /*
- * Flush all of the blocks in the cache
+ * Write out a run of dirty cache entries for consecutive blocks.  The
+ * whole run is written with a single writev; if that fails, fall back
+ * to writing the blocks one at a time, so that the channel's
+ * write_error handler sees the same single-block requests it would
+ * have without the batching.
+ */
+static errcode_t write_cached_run(io_channel channel,
+				  struct unix_private_data *data,
+				  struct unix_cache **run, int count)
+{
+	struct io_blk_vec vec[FLUSH_BATCH_SIZE];
+	errcode_t	retval, retval2;
+	int		i;
+
+	if (count > 1) {
+		for (i = 0; i < count; i++) {
+			vec[i].buf = run[i]->buf;
+			vec[i].count = 1;
+		}
+		if (raw_rw_vec(channel, data, run[0]->block,
+			       vec, count, 1) == 0) {
+			for (i = 0; i < count; i++)
+				run[i]->dirty = 0;
+			return 0;
+		}
+	}
+
+	retval2 = 0;
+	for (i = 0; i < count; i++) {
+		retval = raw_write_blk(channel, data, run[i]->block, 1,
+				       run[i]->buf);
+		if (retval)
+			retval2 = retval;
+		else
+			run[i]->dirty = 0;
+	}
+	return retval2;
+}
+
+/*
+ * Flush all of the blocks in the cache.  The dirty blocks are sorted
+ * so that they go out in disk order, and runs of consecutive blocks
+ * are merged into larger writes.
  */
 static errcode_t flush_cached_blocks(io_channel channel,
 				     struct unix_private_data *data,
 				     int invalidate)
 
 {
-	struct unix_cache	*cache;
+	struct unix_cache	*cache, **list = data->flush_list;
 	errcode_t		retval, retval2;
-	int			i;
+	unsigned int		i, j, n, entries;
 
 	retval2 = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
+	n = 0;
+	entries = data->cache_sets * CACHE_WAYS;
+	for (i=0, cache = data->cache; i < entries; i++, cache++) {
 		if (!cache->in_use)
 			continue;
 
@@ -417,8 +714,61 @@ static errcode_t flush_cached_blocks(io_channel channel,
 		if (!cache->dirty)
 			continue;
 
-		retval = raw_write_blk(channel, data,
-				       cache->block, 1, cache->buf);
+		list[n++] = cache;
+	}
+	if (n > 1)
+		qsort(list, n, sizeof(struct unix_cache *), cache_block_cmp);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && j - i < FLUSH_BATCH_SIZE; j++)
+			if (list[j]->block != list[j-1]->block + 1)
+				break;
+		retval = write_cached_run(channel, data, list + i, j - i);
+		if (retval)
+			retval2 = retval;
+	}
+	return retval2;
+}
+
+/*
+ * Prepare the cache for an uncached transfer of the given blocks.
+ * Before a read, any dirty cached copies are written out; before a
+ * write (discard != 0), the cached copies are simply dropped, since
+ * they are about to be overwritten.  Blocks outside of the range are
+ * left alone.
+ */
+static errcode_t flush_cached_range(io_channel channel,
+				    struct unix_private_data *data,
+				    unsigned long long block,
+				    unsigned long long count,
+				    int discard)
+{
+	struct unix_cache	*cache;
+	errcode_t		retval, retval2 = 0;
+	unsigned long long	i, entries;
+
+	entries = data->cache_sets * CACHE_WAYS;
+	for (i = 0; i < count && i < entries; i++) {
+		if (count > entries) {
+			/* Cheaper to look at every cache entry */
+			cache = data->cache + i;
+			if (!cache->in_use || cache->block < block ||
+			    cache->block >= block + count)
+				continue;
+		} else {
+			cache = find_cached_block(data, block + i, 0);
+			if (!cache)
+				continue;
+		}
+		if (discard) {
+			cache->in_use = 0;
+			cache->dirty = 0;
+			continue;
+		}
+		if (!cache->dirty)
+			continue;
+		retval = raw_write_blk(channel, data, cache->block, 1,
+				       cache->buf);
 		if (retval)
 			retval2 = retval;
 		else
@@ -466,6 +816,47 @@ int ext2fs_fstat(int fd, ext2fs_struct_stat *buf)
 #endif
 }
 
+#if defined(__linux__) && defined(major)
+static int read_sysfs_num(const char *path, unsigned long long *ret)
+{
+	FILE	*f;
+	int	n;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	n = fscanf(f, "%llu", ret);
+	fclose(f);
+	return n == 1 ? 0 : -1;
+}
+#endif
+
+/*
+ * Find the unit in which the device discards, so that discards can be
+ * trimmed to whole units; a partition has no queue directory of its
+ * own, so look in the disk's.
+ */
+static void get_discard_limits(struct unix_private_data *data,
+			       ext2fs_struct_stat *st)
+{
+#if defined(__linux__) && defined(major)
+	char		path[80];
+	unsigned int	maj = major(st->st_rdev), min = minor(st->st_rdev);
+
+	sprintf(path, "/sys/dev/block/%u:%u/queue/discard_granularity",
+		maj, min);
+	if (read_sysfs_num(path, &data->discard_granularity)) {
+		sprintf(path, "/sys/dev/block/%u:%u/../queue/"
+			"discard_granularity", maj, min);
+		if (read_sysfs_num(path, &data->discard_granularity))
+			data->discard_granularity = 0;
+	}
+	sprintf(path, "/sys/dev/block/%u:%u/discard_alignment", maj, min);
+	if (read_sysfs_num(path, &data->discard_alignment))
+		data->discard_alignment = 0;
+#endif
+}
+
 static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 {
 	io_channel	io = NULL;
@@ -503,7 +894,7 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
-	data->io_stats.num_fields = 2;
+	data->io_stats.num_fields = IO_STATS_NUM_FIELDS;
 	data->dev = -1;
 
 	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
@@ -542,9 +933,10 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 	 * zero.
 	 */
 	if (ext2fs_stat(io->name, &st) == 0) {
-		if (S_ISBLK(st.st_mode))
+		if (S_ISBLK(st.st_mode)) {
 			io->flags |= CHANNEL_FLAGS_BLOCK_DEVICE;
-		else
+			get_discard_limits(data, &st);
+		} else
 			io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
 	}
 
@@ -692,7 +1084,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			       int count, void *buf)
 {
 	struct unix_private_data *data;
-	struct unix_cache *cache, *reuse[READ_DIRECT_SIZE];
+	struct unix_cache *cache, *reuse;
 	errcode_t	retval;
 	char		*cp;
 	int		i, j;
@@ -708,19 +1100,26 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 	 * If we're doing an odd-sized read or a very large read,
 	 * flush out the cache and then do a direct read.
 	 */
-	if (count < 0 || count > WRITE_DIRECT_SIZE) {
+	if (count < 0) {
 		if ((retval = flush_cached_blocks(channel, data, 0)))
 			return retval;
 		return raw_read_blk(channel, data, block, count, buf);
 	}
+	if (count > WRITE_DIRECT_SIZE) {
+		if ((retval = flush_cached_range(channel, data, block,
+						 count, 0)))
+			return retval;
+		return raw_read_blk(channel, data, block, count, buf);
+	}
 
 	cp = buf;
 	while (count > 0) {
 		/* If it's in the cache, use it! */
-		if ((cache = find_cached_block(data, block, &reuse[0]))) {
+		if ((cache = find_cached_block(data, block, &reuse))) {
 #ifdef DEBUG
 			printf("Using cached block %lu\n", block);
 #endif
+			data->io_stats.cache_hits++;
 			memcpy(cp, cache->buf, channel->block_size);
 			count--;
 			block++;
@@ -732,7 +1131,8 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 			 * Special case where we read directly into the
 			 * cache buffer; important in the O_DIRECT case
 			 */
-			cache = reuse[0];
+			data->io_stats.cache_misses++;
+			cache = reuse;
 			reuse_cache(channel, data, cache, block);
 			if ((retval = raw_read_blk(channel, data, block, 1,
 						   cache->buf))) {
@@ -748,18 +1148,23 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 		 * single read request
 		 */
 		for (i=1; i < count; i++)
-			if (find_cached_block(data, block+i, &reuse[i]))
+			if (find_cached_block(data, block+i, 0))
 				break;
+		data->io_stats.cache_misses += i;
 #ifdef DEBUG
 		printf("Reading %d blocks starting at %lu\n", i, block);
 #endif
 		if ((retval = raw_read_blk(channel, data, block, i, cp)))
 			return retval;
 
-		/* Save the results in the cache */
+		/*
+		 * Save the results in the cache.  Look up the entry to
+		 * replace only now, since earlier blocks of this read
+		 * may have taken the slot which was oldest before.
+		 */
 		for (j=0; j < i; j++) {
 			count--;
-			cache = reuse[j];
+			find_cached_block(data, block, &cache);
 			reuse_cache(channel, data, cache, block++);
 			memcpy(cache->buf, cp, channel->block_size);
 			cp += channel->block_size;
@@ -795,11 +1200,15 @@ static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
 	 * If we're doing an odd-sized write or a very large write,
 	 * flush out the cache completely and then do a direct write.
 	 */
-	if (count < 0 || count > WRITE_DIRECT_SIZE) {
+	if (count < 0) {
 		if ((retval = flush_cached_blocks(channel, data, 1)))
 			return retval;
 		return raw_write_blk(channel, data, block, count, buf);
 	}
+	if (count > WRITE_DIRECT_SIZE) {
+		flush_cached_range(channel, data, block, count, 1);
+		return raw_write_blk(channel, data, block, count, buf);
+	}
 
 	/*
 	 * For a moderate-sized multi-block write, first force a write
@@ -833,6 +1242,54 @@ static errcode_t unix_write_blk(io_channel channel, unsigned long block,
 	return unix_write_blk64(channel, block, count, buf);
 }
 
+static errcode_t unix_read_blk_vec(io_channel channel,
+				   unsigned long long block,
+				   struct io_blk_vec *vec, int nr_vec)
+{
+	struct unix_private_data *data;
+	unsigned long long count = 0;
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr_vec; i++) {
+		if (vec[i].count <= 0)
+			return EXT2_ET_INVALID_ARGUMENT;
+		count += vec[i].count;
+	}
+#ifndef NO_IO_CACHE
+	if ((retval = flush_cached_range(channel, data, block, count, 0)))
+		return retval;
+#endif
+	return raw_read_vec(channel, data, block, vec, nr_vec);
+}
+
+static errcode_t unix_write_blk_vec(io_channel channel,
+				    unsigned long long block,
+				    const struct io_blk_vec *vec, int nr_vec)
+{
+	struct unix_private_data *data;
+	unsigned long long count = 0;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < nr_vec; i++) {
+		if (vec[i].count <= 0)
+			return EXT2_ET_INVALID_ARGUMENT;
+		count += vec[i].count;
+	}
+#ifndef NO_IO_CACHE
+	flush_cached_range(channel, data, block, count, 1);
+#endif
+	return raw_write_vec(channel, data, block, vec, nr_vec);
+}
+
 static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 				 int size, const void *buf)
 {
@@ -885,6 +1342,7 @@ static errcode_t unix_flush(io_channel channel)
 	retval = flush_cached_blocks(channel, data, 0);
 #endif
 	fsync(data->dev);
+	data->io_stats.flushes++;
 	return retval;
 }
 
@@ -893,6 +1351,7 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 {
 	struct unix_private_data *data;
 	unsigned long long tmp;
+	errcode_t retval;
 	char *end;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
@@ -911,9 +1370,68 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 			return EXT2_ET_INVALID_ARGUMENT;
 		return 0;
 	}
+	if (!strcmp(option, "cache_size")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		tmp = strtoull(arg, &end, 0);
+		switch (*end) {
+		case 'g': case 'G':
+			tmp <<= 10;
+			/* fallthrough */
+		case 'm': case 'M':
+			tmp <<= 10;
+			/* fallthrough */
+		case 'k': case 'K':
+			tmp <<= 10;
+			end++;
+		}
+		if (*end)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+#ifndef NO_IO_CACHE
+		if ((retval = flush_cached_blocks(channel, data, 0)))
+			return retval;
+#endif
+		data->cache_bytes = tmp;
+		free_cache(data);
+		retval = alloc_cache(channel, data);
+		if (retval) {
+			/* Fall back to the default size */
+			data->cache_bytes = 0;
+			free_cache(data);
+			(void) alloc_cache(channel, data);
+		}
+		return retval;
+	}
 	return EXT2_ET_INVALID_ARGUMENT;
 }
 
+/*
+ * Ask the kernel to start reading the blocks into the page cache, so
+ * that the read_blk call which follows doesn't have to wait for them.
+ */
+static errcode_t unix_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return posix_fadvise(data->dev,
+			     (ext2_loff_t)block * channel->block_size +
+			     data->offset,
+			     (ext2_loff_t)count * channel->block_size,
+			     POSIX_FADV_WILLNEED);
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
 #if defined(__linux__) && !defined(BLKDISCARD)
 #define BLKDISCARD		_IO(0x12,119)
 #endif
@@ -922,18 +1440,36 @@ static errcode_t unix_discard(io_channel channel, unsigned long long block,
 			      unsigned long long count)
 {
 	struct unix_private_data *data;
+	unsigned long long start, end, unit, skew;
 	int		ret;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	start = block * channel->block_size + data->offset;
+	end = start + count * channel->block_size;
+
 	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE) {
 #ifdef BLKDISCARD
 		__uint64_t range[2];
 
-		range[0] = (__uint64_t)(block) * channel->block_size;
-		range[1] = (__uint64_t)(count) * channel->block_size;
+		/*
+		 * The device ignores whatever doesn't cover a whole
+		 * discard unit, so don't send it.
+		 */
+		unit = data->discard_granularity;
+		if (unit > (unsigned) channel->block_size) {
+			skew = data->discard_alignment % unit;
+			start = ((start + unit - 1 - skew) / unit) * unit + skew;
+			if (end < skew)
+				return 0;
+			end = ((end - skew) / unit) * unit + skew;
+			if (end <= start)
+				return 0;
+		}
+		range[0] = start;
+		range[1] = end - start;
 
 		ret = ioctl(data->dev, BLKDISCARD, &range);
 #else
@@ -947,8 +1483,7 @@ static errcode_t unix_discard(io_channel channel, unsigned long long block,
 		 */
 		ret = fallocate(data->dev,
 				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-				(off_t)(block) * channel->block_size,
-				(off_t)(count) * channel->block_size);
+				(off_t) start, (off_t) (end - start));
 #else
 		goto unimplemented;
 #endif
@@ -958,6 +1493,93 @@ static errcode_t unix_discard(io_channel channel, unsigned long long block,
 			goto unimplemented;
 		return errno;
 	}
+	data->io_stats.discards++;
+	data->io_stats.bytes_discarded += end - start;
+	return 0;
+unimplemented:
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+#if defined(__linux__) && !defined(BLKZEROOUT)
+#define BLKZEROOUT		_IO(0x12,127)
+#endif
+
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE	0x10
+#endif
+
+/*
+ * Zero a range of blocks without sending the zeroes over the bus: on
+ * a block device the kernel turns BLKZEROOUT into WRITE ZEROES or
+ * WRITE SAME commands where the device supports them, and a regular
+ * file just gets its blocks converted to unwritten extents.  Returns
+ * EXT2_ET_UNIMPLEMENTED if neither is possible, in which case the
+ * caller is expected to write the zeroes itself.
+ */
+static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
+			      unsigned long long count)
+{
+	struct unix_private_data *data;
+	ext2_loff_t	start, len;
+	int		ret;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!(data->flags & IO_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+	if (count == 0)
+		return 0;
+	start = (ext2_loff_t) block * channel->block_size + data->offset;
+	len = (ext2_loff_t) count * channel->block_size;
+
+#ifndef NO_IO_CACHE
+	/* Cached copies of these blocks, dirty or not, are now stale */
+	flush_cached_range(channel, data, block, count, 1);
+#endif
+
+	if (channel->flags & CHANNEL_FLAGS_BLOCK_DEVICE) {
+#ifdef BLKZEROOUT
+		__uint64_t range[2];
+
+		range[0] = start;
+		range[1] = len;
+		ret = ioctl(data->dev, BLKZEROOUT, &range);
+#else
+		goto unimplemented;
+#endif
+	} else {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+		struct stat	st;
+
+		if (fstat(data->dev, &st) < 0)
+			return errno;
+		/*
+		 * Anything past the end of the file reads back as
+		 * zeroes already; just extend the file to cover it.
+		 */
+		if (st.st_size < start + len) {
+			if (ftruncate(data->dev, start + len) < 0)
+				return errno;
+			if (st.st_size <= start)
+				return 0;
+			len = st.st_size - start;
+		}
+		ret = fallocate(data->dev, FALLOC_FL_ZERO_RANGE, start, len);
+		if (ret < 0 && errno == EOPNOTSUPP)
+			ret = fallocate(data->dev, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE, start, len);
+#else
+		goto unimplemented;
+#endif
+	}
+	if (ret < 0) {
+		if (errno == EOPNOTSUPP || errno == ENOTTY ||
+		    errno == EINVAL)
+			goto unimplemented;
+		return errno;
+	}
 	return 0;
 unimplemented:
 	return EXT2_ET_UNIMPLEMENTED;
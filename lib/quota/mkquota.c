@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 
@@ -106,7 +107,24 @@ errcode_t quota_remove_inode(ext2_filsys fs, int qtype)
 static void write_dquots(dict_t *dict, struct quota_handle *qh)
 {
 	dnode_t		*n;
-	struct dquot	*dq;
+	struct dquot	*dq, **dquots = 0;
+	int		count = 0;
+
+	if (qh->qh_ops->commit_dquots &&
+	    ext2fs_get_array(dict_count(dict), sizeof(struct dquot *),
+			     &dquots) == 0) {
+		for (n = dict_first(dict); n; n = dict_next(dict, n)) {
+			dq = dnode_get(n);
+			if (dq) {
+				dq->dq_h = qh;
+				update_grace_times(dq);
+				dquots[count++] = dq;
+			}
+		}
+		qh->qh_ops->commit_dquots(qh, dquots, count);
+		ext2fs_free_mem(&dquots);
+		return;
+	}
 
 	for (n = dict_first(dict); n; n = dict_next(dict, n)) {
 		dq = dnode_get(n);
@@ -188,7 +206,7 @@ static int dict_uint_cmp(const void *a, const void *b)
 	c = VOIDPTR_TO_UINT(a);
 	d = VOIDPTR_TO_UINT(b);
 
-	return c - d;
+	return (c > d) - (c < d);
 }
 
 static inline qid_t get_qid(struct ext2_inode *inode, int qtype)
@@ -255,6 +273,7 @@ void quota_release_context(quota_ctx_t *qctx)
 	for (i = 0; i < MAXQUOTAS; i++) {
 		dict = ctx->quota_dict[i];
 		ctx->quota_dict[i] = 0;
+		ctx->last_dq[i] = 0;
 		if (dict) {
 			dict_free_nodes(dict);
 			free(dict);
@@ -284,6 +303,22 @@ static struct dquot *get_dq(dict_t *dict, __u32 key)
 	return dq;
 }
 
+/*
+ * Inodes are visited in order of inode number, and neighbouring inodes
+ * usually belong to the same user and group, so remembering the last
+ * dquot found saves most of the dictionary lookups.
+ */
+static struct dquot *get_ctx_dq(quota_ctx_t qctx, int qtype, __u32 key)
+{
+	struct dquot	*dq = qctx->last_dq[qtype];
+
+	if (dq && dq->dq_id == key)
+		return dq;
+	dq = get_dq(qctx->quota_dict[qtype], key);
+	qctx->last_dq[qtype] = dq;
+	return dq;
+}
+
 
 /*
  * Called to update the blocks used by a particular inode
@@ -304,7 +339,7 @@ void quota_data_add(quota_ctx_t qctx, struct ext2_inode *inode, ext2_ino_t ino,
 	for (i = 0; i < MAXQUOTAS; i++) {
 		dict = qctx->quota_dict[i];
 		if (dict) {
-			dq = get_dq(dict, get_qid(inode, i));
+			dq = get_ctx_dq(qctx, i, get_qid(inode, i));
 			if (dq)
 				dq->dq_dqb.dqb_curspace += space;
 		}
@@ -330,7 +365,7 @@ void quota_data_sub(quota_ctx_t qctx, struct ext2_inode *inode, ext2_ino_t ino,
 	for (i = 0; i < MAXQUOTAS; i++) {
 		dict = qctx->quota_dict[i];
 		if (dict) {
-			dq = get_dq(dict, get_qid(inode, i));
+			dq = get_ctx_dq(qctx, i, get_qid(inode, i));
 			dq->dq_dqb.dqb_curspace -= space;
 		}
 	}
@@ -355,7 +390,7 @@ void quota_data_inodes(quota_ctx_t qctx, struct ext2_inode *inode,
 	for (i = 0; i < MAXQUOTAS; i++) {
 		dict = qctx->quota_dict[i];
 		if (dict) {
-			dq = get_dq(dict, get_qid(inode, i));
+			dq = get_ctx_dq(qctx, i, get_qid(inode, i));
 			dq->dq_dqb.dqb_curinodes += adjust;
 		}
 	}
@@ -374,7 +409,8 @@ errcode_t quota_compute_usage(quota_ctx_t qctx)
 		return 0;
 
 	fs = qctx->fs;
-	ret = ext2fs_open_inode_scan(fs, 0, &scan);
+	/* Read a whole group's inode table at a time */
+	ret = ext2fs_open_inode_scan(fs, fs->inode_blocks_per_group, &scan);
 	if (ret) {
 		log_err("while opening inode scan. ret=%ld", ret);
 		return ret;
@@ -519,21 +555,98 @@ out:
 	return err;
 }
 
+/*
+ * What quota_compare_and_update() keeps of each dquot in the quota file
+ */
+struct disk_dquot {
+	qid_t		id;
+	ext2_loff_t	off;
+	qsize_t		curspace, curinodes;
+	qsize_t		ihardlimit, isoftlimit, bhardlimit, bsoftlimit;
+};
+
+struct disk_dquot_list {
+	struct disk_dquot	*list;
+	size_t			count, size;
+	int			error;
+};
+
+static int collect_dquots_callback(struct dquot *dquot, void *cb_data)
+{
+	struct disk_dquot_list *dl = cb_data;
+	struct disk_dquot *d;
+	size_t size;
+
+	if (dl->count == dl->size) {
+		size = dl->size ? dl->size * 2 : 256;
+		if (ext2fs_resize_mem(dl->size * sizeof(struct disk_dquot),
+				      size * sizeof(struct disk_dquot),
+				      &dl->list)) {
+			dl->error = 1;
+			return -1;
+		}
+		dl->size = size;
+	}
+	d = dl->list + dl->count++;
+	d->id = dquot->dq_id;
+	d->off = dquot->dq_dqb.u.v2_mdqb.dqb_off;
+	d->curspace = dquot->dq_dqb.dqb_curspace;
+	d->curinodes = dquot->dq_dqb.dqb_curinodes;
+	d->ihardlimit = dquot->dq_dqb.dqb_ihardlimit;
+	d->isoftlimit = dquot->dq_dqb.dqb_isoftlimit;
+	d->bhardlimit = dquot->dq_dqb.dqb_bhardlimit;
+	d->bsoftlimit = dquot->dq_dqb.dqb_bsoftlimit;
+	return 0;
+}
+
+static int disk_dquot_cmp(const void *a, const void *b)
+{
+	qid_t	c = ((const struct disk_dquot *) a)->id;
+	qid_t	d = ((const struct disk_dquot *) b)->id;
+
+	return (c > d) - (c < d);
+}
+
+static void mark_inconsistent(struct dquot *dq, qsize_t space,
+			      qsize_t inodes, int *usage_inconsistent)
+{
+	fprintf(stderr, "[QUOTA WARNING] Usage inconsistent for ID %d:"
+		"actual (%llu, %llu) != expected (%llu, %llu)\n",
+		dq->dq_id, (long long)dq->dq_dqb.dqb_curspace,
+		(long long)dq->dq_dqb.dqb_curinodes,
+		(long long)space, (long long)inodes);
+	dq->dq_flags |= DQF_CHANGED;
+	*usage_inconsistent = 1;
+}
+
 /*
  * Compares the measured quota in qctx->quota_dict with that in the quota inode
  * on disk and updates the limits in qctx->quota_dict. 'usage_inconsistent' is
  * set to 1 if the supplied and on-disk quota usage values are not identical.
+ *
+ * The dquots in the quota file are read into a list sorted by id, which
+ * is then merged with the dictionary, itself in id order, rather than
+ * looking each of them up.  The dquots which differ are marked, so that
+ * quota_update_inode() can rewrite just those.
  */
 errcode_t quota_compare_and_update(quota_ctx_t qctx, int qtype,
 				   int *usage_inconsistent)
 {
 	ext2_filsys fs = qctx->fs;
 	struct quota_handle qh;
-	struct scan_dquots_data scan_data;
+	struct disk_dquot_list dl;
+	struct disk_dquot *d;
+	struct dquot *dq;
+	dict_t *dict = qctx->quota_dict[qtype];
+	dnode_t *n;
 	ext2_ino_t qf_ino;
+	ext2_loff_t max_off;
 	errcode_t err = 0;
+	size_t i;
+	int in_place = 1;
 
-	if (!qctx->quota_dict[qtype])
+	qctx->update_in_place[qtype] = 0;
+	if (!dict)
 		goto out;
 
 	qf_ino = qtype == USRQUOTA ? fs->super->s_usr_quota_inum :
@@ -544,17 +657,122 @@ errcode_t quota_compare_and_update(quota_ctx_t qctx, int qtype,
 		goto out;
 	}
 
-	scan_data.quota_dict = qctx->quota_dict[qtype];
-	scan_data.update_limits = 1;
-	scan_data.update_usage = 0;
-	scan_data.usage_is_inconsistent = 0;
-	err = qh.qh_ops->scan_dquots(&qh, scan_dquots_callback, &scan_data);
+	memset(&dl, 0, sizeof(dl));
+	err = qh.qh_ops->scan_dquots(&qh, collect_dquots_callback, &dl);
+	ext2fs_file_close(qh.qh_qf.e2_file);
+	if (!err && dl.error)
+		err = EXT2_ET_NO_MEMORY;
 	if (err) {
 		log_err("Error scanning dquots");
-		goto out;
+		goto out_free;
 	}
-	*usage_inconsistent = scan_data.usage_is_inconsistent;
+	qsort(dl.list, dl.count, sizeof(struct disk_dquot), disk_dquot_cmp);
+	max_off = (ext2_loff_t) qh.qh_info.u.v2_mdqi.dqi_qtree.dqi_blocks <<
+		QT_BLKSIZE_BITS;
+
+	*usage_inconsistent = 0;
+	n = dict_first(dict);
+	for (i = 0; n || i < dl.count; ) {
+		dq = n ? dnode_get(n) : NULL;
+		d = i < dl.count ? dl.list + i : NULL;
+		if (d && (d->off >= max_off || (i && d->id == d[-1].id))) {
+			/* A damaged file; don't try to patch it */
+			in_place = 0;
+			if (i && d->id == d[-1].id) {
+				i++;
+				continue;
+			}
+		}
+
+		if (!d || (dq && dq->dq_id < d->id)) {
+			/* Only in memory */
+			dq->dq_flags = 0;
+			if (dq->dq_dqb.dqb_curspace ||
+			    dq->dq_dqb.dqb_curinodes)
+				mark_inconsistent(dq, 0, 0,
+						  usage_inconsistent);
+			n = dict_next(dict, n);
+			continue;
+		}
+		if (!dq || d->id < dq->dq_id) {
+			/* Only in the file: nothing uses this id now */
+			dq = get_dq(dict, d->id);
+			if (!dq) {
+				err = EXT2_ET_NO_MEMORY;
+				goto out_free;
+			}
+		} else
+			n = dict_next(dict, n);
+		i++;
+
+		dq->dq_flags = 0;
+		dq->dq_dqb.u.v2_mdqb.dqb_off = d->off;
+		if (dq->dq_dqb.dqb_curspace != d->curspace ||
+		    dq->dq_dqb.dqb_curinodes != d->curinodes)
+			mark_inconsistent(dq, d->curspace, d->curinodes,
+					  usage_inconsistent);
+		dq->dq_dqb.dqb_ihardlimit = d->ihardlimit;
+		dq->dq_dqb.dqb_isoftlimit = d->isoftlimit;
+		dq->dq_dqb.dqb_bhardlimit = d->bhardlimit;
+		dq->dq_dqb.dqb_bsoftlimit = d->bsoftlimit;
+	}
+	qctx->update_in_place[qtype] = in_place;
 
+out_free:
+	ext2fs_free_mem(&dl.list);
 out:
 	return err;
 }
+
+/*
+ * Writes the dquots which quota_compare_and_update() found to differ
+ * back to the quota file in place, instead of writing a whole new
+ * file.  If the file didn't look sane enough for that, an error is
+ * returned, and quota_write_inode() should be used instead.
+ */
+errcode_t quota_update_inode(quota_ctx_t qctx, int qtype)
+{
+	ext2_filsys fs = qctx->fs;
+	struct quota_handle qh;
+	struct dquot *dq;
+	dict_t *dict = qctx->quota_dict[qtype];
+	dnode_t *n;
+	ext2_ino_t qf_ino;
+	errcode_t err;
+
+	qf_ino = qtype == USRQUOTA ? fs->super->s_usr_quota_inum :
+				     fs->super->s_grp_quota_inum;
+	if (!dict || !qctx->update_in_place[qtype] ||
+	    qf_ino != (qtype == USRQUOTA ? EXT4_USR_QUOTA_INO :
+		       EXT4_GRP_QUOTA_INO))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	qctx->update_in_place[qtype] = 0;
+
+	err = quota_file_open(&qh, fs, qf_ino, qtype, -1, EXT2_FILE_WRITE);
+	if (err) {
+		log_err("Open quota file failed");
+		return err;
+	}
+
+	for (n = dict_first(dict); n; n = dict_next(dict, n)) {
+		dq = dnode_get(n);
+		if (!(dq->dq_flags & DQF_CHANGED))
+			continue;
+		dq->dq_h = &qh;
+		update_grace_times(dq);
+		qh.qh_ops->commit_dquot(dq);
+		dq->dq_flags &= ~DQF_CHANGED;
+	}
+
+	err = quota_file_close(&qh);
+	if (err) {
+		log_err("Cannot finish IO on quotafile: %s",
+			strerror(errno));
+		if (qh.qh_qf.e2_file)
+			ext2fs_file_close(qh.qh_qf.e2_file);
+		return err;
+	}
+	ext2fs_mark_bb_dirty(fs);
+	fs->flags &= ~EXT2_FLAG_SUPER_ONLY;
+	return 0;
+}
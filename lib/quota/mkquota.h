@@ -40,6 +40,8 @@ typedef struct quota_ctx *quota_ctx_t;
 struct quota_ctx {
 	ext2_filsys	fs;
 	dict_t		*quota_dict[MAXQUOTAS];
+	struct dquot	*last_dq[MAXQUOTAS];	/* most recently looked up */
+	int		update_in_place[MAXQUOTAS]; /* see quota_update_inode */
 };
 
 /* In mkquota.c */
@@ -60,5 +62,6 @@ int quota_file_exists(ext2_filsys fs, int qtype, int fmt);
 void quota_set_sb_inum(ext2_filsys fs, ext2_ino_t ino, int qtype);
 errcode_t quota_compare_and_update(quota_ctx_t qctx, int qtype,
 				   int *usage_inconsistent);
+errcode_t quota_update_inode(quota_ctx_t qctx, int qtype);
 
 #endif  /* __QUOTA_QUOTAIO_H__ */
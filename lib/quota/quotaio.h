@@ -104,6 +104,9 @@ struct dquot {
 	struct util_dqblk dq_dqb;	/* Parsed data of dquot */
 };
 
+/* Flags in dq_flags */
+#define DQF_CHANGED	0x0001	/* differs from the quota file */
+
 /* Structure of quotafile operations */
 struct quotafile_ops {
 	/* Check whether quotafile is in our format */
@@ -120,6 +123,9 @@ struct quotafile_ops {
 	struct dquot *(*read_dquot) (struct quota_handle *h, qid_t id);
 	/* Write given dquot to disk */
 	int (*commit_dquot) (struct dquot *dquot);
+	/* Write all dquots of a newly created quotafile */
+	int (*commit_dquots) (struct quota_handle *h, struct dquot **dquots,
+			      int count);
 	/* Scan quotafile and call callback on every structure */
 	int (*scan_dquots) (struct quota_handle *h,
 			    int (*process_dquot) (struct dquot *dquot,
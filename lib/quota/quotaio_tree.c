@@ -344,6 +344,118 @@ void qtree_write_dquot(struct dquot *dquot)
 	ext2fs_free_mem(&ddquot);
 }
 
+static int dquot_id_cmp(const void *a, const void *b)
+{
+	qid_t	c = (*(struct dquot **) a)->dq_id;
+	qid_t	d = (*(struct dquot **) b)->dq_id;
+
+	return (c > d) - (c < d);
+}
+
+/*
+ * Write the dquots of a newly created quota file.  Since every id is
+ * known up front, the tree can be laid out in memory and written with
+ * a single write, rather than walking and rewriting the tree blocks
+ * once per dquot: the tree blocks come first, in the order they are
+ * reached by ascending id, followed by the packed data blocks.
+ */
+int qtree_write_dquots(struct quota_handle *h, struct dquot **dquots,
+		       int count)
+{
+	struct qtree_mem_dqinfo *info = &h->qh_info.u.v2_mdqi.dqi_qtree;
+	struct qt_disk_dqdbheader *dh;
+	unsigned int per_blk = qtree_dqstr_in_blk(info);
+	unsigned int ntree = 0, first_data, nblocks, blk, slot;
+	unsigned int path[QT_TREEDEPTH];
+	unsigned int size;
+	u_int32_t *ref;
+	qid_t prev = 0;
+	char *buf;
+	int i, depth;
+
+	if (info->dqi_blocks != QT_TREEOFF + 1 || info->dqi_free_blk ||
+	    info->dqi_free_entry) {
+		/* Not an empty file; insert the dquots one by one */
+		for (i = 0; i < count; i++)
+			qtree_write_dquot(dquots[i]);
+		return 0;
+	}
+	if (!count)
+		return 0;
+
+	qsort(dquots, count, sizeof(struct dquot *), dquot_id_cmp);
+
+	/* Count the tree blocks below the root */
+	for (i = 0; i < count; i++) {
+		for (depth = 1; depth < QT_TREEDEPTH; depth++)
+			if (i == 0 || (dquots[i]->dq_id >>
+				       ((QT_TREEDEPTH - depth) * 8)) !=
+			    (prev >> ((QT_TREEDEPTH - depth) * 8)))
+				ntree++;
+		prev = dquots[i]->dq_id;
+	}
+	first_data = QT_TREEOFF + 1 + ntree;
+	nblocks = first_data + (count + per_blk - 1) / per_blk;
+	size = (nblocks - QT_TREEOFF) << QT_BLKSIZE_BITS;
+	if (ext2fs_get_memzero(size, &buf)) {
+		log_err("Failed to allocate quota tree");
+		return -ENOMEM;
+	}
+#define QT_BLK(b)	(buf + (((b) - QT_TREEOFF) << QT_BLKSIZE_BITS))
+
+	path[0] = QT_TREEOFF;
+	blk = QT_TREEOFF + 1;
+	for (i = 0; i < count; i++) {
+		struct dquot *dquot = dquots[i];
+
+		for (depth = 1; depth < QT_TREEDEPTH; depth++) {
+			if (i && (dquot->dq_id >>
+				  ((QT_TREEDEPTH - depth) * 8)) ==
+			    (prev >> ((QT_TREEDEPTH - depth) * 8)))
+				continue;
+			path[depth] = blk++;
+			ref = (u_int32_t *) QT_BLK(path[depth - 1]);
+			ref[get_index(dquot->dq_id, depth - 1)] =
+				ext2fs_cpu_to_le32(path[depth]);
+		}
+		prev = dquot->dq_id;
+
+		ref = (u_int32_t *) QT_BLK(path[QT_TREEDEPTH - 1]);
+		ref[get_index(dquot->dq_id, QT_TREEDEPTH - 1)] =
+			ext2fs_cpu_to_le32(first_data + i / per_blk);
+
+		dh = (struct qt_disk_dqdbheader *) QT_BLK(first_data +
+							  i / per_blk);
+		slot = i % per_blk;
+		dh->dqdh_entries = ext2fs_cpu_to_le16(slot + 1);
+		dquot->dq_h = h;
+		dquot->dq_dqb.u.v2_mdqb.dqb_off =
+			((ext2_loff_t) (first_data + i / per_blk) <<
+			 QT_BLKSIZE_BITS) +
+			sizeof(struct qt_disk_dqdbheader) +
+			slot * info->dqi_entry_size;
+		info->dqi_ops->mem2disk_dqblk((char *) (dh + 1) +
+					      slot * info->dqi_entry_size,
+					      dquot);
+	}
+#undef QT_BLK
+
+	/* A partly filled last block is the whole free entry list */
+	if (count % per_blk)
+		info->dqi_free_entry = nblocks - 1;
+	info->dqi_blocks = nblocks;
+	mark_quotafile_info_dirty(h);
+
+	i = 0;
+	if (h->e2fs_write(&h->qh_qf, QT_TREEOFF << QT_BLKSIZE_BITS, buf,
+			  size) != size) {
+		log_err("Cannot write quota tree: %s", strerror(errno));
+		i = -ENOSPC;
+	}
+	ext2fs_free_mem(&buf);
+	return i;
+}
+
 /* Free dquot entry in data block */
 static void free_dqentry(struct quota_handle *h, struct dquot *dquot, uint blk)
 {
@@ -23,6 +23,8 @@ static int v2_new_io(struct quota_handle *h);
 static int v2_write_info(struct quota_handle *h);
 static struct dquot *v2_read_dquot(struct quota_handle *h, qid_t id);
 static int v2_commit_dquot(struct dquot *dquot);
+static int v2_commit_dquots(struct quota_handle *h, struct dquot **dquots,
+			    int count);
 static int v2_scan_dquots(struct quota_handle *h,
 			  int (*process_dquot) (struct dquot *dquot,
 						void *data),
@@ -36,6 +38,7 @@ struct quotafile_ops quotafile_ops_2 = {
 	.write_info	= v2_write_info,
 	.read_dquot	= v2_read_dquot,
 	.commit_dquot	= v2_commit_dquot,
+	.commit_dquots	= v2_commit_dquots,
 	.scan_dquots	= v2_scan_dquots,
 	.report		= v2_report,
 };
@@ -264,6 +267,27 @@ static int v2_commit_dquot(struct dquot *dquot)
 	return 0;
 }
 
+/*
+ * Commit all the dquots of a new quotafile at once.  As in
+ * v2_commit_dquot(), dquots with nothing to record are left out.
+ */
+static int v2_commit_dquots(struct quota_handle *h, struct dquot **dquots,
+			    int count)
+{
+	struct util_dqblk *b;
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		b = &dquots[i]->dq_dqb;
+		if (!b->dqb_curspace && !b->dqb_curinodes &&
+		    !b->dqb_bsoftlimit && !b->dqb_isoftlimit &&
+		    !b->dqb_bhardlimit && !b->dqb_ihardlimit)
+			continue;
+		dquots[n++] = dquots[i];
+	}
+	return qtree_write_dquots(h, dquots, n);
+}
+
 static int v2_scan_dquots(struct quota_handle *h,
 			  int (*process_dquot) (struct dquot *, void *),
 			  void *data)
@@ -542,7 +542,7 @@ static int get_uuid_via_daemon(int op, uuid_t out, int *num)
 	ret = read_all(s, op_buf, reply_len);
 
 	if (op == UUIDD_OP_BULK_TIME_UUID)
-		memcpy(op_buf+16, num, sizeof(int));
+		memcpy(num, op_buf+16, sizeof(int));
 
 	memcpy(out, op_buf, 16);
 
@@ -582,53 +582,108 @@ void uuid__generate_time(uuid_t out, int *num)
 	uuid_pack(&uu, out);
 }
 
+/*
+ * A thread which uses up the time UUIDs it reserved within a second
+ * asks for twice as many the next time, so busy callers don't pay for
+ * a round trip to the daemon, or for locking the clock state file,
+ * every thousand UUIDs.  Each UUID reserves 100ns of the clock, so the
+ * largest block covers 10ms.
+ */
+#define UUIDD_BULK_MIN		1000
+#define UUIDD_BULK_MAX		100000
+
+/*
+ * Reserve a block of *num time UUIDs, the first of which is returned
+ * in out; the rest follow it at one tick intervals.  The block comes
+ * from uuidd if it is running, and from the clock state file
+ * otherwise; either way the whole block is recorded as used.  On
+ * return *num is the number of UUIDs actually reserved.
+ */
+static void uuid_reserve_time(uuid_t out, int *num)
+{
+	int want = *num;
+
+	if (get_uuid_via_daemon(UUIDD_OP_BULK_TIME_UUID, out, num) == 0) {
+		if (*num < 1 || *num > want)
+			*num = 1;
+		return;
+	}
+	*num = want;
+	uuid__generate_time(out, num);
+}
+
+static void uuid_next_time(struct uuid *uu)
+{
+	uu->time_low++;
+	if (uu->time_low == 0) {
+		uu->time_mid++;
+		if (uu->time_mid == 0)
+			uu->time_hi_and_version++;
+	}
+}
+
 void uuid_generate_time(uuid_t out)
 {
 #ifdef TLS
 	THREAD_LOCAL int		num = 0;
+	THREAD_LOCAL int		bulk = UUIDD_BULK_MIN;
 	THREAD_LOCAL struct uuid	uu;
 	THREAD_LOCAL time_t		last_time = 0;
 	time_t				now;
 
 	if (num > 0) {
 		now = time(0);
-		if (now > last_time+1)
+		if (now > last_time+1) {
 			num = 0;
-	}
-	if (num <= 0) {
-		num = 1000;
-		if (get_uuid_via_daemon(UUIDD_OP_BULK_TIME_UUID,
-					out, &num) == 0) {
-			last_time = time(0);
-			uuid_unpack(out, &uu);
-			num--;
-			return;
+			bulk = UUIDD_BULK_MIN;
 		}
-		num = 0;
 	}
-	if (num > 0) {
-		uu.time_low++;
-		if (uu.time_low == 0) {
-			uu.time_mid++;
-			if (uu.time_mid == 0)
-				uu.time_hi_and_version++;
-		}
+	if (num <= 0) {
+		num = bulk;
+		uuid_reserve_time(out, &num);
+		last_time = time(0);
+		uuid_unpack(out, &uu);
 		num--;
-		uuid_pack(&uu, out);
 		return;
 	}
+	uuid_next_time(&uu);
+	num--;
+	if (num == 0 && bulk < UUIDD_BULK_MAX && time(0) <= last_time) {
+		bulk *= 2;
+		if (bulk > UUIDD_BULK_MAX)
+			bulk = UUIDD_BULK_MAX;
+	}
+	uuid_pack(&uu, out);
 #else
 	if (get_uuid_via_daemon(UUIDD_OP_TIME_UUID, out, 0) == 0)
 		return;
-#endif
 
 	uuid__generate_time(out, 0);
+#endif
+}
+
+void uuid_generate_time_batch(uuid_t *out, int n)
+{
+	struct uuid	uu;
+	int		num;
+
+	while (n > 0) {
+		num = (n > UUIDD_BULK_MAX) ? UUIDD_BULK_MAX : n;
+		uuid_reserve_time(*out, &num);
+		uuid_unpack(*out, &uu);
+		out++;
+		n -= num;
+		while (--num > 0) {
+			uuid_next_time(&uu);
+			uuid_pack(&uu, *out);
+			out++;
+		}
+	}
 }
 
 
 void uuid__generate_random(uuid_t out, int *num)
 {
-	uuid_t	buf;
 	struct uuid uu;
 	int i, n;
 
@@ -637,9 +692,9 @@ void uuid__generate_random(uuid_t out, int *num)
 	else
 		n = *num;
 
+	get_random_bytes(out, n * sizeof(uuid_t));
 	for (i = 0; i < n; i++) {
-		get_random_bytes(buf, sizeof(buf));
-		uuid_unpack(buf, &uu);
+		uuid_unpack(out, &uu);
 
 		uu.clock_seq = (uu.clock_seq & 0x3FFF) | 0x8000;
 		uu.time_hi_and_version = (uu.time_hi_and_version & 0x0FFF)
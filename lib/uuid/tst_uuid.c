@@ -70,7 +70,7 @@ static int test_uuid(const char * uuid, int isValid)
 int
 main(int argc ATTR((unused)) , char **argv ATTR((unused)))
 {
-	uuid_t		buf, tst;
+	uuid_t		buf, tst, batch[64];
 	char		str[100];
 	struct timeval	tv;
 	time_t		time_reg, time_gen;
@@ -153,6 +153,21 @@ main(int argc ATTR((unused)) , char **argv ATTR((unused)))
 		printf("UUID time comparison succeeded.\n");
 	}
 
+	uuid_generate_time_batch(batch, 64);
+	for (i = 0; i < 64; i++) {
+		if (uuid_type(batch[i]) != 1 ||
+		    uuid_variant(batch[i]) != UUID_VARIANT_DCE ||
+		    (i && uuid_time(batch[i], 0) < uuid_time(batch[i-1], 0)) ||
+		    (i && !uuid_compare(batch[i], batch[i-1])))
+			break;
+	}
+	if (i == 64)
+		printf("UUID time batch succeeded.\n");
+	else {
+		printf("UUID time batch failed at %d!\n", i);
+		failed++;
+	}
+
 	uuid_parse(str, tst);
 	if (!uuid_compare(buf, tst)) {
 		printf("UUID parse and compare succeeded.\n");
@@ -4,6 +4,7 @@ LOCAL_PATH := $(call my-dir)
 # Build mke2fs
 mke2fs_src_files := \
 	mke2fs.c \
+	populate.c \
 	default_profile.c
 
 mke2fs_c_includes := \
@@ -260,7 +261,8 @@ include $(BUILD_HOST_EXECUTABLE)
 include $(CLEAR_VARS)
 
 chattr_src_files := \
-	chattr.c
+	chattr.c \
+	dirwalk.c
 
 chattr_c_includes := \
 	external/e2fsprogs/lib
@@ -329,7 +331,8 @@ include $(BUILD_HOST_EXECUTABLE)
 include $(CLEAR_VARS)
 
 lsattr_src_files := \
-	lsattr.c
+	lsattr.c \
+	dirwalk.c
 
 lsattr_c_includes := \
 	external/e2fsprogs/lib
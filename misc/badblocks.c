@@ -76,6 +76,7 @@ static int t_flag;			/* number of test patterns */
 static int t_max;			/* allocated test patterns */
 static unsigned int *t_patts;		/* test patterns */
 static int use_buffered_io;
+static unsigned int queue_depth = 1;	/* reads to keep in flight */
 static int exclusive_ok;
 static unsigned int max_bb;		/* Abort test if more than this number of bad blocks has been encountered */
 static unsigned int d_flag;		/* delay factor between reads */
@@ -91,6 +92,7 @@ static void usage(void)
 "Usage: %s [-b block_size] [-i input_file] [-o output_file] [-svwnf]\n"
 "       [-c blocks_at_once] [-d delay_factor_between_reads] [-e max_bad_blocks]\n"
 "       [-p num_passes] [-t test_pattern [-t test_pattern [...]]]\n"
+"       [-j errors[,stride]] [-Q queue_depth]\n"
 "       device [last_block [first_block]]\n"),
 		 program_name);
 	exit (1);
@@ -114,6 +116,17 @@ static FILE *out;
 static blk_t next_bad = 0;
 static ext2_badblocks_iterate bb_iter = NULL;
 
+/* -j: after skip_errors bad blocks in a row, skip skip_stride blocks */
+static unsigned int skip_errors;
+static unsigned int skip_stride;
+static unsigned int bad_run;		/* bad blocks in a row so far */
+
+struct skipped_range {
+	blk_t	start, end;
+};
+static struct skipped_range *skipped;	/* to be read at the end */
+static int num_skipped, max_skipped;
+
 enum error_types { READ_ERROR, WRITE_ERROR, CORRUPTION_ERROR };
 
 static void *allocate_buffer(size_t size)
@@ -365,6 +378,19 @@ static int do_read (int dev, unsigned char * buffer, int try, int block_size,
 	if (v_flag > 1)
 		print_status();
 
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	/*
+	 * Have the kernel start on the next queue_depth - 1 reads while
+	 * we wait for this one, so the device sees more than one
+	 * request at a time.
+	 */
+	if (queue_depth > 1)
+		(void) posix_fadvise(dev,
+			(ext2_loff_t) (current_block + try) * block_size,
+			(ext2_loff_t) try * block_size * (queue_depth - 1),
+			POSIX_FADV_WILLNEED);
+#endif
+
 	/* Seek to the correct loc. */
 	if (ext2fs_llseek (dev, (ext2_loff_t) current_block * block_size,
 			 SEEK_SET) != (ext2_loff_t) current_block * block_size)
@@ -469,19 +495,125 @@ static void flush_bufs(void)
 			_("during ext2fs_sync_device"));
 }
 
-static unsigned int test_ro (int dev, blk_t last_block,
-			     int block_size, blk_t first_block,
-			     unsigned int blocks_at_once)
+/*
+ * In read-only mode, compare the blocks just read against the test
+ * pattern, which is kept after the blocks_at_once blocks of the buffer.
+ */
+static unsigned int check_ro_pattern(unsigned char *blkbuf, int got,
+				     blk_t block, int block_size,
+				     unsigned int blocks_at_once)
 {
-	unsigned char * blkbuf;
-	int try;
+	unsigned int bb_count = 0;
+	int i;
+
+	if (!t_flag)
+		return 0;
+	for (i = 0; i < got; ++i)
+		if (memcmp(blkbuf + i * block_size,
+			   blkbuf + blocks_at_once * block_size, block_size))
+			bb_count += bb_output(block + i, CORRUPTION_ERROR);
+	return bb_count;
+}
+
+static unsigned int bisect_ro(int dev, unsigned char *blkbuf,
+			      int block_size, unsigned int blocks_at_once,
+			      blk_t block, int num);
+
+/*
+ * Read a range of blocks, and if that fails, narrow down where the bad
+ * blocks in it are.
+ */
+static unsigned int read_ro(int dev, unsigned char *blkbuf,
+			    int block_size, unsigned int blocks_at_once,
+			    blk_t block, int num)
+{
+	unsigned int bb_count;
 	int got;
+
+	currently_testing = block;
+	got = do_read(dev, blkbuf, num, block_size, block);
+	bb_count = check_ro_pattern(blkbuf, got, block, block_size,
+				    blocks_at_once);
+	if (got)
+		bad_run = 0;
+	if (got != num)
+		bb_count += bisect_ro(dev, blkbuf, block_size, blocks_at_once,
+				      block + got, num - got);
+	return bb_count;
+}
+
+/*
+ * Find the bad blocks in a range which just failed to read in one go.
+ * The range is halved until the pieces can be read, so the good parts
+ * of it are still read in large pieces instead of block by block.
+ * Inside a run of bad blocks every read of a bad block costs a device
+ * timeout, so there we go block by block until the run ends.
+ */
+static unsigned int bisect_ro(int dev, unsigned char *blkbuf,
+			      int block_size, unsigned int blocks_at_once,
+			      blk_t block, int num)
+{
 	unsigned int bb_count = 0;
-	errcode_t errcode;
-	blk_t recover_block = ~0;
+	int half;
 
-	/* set up abend handler */
-	capture_terminate(NULL);
+	if (num == 1) {
+		bad_run++;
+		return bb_output(block, READ_ERROR);
+	}
+	if (bad_run) {
+		while (num > 0 && bad_run) {
+			bb_count += read_ro(dev, blkbuf, block_size,
+					    blocks_at_once, block, 1);
+			block++;
+			num--;
+		}
+		if (num)
+			bb_count += read_ro(dev, blkbuf, block_size,
+					    blocks_at_once, block, num);
+		return bb_count;
+	}
+	half = num / 2;
+	bb_count = read_ro(dev, blkbuf, block_size, blocks_at_once,
+			   block, half);
+	bb_count += read_ro(dev, blkbuf, block_size, blocks_at_once,
+			    block + half, num - half);
+	return bb_count;
+}
+
+static void skip_range(blk_t start, blk_t end)
+{
+	struct skipped_range *new_skipped;
+
+	if (num_skipped == max_skipped) {
+		new_skipped = realloc(skipped, sizeof(struct skipped_range) *
+				      (max_skipped + 32));
+		if (!new_skipped) {
+			com_err(program_name, ENOMEM, "%s",
+				_("while allocating buffers"));
+			exit(1);
+		}
+		skipped = new_skipped;
+		max_skipped += 32;
+	}
+	skipped[num_skipped].start = start;
+	skipped[num_skipped].end = end;
+	num_skipped++;
+}
+
+/*
+ * Read blocks first_block to last_block - 1, skipping the blocks
+ * already known to be bad.  If allow_skip is set, a run of skip_errors
+ * bad blocks makes us jump over the next skip_stride blocks, which are
+ * recorded so they can be read once the rest of the device is done.
+ */
+static void scan_ro(int dev, unsigned char *blkbuf, int block_size,
+		    blk_t first_block, blk_t last_block,
+		    unsigned int blocks_at_once, unsigned int *bb_count,
+		    int allow_skip)
+{
+	errcode_t errcode;
+	blk_t skip_end;
+	int try, got;
 
 	errcode = ext2fs_badblocks_list_iterate_begin(bb_list,&bb_iter);
 	if (errcode) {
@@ -493,6 +625,72 @@ static unsigned int test_ro (int dev, blk_t last_block,
 		ext2fs_badblocks_list_iterate (bb_iter, &next_bad);
 	} while (next_bad && next_bad < first_block);
 
+	currently_testing = first_block;
+	bad_run = 0;
+	while (currently_testing < last_block)
+	{
+		if (max_bb && *bb_count >= max_bb) {
+			if (s_flag || v_flag) {
+				fputs(_("Too many bad blocks, aborting test\n"), stderr);
+			}
+			break;
+		}
+		if (allow_skip && skip_errors && bad_run >= skip_errors) {
+			skip_end = currently_testing + skip_stride;
+			if (skip_end > last_block || skip_end < currently_testing)
+				skip_end = last_block;
+			skip_range(currently_testing, skip_end);
+			currently_testing = skip_end;
+			bad_run = 0;
+			while (next_bad && next_bad < currently_testing)
+				ext2fs_badblocks_list_iterate(bb_iter,
+							      &next_bad);
+			continue;
+		}
+		try = blocks_at_once;
+		if (next_bad) {
+			if (currently_testing == next_bad) {
+				/* fprintf (out, "%lu\n", nextbad); */
+				ext2fs_badblocks_list_iterate (bb_iter, &next_bad);
+				currently_testing++;
+				continue;
+			}
+			else if (currently_testing + try > next_bad)
+				try = next_bad - currently_testing;
+		}
+		if (currently_testing + try > last_block)
+			try = last_block - currently_testing;
+		got = do_read (dev, blkbuf, try, block_size, currently_testing);
+		*bb_count += check_ro_pattern(blkbuf, got, currently_testing,
+					      block_size, blocks_at_once);
+		if (got)
+			bad_run = 0;
+		currently_testing += got;
+		if (got != try) {
+			blk_t failed = currently_testing;
+
+			*bb_count += bisect_ro(dev, blkbuf, block_size,
+					       blocks_at_once,
+					       failed, try - got);
+			currently_testing = failed + try - got;
+		}
+	}
+
+	ext2fs_badblocks_list_iterate_end(bb_iter);
+	bb_iter = NULL;
+}
+
+static unsigned int test_ro (int dev, blk_t last_block,
+			     int block_size, blk_t first_block,
+			     unsigned int blocks_at_once)
+{
+	unsigned char * blkbuf;
+	unsigned int bb_count = 0;
+	int i;
+
+	/* set up abend handler */
+	capture_terminate(NULL);
+
 	if (t_flag) {
 		blkbuf = allocate_buffer((blocks_at_once + 1) * block_size);
 	} else {
@@ -515,57 +713,23 @@ static unsigned int test_ro (int dev, blk_t last_block,
 			     t_patts[0], block_size);
 	}
 	flush_bufs();
-	try = blocks_at_once;
-	currently_testing = first_block;
 	num_blocks = last_block - 1;
 	if (!t_flag && (s_flag || v_flag))
 		fputs(_("Checking for bad blocks (read-only test): "), stderr);
 	if (s_flag && v_flag <= 1)
 		alarm_intr(SIGALRM);
-	while (currently_testing < last_block)
-	{
-		if (max_bb && bb_count >= max_bb) {
-			if (s_flag || v_flag) {
-				fputs(_("Too many bad blocks, aborting test\n"), stderr);
-			}
+	num_skipped = 0;
+	scan_ro(dev, blkbuf, block_size, first_block, last_block,
+		blocks_at_once, &bb_count, 1);
+	for (i = 0; i < num_skipped; i++) {
+		if (max_bb && bb_count >= max_bb)
 			break;
-		}
-		if (next_bad) {
-			if (currently_testing == next_bad) {
-				/* fprintf (out, "%lu\n", nextbad); */
-				ext2fs_badblocks_list_iterate (bb_iter, &next_bad);
-				currently_testing++;
-				continue;
-			}
-			else if (currently_testing + try > next_bad)
-				try = next_bad - currently_testing;
-		}
-		if (currently_testing + try > last_block)
-			try = last_block - currently_testing;
-		got = do_read (dev, blkbuf, try, block_size, currently_testing);
-		if (t_flag) {
-			/* test the comparison between all the
-			   blocks successfully read  */
-			int i;
-			for (i = 0; i < got; ++i)
-				if (memcmp (blkbuf+i*block_size,
-					    blkbuf+blocks_at_once*block_size,
-					    block_size))
-					bb_count += bb_output(currently_testing + i, CORRUPTION_ERROR);
-		}
-		if (got == 0 && try == 1)
-			bb_count += bb_output(currently_testing++, READ_ERROR);
-		currently_testing += got;
-		if (got != try) {
-			try = 1;
-			if (recover_block == ~0U)
-				recover_block = currently_testing - got +
-					blocks_at_once;
-			continue;
-		} else if (currently_testing == recover_block) {
-			try = blocks_at_once;
-			recover_block = ~0;
-		}
+		if (v_flag > 1)
+			fprintf(stderr, _("Going back to blocks %lu to %lu\n"),
+				(unsigned long) skipped[i].start,
+				(unsigned long) skipped[i].end - 1);
+		scan_ro(dev, blkbuf, block_size, skipped[i].start,
+			skipped[i].end, blocks_at_once, &bb_count, 0);
 	}
 	num_blocks = 0;
 	alarm(0);
@@ -575,8 +739,6 @@ static unsigned int test_ro (int dev, blk_t last_block,
 	fflush (stderr);
 	free (blkbuf);
 
-	ext2fs_badblocks_list_iterate_end(bb_iter);
-
 	uncapture_terminate();
 
 	return bb_count;
@@ -1051,6 +1213,7 @@ int main (int argc, char ** argv)
 	int open_flag;
 	long sysval;
 	blk64_t inblk;
+	char *tmp;
 
 	setbuf(stdout, NULL);
 	setbuf(stderr, NULL);
@@ -1078,7 +1241,7 @@ int main (int argc, char ** argv)
 
 	if (argc && *argv)
 		program_name = *argv;
-	while ((c = getopt (argc, argv, "b:d:e:fi:o:svwnc:p:h:t:BX")) != EOF) {
+	while ((c = getopt (argc, argv, "b:d:e:fi:j:o:svwnc:p:h:t:BQ:X")) != EOF) {
 		switch (c) {
 		case 'b':
 			block_size = parse_uint(optarg, "block size");
@@ -1154,6 +1317,21 @@ int main (int argc, char ** argv)
 		case 'B':
 			use_buffered_io = 1;
 			break;
+		case 'j':
+			tmp = strchr(optarg, ',');
+			if (tmp)
+				*tmp++ = 0;
+			skip_errors = parse_uint(optarg,
+						 "consecutive bad block count");
+			if (tmp)
+				skip_stride = parse_uint(tmp, "skip stride");
+			break;
+		case 'Q':
+			queue_depth = parse_uint(optarg, "queue depth");
+			/* The read ahead goes through the page cache */
+			if (queue_depth > 1)
+				use_buffered_io = 1;
+			break;
 		case 'X':
 			exclusive_ok++;
 			break;
@@ -1161,6 +1339,8 @@ int main (int argc, char ** argv)
 			usage();
 		}
 	}
+	if (skip_errors && !skip_stride)
+		skip_stride = 64 * blocks_at_once;
 	if (!w_flag) {
 		if (t_flag > 1) {
 			com_err(program_name, 0, "%s",
@@ -1327,5 +1507,6 @@ int main (int argc, char ** argv)
 	if (out != stdout)
 		fclose (out);
 	free(t_patts);
+	free(skipped);
 	return 0;
 }
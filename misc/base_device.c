@@ -27,9 +27,20 @@
 #endif
 #include <ctype.h>
 #include <string.h>
+#include <limits.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
 
 #include "fsck.h"
 
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
 /*
  * Required for the uber-silly devfs /dev/ide/host1/bus2/target3/lun3
  * pathames.
@@ -146,6 +157,68 @@ errout:
 	return NULL;
 }
 
+static int read_sysfs_num(const char *dir, const char *file,
+			  unsigned long long *ret)
+{
+	char	path[PATH_MAX];
+	FILE	*f;
+	int	n;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	n = fscanf(f, "%llu", ret);
+	fclose(f);
+	return n == 1 ? 0 : -1;
+}
+
+/*
+ * Look a block device up in sysfs to find the whole disk it lives on,
+ * whether that disk is rotational, and the size of the device in
+ * bytes.  *disk is set to an allocated "/dev/<disk>" string, in the
+ * same form base_device() returns.  Returns -1 if sysfs doesn't know
+ * about the device.
+ */
+int disk_info(const char *device, char **disk, int *rotational,
+	      unsigned long long *size)
+{
+#if defined(__linux__) && defined(S_ISBLK) && defined(major)
+	char	path[PATH_MAX], real[PATH_MAX], *cp;
+	struct stat st;
+	unsigned long long val;
+
+	if (stat(device, &st) < 0 || !S_ISBLK(st.st_mode))
+		return -1;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+		 (unsigned) major(st.st_rdev), (unsigned) minor(st.st_rdev));
+	if (!realpath(path, real))
+		return -1;
+	*size = read_sysfs_num(real, "size", &val) ? 0 : val * 512;
+
+	/* A partition's directory sits inside the one for its disk */
+	if (read_sysfs_num(real, "partition", &val) == 0) {
+		cp = strrchr(real, '/');
+		if (!cp)
+			return -1;
+		*cp = 0;
+	}
+	*rotational = (read_sysfs_num(real, "queue/rotational", &val) == 0) ?
+		(val != 0) : 1;
+
+	cp = strrchr(real, '/');
+	if (!cp)
+		return -1;
+	*disk = malloc(strlen(cp) + 5);
+	if (!*disk)
+		return -1;
+	sprintf(*disk, "/dev%s", cp);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 #ifdef DEBUG
 int main(int argc, char** argv)
 {
@@ -53,6 +53,7 @@
 
 #include "../version.h"
 #include "nls-enable.h"
+#include "dirwalk.h"
 
 static const char * program_name = "chattr";
 
@@ -66,6 +67,7 @@ static unsigned long version;
 static int recursive;
 static int verbose;
 static int silent;
+static int num_workers;
 
 static unsigned long af;
 static unsigned long rf;
@@ -79,10 +81,21 @@ static unsigned long sf;
 #define STRUCT_STAT	struct stat
 #endif
 
+#ifdef O_LARGEFILE
+#define OPEN_FLAGS (O_RDONLY|O_NONBLOCK|O_LARGEFILE)
+#else
+#define OPEN_FLAGS (O_RDONLY|O_NONBLOCK)
+#endif
+
+#ifdef HAVE_DIRWALK
+static struct dirwalk walk;
+#endif
+
 static void usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-RVf] [-+=AaCcDdeijsSu] [-v version] files...\n"),
+		_("Usage: %s [-RVf] [-+=AaCcDdeijsSu] [-v version] "
+		  "[-w workers] files...\n"),
 		program_name);
 	exit(1);
 }
@@ -158,6 +171,20 @@ static int decode_arg (int * i, int argc, char ** argv)
 				set_version = 1;
 				continue;
 			}
+			if (*p == 'w') {
+				(*i)++;
+				if (*i >= argc)
+					usage ();
+				num_workers = strtol (argv[*i], &tmp, 0);
+				if (*tmp || num_workers < 1 ||
+				    num_workers > DIRWALK_MAX_WORKERS) {
+					com_err (program_name, 0,
+						 _("bad number of workers - %s\n"),
+						 argv[*i]);
+					usage ();
+				}
+				continue;
+			}
 			if ((fl = get_flag(*p)) == 0)
 				usage();
 			rf |= fl;
@@ -189,19 +216,16 @@ static int decode_arg (int * i, int argc, char ** argv)
 
 static int chattr_dir_proc(const char *, struct dirent *, void *);
 
-static int change_attributes(const char * name)
+/*
+ * Change the flags and version of name, through fd if it is open and
+ * by name if it is -1, and report what was done to f.
+ */
+static int apply_attributes(FILE * f, const char * name, int fd,
+			    mode_t mode)
 {
 	unsigned long flags;
-	STRUCT_STAT	st;
-
-	if (LSTAT (name, &st) == -1) {
-		if (!silent)
-			com_err (program_name, errno,
-				 _("while trying to stat %s"), name);
-		return -1;
-	}
 
-	if (fgetflags(name, &flags) == -1) {
+	if ((fd < 0 ? fgetflags(name, &flags) : getflags(fd, &flags)) == -1) {
 		if (!silent)
 			com_err(program_name, errno,
 					_("while reading flags on %s"), name);
@@ -209,11 +233,11 @@ static int change_attributes(const char * name)
 	}
 	if (set) {
 		if (verbose) {
-			printf (_("Flags of %s set as "), name);
-			print_flags (stdout, sf, 0);
-			printf ("\n");
+			fprintf (f, _("Flags of %s set as "), name);
+			print_flags (f, sf, 0);
+			fprintf (f, "\n");
 		}
-		if (fsetflags (name, sf) == -1)
+		if ((fd < 0 ? fsetflags (name, sf) : setflags (fd, sf)) == -1)
 			perror (name);
 	} else {
 		if (rem)
@@ -221,13 +245,14 @@ static int change_attributes(const char * name)
 		if (add)
 			flags |= af;
 		if (verbose) {
-			printf(_("Flags of %s set as "), name);
-			print_flags(stdout, flags, 0);
-			printf("\n");
+			fprintf(f, _("Flags of %s set as "), name);
+			print_flags(f, flags, 0);
+			fprintf(f, "\n");
 		}
-		if (!S_ISDIR(st.st_mode))
+		if (!S_ISDIR(mode))
 			flags &= ~EXT2_DIRSYNC_FL;
-		if (fsetflags(name, flags) == -1) {
+		if ((fd < 0 ? fsetflags(name, flags) :
+		     setflags(fd, flags)) == -1) {
 			if (!silent) {
 				com_err(program_name, errno,
 						_("while setting flags on %s"),
@@ -238,8 +263,10 @@ static int change_attributes(const char * name)
 	}
 	if (set_version) {
 		if (verbose)
-			printf (_("Version of %s set as %lu\n"), name, version);
-		if (fsetversion (name, version) == -1) {
+			fprintf (f, _("Version of %s set as %lu\n"), name,
+				 version);
+		if ((fd < 0 ? fsetversion (name, version) :
+		     setversion (fd, version)) == -1) {
 			if (!silent)
 				com_err (program_name, errno,
 					 _("while setting version on %s"),
@@ -247,11 +274,72 @@ static int change_attributes(const char * name)
 			return -1;
 		}
 	}
-	if (S_ISDIR(st.st_mode) && recursive)
+	return 0;
+}
+
+static int change_attributes(const char * name)
+{
+	STRUCT_STAT	st;
+
+	if (LSTAT (name, &st) == -1) {
+		if (!silent)
+			com_err (program_name, errno,
+				 _("while trying to stat %s"), name);
+		return -1;
+	}
+
+	if (apply_attributes(stdout, name, -1, st.st_mode))
+		return -1;
+	if (S_ISDIR(st.st_mode) && recursive) {
+#ifdef HAVE_DIRWALK
+		if (walk.p)
+			return dirwalk_add(&walk, name);
+#endif
 		return iterate_on_dir (name, chattr_dir_proc, NULL);
+	}
 	return 0;
 }
 
+#ifdef HAVE_DIRWALK
+/*
+ * The workers open each entry once, relative to its directory, and
+ * read and set its flags through that one descriptor.
+ */
+static int chattr_walk_entry(struct dirwalk *dw EXT2FS_ATTR((unused)),
+			     int dir_fd, const char *path, const char *name,
+			     mode_t mode, FILE *out)
+{
+	int fd, retval;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return 0;
+	if (!mode) {
+		if (!silent)
+			com_err (program_name, errno,
+				 _("while trying to stat %s"), path);
+		return -1;
+	}
+	if (!S_ISREG(mode) && !S_ISDIR(mode)) {
+		if (!silent)
+			com_err(program_name, EOPNOTSUPP,
+				_("while reading flags on %s"), path);
+		return -1;
+	}
+	fd = openat(dir_fd, name, OPEN_FLAGS | O_NOFOLLOW);
+	if (fd == -1) {
+		if (!silent)
+			com_err(program_name, errno,
+				_("while reading flags on %s"), path);
+		return -1;
+	}
+	retval = apply_attributes(out, path, fd, mode);
+	close(fd);
+	if (retval)
+		return retval;
+	return S_ISDIR(mode);
+}
+#endif
+
 static int chattr_dir_proc (const char * dir_name, struct dirent * de,
 			    void * private EXT2FS_ATTR((unused)))
 {
@@ -317,10 +405,24 @@ int main (int argc, char ** argv)
 	if (verbose)
 		fprintf (stderr, "chattr %s (%s)\n",
 			 E2FSPROGS_VERSION, E2FSPROGS_DATE);
+	/* Where the workers can't be had, -w is accepted and ignored */
+#ifdef HAVE_DIRWALK
+	if (recursive && num_workers) {
+		walk.num_workers = num_workers;
+		walk.entry = chattr_walk_entry;
+		if (dirwalk_start (&walk))
+			com_err (program_name, errno, "%s",
+				 _("while starting the workers"));
+	}
+#endif
 	for (j = i; j < argc; j++) {
 		err = change_attributes (argv[j]);
 		if (err)
 			retval = 1;
 	}
+#ifdef HAVE_DIRWALK
+	if (walk.p && dirwalk_finish (&walk))
+		retval = 1;
+#endif
 	exit(retval);
 }
@@ -0,0 +1,430 @@
+/*
+ * dirwalk.c --- walk directory trees from several processes at once
+ *
+ * lsattr -R and chattr -R spend nearly all of their time waiting for
+ * the stat, open and ioctl of one file after another.  With -w, they
+ * hand the directories to a number of worker processes instead.  Each
+ * worker reads a whole directory, looking its entries up relative to
+ * the directory's file descriptor rather than by path name, and sends
+ * back the subdirectories it found as it goes and the output for the
+ * directory when it is done.  The parent keeps the directories which
+ * are waiting in a stack and gives the next one to whichever worker
+ * becomes idle first, so that a worker stuck in a big directory
+ * doesn't hold the others up.
+ *
+ * The e2p functions and stdio aren't shared between processes, which
+ * is why each worker writes its output to a memory stream and the
+ * parent copies it to standard output a directory at a time; the
+ * order of the directories varies from run to run, but the order
+ * within each one does not.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+
+#include "dirwalk.h"
+
+#ifdef HAVE_DIRWALK
+
+#ifdef _LFS64_LARGEFILE
+#define FSTATAT		fstatat64
+#define STRUCT_STAT	struct stat64
+#else
+#define FSTATAT		fstatat
+#define STRUCT_STAT	struct stat
+#endif
+
+/* What a worker sends back: a subdirectory, or a directory's output */
+#define DIRWALK_MSG_DIR		1
+#define DIRWALK_MSG_DONE	2
+
+struct dirwalk_msg {
+	int	type;
+	int	errors;
+	size_t	len;
+};
+
+/* What the parent sends a worker: a directory to read */
+struct dirwalk_job_hdr {
+	int	depth;
+	size_t	len;
+};
+
+struct dirwalk_job {
+	struct dirwalk_job	*next;
+	int			depth;
+	char			path[1];
+};
+
+struct dirwalk_worker {
+	pid_t	pid;
+	int	to_fd;		/* jobs go out here */
+	int	from_fd;	/* and messages come back here */
+	int	busy;
+	int	depth;
+};
+
+struct dirwalk_private {
+	struct dirwalk_worker	workers[DIRWALK_MAX_WORKERS];
+	int			num_workers;
+	struct dirwalk_job	*jobs;		/* a stack */
+	int			errors;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char	*cp = buf;
+	ssize_t		n;
+
+	while (len) {
+		n = write(fd, cp, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		cp += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns 1 on a clean end of file before anything was read */
+static int read_all(int fd, void *buf, size_t len)
+{
+	char		*cp = buf;
+	size_t		done = 0;
+	ssize_t		n;
+
+	while (done < len) {
+		n = read(fd, cp + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return done ? -1 : 1;
+		done += n;
+	}
+	return 0;
+}
+
+static int send_msg(int fd, int type, int errors, const void *buf,
+		    size_t len)
+{
+	struct dirwalk_msg	msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.errors = errors;
+	msg.len = len;
+	if (write_all(fd, &msg, sizeof(msg)))
+		return -1;
+	return write_all(fd, buf, len);
+}
+
+/* Read one directory in a worker */
+static void walk_dir(struct dirwalk *dw, int to_parent, const char *path,
+		     int depth)
+{
+	STRUCT_STAT	st;
+	struct dirent	*de;
+	DIR		*dir = NULL;
+	FILE		*out;
+	char		*buf = NULL, *child;
+	size_t		size = 0, dir_len = strlen(path);
+	mode_t		mode;
+	int		fd, ret, errors = 0;
+
+	out = open_memstream(&buf, &size);
+	if (!out) {
+		send_msg(to_parent, DIRWALK_MSG_DONE, 1, "", 0);
+		return;
+	}
+	if (dw->dir_begin)
+		(dw->dir_begin)(dw, path, depth, out);
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NONBLOCK);
+	if (fd >= 0)
+		dir = fdopendir(fd);
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		errors++;
+		goto out;
+	}
+	while ((de = readdir(dir))) {
+		child = malloc(dir_len + strlen(de->d_name) + 2);
+		if (!child) {
+			errors++;
+			break;
+		}
+		if (dir_len && path[dir_len - 1] == '/')
+			sprintf(child, "%s%s", path, de->d_name);
+		else
+			sprintf(child, "%s/%s", path, de->d_name);
+		mode = 0;
+		if (FSTATAT(dirfd(dir), de->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == 0)
+			mode = st.st_mode;
+		ret = (dw->entry)(dw, dirfd(dir), child, de->d_name, mode, out);
+		if (ret < 0)
+			errors++;
+		else if (ret > 0 && S_ISDIR(mode) &&
+			 strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			send_msg(to_parent, DIRWALK_MSG_DIR, 0, child,
+				 strlen(child));
+		free(child);
+	}
+	closedir(dir);
+out:
+	if (dw->dir_end)
+		(dw->dir_end)(dw, path, depth, out);
+	fclose(out);
+	send_msg(to_parent, DIRWALK_MSG_DONE, errors, buf, size);
+	free(buf);
+}
+
+static void worker_loop(struct dirwalk *dw, int from_parent, int to_parent)
+{
+	struct dirwalk_job_hdr	hdr;
+	char			*path;
+
+	while (read_all(from_parent, &hdr, sizeof(hdr)) == 0) {
+		path = malloc(hdr.len + 1);
+		if (!path || read_all(from_parent, path, hdr.len))
+			break;
+		path[hdr.len] = 0;
+		walk_dir(dw, to_parent, path, hdr.depth);
+		free(path);
+	}
+}
+
+static int push_job(struct dirwalk_private *p, const char *path,
+		    size_t len, int depth)
+{
+	struct dirwalk_job	*job;
+
+	job = malloc(sizeof(struct dirwalk_job) + len);
+	if (!job)
+		return -1;
+	memcpy(job->path, path, len);
+	job->path[len] = 0;
+	job->depth = depth;
+	job->next = p->jobs;
+	p->jobs = job;
+	return 0;
+}
+
+static void stop_worker(struct dirwalk_worker *w)
+{
+	if (w->to_fd >= 0)
+		close(w->to_fd);
+	if (w->from_fd >= 0)
+		close(w->from_fd);
+	w->to_fd = w->from_fd = -1;
+	w->busy = 0;
+}
+
+/*
+ * Fork dw->num_workers workers.  Returns 0 if at least one of them
+ * could be started.
+ */
+int dirwalk_start(struct dirwalk *dw)
+{
+	struct dirwalk_private	*p;
+	struct dirwalk_worker	*w;
+	int			to[2], from[2], i, n;
+
+	p = calloc(1, sizeof(struct dirwalk_private));
+	if (!p)
+		return -1;
+	dw->p = p;
+	n = dw->num_workers;
+	if (n < 1)
+		n = 1;
+	if (n > DIRWALK_MAX_WORKERS)
+		n = DIRWALK_MAX_WORKERS;
+
+	/* The workers mustn't write out what is waiting in our buffers */
+	fflush(stdout);
+	fflush(stderr);
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < n; i++) {
+		w = &p->workers[p->num_workers];
+		if (pipe(to) < 0)
+			break;
+		if (pipe(from) < 0) {
+			close(to[0]);
+			close(to[1]);
+			break;
+		}
+		w->pid = fork();
+		if (w->pid < 0) {
+			close(to[0]);
+			close(to[1]);
+			close(from[0]);
+			close(from[1]);
+			break;
+		}
+		if (w->pid == 0) {
+			/* Let the earlier workers see the end of their jobs */
+			while (--i >= 0)
+				stop_worker(&p->workers[i]);
+			close(to[1]);
+			close(from[0]);
+			worker_loop(dw, to[0], from[1]);
+			_exit(0);
+		}
+		close(to[0]);
+		close(from[1]);
+		w->to_fd = to[1];
+		w->from_fd = from[0];
+		w->busy = 0;
+		p->num_workers++;
+	}
+	if (!p->num_workers) {
+		free(p);
+		dw->p = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Queue a directory to be walked */
+int dirwalk_add(struct dirwalk *dw, const char *path)
+{
+	return push_job(dw->p, path, strlen(path), 0);
+}
+
+/* Handle one message from a busy worker; returns -1 if it went away */
+static int handle_msg(struct dirwalk_private *p, struct dirwalk_worker *w)
+{
+	struct dirwalk_msg	msg;
+	char			*buf;
+
+	if (read_all(w->from_fd, &msg, sizeof(msg)))
+		return -1;
+	buf = malloc(msg.len + 1);
+	if (!buf || read_all(w->from_fd, buf, msg.len)) {
+		free(buf);
+		return -1;
+	}
+	if (msg.type == DIRWALK_MSG_DIR) {
+		if (push_job(p, buf, msg.len, w->depth + 1))
+			p->errors++;
+	} else {
+		fwrite(buf, 1, msg.len, stdout);
+		p->errors += msg.errors;
+		w->busy = 0;
+	}
+	free(buf);
+	return 0;
+}
+
+/*
+ * Walk everything which has been queued, then stop the workers.
+ * Returns the number of errors.
+ */
+int dirwalk_finish(struct dirwalk *dw)
+{
+	struct dirwalk_private	*p = dw->p;
+	struct dirwalk_worker	*w;
+	struct dirwalk_job_hdr	hdr;
+	struct dirwalk_job	*job;
+	fd_set			rfds;
+	int			i, busy, max_fd, errors;
+
+	while (1) {
+		busy = 0;
+		max_fd = -1;
+		FD_ZERO(&rfds);
+		for (i = 0; i < p->num_workers; i++) {
+			w = &p->workers[i];
+			if (w->to_fd < 0)
+				continue;
+			if (!w->busy && p->jobs) {
+				job = p->jobs;
+				p->jobs = job->next;
+				memset(&hdr, 0, sizeof(hdr));
+				hdr.depth = job->depth;
+				hdr.len = strlen(job->path);
+				if (write_all(w->to_fd, &hdr, sizeof(hdr)) ||
+				    write_all(w->to_fd, job->path, hdr.len)) {
+					p->errors++;
+					stop_worker(w);
+					free(job);
+					continue;
+				}
+				w->busy = 1;
+				w->depth = job->depth;
+				free(job);
+			}
+			if (w->busy) {
+				busy++;
+				FD_SET(w->from_fd, &rfds);
+				if (w->from_fd > max_fd)
+					max_fd = w->from_fd;
+			}
+		}
+		if (!busy)
+			break;
+		fflush(stdout);
+		if (select(max_fd + 1, &rfds, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < p->num_workers; i++) {
+			w = &p->workers[i];
+			if (w->busy && FD_ISSET(w->from_fd, &rfds) &&
+			    handle_msg(p, w)) {
+				p->errors++;
+				stop_worker(w);
+			}
+		}
+	}
+
+	/* Whatever is left had no worker to go to */
+	while ((job = p->jobs)) {
+		p->jobs = job->next;
+		p->errors++;
+		free(job);
+	}
+	for (i = 0; i < p->num_workers; i++)
+		stop_worker(&p->workers[i]);
+	for (i = 0; i < p->num_workers; i++)
+		while (waitpid(p->workers[i].pid, NULL, 0) < 0 &&
+		       errno == EINTR)
+			;
+	fflush(stdout);
+	errors = p->errors;
+	free(p);
+	dw->p = NULL;
+	return errors;
+}
+
+#endif /* HAVE_DIRWALK */
@@ -0,0 +1,51 @@
+/*
+ * dirwalk.h --- walk directory trees from several processes at once
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && \
+	defined(HAVE_FDOPENDIR) && defined(HAVE_OPEN_MEMSTREAM) && \
+	defined(HAVE_SYS_WAIT_H) && defined(HAVE_SYS_SELECT_H)
+#define HAVE_DIRWALK
+#endif
+
+#define DIRWALK_MAX_WORKERS	64
+
+struct dirwalk;
+struct dirwalk_private;
+
+/*
+ * Called in a worker for each entry of a directory, "." and ".."
+ * included, with the directory open as dir_fd, so that the entry can
+ * be opened relative to it.  mode is 0 if the entry couldn't be
+ * stat'ed, and errno is then set.  Whatever is written to out for a
+ * directory reaches standard output in one piece, in the order the
+ * entries were read.  Returns 1 to descend into the entry if it is a
+ * directory, 0 not to, and -1 to count an error.
+ */
+typedef int (*dirwalk_entry_func)(struct dirwalk *dw, int dir_fd,
+				  const char *path, const char *name,
+				  mode_t mode, FILE *out);
+
+/* Called before and after the entries of a directory; depth 0 is a
+ * directory passed to dirwalk_add() */
+typedef void (*dirwalk_dir_func)(struct dirwalk *dw, const char *path,
+				 int depth, FILE *out);
+
+struct dirwalk {
+	int			num_workers;
+	dirwalk_entry_func	entry;
+	dirwalk_dir_func	dir_begin;	/* may be NULL */
+	dirwalk_dir_func	dir_end;	/* may be NULL */
+	void			*priv;
+	struct dirwalk_private	*p;
+};
+
+/* dirwalk.c */
+extern int dirwalk_start(struct dirwalk *dw);
+extern int dirwalk_add(struct dirwalk *dw, const char *path);
+extern int dirwalk_finish(struct dirwalk *dw);
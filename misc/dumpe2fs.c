@@ -47,12 +47,14 @@ extern int optind;
 static const char * program_name = "dumpe2fs";
 static char * device_name = NULL;
 static int hex_format = 0;
+static int json_format = 0;
 static int blocks64 = 0;
 
 static void usage(void)
 {
-	fprintf (stderr, _("Usage: %s [-bfhixV] [-o superblock=<num>] "
-		 "[-o blocksize=<num>] device\n"), program_name);
+	fprintf (stderr, _("Usage: %s [-bfhijxV] [-g first[:last]] "
+		 "[-o superblock=<num>] [-o blocksize=<num>] device\n"),
+		 program_name);
 	exit (1);
 }
 
@@ -78,6 +80,35 @@ static void print_range(unsigned long long a, unsigned long long b)
 		printf("%llu-%llu", a, b);
 }
 
+/*
+ * Return the first bit from i on in bitmap which is set (or clear, if
+ * set is zero), or num if there is none.  Whole words and bytes which
+ * can't hold it are skipped without testing their bits one by one.
+ */
+static unsigned long next_bit(char *bitmap, unsigned long i,
+			      unsigned long num, int set)
+{
+	unsigned char	skip = set ? 0 : 0xff;
+	__u64		skip64 = set ? 0 : ~0ULL;
+
+	while (i < num) {
+		if (!(i & 63) && i + 64 <= num &&
+		    *(__u64 *) (bitmap + (i >> 3)) == skip64) {
+			i += 64;
+			continue;
+		}
+		if (!(i & 7) && i + 8 <= num &&
+		    ((unsigned char *) bitmap)[i >> 3] == skip) {
+			i += 8;
+			continue;
+		}
+		if (!!in_use(bitmap, i) == set)
+			return i;
+		i++;
+	}
+	return num;
+}
+
 static void print_free(unsigned long group, char * bitmap,
 		       unsigned long num, unsigned long offset, int ratio)
 {
@@ -87,21 +118,34 @@ static void print_free(unsigned long group, char * bitmap,
 
 	offset /= ratio;
 	offset += group * num;
-	for (i = 0; i < num; i++)
-		if (!in_use (bitmap, i))
-		{
-			if (p)
-				printf (", ");
-			print_number((i + offset) * ratio);
-			for (j = i; j < num && !in_use (bitmap, j); j++)
-				;
-			if (--j != i) {
-				fputc('-', stdout);
-				print_number((j + offset) * ratio);
-				i = j;
-			}
-			p = 1;
+	for (i = next_bit(bitmap, 0, num, 0); i < num;
+	     i = next_bit(bitmap, j + 1, num, 0)) {
+		if (p)
+			printf (", ");
+		print_number((i + offset) * ratio);
+		j = next_bit(bitmap, i, num, 1) - 1;
+		if (j != i) {
+			fputc('-', stdout);
+			print_number((j + offset) * ratio);
 		}
+		p = 1;
+	}
+}
+
+/* Count the runs of free bits in bitmap and find the longest one */
+static void count_free(char *bitmap, unsigned long num,
+		       unsigned long *runs, unsigned long *longest)
+{
+	unsigned long i, j;
+
+	*runs = *longest = 0;
+	for (i = next_bit(bitmap, 0, num, 0); i < num;
+	     i = next_bit(bitmap, j, num, 0)) {
+		j = next_bit(bitmap, i, num, 1);
+		(*runs)++;
+		if (j - i > *longest)
+			*longest = j - i;
+	}
 }
 
 static void print_bg_opt(int bg_flags, int mask,
@@ -149,7 +193,96 @@ static void print_bg_rel_offset(ext2_filsys fs, blk64_t block, int itable,
 	}
 }
 
-static void list_desc (ext2_filsys fs)
+static void print_json_range(const char *name, blk64_t a, blk64_t b)
+{
+	printf(", \"%s\": [%llu, %llu]", name, a, b);
+}
+
+/*
+ * Print the descriptor of group i as one line of JSON.  The free space
+ * in the bitmaps is summarized rather than listed, so that the output
+ * stays small on file systems with many groups.
+ */
+static void print_group_json(ext2_filsys fs, dgrp_t i,
+			     char *block_bitmap, char *inode_bitmap,
+			     int old_desc_blocks, int inode_blocks_per_group)
+{
+	blk64_t		super_blk, old_desc_blk, new_desc_blk;
+	int		reserved_gdt = fs->super->s_reserved_gdt_blocks;
+	int		bg_flags = 0, first = 1;
+	unsigned long	runs, longest;
+
+	ext2fs_super_and_bgd_loc2(fs, i, &super_blk,
+				  &old_desc_blk, &new_desc_blk, 0);
+	printf("{\"group\": %u", i);
+	print_json_range("blocks", ext2fs_group_first_block2(fs, i),
+			 ext2fs_group_last_block2(fs, i));
+
+	if (fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM)
+		bg_flags = ext2fs_bg_flags(fs, i);
+	fputs(", \"flags\": [", stdout);
+	if (bg_flags & EXT2_BG_INODE_UNINIT) {
+		printf("%s\"INODE_UNINIT\"", first ? "" : ", ");
+		first = 0;
+	}
+	if (bg_flags & EXT2_BG_BLOCK_UNINIT) {
+		printf("%s\"BLOCK_UNINIT\"", first ? "" : ", ");
+		first = 0;
+	}
+	if (bg_flags & EXT2_BG_INODE_ZEROED)
+		printf("%s\"ITABLE_ZEROED\"", first ? "" : ", ");
+	fputc(']', stdout);
+
+	if (fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM) {
+		unsigned csum = ext2fs_bg_checksum(fs, i);
+
+		printf(", \"checksum\": %u, \"checksum_ok\": %s", csum,
+		       csum == ext2fs_group_desc_csum(fs, i) ?
+		       "true" : "false");
+	}
+	if (i == 0 || super_blk)
+		printf(", \"superblock\": %llu", super_blk);
+	if (old_desc_blk) {
+		print_json_range("group_descriptors", old_desc_blk,
+				 old_desc_blk + old_desc_blocks - 1);
+		if (reserved_gdt)
+			print_json_range("reserved_gdt",
+					 old_desc_blk + old_desc_blocks,
+					 old_desc_blk + old_desc_blocks +
+					 reserved_gdt - 1);
+	} else if (new_desc_blk)
+		print_json_range("group_descriptors", new_desc_blk,
+				 new_desc_blk);
+	printf(", \"block_bitmap\": %llu, \"inode_bitmap\": %llu",
+	       ext2fs_block_bitmap_loc(fs, i), ext2fs_inode_bitmap_loc(fs, i));
+	print_json_range("inode_table", ext2fs_inode_table_loc(fs, i),
+			 ext2fs_inode_table_loc(fs, i) +
+			 inode_blocks_per_group - 1);
+	printf(", \"free_%s\": %u, \"free_inodes\": %u, "
+	       "\"directories\": %u, \"unused_inodes\": %u",
+	       EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					  EXT4_FEATURE_RO_COMPAT_BIGALLOC) ?
+	       "clusters" : "blocks",
+	       ext2fs_bg_free_blocks_count(fs, i),
+	       ext2fs_bg_free_inodes_count(fs, i),
+	       ext2fs_bg_used_dirs_count(fs, i),
+	       ext2fs_bg_itable_unused(fs, i));
+	if (block_bitmap) {
+		count_free(block_bitmap, fs->super->s_clusters_per_group,
+			   &runs, &longest);
+		printf(", \"free_block_extents\": %lu, "
+		       "\"max_free_extent\": %llu", runs,
+		       (unsigned long long) longest * EXT2FS_CLUSTER_RATIO(fs));
+	}
+	if (inode_bitmap) {
+		count_free(inode_bitmap, fs->super->s_inodes_per_group,
+			   &runs, &longest);
+		printf(", \"free_inode_ranges\": %lu", runs);
+	}
+	fputs("}\n", stdout);
+}
+
+static void list_desc (ext2_filsys fs, dgrp_t first_group, dgrp_t last_group)
 {
 	unsigned long i;
 	blk64_t	first_block, last_block;
@@ -159,9 +292,9 @@ static void list_desc (ext2_filsys fs)
 	int inode_blocks_per_group, old_desc_blocks, reserved_gdt;
 	int		block_nbytes, inode_nbytes;
 	int has_super;
-	blk64_t		blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
-	ext2_ino_t	ino_itr = 1;
-	errcode_t	retval;
+	blk64_t		blk_itr;
+	ext2_ino_t	ino_itr;
+	errcode_t	block_retval = 0, inode_retval = 0;
 
 	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 				       EXT4_FEATURE_RO_COMPAT_BIGALLOC))
@@ -180,13 +313,42 @@ static void list_desc (ext2_filsys fs)
 				  EXT2_BLOCK_SIZE(fs->super) - 1) /
 				 EXT2_BLOCK_SIZE(fs->super);
 	reserved_gdt = fs->super->s_reserved_gdt_blocks;
-	fputc('\n', stdout);
+	if (!json_format)
+		fputc('\n', stdout);
 	first_block = fs->super->s_first_data_block;
 	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
 		old_desc_blocks = fs->super->s_first_meta_bg;
 	else
 		old_desc_blocks = fs->desc_blocks;
-	for (i = 0; i < fs->group_desc_count; i++) {
+	for (i = first_group; i <= last_group; i++) {
+		blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block) +
+			(blk64_t) i * fs->super->s_clusters_per_group;
+		ino_itr = 1 + (ext2_ino_t) i * fs->super->s_inodes_per_group;
+
+		if (block_bitmap)
+			block_retval = ext2fs_get_block_bitmap_range2(
+				fs->block_map, blk_itr, block_nbytes << 3,
+				block_bitmap);
+		if (inode_bitmap)
+			inode_retval = ext2fs_get_inode_bitmap_range2(
+				fs->inode_map, ino_itr, inode_nbytes << 3,
+				inode_bitmap);
+
+		if (json_format) {
+			if (block_retval)
+				com_err("list_desc", block_retval,
+					"while reading block bitmap");
+			if (inode_retval)
+				com_err("list_desc", inode_retval,
+					"while reading inode bitmap");
+			print_group_json(fs, i,
+					 block_retval ? NULL : block_bitmap,
+					 inode_retval ? NULL : inode_bitmap,
+					 old_desc_blocks,
+					 inode_blocks_per_group);
+			continue;
+		}
+
 		first_block = ext2fs_group_first_block2(fs, i);
 		last_block = ext2fs_group_last_block2(fs, i);
 
@@ -256,10 +418,8 @@ static void list_desc (ext2_filsys fs)
 				ext2fs_bg_itable_unused(fs, i));
 		if (block_bitmap) {
 			fputs(_("  Free blocks: "), stdout);
-			retval = ext2fs_get_block_bitmap_range2(fs->block_map,
-				 blk_itr, block_nbytes << 3, block_bitmap);
-			if (retval)
-				com_err("list_desc", retval,
+			if (block_retval)
+				com_err("list_desc", block_retval,
 					"while reading block bitmap");
 			else
 				print_free(i, block_bitmap,
@@ -267,21 +427,17 @@ static void list_desc (ext2_filsys fs)
 					   fs->super->s_first_data_block,
 					   EXT2FS_CLUSTER_RATIO(fs));
 			fputc('\n', stdout);
-			blk_itr += fs->super->s_clusters_per_group;
 		}
 		if (inode_bitmap) {
 			fputs(_("  Free inodes: "), stdout);
-			retval = ext2fs_get_inode_bitmap_range2(fs->inode_map,
-				 ino_itr, inode_nbytes << 3, inode_bitmap);
-			if (retval)
-				com_err("list_desc", retval,
+			if (inode_retval)
+				com_err("list_desc", inode_retval,
 					"while reading inode bitmap");
 			else
 				print_free(i, inode_bitmap,
 					   fs->super->s_inodes_per_group,
 					   1, 1);
 			fputc('\n', stdout);
-			ino_itr += fs->super->s_inodes_per_group;
 		}
 	}
 	if (block_bitmap)
@@ -530,6 +686,9 @@ int main (int argc, char ** argv)
 	int		flags;
 	int		header_only = 0;
 	int		c;
+	char		*group_range = NULL, *p;
+	unsigned long	first_group = 0, last_group = ~0UL;
+	io_manager	io_ptr = unix_io_manager;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -544,7 +703,7 @@ int main (int argc, char ** argv)
 	if (argc && *argv)
 		program_name = *argv;
 
-	while ((c = getopt (argc, argv, "bfhixVo:")) != EOF) {
+	while ((c = getopt (argc, argv, "bfg:hijxVo:")) != EOF) {
 		switch (c) {
 		case 'b':
 			print_badblocks++;
@@ -552,12 +711,26 @@ int main (int argc, char ** argv)
 		case 'f':
 			force++;
 			break;
+		case 'g':
+			group_range = optarg;
+			first_group = last_group = strtoul(optarg, &p, 0);
+			if (*p == ':')
+				last_group = strtoul(p + 1, &p, 0);
+			if (*p || last_group < first_group) {
+				fprintf(stderr, _("Invalid group range: %s\n"),
+					optarg);
+				exit(1);
+			}
+			break;
 		case 'h':
 			header_only++;
 			break;
 		case 'i':
 			image_dump++;
 			break;
+		case 'j':
+			json_format++;
+			break;
 		case 'o':
 			parse_extended_opts(optarg, &use_superblock,
 					    &use_blocksize);
@@ -580,8 +753,14 @@ int main (int argc, char ** argv)
 	flags = EXT2_FLAG_JOURNAL_DEV_OK | EXT2_FLAG_SOFTSUPP_FEATURES | EXT2_FLAG_64BITS;
 	if (force)
 		flags |= EXT2_FLAG_FORCE;
+	if (header_only)
+		flags |= EXT2_FLAG_LAZY_DESC;
 	if (image_dump)
 		flags |= EXT2_FLAG_IMAGE_FILE;
+	else if (qcow2_io_probe(device_name))
+		io_ptr = qcow2_io_manager;
+	else if (http_io_probe(device_name))
+		io_ptr = http_io_manager;
 
 	if (use_superblock && !use_blocksize) {
 		for (use_blocksize = EXT2_MIN_BLOCK_SIZE;
@@ -589,14 +768,13 @@ int main (int argc, char ** argv)
 		     use_blocksize *= 2) {
 			retval = ext2fs_open (device_name, flags,
 					      use_superblock,
-					      use_blocksize, unix_io_manager,
-					      &fs);
+					      use_blocksize, io_ptr, &fs);
 			if (!retval)
 				break;
 		}
 	} else
 		retval = ext2fs_open (device_name, flags, use_superblock,
-				      use_blocksize, unix_io_manager, &fs);
+				      use_blocksize, io_ptr, &fs);
 	if (retval) {
 		com_err (program_name, retval, _("while trying to open %s"),
 			 device_name);
@@ -606,8 +784,33 @@ int main (int argc, char ** argv)
 	fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
 	if (fs->super->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
 		blocks64 = 1;
+	if (group_range && first_group >= fs->group_desc_count) {
+		fprintf(stderr, _("%s: group %lu does not exist: "
+				  "%s has %u groups\n"), program_name,
+			first_group, device_name, fs->group_desc_count);
+		ext2fs_close(fs);
+		exit(1);
+	}
+	if (last_group >= fs->group_desc_count)
+		last_group = fs->group_desc_count - 1;
 	if (print_badblocks) {
 		list_bad_blocks(fs, 1);
+	} else if (json_format) {
+		if (fs->super->s_feature_incompat &
+		    EXT3_FEATURE_INCOMPAT_JOURNAL_DEV) {
+			ext2fs_close(fs);
+			exit(0);
+		}
+		/*
+		 * One line per group can add up to a lot of output;
+		 * write it out in large pieces.
+		 */
+		setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+		retval = ext2fs_read_bitmaps (fs);
+		if (retval)
+			com_err(program_name, retval,
+				_("while reading bitmaps of %s"), device_name);
+		list_desc (fs, first_group, last_group);
 	} else {
 		list_super (fs->super);
 		if (fs->super->s_feature_incompat &
@@ -626,7 +829,7 @@ int main (int argc, char ** argv)
 			exit (0);
 		}
 		retval = ext2fs_read_bitmaps (fs);
-		list_desc (fs);
+		list_desc (fs, first_group, last_group);
 		if (retval) {
 			printf(_("\n%s: %s: error reading bitmaps: %s\n"),
 			       program_name, device_name,
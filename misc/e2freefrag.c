@@ -31,7 +31,7 @@ extern int optind;
 
 static void usage(const char *prog)
 {
-	fprintf(stderr, "usage: %s [-c chunksize in kb] [-h] "
+	fprintf(stderr, "usage: %s [-c chunksize in kb] [-j] [-h] "
 		"device_name\n", prog);
 #ifndef DEBUGFS
 	exit(1);
@@ -92,54 +92,140 @@ static void update_chunk_stats(struct chunk_info *info,
 	info->real_free_chunks++;
 }
 
+static void update_group_stats(ext2_filsys fs, struct chunk_info *info,
+			       blk64_t first, blk64_t last)
+{
+	struct group_free_info *gi;
+	dgrp_t group;
+	blk64_t group_end;
+	unsigned long len;
+
+	group = ext2fs_group_of_blk2(fs, first);
+	while (first < last) {
+		group_end = ext2fs_group_last_block2(fs, group) + 1;
+		len = (group_end < last ? group_end : last) - first;
+
+		gi = &info->groups[group];
+		gi->free_blocks += len;
+		gi->free_extents++;
+		if (len > gi->max_extent)
+			gi->max_extent = len;
+
+		first += len;
+		group++;
+	}
+}
+
+/*
+ * Walk the free extents of the bitmap with find_first_zero and
+ * find_first_set, which the bitmap backends implement a word (or an
+ * rbtree extent) at a time, instead of testing every block.
+ */
 static void scan_block_bitmap(ext2_filsys fs, struct chunk_info *info)
 {
-	unsigned long long blocks_count = ext2fs_blocks_count(fs->super);
-	unsigned long long chunks = (blocks_count + info->blks_in_chunk) >>
-				(info->chunkbits - info->blocksize_bits);
-	unsigned long long chunk_num;
-	unsigned long last_chunk_size = 0;
-	unsigned long long chunk_start_blk = 0;
-	int used;
-
-	for (chunk_num = 0; chunk_num < chunks; chunk_num++) {
-		unsigned long long blk, num_blks;
-		int chunk_free;
-
-		/* Last chunk may be smaller */
-		if (chunk_start_blk + info->blks_in_chunk > blocks_count)
-			num_blks = blocks_count - chunk_start_blk;
-		else
-			num_blks = info->blks_in_chunk;
+	blk64_t start = fs->super->s_first_data_block;
+	blk64_t end = ext2fs_blocks_count(fs->super) - 1;
+	blk64_t first, last;
+	unsigned long long first_chunk, last_chunk;
+
+	while (start <= end) {
+		if (ext2fs_find_first_zero_block_bitmap2(fs->block_map,
+							 start, end, &first))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map,
+							first, end, &last))
+			last = end + 1;
 
-		chunk_free = 0;
+		update_chunk_stats(info, last - first);
 
-		/* Initialize starting block for first chunk correctly else
-		 * there is a segfault when blocksize = 1024 in which case
-		 * block_map->start = 1 */
-		for (blk = 0; blk < num_blks; blk++, chunk_start_blk++) {
-			if (chunk_num == 0 && blk == 0) {
-				blk = fs->super->s_first_data_block;
-				chunk_start_blk = blk;
-			}
-			used = ext2fs_fast_test_block_bitmap2(fs->block_map,
-				chunk_start_blk >> fs->cluster_ratio_bits);
-			if (!used) {
-				last_chunk_size++;
-				chunk_free++;
-			}
+		/* The aligned chunks which are entirely in this extent */
+		first_chunk = (first + info->blks_in_chunk - 1) /
+			info->blks_in_chunk;
+		last_chunk = last / info->blks_in_chunk;
+		if (last_chunk > first_chunk)
+			info->free_chunks += last_chunk - first_chunk;
 
-			if (used && last_chunk_size != 0) {
-				update_chunk_stats(info, last_chunk_size);
-				last_chunk_size = 0;
-			}
-		}
+		if (info->groups)
+			update_group_stats(fs, info, first, last);
+
+		start = last + 1;
+	}
+}
 
-		if (chunk_free == info->blks_in_chunk)
-			info->free_chunks++;
+static void print_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char) *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * Print the report as a single JSON object, with the free space of
+ * each group, so that it can be collected and compared over time.
+ * Extent sizes are in blocks, except for the KB averages which match
+ * the text report.
+ */
+static void print_json(ext2_filsys fs, struct chunk_info *info, FILE *f)
+{
+	struct group_free_info *gi;
+	unsigned long long total_chunks;
+	dgrp_t group;
+	int i, sep = 0;
+
+	fprintf(f, "{\n  \"device\": ");
+	print_json_string(f, fs->device_name);
+	fprintf(f, ",\n  \"blocksize\": %u,\n", fs->blocksize);
+	fprintf(f, "  \"total_blocks\": %llu,\n  \"free_blocks\": %llu,\n",
+		ext2fs_blocks_count(fs->super),
+		ext2fs_free_blocks_count(fs->super));
+	if (info->chunkbytes) {
+		total_chunks = (ext2fs_blocks_count(fs->super) +
+				info->blks_in_chunk) >>
+			(info->chunkbits - info->blocksize_bits);
+		fprintf(f, "  \"chunksize\": %lu,\n"
+			"  \"total_chunks\": %llu,\n"
+			"  \"free_chunks\": %lu,\n",
+			info->chunkbytes, total_chunks, info->free_chunks);
+	}
+	fprintf(f, "  \"min_free_extent_kb\": %lu,\n"
+		"  \"max_free_extent_kb\": %lu,\n"
+		"  \"avg_free_extent_kb\": %lu,\n"
+		"  \"free_extents\": %lu,\n",
+		info->min, info->max, info->avg, info->real_free_chunks);
+
+	fprintf(f, "  \"histogram\": [");
+	for (i = 1; i < MAX_HIST; i++) {
+		if (info->histogram.fc_chunks[i] == 0)
+			continue;
+		fprintf(f, "%s\n    { \"min_blocks\": %llu, ", sep ? "," : "",
+			1ULL << (i - 1));
+		if (i == MAX_HIST - 1)
+			fprintf(f, "\"max_blocks\": null, ");
+		else
+			fprintf(f, "\"max_blocks\": %llu, ", (1ULL << i) - 1);
+		fprintf(f, "\"free_extents\": %lu, \"free_blocks\": %lu }",
+			info->histogram.fc_chunks[i],
+			info->histogram.fc_blocks[i]);
+		sep = 1;
+	}
+	fprintf(f, "\n  ],\n");
+
+	fprintf(f, "  \"groups\": [");
+	for (group = 0; group < fs->group_desc_count; group++) {
+		gi = &info->groups[group];
+		fprintf(f, "%s\n    { \"group\": %u, \"free_blocks\": %lu, "
+			"\"free_extents\": %lu, \"max_free_extent\": %lu }",
+			group ? "," : "", group, gi->free_blocks,
+			gi->free_extents, gi->max_extent);
 	}
-	if (last_chunk_size != 0)
-		update_chunk_stats(info, last_chunk_size);
+	fprintf(f, "\n  ]\n}\n");
 }
 
 static errcode_t get_chunk_info(ext2_filsys fs, struct chunk_info *info,
@@ -153,6 +239,21 @@ static errcode_t get_chunk_info(ext2_filsys fs, struct chunk_info *info,
 
 	scan_block_bitmap(fs, info);
 
+	/* Display chunk information in KB */
+	if (info->real_free_chunks) {
+		unsigned int scale = fs->blocksize >> 10;
+		info->min = info->min * scale;
+		info->max = info->max * scale;
+		info->avg = info->avg / info->real_free_chunks * scale;
+	} else {
+		info->min = 0;
+	}
+
+	if (info->groups) {
+		print_json(fs, info, f);
+		return 0;
+	}
+
 	fprintf(f, "Total blocks: %llu\nFree blocks: %u (%0.1f%%)\n",
 		ext2fs_blocks_count(fs->super), fs->super->s_free_blocks_count,
 		(double)fs->super->s_free_blocks_count * 100 /
@@ -169,16 +270,6 @@ static errcode_t get_chunk_info(ext2_filsys fs, struct chunk_info *info,
 			(double)info->free_chunks * 100 / total_chunks);
 	}
 
-	/* Display chunk information in KB */
-	if (info->real_free_chunks) {
-		unsigned int scale = fs->blocksize >> 10;
-		info->min = info->min * scale;
-		info->max = info->max * scale;
-		info->avg = info->avg / info->real_free_chunks * scale;
-	} else {
-		info->min = 0;
-	}
-
 	fprintf(f, "\nMin. free extent: %lu KB \nMax. free extent: %lu KB\n"
 		"Avg. free extent: %lu KB\n", info->min, info->max, info->avg);
 	fprintf(f, "Num. free extent: %lu\n", info->real_free_chunks);
@@ -224,8 +315,10 @@ static void collect_info(ext2_filsys fs, struct chunk_info *chunk_info, FILE *f)
 {
 	unsigned int retval = 0;
 
-	fprintf(f, "Device: %s\n", fs->device_name);
-	fprintf(f, "Blocksize: %u bytes\n", fs->blocksize);
+	if (!chunk_info->groups) {
+		fprintf(f, "Device: %s\n", fs->device_name);
+		fprintf(f, "Blocksize: %u bytes\n", fs->blocksize);
+	}
 
 	retval = ext2fs_read_block_bitmap(fs);
 	if (retval) {
@@ -271,7 +364,8 @@ int main(int argc, char *argv[])
 	ext2_filsys fs = NULL;
 	char *progname;
 	char *end;
-	int c;
+	int c, json = 0;
+	errcode_t retval;
 
 #ifdef DEBUGFS
 	if (check_fs_open(argv[0]))
@@ -284,7 +378,7 @@ int main(int argc, char *argv[])
 	progname = argv[0];
 	memset(&chunk_info, 0, sizeof(chunk_info));
 
-	while ((c = getopt(argc, argv, "c:h")) != EOF) {
+	while ((c = getopt(argc, argv, "c:hj")) != EOF) {
 		switch (c) {
 		case 'c':
 			chunk_info.chunkbytes = strtoull(optarg, &end, 0);
@@ -301,6 +395,9 @@ int main(int argc, char *argv[])
 			}
 			chunk_info.chunkbytes *= 1024;
 			break;
+		case 'j':
+			json = 1;
+			break;
 		case 'h':
 		default:
 			usage(progname);
@@ -326,7 +423,18 @@ int main(int argc, char *argv[])
 			"to filesystem blocksize.\n", progname);
 		exit(1);
 	}
+	if (json) {
+		retval = ext2fs_get_arrayzero(fs->group_desc_count,
+					      sizeof(struct group_free_info),
+					      &chunk_info.groups);
+		if (retval) {
+			com_err(progname, retval,
+				"while allocating group statistics");
+			exit(1);
+		}
+	}
 	collect_info(fs, &chunk_info, stdout);
+	ext2fs_free_mem(&chunk_info.groups);
 #ifndef DEBUGFS
 	close_device(device_name, fs);
 
@@ -8,6 +8,13 @@ struct free_chunk_histogram {
 	unsigned long fc_blocks[MAX_HIST];
 };
 
+/* Free space of one block group, for -j */
+struct group_free_info {
+	unsigned long free_blocks;
+	unsigned long free_extents;	/* counting extents split by the group */
+	unsigned long max_extent;	/* in blocks */
+};
+
 struct chunk_info {
 	unsigned long chunkbytes;	/* chunk size in bytes */
 	int chunkbits;			/* chunk size in bits */
@@ -17,4 +24,5 @@ struct chunk_info {
 	int blks_in_chunk;		/* number of blocks in a chunk */
 	unsigned long min, max, avg;	/* chunk size stats */
 	struct free_chunk_histogram histogram; /* histogram of all chunk sizes*/
+	struct group_free_info *groups;	/* per group stats, only with -j */
 };
@@ -35,6 +35,9 @@ extern int optind;
 #include <sys/types.h>
 #include <assert.h>
 #include <signal.h>
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
@@ -71,6 +74,10 @@ static char move_mode;
 static char show_progress;
 static char *check_buf;
 static int skipped_blocks;
+static char dedup_flag;
+static char digest_flag;
+static char *base_image;
+static io_channel base_io;
 
 static blk64_t align_offset(blk64_t offset, unsigned int n)
 {
@@ -97,12 +104,21 @@ static int get_bits_from_size(size_t size)
 
 static void usage(void)
 {
-	fprintf(stderr, _("Usage: %s [ -r|Q ] [ -fr ] device image-file\n"),
+	fprintf(stderr, _("Usage: %s [ -r|Q ] [ -fr ] [ -Dk ] device "
+			  "image-file\n"),
 		program_name);
+	fprintf(stderr, _("       %s -Q [ -f ] -d base-image device "
+			  "image-file\n"), program_name);
 	fprintf(stderr, _("       %s -I device image-file\n"), program_name);
 	fprintf(stderr, _("       %s -ra  [  -cfnp  ] [ -o src_offset ] "
 			  "[ -O dest_offset ] src_fs [ dest_fs ]\n"),
 		program_name);
+	fprintf(stderr, _("       %s -ra  [ -fp ] -P streams [ -o src_offset ] "
+			  "[ -O dest_offset ] src_fs dest_fs\n"),
+		program_name);
+	fprintf(stderr, _("       %s -ra  [  -cfnp  ] [ -j journal ] "
+			  "[ -o src_offset ] [ -O dest_offset ] fs\n"),
+		program_name);
 	exit (1);
 }
 
@@ -355,33 +371,30 @@ static void use_inode_shortcuts(ext2_filsys fs, int use_shortcuts)
 }
 
 static int process_dir_block(ext2_filsys fs EXT2FS_ATTR((unused)),
-			     blk64_t *block_nr,
-			     e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
-			     blk64_t ref_block EXT2FS_ATTR((unused)),
-			     int ref_offset EXT2FS_ATTR((unused)),
-			     void *priv_data EXT2FS_ATTR((unused)))
+			     blk64_t lblk EXT2FS_ATTR((unused)),
+			     blk64_t pblk, __u32 len, int flags,
+			     void *priv_data)
 {
 	struct process_block_struct *p;
 
 	p = (struct process_block_struct *) priv_data;
 
-	ext2fs_mark_block_bitmap2(meta_block_map, *block_nr);
-	meta_blocks_count++;
-	if (scramble_block_map && p->is_dir && blockcnt >= 0)
-		ext2fs_mark_block_bitmap2(scramble_block_map, *block_nr);
+	ext2fs_mark_block_bitmap_range2(meta_block_map, pblk, len);
+	meta_blocks_count += len;
+	if (scramble_block_map && p->is_dir &&
+	    !(flags & EXT2_EXTENT_ITERATE_METADATA))
+		ext2fs_mark_block_bitmap_range2(scramble_block_map, pblk, len);
 	return 0;
 }
 
 static int process_file_block(ext2_filsys fs EXT2FS_ATTR((unused)),
-			      blk64_t *block_nr,
-			      e2_blkcnt_t blockcnt,
-			      blk64_t ref_block EXT2FS_ATTR((unused)),
-			      int ref_offset EXT2FS_ATTR((unused)),
+			      blk64_t lblk EXT2FS_ATTR((unused)),
+			      blk64_t pblk, __u32 len, int flags,
 			      void *priv_data EXT2FS_ATTR((unused)))
 {
-	if (blockcnt < 0 || all_data) {
-		ext2fs_mark_block_bitmap2(meta_block_map, *block_nr);
-		meta_blocks_count++;
+	if ((flags & EXT2_EXTENT_ITERATE_METADATA) || all_data) {
+		ext2fs_mark_block_bitmap_range2(meta_block_map, pblk, len);
+		meta_blocks_count += len;
 	}
 	return 0;
 }
@@ -553,21 +566,152 @@ static int print_progress(blk64_t num, blk64_t total)
 		      calc_percent(num, total));
 }
 
+static void update_progress(blk64_t written, blk64_t total, int blocksize,
+			    time_t start_time, time_t *last_update,
+			    int *bscount)
+{
+	time_t duration;
+
+	if (*last_update == time(NULL))
+		return;
+	*last_update = time(NULL);
+	while ((*bscount)--)
+		fputc('\b', stderr);
+	*bscount = print_progress(written, total);
+	duration = time(NULL) - start_time;
+	if (duration > 5 && written) {
+		time_t est = (duration * total / written) - duration;
+		char buff[30];
+		strftime(buff, 30, "%T", gmtime(&est));
+		*bscount += fprintf(stderr, _(" %s remaining at %.2f MB/s"),
+				    buff, calc_rate(written, blocksize,
+						    duration));
+	}
+	fflush (stderr);
+}
+
+static void finish_progress(blk64_t written, blk64_t total, int blocksize,
+			    time_t start_time, int bscount)
+{
+	time_t duration = time(NULL) - start_time;
+	char buff[30];
+
+	while (bscount--)
+		fputc('\b', stderr);
+	strftime(buff, 30, "%T", gmtime(&duration));
+	fprintf(stderr, _("\b\b\b\b\b\b\b\bCopied %llu / %llu "
+		 "blocks (%d%%) in %s at %.2f MB/s       \n"),
+	       written, total, calc_percent(written, total), buff,
+	       calc_rate(written, blocksize, duration));
+}
+
+/* Say how many requests the source device got, and how long they took */
+static void print_io_requests(ext2_filsys fs)
+{
+	io_stats	stats = 0;
+
+	if (!fs->io->manager->get_stats ||
+	    fs->io->manager->get_stats(fs->io, &stats) || !stats ||
+	    stats->num_fields < IO_STATS_NUM_FIELDS)
+		return;
+	fprintf(stderr, _("%llu reads (50%% under %lluus, 99%% under %lluus) "
+			  "from the file system\n"), stats->reads,
+		io_stats_latency(stats->read_latency, 0, 50),
+		io_stats_latency(stats->read_latency, 0, 99));
+}
+
+/* Metadata is read in runs of up to this many bytes */
+#define META_RUN_BYTES	(4 * 1024 * 1024)
+
+static int meta_run_blocks(ext2_filsys fs)
+{
+	return META_RUN_BYTES / fs->blocksize;
+}
+
+/*
+ * Read the run of blocks in meta_block_map which starts at blk, up to
+ * max blocks and not past end, with a single I/O, and ask for the run
+ * after it to be read ahead meanwhile.  A block which cannot be read
+ * is reported and comes back zeroed.  Returns the number of blocks
+ * read.
+ */
+static blk64_t read_meta_run(ext2_filsys fs, blk64_t blk, blk64_t end,
+			     char *buf, blk64_t max)
+{
+	blk64_t		last = blk + max - 1, next, stop, i, count;
+	errcode_t	retval;
+
+	if (last >= end)
+		last = end - 1;
+	if (ext2fs_find_first_zero_block_bitmap2(meta_block_map, blk, last,
+						 &next))
+		next = last + 1;
+	count = next - blk;
+
+	retval = io_channel_read_blk64(fs->io, blk, count, buf);
+	if (retval) {
+		for (i = 0; i < count; i++) {
+			retval = io_channel_read_blk64(fs->io, blk + i, 1,
+						buf + i * fs->blocksize);
+			if (retval) {
+				com_err(program_name, retval,
+					_("error reading block %llu"),
+					blk + i);
+				memset(buf + i * fs->blocksize, 0,
+				       fs->blocksize);
+			}
+		}
+	}
+
+	if (next < end &&
+	    !ext2fs_find_first_set_block_bitmap2(meta_block_map, next,
+						 end - 1, &next)) {
+		last = next + max - 1;
+		if (last >= end)
+			last = end - 1;
+		if (ext2fs_find_first_zero_block_bitmap2(meta_block_map, next,
+							 last, &stop))
+			stop = last + 1;
+		io_channel_cache_readahead(fs->io, next, stop - next);
+	}
+	return count;
+}
+
+/*
+ * Write count blocks which are contiguous both in buf and in the
+ * output with one write().
+ */
+static void write_blocks(int fd, char *buf, blk64_t blk, blk64_t count,
+			 int blocksize)
+{
+	blk64_t	i;
+
+	if (nop_flag) {
+		for (i = 0; i < count; i++)
+			generic_write(fd, buf + i * blocksize, blocksize,
+				      blk + i);
+		return;
+	}
+	generic_write(fd, buf, count * blocksize, blk);
+}
+
 static void output_meta_data_blocks(ext2_filsys fs, int fd, int flags)
 {
 	errcode_t	retval;
 	blk64_t		blk;
 	char		*buf, *zero_buf;
 	int		sparse = 0;
-	blk64_t		start = 0;
-	blk64_t		distance = 0;
 	blk64_t		end = ext2fs_blocks_count(fs->super);
 	time_t		last_update = 0;
 	time_t		start_time = 0;
 	blk64_t		total_written = 0;
 	int		bscount = 0;
+	char		*run_buf, *pend_buf = 0;
+	blk64_t		run_start = 0, run_count = 0;
+	blk64_t		pend_start = 0, pend_count = 0;
 
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	retval = ext2fs_get_array(meta_run_blocks(fs), fs->blocksize,
+				  &run_buf);
 	if (retval) {
 		com_err(program_name, retval, _("while allocating buffer"));
 		exit(1);
@@ -584,74 +728,25 @@ static void output_meta_data_blocks(ext2_filsys fs, int fd, int flags)
 		last_update = time(NULL);
 		start_time = time(NULL);
 	}
-	/* when doing an in place move to the right, you can't start
-	   at the beginning or you will overwrite data, so instead
-	   divide the fs up into distance size chunks and write them
-	   in reverse. */
-	if (move_mode && dest_offset > source_offset) {
-		distance = (dest_offset - source_offset) / fs->blocksize;
-		if (distance < ext2fs_blocks_count(fs->super))
-			start = ext2fs_blocks_count(fs->super) - distance;
-	}
-	if (move_mode)
-		signal (SIGINT, sigint_handler);
-more_blocks:
-	if (distance)
-		seek_set(fd, (start * fs->blocksize) + dest_offset);
-	for (blk = start; blk < end; blk++) {
-		if (got_sigint) {
-			if (distance) {
-				/* moving to the right */
-				if (distance >= ext2fs_blocks_count(fs->super) ||
-				    start == ext2fs_blocks_count(fs->super) - distance)
-					kill (getpid(), SIGINT);
-			} else {
-				/* moving to the left */
-				if (blk < (source_offset - dest_offset) / fs->blocksize)
-					kill (getpid(), SIGINT);
-			}
-			if (show_progress)
-				fputc('\r', stderr);
-			fprintf(stderr,
-				_("Stopping now will destroy the filesystem, "
-				 "interrupt again if you are sure\n"));
-			if (show_progress) {
-				fprintf(stderr, _("Copying "));
-				bscount = print_progress(total_written,
-							 meta_blocks_count);
-				fflush(stderr);
-			}
-
-			got_sigint = 0;
-		}
-		if (show_progress && last_update != time(NULL)) {
-			time_t duration;
-			last_update = time(NULL);
-			while (bscount--)
-				fputc('\b', stderr);
-			bscount = print_progress(total_written,
-						 meta_blocks_count);
-			duration = time(NULL) - start_time;
-			if (duration > 5) {
-				time_t est = (duration * meta_blocks_count /
-					      total_written) - duration;
-				char buff[30];
-				strftime(buff, 30, "%T", gmtime(&est));
-				bscount += fprintf(stderr,
-						   _(" %s remaining at %.2f MB/s"),
-						   buff, calc_rate(total_written,
-								   fs->blocksize,
-								   duration));
-			}
-			fflush (stderr);
-		}
+	for (blk = 0; blk < end; blk++) {
+		if (show_progress)
+			update_progress(total_written, meta_blocks_count,
+					fs->blocksize, start_time,
+					&last_update, &bscount);
 		if ((blk >= fs->super->s_first_data_block) &&
 		    ext2fs_test_block_bitmap2(meta_block_map, blk)) {
-			retval = io_channel_read_blk64(fs->io, blk, 1, buf);
-			if (retval) {
-				com_err(program_name, retval,
-					_("error reading block %llu"), blk);
+			if (blk < run_start || blk >= run_start + run_count) {
+				/* pend_buf points into run_buf */
+				if (pend_count)
+					write_blocks(fd, pend_buf, pend_start,
+						     pend_count,
+						     fs->blocksize);
+				pend_count = 0;
+				run_start = blk;
+				run_count = read_meta_run(fs, blk, end,
+						run_buf, meta_run_blocks(fs));
 			}
+			buf = run_buf + (blk - run_start) * fs->blocksize;
 			total_written++;
 			if (scramble_block_map &&
 			    ext2fs_test_block_bitmap2(scramble_block_map, blk))
@@ -662,13 +757,25 @@ more_blocks:
 			if (sparse)
 				seek_relative(fd, sparse);
 			sparse = 0;
-			if (check_block(fd, buf, check_buf, fs->blocksize)) {
+			if (!check_buf) {
+				/* Written out with its neighbours later */
+				if (!pend_count) {
+					pend_start = blk;
+					pend_buf = buf;
+				}
+				pend_count++;
+			} else if (check_block(fd, buf, check_buf,
+					       fs->blocksize)) {
 				seek_relative(fd, fs->blocksize);
 				skipped_blocks++;
 			} else
 				generic_write(fd, buf, fs->blocksize, blk);
 		} else {
 		sparse_write:
+			if (pend_count)
+				write_blocks(fd, pend_buf, pend_start,
+					     pend_count, fs->blocksize);
+			pend_count = 0;
 			if (fd == 1) {
 				if (!nop_flag)
 					generic_write(fd, zero_buf,
@@ -682,43 +789,18 @@ more_blocks:
 			}
 		}
 	}
-	if (distance && start) {
-		if (start < distance) {
-			end = start;
-			start = 0;
-		} else {
-			end -= distance;
-			start -= distance;
-			if (end < distance) {
-				/* past overlap, do rest in one go */
-				end = start;
-				start = 0;
-			}
-		}
-		sparse = 0;
-		goto more_blocks;
-	}
-	signal (SIGINT, SIG_DFL);
+	if (pend_count)
+		write_blocks(fd, pend_buf, pend_start, pend_count,
+			     fs->blocksize);
+	pend_count = 0;
 	if (show_progress) {
-		time_t duration = time(NULL) - start_time;
-		char buff[30];
-		while (bscount--)
-			fputc('\b', stderr);
-		strftime(buff, 30, "%T", gmtime(&duration));
-		fprintf(stderr, _("\b\b\b\b\b\b\b\bCopied %llu / %llu "
-			 "blocks (%llu%%) in %s at %.2f MB/s       \n"),
-		       total_written, meta_blocks_count,
-		       calc_percent(total_written, meta_blocks_count), buff,
-		       calc_rate(total_written, fs->blocksize, duration));
+		finish_progress(total_written, meta_blocks_count,
+				fs->blocksize, start_time, bscount);
+		print_io_requests(fs);
 	}
 #ifdef HAVE_FTRUNCATE64
 	if (sparse) {
-		ext2_loff_t offset;
-		if (distance)
-			offset = seek_set(fd,
-					  fs->blocksize * ext2fs_blocks_count(fs->super) + dest_offset);
-		else
-			offset = seek_relative(fd, sparse);
+		ext2_loff_t offset = seek_relative(fd, sparse);
 
 		if (ftruncate64(fd, offset) < 0) {
 			seek_relative(fd, -1);
@@ -726,158 +808,789 @@ more_blocks:
 		}
 	}
 #else
-	if (sparse && !distance) {
+	if (sparse) {
 		seek_relative(fd, sparse-1);
 		generic_write(fd, zero_buf, 1, NO_BLK);
 	}
 #endif
 	ext2fs_free_mem(&zero_buf);
-	ext2fs_free_mem(&buf);
+	ext2fs_free_mem(&run_buf);
 }
 
-static void init_l1_table(struct ext2_qcow2_image *image)
-{
-	__u64 *l1_table;
-	errcode_t ret;
+/*
+ * An in-place move copies the file system a chunk at a time, reading
+ * each chunk in full before writing any of it, in an order which never
+ * overwrites a block before it has been read: from the end backwards
+ * when moving to the right, from the start forwards when moving to the
+ * left.
+ *
+ * With -j, the progress of the move is kept in a journal file, so that
+ * a move which was interrupted, or cut short by a crash, can be resumed
+ * by running the same command again.  The journal header says how far
+ * the move has got; it is kept in two copies, written in turn, so that
+ * a torn write leaves the other one.  A chunk whose destination
+ * overlaps its own source is saved in the journal before it is written,
+ * since it could not be read again if the write did not finish.
+ */
+#define MOVE_CHUNK_BYTES	(8 * 1024 * 1024)
+#define MOVE_JOURNAL_MAGIC	0x45324d56	/* "E2MV" */
+#define MOVE_JOURNAL_HDR_SIZE	512
+#define MOVE_JOURNAL_DATA	4096	/* where a saved chunk goes */
+
+struct move_journal {
+	__u32	magic;
+	__u32	blocksize;
+	__u64	src_offset;
+	__u64	dest_offset;
+	__u64	blocks_count;
+	__u64	seq;
+	__u64	done;		/* the boundary of the blocks moved */
+	__u64	saved_start;	/* the chunk saved in the journal */
+	__u32	saved_count;	/* 0 if none */
+	__u32	saved_crc;
+	__u32	reserved;
+	__u32	crc;		/* of the fields above */
+};
 
-	ret = ext2fs_get_arrayzero(image->l1_size, sizeof(__u64), &l1_table);
-	if (ret) {
-		com_err(program_name, ret, _("while allocating l1 table"));
-		exit(1);
-	}
+static char *move_journal_name;
+static int move_journal_fd = -1;
+static struct move_journal move_jnl;	/* in cpu byte order */
 
-	image->l1_table = l1_table;
+static void move_fsync(int fd, const char *name)
+{
+	if (nop_flag || fsync(fd) == 0)
+		return;
+	com_err(program_name, errno, _("while syncing %s"), name);
+	exit(1);
 }
 
-static void init_l2_cache(struct ext2_qcow2_image *image)
+static void move_swab(struct move_journal *to, struct move_journal *from)
 {
-	unsigned int count, i;
-	struct ext2_qcow2_l2_cache *cache;
-	struct ext2_qcow2_l2_table *table;
-	errcode_t ret;
-
-	ret = ext2fs_get_arrayzero(1, sizeof(struct ext2_qcow2_l2_cache),
-				   &cache);
-	if (ret)
-		goto alloc_err;
-
-	count = (image->l1_size > L2_CACHE_PREALLOC) ? L2_CACHE_PREALLOC :
-		 image->l1_size;
+	to->magic = ext2fs_cpu_to_le32(from->magic);
+	to->blocksize = ext2fs_cpu_to_le32(from->blocksize);
+	to->src_offset = ext2fs_cpu_to_le64(from->src_offset);
+	to->dest_offset = ext2fs_cpu_to_le64(from->dest_offset);
+	to->blocks_count = ext2fs_cpu_to_le64(from->blocks_count);
+	to->seq = ext2fs_cpu_to_le64(from->seq);
+	to->done = ext2fs_cpu_to_le64(from->done);
+	to->saved_start = ext2fs_cpu_to_le64(from->saved_start);
+	to->saved_count = ext2fs_cpu_to_le32(from->saved_count);
+	to->saved_crc = ext2fs_cpu_to_le32(from->saved_crc);
+	to->reserved = 0;
+	to->crc = ext2fs_cpu_to_le32(from->crc);
+}
 
-	cache->count = count;
-	cache->free = count;
-	cache->next_offset = image->l2_offset;
+static __u32 move_journal_crc(struct move_journal *disk)
+{
+	return ext2fs_crc32c_le(~0, (unsigned char *) disk,
+				offsetof(struct move_journal, crc));
+}
 
-	for (i = 0; i < count; i++) {
-		ret = ext2fs_get_arrayzero(1,
-				sizeof(struct ext2_qcow2_l2_table), &table);
-		if (ret)
-			goto alloc_err;
+static void write_move_journal(void)
+{
+	struct move_journal disk;
 
-		ret = ext2fs_get_arrayzero(image->l2_size,
-						   sizeof(__u64), &table->data);
-		if (ret)
-			goto alloc_err;
+	if (nop_flag)
+		return;
+	move_jnl.seq++;
+	move_swab(&disk, &move_jnl);
+	disk.crc = ext2fs_cpu_to_le32(move_journal_crc(&disk));
+	if (pwrite(move_journal_fd, &disk, sizeof(disk),
+		   (move_jnl.seq & 1) * MOVE_JOURNAL_HDR_SIZE) !=
+	    sizeof(disk)) {
+		com_err(program_name, errno, _("while writing %s"),
+			move_journal_name);
+		exit(1);
+	}
+	move_fsync(move_journal_fd, move_journal_name);
+}
 
-		table->next = cache->free_head;
-		cache->free_head = table;
+/*
+ * Open the move journal, creating it if need be.  Returns 1 if it
+ * holds a move which is to be resumed.
+ */
+static int open_move_journal(void)
+{
+	struct move_journal disk, best;
+	int	i, found = 0;
+
+	memset(&best, 0, sizeof(best));
+	move_journal_fd = ext2fs_open_file(move_journal_name,
+					   O_CREAT | O_RDWR, 0600);
+	if (move_journal_fd < 0) {
+		com_err(program_name, errno, _("while trying to open %s"),
+			move_journal_name);
+		exit(1);
+	}
+	for (i = 0; i < 2; i++) {
+		if (pread(move_journal_fd, &disk, sizeof(disk),
+			  i * MOVE_JOURNAL_HDR_SIZE) != sizeof(disk) ||
+		    ext2fs_le32_to_cpu(disk.magic) != MOVE_JOURNAL_MAGIC ||
+		    ext2fs_le32_to_cpu(disk.crc) != move_journal_crc(&disk))
+			continue;
+		if (!found || ext2fs_le64_to_cpu(disk.seq) >
+		    ext2fs_le64_to_cpu(best.seq))
+			best = disk;
+		found = 1;
+	}
+	if (!found) {
+		if (lseek(move_journal_fd, 0, SEEK_END) > 0) {
+			com_err(program_name, 0,
+				_("%s is not an e2image move journal"),
+				move_journal_name);
+			exit(1);
+		}
+		return 0;
 	}
+	move_swab(&move_jnl, &best);
+	if (move_jnl.src_offset != source_offset ||
+	    move_jnl.dest_offset != dest_offset) {
+		com_err(program_name, 0,
+			_("%s is the journal of a move from offset %llu "
+			  "to %llu"), move_journal_name,
+			move_jnl.src_offset, move_jnl.dest_offset);
+		exit(1);
+	}
+	if (move_jnl.blocksize < EXT2_MIN_BLOCK_SIZE ||
+	    move_jnl.blocksize > EXT2_MAX_BLOCK_SIZE ||
+	    move_jnl.saved_count > MOVE_CHUNK_BYTES / move_jnl.blocksize) {
+		com_err(program_name, 0, _("%s is corrupt"),
+			move_journal_name);
+		exit(1);
+	}
+	return 1;
+}
 
-	image->l2_cache = cache;
-	return;
+static void move_read(int fd, char *buf, blk64_t blk, blk64_t count)
+{
+	int	bs = move_jnl.blocksize;
+	blk64_t	i;
 
-alloc_err:
-	com_err(program_name, ret, _("while allocating l2 cache"));
-	exit(1);
+	if (pread(fd, buf, count * bs, source_offset + blk * bs) ==
+	    (ssize_t) (count * bs))
+		return;
+	for (i = 0; i < count; i++) {
+		if (pread(fd, buf + i * bs, bs, source_offset + (blk + i) * bs)
+		    == bs)
+			continue;
+		com_err(program_name, errno, _("error reading block %llu"),
+			blk + i);
+		memset(buf + i * bs, 0, bs);
+	}
 }
 
-static void put_l2_cache(struct ext2_qcow2_image *image)
+static void move_write(int fd, char *buf, blk64_t blk, blk64_t count)
 {
-	struct ext2_qcow2_l2_cache *cache = image->l2_cache;
-	struct ext2_qcow2_l2_table *tmp, *table;
+	int	bs = move_jnl.blocksize;
+	blk64_t	i;
 
-	if (!cache)
+	seek_set(fd, dest_offset + blk * bs);
+	if (!check_buf) {
+		write_blocks(fd, buf, blk, count, bs);
 		return;
-
-	table = cache->free_head;
-	cache->free_head = NULL;
-again:
-	while (table) {
-		tmp = table;
-		table = table->next;
-		ext2fs_free_mem(&tmp->data);
-		ext2fs_free_mem(&tmp);
 	}
-
-	if (cache->free != cache->count) {
-		fprintf(stderr, _("Warning: There are still tables in the "
-				  "cache while putting the cache, data will "
-				  "be lost so the image may not be valid.\n"));
-		table = cache->used_head;
-		cache->used_head = NULL;
-		goto again;
+	for (i = 0; i < count; i++, buf += bs) {
+		if (check_block(fd, buf, check_buf, bs)) {
+			seek_relative(fd, bs);
+			skipped_blocks++;
+		} else
+			generic_write(fd, buf, bs, blk + i);
 	}
+}
 
-	ext2fs_free_mem(&cache);
+/* Is the block to be copied?  Every block is, when resuming a move */
+static int move_block(ext2_filsys fs, blk64_t blk)
+{
+	if (!fs)
+		return 1;
+	return blk >= fs->super->s_first_data_block &&
+		ext2fs_test_block_bitmap2(meta_block_map, blk);
 }
 
-static int init_refcount(struct ext2_qcow2_image *img, blk64_t table_offset)
+/* Copy the chunk [start, end) */
+static blk64_t move_chunk(ext2_filsys fs, int fd, char *buf, int right,
+			  blk64_t start, blk64_t end)
 {
-	struct	ext2_qcow2_refcount	*ref;
-	blk64_t table_clusters;
-	errcode_t ret;
+	int	bs = move_jnl.blocksize;
+	__u64	distance = right ? dest_offset - source_offset :
+		source_offset - dest_offset;
+	blk64_t	blk, run, i, copied = 0;
+
+	for (blk = start; blk < end; blk += run) {
+		for (run = 0; blk + run < end && move_block(fs, blk + run);
+		     run++)
+			;
+		if (!run) {
+			run = 1;
+			continue;
+		}
+		move_read(fd, buf + (blk - start) * bs, blk, run);
+		for (i = blk; scramble_block_map && i < blk + run; i++)
+			if (ext2fs_test_block_bitmap2(scramble_block_map, i))
+				scramble_dir_block(fs, i,
+						   buf + (i - start) * bs);
+		copied += run;
+	}
+	if (!copied)
+		goto done;
+
+	if (move_journal_fd >= 0 && !nop_flag &&
+	    (end - start) * bs > distance) {
+		if (pwrite(move_journal_fd, buf, (end - start) * bs,
+			   MOVE_JOURNAL_DATA) != (ssize_t) ((end - start) * bs)) {
+			com_err(program_name, errno, _("while writing %s"),
+				move_journal_name);
+			exit(1);
+		}
+		move_fsync(move_journal_fd, move_journal_name);
+		move_jnl.saved_start = start;
+		move_jnl.saved_count = end - start;
+		move_jnl.saved_crc = ext2fs_crc32c_le(~0, (unsigned char *) buf,
+						      (end - start) * bs);
+		write_move_journal();
+	}
+
+	for (blk = start; blk < end; blk += run) {
+		for (run = 0; blk + run < end && move_block(fs, blk + run);
+		     run++)
+			;
+		if (!run) {
+			run = 1;
+			continue;
+		}
+		move_write(fd, buf + (blk - start) * bs, blk, run);
+	}
+done:
+	if (move_journal_fd >= 0) {
+		move_fsync(fd, device_name);
+		move_jnl.done = right ? start : end;
+		move_jnl.saved_count = 0;
+		write_move_journal();
+	}
+	return copied;
+}
 
-	ref = &(img->refcount);
+/*
+ * Move the file system, or with fs NULL, resume the move recorded in
+ * the journal.  The metadata which said which blocks are in use may
+ * have been overwritten by then, so a resumed move copies every block
+ * that has not been moved yet.
+ */
+static void move_blocks(ext2_filsys fs, int fd)
+{
+	int		right = dest_offset > source_offset;
+	blk64_t		start, end, count, chunk, total, copied = 0;
+	time_t		last_update = 0, start_time = 0;
+	int		bscount = 0, bs;
+	char		*buf;
+	errcode_t	retval;
+	struct stat	st;
+
+	if (fs) {
+		move_jnl.magic = MOVE_JOURNAL_MAGIC;
+		move_jnl.blocksize = fs->blocksize;
+		move_jnl.src_offset = source_offset;
+		move_jnl.dest_offset = dest_offset;
+		move_jnl.blocks_count = ext2fs_blocks_count(fs->super);
+		move_jnl.done = right ? move_jnl.blocks_count : 0;
+		total = meta_blocks_count;
+	} else
+		total = right ? move_jnl.done :
+			move_jnl.blocks_count - move_jnl.done;
+	bs = move_jnl.blocksize;
+	count = move_jnl.blocks_count;
+	chunk = MOVE_CHUNK_BYTES / bs;
 
-	/*
-	 * One refcount block addresses 2048 clusters, one refcount table
-	 * addresses cluster/sizeof(__u64) refcount blocks, and we need
-	 * to address meta_blocks_count clusters + qcow2 metadata clusters
-	 * in the worst case.
-	 */
-	table_clusters = meta_blocks_count + (table_offset >>
-					      img->cluster_bits);
-	table_clusters >>= (img->cluster_bits + 6 - 1);
-	table_clusters = (table_clusters == 0) ? 1 : table_clusters;
+	retval = ext2fs_get_array(chunk, bs, &buf);
+	if (retval) {
+		com_err(program_name, retval, _("while allocating buffer"));
+		exit(1);
+	}
 
-	ref->refcount_table_offset = table_offset;
-	ref->refcount_table_clusters = table_clusters;
-	ref->refcount_table_index = 0;
-	ref->refcount_block_index = 0;
+	/* Write the chunk which was saved in the journal again */
+	if (move_jnl.saved_count) {
+		blk64_t n = move_jnl.saved_count;
 
-	/* Allocate refcount table */
-	ret = ext2fs_get_arrayzero(ref->refcount_table_clusters,
-				   img->cluster_size, &ref->refcount_table);
-	if (ret)
-		return ret;
+		if (pread(move_journal_fd, buf, n * bs, MOVE_JOURNAL_DATA) !=
+		    (ssize_t) (n * bs) ||
+		    ext2fs_crc32c_le(~0, (unsigned char *) buf, n * bs) !=
+		    move_jnl.saved_crc) {
+			com_err(program_name, 0,
+				_("The chunk saved in %s is corrupt"),
+				move_journal_name);
+			exit(1);
+		}
+		move_write(fd, buf, move_jnl.saved_start, n);
+		move_fsync(fd, device_name);
+		move_jnl.done = right ? move_jnl.saved_start :
+			move_jnl.saved_start + n;
+		move_jnl.saved_count = 0;
+		write_move_journal();
+	} else if (fs && move_journal_fd >= 0)
+		write_move_journal();
 
-	/* Allocate refcount block */
-	ret = ext2fs_get_arrayzero(1, img->cluster_size, &ref->refcount_block);
-	if (ret)
-		ext2fs_free_mem(&ref->refcount_table);
+	if (show_progress) {
+		fprintf(stderr, _("Copying "));
+		bscount = print_progress(copied, total);
+		fflush(stderr);
+		last_update = time(NULL);
+		start_time = time(NULL);
+	}
+	signal (SIGINT, sigint_handler);
+	start = end = move_jnl.done;
+	while (right ? end > 0 : start < count) {
+		if (right)
+			start = (end > chunk) ? end - chunk : 0;
+		else
+			end = (count - start > chunk) ? start + chunk : count;
+		/* Have the next chunk read in while this one is written */
+#ifdef HAVE_POSIX_FADVISE
+		if (right && start)
+			posix_fadvise(fd, source_offset +
+				      (start - (start > chunk ? chunk : start)) *
+				      bs, (start > chunk ? chunk : start) * bs,
+				      POSIX_FADV_WILLNEED);
+		else if (!right && end < count)
+			posix_fadvise(fd, source_offset + end * bs,
+				      (count - end > chunk ? chunk :
+				       count - end) * bs,
+				      POSIX_FADV_WILLNEED);
+#endif
+		copied += move_chunk(fs, fd, buf, right, start, end);
+		if (right)
+			end = start;
+		else
+			start = end;
 
-	return ret;
+		if (show_progress)
+			update_progress(copied, total, bs, start_time,
+					&last_update, &bscount);
+		if (!got_sigint)
+			continue;
+		if (show_progress)
+			fputc('\r', stderr);
+		if (move_journal_fd >= 0) {
+			fprintf(stderr, _("Move interrupted; run e2image "
+					  "again with the same arguments to "
+					  "resume it\n"));
+			exit(1);
+		}
+		fprintf(stderr,
+			_("Stopping now will destroy the filesystem, "
+			 "interrupt again if you are sure\n"));
+		if (show_progress) {
+			fprintf(stderr, _("Copying "));
+			bscount = print_progress(copied, total);
+			fflush(stderr);
+		}
+		got_sigint = 0;
+	}
+	signal (SIGINT, SIG_DFL);
+	if (show_progress)
+		finish_progress(copied, total, bs, start_time, bscount);
+
+	/* An image file may have to be extended to its new end */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    (__u64) st.st_size < dest_offset + count * bs) {
+#ifdef HAVE_FTRUNCATE64
+		if (ftruncate64(fd, dest_offset + count * bs) < 0)
+#endif
+		{
+			char zero = 0;
+
+			seek_set(fd, dest_offset + count * bs - 1);
+			generic_write(fd, &zero, 1, NO_BLK);
+		}
+	}
+	move_fsync(fd, device_name);
+	if (move_journal_fd >= 0) {
+		close(move_journal_fd);
+		if (!nop_flag)
+			unlink(move_journal_name);
+	}
+	ext2fs_free_mem(&buf);
 }
 
-static int initialize_qcow2_image(int fd, ext2_filsys fs,
-			    struct ext2_qcow2_image *image)
-{
-	struct ext2_qcow2_hdr *header;
-	blk64_t total_size, offset;
-	int shift, l2_bits, header_size, l1_size, ret;
-	int cluster_bits = get_bits_from_size(fs->blocksize);
-	struct ext2_super_block *sb = fs->super;
+/*
+ * A clone (-ra with -P) trusts the block bitmap rather than walking
+ * every inode: the runs of blocks it marks in use are copied by several
+ * processes at once, each of which takes every nth chunk of the file
+ * system, and the free runs between them are discarded on the
+ * destination (or punched out of an image file) instead of written.
+ */
+#define CLONE_CHUNK_BYTES	(64 * 1024 * 1024)
+#define CLONE_MAX_STREAMS	32
 
-	/* Allocate header */
-	ret = ext2fs_get_memzero(sizeof(struct ext2_qcow2_hdr), &header);
-	if (ret)
-		return ret;
+static int clone_streams;
 
-	total_size = ext2fs_blocks_count(sb) << cluster_bits;
-	image->cluster_size = fs->blocksize;
-	image->l2_size = 1 << (cluster_bits - 3);
-	image->cluster_bits = cluster_bits;
-	image->fd = fd;
+static io_channel clone_open(const char *name, int flags, blk64_t offset,
+			     int blocksize)
+{
+	io_channel	io;
+	errcode_t	retval;
+	char		opt[64];
+
+	retval = unix_io_manager->open(name, flags, &io);
+	if (retval) {
+		com_err(program_name, retval, _("while trying to open %s"),
+			name);
+		exit(1);
+	}
+	io_channel_set_blksize(io, blocksize);
+	if (offset) {
+		sprintf(opt, "offset=%llu", (unsigned long long) offset);
+		retval = io_channel_set_options(io, opt);
+		if (retval) {
+			com_err(program_name, retval,
+				_("while setting the offset of %s"), name);
+			exit(1);
+		}
+	}
+	return io;
+}
+
+static void clone_run(io_channel src, io_channel dst, blk64_t blk,
+		      blk64_t end, char *buf, blk64_t max, int done_fd)
+{
+	errcode_t	retval;
+	blk64_t		count;
+
+	for (; blk < end; blk += count) {
+		count = end - blk;
+		if (count > max)
+			count = max;
+		retval = io_channel_read_blk64(src, blk, count, buf);
+		if (retval) {
+			com_err(program_name, retval,
+				_("error reading block %llu"), blk);
+			exit(1);
+		}
+		retval = io_channel_write_blk64(dst, blk, count, buf);
+		if (retval) {
+			com_err(program_name, retval,
+				_("error writing block %llu"), blk);
+			exit(1);
+		}
+		if (write(done_fd, &count, sizeof(count)) < 0)
+			exit(1);
+	}
+}
+
+/* Copy the chunks of one stream, saying how many blocks it has done */
+static void clone_stream(ext2_filsys fs, const char *image_fn, int stream,
+			 int done_fd)
+{
+	io_channel	src, dst;
+	errcode_t	retval;
+	blk64_t		chunk = CLONE_CHUNK_BYTES / fs->blocksize;
+	blk64_t		max = meta_run_blocks(fs);
+	blk64_t		first = fs->super->s_first_data_block;
+	blk64_t		end = ext2fs_blocks_count(fs->super);
+	blk64_t		start, stop, blk, used;
+	char		*buf;
+
+	retval = ext2fs_get_array(max, fs->blocksize, &buf);
+	if (retval) {
+		com_err(program_name, retval, _("while allocating buffer"));
+		exit(1);
+	}
+	src = clone_open(device_name, 0, source_offset, fs->blocksize);
+	dst = clone_open(image_fn, IO_FLAG_RW, dest_offset, fs->blocksize);
+
+	/* The boot block isn't in the bitmap */
+	if (stream == 0)
+		clone_run(src, dst, 0, first, buf, max, done_fd);
+	for (start = stream * chunk; start < end;
+	     start += clone_streams * chunk) {
+		stop = start + chunk;
+		if (stop > end)
+			stop = end;
+		blk = start < first ? first : start;
+		while (blk < stop) {
+			if (ext2fs_find_first_set_block_bitmap2(fs->block_map,
+							blk, stop - 1, &used))
+				used = stop;
+			/* Nothing there is worth keeping */
+			if (used > blk)
+				(void) io_channel_discard(dst, blk, used - blk);
+			if (used >= stop)
+				break;
+			if (ext2fs_find_first_zero_block_bitmap2(fs->block_map,
+							used, stop - 1, &blk))
+				blk = stop;
+			clone_run(src, dst, used, blk, buf, max, done_fd);
+		}
+	}
+	retval = io_channel_flush(dst);
+	if (retval) {
+		com_err(program_name, retval, _("while writing to %s"),
+			image_fn);
+		exit(1);
+	}
+	io_channel_close(dst);
+	io_channel_close(src);
+	ext2fs_free_mem(&buf);
+}
+
+static void clone_blocks(ext2_filsys fs, const char *image_fn, int fd)
+{
+	errcode_t	retval;
+	pid_t		pids[CLONE_MAX_STREAMS];
+	int		done[2], i, status, failed = 0, bscount = 0;
+	blk64_t		end = ext2fs_blocks_count(fs->super);
+	blk64_t		blk, next, count, total, written = 0;
+	time_t		last_update = 0, start_time = 0;
+	ssize_t		n;
+	struct stat	st;
+
+	retval = ext2fs_read_block_bitmap(fs);
+	if (retval) {
+		com_err(program_name, retval, _("while reading block bitmap"));
+		exit(1);
+	}
+	total = fs->super->s_first_data_block;
+	for (blk = total; blk < end; blk = next) {
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map, blk,
+							end - 1, &blk))
+			break;
+		if (ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk,
+							 end - 1, &next))
+			next = end;
+		total += next - blk;
+	}
+
+	if (pipe(done) < 0) {
+		com_err(program_name, errno, _("while creating a pipe"));
+		exit(1);
+	}
+	if (show_progress) {
+		fprintf(stderr, _("Copying "));
+		bscount = print_progress(written, total);
+		last_update = start_time = time(NULL);
+	}
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < clone_streams; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			com_err(program_name, errno,
+				_("while starting copy stream %d"), i);
+			exit(1);
+		}
+		if (pids[i] == 0) {
+			close(done[0]);
+			clone_stream(fs, image_fn, i, done[1]);
+			exit(0);
+		}
+	}
+	close(done[1]);
+	while ((n = read(done[0], &count, sizeof(count))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += count;
+		if (show_progress)
+			update_progress(written, total, fs->blocksize,
+					start_time, &last_update, &bscount);
+	}
+	close(done[0]);
+	for (i = 0; i < clone_streams; i++) {
+		while (waitpid(pids[i], &status, 0) < 0)
+			if (errno != EINTR) {
+				status = 1;
+				break;
+			}
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	}
+	if (failed) {
+		com_err(program_name, 0,
+			_("%d of the copy streams failed"), failed);
+		exit(1);
+	}
+	if (show_progress)
+		finish_progress(written, total, fs->blocksize, start_time,
+				bscount);
+
+	/* The destination is as large as the file system */
+	count = end * fs->blocksize;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    (__u64) st.st_size < dest_offset + count) {
+#ifdef HAVE_FTRUNCATE64
+		if (ftruncate64(fd, dest_offset + count) < 0)
+#endif
+		{
+			char zero = 0;
+
+			seek_set(fd, dest_offset + count - 1);
+			generic_write(fd, &zero, 1, NO_BLK);
+		}
+	}
+}
+
+static void init_l1_table(struct ext2_qcow2_image *image)
+{
+	__u64 *l1_table;
+	errcode_t ret;
+
+	ret = ext2fs_get_arrayzero(image->l1_size, sizeof(__u64), &l1_table);
+	if (ret) {
+		com_err(program_name, ret, _("while allocating l1 table"));
+		exit(1);
+	}
+
+	image->l1_table = l1_table;
+}
+
+static struct ext2_qcow2_l2_table *alloc_l2_table(
+					struct ext2_qcow2_image *image)
+{
+	struct ext2_qcow2_l2_table *table;
+	errcode_t ret;
+
+	ret = ext2fs_get_arrayzero(1, sizeof(struct ext2_qcow2_l2_table),
+				   &table);
+	if (!ret)
+		ret = ext2fs_get_arrayzero(image->l2_size, sizeof(__u64),
+					   &table->data);
+	if (ret) {
+		com_err(program_name, ret, _("while allocating l2 cache"));
+		exit(1);
+	}
+	image->l2_cache->allocated++;
+	return table;
+}
+
+static void init_l2_cache(struct ext2_qcow2_image *image)
+{
+	unsigned int count, i;
+	struct ext2_qcow2_l2_cache *cache;
+	struct ext2_qcow2_l2_table *table;
+	errcode_t ret;
+
+	ret = ext2fs_get_arrayzero(1, sizeof(struct ext2_qcow2_l2_cache),
+				   &cache);
+	if (ret)
+		goto alloc_err;
+
+	/*
+	 * The cache may grow to L2_CACHE_MEM, so that tables are
+	 * written out in large sorted batches rather than a few at a
+	 * time; only L2_CACHE_PREALLOC of them are allocated up front.
+	 */
+	count = L2_CACHE_MEM / image->cluster_size;
+	if (count < L2_CACHE_PREALLOC)
+		count = L2_CACHE_PREALLOC;
+	if (count > image->l1_size)
+		count = image->l1_size;
+	cache->count = count;
+	cache->next_offset = image->l2_offset;
+	image->l2_cache = cache;
+
+	if (count > L2_CACHE_PREALLOC)
+		count = L2_CACHE_PREALLOC;
+	for (i = 0; i < count; i++) {
+		table = alloc_l2_table(image);
+		table->next = cache->free_head;
+		cache->free_head = table;
+		cache->free++;
+	}
+	return;
+
+alloc_err:
+	com_err(program_name, ret, _("while allocating l2 cache"));
+	exit(1);
+}
+
+static void put_l2_cache(struct ext2_qcow2_image *image)
+{
+	struct ext2_qcow2_l2_cache *cache = image->l2_cache;
+	struct ext2_qcow2_l2_table *tmp, *table;
+
+	if (!cache)
+		return;
+
+	table = cache->free_head;
+	cache->free_head = NULL;
+again:
+	while (table) {
+		tmp = table;
+		table = table->next;
+		ext2fs_free_mem(&tmp->data);
+		ext2fs_free_mem(&tmp);
+	}
+
+	if (cache->free != cache->allocated) {
+		fprintf(stderr, _("Warning: There are still tables in the "
+				  "cache while putting the cache, data will "
+				  "be lost so the image may not be valid.\n"));
+		table = cache->used_head;
+		cache->used_head = NULL;
+		goto again;
+	}
+
+	ext2fs_free_mem(&cache);
+}
+
+static int init_refcount(struct ext2_qcow2_image *img, blk64_t table_offset)
+{
+	struct	ext2_qcow2_refcount	*ref;
+	blk64_t table_clusters;
+	errcode_t ret;
+
+	ref = &(img->refcount);
+
+	/*
+	 * One refcount block addresses 2048 clusters, one refcount table
+	 * addresses cluster/sizeof(__u64) refcount blocks, and we need
+	 * to address meta_blocks_count clusters + qcow2 metadata clusters
+	 * in the worst case.
+	 */
+	table_clusters = meta_blocks_count + (table_offset >>
+					      img->cluster_bits);
+	table_clusters >>= (img->cluster_bits + 6 - 1);
+	table_clusters = (table_clusters == 0) ? 1 : table_clusters;
+
+	ref->refcount_table_offset = table_offset;
+	ref->refcount_table_clusters = table_clusters;
+	ref->refcount_table_index = 0;
+	ref->refcount_block_index = 0;
+
+	/* Allocate refcount table */
+	ret = ext2fs_get_arrayzero(ref->refcount_table_clusters,
+				   img->cluster_size, &ref->refcount_table);
+	if (ret)
+		return ret;
+
+	/* Allocate refcount block */
+	ret = ext2fs_get_arrayzero(1, img->cluster_size, &ref->refcount_block);
+	if (ret)
+		ext2fs_free_mem(&ref->refcount_table);
+
+	return ret;
+}
+
+static int initialize_qcow2_image(int fd, ext2_filsys fs,
+			    struct ext2_qcow2_image *image)
+{
+	struct ext2_qcow2_hdr *header;
+	blk64_t total_size, offset;
+	int shift, l2_bits, header_size, l1_size, ret;
+	int cluster_bits = get_bits_from_size(fs->blocksize);
+	struct ext2_super_block *sb = fs->super;
+
+	/* Allocate header */
+	ret = ext2fs_get_memzero(sizeof(struct ext2_qcow2_hdr), &header);
+	if (ret)
+		return ret;
+
+	total_size = ext2fs_blocks_count(sb) << cluster_bits;
+	image->cluster_size = fs->blocksize;
+	image->l2_size = 1 << (cluster_bits - 3);
+	image->cluster_bits = cluster_bits;
+	image->fd = fd;
 
 	header->magic = ext2fs_cpu_to_be32(QCOW_MAGIC);
 	header->version = ext2fs_cpu_to_be32(QCOW_VERSION);
@@ -942,6 +1655,10 @@ static void free_qcow2_image(struct ext2_qcow2_image *img)
 		ext2fs_free_mem(&img->refcount.refcount_table);
 	if (img->refcount.refcount_block)
 		ext2fs_free_mem(&img->refcount.refcount_block);
+	if (img->refcount.pending)
+		ext2fs_free_mem(&img->refcount.pending);
+	if (img->refcount.pending_offset)
+		ext2fs_free_mem(&img->refcount.pending_offset);
 
 	put_l2_cache(img);
 
@@ -983,11 +1700,14 @@ static void flush_l2_cache(struct ext2_qcow2_image *image)
 	struct ext2_qcow2_l2_table *table = cache->used_head;
 	int fd = image->fd;
 
+	/* A differential image need not have any blocks of its own */
+	if (!table)
+		return;
+
 	/* Store current position */
 	offset = seek_relative(fd, 0);
 
-	assert(table);
-	while (cache->free < cache->count) {
+	while (cache->free < cache->allocated) {
 		if (seek != table->offset) {
 			seek_set(fd, table->offset);
 			seek = table->offset;
@@ -1015,8 +1735,15 @@ static void get_free_table(struct ext2_qcow2_image *image,
 	struct ext2_qcow2_l2_table *table;
 	struct ext2_qcow2_l2_cache *cache = image->l2_cache;
 
-	if (0 == cache->free)
-		flush_l2_cache(image);
+	if (0 == cache->free) {
+		if (cache->allocated < cache->count) {
+			table = alloc_l2_table(image);
+			table->next = cache->free_head;
+			cache->free_head = table;
+			cache->free++;
+		} else
+			flush_l2_cache(image);
+	}
 
 	table = cache->free_head;
 	assert(table);
@@ -1034,8 +1761,12 @@ static void get_free_table(struct ext2_qcow2_image *image,
 	*l2_table = table;
 }
 
+/*
+ * With shared set, the data cluster is referenced more than once and
+ * must not be flagged as copied.
+ */
 static int add_l2_item(struct ext2_qcow2_image *img, blk64_t blk,
-		       blk64_t data, blk64_t next)
+		       blk64_t data, blk64_t next, int shared)
 {
 	struct ext2_qcow2_l2_cache *cache = img->l2_cache;
 	struct ext2_qcow2_l2_table *table = cache->used_tail;
@@ -1057,10 +1788,64 @@ static int add_l2_item(struct ext2_qcow2_image *img, blk64_t blk,
 		ret++;
 	}
 
-	table->data[l2_index] = ext2fs_cpu_to_be64(data | QCOW_OFLAG_COPIED);
+	table->data[l2_index] = ext2fs_cpu_to_be64(shared ? data :
+						   data | QCOW_OFLAG_COPIED);
 	return ret;
 }
 
+/*
+ * Write out the full refcount blocks which have been held back.
+ * They were allocated in order, so this is a single pass forward
+ * through the image.
+ */
+static void flush_refcount_blocks(int fd, struct ext2_qcow2_image *img)
+{
+	struct	ext2_qcow2_refcount	*ref = &img->refcount;
+	ext2_loff_t			offset;
+	__u32				i;
+
+	if (!ref->pending_count)
+		return;
+	offset = seek_relative(fd, 0);
+	for (i = 0; i < ref->pending_count; i++) {
+		seek_set(fd, ref->pending_offset[i]);
+		generic_write(fd, ref->pending + i * img->cluster_size,
+			      img->cluster_size, NO_BLK);
+	}
+	ref->pending_count = 0;
+	seek_set(fd, offset);
+}
+
+/*
+ * Hold on to a full refcount block rather than seeking back to write
+ * it right away.
+ */
+static void queue_refcount_block(int fd, struct ext2_qcow2_image *img)
+{
+	struct	ext2_qcow2_refcount	*ref = &img->refcount;
+	errcode_t			ret;
+
+	if (!ref->pending) {
+		ref->pending_max = REFCOUNT_PENDING_MEM / img->cluster_size;
+		ret = ext2fs_get_array(ref->pending_max, img->cluster_size,
+				       &ref->pending);
+		if (!ret)
+			ret = ext2fs_get_array(ref->pending_max,
+					       sizeof(__u64),
+					       &ref->pending_offset);
+		if (ret) {
+			com_err(program_name, ret,
+				_("while allocating refcount blocks"));
+			exit(1);
+		}
+	}
+	if (ref->pending_count == ref->pending_max)
+		flush_refcount_blocks(fd, img);
+	memcpy(ref->pending + ref->pending_count * img->cluster_size,
+	       ref->refcount_block, img->cluster_size);
+	ref->pending_offset[ref->pending_count++] = ref->refcount_block_offset;
+}
+
 static int update_refcount(int fd, struct ext2_qcow2_image *img,
 			   blk64_t offset, blk64_t rfblk_pos)
 {
@@ -1077,10 +1862,7 @@ static int update_refcount(int fd, struct ext2_qcow2_image *img,
 	 */
 	if (table_index != ref->refcount_table_index) {
 
-		seek_set(fd, ref->refcount_block_offset);
-
-		generic_write(fd, (char *)ref->refcount_block,
-			      img->cluster_size, NO_BLK);
+		queue_refcount_block(fd, img);
 		memset(ref->refcount_block, 0, img->cluster_size);
 
 		ref->refcount_table[ref->refcount_table_index] =
@@ -1106,6 +1888,7 @@ static int sync_refcount(int fd, struct ext2_qcow2_image *img)
 	struct	ext2_qcow2_refcount	*ref;
 
 	ref = &(img->refcount);
+	flush_refcount_blocks(fd, img);
 
 	ref->refcount_table[ref->refcount_table_index] =
 		ext2fs_cpu_to_be64(ref->refcount_block_offset);
@@ -1119,16 +1902,420 @@ static int sync_refcount(int fd, struct ext2_qcow2_image *img)
 	return 0;
 }
 
+/*
+ * With -D, a block which is identical to one already in the qcow2
+ * image is not written again: its L2 entry points at the earlier
+ * copy's cluster and that cluster's refcount goes up.  Blocks are
+ * looked up by crc32c, and a match is compared against the copy in
+ * the image before it is shared.  The earlier copy's refcount block
+ * and L2 table may have been written out by then, so their entries
+ * are corrected once the rest of the image is done.
+ */
+#define DEDUP_MAX_ENTRIES	(1UL << 22)
+
+struct dedup_entry {
+	__u32		crc;
+	__u32		refs;		/* 0 for an empty slot */
+	blk64_t		blk;		/* block of the first copy */
+	blk64_t		offset;		/* and its cluster in the image */
+};
+
+struct dedup_table {
+	struct dedup_entry	*ent;
+	unsigned long		mask;
+	unsigned long		used, max_used;
+	int			cluster_size;
+	char			*cmp_buf;
+};
+
+static struct dedup_table *dedup_init(struct ext2_qcow2_image *img)
+{
+	struct dedup_table	*dt;
+	unsigned long		size = 1024;
+	errcode_t		retval;
+
+	/* Keep the table at most half full */
+	while (size < 2 * meta_blocks_count && size < 2 * DEDUP_MAX_ENTRIES)
+		size <<= 1;
+
+	retval = ext2fs_get_memzero(sizeof(struct dedup_table), &dt);
+	if (!retval)
+		retval = ext2fs_get_arrayzero(size, sizeof(struct dedup_entry),
+					      &dt->ent);
+	if (!retval)
+		retval = ext2fs_get_mem(img->cluster_size, &dt->cmp_buf);
+	if (retval) {
+		com_err(program_name, retval,
+			_("while allocating dedup table"));
+		exit(1);
+	}
+	dt->mask = size - 1;
+	dt->max_used = size / 2;
+	dt->cluster_size = img->cluster_size;
+	return dt;
+}
+
+static void dedup_free(struct dedup_table *dt)
+{
+	ext2fs_free_mem(&dt->cmp_buf);
+	ext2fs_free_mem(&dt->ent);
+	ext2fs_free_mem(&dt);
+}
+
+/*
+ * Look for an earlier copy of buf.  If there is none, *ret_slot is
+ * where dedup_add() should record this one.
+ */
+static struct dedup_entry *dedup_find(struct dedup_table *dt, int fd,
+				      char *buf, __u32 crc,
+				      unsigned long *ret_slot)
+{
+	struct dedup_entry	*ent;
+	unsigned long		i;
+
+	for (i = crc & dt->mask; dt->ent[i].refs; i = (i + 1) & dt->mask) {
+		ent = &dt->ent[i];
+		if (ent->crc != crc || ent->refs == 0xFFFF)
+			continue;
+		if (pread(fd, dt->cmp_buf, dt->cluster_size, ent->offset) !=
+		    dt->cluster_size)
+			continue;
+		if (memcmp(dt->cmp_buf, buf, dt->cluster_size) == 0)
+			return ent;
+	}
+	*ret_slot = i;
+	return 0;
+}
+
+static void dedup_add(struct dedup_table *dt, unsigned long slot, __u32 crc,
+		      blk64_t blk, blk64_t offset)
+{
+	struct dedup_entry	*ent = &dt->ent[slot];
+
+	if (dt->used >= dt->max_used)
+		return;
+	ent->crc = crc;
+	ent->refs = 1;
+	ent->blk = blk;
+	ent->offset = offset;
+	dt->used++;
+}
+
+/*
+ * Give every shared cluster its real refcount, and clear the copied
+ * flag in the L2 entry of its first copy.
+ */
+static void dedup_fixup(struct dedup_table *dt, int fd,
+			struct ext2_qcow2_image *img)
+{
+	struct ext2_qcow2_refcount *ref = &img->refcount;
+	struct dedup_entry	*ent;
+	unsigned long		i;
+	blk64_t			pos;
+	__u16			refs;
+	__u64			l2_entry;
+
+	for (i = 0; i <= dt->mask; i++) {
+		ent = &dt->ent[i];
+		if (ent->refs < 2)
+			continue;
+
+		pos = ext2fs_be64_to_cpu(ref->refcount_table[ent->offset >>
+						(2 * img->cluster_bits - 1)]);
+		pos += ((ent->offset >> img->cluster_bits) &
+			((1 << (img->cluster_bits - 1)) - 1)) * sizeof(__u16);
+		refs = ext2fs_cpu_to_be16(ent->refs);
+		seek_set(fd, pos);
+		generic_write(fd, (char *) &refs, sizeof(refs), NO_BLK);
+
+		pos = ext2fs_be64_to_cpu(img->l1_table[ent->blk /
+						       img->l2_size]) &
+			~QCOW_OFLAG_COPIED;
+		pos += (ent->blk & (img->l2_size - 1)) * sizeof(__u64);
+		l2_entry = ext2fs_cpu_to_be64(ent->offset);
+		seek_set(fd, pos);
+		generic_write(fd, (char *) &l2_entry, sizeof(l2_entry),
+			      NO_BLK);
+	}
+}
+
+/*
+ * With -k or -d, a qcow2 image records the crc32c of each nonzero block
+ * it holds (see qcow2.h).  With -d, a block whose digest is the same as
+ * in the base image is read back from the base image, and if it is
+ * really unchanged it is left unmapped, so that it is read from the base
+ * image instead; a block which the base image has but which is now
+ * zero, or no longer metadata, is written as zeros.
+ */
+static struct ext2_qcow2_digest *digests, *base_digests;
+static blk64_t digests_count, digests_max, base_digests_count, base_pos;
+static char *backing_name;
+
+static void digest_add(blk64_t blk, __u32 crc)
+{
+	errcode_t	retval;
+	blk64_t		max;
+
+	if (digests_count == digests_max) {
+		max = digests_max ? 2 * digests_max : meta_blocks_count + 1024;
+		retval = ext2fs_resize_mem(digests_max * sizeof(*digests),
+					   max * sizeof(*digests), &digests);
+		if (retval) {
+			com_err(program_name, retval, "%s",
+				_("while allocating block digests"));
+			exit(1);
+		}
+		digests_max = max;
+	}
+	digests[digests_count].blk = blk;
+	digests[digests_count].crc = crc;
+	digests[digests_count].reserved = 0;
+	digests_count++;
+}
+
+/* Blocks are looked up in increasing order */
+static int base_digest(blk64_t blk, __u32 *crc)
+{
+	while (base_pos < base_digests_count &&
+	       base_digests[base_pos].blk < blk)
+		base_pos++;
+	if (base_pos == base_digests_count || base_digests[base_pos].blk != blk)
+		return 0;
+	*crc = base_digests[base_pos].crc;
+	return 1;
+}
+
+/* The header extension and the backing file name follow the header */
+#define DIGEST_EXT_OFFSET	sizeof(struct ext2_qcow2_hdr)
+#define BACKING_NAME_OFFSET	(DIGEST_EXT_OFFSET + \
+				 2 * sizeof(struct ext2_qcow2_ext) + \
+				 sizeof(struct ext2_qcow2_digest_ext))
+
+/*
+ * Write the digests in clusters from offset on, and the header
+ * extension which points at them.
+ */
+static void write_digests(ext2_filsys fs, int fd,
+			  struct ext2_qcow2_image *img, blk64_t offset)
+{
+	struct {
+		struct ext2_qcow2_ext		ext;
+		struct ext2_qcow2_digest_ext	digest;
+	} hdr_ext;
+	struct ext2_qcow2_digest *d;
+	__u32		crc = ~0;
+	blk64_t		i, n;
+
+	for (i = 0, d = digests; i < digests_count; i++, d++) {
+		d->blk = ext2fs_cpu_to_be64(d->blk);
+		d->crc = ext2fs_cpu_to_be32(d->crc);
+	}
+	offset = align_offset(offset, img->cluster_size);
+	seek_set(fd, offset);
+	for (i = 0; i < digests_count; i += n) {
+		n = digests_count - i;
+		if (n > 65536)
+			n = 65536;
+		crc = ext2fs_crc32c_le(crc, (unsigned char *) (digests + i),
+				       n * sizeof(*digests));
+		generic_write(fd, (char *) (digests + i),
+			      n * sizeof(*digests), NO_BLK);
+	}
+
+	memset(&hdr_ext, 0, sizeof(hdr_ext));
+	hdr_ext.ext.magic = ext2fs_cpu_to_be32(QCOW2_EXT_MAGIC_E2_DIGESTS);
+	hdr_ext.ext.len = ext2fs_cpu_to_be32(sizeof(hdr_ext.digest));
+	hdr_ext.digest.table_offset = ext2fs_cpu_to_be64(offset);
+	hdr_ext.digest.nr_digests = ext2fs_cpu_to_be64(digests_count);
+	hdr_ext.digest.table_crc = ext2fs_cpu_to_be32(crc);
+	memcpy(hdr_ext.digest.uuid, fs->super->s_uuid,
+	       sizeof(hdr_ext.digest.uuid));
+	seek_set(fd, DIGEST_EXT_OFFSET);
+	generic_write(fd, (char *) &hdr_ext, sizeof(hdr_ext), NO_BLK);
+}
+
+/*
+ * Read the digests of the base image given with -d, and work out how
+ * the image being written should name it.
+ */
+static void read_base_digests(ext2_filsys fs, const char *image_fn)
+{
+	struct ext2_qcow2_hdr	*hdr;
+	struct ext2_qcow2_ext	*ext;
+	struct ext2_qcow2_digest_ext *dext = 0;
+	struct stat		base_st, st;
+	char			*buf, *cp;
+	size_t			pos, end, len, dir_len;
+	errcode_t		retval;
+	blk64_t			i;
+	__u32			crc;
+	int			fd;
+
+	if (stat(base_image, &base_st) == 0 && stat(image_fn, &st) == 0 &&
+	    base_st.st_dev == st.st_dev && base_st.st_ino == st.st_ino) {
+		com_err(program_name, 0,
+			_("The base image can not also be the output"));
+		exit(1);
+	}
+	fd = ext2fs_open_file(base_image, O_RDONLY, 0);
+	if (fd < 0) {
+		com_err(program_name, errno, _("while trying to open %s"),
+			base_image);
+		exit(1);
+	}
+	hdr = qcow2_read_header(fd);
+	if (!hdr) {
+		com_err(program_name, 0, _("%s is not a QCOW2 image"),
+			base_image);
+		exit(1);
+	}
+	if ((1U << ext2fs_be32_to_cpu(hdr->cluster_bits)) != fs->blocksize ||
+	    ext2fs_be64_to_cpu(hdr->size) !=
+	    ext2fs_blocks_count(fs->super) * fs->blocksize)
+		goto not_this_fs;
+
+	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	if (retval) {
+		com_err(program_name, retval, "%s",
+			_("while allocating buffer"));
+		exit(1);
+	}
+	if (pread(fd, buf, fs->blocksize, 0) != (ssize_t) fs->blocksize) {
+		com_err(program_name, errno, _("while reading %s"), base_image);
+		exit(1);
+	}
+	end = fs->blocksize;
+	if (hdr->backing_file_offset &&
+	    ext2fs_be64_to_cpu(hdr->backing_file_offset) < end)
+		end = ext2fs_be64_to_cpu(hdr->backing_file_offset);
+	for (pos = DIGEST_EXT_OFFSET; pos + sizeof(*ext) <= end;
+	     pos += sizeof(*ext) + ((len + 7) & ~7)) {
+		ext = (struct ext2_qcow2_ext *) (buf + pos);
+		len = ext2fs_be32_to_cpu(ext->len);
+		if (ext->magic == QCOW2_EXT_MAGIC_END)
+			break;
+		if (ext2fs_be32_to_cpu(ext->magic) ==
+		    QCOW2_EXT_MAGIC_E2_DIGESTS && len >= sizeof(*dext) &&
+		    pos + sizeof(*ext) + sizeof(*dext) <= end) {
+			dext = (struct ext2_qcow2_digest_ext *) (ext + 1);
+			break;
+		}
+	}
+	if (!dext) {
+		com_err(program_name, 0,
+			_("%s has no block digests to compare against"),
+			base_image);
+		exit(1);
+	}
+	if (memcmp(dext->uuid, fs->super->s_uuid, sizeof(dext->uuid)))
+		goto not_this_fs;
+
+	base_digests_count = ext2fs_be64_to_cpu(dext->nr_digests);
+	if (base_digests_count > ext2fs_blocks_count(fs->super))
+		goto corrupt;
+	retval = ext2fs_get_array(base_digests_count + 1,
+				  sizeof(*base_digests), &base_digests);
+	if (retval) {
+		com_err(program_name, retval, "%s",
+			_("while allocating block digests"));
+		exit(1);
+	}
+	len = base_digests_count * sizeof(*base_digests);
+	if (pread(fd, base_digests, len,
+		  ext2fs_be64_to_cpu(dext->table_offset)) != (ssize_t) len)
+		goto corrupt;
+	crc = ext2fs_crc32c_le(~0, (unsigned char *) base_digests, len);
+	if (crc != ext2fs_be32_to_cpu(dext->table_crc))
+		goto corrupt;
+	for (i = 0; i < base_digests_count; i++) {
+		base_digests[i].blk = ext2fs_be64_to_cpu(base_digests[i].blk);
+		base_digests[i].crc = ext2fs_be32_to_cpu(base_digests[i].crc);
+		if (i && base_digests[i].blk <= base_digests[i - 1].blk)
+			goto corrupt;
+	}
+	ext2fs_free_mem(&buf);
+	free(hdr);
+	close(fd);
+
+	/* For comparing the blocks whose digests match */
+	retval = qcow2_io_manager->open(base_image, 0, &base_io);
+	if (retval) {
+		com_err(program_name, retval, _("while trying to open %s"),
+			base_image);
+		exit(1);
+	}
+	io_channel_set_blksize(base_io, fs->blocksize);
+
+	/*
+	 * The backing file name is taken relative to the directory of
+	 * the image; fall back to the absolute path of the base image
+	 * if it can't be found from there as given.
+	 */
+	backing_name = base_image;
+	cp = strrchr(image_fn, '/');
+	if (base_image[0] != '/' && cp) {
+		dir_len = cp - image_fn + 1;
+		retval = ext2fs_get_mem(dir_len + strlen(base_image) + 1, &buf);
+		if (retval) {
+			com_err(program_name, retval, "%s",
+				_("while allocating buffer"));
+			exit(1);
+		}
+		memcpy(buf, image_fn, dir_len);
+		strcpy(buf + dir_len, base_image);
+		if (stat(buf, &st) || st.st_dev != base_st.st_dev ||
+		    st.st_ino != base_st.st_ino)
+			backing_name = realpath(base_image, NULL);
+		ext2fs_free_mem(&buf);
+	}
+	if (!backing_name || strlen(backing_name) > 1023 ||
+	    BACKING_NAME_OFFSET + strlen(backing_name) > fs->blocksize) {
+		com_err(program_name, 0,
+			_("The name of the base image %s is too long"),
+			base_image);
+		exit(1);
+	}
+	return;
+
+not_this_fs:
+	com_err(program_name, 0,
+		_("%s is not an image of this file system"), base_image);
+	exit(1);
+corrupt:
+	com_err(program_name, 0, _("The block digests in %s are corrupt"),
+		base_image);
+	exit(1);
+}
+
+/*
+ * A matching digest makes it likely that a block is unchanged since the
+ * base image; compare it with the base image's copy to be sure.
+ */
+static int same_as_base(ext2_filsys fs, blk64_t blk, const char *buf,
+			char *base_buf)
+{
+	if (io_channel_read_blk64(base_io, blk, 1, base_buf))
+		return 0;
+	return memcmp(buf, base_buf, fs->blocksize) == 0;
+}
+
 static void output_qcow2_meta_data_blocks(ext2_filsys fs, int fd)
 {
 	errcode_t		retval;
 	blk64_t			blk, offset, size, end;
-	char			*buf;
+	blk64_t			run_start = 0, run_count = 0;
+	char			*buf, *run_buf, *zero_buf, *base_buf = 0;
 	struct ext2_qcow2_image	*img;
 	unsigned int		header_size;
+	struct dedup_table	*dedup = 0;
+	struct dedup_entry	*dup;
+	__u32			crc = 0, zero_crc, base_crc = 0;
+	unsigned long		slot = 0;
+	int			in_base;
+	struct stat		st;
 
 	/* allocate  struct ext2_qcow2_image */
-	retval = ext2fs_get_mem(sizeof(struct ext2_qcow2_image), &img);
+	retval = ext2fs_get_memzero(sizeof(struct ext2_qcow2_image), &img);
 	if (retval) {
 		com_err(program_name, retval,
 			_("while allocating ext2_qcow2_image"));
@@ -1143,7 +2330,17 @@ static void output_qcow2_meta_data_blocks(ext2_filsys fs, int fd)
 	}
 	header_size = align_offset(sizeof(struct ext2_qcow2_hdr),
 				   img->cluster_size);
+	if (backing_name) {
+		img->hdr->backing_file_offset =
+			ext2fs_cpu_to_be64(BACKING_NAME_OFFSET);
+		img->hdr->backing_file_size =
+			ext2fs_cpu_to_be32(strlen(backing_name));
+	}
 	write_header(fd, img->hdr, sizeof(struct ext2_qcow2_hdr), header_size);
+	if (backing_name) {
+		seek_set(fd, BACKING_NAME_OFFSET);
+		generic_write(fd, backing_name, strlen(backing_name), NO_BLK);
+	}
 
 	/* Refcount all qcow2 related metadata up to refcount_block_offset */
 	end = img->refcount.refcount_block_offset;
@@ -1161,81 +2358,162 @@ static void output_qcow2_meta_data_blocks(ext2_filsys fs, int fd)
 	}
 	seek_set(fd, offset);
 
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	retval = ext2fs_get_array(meta_run_blocks(fs), fs->blocksize,
+				  &run_buf);
 	if (retval) {
 		com_err(program_name, retval, _("while allocating buffer"));
 		exit(1);
 	}
+	retval = ext2fs_get_memzero(fs->blocksize, &zero_buf);
+	if (retval) {
+		com_err(program_name, retval, _("while allocating buffer"));
+		exit(1);
+	}
+	if (base_io) {
+		retval = ext2fs_get_mem(fs->blocksize, &base_buf);
+		if (retval) {
+			com_err(program_name, retval,
+				_("while allocating buffer"));
+			exit(1);
+		}
+	}
+	zero_crc = ext2fs_crc32c_le(~0, (unsigned char *) zero_buf,
+				    fs->blocksize);
+	if (dedup_flag)
+		dedup = dedup_init(img);
+
 	/* Write qcow2 data blocks */
 	for (blk = 0; blk < ext2fs_blocks_count(fs->super); blk++) {
+		in_base = base_digests && base_digest(blk, &base_crc);
 		if ((blk >= fs->super->s_first_data_block) &&
 		    ext2fs_test_block_bitmap2(meta_block_map, blk)) {
-			retval = io_channel_read_blk64(fs->io, blk, 1, buf);
-			if (retval) {
-				com_err(program_name, retval,
-					_("error reading block %llu"), blk);
-				continue;
+			/* Blocks which can't be read come back zeroed */
+			if (blk >= run_start + run_count) {
+				run_start = blk;
+				run_count = read_meta_run(fs, blk,
+					ext2fs_blocks_count(fs->super),
+					run_buf, meta_run_blocks(fs));
 			}
+			buf = run_buf + (blk - run_start) * fs->blocksize;
 			if (scramble_block_map &&
 			    ext2fs_test_block_bitmap2(scramble_block_map, blk))
 				scramble_dir_block(fs, blk, buf);
-			if (check_zero_block(buf, fs->blocksize))
+		} else if (in_base)
+			buf = zero_buf;
+		else
+			continue;
+		if (buf == zero_buf || check_zero_block(buf, fs->blocksize)) {
+			/* Zeros hide what the base image has there */
+			if (!in_base)
 				continue;
-
-			if (update_refcount(fd, img, offset, offset)) {
-				/* Make space for another refcount block */
+			buf = zero_buf;
+			crc = zero_crc;
+		} else {
+			crc = ext2fs_crc32c_le(~0, (unsigned char *) buf,
+					       fs->blocksize);
+			if (digest_flag)
+				digest_add(blk, crc);
+			if (in_base && crc == base_crc &&
+			    same_as_base(fs, blk, buf, base_buf))
+				continue;
+		}
+		dup = 0;
+		if (dedup)
+			dup = dedup_find(dedup, fd, buf, crc, &slot);
+		if (dup) {
+			dup->refs++;
+			if (!add_l2_item(img, blk, dup->offset, offset,
+					 1))
+				continue;
+			/* offset is now taken by the next L2 table */
+			if (update_refcount(fd, img, offset,
+				offset + img->cluster_size)) {
 				offset += img->cluster_size;
-				seek_set(fd, offset);
-				/*
-				 * We have created the new refcount block, this
-				 * means that we need to refcount it as well.
-				 * So the previous update_refcount refcounted
-				 * the block itself and now we are going to
-				 * create refcount for data. New refcount
-				 * block should not be created!
-				 */
-				if (update_refcount(fd, img, offset, offset)) {
-					fprintf(stderr, _("Programming error: "
-						"multiple sequential refcount "
-						"blocks created!\n"));
+				if (update_refcount(fd, img, offset,
+						    offset)) {
+					fprintf(stderr,
+		_("Programming error: multiple sequential refcount "
+		  "blocks created!\n"));
 					exit(1);
 				}
 			}
+			offset += img->cluster_size;
+			seek_set(fd, offset);
+			continue;
+		}
 
-			generic_write(fd, buf, fs->blocksize, blk);
+		if (update_refcount(fd, img, offset, offset)) {
+			/* Make space for another refcount block */
+			offset += img->cluster_size;
+			seek_set(fd, offset);
+			/*
+			 * We have created the new refcount block, this
+			 * means that we need to refcount it as well.
+			 * So the previous update_refcount refcounted
+			 * the block itself and now we are going to
+			 * create refcount for data. New refcount
+			 * block should not be created!
+			 */
+			if (update_refcount(fd, img, offset, offset)) {
+				fprintf(stderr, _("Programming error: "
+					"multiple sequential refcount "
+					"blocks created!\n"));
+				exit(1);
+			}
+		}
 
-			if (add_l2_item(img, blk, offset,
-					offset + img->cluster_size)) {
+		generic_write(fd, buf, fs->blocksize, blk);
+
+		if (dedup)
+			dedup_add(dedup, slot, crc, blk, offset);
+
+		if (add_l2_item(img, blk, offset,
+				offset + img->cluster_size, 0)) {
+			offset += img->cluster_size;
+			if (update_refcount(fd, img, offset,
+				offset + img->cluster_size)) {
 				offset += img->cluster_size;
 				if (update_refcount(fd, img, offset,
-					offset + img->cluster_size)) {
-					offset += img->cluster_size;
-					if (update_refcount(fd, img, offset,
-							    offset)) {
-						fprintf(stderr,
-			_("Programming error: multiple sequential refcount "
-			  "blocks created!\n"));
-						exit(1);
-					}
+						    offset)) {
+					fprintf(stderr,
+		_("Programming error: multiple sequential refcount "
+		  "blocks created!\n"));
+					exit(1);
 				}
-				offset += img->cluster_size;
-				seek_set(fd, offset);
-				continue;
 			}
-
 			offset += img->cluster_size;
+			seek_set(fd, offset);
+			continue;
 		}
+
+		offset += img->cluster_size;
 	}
 	update_refcount(fd, img, offset, offset);
 	flush_l2_cache(img);
 	sync_refcount(fd, img);
+	if (dedup) {
+		dedup_fixup(dedup, fd, img);
+		dedup_free(dedup);
+	}
 
 	/* Write l1_table*/
 	seek_set(fd, img->l1_offset);
 	size = img->l1_size * sizeof(__u64);
 	generic_write(fd, (char *)img->l1_table, size, NO_BLK);
 
-	ext2fs_free_mem(&buf);
+	if (digest_flag) {
+		if (fstat(fd, &st) == 0 && (blk64_t) st.st_size > offset)
+			offset = st.st_size;
+		write_digests(fs, fd, img, offset + img->cluster_size);
+	}
+	if (base_io) {
+		io_channel_close(base_io);
+		base_io = 0;
+		ext2fs_free_mem(&base_buf);
+	}
+
+	ext2fs_free_mem(&zero_buf);
+	ext2fs_free_mem(&run_buf);
 	free_qcow2_image(img);
 }
 
@@ -1315,8 +2593,7 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags)
 		    (LINUX_S_ISLNK(inode.i_mode) &&
 		     ext2fs_inode_has_valid_blocks2(fs, &inode)) ||
 		    ino == fs->super->s_journal_inum) {
-			retval = ext2fs_block_iterate3(fs, ino,
-					BLOCK_FLAG_READ_ONLY, block_buf,
+			retval = ext2fs_extent_iterate(fs, ino, 0, block_buf,
 					process_dir_block, &pb);
 			if (retval) {
 				com_err(program_name, retval,
@@ -1329,9 +2606,8 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags)
 			    inode.i_block[EXT2_IND_BLOCK] ||
 			    inode.i_block[EXT2_DIND_BLOCK] ||
 			    inode.i_block[EXT2_TIND_BLOCK] || all_data) {
-				retval = ext2fs_block_iterate3(fs,
-				       ino, BLOCK_FLAG_READ_ONLY, block_buf,
-				       process_file_block, &pb);
+				retval = ext2fs_extent_iterate(fs, ino, 0,
+				       block_buf, process_file_block, &pb);
 				if (retval) {
 					com_err(program_name, retval,
 					_("while iterating over inode %u"), ino);
@@ -1344,6 +2620,8 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags)
 
 	if (type & E2IMAGE_QCOW2)
 		output_qcow2_meta_data_blocks(fs, fd);
+	else if (move_mode)
+		move_blocks(fs, fd);
 	else
 		output_meta_data_blocks(fs, fd, flags);
 
@@ -1417,6 +2695,55 @@ static void install_image(char *device, char *image_fn, int type)
 	ext2fs_close (fs);
 }
 
+/*
+ * qcow2_write_raw_image() only copies the clusters stored in the image
+ * itself; an image with a backing file is read through the qcow2 I/O
+ * manager instead, which follows the chain of backing files.
+ */
+static errcode_t qcow2_chain_write_raw_image(char *name, int raw_fd,
+					     struct ext2_qcow2_hdr *hdr)
+{
+	io_channel	io;
+	errcode_t	retval;
+	char		*buf = 0;
+	int		cluster_size = 1 << ext2fs_be32_to_cpu(hdr->cluster_bits);
+	__u64		image_size = ext2fs_be64_to_cpu(hdr->size);
+	__u64		pos;
+	int		len, skipped = 0;
+
+	retval = qcow2_io_manager->open(name, 0, &io);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(cluster_size, &buf);
+	if (retval)
+		goto out;
+	io_channel_set_blksize(io, 1);
+	seek_set(raw_fd, 0);
+	for (pos = 0; pos < image_size; pos += len) {
+		len = cluster_size;
+		if (image_size - pos < (__u64) len)
+			len = image_size - pos;
+		retval = io_channel_read_blk64(io, pos, -len, buf);
+		if (retval)
+			goto out;
+		skipped = check_zero_block(buf, len);
+		if (skipped)
+			seek_relative(raw_fd, len);
+		else
+			generic_write(raw_fd, buf, len, pos / cluster_size);
+	}
+	/* Resize the output image to the filesystem size */
+	if (skipped) {
+		seek_set(raw_fd, image_size - 1);
+		generic_write(raw_fd, NULL, 1, NO_BLK);
+	}
+out:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	io_channel_close(io);
+	return retval;
+}
+
 static struct ext2_qcow2_hdr *check_qcow2_image(int *fd, char *name)
 {
 
@@ -1432,7 +2759,7 @@ int main (int argc, char ** argv)
 	int c;
 	errcode_t retval;
 	ext2_filsys fs;
-	char *image_fn, offset_opt[64];
+	char *image_fn, offset_opt[64], *io_options, *open_opts;
 	struct ext2_qcow2_hdr *header = NULL;
 	int open_flag = EXT2_FLAG_64BITS;
 	int img_type = 0;
@@ -1443,7 +2770,9 @@ int main (int argc, char ** argv)
 	int ret = 0;
 	int ignore_rw_mount = 0;
 	int check = 0;
+	int resume = 0;
 	struct stat st;
+	char *tmp;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -1457,7 +2786,7 @@ int main (int argc, char ** argv)
 	if (argc && *argv)
 		program_name = *argv;
 	add_error_table(&et_ext2_error_table);
-	while ((c = getopt(argc, argv, "nrsIQafo:O:pc")) != EOF)
+	while ((c = getopt(argc, argv, "nrsIQaDd:fj:ko:O:pP:c")) != EOF)
 		switch (c) {
 		case 'I':
 			flags |= E2IMAGE_INSTALL_FLAG;
@@ -1478,9 +2807,21 @@ int main (int argc, char ** argv)
 		case 'a':
 			all_data = 1;
 			break;
+		case 'D':
+			dedup_flag = 1;
+			break;
+		case 'd':
+			base_image = optarg;
+			break;
 		case 'f':
 			ignore_rw_mount = 1;
 			break;
+		case 'j':
+			move_journal_name = optarg;
+			break;
+		case 'k':
+			digest_flag = 1;
+			break;
 		case 'n':
 			nop_flag = 1;
 			break;
@@ -1493,6 +2834,16 @@ int main (int argc, char ** argv)
 		case 'p':
 			show_progress = 1;
 			break;
+		case 'P':
+			clone_streams = strtoul(optarg, &tmp, 0);
+			if (*tmp || clone_streams < 1 ||
+			    clone_streams > CLONE_MAX_STREAMS) {
+				com_err(program_name, 0,
+					_("Invalid number of streams: %s"),
+					optarg);
+				exit(1);
+			}
+			break;
 		case 'c':
 			check = 1;
 			break;
@@ -1510,6 +2861,27 @@ int main (int argc, char ** argv)
 					   "with raw or QCOW2 images."));
 		exit(1);
 	}
+	if (dedup_flag && img_type != E2IMAGE_QCOW2) {
+		com_err(program_name, 0, _("-D option can only be used "
+					   "with QCOW2 images."));
+		exit(1);
+	}
+	if (base_image && img_type != E2IMAGE_QCOW2) {
+		com_err(program_name, 0, _("-d option can only be used "
+					   "with QCOW2 images."));
+		exit(1);
+	}
+	if (digest_flag && img_type != E2IMAGE_QCOW2) {
+		com_err(program_name, 0, _("-k option can only be used "
+					   "with QCOW2 images."));
+		exit(1);
+	}
+	/*
+	 * Blocks cleared since the base image are all the same, and the
+	 * new image can be the base of the next
+	 */
+	if (base_image)
+		dedup_flag = digest_flag = 1;
 	if ((source_offset || dest_offset) && img_type != E2IMAGE_RAW) {
 		com_err(program_name, 0,
 			_("Offsets are only allowed with raw images."));
@@ -1525,7 +2897,28 @@ int main (int argc, char ** argv)
 			_("Move mode requires all data mode."));
 		exit(1);
 	}
+	if (clone_streams && (img_type != E2IMAGE_RAW || !all_data ||
+			      move_mode)) {
+		com_err(program_name, 0,
+			_("-P option can only be used when copying a file "
+			  "system with -ra."));
+		exit(1);
+	}
+	if (clone_streams && (nop_flag ||
+			      (flags & E2IMAGE_SCRAMBLE_FLAG))) {
+		com_err(program_name, 0,
+			_("-P option can't be used with -n or -s."));
+		exit(1);
+	}
+	if (move_journal_name && !move_mode) {
+		com_err(program_name, 0,
+			_("-j option can only be used with move mode."));
+		exit(1);
+	}
 	device_name = argv[optind];
+	io_options = strchr(device_name, '?');
+	if (io_options)
+		*io_options++ = 0;
 	if (move_mode)
 		image_fn = device_name;
 	else image_fn = argv[optind+1];
@@ -1559,15 +2952,35 @@ int main (int argc, char ** argv)
 			goto skip_device;
 		}
 	}
+	if (move_journal_name && open_move_journal()) {
+		fprintf(stderr, _("Resuming the move recorded in %s\n"),
+			move_journal_name);
+		resume = 1;
+		goto skip_device;
+	}
 	sprintf(offset_opt, "offset=%llu", source_offset);
-	retval = ext2fs_open2(device_name, offset_opt, open_flag, 0, 0,
+	open_opts = offset_opt;
+	if (io_options) {
+		open_opts = malloc(strlen(offset_opt) + strlen(io_options) + 2);
+		if (!open_opts) {
+			com_err(program_name, ENOMEM, "%s",
+				_("while allocating I/O options"));
+			exit(1);
+		}
+		sprintf(open_opts, "%s&%s", offset_opt, io_options);
+	}
+	retval = ext2fs_open2(device_name, open_opts, open_flag, 0, 0,
 			      unix_io_manager, &fs);
+	if (open_opts != offset_opt)
+		free(open_opts);
         if (retval) {
 		com_err (program_name, retval, _("while trying to open %s"),
 			 device_name);
 		fputs(_("Couldn't find valid filesystem superblock.\n"), stdout);
 		exit(1);
 	}
+	if (base_image)
+		read_base_digests(fs, image_fn);
 
 skip_device:
 	if (strcmp(image_fn, "-") == 0)
@@ -1603,7 +3016,11 @@ skip_device:
 			output_is_blk = 1;
 	}
 	if (flags & E2IMAGE_IS_QCOW2_FLAG) {
-		ret = qcow2_write_raw_image(qcow2_fd, fd, header);
+		if (header->backing_file_offset)
+			ret = qcow2_chain_write_raw_image(device_name, fd,
+							  header);
+		else
+			ret = qcow2_write_raw_image(qcow2_fd, fd, header);
 		if (ret) {
 			if (ret == -QCOW_COMPRESSED)
 				fprintf(stderr, _("Image (%s) is compressed\n"),
@@ -1618,7 +3035,17 @@ skip_device:
 		}
 		goto out;
 	}
+	if (resume) {
+		move_blocks(NULL, fd);
+		goto out;
+	}
 
+	if (clone_streams && (check || fd == 1)) {
+		com_err(program_name, 0,
+			_("-P option can't be used with -c or when writing "
+			  "to stdout."));
+		exit(1);
+	}
 	if (check) {
 		if (img_type != E2IMAGE_RAW) {
 			fprintf(stderr, _("The -c option only supported "
@@ -1642,7 +3069,9 @@ skip_device:
 				  "in raw mode\n"));
 		exit(1);
 	}
-	if (img_type)
+	if (clone_streams)
+		clone_blocks(fs, image_fn, fd);
+	else if (img_type)
 		write_raw_image_file(fs, fd, img_type, flags);
 	else
 		write_image_file(fs, fd);
@@ -0,0 +1,453 @@
+/*
+ * e2ioreplay.c --- summarize an I/O trace, or replay it onto a device
+ *
+ * The traces are written by the trace I/O manager in libext2fs, for
+ * instance by "e2fsck -E io_trace=file".  Replaying one on another
+ * device reissues the same requests in the same order, either keeping
+ * the original spacing in time or as fast as the device allows, and
+ * reports how long they took compared with the original run.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#else
+extern char *optarg;
+extern int optind;
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "ext2fs/ext2fs.h"
+#include "ext2fs/trace_io.h"
+#include "nls-enable.h"
+
+#define MAX_TAGS	256
+
+struct replay_stats {
+	unsigned long long	ops;
+	unsigned long long	bytes_read;
+	unsigned long long	bytes_written;
+	unsigned long long	skipped;
+	unsigned long long	errors;
+	unsigned long long	traced_usec;	/* latency in the trace */
+	unsigned long long	replay_usec;	/* latency when replayed */
+};
+
+static const char *op_names[IO_TRACE_OP_MAX + 1] = {
+	"unknown", "open", "close", "set_blksize", "read", "write",
+	"write_byte", "flush", "discard", "readahead", "zeroout", "tag"
+};
+
+static char *prg_name;
+static char *tag_names[MAX_TAGS];
+static struct replay_stats tag_stats[MAX_TAGS];
+static struct replay_stats op_stats[IO_TRACE_OP_MAX + 1];
+
+static int dump, fast, do_writes, only_channel = -1;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		_("Usage: %s [-d] [-f] [-w] [-D] [-c channel] "
+		  "[-o io_options] trace_file [device]\n"), prg_name);
+	exit(1);
+}
+
+static unsigned long long now_usec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static const char *tag_name(int tag)
+{
+	if (tag && tag_names[tag])
+		return tag_names[tag];
+	return "-";
+}
+
+static int read_record(FILE *f, unsigned int record_size,
+		       struct io_trace_record *rec, char *name,
+		       unsigned int name_size)
+{
+	unsigned int	len, pad;
+	char		skip[256];
+
+	if (fread(rec, sizeof(struct io_trace_record), 1, f) != 1)
+		return 0;
+	/* Later versions may append fields we don't know about */
+	for (len = record_size - sizeof(struct io_trace_record); len;
+	     len -= pad) {
+		pad = len > sizeof(skip) ? sizeof(skip) : len;
+		if (fread(skip, pad, 1, f) != 1)
+			return 0;
+	}
+	rec->when = ext2fs_le64_to_cpu(rec->when);
+	rec->block = ext2fs_le64_to_cpu(rec->block);
+	rec->count = ext2fs_le64_to_cpu(rec->count);
+	rec->latency = ext2fs_le32_to_cpu(rec->latency);
+	rec->blksize = ext2fs_le32_to_cpu(rec->blksize);
+
+	name[0] = 0;
+	if (rec->op != IO_TRACE_OP_OPEN && rec->op != IO_TRACE_OP_TAG)
+		return 1;
+	len = rec->count;
+	pad = IO_TRACE_NAME_PAD(len);
+	if (pad >= name_size)
+		return 0;
+	if (pad && fread(name, pad, 1, f) != 1)
+		return 0;
+	name[len] = 0;
+	return 1;
+}
+
+static void dump_record(struct io_trace_record *rec, const char *name)
+{
+	const char *op = rec->op <= IO_TRACE_OP_MAX ? op_names[rec->op] :
+		op_names[0];
+
+	printf("%12.6f ch%-3u %-12s %-11s ", rec->when / 1000000.0,
+	       rec->channel, tag_name(rec->tag), op);
+	switch (rec->op) {
+	case IO_TRACE_OP_OPEN:
+		printf("%s flags 0x%llx\n", name,
+		       (unsigned long long) rec->block);
+		return;
+	case IO_TRACE_OP_TAG:
+		printf("%s\n", name);
+		return;
+	case IO_TRACE_OP_SET_BLKSIZE:
+		printf("%lld", (long long) rec->count);
+		break;
+	case IO_TRACE_OP_CLOSE:
+	case IO_TRACE_OP_FLUSH:
+		break;
+	default:
+		printf("%llu+%lld", (unsigned long long) rec->block,
+		       (long long) rec->count);
+		break;
+	}
+	printf(" %uus%s\n", rec->latency,
+	       (rec->flags & IO_TRACE_FLAG_ERROR) ? " error" : "");
+}
+
+/*
+ * Reissue one request on the device; returns 0 if it was skipped.
+ */
+static int replay_record(io_channel channel, struct io_trace_record *rec,
+			 char **buf, unsigned long long *buf_size,
+			 errcode_t *err, unsigned long long *bytes)
+{
+	unsigned long long size;
+	errcode_t	retval = 0;
+
+	if (rec->blksize && rec->blksize != (unsigned) channel->block_size) {
+		retval = io_channel_set_blksize(channel, rec->blksize);
+		if (retval) {
+			*err = retval;
+			return 1;
+		}
+	}
+
+	size = rec->count < 0 ? -rec->count :
+		(unsigned long long) rec->count * channel->block_size;
+	*bytes = 0;
+	switch (rec->op) {
+	case IO_TRACE_OP_READ:
+	case IO_TRACE_OP_WRITE:
+		if (rec->op == IO_TRACE_OP_WRITE && !do_writes)
+			return 0;
+		if (size > *buf_size) {
+			if (*buf)
+				ext2fs_free_mem(buf);
+			*buf_size = 0;
+			retval = io_channel_alloc_buf(channel,
+						      (int) rec->count, buf);
+			if (retval)
+				break;
+			memset(*buf, 0, size);
+			*buf_size = size;
+		}
+		if (rec->op == IO_TRACE_OP_READ)
+			retval = io_channel_read_blk64(channel, rec->block,
+						       rec->count, *buf);
+		else
+			retval = io_channel_write_blk64(channel, rec->block,
+							rec->count, *buf);
+		*bytes = size;
+		break;
+	case IO_TRACE_OP_WRITE_BYTE:
+		if (!do_writes)
+			return 0;
+		if ((unsigned long long) rec->count > *buf_size) {
+			if (*buf)
+				ext2fs_free_mem(buf);
+			*buf_size = 0;
+			retval = ext2fs_get_memzero(rec->count, buf);
+			if (retval)
+				break;
+			*buf_size = rec->count;
+		}
+		retval = io_channel_write_byte(channel, rec->block,
+					       rec->count, *buf);
+		*bytes = rec->count;
+		break;
+	case IO_TRACE_OP_FLUSH:
+		retval = io_channel_flush(channel);
+		break;
+	case IO_TRACE_OP_DISCARD:
+		if (!do_writes)
+			return 0;
+		retval = io_channel_discard(channel, rec->block, rec->count);
+		break;
+	case IO_TRACE_OP_ZEROOUT:
+		if (!do_writes)
+			return 0;
+		retval = io_channel_zeroout(channel, rec->block, rec->count);
+		*bytes = size;
+		break;
+	case IO_TRACE_OP_READAHEAD:
+		retval = io_channel_cache_readahead(channel, rec->block,
+						    rec->count);
+		break;
+	default:
+		return 0;
+	}
+	*err = retval;
+	return 1;
+}
+
+static void add_stats(struct replay_stats *s, struct io_trace_record *rec,
+		      unsigned long long bytes, unsigned long long usec,
+		      int skipped, errcode_t err)
+{
+	s->ops++;
+	s->traced_usec += rec->latency;
+	if (skipped) {
+		s->skipped++;
+		return;
+	}
+	s->replay_usec += usec;
+	if (err)
+		s->errors++;
+	else if (rec->op == IO_TRACE_OP_READ)
+		s->bytes_read += bytes;
+	else
+		s->bytes_written += bytes;
+}
+
+static void print_stats(const char *name, struct replay_stats *s,
+			int replayed)
+{
+	printf("%-12s %10llu %10.1f %10.1f %11.3f", name, s->ops,
+	       s->bytes_read / 1048576.0, s->bytes_written / 1048576.0,
+	       s->traced_usec / 1000000.0);
+	if (replayed)
+		printf(" %11.3f %8llu %6llu", s->replay_usec / 1000000.0,
+		       s->skipped, s->errors);
+	fputc('\n', stdout);
+}
+
+static void print_summary(int replayed, unsigned long long trace_usec,
+			  unsigned long long replay_usec)
+{
+	const char *hdr = "%-12s %10s %10s %10s %11s";
+	int	i;
+
+	printf(hdr, _("tag"), _("requests"), _("MB read"), _("MB written"),
+	       _("traced (s)"));
+	if (replayed)
+		printf(" %11s %8s %6s", _("replayed (s)"), _("skipped"),
+		       _("errors"));
+	fputc('\n', stdout);
+	for (i = 0; i < MAX_TAGS; i++)
+		if (tag_stats[i].ops)
+			print_stats(tag_name(i), &tag_stats[i], replayed);
+	fputc('\n', stdout);
+
+	printf(hdr, _("request"), _("count"), _("MB read"), _("MB written"),
+	       _("traced (s)"));
+	if (replayed)
+		printf(" %11s %8s %6s", _("replayed (s)"), _("skipped"),
+		       _("errors"));
+	fputc('\n', stdout);
+	for (i = 1; i <= IO_TRACE_OP_MAX; i++)
+		if (op_stats[i].ops)
+			print_stats(op_names[i], &op_stats[i], replayed);
+	fputc('\n', stdout);
+
+	printf(_("Traced run took %.3f seconds\n"), trace_usec / 1000000.0);
+	if (replayed)
+		printf(_("Replay took %.3f seconds%s\n"),
+		       replay_usec / 1000000.0,
+		       fast ? _(" at full speed") : "");
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_trace_header hdr;
+	struct io_trace_record rec;
+	io_channel	channel = 0;
+	io_manager	manager = unix_io_manager;
+	FILE		*f;
+	char		*device = 0, *io_options = 0, *buf = 0, *end;
+	char		name[4096];
+	unsigned long long buf_size = 0, start = 0, when, t, bytes;
+	unsigned long long last = 0, elapsed = 0;
+	unsigned int	record_size;
+	int		c, flags = 0, done;
+	errcode_t	retval;
+
+#ifdef ENABLE_NLS
+	setlocale(LC_MESSAGES, "");
+	setlocale(LC_CTYPE, "");
+	bindtextdomain(NLS_CAT_NAME, LOCALEDIR);
+	textdomain(NLS_CAT_NAME);
+	set_com_err_gettext(gettext);
+#endif
+	add_error_table(&et_ext2_error_table);
+
+	prg_name = argv[0];
+	while ((c = getopt(argc, argv, "c:dDfo:w")) != EOF) {
+		switch (c) {
+		case 'c':
+			only_channel = strtoul(optarg, &end, 0);
+			if (*end)
+				usage();
+			break;
+		case 'd':
+			dump = 1;
+			break;
+		case 'D':
+			flags |= IO_FLAG_DIRECT_IO;
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'o':
+			io_options = optarg;
+			break;
+		case 'w':
+			do_writes = 1;
+			flags |= IO_FLAG_RW;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc || argc - optind > 2)
+		usage();
+	if (argc - optind == 2)
+		device = argv[optind + 1];
+
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		com_err(prg_name, errno, _("while opening %s"), argv[optind]);
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, IO_TRACE_MAGIC, IO_TRACE_MAGIC_LEN)) {
+		fprintf(stderr, _("%s: %s is not an I/O trace\n"), prg_name,
+			argv[optind]);
+		exit(1);
+	}
+	record_size = ext2fs_le32_to_cpu(hdr.record_size);
+	if (record_size < sizeof(struct io_trace_record)) {
+		fprintf(stderr, _("%s: %s has records of unknown size %u\n"),
+			prg_name, argv[optind], record_size);
+		exit(1);
+	}
+
+	if (device) {
+		retval = manager->open(device, flags, &channel);
+		if (retval) {
+			com_err(prg_name, retval, _("while opening %s"),
+				device);
+			exit(1);
+		}
+		if (io_options) {
+			retval = io_channel_set_options(channel, io_options);
+			if (retval) {
+				com_err(prg_name, retval,
+					_("while setting I/O options %s"),
+					io_options);
+				exit(1);
+			}
+		}
+		start = now_usec();
+	}
+
+	while (read_record(f, record_size, &rec, name, sizeof(name))) {
+		if (rec.op == IO_TRACE_OP_TAG && !tag_names[rec.tag])
+			tag_names[rec.tag] = strdup(name);
+		if (only_channel >= 0 && rec.channel != only_channel)
+			continue;
+		if (dump)
+			dump_record(&rec, name);
+		if (rec.when + rec.latency > last)
+			last = rec.when + rec.latency;
+		if (rec.op == IO_TRACE_OP_OPEN || rec.op == IO_TRACE_OP_TAG ||
+		    rec.op == IO_TRACE_OP_CLOSE ||
+		    rec.op == IO_TRACE_OP_SET_BLKSIZE || rec.op > IO_TRACE_OP_MAX)
+			continue;
+
+		bytes = 0;
+		retval = 0;
+		done = 0;
+		t = 0;
+		if (channel) {
+			if (!fast) {
+				when = now_usec() - start;
+				if (rec.when > when)
+					usleep(rec.when - when);
+			}
+			t = now_usec();
+			done = replay_record(channel, &rec, &buf, &buf_size,
+					     &retval, &bytes);
+			t = now_usec() - t;
+		} else if (rec.op == IO_TRACE_OP_READ ||
+			   rec.op == IO_TRACE_OP_WRITE ||
+			   rec.op == IO_TRACE_OP_WRITE_BYTE) {
+			/* Account for the traced request instead */
+			bytes = rec.count < 0 ? -rec.count :
+				(unsigned long long) rec.count * rec.blksize;
+			done = 1;
+		}
+		add_stats(&tag_stats[rec.tag], &rec, bytes, t, !done, retval);
+		add_stats(&op_stats[rec.op], &rec, bytes, t, !done, retval);
+	}
+	if (ferror(f)) {
+		com_err(prg_name, errno, _("while reading %s"), argv[optind]);
+		exit(1);
+	}
+	fclose(f);
+
+	if (channel) {
+		elapsed = now_usec() - start;
+		retval = io_channel_close(channel);
+		if (retval)
+			com_err(prg_name, retval, _("while closing %s"),
+				device);
+	}
+	if (buf)
+		ext2fs_free_mem(&buf);
+
+	if (dump)
+		fputc('\n', stdout);
+	print_summary(channel != 0, last, elapsed);
+	remove_error_table(&et_ext2_error_table);
+	return 0;
+}
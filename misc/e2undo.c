@@ -19,8 +19,11 @@
 #if HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#include <string.h>
+#include <unistd.h>
 #include "ext2fs/tdb.h"
 #include "ext2fs/ext2fs.h"
+#include "ext2fs/undo_io.h"
 #include "nls-enable.h"
 
 static unsigned char mtime_key[] = "filesystem MTIME";
@@ -32,10 +35,97 @@ static char *prg_name;
 static void usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s <transaction file> <filesystem>\n"), prg_name);
+		_("Usage: %s [-f] [-n] <transaction file> <filesystem>\n"),
+		prg_name);
 	exit(1);
 }
 
+/*
+ * The saved blocks are restored in block order, and blocks which are
+ * adjacent on the device are gathered into one write of up to
+ * RESTORE_MAX_WRITE bytes, so undoing a large operation writes the
+ * device sequentially in big chunks.
+ */
+#define RESTORE_MAX_WRITE	(1024 * 1024)
+
+struct restore_state {
+	io_channel	channel;
+	int		dry_run;
+	blk64_t		block;		/* first block of the pending run */
+	char		*buf;
+	size_t		len;		/* bytes in the pending run */
+	size_t		size;		/* bytes allocated for buf */
+	unsigned long long writes;
+	unsigned long long bytes;
+	__u32		crc;		/* of everything restored, in order */
+};
+
+static errcode_t restore_flush(struct restore_state *rs)
+{
+	errcode_t	retval = 0;
+
+	if (!rs->len)
+		return 0;
+	rs->crc = ext2fs_crc32c_le(rs->crc, (unsigned char *) rs->buf,
+				   rs->len);
+	if (rs->dry_run)
+		printf(_("Would replay transaction of size %zu at "
+			 "location %llu\n"), rs->len, rs->block);
+	else {
+		printf(_("Replayed transaction of size %zu at location %llu\n"),
+		       rs->len, rs->block);
+		retval = io_channel_write_blk64(rs->channel, rs->block,
+						-(int) rs->len, rs->buf);
+		if (retval)
+			com_err(prg_name, retval,
+				_("while writing block %llu\n"), rs->block);
+	}
+	rs->writes++;
+	rs->bytes += rs->len;
+	rs->len = 0;
+	return retval;
+}
+
+/*
+ * Return where the len bytes saved for block go in the pending run,
+ * writing out the run first if they don't follow on from it.
+ */
+static errcode_t restore_space(struct restore_state *rs, blk64_t block,
+			       size_t len, char **ret)
+{
+	unsigned int	block_size = rs->channel->block_size;
+	errcode_t	retval;
+
+	if (rs->len && (rs->len % block_size ||
+			rs->block + rs->len / block_size != block ||
+			rs->len + len > RESTORE_MAX_WRITE)) {
+		retval = restore_flush(rs);
+		if (retval)
+			return retval;
+	}
+	if (rs->len + len > rs->size) {
+		retval = ext2fs_resize_mem(rs->size, rs->len + len, &rs->buf);
+		if (retval) {
+			com_err(prg_name, retval, "%s",
+				_("while allocating memory"));
+			return retval;
+		}
+		rs->size = rs->len + len;
+	}
+	if (!rs->len)
+		rs->block = block;
+	*ret = rs->buf + rs->len;
+	rs->len += len;
+	return 0;
+}
+
+static void restore_summary(struct restore_state *rs)
+{
+	printf(_("%s %llu bytes in %llu writes, checksum %08x\n"),
+	       rs->dry_run ? _("Would restore") : _("Restored"),
+	       rs->bytes, rs->writes, rs->crc);
+}
+
 static int check_filesystem(TDB_CONTEXT *tdb, io_channel channel)
 {
 	__u32   s_mtime;
@@ -117,17 +207,297 @@ static int set_blk_size(TDB_CONTEXT *tdb, io_channel channel)
 	return 0;
 }
 
+static errcode_t undo_pread(int fd, ext2_loff_t offset, void *buf,
+			    size_t size)
+{
+	ssize_t	actual;
+
+	if (ext2fs_llseek(fd, offset, SEEK_SET) != offset)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	actual = read(fd, buf, size);
+	if (actual < 0)
+		return errno;
+	if ((size_t) actual != size)
+		return EXT2_ET_SHORT_READ;
+	return 0;
+}
+
+static int undo_key_cmp(const void *a, const void *b)
+{
+	const struct undo_key *ka = a, *kb = b;
+
+	if (ka->block < kb->block)
+		return -1;
+	return ka->block > kb->block;
+}
+
+/*
+ * Read the index of an undo file, or rebuild it from the extents if
+ * the program writing the undo file never got to close it.  The keys
+ * are returned in cpu byte order, sorted by block.
+ */
+static errcode_t read_undo_keys(int fd, struct undo_header *hdr,
+				struct undo_key **ret_keys,
+				unsigned long long *ret_num)
+{
+	struct undo_extent extent;
+	struct undo_key *keys = 0, *key;
+	unsigned long long i, num = 0, max = 0;
+	ext2_loff_t	offset;
+	errcode_t	retval;
+	size_t		size;
+	char		*buf = 0;
+
+	if (ext2fs_le32_to_cpu(hdr->state) == E2UNDO_STATE_FINISHED) {
+		num = ext2fs_le64_to_cpu(hdr->num_keys);
+		size = num * sizeof(struct undo_key);
+		if (size / sizeof(struct undo_key) != num)
+			return EXT2_ET_UNDO_FILE_CORRUPT;
+		retval = ext2fs_get_mem(size ? size : 1, &keys);
+		if (retval)
+			return retval;
+		retval = undo_pread(fd, ext2fs_le64_to_cpu(hdr->index_offset),
+				    keys, size);
+		if (retval)
+			goto errout;
+		if (ext2fs_crc32c_le(~0, (unsigned char *) keys, size) !=
+		    ext2fs_le32_to_cpu(hdr->index_crc)) {
+			retval = EXT2_ET_UNDO_FILE_CORRUPT;
+			goto errout;
+		}
+		for (i = 0, key = keys; i < num; i++, key++) {
+			key->block = ext2fs_le64_to_cpu(key->block);
+			key->offset = ext2fs_le64_to_cpu(key->offset);
+			key->len = ext2fs_le32_to_cpu(key->len);
+			key->crc = ext2fs_le32_to_cpu(key->crc);
+		}
+		goto out;
+	}
+
+	/* Walk the extents up to the first one which was not completed */
+	offset = E2UNDO_HEADER_SIZE;
+	while (!undo_pread(fd, offset, &extent, sizeof(extent))) {
+		if (ext2fs_le32_to_cpu(extent.magic) != E2UNDO_EXTENT_MAGIC)
+			break;
+		size = ext2fs_le32_to_cpu(extent.len);
+		retval = ext2fs_resize_mem(0, size, &buf);
+		if (retval)
+			goto errout;
+		if (undo_pread(fd, offset + sizeof(extent), buf, size) ||
+		    ext2fs_crc32c_le(~0, (unsigned char *) buf, size) !=
+		    ext2fs_le32_to_cpu(extent.crc))
+			break;
+		if (num >= max) {
+			retval = ext2fs_resize_mem(max * sizeof(struct undo_key),
+					(max ? max * 2 : 1024) *
+					sizeof(struct undo_key), &keys);
+			if (retval)
+				goto errout;
+			max = max ? max * 2 : 1024;
+		}
+		key = keys + num++;
+		key->block = ext2fs_le64_to_cpu(extent.block);
+		key->offset = offset + sizeof(extent);
+		key->len = size;
+		key->crc = ext2fs_le32_to_cpu(extent.crc);
+		offset += sizeof(extent) + size;
+	}
+	if (keys)
+		qsort(keys, num, sizeof(struct undo_key), undo_key_cmp);
+out:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	*ret_keys = keys;
+	*ret_num = num;
+	return 0;
+
+errout:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	if (keys)
+		ext2fs_free_mem(&keys);
+	return retval;
+}
+
+/*
+ * Replay an undo file in the format described in undo_io.h.  The
+ * extents are written back in block order, so the device is written
+ * sequentially.
+ */
+static int replay_undo_file(int fd, struct undo_header *hdr,
+			    struct restore_state *rs, int force)
+{
+	struct ext2_super_block super;
+	struct undo_key *keys, *key;
+	io_channel	channel = rs->channel;
+	unsigned long long i, num;
+	unsigned int	block_size;
+	errcode_t	retval;
+	char		*buf;
+
+	if (ext2fs_crc32c_le(~0, (unsigned char *) hdr,
+			     offsetof(struct undo_header, header_crc)) !=
+	    ext2fs_le32_to_cpu(hdr->header_crc)) {
+		com_err(prg_name, EXT2_ET_UNDO_FILE_CORRUPT, "%s",
+			_("while reading the undo file header\n"));
+		return 1;
+	}
+
+	block_size = ext2fs_le32_to_cpu(hdr->block_size);
+	if (ext2fs_le32_to_cpu(hdr->state) != E2UNDO_STATE_FINISHED) {
+		if (!force) {
+			com_err(prg_name, 0, "%s",
+				_("The undo file was not closed properly; "
+				  "use -f to replay what it holds\n"));
+			return 1;
+		}
+	} else if (!force) {
+		io_channel_set_blksize(channel, SUPERBLOCK_OFFSET);
+		retval = io_channel_read_blk64(channel, 1, -SUPERBLOCK_SIZE,
+					       &super);
+		if (retval) {
+			com_err(prg_name, retval,
+				"%s", _("Failed to read the file system data \n"));
+			return 1;
+		}
+		if (super.s_mtime != hdr->fs_mtime) {
+			com_err(prg_name, 0,
+				_("The file system Mount time didn't match %u\n"),
+				hdr->fs_mtime);
+			return 1;
+		}
+		if (memcmp(super.s_uuid, hdr->fs_uuid, sizeof(super.s_uuid))) {
+			com_err(prg_name, 0, "%s",
+				_("The file system UUID didn't match \n"));
+			return 1;
+		}
+	}
+
+	retval = read_undo_keys(fd, hdr, &keys, &num);
+	if (retval) {
+		com_err(prg_name, retval, "%s",
+			_("while reading the undo file index\n"));
+		return 1;
+	}
+	if (!num)
+		goto out;
+	if (!block_size) {
+		com_err(prg_name, EXT2_ET_UNDO_FILE_CORRUPT, "%s",
+			_("while reading the undo file header\n"));
+		goto errout;
+	}
+	io_channel_set_blksize(channel, block_size);
+
+	for (i = 0, key = keys; i < num; i++, key++) {
+		if (restore_space(rs, key->block, key->len, &buf))
+			goto errout;
+		retval = undo_pread(fd, key->offset, buf, key->len);
+		if (!retval &&
+		    ext2fs_crc32c_le(~0, (unsigned char *) buf, key->len) !=
+		    key->crc)
+			retval = EXT2_ET_UNDO_FILE_CORRUPT;
+		if (retval) {
+			com_err(prg_name, retval,
+				_("while reading undo data for block %llu\n"),
+				key->block);
+			goto errout;
+		}
+	}
+	if (restore_flush(rs))
+		goto errout;
+out:
+	if (keys)
+		ext2fs_free_mem(&keys);
+	return 0;
+
+errout:
+	ext2fs_free_mem(&keys);
+	return 1;
+}
+
+static int blk64_cmp(const void *a, const void *b)
+{
+	const blk64_t *ba = a, *bb = b;
+
+	if (*ba < *bb)
+		return -1;
+	return *ba > *bb;
+}
+
+/*
+ * Replay an undo file written by an older version.  The tdb hands out
+ * the keys in hash order, so collect them all and restore the blocks
+ * in block order instead.
+ */
+static int replay_tdb(TDB_CONTEXT *tdb, struct restore_state *rs)
+{
+	TDB_DATA	key, next, data;
+	blk64_t		*blocks = 0;
+	unsigned long long i, num = 0, max = 0;
+	errcode_t	retval;
+	char		*buf;
+	int		ret = 1;
+
+	for (key = tdb_firstkey(tdb); key.dptr; key = next) {
+		/* The other keys are the file system identity strings */
+		if (key.dsize == sizeof(blk64_t)) {
+			if (num >= max) {
+				retval = ext2fs_resize_mem(max * sizeof(blk64_t),
+						(max ? max * 2 : 1024) *
+						sizeof(blk64_t), &blocks);
+				if (retval) {
+					com_err(prg_name, retval, "%s",
+						_("while allocating memory"));
+					free(key.dptr);
+					goto out;
+				}
+				max = max ? max * 2 : 1024;
+			}
+			memcpy(&blocks[num++], key.dptr, sizeof(blk64_t));
+		}
+		next = tdb_nextkey(tdb, key);
+		free(key.dptr);
+	}
+	if (num)
+		qsort(blocks, num, sizeof(blk64_t), blk64_cmp);
+
+	for (i = 0; i < num; i++) {
+		key.dptr = (unsigned char *) &blocks[i];
+		key.dsize = sizeof(blk64_t);
+		data = tdb_fetch(tdb, key);
+		if (!data.dptr) {
+			com_err(prg_name, 0,
+				_("Failed tdb_fetch %s\n"), tdb_errorstr(tdb));
+			goto out;
+		}
+		retval = restore_space(rs, blocks[i], data.dsize, &buf);
+		if (!retval)
+			memcpy(buf, data.dptr, data.dsize);
+		free(data.dptr);
+		if (retval)
+			goto out;
+	}
+	if (restore_flush(rs))
+		goto out;
+	ret = 0;
+out:
+	if (blocks)
+		ext2fs_free_mem(&blocks);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
-	int c,force = 0;
+	int c,force = 0, dry_run = 0;
 	TDB_CONTEXT *tdb;
-	TDB_DATA key, data;
 	io_channel channel;
 	errcode_t retval;
 	int  mount_flags;
-	blk64_t  blk_num;
 	char *device_name, *tdb_file;
+	struct restore_state rs;
 	io_manager manager = unix_io_manager;
+	struct undo_header undo_hdr;
+	int undo_fd;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -139,11 +509,14 @@ int main(int argc, char *argv[])
 	add_error_table(&et_ext2_error_table);
 
 	prg_name = argv[0];
-	while((c = getopt(argc, argv, "f")) != EOF) {
+	while((c = getopt(argc, argv, "fn")) != EOF) {
 		switch (c) {
 			case 'f':
 				force = 1;
 				break;
+			case 'n':
+				dry_run = 1;
+				break;
 			default:
 				usage();
 		}
@@ -155,13 +528,28 @@ int main(int argc, char *argv[])
 	tdb_file = argv[optind];
 	device_name = argv[optind+1];
 
-	tdb = tdb_open(tdb_file, 0, 0, O_RDONLY, 0600);
-
-	if (!tdb) {
+	undo_fd = ext2fs_open_file(tdb_file, O_RDONLY, 0);
+	if (undo_fd < 0) {
 		com_err(prg_name, errno,
-				_("Failed tdb_open %s\n"), tdb_file);
+				_("while opening undo file %s\n"), tdb_file);
 		exit(1);
 	}
+	memset(&undo_hdr, 0, sizeof(undo_hdr));
+	if (!undo_pread(undo_fd, 0, &undo_hdr, sizeof(undo_hdr)) &&
+	    !memcmp(undo_hdr.magic, E2UNDO_MAGIC, E2UNDO_MAGIC_LEN)) {
+		tdb = NULL;
+	} else {
+		/* An undo file written by an older version */
+		close(undo_fd);
+		undo_fd = -1;
+		tdb = tdb_open(tdb_file, 0, 0, O_RDONLY, 0600);
+
+		if (!tdb) {
+			com_err(prg_name, errno,
+					_("Failed tdb_open %s\n"), tdb_file);
+			exit(1);
+		}
+	}
 
 	retval = ext2fs_check_if_mounted(device_name, &mount_flags);
 	if (retval) {
@@ -176,13 +564,26 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	retval = manager->open(device_name,
+	retval = manager->open(device_name, dry_run ? 0 :
 				IO_FLAG_EXCLUSIVE | IO_FLAG_RW,  &channel);
 	if (retval) {
 		com_err(prg_name, retval,
 				_("Failed to open %s\n"), device_name);
 		exit(1);
 	}
+	memset(&rs, 0, sizeof(rs));
+	rs.channel = channel;
+	rs.dry_run = dry_run;
+	rs.crc = ~0;
+
+	if (undo_fd >= 0) {
+		if (replay_undo_file(undo_fd, &undo_hdr, &rs, force))
+			exit(1);
+		restore_summary(&rs);
+		io_channel_close(channel);
+		close(undo_fd);
+		return 0;
+	}
 
 	if (!force && check_filesystem(tdb, channel)) {
 		exit(1);
@@ -192,31 +593,9 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	for (key = tdb_firstkey(tdb); key.dptr; key = tdb_nextkey(tdb, key)) {
-		if (!strcmp((char *) key.dptr, (char *) mtime_key) ||
-		    !strcmp((char *) key.dptr, (char *) uuid_key) ||
-		    !strcmp((char *) key.dptr, (char *) blksize_key)) {
-			continue;
-		}
-
-		data = tdb_fetch(tdb, key);
-		if (!data.dptr) {
-			com_err(prg_name, 0,
-				_("Failed tdb_fetch %s\n"), tdb_errorstr(tdb));
-			exit(1);
-		}
-		blk_num = *(blk64_t *)key.dptr;
-		printf(_("Replayed transaction of size %zd at location %llu\n"),
-							data.dsize, blk_num);
-		retval = io_channel_write_blk64(channel, blk_num,
-						-data.dsize, data.dptr);
-		if (retval == -1) {
-			com_err(prg_name, retval,
-					_("Failed write %s\n"),
-					strerror(errno));
-			exit(1);
-		}
-	}
+	if (replay_tdb(tdb, &rs))
+		exit(1);
+	restore_summary(&rs);
 	io_channel_close(channel);
 	tdb_close(tdb);
 
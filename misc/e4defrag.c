@@ -40,8 +40,12 @@
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
 #include <sys/vfs.h>
 
+#include "e2freefrag.h"
+
 /* A relatively new ioctl interface ... */
 #ifndef EXT4_IOC_MOVE_EXT
 #define EXT4_IOC_MOVE_EXT      _IOWR('f', 15, struct move_extent)
@@ -86,6 +90,7 @@
 /* The mode of defrag */
 #define DETAIL			0x01
 #define STATISTIC		0x02
+#define PLAN			0x04
 
 #define DEVNAME			0
 #define DIRNAME			1
@@ -113,7 +118,7 @@
 
 /* The following macros are error message */
 #define MSG_USAGE		\
-"Usage	: e4defrag [-v] file...| directory...| device...\n\
+"Usage	: e4defrag [-p] [-r rate] [-v] file...| directory...| device...\n\
 	: e4defrag  -c  file...| directory...| device...\n"
 
 #define NGMSG_EXT4		"Filesystem is not ext4 filesystem"
@@ -163,6 +168,14 @@ struct frag_statistic_ino {
 	char msg_buffer[PATH_MAX + 1];	/* pathname of the file */
 };
 
+struct plan_entry {
+	char *file;		/* pathname of the entry */
+	struct stat64 st;
+	unsigned int order;	/* position in the tree walk */
+	int gain;		/* files with a lower gain are done first */
+	ext4_fsblk_t physical;	/* first physical block of the file */
+};
+
 static char	lost_found_dir[PATH_MAX + 1];
 static int	block_size;
 static int	extents_before_defrag;
@@ -180,6 +193,15 @@ static __u32 blocks_per_group;
 static __u32 feature_incompat;
 static ext4_fsblk_t	files_block_count;
 static struct frag_statistic_ino	frag_rank[SHOW_FRAG_FILES];
+static struct plan_entry	*plan;
+static unsigned int	plan_count;
+static unsigned int	plan_max;
+static unsigned long	rate_limit;	/* MB per second, 0 is unlimited */
+static unsigned long long	moved_bytes;
+static struct timeval	move_start;
+static struct free_chunk_histogram	free_hist;
+static ext4_fsblk_t	max_free_len;
+static int	have_free_hist;
 
 
 /* Local definitions of some syscalls glibc may not yet have */
@@ -1077,6 +1099,116 @@ static int get_best_count(ext4_fsblk_t block_count)
 }
 
 
+/*
+ * scan_free_space() -	Build the histogram of free extents of the file
+ *			system, as e2freefrag does.
+ *
+ * @fs:			the file system, opened by the caller.
+ *
+ * This is only a snapshot of the bitmaps on disk, but defrag turns
+ * large free extents into small ones, so it errs on the side of
+ * trying a donor which turns out no better than the file.
+ */
+static void scan_free_space(ext2_filsys fs)
+{
+	blk64_t	start, end, first, last;
+	ext4_fsblk_t	len;
+	int	idx;
+
+	memset(&free_hist, 0, sizeof(free_hist));
+	max_free_len = 0;
+	have_free_hist = 0;
+
+	if (ext2fs_read_block_bitmap(fs))
+		return;
+
+	start = fs->super->s_first_data_block;
+	end = ext2fs_blocks_count(fs->super) - 1;
+	while (start <= end) {
+		if (ext2fs_find_first_zero_block_bitmap2(fs->block_map,
+							 start, end, &first))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map,
+							first, end, &last))
+			last = end + 1;
+		len = last - first;
+		for (idx = 1; idx < MAX_HIST - 1 && (len >> idx); idx++)
+			;
+		free_hist.fc_chunks[idx]++;
+		free_hist.fc_blocks[idx] += len;
+		if (len > max_free_len)
+			max_free_len = len;
+		start = last + 1;
+	}
+	have_free_hist = 1;
+}
+
+/*
+ * free_extents_needed() -	Get the fewest free extents which could
+ *				hold a donor for the file.
+ *
+ * @blk_count:		the file's block count.
+ */
+static int free_extents_needed(ext4_fsblk_t blk_count)
+{
+	int	i, count = 0;
+	ext4_fsblk_t	avg, n;
+
+	for (i = MAX_HIST - 1; i > 0 && blk_count; i--) {
+		if (!free_hist.fc_chunks[i])
+			continue;
+		if (free_hist.fc_blocks[i] < blk_count) {
+			count += free_hist.fc_chunks[i];
+			blk_count -= free_hist.fc_blocks[i];
+			continue;
+		}
+		avg = free_hist.fc_blocks[i] / free_hist.fc_chunks[i];
+		n = (blk_count + avg - 1) / avg;
+		return count + n;
+	}
+
+	return blk_count ? INT_MAX : count;
+}
+
+/*
+ * find_worst_run() -	Find the run of extents which gains the most from
+ *			being moved into one free extent.
+ *
+ * @ext_list_head:	the head of the file's logical extent list.
+ * @max_len:		the largest donor which can be allocated.
+ * @first:		set to the first extent of the run.
+ * @last:		set to the last extent of the run.
+ *
+ * Returns the count of extents in the run.
+ */
+static int find_worst_run(struct fiemap_extent_list *ext_list_head,
+			  ext4_fsblk_t max_len,
+			  struct fiemap_extent_list **first,
+			  struct fiemap_extent_list **last)
+{
+	struct fiemap_extent_list	*lo = ext_list_head;
+	struct fiemap_extent_list	*hi = ext_list_head;
+	int	count = 0, best = 0;
+
+	do {
+		count++;
+		while (lo != hi && hi->data.logical + hi->data.len -
+		       lo->data.logical > max_len) {
+			lo = lo->next;
+			count--;
+		}
+		if (count > best && hi->data.logical + hi->data.len -
+		    lo->data.logical <= max_len) {
+			best = count;
+			*first = lo;
+			*last = hi;
+		}
+		hi = hi->next;
+	} while (hi != ext_list_head);
+
+	return best;
+}
+
 /*
  * file_statistic() -	Get statistic info of the file's fragments.
  *
@@ -1339,6 +1471,37 @@ static void print_progress(const char *file, loff_t start, loff_t file_size)
 	return;
 }
 
+/*
+ * throttle_move() -	Sleep long enough to keep the data moved by
+ *			EXT4_IOC_MOVE_EXT under the rate given with -r.
+ *
+ * @moved_len:		blocks moved by the last ioctl.
+ */
+static void throttle_move(__u64 moved_len)
+{
+	struct timeval	now;
+	struct timespec	ts;
+	double	elapsed, wanted;
+
+	if (!rate_limit)
+		return;
+
+	if (!move_start.tv_sec)
+		gettimeofday(&move_start, NULL);
+	moved_bytes += moved_len * block_size;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - move_start.tv_sec) +
+		(now.tv_usec - move_start.tv_usec) / 1000000.0;
+	wanted = (double) moved_bytes / (rate_limit * 1024.0 * 1024.0);
+	if (wanted <= elapsed)
+		return;
+
+	ts.tv_sec = wanted - elapsed;
+	ts.tv_nsec = (wanted - elapsed - ts.tv_sec) * 1000000000.0;
+	nanosleep(&ts, NULL);
+}
+
 /*
  * call_defrag() -	Execute the defrag program.
  *
@@ -1420,6 +1583,8 @@ static int call_defrag(int fd, int donor_fd, const char *file,
 			}
 			return -1;
 		}
+		throttle_move(move_data.moved_len);
+
 		/* Adjust logical offset for next ioctl */
 		move_data.orig_start += move_data.moved_len;
 		move_data.donor_start = move_data.orig_start;
@@ -1465,6 +1630,9 @@ static int file_defrag(const char *file, const struct stat64 *buf,
 	struct fiemap_extent_list	*donor_list_logical = NULL;
 	struct fiemap_extent_group	*orig_group_head = NULL;
 	struct fiemap_extent_group	*orig_group_tmp = NULL;
+	struct fiemap_extent_list	*run_first = NULL, *run_last = NULL;
+	struct fiemap_extent_list	*ext_tmp;
+	ext4_fsblk_t	run_start, run_end;
 
 	defraged_file_count++;
 
@@ -1564,6 +1732,23 @@ static int file_defrag(const char *file, const struct stat64 *buf,
 	if (file_frags_start <= best)
 		goto check_improvement;
 
+	/*
+	 * If the free space is too fragmented to hold a donor with fewer
+	 * extents than the file, don't allocate one for the whole file,
+	 * but only for the run of extents which gains the most.
+	 */
+	if (have_free_hist &&
+	    free_extents_needed(blk_count) >= orig_physical_cnt) {
+		ret = find_worst_run(orig_list_logical, max_free_len,
+				     &run_first, &run_last);
+		if (ret < 2) {
+			donor_physical_cnt = orig_physical_cnt;
+			goto check_improvement;
+		}
+		/* The donor is only compared with the run it replaces */
+		orig_physical_cnt = ret;
+	}
+
 	/* Combine extents to group */
 	ret = join_extents(orig_list_logical, &orig_group_head);
 	if (ret < 0) {
@@ -1602,8 +1787,32 @@ static int file_defrag(const char *file, const struct stat64 *buf,
 	}
 
 	/* Allocate space for donor inode */
-	orig_group_tmp = orig_group_head;
-	do {
+	for (ext_tmp = run_first; ext_tmp; ext_tmp = ext_tmp->next) {
+		/* Logically contiguous extents of the run at once */
+		run_start = ext_tmp->data.logical;
+		run_end = run_start + ext_tmp->data.len;
+		while (ext_tmp != run_last &&
+		       ext_tmp->next->data.logical == run_end) {
+			ext_tmp = ext_tmp->next;
+			run_end += ext_tmp->data.len;
+		}
+
+		ret = fallocate64(donor_fd, 0, (loff_t)run_start * block_size,
+				  (loff_t)(run_end - run_start) * block_size);
+		if (ret < 0) {
+			if (mode_flag & DETAIL) {
+				PRINT_FILE_NAME(file);
+				PRINT_ERR_MSG_WITH_ERRNO("Failed to fallocate");
+			}
+			goto out;
+		}
+
+		if (ext_tmp == run_last)
+			break;
+	}
+
+	orig_group_tmp = run_first ? NULL : orig_group_head;
+	while (orig_group_tmp) {
 		ret = fallocate64(donor_fd, 0,
 		  (loff_t)orig_group_tmp->start->data.logical * block_size,
 		  (loff_t)orig_group_tmp->len * block_size);
@@ -1616,7 +1825,9 @@ static int file_defrag(const char *file, const struct stat64 *buf,
 		}
 
 		orig_group_tmp = orig_group_tmp->next;
-	} while (orig_group_tmp != orig_group_head);
+		if (orig_group_tmp == orig_group_head)
+			break;
+	}
 
 	/* Get donor inode's extents */
 	ret = get_file_extents(donor_fd, &donor_list_physical);
@@ -1717,6 +1928,144 @@ out:
  * @argc:		the number of parameter.
  * @argv[]:		the pointer array of parameter.
  */
+/*
+ * plan_gain() -	Work out how much defragmenting a file is worth.
+ *
+ * @ent:		the plan entry of a regular file.
+ *
+ * The gain is the log2 of the file's average extent size in blocks,
+ * so that the files which lose the most extents for each block that
+ * has to be moved come first.  Files which are already in one extent
+ * are left at INT_MAX.
+ */
+static void plan_gain(struct plan_entry *ent)
+{
+	int	fd;
+	int	count;
+	ext4_fsblk_t	avg;
+	__u64	fm_buf[(sizeof(struct fiemap) +
+			sizeof(struct fiemap_extent)) / sizeof(__u64)];
+	struct fiemap	*fiemap_buf = (struct fiemap *) fm_buf;
+
+	fd = open64(ent->file, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	count = file_frag_count(fd);
+	if (count <= 1)
+		goto out;
+
+	/* Get the first extent, to sort files by their location */
+	memset(fm_buf, 0, sizeof(fm_buf));
+	fiemap_buf->fm_length = FIEMAP_MAX_OFFSET;
+	fiemap_buf->fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, fiemap_buf) == 0 &&
+	    fiemap_buf->fm_mapped_extents == 1)
+		ent->physical = fiemap_buf->fm_extents[0].fe_physical /
+				block_size;
+
+	avg = ent->st.st_blocks * 512 / block_size / count;
+	ent->gain = 0;
+	while (avg > 1) {
+		avg >>= 1;
+		ent->gain++;
+	}
+out:
+	close(fd);
+}
+
+/*
+ * plan_entry_add() -	Remember an entry of the tree walk for -p.
+ *
+ * @file:		the file's name.
+ * @buf:		the pointer of the struct stat64.
+ * @flag:		file type.
+ * @ftwbuf:		the pointer of a struct FTW.
+ */
+static int plan_entry_add(const char *file, const struct stat64 *buf,
+			int flag EXT2FS_ATTR((unused)),
+			struct FTW *ftwbuf EXT2FS_ATTR((unused)))
+{
+	struct plan_entry	*ent;
+
+	if (plan_count == plan_max) {
+		unsigned int	new_max = plan_max ? plan_max * 2 : 1024;
+
+		ent = realloc(plan, new_max * sizeof(struct plan_entry));
+		if (ent == NULL) {
+			PRINT_ERR_MSG_WITH_ERRNO("Couldn't plan defrag");
+			return -1;
+		}
+		plan = ent;
+		plan_max = new_max;
+	}
+
+	ent = &plan[plan_count];
+	ent->file = strdup(file);
+	if (ent->file == NULL) {
+		PRINT_ERR_MSG_WITH_ERRNO("Couldn't plan defrag");
+		return -1;
+	}
+	ent->st = *buf;
+	ent->order = plan_count;
+	ent->gain = INT_MAX;
+	ent->physical = 0;
+
+	if (S_ISREG(buf->st_mode) && buf->st_blocks &&
+	    (lost_found_dir[0] == '\0' ||
+	     memcmp(file, lost_found_dir, strnlen(lost_found_dir, PATH_MAX))))
+		plan_gain(ent);
+
+	plan_count++;
+
+	return 0;
+}
+
+/*
+ * plan_cmp() -		Order the plan entries for defrag.
+ *
+ * Files of about the same gain are done in the order of their first
+ * block, so that the moves work their way across the disk; everything
+ * which can't gain anything is left in the order of the tree walk.
+ */
+static int plan_cmp(const void *a, const void *b)
+{
+	const struct plan_entry	*ea = a;
+	const struct plan_entry	*eb = b;
+
+	if (ea->gain != eb->gain)
+		return ea->gain < eb->gain ? -1 : 1;
+	if (ea->physical != eb->physical)
+		return ea->physical < eb->physical ? -1 : 1;
+	return ea->order < eb->order ? -1 : (ea->order > eb->order);
+}
+
+/*
+ * plan_defrag() -	Defrag the entries under a directory, most
+ *			fragmented files first.
+ *
+ * @dir_name:		the directory to walk.
+ * @flags:		flags for nftw64().
+ */
+static void plan_defrag(const char *dir_name, int flags)
+{
+	unsigned int	i;
+	struct stat64	buf;
+
+	plan_count = 0;
+	nftw64(dir_name, plan_entry_add, FTW_OPEN_FD, flags);
+	qsort(plan, plan_count, sizeof(struct plan_entry), plan_cmp);
+
+	for (i = 0; i < plan_count; i++) {
+		/* The file may have changed since it was looked at */
+		if (lstat64(plan[i].file, &buf) < 0)
+			buf = plan[i].st;
+		file_defrag(plan[i].file, &buf, FTW_F, NULL);
+		free(plan[i].file);
+	}
+	plan_count = 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int	opt;
@@ -1726,6 +2075,7 @@ int main(int argc, char *argv[])
 	int	success_flag = 0;
 	char	dir_name[PATH_MAX + 1];
 	char	dev_name[PATH_MAX + 1];
+	char	*end;
 	struct stat64	buf;
 	ext2_filsys fs = NULL;
 
@@ -1733,7 +2083,7 @@ int main(int argc, char *argv[])
 	if (argc == 1)
 		goto out;
 
-	while ((opt = getopt(argc, argv, "vc")) != EOF) {
+	while ((opt = getopt(argc, argv, "vcpr:")) != EOF) {
 		switch (opt) {
 		case 'v':
 			mode_flag |= DETAIL;
@@ -1741,6 +2091,16 @@ int main(int argc, char *argv[])
 		case 'c':
 			mode_flag |= STATISTIC;
 			break;
+		case 'p':
+			mode_flag |= PLAN;
+			break;
+		case 'r':
+			rate_limit = strtoul(optarg, &end, 0);
+			if (*end || !rate_limit) {
+				fprintf(stderr, "Invalid rate: %s\n", optarg);
+				goto out;
+			}
+			break;
 		default:
 			goto out;
 		}
@@ -1765,6 +2125,7 @@ int main(int argc, char *argv[])
 		blocks_per_group = 0;
 		feature_incompat = 0;
 		log_groups_per_flex = 0;
+		have_free_hist = 0;
 
 		memset(dir_name, 0, PATH_MAX + 1);
 		memset(dev_name, 0, PATH_MAX + 1);
@@ -1859,6 +2220,8 @@ int main(int argc, char *argv[])
 			blocks_per_group = fs->super->s_blocks_per_group;
 			feature_incompat = fs->super->s_feature_incompat;
 			log_groups_per_flex = fs->super->s_log_groups_per_flex;
+			if (!(mode_flag & STATISTIC))
+				scan_free_space(fs);
 
 			ext2fs_close(fs);
 		}
@@ -1958,7 +2321,11 @@ int main(int argc, char *argv[])
 				break;
 			}
 			/* File tree walk */
-			nftw64(dir_name, file_defrag, FTW_OPEN_FD, flags);
+			if (mode_flag & PLAN)
+				plan_defrag(dir_name, flags);
+			else
+				nftw64(dir_name, file_defrag,
+							FTW_OPEN_FD, flags);
 			printf("\n\tSuccess:\t\t\t[ %u/%u ]\n", succeed_cnt,
 				total_count);
 			printf("\tFailure:\t\t\t[ %u/%u ]\n",
@@ -2069,6 +2436,7 @@ int main(int argc, char *argv[])
 		}
 
 	}
+	free(plan);
 
 	if (success_flag)
 		return 0;
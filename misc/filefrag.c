@@ -28,6 +28,7 @@ int main(void) {
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #else
@@ -49,6 +50,7 @@ int sync_file = 0;	/* fsync file before getting the mapping */
 int xattr_map = 0;	/* get xattr mapping */
 int force_bmap;	/* force use of FIBMAP instead of FIEMAP */
 int force_extent;	/* print output in extent format always */
+int recursive;		/* report on the files below directories */
 int logical_width = 8;
 int physical_width = 10;
 const char *ext_fmt = "%4d: %*llu..%*llu: %*llu..%*llu: %6llu: %s\n";
@@ -179,14 +181,22 @@ static void print_extent_info(struct fiemap_extent *fm_extent, int cur_ex,
 	       ext_len, flags);
 }
 
+/*
+ * The FIEMAP buffer starts small, and is doubled (and kept for the
+ * following files) each time it is filled by a file with more extents,
+ * so that files with millions of extents don't take millions of ioctls.
+ */
+#define FIEMAP_BUF_MIN	16384
+#define FIEMAP_BUF_MAX	(4 * 1024 * 1024)
+
 static int filefrag_fiemap(int fd, int blk_shift, int *num_extents,
 			   ext2fs_struct_stat *st)
 {
-	char buf[16384];
-	struct fiemap *fiemap = (struct fiemap *)buf;
-	struct fiemap_extent *fm_ext = &fiemap->fm_extents[0];
-	int count = (sizeof(buf) - sizeof(*fiemap)) /
-			sizeof(struct fiemap_extent);
+	static char *buf;
+	static int buf_size;
+	struct fiemap *fiemap;
+	struct fiemap_extent *fm_ext;
+	int count;
 	unsigned long long expected = 0;
 	unsigned long flags = 0;
 	unsigned int i;
@@ -196,6 +206,16 @@ static int filefrag_fiemap(int fd, int blk_shift, int *num_extents,
 	int last = 0;
 	int rc;
 
+	if (!buf) {
+		buf = malloc(FIEMAP_BUF_MIN);
+		if (!buf)
+			return -1;
+		buf_size = FIEMAP_BUF_MIN;
+	}
+	fiemap = (struct fiemap *)buf;
+	fm_ext = &fiemap->fm_extents[0];
+	count = (buf_size - sizeof(*fiemap)) / sizeof(struct fiemap_extent);
+
 	memset(fiemap, 0, sizeof(struct fiemap));
 
 	if (sync_file)
@@ -248,6 +268,20 @@ static int filefrag_fiemap(int fd, int blk_shift, int *num_extents,
 
 		fiemap->fm_start = (fm_ext[i - 1].fe_logical +
 				    fm_ext[i - 1].fe_length);
+
+		if (!last && fiemap->fm_mapped_extents == (unsigned) count &&
+		    buf_size < FIEMAP_BUF_MAX) {
+			char *new_buf = realloc(buf, buf_size * 2);
+
+			if (new_buf) {
+				buf = new_buf;
+				buf_size *= 2;
+				fiemap = (struct fiemap *)buf;
+				fm_ext = &fiemap->fm_extents[0];
+				count = (buf_size - sizeof(*fiemap)) /
+					sizeof(struct fiemap_extent);
+			}
+		}
 	} while (last == 0);
 
 	*num_extents = tot_extents;
@@ -444,9 +478,52 @@ out_close:
 	close(fd);
 }
 
+/*
+ * Report on every regular file below dirname, without following
+ * symlinks or crossing into other file systems.
+ */
+static void frag_report_dir(const char *dirname, dev_t dev)
+{
+	DIR		*dir;
+	struct dirent	*de;
+	ext2fs_struct_stat st;
+	char		*path;
+	size_t		len = strlen(dirname);
+
+	dir = opendir(dirname);
+	if (!dir) {
+		perror(dirname);
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		path = malloc(len + strlen(de->d_name) + 2);
+		if (!path) {
+			perror("malloc");
+			break;
+		}
+		sprintf(path, "%s%s%s", dirname,
+			len && dirname[len - 1] == '/' ? "" : "/", de->d_name);
+#if defined(HAVE_FSTAT64) && !defined(__OSX_AVAILABLE_BUT_DEPRECATED)
+		if (lstat64(path, &st) < 0)
+#else
+		if (lstat(path, &st) < 0)
+#endif
+			perror(path);
+		else if (S_ISDIR(st.st_mode)) {
+			if (st.st_dev == dev)
+				frag_report_dir(path, dev);
+		} else if (S_ISREG(st.st_mode))
+			frag_report(path);
+		free(path);
+	}
+	closedir(dir);
+}
+
 static void usage(const char *progname)
 {
-	fprintf(stderr, "Usage: %s [-b{blocksize}] [-BeklsvxX] file ...\n",
+	fprintf(stderr, "Usage: %s [-b{blocksize}] [-BeklrsvxX] file ...\n",
 		progname);
 	exit(1);
 }
@@ -456,7 +533,7 @@ int main(int argc, char**argv)
 	char **cpp;
 	int c;
 
-	while ((c = getopt(argc, argv, "Bb::eksvxX")) != EOF)
+	while ((c = getopt(argc, argv, "Bb::ekrsvxX")) != EOF)
 		switch (c) {
 		case 'B':
 			force_bmap++;
@@ -499,6 +576,9 @@ int main(int argc, char**argv)
 		case 'k':
 			blocksize = 1024;
 			break;
+		case 'r':
+			recursive++;
+			break;
 		case 's':
 			sync_file++;
 			break;
@@ -517,8 +597,19 @@ int main(int argc, char**argv)
 		}
 	if (optind == argc)
 		usage(argv[0]);
-	for (cpp=argv+optind; *cpp; cpp++)
-		frag_report(*cpp);
+	for (cpp=argv+optind; *cpp; cpp++) {
+		ext2fs_struct_stat st;
+
+#if defined(HAVE_FSTAT64) && !defined(__OSX_AVAILABLE_BUT_DEPRECATED)
+		if (recursive && stat64(*cpp, &st) == 0 &&
+#else
+		if (recursive && stat(*cpp, &st) == 0 &&
+#endif
+		    S_ISDIR(st.st_mode))
+			frag_report_dir(*cpp, st.st_dev);
+		else
+			frag_report(*cpp);
+	}
 	return 0;
 }
 #endif
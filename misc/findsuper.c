@@ -47,6 +47,15 @@
  * It _should_ also handle signals and tell you the ending block, so
  * that you can resume at a later time, but it doesn't yet...
  *
+ * The device is read in windows of several megabytes, and every
+ * candidate offset in a window is checked for the superblock magic in
+ * memory.  A superblock which passes the sanity checks is also checked
+ * against the group descriptors which follow it.  With -w, the windows
+ * are dealt out in turn to several worker processes; each prints what
+ * it finds as it goes.  The journal copy detection compares a
+ * superblock with the previous one found by the same worker, so it can
+ * miss a copy then.
+ *
  * Note that gpart does not appear to find all superblocks that aren't aligned
  * with the start of a possible partition, so it is not useful in systems
  * with LVM or similar setups which don't use fat partition alignment.
@@ -90,38 +99,254 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
 #include "nls-enable.h"
 
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && \
+	defined(MAP_ANONYMOUS) && defined(HAVE_SYS_WAIT_H)
+#define HAVE_SCAN_WORKERS
+#endif
+
 #undef DEBUG
 
 #ifdef DEBUG
-#define WHY(fmt, arg...) { printf("\r%Ld: " fmt, sk, ##arg) ; continue; }
+#define WHY(fmt, arg...) { printf("\r%Ld: " fmt, sk, ##arg) ; return 0; }
 #else
-#define WHY(fmt, arg...) { continue; }
+#define WHY(fmt, arg...) { return 0; }
 #endif
 
+/* The device is read this many bytes at a time */
+#define SCAN_WINDOW		(4 * 1024 * 1024)
+#define SCAN_MAX_WORKERS	64
+/* How much of each candidate superblock is looked at */
+#define SB_PROBE_SIZE		512
+
+/* What a worker tells the parent; shared between them */
+struct scan_state {
+	loff_t	scanned;	/* bytes read so far */
+	loff_t	end;		/* the furthest offset read */
+	int	err;
+	int	done;
+};
+
+static int skiprate = 512;		/* one sector */
+static int print_jnl_copies;
+static int nr_workers = 1;
+static loff_t start_offset;
+
 static void usage(void)
 {
 	fprintf(stderr,
-		_("Usage:  findsuper device [skipbytes [startkb]]\n"));
+		_("Usage:  findsuper [-j] [-w workers] device "
+		  "[skipbytes [startkb]]\n"));
 	exit(1);
 }
 
+static int check_super(loff_t sk, struct ext2_super_block *ext2)
+{
+	if (ext2->s_log_block_size > 6)
+		WHY("log block size > 6 (%u)\n", ext2->s_log_block_size);
+	if (ext2fs_r_blocks_count(ext2) > ext2fs_blocks_count(ext2))
+		WHY("r_blocks_count > blocks_count (%u > %u)\n",
+		    ext2fs_r_blocks_count(ext2),
+		    ext2fs_blocks_count(ext2));
+	if (ext2fs_free_blocks_count(ext2) > ext2fs_blocks_count(ext2))
+		WHY("free_blocks_count > blocks_count\n (%u > %u)\n",
+		    ext2fs_free_blocks_count(ext2),
+		    ext2fs_blocks_count(ext2));
+	if (ext2->s_free_inodes_count > ext2->s_inodes_count)
+		WHY("free_inodes_count > inodes_count (%u > %u)\n",
+		    ext2->s_free_inodes_count, ext2->s_inodes_count);
+	return 1;
+}
+
+/*
+ * Check the copy of the group descriptors which follows the superblock
+ * at sk: the bitmaps and inode tables of the groups described in its
+ * first block have to lie within the file system.  Returns 1 if they
+ * do, 0 if they don't, and -1 if there is no such copy to check.
+ */
+static int check_group_desc(int fd, loff_t sk, struct ext2_super_block *ext2)
+{
+	unsigned long long bsize = 1 << (ext2->s_log_block_size + 10);
+	blk64_t		blocks = ext2fs_blocks_count(ext2), blk[3];
+	blk64_t		first = ext2->s_first_data_block;
+	unsigned int	desc_size = EXT2_MIN_DESC_SIZE, groups, i, j;
+	struct ext4_group_desc *gd;
+	char		*buf;
+	loff_t		gdt;
+	int		ret = 1;
+
+	if ((ext2->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG) ||
+	    ext2->s_blocks_per_group == 0 || blocks <= first)
+		return -1;
+	if (ext2->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		desc_size = ext2->s_desc_size;
+	if (desc_size < EXT2_MIN_DESC_SIZE || desc_size > bsize ||
+	    (desc_size & (desc_size - 1)))
+		return 0;
+	groups = ext2fs_div64_ceil(blocks - first, ext2->s_blocks_per_group);
+	if (groups > bsize / desc_size)
+		groups = bsize / desc_size;
+
+	/* The superblock of group 0 is 1024 bytes into its block */
+	gdt = sk + bsize;
+	if (bsize > 1024 && ext2->s_block_group_nr == 0)
+		gdt -= 1024;
+	buf = malloc(bsize);
+	if (!buf)
+		return -1;
+	if (pread(fd, buf, bsize, gdt) != (ssize_t) bsize) {
+		free(buf);
+		return -1;
+	}
+	for (i = 0; i < groups && ret; i++) {
+		gd = (struct ext4_group_desc *) (buf + i * desc_size);
+		blk[0] = ext2fs_le32_to_cpu(gd->bg_block_bitmap);
+		blk[1] = ext2fs_le32_to_cpu(gd->bg_inode_bitmap);
+		blk[2] = ext2fs_le32_to_cpu(gd->bg_inode_table);
+		if (desc_size >= EXT2_MIN_DESC_SIZE_64BIT) {
+			blk[0] |= (blk64_t)
+				ext2fs_le32_to_cpu(gd->bg_block_bitmap_hi) << 32;
+			blk[1] |= (blk64_t)
+				ext2fs_le32_to_cpu(gd->bg_inode_bitmap_hi) << 32;
+			blk[2] |= (blk64_t)
+				ext2fs_le32_to_cpu(gd->bg_inode_table_hi) << 32;
+		}
+		for (j = 0; j < 3; j++)
+			if (blk[j] <= first || blk[j] >= blocks)
+				ret = 0;
+		if (ext2fs_le16_to_cpu(gd->bg_free_inodes_count) >
+		    ext2->s_inodes_per_group)
+			ret = 0;
+	}
+	free(buf);
+	return ret;
+}
+
+static void report_super(int fd, loff_t sk, struct ext2_super_block *ext2,
+			 unsigned char *last_uuid)
+{
+	unsigned long long bsize, grpsize;
+	int jnl_copy, sb_offset, bad_gdt;
+	time_t tm;
+	char *s;
+
+	tm = ext2->s_mtime;
+	s = ctime(&tm);
+	s[24] = 0;
+	bsize = 1 << (ext2->s_log_block_size + 10);
+	grpsize = bsize * ext2->s_blocks_per_group;
+	if (memcmp(ext2->s_uuid, last_uuid, 16) == 0 &&
+	    ext2->s_rev_level > 0 && ext2->s_block_group_nr == 0) {
+		jnl_copy = 1;
+	} else {
+		jnl_copy = 0;
+		memcpy(last_uuid, ext2->s_uuid, 16);
+	}
+	if (ext2->s_block_group_nr == 0 || bsize == 1024)
+		sb_offset = 1024;
+	else
+		sb_offset = 0;
+	if (jnl_copy && !print_jnl_copies)
+		return;
+	bad_gdt = !jnl_copy && check_group_desc(fd, sk, ext2) == 0;
+	printf("\r%11Lu %11Lu%s %11Lu%s %9u %5Lu %4u%s %s %02x%02x%02x%02x %s\n",
+	       sk, sk - ext2->s_block_group_nr * grpsize - sb_offset,
+	       jnl_copy ? "*":" ",
+	       sk + ext2fs_blocks_count(ext2) * bsize -
+			ext2->s_block_group_nr * grpsize - sb_offset,
+	       jnl_copy ? "*" : " ", ext2fs_blocks_count(ext2), bsize,
+	       ext2->s_block_group_nr, jnl_copy ? "*" : bad_gdt ? "!" : " ",
+	       s, ext2->s_uuid[0], ext2->s_uuid[1],
+	       ext2->s_uuid[2], ext2->s_uuid[3], ext2->s_volume_name);
+	/* Several workers may be writing to stdout */
+	fflush(stdout);
+}
+
+static void print_rate(loff_t sk, loff_t bytes, time_t diff)
+{
+	time_t now = time(0);
+	char *s = ctime(&now);
+
+	s[24] = 0;
+	printf("\r%11Lu: %8LukB/s @ %s", sk, (bytes / diff) >> 10, s);
+	fflush(stdout);
+}
+
+/*
+ * Scan every nr_workers'th window of the device, starting with the
+ * worker'th one.  The candidates in a window are skiprate apart.
+ */
+static void scan(int fd, int worker, struct scan_state *st)
+{
+	static unsigned char last_uuid[16] = "blah";
+	struct ext2_super_block ext2;
+	loff_t		per_window, window, sk, skl = start_offset;
+	size_t		len;
+	ssize_t		got;
+	char		*buf;
+	time_t		now, last = time(0);
+	int		i;
+
+	per_window = SCAN_WINDOW / skiprate;
+	if (per_window < 1)
+		per_window = 1;
+	len = (per_window - 1) * skiprate + SB_PROBE_SIZE;
+	buf = malloc(len);
+	if (!buf) {
+		st->err = ENOMEM;
+		return;
+	}
+	memset(&ext2, 0, sizeof(ext2));
+	for (window = start_offset + worker * per_window * skiprate; ;
+	     window += nr_workers * per_window * skiprate) {
+		got = pread(fd, buf, len, window);
+		if (got < 0) {
+			st->err = errno;
+			break;
+		}
+		for (i = 0; i < per_window &&
+			     i * skiprate + SB_PROBE_SIZE <= got; i++) {
+			sk = window + i * skiprate;
+			memcpy(&ext2, buf + i * skiprate, SB_PROBE_SIZE);
+			if (ext2.s_magic != EXT2_SUPER_MAGIC ||
+			    !check_super(sk, &ext2))
+				continue;
+			report_super(fd, sk, &ext2, last_uuid);
+		}
+		st->scanned += got;
+		if (got)
+			st->end = window + got;
+		if ((size_t) got < len)
+			break;
+
+		if (nr_workers == 1 && (now = time(0)) - last >= 5) {
+			print_rate(window, window - skl, now - last);
+			last = now;
+			skl = window;
+		}
+	}
+	free(buf);
+}
 
 int main(int argc, char *argv[])
 {
-	int skiprate=512;		/* one sector */
-	loff_t sk=0, skl=0;
-	int fd;
+	struct scan_state *states, one;
+	loff_t sk, end = 0, scanned, last_scanned = 0;
+	int fd, c, i, err = 0;
 	char *s;
-	time_t tm, last = time(0);
-	loff_t interval = 1024 * 1024;
-	int c, print_jnl_copies = 0;
+	time_t now, last;
 	const char * device_name;
-	struct ext2_super_block ext2;
 	/* interesting fields: EXT2_SUPER_MAGIC
 	 *      s_blocks_count s_log_block_size s_mtime s_magic s_lastcheck */
 
@@ -133,11 +358,21 @@ int main(int argc, char *argv[])
 	set_com_err_gettext(gettext);
 #endif
 
-	while ((c = getopt (argc, argv, "j")) != EOF) {
+	while ((c = getopt (argc, argv, "jw:")) != EOF) {
 		switch (c) {
 		case 'j':
 			print_jnl_copies++;
 			break;
+		case 'w':
+			nr_workers = strtol(optarg, &s, 0);
+			if (*s || nr_workers < 1 ||
+			    nr_workers > SCAN_MAX_WORKERS) {
+				fprintf(stderr, _("workers should be a number "
+						  "from 1 to %d, not %s\n"),
+					SCAN_MAX_WORKERS, optarg);
+				exit(1);
+			}
+			break;
 		default:
 			usage();
 		}
@@ -156,13 +391,13 @@ int main(int argc, char *argv[])
 		}
 		optind++;
 	}
-	if (skiprate & 0x1ff) {
+	if (skiprate <= 0 || (skiprate & 0x1ff)) {
 		fprintf(stderr,
 			_("skipbytes must be a multiple of the sector size\n"));
 		exit(2);
 	}
 	if (optind < argc) {
-		sk = skl = strtoll(argv[optind], &s, 0) << 10;
+		start_offset = strtoll(argv[optind], &s, 0) << 10;
 		if (s == argv[optind]) {
 			fprintf(stderr,
 				_("startkb should be a number, not %s\n"), s);
@@ -170,8 +405,9 @@ int main(int argc, char *argv[])
 		}
 		optind++;
 	}
-	if (sk < 0) {
-		fprintf(stderr, _("startkb should be positive, not %llu\n"),sk);
+	if (start_offset < 0) {
+		fprintf(stderr, _("startkb should be positive, not %llu\n"),
+			start_offset);
 		exit(1);
 	}
 
@@ -180,85 +416,88 @@ int main(int argc, char *argv[])
 		perror(device_name);
 		exit(1);
 	}
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
 	/* Now, go looking for the superblock! */
-	printf(_("starting at %llu, with %u byte increments\n"), sk, skiprate);
+	printf(_("starting at %llu, with %u byte increments\n"), start_offset,
+	       skiprate);
 	if (print_jnl_copies)
 		printf(_("[*] probably superblock written in the ext3 "
 			 "journal superblock,\n\tso start/end/grp wrong\n"));
+	printf(_("[!] the group descriptors after the superblock do not "
+		 "match it\n"));
 	printf(_("byte_offset  byte_start     byte_end  fs_blocks blksz  grp  last_mount_time           sb_uuid label\n"));
-	for (; lseek64(fd, sk, SEEK_SET) != -1 &&
-	       read(fd, &ext2, 512) == 512; sk += skiprate) {
-		static unsigned char last_uuid[16] = "blah";
-		unsigned long long bsize, grpsize;
-		int jnl_copy, sb_offset;
+	fflush(stdout);
 
-		if (sk && !(sk & (interval - 1))) {
-			time_t now, diff;
+	states = &one;
+#ifdef HAVE_SCAN_WORKERS
+	if (nr_workers > 1) {
+		states = mmap(NULL, nr_workers * sizeof(*states),
+			      PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (states == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+	}
+#else
+	nr_workers = 1;
+#endif
+	memset(states, 0, nr_workers * sizeof(*states));
 
-			now = time(0);
-			diff = now - last;
+	if (nr_workers == 1)
+		scan(fd, 0, states);
+#ifdef HAVE_SCAN_WORKERS
+	else {
+		for (i = 0; i < nr_workers; i++) {
+			pid_t pid = fork();
 
-			if (diff > 0) {
-				s = ctime(&now);
-				s[24] = 0;
-				printf("\r%11Lu: %8LukB/s @ %s", sk,
-				       (((sk - skl)) / diff) >> 10, s);
+			if (pid < 0) {
+				states[i].err = errno;
+				states[i].done = 1;
+				continue;
+			}
+			if (pid == 0) {
+				scan(fd, i, &states[i]);
+				states[i].done = 1;
 				fflush(stdout);
+				_exit(0);
 			}
-			if (diff < 5)
-				interval <<= 1;
-			else if (diff > 20)
-				interval >>= 1;
-			last = now;
-			skl = sk;
 		}
-		if (ext2.s_magic != EXT2_SUPER_MAGIC)
-			continue;
-		if (ext2.s_log_block_size > 6)
-			WHY("log block size > 6 (%u)\n", ext2.s_log_block_size);
-		if (ext2fs_r_blocks_count(&ext2) > ext2fs_blocks_count(&ext2))
-			WHY("r_blocks_count > blocks_count (%u > %u)\n",
-			    ext2fs_r_blocks_count(&ext2),
-			    ext2fs_blocks_count(&ext2));
-		if (ext2fs_free_blocks_count(&ext2) > ext2fs_blocks_count(&ext2))
-			WHY("free_blocks_count > blocks_count\n (%u > %u)\n",
-			    ext2fs_free_blocks_count(&ext2),
-			    ext2fs_blocks_count(&ext2));
-		if (ext2.s_free_inodes_count > ext2.s_inodes_count)
-			WHY("free_inodes_count > inodes_count (%u > %u)\n",
-			    ext2.s_free_inodes_count, ext2.s_inodes_count);
-
-		tm = ext2.s_mtime;
-		s = ctime(&tm);
-		s[24] = 0;
-		bsize = 1 << (ext2.s_log_block_size + 10);
-		grpsize = bsize * ext2.s_blocks_per_group;
-		if (memcmp(ext2.s_uuid, last_uuid, sizeof(last_uuid)) == 0 &&
-		    ext2.s_rev_level > 0 && ext2.s_block_group_nr == 0) {
-			jnl_copy = 1;
-		} else {
-			jnl_copy = 0;
-			memcpy(last_uuid, ext2.s_uuid, sizeof(last_uuid));
+		last = time(0);
+		while (1) {
+			usleep(100000);
+			while (waitpid(-1, NULL, WNOHANG) > 0)
+				;
+			for (i = 0, c = 0, scanned = 0; i < nr_workers; i++) {
+				c += states[i].done;
+				scanned += states[i].scanned;
+			}
+			if (c == nr_workers)
+				break;
+			now = time(0);
+			if (now - last >= 5) {
+				print_rate(start_offset + scanned,
+					   scanned - last_scanned, now - last);
+				last = now;
+				last_scanned = scanned;
+			}
 		}
-		if (ext2.s_block_group_nr == 0 || bsize == 1024)
-			sb_offset = 1024;
-		else
-			sb_offset = 0;
-		if (jnl_copy && !print_jnl_copies)
-			continue;
-		printf("\r%11Lu %11Lu%s %11Lu%s %9u %5Lu %4u%s %s %02x%02x%02x%02x %s\n",
-		       sk, sk - ext2.s_block_group_nr * grpsize - sb_offset,
-		       jnl_copy ? "*":" ",
-		       sk + ext2fs_blocks_count(&ext2) * bsize -
-		            ext2.s_block_group_nr * grpsize - sb_offset,
-		       jnl_copy ? "*" : " ", ext2fs_blocks_count(&ext2), bsize,
-		       ext2.s_block_group_nr, jnl_copy ? "*" : " ", s,
-		       ext2.s_uuid[0], ext2.s_uuid[1],
-		       ext2.s_uuid[2], ext2.s_uuid[3], ext2.s_volume_name);
+		while (wait(NULL) > 0)
+			;
+	}
+#endif
+	for (i = 0; i < nr_workers; i++) {
+		if (states[i].end > end)
+			end = states[i].end;
+		if (!err)
+			err = states[i].err;
 	}
-	printf(_("\n%11Lu: finished with errno %d\n"), sk, errno);
+	sk = end;
+	printf(_("\n%11Lu: finished with errno %d\n"), sk, err);
 	close(fd);
 
-	return errno;
+	return err;
 }
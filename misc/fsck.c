@@ -113,6 +113,7 @@ static int progress_fd = 0;
 static int force_all_parallel = 0;
 static int num_running = 0;
 static int max_running = 0;
+static int max_running_nonrot = 4;
 static volatile int cancel_requested = 0;
 static int kill_sent = 0;
 static char *progname;
@@ -255,6 +256,9 @@ static struct fs_info *create_fs_device(const char *device, const char *mntpnt,
 	fs->freq = freq;
 	fs->passno = passno;
 	fs->flags = 0;
+	fs->disk = NULL;
+	fs->rotational = 1;
+	fs->size = 0;
 	fs->next = NULL;
 
 	if (!filesys_info)
@@ -431,6 +435,26 @@ static int progress_active(NOARGS)
  * Execute a particular fsck program, and link it into the list of
  * child processes we are waiting for.
  */
+/*
+ * Returns the disk that a device is on, preferably as sysfs sees it,
+ * along with whether it is rotational and how big the device is.
+ */
+static char *find_disk(const char *device, int *rotational,
+		       unsigned long long *size)
+{
+	char *disk;
+	int rot = 1;
+	unsigned long long sz = 0;
+
+	if (disk_info(device, &disk, &rot, &sz) < 0)
+		disk = base_device(device);
+	if (rotational)
+		*rotational = rot;
+	if (size)
+		*size = sz;
+	return disk;
+}
+
 static int execute(const char *type, const char *device, const char *mntpt,
 		   int interactive)
 {
@@ -510,7 +534,7 @@ static int execute(const char *type, const char *device, const char *mntpt,
 	inst->prog = string_copy(prog);
 	inst->type = string_copy(type);
 	inst->device = string_copy(device);
-	inst->base_device = base_device(device);
+	inst->base_device = find_disk(device, 0, 0);
 	inst->start_time = time(0);
 	inst->next = NULL;
 
@@ -916,14 +940,24 @@ static int ignore(struct fs_info *fs)
 	return 0;
 }
 
+static void get_disk_info(struct fs_info *fs)
+{
+	if (fs->flags & FLAG_DISK_INFO)
+		return;
+	fs->disk = find_disk(fs->device, &fs->rotational, &fs->size);
+	fs->flags |= FLAG_DISK_INFO;
+}
+
 /*
- * Returns TRUE if a partition on the same disk is already being
- * checked.
+ * Returns TRUE if the disk the file system is on is already busy: a
+ * rotational disk takes one check at a time, since otherwise the heads
+ * would be seeking all over the place, while an SSD can serve
+ * max_running_nonrot of them.
  */
-static int device_already_active(char *device)
+static int device_already_active(struct fs_info *fs)
 {
 	struct fsck_instance *inst;
-	char *base;
+	int active = 0;
 
 	if (force_all_parallel)
 		return 0;
@@ -932,25 +966,65 @@ static int device_already_active(char *device)
 	/* Don't check a soft raid disk with any other disk */
 	if (instance_list &&
 	    (!strncmp(instance_list->device, BASE_MD, sizeof(BASE_MD)-1) ||
-	     !strncmp(device, BASE_MD, sizeof(BASE_MD)-1)))
+	     !strncmp(fs->device, BASE_MD, sizeof(BASE_MD)-1)))
 		return 1;
 #endif
 
-	base = base_device(device);
+	get_disk_info(fs);
 	/*
 	 * If we don't know the base device, assume that the device is
 	 * already active if there are any fsck instances running.
 	 */
-	if (!base)
+	if (!fs->disk)
 		return (instance_list != 0);
 	for (inst = instance_list; inst; inst = inst->next) {
-		if (!inst->base_device || !strcmp(base, inst->base_device)) {
-			free(base);
+		if (!inst->base_device)
 			return 1;
-		}
+		if (!strcmp(fs->disk, inst->base_device))
+			active++;
 	}
-	free(base);
-	return 0;
+	if (!active)
+		return 0;
+	return fs->rotational || (max_running_nonrot &&
+				  active >= max_running_nonrot);
+}
+
+/*
+ * Order the file systems by decreasing size, keeping the fstab order
+ * for ones of the same size.  Since each pass waits for all of its
+ * checks to finish, starting the biggest ones first keeps the small
+ * ones from delaying them.
+ */
+static void sort_by_size(NOARGS)
+{
+	struct fs_info *fs, **list;
+	int i, j, num = 0;
+
+	for (fs = filesys_info; fs; fs = fs->next)
+		num++;
+	if (num < 2)
+		return;
+	list = malloc(num * sizeof(struct fs_info *));
+	if (!list)
+		return;
+	for (i = 0, fs = filesys_info; fs; fs = fs->next) {
+		if (!(fs->flags & FLAG_DONE))
+			get_disk_info(fs);
+		list[i++] = fs;
+	}
+	/* An insertion sort is stable, and fstab is never very long */
+	for (i = 1; i < num; i++) {
+		fs = list[i];
+		for (j = i; j > 0 && list[j-1]->size < fs->size; j--)
+			list[j] = list[j-1];
+		list[j] = fs;
+	}
+	filesys_info = list[0];
+	for (i = 1; i < num; i++)
+		list[i-1]->next = list[i];
+	list[num-1]->next = NULL;
+	filesys_last = list[num-1];
+	free(list);
 }
 
 /* Check all file systems, using the /etc/fstab table. */
@@ -974,6 +1048,8 @@ static int check_all(NOARGS)
 		if (ignore(fs))
 			fs->flags |= FLAG_DONE;
 	}
+	if (!serialize)
+		sort_by_size();
 
 	/*
 	 * Find and check the root filesystem.
@@ -1030,7 +1106,7 @@ static int check_all(NOARGS)
 			 * already been spawned, then we need to defer
 			 * this to another pass.
 			 */
-			if (device_already_active(fs->device)) {
+			if (device_already_active(fs)) {
 				pass_done = 0;
 				continue;
 			}
@@ -1247,6 +1323,8 @@ static void PRS(int argc, char *argv[])
 		force_all_parallel++;
 	if ((tmp = getenv("FSCK_MAX_INST")))
 	    max_running = atoi(tmp);
+	if ((tmp = getenv("FSCK_MAX_INST_NONROT")))
+	    max_running_nonrot = atoi(tmp);
 }
 
 int main(int argc, char *argv[])
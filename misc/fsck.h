@@ -45,11 +45,15 @@ struct fs_info {
 	int   freq;
 	int   passno;
 	int   flags;
+	char  *disk;
+	int   rotational;
+	unsigned long long size;
 	struct fs_info *next;
 };
 
 #define FLAG_DONE 1
 #define FLAG_PROGRESS 2
+#define FLAG_DISK_INFO 4
 
 /*
  * Structure to allow exit codes to be stored
@@ -67,6 +71,8 @@ struct fsck_instance {
 };
 
 extern char *base_device(const char *device);
+extern int disk_info(const char *device, char **disk, int *rotational,
+		     unsigned long long *size);
 extern const char *identify_fs(const char *fs_name, const char *fs_types);
 
 /* ismounted.h */
@@ -0,0 +1,625 @@
+/*
+ * fuse2fs.c --- mount an ext2/ext3/ext4 file system read-only with FUSE
+ *
+ * This lets an image, a snapshot or a qcow2 or remote image be looked
+ * at with ordinary tools, without root privileges and without copying
+ * it out with debugfs's rdump first.  Everything is read through
+ * libext2fs: paths are resolved with ext2fs_namei(), directories are
+ * listed with ext2fs_dir_iterate2(), and files are read with
+ * ext2fs_file_read().
+ *
+ * Nothing is written, not even the bitmaps are read, so opening a file
+ * system costs no more than reading its group descriptors.  The I/O
+ * manager's block cache, the inode cache and the dentry cache are made
+ * large, since they are shared by every request.  Each open file keeps
+ * its own handle, and a file which is read sequentially gets a
+ * readahead window which grows up to max_readahead, so a large file is
+ * read in a few long I/Os of whole extents.
+ *
+ * libext2fs does no locking, so requests are handled one at a time.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
+#include <fuse.h>
+
+#include "ext2fs/ext2_fs.h"
+#include "ext2fs/ext2fs.h"
+#include "et/com_err.h"
+#include "../version.h"
+
+/* Defaults for the mount options of the same names */
+#define FUSE2FS_CACHE_SIZE	"64m"
+#define FUSE2FS_MAX_READAHEAD	(4 * 1024 * 1024)
+#define FUSE2FS_ICACHE_SIZE	4096
+#define FUSE2FS_DCACHE_SIZE	65536
+
+#define FUSE2FS_MOUNT_OPTS	"-oro,default_permissions,use_ino," \
+				"subtype=ext4,fsname="
+
+/* The extra timestamp fields hold nanoseconds << 2 | extra epoch bits */
+#define EXTRA_EPOCH_BITS	2
+#define EXTRA_EPOCH_MASK	((1 << EXTRA_EPOCH_BITS) - 1)
+
+struct fuse2fs {
+	ext2_filsys	fs;
+	char		*device;
+	char		*cache_size;
+	char		*max_readahead;
+	unsigned int	ra_max;		/* readahead limit, in blocks */
+	unsigned int	icache_size;
+	unsigned int	dcache_size;
+};
+
+/* Per open file: the handle and how it has been read so far */
+struct fuse2fs_file {
+	ext2_file_t	file;
+	__u64		next_pos;	/* where a sequential read goes on */
+	unsigned int	ra_blocks;	/* current readahead window */
+};
+
+static struct fuse2fs fuse2fs;
+
+#define FUSE2FS_OPT(t, p) { t, offsetof(struct fuse2fs, p), 0 }
+
+enum {
+	FUSE2FS_KEY_HELP,
+	FUSE2FS_KEY_VERSION,
+};
+
+static struct fuse_opt fuse2fs_opts[] = {
+	FUSE2FS_OPT("cache_size=%s", cache_size),
+	FUSE2FS_OPT("max_readahead=%s", max_readahead),
+	FUSE2FS_OPT("inode_cache=%u", icache_size),
+	FUSE2FS_OPT("dentry_cache=%u", dcache_size),
+	FUSE_OPT_KEY("-h", FUSE2FS_KEY_HELP),
+	FUSE_OPT_KEY("--help", FUSE2FS_KEY_HELP),
+	FUSE_OPT_KEY("-V", FUSE2FS_KEY_VERSION),
+	FUSE_OPT_KEY("--version", FUSE2FS_KEY_VERSION),
+	FUSE_OPT_END
+};
+
+/*
+ * Error codes below 256 are errno values to begin with; the rest are
+ * translated where there is an obvious match.
+ */
+static int translate_error(errcode_t err)
+{
+	if (err > 0 && err < 256)
+		return -err;
+	switch (err) {
+	case EXT2_ET_FILE_NOT_FOUND:
+		return -ENOENT;
+	case EXT2_ET_NO_DIRECTORY:
+		return -ENOTDIR;
+	case EXT2_ET_RO_FILSYS:
+		return -EROFS;
+	case EXT2_ET_NO_MEMORY:
+		return -ENOMEM;
+	case EXT2_ET_SYMLINK_LOOP:
+		return -ELOOP;
+	case EXT2_ET_FILE_TOO_BIG:
+		return -EFBIG;
+	default:
+		return -EIO;
+	}
+}
+
+static int parse_size(const char *str, unsigned long long *ret)
+{
+	unsigned long long size;
+	char		*end;
+
+	size = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fallthrough */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fallthrough */
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+	}
+	if (*end || end == str)
+		return -1;
+	*ret = size;
+	return 0;
+}
+
+static int lookup(const char *path, ext2_ino_t *ino)
+{
+	errcode_t	retval;
+
+	if (path[0] == '/' && path[1] == 0) {
+		*ino = EXT2_ROOT_INO;
+		return 0;
+	}
+	retval = ext2fs_namei(fuse2fs.fs, EXT2_ROOT_INO, EXT2_ROOT_INO,
+			      path, ino);
+	return retval ? translate_error(retval) : 0;
+}
+
+static void fill_time(time_t *sec, long *nsec, __u32 t, __u32 extra,
+		      struct ext2_inode_large *inode, size_t field_end)
+{
+	*sec = (__s32) t;
+	*nsec = 0;
+	if (inode->i_extra_isize &&
+	    EXT2_GOOD_OLD_INODE_SIZE + inode->i_extra_isize >= field_end) {
+		/* The low two bits extend the seconds past 2038 */
+		*sec += (time_t) (extra & EXTRA_EPOCH_MASK) << 32;
+		*nsec = extra >> EXTRA_EPOCH_BITS;
+	}
+}
+
+/* st_blocks is always in 512-byte units */
+static blkcnt_t stat_blocks(ext2_filsys fs, struct ext2_inode *inode)
+{
+	blkcnt_t	blocks = inode->i_blocks;
+
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_HUGE_FILE)) {
+		blocks |= (blkcnt_t) inode->osd2.linux2.l_i_blocks_hi << 32;
+		if (inode->i_flags & EXT4_HUGE_FILE_FL)
+			blocks *= fs->blocksize / 512;
+	}
+	return blocks;
+}
+
+static void fill_stat(ext2_ino_t ino, struct ext2_inode_large *inode,
+		      struct stat *st)
+{
+	ext2_filsys	fs = fuse2fs.fs;
+	struct ext2_inode *ip = (struct ext2_inode *) inode;
+	__u32		major, minor;
+
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = inode->i_mode;
+	st->st_nlink = inode->i_links_count;
+	st->st_uid = inode_uid(*inode);
+	st->st_gid = inode_gid(*inode);
+	st->st_size = EXT2_I_SIZE(inode);
+	st->st_blksize = fs->blocksize;
+	st->st_blocks = stat_blocks(fs, ip);
+	if (fs->super->s_rev_level > EXT2_GOOD_OLD_REV &&
+	    EXT2_INODE_SIZE(fs->super) > EXT2_GOOD_OLD_INODE_SIZE) {
+		fill_time(&st->st_atime, &st->st_atim.tv_nsec,
+			  inode->i_atime, inode->i_atime_extra, inode,
+			  offsetof(struct ext2_inode_large, i_atime_extra) +
+			  sizeof(inode->i_atime_extra));
+		fill_time(&st->st_mtime, &st->st_mtim.tv_nsec,
+			  inode->i_mtime, inode->i_mtime_extra, inode,
+			  offsetof(struct ext2_inode_large, i_mtime_extra) +
+			  sizeof(inode->i_mtime_extra));
+		fill_time(&st->st_ctime, &st->st_ctim.tv_nsec,
+			  inode->i_ctime, inode->i_ctime_extra, inode,
+			  offsetof(struct ext2_inode_large, i_ctime_extra) +
+			  sizeof(inode->i_ctime_extra));
+	} else {
+		st->st_atime = (__s32) inode->i_atime;
+		st->st_mtime = (__s32) inode->i_mtime;
+		st->st_ctime = (__s32) inode->i_ctime;
+	}
+
+	if (LINUX_S_ISCHR(inode->i_mode) || LINUX_S_ISBLK(inode->i_mode)) {
+		if (inode->i_block[0]) {
+			major = (inode->i_block[0] >> 8) & 255;
+			minor = inode->i_block[0] & 255;
+		} else {
+			major = (inode->i_block[1] & 0xfff00) >> 8;
+			minor = ((inode->i_block[1] & 0xff) |
+				 ((inode->i_block[1] >> 12) & 0xfff00));
+		}
+		st->st_rdev = makedev(major, minor);
+	}
+}
+
+static int read_inode(ext2_ino_t ino, struct ext2_inode_large *inode)
+{
+	errcode_t	retval;
+
+	memset(inode, 0, sizeof(*inode));
+	retval = ext2fs_read_inode_full(fuse2fs.fs, ino,
+					(struct ext2_inode *) inode,
+					sizeof(*inode));
+	return retval ? translate_error(retval) : 0;
+}
+
+static int op_getattr(const char *path, struct stat *st)
+{
+	struct ext2_inode_large inode;
+	ext2_ino_t	ino;
+	int		ret;
+
+	if ((ret = lookup(path, &ino)) || (ret = read_inode(ino, &inode)))
+		return ret;
+	fill_stat(ino, &inode, st);
+	return 0;
+}
+
+static int op_readlink(const char *path, char *buf, size_t len)
+{
+	struct ext2_inode_large inode;
+	struct ext2_inode *ip = (struct ext2_inode *) &inode;
+	ext2_file_t	file;
+	ext2_ino_t	ino;
+	unsigned int	size, got;
+	errcode_t	retval;
+	int		ret;
+
+	if ((ret = lookup(path, &ino)) || (ret = read_inode(ino, &inode)))
+		return ret;
+	if (!LINUX_S_ISLNK(inode.i_mode))
+		return -EINVAL;
+	if (len == 0)
+		return -EINVAL;
+
+	size = EXT2_I_SIZE(ip);
+	if (size > len - 1)
+		size = len - 1;
+	if (ext2fs_inode_data_blocks2(fuse2fs.fs, ip) == 0) {
+		/* A fast symlink keeps its target in i_block */
+		if (size > sizeof(inode.i_block))
+			return -EIO;
+		memcpy(buf, inode.i_block, size);
+	} else {
+		retval = ext2fs_file_open2(fuse2fs.fs, ino, ip, 0, &file);
+		if (retval)
+			return translate_error(retval);
+		retval = ext2fs_file_read(file, buf, size, &got);
+		ext2fs_file_close(file);
+		if (retval)
+			return translate_error(retval);
+		size = got;
+	}
+	buf[size] = 0;
+	return 0;
+}
+
+static int op_open(const char *path, struct fuse_file_info *fi)
+{
+	struct fuse2fs_file *fh;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+	int		ret;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	if ((ret = lookup(path, &ino)))
+		return ret;
+
+	fh = calloc(1, sizeof(*fh));
+	if (!fh)
+		return -ENOMEM;
+	retval = ext2fs_file_open(fuse2fs.fs, ino, EXT2_FILE_READAHEAD,
+				  &fh->file);
+	if (retval) {
+		free(fh);
+		return translate_error(retval);
+	}
+	fh->ra_blocks = 1;
+	ext2fs_file_set_readahead(fh->file, fh->ra_blocks);
+	fi->fh = (uintptr_t) fh;
+	/* What we hand out never changes under the kernel's feet */
+	fi->keep_cache = 1;
+	return 0;
+}
+
+/*
+ * Size the file's readahead window from how it is being read: a read
+ * that carries on where the last one stopped doubles the window, up to
+ * max_readahead, and any other read shrinks it back to the size of the
+ * request, so random reads don't pull in data nobody asked for.
+ */
+static void adjust_readahead(struct fuse2fs_file *fh, off_t offset,
+			     size_t len)
+{
+	unsigned int	blocksize = fuse2fs.fs->blocksize;
+	unsigned int	want;
+
+	if (fh->next_pos && (__u64) offset == fh->next_pos) {
+		want = fh->ra_blocks * 2;
+		if (want > fuse2fs.ra_max)
+			want = fuse2fs.ra_max;
+	} else {
+		want = (len + blocksize - 1) / blocksize;
+		if (want == 0)
+			want = 1;
+	}
+	if (want != fh->ra_blocks) {
+		ext2fs_file_set_readahead(fh->file, want);
+		fh->ra_blocks = want;
+	}
+}
+
+static int op_read(const char *path, char *buf, size_t len, off_t offset,
+		   struct fuse_file_info *fi)
+{
+	struct fuse2fs_file *fh = (struct fuse2fs_file *) (uintptr_t) fi->fh;
+	unsigned int	got;
+	size_t		done = 0;
+	errcode_t	retval;
+
+	adjust_readahead(fh, offset, len);
+	retval = ext2fs_file_llseek(fh->file, offset, EXT2_SEEK_SET, NULL);
+	if (retval)
+		return translate_error(retval);
+	while (done < len) {
+		retval = ext2fs_file_read(fh->file, buf + done,
+					  len - done, &got);
+		if (retval)
+			return translate_error(retval);
+		if (got == 0)
+			break;
+		done += got;
+	}
+	fh->next_pos = offset + done;
+	return done;
+}
+
+static int op_release(const char *path, struct fuse_file_info *fi)
+{
+	struct fuse2fs_file *fh = (struct fuse2fs_file *) (uintptr_t) fi->fh;
+
+	ext2fs_file_close(fh->file);
+	free(fh);
+	return 0;
+}
+
+struct readdir_struct {
+	void		*buf;
+	fuse_fill_dir_t	filler;
+};
+
+static const mode_t ft_to_mode[EXT2_FT_MAX] = {
+	[EXT2_FT_UNKNOWN] = 0,
+	[EXT2_FT_REG_FILE] = S_IFREG,
+	[EXT2_FT_DIR] = S_IFDIR,
+	[EXT2_FT_CHRDEV] = S_IFCHR,
+	[EXT2_FT_BLKDEV] = S_IFBLK,
+	[EXT2_FT_FIFO] = S_IFIFO,
+	[EXT2_FT_SOCK] = S_IFSOCK,
+	[EXT2_FT_SYMLINK] = S_IFLNK,
+};
+
+static int readdir_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
+			int entry EXT2FS_ATTR((unused)),
+			struct ext2_dir_entry *dirent,
+			int offset EXT2FS_ATTR((unused)),
+			int blocksize EXT2FS_ATTR((unused)),
+			char *buf EXT2FS_ATTR((unused)), void *priv_data)
+{
+	struct readdir_struct *rs = (struct readdir_struct *) priv_data;
+	char		name[EXT2_NAME_LEN + 1];
+	struct stat	st;
+	int		len, type;
+
+	len = dirent->name_len & 0xFF;
+	memcpy(name, dirent->name, len);
+	name[len] = 0;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = dirent->inode;
+	type = dirent->name_len >> 8;
+	if (type < EXT2_FT_MAX)
+		st.st_mode = ft_to_mode[type];
+
+	if (rs->filler(rs->buf, name, &st, 0))
+		return DIRENT_ABORT;
+	return 0;
+}
+
+static int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		      off_t offset EXT2FS_ATTR((unused)),
+		      struct fuse_file_info *fi EXT2FS_ATTR((unused)))
+{
+	struct readdir_struct rs;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+	int		ret;
+
+	if ((ret = lookup(path, &ino)))
+		return ret;
+	rs.buf = buf;
+	rs.filler = filler;
+	retval = ext2fs_dir_iterate2(fuse2fs.fs, ino, 0, 0, readdir_proc,
+				     &rs);
+	return retval ? translate_error(retval) : 0;
+}
+
+static int op_statfs(const char *path EXT2FS_ATTR((unused)),
+		     struct statvfs *buf)
+{
+	ext2_filsys	fs = fuse2fs.fs;
+	blk64_t		bfree, reserved;
+	__u64		fsid;
+
+	memset(buf, 0, sizeof(*buf));
+	bfree = ext2fs_free_blocks_count(fs->super);
+	reserved = ext2fs_r_blocks_count(fs->super);
+	buf->f_bsize = fs->blocksize;
+	buf->f_frsize = fs->blocksize;
+	buf->f_blocks = ext2fs_blocks_count(fs->super);
+	buf->f_bfree = bfree;
+	buf->f_bavail = bfree > reserved ? bfree - reserved : 0;
+	buf->f_files = fs->super->s_inodes_count;
+	buf->f_ffree = fs->super->s_free_inodes_count;
+	buf->f_favail = fs->super->s_free_inodes_count;
+	memcpy(&fsid, fs->super->s_uuid, sizeof(fsid));
+	buf->f_fsid = fsid;
+	buf->f_flag = ST_RDONLY;
+	buf->f_namemax = EXT2_NAME_LEN;
+	return 0;
+}
+
+static struct fuse_operations fuse2fs_ops = {
+	.getattr	= op_getattr,
+	.readlink	= op_readlink,
+	.open		= op_open,
+	.read		= op_read,
+	.release	= op_release,
+	.readdir	= op_readdir,
+	.statfs		= op_statfs,
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s device mountpoint [-o option[,...]]\n"
+		"\n"
+		"fuse2fs options:\n"
+		"    -o cache_size=N         block cache size (default %s)\n"
+		"    -o max_readahead=N      largest readahead (default %dm)\n"
+		"    -o inode_cache=N        inodes to cache (default %d)\n"
+		"    -o dentry_cache=N       lookups to cache (default %d)\n"
+		"\n", prog, FUSE2FS_CACHE_SIZE,
+		FUSE2FS_MAX_READAHEAD >> 20, FUSE2FS_ICACHE_SIZE,
+		FUSE2FS_DCACHE_SIZE);
+}
+
+static int fuse2fs_opt_proc(void *data, const char *arg, int key,
+			    struct fuse_args *outargs)
+{
+	struct fuse2fs	*ff = (struct fuse2fs *) data;
+
+	switch (key) {
+	case FUSE_OPT_KEY_NONOPT:
+		if (!ff->device) {
+			ff->device = strdup(arg);
+			return 0;
+		}
+		return 1;
+	case FUSE2FS_KEY_HELP:
+		usage(outargs->argv[0]);
+		fuse_opt_add_arg(outargs, "-ho");
+		fuse_main(outargs->argc, outargs->argv, &fuse2fs_ops, NULL);
+		exit(1);
+	case FUSE2FS_KEY_VERSION:
+		fprintf(stderr, "fuse2fs %s (%s)\n", E2FSPROGS_VERSION,
+			E2FSPROGS_DATE);
+		fuse_opt_add_arg(outargs, "--version");
+		fuse_main(outargs->argc, outargs->argv, &fuse2fs_ops, NULL);
+		exit(0);
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	io_manager	io_ptr = unix_io_manager;
+	unsigned long long ra_bytes = FUSE2FS_MAX_READAHEAD;
+	const char	*cache_size;
+	char		*cache_opt, *fs_opt;
+	errcode_t	retval;
+	int		ret;
+
+	add_error_table(&et_ext2_error_table);
+	if (fuse_opt_parse(&args, &fuse2fs, fuse2fs_opts, fuse2fs_opt_proc))
+		exit(1);
+	if (!fuse2fs.device) {
+		usage(argv[0]);
+		exit(1);
+	}
+	if (fuse2fs.max_readahead &&
+	    parse_size(fuse2fs.max_readahead, &ra_bytes)) {
+		com_err(argv[0], 0, "invalid max_readahead: %s",
+			fuse2fs.max_readahead);
+		exit(1);
+	}
+
+	if (qcow2_io_probe(fuse2fs.device))
+		io_ptr = qcow2_io_manager;
+	else if (http_io_probe(fuse2fs.device))
+		io_ptr = http_io_manager;
+	retval = ext2fs_open(fuse2fs.device, EXT2_FLAG_64BITS |
+			     EXT2_FLAG_SOFTSUPP_FEATURES, 0, 0, io_ptr,
+			     &fuse2fs.fs);
+	if (retval) {
+		com_err(argv[0], retval, "while opening %s", fuse2fs.device);
+		exit(1);
+	}
+	if (EXT2_HAS_INCOMPAT_FEATURE(fuse2fs.fs->super,
+				      EXT3_FEATURE_INCOMPAT_RECOVER))
+		com_err(argv[0], 0, "%s has a journal that needs recovery; "
+			"recent changes will not be visible", fuse2fs.device);
+
+	/*
+	 * The caches are shared by every request, so make them large;
+	 * the default block cache size isn't an error when the I/O
+	 * manager can't be tuned, but one that was asked for is.
+	 */
+	cache_size = fuse2fs.cache_size ? fuse2fs.cache_size :
+		FUSE2FS_CACHE_SIZE;
+	cache_opt = malloc(strlen(cache_size) + 12);
+	if (!cache_opt) {
+		com_err(argv[0], ENOMEM, "while setting up caches");
+		exit(1);
+	}
+	sprintf(cache_opt, "cache_size=%s", cache_size);
+	retval = io_channel_set_options(fuse2fs.fs->io, cache_opt);
+	if (retval && fuse2fs.cache_size) {
+		com_err(argv[0], retval, "while setting %s", cache_opt);
+		exit(1);
+	}
+	free(cache_opt);
+	retval = ext2fs_create_inode_cache(fuse2fs.fs, fuse2fs.icache_size ?
+					   fuse2fs.icache_size :
+					   FUSE2FS_ICACHE_SIZE);
+	if (!retval)
+		retval = ext2fs_create_dentry_cache(fuse2fs.fs,
+				fuse2fs.dcache_size ? fuse2fs.dcache_size :
+				FUSE2FS_DCACHE_SIZE);
+	if (retval) {
+		com_err(argv[0], retval, "while setting up caches");
+		exit(1);
+	}
+	fuse2fs.ra_max = ra_bytes / fuse2fs.fs->blocksize;
+	if (fuse2fs.ra_max == 0)
+		fuse2fs.ra_max = 1;
+
+	/*
+	 * Run single threaded, since libext2fs takes no locks, and let
+	 * the kernel check permissions against the inodes' modes.
+	 */
+	fs_opt = malloc(strlen(fuse2fs.device) + sizeof(FUSE2FS_MOUNT_OPTS));
+	if (!fs_opt) {
+		com_err(argv[0], ENOMEM, "while building mount options");
+		exit(1);
+	}
+	sprintf(fs_opt, FUSE2FS_MOUNT_OPTS "%s", fuse2fs.device);
+	fuse_opt_add_arg(&args, "-s");
+	fuse_opt_add_arg(&args, fs_opt);
+
+	ret = fuse_main(args.argc, args.argv, &fuse2fs_ops, NULL);
+
+	fuse_opt_free_args(&args);
+	free(fs_opt);
+	ext2fs_close(fuse2fs.fs);
+	remove_error_table(&et_ext2_error_table);
+	return ret ? 1 : 0;
+}
@@ -44,6 +44,7 @@ extern char *optarg;
 
 #include "../version.h"
 #include "nls-enable.h"
+#include "dirwalk.h"
 
 #ifdef __GNUC__
 #define EXT2FS_ATTR(x) __attribute__(x)
@@ -59,6 +60,7 @@ static unsigned pf_options;
 static int recursive;
 static int verbose;
 static int generation_opt;
+static int num_workers;
 
 #ifdef _LFS64_LARGEFILE
 #define LSTAT		lstat64
@@ -68,42 +70,107 @@ static int generation_opt;
 #define STRUCT_STAT	struct stat
 #endif
 
+#ifdef O_LARGEFILE
+#define OPEN_FLAGS (O_RDONLY|O_NONBLOCK|O_LARGEFILE)
+#else
+#define OPEN_FLAGS (O_RDONLY|O_NONBLOCK)
+#endif
+
 static void usage(void)
 {
-	fprintf(stderr, _("Usage: %s [-RVadlv] [files...]\n"), program_name);
+	fprintf(stderr, _("Usage: %s [-RVadlv] [-w workers] [files...]\n"),
+		program_name);
 	exit(1);
 }
 
-static int list_attributes (const char * name)
+/*
+ * Print the flags of name to f, reading them through fd if it is open
+ * and by name if it is -1.
+ */
+static int show_attributes (FILE * f, const char * name, int fd)
 {
 	unsigned long flags;
 	unsigned long generation;
 
-	if (fgetflags (name, &flags) == -1) {
+	if ((fd < 0 ? fgetflags (name, &flags) : getflags (fd, &flags)) == -1) {
 		com_err (program_name, errno, _("While reading flags on %s"),
 			 name);
 		return -1;
 	}
 	if (generation_opt) {
-		if (fgetversion (name, &generation) == -1) {
+		if ((fd < 0 ? fgetversion (name, &generation) :
+		     getversion (fd, &generation)) == -1) {
 			com_err (program_name, errno,
 				 _("While reading version on %s"),
 				 name);
 			return -1;
 		}
-		printf ("%5lu ", generation);
+		fprintf (f, "%5lu ", generation);
 	}
 	if (pf_options & PFOPT_LONG) {
-		printf("%-28s ", name);
-		print_flags(stdout, flags, pf_options);
-		fputc('\n', stdout);
+		fprintf(f, "%-28s ", name);
+		print_flags(f, flags, pf_options);
+		fputc('\n', f);
 	} else {
-		print_flags(stdout, flags, pf_options);
-		printf(" %s\n", name);
+		print_flags(f, flags, pf_options);
+		fprintf(f, " %s\n", name);
 	}
 	return 0;
 }
 
+static int list_attributes (const char * name)
+{
+	return show_attributes (stdout, name, -1);
+}
+
+#ifdef HAVE_DIRWALK
+static struct dirwalk walk;
+
+/* Like lsattr_dir_proc(), problems with one entry don't stop the walk */
+static int lsattr_walk_entry (struct dirwalk *dw EXT2FS_ATTR((unused)),
+			      int dir_fd, const char *path, const char *name,
+			      mode_t mode, FILE *out)
+{
+	int fd;
+
+	if (!mode) {
+		perror (path);
+		return 0;
+	}
+	if (name[0] == '.' && !all)
+		return 0;
+	if (!S_ISREG(mode) && !S_ISDIR(mode)) {
+		com_err (program_name, EOPNOTSUPP,
+			 _("While reading flags on %s"), path);
+		return 0;
+	}
+	fd = openat (dir_fd, name, OPEN_FLAGS | O_NOFOLLOW);
+	if (fd == -1)
+		com_err (program_name, errno, _("While reading flags on %s"),
+			 path);
+	else {
+		show_attributes (out, path, fd);
+		close (fd);
+	}
+	return S_ISDIR(mode) && recursive;
+}
+
+static void lsattr_walk_begin (struct dirwalk *dw EXT2FS_ATTR((unused)),
+			       const char *path, int depth, FILE *out)
+{
+	if (depth)
+		fprintf (out, "\n%s:\n", path);
+}
+
+static void lsattr_walk_end (struct dirwalk *dw EXT2FS_ATTR((unused)),
+			     const char *path EXT2FS_ATTR((unused)),
+			     int depth, FILE *out)
+{
+	if (depth)
+		fputc ('\n', out);
+}
+#endif
+
 static int lsattr_dir_proc (const char *, struct dirent *, void *);
 
 static int lsattr_args (const char * name)
@@ -116,9 +183,13 @@ static int lsattr_args (const char * name)
 			 name);
 		retval = -1;
 	} else {
-		if (S_ISDIR(st.st_mode) && !dirs_opt)
+		if (S_ISDIR(st.st_mode) && !dirs_opt) {
+#ifdef HAVE_DIRWALK
+			if (walk.p)
+				return dirwalk_add (&walk, name);
+#endif
 			retval = iterate_on_dir (name, lsattr_dir_proc, NULL);
-		else
+		} else
 			retval = list_attributes (name);
 	}
 	return retval;
@@ -160,6 +231,7 @@ int main (int argc, char ** argv)
 	int c;
 	int i;
 	int err, retval = 0;
+	char *tmp;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -170,7 +242,7 @@ int main (int argc, char ** argv)
 #endif
 	if (argc && *argv)
 		program_name = *argv;
-	while ((c = getopt (argc, argv, "RVadlv")) != EOF)
+	while ((c = getopt (argc, argv, "RVadlvw:")) != EOF)
 		switch (c)
 		{
 			case 'R':
@@ -191,6 +263,16 @@ int main (int argc, char ** argv)
 			case 'v':
 				generation_opt = 1;
 				break;
+			case 'w':
+				num_workers = strtoul(optarg, &tmp, 0);
+				if (*tmp || num_workers < 1 ||
+				    num_workers > DIRWALK_MAX_WORKERS) {
+					com_err (program_name, 0,
+						 _("bad number of workers - %s"),
+						 optarg);
+					usage();
+				}
+				break;
 			default:
 				usage();
 		}
@@ -198,6 +280,18 @@ int main (int argc, char ** argv)
 	if (verbose)
 		fprintf (stderr, "lsattr %s (%s)\n",
 			 E2FSPROGS_VERSION, E2FSPROGS_DATE);
+	/* Where the workers can't be had, -w is accepted and ignored */
+#ifdef HAVE_DIRWALK
+	if (recursive && num_workers) {
+		walk.num_workers = num_workers;
+		walk.entry = lsattr_walk_entry;
+		walk.dir_begin = lsattr_walk_begin;
+		walk.dir_end = lsattr_walk_end;
+		if (dirwalk_start (&walk))
+			com_err (program_name, errno, "%s",
+				 _("while starting the workers"));
+	}
+#endif
 	if (optind > argc - 1) {
 		if (lsattr_args (".") == -1)
 			retval = 1;
@@ -208,5 +302,9 @@ int main (int argc, char ** argv)
 				retval = 1;
 		}
 	}
+#ifdef HAVE_DIRWALK
+	if (walk.p && dirwalk_finish (&walk))
+		retval = 1;
+#endif
 	exit(retval);
 }
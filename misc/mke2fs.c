@@ -56,6 +56,7 @@ extern int optind;
 #include "e2p/e2p.h"
 #include "ext2fs/ext2fs.h"
 #include "util.h"
+#include "populate.h"
 #include "profile.h"
 #include "prof_err.h"
 #include "../version.h"
@@ -105,6 +106,10 @@ static char *fs_uuid = NULL;
 static char *creator_os;
 static char *volume_label;
 static char *mount_dir;
+static char *src_root_dir;	/* -d: tree to copy into the new fs */
+static char *template_file;		/* -E template: layout to write */
+static char *save_template_file;	/* -E save_template: where to keep it */
+static struct populate_info src_info;
 char *journal_device;
 static int sync_kludge;	/* Set using the MKE2FS_SYNC env. option */
 static char **fs_types;
@@ -125,7 +130,7 @@ static void usage(void)
 	"[-M last-mounted-directory]\n\t[-O feature[,...]] "
 	"[-r fs-revision] [-E extended-option[,...]]\n"
 	"\t[-t fs-type] [-T usage-type ] [-U UUID] "
-	"[-jnqvDFKSV] device [blocks-count]\n"),
+	"[-d root-directory]\n\t[-jnqvDFKSV] device [blocks-count]\n"),
 		program_name);
 	exit(1);
 }
@@ -243,30 +248,46 @@ static void handle_bad_blocks(ext2_filsys fs, badblocks_list bb_list)
 	blk_t			j;
 	unsigned 		must_be_good;
 	blk_t			blk;
+	blk64_t			bad = 0;
+	unsigned int		num;
 	badblocks_iterate	bb_iter;
 	errcode_t		retval;
 	blk_t			group_block;
 	int			group;
 	int			group_bad;
+	ext2fs_block_bitmap	bb_map;
 
 	if (!bb_list)
 		return;
 
+	/*
+	 * The areas below are tested a range at a time, against the bad
+	 * blocks as extents, instead of looking each of their blocks up
+	 * in the list.
+	 */
+	retval = ext2fs_badblocks_list_to_bitmap(fs, bb_list, &bb_map);
+	if (retval) {
+		com_err("ext2fs_badblocks_list_to_bitmap", retval, "%s",
+			_("while processing list of bad blocks"));
+		exit(1);
+	}
+
 	/*
 	 * The primary superblock and group descriptors *must* be
 	 * good; if not, abort.
 	 */
 	must_be_good = fs->super->s_first_data_block + 1 + fs->desc_blocks;
-	for (i = fs->super->s_first_data_block; i <= must_be_good; i++) {
-		if (ext2fs_badblocks_list_test(bb_list, i)) {
-			fprintf(stderr, _("Block %d in primary "
-				"superblock/group descriptor area bad.\n"), i);
-			fprintf(stderr, _("Blocks %u through %u must be good "
-				"in order to build a filesystem.\n"),
-				fs->super->s_first_data_block, must_be_good);
-			fputs(_("Aborting....\n"), stderr);
-			exit(1);
-		}
+	i = fs->super->s_first_data_block;
+	if (!ext2fs_test_block_bitmap_range2(bb_map, i, must_be_good - i + 1)) {
+		ext2fs_find_first_set_block_bitmap2(bb_map, i, must_be_good,
+						    &bad);
+		fprintf(stderr, _("Block %d in primary "
+			"superblock/group descriptor area bad.\n"), (int) bad);
+		fprintf(stderr, _("Blocks %u through %u must be good "
+			"in order to build a filesystem.\n"),
+			fs->super->s_first_data_block, must_be_good);
+		fputs(_("Aborting....\n"), stderr);
+		exit(1);
 	}
 
 	/*
@@ -279,9 +300,14 @@ static void handle_bad_blocks(ext2_filsys fs, badblocks_list bb_list)
 
 	for (i = 1; i < fs->group_desc_count; i++) {
 		group_bad = 0;
-		for (j=0; j < fs->desc_blocks+1; j++) {
-			if (ext2fs_badblocks_list_test(bb_list,
-						       group_block + j)) {
+		num = fs->desc_blocks + 1;
+		if (group_block + num > ext2fs_blocks_count(fs->super))
+			num = ext2fs_blocks_count(fs->super) - group_block;
+		if (ext2fs_test_block_bitmap_range2(bb_map, group_block, num))
+			num = 0;	/* all good */
+		for (j = 0; j < num; j++) {
+			if (ext2fs_test_block_bitmap2(bb_map,
+						      group_block + j)) {
 				if (!group_bad)
 					fprintf(stderr,
 _("Warning: the backup superblock/group descriptors at block %u contain\n"
@@ -296,6 +322,7 @@ _("Warning: the backup superblock/group descriptors at block %u contain\n"
 		}
 		group_block += fs->super->s_blocks_per_group;
 	}
+	ext2fs_free_block_bitmap(bb_map);
 
 	/*
 	 * Mark all the bad blocks as used...
@@ -311,49 +338,122 @@ _("Warning: the backup superblock/group descriptors at block %u contain\n"
 	ext2fs_badblocks_list_iterate_end(bb_iter);
 }
 
+/*
+ * Zeroing requests are built up from adjacent inode tables (which is
+ * the normal case with flex_bg), so that a device which can zero a
+ * range by itself gets big requests; this bounds their size so that
+ * the progress meter still moves.
+ */
+#define ITABLE_ZERO_MAX_BLOCKS	65536
+
+/*
+ * Like ext2fs_numeric_progress_update(), but also shows the rate at
+ * which the inode tables are being zeroed.  Returns the width of what
+ * is on the screen, so that it can be erased afterwards.
+ */
+static int itable_progress_update(ext2_filsys fs,
+				  struct ext2fs_numeric_progress_struct *progress,
+				  dgrp_t group, __u64 bytes, time_t start,
+				  int width)
+{
+	static time_t	last_update;
+	time_t		now;
+	char		buf[80];
+	int		len;
+
+	if (!(fs->flags & EXT2_FLAG_PRINT_PROGRESS) ||
+	    progress->skip_progress)
+		return width;
+	now = time(0);
+	if (now == last_update)
+		return width;
+	last_update = now;
+
+	len = snprintf(buf, sizeof(buf), "%*u/%*llu", progress->log_max,
+		       group, progress->log_max, progress->max);
+	if (now > start && len > 0 && len < (int) sizeof(buf))
+		len += snprintf(buf + len, sizeof(buf) - len, _(" (%llu MB/s)"),
+				(unsigned long long) (bytes >> 20) /
+				(now - start));
+	if (len < 0 || len >= (int) sizeof(buf))
+		return width;
+	if (len > width)
+		width = len;
+	printf("%-*s", width, buf);
+	for (len = 0; len < width; len++)
+		putchar('\b');
+	fflush(stdout);
+	return width;
+}
+
 static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
 {
 	errcode_t	retval;
-	blk64_t		blk;
+	blk64_t		blk = 0, run_blk = 0;
 	dgrp_t		i;
-	int		num;
+	int		num = 0, run_num = 0, width = 0;
+	__u64		bytes = 0;
+	time_t		start;
 	struct ext2fs_numeric_progress_struct progress;
 
 	ext2fs_numeric_progress_init(fs, &progress,
 				     _("Writing inode tables: "),
 				     fs->group_desc_count);
-
-	for (i = 0; i < fs->group_desc_count; i++) {
-		ext2fs_numeric_progress_update(fs, &progress, i);
-
-		blk = ext2fs_inode_table_loc(fs, i);
-		num = fs->inode_blocks_per_group;
-
-		if (lazy_flag)
-			num = ext2fs_div_ceil((fs->super->s_inodes_per_group -
-					       ext2fs_bg_itable_unused(fs, i)) *
-					      EXT2_INODE_SIZE(fs->super),
-					      EXT2_BLOCK_SIZE(fs->super));
-		if (!lazy_flag || itable_zeroed) {
-			/* The kernel doesn't need to zero the itable blocks */
-			ext2fs_bg_flags_set(fs, i, EXT2_BG_INODE_ZEROED);
-			ext2fs_group_desc_csum_set(fs, i);
+	start = time(0);
+
+	for (i = 0; i <= fs->group_desc_count; i++) {
+		if (i < fs->group_desc_count) {
+			blk = ext2fs_inode_table_loc(fs, i);
+			num = fs->inode_blocks_per_group;
+
+			if (lazy_flag)
+				num = ext2fs_div_ceil((fs->super->s_inodes_per_group -
+						       ext2fs_bg_itable_unused(fs, i)) *
+						      EXT2_INODE_SIZE(fs->super),
+						      EXT2_BLOCK_SIZE(fs->super));
+			if (!lazy_flag || itable_zeroed) {
+				/* The kernel doesn't need to zero the itable blocks */
+				ext2fs_bg_flags_set(fs, i, EXT2_BG_INODE_ZEROED);
+				ext2fs_group_desc_csum_set(fs, i);
+			}
+			/* Extend the pending run if this table follows it */
+			if (run_num && blk == run_blk + run_num &&
+			    run_num + num <= ITABLE_ZERO_MAX_BLOCKS &&
+			    !sync_kludge) {
+				run_num += num;
+				continue;
+			}
 		}
-		retval = ext2fs_zero_blocks2(fs, blk, num, &blk, &num);
-		if (retval) {
-			fprintf(stderr, _("\nCould not write %d "
-				  "blocks in inode table starting at %llu: %s\n"),
-				num, blk, error_message(retval));
-			exit(1);
+		if (run_num) {
+			retval = ext2fs_zero_blocks2(fs, run_blk, run_num,
+						     &run_blk, &run_num);
+			if (retval) {
+				fprintf(stderr, _("\nCould not write %d "
+					  "blocks in inode table starting at %llu: %s\n"),
+					run_num, run_blk, error_message(retval));
+				exit(1);
+			}
+			bytes += (__u64) run_num * fs->blocksize;
+			width = itable_progress_update(fs, &progress, i,
+						       bytes, start, width);
+			if (sync_kludge) {
+				if (sync_kludge == 1)
+					sync();
+				else if (((i - 1) % sync_kludge) == 0)
+					sync();
+			}
 		}
-		if (sync_kludge) {
-			if (sync_kludge == 1)
-				sync();
-			else if ((i % sync_kludge) == 0)
-				sync();
+		if (i < fs->group_desc_count) {
+			run_blk = blk;
+			run_num = num;
 		}
 	}
 	ext2fs_zero_blocks2(0, 0, 0, 0, 0);
+	if (width) {
+		printf("%*s", width, "");
+		while (width-- > 0)
+			putchar('\b');
+	}
 	ext2fs_numeric_progress_close(fs, &progress,
 				      _("done                            \n"));
 }
@@ -854,6 +954,23 @@ static void parse_extended_opts(struct ext2_super_block *param,
 			discard = 1;
 		} else if (!strcmp(token, "nodiscard")) {
 			discard = 0;
+		} else if (!strcmp(token, "template") ||
+			   !strcmp(token, "save_template")) {
+			if (!arg || !*arg) {
+				r_usage++;
+				badopt = token;
+				continue;
+			}
+			p = strdup(arg);
+			if (!p) {
+				fprintf(stderr, "%s", _("Couldn't allocate "
+					"memory to parse options!\n"));
+				exit(1);
+			}
+			if (*token == 't')
+				template_file = p;
+			else
+				save_template_file = p;
 		} else if (!strcmp(token, "quotatype")) {
 			if (!arg) {
 				r_usage++;
@@ -892,7 +1009,9 @@ static void parse_extended_opts(struct ext2_super_block *param,
 			"\ttest_fs\n"
 			"\tdiscard\n"
 			"\tnodiscard\n"
-			"\tquotatype=<usr OR grp>\n\n"),
+			"\tquotatype=<usr OR grp>\n"
+			"\ttemplate=<template to write instead of laying out>\n"
+			"\tsave_template=<file to save a template in>\n\n"),
 			badopt ? badopt : "");
 		free(buf);
 		exit(1);
@@ -1397,7 +1516,7 @@ profile_error:
 	}
 
 	while ((c = getopt (argc, argv,
-		    "b:cg:i:jl:m:no:qr:s:t:vC:DE:FG:I:J:KL:M:N:O:R:ST:U:V")) != EOF) {
+		    "b:cd:g:i:jl:m:no:qr:s:t:vC:DE:FG:I:J:KL:M:N:O:R:ST:U:V")) != EOF) {
 		switch (c) {
 		case 'b':
 			blocksize = parse_num_blocks2(optarg, -1);
@@ -1430,6 +1549,9 @@ profile_error:
 				exit(1);
 			}
 			break;
+		case 'd':
+			src_root_dir = optarg;
+			break;
 		case 'D':
 			direct_io = 1;
 			break;
@@ -1610,6 +1732,21 @@ profile_error:
 		exit(0);
 	}
 
+	if (src_root_dir) {
+		if (super_only) {
+			com_err(program_name, 0, "%s",
+				_("The -d and -S options are incompatible"));
+			exit(1);
+		}
+		retval = populate_scan(src_root_dir, &src_info);
+		if (retval) {
+			com_err(program_name, retval, _("while scanning %s"),
+				src_info.err_path ? src_info.err_path :
+				src_root_dir);
+			exit(1);
+		}
+	}
+
 	/*
 	 * If there's no blocksize specified and there is a journal
 	 * device, use it to figure out the blocksize
@@ -2009,6 +2146,24 @@ profile_error:
 	if (extended_opts)
 		parse_extended_opts(&fs_param, extended_opts);
 
+	if (template_file && save_template_file) {
+		com_err(program_name, 0, "%s",
+			_("The template and save_template options are "
+			  "incompatible"));
+		exit(1);
+	}
+	if ((template_file || save_template_file) &&
+	    (super_only || cflag || bad_blocks_filename || journal_device ||
+	     (template_file && src_root_dir) ||
+	     (fs_param.s_feature_incompat &
+	      EXT3_FEATURE_INCOMPAT_JOURNAL_DEV))) {
+		com_err(program_name, 0, "%s",
+			_("Templates can't be used with -c, -l or -S, with "
+			  "an external journal,\n\tor to make a journal "
+			  "device; and -d can't be used with a template"));
+		exit(1);
+	}
+
 	/* Can't support bigalloc feature without extents feature */
 	if ((fs_param.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_BIGALLOC) &&
 	    !(fs_param.s_feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS)) {
@@ -2127,6 +2282,12 @@ profile_error:
 	fs_param.s_inodes_count = num_inodes ? num_inodes :
 		(ext2fs_blocks_count(&fs_param) * blocksize) / inode_ratio;
 
+	/* Make the inode tables big enough for the -d tree */
+	if (src_root_dir && !num_inodes &&
+	    fs_param.s_inodes_count < src_info.inodes + EXT2_GOOD_OLD_FIRST_INO)
+		fs_param.s_inodes_count = src_info.inodes +
+			EXT2_GOOD_OLD_FIRST_INO;
+
 	if ((((unsigned long long)fs_param.s_inodes_count) *
 	     (inode_size ? inode_size : EXT2_GOOD_OLD_INODE_SIZE)) >=
 	    ((ext2fs_blocks_count(&fs_param)) *
@@ -2152,6 +2313,139 @@ profile_error:
 	free(usage_types);
 }
 
+/*
+ * Does the template's superblock describe the file system which would
+ * have been laid out here?  Everything which decides where the
+ * metadata goes has to be the same.
+ */
+static int template_matches(struct ext2_super_block *t,
+			    struct ext2_super_block *sb)
+{
+	return ext2fs_blocks_count(t) == ext2fs_blocks_count(sb) &&
+		ext2fs_r_blocks_count(t) == ext2fs_r_blocks_count(sb) &&
+		t->s_inodes_count == sb->s_inodes_count &&
+		t->s_first_data_block == sb->s_first_data_block &&
+		t->s_log_block_size == sb->s_log_block_size &&
+		t->s_log_cluster_size == sb->s_log_cluster_size &&
+		t->s_blocks_per_group == sb->s_blocks_per_group &&
+		t->s_clusters_per_group == sb->s_clusters_per_group &&
+		t->s_inodes_per_group == sb->s_inodes_per_group &&
+		t->s_rev_level == sb->s_rev_level &&
+		t->s_first_ino == sb->s_first_ino &&
+		t->s_inode_size == sb->s_inode_size &&
+		t->s_feature_compat == sb->s_feature_compat &&
+		t->s_feature_incompat == sb->s_feature_incompat &&
+		/* The resize inode may have added large_file */
+		((t->s_feature_ro_compat ^ sb->s_feature_ro_compat) &
+		 ~EXT2_FEATURE_RO_COMPAT_LARGE_FILE) == 0 &&
+		t->s_reserved_gdt_blocks == sb->s_reserved_gdt_blocks &&
+		t->s_desc_size == sb->s_desc_size &&
+		t->s_log_groups_per_flex == sb->s_log_groups_per_flex &&
+		t->s_raid_stride == sb->s_raid_stride &&
+		t->s_raid_stripe_width == sb->s_raid_stripe_width &&
+		t->s_creator_os == sb->s_creator_os;
+}
+
+/*
+ * Write the template given with -E template instead of laying out the
+ * file system, then give the copy the UUID, hash seed, label and
+ * times which were set up for it in fs.  fs is freed.
+ */
+static void apply_template(ext2_filsys fs, io_manager io_ptr, int zeroed)
+{
+	struct ext2_super_block	tsb, param = *fs->super, *sb;
+	struct ext2_inode	inode;
+	ext2_filsys		tfs;
+	ext2_ino_t		ino[2];
+	dgrp_t			i;
+	errcode_t		retval;
+
+	retval = template_io_read_super(template_file, &tsb);
+	if (retval) {
+		com_err(program_name, retval, _("while reading template %s"),
+			template_file);
+		exit(1);
+	}
+	if (!template_matches(&tsb, fs->super)) {
+		com_err(program_name, 0,
+			_("template %s was made for a different layout"),
+			template_file);
+		exit(1);
+	}
+	if (!quiet) {
+		printf(_("Writing template %s: "), template_file);
+		fflush(stdout);
+	}
+	retval = template_io_apply(fs->io, template_file,
+				   zeroed ? TEMPLATE_IO_SKIP_ZEROES : 0);
+	if (retval) {
+		com_err(program_name, retval,
+			_("\n\twhile writing template %s"), template_file);
+		exit(1);
+	}
+	ext2fs_free(fs);
+
+	retval = ext2fs_open2(device_name, 0, EXT2_FLAG_RW |
+			      EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_64BITS, 0, 0,
+			      io_ptr, &tfs);
+	if (retval) {
+		com_err(program_name, retval,
+			_("\n\twhile opening %s after writing the template"),
+			device_name);
+		exit(1);
+	}
+	sb = tfs->super;
+	memcpy(sb->s_uuid, param.s_uuid, sizeof(sb->s_uuid));
+	memcpy(sb->s_hash_seed, param.s_hash_seed, sizeof(sb->s_hash_seed));
+	sb->s_def_hash_version = param.s_def_hash_version;
+	memcpy(sb->s_volume_name, param.s_volume_name,
+	       sizeof(sb->s_volume_name));
+	memcpy(sb->s_last_mounted, param.s_last_mounted,
+	       sizeof(sb->s_last_mounted));
+	sb->s_flags = param.s_flags;
+	sb->s_max_mnt_count = param.s_max_mnt_count;
+	sb->s_checkinterval = param.s_checkinterval;
+	sb->s_mkfs_time = sb->s_lastcheck = param.s_mkfs_time;
+	sb->s_kbytes_written = param.s_kbytes_written;
+	/* The group descriptor checksums depend on the UUID */
+	for (i = 0; i < tfs->group_desc_count; i++)
+		ext2fs_group_desc_csum_set(tfs, i);
+	ext2fs_mark_super_dirty(tfs);
+
+	/*
+	 * The directories mke2fs makes carry the time the template was
+	 * saved.  (The internal journal keeps the template's UUID in its
+	 * superblock; nothing looks at it there.)
+	 */
+	ino[0] = EXT2_ROOT_INO;
+	if (ext2fs_lookup(tfs, EXT2_ROOT_INO, "lost+found", 10, 0, &ino[1]))
+		ino[1] = 0;
+	for (i = 0; i < 2; i++) {
+		if (!ino[i])
+			continue;
+		retval = ext2fs_read_inode(tfs, ino[i], &inode);
+		if (!retval) {
+			inode.i_atime = inode.i_ctime = inode.i_mtime =
+				sb->s_mkfs_time;
+			retval = ext2fs_write_inode(tfs, ino[i], &inode);
+		}
+		if (retval) {
+			com_err(program_name, retval,
+				_("\n\twhile updating inode %u"), ino[i]);
+			exit(1);
+		}
+	}
+
+	retval = ext2fs_close(tfs);
+	if (retval) {
+		com_err(program_name, retval, "%s",
+			_("\n\twhile writing superblocks"));
+		exit(1);
+	}
+	if (!quiet)
+		printf("%s", _("done\n"));
+}
+
 static int should_do_undo(const char *name)
 {
 	errcode_t retval;
@@ -2279,18 +2573,22 @@ static int mke2fs_discard_device(ext2_filsys fs)
 	blk64_t cur;
 	int retval = 0;
 
+	count *= (1024 * 1024);
+	count /= fs->blocksize;
+	if (count > blocks)
+		count = blocks;
+
 	/*
 	 * Let's try if discard really works on the device, so
 	 * we do not print numeric progress resulting in failure
-	 * afterwards.
+	 * afterwards.  The first step is used for this, since a
+	 * single block may be smaller than what the device can
+	 * discard.
 	 */
-	retval = io_channel_discard(fs->io, 0, fs->blocksize);
+	retval = io_channel_discard(fs->io, 0, count);
 	if (retval)
 		return retval;
-	cur = fs->blocksize;
-
-	count *= (1024 * 1024);
-	count /= fs->blocksize;
+	cur = count;
 
 	ext2fs_numeric_progress_init(fs, &progress,
 				     _("Discarding device blocks: "),
@@ -2392,12 +2690,18 @@ int main (int argc, char *argv[])
 #endif
 		io_ptr = unix_io_manager;
 
-	if (should_do_undo(device_name)) {
+	/* The device is opened again once a template is written */
+	if (!template_file && should_do_undo(device_name)) {
 		retval = mke2fs_setup_tdb(device_name, &io_ptr);
 		if (retval)
 			exit(1);
 	}
 
+	if (save_template_file) {
+		set_template_io_backing_manager(io_ptr);
+		io_ptr = template_io_manager;
+	}
+
 	/*
 	 * Initialize the superblock....
 	 */
@@ -2431,7 +2735,12 @@ int main (int argc, char *argv[])
 	/* Can't undo discard ... */
 	if (!noaction && discard && (io_ptr != undo_io_manager)) {
 		retval = mke2fs_discard_device(fs);
-		if (!retval && io_channel_discard_zeroes_data(fs->io)) {
+		/*
+		 * A template has to hold the zeroed inode tables, since
+		 * the devices it goes to may not read back zeroes.
+		 */
+		if (!retval && io_channel_discard_zeroes_data(fs->io) &&
+		    !save_template_file) {
 			if (verbose)
 				printf("%s",
 				       _("Discard succeeded and will return "
@@ -2561,6 +2870,11 @@ int main (int argc, char *argv[])
 		exit(ext2fs_close(fs) ? 1 : 0);
 	}
 
+	if (template_file) {
+		apply_template(fs, io_ptr, itable_zeroed);
+		exit(0);
+	}
+
 	if (bad_blocks_filename)
 		read_bb_file(fs, &bb_list, bad_blocks_filename);
 	if (cflag)
@@ -2722,6 +3036,23 @@ no_journal:
 			       fs->super->s_mmp_update_interval);
 	}
 
+	if (src_root_dir) {
+		if (!quiet) {
+			printf("%s", _("Copying files into the device: "));
+			fflush(stdout);
+		}
+		retval = populate_fs(fs, src_root_dir, &src_info);
+		if (retval) {
+			com_err(program_name, retval,
+				_("\n\twhile populating file system from %s"),
+				src_info.err_path ? src_info.err_path :
+				src_root_dir);
+			exit(1);
+		}
+		if (!quiet)
+			printf("%s", _("done\n"));
+	}
+
 	if (EXT2_HAS_RO_COMPAT_FEATURE(&fs_param,
 				       EXT4_FEATURE_RO_COMPAT_BIGALLOC))
 		fix_cluster_bg_counts(fs);
@@ -2734,6 +3065,17 @@ no_journal:
 		       "filesystem accounting information: "));
 	checkinterval = fs->super->s_checkinterval;
 	max_mnt_count = fs->super->s_max_mnt_count;
+	if (save_template_file) {
+		retval = ext2fs_flush(fs);
+		if (!retval)
+			retval = template_io_save(fs->io, save_template_file);
+		if (retval) {
+			com_err(program_name, retval,
+				_("\n\twhile saving template %s"),
+				save_template_file);
+			exit(1);
+		}
+	}
 	retval = ext2fs_close(fs);
 	if (retval) {
 		fprintf(stderr, "%s",
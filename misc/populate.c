@@ -0,0 +1,848 @@
+/*
+ * populate.c --- copy a directory tree into a new file system
+ *
+ * This is what "mke2fs -d" uses.  The source tree is walked once, in
+ * sorted order, and each inode, its data, and the directory blocks
+ * which name it are written exactly once:
+ *
+ *  - inodes are handed out in the order the files are found, so they
+ *    fill the inode tables from the start;
+ *  - file data is written through EXT2_FILE_DELALLOC, so each file
+ *    lands in contiguous runs just after the previous one, and each
+ *    run goes out with one large write;
+ *  - a directory's blocks are built in memory once all of its entries
+ *    are known, instead of adding names one at a time with
+ *    ext2fs_link() and growing the directory with ext2fs_expand_dir().
+ *
+ * populate_scan() is run first, before the file system is created, so
+ * that mke2fs can make the inode tables big enough.
+ *
+ * Extended attributes are not copied.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
+
+#include "ext2fs/ext2_fs.h"
+#include "ext2fs/ext2fs.h"
+#include "et/com_err.h"
+#include "nls-enable.h"
+#include "populate.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Size of the buffer file data is copied through */
+#define COPY_BUF_SIZE	(1024 * 1024)
+
+struct dir_ent {
+	char		*name;
+	ext2_ino_t	ino;
+	int		filetype;
+};
+
+/* An inode which more than one name in the source tree refers to */
+struct hard_link {
+	dev_t		dev;
+	ino_t		src_ino;
+	ext2_ino_t	ino;
+};
+
+struct populate_ctx {
+	ext2_filsys	fs;
+	char		path[PATH_MAX];
+	ext2_ino_t	last_ino;	/* allocation hint */
+	char		*buf;		/* COPY_BUF_SIZE bytes */
+	char		*dirbuf;	/* one block */
+	struct hard_link *links;
+	unsigned int	links_size;	/* a power of 2 */
+	unsigned int	links_used;
+};
+
+/*
+ * Append name to path, which is len bytes long, and return the new
+ * length in *ret_len.
+ */
+static errcode_t path_push(char *path, size_t len, const char *name,
+			   size_t *ret_len)
+{
+	size_t	n = strlen(name);
+
+	if (len + n + 2 > PATH_MAX)
+		return ENAMETOOLONG;
+	if (len && path[len - 1] != '/')
+		path[len++] = '/';
+	memcpy(path + len, name, n + 1);
+	*ret_len = len + n;
+	return 0;
+}
+
+static int dir_ent_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dir_ent *) a)->name,
+		      ((const struct dir_ent *) b)->name);
+}
+
+static void free_dir_ents(struct dir_ent *ents, unsigned int num)
+{
+	unsigned int	i;
+
+	for (i = 0; i < num; i++)
+		free(ents[i].name);
+	free(ents);
+}
+
+/*
+ * Read the names in the directory at path, sorted so that the image
+ * doesn't depend on the order readdir() returns them in.  The
+ * directory is closed again before anything under it is visited, so
+ * deep trees don't run out of file descriptors.
+ */
+static errcode_t read_dir_ents(const char *path, int skip_lost_found,
+			       struct dir_ent **ret_ents,
+			       unsigned int *ret_num)
+{
+	struct dir_ent	*ents = 0, *new_ents;
+	unsigned int	num = 0, size = 0;
+	struct dirent	*de;
+	DIR		*dir;
+	errcode_t	retval = 0;
+
+	dir = opendir(path);
+	if (!dir)
+		return errno;
+	while ((errno = 0, de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (skip_lost_found && !strcmp(de->d_name, "lost+found")) {
+			fprintf(stderr, _("Warning: skipping %s/lost+found; "
+					  "mke2fs creates its own.\n"), path);
+			continue;
+		}
+		if (strlen(de->d_name) > EXT2_NAME_LEN) {
+			retval = ENAMETOOLONG;
+			break;
+		}
+		if (num == size) {
+			size = size ? size * 2 : 32;
+			new_ents = realloc(ents, size * sizeof(*ents));
+			if (!new_ents) {
+				retval = EXT2_ET_NO_MEMORY;
+				break;
+			}
+			ents = new_ents;
+		}
+		ents[num].name = strdup(de->d_name);
+		if (!ents[num].name) {
+			retval = EXT2_ET_NO_MEMORY;
+			break;
+		}
+		ents[num].ino = 0;
+		ents[num].filetype = EXT2_FT_UNKNOWN;
+		num++;
+	}
+	if (!retval && errno)
+		retval = errno;
+	closedir(dir);
+	if (retval) {
+		free_dir_ents(ents, num);
+		return retval;
+	}
+	if (num)
+		qsort(ents, num, sizeof(*ents), dir_ent_cmp);
+	*ret_ents = ents;
+	*ret_num = num;
+	return 0;
+}
+
+static errcode_t scan_dir(char *path, size_t len, struct populate_info *info)
+{
+	struct dir_ent	*ents;
+	unsigned int	i, num;
+	struct stat	st;
+	size_t		sub_len;
+	errcode_t	retval;
+
+	retval = read_dir_ents(path, 0, &ents, &num);
+	if (retval)
+		return retval;
+	for (i = 0; i < num; i++) {
+		retval = path_push(path, len, ents[i].name, &sub_len);
+		if (retval)
+			break;
+		if (lstat(path, &st) < 0) {
+			retval = errno;
+			break;
+		}
+		info->inodes++;
+		if (S_ISDIR(st.st_mode)) {
+			info->dirs++;
+			retval = scan_dir(path, sub_len, info);
+			if (retval)
+				break;
+		} else {
+			if (st.st_nlink > 1)
+				info->links++;
+			if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+				info->bytes += st.st_size;
+		}
+		path[len] = 0;
+	}
+	free_dir_ents(ents, num);
+	return retval;
+}
+
+/*
+ * Count what is under source, so that the file system can be sized
+ * to hold it.  An inode with several links is counted once per link.
+ */
+errcode_t populate_scan(const char *source, struct populate_info *info)
+{
+	char		path[PATH_MAX];
+	struct stat	st;
+	size_t		len;
+	errcode_t	retval;
+
+	memset(info, 0, sizeof(*info));
+	if (stat(source, &st) < 0)
+		return errno;
+	if (!S_ISDIR(st.st_mode))
+		return ENOTDIR;
+	len = strlen(source);
+	if (len >= PATH_MAX)
+		return ENAMETOOLONG;
+	strcpy(path, source);
+	retval = scan_dir(path, len, info);
+	if (retval) {
+		info->err_path = strdup(path);
+		return retval;
+	}
+	return 0;
+}
+
+/*
+ * The hard link table is open addressed, and grows when it is half
+ * full.
+ */
+static unsigned int link_hash(struct populate_ctx *ctx, dev_t dev, ino_t ino)
+{
+	return ((unsigned int) ino * 2654435761U + (unsigned int) dev) &
+		(ctx->links_size - 1);
+}
+
+static struct hard_link *find_link(struct populate_ctx *ctx, dev_t dev,
+				   ino_t ino)
+{
+	unsigned int	h;
+
+	if (!ctx->links_size)
+		return 0;
+	for (h = link_hash(ctx, dev, ino); ctx->links[h].ino;
+	     h = (h + 1) & (ctx->links_size - 1))
+		if (ctx->links[h].dev == dev && ctx->links[h].src_ino == ino)
+			return &ctx->links[h];
+	return 0;
+}
+
+static errcode_t add_link(struct populate_ctx *ctx, dev_t dev, ino_t src_ino,
+			  ext2_ino_t ino)
+{
+	struct hard_link *old = ctx->links;
+	unsigned int	old_size = ctx->links_size, i, h;
+	errcode_t	retval;
+
+	if (2 * (ctx->links_used + 1) > ctx->links_size) {
+		ctx->links_size = old_size ? old_size * 2 : 64;
+		retval = ext2fs_get_memzero(ctx->links_size *
+					    sizeof(struct hard_link),
+					    &ctx->links);
+		if (retval) {
+			ctx->links = old;
+			ctx->links_size = old_size;
+			return retval;
+		}
+		ctx->links_used = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i].ino)
+				add_link(ctx, old[i].dev, old[i].src_ino,
+					 old[i].ino);
+		if (old)
+			ext2fs_free_mem(&old);
+	}
+	for (h = link_hash(ctx, dev, src_ino); ctx->links[h].ino;
+	     h = (h + 1) & (ctx->links_size - 1))
+		;
+	ctx->links[h].dev = dev;
+	ctx->links[h].src_ino = src_ino;
+	ctx->links[h].ino = ino;
+	ctx->links_used++;
+	return 0;
+}
+
+static int mode_to_filetype(int mode)
+{
+	if (LINUX_S_ISREG(mode))
+		return EXT2_FT_REG_FILE;
+	if (LINUX_S_ISDIR(mode))
+		return EXT2_FT_DIR;
+	if (LINUX_S_ISCHR(mode))
+		return EXT2_FT_CHRDEV;
+	if (LINUX_S_ISBLK(mode))
+		return EXT2_FT_BLKDEV;
+	if (LINUX_S_ISLNK(mode))
+		return EXT2_FT_SYMLINK;
+	if (LINUX_S_ISFIFO(mode))
+		return EXT2_FT_FIFO;
+	if (LINUX_S_ISSOCK(mode))
+		return EXT2_FT_SOCK;
+	return EXT2_FT_UNKNOWN;
+}
+
+static errcode_t new_inode(struct populate_ctx *ctx, ext2_ino_t dir,
+			   int mode, ext2_ino_t *ret)
+{
+	errcode_t	retval;
+
+	/*
+	 * A directory goes where the library spreads directories to;
+	 * anything else is searched for on from the last inode handed
+	 * out, so that files follow the directory they were put in.
+	 */
+	if (!LINUX_S_ISDIR(mode) && ctx->last_ino)
+		dir = ctx->last_ino;
+	retval = ext2fs_new_inode(ctx->fs, dir, mode, 0, ret);
+	if (retval)
+		return retval;
+	ext2fs_inode_alloc_stats2(ctx->fs, *ret, +1, LINUX_S_ISDIR(mode));
+	ctx->last_ino = *ret;
+	return 0;
+}
+
+static void fill_inode(struct ext2_inode *inode, struct stat *st, int mode)
+{
+	memset(inode, 0, sizeof(*inode));
+	inode->i_mode = mode | (st->st_mode & 07777);
+	inode->i_uid = st->st_uid;
+	ext2fs_set_i_uid_high(*inode, st->st_uid >> 16);
+	inode->i_gid = st->st_gid;
+	ext2fs_set_i_gid_high(*inode, st->st_gid >> 16);
+	inode->i_atime = st->st_atime;
+	inode->i_mtime = st->st_mtime;
+	inode->i_ctime = st->st_ctime;
+	inode->i_links_count = 1;
+}
+
+/* Give an inode which will have data an empty extent tree */
+static errcode_t init_extents(ext2_filsys fs, ext2_ino_t ino,
+			      struct ext2_inode *inode)
+{
+	ext2_extent_handle_t	handle;
+	errcode_t		retval;
+
+	if (!EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+				       EXT3_FEATURE_INCOMPAT_EXTENTS))
+		return 0;
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+	ext2fs_extent_free(handle);
+	return 0;
+}
+
+static errcode_t write_all(ext2_file_t file, const char *buf,
+			   unsigned int len)
+{
+	unsigned int	written;
+	errcode_t	retval;
+
+	while (len) {
+		retval = ext2fs_file_write(file, buf, len, &written);
+		if (retval)
+			return retval;
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+static int is_zero(const char *buf, unsigned int len)
+{
+	return len == 0 || (buf[0] == 0 && !memcmp(buf, buf + 1, len - 1));
+}
+
+/*
+ * Copy the contents of fd into the file.  Blocks of zeros in a source
+ * file which is itself sparse become holes.
+ */
+static errcode_t copy_data(struct populate_ctx *ctx, int fd, ext2_ino_t ino,
+			   struct stat *st)
+{
+	ext2_filsys	fs = ctx->fs;
+	ext2_file_t	file;
+	unsigned int	bs = fs->blocksize, i, start, n;
+	__u64		pos = 0;
+	ssize_t		got;
+	int		sparse;
+	errcode_t	retval, retval2;
+
+	sparse = (__u64) st->st_blocks * 512 < (__u64) st->st_size;
+
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE | EXT2_FILE_DELALLOC,
+				  &file);
+	if (retval)
+		return retval;
+
+	while ((got = read(fd, ctx->buf, COPY_BUF_SIZE)) != 0) {
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			retval = errno;
+			goto out;
+		}
+		if (!sparse) {
+			retval = write_all(file, ctx->buf, got);
+			if (retval)
+				goto out;
+			pos += got;
+			continue;
+		}
+		/* Write each run of blocks which aren't all zeros */
+		for (start = i = 0; i < (unsigned int) got; i += n) {
+			n = got - i < bs ? got - i : bs;
+			if (!is_zero(ctx->buf + i, n))
+				continue;
+			retval = write_all(file, ctx->buf + start, i - start);
+			if (retval)
+				goto out;
+			start = i + n;
+			retval = ext2fs_file_llseek(file, pos + start,
+						    EXT2_SEEK_SET, NULL);
+			if (retval)
+				goto out;
+		}
+		retval = write_all(file, ctx->buf + start, got - start);
+		if (retval)
+			goto out;
+		pos += got;
+	}
+
+	/* A hole at the end of the file */
+	if (EXT2_I_SIZE(ext2fs_file_get_inode(file)) < pos)
+		retval = ext2fs_file_set_size2(file, pos);
+out:
+	retval2 = ext2fs_file_close(file);
+	return retval ? retval : retval2;
+}
+
+static errcode_t write_file(struct populate_ctx *ctx, ext2_ino_t parent,
+			    struct stat *st, ext2_ino_t *ret_ino)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct ext2_inode inode;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+	int		fd;
+
+	fd = open(ctx->path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	retval = new_inode(ctx, parent, LINUX_S_IFREG, &ino);
+	if (retval)
+		goto out;
+	fill_inode(&inode, st, LINUX_S_IFREG);
+	retval = init_extents(fs, ino, &inode);
+	if (retval)
+		goto out;
+	retval = ext2fs_write_new_inode(fs, ino, &inode);
+	if (retval)
+		goto out;
+	retval = copy_data(ctx, fd, ino, st);
+	if (retval)
+		goto out;
+	*ret_ino = ino;
+out:
+	close(fd);
+	return retval;
+}
+
+static errcode_t write_symlink(struct populate_ctx *ctx, ext2_ino_t parent,
+			       struct stat *st, ext2_ino_t *ret_ino)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct ext2_inode inode;
+	ext2_file_t	file;
+	ext2_ino_t	ino;
+	errcode_t	retval, retval2;
+	ssize_t		len;
+
+	len = readlink(ctx->path, ctx->buf, COPY_BUF_SIZE);
+	if (len < 0)
+		return errno;
+	if (len >= fs->blocksize)
+		return ENAMETOOLONG;
+	retval = new_inode(ctx, parent, LINUX_S_IFLNK, &ino);
+	if (retval)
+		return retval;
+	fill_inode(&inode, st, LINUX_S_IFLNK);
+
+	/* Short targets live in i_block ("fast" symlinks) */
+	if (len < (ssize_t) sizeof(inode.i_block)) {
+		memcpy(inode.i_block, ctx->buf, len);
+		inode.i_size = len;
+		retval = ext2fs_write_new_inode(fs, ino, &inode);
+		goto out;
+	}
+
+	retval = init_extents(fs, ino, &inode);
+	if (retval)
+		return retval;
+	retval = ext2fs_write_new_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE, &file);
+	if (retval)
+		return retval;
+	retval = write_all(file, ctx->buf, len);
+	retval2 = ext2fs_file_close(file);
+	if (!retval)
+		retval = retval2;
+out:
+	if (!retval)
+		*ret_ino = ino;
+	return retval;
+}
+
+static errcode_t write_special(struct populate_ctx *ctx, ext2_ino_t parent,
+			       struct stat *st, int mode, ext2_ino_t *ret_ino)
+{
+	struct ext2_inode inode;
+	ext2_ino_t	ino;
+	unsigned int	major, minor;
+	errcode_t	retval;
+
+	retval = new_inode(ctx, parent, mode, &ino);
+	if (retval)
+		return retval;
+	fill_inode(&inode, st, mode);
+	if (LINUX_S_ISCHR(mode) || LINUX_S_ISBLK(mode)) {
+		major = major(st->st_rdev);
+		minor = minor(st->st_rdev);
+		if ((major < 256) && (minor < 256)) {
+			inode.i_block[0] = major * 256 + minor;
+			inode.i_block[1] = 0;
+		} else {
+			inode.i_block[0] = 0;
+			inode.i_block[1] = (minor & 0xff) | (major << 8) |
+				((minor & ~0xff) << 12);
+		}
+	}
+	retval = ext2fs_write_new_inode(ctx->fs, ino, &inode);
+	if (retval)
+		return retval;
+	*ret_ino = ino;
+	return 0;
+}
+
+static void swab_dir_block(ext2_filsys fs EXT2FS_ATTR((unused)),
+			   char *buf EXT2FS_ATTR((unused)))
+{
+#ifdef WORDS_BIGENDIAN
+	struct ext2_dir_entry *dirent;
+	char		*p = buf, *end = buf + fs->blocksize;
+	unsigned int	rec_len;
+
+	while (p < end) {
+		dirent = (struct ext2_dir_entry *) p;
+		ext2fs_get_rec_len(fs, dirent, &rec_len);
+		p += rec_len;
+		dirent->inode = ext2fs_swab32(dirent->inode);
+		dirent->rec_len = ext2fs_swab16(dirent->rec_len);
+		dirent->name_len = ext2fs_swab16(dirent->name_len);
+	}
+#endif
+}
+
+/*
+ * Write out all of a directory's entries, starting with "." and "..",
+ * packed into as few blocks as they fit in.
+ */
+static errcode_t write_dir_blocks(struct populate_ctx *ctx, ext2_ino_t ino,
+				  ext2_ino_t parent, struct dir_ent *ents,
+				  unsigned int num)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct ext2_dir_entry *dirent = 0;
+	ext2_file_t	file;
+	unsigned int	i, offset = 0, len, name_len, filetype = 0;
+	const char	*name;
+	errcode_t	retval, retval2;
+
+	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)
+		filetype = 1;
+
+	retval = ext2fs_file_open(fs, ino, EXT2_FILE_WRITE | EXT2_FILE_DELALLOC,
+				  &file);
+	if (retval)
+		return retval;
+
+	memset(ctx->dirbuf, 0, fs->blocksize);
+	for (i = 0; i < num + 2; i++) {
+		if (i < 2) {
+			name = i ? ".." : ".";
+			name_len = i + 1;
+		} else {
+			name = ents[i - 2].name;
+			name_len = strlen(name);
+		}
+		len = EXT2_DIR_REC_LEN(name_len);
+		if (offset + len > fs->blocksize) {
+			/* The last entry takes the rest of the block */
+			ext2fs_set_rec_len(fs, fs->blocksize -
+					   ((char *) dirent - ctx->dirbuf),
+					   dirent);
+			swab_dir_block(fs, ctx->dirbuf);
+			retval = write_all(file, ctx->dirbuf, fs->blocksize);
+			if (retval)
+				goto out;
+			memset(ctx->dirbuf, 0, fs->blocksize);
+			offset = 0;
+		}
+		dirent = (struct ext2_dir_entry *) (ctx->dirbuf + offset);
+		dirent->inode = i < 2 ? (i ? parent : ino) : ents[i - 2].ino;
+		dirent->name_len = name_len;
+		if (filetype)
+			dirent->name_len |= (i < 2 ? EXT2_FT_DIR :
+					     ents[i - 2].filetype) << 8;
+		memcpy(dirent->name, name, name_len);
+		ext2fs_set_rec_len(fs, len, dirent);
+		offset += len;
+	}
+	ext2fs_set_rec_len(fs, fs->blocksize - ((char *) dirent - ctx->dirbuf),
+			   dirent);
+	swab_dir_block(fs, ctx->dirbuf);
+	retval = write_all(file, ctx->dirbuf, fs->blocksize);
+out:
+	retval2 = ext2fs_file_close(file);
+	return retval ? retval : retval2;
+}
+
+/*
+ * Copy everything under the source directory at ctx->path, which is
+ * len bytes long, into the directory ino.  ino's inode must already
+ * exist; its entries and its link count are filled in here.
+ */
+static errcode_t populate_dir(struct populate_ctx *ctx, size_t len,
+			      ext2_ino_t ino, ext2_ino_t parent)
+{
+	ext2_filsys	fs = ctx->fs;
+	struct dir_ent	*ents, *new_ents;
+	struct hard_link *link;
+	struct ext2_inode inode;
+	struct stat	st;
+	unsigned int	i, num, subdirs = 0;
+	size_t		sub_len;
+	ext2_ino_t	child, lpf;
+	errcode_t	retval;
+	int		root = (ino == EXT2_ROOT_INO);
+
+	retval = read_dir_ents(ctx->path, root, &ents, &num);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < num; i++) {
+		retval = path_push(ctx->path, len, ents[i].name, &sub_len);
+		if (retval)
+			goto out;
+		if (lstat(ctx->path, &st) < 0) {
+			retval = errno;
+			goto out;
+		}
+
+		if (!S_ISDIR(st.st_mode) && st.st_nlink > 1 &&
+		    (link = find_link(ctx, st.st_dev, st.st_ino)) != NULL) {
+			retval = ext2fs_read_inode(fs, link->ino, &inode);
+			if (retval)
+				goto out;
+			inode.i_links_count++;
+			retval = ext2fs_write_inode(fs, link->ino, &inode);
+			if (retval)
+				goto out;
+			ents[i].ino = link->ino;
+			ents[i].filetype = mode_to_filetype(inode.i_mode);
+			ctx->path[len] = 0;
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			retval = new_inode(ctx, ino, LINUX_S_IFDIR, &child);
+			if (retval)
+				goto out;
+			fill_inode(&inode, &st, LINUX_S_IFDIR);
+			inode.i_links_count = 2;
+			retval = init_extents(fs, child, &inode);
+			if (retval)
+				goto out;
+			retval = ext2fs_write_new_inode(fs, child, &inode);
+			if (retval)
+				goto out;
+			retval = populate_dir(ctx, sub_len, child, ino);
+			subdirs++;
+		} else if (S_ISREG(st.st_mode))
+			retval = write_file(ctx, ino, &st, &child);
+		else if (S_ISLNK(st.st_mode))
+			retval = write_symlink(ctx, ino, &st, &child);
+		else if (S_ISCHR(st.st_mode))
+			retval = write_special(ctx, ino, &st, LINUX_S_IFCHR,
+					       &child);
+		else if (S_ISBLK(st.st_mode))
+			retval = write_special(ctx, ino, &st, LINUX_S_IFBLK,
+					       &child);
+		else if (S_ISFIFO(st.st_mode))
+			retval = write_special(ctx, ino, &st, LINUX_S_IFIFO,
+					       &child);
+		else if (S_ISSOCK(st.st_mode))
+			retval = write_special(ctx, ino, &st, LINUX_S_IFSOCK,
+					       &child);
+		else
+			retval = EXT2_ET_FILE_NOT_FOUND;
+		if (retval)
+			goto out;
+		ctx->path[len] = 0;
+
+		if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+			retval = add_link(ctx, st.st_dev, st.st_ino, child);
+			if (retval)
+				goto out;
+		}
+		retval = ext2fs_read_inode(fs, child, &inode);
+		if (retval)
+			goto out;
+		ents[i].ino = child;
+		ents[i].filetype = mode_to_filetype(inode.i_mode);
+	}
+
+	/* Keep the lost+found which mke2fs made */
+	if (root) {
+		retval = ext2fs_lookup(fs, EXT2_ROOT_INO, "lost+found", 10,
+				       0, &lpf);
+		if (retval == 0) {
+			new_ents = realloc(ents, (num + 1) * sizeof(*ents));
+			if (!new_ents) {
+				retval = EXT2_ET_NO_MEMORY;
+				goto out;
+			}
+			ents = new_ents;
+			memmove(ents + 1, ents, num * sizeof(*ents));
+			ents[0].name = strdup("lost+found");
+			ents[0].ino = lpf;
+			ents[0].filetype = EXT2_FT_DIR;
+			num++;
+			if (!ents[0].name) {
+				retval = EXT2_ET_NO_MEMORY;
+				goto out;
+			}
+			subdirs++;
+		} else if (retval != EXT2_ET_FILE_NOT_FOUND)
+			goto out;
+	}
+
+	retval = write_dir_blocks(ctx, ino, parent, ents, num);
+	if (retval)
+		goto out;
+
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (retval)
+		goto out;
+	inode.i_links_count = 2 + subdirs;
+	if (root) {
+		if (stat(ctx->path, &st) < 0) {
+			retval = errno;
+			goto out;
+		}
+		inode.i_mode = LINUX_S_IFDIR | (st.st_mode & 07777);
+		inode.i_uid = st.st_uid;
+		ext2fs_set_i_uid_high(inode, st.st_uid >> 16);
+		inode.i_gid = st.st_gid;
+		ext2fs_set_i_gid_high(inode, st.st_gid >> 16);
+		inode.i_atime = st.st_atime;
+		inode.i_mtime = st.st_mtime;
+		inode.i_ctime = st.st_ctime;
+	}
+	retval = ext2fs_write_inode(fs, ino, &inode);
+out:
+	free_dir_ents(ents, num);
+	return retval;
+}
+
+/*
+ * Copy the tree under source into the root directory of fs, which
+ * must be freshly made: holding nothing but lost+found.  info is what
+ * populate_scan() returned; if this fails, info->err_path says where.
+ */
+errcode_t populate_fs(ext2_filsys fs, const char *source,
+		      struct populate_info *info)
+{
+	struct populate_ctx ctx;
+	errcode_t	retval;
+	int		spread, space_cache;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fs = fs;
+	if (strlen(source) >= PATH_MAX)
+		return ENAMETOOLONG;
+	strcpy(ctx.path, source);
+
+	retval = ext2fs_get_mem(COPY_BUF_SIZE, &ctx.buf);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(fs->blocksize, &ctx.dirbuf);
+	if (retval)
+		goto out;
+
+	/* Keep the trees under the root apart, as the kernel would */
+	spread = fs->flags & EXT2_FLAG_SPREAD_DIRS;
+	fs->flags |= EXT2_FLAG_SPREAD_DIRS;
+	/* and give each file the run of blocks which fits it best */
+	space_cache = !fs->space_cache &&
+		ext2fs_create_space_cache(fs) == 0;
+	retval = populate_dir(&ctx, strlen(source), EXT2_ROOT_INO,
+			      EXT2_ROOT_INO);
+	if (space_cache)
+		ext2fs_free_space_cache(fs);
+	if (!spread)
+		fs->flags &= ~EXT2_FLAG_SPREAD_DIRS;
+	if (retval) {
+		free(info->err_path);
+		info->err_path = strdup(ctx.path);
+	}
+out:
+	if (ctx.links)
+		ext2fs_free_mem(&ctx.links);
+	if (ctx.dirbuf)
+		ext2fs_free_mem(&ctx.dirbuf);
+	ext2fs_free_mem(&ctx.buf);
+	return retval;
+}
@@ -0,0 +1,24 @@
+/*
+ * populate.h --- copy a directory tree into a new file system
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+/*
+ * Totals gathered by populate_scan(), which mke2fs uses to size the
+ * file system before it is created.
+ */
+struct populate_info {
+	__u64	inodes;		/* files, directories, and so on */
+	__u64	dirs;
+	__u64	links;		/* non-directories with more than one link */
+	__u64	bytes;		/* regular file and symlink data */
+	char	*err_path;	/* path that populate_fs() stopped at */
+};
+
+extern errcode_t populate_scan(const char *source, struct populate_info *info);
+extern errcode_t populate_fs(ext2_filsys fs, const char *source,
+			     struct populate_info *info);
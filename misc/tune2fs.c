@@ -53,6 +53,7 @@ extern int optind;
 
 #include "ext2fs/ext2_fs.h"
 #include "ext2fs/ext2fs.h"
+#include "ext2fs/ext2fsP.h"
 #include "et/com_err.h"
 #include "uuid/uuid.h"
 #include "e2p/e2p.h"
@@ -98,14 +99,22 @@ static int usrquota, grpquota;
 int journal_size, journal_flags;
 char *journal_device;
 
-static struct list_head blk_move_list;
-
+/*
+ * Runs of blocks moved out of the way of the inode tables, in
+ * ascending order of old_loc.
+ */
 struct blk_move {
-	struct list_head list;
 	blk64_t old_loc;
 	blk64_t new_loc;
+	blk64_t len;
 };
 
+static struct blk_move *blk_moves;
+static size_t num_blk_moves, max_blk_moves;
+
+/* Largest run of blocks copied by move_block() in one go */
+#define MOVE_BATCH_BLOCKS	256
+
 
 static const char *please_fsck = N_("Please run e2fsck on the filesystem.\n");
 
@@ -279,16 +288,39 @@ no_valid_journal:
 }
 
 /* Helper function for remove_journal_inode */
+/* Blocks seen by release_blocks_proc() which are not freed yet */
+struct release_run {
+	blk64_t	start;
+	blk64_t	len;
+};
+
+static void release_block_run(ext2_filsys fs, struct release_run *run)
+{
+	if (run->len)
+		ext2fs_block_alloc_stats_range(fs, run->start, run->len, -1);
+	run->len = 0;
+}
+
 static int release_blocks_proc(ext2_filsys fs, blk64_t *blocknr,
 			       e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
 			       blk64_t ref_block EXT2FS_ATTR((unused)),
 			       int ref_offset EXT2FS_ATTR((unused)),
-			       void *private EXT2FS_ATTR((unused)))
+			       void *private)
 {
+	struct release_run *run = private;
 	blk64_t	block;
 	int	group;
 
 	block = *blocknr;
+	if (EXT2FS_CLUSTER_RATIO(fs) == 1) {
+		/* Free runs of consecutive blocks together */
+		if (block != run->start + run->len)
+			release_block_run(fs, run);
+		if (!run->len)
+			run->start = block;
+		run->len++;
+		return 0;
+	}
 	ext2fs_unmark_block_bitmap2(fs->block_map, block);
 	group = ext2fs_group_of_blk2(fs, block);
 	ext2fs_bg_free_blocks_count_set(fs, group, ext2fs_bg_free_blocks_count(fs, group) + 1);
@@ -305,6 +337,7 @@ static errcode_t remove_journal_inode(ext2_filsys fs)
 	struct ext2_inode	inode;
 	errcode_t		retval;
 	ino_t			ino = fs->super->s_journal_inum;
+	struct release_run	run;
 
 	retval = ext2fs_read_inode(fs, ino,  &inode);
 	if (retval) {
@@ -319,9 +352,11 @@ static errcode_t remove_journal_inode(ext2_filsys fs)
 				_("while reading bitmaps"));
 			return retval;
 		}
+		run.start = run.len = 0;
 		retval = ext2fs_block_iterate3(fs, ino,
 					       BLOCK_FLAG_READ_ONLY, NULL,
-					       release_blocks_proc, NULL);
+					       release_blocks_proc, &run);
+		release_block_run(fs, &run);
 		if (retval) {
 			com_err(program_name, retval, "%s",
 				_("while clearing journal inode"));
@@ -562,8 +597,8 @@ mmp_error:
 			gd = ext2fs_group_desc(fs, fs->group_desc, i);
 			gd->bg_itable_unused = 0;
 			gd->bg_flags = EXT2_BG_INODE_ZEROED;
-			ext2fs_group_desc_csum_set(fs, i);
 		}
+		ext2fs_group_desc_csum_set_all(fs);
 		fs->flags &= ~EXT2_FLAG_SUPER_ONLY;
 	}
 
@@ -1375,6 +1410,23 @@ static int ext2fs_is_block_in_group(ext2_filsys fs, dgrp_t group, blk64_t blk)
 	return 0;
 }
 
+/*
+ * Copy the run of blocks at the end of blk_moves to its new location.
+ */
+static errcode_t copy_blk_move(ext2_filsys fs, char *buf)
+{
+	struct blk_move *bmv;
+	errcode_t retval;
+
+	if (!num_blk_moves)
+		return 0;
+	bmv = &blk_moves[num_blk_moves - 1];
+	retval = io_channel_read_blk64(fs->io, bmv->old_loc, bmv->len, buf);
+	if (retval)
+		return retval;
+	return io_channel_write_blk64(fs->io, bmv->new_loc, bmv->len, buf);
+}
+
 static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
 {
 
@@ -1382,17 +1434,23 @@ static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
 	dgrp_t group = 0;
 	errcode_t retval;
 	int meta_data = 0;
-	blk64_t blk, new_blk, goal;
+	blk64_t blk, new_blk, goal, end;
 	struct blk_move *bmv;
+	struct ext2fs_numeric_progress_struct progress;
 
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	retval = ext2fs_get_array(MOVE_BATCH_BLOCKS, fs->blocksize, &buf);
 	if (retval)
 		return retval;
 
+	ext2fs_numeric_progress_init(fs, &progress,
+				     _("Relocating blocks: "),
+				     ext2fs_blocks_count(fs->super));
+	end = ext2fs_blocks_count(fs->super) - 1;
 	for (new_blk = blk = fs->super->s_first_data_block;
-	     blk < ext2fs_blocks_count(fs->super); blk++) {
-		if (!ext2fs_test_block_bitmap2(bmap, blk))
-			continue;
+	     blk <= end; blk++) {
+		if (ext2fs_find_first_set_block_bitmap2(bmap, blk, end, &blk))
+			break;
+		ext2fs_numeric_progress_update(fs, &progress, blk);
 
 		if (ext2fs_is_meta_block(fs, blk)) {
 			/*
@@ -1422,24 +1480,40 @@ static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
 		/* Mark this block as allocated */
 		ext2fs_mark_block_bitmap2(fs->block_map, new_blk);
 
-		/* Add it to block move list */
-		retval = ext2fs_get_mem(sizeof(struct blk_move), &bmv);
-		if (retval)
-			goto err_out;
-
+		/*
+		 * Add it to the block move list, growing the last run
+		 * if both the old and the new location follow on from
+		 * it; the blocks of a run are copied together once the
+		 * run is complete.
+		 */
+		if (num_blk_moves) {
+			bmv = &blk_moves[num_blk_moves - 1];
+			if (bmv->old_loc + bmv->len == blk &&
+			    bmv->new_loc + bmv->len == new_blk &&
+			    bmv->len < MOVE_BATCH_BLOCKS) {
+				bmv->len++;
+				continue;
+			}
+			retval = copy_blk_move(fs, buf);
+			if (retval)
+				goto err_out;
+		}
+		if (num_blk_moves == max_blk_moves) {
+			retval = ext2fs_resize_mem(max_blk_moves *
+					sizeof(struct blk_move),
+					(max_blk_moves + 1024) *
+					sizeof(struct blk_move), &blk_moves);
+			if (retval)
+				goto err_out;
+			max_blk_moves += 1024;
+		}
+		bmv = &blk_moves[num_blk_moves++];
 		bmv->old_loc = blk;
 		bmv->new_loc = new_blk;
-
-		list_add(&(bmv->list), &blk_move_list);
-
-		retval = io_channel_read_blk64(fs->io, blk, 1, buf);
-		if (retval)
-			goto err_out;
-
-		retval = io_channel_write_blk64(fs->io, new_blk, 1, buf);
-		if (retval)
-			goto err_out;
+		bmv->len = 1;
 	}
+	retval = copy_blk_move(fs, buf);
+	ext2fs_numeric_progress_close(fs, &progress, _("done\n"));
 
 err_out:
 	ext2fs_free_mem(&buf);
@@ -1448,13 +1522,19 @@ err_out:
 
 static blk64_t translate_block(blk64_t blk)
 {
-	struct list_head *entry;
+	size_t lo = 0, hi = num_blk_moves;
 	struct blk_move *bmv;
 
-	list_for_each(entry, &blk_move_list) {
-		bmv = list_entry(entry, struct blk_move, list);
-		if (bmv->old_loc == blk)
-			return bmv->new_loc;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		bmv = &blk_moves[mid];
+		if (blk < bmv->old_loc)
+			hi = mid;
+		else if (blk >= bmv->old_loc + bmv->len)
+			lo = mid + 1;
+		else
+			return bmv->new_loc + (blk - bmv->old_loc);
 	}
 
 	return 0;
@@ -1485,6 +1565,29 @@ static int process_block(ext2_filsys fs EXT2FS_ATTR((unused)),
 	return ret;
 }
 
+struct check_run {
+	ext2fs_block_bitmap bmap;
+	int		found;
+};
+
+/*
+ * Only a file with a block in bmap needs to be walked block by block;
+ * finding out is a single test of the bitmap per run of blocks.
+ */
+static int check_block_run(ext2_filsys fs EXT2FS_ATTR((unused)),
+			   blk64_t lblk EXT2FS_ATTR((unused)),
+			   blk64_t pblk, __u32 len,
+			   int flags EXT2FS_ATTR((unused)),
+			   void *priv_data)
+{
+	struct check_run *cr = (struct check_run *) priv_data;
+
+	if (ext2fs_test_block_bitmap_range2(cr->bmap, pblk, len))
+		return 0;
+	cr->found = 1;
+	return BLOCK_ABORT;
+}
+
 static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 {
 	errcode_t retval = 0;
@@ -1493,7 +1596,10 @@ static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 	char *block_buf = 0;
 	struct ext2_inode inode;
 	ext2_inode_scan	scan = NULL;
+	struct ext2fs_numeric_progress_struct progress;
+	struct check_run cr;
 
+	cr.bmap = bmap;
 	retval = ext2fs_get_mem(fs->blocksize * 3, &block_buf);
 	if (retval)
 		return retval;
@@ -1502,6 +1608,9 @@ static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 	if (retval)
 		goto err_out;
 
+	ext2fs_numeric_progress_init(fs, &progress,
+				     _("Updating block references: "),
+				     fs->super->s_inodes_count);
 	while (1) {
 		retval = ext2fs_get_next_inode(scan, &ino, &inode);
 		if (retval)
@@ -1509,6 +1618,7 @@ static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 
 		if (!ino)
 			break;
+		ext2fs_numeric_progress_update(fs, &progress, ino);
 
 		if (inode.i_links_count == 0)
 			continue; /* inode not in use */
@@ -1542,12 +1652,21 @@ static int inode_scan_and_fix(ext2_filsys fs, ext2fs_block_bitmap bmap)
 		if (!ext2fs_inode_has_valid_blocks2(fs, &inode))
 			continue;
 
+		cr.found = 0;
+		retval = ext2fs_extent_iterate(fs, ino, 0, block_buf,
+					       check_block_run, &cr);
+		if (retval)
+			goto err_out;
+		if (!cr.found)
+			continue;
+
 		retval = ext2fs_block_iterate3(fs, ino, 0, block_buf,
 					       process_block, bmap);
 		if (retval)
 			goto err_out;
 
 	}
+	ext2fs_numeric_progress_close(fs, &progress, _("done\n"));
 
 err_out:
 	ext2fs_free_mem(&block_buf);
@@ -1596,6 +1715,7 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	char *tmp_old_itable = NULL, *tmp_new_itable = NULL;
 	unsigned long old_ino_size;
 	int old_itable_size, new_itable_size;
+	struct ext2fs_numeric_progress_struct progress;
 
 	old_itable_size = fs->inode_blocks_per_group * fs->blocksize;
 	old_ino_size = EXT2_INODE_SIZE(fs->super);
@@ -1618,8 +1738,20 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	tmp_old_itable = old_itable;
 	tmp_new_itable = new_itable;
 
+	ext2fs_numeric_progress_init(fs, &progress,
+				     _("Expanding inode tables: "),
+				     fs->group_desc_count);
 	for (i = 0; i < fs->group_desc_count; i++) {
+		ext2fs_numeric_progress_update(fs, &progress, i);
 		blk = ext2fs_inode_table_loc(fs, i);
+		/*
+		 * Have the next table on its way from the disk while
+		 * this one is converted and written out.
+		 */
+		if (i + 1 < fs->group_desc_count)
+			io_channel_cache_readahead(fs->io,
+					ext2fs_inode_table_loc(fs, i + 1),
+					fs->inode_blocks_per_group);
 		retval = io_channel_read_blk64(fs->io, blk,
 				fs->inode_blocks_per_group, old_itable);
 		if (retval)
@@ -1644,6 +1776,7 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 		if (retval)
 			goto err_out;
 	}
+	ext2fs_numeric_progress_close(fs, &progress, _("done\n"));
 
 	/* Update the meta data */
 	fs->inode_blocks_per_group = new_ino_blks_per_grp;
@@ -1661,30 +1794,26 @@ err_out:
 
 static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
 {
-	blk64_t		blk;
-	ext2_ino_t	ino;
-	unsigned int	group = 0;
-	unsigned int	count = 0;
-	int		total_free = 0;
-	int		group_free = 0;
+	blk64_t		first, last, used, group_free;
+	blk64_t		total_free = 0;
+	ext2_ino_t	used_inodes, group_inodes_free;
+	ext2_ino_t	total_inodes_free = 0;
+	dgrp_t		group;
+	errcode_t	retval;
 
 	/*
 	 * First calculate the block statistics
 	 */
-	for (blk = fs->super->s_first_data_block;
-	     blk < ext2fs_blocks_count(fs->super); blk++) {
-		if (!ext2fs_fast_test_block_bitmap2(fs->block_map, blk)) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_blocks_per_group) ||
-		    (blk == ext2fs_blocks_count(fs->super)-1)) {
-			ext2fs_bg_free_blocks_count_set(fs, group++,
-							group_free);
-			count = 0;
-			group_free = 0;
-		}
+	for (group = 0; group < fs->group_desc_count; group++) {
+		first = ext2fs_group_first_block2(fs, group);
+		last = ext2fs_group_last_block2(fs, group);
+		retval = ext2fs_count_used_clusters(fs, first, last, &used);
+		if (retval)
+			return retval;
+		group_free = EXT2FS_B2C(fs, last) - EXT2FS_B2C(fs, first) + 1 -
+			used;
+		ext2fs_bg_free_blocks_count_set(fs, group, group_free);
+		total_free += group_free;
 	}
 	total_free = EXT2FS_C2B(fs, total_free);
 	ext2fs_free_blocks_count_set(fs->super, total_free);
@@ -1692,46 +1821,28 @@ static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
 	/*
 	 * Next, calculate the inode statistics
 	 */
-	group_free = 0;
-	total_free = 0;
-	count = 0;
-	group = 0;
-
-	/* Protect loop from wrap-around if s_inodes_count maxed */
-	for (ino = 1; ino <= fs->super->s_inodes_count && ino > 0; ino++) {
-		if (!ext2fs_fast_test_inode_bitmap2(fs->inode_map, ino)) {
-			group_free++;
-			total_free++;
-		}
-		count++;
-		if ((count == fs->super->s_inodes_per_group) ||
-		    (ino == fs->super->s_inodes_count)) {
-			ext2fs_bg_free_inodes_count_set(fs, group++,
-							group_free);
-			count = 0;
-			group_free = 0;
-		}
+	for (group = 0; group < fs->group_desc_count; group++) {
+		retval = ext2fs_count_used_inodes(fs,
+				group * fs->super->s_inodes_per_group + 1,
+				(group + 1) * fs->super->s_inodes_per_group,
+				&used_inodes);
+		if (retval)
+			return retval;
+		group_inodes_free = fs->super->s_inodes_per_group -
+			used_inodes;
+		ext2fs_bg_free_inodes_count_set(fs, group, group_inodes_free);
+		total_inodes_free += group_inodes_free;
 	}
-	fs->super->s_free_inodes_count = total_free;
+	fs->super->s_free_inodes_count = total_inodes_free;
 	ext2fs_mark_super_dirty(fs);
 	return 0;
 }
 
-#define list_for_each_safe(pos, pnext, head) \
-	for (pos = (head)->next, pnext = pos->next; pos != (head); \
-	     pos = pnext, pnext = pos->next)
-
 static void free_blk_move_list(void)
 {
-	struct list_head *entry, *tmp;
-	struct blk_move *bmv;
-
-	list_for_each_safe(entry, tmp, &blk_move_list) {
-		bmv = list_entry(entry, struct blk_move, list);
-		list_del(entry);
-		ext2fs_free_mem(&bmv);
-	}
-	return;
+	if (blk_moves)
+		ext2fs_free_mem(&blk_moves);
+	num_blk_moves = max_blk_moves = 0;
 }
 
 static int resize_inode(ext2_filsys fs, unsigned long new_size)
@@ -1750,8 +1861,6 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 		fputs(_("Failed to read block bitmap\n"), stderr);
 		return retval;
 	}
-	INIT_LIST_HEAD(&blk_move_list);
-
 
 	new_ino_blks_per_grp = ext2fs_div_ceil(
 					EXT2_INODES_PER_GROUP(fs->super)*
@@ -1771,6 +1880,10 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 				"increasing inode size\n"), stderr);
 		return retval;
 	}
+
+	/* This can take a long time on a big file system */
+	fs->flags |= EXT2_FLAG_PRINT_PROGRESS;
+
 	retval = get_move_bitmaps(fs, new_ino_blks_per_grp, bmap);
 	if (retval) {
 		fputs(_("Not enough space to increase inode size \n"), stderr);
@@ -1804,12 +1917,14 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 err_out:
 	free_blk_move_list();
 	ext2fs_free_block_bitmap(bmap);
+	fs->flags &= ~EXT2_FLAG_PRINT_PROGRESS;
 
 	return retval;
 
 err_out_undo:
 	free_blk_move_list();
 	ext2fs_free_block_bitmap(bmap);
+	fs->flags &= ~EXT2_FLAG_PRINT_PROGRESS;
 	fputs(_("Error in resizing the inode size.\n"
 			"Run e2undo to undo the "
 			"file system changes. \n"), stderr);
@@ -1923,6 +2038,9 @@ retry_open:
 
 	open_flag |= EXT2_FLAG_64BITS;
 
+	/* Most changes only touch the superblock */
+	open_flag |= EXT2_FLAG_LAZY_DESC;
+
 	/* keep the filesystem struct around to dump MMP data */
 	open_flag |= EXT2_FLAG_NOFREE_ON_ERROR;
 
@@ -2201,8 +2319,7 @@ retry_open:
 			goto closefs;
 		}
 		if (set_csum) {
-			for (i = 0; i < fs->group_desc_count; i++)
-				ext2fs_group_desc_csum_set(fs, i);
+			ext2fs_group_desc_csum_set_all(fs);
 			fs->flags &= ~EXT2_FLAG_SUPER_ONLY;
 		}
 		ext2fs_mark_super_dirty(fs);
@@ -2270,5 +2387,5 @@ if (rc) {
 		exit(1);
 #endif
 	}
-	return (ext2fs_close(fs) ? 1 : 0);
+	return (ext2fs_close2(fs, EXT2_FLAG_FLUSH_DEFER_BACKUPS) ? 1 : 0);
 }
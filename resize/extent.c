@@ -190,6 +190,48 @@ __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc)
 	return 0;
 }
 
+/*
+ * Like ext2fs_extent_translate(), but for a range of count locations
+ * starting at old_loc.  Returns the new location of old_loc, or 0 if
+ * it isn't being moved, and sets *ret_count to the number of locations
+ * from old_loc onwards for which that stays true (contiguously).
+ */
+__u64 ext2fs_extent_translate_range(ext2_extent extent, __u64 old_loc,
+				    __u64 count, __u64 *ret_count)
+{
+	struct ext2_extent_entry *ent;
+	__s64	low, high, mid;
+
+	if (!extent->sorted) {
+		qsort(extent->list, extent->num,
+		      sizeof(struct ext2_extent_entry), extent_cmp);
+		extent->sorted = 1;
+	}
+	/* Find the first entry which ends after old_loc */
+	low = 0;
+	high = extent->num;
+	while (low < high) {
+		mid = (low + high) / 2;
+		ent = extent->list + mid;
+		if (ent->old_loc + ent->size <= old_loc)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	*ret_count = count;
+	if ((__u64) low >= extent->num)
+		return 0;
+	ent = extent->list + low;
+	if (ent->old_loc > old_loc) {
+		if (ent->old_loc - old_loc < count)
+			*ret_count = ent->old_loc - old_loc;
+		return 0;
+	}
+	if (ent->old_loc + ent->size - old_loc < count)
+		*ret_count = ent->old_loc + ent->size - old_loc;
+	return ent->new_loc + (old_loc - ent->old_loc);
+}
+
 /*
  * For debugging only
  */
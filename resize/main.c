@@ -28,6 +28,7 @@ extern int optind;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "e2p/e2p.h"
 
@@ -37,11 +38,13 @@ extern int optind;
 
 char *program_name;
 static char *device_name, *io_options;
+static time_t pass_start;
 
 static void usage (char *prog)
 {
-	fprintf (stderr, _("Usage: %s [-d debug_flags] [-f] [-F] [-M] [-P] "
-			   "[-p] device [new_size]\n\n"), prog);
+	fprintf (stderr, _("Usage: %s [-d debug_flags] [-f] [-F] "
+			   "[-G flex_bg_size] [-m] [-M] [-n] [-P] [-p] "
+			   "device [new_size]\n\n"), prog);
 
 	exit (1);
 }
@@ -81,6 +84,7 @@ static errcode_t resize_progress_func(ext2_resize_t rfs, int pass,
 			break;
 		}
 		printf(_("Begin pass %d (max = %lu)\n"), pass, max);
+		pass_start = time(0);
 		retval = ext2fs_progress_init(&progress, label, 30,
 					      40, max, 0);
 		if (retval)
@@ -94,6 +98,17 @@ static errcode_t resize_progress_func(ext2_resize_t rfs, int pass,
 			ext2fs_progress_close(progress);
 		progress = 0;
 		rfs->prog_data = 0;
+		/* Only worth reporting for moves that took a while */
+		if (pass == E2_RSZ_BLOCK_RELOC_PASS &&
+		    time(0) - pass_start >= 1) {
+			unsigned long	mb, secs;
+
+			mb = ((unsigned long long) max *
+			      rfs->new_fs->blocksize) >> 20;
+			secs = time(0) - pass_start;
+			printf(_("Relocated %lu MB in %lu seconds "
+				 "(%lu MB/s)\n"), mb, secs, mb / secs);
+		}
 	}
 	return 0;
 }
@@ -175,8 +190,9 @@ int main (int argc, char ** argv)
 	blk64_t		max_size = 0;
 	blk64_t		min_size = 0;
 	io_manager	io_ptr;
-	char		*new_size_str = 0;
+	char		*new_size_str = 0, *tmp;
 	int		use_stride = -1;
+	unsigned long	flex_bg_size = 0;
 	ext2fs_struct_stat st_buf;
 	__s64		new_file_size;
 	unsigned int	sys_page_size = 4096;
@@ -199,7 +215,7 @@ int main (int argc, char ** argv)
 	if (argc && *argv)
 		program_name = *argv;
 
-	while ((c = getopt (argc, argv, "d:fFhMPpS:")) != EOF) {
+	while ((c = getopt (argc, argv, "d:fFG:hmMnPpS:")) != EOF) {
 		switch (c) {
 		case 'h':
 			usage(program_name);
@@ -210,9 +226,29 @@ int main (int argc, char ** argv)
 		case 'F':
 			flush = 1;
 			break;
+		case 'G':
+			flex_bg_size = strtoul(optarg, &tmp, 0);
+			if (*tmp || flex_bg_size < 2 ||
+			    (flex_bg_size & (flex_bg_size - 1)) ||
+			    flex_bg_size > (1UL << 31)) {
+				com_err(program_name, 0,
+					_("Invalid flex_bg size: %s\n"),
+					optarg);
+				exit(1);
+			}
+			for (c = 0; (1UL << c) < flex_bg_size; c++)
+				;
+			flags |= RESIZE_FLEX_BG | (c << RESIZE_FLEX_LOG_SHIFT);
+			break;
+		case 'm':
+			flags |= RESIZE_PLAN_MOVES;
+			break;
 		case 'M':
 			force_min_size = 1;
 			break;
+		case 'n':
+			flags |= RESIZE_DRY_RUN;
+			break;
 		case 'P':
 			print_min_size = 1;
 			break;
@@ -266,7 +302,20 @@ int main (int argc, char ** argv)
 		len = 2 * len;
 	}
 
-	fd = ext2fs_open_file(device_name, O_RDWR, 0);
+	if ((flags & RESIZE_FLEX_BG) && (mount_flags & EXT2_MF_MOUNTED)) {
+		com_err(program_name, 0, "%s",
+			_("The file system must be unmounted to convert it "
+			  "to flex_bg"));
+		exit(1);
+	}
+	if ((flags & RESIZE_DRY_RUN) && (mount_flags & EXT2_MF_MOUNTED)) {
+		com_err(program_name, 0, "%s",
+			_("A dry run is not possible for an online resize"));
+		exit(1);
+	}
+
+	fd = ext2fs_open_file(device_name,
+			      (flags & RESIZE_DRY_RUN) ? O_RDONLY : O_RDWR, 0);
 	if (fd < 0) {
 		com_err("open", errno, _("while opening %s"),
 			device_name);
@@ -304,7 +353,7 @@ int main (int argc, char ** argv)
 #endif
 		io_ptr = unix_io_manager;
 
-	if (!(mount_flags & EXT2_MF_MOUNTED))
+	if (!(mount_flags & EXT2_MF_MOUNTED) && !(flags & RESIZE_DRY_RUN))
 		io_flags = EXT2_FLAG_RW | EXT2_FLAG_EXCLUSIVE;
 
 	io_flags |= EXT2_FLAG_64BITS;
@@ -328,6 +377,15 @@ int main (int argc, char ** argv)
 		exit(1);
 	}
 
+	if ((flags & RESIZE_FLEX_BG) &&
+	    EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+				      EXT4_FEATURE_INCOMPAT_FLEX_BG)) {
+		com_err(program_name, 0,
+			_("%s already has the flex_bg feature\n"),
+			device_name);
+		exit(1);
+	}
+
 	min_size = calculate_minimum_resize_size(fs, flags);
 
 	if (print_min_size) {
@@ -367,7 +425,18 @@ int main (int argc, char ** argv)
 			_("while trying to determine filesystem size"));
 		exit(1);
 	}
-	if (force_min_size)
+	if (flags & RESIZE_FLEX_BG) {
+		if (force_min_size || (new_size_str &&
+		    parse_num_blocks2(new_size_str,
+				      fs->super->s_log_block_size) !=
+		    ext2fs_blocks_count(fs->super))) {
+			com_err(program_name, 0, "%s",
+				_("The size can't be changed while "
+				  "converting to flex_bg\n"));
+			exit(1);
+		}
+		new_size = ext2fs_blocks_count(fs->super);
+	} else if (force_min_size)
 		new_size = min_size;
 	else if (new_size_str) {
 		new_size = parse_num_blocks2(new_size_str,
@@ -422,6 +491,9 @@ int main (int argc, char ** argv)
 	    (((__u64) 1) << (sizeof(st_buf.st_size)*8 - 1)) - 1)
 		fd = -1;
 	if ((new_file_size > st_buf.st_size) &&
+	    (fd > 0) && (flags & RESIZE_DRY_RUN))
+		max_size = new_size;
+	else if ((new_file_size > st_buf.st_size) &&
 	    (fd > 0)) {
 		if ((ext2fs_llseek(fd, new_file_size-1, SEEK_SET) >= 0) &&
 		    (write(fd, "0", 1) == 1))
@@ -434,7 +506,8 @@ int main (int argc, char ** argv)
 			fs->blocksize / 1024, new_size);
 		exit(1);
 	}
-	if (new_size == ext2fs_blocks_count(fs->super)) {
+	if (new_size == ext2fs_blocks_count(fs->super) &&
+	    !(flags & RESIZE_FLEX_BG)) {
 		fprintf(stderr, _("The filesystem is already %llu blocks "
 			"long.  Nothing to do!\n\n"), new_size);
 		exit(0);
@@ -452,9 +525,22 @@ int main (int argc, char ** argv)
 			exit(1);
 		}
 		bigalloc_check(fs, force);
-		printf(_("Resizing the filesystem on "
-			 "%s to %llu (%dk) blocks.\n"),
-		       device_name, new_size, fs->blocksize / 1024);
+		if ((flags & RESIZE_FLEX_BG) && (flags & RESIZE_DRY_RUN))
+			printf(_("Planning the conversion of the filesystem "
+				 "on %s to flex_bg (%lu groups per flex "
+				 "group).\n"), device_name, flex_bg_size);
+		else if (flags & RESIZE_FLEX_BG)
+			printf(_("Converting the filesystem on %s to flex_bg "
+				 "(%lu groups per flex group).\n"),
+			       device_name, flex_bg_size);
+		else if (flags & RESIZE_DRY_RUN)
+			printf(_("Planning a resize of the filesystem on "
+				 "%s to %llu (%dk) blocks.\n"),
+			       device_name, new_size, fs->blocksize / 1024);
+		else
+			printf(_("Resizing the filesystem on "
+				 "%s to %llu (%dk) blocks.\n"),
+			       device_name, new_size, fs->blocksize / 1024);
 		retval = resize_fs(fs, &new_size, flags,
 				   ((flags & RESIZE_PERCENT_COMPLETE) ?
 				    resize_progress_func : 0));
@@ -463,15 +549,28 @@ int main (int argc, char ** argv)
 	if (retval) {
 		com_err(program_name, retval, _("while trying to resize %s"),
 			device_name);
-		fprintf(stderr,
-			_("Please run 'e2fsck -fy %s' to fix the filesystem\n"
-			  "after the aborted resize operation.\n"),
-			device_name);
+		if (!(flags & RESIZE_DRY_RUN))
+			fprintf(stderr,
+				_("Please run 'e2fsck -fy %s' to fix the "
+				  "filesystem\nafter the aborted resize "
+				  "operation.\n"), device_name);
 		ext2fs_close(fs);
 		exit(1);
 	}
-	printf(_("The filesystem on %s is now %llu blocks long.\n\n"),
-	       device_name, new_size);
+	if (flags & RESIZE_DRY_RUN) {
+		printf(_("Dry run only; %s was not changed.\n\n"),
+		       device_name);
+		if (fd > 0)
+			close(fd);
+		remove_error_table(&et_ext2_error_table);
+		return 0;
+	}
+	if (flags & RESIZE_FLEX_BG)
+		printf(_("The filesystem on %s now has its group metadata "
+			 "in flex groups.\n\n"), device_name);
+	else
+		printf(_("The filesystem on %s is now %llu blocks long.\n\n"),
+		       device_name, new_size);
 
 	if ((st_buf.st_size > new_file_size) &&
 	    (fd > 0)) {
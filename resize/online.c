@@ -45,6 +45,26 @@ static int parse_version_number(const char *s)
 
 #define VERSION_CODE(a,b,c) (((a) << 16) + ((b) << 8) + (c))
 
+/*
+ * The kernel keeps the allocation bitmaps of the existing block
+ * groups itself, and adjust_fs_info() only needs bitmaps to lay out
+ * the new groups, all of which lie past the current end of the file
+ * system.  So rather than reading in every bitmap block of a file
+ * system which may be many terabytes in size, start from empty
+ * in-memory bitmaps.
+ */
+static errcode_t online_alloc_bitmaps(ext2_filsys fs)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_allocate_block_bitmap(fs, _("block bitmap"),
+					      &fs->block_map);
+	if (retval)
+		return retval;
+	return ext2fs_allocate_inode_bitmap(fs, _("inode bitmap"),
+					    &fs->inode_map);
+}
+
 #endif
 
 errcode_t online_resize_fs(ext2_filsys fs, const char *mtpt,
@@ -182,7 +202,7 @@ errcode_t online_resize_fs(ext2_filsys fs, const char *mtpt,
 	percent = (ext2fs_r_blocks_count(sb) * 100.0) /
 		ext2fs_blocks_count(sb);
 
-	retval = ext2fs_read_bitmaps(fs);
+	retval = online_alloc_bitmaps(fs);
 	if (retval) {
 		close(fd);
 		return retval;
@@ -35,6 +35,12 @@
 
 #include "resize2fs.h"
 #include <time.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 
 #ifdef __linux__			/* Kludge for debugging */
 #define RESIZE2FS_DEBUG
@@ -52,6 +58,9 @@ static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs);
 static errcode_t fix_sb_journal_backup(ext2_filsys fs);
 static errcode_t mark_table_blocks(ext2_filsys fs,
 				   ext2fs_block_bitmap bmap);
+static errcode_t imap_add(ext2_resize_t rfs, ext2_ino_t old_ino,
+			  ext2_ino_t new_ino);
+static void imap_free(ext2_resize_t rfs);
 
 /*
  * Some helper CPP macros
@@ -107,9 +116,11 @@ errcode_t resize_fs(ext2_filsys fs, blk64_t *new_size, int flags,
 		goto errout;
 	print_resource_track(rfs, &rtrack, fs->io);
 
-	fs->super->s_state |= EXT2_ERROR_FS;
-	ext2fs_mark_super_dirty(fs);
-	ext2fs_flush(fs);
+	if (!(flags & RESIZE_DRY_RUN)) {
+		fs->super->s_state |= EXT2_ERROR_FS;
+		ext2fs_mark_super_dirty(fs);
+		ext2fs_flush(fs);
+	}
 
 	init_resource_track(&rtrack, "fix_uninit_block_bitmaps 1", fs->io);
 	fix_uninit_block_bitmaps(fs);
@@ -154,6 +165,12 @@ errcode_t resize_fs(ext2_filsys fs, blk64_t *new_size, int flags,
 		goto errout;
 	print_resource_track(rfs, &rtrack, fs->io);
 
+	/* For a dry run, nothing has been written and we stop here */
+	if (flags & RESIZE_DRY_RUN) {
+		ext2fs_free(rfs->new_fs);
+		goto cleanup;
+	}
+
 	init_resource_track(&rtrack, "inode_scan_and_fix", fs->io);
 	retval = inode_scan_and_fix(rfs);
 	if (retval)
@@ -200,6 +217,7 @@ errcode_t resize_fs(ext2_filsys fs, blk64_t *new_size, int flags,
 
 	rfs->flags = flags;
 
+cleanup:
 	ext2fs_free(rfs->old_fs);
 	if (rfs->itable_buf)
 		ext2fs_free_mem(&rfs->itable_buf);
@@ -207,6 +225,8 @@ errcode_t resize_fs(ext2_filsys fs, blk64_t *new_size, int flags,
 		ext2fs_free_block_bitmap(rfs->reserve_blocks);
 	if (rfs->move_blocks)
 		ext2fs_free_block_bitmap(rfs->move_blocks);
+	if (rfs->bmap)
+		ext2fs_free_extent_table(rfs->bmap);
 	ext2fs_free_mem(&rfs);
 
 	return 0;
@@ -216,6 +236,7 @@ errout:
 		ext2fs_free(rfs->new_fs);
 	if (rfs->itable_buf)
 		ext2fs_free_mem(&rfs->itable_buf);
+	imap_free(rfs);
 	ext2fs_free_mem(&rfs);
 	return retval;
 }
@@ -669,9 +690,10 @@ static errcode_t adjust_superblock(ext2_resize_t rfs, blk64_t new_size)
 	 * supports lazy inode initialization, we can skip
 	 * initializing the inode table.
 	 */
-	if (lazy_itable_init &&
-	    EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
-				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+	if ((lazy_itable_init &&
+	     EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) ||
+	    (rfs->flags & RESIZE_DRY_RUN)) {
 		retval = 0;
 		goto errout;
 	}
@@ -843,6 +865,83 @@ static void mark_fs_metablock(ext2_resize_t rfs,
 }
 
 
+/*
+ * Take num blocks from blk on for new group metadata, and mark those
+ * holding file data to be moved.
+ */
+static void flex_bg_claim(ext2_resize_t rfs, ext2fs_block_bitmap meta_bmap,
+			  blk64_t blk, blk64_t num)
+{
+	ext2_filsys	fs = rfs->new_fs;
+
+	ext2fs_mark_block_bitmap_range2(fs->block_map, blk, num);
+	for (; num; blk++, num--) {
+		if (ext2fs_test_block_bitmap2(rfs->old_fs->block_map, blk) &&
+		    !ext2fs_test_block_bitmap2(meta_bmap, blk)) {
+			ext2fs_mark_block_bitmap2(rfs->move_blocks, blk);
+			rfs->needed_blocks++;
+		}
+	}
+}
+
+/*
+ * For -G: lay the group metadata out again in packed flex groups, the
+ * way mke2fs does on a new file system, and set the flex_bg feature.
+ * The new tables must not land on any of the old ones, which stay in
+ * use until move_itables() has copied them, so all of those are
+ * reserved first; file blocks in the way are marked to be moved out
+ * by block_mover().  The old bitmap blocks are released here, since
+ * the bitmaps are only written out at the end, and the old inode
+ * tables are released by move_itables().
+ */
+static errcode_t flex_bg_layout(ext2_resize_t rfs,
+				ext2fs_block_bitmap meta_bmap)
+{
+	ext2_filsys	fs = rfs->new_fs;
+	ext2_filsys	old_fs = rfs->old_fs;
+	int		flex_log = RESIZE_FLEX_LOG(rfs->flags);
+	dgrp_t		i;
+	errcode_t	retval;
+
+	fs->super->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_FLEX_BG;
+	fs->super->s_log_groups_per_flex = flex_log;
+	ext2fs_mark_super_dirty(fs);
+
+	retval = mark_table_blocks(old_fs, rfs->reserve_blocks);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < fs->group_desc_count; i++) {
+		ext2fs_block_bitmap_loc_set(fs, i, 0);
+		ext2fs_inode_bitmap_loc_set(fs, i, 0);
+		ext2fs_inode_table_loc_set(fs, i, 0);
+	}
+
+	for (i = 0; i < fs->group_desc_count; i++) {
+		retval = ext2fs_allocate_group_table(fs, i,
+						     rfs->reserve_blocks);
+		if (retval)
+			return retval;
+
+		flex_bg_claim(rfs, meta_bmap, ext2fs_block_bitmap_loc(fs, i), 1);
+		flex_bg_claim(rfs, meta_bmap, ext2fs_inode_bitmap_loc(fs, i), 1);
+		flex_bg_claim(rfs, meta_bmap, ext2fs_inode_table_loc(fs, i),
+			      fs->inode_blocks_per_group);
+
+		ext2fs_unmark_block_bitmap2(fs->block_map,
+					    ext2fs_block_bitmap_loc(old_fs, i));
+		ext2fs_unmark_block_bitmap2(fs->block_map,
+					    ext2fs_inode_bitmap_loc(old_fs, i));
+	}
+
+	if (rfs->flags & RESIZE_DRY_RUN)
+		printf(_("The metadata of %u groups would move into %u flex "
+			 "groups of %d.\n"), fs->group_desc_count,
+		       (fs->group_desc_count + (1U << flex_log) - 1) >>
+		       flex_log, 1 << flex_log);
+	return 0;
+}
+
 /*
  * This routine marks and unmarks reserved blocks in the new block
  * bitmap.  It also determines which blocks need to be moved and
@@ -882,6 +981,11 @@ static errcode_t blocks_to_move(ext2_resize_t rfs)
 
 	fs = rfs->new_fs;
 
+	if (rfs->flags & RESIZE_FLEX_BG) {
+		retval = flex_bg_layout(rfs, meta_bmap);
+		goto errout;
+	}
+
 	/*
 	 * If we're shrinking the filesystem, we need to move any
 	 * group's metadata blocks (either allocation bitmaps or the
@@ -1208,18 +1312,368 @@ static errcode_t resize2fs_get_alloc_block(ext2_filsys fs, blk64_t goal,
 	return 0;
 }
 
+/*
+ * The planned block allocator, used with -m.  get_new_block() hands
+ * out the lowest free block each time it is asked, so a run of blocks
+ * which has to move gets scattered over whatever holes come first.
+ * Instead, gather every run of clusters which has to move and every
+ * free extent they may go to, then place the longest runs first, each
+ * in the smallest free extent which holds it whole.  A run is only
+ * broken up when no free extent is long enough for it, and then it
+ * fills the longest one left.  Only the clusters which must move are
+ * moved, and a file whose tail lies past the new end of the file
+ * system keeps that tail in one piece.
+ *
+ * Free extents are kept in lists by size class (the log2 of their
+ * length), so finding a fit doesn't mean searching all of them.
+ */
+#define PLAN_CLASSES	64
+#define PLAN_SCAN	32	/* extents looked at in a class for a best fit */
+
+struct plan_extent {
+	blk64_t		blk;	/* first block */
+	blk64_t		len;	/* length in clusters */
+	unsigned int	pos;	/* index in the size class list */
+};
+
+struct plan_class {
+	unsigned int	*list;	/* indexes into the free extents */
+	unsigned int	num, max;
+};
+
+struct move_plan {
+	struct plan_extent	*runs;
+	unsigned int		num_runs, max_runs;
+	struct plan_extent	*free;
+	unsigned int		num_free, max_free;
+	struct plan_class	class[PLAN_CLASSES];
+};
+
+static errcode_t plan_grow(void *ptr, size_t size, unsigned int *max)
+{
+	unsigned int	new_max = *max ? *max * 2 : 256;
+	errcode_t	retval;
+
+	retval = ext2fs_resize_mem(*max * size, new_max * size, ptr);
+	if (retval)
+		return retval;
+	*max = new_max;
+	return 0;
+}
+
+static void plan_free(struct move_plan *plan)
+{
+	int	i;
+
+	if (plan->runs)
+		ext2fs_free_mem(&plan->runs);
+	if (plan->free)
+		ext2fs_free_mem(&plan->free);
+	for (i = 0; i < PLAN_CLASSES; i++)
+		if (plan->class[i].list)
+			ext2fs_free_mem(&plan->class[i].list);
+}
+
+static int plan_class_of(blk64_t len)
+{
+	int	c = 0;
+
+	while (len >>= 1)
+		c++;
+	return c;
+}
+
+static errcode_t plan_link(struct move_plan *plan, unsigned int i)
+{
+	struct plan_class	*cl;
+	errcode_t		retval;
+
+	cl = &plan->class[plan_class_of(plan->free[i].len)];
+	if (cl->num == cl->max) {
+		retval = plan_grow(&cl->list, sizeof(unsigned int), &cl->max);
+		if (retval)
+			return retval;
+	}
+	plan->free[i].pos = cl->num;
+	cl->list[cl->num++] = i;
+	return 0;
+}
+
+static void plan_unlink(struct move_plan *plan, unsigned int i)
+{
+	struct plan_class	*cl;
+	unsigned int		last;
+
+	cl = &plan->class[plan_class_of(plan->free[i].len)];
+	last = cl->list[--cl->num];
+	if (plan->free[i].pos != cl->num) {
+		cl->list[plan->free[i].pos] = last;
+		plan->free[last].pos = plan->free[i].pos;
+	}
+}
+
+/*
+ * Add a cluster which has to move, extending the last run if it
+ * follows on from it.
+ */
+static errcode_t plan_add_block(ext2_filsys fs, struct move_plan *plan,
+				blk64_t blk)
+{
+	struct plan_extent	*run;
+	errcode_t		retval;
+
+	if (plan->num_runs) {
+		run = &plan->runs[plan->num_runs - 1];
+		if (run->blk + C2B(run->len) == blk) {
+			run->len++;
+			return 0;
+		}
+	}
+	if (plan->num_runs == plan->max_runs) {
+		retval = plan_grow(&plan->runs, sizeof(struct plan_extent),
+				   &plan->max_runs);
+		if (retval)
+			return retval;
+	}
+	run = &plan->runs[plan->num_runs++];
+	run->blk = blk;
+	run->len = 1;
+	return 0;
+}
+
+static errcode_t plan_add_free(struct move_plan *plan, blk64_t blk,
+			       blk64_t len)
+{
+	struct plan_extent	*ext;
+	errcode_t		retval;
+
+	if (plan->num_free == plan->max_free) {
+		retval = plan_grow(&plan->free, sizeof(struct plan_extent),
+				   &plan->max_free);
+		if (retval)
+			return retval;
+	}
+	ext = &plan->free[plan->num_free];
+	ext->blk = blk;
+	ext->len = len;
+	return plan_link(plan, plan->num_free++);
+}
+
+/*
+ * Collect the free extents of the new file system.  Unless desperate,
+ * blocks still in use in the old file system are avoided, just as
+ * get_new_block() does.
+ */
+static errcode_t plan_find_free(ext2_resize_t rfs, struct move_plan *plan,
+				int desperate)
+{
+	ext2_filsys	fs = rfs->new_fs;
+	blk64_t		blk, next, b, start = 0;
+	blk64_t		end = ext2fs_blocks_count(fs->super);
+	blk64_t		old_end = ext2fs_blocks_count(rfs->old_fs->super);
+	errcode_t	retval;
+	int		i;
+
+	plan->num_free = 0;
+	for (i = 0; i < PLAN_CLASSES; i++)
+		plan->class[i].num = 0;
+
+	for (blk = fs->super->s_first_data_block; blk < end; blk = next) {
+		if (ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk,
+							 end - 1, &blk))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map, blk,
+							end - 1, &next))
+			next = end;
+		for (b = blk; b < next; b += EXT2FS_CLUSTER_RATIO(fs)) {
+			if (ext2fs_test_block_bitmap2(rfs->reserve_blocks, b) ||
+			    (!desperate && b < old_end &&
+			     ext2fs_test_block_bitmap2(rfs->old_fs->block_map,
+						       b))) {
+				if (start) {
+					retval = plan_add_free(plan, start,
+							B2C(b - start));
+					if (retval)
+						return retval;
+				}
+				start = 0;
+			} else if (!start)
+				start = b;
+		}
+		if (start) {
+			retval = plan_add_free(plan, start,
+					       B2C(next - start));
+			if (retval)
+				return retval;
+		}
+		start = 0;
+	}
+	return 0;
+}
+
+/*
+ * Return the free extent a run of len clusters should go to: the
+ * smallest one which holds it, or failing that the longest one.
+ * Returns -1 if there are no free extents left.
+ */
+static int plan_fit(struct move_plan *plan, blk64_t len)
+{
+	struct plan_class	*cl;
+	int			c, i, best = -1;
+
+	c = plan_class_of(len);
+	cl = &plan->class[c];
+	for (i = 0; i < (int) cl->num && i < PLAN_SCAN; i++) {
+		struct plan_extent *ext = &plan->free[cl->list[i]];
+
+		if (ext->len >= len &&
+		    (best < 0 || ext->len < plan->free[best].len))
+			best = cl->list[i];
+	}
+	if (best >= 0)
+		return best;
+	for (c++; c < PLAN_CLASSES; c++)
+		if (plan->class[c].num)
+			return plan->class[c].list[plan->class[c].num - 1];
+	for (c = plan_class_of(len); c >= 0; c--) {
+		cl = &plan->class[c];
+		for (i = 0; i < (int) cl->num && i < PLAN_SCAN; i++)
+			if (best < 0 ||
+			    plan->free[cl->list[i]].len > plan->free[best].len)
+				best = cl->list[i];
+		if (best >= 0)
+			return best;
+	}
+	return -1;
+}
+
+static EXT2_QSORT_TYPE plan_run_cmp(const void *a, const void *b)
+{
+	const struct plan_extent *run_a = (const struct plan_extent *) a;
+	const struct plan_extent *run_b = (const struct plan_extent *) b;
+
+	if (run_a->len != run_b->len)
+		return run_a->len < run_b->len ? 1 : -1;
+	return run_a->blk < run_b->blk ? -1 : (run_a->blk > run_b->blk);
+}
+
+/*
+ * Decide where every run gathered by plan_add_block() goes, and
+ * record it in the block move map.
+ */
+static errcode_t plan_place(ext2_resize_t rfs, struct move_plan *plan,
+			    int *to_move)
+{
+	ext2_filsys		fs = rfs->new_fs;
+	struct plan_extent	*run, *ext;
+	blk64_t			blk, left, n, j;
+	unsigned int		r;
+	int			i, desperate = 0;
+	errcode_t		retval;
+
+	retval = plan_find_free(rfs, plan, 0);
+	if (retval)
+		return retval;
+	qsort(plan->runs, plan->num_runs, sizeof(struct plan_extent),
+	      plan_run_cmp);
+
+	for (r = 0, run = plan->runs; r < plan->num_runs; r++, run++) {
+		blk = run->blk;
+		left = run->len;
+		while (left) {
+			i = plan_fit(plan, left);
+			if (i < 0) {
+				if (desperate)
+					return ENOSPC;
+#ifdef RESIZE2FS_DEBUG
+				if (rfs->flags & RESIZE_DEBUG_BMOVE)
+					printf("Going into desperation mode "
+					       "for block allocations\n");
+#endif
+				desperate = 1;
+				retval = plan_find_free(rfs, plan, 1);
+				if (retval)
+					return retval;
+				continue;
+			}
+			ext = &plan->free[i];
+			n = ext->len < left ? ext->len : left;
+#ifdef RESIZE2FS_DEBUG
+			if (rfs->flags & RESIZE_DEBUG_BMOVE)
+				printf("Planning %llu clusters %llu->%llu\n",
+				       n, blk, ext->blk);
+#endif
+			for (j = 0; j < n; j++) {
+				ext2fs_block_alloc_stats2(fs,
+						ext->blk + C2B(j), +1);
+				retval = ext2fs_add_extent_entry(rfs->bmap,
+						B2C(blk) + j,
+						B2C(ext->blk) + j);
+				if (retval)
+					return retval;
+			}
+			plan_unlink(plan, i);
+			ext->blk += C2B(n);
+			ext->len -= n;
+			if (ext->len) {
+				retval = plan_link(plan, i);
+				if (retval)
+					return retval;
+			}
+			blk += C2B(n);
+			left -= n;
+			*to_move += n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * For -n: describe the relocation block_mover() would carry out.
+ */
+static void print_move_plan(ext2_resize_t rfs)
+{
+	ext2_filsys	fs = rfs->new_fs;
+	__u64		old_loc, new_loc, size, last = 0;
+	__u64		blocks = 0, mb;
+	unsigned long	src = 0, dst = 0;
+
+	if (ext2fs_iterate_extent(rfs->bmap, 0, 0, 0))
+		return;
+	while (!ext2fs_iterate_extent(rfs->bmap, &old_loc, &new_loc,
+				      &size) && size) {
+		if (!dst || old_loc != last)
+			src++;
+		dst++;
+		last = old_loc + size;
+		blocks += C2B(size);
+	}
+	mb = (blocks * fs->blocksize + (1 << 20) - 1) >> 20;
+	printf(_("Relocation plan: %llu blocks in %lu extents would move "
+		 "to %lu extents.\n"), blocks, src, dst);
+	printf(_("Estimated I/O: %llu MB read and %llu MB written.\n"),
+	       mb, mb);
+}
+
+/* Blocks are copied in chunks of at least this many bytes */
+#define MOVE_CHUNK_BYTES	(4 * 1024 * 1024)
+
 static errcode_t block_mover(ext2_resize_t rfs)
 {
 	blk64_t			blk, old_blk, new_blk;
+	blk64_t			next_old, next_new;
 	ext2_filsys		fs = rfs->new_fs;
 	ext2_filsys		old_fs = rfs->old_fs;
 	errcode_t		retval;
-	__u64			size;
-	int			c;
+	__u64			size, next_size;
+	int			c, chunk;
 	int			to_move, moved;
 	ext2_badblocks_list	badblock_list = 0;
 	int			bb_modified = 0;
+	char			*buf = 0;
+	struct move_plan	plan;
 
+	memset(&plan, 0, sizeof(plan));
 	fs->get_alloc_block = resize2fs_get_alloc_block;
 	old_fs->get_alloc_block = resize2fs_get_alloc_block;
 
@@ -1228,13 +1682,6 @@ static errcode_t block_mover(ext2_resize_t rfs)
 		return retval;
 
 	new_blk = fs->super->s_first_data_block;
-	if (!rfs->itable_buf) {
-		retval = ext2fs_get_array(fs->blocksize,
-					fs->inode_blocks_per_group,
-					&rfs->itable_buf);
-		if (retval)
-			return retval;
-	}
 	retval = ext2fs_create_extent_table(&rfs->bmap, 0);
 	if (retval)
 		return retval;
@@ -1257,6 +1704,12 @@ static errcode_t block_mover(ext2_resize_t rfs)
 			bb_modified++;
 			continue;
 		}
+		if (rfs->flags & RESIZE_PLAN_MOVES) {
+			retval = plan_add_block(fs, &plan, blk);
+			if (retval)
+				goto errout;
+			continue;
+		}
 
 		new_blk = get_new_block(rfs);
 		if (!new_blk) {
@@ -1267,8 +1720,16 @@ static errcode_t block_mover(ext2_resize_t rfs)
 		ext2fs_add_extent_entry(rfs->bmap, B2C(blk), B2C(new_blk));
 		to_move++;
 	}
+	if (rfs->flags & RESIZE_PLAN_MOVES) {
+		retval = plan_place(rfs, &plan, &to_move);
+		if (retval)
+			goto errout;
+	}
 
 	if (to_move == 0) {
+		if (rfs->flags & RESIZE_DRY_RUN)
+			printf("%s", _("Relocation plan: no blocks need to "
+				       "move.\n"));
 		if (rfs->bmap) {
 			ext2fs_free_extent_table(rfs->bmap);
 			rfs->bmap = 0;
@@ -1276,12 +1737,31 @@ static errcode_t block_mover(ext2_resize_t rfs)
 		retval = 0;
 		goto errout;
 	}
+	if (rfs->flags & RESIZE_DRY_RUN) {
+		print_move_plan(rfs);
+		goto errout;
+	}
 
 	/*
-	 * Step two is to actually move the blocks
+	 * Step two is to actually move the blocks.  The extents come
+	 * back sorted by source, so the reads are sequential; with the
+	 * default allocator new blocks were handed out in ascending
+	 * order, so the writes are too.  While one chunk is
+	 * being copied, the next one is read ahead, so the device has
+	 * work queued while we write.
 	 */
+	chunk = MOVE_CHUNK_BYTES / fs->blocksize;
+	if (chunk < (int) fs->inode_blocks_per_group)
+		chunk = fs->inode_blocks_per_group;
+	retval = io_channel_alloc_buf(fs->io, chunk, &buf);
+	if (retval)
+		goto errout;
+
 	retval =  ext2fs_iterate_extent(rfs->bmap, 0, 0, 0);
 	if (retval) goto errout;
+	retval = ext2fs_iterate_extent(rfs->bmap, &next_old, &next_new,
+				       &next_size);
+	if (retval) goto errout;
 
 	if (rfs->progress) {
 		retval = (rfs->progress)(rfs, E2_RSZ_BLOCK_RELOC_PASS,
@@ -1289,14 +1769,13 @@ static errcode_t block_mover(ext2_resize_t rfs)
 		if (retval)
 			goto errout;
 	}
-	while (1) {
-		retval = ext2fs_iterate_extent(rfs->bmap, &old_blk, &new_blk, &size);
+	while (next_size) {
+		old_blk = C2B(next_old);
+		new_blk = C2B(next_new);
+		size = C2B(next_size);
+		retval = ext2fs_iterate_extent(rfs->bmap, &next_old, &next_new,
+					       &next_size);
 		if (retval) goto errout;
-		if (!size)
-			break;
-		old_blk = C2B(old_blk);
-		new_blk = C2B(new_blk);
-		size = C2B(size);
 #ifdef RESIZE2FS_DEBUG
 		if (rfs->flags & RESIZE_DEBUG_BMOVE)
 			printf("Moving %llu blocks %llu->%llu\n",
@@ -1304,13 +1783,22 @@ static errcode_t block_mover(ext2_resize_t rfs)
 #endif
 		do {
 			c = size;
-			if (c > fs->inode_blocks_per_group)
-				c = fs->inode_blocks_per_group;
+			if (c > chunk)
+				c = chunk;
+			if (size > (__u64) c)
+				io_channel_cache_readahead(fs->io, old_blk + c,
+					size - c > (__u64) chunk ?
+					chunk : size - c);
+			else if (next_size)
+				io_channel_cache_readahead(fs->io,
+					C2B(next_old),
+					C2B(next_size) > (__u64) chunk ?
+					chunk : C2B(next_size));
 			retval = io_channel_read_blk64(fs->io, old_blk, c,
-						       rfs->itable_buf);
+						       buf);
 			if (retval) goto errout;
 			retval = io_channel_write_blk64(fs->io, new_blk, c,
-							rfs->itable_buf);
+							buf);
 			if (retval) goto errout;
 			size -= c;
 			new_blk += c;
@@ -1325,12 +1813,16 @@ static errcode_t block_mover(ext2_resize_t rfs)
 					goto errout;
 			}
 		} while (size > 0);
-		io_channel_flush(fs->io);
 	}
+	io_channel_flush(fs->io);
 
 errout:
+	plan_free(&plan);
+	if (buf)
+		ext2fs_free_mem(&buf);
 	if (badblock_list) {
-		if (!retval && bb_modified)
+		if (!retval && bb_modified &&
+		    !(rfs->flags & RESIZE_DRY_RUN))
 			retval = ext2fs_update_bb_inode(old_fs,
 							badblock_list);
 		ext2fs_badblocks_list_free(badblock_list);
@@ -1408,62 +1900,301 @@ static int process_block(ext2_filsys fs, blk64_t	*block_nr,
 }
 
 /*
- * Progress callback
+ * Range version of extent_translate(): returns the new location of
+ * blk, or 0 if it isn't moving, and sets *ret_count to the number of
+ * blocks (at most count) for which the same holds contiguously.
  */
-static errcode_t progress_callback(ext2_filsys fs,
-				   ext2_inode_scan scan EXT2FS_ATTR((unused)),
-				   dgrp_t group, void * priv_data)
+static blk64_t extent_translate_range(ext2_filsys fs, ext2_extent extent,
+				      blk64_t blk, blk64_t count,
+				      blk64_t *ret_count)
 {
-	ext2_resize_t rfs = (ext2_resize_t) priv_data;
-	errcode_t		retval;
-
-	/*
-	 * This check is to protect against old ext2 libraries.  It
-	 * shouldn't be needed against new libraries.
-	 */
-	if ((group+1) == 0)
-		return 0;
+	__u64	offset = blk & EXT2FS_CLUSTER_MASK(fs);
+	__u64	new_blk, run;
+
+	new_blk = ext2fs_extent_translate_range(extent, B2C(blk),
+				B2C(blk + count - 1) - B2C(blk) + 1, &run);
+	run = C2B(run) - offset;
+	*ret_count = run < count ? run : count;
+	return new_blk ? C2B(new_blk) + offset : 0;
+}
 
-	if (rfs->progress) {
-		io_channel_flush(fs->io);
-		retval = (rfs->progress)(rfs, E2_RSZ_INODE_SCAN_PASS,
-					 group+1, fs->group_desc_count);
-		if (retval)
-			return retval;
+/*
+ * Split an extent into the pieces which the block move map sends to
+ * different places, merging pieces which stay physically contiguous.
+ * At most max pieces are stored in ret; *ret_len is set to the number
+ * of blocks they cover, which is less than e_len if more were needed.
+ * Returns the number of pieces.
+ */
+static int remap_extent(ext2_resize_t rfs, struct ext2fs_extent *extent,
+			struct ext2fs_extent *ret, int max, __u32 *ret_len)
+{
+	blk64_t		pblk = extent->e_pblk, new_blk, run;
+	blk64_t		lblk = extent->e_lblk;
+	__u32		left = extent->e_len;
+	int		n = 0;
+
+	*ret_len = 0;
+	while (left) {
+		new_blk = 0;
+		run = left;
+		if (rfs->bmap)
+			new_blk = extent_translate_range(rfs->old_fs,
+							 rfs->bmap, pblk,
+							 left, &run);
+		if (!new_blk)
+			new_blk = pblk;
+		if (n && ret[n-1].e_pblk + ret[n-1].e_len == new_blk)
+			ret[n-1].e_len += run;
+		else {
+			if (n == max)
+				break;
+			ret[n] = *extent;
+			ret[n].e_lblk = lblk;
+			ret[n].e_pblk = new_blk;
+			ret[n].e_len = run;
+			n++;
+		}
+		pblk += run;
+		lblk += run;
+		left -= run;
+		*ret_len += run;
 	}
+	return n;
+}
 
+/*
+ * Check whether any block mapped by an inode whose extent tree fits in
+ * the inode is about to move, without opening the tree.
+ */
+static int inline_extents_move(ext2_resize_t rfs, struct ext2_inode *inode)
+{
+	struct ext3_extent_header *eh;
+	struct ext3_extent	*ex;
+	blk64_t			run;
+	int			i;
+
+	eh = (struct ext3_extent_header *) inode->i_block;
+	if (ext2fs_extent_header_verify(eh, sizeof(inode->i_block)) ||
+	    ext2fs_le16_to_cpu(eh->eh_depth) != 0)
+		return 1;
+	ex = EXT_FIRST_EXTENT(eh);
+	for (i = 0; i < ext2fs_le16_to_cpu(eh->eh_entries); i++, ex++) {
+		blk64_t	start = ext2fs_le32_to_cpu(ex->ee_start) +
+			((blk64_t) ext2fs_le16_to_cpu(ex->ee_start_hi) << 32);
+		blk64_t	len = ext2fs_le16_to_cpu(ex->ee_len);
+
+		if (len > EXT_INIT_MAX_LEN)
+			len -= EXT_INIT_MAX_LEN;
+		while (len) {
+			if (extent_translate_range(rfs->old_fs, rfs->bmap,
+						   start, len, &run))
+				return 1;
+			start += run;
+			len -= run;
+		}
+	}
 	return 0;
 }
 
-static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
+#define REMAP_MAX_PIECES	16
+
+/*
+ * Relocate the blocks of an extent-mapped inode a whole extent at a
+ * time.  Every extent the move map leaves alone, or moves in one
+ * piece, is rewritten in place; only extents which the map splits are
+ * broken up, and only where it splits them.
+ */
+static errcode_t fix_extent_inode(ext2_resize_t rfs, ext2_ino_t ino,
+				  struct ext2_inode *inode,
+				  struct process_block_struct *pb)
 {
-	struct process_block_struct	pb;
-	ext2_ino_t		ino, new_inode;
-	struct ext2_inode 	*inode = NULL;
-	ext2_inode_scan 	scan = NULL;
+	ext2_filsys		fs = rfs->old_fs;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent, pieces[REMAP_MAX_PIECES];
+	blk64_t			new_blk, *splits = 0, i;
+	int			op = EXT2_EXTENT_ROOT, n, j, first;
+	__u32			len;
+	unsigned int		nsplits = 0, max_splits = 0;
 	errcode_t		retval;
-	char			*block_buf = 0;
-	ext2_ino_t		start_to_move;
-	blk64_t			orig_size;
-	blk64_t			new_block;
-	int			inode_size;
 
-	if ((rfs->old_fs->group_desc_count <=
-	     rfs->new_fs->group_desc_count) &&
-	    !rfs->bmap)
-		return 0;
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
 
 	/*
-	 * Save the original size of the old filesystem, and
-	 * temporarily set the size to be the new size if the new size
-	 * is larger.  We need to do this to avoid catching an error
-	 * by the block iterator routines
+	 * First pass: fix up everything which doesn't change the shape
+	 * of the tree, and note the extents which need to be split.
 	 */
-	orig_size = ext2fs_blocks_count(rfs->old_fs->super);
-	if (orig_size < ext2fs_blocks_count(rfs->new_fs->super))
-		ext2fs_blocks_count_set(rfs->old_fs->super,
-				ext2fs_blocks_count(rfs->new_fs->super));
-
+	while (1) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval) {
+			if (retval == EXT2_ET_EXTENT_NO_NEXT)
+				retval = 0;
+			break;
+		}
+		op = EXT2_EXTENT_NEXT;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
+			if ((extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT) ||
+			    !rfs->bmap)
+				continue;
+			new_blk = extent_translate(fs, rfs->bmap,
+						   extent.e_pblk);
+			if (!new_blk)
+				continue;
+			extent.e_pblk = new_blk;
+			retval = ext2fs_extent_replace(handle, 0, &extent);
+			if (retval)
+				break;
+			pb->changed = 1;
+			continue;
+		}
+
+		for (i = 0; pb->is_dir && i < extent.e_len; i++) {
+			new_blk = 0;
+			if (rfs->bmap)
+				new_blk = extent_translate(fs, rfs->bmap,
+							extent.e_pblk + i);
+			retval = ext2fs_add_dir_block2(fs->dblist, ino,
+					new_blk ? new_blk : extent.e_pblk + i,
+					extent.e_lblk + i);
+			if (retval)
+				goto errout;
+		}
+		n = remap_extent(rfs, &extent, pieces, REMAP_MAX_PIECES, &len);
+		if (n == 1 && len == extent.e_len &&
+		    pieces[0].e_pblk == extent.e_pblk)
+			continue;
+		if (n == 1 && len == extent.e_len) {
+#ifdef RESIZE2FS_DEBUG
+			if (rfs->flags & RESIZE_DEBUG_BMOVE)
+				printf("ino=%u, extent %llu (%u): %llu->%llu\n",
+				       ino, extent.e_lblk, extent.e_len,
+				       extent.e_pblk, pieces[0].e_pblk);
+#endif
+			retval = ext2fs_extent_replace(handle, 0, &pieces[0]);
+			if (retval)
+				break;
+			pb->changed = 1;
+			continue;
+		}
+		if (nsplits == max_splits) {
+			max_splits = max_splits ? max_splits * 2 : 16;
+			retval = ext2fs_resize_mem(nsplits * sizeof(blk64_t),
+						   max_splits *
+						   sizeof(blk64_t), &splits);
+			if (retval)
+				break;
+		}
+		splits[nsplits++] = extent.e_lblk;
+	}
+	if (retval)
+		goto errout;
+
+	/*
+	 * Second pass: split the extents which need it.  Inserting may
+	 * split tree nodes, so look each one up again.
+	 */
+	while (nsplits) {
+		retval = ext2fs_extent_goto(handle, splits[--nsplits]);
+		if (retval)
+			break;
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+					   &extent);
+		if (retval)
+			break;
+#ifdef RESIZE2FS_DEBUG
+		if (rfs->flags & RESIZE_DEBUG_BMOVE)
+			printf("ino=%u, splitting extent %llu (%u)\n",
+			       ino, extent.e_lblk, extent.e_len);
+#endif
+		/*
+		 * The first piece replaces the extent and the rest are
+		 * inserted after it, a batch of pieces at a time.
+		 */
+		for (first = 1; extent.e_len; first = 0) {
+			n = remap_extent(rfs, &extent, pieces,
+					 REMAP_MAX_PIECES, &len);
+			for (j = 0; j < n; j++) {
+				if (first && j == 0)
+					retval = ext2fs_extent_replace(handle,
+							0, &pieces[0]);
+				else
+					retval = ext2fs_extent_insert(handle,
+						EXT2_EXTENT_INSERT_AFTER,
+						&pieces[j]);
+				if (retval)
+					goto errout;
+			}
+			extent.e_lblk += len;
+			extent.e_pblk += len;
+			extent.e_len -= len;
+		}
+		pb->changed = 1;
+	}
+errout:
+	if (splits)
+		ext2fs_free_mem(&splits);
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
+/*
+ * Progress callback
+ */
+static errcode_t progress_callback(ext2_filsys fs,
+				   ext2_inode_scan scan EXT2FS_ATTR((unused)),
+				   dgrp_t group, void * priv_data)
+{
+	ext2_resize_t rfs = (ext2_resize_t) priv_data;
+	errcode_t		retval;
+
+	/*
+	 * This check is to protect against old ext2 libraries.  It
+	 * shouldn't be needed against new libraries.
+	 */
+	if ((group+1) == 0)
+		return 0;
+
+	if (rfs->progress) {
+		io_channel_flush(fs->io);
+		retval = (rfs->progress)(rfs, E2_RSZ_INODE_SCAN_PASS,
+					 group+1, fs->group_desc_count);
+		if (retval)
+			return retval;
+	}
+
+	return 0;
+}
+
+static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
+{
+	struct process_block_struct	pb;
+	ext2_ino_t		ino, new_inode;
+	struct ext2_inode 	*inode = NULL;
+	ext2_inode_scan 	scan = NULL;
+	errcode_t		retval;
+	char			*block_buf = 0;
+	ext2_ino_t		start_to_move;
+	blk64_t			orig_size;
+	blk64_t			new_block;
+	int			inode_size;
+
+	if ((rfs->old_fs->group_desc_count <=
+	     rfs->new_fs->group_desc_count) &&
+	    !rfs->bmap)
+		return 0;
+
+	/*
+	 * Save the original size of the old filesystem, and
+	 * temporarily set the size to be the new size if the new size
+	 * is larger.  We need to do this to avoid catching an error
+	 * by the block iterator routines
+	 */
+	orig_size = ext2fs_blocks_count(rfs->old_fs->super);
+	if (orig_size < ext2fs_blocks_count(rfs->new_fs->super))
+		ext2fs_blocks_count_set(rfs->old_fs->super,
+				ext2fs_blocks_count(rfs->new_fs->super));
+
 	retval = ext2fs_open_inode_scan(rfs->old_fs, 0, &scan);
 	if (retval) goto errout;
 
@@ -1523,9 +2254,13 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 		if (ext2fs_inode_has_valid_blocks2(rfs->old_fs, inode) &&
 		    (rfs->bmap || pb.is_dir)) {
 			pb.ino = ino;
-			retval = ext2fs_block_iterate3(rfs->old_fs,
+			if (!(inode->i_flags & EXT4_EXTENTS_FL))
+				retval = ext2fs_block_iterate3(rfs->old_fs,
 						       ino, 0, block_buf,
 						       process_block, &pb);
+			else if (pb.is_dir || inline_extents_move(rfs, inode))
+				retval = fix_extent_inode(rfs, ino, inode,
+							  &pb);
 			if (retval)
 				goto errout;
 			if (pb.error) {
@@ -1561,12 +2296,9 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 		if (rfs->flags & RESIZE_DEBUG_INODEMAP)
 			printf("Inode moved %u->%u\n", ino, new_inode);
 #endif
-		if (!rfs->imap) {
-			retval = ext2fs_create_extent_table(&rfs->imap, 0);
-			if (retval)
-				goto errout;
-		}
-		ext2fs_add_extent_entry(rfs->imap, ino, new_inode);
+		retval = imap_add(rfs, ino, new_inode);
+		if (retval)
+			goto errout;
 	}
 	io_channel_flush(rfs->old_fs->io);
 
@@ -1591,64 +2323,430 @@ errout:
  * --------------------------------------------------------------------
  */
 
+/*
+ * The inodes which were moved are kept in an open-addressed hash table
+ * keyed by their old inode number.  Phase 4 looks up every entry of
+ * every directory, and nearly all of them are for inodes which didn't
+ * move; since only inodes past the end of the new inode table are
+ * moved, anything below the lowest of them is turned away without
+ * looking at the table at all.
+ */
+struct resize_inode_map_ent {
+	ext2_ino_t	old_ino;	/* 0 marks a free slot */
+	ext2_ino_t	new_ino;
+};
+
+struct resize_inode_map {
+	struct resize_inode_map_ent *ents;
+	unsigned int	size;		/* a power of two */
+	unsigned int	count;
+	ext2_ino_t	min_ino;
+};
+
+static unsigned int imap_slot(struct resize_inode_map *imap, ext2_ino_t ino)
+{
+	return (ino * 0x9E3779B1U) & (imap->size - 1);
+}
+
+static void imap_insert(struct resize_inode_map *imap, ext2_ino_t old_ino,
+			ext2_ino_t new_ino)
+{
+	unsigned int	slot = imap_slot(imap, old_ino);
+
+	while (imap->ents[slot].old_ino && imap->ents[slot].old_ino != old_ino)
+		slot = (slot + 1) & (imap->size - 1);
+	if (!imap->ents[slot].old_ino)
+		imap->count++;
+	imap->ents[slot].old_ino = old_ino;
+	imap->ents[slot].new_ino = new_ino;
+}
+
+static errcode_t imap_grow(struct resize_inode_map *imap)
+{
+	struct resize_inode_map_ent *old = imap->ents;
+	unsigned int	old_size = imap->size, i;
+	errcode_t	retval;
+
+	retval = ext2fs_get_arrayzero(old_size ? 2 * old_size : 1024,
+				      sizeof(struct resize_inode_map_ent),
+				      &imap->ents);
+	if (retval) {
+		imap->ents = old;
+		return retval;
+	}
+	imap->size = old_size ? 2 * old_size : 1024;
+	imap->count = 0;
+	for (i = 0; i < old_size; i++)
+		if (old[i].old_ino)
+			imap_insert(imap, old[i].old_ino, old[i].new_ino);
+	if (old)
+		ext2fs_free_mem(&old);
+	return 0;
+}
+
+static errcode_t imap_add(ext2_resize_t rfs, ext2_ino_t old_ino,
+			  ext2_ino_t new_ino)
+{
+	struct resize_inode_map *imap = rfs->imap;
+	errcode_t	retval;
+
+	if (!imap) {
+		retval = ext2fs_get_memzero(sizeof(struct resize_inode_map),
+					    &imap);
+		if (retval)
+			return retval;
+		rfs->imap = imap;
+		imap->min_ino = old_ino;
+	}
+	if (4 * (imap->count + 1) > 3 * imap->size) {
+		retval = imap_grow(imap);
+		if (retval)
+			return retval;
+	}
+	imap_insert(imap, old_ino, new_ino);
+	if (old_ino < imap->min_ino)
+		imap->min_ino = old_ino;
+	return 0;
+}
+
+/* Returns the new number of inode ino, or 0 if it didn't move */
+static ext2_ino_t imap_translate(struct resize_inode_map *imap,
+				 ext2_ino_t ino)
+{
+	unsigned int	slot;
+
+	if (ino < imap->min_ino)
+		return 0;
+	for (slot = imap_slot(imap, ino); imap->ents[slot].old_ino;
+	     slot = (slot + 1) & (imap->size - 1))
+		if (imap->ents[slot].old_ino == ino)
+			return imap->ents[slot].new_ino;
+	return 0;
+}
+
+static void imap_free(ext2_resize_t rfs)
+{
+	if (!rfs->imap)
+		return;
+	if (rfs->imap->ents)
+		ext2fs_free_mem(&rfs->imap->ents);
+	ext2fs_free_mem(&rfs->imap);
+}
+
+/*
+ * Only a few of the directory blocks usually refer to an inode which
+ * was moved, so the directory blocks are first scanned for the ones
+ * which do.  The dblist is sorted by block number and split into as
+ * many parts as there are processors (up to REF_SCAN_MAX_WORKERS), and
+ * each part is scanned by a worker process of its own, which reads
+ * runs of consecutive blocks with a single request and marks the
+ * entries of the blocks which need fixing in a shared array.  Then
+ * the blocks which were marked are read again and rewritten, by this
+ * process alone, since only it may write to the file system.
+ *
+ * A block which can't be read, or doesn't look like a directory block,
+ * is marked too; the error is then reported when it is fixed.  If a
+ * worker dies, everything in its part is marked.
+ */
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && \
+	defined(MAP_ANONYMOUS) && defined(HAVE_SYS_WAIT_H)
+#define HAVE_REF_SCAN_WORKERS
+#endif
+
+#define REF_SCAN_MAX_WORKERS	8
+#define REF_SCAN_MIN_BLOCKS	4096	/* per worker, or it isn't worth it */
+#define REF_SCAN_RUN		64	/* blocks read at once */
+
+struct ref_scan {
+	ext2_resize_t	rfs;
+	unsigned char	*marks;		/* one per dblist entry */
+	unsigned long long entry;	/* of the next call */
+	char		*buf;		/* REF_SCAN_RUN blocks */
+	blk64_t		run_blk;
+	int		run_len;
+	int		num_ents;
+	unsigned long long ents[REF_SCAN_RUN];	/* dblist entries of the run */
+	int		slot[REF_SCAN_RUN];	/* and their blocks in buf */
+};
+
+static int block_refs_moved(ext2_filsys fs, struct resize_inode_map *imap,
+			    char *buf)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+
+	if (ext2fs_dirent_swab_in(fs, buf, 0))
+		return 1;
+	while (offset < fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		if (ext2fs_get_rec_len(fs, dirent, &rec_len) ||
+		    offset + rec_len > fs->blocksize || rec_len < 8)
+			return 1;
+		if (dirent->inode && imap_translate(imap, dirent->inode))
+			return 1;
+		offset += rec_len;
+	}
+	return 0;
+}
+
+static void scan_run(ext2_filsys fs, struct ref_scan *rs)
+{
+	int	i, last_slot = -1, mark = 0;
+
+	if (!rs->num_ents)
+		return;
+	if (io_channel_read_blk64(fs->io, rs->run_blk, rs->run_len, rs->buf)) {
+		for (i = 0; i < rs->num_ents; i++)
+			rs->marks[rs->ents[i]] = 1;
+	} else {
+		for (i = 0; i < rs->num_ents; i++) {
+			/* a block listed twice has already been swapped */
+			if (rs->slot[i] != last_slot)
+				mark = block_refs_moved(fs, rs->rfs->imap,
+					rs->buf + rs->slot[i] * fs->blocksize);
+			last_slot = rs->slot[i];
+			rs->marks[rs->ents[i]] = mark;
+		}
+	}
+	rs->run_len = 0;
+	rs->num_ents = 0;
+}
+
+static int scan_dir_block(ext2_filsys fs, struct ext2_db_entry2 *db,
+			  void *priv_data)
+{
+	struct ref_scan *rs = (struct ref_scan *) priv_data;
+	unsigned long long entry = rs->entry++;
+
+	if (!db->blk)
+		return 0;
+	if (rs->num_ents == REF_SCAN_RUN ||
+	    (rs->run_len && db->blk != rs->run_blk + rs->run_len - 1 &&
+	     (db->blk != rs->run_blk + rs->run_len ||
+	      rs->run_len == REF_SCAN_RUN)))
+		scan_run(fs, rs);
+	if (!rs->run_len) {
+		rs->run_blk = db->blk;
+		rs->run_len = 1;
+	} else if (db->blk == rs->run_blk + rs->run_len)
+		rs->run_len++;
+	rs->ents[rs->num_ents] = entry;
+	rs->slot[rs->num_ents++] = db->blk - rs->run_blk;
+	return 0;
+}
+
+static errcode_t scan_part(ext2_resize_t rfs, unsigned char *marks,
+			   unsigned long long start, unsigned long long count)
+{
+	ext2_filsys	fs = rfs->old_fs;
+	struct ref_scan	rs;
+	errcode_t	retval;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.rfs = rfs;
+	rs.marks = marks;
+	rs.entry = start;
+	retval = ext2fs_get_array(REF_SCAN_RUN, fs->blocksize, &rs.buf);
+	if (retval)
+		return retval;
+	retval = ext2fs_dblist_iterate3(fs->dblist, scan_dir_block, start,
+					count, &rs);
+	scan_run(fs, &rs);
+	ext2fs_free_mem(&rs.buf);
+	return retval;
+}
+
+#ifdef HAVE_REF_SCAN_WORKERS
+static int ref_scan_workers(unsigned long long count)
+{
+	long	n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n > REF_SCAN_MAX_WORKERS)
+		n = REF_SCAN_MAX_WORKERS;
+	if ((unsigned long long) n > count / REF_SCAN_MIN_BLOCKS)
+		n = count / REF_SCAN_MIN_BLOCKS;
+	return n < 1 ? 1 : n;
+}
+#endif
+
+/*
+ * Mark the dblist entries whose blocks refer to a moved inode.
+ * Returns the marks, one byte per entry, in *ret_marks, to be freed
+ * with free_ref_marks(); *shared says whether they are in memory
+ * shared with the workers.
+ */
+static errcode_t scan_refs(ext2_resize_t rfs, unsigned long long count,
+			   unsigned char **ret_marks, int *shared)
+{
+	ext2_filsys	fs = rfs->old_fs;
+	unsigned char	*marks;
+	errcode_t	retval;
+#ifdef HAVE_REF_SCAN_WORKERS
+	unsigned long long start, end;
+	int		num_workers = ref_scan_workers(count);
+	volatile int	*done;
+	pid_t		pids[REF_SCAN_MAX_WORKERS];
+	char		*mem;
+	int		i, status;
+#endif
+
+	/* the workers read the blocks from the disk */
+	retval = io_channel_flush(fs->io);
+	if (retval)
+		return retval;
+	*shared = 0;
+
+#ifdef HAVE_REF_SCAN_WORKERS
+	if (num_workers > 1) {
+		mem = mmap(NULL, REF_SCAN_MAX_WORKERS * sizeof(int) + count,
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			   -1, 0);
+		if (mem != MAP_FAILED)
+			goto have_shared;
+	}
+#endif
+	retval = ext2fs_get_memzero(count ? count : 1, &marks);
+	if (retval)
+		return retval;
+	retval = scan_part(rfs, marks, 0, count);
+	if (retval) {
+		ext2fs_free_mem(&marks);
+		return retval;
+	}
+	*ret_marks = marks;
+	return 0;
+
+#ifdef HAVE_REF_SCAN_WORKERS
+have_shared:
+	done = (volatile int *) mem;
+	marks = (unsigned char *) mem + REF_SCAN_MAX_WORKERS * sizeof(int);
+	for (i = 0; i < num_workers; i++) {
+		start = count * i / num_workers;
+		end = count * (i + 1) / num_workers;
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			fs->flags &= ~EXT2_FLAG_RW;
+			done[i] = scan_part(rfs, marks, start,
+					    end - start) == 0;
+			_exit(0);
+		}
+		/* no process for this part; it gets marked below */
+	}
+	for (i = 0; i < num_workers; i++) {
+		if (pids[i] > 0)
+			while (waitpid(pids[i], &status, 0) < 0 &&
+			       errno == EINTR)
+				;
+		if (!done[i]) {
+			start = count * i / num_workers;
+			end = count * (i + 1) / num_workers;
+			memset(marks + start, 1, end - start);
+		}
+	}
+	*ret_marks = marks;
+	*shared = 1;
+	return 0;
+#endif
+}
+
+static void free_ref_marks(unsigned char *marks, int shared,
+			   unsigned long long count)
+{
+#ifdef HAVE_REF_SCAN_WORKERS
+	if (shared) {
+		munmap(marks - REF_SCAN_MAX_WORKERS * sizeof(int),
+		       REF_SCAN_MAX_WORKERS * sizeof(int) + count);
+		return;
+	}
+#endif
+	ext2fs_free_mem(&marks);
+}
+
 struct istruct {
 	ext2_resize_t rfs;
 	errcode_t	err;
-	unsigned int	max_dirs;
-	unsigned int	num;
+	unsigned long long max_dirs;
+	unsigned long long num;
+	unsigned char	*marks;
+	int		marks_shared;
+	char		*buf;
 };
 
-static int check_and_change_inodes(ext2_ino_t dir,
-				   int entry EXT2FS_ATTR((unused)),
-				   struct ext2_dir_entry *dirent, int offset,
-				   int	blocksize EXT2FS_ATTR((unused)),
-				   char *buf EXT2FS_ATTR((unused)),
-				   void *priv_data)
+/* Rewrite the entries of a marked directory block */
+static int fix_dir_block(ext2_filsys fs, struct ext2_db_entry2 *db,
+			 void *priv_data)
 {
-	struct istruct *is = (struct istruct *) priv_data;
-	struct ext2_inode 	inode;
+	struct istruct		*is = (struct istruct *) priv_data;
+	struct ext2_dir_entry	*dirent;
+	struct ext2_inode	inode;
+	unsigned int		offset = 0, rec_len;
 	ext2_ino_t		new_inode;
-	errcode_t		retval;
+	int			changed = 0;
 
-	if (is->rfs->progress && offset == 0) {
-		io_channel_flush(is->rfs->old_fs->io);
+	if (!is->marks[is->num++])
+		return 0;
+
+	if (is->rfs->progress) {
+		io_channel_flush(fs->io);
 		is->err = (is->rfs->progress)(is->rfs,
 					      E2_RSZ_INODE_REF_UPD_PASS,
-					      ++is->num, is->max_dirs);
+					      is->num, is->max_dirs);
 		if (is->err)
 			return DIRENT_ABORT;
 	}
 
-	if (!dirent->inode)
-		return 0;
-
-	new_inode = ext2fs_extent_translate(is->rfs->imap, dirent->inode);
-
-	if (!new_inode)
-		return 0;
+	is->err = ext2fs_read_dir_block3(fs, db->blk, is->buf, 0);
+	if (is->err)
+		return DIRENT_ABORT;
+	while (offset < fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (is->buf + offset);
+		is->err = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (is->err)
+			return DIRENT_ABORT;
+		if ((offset + rec_len > fs->blocksize) || (rec_len < 8) ||
+		    (rec_len % 4) ||
+		    ((unsigned) (dirent->name_len & 0xFF) + 8 > rec_len)) {
+			is->err = EXT2_ET_DIR_CORRUPTED;
+			return DIRENT_ABORT;
+		}
+		offset += rec_len;
+		if (!dirent->inode)
+			continue;
+		new_inode = imap_translate(is->rfs->imap, dirent->inode);
+		if (!new_inode)
+			continue;
 #ifdef RESIZE2FS_DEBUG
-	if (is->rfs->flags & RESIZE_DEBUG_INODEMAP)
-		printf("Inode translate (dir=%u, name=%.*s, %u->%u)\n",
-		       dir, dirent->name_len&0xFF, dirent->name,
-		       dirent->inode, new_inode);
+		if (is->rfs->flags & RESIZE_DEBUG_INODEMAP)
+			printf("Inode translate (dir=%u, name=%.*s, %u->%u)\n",
+			       db->ino, dirent->name_len&0xFF, dirent->name,
+			       dirent->inode, new_inode);
 #endif
+		dirent->inode = new_inode;
+		changed++;
+	}
+	if (!changed)
+		return 0;
 
-	dirent->inode = new_inode;
+	is->err = ext2fs_write_dir_block3(fs, db->blk, is->buf, 0);
+	if (is->err)
+		return DIRENT_ABORT;
 
 	/* Update the directory mtime and ctime */
-	retval = ext2fs_read_inode(is->rfs->old_fs, dir, &inode);
-	if (retval == 0) {
+	if (ext2fs_read_inode(fs, db->ino, &inode) == 0) {
 		inode.i_mtime = inode.i_ctime = time(0);
-		is->err = ext2fs_write_inode(is->rfs->old_fs, dir, &inode);
+		is->err = ext2fs_write_inode(fs, db->ino, &inode);
 		if (is->err)
 			return DIRENT_ABORT;
 	}
-
-	return DIRENT_CHANGED;
+	return 0;
 }
 
 static errcode_t inode_ref_fix(ext2_resize_t rfs)
 {
+	ext2_filsys		fs = rfs->old_fs;
 	errcode_t		retval;
 	struct istruct 		is;
 
@@ -1659,10 +2757,9 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
 	 * Now, we iterate over all of the directories to update the
 	 * inode references
 	 */
-	is.num = 0;
-	is.max_dirs = ext2fs_dblist_count2(rfs->old_fs->dblist);
+	memset(&is, 0, sizeof(is));
+	is.max_dirs = ext2fs_dblist_count2(fs->dblist);
 	is.rfs = rfs;
-	is.err = 0;
 
 	if (rfs->progress) {
 		retval = (rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS,
@@ -1671,9 +2768,15 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
 			goto errout;
 	}
 
-	retval = ext2fs_dblist_dir_iterate(rfs->old_fs->dblist,
-					   DIRENT_FLAG_INCLUDE_EMPTY, 0,
-					   check_and_change_inodes, &is);
+	ext2fs_dblist_sort2(fs->dblist, 0);
+	retval = scan_refs(rfs, is.max_dirs, &is.marks, &is.marks_shared);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_mem(fs->blocksize, &is.buf);
+	if (retval)
+		goto errout;
+
+	retval = ext2fs_dblist_iterate2(fs->dblist, fix_dir_block, &is);
 	if (retval)
 		goto errout;
 	if (is.err) {
@@ -1681,13 +2784,16 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
 		goto errout;
 	}
 
-	if (rfs->progress && (is.num < is.max_dirs))
+	if (rfs->progress)
 		(rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS,
 				is.max_dirs, is.max_dirs);
 
 errout:
-	ext2fs_free_extent_table(rfs->imap);
-	rfs->imap = 0;
+	if (is.marks)
+		free_ref_marks(is.marks, is.marks_shared, is.max_dirs);
+	if (is.buf)
+		ext2fs_free_mem(&is.buf);
+	imap_free(rfs);
 	return retval;
 }
 
@@ -1712,27 +2818,93 @@ errout:
  * After this you have to use the rfs->new_fs file handle to read and
  * write inodes.
  */
+/*
+ * With uninit_bg, the blocks of a group's inode table past the last
+ * inode which may be in use hold nothing worth copying.  Inodes may
+ * have been moved into the group since old_fs was read, so both
+ * descriptors have to agree that an inode is unused.
+ */
+static blk64_t itable_used_blocks(ext2_resize_t rfs, dgrp_t g)
+{
+	ext2_filsys	fs = rfs->new_fs;
+	ext2_ino_t	unused, ipg = fs->super->s_inodes_per_group;
+
+	if (!EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+		return fs->inode_blocks_per_group;
+	if (ext2fs_bg_flags_test(fs, g, EXT2_BG_INODE_UNINIT) &&
+	    ext2fs_bg_flags_test(rfs->old_fs, g, EXT2_BG_INODE_UNINIT))
+		return 0;
+	unused = ext2fs_bg_itable_unused(fs, g);
+	if (ext2fs_bg_itable_unused(rfs->old_fs, g) < unused)
+		unused = ext2fs_bg_itable_unused(rfs->old_fs, g);
+	if (unused > ipg)
+		unused = ipg;
+	return ((blk64_t) (ipg - unused) * EXT2_INODE_SIZE(fs->super) +
+		fs->blocksize - 1) / fs->blocksize;
+}
+
+/*
+ * Write zeros over blocks [blk, blk + num) of a new inode table, except
+ * for those in [zero_start, zero_end), which are known to be zero
+ * already.
+ */
+static errcode_t zero_itable_tail(ext2_filsys fs, blk64_t blk, blk64_t num,
+				  blk64_t zero_start, blk64_t zero_end)
+{
+	blk64_t		end = blk + num;
+	errcode_t	retval;
+
+	if (zero_start < blk)
+		zero_start = blk;
+	if (zero_end > end)
+		zero_end = end;
+	if (zero_start >= zero_end)
+		return ext2fs_zero_blocks2(fs, blk, num, NULL, NULL);
+	if (zero_start > blk) {
+		retval = ext2fs_zero_blocks2(fs, blk, zero_start - blk,
+					     NULL, NULL);
+		if (retval)
+			return retval;
+	}
+	if (end > zero_end)
+		return ext2fs_zero_blocks2(fs, zero_end, end - zero_end,
+					   NULL, NULL);
+	return 0;
+}
+
+#define ITABLE_MOVE_BUF_BYTES	(32 * 1024 * 1024)
+#define ITABLE_MOVE_GAP		32	/* unused blocks we copy anyway */
+
+/*
+ * Move the inode tables.  The tables of neighbouring groups which sit
+ * next to each other both before and after the move, as they do in a
+ * flex_bg, are copied as one run, and the descriptors are only written
+ * out once per run; while one run is written, the next one is being
+ * read ahead.  With uninit_bg, only the part of a table that may hold
+ * inodes in use is copied (a run only takes in the next table if it
+ * would skip no more than ITABLE_MOVE_GAP blocks of this one), and the
+ * rest of the new table is zeroed, or left for the kernel to zero if
+ * it will do that lazily.
+ */
 static errcode_t move_itables(ext2_resize_t rfs)
 {
-	int		n, num, size;
-	long long	diff;
-	dgrp_t		i, max_groups;
+	dgrp_t		i, k, g, max_groups;
 	ext2_filsys	fs = rfs->new_fs;
-	char		*cp;
-	blk64_t		old_blk, new_blk, blk;
+	char		*buf = 0;
+	blk64_t		old_blk, new_blk, blk, ipb, buf_blocks, total;
+	blk64_t		used, copy, tail, known_zero;
+	long long	diff;
 	errcode_t	retval;
-	int		j, to_move, moved;
+	int		to_move, moved, csum_flag, need_zero;
+	unsigned int	j;
 
 	max_groups = fs->group_desc_count;
 	if (max_groups > rfs->old_fs->group_desc_count)
 		max_groups = rfs->old_fs->group_desc_count;
-
-	size = fs->blocksize * fs->inode_blocks_per_group;
-	if (!rfs->itable_buf) {
-		retval = ext2fs_get_mem(size, &rfs->itable_buf);
-		if (retval)
-			return retval;
-	}
+	ipb = fs->inode_blocks_per_group;
+	csum_flag = EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+					       EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
 
 	/*
 	 * Figure out how many inode tables we need to move
@@ -1746,6 +2918,15 @@ static errcode_t move_itables(ext2_resize_t rfs)
 	if (to_move == 0)
 		return 0;
 
+	buf_blocks = ITABLE_MOVE_BUF_BYTES / fs->blocksize;
+	if (buf_blocks > to_move * ipb)
+		buf_blocks = to_move * ipb;
+	if (buf_blocks < ipb)
+		buf_blocks = ipb;
+	retval = ext2fs_get_array(buf_blocks, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+
 	if (rfs->progress) {
 		retval = rfs->progress(rfs, E2_RSZ_MOVE_ITABLE_PASS,
 				       0, to_move);
@@ -1755,7 +2936,8 @@ static errcode_t move_itables(ext2_resize_t rfs)
 
 	rfs->old_fs->flags |= EXT2_FLAG_MASTER_SB_ONLY;
 
-	for (i=0; i < max_groups; i++) {
+	for (i=0; i < max_groups; i = k) {
+		k = i + 1;
 		old_blk = ext2fs_inode_table_loc(rfs->old_fs, i);
 		new_blk = ext2fs_inode_table_loc(fs, i);
 		diff = new_blk - old_blk;
@@ -1769,72 +2951,137 @@ static errcode_t move_itables(ext2_resize_t rfs)
 		if (!diff)
 			continue;
 
-		retval = io_channel_read_blk64(fs->io, old_blk,
-					       fs->inode_blocks_per_group,
-					       rfs->itable_buf);
-		if (retval)
-			goto errout;
+		/* Take in the tables which follow on from this one */
+		used = itable_used_blocks(rfs, i);
+		while (k < max_groups && ipb - used <= ITABLE_MOVE_GAP &&
+		       (k - i + 1) * ipb <= buf_blocks &&
+		       ext2fs_inode_table_loc(rfs->old_fs, k) ==
+		       old_blk + (k - i) * ipb &&
+		       ext2fs_inode_table_loc(fs, k) ==
+		       new_blk + (k - i) * ipb) {
+#ifdef RESIZE2FS_DEBUG
+			if (rfs->flags & RESIZE_DEBUG_ITABLEMOVE)
+				printf("Itable move group %d block %llu->%llu "
+				       "(diff %lld)\n", k,
+				       ext2fs_inode_table_loc(rfs->old_fs, k),
+				       ext2fs_inode_table_loc(fs, k), diff);
+#endif
+			used = itable_used_blocks(rfs, k);
+			k++;
+		}
+		total = (k - i) * ipb;
+		copy = total - ipb + used;
+
+		if (copy) {
+			retval = io_channel_read_blk64(fs->io, old_blk, copy,
+						       buf);
+			if (retval)
+				goto errout;
+		}
+
 		/*
-		 * The end of the inode table segment often contains
-		 * all zeros, and we're often only moving the inode
-		 * table down a block or two.  If so, we can optimize
-		 * things by not rewriting blocks that we know to be zero
-		 * already.
+		 * Which blocks past the copied ones have to read as zero
+		 * in the new table, and which of the old ones already do?
+		 * Without uninit_bg, the end of the inode table often
+		 * contains all zeros, and we're often only moving the
+		 * inode table down a block or two.  If so, we can
+		 * optimize things by not rewriting blocks that we know
+		 * to be zero already.
 		 */
-		for (cp = rfs->itable_buf+size-1, n=0; n < size; n++, cp--)
-			if (*cp)
-				break;
-		n = n >> EXT2_BLOCK_SIZE_BITS(fs->super);
+		need_zero = 1;
+		known_zero = total;
+		if (!csum_flag) {
+			for (; copy > total - ipb; copy--) {
+				for (j = 0; j < fs->blocksize; j++)
+					if (buf[(copy - 1) * fs->blocksize + j])
+						break;
+				if (j < fs->blocksize)
+					break;
+			}
+			known_zero = copy;
+		} else if (!ext2fs_bg_flags_test(fs, k - 1,
+						 EXT2_BG_INODE_ZEROED)) {
+			need_zero = 0;
+		} else {
+			if (ext2fs_bg_flags_test(rfs->old_fs, k - 1,
+						 EXT2_BG_INODE_ZEROED))
+				known_zero = copy;
+			if (lazy_itable_init) {
+				ext2fs_bg_flags_clear(fs, k - 1,
+						      EXT2_BG_INODE_ZEROED);
+				ext2fs_bg_flags_clear(rfs->old_fs, k - 1,
+						      EXT2_BG_INODE_ZEROED);
+				need_zero = 0;
+			}
+		}
+		tail = total - copy;
 #ifdef RESIZE2FS_DEBUG
 		if (rfs->flags & RESIZE_DEBUG_ITABLEMOVE)
-			printf("%d blocks of zeros...\n", n);
+			printf("%llu blocks to copy, %llu blocks of zeros...\n",
+			       copy, tail);
 #endif
-		num = fs->inode_blocks_per_group;
-		if (n > diff)
-			num -= n;
 
-		retval = io_channel_write_blk64(fs->io, new_blk,
-						num, rfs->itable_buf);
-		if (retval) {
-			io_channel_write_blk64(fs->io, old_blk,
-					       num, rfs->itable_buf);
-			goto errout;
+		/* Start reading the next table while we write this run */
+		for (g = k; g < max_groups; g++) {
+			blk = ext2fs_inode_table_loc(rfs->old_fs, g);
+			if (blk == ext2fs_inode_table_loc(fs, g))
+				continue;
+			if (itable_used_blocks(rfs, g))
+				io_channel_cache_readahead(fs->io, blk,
+					itable_used_blocks(rfs, g));
+			break;
 		}
-		if (n > diff) {
-			retval = io_channel_write_blk64(fs->io,
-			      old_blk + fs->inode_blocks_per_group,
-			      diff, (rfs->itable_buf +
-				     (fs->inode_blocks_per_group - diff) *
-				     fs->blocksize));
+
+		if (copy) {
+			retval = io_channel_write_blk64(fs->io, new_blk,
+							copy, buf);
+			if (retval) {
+				io_channel_write_blk64(fs->io, old_blk,
+						       copy, buf);
+				goto errout;
+			}
+		}
+		if (tail && need_zero) {
+			retval = zero_itable_tail(fs, new_blk + copy, tail,
+						  old_blk + known_zero,
+						  old_blk + total);
 			if (retval)
 				goto errout;
 		}
 
-		for (blk = ext2fs_inode_table_loc(rfs->old_fs, i), j=0;
-		     j < fs->inode_blocks_per_group ; j++, blk++)
-			ext2fs_block_alloc_stats2(fs, blk, -1);
-
-		ext2fs_inode_table_loc_set(rfs->old_fs, i, new_blk);
-		ext2fs_group_desc_csum_set(rfs->old_fs, i);
+		for (g = i; g < k; g++) {
+			for (blk = ext2fs_inode_table_loc(rfs->old_fs, g);
+			     blk < ext2fs_inode_table_loc(rfs->old_fs, g) + ipb;
+			     blk++)
+				ext2fs_block_alloc_stats2(fs, blk, -1);
+			ext2fs_inode_table_loc_set(rfs->old_fs, g,
+					ext2fs_inode_table_loc(fs, g));
+			ext2fs_group_desc_csum_set(rfs->old_fs, g);
+		}
 		ext2fs_mark_super_dirty(rfs->old_fs);
 		ext2fs_flush(rfs->old_fs);
 
 		if (rfs->progress) {
+			moved += k - i;
 			retval = rfs->progress(rfs, E2_RSZ_MOVE_ITABLE_PASS,
-					       ++moved, to_move);
+					       moved, to_move);
 			if (retval)
 				goto errout;
 		}
 	}
 	mark_table_blocks(fs, fs->block_map);
+	/* Cached inode table blocks may now be at the wrong address */
+	ext2fs_flush_icache(fs);
 	ext2fs_flush(fs);
 #ifdef RESIZE2FS_DEBUG
 	if (rfs->flags & RESIZE_DEBUG_ITABLEMOVE)
 		printf("Inode table move finished.\n");
 #endif
-	return 0;
+	retval = 0;
 
 errout:
+	if (buf)
+		ext2fs_free_mem(&buf);
 	return retval;
 }
 
@@ -1892,23 +3139,16 @@ errout:
 /*
  * Finally, recalculate the summary information
  */
-static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
+/*
+ * Count the free clusters of a group which still has BLOCK_UNINIT
+ * set: everything except for the group's own metadata.
+ */
+static blk64_t uninit_group_free_clusters(ext2_filsys fs, dgrp_t group)
 {
-	blk64_t		blk;
-	ext2_ino_t	ino;
-	unsigned int	group = 0;
-	unsigned int	count = 0;
-	blk64_t		total_blocks_free = 0;
-	int		total_inodes_free = 0;
-	int		group_free = 0;
-	int		uninit = 0;
+	blk64_t		blk, first, last, free_clusters = 0;
 	blk64_t		super_blk, old_desc_blk, new_desc_blk;
 	int		old_desc_blocks;
 
-	/*
-	 * First calculate the block statistics
-	 */
-	uninit = ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT);
 	ext2fs_super_and_bgd_loc2(fs, group, &super_blk, &old_desc_blk,
 				  &new_desc_blk, 0);
 	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
@@ -1916,45 +3156,54 @@ static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
 	else
 		old_desc_blocks = fs->desc_blocks +
 			fs->super->s_reserved_gdt_blocks;
-	for (blk = B2C(fs->super->s_first_data_block);
-	     blk < ext2fs_blocks_count(fs->super);
-	     blk += EXT2FS_CLUSTER_RATIO(fs)) {
-		if ((uninit &&
-		     !(EQ_CLSTR(blk, super_blk) ||
-		       ((old_desc_blk && old_desc_blocks &&
-			 GE_CLSTR(blk, old_desc_blk) &&
-			 LT_CLSTR(blk, old_desc_blk + old_desc_blocks))) ||
-		       ((new_desc_blk && EQ_CLSTR(blk, new_desc_blk))) ||
-		       EQ_CLSTR(blk, ext2fs_block_bitmap_loc(fs, group)) ||
-		       EQ_CLSTR(blk, ext2fs_inode_bitmap_loc(fs, group)) ||
-		       ((GE_CLSTR(blk, ext2fs_inode_table_loc(fs, group)) &&
-			 LT_CLSTR(blk, ext2fs_inode_table_loc(fs, group)
-				  + fs->inode_blocks_per_group))))) ||
-		    (!ext2fs_fast_test_block_bitmap2(fs->block_map, blk))) {
-			group_free++;
-			total_blocks_free++;
-		}
-		count++;
-		if ((count == fs->super->s_clusters_per_group) ||
-		    EQ_CLSTR(blk, ext2fs_blocks_count(fs->super)-1)) {
-			ext2fs_bg_free_blocks_count_set(fs, group, group_free);
-			ext2fs_group_desc_csum_set(fs, group);
-			group++;
-			if (group >= fs->group_desc_count)
-				break;
-			count = 0;
-			group_free = 0;
-			uninit = ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT);
-			ext2fs_super_and_bgd_loc2(fs, group, &super_blk,
-						  &old_desc_blk,
-						  &new_desc_blk, 0);
-			if (fs->super->s_feature_incompat &
-			    EXT2_FEATURE_INCOMPAT_META_BG)
-				old_desc_blocks = fs->super->s_first_meta_bg;
-			else
-				old_desc_blocks = fs->desc_blocks +
-					fs->super->s_reserved_gdt_blocks;
+	first = ext2fs_group_first_block2(fs, group);
+	last = ext2fs_group_last_block2(fs, group);
+	for (blk = first; blk <= last; blk += EXT2FS_CLUSTER_RATIO(fs)) {
+		if (EQ_CLSTR(blk, super_blk) ||
+		    ((old_desc_blk && old_desc_blocks &&
+		      GE_CLSTR(blk, old_desc_blk) &&
+		      LT_CLSTR(blk, old_desc_blk + old_desc_blocks))) ||
+		    ((new_desc_blk && EQ_CLSTR(blk, new_desc_blk))) ||
+		    EQ_CLSTR(blk, ext2fs_block_bitmap_loc(fs, group)) ||
+		    EQ_CLSTR(blk, ext2fs_inode_bitmap_loc(fs, group)) ||
+		    ((GE_CLSTR(blk, ext2fs_inode_table_loc(fs, group)) &&
+		      LT_CLSTR(blk, ext2fs_inode_table_loc(fs, group)
+			       + fs->inode_blocks_per_group))))
+			continue;
+		free_clusters++;
+	}
+	return free_clusters;
+}
+
+static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
+{
+	blk64_t		first, last, used;
+	ext2_ino_t	used_inodes;
+	dgrp_t		group;
+	blk64_t		total_blocks_free = 0;
+	ext2_ino_t	total_inodes_free = 0;
+	blk64_t		group_free;
+	ext2_ino_t	group_inodes_free;
+	errcode_t	retval;
+
+	/*
+	 * First calculate the block statistics
+	 */
+	for (group = 0; group < fs->group_desc_count; group++) {
+		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT))
+			group_free = uninit_group_free_clusters(fs, group);
+		else {
+			first = ext2fs_group_first_block2(fs, group);
+			last = ext2fs_group_last_block2(fs, group);
+			retval = ext2fs_count_used_clusters(fs, first, last,
+							    &used);
+			if (retval)
+				return retval;
+			group_free = B2C(last) - B2C(first) + 1 - used;
 		}
+		ext2fs_bg_free_blocks_count_set(fs, group, group_free);
+		ext2fs_group_desc_csum_set(fs, group);
+		total_blocks_free += group_free;
 	}
 	total_blocks_free = C2B(total_blocks_free);
 	ext2fs_free_blocks_count_set(fs->super, total_blocks_free);
@@ -1962,30 +3211,20 @@ static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
 	/*
 	 * Next, calculate the inode statistics
 	 */
-	group_free = 0;
-	count = 0;
-	group = 0;
-
-	/* Protect loop from wrap-around if s_inodes_count maxed */
-	uninit = ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT);
-	for (ino = 1; ino <= fs->super->s_inodes_count && ino > 0; ino++) {
-		if (uninit ||
-		    !ext2fs_fast_test_inode_bitmap2(fs->inode_map, ino)) {
-			group_free++;
-			total_inodes_free++;
-		}
-		count++;
-		if ((count == fs->super->s_inodes_per_group) ||
-		    (ino == fs->super->s_inodes_count)) {
-			ext2fs_bg_free_inodes_count_set(fs, group, group_free);
-			ext2fs_group_desc_csum_set(fs, group);
-			group++;
-			if (group >= fs->group_desc_count)
-				break;
-			count = 0;
-			group_free = 0;
-			uninit = ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT);
+	for (group = 0; group < fs->group_desc_count; group++) {
+		group_inodes_free = fs->super->s_inodes_per_group;
+		if (!ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT)) {
+			retval = ext2fs_count_used_inodes(fs,
+				group * fs->super->s_inodes_per_group + 1,
+				(group + 1) * fs->super->s_inodes_per_group,
+				&used_inodes);
+			if (retval)
+				return retval;
+			group_inodes_free -= used_inodes;
 		}
+		ext2fs_bg_free_inodes_count_set(fs, group, group_inodes_free);
+		ext2fs_group_desc_csum_set(fs, group);
+		total_inodes_free += group_inodes_free;
 	}
 	fs->super->s_free_inodes_count = total_inodes_free;
 	ext2fs_mark_super_dirty(fs);
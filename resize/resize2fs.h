@@ -64,6 +64,11 @@
  */
 typedef struct _ext2_extent *ext2_extent;
 
+/*
+ * For the map of moved inodes
+ */
+struct resize_inode_map;
+
 /*
  * For the simple progress meter
  */
@@ -81,6 +86,16 @@ typedef struct ext2_sim_progress *ext2_sim_progmeter;
 
 #define RESIZE_PERCENT_COMPLETE		0x0100
 #define RESIZE_VERBOSE			0x0200
+#define RESIZE_PLAN_MOVES		0x0400
+#define RESIZE_DRY_RUN			0x0800
+#define RESIZE_FLEX_BG			0x1000
+
+/*
+ * With RESIZE_FLEX_BG, the log2 of the number of groups per flex group
+ * is kept in the top bits of the flags
+ */
+#define RESIZE_FLEX_LOG_SHIFT		24
+#define RESIZE_FLEX_LOG(flags)		(((flags) >> RESIZE_FLEX_LOG_SHIFT) & 0x1f)
 
 /*
  * This structure is used for keeping track of how much resources have
@@ -94,6 +109,11 @@ struct resource_track {
 	void	*brk_start;
 	unsigned long long bytes_read;
 	unsigned long long bytes_written;
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long flushes;
+	unsigned long long read_latency[IO_STATS_LATENCY_BUCKETS];
+	unsigned long long write_latency[IO_STATS_LATENCY_BUCKETS];
 };
 
 /*
@@ -107,7 +127,7 @@ struct ext2_resize_struct {
 	ext2fs_block_bitmap reserve_blocks;
 	ext2fs_block_bitmap move_blocks;
 	ext2_extent	bmap;
-	ext2_extent	imap;
+	struct resize_inode_map *imap;
 	blk64_t		needed_blocks;
 	int		flags;
 	char		*itable_buf;
@@ -156,6 +176,8 @@ extern void ext2fs_free_extent_table(ext2_extent extent);
 extern errcode_t ext2fs_add_extent_entry(ext2_extent extent,
 					 __u64 old_loc, __u64 new_loc);
 extern __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc);
+extern __u64 ext2fs_extent_translate_range(ext2_extent extent, __u64 old_loc,
+					   __u64 count, __u64 *ret_count);
 extern void ext2fs_extent_dump(ext2_extent extent, FILE *out);
 extern errcode_t ext2fs_iterate_extent(ext2_extent extent, __u64 *old_loc,
 				       __u64 *new_loc, __u64 *size);
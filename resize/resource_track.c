@@ -41,12 +41,24 @@ void init_resource_track(struct resource_track *track, const char *desc,
 #endif
 	track->bytes_read = 0;
 	track->bytes_written = 0;
+	track->reads = track->writes = track->flushes = 0;
+	memset(track->read_latency, 0, sizeof(track->read_latency));
+	memset(track->write_latency, 0, sizeof(track->write_latency));
 	if (channel && channel->manager && channel->manager->get_stats)
 		channel->manager->get_stats(channel, &io_start);
 	if (io_start) {
 		track->bytes_read = io_start->bytes_read;
 		track->bytes_written = io_start->bytes_written;
 	}
+	if (io_start && io_start->num_fields >= IO_STATS_NUM_FIELDS) {
+		track->reads = io_start->reads;
+		track->writes = io_start->writes;
+		track->flushes = io_start->flushes;
+		memcpy(track->read_latency, io_start->read_latency,
+		       sizeof(track->read_latency));
+		memcpy(track->write_latency, io_start->write_latency,
+		       sizeof(track->write_latency));
+	}
 }
 
 static float timeval_subtract(struct timeval *tv1,
@@ -119,6 +131,24 @@ void print_resource_track(ext2_resize_t rfs, struct resource_track *track,
 			       mbytes(bytes_written),
 			       (double)mbytes(bytes_read + bytes_written) /
 			       timeval_subtract(&time_end, &track->time_start));
+			if (delta->num_fields < IO_STATS_NUM_FIELDS)
+				goto skip_io;
+			if (track->desc)
+				printf("%s: ", track->desc);
+			printf("I/O requests: %llu reads (50%% under %lluus, "
+			       "99%% under %lluus), %llu writes (50%% under "
+			       "%lluus, 99%% under %lluus), %llu flushes\n",
+			       delta->reads - track->reads,
+			       io_stats_latency(delta->read_latency,
+						track->read_latency, 50),
+			       io_stats_latency(delta->read_latency,
+						track->read_latency, 99),
+			       delta->writes - track->writes,
+			       io_stats_latency(delta->write_latency,
+						track->write_latency, 50),
+			       io_stats_latency(delta->write_latency,
+						track->write_latency, 99),
+			       delta->flushes - track->flushes);
 		}
 	}
 skip_io:
@@ -0,0 +1,310 @@
+/*
+ * bench_lib.c --- microbenchmarks for libext2fs hot paths
+ *
+ * Times the block bitmap backends, icount, crc32c, the directory
+ * hashes and, given a file system image, the inode scan.  The results
+ * are written to stdout as a JSON object so that runs from different
+ * releases can be compared by a script; run_bench in the tests
+ * directory merges them into its own report.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#include <sys/time.h>
+
+#include "et/com_err.h"
+#include "ext2fs/ext2fs.h"
+
+static const char *program_name = "bench_lib";
+static int num_results;
+static unsigned long scale = 1;
+
+static double now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void report(const char *name, unsigned long long ops, double start)
+{
+	double	secs = now() - start;
+
+	printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, "
+	       "\"seconds\": %.6f, \"ops_per_sec\": %.0f}",
+	       num_results++ ? "," : "", name, ops, secs,
+	       secs > 0 ? ops / secs : 0.0);
+	fflush(stdout);
+}
+
+/* A small pseudo-random generator, so that every run does the same work */
+static unsigned int bench_seed = 1;
+
+static unsigned int bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return (bench_seed >> 8) & 0xFFFFFF;
+}
+
+static ext2_filsys setup_fs(blk64_t blocks)
+{
+	struct ext2_super_block param;
+	ext2_filsys	fs;
+	errcode_t	retval;
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, blocks);
+	param.s_log_block_size = 2;
+	retval = ext2fs_initialize("bench fs", EXT2_FLAG_64BITS, &param,
+				   test_io_manager, &fs);
+	if (retval) {
+		com_err(program_name, retval, "while initializing filesystem");
+		exit(1);
+	}
+	return fs;
+}
+
+static void bench_bitmap(const char *backend, int type)
+{
+	ext2_filsys	fs;
+	ext2fs_block_bitmap bmap;
+	blk64_t		blocks = 1 << 22, blk, first, last, out;
+	unsigned long	i, n;
+	char		name[64];
+	double		start;
+	errcode_t	retval;
+
+	fs = setup_fs(blocks);
+	fs->default_bitmap_type = type;
+	retval = ext2fs_allocate_block_bitmap(fs, "bench", &bmap);
+	if (retval) {
+		com_err(program_name, retval, "while allocating %s bitmap",
+			backend);
+		exit(1);
+	}
+	first = ext2fs_get_block_bitmap_start2(bmap);
+	last = ext2fs_get_block_bitmap_end2(bmap);
+
+	/* Runs of 16 set and 16 clear blocks, as left by fragmented files */
+	start = now();
+	n = 0;
+	for (blk = first; blk + 16 <= last; blk += 32) {
+		ext2fs_mark_block_bitmap_range2(bmap, blk, 16);
+		n++;
+	}
+	sprintf(name, "bitmap_%s_mark_range", backend);
+	report(name, n, start);
+
+	start = now();
+	n = 1000000 * scale;
+	for (i = 0; i < n; i++)
+		ext2fs_test_block_bitmap2(bmap, first + bench_rand() %
+					  (last - first));
+	sprintf(name, "bitmap_%s_test_random", backend);
+	report(name, n, start);
+
+	start = now();
+	n = 0;
+	for (blk = first; blk <= last; blk = out + 1, n++)
+		if (ext2fs_find_first_zero_block_bitmap2(bmap, blk, last,
+							 &out))
+			break;
+	sprintf(name, "bitmap_%s_find_zero", backend);
+	report(name, n, start);
+
+	start = now();
+	n = 500000 * scale;
+	for (i = 0; i < n; i++) {
+		blk = first + bench_rand() % (last - first);
+		ext2fs_unmark_block_bitmap2(bmap, blk);
+		ext2fs_mark_block_bitmap2(bmap, blk);
+	}
+	sprintf(name, "bitmap_%s_toggle_random", backend);
+	report(name, 2 * n, start);
+
+	ext2fs_free_block_bitmap(bmap);
+	ext2fs_close(fs);
+}
+
+static void bench_icount(void)
+{
+	ext2_filsys	fs;
+	ext2_icount_t	icount;
+	ext2_ino_t	ino;
+	unsigned long	i, n = 2000000 * scale;
+	__u16		count;
+	double		start;
+	errcode_t	retval;
+
+	fs = setup_fs(1 << 20);
+	retval = ext2fs_create_icount2(fs, 0, 0, 0, &icount);
+	if (retval) {
+		com_err(program_name, retval, "while creating icount");
+		exit(1);
+	}
+
+	/*
+	 * Links are mostly found in inode order, as pass 2 does; random
+	 * insertion into the list would measure memmove() instead.
+	 */
+	start = now();
+	for (i = 0; i < n; i++) {
+		ino = 1 + i % fs->super->s_inodes_count;
+		ext2fs_icount_increment(icount, ino, &count);
+	}
+	report("icount_increment", n, start);
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		ino = 1 + bench_rand() % fs->super->s_inodes_count;
+		ext2fs_icount_fetch(icount, ino, &count);
+	}
+	report("icount_fetch", n, start);
+
+	ext2fs_free_icount(icount);
+	ext2fs_close(fs);
+}
+
+static void bench_crc32c(void)
+{
+	unsigned char	*buf;
+	unsigned long	i, n = 16384 * scale;
+	__u32		crc = ~0;
+	double		start;
+
+	buf = malloc(4096);
+	if (!buf) {
+		com_err(program_name, ENOMEM, "while allocating buffer");
+		exit(1);
+	}
+	for (i = 0; i < 4096; i++)
+		buf[i] = bench_rand();
+
+	start = now();
+	for (i = 0; i < n; i++)
+		crc = ext2fs_crc32c_le(crc, buf, 4096);
+	report("crc32c_4k_blocks", n, start);
+	free(buf);
+}
+
+static void bench_dirhash(const char *hash_name, int version)
+{
+	char		names[1024][32];
+	int		lens[1024];
+	ext2_dirhash_t	hash, minor_hash;
+	__u32		seed[4] = { 0x12345678, 0x9abcdef0, 0x0fedcba9,
+				    0x87654321 };
+	unsigned long	i, n = 1000000 * scale;
+	char		name[64];
+	double		start;
+
+	for (i = 0; i < 1024; i++)
+		lens[i] = sprintf(names[i], "file-%06u.%x", bench_rand(),
+				  (unsigned int) i);
+
+	start = now();
+	for (i = 0; i < n; i++)
+		ext2fs_dirhash(version, names[i & 1023], lens[i & 1023],
+			       seed, &hash, &minor_hash);
+	sprintf(name, "dirhash_%s", hash_name);
+	report(name, n, start);
+}
+
+static void bench_inode_scan(const char *device)
+{
+	ext2_filsys	fs;
+	ext2_inode_scan	scan;
+	ext2_ino_t	ino;
+	struct ext2_inode inode;
+	unsigned long long n = 0;
+	double		start;
+	errcode_t	retval;
+
+	retval = ext2fs_open(device, 0, 0, 0, unix_io_manager, &fs);
+	if (retval) {
+		com_err(program_name, retval, "while opening %s", device);
+		exit(1);
+	}
+
+	start = now();
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval) {
+		com_err(program_name, retval, "while opening inode scan");
+		exit(1);
+	}
+	while (1) {
+		retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+			continue;
+		if (retval) {
+			com_err(program_name, retval,
+				"while getting next inode");
+			exit(1);
+		}
+		if (!ino)
+			break;
+		n++;
+	}
+	ext2fs_close_inode_scan(scan);
+	report("inode_scan", n, start);
+	ext2fs_close(fs);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-s scale] [-i image]\n", program_name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char	*image = NULL;
+	int		c;
+
+	add_error_table(&et_ext2_error_table);
+
+	while ((c = getopt(argc, argv, "i:s:")) != EOF) {
+		switch (c) {
+		case 'i':
+			image = optarg;
+			break;
+		case 's':
+			scale = strtoul(optarg, NULL, 0);
+			if (!scale)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	printf("{\n  \"benchmark\": \"libext2fs\",\n  \"scale\": %lu,\n"
+	       "  \"results\": [", scale);
+	bench_bitmap("bitarray", EXT2FS_BMAP64_BITARRAY);
+	bench_bitmap("rbtree", EXT2FS_BMAP64_RBTREE);
+	bench_bitmap("radixtree", EXT2FS_BMAP64_RADIXTREE);
+	bench_icount();
+	bench_crc32c();
+	bench_dirhash("legacy", EXT2_HASH_LEGACY);
+	bench_dirhash("half_md4", EXT2_HASH_HALF_MD4);
+	bench_dirhash("tea", EXT2_HASH_TEA);
+	if (image)
+		bench_inode_scan(image);
+	printf("\n  ]\n}\n");
+
+	remove_error_table(&et_ext2_error_table);
+	return 0;
+}